@@ -1141,6 +1141,30 @@ LUA_API void lua_sharestring (lua_State *L, int index) {
   luaS_share(ts);
 }
 
+/*
+** Add the short string at 'index' to the process-wide pool, so every state
+** creating it later gets the pooled copy. Returns 0 for a long string or a
+** full pool.
+*/
+LUA_API int lua_poolstring (lua_State *L, int index) {
+  TString *ts;
+  if (lua_type(L,index) != LUA_TSTRING)
+    luaG_runerror(L, "need a string to pool");
+  ts = tsvalue(index2value(L,index));
+  if (ts->tt != LUA_VSHRSTR)
+    return 0;
+  return luaS_poolshrstr(ts) != NULL;
+}
+
+LUA_API int lua_poolstat (size_t *bytes) {
+  int n;
+  size_t sz;
+  luaS_poolstat(&n, &sz);
+  if (bytes)
+    *bytes = sz;
+  return n;
+}
+
 LUA_API void lua_clonetable(lua_State *L, const void * tp) {
   Table *t = cast(Table *, tp);
 
@@ -1378,6 +1402,14 @@ void lua_setwarnf (lua_State *L, lua_WarnFunction f, void *ud) {
 }
 
 
+void lua_setgchook (lua_State *L, lua_GCHook f, void *ud) {
+  lua_lock(L);
+  G(L)->ud_gchook = ud;
+  G(L)->gchook = f;
+  lua_unlock(L);
+}
+
+
 void lua_warning (lua_State *L, const char *msg, int tocont) {
   lua_lock(L);
   luaE_warning(L, msg, tocont);
@@ -1280,6 +1280,8 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
     lua_clonefunction(L, oldv);
   } else {
     lua_clonefunction(L, proto);
+    /* the proto tree is shared now, drop what the parser left behind in eL */
+    lua_gc(eL, LUA_GCCOLLECT);
     /* Never close it. notice: memory leak */
   }
 
@@ -1293,10 +1295,125 @@ cache_clear(lua_State *L) {
 	return 0;
 }
 
+/*
+** Resolved paths of package.searchpath, shared by all the states.
+** They are saved in the registry of CC.L with the arguments joined by '\0'
+** as the key, and a string value ( the protos are lightuserdata ).
+*/
+
+static int
+load_path(lua_State *L, const char *key, size_t ksz) {
+  lua_State *cL;
+  int found = 0;
+  if (CC.L == NULL)
+    return 0;
+  SPIN_LOCK(&CC)
+    cL = CC.L;
+    lua_pushlstring(cL, key, ksz);
+    if (lua_rawget(cL, LUA_REGISTRYINDEX) == LUA_TSTRING) {
+      size_t sz = 0;
+      const char * filename = lua_tolstring(cL, -1, &sz);
+      lua_pushlstring(L, filename, sz);
+      found = 1;
+    }
+    lua_pop(cL, 1);
+  SPIN_UNLOCK(&CC)
+  return found;
+}
+
+static void
+save_path(const char *key, size_t ksz, const char *filename, size_t sz) {
+  lua_State *cL;
+  SPIN_LOCK(&CC)
+    if (CC.L == NULL) {
+      init();
+    }
+    cL = CC.L;
+    lua_pushlstring(cL, key, ksz);
+    lua_pushlstring(cL, filename, sz);
+    lua_rawset(cL, LUA_REGISTRYINDEX);
+  SPIN_UNLOCK(&CC)
+}
+
+static int
+cache_searchpath(lua_State *L) {
+	int i, n = lua_gettop(L);
+	int level;
+	luaL_Buffer b;
+	size_t ksz;
+	const char * key;
+	luaL_checkstring(L, 1);
+	luaL_checkstring(L, 2);
+	if (n > 4)
+		n = 4;
+	lua_settop(L, n);
+	level = cache_level(L);
+	if (level == CACHE_OFF) {
+		lua_getglobal(L, "package");
+		lua_getfield(L, -1, "searchpath");
+		lua_insert(L, 1);
+		lua_pop(L, 1);
+		lua_call(L, n, 2);
+		return 2;
+	}
+	luaL_buffinit(L, &b);
+	for (i=1;i<=n;i++) {
+		size_t sz = 0;
+		const char * s = luaL_checklstring(L, i, &sz);
+		if (i > 1)
+			luaL_addchar(&b, '\0');
+		luaL_addlstring(&b, s, sz);
+	}
+	luaL_pushresult(&b);
+	key = lua_tolstring(L, -1, &ksz);
+	if (load_path(L, key, ksz))
+		return 1;
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "searchpath");
+	for (i=1;i<=n;i++) {
+		lua_pushvalue(L, i);
+	}
+	lua_call(L, n, 2);
+	if (lua_type(L, -2) == LUA_TSTRING) {
+		if (level == CACHE_ON) {
+			size_t sz = 0;
+			const char * filename = lua_tolstring(L, -2, &sz);
+			save_path(key, ksz, filename, sz);
+		}
+		lua_pop(L, 1);
+		return 1;
+	}
+	/* not found is not cached, the file may be added later */
+	return 2;
+}
+
+static int
+cache_clearpath(lua_State *L) {
+	lua_State *cL;
+	(void)(L);
+	if (CC.L == NULL)
+		return 0;
+	SPIN_LOCK(&CC)
+		cL = CC.L;
+		lua_pushnil(cL);
+		while (lua_next(cL, LUA_REGISTRYINDEX) != 0) {
+			if (lua_type(cL, -1) == LUA_TSTRING) {
+				lua_pushvalue(cL, -2);
+				lua_pushnil(cL);
+				lua_rawset(cL, LUA_REGISTRYINDEX);
+			}
+			lua_pop(cL, 1);
+		}
+	SPIN_UNLOCK(&CC)
+	return 0;
+}
+
 LUAMOD_API int luaopen_cache(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "clear", cache_clear },
 		{ "mode", cache_mode },
+		{ "searchpath", cache_searchpath },
+		{ "clearpath", cache_clearpath },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
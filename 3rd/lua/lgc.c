@@ -1698,10 +1698,14 @@ void luaC_step (lua_State *L) {
   if (!gcrunning(g))  /* not running? */
     luaE_setdebt(g, -2000);
   else {
+    if (g->gchook)
+      g->gchook(g->ud_gchook, LUA_GCHOOKSTEP, 0);
     if(isdecGCmodegen(g))
       genstep(L, g);
     else
       incstep(L, g);
+    if (g->gchook)
+      g->gchook(g->ud_gchook, LUA_GCHOOKSTEP, 1);
   }
 }
 
@@ -1737,10 +1741,14 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   lua_assert(!g->gcemergency);
   g->gcemergency = isemergency;  /* set flag */
+  if (g->gchook)
+    g->gchook(g->ud_gchook, LUA_GCHOOKFULL, 0);
   if (g->gckind == KGC_INC)
     fullinc(L, g);
   else
     fullgen(L, g);
+  if (g->gchook)
+    g->gchook(g->ud_gchook, LUA_GCHOOKFULL, 1);
   g->gcemergency = 0;
 }
 
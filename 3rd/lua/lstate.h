@@ -299,6 +299,8 @@ typedef struct global_State {
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
   lua_WarnFunction warnf;  /* warning function */
   void *ud_warn;         /* auxiliary data to 'warnf' */
+  lua_GCHook gchook;  /* hook around the collector steps (skynet) */
+  void *ud_gchook;       /* auxiliary data to 'gchook' */
 } global_State;
 
 
@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "lua.h"
@@ -25,6 +26,27 @@
 static unsigned int STRSEED;
 static ATOM_SIZET STRID = 0;
 
+/*
+** Process-wide pool of shared short strings. The strings are allocated
+** outside of any state, marked shared (so no collector touches them) and
+** live until the process exits. The pool is an open-addressing table;
+** readers never lock, writers append under 'SHRPOOL_LOCK' and publish a
+** bigger copy when it is half full (the old copies are never freed, as a
+** reader may still be probing them).
+*/
+#define SHRPOOL_MINSIZE	1024
+#define SHRPOOL_MAX	(1 << 20)
+
+struct shrpool {
+  int size;  /* power of 2 */
+  ATOM_POINTER slot[1];
+};
+
+static ATOM_POINTER SHRPOOL = 0;
+static ATOM_INT SHRPOOL_LOCK = 0;
+static int SHRPOOL_NUSE = 0;
+static size_t SHRPOOL_BYTES = 0;
+
 /*
 ** Maximum size for string table.
 */
@@ -73,6 +95,132 @@ unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
 }
 
 
+static TString *poolfind (struct shrpool *p, const char *str, size_t l,
+                          unsigned int h) {
+  int mask = p->size - 1;
+  int i;
+  for (i = h & mask; ; i = (i + 1) & mask) {
+    TString *ts = (TString *)ATOM_LOAD(&p->slot[i]);
+    if (ts == NULL)
+      return NULL;
+    if (ts->hash == h && ts->shrlen == l &&
+        memcmp(str, getshrstr(ts), l * sizeof(char)) == 0)
+      return ts;
+  }
+}
+
+
+static void poolinsert (struct shrpool *p, TString *ts) {
+  int mask = p->size - 1;
+  int i = ts->hash & mask;
+  while (ATOM_LOAD(&p->slot[i]) != 0)
+    i = (i + 1) & mask;
+  ATOM_STORE(&p->slot[i], (uintptr_t)ts);
+}
+
+
+static struct shrpool *poolnew (int size) {
+  struct shrpool *p = (struct shrpool *)malloc(sizeof(struct shrpool) +
+                                     (size - 1) * sizeof(ATOM_POINTER));
+  int i;
+  if (p == NULL)
+    return NULL;
+  p->size = size;
+  for (i = 0; i < size; i++)
+    ATOM_INIT(&p->slot[i], 0);
+  return p;
+}
+
+
+/*
+** Find a short string in the shared pool, NULL if it is not there.
+*/
+static TString *poollookup (const char *str, size_t l, unsigned int h) {
+  struct shrpool *p = (struct shrpool *)ATOM_LOAD(&SHRPOOL);
+  if (p == NULL)
+    return NULL;
+  return poolfind(p, str, l, h);
+}
+
+
+/*
+** Copy 'ts' into the pool, growing it if needed. Called with the lock.
+*/
+static TString *poolnewstr (struct shrpool *p, TString *ts) {
+  size_t l = ts->shrlen;
+  TString *ps;
+  if (p == NULL || (SHRPOOL_NUSE + 1) * 2 > p->size) {  /* grow? */
+    struct shrpool *np = poolnew(p ? p->size * 2 : SHRPOOL_MINSIZE);
+    if (np != NULL) {
+      if (p != NULL) {
+        int i;
+        for (i = 0; i < p->size; i++) {
+          TString *o = (TString *)ATOM_LOAD(&p->slot[i]);
+          if (o)
+            poolinsert(np, o);
+        }
+      }
+      ATOM_STORE(&SHRPOOL, (uintptr_t)np);
+      p = np;
+    }
+    else if (p == NULL || SHRPOOL_NUSE + 1 >= p->size)
+      return NULL;  /* keep at least one empty slot */
+  }
+  ps = (TString *)malloc(sizelstring(l));
+  if (ps == NULL)
+    return NULL;
+  ps->next = NULL;
+  ps->tt = LUA_VSHRSTR;
+  ps->marked = bitmask(BLACKBIT);  /* never white, never collected */
+  makeshared(ps);
+  ps->extra = 0;
+  ps->shrlen = cast_byte(l);
+  ps->hash = ts->hash;
+  ps->id = (ts->id != 0) ? ts->id : ATOM_FDEC(&STRID)-1;
+  ps->u.hnext = NULL;
+  memcpy(getshrstr(ps), getshrstr(ts), l * sizeof(char));
+  getshrstr(ps)[l] = '\0';
+  poolinsert(p, ps);
+  SHRPOOL_NUSE++;
+  SHRPOOL_BYTES += sizelstring(l);
+  return ps;
+}
+
+
+/*
+** Add a short string to the shared pool and return the pooled copy (NULL
+** if the pool is full or out of memory). 'ts' and the copy get the same
+** id, so they compare equal without 'memcmp'.
+*/
+TString *luaS_poolshrstr (TString *ts) {
+  const char *str = getshrstr(ts);
+  size_t l = ts->shrlen;
+  TString *ps;
+  struct shrpool *p;
+  lua_assert(ts->tt == LUA_VSHRSTR);
+  ps = poollookup(str, l, ts->hash);
+  if (ps == NULL) {
+    while (!ATOM_CAS(&SHRPOOL_LOCK, 0, 1)) {}
+    p = (struct shrpool *)ATOM_LOAD(&SHRPOOL);
+    ps = (p == NULL) ? NULL : poolfind(p, str, l, ts->hash);
+    if (ps == NULL && SHRPOOL_NUSE < SHRPOOL_MAX)
+      ps = poolnewstr(p, ts);
+    ATOM_STORE(&SHRPOOL_LOCK, 0);
+  }
+  if (ps != NULL && ps != ts)
+    ts->id = ps->id;  /* equal strings may share an id */
+  return ps;
+}
+
+
+void luaS_poolstat (int *count, size_t *bytes) {
+  while (!ATOM_CAS(&SHRPOOL_LOCK, 0, 1)) {}
+  *count = SHRPOOL_NUSE;
+  *bytes = SHRPOOL_BYTES;
+  ATOM_STORE(&SHRPOOL_LOCK, 0);
+}
+
+
 unsigned int luaS_hashlongstr (TString *ts) {
   lua_assert(ts->tt == LUA_VLNGSTR);
   if (ts->extra == 0) {  /* no hash? */
@@ -246,6 +394,10 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
       return ts;
     }
   }
+  /* then the shared pool (not while building the state: the reserved
+     words and the metamethod names must be its own fixed strings) */
+  if (!(g->gcstp & GCSTPGC) && (ts = poollookup(str, l, h)) != NULL)
+    return ts;
   /* else must create a new string */
   if (tb->nuse >= tb->size) {  /* need to grow string table? */
     growstrtab(L, tb);
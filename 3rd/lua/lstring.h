@@ -54,5 +54,7 @@ LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
 LUAI_FUNC TString *luaS_new (lua_State *L, const char *str);
 LUAI_FUNC TString *luaS_createlngstrobj (lua_State *L, size_t l);
 LUAI_FUNC void luaS_share(TString *ts);
+LUAI_FUNC TString *luaS_poolshrstr (TString *ts);
+LUAI_FUNC void luaS_poolstat (int *count, size_t *bytes);
 
 #endif
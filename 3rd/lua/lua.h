@@ -131,6 +131,16 @@ typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 typedef void (*lua_WarnFunction) (void *ud, const char *msg, int tocont);
 
 
+/*
+** Type for GC hooks (skynet), called before ('done' == 0) and after
+** ('done' == 1) each collector step and each full collection
+*/
+typedef void (*lua_GCHook) (void *ud, int what, int done);
+
+#define LUA_GCHOOKSTEP	0
+#define LUA_GCHOOKFULL	1
+
+
 /*
 ** Type used by the debug API to collect debug information
 */
@@ -258,6 +268,8 @@ LUA_API void  (lua_clonefunction) (lua_State *L, const void * fp);
 LUA_API void  (lua_sharefunction) (lua_State *L, int index);
 LUA_API void  (lua_sharestring) (lua_State *L, int index);
 LUA_API void  (lua_clonetable) (lua_State *L, const void * t);
+LUA_API int   (lua_poolstring) (lua_State *L, int index);
+LUA_API int   (lua_poolstat) (size_t *bytes);
 
 /*
 ** get functions (Lua -> stack)
@@ -326,6 +338,8 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 LUA_API void (lua_setwarnf) (lua_State *L, lua_WarnFunction f, void *ud);
 LUA_API void (lua_warning)  (lua_State *L, const char *msg, int tocont);
 
+LUA_API void (lua_setgchook) (lua_State *L, lua_GCHook f, void *ud);
+
 
 /*
 ** garbage-collection function and options
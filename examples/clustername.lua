@@ -1,4 +1,8 @@
 __nowaiting = true	-- If you turn this flag off, cluster.call would block when node name is absent
+-- __lanes = 4	-- Connections to each node. The last one carries the large (multi-part) requests, a small one sent after them may arrive first
+-- __coalesce = 5	-- Flush the requests to a node every 5ms. false : write each request at once
+-- __compress = 4096	-- Compress the requests and responses not smaller than 4096 bytes. Both nodes need the support
+-- __shm = true	-- Use a shared memory channel (1M each direction, or the size in bytes) to the nodes on 127.0.0.1
 
 db = "127.0.0.1:2528"
 db2 = "127.0.0.1:2529"
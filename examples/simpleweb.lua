@@ -11,15 +11,27 @@ protocol = protocol or "http"
 
 if mode == "agent" then
 
-local function response(id, write, ...)
-	local ok, err = httpd.write_response(write, ...)
-	if not ok then
-		-- if err == sockethelper.socket_error , that means socket closed.
-		skynet.error(string.format("fd = %d, %s", id, err))
+local function handle(url, method, header, body)
+	local tmp = {}
+	if header.host then
+		table.insert(tmp, string.format("host: %s", header.host))
 	end
+	local path, query = urllib.parse(url)
+	table.insert(tmp, string.format("path: %s", path))
+	if query then
+		local q = urllib.parse_query(query)
+		for k, v in pairs(q) do
+			table.insert(tmp, string.format("query: %s= %s", k,v))
+		end
+	end
+	table.insert(tmp, "-----header----")
+	for k,v in pairs(header) do
+		table.insert(tmp, string.format("%s = %s",k,v))
+	end
+	table.insert(tmp, "-----body----\n" .. body)
+	return 200, table.concat(tmp,"\n")
 end
 
-
 local SSLCTX_SERVER = nil
 local function gen_interface(protocol, fd)
 	if protocol == "http" then
@@ -28,17 +40,22 @@ local function gen_interface(protocol, fd)
 			close = nil,
 			read = sockethelper.readfunc(fd),
 			write = sockethelper.writefunc(fd),
+			sendfile = sockethelper.sendfilefunc(fd),
+			sendshared = sockethelper.sendsharedfunc(fd),
 		}
 	elseif protocol == "https" then
 		local tls = require "http.tlshelper"
 		if not SSLCTX_SERVER then
-			SSLCTX_SERVER = tls.newctx()
 			-- gen cert and key
 			-- openssl req -x509 -newkey rsa:2048 -days 3650 -nodes -keyout server-key.pem -out server-cert.pem
 			local certfile = skynet.getenv("certfile") or "./server-cert.pem"
 			local keyfile = skynet.getenv("keyfile") or "./server-key.pem"
 			print(certfile, keyfile)
+			-- share one SSL_CTX with the other services using the same cert
+			SSLCTX_SERVER = tls.newctx("server:" .. certfile)
 			SSLCTX_SERVER:set_cert(certfile, keyfile)
+			-- serve http/2 if the client supports it
+			SSLCTX_SERVER:set_alpn { "h2", "http/1.1" }
 		end
 		local tls_ctx = tls.newtls("server", SSLCTX_SERVER)
 		return {
@@ -46,6 +63,9 @@ local function gen_interface(protocol, fd)
 			close = tls.closefunc(tls_ctx),
 			read = tls.readfunc(fd, tls_ctx),
 			write = tls.writefunc(fd, tls_ctx),
+			alpn = function()
+				return tls_ctx:alpn()
+			end,
 		}
 	else
 		error(string.format("Invalid protocol: %s", protocol))
@@ -59,36 +79,14 @@ skynet.start(function()
 		if interface.init then
 			interface.init()
 		end
+		-- serve the keep-alive and pipelined requests on this connection,
 		-- limit request body size to 8192 (you can pass nil to unlimit)
-		local code, url, method, header, body = httpd.read_request(interface.read, 8192)
-		if code then
-			if code ~= 200 then
-				response(id, interface.write, code)
-			else
-				local tmp = {}
-				if header.host then
-					table.insert(tmp, string.format("host: %s", header.host))
-				end
-				local path, query = urllib.parse(url)
-				table.insert(tmp, string.format("path: %s", path))
-				if query then
-					local q = urllib.parse_query(query)
-					for k, v in pairs(q) do
-						table.insert(tmp, string.format("query: %s= %s", k,v))
-					end
-				end
-				table.insert(tmp, "-----header----")
-				for k,v in pairs(header) do
-					table.insert(tmp, string.format("%s = %s",k,v))
-				end
-				table.insert(tmp, "-----body----\n" .. body)
-				response(id, interface.write, code, table.concat(tmp,"\n"))
-			end
-		else
-			if url == sockethelper.socket_error then
+		local ok, err = httpd.serve(interface, handle, 8192)
+		if not ok then
+			if err == sockethelper.socket_error then
 				skynet.error("socket closed")
 			else
-				skynet.error(url)
+				skynet.error(string.format("fd = %d, %s", id, err))
 			end
 		end
 		socket.close(id)
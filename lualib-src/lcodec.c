@@ -0,0 +1,446 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+	hex 和 base64 编解码的向量化部分，见 lua-crypt.c 的 tohex / fromhex / base64encode / base64decode
+	x86 上按 CPU 支持选 AVX2 或 SSSE3 ， ARM64 上用 NEON 。
+	每个函数只处理整块的输入，返回处理了多少字节，剩下的（包括补齐和出错的情况）由标量代码处理，
+	所以输出和标量实现完全相同。解码时一块里有任何不合法的字符就停下来交给标量代码。
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#define CODEC_X86
+#include <immintrin.h>
+
+// hex
+
+__attribute__((target("ssse3")))
+static size_t
+hex_encode_ssse3(char *dst, const uint8_t *src, size_t n) {
+	const __m128i lut = _mm_setr_epi8('0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f');
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i;
+	for (i=0;i+16<=n;i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		__m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+		_mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+hex_encode_avx2(char *dst, const uint8_t *src, size_t n) {
+	const __m256i lut = _mm256_setr_epi8(
+		'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f',
+		'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f');
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i;
+	for (i=0;i+32<=n;i+=32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+		__m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+		// unpack 在每个 128 位的 lane 里交错，a = [0-7, 16-23] , b = [8-15, 24-31]
+		__m256i a = _mm256_unpacklo_epi8(hi, lo);
+		__m256i b = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i *)(dst + i * 2), _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+	}
+	return i;
+}
+
+// 16 个字符 [0-9a-f] 转换成 0-15 ，有其他字符时返回 0
+__attribute__((target("ssse3")))
+static inline int
+hex_value_ssse3(__m128i c, __m128i *v) {
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i a = _mm_sub_epi8(c, _mm_set1_epi8('a'));
+	__m128i isd = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	__m128i isa = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+	if (_mm_movemask_epi8(_mm_or_si128(isd, isa)) != 0xffff)
+		return 0;
+	*v = _mm_or_si128(_mm_and_si128(isd, d), _mm_and_si128(isa, _mm_add_epi8(a, _mm_set1_epi8(10))));
+	return 1;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+hex_decode_ssse3(uint8_t *dst, const char *src, size_t n) {
+	// 每对 (hi, lo) 算 hi * 16 + lo
+	const __m128i weight = _mm_set1_epi16(0x0110);
+	size_t i;
+	for (i=0;i+32<=n;i+=32) {
+		__m128i v0, v1;
+		if (!hex_value_ssse3(_mm_loadu_si128((const __m128i *)(src + i)), &v0) ||
+			!hex_value_ssse3(_mm_loadu_si128((const __m128i *)(src + i + 16)), &v1))
+			break;
+		__m128i r = _mm_packus_epi16(_mm_maddubs_epi16(v0, weight), _mm_maddubs_epi16(v1, weight));
+		_mm_storeu_si128((__m128i *)(dst + i / 2), r);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static inline int
+hex_value_avx2(__m256i c, __m256i *v) {
+	__m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	__m256i a = _mm256_sub_epi8(c, _mm256_set1_epi8('a'));
+	__m256i isd = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+	__m256i isa = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(5)), a);
+	if (_mm256_movemask_epi8(_mm256_or_si256(isd, isa)) != -1)
+		return 0;
+	*v = _mm256_or_si256(_mm256_and_si256(isd, d), _mm256_and_si256(isa, _mm256_add_epi8(a, _mm256_set1_epi8(10))));
+	return 1;
+}
+
+__attribute__((target("avx2")))
+static size_t
+hex_decode_avx2(uint8_t *dst, const char *src, size_t n) {
+	const __m256i weight = _mm256_set1_epi16(0x0110);
+	size_t i;
+	for (i=0;i+64<=n;i+=64) {
+		__m256i v0, v1;
+		if (!hex_value_avx2(_mm256_loadu_si256((const __m256i *)(src + i)), &v0) ||
+			!hex_value_avx2(_mm256_loadu_si256((const __m256i *)(src + i + 32)), &v1))
+			break;
+		// packus 在每个 lane 里合并，得到 [0-7, 16-23, 8-15, 24-31] ，再按 64 位重排
+		__m256i r = _mm256_packus_epi16(_mm256_maddubs_epi16(v0, weight), _mm256_maddubs_epi16(v1, weight));
+		_mm256_storeu_si256((__m256i *)(dst + i / 2), _mm256_permute4x64_epi64(r, 0xD8));
+	}
+	return i;
+}
+
+// base64 ，见 http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html 和 2016-01-17-sse-base64-decoding.html
+
+// 每 32 位里有 4 个 6 位的下标，转换成字符
+__attribute__((target("ssse3")))
+static inline __m128i
+b64_split_ssse3(__m128i in) {
+	// 每 3 个字节放进一个 32 位里： [b1, b0, b2, b1]
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	__m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t0, t1);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i
+b64_lookup_ssse3(__m128i idx) {
+	// 按下标的范围得到字符和下标的差： 0-25 'A' ， 26-51 'a'-26 ， 52-61 '0'-52 ， 62 '+'-62 ， 63 '/'-63
+	const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	__m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+	r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+	return _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx);
+}
+
+__attribute__((target("ssse3")))
+static size_t
+b64_encode_ssse3(char *dst, const uint8_t *src, size_t n) {
+	size_t i, j = 0;
+	// 每次读 16 字节，用前 12 字节
+	for (i=0;i+16<=n;i+=12) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + j), b64_lookup_ssse3(b64_split_ssse3(in)));
+		j += 16;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+b64_encode_avx2(char *dst, const uint8_t *src, size_t n) {
+	const __m256i shuffle = _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	size_t i, j = 0;
+	// 每个 lane 12 字节，两次 128 位的读取最多到 i + 28
+	for (i=0;i+28<=n;i+=24) {
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + i))),
+			_mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+		in = _mm256_shuffle_epi8(in, shuffle);
+		__m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+		__m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+		__m256i idx = _mm256_or_si256(t0, t1);
+		__m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		__m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+		r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		_mm256_storeu_si256((__m256i *)(dst + j), _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), idx));
+		j += 32;
+	}
+	return i;
+}
+
+/*
+	字符按高 4 位和低 4 位各查一张位图，两者相与不为 0 的是不合法的字符（包括 '=' ），
+	合法的字符按高 4 位（ '/' 单独处理）加上一个差得到 0-63
+ */
+#define B64_LUT_LO 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+#define B64_LUT_HI 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define B64_LUT_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+
+__attribute__((target("ssse3")))
+static size_t
+b64_decode_ssse3(uint8_t *dst, const uint8_t *src, size_t n) {
+	const __m128i lut_lo = _mm_setr_epi8(B64_LUT_LO);
+	const __m128i lut_hi = _mm_setr_epi8(B64_LUT_HI);
+	const __m128i lut_roll = _mm_setr_epi8(B64_LUT_ROLL);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i, j = 0;
+	// 每次写 16 字节（用 12 字节），输入多留 8 字节保证不写出输出的缓冲区
+	for (i=0;i+24<=n;i+=16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi_nibble = _mm_and_si128(_mm_srli_epi32(in, 4), mask);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(in, mask));
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibble);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+			break;
+		__m128i eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+		__m128i v = _mm_add_epi8(in, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibble)));
+		// 每 4 个 6 位合成 24 位，再取出每个 32 位里的 3 个字节
+		v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+		v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+		v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		_mm_storeu_si128((__m128i *)(dst + j), v);
+		j += 12;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+b64_decode_avx2(uint8_t *dst, const uint8_t *src, size_t n) {
+	const __m256i lut_lo = _mm256_setr_epi8(B64_LUT_LO, B64_LUT_LO);
+	const __m256i lut_hi = _mm256_setr_epi8(B64_LUT_HI, B64_LUT_HI);
+	const __m256i lut_roll = _mm256_setr_epi8(B64_LUT_ROLL, B64_LUT_ROLL);
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	const __m256i shuffle = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	size_t i, j = 0;
+	// 每次写 32 字节（用 24 字节）
+	for (i=0;i+48<=n;i+=32) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i hi_nibble = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, mask));
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibble);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+		__m256i eq_2f = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+		__m256i v = _mm256_add_epi8(in, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibble)));
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, shuffle);
+		// 两个 lane 各 12 字节，合并到前 24 字节
+		v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm256_storeu_si256((__m256i *)(dst + j), v);
+		j += 24;
+	}
+	return i;
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+#define CODEC_NEON
+#include <arm_neon.h>
+
+static size_t
+hex_encode_neon(char *dst, const uint8_t *src, size_t n) {
+	const uint8x16_t lut = vld1q_u8((const uint8_t *)"0123456789abcdef");
+	const uint8x16_t mask = vdupq_n_u8(0x0f);
+	size_t i;
+	for (i=0;i+16<=n;i+=16) {
+		uint8x16_t v = vld1q_u8(src + i);
+		uint8x16x2_t r;
+		r.val[0] = vqtbl1q_u8(lut, vshrq_n_u8(v, 4));
+		r.val[1] = vqtbl1q_u8(lut, vandq_u8(v, mask));
+		vst2q_u8((uint8_t *)dst + i * 2, r);
+	}
+	return i;
+}
+
+// 16 个字符 [0-9a-f] 转换成 0-15 ，不合法的字符在 valid 里为 0
+static inline uint8x16_t
+hex_value_neon(uint8x16_t c, uint8x16_t *valid) {
+	uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+	uint8x16_t a = vsubq_u8(c, vdupq_n_u8('a'));
+	uint8x16_t isd = vcleq_u8(d, vdupq_n_u8(9));
+	uint8x16_t isa = vcleq_u8(a, vdupq_n_u8(5));
+	*valid = vandq_u8(*valid, vorrq_u8(isd, isa));
+	return vbslq_u8(isd, d, vaddq_u8(a, vdupq_n_u8(10)));
+}
+
+static size_t
+hex_decode_neon(uint8_t *dst, const char *src, size_t n) {
+	size_t i;
+	for (i=0;i+32<=n;i+=32) {
+		// val[0] 是高 4 位的字符， val[1] 是低 4 位的
+		uint8x16x2_t c = vld2q_u8((const uint8_t *)src + i);
+		uint8x16_t valid = vdupq_n_u8(0xff);
+		uint8x16_t hi = hex_value_neon(c.val[0], &valid);
+		uint8x16_t lo = hex_value_neon(c.val[1], &valid);
+		if (vminvq_u8(valid) == 0)
+			break;
+		vst1q_u8(dst + i / 2, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+	}
+	return i;
+}
+
+static const uint8_t b64_encoding[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// 0xff 为不合法的字符
+static const uint8_t b64_decoding[128] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+static inline uint8x16x4_t
+load_lut(const uint8_t *p) {
+	uint8x16x4_t t;
+	t.val[0] = vld1q_u8(p);
+	t.val[1] = vld1q_u8(p + 16);
+	t.val[2] = vld1q_u8(p + 32);
+	t.val[3] = vld1q_u8(p + 48);
+	return t;
+}
+
+static size_t
+b64_encode_neon(char *dst, const uint8_t *src, size_t n) {
+	const uint8x16x4_t lut = load_lut(b64_encoding);
+	const uint8x16_t mask = vdupq_n_u8(0x3f);
+	size_t i, j = 0;
+	for (i=0;i+48<=n;i+=48) {
+		uint8x16x3_t in = vld3q_u8(src + i);
+		uint8x16x4_t out;
+		out.val[0] = vshrq_n_u8(in.val[0], 2);
+		out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask);
+		out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask);
+		out.val[3] = vandq_u8(in.val[2], mask);
+		out.val[0] = vqtbl4q_u8(lut, out.val[0]);
+		out.val[1] = vqtbl4q_u8(lut, out.val[1]);
+		out.val[2] = vqtbl4q_u8(lut, out.val[2]);
+		out.val[3] = vqtbl4q_u8(lut, out.val[3]);
+		vst4q_u8((uint8_t *)dst + j, out);
+		j += 64;
+	}
+	return i;
+}
+
+// 查表得到 0-63 ， 0xff 或者字符 >= 128 时高位不为 0
+static inline uint8x16_t
+b64_value_neon(uint8x16x4_t lo, uint8x16x4_t hi, uint8x16_t c) {
+	// 下标超过 63 时 vqtbl4q 返回 0
+	uint8x16_t v = vorrq_u8(vqtbl4q_u8(lo, c), vqtbl4q_u8(hi, veorq_u8(c, vdupq_n_u8(0x40))));
+	return vorrq_u8(v, vcgtq_u8(c, vdupq_n_u8(0x7f)));
+}
+
+static size_t
+b64_decode_neon(uint8_t *dst, const uint8_t *src, size_t n) {
+	const uint8x16x4_t lo = load_lut(b64_decoding);
+	const uint8x16x4_t hi = load_lut(b64_decoding + 64);
+	size_t i, j = 0;
+	for (i=0;i+64<=n;i+=64) {
+		uint8x16x4_t c = vld4q_u8(src + i);
+		uint8x16_t a = b64_value_neon(lo, hi, c.val[0]);
+		uint8x16_t b = b64_value_neon(lo, hi, c.val[1]);
+		uint8x16_t d = b64_value_neon(lo, hi, c.val[2]);
+		uint8x16_t e = b64_value_neon(lo, hi, c.val[3]);
+		if (vmaxvq_u8(vorrq_u8(vorrq_u8(a, b), vorrq_u8(d, e))) > 0x3f)
+			break;
+		uint8x16x3_t out;
+		out.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+		out.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(d, 2));
+		out.val[2] = vorrq_u8(vshlq_n_u8(d, 6), e);
+		vst3q_u8(dst + j, out);
+		j += 48;
+	}
+	return i;
+}
+
+#endif
+
+// 返回编码了的字节数 ， dst 写入 2 倍的字符
+size_t
+codec_hex_encode(char *dst, const uint8_t *src, size_t n) {
+#if defined(CODEC_X86)
+	if (__builtin_cpu_supports("avx2")) {
+		// 剩下不到一块的部分再交给 SSSE3
+		size_t i = hex_encode_avx2(dst, src, n);
+		return i + hex_encode_ssse3(dst + i * 2, src + i, n - i);
+	}
+	if (__builtin_cpu_supports("ssse3"))
+		return hex_encode_ssse3(dst, src, n);
+#elif defined(CODEC_NEON)
+	return hex_encode_neon(dst, src, n);
+#endif
+	return 0;
+}
+
+// 返回解码了的字符数（偶数）， dst 写入一半的字节
+size_t
+codec_hex_decode(uint8_t *dst, const char *src, size_t n) {
+#if defined(CODEC_X86)
+	if (__builtin_cpu_supports("avx2")) {
+		// 剩下不到一块的部分再交给 SSSE3
+		size_t i = hex_decode_avx2(dst, src, n);
+		return i + hex_decode_ssse3(dst + i / 2, src + i, n - i);
+	}
+	if (__builtin_cpu_supports("ssse3"))
+		return hex_decode_ssse3(dst, src, n);
+#elif defined(CODEC_NEON)
+	return hex_decode_neon(dst, src, n);
+#endif
+	return 0;
+}
+
+// 返回编码了的字节数（3 的倍数）， dst 写入 4/3 倍的字符
+size_t
+codec_b64_encode(char *dst, const uint8_t *src, size_t n) {
+#if defined(CODEC_X86)
+	if (__builtin_cpu_supports("avx2")) {
+		// 剩下不到一块的部分再交给 SSSE3
+		size_t i = b64_encode_avx2(dst, src, n);
+		return i + b64_encode_ssse3(dst + i / 3 * 4, src + i, n - i);
+	}
+	if (__builtin_cpu_supports("ssse3"))
+		return b64_encode_ssse3(dst, src, n);
+#elif defined(CODEC_NEON)
+	return b64_encode_neon(dst, src, n);
+#endif
+	return 0;
+}
+
+/*
+	返回解码了的字符数（4 的倍数）， dst 写入 3/4 倍的字节。
+	dst 至少要有 (n + 3) / 4 * 3 字节，向量写入可能超过实际的输出，但不会超过这个大小
+ */
+size_t
+codec_b64_decode(uint8_t *dst, const uint8_t *src, size_t n) {
+#if defined(CODEC_X86)
+	if (__builtin_cpu_supports("avx2")) {
+		// 剩下不到一块的部分再交给 SSSE3
+		size_t i = b64_decode_avx2(dst, src, n);
+		return i + b64_decode_ssse3(dst + i / 4 * 3, src + i, n - i);
+	}
+	if (__builtin_cpu_supports("ssse3"))
+		return b64_decode_ssse3(dst, src, n);
+#elif defined(CODEC_NEON)
+	return b64_decode_neon(dst, src, n);
+#endif
+	return 0;
+}
@@ -0,0 +1,215 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+	raw deflate 流，用于 WebSocket 的 permessage-deflate (RFC 7692) ，见 http/websocket.lua
+
+	每个消息以 Z_SYNC_FLUSH 结束，去掉末尾的 00 00 ff ff ；解压时补上。
+	nocontext (no_context_takeover) 时每个消息之后重置，不保留滑动窗口。
+ */
+
+#define DEFLATER_METATABLE "DEFLATE_DEFLATER"
+#define INFLATER_METATABLE "DEFLATE_INFLATER"
+
+#define CHUNK 4096
+
+static const unsigned char TAIL[4] = { 0, 0, 0xff, 0xff };
+
+struct stream {
+	z_stream z;
+	int init;
+	int nocontext;
+	size_t maxsize;
+};
+
+static struct stream *
+newstream(lua_State *L, const char *meta, const luaL_Reg *l, lua_CFunction gc) {
+	struct stream * s = (struct stream *)lua_newuserdatauv(L, sizeof(*s), 0);
+	memset(s, 0, sizeof(*s));
+	if (luaL_newmetatable(L, meta)) {
+		lua_newtable(L);
+		luaL_setfuncs(L, l, 0);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return s;
+}
+
+/*
+	string data
+	return string : 压缩后的消息
+ */
+static int
+ldeflate(lua_State *L) {
+	struct stream * s = (struct stream *)luaL_checkudata(L, 1, DEFLATER_METATABLE);
+	size_t sz;
+	const char * data = luaL_checklstring(L, 2, &sz);
+	if (!s->init)
+		return luaL_error(L, "deflater is closed");
+	z_stream * z = &s->z;
+	z->next_in = (Bytef *)data;
+	z->avail_in = (uInt)sz;
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	do {
+		z->next_out = (Bytef *)luaL_prepbuffsize(&b, CHUNK);
+		z->avail_out = CHUNK;
+		int err = deflate(z, Z_SYNC_FLUSH);
+		if (err != Z_OK && err != Z_BUF_ERROR)
+			return luaL_error(L, "deflate error : %s", z->msg ? z->msg : "unknown");
+		luaL_addsize(&b, CHUNK - z->avail_out);
+	} while (z->avail_out == 0);
+	if (luaL_bufflen(&b) >= 4) {
+		// Z_SYNC_FLUSH 以 00 00 ff ff 结尾
+		luaL_buffsub(&b, 4);
+	} else {
+		// 刚 flush 过又没有输入时没有输出，用一个空的 stored block
+		luaL_buffsub(&b, luaL_bufflen(&b));
+		luaL_addchar(&b, 0);
+	}
+	z->next_in = NULL;
+	if (s->nocontext)
+		deflateReset(z);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+	string data : 一个完整的消息
+	return string
+ */
+static int
+linflate(lua_State *L) {
+	struct stream * s = (struct stream *)luaL_checkudata(L, 1, INFLATER_METATABLE);
+	size_t sz;
+	const char * data = luaL_checklstring(L, 2, &sz);
+	if (!s->init)
+		return luaL_error(L, "inflater is closed");
+	z_stream * z = &s->z;
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	size_t total = 0;
+	int tail;
+	for (tail=0;tail<2;tail++) {
+		if (tail) {
+			z->next_in = (Bytef *)TAIL;
+			z->avail_in = sizeof(TAIL);
+		} else {
+			z->next_in = (Bytef *)data;
+			z->avail_in = (uInt)sz;
+		}
+		for (;;) {
+			z->next_out = (Bytef *)luaL_prepbuffsize(&b, CHUNK);
+			z->avail_out = CHUNK;
+			int err = inflate(z, Z_SYNC_FLUSH);
+			size_t n = CHUNK - z->avail_out;
+			luaL_addsize(&b, n);
+			total += n;
+			if (total > s->maxsize) {
+				inflateReset(z);
+				return luaL_error(L, "payload_len is too large");
+			}
+			if (err == Z_STREAM_END) {
+				// 对方设置了 BFINAL ，后面的数据是新的流
+				inflateReset(z);
+			} else if (err == Z_BUF_ERROR) {
+				break;
+			} else if (err != Z_OK) {
+				const char * msg = z->msg ? z->msg : "unknown";
+				inflateReset(z);
+				return luaL_error(L, "inflate error : %s", msg);
+			}
+			if (z->avail_in == 0 && z->avail_out != 0)
+				break;
+		}
+	}
+	z->next_in = NULL;
+	if (s->nocontext)
+		inflateReset(z);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+static int
+ldeflater_gc(lua_State *L) {
+	struct stream * s = (struct stream *)lua_touserdata(L, 1);
+	if (s->init) {
+		deflateEnd(&s->z);
+		s->init = 0;
+	}
+	return 0;
+}
+
+static int
+linflater_gc(lua_State *L) {
+	struct stream * s = (struct stream *)lua_touserdata(L, 1);
+	if (s->init) {
+		inflateEnd(&s->z);
+		s->init = 0;
+	}
+	return 0;
+}
+
+/*
+	integer level : 压缩级别，默认 Z_DEFAULT_COMPRESSION
+	integer windowbits : 9 - 15 ，默认 15
+	boolean nocontext
+	return deflater : deflater:deflate(data) 返回压缩后的数据
+ */
+static int
+lnewdeflater(lua_State *L) {
+	int level = (int)luaL_optinteger(L, 1, Z_DEFAULT_COMPRESSION);
+	int bits = (int)luaL_optinteger(L, 2, MAX_WBITS);
+	luaL_argcheck(L, bits >= 9 && bits <= MAX_WBITS, 2, "windowbits should be 9 - 15");
+	int nocontext = lua_toboolean(L, 3);
+	luaL_Reg l[] = {
+		{ "deflate", ldeflate },
+		{ NULL, NULL },
+	};
+	struct stream * s = newstream(L, DEFLATER_METATABLE, l, ldeflater_gc);
+	s->nocontext = nocontext;
+	// 窗口越小，每个连接占的内存越少
+	if (deflateInit2(&s->z, level, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return luaL_error(L, "deflateInit failed");
+	s->init = 1;
+	return 1;
+}
+
+/*
+	integer maxsize : 解压后的上限，可选
+	boolean nocontext
+	return inflater : inflater:inflate(data) 返回解压后的数据
+ */
+static int
+lnewinflater(lua_State *L) {
+	lua_Integer maxsize = luaL_optinteger(L, 1, -1);
+	int nocontext = lua_toboolean(L, 2);
+	luaL_Reg l[] = {
+		{ "inflate", linflate },
+		{ NULL, NULL },
+	};
+	struct stream * s = newstream(L, INFLATER_METATABLE, l, linflater_gc);
+	s->maxsize = (size_t)maxsize;
+	s->nocontext = nocontext;
+	// 15 可以解开对方任何大小窗口的数据
+	if (inflateInit2(&s->z, -MAX_WBITS) != Z_OK)
+		return luaL_error(L, "inflateInit failed");
+	s->init = 1;
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_ldeflate(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "deflater", lnewdeflater },
+		{ "inflater", lnewinflater },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
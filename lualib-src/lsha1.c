@@ -173,6 +173,80 @@ static void	SHA1_Transform(uint32_t	state[5], const	uint8_t	buffer[64])
 }
 
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+/* SHA extensions (SHA-NI), chosen at runtime in SHA1_Blocks() */
+#define	SHA1_SHANI
+#include <immintrin.h>
+
+/* 4 rounds, k is the step (0-19); e is the E of this step and the ABCD
+   before the rounds is saved in o, the next step's E. The message words
+   are scheduled 3 steps ahead in msg[]. */
+#define	SHANI_STEP(k, e, o) do { \
+	if ((k) == 0) { \
+		e = _mm_add_epi32(e, msg[0]); \
+	} else { \
+		e = _mm_sha1nexte_epu32(e, msg[(k)&3]); \
+	} \
+	o = abcd; \
+	if ((k) >= 3 && (k) < 19) \
+		msg[((k)+1)&3] = _mm_sha1msg2_epu32(msg[((k)+1)&3], msg[(k)&3]); \
+	abcd = _mm_sha1rnds4_epu32(abcd, e, (k)/5); \
+	if ((k) >= 1 && (k) < 17) \
+		msg[((k)+3)&3] = _mm_sha1msg1_epu32(msg[((k)+3)&3], msg[(k)&3]); \
+	if ((k) >= 2 && (k) < 18) \
+		msg[((k)+2)&3] = _mm_xor_si128(msg[((k)+2)&3], msg[(k)&3]); \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void	sha1_shani(uint32_t	state[5], const	uint8_t	*data, size_t n)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const	__m128i	*)state), 0x1B);
+	__m128i	e0 = _mm_set_epi32((int)state[4], 0, 0,	0);
+	__m128i	e1;
+	__m128i	msg[4];
+	int	i;
+
+	while (n--)	{
+		__m128i	abcd_save =	abcd;
+		__m128i	e0_save	= e0;
+		for	(i = 0;	i <	4; i++)	{
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), mask);
+		}
+		SHANI_STEP(0, e0, e1);	SHANI_STEP(1, e1, e0);	SHANI_STEP(2, e0, e1);	SHANI_STEP(3, e1, e0);
+		SHANI_STEP(4, e0, e1);	SHANI_STEP(5, e1, e0);	SHANI_STEP(6, e0, e1);	SHANI_STEP(7, e1, e0);
+		SHANI_STEP(8, e0, e1);	SHANI_STEP(9, e1, e0);	SHANI_STEP(10, e0, e1);	SHANI_STEP(11, e1, e0);
+		SHANI_STEP(12, e0, e1);	SHANI_STEP(13, e1, e0);	SHANI_STEP(14, e0, e1);	SHANI_STEP(15, e1, e0);
+		SHANI_STEP(16, e0, e1);	SHANI_STEP(17, e1, e0);	SHANI_STEP(18, e0, e1);	SHANI_STEP(19, e1, e0);
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+		data +=	64;
+	}
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#endif
+
+/* Hash	n 512-bit blocks */
+static void	SHA1_Blocks(uint32_t state[5], const uint8_t *data,	size_t n)
+{
+	if (n == 0)
+		return;
+#ifdef SHA1_SHANI
+	if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+		sha1_shani(state, data,	n);
+		return;
+	}
+#endif
+	while (n--)	{
+		SHA1_Transform(state, data);
+		data +=	64;
+	}
+}
+
+
 /* SHA1Init	- Initialize new context */
 static void sat_SHA1_Init(SHA1_CTX* context)
 {
@@ -200,10 +274,9 @@ static void sat_SHA1_Update(SHA1_CTX* context,	const uint8_t* data, const size_t
 	context->count[1] += (len >> 29);
 	if ((j + len) >	63)	{
 		memcpy(&context->buffer[j],	data, (i = 64-j));
-		SHA1_Transform(context->state, context->buffer);
-		for	( ;	i +	63 < len; i	+= 64) {
-			SHA1_Transform(context->state, data	+ i);
-		}
+		SHA1_Blocks(context->state, context->buffer, 1);
+		SHA1_Blocks(context->state, data + i, (len - i) / 64);
+		i += (len - i) & ~(size_t)63;
 		j =	0;
 	}
 	else i = 0;
@@ -220,15 +293,18 @@ static void sat_SHA1_Final(SHA1_CTX* context, uint8_t digest[SHA1_DIGEST_SIZE])
 {
 	uint32_t i;
 	uint8_t	 finalcount[8];
+	uint8_t	 padding[64];
+	size_t	 j = (context->count[0]	>> 3) &	63;
+	size_t	 padsize = j < 56 ? 56 - j : 120 - j;
 
 	for	(i = 0;	i <	8; i++)	{
 		finalcount[i] =	(unsigned char)((context->count[(i >= 4	? 0	: 1)]
 		 >>	((3-(i & 3)) * 8) )	& 255);	 /*	Endian independent */
 	}
-	sat_SHA1_Update(context, (uint8_t *)"\200",	1);
-	while ((context->count[0] &	504) !=	448) {
-		sat_SHA1_Update(context, (uint8_t *)"\0", 1);
-	}
+	/* pad with	\200 and zeros	until 56 bytes (mod	64) in one update */
+	padding[0] = 0x80;
+	memset(padding + 1,	0, padsize - 1);
+	sat_SHA1_Update(context, padding, padsize);
 	sat_SHA1_Update(context, finalcount, 8);  /* Should	cause a	SHA1_Transform() */
 	for	(i = 0;	i <	SHA1_DIGEST_SIZE; i++) {
 		digest[i] =	(uint8_t)
@@ -271,15 +347,14 @@ xor_key(uint8_t key[BLOCKSIZE], uint32_t xor_) {
 	}
 }
 
-LUAMOD_API int
-lhmac_sha1(lua_State *L) {
-	size_t key_sz = 0;
-	const uint8_t * key = (const uint8_t *)luaL_checklstring(L, 1, &key_sz);
-	size_t text_sz = 0;
-	const uint8_t * text = (const uint8_t *)luaL_checklstring(L, 2, &text_sz);
-	SHA1_CTX ctx1, ctx2;
-	uint8_t digest1[SHA1_DIGEST_SIZE];
-	uint8_t digest2[SHA1_DIGEST_SIZE];
+struct hmac_sha1 {
+	SHA1_CTX inner;
+	SHA1_CTX outer;
+};
+
+// The key	blocks are hashed once, then copied	for	each text
+static void
+hmac_sha1_init(struct hmac_sha1	*h,	const uint8_t *key,	size_t key_sz) {
 	uint8_t rkey[BLOCKSIZE];
 	memset(rkey, 0, BLOCKSIZE);
 
@@ -288,26 +363,66 @@ lhmac_sha1(lua_State *L) {
 		sat_SHA1_Init(&ctx);
 		sat_SHA1_Update(&ctx, key, key_sz);
 		sat_SHA1_Final(&ctx, rkey);
-		key_sz = SHA1_DIGEST_SIZE;
 	} else {
 		memcpy(rkey, key, key_sz);
 	}
 
 	xor_key(rkey, 0x5c5c5c5c);
-	sat_SHA1_Init(&ctx1);
-	sat_SHA1_Update(&ctx1, rkey, BLOCKSIZE);
+	sat_SHA1_Init(&h->outer);
+	sat_SHA1_Update(&h->outer, rkey, BLOCKSIZE);
 
 	xor_key(rkey, 0x5c5c5c5c ^ 0x36363636);
-	sat_SHA1_Init(&ctx2);
-	sat_SHA1_Update(&ctx2, rkey, BLOCKSIZE);
+	sat_SHA1_Init(&h->inner);
+	sat_SHA1_Update(&h->inner, rkey, BLOCKSIZE);
+}
+
+static void
+hmac_sha1_digest(const struct hmac_sha1	*h,	const uint8_t *text, size_t	text_sz, uint8_t digest[SHA1_DIGEST_SIZE]) {
+	SHA1_CTX ctx1 = h->outer;
+	SHA1_CTX ctx2 = h->inner;
+	uint8_t digest2[SHA1_DIGEST_SIZE];
+
 	sat_SHA1_Update(&ctx2, text, text_sz);
 	sat_SHA1_Final(&ctx2, digest2);
 
 	sat_SHA1_Update(&ctx1, digest2, SHA1_DIGEST_SIZE);
-	sat_SHA1_Final(&ctx1, digest1);
+	sat_SHA1_Final(&ctx1, digest);
+}
 
-	lua_pushlstring(L, (const char *)digest1, SHA1_DIGEST_SIZE);
+/*
+	string key
+	string text	/ table	texts :	sign a batch of	texts with the same	key
+	return string digest / table digests
+ */
+LUAMOD_API int
+lhmac_sha1(lua_State *L) {
+	size_t key_sz = 0;
+	const uint8_t * key = (const uint8_t *)luaL_checklstring(L, 1, &key_sz);
+	struct hmac_sha1 h;
+	uint8_t digest[SHA1_DIGEST_SIZE];
+	size_t text_sz = 0;
+	const uint8_t * text;
+
+	if (lua_type(L, 2) == LUA_TTABLE) {
+		lua_Integer i, n = (lua_Integer)lua_rawlen(L, 2);
+		hmac_sha1_init(&h, key, key_sz);
+		lua_createtable(L, (int)n, 0);
+		for (i=1;i<=n;i++) {
+			lua_rawgeti(L, 2, i);
+			if (lua_type(L, -1) != LUA_TSTRING)
+				return luaL_error(L, "text %d is not a string", (int)i);
+			text = (const uint8_t *)lua_tolstring(L, -1, &text_sz);
+			hmac_sha1_digest(&h, text, text_sz, digest);
+			lua_pop(L, 1);
+			lua_pushlstring(L, (const char *)digest, SHA1_DIGEST_SIZE);
+			lua_rawseti(L, -2, i);
+		}
+		return 1;
+	}
+	text = (const uint8_t *)luaL_checklstring(L, 2, &text_sz);
+	hmac_sha1_init(&h, key, key_sz);
+	hmac_sha1_digest(&h, text, text_sz, digest);
+	lua_pushlstring(L, (const char *)digest, SHA1_DIGEST_SIZE);
 
 	return 1;
 }
-
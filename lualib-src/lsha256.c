@@ -0,0 +1,272 @@
+#define LUA_LIB
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+	SHA-256 (FIPS 180-4) 和 HMAC-SHA256 (RFC 2104)
+	x86 上 CPU 支持 SHA 指令 (SHA-NI) 时用它，否则用标量实现。
+ */
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;	// 字节数
+	uint8_t buffer[SHA256_BLOCK_SIZE];
+};
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline uint32_t
+load_be32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void
+sha256_transform(uint32_t state[8], const uint8_t *data, size_t n) {
+	uint32_t w[64];
+	int i;
+	while (n--) {
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (i=0;i<16;i++) {
+			w[i] = load_be32(data + i * 4);
+		}
+		for (;i<64;i++) {
+			uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+			uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+		for (i=0;i<64;i++) {
+			uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+			uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += SHA256_BLOCK_SIZE;
+	}
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#define SHA256_SHANI
+#include <immintrin.h>
+
+// 4 轮，k 是第几组 (0-15) ，k >= 4 时先由前 4 组算出这一组的消息
+#define SHANI_ROUNDS(k) do { \
+	if ((k) >= 4) { \
+		__m128i t = _mm_sha256msg1_epu32(msg[(k)&3], msg[((k)+1)&3]); \
+		t = _mm_add_epi32(t, _mm_alignr_epi8(msg[((k)+3)&3], msg[((k)+2)&3], 4)); \
+		msg[(k)&3] = _mm_sha256msg2_epu32(t, msg[((k)+3)&3]); \
+	} \
+	__m128i m = _mm_add_epi32(msg[(k)&3], _mm_loadu_si128((const __m128i *)&K[(k)*4])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, m); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0E)); \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_shani(uint32_t state[8], const uint8_t *data, size_t n) {
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);	// CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);	// EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);	// ABEF
+	__m128i msg[4];
+	int i;
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	// CDGH
+	while (n--) {
+		__m128i save0 = state0;
+		__m128i save1 = state1;
+		for (i=0;i<4;i++) {
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), mask);
+		}
+		SHANI_ROUNDS(0); SHANI_ROUNDS(1); SHANI_ROUNDS(2); SHANI_ROUNDS(3);
+		SHANI_ROUNDS(4); SHANI_ROUNDS(5); SHANI_ROUNDS(6); SHANI_ROUNDS(7);
+		SHANI_ROUNDS(8); SHANI_ROUNDS(9); SHANI_ROUNDS(10); SHANI_ROUNDS(11);
+		SHANI_ROUNDS(12); SHANI_ROUNDS(13); SHANI_ROUNDS(14); SHANI_ROUNDS(15);
+		state0 = _mm_add_epi32(state0, save0);
+		state1 = _mm_add_epi32(state1, save1);
+		data += SHA256_BLOCK_SIZE;
+	}
+	tmp = _mm_shuffle_epi32(state0, 0x1B);	// FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);	// DCHG
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));	// DCBA
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));	// HGFE
+}
+
+#endif
+
+static void
+sha256_blocks(uint32_t state[8], const uint8_t *data, size_t n) {
+	if (n == 0)
+		return;
+#ifdef SHA256_SHANI
+	if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+		sha256_shani(state, data, n);
+		return;
+	}
+#endif
+	sha256_transform(state, data, n);
+}
+
+static void
+sha256_init(struct sha256_ctx *ctx) {
+	static const uint32_t H[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(ctx->state, H, sizeof(H));
+	ctx->count = 0;
+}
+
+static void
+sha256_update(struct sha256_ctx *ctx, const uint8_t *data, size_t sz) {
+	size_t used = ctx->count & (SHA256_BLOCK_SIZE - 1);
+	ctx->count += sz;
+	if (used) {
+		size_t left = SHA256_BLOCK_SIZE - used;
+		if (sz < left) {
+			memcpy(ctx->buffer + used, data, sz);
+			return;
+		}
+		memcpy(ctx->buffer + used, data, left);
+		sha256_blocks(ctx->state, ctx->buffer, 1);
+		data += left;
+		sz -= left;
+	}
+	sha256_blocks(ctx->state, data, sz / SHA256_BLOCK_SIZE);
+	data += sz & ~(size_t)(SHA256_BLOCK_SIZE - 1);
+	memcpy(ctx->buffer, data, sz & (SHA256_BLOCK_SIZE - 1));
+}
+
+static void
+sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+	uint8_t padding[SHA256_BLOCK_SIZE + 8];
+	size_t used = ctx->count & (SHA256_BLOCK_SIZE - 1);
+	size_t padsize = used < 56 ? 56 - used : 120 - used;
+	uint64_t bits = ctx->count << 3;
+	int i;
+	padding[0] = 0x80;
+	memset(padding + 1, 0, padsize - 1);
+	for (i=0;i<8;i++) {
+		padding[padsize + i] = (uint8_t)(bits >> (56 - i * 8));
+	}
+	sha256_update(ctx, padding, padsize + 8);
+	for (i=0;i<8;i++) {
+		digest[i*4] = (uint8_t)(ctx->state[i] >> 24);
+		digest[i*4+1] = (uint8_t)(ctx->state[i] >> 16);
+		digest[i*4+2] = (uint8_t)(ctx->state[i] >> 8);
+		digest[i*4+3] = (uint8_t)ctx->state[i];
+	}
+}
+
+/*
+	string text
+	return string : 32 字节的摘要
+ */
+int
+lsha256(lua_State *L) {
+	size_t sz = 0;
+	const uint8_t * text = (const uint8_t *)luaL_checklstring(L, 1, &sz);
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	struct sha256_ctx ctx;
+	sha256_init(&ctx);
+	sha256_update(&ctx, text, sz);
+	sha256_final(&ctx, digest);
+	lua_pushlstring(L, (const char *)digest, SHA256_DIGEST_SIZE);
+	return 1;
+}
+
+struct hmac_sha256 {
+	struct sha256_ctx inner;
+	struct sha256_ctx outer;
+};
+
+// key 的两个块只算一次，每个 text 复制一份状态
+static void
+hmac_sha256_init(struct hmac_sha256 *h, const uint8_t *key, size_t key_sz) {
+	uint8_t rkey[SHA256_BLOCK_SIZE];
+	int i;
+	memset(rkey, 0, SHA256_BLOCK_SIZE);
+	if (key_sz > SHA256_BLOCK_SIZE) {
+		struct sha256_ctx ctx;
+		sha256_init(&ctx);
+		sha256_update(&ctx, key, key_sz);
+		sha256_final(&ctx, rkey);
+	} else {
+		memcpy(rkey, key, key_sz);
+	}
+	for (i=0;i<SHA256_BLOCK_SIZE;i++) {
+		rkey[i] ^= 0x5c;
+	}
+	sha256_init(&h->outer);
+	sha256_update(&h->outer, rkey, SHA256_BLOCK_SIZE);
+	for (i=0;i<SHA256_BLOCK_SIZE;i++) {
+		rkey[i] ^= 0x5c ^ 0x36;
+	}
+	sha256_init(&h->inner);
+	sha256_update(&h->inner, rkey, SHA256_BLOCK_SIZE);
+}
+
+static void
+hmac_sha256_digest(const struct hmac_sha256 *h, const uint8_t *text, size_t sz, uint8_t digest[SHA256_DIGEST_SIZE]) {
+	struct sha256_ctx inner = h->inner;
+	struct sha256_ctx outer = h->outer;
+	uint8_t tmp[SHA256_DIGEST_SIZE];
+	sha256_update(&inner, text, sz);
+	sha256_final(&inner, tmp);
+	sha256_update(&outer, tmp, SHA256_DIGEST_SIZE);
+	sha256_final(&outer, digest);
+}
+
+/*
+	string key
+	string text / table texts : 用同一个 key 签名一批 text
+	return string digest / table digests
+ */
+int
+lhmac_sha256(lua_State *L) {
+	size_t key_sz = 0;
+	const uint8_t * key = (const uint8_t *)luaL_checklstring(L, 1, &key_sz);
+	struct hmac_sha256 h;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	size_t sz = 0;
+	const uint8_t * text;
+	if (lua_type(L, 2) == LUA_TTABLE) {
+		lua_Integer i, n = (lua_Integer)lua_rawlen(L, 2);
+		hmac_sha256_init(&h, key, key_sz);
+		lua_createtable(L, (int)n, 0);
+		for (i=1;i<=n;i++) {
+			lua_rawgeti(L, 2, i);
+			if (lua_type(L, -1) != LUA_TSTRING)
+				return luaL_error(L, "text %d is not a string", (int)i);
+			text = (const uint8_t *)lua_tolstring(L, -1, &sz);
+			hmac_sha256_digest(&h, text, sz, digest);
+			lua_pop(L, 1);
+			lua_pushlstring(L, (const char *)digest, SHA256_DIGEST_SIZE);
+			lua_rawseti(L, -2, i);
+		}
+		return 1;
+	}
+	text = (const uint8_t *)luaL_checklstring(L, 2, &sz);
+	hmac_sha256_init(&h, key, key_sz);
+	hmac_sha256_digest(&h, text, sz, digest);
+	lua_pushlstring(L, (const char *)digest, SHA256_DIGEST_SIZE);
+	return 1;
+}
@@ -10,21 +10,153 @@
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "spinlock.h"
+#include "atomic.h"
+
 
 static bool TLS_IS_INIT = false;
 
+#define TLS_RECORD_SIZE 16384   // max plaintext of a tls record
+#define SESSION_CACHE_SIZE 1024 // client sessions kept for resumption, direct mapped by server name
+#define SHARED_CTX_MAX 64       // named SSL_CTX shared by all services
+#define TICKET_KEYS_MAX 128
+
 struct tls_context {
     SSL* ssl;
     BIO* in_bio;
     BIO* out_bio;
     bool is_server;
     bool is_close;
+    bool session_checked;
 };
 
 struct ssl_ctx {
     SSL_CTX* ctx;
+    bool shared;
+};
+
+struct session_entry {
+    char* host;
+    SSL_SESSION* session;
+};
+
+struct shared_ctx {
+    char* name;
+    SSL_CTX* ctx;
 };
 
+// process wide state, every service loads the same ltls.so
+static struct {
+    struct spinlock lock;
+    struct session_entry session[SESSION_CACHE_SIZE];
+    struct shared_ctx shared[SHARED_CTX_MAX];
+    int shared_n;
+    // all SSL_CTX use the same ticket keys, so a ticket issued by one service is accepted by another
+    unsigned char ticket_keys[TICKET_KEYS_MAX];
+    int ticket_keys_len;
+    int alpn_index;     // ex_data of SSL_CTX, the ALPN protocols of a server
+} G;
+
+static struct {
+    ATOM_INT cache_hit;
+    ATOM_INT cache_miss;
+    ATOM_INT client_resumed;
+    ATOM_INT client_full;
+    ATOM_INT server_resumed;
+    ATOM_INT server_full;
+} STAT;
+
+static unsigned int
+_hash_host(const char* host) {
+    unsigned int h = 5381;
+    while(*host) {
+        h = h * 33 + (unsigned char)*host++;
+    }
+    return h & (SESSION_CACHE_SIZE - 1);
+}
+
+// new session callback: keep the client sessions in the process wide cache
+static int
+_new_session(SSL* ssl, SSL_SESSION* session) {
+    if(SSL_is_server(ssl)) {
+        return 0;
+    }
+    const char* host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if(!host) {
+        return 0;
+    }
+    struct session_entry* e = &G.session[_hash_host(host)];
+    char* h = strdup(host);
+    spinlock_lock(&G.lock);
+    char* old_host = e->host;
+    SSL_SESSION* old_session = e->session;
+    e->host = h;
+    e->session = session;
+    spinlock_unlock(&G.lock);
+    free(old_host);
+    if(old_session) {
+        SSL_SESSION_free(old_session);
+    }
+    return 1;   // we hold the reference now
+}
+
+static SSL_SESSION*
+_get_session(const char* host) {
+    struct session_entry* e = &G.session[_hash_host(host)];
+    SSL_SESSION* session = NULL;
+    spinlock_lock(&G.lock);
+    if(e->host && strcmp(e->host, host) == 0 && SSL_SESSION_is_resumable(e->session)) {
+        session = e->session;
+        SSL_SESSION_up_ref(session);
+    }
+    spinlock_unlock(&G.lock);
+    return session;
+}
+
+// called before the first handshake of a client, resume the last session of the same server name
+static void
+_resume_session(struct tls_context* tls_p) {
+    tls_p->session_checked = true;
+    const char* host = SSL_get_servername(tls_p->ssl, TLSEXT_NAMETYPE_host_name);
+    if(!host) {
+        return;
+    }
+    SSL_SESSION* session = _get_session(host);
+    if(session) {
+        ATOM_FINC(&STAT.cache_hit);
+        SSL_set_session(tls_p->ssl, session);
+        SSL_SESSION_free(session);
+    } else {
+        ATOM_FINC(&STAT.cache_miss);
+    }
+}
+
+static void
+_handshake_done(struct tls_context* tls_p) {
+    int reused = SSL_session_reused(tls_p->ssl);
+    if(tls_p->is_server) {
+        ATOM_FINC(reused ? &STAT.server_resumed : &STAT.server_full);
+    } else {
+        ATOM_FINC(reused ? &STAT.client_resumed : &STAT.client_full);
+    }
+}
+
+static void
+_init_sslctx(SSL_CTX* ctx) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_BOTH);
+    SSL_CTX_sess_set_new_cb(ctx, _new_session);
+    spinlock_lock(&G.lock);
+    if(G.ticket_keys_len == 0) {
+        int len = SSL_CTX_get_tlsext_ticket_keys(ctx, NULL, 0);
+        if(len > 0 && len <= TICKET_KEYS_MAX && SSL_CTX_get_tlsext_ticket_keys(ctx, G.ticket_keys, len)) {
+            G.ticket_keys_len = len;
+        }
+    } else {
+        SSL_CTX_set_tlsext_ticket_keys(ctx, G.ticket_keys, G.ticket_keys_len);
+    }
+    spinlock_unlock(&G.lock);
+}
+
 // static int
 // _ssl_verify_peer(int ok, X509_STORE_CTX* ctx) {
 //     return 1;
@@ -57,6 +189,7 @@ _init_bio(lua_State* L, struct tls_context* tls_p, struct ssl_ctx* ctx_p) {
 static void
 _init_client_context(lua_State* L, struct tls_context* tls_p, struct ssl_ctx* ctx_p) {
     tls_p->is_server = false;
+    tls_p->session_checked = false;
     _init_bio(L, tls_p, ctx_p);
     SSL_set_connect_state(tls_p->ssl);
 }
@@ -64,6 +197,7 @@ _init_client_context(lua_State* L, struct tls_context* tls_p, struct ssl_ctx* ct
 static void
 _init_server_context(lua_State* L, struct tls_context* tls_p, struct ssl_ctx* ctx_p) {
     tls_p->is_server = true;
+    tls_p->session_checked = true;
     _init_bio(L, tls_p, ctx_p);
     SSL_set_accept_state(tls_p->ssl);
 }
@@ -110,9 +244,9 @@ _ltls_context_close(lua_State* L) {
     return 0;
 }
 
+// read the whole out bio straight into the lua buffer, no intermediate copy
 static int
 _bio_read(lua_State* L, struct tls_context* tls_p) {
-    char outbuff[4096];
     int all_read = 0;
     int read = 0;
     int pending = BIO_ctrl_pending(tls_p->out_bio);
@@ -120,13 +254,14 @@ _bio_read(lua_State* L, struct tls_context* tls_p) {
         luaL_Buffer b;
         luaL_buffinit(L, &b);
         while(pending > 0) {
-            read = BIO_read(tls_p->out_bio, outbuff, sizeof(outbuff));
+            char* outbuff = luaL_prepbuffsize(&b, pending);
+            read = BIO_read(tls_p->out_bio, outbuff, pending);
             // printf("BIO_read read:%d pending:%d\n", read, pending);
             if(read <= 0) {
                 luaL_error(L, "BIO_read error:%d", read);
-            }else if(read <= sizeof(outbuff)) {
+            }else if(read <= pending) {
                 all_read += read;
-                luaL_addlstring(&b, (const char*)outbuff, read);
+                luaL_addsize(&b, read);
             }else {
                 luaL_error(L, "invalid BIO_read:%d", read);
             }
@@ -175,16 +310,24 @@ _ltls_context_handshake(lua_State* L) {
         _bio_write(L, tls_p, exchange, slen);
     }
 
+    if(!tls_p->is_server && !tls_p->session_checked) {
+        _resume_session(tls_p);
+    }
+
     // first handshake; initiated by client
     if(!SSL_is_init_finished(tls_p->ssl)) {
         int ret = SSL_do_handshake(tls_p->ssl);
         if(ret == 1) {
+            _handshake_done(tls_p);
             return 0;
         } else if (ret < 0) {
             int err = SSL_get_error(tls_p->ssl, ret);
             ERR_clear_error();
             if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
                 int all_read = _bio_read(L, tls_p);
+                if(SSL_is_init_finished(tls_p->ssl)) {
+                    _handshake_done(tls_p);
+                }
                 if(all_read>0) {
                     return 1;
                 }
@@ -212,13 +355,14 @@ _ltls_context_read(lua_State* L) {
         _bio_write(L, tls_p, encrypted_data, slen);
     }
 
-    char outbuff[4096];
     int read = 0;
     luaL_Buffer b;
     luaL_buffinit(L, &b);
 
     do {
-        read = SSL_read(tls_p->ssl, outbuff, sizeof(outbuff));
+        // decrypt straight into the lua buffer, one tls record (at most 16k) each time
+        char* outbuff = luaL_prepbuffsize(&b, TLS_RECORD_SIZE);
+        read = SSL_read(tls_p->ssl, outbuff, TLS_RECORD_SIZE);
         if(read < 0) {
             int err = SSL_get_error(tls_p->ssl, read);
             ERR_clear_error();
@@ -229,8 +373,8 @@ _ltls_context_read(lua_State* L) {
         }else if(read == 0){
             break;
         }
-        else if(read <= sizeof(outbuff)) {
-            luaL_addlstring(&b, outbuff, read);
+        else if(read <= TLS_RECORD_SIZE) {
+            luaL_addsize(&b, read);
         }else {
             luaL_error(L, "invalid SSL_read:%d", read);
         }
@@ -267,6 +411,58 @@ _ltls_context_write(lua_State* L) {
     return 1;
 }
 
+// { "h2", "http/1.1" } to the wire format of ALPN, pushed as a string
+static void
+_alpn_protos(lua_State* L, int idx) {
+    luaL_checktype(L, idx, LUA_TTABLE);
+    luaL_Buffer b;
+    int n = (int)lua_rawlen(L, idx);
+    int i;
+    lua_pushnil(L);     // scratch slot below the buffer
+    int scratch = lua_gettop(L);
+    luaL_buffinit(L, &b);
+    for(i=1; i<=n; i++) {
+        size_t sz;
+        lua_rawgeti(L, idx, i);
+        lua_replace(L, scratch);
+        const char* proto = lua_tolstring(L, scratch, &sz);
+        if(!proto || sz == 0 || sz > 255) {
+            luaL_error(L, "invalid alpn protocol at %d", i);
+        }
+        luaL_addchar(&b, (char)sz);
+        luaL_addlstring(&b, proto, sz);
+    }
+    luaL_pushresult(&b);
+    lua_replace(L, scratch);
+}
+
+static int
+_lset_alpn(lua_State* L) {
+    struct tls_context* tls_p = _check_context(L, 1);
+    _alpn_protos(L, 2);
+    size_t sz;
+    const unsigned char* protos = (const unsigned char*)lua_tolstring(L, -1, &sz);
+    // returns 0 on success
+    if(SSL_set_alpn_protos(tls_p->ssl, protos, (unsigned int)sz) != 0) {
+        luaL_error(L, "SSL_set_alpn_protos error");
+    }
+    return 0;
+}
+
+// the protocol selected by ALPN, or nil
+static int
+_lalpn(lua_State* L) {
+    struct tls_context* tls_p = _check_context(L, 1);
+    const unsigned char* data = NULL;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(tls_p->ssl, &data, &len);
+    if(data == NULL || len == 0) {
+        return 0;
+    }
+    lua_pushlstring(L, (const char*)data, len);
+    return 1;
+}
+
 static int
 _lset_ext_host_name(lua_State* L) {
     struct tls_context* tls_p = _check_context(L, 1);
@@ -287,6 +483,21 @@ _lctx_gc(lua_State* L) {
     return 0;
 }
 
+// returns the name of the failed call, or NULL
+static const char*
+_use_cert(SSL_CTX* ctx, const char* certfile, const char* key) {
+    if(SSL_CTX_use_certificate_chain_file(ctx, certfile) != 1) {
+        return "SSL_CTX_use_certificate_chain_file";
+    }
+    if(SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1) {
+        return "SSL_CTX_use_PrivateKey_file";
+    }
+    if(SSL_CTX_check_private_key(ctx) != 1) {
+        return "SSL_CTX_check_private_key";
+    }
+    return NULL;
+}
+
 static int
 _lctx_cert(lua_State* L) {
     struct ssl_ctx* ctx_p = _check_sslctx(L, 1);
@@ -300,18 +511,23 @@ _lctx_cert(lua_State* L) {
         luaL_error(L, "need private key");
     }
 
-    int ret = SSL_CTX_use_certificate_chain_file(ctx_p->ctx, certfile);
-    if(ret != 1) {
-        luaL_error(L, "SSL_CTX_use_certificate_chain_file error:%d", ret);
+    if(!ctx_p->shared) {
+        const char* err = _use_cert(ctx_p->ctx, certfile, key);
+        if(err) {
+            luaL_error(L, "%s error", err);
+        }
+        return 0;
     }
 
-    ret = SSL_CTX_use_PrivateKey_file(ctx_p->ctx, key, SSL_FILETYPE_PEM);
-    if(ret != 1) {
-        luaL_error(L, "SSL_CTX_use_PrivateKey_file error:%d", ret);
+    // a shared ctx is configured once, by the first service
+    const char* err = NULL;
+    spinlock_lock(&G.lock);
+    if(!SSL_CTX_get0_certificate(ctx_p->ctx)) {
+        err = _use_cert(ctx_p->ctx, certfile, key);
     }
-    ret = SSL_CTX_check_private_key(ctx_p->ctx);
-    if(ret != 1) {
-        luaL_error(L, "SSL_CTX_check_private_key error:%d", ret);
+    spinlock_unlock(&G.lock);
+    if(err) {
+        luaL_error(L, "%s error", err);
     }
     return 0;
 }
@@ -331,21 +547,123 @@ _lctx_ciphers(lua_State* L) {
 }
 
 
+static void
+_free_alpn(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+    free(ptr);
+}
+
+// the server chooses by its own preference
+static int
+_select_alpn(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg) {
+    const unsigned char* protos = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), G.alpn_index);
+    if(protos == NULL) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    unsigned char* selected = NULL;
+    if(SSL_select_next_proto(&selected, outlen, protos + 1, protos[0], in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// set_alpn({ "h2", "http/1.1" }) : the protocols a server accepts, in its preference
+static int
+_lctx_alpn(lua_State* L) {
+    struct ssl_ctx* ctx_p = _check_sslctx(L, 1);
+    _alpn_protos(L, 2);
+    size_t sz;
+    const char* protos = lua_tolstring(L, -1, &sz);
+    // the first byte is the length of the whole list, it's less than 256 in practice
+    if(sz > 255) {
+        luaL_error(L, "alpn protocols too long");
+    }
+    unsigned char* p = malloc(sz + 1);
+    p[0] = (unsigned char)sz;
+    memcpy(p + 1, protos, sz);
+    spinlock_lock(&G.lock);
+    void* old = SSL_CTX_get_ex_data(ctx_p->ctx, G.alpn_index);
+    if(old && ctx_p->shared) {
+        // a shared ctx is configured once, by the first service
+        spinlock_unlock(&G.lock);
+        free(p);
+        return 0;
+    }
+    SSL_CTX_set_ex_data(ctx_p->ctx, G.alpn_index, p);
+    SSL_CTX_set_alpn_select_cb(ctx_p->ctx, _select_alpn, NULL);
+    spinlock_unlock(&G.lock);
+    free(old);
+    return 0;
+}
+
+static SSL_CTX*
+_shared_ctx(const char* name) {
+    SSL_CTX* ctx = NULL;
+    int i;
+    spinlock_lock(&G.lock);
+    for(i=0; i<G.shared_n; i++) {
+        if(strcmp(G.shared[i].name, name) == 0) {
+            ctx = G.shared[i].ctx;
+            SSL_CTX_up_ref(ctx);
+            break;
+        }
+    }
+    spinlock_unlock(&G.lock);
+    return ctx;
+}
+
+static SSL_CTX*
+_share_ctx(const char* name, SSL_CTX* ctx) {
+    SSL_CTX* exist = NULL;
+    int i;
+    spinlock_lock(&G.lock);
+    for(i=0; i<G.shared_n; i++) {
+        if(strcmp(G.shared[i].name, name) == 0) {
+            exist = G.shared[i].ctx;
+            SSL_CTX_up_ref(exist);
+            break;
+        }
+    }
+    if(!exist && G.shared_n < SHARED_CTX_MAX) {
+        // the registry keeps one reference for the lifetime of the process
+        SSL_CTX_up_ref(ctx);
+        G.shared[G.shared_n].name = strdup(name);
+        G.shared[G.shared_n].ctx = ctx;
+        ++G.shared_n;
+    }
+    spinlock_unlock(&G.lock);
+    if(exist) {
+        // created by another service at the same time
+        SSL_CTX_free(ctx);
+        return exist;
+    }
+    return ctx;
+}
+
+// newctx([name]) : with a name, all the services get the same SSL_CTX
 static int
 lnew_ctx(lua_State* L) {
+    const char* name = luaL_optstring(L, 1, NULL);
     struct ssl_ctx* ctx_p = (struct ssl_ctx*)lua_newuserdatauv(L, sizeof(*ctx_p), 0);
-    ctx_p->ctx = SSL_CTX_new(SSLv23_method());
+    ctx_p->shared = (name != NULL);
+    ctx_p->ctx = name ? _shared_ctx(name) : NULL;
     if(!ctx_p->ctx) {
-        unsigned int err = ERR_get_error();
-        char buf[256];
-        ERR_error_string_n(err, buf, sizeof(buf));
-        luaL_error(L, "SSL_CTX_new client failed. %s\n", buf);
+        SSL_CTX* ctx = SSL_CTX_new(SSLv23_method());
+        if(!ctx) {
+            unsigned int err = ERR_get_error();
+            char buf[256];
+            ERR_error_string_n(err, buf, sizeof(buf));
+            luaL_error(L, "SSL_CTX_new client failed. %s\n", buf);
+        }
+        _init_sslctx(ctx);
+        ctx_p->ctx = name ? _share_ctx(name, ctx) : ctx;
     }
 
     if(luaL_newmetatable(L, "_TLS_SSLCTX_METATABLE_")) {
         luaL_Reg l[] = {
             {"set_ciphers", _lctx_ciphers},
             {"set_cert", _lctx_cert},
+            {"set_alpn", _lctx_alpn},
             {NULL, NULL},
         };
 
@@ -388,6 +706,8 @@ lnew_tls(lua_State* L) {
             {"read", _ltls_context_read},
             {"write", _ltls_context_write},
             {"set_ext_host_name", _lset_ext_host_name},
+            {"set_alpn", _lset_alpn},
+            {"alpn", _lalpn},
             {NULL, NULL},
         };
         luaL_newlib(L, l);
@@ -399,6 +719,25 @@ lnew_tls(lua_State* L) {
     return 1;
 }
 
+// handshake counters of the whole process
+static int
+lstat(lua_State* L) {
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, ATOM_LOAD(&STAT.cache_hit));
+    lua_setfield(L, -2, "cache_hit");
+    lua_pushinteger(L, ATOM_LOAD(&STAT.cache_miss));
+    lua_setfield(L, -2, "cache_miss");
+    lua_pushinteger(L, ATOM_LOAD(&STAT.client_resumed));
+    lua_setfield(L, -2, "client_resumed");
+    lua_pushinteger(L, ATOM_LOAD(&STAT.client_full));
+    lua_setfield(L, -2, "client_full");
+    lua_pushinteger(L, ATOM_LOAD(&STAT.server_resumed));
+    lua_setfield(L, -2, "server_resumed");
+    lua_pushinteger(L, ATOM_LOAD(&STAT.server_full));
+    lua_setfield(L, -2, "server_full");
+    return 1;
+}
+
 int
 luaopen_ltls_c(lua_State* L) {
     if(!TLS_IS_INIT) {
@@ -407,6 +746,7 @@ luaopen_ltls_c(lua_State* L) {
     luaL_Reg l[] = {
         {"newctx", lnew_ctx},
         {"newtls", lnew_tls},
+        {"stat", lstat},
         {NULL, NULL},
     };
     luaL_checkversion(L);
@@ -427,6 +767,10 @@ ltls_init_constructor(lua_State* L) {
         OpenSSL_add_all_algorithms();
     }
 #endif
+    if(!TLS_IS_INIT) {
+        spinlock_init(&G.lock);
+        G.alpn_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, _free_alpn);
+    }
     TLS_IS_INIT = true;
     return 0;
 }
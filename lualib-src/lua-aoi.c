@@ -0,0 +1,678 @@
+#define LUA_LIB
+
+#include "skynet.h"
+#include "skynet_socket.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+/*
+	九宫格（网格）的 AOI ，见 lualib/skynet/aoi.lua
+
+	场景划分成 cell 大小的格子，每个格子是一个实体的双向链表。实体看到周围 radius 格以内的实体，
+	视野是对称的。每次 enter / move / leave 增量地算出三个集合，保存到下一次操作之前：
+		enter : 新看到的实体（它们也新看到了这个实体）
+		leave : 不再看到的实体
+		move : 之前和之后都能看到的实体
+	send 把同一份数据通过 skynet_socket_broadcast 发给集合里实体的 socket ，数据只复制一次。
+ */
+
+#define SET_ENTER 0
+#define SET_LEAVE 1
+#define SET_MOVE 2
+#define SET_VIEW 3	// enter + move ，操作之后所有能看到这个实体的
+
+#define HASH_INITSIZE 64
+
+struct entity {
+	lua_Integer id;
+	double x;
+	double y;
+	int fd;       // socket id ， 0 表示没有
+	int cell;     // 所在的格子，空闲时为 -1
+	int prev;     // 格子链表，-1 表示没有；空闲时 next 是空闲链表
+	int next;
+	int hnext;    // id 的哈希链表
+};
+
+struct intset {
+	int n;
+	int cap;
+	int *idx;
+};
+
+struct aoi_space {
+	double cellsize;
+	int radius;         // 视野的格子数
+	int w;
+	int h;
+	int *cell;          // 每个格子链表的第一个实体，-1 表示空
+	struct entity *e;
+	int n;              // 实体数量
+	int cap;
+	int freelist;
+	int *hash;          // id 的哈希桶，大小为 hcap （2的幂）
+	int hcap;
+	struct intset set[3];
+};
+
+static struct aoi_space *
+check_space(lua_State *L) {
+	struct aoi_space *s = (struct aoi_space *)luaL_checkudata(L, 1, "SKYNET_AOI");
+	if (s->cell == NULL)
+		luaL_error(L, "The aoi space is released");
+	return s;
+}
+
+static inline int
+hash_id(struct aoi_space *s, lua_Integer id) {
+	uint64_t h = (uint64_t)id * 0x9e3779b97f4a7c15ull;
+	return (int)(h >> 32) & (s->hcap - 1);
+}
+
+static int
+find_entity(struct aoi_space *s, lua_Integer id) {
+	int i = s->hash[hash_id(s, id)];
+	while (i >= 0) {
+		if (s->e[i].id == id)
+			return i;
+		i = s->e[i].hnext;
+	}
+	return -1;
+}
+
+static int
+check_entity(lua_State *L, struct aoi_space *s, int index) {
+	lua_Integer id = luaL_checkinteger(L, index);
+	int i = find_entity(s, id);
+	if (i < 0)
+		luaL_error(L, "No entity %I in the aoi space", id);
+	return i;
+}
+
+static void
+hash_rebuild(struct aoi_space *s, int hcap) {
+	skynet_free(s->hash);
+	s->hcap = hcap;
+	s->hash = skynet_malloc(hcap * sizeof(int));
+	memset(s->hash, 0xff, hcap * sizeof(int));
+	int i;
+	for (i=0;i<s->cap;i++) {
+		struct entity *e = &s->e[i];
+		if (e->cell >= 0) {
+			int h = hash_id(s, e->id);
+			e->hnext = s->hash[h];
+			s->hash[h] = i;
+		}
+	}
+}
+
+static void
+hash_remove(struct aoi_space *s, int index) {
+	int *p = &s->hash[hash_id(s, s->e[index].id)];
+	while (*p != index) {
+		p = &s->e[*p].hnext;
+	}
+	*p = s->e[index].hnext;
+}
+
+static int
+cell_index(struct aoi_space *s, double x, double y) {
+	int cx = (int)floor(x / s->cellsize);
+	int cy = (int)floor(y / s->cellsize);
+	if (cx < 0)
+		cx = 0;
+	else if (cx >= s->w)
+		cx = s->w - 1;
+	if (cy < 0)
+		cy = 0;
+	else if (cy >= s->h)
+		cy = s->h - 1;
+	return cy * s->w + cx;
+}
+
+static void
+cell_link(struct aoi_space *s, int index, int cell) {
+	struct entity *e = &s->e[index];
+	e->cell = cell;
+	e->prev = -1;
+	e->next = s->cell[cell];
+	if (e->next >= 0)
+		s->e[e->next].prev = index;
+	s->cell[cell] = index;
+}
+
+static void
+cell_unlink(struct aoi_space *s, int index) {
+	struct entity *e = &s->e[index];
+	if (e->prev >= 0)
+		s->e[e->prev].next = e->next;
+	else
+		s->cell[e->cell] = e->next;
+	if (e->next >= 0)
+		s->e[e->next].prev = e->prev;
+}
+
+static void
+set_push(struct intset *set, int index) {
+	if (set->n >= set->cap) {
+		set->cap = set->cap ? set->cap * 2 : 64;
+		set->idx = skynet_realloc(set->idx, set->cap * sizeof(int));
+	}
+	set->idx[set->n++] = index;
+}
+
+static void
+set_clear(struct aoi_space *s) {
+	s->set[SET_ENTER].n = 0;
+	s->set[SET_LEAVE].n = 0;
+	s->set[SET_MOVE].n = 0;
+}
+
+// 格子周围 radius 格的范围
+struct rect {
+	int x0, y0, x1, y1;
+};
+
+static void
+view_rect(struct aoi_space *s, int cell, struct rect *r) {
+	int cx = cell % s->w;
+	int cy = cell / s->w;
+	r->x0 = cx > s->radius ? cx - s->radius : 0;
+	r->y0 = cy > s->radius ? cy - s->radius : 0;
+	r->x1 = cx + s->radius < s->w ? cx + s->radius : s->w - 1;
+	r->y1 = cy + s->radius < s->h ? cy + s->radius : s->h - 1;
+}
+
+static inline int
+in_rect(const struct rect *r, int x, int y) {
+	return x >= r->x0 && x <= r->x1 && y >= r->y0 && y <= r->y1;
+}
+
+// 把格子里除了 self 以外的实体放进集合
+static void
+collect(struct aoi_space *s, int cell, int self, struct intset *set) {
+	int i = s->cell[cell];
+	while (i >= 0) {
+		if (i != self)
+			set_push(set, i);
+		i = s->e[i].next;
+	}
+}
+
+static void
+collect_rect(struct aoi_space *s, const struct rect *r, int self, struct intset *set) {
+	int x, y;
+	for (y=r->y0;y<=r->y1;y++) {
+		for (x=r->x0;x<=r->x1;x++) {
+			collect(s, y * s->w + x, self, set);
+		}
+	}
+}
+
+static int
+alloc_entity(struct aoi_space *s) {
+	if (s->freelist < 0) {
+		int cap = s->cap * 2;
+		s->e = skynet_realloc(s->e, cap * sizeof(struct entity));
+		int i;
+		for (i=s->cap;i<cap;i++) {
+			s->e[i].cell = -1;
+			s->e[i].next = i + 1 < cap ? i + 1 : -1;
+		}
+		s->freelist = s->cap;
+		s->cap = cap;
+	}
+	int index = s->freelist;
+	s->freelist = s->e[index].next;
+	return index;
+}
+
+/*
+	integer id
+	number x
+	number y
+	integer fd (optional)
+	return the number of the enter set
+ */
+static int
+laoi_enter(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	lua_Integer id = luaL_checkinteger(L, 2);
+	double x = luaL_checknumber(L, 3);
+	double y = luaL_checknumber(L, 4);
+	int fd = (int)luaL_optinteger(L, 5, 0);
+	if (find_entity(s, id) >= 0)
+		return luaL_error(L, "Entity %I is already in the aoi space", id);
+	if (s->n >= s->hcap) {
+		hash_rebuild(s, s->hcap * 2);
+	}
+	int index = alloc_entity(s);
+	struct entity *e = &s->e[index];
+	e->id = id;
+	e->x = x;
+	e->y = y;
+	e->fd = fd;
+	int h = hash_id(s, id);
+	e->hnext = s->hash[h];
+	s->hash[h] = index;
+	++s->n;
+
+	int cell = cell_index(s, x, y);
+	struct rect r;
+	view_rect(s, cell, &r);
+	set_clear(s);
+	collect_rect(s, &r, -1, &s->set[SET_ENTER]);
+	cell_link(s, index, cell);
+	lua_pushinteger(L, s->set[SET_ENTER].n);
+	return 1;
+}
+
+/*
+	integer id
+	number x
+	number y
+	return the number of the enter, leave and move sets
+
+	只在跨格子时比较前后两个范围，格子里的实体按所在的格子整体归类
+ */
+static int
+laoi_move(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	int index = check_entity(L, s, 2);
+	double x = luaL_checknumber(L, 3);
+	double y = luaL_checknumber(L, 4);
+	struct entity *e = &s->e[index];
+	e->x = x;
+	e->y = y;
+	int cell = cell_index(s, x, y);
+	set_clear(s);
+	struct rect old;
+	view_rect(s, e->cell, &old);
+	if (cell == e->cell) {
+		collect_rect(s, &old, index, &s->set[SET_MOVE]);
+	} else {
+		struct rect r;
+		view_rect(s, cell, &r);
+		int cx, cy;
+		for (cy=old.y0;cy<=old.y1;cy++) {
+			for (cx=old.x0;cx<=old.x1;cx++) {
+				collect(s, cy * s->w + cx, index, &s->set[in_rect(&r, cx, cy) ? SET_MOVE : SET_LEAVE]);
+			}
+		}
+		for (cy=r.y0;cy<=r.y1;cy++) {
+			for (cx=r.x0;cx<=r.x1;cx++) {
+				if (!in_rect(&old, cx, cy))
+					collect(s, cy * s->w + cx, index, &s->set[SET_ENTER]);
+			}
+		}
+		cell_unlink(s, index);
+		cell_link(s, index, cell);
+	}
+	lua_pushinteger(L, s->set[SET_ENTER].n);
+	lua_pushinteger(L, s->set[SET_LEAVE].n);
+	lua_pushinteger(L, s->set[SET_MOVE].n);
+	return 3;
+}
+
+/*
+	integer id
+	return the number of the leave set
+ */
+static int
+laoi_leave(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	int index = check_entity(L, s, 2);
+	struct entity *e = &s->e[index];
+	struct rect r;
+	view_rect(s, e->cell, &r);
+	set_clear(s);
+	collect_rect(s, &r, index, &s->set[SET_LEAVE]);
+	cell_unlink(s, index);
+	hash_remove(s, index);
+	e->cell = -1;
+	e->next = s->freelist;
+	s->freelist = index;
+	--s->n;
+	lua_pushinteger(L, s->set[SET_LEAVE].n);
+	return 1;
+}
+
+static const char * set_names[] = { "enter", "leave", "move", "view", NULL };
+
+// 把 n 个实体的 id 放进表 t （栈顶），清掉后面原来的内容
+static void
+fill_ids(lua_State *L, struct aoi_space *s, const int *idx, int n, int from) {
+	int i;
+	for (i=0;i<n;i++) {
+		lua_pushinteger(L, s->e[idx[i]].id);
+		lua_rawseti(L, -2, from + i + 1);
+	}
+}
+
+static void
+clear_tail(lua_State *L, int n) {
+	while (lua_rawgeti(L, -1, ++n) != LUA_TNIL) {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_rawseti(L, -2, n);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+	string set : "enter" / "leave" / "move" / "view"
+	table t (optional)
+	return t, n
+
+	最近一次操作的集合中实体的 id ，t 用来复用，避免每次创建新表
+ */
+static int
+laoi_ids(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	int set = luaL_checkoption(L, 2, NULL, set_names);
+	if (lua_isnoneornil(L, 3)) {
+		lua_settop(L, 2);
+		lua_newtable(L);
+	} else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_settop(L, 3);
+	}
+	int n;
+	if (set == SET_VIEW) {
+		struct intset *enter = &s->set[SET_ENTER];
+		struct intset *move = &s->set[SET_MOVE];
+		fill_ids(L, s, enter->idx, enter->n, 0);
+		fill_ids(L, s, move->idx, move->n, enter->n);
+		n = enter->n + move->n;
+	} else {
+		fill_ids(L, s, s->set[set].idx, s->set[set].n, 0);
+		n = s->set[set].n;
+	}
+	clear_tail(L, n);
+	lua_pushinteger(L, n);
+	return 2;
+}
+
+/*
+	integer id
+	table t (optional)
+	return t, n
+
+	能看到 id 的所有实体
+ */
+static int
+laoi_view(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	int index = check_entity(L, s, 2);
+	if (lua_isnoneornil(L, 3)) {
+		lua_settop(L, 2);
+		lua_newtable(L);
+	} else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_settop(L, 3);
+	}
+	struct rect r;
+	view_rect(s, s->e[index].cell, &r);
+	int n = 0;
+	int x, y;
+	for (y=r.y0;y<=r.y1;y++) {
+		for (x=r.x0;x<=r.x1;x++) {
+			int i = s->cell[y * s->w + x];
+			while (i >= 0) {
+				if (i != index) {
+					lua_pushinteger(L, s->e[i].id);
+					lua_rawseti(L, -2, ++n);
+				}
+				i = s->e[i].next;
+			}
+		}
+	}
+	clear_tail(L, n);
+	lua_pushinteger(L, n);
+	return 2;
+}
+
+struct fdlist {
+	int n;
+	int cap;
+	int *fd;
+	int tmp[256];
+};
+
+static void
+fdlist_push(struct fdlist *l, int fd) {
+	if (fd <= 0)
+		return;
+	if (l->n >= l->cap) {
+		int cap = l->cap * 2;
+		int *fd = skynet_malloc(cap * sizeof(int));
+		memcpy(fd, l->fd, l->n * sizeof(int));
+		if (l->fd != l->tmp)
+			skynet_free(l->fd);
+		l->fd = fd;
+		l->cap = cap;
+	}
+	l->fd[l->n++] = fd;
+}
+
+static void
+fdlist_set(struct fdlist *l, struct aoi_space *s, struct intset *set) {
+	int i;
+	for (i=0;i<set->n;i++) {
+		fdlist_push(l, s->e[set->idx[i]].fd);
+	}
+}
+
+// 把 index 位置的字符串一次发给所有的 fd
+static int
+fdlist_send(lua_State *L, struct fdlist *l, int index) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	struct socket_sendbuffer buf;
+	buf.id = 0;
+	buf.type = SOCKET_BUFFER_RAWPOINTER;
+	buf.buffer = luaL_checklstring(L, index, &buf.sz);
+	int count = 0;
+	if (l->n > 0 && buf.sz > 0) {
+		count = skynet_socket_broadcast(ctx, l->fd, l->n, &buf);
+	}
+	if (l->fd != l->tmp)
+		skynet_free(l->fd);
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+static void
+fdlist_init(struct fdlist *l) {
+	l->n = 0;
+	l->cap = sizeof(l->tmp) / sizeof(l->tmp[0]);
+	l->fd = l->tmp;
+}
+
+/*
+	string set : "enter" / "leave" / "move" / "view"
+	string msg
+	return the number of the sockets sent
+
+	把 msg 发给最近一次操作的集合中实体的 socket
+ */
+static int
+laoi_send(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	int set = luaL_checkoption(L, 2, NULL, set_names);
+	luaL_checktype(L, 3, LUA_TSTRING);
+	struct fdlist l;
+	fdlist_init(&l);
+	if (set == SET_VIEW) {
+		fdlist_set(&l, s, &s->set[SET_ENTER]);
+		fdlist_set(&l, s, &s->set[SET_MOVE]);
+	} else {
+		fdlist_set(&l, s, &s->set[set]);
+	}
+	return fdlist_send(L, &l, 3);
+}
+
+/*
+	integer id
+	string msg
+	return the number of the sockets sent
+
+	把 msg 发给能看到 id 的所有实体的 socket
+ */
+static int
+laoi_broadcast(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	int index = check_entity(L, s, 2);
+	luaL_checktype(L, 3, LUA_TSTRING);
+	struct rect r;
+	view_rect(s, s->e[index].cell, &r);
+	struct fdlist l;
+	fdlist_init(&l);
+	int x, y;
+	for (y=r.y0;y<=r.y1;y++) {
+		for (x=r.x0;x<=r.x1;x++) {
+			int i = s->cell[y * s->w + x];
+			while (i >= 0) {
+				if (i != index)
+					fdlist_push(&l, s->e[i].fd);
+				i = s->e[i].next;
+			}
+		}
+	}
+	return fdlist_send(L, &l, 3);
+}
+
+/*
+	integer id
+	return x, y, fd ; nil if id is not in the space
+ */
+static int
+laoi_get(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	int index = find_entity(s, luaL_checkinteger(L, 2));
+	if (index < 0)
+		return 0;
+	struct entity *e = &s->e[index];
+	lua_pushnumber(L, e->x);
+	lua_pushnumber(L, e->y);
+	lua_pushinteger(L, e->fd);
+	return 3;
+}
+
+/*
+	integer id
+	integer fd : 0 表示没有 socket
+ */
+static int
+laoi_setfd(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	int index = check_entity(L, s, 2);
+	s->e[index].fd = (int)luaL_checkinteger(L, 3);
+	return 0;
+}
+
+static int
+laoi_count(lua_State *L) {
+	struct aoi_space *s = check_space(L);
+	lua_pushinteger(L, s->n);
+	return 1;
+}
+
+static int
+laoi_gc(lua_State *L) {
+	struct aoi_space *s = (struct aoi_space *)lua_touserdata(L, 1);
+	if (s->cell == NULL)
+		return 0;
+	skynet_free(s->cell);
+	skynet_free(s->e);
+	skynet_free(s->hash);
+	int i;
+	for (i=0;i<3;i++) {
+		skynet_free(s->set[i].idx);
+	}
+	memset(s, 0, sizeof(*s));
+	return 0;
+}
+
+/*
+	number width
+	number height
+	number cell : 格子的大小
+	number view : 视野的距离，向上取整到格子
+	return space
+ */
+static int
+laoi_new(lua_State *L) {
+	double width = luaL_checknumber(L, 1);
+	double height = luaL_checknumber(L, 2);
+	double cellsize = luaL_checknumber(L, 3);
+	double view = luaL_checknumber(L, 4);
+	if (width <= 0 || height <= 0 || cellsize <= 0 || view < 0)
+		return luaL_error(L, "Invalid aoi space %f x %f (cell %f, view %f)", width, height, cellsize, view);
+	double w = ceil(width / cellsize);
+	double h = ceil(height / cellsize);
+	if (w * h > 16 * 1024 * 1024)
+		return luaL_error(L, "Too many cells %f x %f", w, h);
+	struct aoi_space *s = lua_newuserdatauv(L, sizeof(*s), 0);
+	memset(s, 0, sizeof(*s));
+	s->cellsize = cellsize;
+	s->radius = (int)ceil(view / cellsize);
+	s->w = (int)w;
+	s->h = (int)h;
+	s->cell = skynet_malloc(s->w * s->h * sizeof(int));
+	memset(s->cell, 0xff, s->w * s->h * sizeof(int));
+	s->cap = HASH_INITSIZE;
+	s->e = skynet_malloc(s->cap * sizeof(struct entity));
+	int i;
+	for (i=0;i<s->cap;i++) {
+		s->e[i].cell = -1;
+		s->e[i].next = i + 1 < s->cap ? i + 1 : -1;
+	}
+	s->freelist = 0;
+	s->hcap = HASH_INITSIZE;
+	s->hash = skynet_malloc(s->hcap * sizeof(int));
+	memset(s->hash, 0xff, s->hcap * sizeof(int));
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_skynet_aoi_core(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg m[] = {
+		{ "enter", laoi_enter },
+		{ "move", laoi_move },
+		{ "leave", laoi_leave },
+		{ "ids", laoi_ids },
+		{ "view", laoi_view },
+		{ "send", laoi_send },
+		{ "broadcast", laoi_broadcast },
+		{ "get", laoi_get },
+		{ "setfd", laoi_setfd },
+		{ "count", laoi_count },
+		{ NULL, NULL },
+	};
+	lua_getfield(L, LUA_REGISTRYINDEX, "skynet_context");
+	struct skynet_context *ctx = lua_touserdata(L,-1);
+	if (ctx == NULL) {
+		return luaL_error(L, "Init skynet context first");
+	}
+	luaL_newmetatable(L, "SKYNET_AOI");
+	luaL_newlibtable(L, m);
+	lua_pushlightuserdata(L, ctx);
+	luaL_setfuncs(L, m, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, laoi_gc);
+	lua_setfield(L, -2, "__gc");
+
+	lua_newtable(L);
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, laoi_new, 1);
+	lua_setfield(L, -2, "new");
+	return 1;
+}
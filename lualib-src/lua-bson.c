@@ -55,6 +55,15 @@ struct bson_reader {
 	int size;
 };
 
+// A lazy view of a bson document in a buffer owned by another object
+// (uservalue 1). The offsets of the keys scanned are cached in uservalue 2.
+struct bson_view {
+	const uint8_t * doc;
+	int32_t size;
+	int32_t scanned;	// the offset of the first element not indexed yet
+	int array;
+};
+
 static inline int32_t
 get_length(const uint8_t * data) {
 	const uint8_t * b = (const uint8_t *)data;
@@ -328,6 +337,15 @@ append_one(struct bson *bs, lua_State *L, const char *key, size_t sz, int depth)
 		append_number(bs, L, key, sz);
 		break;
 	case LUA_TUSERDATA: {
+		struct bson_view * view = (struct bson_view *)luaL_testudata(L, -1, "bson_view");
+		if (view) {
+			// copy the raw bytes of an unchanged sub document
+			append_key(bs, L, view->array ? BSON_ARRAY : BSON_DOCUMENT, key, sz);
+			bson_reserve(bs, view->size);
+			memcpy(bs->ptr + bs->size, view->doc, view->size);
+			bs->size += view->size;
+			break;
+		}
 		append_key(bs, L, BSON_DOCUMENT, key, sz);
 		int32_t * doc = (int32_t*)lua_touserdata(L,-1);
 		int32_t sz = *doc;
@@ -598,6 +616,124 @@ make_object(lua_State *L, int type, const void * ptr, size_t len) {
 	luaL_pushresult(&b);
 }
 
+static void unpack_dict(lua_State *L, struct bson_reader *br, bool array);
+
+// push the value of type bt
+static void
+unpack_value(lua_State *L, struct bson_reader *br, int bt) {
+	switch (bt) {
+	case BSON_REAL:
+		lua_pushnumber(L, read_double(L, br));
+		break;
+	case BSON_BOOLEAN:
+		lua_pushboolean(L, read_byte(L, br));
+		break;
+	case BSON_STRING: {
+		int sz = read_int32(L, br);
+		if (sz <= 0) {
+			luaL_error(L, "Invalid bson string , length = %d", sz);
+		}
+		lua_pushlstring(L, (const char*)read_bytes(L, br, sz), sz-1);
+		break;
+	}
+	case BSON_DOCUMENT:
+		unpack_dict(L, br, false);
+		break;
+	case BSON_ARRAY:
+		unpack_dict(L, br, true);
+		break;
+	case BSON_BINARY: {
+		int sz = read_int32(L, br);
+		int subtype = read_byte(L, br);
+
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+		luaL_addchar(&b, 0);
+		luaL_addchar(&b, BSON_BINARY);
+		luaL_addchar(&b, subtype);
+		luaL_addlstring(&b, (const char*)read_bytes(L, br, sz), sz);
+		luaL_pushresult(&b);
+		break;
+	}
+	case BSON_OBJECTID:
+		make_object(L, BSON_OBJECTID, read_bytes(L, br, 12), 12);
+		break;
+	case BSON_DATE: {
+		int64_t date = read_int64(L, br);
+		uint32_t v = date / 1000;
+		make_object(L, BSON_DATE, &v, 4);
+		break;
+	}
+	case BSON_MINKEY:
+	case BSON_MAXKEY:
+	case BSON_NULL: {
+		char key[] = { 0, (char)bt };
+		lua_pushlstring(L, key, sizeof(key));
+		break;
+	}
+	case BSON_REGEX: {
+		size_t rlen1=0;
+		size_t rlen2=0;
+		const char * r1 = read_cstring(L, br, &rlen1);
+		const char * r2 = read_cstring(L, br, &rlen2);
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+		luaL_addchar(&b, 0);
+		luaL_addchar(&b, BSON_REGEX);
+		luaL_addlstring(&b, r1, rlen1);
+		luaL_addchar(&b,0);
+		luaL_addlstring(&b, r2, rlen2);
+		luaL_addchar(&b,0);
+		luaL_pushresult(&b);
+		break;
+	}
+	case BSON_INT32:
+		lua_pushinteger(L, read_int32(L, br));
+		break;
+	case BSON_TIMESTAMP: {
+		int32_t inc = read_int32(L, br);
+		int32_t ts = read_int32(L, br);
+
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+		luaL_addchar(&b, 0);
+		luaL_addchar(&b, BSON_TIMESTAMP);
+		luaL_addlstring(&b, (const char *)&inc, 4);
+		luaL_addlstring(&b, (const char *)&ts, 4);
+		luaL_pushresult(&b);
+		break;
+	}
+	case BSON_INT64:
+		lua_pushinteger(L, read_int64(L, br));
+		break;
+	case BSON_DBPOINTER: {
+		const void * ptr = br->ptr;
+		int sz = read_int32(L, br);
+		read_bytes(L, br, sz+12);
+		make_object(L, BSON_DBPOINTER, ptr, sz + 16);
+		break;
+	}
+	case BSON_JSCODE:
+	case BSON_SYMBOL: {
+		const void * ptr = br->ptr;
+		int sz = read_int32(L, br);
+		read_bytes(L, br, sz);
+		make_object(L, bt, ptr, sz + 4);
+		break;
+	}
+	case BSON_CODEWS: {
+		const void * ptr = br->ptr;
+		int sz = read_int32(L, br);
+		read_bytes(L, br, sz-4);
+		make_object(L, bt, ptr, sz);
+		break;
+	}
+	default:
+		// unsupported
+		luaL_error(L, "Invalid bson type : %d", bt);
+	}
+}
+
 static void
 unpack_dict(lua_State *L, struct bson_reader *br, bool array) {
 	luaL_checkstack(L, 16, NULL);	// reserve enough stack space to unpack table
@@ -623,123 +759,76 @@ unpack_dict(lua_State *L, struct bson_reader *br, bool array) {
 		} else {
 			lua_pushlstring(L, key, klen);
 		}
-		switch (bt) {
-		case BSON_REAL:
-			lua_pushnumber(L, read_double(L, &t));
-			break;
-		case BSON_BOOLEAN:
-			lua_pushboolean(L, read_byte(L, &t));
-			break;
-		case BSON_STRING: {
-			int sz = read_int32(L, &t);
-			if (sz <= 0) {
-				luaL_error(L, "Invalid bson string , length = %d", sz);
-			}
-			lua_pushlstring(L, (const char*)read_bytes(L, &t, sz), sz-1);
-			break;
-		}
-		case BSON_DOCUMENT:
-			unpack_dict(L, &t, false);
-			break;
-		case BSON_ARRAY:
-			unpack_dict(L, &t, true);
-			break;
-		case BSON_BINARY: {
-			int sz = read_int32(L, &t);
-			int subtype = read_byte(L, &t);
-
-			luaL_Buffer b;
-			luaL_buffinit(L, &b);
-			luaL_addchar(&b, 0);
-			luaL_addchar(&b, BSON_BINARY);
-			luaL_addchar(&b, subtype);
-			luaL_addlstring(&b, (const char*)read_bytes(L, &t, sz), sz);
-			luaL_pushresult(&b);
-			break;
-		}
-		case BSON_OBJECTID:
-			make_object(L, BSON_OBJECTID, read_bytes(L, &t, 12), 12);
-			break;
-		case BSON_DATE: {
-			int64_t date = read_int64(L, &t);
-			uint32_t v = date / 1000;
-			make_object(L, BSON_DATE, &v, 4);
-			break;
-		}
-		case BSON_MINKEY:
-		case BSON_MAXKEY:
-		case BSON_NULL: {
-			char key[] = { 0, (char)bt };
-			lua_pushlstring(L, key, sizeof(key));
-			break;
-		}
-		case BSON_REGEX: {
-			size_t rlen1=0;
-			size_t rlen2=0;
-			const char * r1 = read_cstring(L, &t, &rlen1);
-			const char * r2 = read_cstring(L, &t, &rlen2);
-			luaL_Buffer b;
-			luaL_buffinit(L, &b);
-			luaL_addchar(&b, 0);
-			luaL_addchar(&b, BSON_REGEX);
-			luaL_addlstring(&b, r1, rlen1);
-			luaL_addchar(&b,0);
-			luaL_addlstring(&b, r2, rlen2);
-			luaL_addchar(&b,0);
-			luaL_pushresult(&b);
-			break;
-		}
-		case BSON_INT32:
-			lua_pushinteger(L, read_int32(L, &t));
-			break;
-		case BSON_TIMESTAMP: {
-			int32_t inc = read_int32(L, &t);
-			int32_t ts = read_int32(L, &t);
-
-			luaL_Buffer b;
-			luaL_buffinit(L, &b);
-			luaL_addchar(&b, 0);
-			luaL_addchar(&b, BSON_TIMESTAMP);
-			luaL_addlstring(&b, (const char *)&inc, 4);
-			luaL_addlstring(&b, (const char *)&ts, 4);
-			luaL_pushresult(&b);
-			break;
-		}
-		case BSON_INT64:
-			lua_pushinteger(L, read_int64(L, &t));
-			break;
-		case BSON_DBPOINTER: {
-			const void * ptr = t.ptr;
-			int sz = read_int32(L, &t);
-			read_bytes(L, &t, sz+12);
-			make_object(L, BSON_DBPOINTER, ptr, sz + 16);
-			break;
-		}
-		case BSON_JSCODE:
-		case BSON_SYMBOL: {
-			const void * ptr = t.ptr;
-			int sz = read_int32(L, &t);
-			read_bytes(L, &t, sz);
-			make_object(L, bt, ptr, sz + 4);
-			break;
-		}
-		case BSON_CODEWS: {
-			const void * ptr = t.ptr;
-			int sz = read_int32(L, &t);
-			read_bytes(L, &t, sz-4);
-			make_object(L, bt, ptr, sz);
-			break;
-		}
-		default:
-			// unsupported
-			luaL_error(L, "Invalid bson type : %d", bt);
-			lua_pop(L,1);
-			continue;
-		}
+		unpack_value(L, &t, bt);
 		lua_rawset(L,-3);
 	}
 }
 
+// skip the value of type bt, returns the size of the fixed size types, or 0
+static int
+skip_value(lua_State *L, struct bson_reader *br, int bt) {
+	int field_size = 0;
+	switch (bt) {
+	case BSON_INT64:
+	case BSON_TIMESTAMP:
+	case BSON_DATE:
+	case BSON_REAL:
+		field_size = 8;
+		break;
+	case BSON_BOOLEAN:
+		field_size = 1;
+		break;
+	case BSON_JSCODE:
+	case BSON_SYMBOL:
+	case BSON_STRING: {
+		int sz = read_int32(L, br);
+		read_bytes(L, br, sz);
+		break;
+	}
+	case BSON_CODEWS:
+	case BSON_ARRAY:
+	case BSON_DOCUMENT: {
+		int sz = read_int32(L, br);
+		read_bytes(L, br, sz-4);
+		break;
+	}
+	case BSON_BINARY: {
+		int sz = read_int32(L, br);
+		read_bytes(L, br, sz+1);
+		break;
+	}
+	case BSON_OBJECTID:
+		field_size = 12;
+		break;
+	case BSON_MINKEY:
+	case BSON_MAXKEY:
+	case BSON_NULL:
+		break;
+	case BSON_REGEX: {
+		size_t rlen1=0;
+		size_t rlen2=0;
+		read_cstring(L, br, &rlen1);
+		read_cstring(L, br, &rlen2);
+		break;
+	}
+	case BSON_INT32:
+		field_size = 4;
+		break;
+	case BSON_DBPOINTER: {
+		int sz = read_int32(L, br);
+		read_bytes(L, br, sz+12);
+		break;
+	}
+	default:
+		// unsupported
+		luaL_error(L, "Invalid bson type : %d", bt);
+	}
+	if (field_size > 0) {
+		read_bytes(L, br, field_size);
+	}
+	return field_size;
+}
+
 static int
 lmakeindex(lua_State *L) {
 	int32_t *bson = (int32_t*)luaL_checkudata(L,1,"bson");
@@ -753,67 +842,10 @@ lmakeindex(lua_State *L) {
 		int bt = read_byte(L, &br);
 		size_t klen = 0;
 		const char * key = read_cstring(L, &br, &klen);
-		int field_size = 0;
-		switch (bt) {
-		case BSON_INT64:
-		case BSON_TIMESTAMP: 
-		case BSON_DATE:
-		case BSON_REAL:
-			field_size = 8;
-			break;
-		case BSON_BOOLEAN:
-			field_size = 1;
-			break;
-		case BSON_JSCODE:
-		case BSON_SYMBOL: 
-		case BSON_STRING: {
-			int sz = read_int32(L, &br);
-			read_bytes(L, &br, sz);
-			break;
-		}
-		case BSON_CODEWS:
-		case BSON_ARRAY:
-		case BSON_DOCUMENT: {
-			int sz = read_int32(L, &br);
-			read_bytes(L, &br, sz-4);
-			break;
-		}
-		case BSON_BINARY: {
-			int sz = read_int32(L, &br);
-			read_bytes(L, &br, sz+1);
-			break;
-		}
-		case BSON_OBJECTID:
-			field_size = 12;
-			break;
-		case BSON_MINKEY:
-		case BSON_MAXKEY:
-		case BSON_NULL:
-			break;
-		case BSON_REGEX: {
-			size_t rlen1=0;
-			size_t rlen2=0;
-			read_cstring(L, &br, &rlen1);
-			read_cstring(L, &br, &rlen2);
-			break;
-		}
-		case BSON_INT32:
-			field_size = 4;
-			break;
-		case BSON_DBPOINTER: {
-			int sz = read_int32(L, &br);
-			read_bytes(L, &br, sz+12);
-			break;
-		}
-		default:
-			// unsupported
-			luaL_error(L, "Invalid bson type : %d", bt);
-			lua_pop(L,1);
-			continue;
-		}
+		const uint8_t * value = br.ptr;
+		int field_size = skip_value(L, &br, bt);
 		if (field_size > 0) {
-			int id = bt | (int)(br.ptr - start) << BSON_TYPE_SHIFT;
-			read_bytes(L, &br, field_size);
+			int id = bt | (int)(value - start) << BSON_TYPE_SHIFT;
 			lua_pushlstring(L, key, klen);
 			lua_pushinteger(L,id);
 			lua_rawset(L,-3);
@@ -913,6 +945,23 @@ lreplace(lua_State *L) {
 
 static int
 ldecode(lua_State *L) {
+	struct bson_view * view = (struct bson_view *)luaL_testudata(L, 1, "bson_view");
+	if (view) {
+		struct bson_reader br = { view->doc, view->size };
+		unpack_dict(L, &br, view->array);
+		return 1;
+	}
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		// the bson string of a document, see mongo_cursor:raw
+		size_t sz;
+		const uint8_t * str = (const uint8_t *)lua_tolstring(L, 1, &sz);
+		if (sz < 5 || get_length(str) != (int32_t)sz) {
+			return luaL_error(L, "Invalid bson string");
+		}
+		struct bson_reader br = { str, (int)sz };
+		unpack_dict(L, &br, false);
+		return 1;
+	}
 	const int32_t * data = (const int32_t*)lua_touserdata(L,1);
 	if (data == NULL) {
 		return 0;
@@ -926,6 +975,303 @@ ldecode(lua_State *L) {
 	return 1;
 }
 
+// push a view of doc, the owner of the buffer is at index owner
+static void
+new_view(lua_State *L, const uint8_t * doc, size_t limit, int array, int owner) {
+	owner = lua_absindex(L, owner);
+	if (limit < 5) {
+		luaL_error(L, "Invalid bson block");
+	}
+	int32_t size = get_length(doc);
+	if (size < 5 || (size_t)size > limit || doc[size-1] != 0) {
+		luaL_error(L, "Invalid bson block (%d)", size);
+	}
+	struct bson_view * view = (struct bson_view *)lua_newuserdatauv(L, sizeof(*view), 2);
+	view->doc = doc;
+	view->size = size;
+	view->scanned = 4;
+	view->array = array;
+	lua_pushvalue(L, owner);
+	lua_setiuservalue(L, -2, 1);
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 2);
+	luaL_setmetatable(L, "bson_view");
+}
+
+// Index the elements from view->scanned until key is found (or to the end if
+// key is NULL). The index table is at index. Returns the offset of the key.
+static int
+view_scan(lua_State *L, struct bson_view *view, int index, const char *key, size_t sz) {
+	while (view->scanned < view->size - 1) {
+		int offset = view->scanned;
+		struct bson_reader br = { view->doc + offset, view->size - 1 - offset };
+		int bt = read_byte(L, &br);
+		size_t klen = 0;
+		const char * k = read_cstring(L, &br, &klen);
+		skip_value(L, &br, bt);
+		view->scanned = (int32_t)(br.ptr - view->doc);
+		lua_pushlstring(L, k, klen);
+		lua_pushinteger(L, offset);
+		lua_rawset(L, index);
+		if (key && klen == sz && memcmp(k, key, sz) == 0) {
+			return offset;
+		}
+	}
+	return 0;
+}
+
+// push the value of the element at offset, the sub documents are views
+static void
+view_value(lua_State *L, struct bson_view *view, int self, int offset) {
+	struct bson_reader br = { view->doc + offset, view->size - 1 - offset };
+	int bt = read_byte(L, &br);
+	size_t klen = 0;
+	read_cstring(L, &br, &klen);
+	if (bt == BSON_DOCUMENT || bt == BSON_ARRAY) {
+		lua_getiuservalue(L, self, 1);
+		new_view(L, br.ptr, br.size, bt == BSON_ARRAY, -1);
+		lua_remove(L, -2);
+	} else {
+		unpack_value(L, &br, bt);
+	}
+}
+
+static int
+lview_index(lua_State *L) {
+	struct bson_view * view = (struct bson_view *)lua_touserdata(L, 1);
+	lua_settop(L, 2);
+	char tmp[32];
+	const char * key;
+	size_t sz;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		key = lua_tolstring(L, 2, &sz);
+	} else if (view->array && lua_isinteger(L, 2)) {
+		// array keys are "0", "1", ...
+		sz = snprintf(tmp, sizeof(tmp), "%lld", (long long)lua_tointeger(L, 2) - 1);
+		key = tmp;
+		lua_pushlstring(L, key, sz);
+		lua_replace(L, 2);
+	} else {
+		return 0;
+	}
+	lua_getiuservalue(L, 1, 2);
+	lua_pushvalue(L, 2);
+	int offset;
+	switch (lua_rawget(L, 3)) {
+	case LUA_TNUMBER:
+		offset = (int)lua_tointeger(L, -1);
+		break;
+	case LUA_TUSERDATA:
+		// a view of sub document
+		return 1;
+	default:
+		offset = view_scan(L, view, 3, key, sz);
+		if (offset == 0)
+			return 0;
+		break;
+	}
+	lua_pop(L, 1);
+	view_value(L, view, 1, offset);
+	if (lua_type(L, -1) == LUA_TUSERDATA) {
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, 3);
+	}
+	return 1;
+}
+
+static int
+lview_next(lua_State *L) {
+	struct bson_view * view = (struct bson_view *)lua_touserdata(L, 1);
+	int offset = (int)lua_tointeger(L, lua_upvalueindex(1));
+	if (offset >= view->size - 1)
+		return 0;
+	struct bson_reader br = { view->doc + offset, view->size - 1 - offset };
+	int bt = read_byte(L, &br);
+	size_t klen = 0;
+	const char * key = read_cstring(L, &br, &klen);
+	skip_value(L, &br, bt);
+	lua_pushinteger(L, br.ptr - view->doc);
+	lua_replace(L, lua_upvalueindex(1));
+	if (view->array) {
+		lua_pushinteger(L, strtol(key, NULL, 10) + 1);
+	} else {
+		lua_pushlstring(L, key, klen);
+	}
+	view_value(L, view, 1, offset);
+	return 2;
+}
+
+static int
+lview_pairs(lua_State *L) {
+	luaL_checkudata(L, 1, "bson_view");
+	lua_pushinteger(L, 4);
+	lua_pushcclosure(L, lview_next, 1);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+// the number of elements
+static int
+lview_len(lua_State *L) {
+	struct bson_view * view = (struct bson_view *)lua_touserdata(L, 1);
+	struct bson_reader br = { view->doc + 4, view->size - 5 };
+	int n = 0;
+	while (br.size > 0) {
+		int bt = read_byte(L, &br);
+		size_t klen = 0;
+		read_cstring(L, &br, &klen);
+		skip_value(L, &br, bt);
+		++n;
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+static int
+lview_tostring(lua_State *L) {
+	struct bson_view * view = (struct bson_view *)lua_touserdata(L, 1);
+	lua_pushlstring(L, (const char *)view->doc, view->size);
+	return 1;
+}
+
+/*
+	bson.view(bson) / bson.view(string) / bson.view(lightuserdata, owner)
+	A lazy read only document: the fields are decoded when they are indexed,
+	and the sub documents are views of the same buffer. bson.decode(view)
+	converts the whole view into a table.
+ */
+static int
+lview(lua_State *L) {
+	switch (lua_type(L, 1)) {
+	case LUA_TUSERDATA: {
+		if (luaL_testudata(L, 1, "bson_view")) {
+			lua_settop(L, 1);
+			return 1;
+		}
+		new_view(L, (const uint8_t *)lua_touserdata(L, 1), lua_rawlen(L, 1), 0, 1);
+		break;
+	}
+	case LUA_TSTRING: {
+		size_t sz;
+		const char * str = lua_tolstring(L, 1, &sz);
+		new_view(L, (const uint8_t *)str, sz, 0, 1);
+		break;
+	}
+	case LUA_TLIGHTUSERDATA: {
+		// the owner keeps the buffer alive, the size is not known
+		luaL_checkany(L, 2);
+		const uint8_t * doc = (const uint8_t *)lua_touserdata(L, 1);
+		new_view(L, doc, (size_t)get_length(doc), 0, 2);
+		break;
+	}
+	default:
+		return luaL_error(L, "Invalid bson view source : %s", luaL_typename(L, 1));
+	}
+	return 1;
+}
+
+static void bson_meta(lua_State *L);
+
+static int
+update_bson(lua_State *L) {
+	const uint8_t * doc = (const uint8_t *)lua_touserdata(L, 1);
+	struct bson *b = (struct bson *)lua_touserdata(L, 3);
+	lua_settop(L, 2);
+	lua_newtable(L);	// 3: the keys updated
+	int length = reserve_length(b);
+	struct bson_reader br = { doc + 4, get_length(doc) - 5 };
+	while (br.size > 0) {
+		const uint8_t * element = br.ptr;
+		int bt = read_byte(L, &br);
+		size_t klen = 0;
+		const char * key = read_cstring(L, &br, &klen);
+		skip_value(L, &br, bt);
+		lua_pushlstring(L, key, klen);
+		if (lua_rawget(L, 2) == LUA_TNIL) {
+			// unchanged, copy the raw bytes
+			int sz = (int)(br.ptr - element);
+			bson_reserve(b, sz);
+			memcpy(b->ptr + b->size, element, sz);
+			b->size += sz;
+		} else {
+			append_one(b, L, key, klen, 0);
+			lua_pushlstring(L, key, klen);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, 3);
+		}
+		lua_pop(L, 1);
+	}
+	// the new keys
+	lua_pushnil(L);
+	while (lua_next(L, 2) != 0) {
+		lua_pushvalue(L, -2);
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			luaL_error(L, "Invalid key type : %s", lua_typename(L, lua_type(L, -1)));
+		}
+		if (lua_rawget(L, 3) == LUA_TNIL) {
+			lua_pop(L, 1);
+			size_t klen;
+			const char * key = lua_tolstring(L, -2, &klen);
+			append_one(b, L, key, klen, 0);
+		} else {
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	write_byte(b, 0);
+	write_length(b, b->size - length, length);
+	void * ud = lua_newuserdatauv(L, b->size, 1);
+	memcpy(ud, b->ptr, b->size);
+	return 1;
+}
+
+/*
+	bson.update(bson or view, changes)
+	Returns a new bson document with the fields in changes replaced (or
+	appended). Only the changed fields are encoded, the others are copied.
+ */
+static int
+lupdate(lua_State *L) {
+	const uint8_t * doc;
+	struct bson_view * view = (struct bson_view *)luaL_testudata(L, 1, "bson_view");
+	if (view) {
+		doc = view->doc;
+	} else {
+		doc = (const uint8_t *)luaL_checkudata(L, 1, "bson");
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	struct bson b;
+	bson_create(&b);
+	lua_pushcfunction(L, update_bson);
+	lua_pushlightuserdata(L, (void *)doc);
+	lua_pushvalue(L, 2);
+	lua_pushlightuserdata(L, &b);
+	if (lua_pcall(L, 3, 1, 0) != LUA_OK) {
+		bson_destroy(&b);
+		return lua_error(L);
+	}
+	bson_destroy(&b);
+	bson_meta(L);
+	return 1;
+}
+
+static void
+view_meta(lua_State *L) {
+	if (luaL_newmetatable(L, "bson_view")) {
+		luaL_Reg l[] = {
+			{ "__index", lview_index },
+			{ "__pairs", lview_pairs },
+			{ "__len", lview_len },
+			{ "__tostring", lview_tostring },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_pop(L, 1);
+}
+
 static void
 bson_meta(lua_State *L) {
 	if (luaL_newmetatable(L, "bson")) {
@@ -960,20 +1306,56 @@ encode_bson(lua_State *L) {
 	return 1;
 }
 
+// A growable buffer. One of them (the upvalue of encode/encode_order) is
+// reused by all the encodings of a lua state, bson.buffer() creates others.
+struct bson_buffer {
+	int busy;
+	struct bson b;
+};
+
+// don't keep a larger buffer after use
+#define BUFFER_KEEP (1024 * 1024)
+
+static struct bson *
+buffer_begin(struct bson_buffer *cache, struct bson *tmp) {
+	if (cache->busy) {
+		// encode again in a __pairs metamethod
+		bson_create(tmp);
+		return tmp;
+	}
+	cache->busy = 1;
+	cache->b.size = 0;
+	return &cache->b;
+}
+
+static void
+buffer_end(struct bson_buffer *cache, struct bson *b) {
+	if (b != &cache->b) {
+		bson_destroy(b);
+		return;
+	}
+	cache->busy = 0;
+	if (b->cap > BUFFER_KEEP) {
+		bson_destroy(b);
+		bson_create(b);
+	}
+}
+
 static int
 lencode(lua_State *L) {
-	struct bson b;
+	struct bson_buffer *cache = (struct bson_buffer *)lua_touserdata(L, lua_upvalueindex(1));
+	struct bson tmp;
 	lua_settop(L,1);
 	luaL_checktype(L, 1, LUA_TTABLE);
-	bson_create(&b);
+	struct bson *b = buffer_begin(cache, &tmp);
 	lua_pushcfunction(L, encode_bson);
 	lua_pushvalue(L, 1);
-	lua_pushlightuserdata(L, &b);
+	lua_pushlightuserdata(L, b);
 	if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
-		bson_destroy(&b);
+		buffer_end(cache, b);
 		return lua_error(L);
 	}
-	bson_destroy(&b);
+	buffer_end(cache, b);
 	bson_meta(L);
 	return 1;
 }
@@ -992,25 +1374,210 @@ encode_bson_byorder(lua_State *L) {
 
 static int
 lencode_order(lua_State *L) {
-	struct bson b;
+	struct bson_buffer *cache = (struct bson_buffer *)lua_touserdata(L, lua_upvalueindex(1));
+	struct bson tmp;
 	int n = lua_gettop(L);
 	if (n%2 != 0) {
 		return luaL_error(L, "Invalid ordered dict");
 	}
-	bson_create(&b);
+	struct bson *b = buffer_begin(cache, &tmp);
 	lua_pushvalue(L, 1);	// copy the first arg to n
 	lua_pushcfunction(L, encode_bson_byorder);
 	lua_replace(L, 1);
-	lua_pushlightuserdata(L, &b);
+	lua_pushlightuserdata(L, b);
 	if (lua_pcall(L, n+1, 1, 0) != LUA_OK) {
-		bson_destroy(&b);
+		buffer_end(cache, b);
 		return lua_error(L);
 	}
-	bson_destroy(&b);
+	buffer_end(cache, b);
 	bson_meta(L);
 	return 1;
 }
 
+/*
+	bson.buffer() : a buffer to build a message with bson documents in place,
+	such as a mongo OP_MSG packet.
+
+	buffer:reset()
+	buffer:size()
+	buffer:int8(v) / buffer:int32(v) / buffer:cstring(s)
+	buffer:append(string or bson or view) : raw bytes
+	buffer:encode(table) / buffer:encode_order(k, v, ...) : append a document
+	buffer:length(offset) : write size - offset as int32 at offset
+	buffer:tostring()
+	buffer:pack() : lightuserdata, size ; a copy for socket.write, which frees it
+
+	If an encoding raises an error, the content of the buffer is undefined.
+ */
+static struct bson *
+check_buffer(lua_State *L) {
+	struct bson_buffer *buf = (struct bson_buffer *)luaL_checkudata(L, 1, "bson_buffer");
+	return &buf->b;
+}
+
+static int
+lbuffer_reset(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	b->size = 0;
+	if (b->cap > BUFFER_KEEP) {
+		bson_destroy(b);
+		bson_create(b);
+	}
+	return 0;
+}
+
+static int
+lbuffer_size(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	lua_pushinteger(L, b->size);
+	return 1;
+}
+
+static int
+lbuffer_int8(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	write_byte(b, (uint8_t)luaL_checkinteger(L, 2));
+	return 0;
+}
+
+static int
+lbuffer_int32(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	write_int32(b, (int32_t)luaL_checkinteger(L, 2));
+	return 0;
+}
+
+static int
+lbuffer_cstring(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	size_t sz;
+	const char * str = luaL_checklstring(L, 2, &sz);
+	bson_reserve(b, sz+1);
+	memcpy(b->ptr + b->size, str, sz+1);
+	b->size += sz+1;
+	return 0;
+}
+
+static int
+lbuffer_append(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	const void * ptr;
+	size_t sz;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		ptr = lua_tolstring(L, 2, &sz);
+	} else {
+		struct bson_view * view = (struct bson_view *)luaL_testudata(L, 2, "bson_view");
+		if (view) {
+			ptr = view->doc;
+			sz = view->size;
+		} else {
+			ptr = luaL_checkudata(L, 2, "bson");
+			sz = get_length(ptr);
+		}
+	}
+	bson_reserve(b, (int)sz);
+	memcpy(b->ptr + b->size, ptr, sz);
+	b->size += (int)sz;
+	return 0;
+}
+
+static int
+lbuffer_encode(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	lua_settop(L, 2);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if (luaL_getmetafield(L, 2, "__pairs") != LUA_TNIL) {
+		pack_meta_dict(L, b, 0);
+	} else {
+		pack_simple_dict(L, b, 0);
+	}
+	return 0;
+}
+
+static int
+lbuffer_encode_order(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	lua_remove(L, 1);
+	int n = lua_gettop(L);
+	if (n == 0 || n%2 != 0) {
+		return luaL_error(L, "Invalid ordered dict");
+	}
+	// move the first key to n, see encode_bson_byorder
+	lua_rotate(L, 1, -1);
+	pack_ordered_dict(L, b, n, 0);
+	return 0;
+}
+
+static int
+lbuffer_length(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	int offset = (int)luaL_checkinteger(L, 2);
+	if (offset < 0 || offset + 4 > b->size) {
+		return luaL_error(L, "Invalid offset %d", offset);
+	}
+	write_length(b, b->size - offset, offset);
+	return 0;
+}
+
+static int
+lbuffer_tostring(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	lua_pushlstring(L, (const char *)b->ptr, b->size);
+	return 1;
+}
+
+static int
+lbuffer_pack(lua_State *L) {
+	struct bson *b = check_buffer(L);
+	void * ptr = malloc(b->size);
+	memcpy(ptr, b->ptr, b->size);
+	lua_pushlightuserdata(L, ptr);
+	lua_pushinteger(L, b->size);
+	return 2;
+}
+
+static int
+lbuffer_gc(lua_State *L) {
+	struct bson_buffer *buf = (struct bson_buffer *)lua_touserdata(L, 1);
+	bson_destroy(&buf->b);
+	bson_create(&buf->b);
+	return 0;
+}
+
+static void
+new_buffer(lua_State *L) {
+	struct bson_buffer *buf = (struct bson_buffer *)lua_newuserdatauv(L, sizeof(*buf), 0);
+	buf->busy = 0;
+	bson_create(&buf->b);
+	if (luaL_newmetatable(L, "bson_buffer")) {
+		luaL_Reg l[] = {
+			{ "reset", lbuffer_reset },
+			{ "size", lbuffer_size },
+			{ "int8", lbuffer_int8 },
+			{ "int32", lbuffer_int32 },
+			{ "cstring", lbuffer_cstring },
+			{ "append", lbuffer_append },
+			{ "encode", lbuffer_encode },
+			{ "encode_order", lbuffer_encode_order },
+			{ "length", lbuffer_length },
+			{ "tostring", lbuffer_tostring },
+			{ "pack", lbuffer_pack },
+			{ NULL, NULL },
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lbuffer_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+}
+
+static int
+lbuffer(lua_State *L) {
+	new_buffer(L);
+	return 1;
+}
+
 static int
 ldate(lua_State *L) {
 	int d = luaL_checkinteger(L,1);
@@ -1331,8 +1898,9 @@ luaopen_bson(lua_State *L) {
 		memcpy(bson_numstrs[i], tmp, bson_numstr_len[i]);
 	}
 	luaL_Reg l[] = {
-		{ "encode", lencode },
-		{ "encode_order", lencode_order },
+		{ "encode", NULL },
+		{ "encode_order", NULL },
+		{ "buffer", lbuffer },
 		{ "date", ldate },
 		{ "timestamp", ltimestamp  },
 		{ "regex", lregex },
@@ -1340,11 +1908,22 @@ luaopen_bson(lua_State *L) {
 		{ "objectid", lobjectid },
 		{ "int64", lint64 },
 		{ "decode", ldecode },
+		{ "view", lview },
+		{ "update", lupdate },
 		{ NULL,  NULL },
 	};
 
+	view_meta(L);
 	luaL_newlib(L,l);
 
+	// the encode buffer reused by this lua state
+	new_buffer(L);
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, lencode, 1);
+	lua_setfield(L, -3, "encode");
+	lua_pushcclosure(L, lencode_order, 1);
+	lua_setfield(L, -2, "encode_order");
+
 	typeclosure(L);
 	lua_setfield(L,-2,"type");
 	char null[] = { 0, BSON_NULL };
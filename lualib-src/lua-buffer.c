@@ -0,0 +1,466 @@
+#define LUA_LIB
+
+#include "skynet.h"
+#include "framing.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+	可写的字节缓冲区，用来拼装二进制协议包，省去 string.pack 和 .. 产生的中间字符串
+
+	local buffer = require "skynet.buffer"
+	local b = buffer.new()          -- buffer.new(spec) 在 detach 时按 spec 加上分包头，见 framing.h
+	local pos = b:reserve ">I4"     -- 先占位，返回位置（从 1 开始）
+	b:pack(">I2s2", id, name)       -- string.pack 的子集，不支持对齐（!）
+	b:append(str, ...)
+	b:patch(pos, ">I4", #b - 4)     -- 回填长度
+	socket.write(fd, b:detach())    -- 交出内存（lightuserdata, size），缓冲区清空后可以继续使用
+
+	detach 交出的内存由接收方释放：socket.write / socket.lwrite ，skynet.rawsend / skynet.redirect 都可以直接使用。
+	有分包方式的缓冲区代替 netpack.pack / netpack.packframe ：数据前预留了包头的空间，detach 时写入包头，
+	定长包头不需要再移动数据；varint 和 websocket 包头比预留的短时，数据在原地前移。
+ */
+
+#define METANAME "SKYNET_BUFFER"
+#define DEFAULT_CAP 256
+#define MAXINTSIZE 8
+
+struct buffer {
+	char *ptr;          // skynet_malloc 分配，detach 后交给接收方
+	size_t head;        // 数据前预留给分包头的字节数
+	size_t len;         // 数据长度
+	size_t cap;         // ptr 的大小（包括预留）
+	int framed;         // 是否有分包方式
+	struct framing f;
+};
+
+static struct buffer *
+checkbuffer(lua_State *L) {
+	return (struct buffer *)luaL_checkudata(L, 1, METANAME);
+}
+
+static inline char *
+data(struct buffer *b) {
+	return b->ptr + b->head;
+}
+
+// 保证还能追加 sz 字节
+static void
+reserve_space(lua_State *L, struct buffer *b, size_t sz) {
+	size_t need = b->head + b->len + sz;
+	if (need < b->len)
+		luaL_error(L, "buffer overflow");
+	if (need <= b->cap)
+		return;
+	size_t cap = b->cap ? b->cap : DEFAULT_CAP;
+	while (cap < need) {
+		cap *= 2;
+	}
+	b->ptr = skynet_realloc(b->ptr, cap);
+	b->cap = cap;
+}
+
+/*
+	integer cap (可选)
+	string spec (可选)
+	return userdata buffer
+ */
+static int
+lnew(lua_State *L) {
+	size_t cap = 0;
+	const char *spec = NULL;
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		spec = lua_tostring(L, 1);
+		cap = luaL_optinteger(L, 2, 0);
+	} else {
+		cap = luaL_optinteger(L, 1, 0);
+		spec = luaL_optstring(L, 2, NULL);
+	}
+	struct buffer *b = (struct buffer *)lua_newuserdatauv(L, sizeof(*b), 0);
+	memset(b, 0, sizeof(*b));
+	luaL_setmetatable(L, METANAME);
+	if (spec) {
+		if (framing_init(&b->f, spec, FRAMING_DEFAULTMAX)) {
+			return luaL_error(L, "Invalid framing : %s", spec);
+		}
+		b->framed = 1;
+		b->head = b->f.type == FRAMING_LENGTH ? b->f.header : FRAMING_MAXHEADER;
+	}
+	if (cap > 0) {
+		reserve_space(L, b, cap);
+	}
+	return 1;
+}
+
+static int
+lgc(lua_State *L) {
+	struct buffer *b = checkbuffer(L);
+	skynet_free(b->ptr);
+	b->ptr = NULL;
+	b->len = b->cap = 0;
+	return 0;
+}
+
+static int
+llen(lua_State *L) {
+	struct buffer *b = checkbuffer(L);
+	lua_pushinteger(L, b->len);
+	return 1;
+}
+
+static int
+lclear(lua_State *L) {
+	struct buffer *b = checkbuffer(L);
+	b->len = 0;
+	return 0;
+}
+
+/*
+	string ...
+	return buffer
+ */
+static int
+lappend(lua_State *L) {
+	struct buffer *b = checkbuffer(L);
+	int top = lua_gettop(L);
+	int i;
+	for (i=2;i<=top;i++) {
+		size_t sz;
+		const char *str = luaL_checklstring(L, i, &sz);
+		reserve_space(L, b, sz);
+		memcpy(data(b) + b->len, str, sz);
+		b->len += sz;
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+// 格式的解析，和 lstrlib.c 的 string.pack 一致
+
+enum kind {
+	K_INT,
+	K_UINT,
+	K_FLOAT,
+	K_DOUBLE,
+	K_STRING,   // 带长度头的字符串
+	K_ZSTR,     // 以 0 结尾的字符串
+	K_PADDING,
+	K_NOP,
+};
+
+struct header {
+	const char *fmt;
+	int little;
+};
+
+static int
+readsize(const char **fmt, int df) {
+	const char *p = *fmt;
+	if (*p < '0' || *p > '9')
+		return df;
+	int n = 0;
+	while (*p >= '0' && *p <= '9' && n < 100) {
+		n = n * 10 + (*p++ - '0');
+	}
+	*fmt = p;
+	return n;
+}
+
+static int
+intsize(lua_State *L, const char **fmt, int df) {
+	int sz = readsize(fmt, df);
+	if (sz < 1 || sz > MAXINTSIZE)
+		luaL_error(L, "integral size (%d) out of limits [1,%d]", sz, MAXINTSIZE);
+	return sz;
+}
+
+// 读出下一项，返回类型，size 是定长部分的字节数
+static enum kind
+getoption(lua_State *L, struct header *h, int *size) {
+	int opt = *h->fmt++;
+	*size = 0;
+	switch (opt) {
+	case 'b': *size = 1; return K_INT;
+	case 'B': *size = 1; return K_UINT;
+	case 'h': *size = 2; return K_INT;
+	case 'H': *size = 2; return K_UINT;
+	case 'i': *size = intsize(L, &h->fmt, sizeof(int)); return K_INT;
+	case 'I': *size = intsize(L, &h->fmt, sizeof(int)); return K_UINT;
+	case 'l': *size = sizeof(long); return K_INT;
+	case 'L': *size = sizeof(long); return K_UINT;
+	case 'j': *size = sizeof(lua_Integer); return K_INT;
+	case 'J': *size = sizeof(lua_Integer); return K_UINT;
+	case 'T': *size = sizeof(size_t); return K_UINT;
+	case 'f': *size = sizeof(float); return K_FLOAT;
+	case 'd': case 'n': *size = sizeof(double); return K_DOUBLE;
+	case 's': *size = intsize(L, &h->fmt, sizeof(size_t)); return K_STRING;
+	case 'z': return K_ZSTR;
+	case 'x': *size = 1; return K_PADDING;
+	case ' ': return K_NOP;
+	case '<': h->little = 1; return K_NOP;
+	case '>': h->little = 0; return K_NOP;
+	case '=': {
+		union { int i; char c; } u = { 1 };
+		h->little = u.c;
+		return K_NOP;
+	}
+	default:
+		luaL_error(L, "invalid format option '%c'", opt);
+	}
+	return K_NOP;
+}
+
+static void
+write_int(char *p, lua_Unsigned v, int little, int size) {
+	int i;
+	for (i=0;i<size;i++) {
+		p[little ? i : size-1-i] = (char)(v & 0xff);
+		v >>= 8;
+	}
+}
+
+static void
+check_int(lua_State *L, int arg, enum kind k, lua_Integer v, int size) {
+	if (size >= MAXINTSIZE)
+		return;
+	lua_Integer lim = (lua_Integer)1 << (size * 8 - 1);
+	if (k == K_INT) {
+		luaL_argcheck(L, -lim <= v && v < lim, arg, "integer overflow");
+	} else {
+		luaL_argcheck(L, (lua_Unsigned)v < (lua_Unsigned)lim * 2, arg, "unsigned overflow");
+	}
+}
+
+/*
+	按 fmt 把 arg 开始的参数写到缓冲区的 offset 处
+	patch 为 0 时追加（offset 必须是 len），否则只能覆盖已有的数据，且不接受变长的项
+ */
+static void
+pack(lua_State *L, struct buffer *b, const char *fmt, int arg, size_t offset, int patch) {
+	struct header h = { fmt, 0 };
+	union { int i; char c; } u = { 1 };
+	h.little = u.c;
+	while (*h.fmt) {
+		int size;
+		enum kind k = getoption(L, &h, &size);
+		if (k == K_NOP)
+			continue;
+		size_t slen = 0;
+		const char *str = NULL;
+		size_t total = size;
+		if (k == K_STRING || k == K_ZSTR) {
+			if (patch)
+				luaL_error(L, "variable-length format in patch");
+			str = luaL_checklstring(L, arg, &slen);
+			if (k == K_STRING) {
+				luaL_argcheck(L, size >= (int)sizeof(size_t) ||
+					slen < ((size_t)1 << (size * 8)), arg, "string length does not fit in given size");
+			} else {
+				luaL_argcheck(L, strlen(str) == slen, arg, "string contains zeros");
+				size = 0;
+				slen += 1;
+			}
+			total = size + slen;
+		}
+		if (patch) {
+			if (offset + total > b->len)
+				luaL_error(L, "patch out of range");
+		} else {
+			// 全部写完才修改 len ，出错时缓冲区不变
+			reserve_space(L, b, offset + total - b->len);
+		}
+		char *p = data(b) + offset;
+		switch (k) {
+		case K_INT:
+		case K_UINT: {
+			lua_Integer v = luaL_checkinteger(L, arg++);
+			check_int(L, arg-1, k, v, size);
+			write_int(p, (lua_Unsigned)v, h.little, size);
+			break;
+		}
+		case K_FLOAT: {
+			float f = (float)luaL_checknumber(L, arg++);
+			uint32_t v;
+			memcpy(&v, &f, sizeof(v));
+			write_int(p, v, h.little, size);
+			break;
+		}
+		case K_DOUBLE: {
+			double d = (double)luaL_checknumber(L, arg++);
+			uint64_t v;
+			memcpy(&v, &d, sizeof(v));
+			write_int(p, v, h.little, size);
+			break;
+		}
+		case K_STRING:
+			write_int(p, slen, h.little, size);
+			memcpy(p + size, str, slen);
+			arg++;
+			break;
+		case K_ZSTR:
+			memcpy(p, str, slen);
+			arg++;
+			break;
+		case K_PADDING:
+			*p = 0;
+			break;
+		default:
+			break;
+		}
+		offset += total;
+	}
+	if (!patch) {
+		b->len = offset;
+	}
+}
+
+/*
+	string fmt
+	... 同 string.pack
+	return buffer
+ */
+static int
+lpack(lua_State *L) {
+	struct buffer *b = checkbuffer(L);
+	const char *fmt = luaL_checkstring(L, 2);
+	pack(L, b, fmt, 3, b->len, 0);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+	string fmt (定长)
+	return integer pos
+
+	追加 fmt 大小的 0 ，返回位置，之后用 patch 回填
+ */
+static int
+lreserve(lua_State *L) {
+	struct buffer *b = checkbuffer(L);
+	struct header h = { luaL_checkstring(L, 2), 0 };
+	size_t total = 0;
+	while (*h.fmt) {
+		int size;
+		enum kind k = getoption(L, &h, &size);
+		if (k == K_STRING || k == K_ZSTR)
+			return luaL_error(L, "variable-length format in reserve");
+		total += size;
+	}
+	reserve_space(L, b, total);
+	memset(data(b) + b->len, 0, total);
+	lua_pushinteger(L, b->len + 1);
+	b->len += total;
+	return 1;
+}
+
+/*
+	integer pos
+	string fmt (定长)
+	...
+	return buffer
+ */
+static int
+lpatch(lua_State *L) {
+	struct buffer *b = checkbuffer(L);
+	lua_Integer pos = luaL_checkinteger(L, 2);
+	const char *fmt = luaL_checkstring(L, 3);
+	luaL_argcheck(L, pos >= 1 && (lua_Unsigned)pos <= b->len, 2, "out of range");
+	pack(L, b, fmt, 4, (size_t)pos - 1, 1);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+	integer i, j (可选，同 string.sub)
+	return string
+ */
+static int
+ltostring(lua_State *L) {
+	struct buffer *b = checkbuffer(L);
+	lua_Integer len = (lua_Integer)b->len;
+	lua_Integer i = luaL_optinteger(L, 2, 1);
+	lua_Integer j = luaL_optinteger(L, 3, -1);
+	if (i < 0)
+		i = len + i + 1;
+	if (i < 1)
+		i = 1;
+	if (j < 0)
+		j = len + j + 1;
+	if (j > len)
+		j = len;
+	if (i > j) {
+		lua_pushliteral(L, "");
+	} else {
+		lua_pushlstring(L, data(b) + i - 1, j - i + 1);
+	}
+	return 1;
+}
+
+/*
+	return lightuserdata, integer size
+
+	交出内存，之后缓冲区为空，可以继续写入（重新分配）
+ */
+static int
+ldetach(lua_State *L) {
+	struct buffer *b = checkbuffer(L);
+	size_t sz = b->len;
+	if (b->ptr == NULL) {
+		reserve_space(L, b, 0);
+	}
+	char *ptr = b->ptr;
+	if (b->framed) {
+		if (sz > (size_t)b->f.max)
+			return luaL_error(L, "Invalid size (too long) of data : %d", (int)sz);
+		uint8_t header[FRAMING_MAXHEADER];
+		int hsz = framing_write(&b->f, header, sz);
+		char *start = data(b) - hsz;
+		memcpy(start, header, hsz);
+		if (start != ptr) {
+			memmove(ptr, start, hsz + sz);
+		}
+		sz += hsz;
+	}
+	b->ptr = NULL;
+	b->len = b->cap = 0;
+	lua_pushlightuserdata(L, ptr);
+	lua_pushinteger(L, sz);
+	return 2;
+}
+
+LUAMOD_API int
+luaopen_skynet_buffer(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg m[] = {
+		{ "append", lappend },
+		{ "pack", lpack },
+		{ "reserve", lreserve },
+		{ "patch", lpatch },
+		{ "len", llen },
+		{ "clear", lclear },
+		{ "tostring", ltostring },
+		{ "detach", ldetach },
+		{ NULL, NULL },
+	};
+	if (luaL_newmetatable(L, METANAME)) {
+		luaL_newlib(L, m);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lgc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, llen);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, ltostring);
+		lua_setfield(L, -2, "__tostring");
+	}
+	lua_pop(L, 1);
+	luaL_Reg l[] = {
+		{ "new", lnew },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
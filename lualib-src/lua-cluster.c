@@ -7,6 +7,8 @@
 #include <unistd.h>
 
 #include "skynet.h"
+#include "rwlock.h"
+#include "lzblock.h"
 
 /*
 	uint32_t/string addr
@@ -131,39 +133,132 @@ fill_header(lua_State *L, uint8_t *buf, int sz) {
 		WORD stringsz + 1 - 包大小
 		BYTE 4 - 跟踪标识
 		STRING tag - 跟踪标签
+
+	option
+		WORD 5
+		BYTE 5
+		DWORD threshold
+	连接选项（发送方连上后发出）：
+		threshold - 发送方能解压响应，大于这个长度的响应可以压缩，0 表示不压缩
+
+	stream begin
+		WORD sz+9 / sz+6+namelen
+		BYTE 6 / 0x86
+		the same as type 0 / 0x80 , msg is the arguments of the call (sz < 0x8000)
+	流请求开始：格式和 0 / 0x80 相同，msg 是调用参数，之后的数据块按到达的顺序交给接收者读取
+
+	stream chunk
+		WORD sz + 5
+		BYTE 7 ; 8 : stream end (sz = 0)
+		DWORD session
+		PADDING chunk(sz)
+	流数据块：
+		BYTE 7 - 数据块，8 - 流结束（没有数据）
+		DWORD session - 流请求的会话ID
+
+	compressed
+		packrequest/packpush 的 threshold 参数不为 0 时，不小于 threshold 的消息先用 LZ4 块格式压缩，
+		压缩后变小才使用。类型字节加上 0x20（0x20 0x21 0x61 0xa0 0xa1 0xe1），
+		session 之后（多部分请求在 sz 之后）多一个 DWORD 原始长度，sz 和分段的内容都是压缩后的数据。
+
+	shared memory
+		WORD pathsz + 1
+		BYTE 9 ; 13 : confirmed , 14 : abandoned
+		STRING path
+	共享内存通道（同一台机器上的发送方连上后发出）：
+		path 是发送方创建的共享内存通道（见 lua-shmring.c），接收方打开之后等待发送方的确认，打不开时忽略。
+		发送方看到接收方打开后发出 13，之后的请求改用共享内存；等待超时则发出 14 并删除通道，接收方关闭它。
+		两种情况都继续使用这个连接，每个响应都从它的请求到达的通道发回。
+
+	deadline
+		WORD 5
+		BYTE 10
+		DWORD ttl
+	请求的期限（发送方在请求之前发出，只作用于紧接着的一个请求，和 trace 一样）：
+		ttl 是发送时剩下的时间（1/100秒），用相对时间传递，不要求两个节点的时钟一致
+
+	cancel
+		WORD 5
+		BYTE 11
+		DWORD session
+	取消请求（调用方放弃等待后发出，和请求走同一个连接）：
+		接收方不再处理还没开始的请求，并立即回应一个错误
+
+	stream ack
+		WORD 9
+		BYTE 12
+		DWORD session
+		DWORD ack session
+	流确认请求（发送方每发出若干数据块后发出，和流的数据块走同一个连接）：
+		接收方在这之前的数据块都被读走（或被丢弃）后，对 ack session 回应一个空的成功响应，
+		发送方据此限制没有确认的数据块数量
  */
-// 打包数字地址的请求
+// 压缩消息，压缩后没有变小时返回 NULL
+static void *
+compress_msg(const void * msg, size_t sz, size_t *csz) {
+	size_t cap = sz - 4;	// 至少省下原始长度占用的 4 字节
+	void * buffer = skynet_malloc(lz_bound(sz));
+	size_t n = lz_compress(msg, sz, buffer, cap);
+	if (n == 0) {
+		skynet_free(buffer);
+		return NULL;
+	}
+	*csz = n;
+	return buffer;
+}
+
+// 解压 sz 字节到新分配的 orig 字节的缓冲区，失败返回 NULL
+// orig 来自对端，先检查上限再分配内存
+static void *
+decompress_msg(const void * msg, size_t sz, size_t orig) {
+	if (orig == 0 || orig > INT32_MAX || orig > lz_maxorig(sz))
+		return NULL;
+	void * buffer = skynet_malloc(orig);
+	if (lz_decompress(msg, sz, buffer, orig) != (long)orig) {
+		skynet_free(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+// 打包数字地址的请求，orig 不为 0 时 msg 是压缩后的数据
 static int
-packreq_number(lua_State *L, int session, void * msg, uint32_t sz, int is_push) {
+packreq_number(lua_State *L, int session, void * msg, uint32_t sz, int is_push, uint32_t orig) {
 	uint32_t addr = (uint32_t)lua_tointeger(L,1);  // 获取目标地址
 	uint8_t buf[TEMP_LENGTH];
+	int extra = orig ? 4 : 0;
+	uint8_t flag = orig ? 0x20 : 0;
 	if (sz < MULTI_PART) {
 		// 小消息：直接打包
-		fill_header(L, buf, sz+9);
-		buf[2] = 0;  // 类型标识
+		fill_header(L, buf, sz+9+extra);
+		buf[2] = flag;  // 类型标识
 		fill_uint32(buf+3, addr);  // 目标地址
 		fill_uint32(buf+7, is_push ? 0 : (uint32_t)session);  // 会话ID（推送时为0）
-		memcpy(buf+11,msg,sz);  // 消息内容
+		if (orig)
+			fill_uint32(buf+11, orig);  // 原始长度
+		memcpy(buf+11+extra,msg,sz);  // 消息内容
 
-		lua_pushlstring(L, (const char *)buf, sz+11);
+		lua_pushlstring(L, (const char *)buf, sz+11+extra);
 		return 0;  // 不需要多部分传输
 	} else {
 		// 大消息：需要多部分传输
 		int part = (sz - 1) / MULTI_PART + 1;  // 计算需要的部分数
-		fill_header(L, buf, 13);
-		buf[2] = is_push ? 0x41 : 1;	// multi push or request
+		fill_header(L, buf, 13+extra);
+		buf[2] = (is_push ? 0x41 : 1) | flag;	// multi push or request
 		                                // 多推送或多请求标识
 		fill_uint32(buf+3, addr);       // 目标地址
 		fill_uint32(buf+7, (uint32_t)session);  // 会话ID
 		fill_uint32(buf+11, sz);        // 消息总大小
-		lua_pushlstring(L, (const char *)buf, 15);
+		if (orig)
+			fill_uint32(buf+15, orig);  // 原始长度
+		lua_pushlstring(L, (const char *)buf, 15+extra);
 		return part;  // 返回需要的部分数
 	}
 }
 
-// 打包字符串地址的请求
+// 打包字符串地址的请求，orig 不为 0 时 msg 是压缩后的数据
 static int
-packreq_string(lua_State *L, int session, void * msg, uint32_t sz, int is_push) {
+packreq_string(lua_State *L, int session, void * msg, uint32_t sz, int is_push, uint32_t orig) {
 	size_t namelen = 0;
 	const char *name = lua_tolstring(L, 1, &namelen);
 	if (name == NULL || namelen < 1 || namelen > 255) {
@@ -177,29 +272,35 @@ packreq_string(lua_State *L, int session, void * msg, uint32_t sz, int is_push)
 	}
 
 	uint8_t buf[TEMP_LENGTH];
+	int extra = orig ? 4 : 0;
+	uint8_t flag = orig ? 0x20 : 0;
 	if (sz < MULTI_PART) {
 		// 小消息：直接打包
-		fill_header(L, buf, sz+6+namelen);
-		buf[2] = 0x80;  // 字符串地址标识
+		fill_header(L, buf, sz+6+namelen+extra);
+		buf[2] = 0x80 | flag;  // 字符串地址标识
 		buf[3] = (uint8_t)namelen;  // 名称长度
 		memcpy(buf+4, name, namelen);  // 名称字符串
 		fill_uint32(buf+4+namelen, is_push ? 0 : (uint32_t)session);  // 会话ID
-		memcpy(buf+8+namelen,msg,sz);  // 消息内容
+		if (orig)
+			fill_uint32(buf+8+namelen, orig);  // 原始长度
+		memcpy(buf+8+namelen+extra,msg,sz);  // 消息内容
 
-		lua_pushlstring(L, (const char *)buf, sz+8+namelen);
+		lua_pushlstring(L, (const char *)buf, sz+8+namelen+extra);
 		return 0;  // 不需要多部分传输
 	} else {
 		// 大消息：需要多部分传输
 		int part = (sz - 1) / MULTI_PART + 1;  // 计算需要的部分数
-		fill_header(L, buf, 10+namelen);
-		buf[2] = is_push ? 0xc1 : 0x81;	// multi push or request
+		fill_header(L, buf, 10+namelen+extra);
+		buf[2] = (is_push ? 0xc1 : 0x81) | flag;	// multi push or request
 		                                    // 字符串多推送或多请求标识
 		buf[3] = (uint8_t)namelen;      // 名称长度
 		memcpy(buf+4, name, namelen);   // 名称字符串
 		fill_uint32(buf+4+namelen, (uint32_t)session);  // 会话ID
 		fill_uint32(buf+8+namelen, sz); // 消息总大小
+		if (orig)
+			fill_uint32(buf+12+namelen, orig);  // 原始长度
 
-		lua_pushlstring(L, (const char *)buf, 12+namelen);
+		lua_pushlstring(L, (const char *)buf, 12+namelen+extra);
 		return part;  // 返回需要的部分数
 	}
 }
@@ -242,18 +343,34 @@ packrequest(lua_State *L, int is_push) {
 	}
 	uint32_t sz = (uint32_t)luaL_checkinteger(L,4);  // 消息大小
 	int session = luaL_checkinteger(L,2);  // 会话ID
+	if (skynet_message_finalized(msg, sz)) {
+		skynet_message_free(msg, sz);
+		return luaL_error(L, "sharedbuffer can't be sent to other nodes");
+	}
 	if (session <= 0) {
 		skynet_free(msg);
 		return luaL_error(L, "Invalid request session %d", session);
 	}
+	uint32_t threshold = (uint32_t)luaL_optinteger(L,5,0);  // 压缩阈值，0 表示不压缩
+	uint32_t orig = 0;
+	if (threshold > 0 && sz >= threshold && sz > 4) {
+		size_t csz;
+		void * c = compress_msg(msg, sz, &csz);
+		if (c) {
+			skynet_free(msg);
+			msg = c;
+			orig = sz;
+			sz = (uint32_t)csz;
+		}
+	}
 	int addr_type = lua_type(L,1);  // 地址类型
 	int multipak;
 	if (addr_type == LUA_TNUMBER) {
 		// 数字地址
-		multipak = packreq_number(L, session, msg, sz, is_push);
+		multipak = packreq_number(L, session, msg, sz, is_push, orig);
 	} else {
 		// 字符串地址
-		multipak = packreq_string(L, session, msg, sz, is_push);
+		multipak = packreq_string(L, session, msg, sz, is_push, orig);
 	}
 	// 计算下一个会话ID
 	uint32_t new_session = (uint32_t)session + 1;
@@ -286,6 +403,26 @@ lpackpush(lua_State *L) {
 	return packrequest(L, 1);  // 推送模式
 }
 
+// Lua 接口：打包共享内存通道的路径，第二个参数是 true/false 时打包发送方的确认/放弃
+static int
+lpackshm(lua_State *L) {
+	size_t sz;
+	const char * path = luaL_checklstring(L, 1, &sz);
+	if (sz > 0xff) {
+		return luaL_error(L, "shm path is too long : %d", (int) sz);
+	}
+	uint8_t buf[0x100 + 3];
+	fill_header(L, buf, sz+1);
+	if (lua_isnoneornil(L, 2)) {
+		buf[2] = 9;
+	} else {
+		buf[2] = lua_toboolean(L, 2) ? 13 : 14;
+	}
+	memcpy(buf+3, path, sz);
+	lua_pushlstring(L, (const char *)buf, sz+3);
+	return 1;
+}
+
 // Lua 接口：打包跟踪信息
 static int
 lpacktrace(lua_State *L) {
@@ -302,6 +439,159 @@ lpacktrace(lua_State *L) {
 	return 1;
 }
 
+// 打包 WORD 5 BYTE type DWORD n 格式的控制包
+static int
+pack_control(lua_State *L, uint8_t type, uint32_t n) {
+	uint8_t buf[7];
+	fill_header(L, buf, 5);
+	buf[2] = type;
+	fill_uint32(buf+3, n);
+	lua_pushlstring(L, (const char *)buf, 7);
+	return 1;
+}
+
+// Lua 接口：打包请求期限，ttl 是剩下的时间（1/100秒）
+static int
+lpackdeadline(lua_State *L) {
+	lua_Integer ttl = luaL_checkinteger(L, 1);
+	if (ttl <= 0 || ttl > UINT32_MAX) {
+		return luaL_error(L, "Invalid deadline %d", (int)ttl);
+	}
+	return pack_control(L, 10, (uint32_t)ttl);
+}
+
+// Lua 接口：打包取消请求
+static int
+lpackcancel(lua_State *L) {
+	return pack_control(L, 11, (uint32_t)luaL_checkinteger(L, 1));
+}
+
+/*
+	uint32_t/string addr
+	integer session
+	lightuserdata msg
+	integer sz
+	return string request , integer next_session
+
+	打包流请求的开始，msg 是调用参数，长度必须小于 MULTI_PART
+ */
+static int
+lpackstream(lua_State *L) {
+	void *msg = lua_touserdata(L,3);
+	if (msg == NULL) {
+		return luaL_error(L, "Invalid request message");
+	}
+	uint32_t sz = (uint32_t)luaL_checkinteger(L,4);
+	int session = luaL_checkinteger(L,2);
+	if (skynet_message_finalized(msg, sz)) {
+		skynet_message_free(msg, sz);
+		return luaL_error(L, "sharedbuffer can't be sent to other nodes");
+	}
+	if (session <= 0 || sz >= MULTI_PART) {
+		skynet_free(msg);
+		return luaL_error(L, "Invalid stream request (session = %d, size = %d)", session, (int)sz);
+	}
+	if (lua_type(L,1) == LUA_TNUMBER) {
+		packreq_number(L, session, msg, sz, 0, 0);
+	} else {
+		packreq_string(L, session, msg, sz, 0, 0);
+	}
+	skynet_free(msg);
+	size_t len;
+	const char * req = lua_tolstring(L, -1, &len);
+	uint8_t buf[TEMP_LENGTH];
+	memcpy(buf, req, len);
+	buf[2] |= 6;  // 0 -> 6 , 0x80 -> 0x86
+	lua_pushlstring(L, (const char *)buf, len);
+	uint32_t new_session = (uint32_t)session + 1;
+	if (new_session > INT32_MAX) {
+		new_session = 1;
+	}
+	lua_pushinteger(L, new_session);
+	return 2;
+}
+
+/*
+	integer session
+	string chunk (nil for the end of stream)
+	return string or table (when the chunk is larger than MULTI_PART)
+
+	打包流数据块，chunk 为 nil 时打包流结束
+ */
+static int
+lpackchunk(lua_State *L) {
+	uint32_t session = (uint32_t)luaL_checkinteger(L,1);
+	uint8_t buf[TEMP_LENGTH];
+	if (lua_isnoneornil(L, 2)) {
+		fill_header(L, buf, 5);
+		buf[2] = 8;  // 流结束
+		fill_uint32(buf+3, session);
+		lua_pushlstring(L, (const char *)buf, 7);
+		return 1;
+	}
+	size_t sz;
+	const char * chunk = luaL_checklstring(L, 2, &sz);
+	int part = sz == 0 ? 1 : (sz - 1) / MULTI_PART + 1;
+	if (part > 1) {
+		lua_createtable(L, part, 0);
+	}
+	int i;
+	for (i=0;i<part;i++) {
+		size_t s = sz > MULTI_PART ? MULTI_PART : sz;
+		fill_header(L, buf, s+5);
+		buf[2] = 7;  // 流数据块
+		fill_uint32(buf+3, session);
+		memcpy(buf+7, chunk, s);
+		lua_pushlstring(L, (const char *)buf, s+7);
+		if (part > 1) {
+			lua_rawseti(L, -2, i+1);
+		}
+		chunk += s;
+		sz -= s;
+	}
+	return 1;
+}
+
+/*
+	integer session
+	integer ack session
+	return string request , integer next_session
+
+	打包流确认请求，ack session 从请求的会话ID中分配
+ */
+static int
+lpackstreamack(lua_State *L) {
+	uint32_t session = (uint32_t)luaL_checkinteger(L,1);
+	int ack = luaL_checkinteger(L,2);
+	if (ack <= 0) {
+		return luaL_error(L, "Invalid stream ack session %d", ack);
+	}
+	uint8_t buf[11];
+	fill_header(L, buf, 9);
+	buf[2] = 12;  // 流确认请求
+	fill_uint32(buf+3, session);
+	fill_uint32(buf+7, (uint32_t)ack);
+	lua_pushlstring(L, (const char *)buf, 11);
+	uint32_t new_session = (uint32_t)ack + 1;
+	if (new_session > INT32_MAX) {
+		new_session = 1;
+	}
+	lua_pushinteger(L, new_session);
+	return 2;
+}
+
+// Lua 接口：打包连接选项，threshold 是能接受的压缩响应的阈值
+static int
+lpackoption(lua_State *L) {
+	uint32_t threshold = (uint32_t)luaL_checkinteger(L, 1);
+	uint8_t buf[7];
+	fill_header(L, buf, 5);
+	buf[2] = 5;  // 选项标识
+	fill_uint32(buf+3, threshold);
+	lua_pushlstring(L, (const char *)buf, 7);
+	return 1;
+}
+
 /*
 	string packed message
 	return
@@ -312,6 +602,16 @@ lpacktrace(lua_State *L) {
 		boolean padding
 		boolean is_push
 
+	For the stream packages, the 7th return value is "begin" , "chunk" , "end" or "ack".
+	The chunk returns false, session, string chunk. The ack returns false, session, integer ack session.
+
+	For the header of a compressed multi part request, sz is a string of two DWORD (compressed size, original size).
+	cluster.concat accepts it as the size and returns the decompressed message.
+	An option package returns false, nil, threshold.
+	A shared memory package returns false, nil, path, "shm".
+	A deadline package returns false, nil, ttl, "deadline".
+	A cancel package returns false, nil, session, "cancel".
+
 	解包消息参数说明：
 	string packed message - 打包的字符串消息数据
 	返回值：
@@ -338,10 +638,31 @@ return_buffer(lua_State *L, const char * buffer, int sz) {
 	lua_pushinteger(L, sz);          // 推入大小
 }
 
+// 返回压缩消息解压后的缓冲区给 Lua
+static void
+return_decompress(lua_State *L, const uint8_t * buffer, int sz, uint32_t orig) {
+	void * ptr = decompress_msg(buffer, sz, orig);
+	if (ptr == NULL) {
+		luaL_error(L, "Invalid compressed cluster message (size=%d)", sz);
+	}
+	lua_pushlightuserdata(L, ptr);
+	lua_pushinteger(L, orig);
+}
+
+// 压缩的多部分请求的长度：压缩后长度和原始长度
+static void
+push_compressed_size(lua_State *L, uint32_t sz, uint32_t orig) {
+	uint8_t tmp[8];
+	fill_uint32(tmp, sz);
+	fill_uint32(tmp+4, orig);
+	lua_pushlstring(L, (const char *)tmp, 8);
+}
+
 // 解包数字地址的请求
 static int
-unpackreq_number(lua_State *L, const uint8_t * buf, int sz) {
-	if (sz < 9) {
+unpackreq_number(lua_State *L, const uint8_t * buf, int sz, int compressed) {
+	int header = compressed ? 13 : 9;
+	if (sz < header) {
 		return luaL_error(L, "Invalid cluster message (size=%d)", sz);
 	}
 	uint32_t address = unpack_uint32(buf+1);  // 解包地址
@@ -349,7 +670,11 @@ unpackreq_number(lua_State *L, const uint8_t * buf, int sz) {
 	lua_pushinteger(L, address);
 	lua_pushinteger(L, session);
 
-	return_buffer(L, (const char *)buf+9, sz-9);  // 返回消息内容
+	if (compressed) {
+		return_decompress(L, buf+13, sz-13, unpack_uint32(buf+9));
+	} else {
+		return_buffer(L, (const char *)buf+9, sz-9);  // 返回消息内容
+	}
 	if (session == 0) {
 		// 推送消息，无需响应
 		lua_pushnil(L);
@@ -363,9 +688,9 @@ unpackreq_number(lua_State *L, const uint8_t * buf, int sz) {
 
 // 解包多部分请求（数字地址）
 static int
-unpackmreq_number(lua_State *L, const uint8_t * buf, int sz, int is_push) {
-	if (sz != 13) {
-		return luaL_error(L, "Invalid cluster message size %d (multi req must be 13)", sz);
+unpackmreq_number(lua_State *L, const uint8_t * buf, int sz, int is_push, int compressed) {
+	if (sz != (compressed ? 17 : 13)) {
+		return luaL_error(L, "Invalid cluster message size %d (multi req must be %d)", sz, compressed ? 17 : 13);
 	}
 	uint32_t address = unpack_uint32(buf+1);  // 解包地址
 	uint32_t session = unpack_uint32(buf+5);  // 解包会话ID
@@ -373,7 +698,11 @@ unpackmreq_number(lua_State *L, const uint8_t * buf, int sz, int is_push) {
 	lua_pushinteger(L, address);
 	lua_pushinteger(L, session);
 	lua_pushnil(L);                           // 无数据内容
-	lua_pushinteger(L, size);
+	if (compressed) {
+		push_compressed_size(L, size, unpack_uint32(buf+13));
+	} else {
+		lua_pushinteger(L, size);
+	}
 	lua_pushboolean(L, 1);	// padding multi part
 	                        // 填充多部分标志
 	lua_pushboolean(L, is_push);              // 是否为推送
@@ -407,18 +736,23 @@ unpacktrace(lua_State *L, const char * buf, int sz) {
 
 // 解包请求（字符串地址）
 static int
-unpackreq_string(lua_State *L, const uint8_t * buf, int sz) {
+unpackreq_string(lua_State *L, const uint8_t * buf, int sz, int compressed) {
 	if (sz < 2) {
 		return luaL_error(L, "Invalid cluster message (size=%d)", sz);
 	}
 	size_t namesz = buf[1];  // 服务名长度
-	if (sz < namesz + 6) {
+	size_t header = namesz + (compressed ? 10 : 6);
+	if (sz < header) {
 		return luaL_error(L, "Invalid cluster message (size=%d)", sz);
 	}
 	lua_pushlstring(L, (const char *)buf+2, namesz);  // 服务名压入堆栈
 	uint32_t session = unpack_uint32(buf + namesz + 2);  // 解包会话ID
 	lua_pushinteger(L, (uint32_t)session);
-	return_buffer(L, (const char *)buf+2+namesz+4, sz - namesz - 6);  // 返回数据
+	if (compressed) {
+		return_decompress(L, buf+header, sz - header, unpack_uint32(buf + namesz + 6));
+	} else {
+		return_buffer(L, (const char *)buf+2+namesz+4, sz - namesz - 6);  // 返回数据
+	}
 	if (session == 0) {
 		lua_pushnil(L);
 		lua_pushboolean(L,1);	// is_push, no reponse
@@ -430,12 +764,12 @@ unpackreq_string(lua_State *L, const uint8_t * buf, int sz) {
 
 // 解包多部分请求（字符串地址）
 static int
-unpackmreq_string(lua_State *L, const uint8_t * buf, int sz, int is_push) {
+unpackmreq_string(lua_State *L, const uint8_t * buf, int sz, int is_push, int compressed) {
 	if (sz < 2) {
 		return luaL_error(L, "Invalid cluster message (size=%d)", sz);
 	}
 	size_t namesz = buf[1];  // 服务名长度
-	if (sz < namesz + 10) {
+	if (sz < namesz + (compressed ? 14 : 10)) {
 		return luaL_error(L, "Invalid cluster message (size=%d)", sz);
 	}
 	lua_pushlstring(L, (const char *)buf+2, namesz);  // 服务名压入堆栈
@@ -443,7 +777,11 @@ unpackmreq_string(lua_State *L, const uint8_t * buf, int sz, int is_push) {
 	uint32_t size = unpack_uint32(buf + namesz + 6);     // 解包数据大小
 	lua_pushinteger(L, session);
 	lua_pushnil(L);                                      // 无数据内容
-	lua_pushinteger(L, size);
+	if (compressed) {
+		push_compressed_size(L, size, unpack_uint32(buf + namesz + 10));
+	} else {
+		lua_pushinteger(L, size);
+	}
 	lua_pushboolean(L, 1);	// padding multipart
 	                        // 填充多部分标志
 	lua_pushboolean(L, is_push);                         // 是否为推送
@@ -471,25 +809,118 @@ lunpackrequest(lua_State *L) {
 	// 根据消息类型字节分发到不同的解包函数
 	switch (msg[0]) {
 	case 0:
-		return unpackreq_number(L, (const uint8_t *)msg, sz);
+	case '\x20':
+		return unpackreq_number(L, (const uint8_t *)msg, sz, msg[0] != 0);
 	case 1:
-		return unpackmreq_number(L, (const uint8_t *)msg, sz, 0);	// request
+	case '\x21':
+		return unpackmreq_number(L, (const uint8_t *)msg, sz, 0, msg[0] != 1);	// request
 		                                                            // 请求
 	case '\x41':
-		return unpackmreq_number(L, (const uint8_t *)msg, sz, 1);	// push
+	case '\x61':
+		return unpackmreq_number(L, (const uint8_t *)msg, sz, 1, msg[0] != '\x41');	// push
 		                                                            // 推送
 	case 2:
 	case 3:
 		return unpackmreq_part(L, (const uint8_t *)msg, sz);        // 多部分数据
 	case 4:
 		return unpacktrace(L, msg, sz);                             // 跟踪消息
+	case 6:
+	case '\x86': {
+		// 流请求开始
+		int n = (msg[0] == 6) ?
+			unpackreq_number(L, (const uint8_t *)msg, sz, 0) :
+			unpackreq_string(L, (const uint8_t *)msg, sz, 0);
+		if (n != 4)
+			return luaL_error(L, "Invalid stream session");
+		lua_pushnil(L);
+		lua_pushnil(L);
+		lua_pushliteral(L, "begin");
+		return 7;
+	}
+	case 7:
+	case 8:
+		// 流数据块和流结束
+		if (sz < 5)
+			return luaL_error(L, "Invalid cluster stream message");
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, unpack_uint32((const uint8_t *)msg+1));
+		if (msg[0] == 7) {
+			lua_pushlstring(L, msg+5, sz-5);
+			lua_pushnil(L);
+			lua_pushnil(L);
+			lua_pushnil(L);
+			lua_pushliteral(L, "chunk");
+		} else {
+			lua_pushnil(L);
+			lua_pushnil(L);
+			lua_pushnil(L);
+			lua_pushnil(L);
+			lua_pushliteral(L, "end");
+		}
+		return 7;
+	case 5:
+		// 连接选项
+		if (sz != 5)
+			return luaL_error(L, "Invalid cluster option (size=%d)", sz);
+		lua_pushboolean(L, 0);
+		lua_pushnil(L);
+		lua_pushinteger(L, unpack_uint32((const uint8_t *)msg+1));
+		return 3;
+	case 9:
+		// 共享内存通道
+		lua_pushboolean(L, 0);
+		lua_pushnil(L);
+		lua_pushlstring(L, msg+1, sz-1);
+		lua_pushliteral(L, "shm");
+		return 4;
+	case 13:
+	case 14:
+		// 共享内存通道的确认和放弃
+		lua_pushboolean(L, 0);
+		lua_pushnil(L);
+		lua_pushlstring(L, msg+1, sz-1);
+		if (msg[0] == 13) {
+			lua_pushliteral(L, "shmconfirm");
+		} else {
+			lua_pushliteral(L, "shmabandon");
+		}
+		return 4;
+	case 10:
+	case 11:
+		// 请求期限和取消请求
+		if (sz != 5)
+			return luaL_error(L, "Invalid cluster control (size=%d)", sz);
+		lua_pushboolean(L, 0);
+		lua_pushnil(L);
+		lua_pushinteger(L, unpack_uint32((const uint8_t *)msg+1));
+		if (msg[0] == 10) {
+			lua_pushliteral(L, "deadline");
+		} else {
+			lua_pushliteral(L, "cancel");
+		}
+		return 4;
+	case 12:
+		// 流确认请求
+		if (sz != 9)
+			return luaL_error(L, "Invalid cluster stream ack (size=%d)", sz);
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, unpack_uint32((const uint8_t *)msg+1));
+		lua_pushinteger(L, unpack_uint32((const uint8_t *)msg+5));
+		lua_pushnil(L);
+		lua_pushnil(L);
+		lua_pushnil(L);
+		lua_pushliteral(L, "ack");
+		return 7;
 	case '\x80':
-		return unpackreq_string(L, (const uint8_t *)msg, sz);       // 字符串地址请求
+	case '\xa0':
+		return unpackreq_string(L, (const uint8_t *)msg, sz, msg[0] != '\x80');       // 字符串地址请求
 	case '\x81':
-		return unpackmreq_string(L, (const uint8_t *)msg, sz, 0 );	// request
+	case '\xa1':
+		return unpackmreq_string(L, (const uint8_t *)msg, sz, 0, msg[0] != '\x81');	// request
 		                                                            // 字符串地址请求
 	case '\xc1':
-		return unpackmreq_string(L, (const uint8_t *)msg, sz, 1 );	// push
+	case '\xe1':
+		return unpackmreq_string(L, (const uint8_t *)msg, sz, 1, msg[0] != '\xc1');	// push
 		                                                            // 字符串地址推送
 	default:
 		return luaL_error(L, "Invalid req package type %d", msg[0]);
@@ -506,25 +937,74 @@ lunpackrequest(lua_State *L) {
 		2: multi begin
 		3: multi part
 		4: multi end
+		5: compressed ok
+		6: compressed multi begin
 	PADDING msg
 		type = 0, error msg
 		type = 1, msg
 		type = 2, DWORD size
 		type = 3/4, msg
+		type = 5, DWORD original size, compressed msg
+		type = 6, DWORD compressed size, DWORD original size (followed by type 3/4 parts of compressed msg)
  */
 /*
 	int session
 	boolean ok
 	lightuserdata msg
 	int sz
+	integer threshold (optional)
 	return string response
 
 	int session - 会话ID
 	boolean ok - 是否成功
 	lightuserdata msg - 消息数据指针
 	int sz - 消息大小
+	integer threshold - 可选，对方通过选项包给出的压缩阈值，0 或 nil 表示不压缩
 	返回值：string response - 打包后的响应数据
  */
+// 打包压缩后的成功响应
+static int
+packresponse_compressed(lua_State *L, uint32_t session, const char * msg, size_t sz, uint32_t orig) {
+	uint8_t buf[TEMP_LENGTH];
+	if (sz + 4 <= MULTI_PART) {
+		fill_header(L, buf, sz+9);
+		fill_uint32(buf+2, session);
+		buf[6] = 5;  // 压缩的单部分响应
+		fill_uint32(buf+7, orig);
+		memcpy(buf+11, msg, sz);
+		lua_pushlstring(L, (const char *)buf, sz+11);
+		return 1;
+	}
+	int part = (sz - 1) / MULTI_PART + 1;
+	lua_createtable(L, part+1, 0);
+	fill_header(L, buf, 13);
+	fill_uint32(buf+2, session);
+	buf[6] = 6;  // 压缩的多部分开始
+	fill_uint32(buf+7, (uint32_t)sz);
+	fill_uint32(buf+11, orig);
+	lua_pushlstring(L, (const char *)buf, 15);
+	lua_rawseti(L, -2, 1);
+	int i;
+	for (i=0;i<part;i++) {
+		int s;
+		if (sz > MULTI_PART) {
+			s = MULTI_PART;
+			buf[6] = 3;
+		} else {
+			s = sz;
+			buf[6] = 4;
+		}
+		fill_header(L, buf, s+5);
+		fill_uint32(buf+2, session);
+		memcpy(buf+7,msg,s);
+		lua_pushlstring(L, (const char *)buf, s+7);
+		lua_rawseti(L, -2, i+2);
+		sz -= s;
+		msg += s;
+	}
+	return 1;
+}
+
 // Lua 接口：打包响应
 static int
 lpackresponse(lua_State *L) {
@@ -545,6 +1025,16 @@ lpackresponse(lua_State *L) {
 		msg = lua_touserdata(L,3);
 		sz = (size_t)luaL_checkinteger(L, 4);
 	}
+	size_t threshold = (size_t)luaL_optinteger(L, 5, 0);
+	if (ok && threshold > 0 && sz >= threshold && sz > 4) {
+		lua_settop(L, 5);
+		// 压缩后的数据放在 userdata 里，由 gc 回收
+		char * ud = lua_newuserdatauv(L, lz_bound(sz), 0);
+		size_t csz = lz_compress(msg, sz, ud, sz - 4);
+		if (csz > 0) {
+			return packresponse_compressed(L, session, ud, csz, (uint32_t)sz);
+		}
+	}
 
 	if (!ok) {
 		// 错误响应
@@ -658,6 +1148,34 @@ lunpackresponse(lua_State *L) {
 		lua_pushlstring(L, buf+5, sz-5);  // 部分数据
 		lua_pushboolean(L, 1);  // 填充标志
 		return 4;
+	case 5: {	// compressed ok
+	            // 压缩的成功响应
+		if (sz < 9) {
+			return 0;
+		}
+		uint32_t orig = unpack_uint32((const uint8_t *)buf+5);
+		if (orig > INT32_MAX || orig > lz_maxorig(sz-9)) {
+			return luaL_error(L, "Invalid compressed cluster response (size=%d)", (int)orig);
+		}
+		luaL_Buffer b;
+		char * out = luaL_buffinitsize(L, &b, orig);
+		if (lz_decompress(buf+9, sz-9, out, orig) != (long)orig) {
+			return luaL_error(L, "Invalid compressed cluster response");
+		}
+		luaL_pushresultsize(&b, orig);
+		lua_pushboolean(L, 1);
+		lua_rotate(L, -2, 1);
+		return 3;
+	}
+	case 6:	// compressed multi begin
+	        // 压缩的多部分开始，大小交给 concat 解压
+		if (sz != 13) {
+			return 0;
+		}
+		lua_pushboolean(L, 1);
+		lua_pushlstring(L, buf+5, 8);  // 压缩后长度和原始长度
+		lua_pushboolean(L, 1);
+		return 4;
 	default:
 		return 0;  // 未知状态
 	}
@@ -696,13 +1214,35 @@ lappend(lua_State *L) {
 	return 0;
 }
 
+/*
+	table : { size, part1, part2, ... }
+	size is an integer, or a string of two DWORD (compressed size, original size) for the compressed message.
+	return lightuserdata, sz
+
+	表的第一项是总大小；压缩的消息是两个 DWORD 的字符串（压缩后长度，原始长度），连接后解压
+ */
 static int
 lconcat(lua_State *L) {
 	if (!lua_istable(L,1))
 		return 0;  // 不是表，返回失败
-	if (lua_geti(L,1,1) != LUA_TNUMBER)
-		return 0;  // 第一个元素不是数字，返回失败
-	int sz = lua_tointeger(L,-1);  // 获取总大小
+	int sz;
+	uint32_t orig = 0;
+	switch (lua_geti(L,1,1)) {
+	case LUA_TNUMBER:
+		sz = lua_tointeger(L,-1);  // 获取总大小
+		break;
+	case LUA_TSTRING: {
+		size_t len;
+		const uint8_t * s = (const uint8_t *)lua_tolstring(L, -1, &len);
+		if (len != 8)
+			return 0;
+		sz = (int)unpack_uint32(s);
+		orig = unpack_uint32(s+4);
+		break;
+	}
+	default:
+		return 0;  // 第一个元素不是大小，返回失败
+	}
 	lua_pop(L,1);
 	char * buff = skynet_malloc(sz);  // 分配缓冲区
 	int idx = 2;
@@ -726,6 +1266,14 @@ lconcat(lua_State *L) {
 		skynet_free(buff);
 		return 0;
 	}
+	if (orig) {
+		char * data = decompress_msg(buff, sz, orig);
+		skynet_free(buff);
+		if (data == NULL)
+			return 0;
+		buff = data;
+		sz = (int)orig;
+	}
 	// buff/sz will send to other service, See clusterd.lua
 	// 缓冲区/大小将发送给其他服务，参见 clusterd.lua
 	lua_pushlightuserdata(L, buff);
@@ -733,6 +1281,151 @@ lconcat(lua_State *L) {
 	return 2;
 }
 
+/*
+	进程内共享的路由表，由 clusterd 更新，所有服务直接读取，不用再向 clusterd 查询。
+	"sender" : 节点名 -> clustersender 的地址
+	"name" : cluster.register 注册的名字 -> 服务地址
+	更新很少，读用读写锁，读者之间互不阻塞。
+ */
+#define ROUTE_INITSIZE 64
+
+struct route_node {
+	struct route_node * next;
+	uint32_t hash;
+	uint32_t value;
+	size_t sz;
+	char key[1];
+};
+
+struct route_table {
+	struct rwlock lock;
+	int size;
+	int count;
+	struct route_node ** slot;
+};
+
+static struct route_table R[2];
+
+static uint32_t
+route_hash(const char * key, size_t sz) {
+	uint32_t h = (uint32_t)sz;
+	size_t i;
+	for (i=0;i<sz;i++) {
+		h = h ^ ((h<<5)+(h>>2)+(uint8_t)key[i]);
+	}
+	return h;
+}
+
+static struct route_node *
+route_find(struct route_table *t, const char * key, size_t sz, uint32_t h) {
+	if (t->size == 0)
+		return NULL;
+	struct route_node * n = t->slot[h & (t->size - 1)];
+	while (n) {
+		if (n->hash == h && n->sz == sz && memcmp(n->key, key, sz) == 0)
+			return n;
+		n = n->next;
+	}
+	return NULL;
+}
+
+// 写锁内调用，数量超过桶数时扩大一倍
+static void
+route_expand(struct route_table *t) {
+	int size = t->size ? t->size * 2 : ROUTE_INITSIZE;
+	struct route_node ** slot = skynet_malloc(size * sizeof(*slot));
+	memset(slot, 0, size * sizeof(*slot));
+	int i;
+	for (i=0;i<t->size;i++) {
+		struct route_node * n = t->slot[i];
+		while (n) {
+			struct route_node * next = n->next;
+			int idx = n->hash & (size - 1);
+			n->next = slot[idx];
+			slot[idx] = n;
+			n = next;
+		}
+	}
+	skynet_free(t->slot);
+	t->slot = slot;
+	t->size = size;
+}
+
+static int
+route_type(lua_State *L) {
+	static const char * const opts[] = { "sender", "name", NULL };
+	return luaL_checkoption(L, 1, NULL, opts);
+}
+
+/*
+	string type ("sender" or "name")
+	string key
+	integer value (nil for remove)
+
+	更新路由表，只应由 clusterd 调用
+ */
+static int
+lsetroute(lua_State *L) {
+	struct route_table *t = &R[route_type(L)];
+	size_t sz;
+	const char * key = luaL_checklstring(L, 2, &sz);
+	uint32_t value = (uint32_t)luaL_optinteger(L, 3, 0);
+	uint32_t h = route_hash(key, sz);
+	rwlock_wlock(&t->lock);
+	struct route_node * n = route_find(t, key, sz, h);
+	if (n) {
+		if (value) {
+			n->value = value;
+		} else {
+			// 删除
+			struct route_node ** p = &t->slot[h & (t->size - 1)];
+			while (*p != n)
+				p = &(*p)->next;
+			*p = n->next;
+			skynet_free(n);
+			--t->count;
+		}
+	} else if (value) {
+		if (t->count >= t->size)
+			route_expand(t);
+		n = skynet_malloc(sizeof(*n) + sz);
+		n->hash = h;
+		n->value = value;
+		n->sz = sz;
+		memcpy(n->key, key, sz);
+		n->key[sz] = '\0';
+		int idx = h & (t->size - 1);
+		n->next = t->slot[idx];
+		t->slot[idx] = n;
+		++t->count;
+	}
+	rwlock_wunlock(&t->lock);
+	return 0;
+}
+
+/*
+	string type ("sender" or "name")
+	string key
+	return integer value or nil
+
+	查询路由表
+ */
+static int
+lroute(lua_State *L) {
+	struct route_table *t = &R[route_type(L)];
+	size_t sz;
+	const char * key = luaL_checklstring(L, 2, &sz);
+	uint32_t h = route_hash(key, sz);
+	rwlock_rlock(&t->lock);
+	struct route_node * n = route_find(t, key, sz, h);
+	uint32_t value = n ? n->value : 0;
+	rwlock_runlock(&t->lock);
+	if (value == 0)
+		return 0;
+	lua_pushinteger(L, value);
+	return 1;
+}
+
 // 检查是否为集群名称（以 @ 开头）
 static int
 lisname(lua_State *L) {
@@ -771,12 +1464,21 @@ luaopen_skynet_cluster_core(lua_State *L) {
 		{ "packrequest", lpackrequest },    // 打包请求
 		{ "packpush", lpackpush },          // 打包推送
 		{ "packtrace", lpacktrace },        // 打包跟踪
+		{ "packoption", lpackoption },      // 打包连接选项
+		{ "packdeadline", lpackdeadline },  // 打包请求期限
+		{ "packcancel", lpackcancel },      // 打包取消请求
+		{ "packshm", lpackshm },            // 打包共享内存通道
+		{ "packstream", lpackstream },      // 打包流请求开始
+		{ "packchunk", lpackchunk },        // 打包流数据块
+		{ "packstreamack", lpackstreamack },  // 打包流确认请求
 		{ "unpackrequest", lunpackrequest }, // 解包请求
 		{ "packresponse", lpackresponse },   // 打包响应
 		{ "unpackresponse", lunpackresponse }, // 解包响应
 		{ "append", lappend },              // 追加数据
 		{ "concat", lconcat },              // 连接数据
 		{ "isname", lisname },              // 检查是否为集群名称
+		{ "setroute", lsetroute },          // 更新共享路由表
+		{ "route", lroute },                // 查询共享路由表
 		{ "nodename", lnodename },          // 获取节点名称
 		{ NULL, NULL },
 	};
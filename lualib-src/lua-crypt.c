@@ -550,6 +550,12 @@ lhashkey(lua_State *L) {
 	return 1;
 }
 
+// defined in lcodec.c
+size_t codec_hex_encode(char *dst, const uint8_t *src, size_t n);
+size_t codec_hex_decode(uint8_t *dst, const char *src, size_t n);
+size_t codec_b64_encode(char *dst, const uint8_t *src, size_t n);
+size_t codec_b64_decode(uint8_t *dst, const uint8_t *src, size_t n);
+
 static int
 ltohex(lua_State *L) {
 	static char hex[] = "0123456789abcdef";
@@ -560,8 +566,8 @@ ltohex(lua_State *L) {
 	if (sz > SMALL_CHUNK/2) {
 		buffer = (char*)lua_newuserdatauv(L, sz * 2, 0);
 	}
-	int i;
-	for (i=0;i<sz;i++) {
+	size_t i = codec_hex_encode(buffer, text, sz);
+	for (;i<sz;i++) {
 		buffer[i*2] = hex[text[i] >> 4];
 		buffer[i*2+1] = hex[text[i] & 0xf];
 	}
@@ -583,8 +589,8 @@ lfromhex(lua_State *L) {
 	if (sz > SMALL_CHUNK*2) {
 		buffer = (char*)lua_newuserdatauv(L, sz / 2, 0);
 	}
-	int i;
-	for (i=0;i<sz;i+=2) {
+	size_t i = codec_hex_decode((uint8_t *)buffer, text, sz);
+	for (;i<sz;i+=2) {
 		uint8_t hi,low;
 		HEX(hi, text[i]);
 		HEX(low, text[i+1]);
@@ -901,8 +907,9 @@ lb64encode(lua_State *L) {
 		buffer = (char*)lua_newuserdatauv(L, encode_sz, 0);
 	}
 	int i,j;
-	j=0;
-	for (i=0;i<(int)sz-2;i+=3) {
+	i = (int)codec_b64_encode(buffer, text, sz);
+	j = i/3*4;
+	for (;i<(int)sz-2;i+=3) {
 		uint32_t v = text[i] << 16 | text[i+1] << 8 | text[i+2];
 		buffer[j] = encoding[v >> 18];
 		buffer[j+1] = encoding[(v >> 12) & 0x3f];
@@ -956,8 +963,9 @@ lb64decode(lua_State *L) {
 		buffer = (char*)lua_newuserdatauv(L, decode_sz, 0);
 	}
 	int i,j;
-	int output = 0;
-	for (i=0;i<sz;) {
+	i = (int)codec_b64_decode((uint8_t *)buffer, text, sz);
+	int output = i/4*3;
+	for (;i<sz;) {
 		int padding = 0;
 		int c[4];
 		for (j=0;j<4;) {
@@ -1034,6 +1042,114 @@ lxor_str(lua_State *L) {
 int lsha1(lua_State *L);
 int lhmac_sha1(lua_State *L);
 
+// defined in lsha256.c
+int lsha256(lua_State *L);
+int lhmac_sha256(lua_State *L);
+
+/*
+	The handshake state machine of snax.loginserver (see lualib/snax/loginserver.lua).
+	One object per connection, call feed for each line from the client.
+ */
+
+#define HANDSHAKE_KEY 0
+#define HANDSHAKE_HMAC 1
+#define HANDSHAKE_TOKEN 2
+#define HANDSHAKE_DONE 3
+
+struct handshake {
+	int state;
+	char challenge[8];
+	char secret[8];
+};
+
+// call f with nargs arguments on the top, leave one result
+static inline void
+call_crypt(lua_State *L, lua_CFunction f, int nargs) {
+	lua_pushcfunction(L, f);
+	lua_insert(L, -nargs-1);
+	lua_call(L, nargs, 1);
+}
+
+/*
+	handshake object
+	string line (without \n)
+
+	HANDSHAKE_KEY : line is base64(client key), return base64(DH-Exchange(server key)).."\n"
+	HANDSHAKE_HMAC : line is base64(HMAC(challenge, secret)), return nothing
+	HANDSHAKE_TOKEN : line is DES(secret, base64(token)), return token, secret
+ */
+static int
+lhandshake_feed(lua_State *L) {
+	struct handshake *h = (struct handshake *)luaL_checkudata(L, 1, "SKYNET_CRYPT_HANDSHAKE");
+	luaL_checkstring(L, 2);
+	lua_settop(L, 2);
+	size_t sz;
+	switch (h->state) {
+	case HANDSHAKE_KEY: {
+		call_crypt(L, lb64decode, 1);
+		lua_tolstring(L, -1, &sz);
+		if (sz != 8) {
+			return luaL_error(L, "Invalid client key");
+		}
+		call_crypt(L, lrandomkey, 0);	// server key
+		lua_pushvalue(L, -2);	// client key
+		lua_pushvalue(L, -2);	// server key
+		call_crypt(L, ldhsecret, 2);
+		memcpy(h->secret, lua_tostring(L, -1), 8);
+		lua_pop(L, 1);
+		call_crypt(L, ldhexchange, 1);
+		call_crypt(L, lb64encode, 1);
+		lua_pushliteral(L, "\n");
+		lua_concat(L, 2);
+		h->state = HANDSHAKE_HMAC;
+		return 1;
+	}
+	case HANDSHAKE_HMAC: {
+		call_crypt(L, lb64decode, 1);
+		lua_pushlstring(L, h->challenge, 8);
+		lua_pushlstring(L, h->secret, 8);
+		call_crypt(L, lhmac64, 2);
+		const char * response = lua_tolstring(L, -2, &sz);
+		if (sz != 8 || memcmp(response, lua_tostring(L, -1), 8) != 0) {
+			return luaL_error(L, "challenge failed");
+		}
+		h->state = HANDSHAKE_TOKEN;
+		return 0;
+	}
+	case HANDSHAKE_TOKEN:
+		call_crypt(L, lb64decode, 1);
+		lua_pushlstring(L, h->secret, 8);
+		lua_insert(L, -2);
+		call_crypt(L, ldesdecode, 2);
+		lua_pushlstring(L, h->secret, 8);
+		h->state = HANDSHAKE_DONE;
+		return 2;
+	default:
+		return luaL_error(L, "Handshake is done");
+	}
+}
+
+/*
+	return handshake object, base64(8bytes random challenge).."\n"
+ */
+static int
+lhandshake(lua_State *L) {
+	struct handshake *h = (struct handshake *)lua_newuserdatauv(L, sizeof(*h), 0);
+	h->state = HANDSHAKE_KEY;
+	if (luaL_newmetatable(L, "SKYNET_CRYPT_HANDSHAKE")) {
+		lua_newtable(L);
+		lua_pushcfunction(L, lhandshake_feed);
+		lua_setfield(L, -2, "feed");
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	call_crypt(L, lrandomkey, 0);
+	memcpy(h->challenge, lua_tostring(L, -1), 8);
+	call_crypt(L, lb64encode, 1);
+	lua_pushliteral(L, "\n");
+	lua_concat(L, 2);
+	return 2;
+}
 
 LUAMOD_API int
 luaopen_skynet_crypt(lua_State *L) {
@@ -1059,8 +1175,11 @@ luaopen_skynet_crypt(lua_State *L) {
 		{ "base64decode", lb64decode },
 		{ "sha1", lsha1 },
 		{ "hmac_sha1", lhmac_sha1 },
+		{ "sha256", lsha256 },
+		{ "hmac_sha256", lhmac_sha256 },
 		{ "hmac_hash", lhmac_hash },
 		{ "xor_str", lxor_str },
+		{ "handshake", lhandshake },
 		{ "padding", NULL },
 		{ NULL, NULL },
 	};
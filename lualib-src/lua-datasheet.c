@@ -1,6 +1,16 @@
+#include "skynet_malloc.h"
+#include "spinlock.h"
+
 #include <lua.h>
 #include <lauxlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 // 缓存键名定义
 #define NODECACHE "_ctable"   // 节点缓存
@@ -14,10 +24,25 @@
 #define VALUE_BOOLEAN 3   // 布尔值
 #define VALUE_TABLE 4     // 表
 #define VALUE_STRING 5    // 字符串
-#define VALUE_INVALID 6   // 无效值
+#define VALUE_INDEX 6     // 二级索引（只出现在根表的第一个键值对，对 Lua 不可见）
+#define VALUE_INVALID 7   // 无效值
 
 #define INVALID_OFFSET 0xffffffff  // 无效偏移量
 
+// 文档头 strtbl 的高位是字符串的存放方式，见 datasheet/dump.lua
+#define STRTBL_POOL 0x80000000u    // 字符串值是全局字符串池的 id，文档里没有字符串
+#define STRTBL_PREFIX 0x40000000u  // 字符串可以引用块内字典中的前缀
+#define STRTBL_OFFSET 0x3fffffffu
+
+// 前缀压缩的字符串条目的首字节
+#define STRING_PREFIX 1            // 1 + uint32 前缀的偏移 + 后缀
+#define STRING_ESCAPE 2            // 2 + 以 1 或 2 开头的原字符串
+
+// 磁盘文件格式，见 datasheet/dump.lua
+#define FILE_MAGIC "SKDS"
+#define FILE_FORMAT 1
+#define FILE_HEADER 20
+
 // 代理结构
 struct proxy {
 	const char * data;  // 数据指针
@@ -42,6 +67,110 @@ struct table {
 	// kvpair[dict]     // 键值对
 };
 
+/*
+ * 全局字符串池：整个节点共享，只增加不删除，字符串活到节点退出。
+ * 构建 datasheet 的服务在锁内查重和追加；读的服务不加锁，它拿到的 id 来自之后才发布的文档。
+ */
+#define POOL_PAGE 4096
+#define POOL_PAGES 65536
+
+struct strpool {
+	struct spinlock lock;
+	uint32_t n;                         // 字符串数，id 为 [0, n)
+	size_t bytes;                       // 字符串占用的内存
+	uint32_t cap;                       // 查重的哈希槽数，2 的幂
+	uint32_t * slot;                    // id + 1，0 为空
+	const char ** page[POOL_PAGES];     // id -> uint32 长度 + 字符串 + '\0'
+};
+
+static struct strpool POOL;
+static pthread_once_t POOL_ONCE = PTHREAD_ONCE_INIT;
+
+static void
+pool_init(void) {
+	spinlock_init(&POOL.lock);
+}
+
+static inline const char *
+pool_get(uint32_t id) {
+	return POOL.page[id / POOL_PAGE][id % POOL_PAGE];
+}
+
+static inline size_t
+pool_len(const char *p) {
+	uint32_t sz;
+	memcpy(&sz, p, sizeof(sz));
+	return sz;
+}
+
+static uint32_t
+pool_hash(const char *s, size_t sz) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i=0;i<sz;i++) {
+		h = (h ^ (uint8_t)s[i]) * 16777619u;
+	}
+	return h;
+}
+
+static void
+pool_rehash(void) {
+	uint32_t cap = POOL.cap ? POOL.cap * 2 : 1024;
+	uint32_t * slot = skynet_malloc(cap * sizeof(uint32_t));
+	memset(slot, 0, cap * sizeof(uint32_t));
+	uint32_t i;
+	for (i=0;i<POOL.n;i++) {
+		const char * p = pool_get(i);
+		uint32_t h = pool_hash(p + sizeof(uint32_t), pool_len(p)) & (cap - 1);
+		while (slot[h])
+			h = (h + 1) & (cap - 1);
+		slot[h] = i + 1;
+	}
+	skynet_free(POOL.slot);
+	POOL.slot = slot;
+	POOL.cap = cap;
+}
+
+// 返回字符串的 id，池满了返回 -1
+static int64_t
+pool_intern(const char *s, size_t sz) {
+	spinlock_lock(&POOL.lock);
+	if ((POOL.n + 1) * 2 > POOL.cap)
+		pool_rehash();
+	uint32_t mask = POOL.cap - 1;
+	uint32_t h = pool_hash(s, sz) & mask;
+	uint32_t id;
+	while ((id = POOL.slot[h]) != 0) {
+		const char * p = pool_get(id - 1);
+		if (pool_len(p) == sz && memcmp(p + sizeof(uint32_t), s, sz) == 0) {
+			spinlock_unlock(&POOL.lock);
+			return id - 1;
+		}
+		h = (h + 1) & mask;
+	}
+	id = POOL.n;
+	if (id >= (uint32_t)POOL_PAGE * POOL_PAGES) {
+		spinlock_unlock(&POOL.lock);
+		return -1;
+	}
+	const char ** page = POOL.page[id / POOL_PAGE];
+	if (page == NULL) {
+		page = skynet_malloc(POOL_PAGE * sizeof(const char *));
+		POOL.page[id / POOL_PAGE] = page;
+	}
+	char * p = skynet_malloc(sizeof(uint32_t) + sz + 1);
+	uint32_t len = (uint32_t)sz;
+	memcpy(p, &len, sizeof(len));
+	memcpy(p + sizeof(uint32_t), s, sz);
+	p[sizeof(uint32_t) + sz] = '\0';
+	page[id % POOL_PAGE] = p;
+	POOL.slot[h] = id + 1;
+	POOL.bytes += sizeof(uint32_t) + sz + 1;
+	POOL.n = id + 1;
+	spinlock_unlock(&POOL.lock);
+	return id;
+}
+
 // 根据索引获取表结构
 static inline const struct table *
 gettable(const struct document *doc, int index) {
@@ -231,6 +360,82 @@ getfloat(const void *v) {
 	}
 }
 
+// 计算值数组的起始位置（考虑对齐）
+static inline const uint32_t *
+tablevalues(const struct table *t) {
+	return (const uint32_t *)((const char *)t + sizeof(uint32_t) + sizeof(uint32_t) + ((t->array + t->dict + 3) & ~3));
+}
+
+// 文档中的一个字符串，前缀压缩的字符串分成前缀和后缀两段
+struct dsstring {
+	const char * prefix;
+	size_t psz;
+	const char * s;
+	size_t sz;
+};
+
+static void
+getstring(const struct document *doc, const void *v, struct dsstring *r) {
+	uint32_t strtbl = doc->strtbl;
+	uint32_t offset = getuint32(v);
+	r->prefix = NULL;
+	r->psz = 0;
+	if (strtbl & STRTBL_POOL) {
+		const char * p = pool_get(offset);
+		r->s = p + sizeof(uint32_t);
+		r->sz = pool_len(p);
+		return;
+	}
+	const char * str = (const char *)doc + (strtbl & STRTBL_OFFSET);
+	const char * s = str + offset;
+	if (strtbl & STRTBL_PREFIX) {
+		if (*s == STRING_PREFIX) {
+			uint32_t prefix;
+			memcpy(&prefix, s + 1, sizeof(prefix));
+			r->prefix = str + getuint32(&prefix);
+			r->psz = strlen(r->prefix);
+			s += 1 + sizeof(prefix);
+		} else if (*s == STRING_ESCAPE) {
+			++s;
+		}
+	}
+	r->s = s;
+	r->sz = strlen(s);
+}
+
+static void
+pushstring(lua_State *L, const struct dsstring *r) {
+	if (r->prefix) {
+		luaL_Buffer b;
+		luaL_buffinitsize(L, &b, r->psz + r->sz);
+		luaL_addlstring(&b, r->prefix, r->psz);
+		luaL_addlstring(&b, r->s, r->sz);
+		luaL_pushresult(&b);
+	} else {
+		lua_pushlstring(L, r->s, r->sz);
+	}
+}
+
+// 按字节比较文档中的字符串和 s
+static int
+comparestring(const struct dsstring *r, const char *s, size_t sz) {
+	int c;
+	if (r->prefix) {
+		size_t n = r->psz < sz ? r->psz : sz;
+		c = memcmp(r->prefix, s, n);
+		if (c != 0)
+			return c;
+		if (r->psz >= sz)
+			return r->psz + r->sz > sz;
+		s += r->psz;
+		sz -= r->psz;
+	}
+	c = memcmp(r->s, s, r->sz < sz ? r->sz : sz);
+	if (c != 0)
+		return c;
+	return r->sz < sz ? -1 : (r->sz > sz);
+}
+
 // 推送值到 Lua 栈（根据类型转换）
 static void
 pushvalue(lua_State *L, const void *v, int type, const struct document * doc) {
@@ -250,9 +455,12 @@ pushvalue(lua_State *L, const void *v, int type, const struct document * doc) {
 	case VALUE_TABLE:
 		create_proxy(L, doc, getuint32(v));  // 表（创建代理）
 		break;
-	case VALUE_STRING:
-		lua_pushstring(L,  (const char *)doc + doc->strtbl + getuint32(v));  // 字符串
+	case VALUE_STRING: {
+		struct dsstring str;
+		getstring(doc, v, &str);
+		pushstring(L, &str);  // 字符串
 		break;
+	}
 	default:
 		luaL_error(L, "Invalid type %d at %p", type, v);
 	}
@@ -269,8 +477,7 @@ copytable(lua_State *L, int tbl, struct proxy *p) {
 	if (t == NULL) {
 		luaL_error(L, "Invalid proxy (index = %d)", p->index);
 	}
-	// 计算值数组的起始位置（考虑对齐）
-	const uint32_t * v = (const uint32_t *)((const char *)t + sizeof(uint32_t) + sizeof(uint32_t) + ((t->array + t->dict + 3) & ~3));
+	const uint32_t * v = tablevalues(t);
 	int i;
 	// 复制数组部分
 	for (i=0;i<t->array;i++) {
@@ -279,6 +486,10 @@ copytable(lua_State *L, int tbl, struct proxy *p) {
 	}
 	// 复制字典部分
 	for (i=0;i<t->dict;i++) {
+		if (t->type[t->array+i] == VALUE_INDEX) {
+			v += 2;  // 跳过二级索引
+			continue;
+		}
 		pushvalue(L, v++, VALUE_STRING, doc);  // 键（字符串）
 		pushvalue(L, v++, t->type[t->array+i], doc);  // 值
 		lua_rawset(L, tbl);  // 设置键值对
@@ -300,6 +511,241 @@ lnew(lua_State *L) {
 	return 1;
 }
 
+// 二级索引，格式见 datasheet/dump.lua
+struct dsindex {
+	const struct document * doc;
+	const struct table * keys;      // 排序的键
+	const struct table * starts;    // 每个键的记录起始位置（从 1 开始）
+	const struct table * records;   // 记录的表索引
+	const struct table * slots;     // 哈希槽，NULL 表示只有排序索引
+};
+
+// 查找的键，整数排在字符串前面
+struct dskey {
+	int type;          // VALUE_INTEGER 或 VALUE_STRING
+	int32_t i;
+	const char * s;
+	size_t sz;
+};
+
+static const struct table *
+indextable(lua_State *L, const struct document *doc, const uint32_t *v, int type) {
+	const struct table * t = NULL;
+	if (type == VALUE_TABLE && getuint32(v) < doc->n) {
+		t = gettable(doc, getuint32(v));
+	}
+	if (t == NULL) {
+		luaL_error(L, "Invalid datasheet index");
+	}
+	return t;
+}
+
+// 参数 1 为 datasheet 中的任意一个表，参数 2 为索引名
+static void
+getindex(lua_State *L, struct dsindex *idx) {
+	lua_getfield(L, LUA_REGISTRYINDEX, PROXYCACHE);
+	lua_pushvalue(L, 1);
+	if (lua_rawget(L, -2) != LUA_TUSERDATA) {
+		luaL_error(L, "Invalid proxy table %p", lua_topointer(L, 1));
+	}
+	struct proxy * p = lua_touserdata(L, -1);
+	lua_pop(L, 2);
+	const char * name = luaL_checkstring(L, 2);
+	const struct document * doc = (const struct document *)p->data;
+	const struct table * root = gettable(doc, 0);
+	if (root == NULL || root->dict == 0 || root->type[root->array] != VALUE_INDEX) {
+		luaL_error(L, "No index %s", name);
+	}
+	const uint32_t * v = tablevalues(root) + root->array;
+	const struct table * dir = indextable(L, doc, v + 1, VALUE_TABLE);
+	v = tablevalues(dir);
+	size_t namesz = strlen(name);
+	int i;
+	for (i=0;i<dir->dict;i++) {
+		struct dsstring str;
+		getstring(doc, v, &str);
+		if (comparestring(&str, name, namesz) == 0) {
+			const struct table * t = indextable(L, doc, v + 1, dir->type[i]);
+			if (t->array < 4) {
+				luaL_error(L, "Invalid index %s", name);
+			}
+			v = tablevalues(t);
+			idx->doc = doc;
+			idx->keys = indextable(L, doc, v, t->type[0]);
+			idx->starts = indextable(L, doc, v + 1, t->type[1]);
+			idx->records = indextable(L, doc, v + 2, t->type[2]);
+			idx->slots = t->type[3] == VALUE_TABLE ? indextable(L, doc, v + 3, t->type[3]) : NULL;
+			if (idx->starts->array != idx->keys->array + 1) {
+				luaL_error(L, "Invalid index %s", name);
+			}
+			return;
+		}
+		v += 2;
+	}
+	luaL_error(L, "No index %s", name);
+}
+
+// 取参数 index 为键，返回 0 表示类型不能作为索引的键
+static int
+getkey(lua_State *L, int index, struct dskey *k) {
+	int isint;
+	lua_Integer i;
+	switch (lua_type(L, index)) {
+	case LUA_TNUMBER:
+		i = lua_tointegerx(L, index, &isint);
+		if (!isint || i < INT32_MIN || i > INT32_MAX)
+			return 0;
+		k->type = VALUE_INTEGER;
+		k->i = (int32_t)i;
+		return 1;
+	case LUA_TSTRING:
+		k->type = VALUE_STRING;
+		k->s = lua_tolstring(L, index, &k->sz);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// 比较 keys 中第 pos 个键（从 0 开始）和 k
+static int
+comparekey(const struct dsindex *idx, int pos, const struct dskey *k) {
+	int type = idx->keys->type[pos];
+	const uint32_t * v = tablevalues(idx->keys) + pos;
+	if (type != k->type) {
+		return type == VALUE_INTEGER ? -1 : 1;
+	}
+	if (type == VALUE_INTEGER) {
+		int32_t i = (int32_t)getuint32(v);
+		return i < k->i ? -1 : (i > k->i);
+	}
+	struct dsstring str;
+	getstring(idx->doc, v, &str);
+	return comparestring(&str, k->s, k->sz);
+}
+
+// 第一个不小于 k 的位置，upper 为真时是第一个大于 k 的位置
+static int
+searchkey(const struct dsindex *idx, const struct dskey *k, int upper) {
+	int begin = 0, end = idx->keys->array;
+	while (begin < end) {
+		int mid = (begin + end) / 2;
+		int c = comparekey(idx, mid, k);
+		if (c < 0 || (upper && c == 0)) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+	return begin;
+}
+
+// 和 dump.lua 中的 hashkey 一致
+static uint32_t
+hashkey(const struct dskey *k) {
+	if (k->type == VALUE_INTEGER) {
+		return (uint32_t)k->i * 2654435761u;
+	}
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i=0;i<k->sz;i++) {
+		h = (h ^ (uint8_t)k->s[i]) * 16777619u;
+	}
+	return h;
+}
+
+// 查找键的位置，没有返回 -1
+static int
+findkey(const struct dsindex *idx, const struct dskey *k) {
+	if (idx->slots) {
+		uint32_t mask = idx->slots->array - 1;
+		const uint32_t * slot = tablevalues(idx->slots);
+		uint32_t h = hashkey(k) & mask;
+		uint32_t i;
+		for (i=0;i<=mask;i++) {
+			uint32_t pos = getuint32(slot + h);
+			if (pos == 0 || pos > idx->keys->array)
+				return -1;
+			if (comparekey(idx, pos - 1, k) == 0)
+				return pos - 1;
+			h = (h + 1) & mask;
+		}
+		return -1;
+	}
+	int pos = searchkey(idx, k, 0);
+	if (pos < idx->keys->array && comparekey(idx, pos, k) == 0)
+		return pos;
+	return -1;
+}
+
+// 键的范围 [from, to) 对应的记录范围
+static void
+recordrange(lua_State *L, const struct dsindex *idx, int from, int to, uint32_t *begin, uint32_t *end) {
+	const uint32_t * starts = tablevalues(idx->starts);
+	*begin = getuint32(starts + from) - 1;
+	*end = getuint32(starts + to) - 1;
+	if (*begin > *end || *end > idx->records->array) {
+		luaL_error(L, "Invalid index");
+	}
+}
+
+static void
+pushrecord(lua_State *L, const struct dsindex *idx, uint32_t i) {
+	const uint32_t * v = tablevalues(idx->records) + i;
+	uint32_t index = getuint32(v);
+	if (idx->records->type[i] != VALUE_TABLE || index >= idx->doc->n) {
+		luaL_error(L, "Invalid index record %d", (int)index);
+	}
+	create_proxy(L, idx->doc, index);
+}
+
+// Lua 接口：lookup(t, name, key) 返回索引中键为 key 的所有记录
+static int
+llookup(lua_State *L) {
+	struct dsindex idx;
+	struct dskey k;
+	getindex(L, &idx);
+	if (!getkey(L, 3, &k))
+		return 0;
+	int pos = findkey(&idx, &k);
+	if (pos < 0)
+		return 0;
+	uint32_t begin, end, i;
+	recordrange(L, &idx, pos, pos + 1, &begin, &end);
+	luaL_checkstack(L, end - begin, NULL);
+	for (i=begin;i<end;i++) {
+		pushrecord(L, &idx, i);
+	}
+	return end - begin;
+}
+
+// Lua 接口：range(t, name, lo, hi) 返回键在 [lo, hi] 中的记录数组，lo 或 hi 为 nil 表示不限
+static int
+lrange(lua_State *L) {
+	struct dsindex idx;
+	struct dskey k;
+	getindex(L, &idx);
+	int from = 0, to = idx.keys->array;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_argcheck(L, getkey(L, 3, &k), 3, "Invalid key");
+		from = searchkey(&idx, &k, 0);
+	}
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_argcheck(L, getkey(L, 4, &k), 4, "Invalid key");
+		to = searchkey(&idx, &k, 1);
+	}
+	if (to < from)
+		to = from;
+	uint32_t begin, end, i;
+	recordrange(L, &idx, from, to, &begin, &end);
+	lua_createtable(L, end - begin, 0);
+	for (i=begin;i<end;i++) {
+		pushrecord(L, &idx, i);
+		lua_rawseti(L, -2, i - begin + 1);
+	}
+	return 1;
+}
+
 // 从数据复制到 Lua 表
 static void
 copyfromdata(lua_State *L) {
@@ -409,13 +855,164 @@ lstringpointer(lua_State *L) {
 	return 1;
 }
 
+// 文件头（小端）
+struct fileheader {
+	char magic[4];      // "SKDS"
+	uint32_t format;    // 格式版本
+	uint32_t id;        // 本文件的版本标识
+	uint32_t base;      // 增量构建时基于的版本标识，0 表示全量
+	uint32_t size;      // 文档长度
+};
+
+// Lua 接口：只读映射一个离线构建的文件，返回文档指针、长度、id、base
+// 同一台机器上的多个进程通过页缓存共享这份数据
+static int
+lmmap(lua_State *L) {
+	const char * filename = luaL_checkstring(L, 1);
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return luaL_error(L, "Can't open %s : %s", filename, strerror(errno));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return luaL_error(L, "Can't stat %s : %s", filename, strerror(errno));
+	}
+	if (st.st_size < FILE_HEADER) {
+		close(fd);
+		return luaL_error(L, "Invalid datasheet file %s", filename);
+	}
+	void * p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return luaL_error(L, "Can't mmap %s : %s", filename, strerror(errno));
+	}
+	const struct fileheader * h = (const struct fileheader *)p;
+	uint32_t size = getuint32(&h->size);
+	const struct document * doc = (const struct document *)((const char *)p + FILE_HEADER);
+	// 文件必须完整，文档头不能越界
+	if (memcmp(h->magic, FILE_MAGIC, 4) != 0 || getuint32(&h->format) != FILE_FORMAT ||
+		st.st_size != (off_t)size + FILE_HEADER || size < 8 ||
+		(getuint32(&doc->strtbl) & STRTBL_POOL) || (getuint32(&doc->strtbl) & STRTBL_OFFSET) >= size ||
+		getuint32(&doc->n) > (size - 8) / sizeof(uint32_t)) {
+		// 字符串池的 id 只在本进程有效，文件里不能用
+		munmap(p, st.st_size);
+		return luaL_error(L, "Invalid datasheet file %s", filename);
+	}
+	lua_pushlightuserdata(L, (void *)doc);
+	lua_pushinteger(L, size);
+	lua_pushinteger(L, getuint32(&h->id));
+	lua_pushinteger(L, getuint32(&h->base));
+	return 4;
+}
+
+// Lua 接口：解除 mmap 的映射，参数为 mmap 返回的指针和长度
+static int
+lunmap(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	char * doc = lua_touserdata(L, 1);
+	size_t size = (size_t)luaL_checkinteger(L, 2);
+	munmap(doc - FILE_HEADER, size + FILE_HEADER);
+	return 0;
+}
+
+// Lua 接口：把映射的文档复制成字符串，用于和内存中的版本做 diff
+static int
+ltostring(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	const char * doc = lua_touserdata(L, 1);
+	size_t size = (size_t)luaL_checkinteger(L, 2);
+	lua_pushlstring(L, doc, size);
+	return 1;
+}
+
+// Lua 接口：把字符串放进全局字符串池，返回 id
+static int
+lintern(lua_State *L) {
+	size_t sz;
+	const char * s = luaL_checklstring(L, 1, &sz);
+	int64_t id = pool_intern(s, sz);
+	if (id < 0)
+		return luaL_error(L, "datasheet string pool is full");
+	lua_pushinteger(L, id);
+	return 1;
+}
+
+// Lua 接口：取全局字符串池中的字符串
+static int
+lpoolstring(lua_State *L) {
+	lua_Integer id = luaL_checkinteger(L, 1);
+	spinlock_lock(&POOL.lock);
+	uint32_t n = POOL.n;
+	spinlock_unlock(&POOL.lock);
+	if (id < 0 || id >= n)
+		return luaL_error(L, "Invalid string id %d", (int)id);
+	const char * p = pool_get((uint32_t)id);
+	lua_pushlstring(L, p + sizeof(uint32_t), pool_len(p));
+	return 1;
+}
+
+// Lua 接口：全局字符串池的字符串数和字节数
+static int
+lpoolstat(lua_State *L) {
+	spinlock_lock(&POOL.lock);
+	uint32_t n = POOL.n;
+	size_t bytes = POOL.bytes;
+	spinlock_unlock(&POOL.lock);
+	lua_pushinteger(L, n);
+	lua_pushinteger(L, bytes);
+	return 2;
+}
+
+// Lua 接口：把文档中在多个表里出现的键（字段名）放进进程级的短字符串池，返回放入的个数
+static int
+lpoolkeys(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	const struct document * doc = lua_touserdata(L, 1);
+	lua_newtable(L);
+	int keys = lua_gettop(L);
+	int i, j;
+	for (i=0;i<doc->n;i++) {
+		const struct table * t = gettable(doc, i);
+		if (t == NULL)
+			continue;
+		const uint32_t * v = tablevalues(t) + t->array;
+		for (j=0;j<t->dict;j++, v+=2) {
+			if (t->type[t->array+j] == VALUE_INDEX)
+				continue;
+			struct dsstring str;
+			getstring(doc, v, &str);
+			if (str.psz + str.sz > 40)	// LUAI_MAXSHORTLEN
+				continue;
+			pushstring(L, &str);
+			lua_pushvalue(L, -1);
+			lua_Integer n = (lua_rawget(L, keys) == LUA_TNUMBER) ? lua_tointeger(L, -1) : 0;
+			lua_pop(L, 1);
+			lua_pushinteger(L, n + 1);
+			lua_rawset(L, keys);
+		}
+	}
+	int n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, keys) != 0) {
+		if (lua_tointeger(L, -1) > 1)
+			n += lua_poolstring(L, -2);
+		lua_pop(L, 1);
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
 // datasheet 核心模块初始化函数
 LUAMOD_API int
 luaopen_skynet_datasheet_core(lua_State *L) {
 	luaL_checkversion(L);
+	pthread_once(&POOL_ONCE, pool_init);
 	luaL_Reg l[] = {
 		{ "new", lnew },        // 创建新数据表
 		{ "update", lupdate },  // 更新数据表
+		{ "lookup", llookup },  // 按二级索引查找
+		{ "range", lrange },    // 按二级索引范围查找
 		{ NULL, NULL },
 	};
 
@@ -424,5 +1021,19 @@ luaopen_skynet_datasheet_core(lua_State *L) {
 	luaL_setfuncs(L, l, 1); // 设置函数（带元表作为 upvalue）
 	lua_pushcfunction(L, lstringpointer);
 	lua_setfield(L, -2, "stringpointer");  // 添加字符串指针函数
+	lua_pushcfunction(L, lmmap);
+	lua_setfield(L, -2, "mmap");
+	lua_pushcfunction(L, lunmap);
+	lua_setfield(L, -2, "unmap");
+	lua_pushcfunction(L, ltostring);
+	lua_setfield(L, -2, "tostring");
+	lua_pushcfunction(L, lintern);
+	lua_setfield(L, -2, "intern");
+	lua_pushcfunction(L, lpoolstring);
+	lua_setfield(L, -2, "poolstring");
+	lua_pushcfunction(L, lpoolstat);
+	lua_setfield(L, -2, "poolstat");
+	lua_pushcfunction(L, lpoolkeys);
+	lua_setfield(L, -2, "poolkeys");
 	return 1;
 }
@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "spinlock.h"
 
 #define METANAME "debugchannel"  // 元表名称
@@ -316,6 +317,412 @@ static int db_sethook (lua_State *L) {
   return 0;
 }
 
+/*
+	断点钩子：只在有断点的函数里打开行钩子。
+	call/return 事件时查函数的断点集（按 source 和 linedefined 缓存），有断点才加上 LUA_MASKLINE，
+	行事件只比较断点行号，条件 "name op value" 也在 C 里求值，命中之后才调用 Lua 的回调。
+ */
+
+#define MAX_BREAKPOINT 64	// 断点集用 uint64_t 表示
+#define BREAK_CACHE 256
+#define BREAK_NAME 32
+#define BREAK_VALUE 64
+#define BREAK_SOURCE 128
+
+#define COND_NONE 0
+#define COND_EQ 1
+#define COND_NE 2
+#define COND_LT 3
+#define COND_LE 4
+#define COND_GT 5
+#define COND_GE 6
+
+struct breakpoint {
+	int line;
+	int op;                     // COND_NONE 为无条件断点
+	int vtype;                  // 常量的类型 LUA_TNUMBER/LUA_TSTRING/LUA_TBOOLEAN/LUA_TNIL
+	lua_Number number;          // 数字或者 boolean
+	char name[BREAK_NAME];      // 条件中的变量名（局部变量或者 upvalue）
+	char value[BREAK_VALUE];    // 字符串常量
+	char source[BREAK_SOURCE];  // 文件名，匹配 chunkname 的结尾
+	char cond[BREAK_SOURCE];    // 条件原文，只用于列出断点
+};
+
+// 函数的断点集缓存
+struct breakcache {
+	const char *source;         // NULL 为空位
+	int linedefined;
+	int lastlinedefined;
+	uint64_t mask;
+};
+
+struct breakstate {
+	int n;
+	struct breakpoint bp[MAX_BREAKPOINT];
+	struct breakcache cache[BREAK_CACHE];
+};
+
+static const int BREAKKEY = 0;   // 注册表中的 breakstate
+static const int BREAKFUNC = 0;  // 注册表中命中断点时的 Lua 回调
+
+static void breakf (lua_State *L, lua_Debug *ar);
+
+static struct breakstate *
+break_state(lua_State *L) {
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &BREAKKEY);
+	struct breakstate *B = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return B;
+}
+
+static struct breakstate *
+break_newstate(lua_State *L) {
+	struct breakstate *B = break_state(L);
+	if (B == NULL) {
+		B = lua_newuserdatauv(L, sizeof(*B), 0);
+		memset(B, 0, sizeof(*B));
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &BREAKKEY);
+	}
+	return B;
+}
+
+// chunkname 是否以 name 结尾（在路径分隔处）
+static int
+break_match(const char *chunkname, const char *name) {
+	if (chunkname[0] == '@' || chunkname[0] == '=')
+		++chunkname;
+	size_t sz = strlen(chunkname);
+	size_t n = strlen(name);
+	if (n > sz || memcmp(chunkname + sz - n, name, n) != 0)
+		return 0;
+	return n == sz || chunkname[sz - n - 1] == '/';
+}
+
+// ar 需要先 lua_getinfo "S"
+static uint64_t
+break_lookup(struct breakstate *B, lua_Debug *ar) {
+	if (ar->what[0] == 'C')
+		return 0;
+	uintptr_t h = ((uintptr_t)ar->source >> 3) ^ ((uintptr_t)ar->linedefined * 0x9e3779b1u);
+	struct breakcache *c = &B->cache[h % BREAK_CACHE];
+	if (c->source == ar->source && c->linedefined == ar->linedefined && c->lastlinedefined == ar->lastlinedefined)
+		return c->mask;
+	int main = ar->what[0] == 'm';
+	uint64_t mask = 0;
+	int i;
+	for (i=0;i<B->n;i++) {
+		struct breakpoint *bp = &B->bp[i];
+		if ((main || (bp->line >= ar->linedefined && bp->line <= ar->lastlinedefined))
+			&& break_match(ar->source, bp->source)) {
+			mask |= (uint64_t)1 << i;
+		}
+	}
+	c->source = ar->source;
+	c->linedefined = ar->linedefined;
+	c->lastlinedefined = ar->lastlinedefined;
+	c->mask = mask;
+	return mask;
+}
+
+static int
+break_compare(lua_State *L, int idx, struct breakpoint *bp) {
+	int t = lua_type(L, idx);
+	int c = 2;	// 2 : 不可比较
+	if (t == bp->vtype) {
+		switch (t) {
+		case LUA_TNUMBER: {
+			lua_Number v = lua_tonumber(L, idx);
+			c = v < bp->number ? -1 : (v > bp->number ? 1 : 0);
+			break;
+		}
+		case LUA_TSTRING: {
+			int r = strcmp(lua_tostring(L, idx), bp->value);
+			c = r < 0 ? -1 : (r > 0 ? 1 : 0);
+			break;
+		}
+		case LUA_TBOOLEAN:
+			c = lua_toboolean(L, idx) == (int)bp->number ? 0 : 2;
+			break;
+		case LUA_TNIL:
+			c = 0;
+			break;
+		}
+	}
+	switch (bp->op) {
+	case COND_EQ: return c == 0;
+	case COND_NE: return c != 0;
+	case COND_LT: return c == -1;
+	case COND_LE: return c == -1 || c == 0;
+	case COND_GT: return c == 1;
+	case COND_GE: return c == 0 || c == 1;
+	}
+	return 0;
+}
+
+// 先找局部变量（同名的取最后一个），再找 upvalue，找不到条件不成立
+static int
+break_cond(lua_State *L, lua_Debug *ar, struct breakpoint *bp) {
+	if (bp->op == COND_NONE)
+		return 1;
+	const char *name;
+	int found = 0;
+	int i;
+	for (i=1; (name = lua_getlocal(L, ar, i)) != NULL; i++) {
+		if (strcmp(name, bp->name) == 0) {
+			if (found) {
+				lua_replace(L, -2);
+			}
+			found = 1;
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	if (!found) {
+		lua_getinfo(L, "f", ar);
+		for (i=1; (name = lua_getupvalue(L, -1, i)) != NULL; i++) {
+			if (strcmp(name, bp->name) == 0) {
+				found = 1;
+				break;
+			}
+			lua_pop(L, 1);
+		}
+		lua_remove(L, found ? -2 : -1);
+		if (!found)
+			return 0;
+	}
+	int r = break_compare(L, -1, bp);
+	lua_pop(L, 1);
+	return r;
+}
+
+static void
+break_setmask(lua_State *L, int line) {
+	int mask = LUA_MASKCALL | LUA_MASKRET | (line ? LUA_MASKLINE : 0);
+	if (lua_gethookmask(L) != mask) {
+		lua_sethook(L, breakf, mask, 0);
+	}
+}
+
+// 只在行事件中调用，回调返回 true 时让出协程（主线程和消息回调的线程不能让出，忽略断点）
+static void
+break_hit(lua_State *L, lua_Debug *ar) {
+	if (!lua_isyieldable(L))
+		return;
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &BREAKFUNC) != LUA_TFUNCTION) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pushstring(L, "break");
+	lua_pushinteger(L, ar->currentline);
+	lua_call(L, 2, 1);
+	int yield = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	if (yield) {
+		lua_yield(L, 0);
+	}
+}
+
+static void
+breakf (lua_State *L, lua_Debug *ar) {
+	struct breakstate *B = break_state(L);
+	if (B == NULL || B->n == 0) {
+		// 断点都清除了
+		lua_sethook(L, NULL, 0, 0);
+		return;
+	}
+	lua_Debug caller;
+	switch (ar->event) {
+	case LUA_HOOKCALL:
+	case LUA_HOOKTAILCALL:
+		lua_getinfo(L, "S", ar);
+		break_setmask(L, break_lookup(B, ar) != 0);
+		break;
+	case LUA_HOOKRET:
+		// 回到调用者
+		if (lua_getstack(L, 1, &caller)) {
+			lua_getinfo(L, "S", &caller);
+			break_setmask(L, break_lookup(B, &caller) != 0);
+		} else {
+			break_setmask(L, 0);
+		}
+		break;
+	case LUA_HOOKLINE: {
+		lua_getinfo(L, "S", ar);
+		uint64_t mask = break_lookup(B, ar);
+		if (mask == 0) {
+			break_setmask(L, 0);
+			return;
+		}
+		int i;
+		for (i=0;i<B->n;i++) {
+			struct breakpoint *bp = &B->bp[i];
+			if (((mask >> i) & 1) && bp->line == ar->currentline && break_cond(L, ar, bp)) {
+				break_hit(L, ar);
+				return;
+			}
+		}
+		break;
+	}
+	}
+}
+
+static const char *
+skipspace(const char *s) {
+	while (*s == ' ' || *s == '\t')
+		++s;
+	return s;
+}
+
+// name op value , value 可以是数字，字符串（用引号），true，false，nil
+static void
+break_parsecond(lua_State *L, struct breakpoint *bp, const char *cond) {
+	const char *p = skipspace(cond);
+	size_t n = 0;
+	while ((p[n] >= 'a' && p[n] <= 'z') || (p[n] >= 'A' && p[n] <= 'Z') || p[n] == '_'
+		|| (n > 0 && p[n] >= '0' && p[n] <= '9')) {
+		++n;
+	}
+	if (n == 0 || n >= BREAK_NAME)
+		luaL_error(L, "Invalid condition : %s", cond);
+	memcpy(bp->name, p, n);
+	bp->name[n] = '\0';
+	p = skipspace(p + n);
+	static const struct { const char *op; int cond; } ops[] = {
+		{ "==", COND_EQ }, { "~=", COND_NE }, { "!=", COND_NE },
+		{ "<=", COND_LE }, { ">=", COND_GE }, { "<", COND_LT }, { ">", COND_GT },
+	};
+	int i;
+	for (i=0;i<(int)(sizeof(ops)/sizeof(ops[0]));i++) {
+		size_t sz = strlen(ops[i].op);
+		if (memcmp(p, ops[i].op, sz) == 0) {
+			bp->op = ops[i].cond;
+			p = skipspace(p + sz);
+			break;
+		}
+	}
+	if (bp->op == COND_NONE)
+		luaL_error(L, "Invalid condition : %s", cond);
+	size_t sz = strlen(p);
+	while (sz > 0 && (p[sz-1] == ' ' || p[sz-1] == '\t'))
+		--sz;
+	if (sz >= 2 && (p[0] == '"' || p[0] == '\'') && p[sz-1] == p[0]) {
+		if (sz - 2 >= BREAK_VALUE)
+			luaL_error(L, "Invalid condition : %s", cond);
+		bp->vtype = LUA_TSTRING;
+		memcpy(bp->value, p + 1, sz - 2);
+		bp->value[sz - 2] = '\0';
+	} else if (sz == 4 && memcmp(p, "true", 4) == 0) {
+		bp->vtype = LUA_TBOOLEAN;
+		bp->number = 1;
+	} else if (sz == 5 && memcmp(p, "false", 5) == 0) {
+		bp->vtype = LUA_TBOOLEAN;
+		bp->number = 0;
+	} else if (sz == 3 && memcmp(p, "nil", 3) == 0) {
+		bp->vtype = LUA_TNIL;
+	} else {
+		lua_pushlstring(L, p, sz);
+		if (sz == 0 || lua_stringtonumber(L, lua_tostring(L, -1)) == 0)
+			luaL_error(L, "Invalid condition : %s", cond);
+		bp->vtype = LUA_TNUMBER;
+		bp->number = lua_tonumber(L, -1);
+		lua_pop(L, 2);
+	}
+	if (bp->vtype != LUA_TNUMBER && bp->vtype != LUA_TSTRING && bp->op != COND_EQ && bp->op != COND_NE)
+		luaL_error(L, "Invalid condition : %s", cond);
+}
+
+// breakpoint(source, line [, cond])  已有的断点会被替换
+static int
+lbreakpoint(lua_State *L) {
+	size_t sz;
+	const char *source = luaL_checklstring(L, 1, &sz);
+	int line = (int)luaL_checkinteger(L, 2);
+	const char *cond = luaL_optstring(L, 3, NULL);
+	luaL_argcheck(L, sz > 0 && sz < BREAK_SOURCE, 1, "Invalid source");
+	struct breakpoint tmp;
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.line = line;
+	memcpy(tmp.source, source, sz + 1);
+	if (cond) {
+		break_parsecond(L, &tmp, cond);
+		strncpy(tmp.cond, cond, BREAK_SOURCE - 1);
+	}
+	struct breakstate *B = break_newstate(L);
+	int i;
+	for (i=0;i<B->n;i++) {
+		if (B->bp[i].line == line && strcmp(B->bp[i].source, source) == 0)
+			break;
+	}
+	if (i == B->n) {
+		if (B->n >= MAX_BREAKPOINT)
+			return luaL_error(L, "Too many breakpoints");
+		++B->n;
+	}
+	B->bp[i] = tmp;
+	memset(B->cache, 0, sizeof(B->cache));
+	lua_pushinteger(L, i + 1);
+	return 1;
+}
+
+// clearbreak([source [, line]])  返回清除的断点数
+static int
+lclearbreak(lua_State *L) {
+	const char *source = luaL_optstring(L, 1, NULL);
+	int line = (int)luaL_optinteger(L, 2, 0);
+	struct breakstate *B = break_state(L);
+	int n = 0;
+	if (B) {
+		int i = 0;
+		while (i < B->n) {
+			struct breakpoint *bp = &B->bp[i];
+			if ((source == NULL || strcmp(bp->source, source) == 0) && (line == 0 || bp->line == line)) {
+				B->bp[i] = B->bp[--B->n];
+				++n;
+			} else {
+				++i;
+			}
+		}
+		memset(B->cache, 0, sizeof(B->cache));
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+// 返回断点列表 { "source:line [cond]", ... }
+static int
+lbreakpoints(lua_State *L) {
+	struct breakstate *B = break_state(L);
+	int n = B ? B->n : 0;
+	lua_createtable(L, n, 0);
+	int i;
+	for (i=0;i<n;i++) {
+		struct breakpoint *bp = &B->bp[i];
+		if (bp->op == COND_NONE) {
+			lua_pushfstring(L, "%s:%d", bp->source, bp->line);
+		} else {
+			lua_pushfstring(L, "%s:%d if %s", bp->source, bp->line, bp->cond);
+		}
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
+// breakhook([thread,] func)  在线程上打开断点钩子，func(event, line) 在命中断点时调用，返回 true 让出协程
+static int
+lbreakhook(lua_State *L) {
+	int arg;
+	lua_State *L1 = getthread(L, &arg);
+	luaL_checktype(L, arg+1, LUA_TFUNCTION);
+	lua_pushvalue(L, arg+1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &BREAKFUNC);
+	struct breakstate *B = break_state(L);
+	if (B && B->n > 0) {
+		// 不知道线程当前所在的函数，先打开行钩子，第一个行事件会修正
+		lua_sethook(L1, breakf, LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE, 0);
+	}
+	return 0;
+}
+
 // debugchannel 模块初始化函数
 LUAMOD_API int
 luaopen_skynet_debugchannel(lua_State *L) {
@@ -326,6 +733,10 @@ luaopen_skynet_debugchannel(lua_State *L) {
 		                        // 用于读取
 		{ "release", lrelease },    // 释放通道
 		{ "sethook", db_sethook },  // 设置调试钩子
+		{ "breakpoint", lbreakpoint },
+		{ "clearbreak", lclearbreak },
+		{ "breakpoints", lbreakpoints },
+		{ "breakhook", lbreakhook },
 		{ NULL, NULL },
 	};
 	luaL_checkversion(L);
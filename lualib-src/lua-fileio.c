@@ -0,0 +1,482 @@
+#define LUA_LIB
+
+#include "skynet.h"
+#include "skynet_malloc.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/*
+	异步文件读写，见 lualib/skynet/fileio.lua
+
+	整个进程共用一组 I/O 线程，服务把请求放进队列后挂起调用的协程，
+	I/O 线程做完后把结果作为 PTYPE_RESPONSE 发回请求的服务，唤醒等待这个 session 的协程，
+	磁盘的延迟不会占住 worker 线程。
+ */
+
+#define FILEIO_MAX_THREAD 64
+
+#define OP_READ 0
+#define OP_WRITE 1
+#define OP_FSYNC 2
+#define OP_STAT 3
+#define OP_LIST 4
+
+struct request {
+	struct request * next;
+	int op;
+	uint32_t handle;
+	int session;
+	int append;         // OP_WRITE : 追加还是覆盖
+	int sync;           // OP_WRITE : 写完后 fsync
+	int64_t offset;     // OP_READ : 从哪里开始读
+	int64_t size;       // OP_READ : 最多读多少，小于 0 读到文件尾
+	size_t sz;          // OP_WRITE : data 的长度
+	char * data;
+	char path[1];
+};
+
+/*
+	应答消息 : struct result 后面跟着内容
+		OP_READ : 读到的数据
+		OP_WRITE : 无
+		OP_STAT : struct result_stat
+		OP_LIST : 以 '\0' 结尾的文件名，一个接一个
+	失败时 err 是 errno
+ */
+struct result {
+	int op;
+	int err;
+};
+
+struct result_stat {
+	int64_t size;
+	int64_t mtime;
+	int mode;
+};
+
+struct fileio {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct request * head;
+	struct request * tail;
+	int thread;
+	int queue;          // 队列中的请求数
+};
+
+static struct fileio F = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	NULL,
+	NULL,
+	0,
+	0,
+};
+
+static void
+respond(struct request *req, struct result *r, size_t sz) {
+	// 服务已经退出时 skynet_send 会释放 r
+	skynet_send(NULL, req->handle, req->handle, PTYPE_RESPONSE | PTYPE_TAG_DONTCOPY, req->session, r, sz);
+}
+
+static struct result *
+new_result(int op, int err, size_t extra) {
+	struct result * r = skynet_malloc(sizeof(*r) + extra);
+	r->op = op;
+	r->err = err;
+	return r;
+}
+
+static void
+respond_error(struct request *req, int err) {
+	respond(req, new_result(req->op, err, 0), sizeof(struct result));
+}
+
+static void
+do_read(struct request *req) {
+	int fd = open(req->path, O_RDONLY);
+	if (fd < 0) {
+		respond_error(req, errno);
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		close(fd);
+		respond_error(req, err);
+		return;
+	}
+	int64_t size = st.st_size - req->offset;
+	if (size < 0)
+		size = 0;
+	if (req->size >= 0 && req->size < size)
+		size = req->size;
+	struct result * r = new_result(OP_READ, 0, size);
+	char * buffer = (char *)(r + 1);
+	int64_t n = 0;
+	while (n < size) {
+		ssize_t rd = pread(fd, buffer + n, size - n, req->offset + n);
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			int err = errno;
+			close(fd);
+			skynet_free(r);
+			respond_error(req, err);
+			return;
+		}
+		if (rd == 0)
+			break;  // 文件在读的时候变短了
+		n += rd;
+	}
+	close(fd);
+	respond(req, r, sizeof(*r) + n);
+}
+
+static void
+do_write(struct request *req) {
+	int flags = O_WRONLY | O_CREAT | (req->append ? O_APPEND : O_TRUNC);
+	int fd = open(req->path, flags, 0644);
+	if (fd < 0) {
+		respond_error(req, errno);
+		return;
+	}
+	size_t n = 0;
+	while (n < req->sz) {
+		ssize_t wt = write(fd, req->data + n, req->sz - n);
+		if (wt < 0) {
+			if (errno == EINTR)
+				continue;
+			int err = errno;
+			close(fd);
+			respond_error(req, err);
+			return;
+		}
+		n += wt;
+	}
+	if (req->sync && fsync(fd) != 0) {
+		int err = errno;
+		close(fd);
+		respond_error(req, err);
+		return;
+	}
+	if (close(fd) != 0) {
+		respond_error(req, errno);
+		return;
+	}
+	respond_error(req, 0);
+}
+
+static void
+do_fsync(struct request *req) {
+	int fd = open(req->path, O_RDONLY);
+	if (fd < 0) {
+		respond_error(req, errno);
+		return;
+	}
+	int err = fsync(fd) == 0 ? 0 : errno;
+	close(fd);
+	respond_error(req, err);
+}
+
+static void
+do_stat(struct request *req) {
+	struct stat st;
+	if (stat(req->path, &st) != 0) {
+		respond_error(req, errno);
+		return;
+	}
+	struct result * r = new_result(OP_STAT, 0, sizeof(struct result_stat));
+	struct result_stat * s = (struct result_stat *)(r + 1);
+	s->size = st.st_size;
+	s->mtime = st.st_mtime;
+	s->mode = st.st_mode;
+	respond(req, r, sizeof(*r) + sizeof(*s));
+}
+
+static void
+do_list(struct request *req) {
+	DIR * dir = opendir(req->path);
+	if (dir == NULL) {
+		respond_error(req, errno);
+		return;
+	}
+	size_t cap = 1024;
+	size_t sz = 0;
+	struct result * r = new_result(OP_LIST, 0, cap);
+	struct dirent * ent;
+	while ((ent = readdir(dir)) != NULL) {
+		const char * name = ent->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		size_t len = strlen(name) + 1;
+		if (sz + len > cap) {
+			while (sz + len > cap)
+				cap *= 2;
+			r = skynet_realloc(r, sizeof(*r) + cap);
+		}
+		memcpy((char *)(r + 1) + sz, name, len);
+		sz += len;
+	}
+	closedir(dir);
+	respond(req, r, sizeof(*r) + sz);
+}
+
+static void
+request_free(struct request *req) {
+	skynet_free(req->data);
+	skynet_free(req);
+}
+
+static void *
+fileio_thread(void *ud) {
+	struct fileio * f = ud;
+	for (;;) {
+		pthread_mutex_lock(&f->lock);
+		while (f->head == NULL)
+			pthread_cond_wait(&f->cond, &f->lock);
+		struct request * req = f->head;
+		f->head = req->next;
+		if (f->head == NULL)
+			f->tail = NULL;
+		--f->queue;
+		pthread_mutex_unlock(&f->lock);
+
+		switch (req->op) {
+		case OP_READ: do_read(req); break;
+		case OP_WRITE: do_write(req); break;
+		case OP_FSYNC: do_fsync(req); break;
+		case OP_STAT: do_stat(req); break;
+		case OP_LIST: do_list(req); break;
+		}
+		request_free(req);
+	}
+	return NULL;
+}
+
+static void
+push_request(struct fileio *f, struct request *req) {
+	req->next = NULL;
+	pthread_mutex_lock(&f->lock);
+	if (f->tail) {
+		f->tail->next = req;
+	} else {
+		f->head = req;
+	}
+	f->tail = req;
+	++f->queue;
+	pthread_cond_signal(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+	integer n
+
+	启动 I/O 线程，已经启动的线程数不少于 n 时什么也不做，返回线程数
+ */
+static int
+lstart(lua_State *L) {
+	int n = (int)luaL_optinteger(L, 1, 2);
+	if (n > FILEIO_MAX_THREAD)
+		n = FILEIO_MAX_THREAD;
+	struct fileio * f = &F;
+	pthread_mutex_lock(&f->lock);
+	while (f->thread < n) {
+		pthread_t pid;
+		if (pthread_create(&pid, NULL, fileio_thread, f) != 0)
+			break;
+		pthread_detach(pid);
+		++f->thread;
+	}
+	n = f->thread;
+	pthread_mutex_unlock(&f->lock);
+	if (n == 0)
+		return luaL_error(L, "Can't create fileio thread");
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+static struct request *
+new_request(lua_State *L, int op) {
+	uint32_t handle = (uint32_t)luaL_checkinteger(L, 1);
+	int session = (int)luaL_checkinteger(L, 2);
+	size_t len = 0;
+	const char * path = luaL_checklstring(L, 3, &len);
+	struct request * req = skynet_malloc(sizeof(*req) + len);
+	memset(req, 0, sizeof(*req));
+	memcpy(req->path, path, len + 1);
+	req->op = op;
+	req->handle = handle;
+	req->session = session;
+	req->size = -1;
+	return req;
+}
+
+/*
+	integer handle
+	integer session
+	string path
+	integer offset | nil
+	integer size | nil
+ */
+static int
+lread(lua_State *L) {
+	int64_t offset = luaL_optinteger(L, 4, 0);
+	int64_t size = luaL_optinteger(L, 5, -1);
+	luaL_argcheck(L, offset >= 0, 4, "need non-negative offset");
+	struct request * req = new_request(L, OP_READ);
+	req->offset = offset;
+	req->size = size;
+	push_request(&F, req);
+	return 0;
+}
+
+/*
+	integer handle
+	integer session
+	string path
+	string data
+	boolean append
+	boolean sync
+ */
+static int
+lwrite(lua_State *L) {
+	size_t sz = 0;
+	const char * data = luaL_checklstring(L, 4, &sz);
+	struct request * req = new_request(L, OP_WRITE);
+	req->append = lua_toboolean(L, 5);
+	req->sync = lua_toboolean(L, 6);
+	req->sz = sz;
+	if (sz > 0) {
+		req->data = skynet_malloc(sz);
+		memcpy(req->data, data, sz);
+	}
+	push_request(&F, req);
+	return 0;
+}
+
+static int
+lfsync(lua_State *L) {
+	push_request(&F, new_request(L, OP_FSYNC));
+	return 0;
+}
+
+static int
+lfilestat(lua_State *L) {
+	push_request(&F, new_request(L, OP_STAT));
+	return 0;
+}
+
+static int
+llist(lua_State *L) {
+	push_request(&F, new_request(L, OP_LIST));
+	return 0;
+}
+
+/*
+	lightuserdata msg
+	integer sz
+
+	解开应答，消息由框架释放
+	return nil, errmsg | result
+		OP_READ : string
+		OP_WRITE, OP_FSYNC : true
+		OP_STAT : { size, mtime, type = "file" | "directory" | "other" }
+		OP_LIST : { name, ... }
+ */
+static int
+lresult(lua_State *L) {
+	const struct result * r = lua_touserdata(L, 1);
+	size_t sz = (size_t)luaL_checkinteger(L, 2);
+	if (r == NULL || sz < sizeof(*r))
+		return luaL_error(L, "Invalid fileio result");
+	if (r->err) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(r->err));
+		return 2;
+	}
+	const char * data = (const char *)(r + 1);
+	sz -= sizeof(*r);
+	switch (r->op) {
+	case OP_READ:
+		lua_pushlstring(L, data, sz);
+		break;
+	case OP_STAT: {
+		struct result_stat s;
+		memcpy(&s, data, sizeof(s));
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, s.size);
+		lua_setfield(L, -2, "size");
+		lua_pushinteger(L, s.mtime);
+		lua_setfield(L, -2, "mtime");
+		if (S_ISREG(s.mode)) {
+			lua_pushliteral(L, "file");
+		} else if (S_ISDIR(s.mode)) {
+			lua_pushliteral(L, "directory");
+		} else {
+			lua_pushliteral(L, "other");
+		}
+		lua_setfield(L, -2, "type");
+		break;
+	}
+	case OP_LIST: {
+		lua_newtable(L);
+		size_t i = 0;
+		int n = 0;
+		while (i < sz) {
+			size_t len = strlen(data + i);
+			lua_pushlstring(L, data + i, len);
+			lua_rawseti(L, -2, ++n);
+			i += len + 1;
+		}
+		break;
+	}
+	default:
+		lua_pushboolean(L, 1);
+		break;
+	}
+	return 1;
+}
+
+// 线程数和排队的请求数
+static int
+linfo(lua_State *L) {
+	struct fileio * f = &F;
+	pthread_mutex_lock(&f->lock);
+	int thread = f->thread;
+	int queue = f->queue;
+	pthread_mutex_unlock(&f->lock);
+	lua_pushinteger(L, thread);
+	lua_pushinteger(L, queue);
+	return 2;
+}
+
+LUAMOD_API int
+luaopen_skynet_fileio_core(lua_State *L) {
+	luaL_checkversion(L);
+
+	luaL_Reg l[] = {
+		{ "start", lstart },
+		{ "read", lread },
+		{ "write", lwrite },
+		{ "fsync", lfsync },
+		{ "stat", lfilestat },
+		{ "list", llist },
+		{ "result", lresult },
+		{ "info", linfo },
+		{ NULL, NULL },
+	};
+
+	luaL_newlib(L,l);
+
+	return 1;
+}
@@ -0,0 +1,391 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+	HTTP/1.1 请求和回应的解析，见 http/httpd.lua 和 http/httpc.lua
+
+	都是增量的：传入已经收到的字节和起始位置，数据不完整时返回 nil ，
+	调用者收到更多数据后从同一位置重新解析。
+ */
+
+#define HEADER_LIMIT 8192
+#define NAME_LIMIT 256
+#define CHUNK_LINE_LIMIT 128
+
+#define PARSE_OK 0
+#define PARSE_MORE 1
+#define PARSE_BAD 400
+#define PARSE_TOOLARGE 413
+
+// 找到一行，行尾的 \r\n 或 \n 不算在 len 里。不完整时返回 NULL
+static const char *
+readline(const char *p, const char *end, size_t *len) {
+	const char * nl = memchr(p, '\n', end - p);
+	if (nl == NULL)
+		return NULL;
+	size_t n = nl - p;
+	if (n > 0 && p[n-1] == '\r')
+		--n;
+	*len = n;
+	return nl + 1;
+}
+
+static int
+isspace_(char c) {
+	return c == ' ' || c == '\t';
+}
+
+static size_t
+getpos(lua_State *L, int index, size_t sz) {
+	lua_Integer pos = luaL_optinteger(L, index, 1);
+	luaL_argcheck(L, pos >= 1 && (size_t)pos <= sz + 1, index, "position out of range");
+	return (size_t)pos - 1;
+}
+
+static void
+addheader(lua_State *L, int header, const char *name, size_t namesz, const char *value, size_t valuesz) {
+	lua_pushlstring(L, name, namesz);
+	lua_pushvalue(L, -1);
+	switch (lua_rawget(L, header)) {
+	case LUA_TNIL:
+		lua_pop(L, 1);
+		lua_pushlstring(L, value, valuesz);
+		lua_rawset(L, header);
+		break;
+	case LUA_TTABLE:
+		// 重复的字段收集成数组
+		lua_pushlstring(L, value, valuesz);
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_pop(L, 2);
+		break;
+	default:
+		lua_createtable(L, 2, 0);
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, 1);
+		lua_pushlstring(L, value, valuesz);
+		lua_rawseti(L, -2, 2);
+		lua_rawset(L, header);
+		break;
+	}
+}
+
+// 以 tab 开头的续行接在上一个字段后面
+static int
+foldheader(lua_State *L, int header, const char *name, size_t namesz, const char *value, size_t valuesz) {
+	lua_pushlstring(L, name, namesz);
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, header) != LUA_TSTRING) {
+		lua_pop(L, 2);
+		return PARSE_BAD;
+	}
+	lua_pushlstring(L, value, valuesz);
+	lua_concat(L, 2);
+	lua_rawset(L, header);
+	return PARSE_OK;
+}
+
+/*
+	解析字段直到空行，字段名转成小写放进 header 表。
+	*ptr 移到空行之后
+ */
+static int
+parseheader(lua_State *L, int header, const char **ptr, const char *end, const char *limit) {
+	const char * p = *ptr;
+	char name[NAME_LIMIT];
+	size_t namesz = 0;
+	for (;;) {
+		size_t len;
+		const char * next = readline(p, end, &len);
+		if (next == NULL) {
+			return (end >= limit) ? PARSE_TOOLARGE : PARSE_MORE;
+		}
+		if (next > limit)
+			return PARSE_TOOLARGE;
+		if (len == 0) {
+			*ptr = next;
+			return PARSE_OK;
+		}
+		if (p[0] == '\t') {
+			if (namesz == 0 || foldheader(L, header, name, namesz, p + 1, len - 1) != PARSE_OK)
+				return PARSE_BAD;
+		} else {
+			const char * colon = memchr(p, ':', len);
+			if (colon == NULL || colon == p || colon - p >= NAME_LIMIT)
+				return PARSE_BAD;
+			namesz = colon - p;
+			size_t i;
+			for (i=0;i<namesz;i++) {
+				char c = p[i];
+				if (c >= 'A' && c <= 'Z')
+					c += 'a' - 'A';
+				name[i] = c;
+			}
+			const char * v = colon + 1;
+			const char * e = p + len;
+			while (v < e && isspace_(*v))
+				++v;
+			while (e > v && isspace_(e[-1]))
+				--e;
+			addheader(L, header, name, namesz, v, e - v);
+		}
+		p = next;
+	}
+}
+
+// 请求行 method SP url SP HTTP/x.y ，压入 method url version
+static int
+parserequestline(lua_State *L, const char *p, size_t len) {
+	const char * end = p + len;
+	const char * m = p;
+	while (p < end && ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z')))
+		++p;
+	if (p == m || p == end || !isspace_(*p))
+		return PARSE_BAD;
+	const char * mend = p;
+	while (p < end && isspace_(*p))
+		++p;
+	const char * url = p;
+	// 版本在最后一个空白之后
+	const char * v = end;
+	while (v > url && !isspace_(v[-1]))
+		--v;
+	if (v == url || end - v < 6 || memcmp(v, "HTTP/", 5) != 0)
+		return PARSE_BAD;
+	const char * uend = v;
+	while (uend > url && isspace_(uend[-1]))
+		--uend;
+	if (uend == url)
+		return PARSE_BAD;
+	char ver[16];
+	size_t versz = end - v - 5;
+	if (versz >= sizeof(ver))
+		return PARSE_BAD;
+	size_t i;
+	for (i=0;i<versz;i++) {
+		char c = v[5+i];
+		if (!((c >= '0' && c <= '9') || c == '.'))
+			return PARSE_BAD;
+		ver[i] = c;
+	}
+	ver[versz] = '\0';
+	lua_pushlstring(L, m, mend - m);
+	lua_pushlstring(L, url, uend - url);
+	if (lua_stringtonumber(L, ver) == 0)
+		return PARSE_BAD;
+	return PARSE_OK;
+}
+
+// 状态行 HTTP/x.y SP code [SP reason] ，压入 code version
+static int
+parsestatusline(lua_State *L, const char *p, size_t len) {
+	const char * end = p + len;
+	if (len < 12 || memcmp(p, "HTTP/", 5) != 0)
+		return PARSE_BAD;
+	const char * v = p + 5;
+	const char * vend = v;
+	while (vend < end && ((*vend >= '0' && *vend <= '9') || *vend == '.'))
+		++vend;
+	char ver[16];
+	size_t versz = vend - v;
+	if (versz == 0 || versz >= sizeof(ver) || vend == end || !isspace_(*vend))
+		return PARSE_BAD;
+	memcpy(ver, v, versz);
+	ver[versz] = '\0';
+	const char * c = vend;
+	while (c < end && isspace_(*c))
+		++c;
+	if (end - c < 3)
+		return PARSE_BAD;
+	int code = 0;
+	int i;
+	for (i=0;i<3;i++) {
+		if (c[i] < '0' || c[i] > '9')
+			return PARSE_BAD;
+		code = code * 10 + c[i] - '0';
+	}
+	if (end - c > 3 && !isspace_(c[3]))
+		return PARSE_BAD;
+	lua_pushinteger(L, code);
+	if (lua_stringtonumber(L, ver) == 0)
+		return PARSE_BAD;
+	return PARSE_OK;
+}
+
+static int
+failed(lua_State *L, int status) {
+	if (status == PARSE_MORE)
+		return 0;
+	lua_pushboolean(L, 0);
+	lua_pushinteger(L, status);
+	return 2;
+}
+
+/*
+	string buffer
+	integer pos
+	return nextpos, method, url, version, header
+		nil : 不完整
+		false, code : 格式错误 (400) 或者头部太长 (413)
+ */
+static int
+lrequest(lua_State *L) {
+	size_t sz;
+	const char * buf = luaL_checklstring(L, 1, &sz);
+	size_t pos = getpos(L, 2, sz);
+	const char * p = buf + pos;
+	const char * end = buf + sz;
+	const char * limit = p + HEADER_LIMIT;
+	size_t len;
+	const char * next;
+	// 忽略请求之前的空行
+	for (;;) {
+		next = readline(p, end, &len);
+		if (next == NULL)
+			return failed(L, (end - p) >= HEADER_LIMIT ? PARSE_TOOLARGE : PARSE_MORE);
+		if (len != 0)
+			break;
+		p = next;
+		limit = p + HEADER_LIMIT;
+	}
+	if (next > limit)
+		return failed(L, PARSE_TOOLARGE);
+	lua_settop(L, 2);
+	int status = parserequestline(L, p, len);
+	if (status != PARSE_OK)
+		return failed(L, status);
+	lua_newtable(L);
+	status = parseheader(L, lua_gettop(L), &next, end, limit);
+	if (status != PARSE_OK)
+		return failed(L, status);
+	lua_pushinteger(L, next - buf + 1);
+	lua_replace(L, 2);
+	return 5;
+}
+
+/*
+	string buffer
+	integer pos
+	return nextpos, code, version, header
+		nil : 不完整
+		false, code : 同 request
+ */
+static int
+lresponse(lua_State *L) {
+	size_t sz;
+	const char * buf = luaL_checklstring(L, 1, &sz);
+	size_t pos = getpos(L, 2, sz);
+	const char * p = buf + pos;
+	const char * end = buf + sz;
+	const char * limit = p + HEADER_LIMIT;
+	size_t len;
+	const char * next = readline(p, end, &len);
+	if (next == NULL)
+		return failed(L, (end - p) >= HEADER_LIMIT ? PARSE_TOOLARGE : PARSE_MORE);
+	if (next > limit)
+		return failed(L, PARSE_TOOLARGE);
+	lua_settop(L, 2);
+	int status = parsestatusline(L, p, len);
+	if (status != PARSE_OK)
+		return failed(L, status);
+	lua_newtable(L);
+	status = parseheader(L, lua_gettop(L), &next, end, limit);
+	if (status != PARSE_OK)
+		return failed(L, status);
+	lua_pushinteger(L, next - buf + 1);
+	lua_replace(L, 2);
+	return 4;
+}
+
+/*
+	string buffer
+	integer pos
+	table header
+	return nextpos ，用于 chunked 编码后的 trailer
+		nil : 不完整
+		false, code : 同 request
+ */
+static int
+lheader(lua_State *L) {
+	size_t sz;
+	const char * buf = luaL_checklstring(L, 1, &sz);
+	size_t pos = getpos(L, 2, sz);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	const char * p = buf + pos;
+	int status = parseheader(L, 3, &p, buf + sz, buf + pos + HEADER_LIMIT);
+	if (status != PARSE_OK)
+		return failed(L, status);
+	lua_pushinteger(L, p - buf + 1);
+	return 1;
+}
+
+/*
+	string buffer
+	integer pos
+	return size, nextpos ：chunk 的长度行，忽略 chunk-ext
+		nil : 不完整
+		false : 格式错误
+ */
+static int
+lchunk(lua_State *L) {
+	size_t sz;
+	const char * buf = luaL_checklstring(L, 1, &sz);
+	size_t pos = getpos(L, 2, sz);
+	const char * p = buf + pos;
+	const char * end = buf + sz;
+	size_t len;
+	const char * next = readline(p, end, &len);
+	if (next == NULL) {
+		// 防止对方发送很长的一行
+		if (end - p > CHUNK_LINE_LIMIT) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		return 0;
+	}
+	if (len > CHUNK_LINE_LIMIT) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_Integer size = 0;
+	size_t i;
+	for (i=0;i<len;i++) {
+		char c = p[i];
+		int d;
+		if (c >= '0' && c <= '9')
+			d = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			d = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			d = c - 'A' + 10;
+		else
+			break;
+		if (i >= 15) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		size = size * 16 + d;
+	}
+	if (i == 0 || (i < len && p[i] != ';' && !isspace_(p[i]))) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushinteger(L, size);
+	lua_pushinteger(L, next - buf + 1);
+	return 2;
+}
+
+LUAMOD_API int
+luaopen_skynet_http_core(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "request", lrequest },
+		{ "response", lresponse },
+		{ "header", lheader },
+		{ "chunk", lchunk },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
@@ -0,0 +1,811 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+	HTTP/2 的帧和 HPACK 头部压缩 (RFC 7541) ，见 http/http2.lua
+ */
+
+#define FRAME_HEADER 9
+#define DEFAULT_FRAME_SIZE 16384
+#define MAX_FRAME_SIZE 16777215
+
+#define STATIC_TABLE_SIZE 61
+#define ENTRY_OVERHEAD 32
+#define DEFAULT_TABLE_SIZE 4096
+#define DEFAULT_HEADER_LIST 65536
+// 超过这个长度的值不放进动态表
+#define INDEX_VALUE_LIMIT 256
+
+#define ENCODER_METATABLE "HPACK_ENCODER"
+#define DECODER_METATABLE "HPACK_DECODER"
+
+static const char * static_table[STATIC_TABLE_SIZE][2] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+static const uint32_t huffman_code[257] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+	0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+	0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+	0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+	0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+	0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+	0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+	0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+	0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+	0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+	0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+	0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+	0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+	0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+	0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+	0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+	0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+	0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+	0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+	0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+	0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+	0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+	0x3fffffff,
+};
+
+static const uint8_t huffman_bits[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+// 规范 huffman 编码：同样长度的编码是连续的，按长度查第一个编码和符号表的位置
+static const uint32_t huffman_first[31] = {
+	0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x14, 0x5c, 0xf8, 0x0, 0x3f8, 0x7fa, 0xffa, 0x1ff8, 0x3ffc, 0x7ffc, 0x0, 0x0, 0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8, 0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0, 0x3ffffffc,
+};
+
+static const uint16_t huffman_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t huffman_offset[31] = {
+	0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92, 0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253,
+};
+
+static const uint16_t huffman_symbol[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+	52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+	110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+	119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+	43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+	179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+	163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+	158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+	144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+	212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+	2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+	256,
+};
+
+struct entry {
+	char * name;	// name 和 value 在同一块内存
+	size_t namesz;
+	size_t valuesz;
+};
+
+// 动态表， e[0] 是最新的一项
+struct table {
+	struct entry * e;
+	int n;
+	int cap;
+	size_t size;
+	size_t maxsize;
+};
+
+struct encoder {
+	struct table t;
+	int update;	// 下一个头部块开头要通知对方新的表大小
+	char * buf;
+	size_t cap;
+	size_t sz;
+};
+
+struct decoder {
+	struct table t;
+	size_t limit;	// SETTINGS_HEADER_TABLE_SIZE ，对方能用的最大表
+	size_t listlimit;
+	char * buf;
+	size_t cap;
+};
+
+static void
+table_evict(struct table *t, size_t size) {
+	while (t->size > size && t->n > 0) {
+		struct entry * last = &t->e[--t->n];
+		t->size -= last->namesz + last->valuesz + ENTRY_OVERHEAD;
+		free(last->name);
+	}
+}
+
+static void
+table_free(struct table *t) {
+	table_evict(t, 0);
+	free(t->e);
+	t->e = NULL;
+	t->cap = 0;
+}
+
+static void
+table_add(struct table *t, const char *name, size_t namesz, const char *value, size_t valuesz) {
+	size_t sz = namesz + valuesz + ENTRY_OVERHEAD;
+	if (sz > t->maxsize) {
+		// 比整个表还大，只是清空表
+		table_evict(t, 0);
+		return;
+	}
+	// name 可能引用将被淘汰的项，先复制
+	char * p = malloc(namesz + valuesz + 1);
+	if (p == NULL)
+		return;
+	memcpy(p, name, namesz);
+	memcpy(p + namesz, value, valuesz);
+	table_evict(t, t->maxsize - sz);
+	if (t->n >= t->cap) {
+		int cap = t->cap ? t->cap * 2 : 16;
+		struct entry * e = realloc(t->e, cap * sizeof(*e));
+		if (e == NULL) {
+			free(p);
+			table_evict(t, 0);
+			return;
+		}
+		t->e = e;
+		t->cap = cap;
+	}
+	memmove(t->e + 1, t->e, t->n * sizeof(struct entry));
+	t->e[0].name = p;
+	t->e[0].namesz = namesz;
+	t->e[0].valuesz = valuesz;
+	t->n++;
+	t->size += sz;
+}
+
+// index 从 1 开始，先是静态表然后是动态表
+static int
+table_get(struct table *t, uint64_t index, const char **name, size_t *namesz, const char **value, size_t *valuesz) {
+	if (index == 0)
+		return 0;
+	if (index <= STATIC_TABLE_SIZE) {
+		*name = static_table[index-1][0];
+		*namesz = strlen(*name);
+		*value = static_table[index-1][1];
+		*valuesz = strlen(*value);
+		return 1;
+	}
+	index -= STATIC_TABLE_SIZE + 1;
+	if (index >= (uint64_t)t->n)
+		return 0;
+	struct entry * e = &t->e[index];
+	*name = e->name;
+	*namesz = e->namesz;
+	*value = e->name + e->namesz;
+	*valuesz = e->valuesz;
+	return 1;
+}
+
+static int
+decode_int(const uint8_t **ptr, const uint8_t *end, int prefix, uint64_t *v) {
+	const uint8_t * p = *ptr;
+	if (p >= end)
+		return 0;
+	uint64_t mask = (1 << prefix) - 1;
+	uint64_t x = *p++ & mask;
+	if (x == mask) {
+		int shift = 0;
+		for (;;) {
+			if (p >= end || shift > 49)
+				return 0;
+			uint8_t b = *p++;
+			x += (uint64_t)(b & 0x7f) << shift;
+			shift += 7;
+			if (!(b & 0x80))
+				break;
+		}
+	}
+	*ptr = p;
+	*v = x;
+	return 1;
+}
+
+static void
+reserve(lua_State *L, char **buf, size_t *cap, size_t sz) {
+	if (sz <= *cap)
+		return;
+	size_t newcap = *cap ? *cap : 256;
+	while (newcap < sz)
+		newcap *= 2;
+	char * p = realloc(*buf, newcap);
+	if (p == NULL)
+		luaL_error(L, "hpack: out of memory");
+	*buf = p;
+	*cap = newcap;
+}
+
+static size_t
+huffman_decode(lua_State *L, struct decoder *d, size_t off, const uint8_t *s, size_t len) {
+	// 最短的编码是 5 位
+	reserve(L, &d->buf, &d->cap, off + len * 8 / 5 + 1);
+	char * out = d->buf + off;
+	size_t n = 0;
+	uint32_t code = 0;
+	int bits = 0;
+	size_t i;
+	for (i=0;i<len;i++) {
+		int b;
+		for (b=7;b>=0;b--) {
+			code = code << 1 | ((s[i] >> b) & 1);
+			++bits;
+			if (bits >= 5) {
+				if (bits > 30)
+					luaL_error(L, "hpack: invalid huffman code");
+				uint32_t idx = code - huffman_first[bits];
+				if (code >= huffman_first[bits] && idx < huffman_count[bits]) {
+					int sym = huffman_symbol[huffman_offset[bits] + idx];
+					if (sym == 256)
+						luaL_error(L, "hpack: EOS in huffman string");
+					out[n++] = (char)sym;
+					code = 0;
+					bits = 0;
+				}
+			}
+		}
+	}
+	// 结尾用 EOS 的前缀（全 1 ）补齐，不超过 7 位
+	if (bits > 7 || code != (1u << bits) - 1)
+		luaL_error(L, "hpack: invalid huffman padding");
+	return n;
+}
+
+struct str {
+	const char * ptr;	// 为 NULL 时在 decoder 的 buf 里
+	size_t off;
+	size_t sz;
+};
+
+static void
+decode_string(lua_State *L, struct decoder *d, const uint8_t **ptr, const uint8_t *end, struct str *s, size_t *used) {
+	if (*ptr >= end)
+		luaL_error(L, "hpack: truncated string");
+	int huffman = **ptr & 0x80;
+	uint64_t len;
+	if (!decode_int(ptr, end, 7, &len) || len > (uint64_t)(end - *ptr))
+		luaL_error(L, "hpack: invalid string length");
+	if (huffman) {
+		s->ptr = NULL;
+		s->off = *used;
+		s->sz = huffman_decode(L, d, *used, *ptr, (size_t)len);
+		*used += s->sz;
+	} else {
+		s->ptr = (const char *)*ptr;
+		s->sz = (size_t)len;
+	}
+	*ptr += len;
+}
+
+static const char *
+str_ptr(struct decoder *d, struct str *s) {
+	return s->ptr ? s->ptr : d->buf + s->off;
+}
+
+static void
+addheader(lua_State *L, int header, const char *name, size_t namesz, const char *value, size_t valuesz) {
+	lua_pushlstring(L, name, namesz);
+	lua_pushvalue(L, -1);
+	switch (lua_rawget(L, header)) {
+	case LUA_TNIL:
+		lua_pop(L, 1);
+		lua_pushlstring(L, value, valuesz);
+		lua_rawset(L, header);
+		break;
+	case LUA_TTABLE:
+		lua_pushlstring(L, value, valuesz);
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_pop(L, 2);
+		break;
+	default:
+		lua_createtable(L, 2, 0);
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, 1);
+		lua_pushlstring(L, value, valuesz);
+		lua_rawseti(L, -2, 2);
+		lua_rawset(L, header);
+		break;
+	}
+}
+
+/*
+	userdata decoder
+	string block : 完整的头部块 (HEADERS 和 CONTINUATION 的内容)
+	table header
+	return header ：重复的字段收集成数组，伪字段 (:method 等) 也在里面
+
+	出错时抛出错误，连接应该以 COMPRESSION_ERROR 关闭
+ */
+static int
+ldecode(lua_State *L) {
+	struct decoder * d = (struct decoder *)luaL_checkudata(L, 1, DECODER_METATABLE);
+	size_t sz;
+	const uint8_t * p = (const uint8_t *)luaL_checklstring(L, 2, &sz);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	lua_settop(L, 3);
+	const uint8_t * end = p + sz;
+	size_t total = 0;
+	while (p < end) {
+		uint8_t c = *p;
+		const char *name, *value;
+		size_t namesz, valuesz;
+		uint64_t index;
+		if (c & 0x80) {
+			// 索引
+			if (!decode_int(&p, end, 7, &index) || !table_get(&d->t, index, &name, &namesz, &value, &valuesz))
+				return luaL_error(L, "hpack: invalid index");
+		} else if ((c & 0xe0) == 0x20) {
+			// 动态表大小
+			uint64_t size;
+			if (!decode_int(&p, end, 5, &size) || size > d->limit)
+				return luaL_error(L, "hpack: invalid table size update");
+			d->t.maxsize = (size_t)size;
+			table_evict(&d->t, d->t.maxsize);
+			continue;
+		} else {
+			int indexing = c & 0x40;
+			if (!decode_int(&p, end, indexing ? 6 : 4, &index))
+				return luaL_error(L, "hpack: invalid index");
+			size_t used = 0;
+			struct str n, v;
+			if (index == 0) {
+				decode_string(L, d, &p, end, &n, &used);
+			} else {
+				const char * dummy;
+				size_t dummysz;
+				if (!table_get(&d->t, index, &n.ptr, &n.sz, &dummy, &dummysz))
+					return luaL_error(L, "hpack: invalid index");
+			}
+			decode_string(L, d, &p, end, &v, &used);
+			name = str_ptr(d, &n);
+			namesz = n.sz;
+			value = str_ptr(d, &v);
+			valuesz = v.sz;
+			if (indexing) {
+				// 先放进 header 表，加入动态表时 name 引用的项可能被淘汰
+				total += namesz + valuesz + ENTRY_OVERHEAD;
+				if (total > d->listlimit)
+					return luaL_error(L, "hpack: header list too large");
+				addheader(L, 3, name, namesz, value, valuesz);
+				table_add(&d->t, name, namesz, value, valuesz);
+				continue;
+			}
+		}
+		total += namesz + valuesz + ENTRY_OVERHEAD;
+		if (total > d->listlimit)
+			return luaL_error(L, "hpack: header list too large");
+		addheader(L, 3, name, namesz, value, valuesz);
+	}
+	return 1;
+}
+
+static int
+ldecoder_gc(lua_State *L) {
+	struct decoder * d = (struct decoder *)lua_touserdata(L, 1);
+	table_free(&d->t);
+	free(d->buf);
+	d->buf = NULL;
+	d->cap = 0;
+	return 0;
+}
+
+/*
+	integer tablesize : 我们的 SETTINGS_HEADER_TABLE_SIZE ，默认 4096
+	integer listlimit : 解开后的头部最大长度，默认 64K
+ */
+static int
+lnewdecoder(lua_State *L) {
+	lua_Integer size = luaL_optinteger(L, 1, DEFAULT_TABLE_SIZE);
+	lua_Integer listlimit = luaL_optinteger(L, 2, DEFAULT_HEADER_LIST);
+	struct decoder * d = (struct decoder *)lua_newuserdatauv(L, sizeof(*d), 0);
+	memset(d, 0, sizeof(*d));
+	d->limit = (size_t)size;
+	d->t.maxsize = (size_t)size;
+	d->listlimit = (size_t)listlimit;
+	if (luaL_newmetatable(L, DECODER_METATABLE)) {
+		luaL_Reg l[] = {
+			{ "decode", ldecode },
+			{ NULL, NULL },
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, ldecoder_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static void
+emit_byte(lua_State *L, struct encoder *e, uint8_t c) {
+	reserve(L, &e->buf, &e->cap, e->sz + 1);
+	e->buf[e->sz++] = (char)c;
+}
+
+static void
+emit_int(lua_State *L, struct encoder *e, uint8_t flags, int prefix, uint64_t v) {
+	uint64_t mask = (1 << prefix) - 1;
+	if (v < mask) {
+		emit_byte(L, e, flags | (uint8_t)v);
+		return;
+	}
+	emit_byte(L, e, flags | (uint8_t)mask);
+	v -= mask;
+	while (v >= 0x80) {
+		emit_byte(L, e, (uint8_t)(v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	emit_byte(L, e, (uint8_t)v);
+}
+
+static void
+emit_string(lua_State *L, struct encoder *e, const char *s, size_t sz) {
+	uint64_t bits = 0;
+	size_t i;
+	for (i=0;i<sz;i++)
+		bits += huffman_bits[(uint8_t)s[i]];
+	size_t hsz = (size_t)((bits + 7) / 8);
+	if (hsz >= sz) {
+		emit_int(L, e, 0, 7, sz);
+		reserve(L, &e->buf, &e->cap, e->sz + sz);
+		memcpy(e->buf + e->sz, s, sz);
+		e->sz += sz;
+		return;
+	}
+	emit_int(L, e, 0x80, 7, hsz);
+	reserve(L, &e->buf, &e->cap, e->sz + hsz);
+	uint8_t * out = (uint8_t *)e->buf + e->sz;
+	uint64_t acc = 0;
+	int n = 0;
+	for (i=0;i<sz;i++) {
+		uint8_t c = (uint8_t)s[i];
+		acc = acc << huffman_bits[c] | huffman_code[c];
+		n += huffman_bits[c];
+		while (n >= 8) {
+			n -= 8;
+			*out++ = (uint8_t)(acc >> n);
+		}
+	}
+	if (n > 0) {
+		// 用 EOS 的前缀补齐
+		*out++ = (uint8_t)((acc << (8 - n)) | (0xff >> n));
+	}
+	e->sz += hsz;
+}
+
+static int
+streq(const char *a, size_t asz, const char *b, size_t bsz) {
+	return asz == bsz && memcmp(a, b, asz) == 0;
+}
+
+// 返回完全匹配的索引，没有时 *nameindex 是名字匹配的索引 (或 0)
+static uint64_t
+encoder_find(struct encoder *e, const char *name, size_t namesz, const char *value, size_t valuesz, uint64_t *nameindex) {
+	*nameindex = 0;
+	int i;
+	for (i=0;i<STATIC_TABLE_SIZE;i++) {
+		const char * n = static_table[i][0];
+		if (streq(name, namesz, n, strlen(n))) {
+			const char * v = static_table[i][1];
+			if (streq(value, valuesz, v, strlen(v)))
+				return i + 1;
+			if (*nameindex == 0)
+				*nameindex = i + 1;
+		}
+	}
+	for (i=0;i<e->t.n;i++) {
+		struct entry * en = &e->t.e[i];
+		if (streq(name, namesz, en->name, en->namesz)) {
+			if (streq(value, valuesz, en->name + en->namesz, en->valuesz))
+				return i + STATIC_TABLE_SIZE + 1;
+			if (*nameindex == 0)
+				*nameindex = i + STATIC_TABLE_SIZE + 1;
+		}
+	}
+	return 0;
+}
+
+#define LITERAL_INDEX 0
+#define LITERAL_NOINDEX 1
+#define LITERAL_NEVER 2
+
+static int
+literal_mode(const char *name, size_t namesz, size_t valuesz) {
+	if (streq(name, namesz, "authorization", 13) || streq(name, namesz, "proxy-authorization", 19))
+		return LITERAL_NEVER;
+	if (valuesz > INDEX_VALUE_LIMIT
+		|| streq(name, namesz, ":path", 5)
+		|| streq(name, namesz, "content-length", 14)
+		|| streq(name, namesz, "date", 4)
+		|| streq(name, namesz, "etag", 4)
+		|| streq(name, namesz, "last-modified", 13)
+		|| streq(name, namesz, "if-modified-since", 17)
+		|| streq(name, namesz, "if-none-match", 13))
+		return LITERAL_NOINDEX;
+	return LITERAL_INDEX;
+}
+
+/*
+	userdata encoder
+	table headers : { name1, value1, name2, value2, ... } ，名字要是小写的
+	return string : 头部块
+ */
+static int
+lencode(lua_State *L) {
+	struct encoder * e = (struct encoder *)luaL_checkudata(L, 1, ENCODER_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	int n = (int)lua_rawlen(L, 2);
+	e->sz = 0;
+	if (e->update) {
+		emit_int(L, e, 0x20, 5, e->t.maxsize);
+		e->update = 0;
+	}
+	int i;
+	for (i=1;i<n;i+=2) {
+		size_t namesz, valuesz;
+		lua_rawgeti(L, 2, i);
+		lua_rawgeti(L, 2, i+1);
+		const char * name = lua_tolstring(L, -2, &namesz);
+		const char * value = lua_tolstring(L, -1, &valuesz);
+		if (name == NULL || value == NULL)
+			return luaL_error(L, "hpack: invalid header at %d", i);
+		uint64_t nameindex;
+		uint64_t index = encoder_find(e, name, namesz, value, valuesz, &nameindex);
+		if (index) {
+			emit_int(L, e, 0x80, 7, index);
+		} else {
+			int mode = literal_mode(name, namesz, valuesz);
+			switch (mode) {
+			case LITERAL_INDEX:
+				emit_int(L, e, 0x40, 6, nameindex);
+				break;
+			case LITERAL_NOINDEX:
+				emit_int(L, e, 0, 4, nameindex);
+				break;
+			default:
+				emit_int(L, e, 0x10, 4, nameindex);
+				break;
+			}
+			if (nameindex == 0)
+				emit_string(L, e, name, namesz);
+			emit_string(L, e, value, valuesz);
+			if (mode == LITERAL_INDEX)
+				table_add(&e->t, name, namesz, value, valuesz);
+		}
+		lua_pop(L, 2);
+	}
+	lua_pushlstring(L, e->buf, e->sz);
+	return 1;
+}
+
+/*
+	userdata encoder
+	integer size : 对方的 SETTINGS_HEADER_TABLE_SIZE
+ */
+static int
+lresize(lua_State *L) {
+	struct encoder * e = (struct encoder *)luaL_checkudata(L, 1, ENCODER_METATABLE);
+	lua_Integer size = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, size >= 0, 2, "invalid table size");
+	// 用不超过默认大小的表
+	size_t maxsize = (size_t)size < DEFAULT_TABLE_SIZE ? (size_t)size : DEFAULT_TABLE_SIZE;
+	if (maxsize != e->t.maxsize) {
+		e->t.maxsize = maxsize;
+		table_evict(&e->t, maxsize);
+		e->update = 1;
+	}
+	return 0;
+}
+
+static int
+lencoder_gc(lua_State *L) {
+	struct encoder * e = (struct encoder *)lua_touserdata(L, 1);
+	table_free(&e->t);
+	free(e->buf);
+	e->buf = NULL;
+	e->cap = 0;
+	return 0;
+}
+
+static int
+lnewencoder(lua_State *L) {
+	struct encoder * e = (struct encoder *)lua_newuserdatauv(L, sizeof(*e), 0);
+	memset(e, 0, sizeof(*e));
+	e->t.maxsize = DEFAULT_TABLE_SIZE;
+	if (luaL_newmetatable(L, ENCODER_METATABLE)) {
+		luaL_Reg l[] = {
+			{ "encode", lencode },
+			{ "resize", lresize },
+			{ NULL, NULL },
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lencoder_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/*
+	string buffer
+	integer pos
+	integer maxsize : SETTINGS_MAX_FRAME_SIZE ，默认 16384
+	return nextpos, type, flags, stream, payload
+		nil : 不完整
+		false : 帧太大
+ */
+static int
+lframe(lua_State *L) {
+	size_t sz;
+	const uint8_t * buf = (const uint8_t *)luaL_checklstring(L, 1, &sz);
+	lua_Integer pos = luaL_optinteger(L, 2, 1);
+	lua_Integer maxsize = luaL_optinteger(L, 3, DEFAULT_FRAME_SIZE);
+	luaL_argcheck(L, pos >= 1 && (size_t)pos <= sz + 1, 2, "position out of range");
+	const uint8_t * p = buf + pos - 1;
+	size_t left = sz - (size_t)(pos - 1);
+	if (left < FRAME_HEADER)
+		return 0;
+	size_t len = (size_t)p[0] << 16 | (size_t)p[1] << 8 | p[2];
+	if (len > (size_t)maxsize) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	if (left < FRAME_HEADER + len)
+		return 0;
+	uint32_t stream = ((uint32_t)p[5] << 24 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 8 | p[8]) & 0x7fffffff;
+	lua_pushinteger(L, pos + FRAME_HEADER + len);
+	lua_pushinteger(L, p[3]);
+	lua_pushinteger(L, p[4]);
+	lua_pushinteger(L, stream);
+	lua_pushlstring(L, (const char *)p + FRAME_HEADER, len);
+	return 5;
+}
+
+/*
+	integer type
+	integer flags
+	integer stream
+	string payload (可选)
+	return string : 整个帧
+ */
+static int
+lpack(lua_State *L) {
+	lua_Integer type = luaL_checkinteger(L, 1);
+	lua_Integer flags = luaL_checkinteger(L, 2);
+	lua_Integer stream = luaL_checkinteger(L, 3);
+	size_t sz = 0;
+	const char * payload = luaL_optlstring(L, 4, "", &sz);
+	luaL_argcheck(L, sz <= MAX_FRAME_SIZE, 4, "payload too large");
+	luaL_Buffer b;
+	char * p = luaL_buffinitsize(L, &b, FRAME_HEADER + sz);
+	p[0] = (char)(sz >> 16);
+	p[1] = (char)(sz >> 8);
+	p[2] = (char)sz;
+	p[3] = (char)type;
+	p[4] = (char)flags;
+	p[5] = (char)((stream >> 24) & 0x7f);
+	p[6] = (char)(stream >> 16);
+	p[7] = (char)(stream >> 8);
+	p[8] = (char)stream;
+	memcpy(p + FRAME_HEADER, payload, sz);
+	luaL_pushresultsize(&b, FRAME_HEADER + sz);
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_skynet_http2_core(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "frame", lframe },
+		{ "pack", lpack },
+		{ "encoder", lnewencoder },
+		{ "decoder", lnewdecoder },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
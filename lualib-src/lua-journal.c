@@ -0,0 +1,198 @@
+#define LUA_LIB
+
+#include "skynet.h"
+#include "skynet_server.h"
+#include "skynet_journal.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+	服务的消息日志，见 lualib/skynet/journal.lua 和 skynet-src/skynet_journal.h
+	打开之后服务收到的每条消息（socket 消息除外）都由写线程追加到日志文件，
+	服务崩溃重启后用 load 读出快照和之后的消息重放。
+ */
+
+// 本服务打开的日志，放在注册表中
+static int JOURNAL_KEY;
+
+static struct skynet_context *
+getctx(lua_State *L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, "skynet_context");
+	struct skynet_context *ctx = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (ctx == NULL) {
+		luaL_error(L, "Init skynet context first");
+	}
+	return ctx;
+}
+
+static struct skynet_journal *
+getjournal(lua_State *L) {
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &JOURNAL_KEY);
+	struct skynet_journal *j = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return j;
+}
+
+static void
+setjournal(lua_State *L, struct skynet_journal *j) {
+	skynet_context_journal(getctx(L), j);
+	if (j) {
+		lua_pushlightuserdata(L, j);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &JOURNAL_KEY);
+}
+
+// open(journal, snapshot)
+static int
+lopen(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	const char *snapshot = luaL_checkstring(L, 2);
+	struct skynet_journal *j = skynet_journal_open(filename, snapshot);
+	if (j == NULL) {
+		return luaL_error(L, "Can't open journal %s", filename);
+	}
+	setjournal(L, j);
+	return 0;
+}
+
+static int
+lclose(lua_State *L) {
+	if (getjournal(L)) {
+		setjournal(L, NULL);
+	}
+	return 0;
+}
+
+// snapshot(string) 或 snapshot(lightuserdata, sz)，返回快照的 seq
+static int
+lsnapshot(lua_State *L) {
+	struct skynet_journal *j = getjournal(L);
+	if (j == NULL) {
+		return luaL_error(L, "Journal is not open");
+	}
+	const void *data;
+	size_t sz;
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		data = lua_tolstring(L, 1, &sz);
+	} else {
+		luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+		data = lua_touserdata(L, 1);
+		sz = (size_t)luaL_checkinteger(L, 2);
+	}
+	lua_pushinteger(L, (lua_Integer)skynet_journal_snapshot(j, data, sz));
+	return 1;
+}
+
+static int
+readfile(lua_State *L, const char *filename) {
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL)
+		return 0;
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	size_t n;
+	do {
+		char *p = luaL_prepbuffer(&b);
+		n = fread(p, 1, LUAL_BUFFERSIZE, f);
+		luaL_addsize(&b, n);
+	} while (n == LUAL_BUFFERSIZE);
+	fclose(f);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+	load(journal, snapshot)
+	返回 快照的 seq(没有快照为 0)，快照的数据(或 nil)，日志文件的内容(或 nil)
+ */
+static int
+lload(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	const char *snapshot = luaL_checkstring(L, 2);
+	lua_settop(L, 2);
+	if (readfile(L, snapshot)) {
+		size_t sz;
+		const char *s = lua_tolstring(L, -1, &sz);
+		uint64_t seq;
+		if (sz < 4 + sizeof(seq) || memcmp(s, JOURNAL_SNAPSHOT_MAGIC, 4) != 0) {
+			return luaL_error(L, "Invalid snapshot %s", snapshot);
+		}
+		memcpy(&seq, s + 4, sizeof(seq));
+		lua_pushinteger(L, (lua_Integer)seq);
+		lua_pushlstring(L, s + 4 + sizeof(seq), sz - 4 - sizeof(seq));
+	} else {
+		lua_pushnil(L);
+		lua_pushinteger(L, 0);
+		lua_pushnil(L);
+	}
+	if (!readfile(L, filename)) {
+		lua_pushnil(L);
+	} else {
+		size_t sz;
+		const char *s = lua_tolstring(L, -1, &sz);
+		if (sz < 4 || memcmp(s, JOURNAL_MAGIC, 4) != 0) {
+			return luaL_error(L, "Invalid journal %s", filename);
+		}
+	}
+	return 3;
+}
+
+/*
+	record(content, pos)
+	从 pos (从 0 开始，第一条记录在 4) 读一条记录，
+	返回 下一条记录的位置，seq，source，type，session，消息内容；读完或者记录不完整时返回 nil
+ */
+static int
+lrecord(lua_State *L) {
+	size_t sz;
+	const char *s = luaL_checklstring(L, 1, &sz);
+	lua_Integer pos = luaL_checkinteger(L, 2);
+	if (pos < 4 || (size_t)pos + JOURNAL_HEADER > sz)
+		return 0;
+	const char *p = s + pos;
+	uint32_t size;
+	uint64_t seq;
+	uint32_t source;
+	int32_t type;
+	int32_t session;
+	memcpy(&size, p, 4);
+	memcpy(&seq, p + 4, 8);
+	memcpy(&source, p + 12, 4);
+	memcpy(&type, p + 16, 4);
+	memcpy(&session, p + 20, 4);
+	if ((size_t)pos + JOURNAL_HEADER + size > sz)
+		return 0;
+	lua_pushinteger(L, pos + JOURNAL_HEADER + size);
+	lua_pushinteger(L, (lua_Integer)seq);
+	lua_pushinteger(L, source);
+	lua_pushinteger(L, type);
+	lua_pushinteger(L, session);
+	lua_pushlstring(L, p + JOURNAL_HEADER, size);
+	return 6;
+}
+
+LUAMOD_API int
+luaopen_skynet_journal_core(lua_State *L) {
+	luaL_checkversion(L);
+
+	luaL_Reg l[] = {
+		{ "open", lopen },
+		{ "close", lclose },
+		{ "snapshot", lsnapshot },
+		{ "load", lload },
+		{ "record", lrecord },
+		{ NULL, NULL },
+	};
+
+	luaL_newlib(L,l);
+
+	return 1;
+}
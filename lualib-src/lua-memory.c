@@ -103,6 +103,72 @@ lprofactive(lua_State *L) {
 	return 1;
 }
 
+// Lua 接口：设置或读取按服务堆采样的间隔（字节），0 为关闭
+static int
+lheapsample(lua_State *L) {
+	size_t interval, *pval = NULL;
+	if (!lua_isnone(L, 1)) {
+		interval = (size_t)luaL_checkinteger(L, 1);
+		pval = &interval;
+	}
+	lua_pushinteger(L, (lua_Integer)malloc_profile(pval));
+	return 1;
+}
+
+// Lua 接口：立即归还 arena（默认所有）中没用的页，返回归还的字节数
+static int
+lpurge(lua_State *L) {
+	int arena = (int)luaL_optinteger(L, 1, -1);
+	lua_pushinteger(L, (lua_Integer)malloc_purge(arena));
+	return 1;
+}
+
+// Lua 接口：设置或读取 dirty 和 muzzy 页的衰减时间（毫秒，-1 为不衰减）
+static int
+ldecay(lua_State *L) {
+	ssize_t dirty = (ssize_t)luaL_optinteger(L, 1, -2);
+	ssize_t muzzy = (ssize_t)luaL_optinteger(L, 2, -2);
+	malloc_decay(&dirty, &muzzy);
+	lua_pushinteger(L, dirty);
+	lua_pushinteger(L, muzzy);
+	return 2;
+}
+
+// Lua 接口：开启或关闭 jemalloc 的后台线程，返回当前状态
+static int
+lbackground(lua_State *L) {
+	bool *pval, enable;
+	if (lua_isnone(L, 1)) {
+		pval = NULL;
+	} else {
+		enable = lua_toboolean(L, 1) ? true : false;
+		pval = &enable;
+	}
+	lua_pushboolean(L, mallctl_bool("background_thread", pval));
+	return 1;
+}
+
+// Lua 接口：整理的统计
+static int
+lpurgestat(lua_State *L) {
+	struct malloc_purge_stat stat;
+	malloc_purge_stat(&stat);
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, (lua_Integer)stat.count);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, (lua_Integer)stat.bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, (lua_Integer)stat.last_bytes);
+	lua_setfield(L, -2, "last_bytes");
+	lua_pushinteger(L, stat.last_arena);
+	lua_setfield(L, -2, "last_arena");
+	lua_pushinteger(L, (lua_Integer)stat.last_usec);
+	lua_setfield(L, -2, "last_usec");
+	lua_pushinteger(L, stat.interval);
+	lua_setfield(L, -2, "interval");
+	return 1;
+}
+
 // memory 模块初始化函数
 LUAMOD_API int
 luaopen_skynet_memory(lua_State *L) {
@@ -119,6 +185,12 @@ luaopen_skynet_memory(lua_State *L) {
 		{ "current", lcurrent },       // 当前内存使用量
 		{ "dumpheap", ldumpheap },     // 转储堆信息
 		{ "profactive", lprofactive }, // 性能分析器控制
+		{ "heapsample", lheapsample }, // 按服务堆采样的间隔
+		{ "heaptop", malloc_profile_dump }, // 按服务汇总的堆采样
+		{ "purge", lpurge },           // 归还没用的页
+		{ "decay", ldecay },           // 衰减时间
+		{ "background", lbackground }, // 后台线程
+		{ "purgestat", lpurgestat },   // 整理的统计
 		{ NULL, NULL },
 	};
 
@@ -0,0 +1,95 @@
+#define LUA_LIB
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "skynet.h"
+#include "skynet_server.h"
+#include "skynet_handle.h"
+#include "skynet_mq.h"
+#include "skynet_timer.h"
+#include "skynet_imp.h"
+
+/*
+	直接读取 C 层的计数，不需要给各个服务发消息，也不会改变任何状态
+	见 service/metrics.lua
+ */
+
+static void
+set_field(lua_State *L, const char *name, lua_Integer v) {
+	lua_pushinteger(L, v);
+	lua_setfield(L, -2, name);
+}
+
+/*
+	return { worker, sleep, globalmq, localmq, timer, service, wakeup, wakeup_nsec }
+ */
+static int
+lnode(lua_State *L) {
+	int count, sleep, local;
+	skynet_worker_stat(&count, &sleep);
+	int global = skynet_globalmq_length(&local);
+	uint64_t wakeup, nsec;
+	skynet_wakeup_stat(&wakeup, &nsec);
+	lua_createtable(L, 0, 8);
+	set_field(L, "worker", count);
+	set_field(L, "sleep", sleep);
+	set_field(L, "globalmq", global);
+	set_field(L, "localmq", local);
+	set_field(L, "timer", skynet_timer_count());
+	set_field(L, "service", skynet_context_total());
+	set_field(L, "wakeup", (lua_Integer)wakeup);
+	set_field(L, "wakeup_nsec", (lua_Integer)nsec);
+	return 1;
+}
+
+/*
+	return { [handle] = { mqlen, dropped, message, cpu, stall } } ， cpu 的单位是秒
+ */
+static int
+lservices(lua_State *L) {
+	int n = 256;
+	uint32_t *handles;
+	int count;
+	for (;;) {
+		handles = skynet_malloc(n * sizeof(*handles));
+		count = skynet_handle_list(handles, n);
+		if (count <= n)
+			break;
+		skynet_free(handles);
+		n = count * 2;
+	}
+	lua_createtable(L, 0, count);
+	int i;
+	for (i=0;i<count;i++) {
+		struct skynet_service_stat st;
+		if (!skynet_context_stat(handles[i], &st))
+			continue;
+		lua_createtable(L, 0, 6);
+		set_field(L, "mqlen", st.mqlen);
+		set_field(L, "dropped", st.dropped);
+		set_field(L, "stall", st.stall);
+		set_field(L, "expired", st.expired);
+		set_field(L, "message", (lua_Integer)st.message);
+		lua_pushnumber(L, (double)st.cpu / 1000000.0);
+		lua_setfield(L, -2, "cpu");
+		lua_seti(L, -2, handles[i]);
+	}
+	skynet_free(handles);
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_skynet_metrics(lua_State *L) {
+	luaL_checkversion(L);
+
+	luaL_Reg l[] = {
+		{ "node", lnode },          // 节点的全局统计
+		{ "services", lservices },  // 每个服务的统计
+		{ NULL, NULL },
+	};
+
+	luaL_newlib(L,l);
+
+	return 1;
+}
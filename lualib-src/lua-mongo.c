@@ -110,13 +110,6 @@ write_int8(struct buffer *b, int8_t v) {
 }
 
 /*
-static inline void
-write_bytes(struct buffer *b, const void * buf, int sz) {
-	buffer_reserve(b,sz);
-	memcpy(b->ptr + b->size, buf, sz);
-	b->size += sz;
-}
-
 static void
 write_string(struct buffer *b, const char *key, size_t sz) {
 	buffer_reserve(b,sz+1);
@@ -220,10 +213,21 @@ reply_length(lua_State *L) {
 	return 1;
 }
 
+static inline void
+write_bytes(struct buffer *b, const void * buf, int sz) {
+	buffer_reserve(b,sz);
+	memcpy(b->ptr + b->size, buf, sz);
+	b->size += sz;
+}
+
 // @param 1 request_id int
 // @param 2 flags int
 // @param 3 command bson document
+// @param 4 identifier string (optional)
+// @param 5 bson document array (optional)
 // @return
+// 带 identifier 时，第 5 个参数中的文档作为 document sequence (payload type 1) 发送，
+// 这样批量写入的文档不用再编码进命令文档的数组里
 static int
 op_msg(lua_State *L) {
 	int id = luaL_checkinteger(L, 1);
@@ -234,8 +238,26 @@ op_msg(lua_State *L) {
 		return luaL_error(L, "opmsg require cmd document");
 	}
 
-	luaL_Buffer b;
-	luaL_buffinit(L, &b);
+	size_t id_sz = 0;
+	const char * identifier = luaL_optlstring(L, 4, NULL, &id_sz);
+	int n = 0;
+	int seq_total = 0;
+	int i;
+	if (identifier) {
+		luaL_checktype(L, 5, LUA_TTABLE);
+		n = (int)lua_rawlen(L, 5);
+		// size(int32) + identifier(cstring) + documents
+		seq_total = 4 + (int)id_sz + 1;
+		for (i=1;i<=n;i++) {
+			lua_rawgeti(L, 5, i);
+			document doc = lua_touserdata(L, -1);
+			lua_pop(L, 1);
+			if (doc == NULL) {
+				return luaL_error(L, "Invalid document at %d", i);
+			}
+			seq_total += get_length(doc);
+		}
+	}
 
 	struct buffer buf;
 	buffer_create(&buf);
@@ -248,13 +270,27 @@ op_msg(lua_State *L) {
 
 		int32_t cmd_len = get_length(cmd);
 		int total = buf.size + cmd_len;
+		if (identifier) {
+			total += 1 + seq_total;
+		}
 
 		write_length(&buf, total, len);
-		luaL_addlstring(&b, (const char *)buf.ptr, buf.size);
+		write_bytes(&buf, cmd, cmd_len);
+
+		if (identifier) {
+			write_int8(&buf, 1);
+			write_int32(&buf, seq_total);
+			write_bytes(&buf, identifier, (int)id_sz + 1);
+			for (i=1;i<=n;i++) {
+				// 文档由第 5 个参数引用，弹出后指针仍然有效
+				lua_rawgeti(L, 5, i);
+				document doc = lua_touserdata(L, -1);
+				lua_pop(L, 1);
+				write_bytes(&buf, doc, get_length(doc));
+			}
+		}
+		lua_pushlstring(L, (const char *)buf.ptr, buf.size);
 	buffer_destroy(&buf);
-
-	luaL_addlstring(&b, (const char *)cmd, cmd_len);
-	luaL_pushresult(&b);
 	return 1;
 }
 
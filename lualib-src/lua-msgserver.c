@@ -0,0 +1,376 @@
+#define LUA_LIB
+
+#include "skynet_malloc.h"
+#include "skynet_socket.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+	snax.msgserver 的分包和应答缓存，见 lualib/snax/msgserver.lua
+
+	请求包  : content session(dword)
+	应答包  : size(word) content ok(byte) session(dword)  ; 所有数字都是大端序
+
+	每个用户一个应答缓存，断线重连后客户端重发的请求直接用缓存的应答回复。
+	缓存是一个字节环：应答按顺序追加在环尾，空间不够或者条数超过上限时从环头淘汰最旧的应答，
+	只在需要时扩大，内存不超过 limit 字节（单个应答比 limit 大时按这个应答的大小）。
+ */
+
+#define RESPONSE_HEADER 2
+#define RESPONSE_TAIL 5
+#define MIN_CACHE 256
+
+struct response {
+	uint32_t session;
+	int version;
+	int offset;     // 在环中的位置
+	int size;       // 整个应答包的大小
+	int alive;      // 0 表示已经删除或者移到了环尾，等待淘汰
+};
+
+struct response_cache {
+	int n;          // 条数上限
+	int first;      // 最旧的一条
+	int count;
+	int limit;      // 环的字节上限
+	int cap;
+	uint8_t * buffer;
+	struct response * r;
+};
+
+static inline struct response *
+cache_at(struct response_cache *c, int i) {
+	return &c->r[(c->first + i) % c->n];
+}
+
+static void
+cache_evict(struct response_cache *c) {
+	c->first = (c->first + 1) % c->n;
+	--c->count;
+}
+
+// 按顺序把留下的应答复制到新的环中，cap 变为 newcap
+static void
+cache_resize(struct response_cache *c, int newcap) {
+	uint8_t * buffer = skynet_malloc(newcap);
+	struct response * list = skynet_malloc(c->n * sizeof(struct response));
+	int offset = 0;
+	int i, j = 0;
+	for (i=0;i<c->count;i++) {
+		struct response *r = cache_at(c, i);
+		if (!r->alive)
+			continue;
+		memcpy(buffer + offset, c->buffer + r->offset, r->size);
+		struct response *to = &list[j++];
+		*to = *r;
+		to->offset = offset;
+		offset += r->size;
+	}
+	skynet_free(c->r);
+	c->r = list;
+	c->first = 0;
+	c->count = j;
+	skynet_free(c->buffer);
+	c->buffer = buffer;
+	c->cap = newcap;
+}
+
+// 环中能放下 sz 字节的位置，放不下返回 -1
+static int
+cache_fit(struct response_cache *c, int sz) {
+	if (c->count == 0) {
+		return sz <= c->cap ? 0 : -1;
+	}
+	struct response *oldest = cache_at(c, 0);
+	struct response *newest = cache_at(c, c->count - 1);
+	int head = oldest->offset;
+	int tail = newest->offset + newest->size;
+	if (newest->offset >= head) {
+		// 没有回绕，数据在 [head, tail)
+		if (tail + sz <= c->cap)
+			return tail;
+		if (sz <= head)
+			return 0;
+		return -1;
+	}
+	// 回绕了，空闲的是 [tail, head)
+	if (tail + sz <= head)
+		return tail;
+	return -1;
+}
+
+// 留下的应答一共多少字节
+static int
+cache_bytes(struct response_cache *c) {
+	int i, bytes = 0;
+	for (i=0;i<c->count;i++) {
+		struct response *r = cache_at(c, i);
+		if (r->alive)
+			bytes += r->size;
+	}
+	return bytes;
+}
+
+static uint8_t *
+cache_alloc(struct response_cache *c, uint32_t session, int version, int sz) {
+	if (c->count == c->n) {
+		cache_evict(c);
+	}
+	if (c->cap > c->limit && sz <= c->limit) {
+		// 为超过上限的大应答扩大过，缩回上限
+		while (cache_bytes(c) + sz > c->limit)
+			cache_evict(c);
+		cache_resize(c, c->limit);
+	}
+	int offset;
+	while ((offset = cache_fit(c, sz)) < 0) {
+		if (c->cap < c->limit || c->cap < sz) {
+			int newcap = c->cap < MIN_CACHE ? MIN_CACHE : c->cap * 2;
+			while (newcap < sz)
+				newcap *= 2;
+			if (newcap > c->limit && newcap > sz)
+				newcap = c->limit > sz ? c->limit : sz;
+			cache_resize(c, newcap);
+		} else {
+			cache_evict(c);
+		}
+	}
+	struct response *r = cache_at(c, c->count++);
+	r->session = session;
+	r->version = version;
+	r->offset = offset;
+	r->size = sz;
+	r->alive = 1;
+	return c->buffer + offset;
+}
+
+static struct response *
+cache_find(struct response_cache *c, uint32_t session) {
+	int i;
+	for (i=c->count-1;i>=0;i--) {
+		struct response *r = cache_at(c, i);
+		if (r->alive && r->session == session)
+			return r;
+	}
+	return NULL;
+}
+
+static inline void
+write_uint32(uint8_t *p, uint32_t v) {
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+// 返回应答包的副本，socketdriver.send 发送后释放
+static int
+push_copy(lua_State *L, const uint8_t *data, int sz) {
+	void * p = skynet_malloc(sz);
+	memcpy(p, data, sz);
+	lua_pushlightuserdata(L, p);
+	lua_pushinteger(L, sz);
+	return 2;
+}
+
+static struct response_cache *
+check_cache(lua_State *L) {
+	return (struct response_cache *)luaL_checkudata(L, 1, "SKYNET_MSGSERVER_CACHE");
+}
+
+/*
+	integer session
+
+	return version | nil
+ */
+static int
+lfind(lua_State *L) {
+	struct response_cache *c = check_cache(L);
+	uint32_t session = (uint32_t)luaL_checkinteger(L, 2);
+	struct response *r = cache_find(c, session);
+	if (r == NULL)
+		return 0;
+	lua_pushinteger(L, r->version);
+	return 1;
+}
+
+static int
+lremove(lua_State *L) {
+	struct response_cache *c = check_cache(L);
+	uint32_t session = (uint32_t)luaL_checkinteger(L, 2);
+	struct response *r = cache_find(c, session);
+	if (r)
+		r->alive = 0;
+	return 0;
+}
+
+/*
+	integer session
+	integer version
+	boolean ok
+	string result | nil
+
+	return lightuserdata, integer
+	保存应答并返回副本
+ */
+static int
+lpush(lua_State *L) {
+	struct response_cache *c = check_cache(L);
+	uint32_t session = (uint32_t)luaL_checkinteger(L, 2);
+	int version = (int)luaL_checkinteger(L, 3);
+	int ok = lua_toboolean(L, 4);
+	size_t len = 0;
+	const char * result = NULL;
+	if (ok) {
+		result = luaL_optlstring(L, 5, "", &len);
+	}
+	if (len + RESPONSE_TAIL > 0xffff) {
+		return luaL_error(L, "Response too long (%d)", (int)len);
+	}
+	struct response *old = cache_find(c, session);
+	if (old)
+		old->alive = 0;
+	int sz = (int)len + RESPONSE_HEADER + RESPONSE_TAIL;
+	uint8_t * p = cache_alloc(c, session, version, sz);
+	int body = (int)len + RESPONSE_TAIL;
+	p[0] = (body >> 8) & 0xff;
+	p[1] = body & 0xff;
+	if (len > 0)
+		memcpy(p + RESPONSE_HEADER, result, len);
+	p[RESPONSE_HEADER + len] = ok ? 1 : 0;
+	write_uint32(p + RESPONSE_HEADER + len + 1, session);
+	return push_copy(L, p, sz);
+}
+
+/*
+	integer session
+	integer version
+
+	return lightuserdata, integer | nil
+	重发缓存的应答，应答移到环尾并更新版本
+ */
+static int
+lresend(lua_State *L) {
+	struct response_cache *c = check_cache(L);
+	uint32_t session = (uint32_t)luaL_checkinteger(L, 2);
+	int version = (int)luaL_checkinteger(L, 3);
+	struct response *r = cache_find(c, session);
+	if (r == NULL)
+		return 0;
+	r->version = version;
+	if (r == cache_at(c, c->count - 1)) {
+		return push_copy(L, c->buffer + r->offset, r->size);
+	}
+	int sz = r->size;
+	uint8_t * tmp = skynet_malloc(sz);
+	memcpy(tmp, c->buffer + r->offset, sz);
+	r->alive = 0;
+	uint8_t * p = cache_alloc(c, session, version, sz);
+	memcpy(p, tmp, sz);
+	lua_pushlightuserdata(L, tmp);
+	lua_pushinteger(L, sz);
+	return 2;
+}
+
+// 缓存的条数、字节数和环的大小
+static int
+lstat(lua_State *L) {
+	struct response_cache *c = check_cache(L);
+	int i, n = 0;
+	for (i=0;i<c->count;i++) {
+		if (cache_at(c, i)->alive)
+			++n;
+	}
+	lua_pushinteger(L, n);
+	lua_pushinteger(L, cache_bytes(c));
+	lua_pushinteger(L, c->cap);
+	return 3;
+}
+
+static int
+lrelease(lua_State *L) {
+	struct response_cache *c = check_cache(L);
+	skynet_free(c->buffer);
+	c->buffer = NULL;
+	skynet_free(c->r);
+	c->r = NULL;
+	c->count = 0;
+	c->cap = 0;
+	return 0;
+}
+
+/*
+	integer n	最多缓存的应答条数
+	integer limit	缓存的字节上限
+
+	return userdata
+ */
+static int
+lcache(lua_State *L) {
+	int n = (int)luaL_checkinteger(L, 1);
+	int limit = (int)luaL_optinteger(L, 2, 65536);
+	luaL_argcheck(L, n > 0, 1, "need positive number");
+	struct response_cache *c = lua_newuserdatauv(L, sizeof(*c), 0);
+	memset(c, 0, sizeof(*c));
+	c->n = n;
+	c->limit = limit;
+	c->r = skynet_malloc(n * sizeof(struct response));
+	if (luaL_newmetatable(L, "SKYNET_MSGSERVER_CACHE")) {
+		luaL_Reg l[] = {
+			{ "find", lfind },
+			{ "remove", lremove },
+			{ "push", lpush },
+			{ "resend", lresend },
+			{ "stat", lstat },
+			{ NULL, NULL },
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lrelease);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/*
+	lightuserdata msg
+	integer sz
+
+	return integer session, string content
+	请求包最后4个字节是session，不需要先转成完整的字符串再截取；msg 放回读缓冲池
+ */
+static int
+lrequest(lua_State *L) {
+	uint8_t * msg = lua_touserdata(L, 1);
+	int sz = (int)luaL_checkinteger(L, 2);
+	if (msg == NULL || sz < 4) {
+		skynet_socket_recycle(msg, sz);
+		return luaL_error(L, "Invalid request size %d", sz);
+	}
+	const uint8_t * s = msg + sz - 4;
+	uint32_t session = (uint32_t)s[0] << 24 | (uint32_t)s[1] << 16 | (uint32_t)s[2] << 8 | s[3];
+	lua_pushinteger(L, session);
+	lua_pushlstring(L, (const char *)msg, sz - 4);
+	skynet_socket_recycle(msg, sz);
+	return 2;
+}
+
+LUAMOD_API int
+luaopen_skynet_msgserver_core(lua_State *L) {
+	luaL_checkversion(L);
+
+	luaL_Reg l[] = {
+		{ "cache", lcache },
+		{ "request", lrequest },
+		{ NULL, NULL },
+	};
+
+	luaL_newlib(L,l);
+
+	return 1;
+}
@@ -50,6 +50,11 @@ mc_packlocal(lua_State *L) {
 	if (size != (uint32_t)size) {
 		return luaL_error(L, "Size should be 32bit integer");
 	}
+	if (skynet_message_finalized(data, size)) {
+		// 多播的消息会被复制，也可能发往其他节点
+		skynet_message_free(data, size);
+		return luaL_error(L, "sharedbuffer can't be multicast");
+	}
 	return pack(L, data, size);  // 直接使用数据指针
 }
 
@@ -169,6 +174,239 @@ mc_remote(lua_State *L) {
 	return 2;
 }
 
+/*
+	订阅者集合，开放寻址的哈希集合，0 表示空位。
+	multicastd 用它保存本地的订阅者，publish 在 C 里一次发给所有订阅者。
+ */
+struct mc_group {
+	int cap;          // 容量，2的幂
+	int n;            // 订阅者数量
+	uint32_t *slot;   // 订阅者地址
+};
+
+#define GROUP_INITSIZE 8
+
+static inline int
+group_home(struct mc_group *g, uint32_t handle) {
+	return (int)((handle * 2654435761u) & (uint32_t)(g->cap - 1));
+}
+
+// 返回 handle 所在的位置，不存在时返回它应该放入的空位
+static int
+group_find(struct mc_group *g, uint32_t handle) {
+	int mask = g->cap - 1;
+	int i = group_home(g, handle);
+	while (g->slot[i] != 0 && g->slot[i] != handle) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static void
+group_resize(struct mc_group *g, int cap) {
+	uint32_t * old = g->slot;
+	int oldcap = g->cap;
+	g->slot = skynet_malloc(cap * sizeof(uint32_t));
+	memset(g->slot, 0, cap * sizeof(uint32_t));
+	g->cap = cap;
+	int i;
+	for (i=0;i<oldcap;i++) {
+		if (old[i]) {
+			g->slot[group_find(g, old[i])] = old[i];
+		}
+	}
+	skynet_free(old);
+}
+
+static struct mc_group *
+check_group(lua_State *L) {
+	return (struct mc_group *)luaL_checkudata(L, 1, "MULTICAST_GROUP");
+}
+
+// Lua 接口：加入订阅者，返回是否新加入
+static int
+lgroup_add(lua_State *L) {
+	struct mc_group *g = check_group(L);
+	uint32_t handle = (uint32_t)luaL_checkinteger(L, 2);
+	if (handle == 0)
+		return luaL_error(L, "Invalid handle");
+	if ((g->n + 1) * 2 > g->cap) {
+		group_resize(g, g->cap * 2);
+	}
+	int i = group_find(g, handle);
+	if (g->slot[i] == handle) {
+		lua_pushboolean(L, 0);
+	} else {
+		g->slot[i] = handle;
+		++g->n;
+		lua_pushboolean(L, 1);
+	}
+	return 1;
+}
+
+// Lua 接口：移除订阅者，返回是否存在
+static int
+lgroup_remove(lua_State *L) {
+	struct mc_group *g = check_group(L);
+	uint32_t handle = (uint32_t)luaL_checkinteger(L, 2);
+	int i = group_find(g, handle);
+	if (g->slot[i] != handle) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	// 线性探测的删除：把后面不在自己位置上的元素往前挪
+	int mask = g->cap - 1;
+	int j = i;
+	g->slot[i] = 0;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (g->slot[j] == 0)
+			break;
+		int k = group_home(g, g->slot[j]);
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			g->slot[i] = g->slot[j];
+			g->slot[j] = 0;
+			i = j;
+		}
+	}
+	--g->n;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// Lua 接口：订阅者数量
+static int
+lgroup_count(lua_State *L) {
+	struct mc_group *g = check_group(L);
+	lua_pushinteger(L, g->n);
+	return 1;
+}
+
+static int
+lgroup_gc(lua_State *L) {
+	struct mc_group *g = check_group(L);
+	skynet_free(g->slot);
+	g->slot = NULL;
+	g->cap = 0;
+	g->n = 0;
+	return 0;
+}
+
+// Lua 接口：创建订阅者集合
+static int
+mc_newgroup(lua_State *L) {
+	struct mc_group *g = lua_newuserdatauv(L, sizeof(*g), 0);
+	g->cap = GROUP_INITSIZE;
+	g->n = 0;
+	g->slot = skynet_malloc(g->cap * sizeof(uint32_t));
+	memset(g->slot, 0, g->cap * sizeof(uint32_t));
+	if (luaL_newmetatable(L, "MULTICAST_GROUP")) {
+		luaL_Reg l[] = {
+			{ "add", lgroup_add },
+			{ "remove", lgroup_remove },
+			{ "count", lgroup_count },
+			{ NULL, NULL },
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lgroup_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/*
+	userdata group
+	integer source
+	integer channel
+	lightuserdata struct mc_package **
+	integer size (must be sizeof(struct mc_package *))
+
+	把包发给集合里的所有订阅者（通道号放在 session 里），引用计数等于成功发出的数量，
+	没有订阅者时直接释放。返回发出的数量
+ */
+// Lua 接口：向订阅者集合发布
+static int
+mc_publish(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	struct mc_group *g = check_group(L);
+	uint32_t source = (uint32_t)luaL_checkinteger(L, 2);
+	int channel = (int)luaL_checkinteger(L, 3);
+	struct mc_package ** ptr = lua_touserdata(L, 4);
+	int sz = luaL_checkinteger(L, 5);
+	if (ptr == NULL || sz != sizeof(*ptr)) {
+		return luaL_error(L, "Invalid multicast package size %d", sz);
+	}
+	struct mc_package *pack = *ptr;
+	skynet_free(ptr);
+	if (ATOM_LOAD(&pack->reference) != 0) {
+		return luaL_error(L, "Can't bind a multicast package more than once");
+	}
+	// 多持有一个引用，发送过程中订阅者释放也不会提前回收
+	ATOM_STORE(&pack->reference, g->n + 1);
+	int i;
+	int fail = 0;
+	int n = 0;
+	for (i=0;i<g->cap;i++) {
+		uint32_t handle = g->slot[i];
+		if (handle) {
+			if (skynet_send(ctx, source, handle, PTYPE_MULTICAST, channel, &pack, sizeof(pack)) < 0) {
+				++fail;
+			} else {
+				++n;
+			}
+		}
+	}
+	int drop = fail + 1;
+	if (ATOM_FSUB(&pack->reference, drop) == drop) {
+		skynet_free(pack->data);
+		skynet_free(pack);
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+/*
+	lightuserdata msg
+	integer sz
+	integer offset
+
+	return channel, source, lightuserdata struct mc_package **, size, nextoffset ; nil at the end
+
+	节点间合并发送的多播消息（见 multicastd.lua ），由多条记录组成，每条是
+		uint32 channel, uint32 source, uint32 size, data （小端）
+	每次取出 offset 处的一条，数据复制到一个新的包里
+ */
+// Lua 接口：解开合并的远程多播消息
+static int
+mc_unpackbatch(lua_State *L) {
+	const uint8_t * msg = lua_touserdata(L, 1);
+	size_t sz = (size_t)luaL_checkinteger(L, 2);
+	size_t offset = (size_t)luaL_checkinteger(L, 3);
+	if (msg == NULL || offset >= sz)
+		return 0;
+	if (sz - offset < 12)
+		return luaL_error(L, "Invalid multicast batch");
+	const uint8_t * p = msg + offset;
+	uint32_t h[3];
+	int i;
+	for (i=0;i<3;i++) {
+		h[i] = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		p += 4;
+	}
+	uint32_t size = h[2];
+	if (sz - offset - 12 < size)
+		return luaL_error(L, "Invalid multicast batch");
+	void * data = skynet_malloc(size);
+	memcpy(data, p, size);
+	lua_pushinteger(L, h[0]);
+	lua_pushinteger(L, h[1]);
+	pack(L, data, size);
+	lua_pushinteger(L, (lua_Integer)(offset + 12 + size));
+	return 5;
+}
+
 // Lua 接口：生成下一个多播ID
 static int
 mc_nextid(lua_State *L) {
@@ -191,10 +429,21 @@ luaopen_skynet_multicast_core(lua_State *L) {
 		{ "close", mc_closelocal },    // 关闭本地包
 		{ "remote", mc_remote },       // 处理远程包
 		{ "packremote", mc_packremote }, // 打包远程数据
+		{ "unpackbatch", mc_unpackbatch }, // 解开合并的远程数据
 		{ "nextid", mc_nextid },       // 生成下一个ID
+		{ "newgroup", mc_newgroup },   // 创建订阅者集合
 		{ NULL, NULL },
 	};
 	luaL_checkversion(L);
 	luaL_newlib(L,l);
+
+	// publish 需要 skynet_context 发送消息
+	lua_getfield(L, LUA_REGISTRYINDEX, "skynet_context");
+	struct skynet_context *ctx = lua_touserdata(L,-1);
+	if (ctx == NULL) {
+		return luaL_error(L, "Init skynet context first");
+	}
+	lua_pushcclosure(L, mc_publish, 1);
+	lua_setfield(L, -2, "publish");
 	return 1;
 }
@@ -0,0 +1,400 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+	MySQL 二进制协议（COM_STMT_EXECUTE 的结果集）的行解码，见 skynet/db/mysql.lua
+	字段类型参考 enum_field_types
+ */
+
+#define TYPE_DECIMAL 0x00
+#define TYPE_TINY 0x01
+#define TYPE_SHORT 0x02
+#define TYPE_LONG 0x03
+#define TYPE_FLOAT 0x04
+#define TYPE_DOUBLE 0x05
+#define TYPE_NULL 0x06
+#define TYPE_TIMESTAMP 0x07
+#define TYPE_LONGLONG 0x08
+#define TYPE_INT24 0x09
+#define TYPE_DATE 0x0a
+#define TYPE_TIME 0x0b
+#define TYPE_DATETIME 0x0c
+#define TYPE_YEAR 0x0d
+#define TYPE_NEWDECIMAL 0xf6
+
+struct reader {
+	const uint8_t * ptr;
+	size_t sz;
+};
+
+static const uint8_t *
+readn(lua_State *L, struct reader *r, size_t n) {
+	if (r->sz < n) {
+		luaL_error(L, "Invalid binary row");
+	}
+	const uint8_t * p = r->ptr;
+	r->ptr += n;
+	r->sz -= n;
+	return p;
+}
+
+static uint64_t
+readint(lua_State *L, struct reader *r, int n) {
+	const uint8_t * p = readn(L, r, n);
+	uint64_t v = 0;
+	int i;
+	for (i=n-1;i>=0;i--) {
+		v = v << 8 | p[i];
+	}
+	return v;
+}
+
+// 符号扩展 n 字节的整数
+static lua_Integer
+signint(uint64_t v, int n, int is_signed) {
+	if (is_signed && n < 8) {
+		uint64_t m = (uint64_t)1 << (n * 8 - 1);
+		return (lua_Integer)((v ^ m) - m);
+	}
+	return (lua_Integer)v;
+}
+
+static uint64_t
+readlength(lua_State *L, struct reader *r) {
+	uint8_t c = *readn(L, r, 1);
+	switch (c) {
+	case 0xfc:
+		return readint(L, r, 2);
+	case 0xfd:
+		return readint(L, r, 3);
+	case 0xfe:
+		return readint(L, r, 8);
+	case 0xfb:
+	case 0xff:
+		return luaL_error(L, "Invalid length coded binary");
+	}
+	return c;
+}
+
+static void
+pushdatetime(lua_State *L, struct reader *r, int withtime) {
+	uint64_t len = readlength(L, r);
+	int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0;
+	uint32_t micro = 0;
+	if (len != 0 && len != 4 && len != 7 && len != 11) {
+		luaL_error(L, "Unsupported date format, len is %d", (int)len);
+	}
+	if (len >= 4) {
+		year = (int)readint(L, r, 2);
+		month = *readn(L, r, 1);
+		day = *readn(L, r, 1);
+	}
+	if (len >= 7) {
+		hour = *readn(L, r, 1);
+		minute = *readn(L, r, 1);
+		second = *readn(L, r, 1);
+	}
+	if (len == 11) {
+		micro = (uint32_t)readint(L, r, 4);
+	}
+	char tmp[64];
+	if (!withtime) {
+		snprintf(tmp, sizeof(tmp), "%04d-%02d-%02d", year, month, day);
+	} else if (micro) {
+		snprintf(tmp, sizeof(tmp), "%04d-%02d-%02d %02d:%02d:%02d.%06u", year, month, day, hour, minute, second, micro);
+	} else {
+		snprintf(tmp, sizeof(tmp), "%04d-%02d-%02d %02d:%02d:%02d", year, month, day, hour, minute, second);
+	}
+	lua_pushstring(L, tmp);
+}
+
+static void
+pushtime(lua_State *L, struct reader *r) {
+	uint64_t len = readlength(L, r);
+	int neg = 0, hour = 0, minute = 0, second = 0;
+	uint32_t days = 0, micro = 0;
+	if (len != 0 && len != 8 && len != 12) {
+		luaL_error(L, "Unsupported time format, len is %d", (int)len);
+	}
+	if (len >= 8) {
+		neg = *readn(L, r, 1);
+		days = (uint32_t)readint(L, r, 4);
+		hour = *readn(L, r, 1);
+		minute = *readn(L, r, 1);
+		second = *readn(L, r, 1);
+	}
+	if (len == 12) {
+		micro = (uint32_t)readint(L, r, 4);
+	}
+	char tmp[64];
+	if (micro) {
+		snprintf(tmp, sizeof(tmp), "%s%02u:%02d:%02d.%06u", neg ? "-" : "", days * 24 + hour, minute, second, micro);
+	} else {
+		snprintf(tmp, sizeof(tmp), "%s%02u:%02d:%02d", neg ? "-" : "", days * 24 + hour, minute, second);
+	}
+	lua_pushstring(L, tmp);
+}
+
+static void
+pushvalue(lua_State *L, struct reader *r, int type, int is_signed) {
+	switch (type) {
+	case TYPE_TINY:
+		lua_pushinteger(L, signint(readint(L, r, 1), 1, is_signed));
+		break;
+	case TYPE_SHORT:
+	case TYPE_YEAR:
+		lua_pushinteger(L, signint(readint(L, r, 2), 2, is_signed));
+		break;
+	case TYPE_LONG:
+	case TYPE_INT24:
+		lua_pushinteger(L, signint(readint(L, r, 4), 4, is_signed));
+		break;
+	case TYPE_LONGLONG:
+		lua_pushinteger(L, signint(readint(L, r, 8), 8, is_signed));
+		break;
+	case TYPE_FLOAT: {
+		uint32_t v = (uint32_t)readint(L, r, 4);
+		float f;
+		memcpy(&f, &v, sizeof(f));
+		lua_pushnumber(L, f);
+		break;
+	}
+	case TYPE_DOUBLE: {
+		uint64_t v = readint(L, r, 8);
+		double d;
+		memcpy(&d, &v, sizeof(d));
+		lua_pushnumber(L, d);
+		break;
+	}
+	case TYPE_NULL:
+		lua_pushnil(L);
+		break;
+	case TYPE_TIMESTAMP:
+	case TYPE_DATETIME:
+		pushdatetime(L, r, 1);
+		break;
+	case TYPE_DATE:
+		pushdatetime(L, r, 0);
+		break;
+	case TYPE_TIME:
+		pushtime(L, r);
+		break;
+	case TYPE_DECIMAL:
+	case TYPE_NEWDECIMAL: {
+		// 和文本协议一样转成数字
+		size_t len = (size_t)readlength(L, r);
+		const char * p = (const char *)readn(L, r, len);
+		lua_pushlstring(L, p, len);
+		if (!lua_stringtonumber(L, lua_tostring(L, -1))) {
+			lua_pushnil(L);
+		}
+		lua_replace(L, -2);
+		break;
+	}
+	case 0x0f:	// varchar
+	case 0x10:	// bit
+	case 0xf5:	// json
+	case 0xf7:	// enum
+	case 0xf8:	// set
+	case 0xf9:	// tiny blob
+	case 0xfa:	// medium blob
+	case 0xfb:	// long blob
+	case 0xfc:	// blob
+	case 0xfd:	// var string
+	case 0xfe:	// string
+	case 0xff: {	// geometry
+		size_t len = (size_t)readlength(L, r);
+		const char * p = (const char *)readn(L, r, len);
+		lua_pushlstring(L, p, len);
+		break;
+	}
+	default:
+		luaL_error(L, "Unsupported field type %d", type);
+	}
+}
+
+// 解码一行，压入行表； names 为列名表在栈上的位置，为 0 时返回数组
+static void
+binaryrow(lua_State *L, struct reader *r, const uint8_t *layout, int ncols, int names) {
+	// 0x00 头，然后是空位图（前两位保留）
+	size_t nullsz = (ncols + 9) / 8;
+	readn(L, r, 1);
+	const uint8_t * nullmap = readn(L, r, nullsz);
+	if (names == 0) {
+		lua_createtable(L, ncols, 0);
+	} else {
+		lua_createtable(L, 0, ncols);
+	}
+	int i;
+	for (i=0;i<ncols;i++) {
+		int bit = i + 2;
+		if (nullmap[bit / 8] & (1 << (bit % 8)))
+			continue;
+		pushvalue(L, r, layout[i*2], layout[i*2+1]);
+		if (names == 0) {
+			lua_rawseti(L, -2, i+1);
+		} else {
+			lua_rawgeti(L, names, i+1);
+			lua_insert(L, -2);
+			lua_rawset(L, -3);
+		}
+	}
+}
+
+/*
+	string packet
+	string layout : 每列两个字节，类型和是否有符号
+	table names : 列名，为 nil 时返回数组
+	return row
+ */
+static int
+lbinaryrow(lua_State *L) {
+	struct reader r;
+	size_t layoutsz;
+	r.ptr = (const uint8_t *)luaL_checklstring(L, 1, &r.sz);
+	const uint8_t * layout = (const uint8_t *)luaL_checklstring(L, 2, &layoutsz);
+	int compact = lua_isnoneornil(L, 3);
+	if (!compact) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+	}
+	binaryrow(L, &r, layout, (int)(layoutsz / 2), compact ? 0 : 3);
+	return 1;
+}
+
+// 文本协议中转成数字的类型，和 mysql.lua 以前的 converters 一致
+static int
+isnumber(int type) {
+	switch (type) {
+	case TYPE_TINY:
+	case TYPE_SHORT:
+	case TYPE_LONG:
+	case TYPE_FLOAT:
+	case TYPE_DOUBLE:
+	case TYPE_LONGLONG:
+	case TYPE_INT24:
+	case TYPE_YEAR:
+	case TYPE_NEWDECIMAL:
+		return 1;
+	}
+	return 0;
+}
+
+// 文本协议（COM_QUERY 的结果集）的一行：每列是一个长度编码的字符串， 0xfb 表示 NULL
+static void
+textrow(lua_State *L, struct reader *r, const uint8_t *layout, int ncols, int names) {
+	if (names == 0) {
+		lua_createtable(L, ncols, 0);
+	} else {
+		lua_createtable(L, 0, ncols);
+	}
+	int i;
+	for (i=0;i<ncols;i++) {
+		if (r->sz > 0 && r->ptr[0] == 0xfb) {
+			// NULL
+			readn(L, r, 1);
+			continue;
+		}
+		size_t len = (size_t)readlength(L, r);
+		const char * p = (const char *)readn(L, r, len);
+		lua_pushlstring(L, p, len);
+		if (isnumber(layout[i*2])) {
+			if (lua_stringtonumber(L, lua_tostring(L, -1))) {
+				lua_replace(L, -2);
+			} else {
+				lua_pop(L, 1);
+				lua_pushnil(L);
+			}
+		}
+		if (names == 0) {
+			lua_rawseti(L, -2, i+1);
+		} else {
+			lua_rawgeti(L, names, i+1);
+			lua_insert(L, -2);
+			lua_rawset(L, -3);
+		}
+	}
+}
+
+/*
+	string packet
+	string layout : 同 binaryrow
+	table names : 列名，为 nil 时返回数组
+	return row
+ */
+static int
+ltextrow(lua_State *L) {
+	struct reader r;
+	size_t layoutsz;
+	r.ptr = (const uint8_t *)luaL_checklstring(L, 1, &r.sz);
+	const uint8_t * layout = (const uint8_t *)luaL_checklstring(L, 2, &layoutsz);
+	int compact = lua_isnoneornil(L, 3);
+	if (!compact) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+	}
+	textrow(L, &r, layout, (int)(layoutsz / 2), compact ? 0 : 3);
+	return 1;
+}
+
+/*
+	string raw : mysql.lua 的 rawquery / rawexecute 返回的结果集，格式为
+		uint8 binary : 1 为二进制协议， 0 为文本协议
+		uint8 compact : 1 表示行是数组，没有列名
+		uint16 layoutsz, layout : 同 binaryrow
+		每个列名 uint16 len, name （compact 时没有）
+		每行 uint32 len, packet
+	return rows
+ */
+static int
+ldecode(lua_State *L) {
+	struct reader r;
+	r.ptr = (const uint8_t *)luaL_checklstring(L, 1, &r.sz);
+	lua_settop(L, 1);
+	const uint8_t * h = readn(L, &r, 2);
+	int binary = h[0];
+	int compact = h[1];
+	size_t layoutsz = (size_t)readint(L, &r, 2);
+	const uint8_t * layout = readn(L, &r, layoutsz);
+	int ncols = (int)(layoutsz / 2);
+	int names = 0;
+	int i;
+	if (!compact) {
+		lua_createtable(L, ncols, 0);
+		for (i=0;i<ncols;i++) {
+			size_t len = (size_t)readint(L, &r, 2);
+			const char * name = (const char *)readn(L, &r, len);
+			lua_pushlstring(L, name, len);
+			lua_rawseti(L, -2, i+1);
+		}
+		names = 2;
+	}
+	lua_newtable(L);
+	int n = 0;
+	while (r.sz > 0) {
+		size_t len = (size_t)readint(L, &r, 4);
+		struct reader row = { readn(L, &r, len), len };
+		if (binary) {
+			binaryrow(L, &row, layout, ncols, names);
+		} else {
+			textrow(L, &row, layout, ncols, names);
+		}
+		lua_rawseti(L, -2, ++n);
+	}
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_skynet_mysql_core(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "binaryrow", lbinaryrow },
+		{ "textrow", ltextrow },
+		{ "decode", ldecode },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
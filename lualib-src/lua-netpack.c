@@ -3,6 +3,7 @@
 #include "skynet_malloc.h"
 
 #include "skynet_socket.h"
+#include "framing.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -14,7 +15,7 @@
 
 // 队列和哈希表大小定义
 #define QUEUESIZE 1024  // 队列大小
-#define HASHSIZE 4096   // 哈希表大小
+#define HASHSIZE 64     // 哈希表初始大小
 #define SMALLSTRING 2048 // 小字符串大小
 
 // 网络包类型定义
@@ -25,10 +26,12 @@
 #define TYPE_CLOSE 5    // 连接关闭
 #define TYPE_WARNING 6  // 警告
 #define TYPE_INIT 7     // 初始化
+#define TYPE_BATCH 8    // 批量数据，完整的包都在队列中
 
 /*
 	Each package is uint16 + data , uint16 (serialized in big-endian) is the number of bytes comprising the data .
 	每个包的格式是 uint16 + data，uint16（大端序）表示数据的字节数。
+	用 netpack.new(spec) 创建的队列可以指定其它分包方式，见 framing.h
  */
 
 // 网络包结构
@@ -41,9 +44,11 @@ struct netpack {
 // 未完成的包结构
 struct uncomplete {
 	struct netpack pack;        // 网络包
-	struct uncomplete * next;   // 链表下一个节点
-	int read;                   // 已读取字节数
-	int header;                 // 包头信息
+	struct uncomplete * next;   // 回收链表的下一个节点
+	int read;                   // 已读取字节数，-1 表示包头还不完整
+	int header;                 // 已缓存的包头字节数
+	struct frame frame;         // 解析出的帧头
+	uint8_t head[FRAMING_MAXHEADER];  // 不完整的包头
 };
 
 // 网络包队列结构
@@ -51,18 +56,24 @@ struct queue {
 	int cap;                            // 队列容量
 	int head;                           // 队列头
 	int tail;                           // 队列尾
-	struct uncomplete * hash[HASHSIZE]; // 未完成包的哈希表
-	struct netpack queue[QUEUESIZE];    // 完成包的队列
+	struct netpack * queue;             // 完成包的环形队列
+	struct framing framing;             // 分包方式
+	int hash_cap;                       // 哈希表槽数，2的幂
+	int hash_n;                         // 哈希表中未完成包的数量
+	struct uncomplete ** hash;          // 未完成包的开放寻址哈希表（线性探测）
+	struct uncomplete * freelist;       // 回收的未完成包结构，用next串起来
+	int nfree;                          // 回收链表的长度
 };
 
-// 清理未完成包链表
+// 回收未完成包结构，缓存的数量不超过哈希表大小
 static void
-clear_list(struct uncomplete * uc) {
-	while (uc) {
-		skynet_free(uc->pack.buffer);  // 释放包缓冲区
-		void * tmp = uc;
-		uc = uc->next;
-		skynet_free(tmp);              // 释放节点内存
+free_uncomplete(struct queue *q, struct uncomplete *uc) {
+	if (q->nfree < q->hash_cap) {
+		uc->next = q->freelist;
+		q->freelist = uc;
+		++q->nfree;
+	} else {
+		skynet_free(uc);
 	}
 }
 
@@ -75,58 +86,134 @@ lclear(lua_State *L) {
 	}
 	int i;
 	// 清理哈希表中的未完成包
-	for (i=0;i<HASHSIZE;i++) {
-		clear_list(q->hash[i]);
-		q->hash[i] = NULL;
+	for (i=0;i<q->hash_cap;i++) {
+		struct uncomplete * uc = q->hash[i];
+		if (uc) {
+			skynet_socket_recycle(uc->pack.buffer, uc->pack.size);  // 释放包缓冲区
+			free_uncomplete(q, uc);
+			q->hash[i] = NULL;
+		}
 	}
+	q->hash_n = 0;
 	// 清理队列中的完成包
 	if (q->head > q->tail) {
 		q->tail += q->cap;  // 处理环形队列的回绕
 	}
 	for (i=q->head;i<q->tail;i++) {
 		struct netpack *np = &q->queue[i % q->cap];
-		skynet_free(np->buffer);  // 释放包缓冲区
+		skynet_socket_recycle(np->buffer, np->size);  // 释放包缓冲区
 	}
 	q->head = q->tail = 0;  // 重置队列指针
 
 	return 0;
 }
 
+// 队列被回收时释放所有内存
+static int
+lrelease(lua_State *L) {
+	struct queue * q = lua_touserdata(L, 1);
+	lclear(L);
+	while (q->freelist) {
+		struct uncomplete * uc = q->freelist;
+		q->freelist = uc->next;
+		skynet_free(uc);
+	}
+	q->nfree = 0;
+	skynet_free(q->hash);
+	q->hash = NULL;
+	q->hash_cap = 0;
+	skynet_free(q->queue);
+	q->queue = NULL;
+	q->cap = 0;
+	return 0;
+}
+
 // 计算文件描述符的哈希值
 static inline int
-hash_fd(int fd) {
-	int a = fd >> 24;  // 高8位
-	int b = fd >> 12;  // 中12位
-	int c = fd;        // 全部位
-	return (int)(((uint32_t)(a + b + c)) % HASHSIZE);
+hash_fd(int fd, int cap) {
+	uint32_t h = (uint32_t)fd;
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return (int)(h & (cap - 1));
 }
 
 // 查找并移除未完成的包
 static struct uncomplete *
 find_uncomplete(struct queue *q, int fd) {
-	if (q == NULL)
+	if (q == NULL || q->hash_n == 0)
 		return NULL;
-	int h = hash_fd(fd);  // 计算哈希值
-	struct uncomplete * uc = q->hash[h];
+	int mask = q->hash_cap - 1;
+	int i = hash_fd(fd, q->hash_cap);
+	struct uncomplete * uc;
+	while ((uc = q->hash[i]) != NULL) {
+		if (uc->pack.id == fd)
+			break;
+		i = (i + 1) & mask;
+	}
 	if (uc == NULL)
 		return NULL;
-	if (uc->pack.id == fd) {
-		// 找到目标，从链表头移除
-		q->hash[h] = uc->next;
-		return uc;
-	}
-	// 在链表中查找
-	struct uncomplete * last = uc;
-	while (last->next) {
-		uc = last->next;
-		if (uc->pack.id == fd) {
-			// 找到目标，从链表中移除
-			last->next = uc->next;
-			return uc;
+	// 移除后把同一探测链上后面的元素前移，不留墓碑
+	int j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		struct uncomplete * next = q->hash[j];
+		if (next == NULL)
+			break;
+		int k = hash_fd(next->pack.id, q->hash_cap);
+		// k 不在 (i, j] 区间内时，next 可以移到空位 i
+		if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			q->hash[i] = next;
+			i = j;
 		}
-		last = uc;
 	}
-	return NULL;
+	q->hash[i] = NULL;
+	--q->hash_n;
+	return uc;
+}
+
+// 把未完成包插入哈希表，负载超过一半时扩大一倍
+static void
+insert_uncomplete(struct queue *q, struct uncomplete *uc) {
+	if ((q->hash_n + 1) * 2 > q->hash_cap) {
+		int old_cap = q->hash_cap;
+		struct uncomplete ** old = q->hash;
+		q->hash_cap = old_cap * 2;
+		q->hash = skynet_malloc(q->hash_cap * sizeof(struct uncomplete *));
+		memset(q->hash, 0, q->hash_cap * sizeof(struct uncomplete *));
+		q->hash_n = 0;
+		int i;
+		for (i=0;i<old_cap;i++) {
+			if (old[i])
+				insert_uncomplete(q, old[i]);
+		}
+		skynet_free(old);
+	}
+	int mask = q->hash_cap - 1;
+	int i = hash_fd(uc->pack.id, q->hash_cap);
+	while (q->hash[i]) {
+		i = (i + 1) & mask;
+	}
+	q->hash[i] = uc;
+	++q->hash_n;
+}
+
+// 创建队列，hint 是预计的连接数，用来决定哈希表的初始大小
+static struct queue *
+new_queue(lua_State *L, int hint) {
+	struct queue *q = lua_newuserdatauv(L, sizeof(struct queue), 0);
+	memset(q, 0, sizeof(*q));
+	q->cap = QUEUESIZE;
+	q->queue = skynet_malloc(QUEUESIZE * sizeof(struct netpack));
+	framing_init(&q->framing, NULL, FRAMING_DEFAULTMAX);
+	q->hash_cap = HASHSIZE;
+	while (q->hash_cap < hint) {
+		q->hash_cap *= 2;
+	}
+	q->hash = skynet_malloc(q->hash_cap * sizeof(struct uncomplete *));
+	memset(q->hash, 0, q->hash_cap * sizeof(struct uncomplete *));
+	luaL_setmetatable(L, "SKYNET_NETPACK");
+	return q;
 }
 
 // 获取或创建队列
@@ -135,47 +222,36 @@ get_queue(lua_State *L) {
 	struct queue *q = lua_touserdata(L,1);
 	if (q == NULL) {
 		// 创建新队列
-		q = lua_newuserdatauv(L, sizeof(struct queue), 0);
-		q->cap = QUEUESIZE;
-		q->head = 0;
-		q->tail = 0;
-		int i;
-		// 初始化哈希表
-		for (i=0;i<HASHSIZE;i++) {
-			q->hash[i] = NULL;
-		}
+		q = new_queue(L, 0);
 		lua_replace(L, 1);
 	}
 	return q;
 }
 
-// 扩展队列容量
+// 扩展队列容量，队列内存不在 userdata 中，扩展后 userdata 不变
 static void
-expand_queue(lua_State *L, struct queue *q) {
-	// 创建更大的队列
-	struct queue *nq = lua_newuserdatauv(L, sizeof(struct queue) + q->cap * sizeof(struct netpack), 0);
-	nq->cap = q->cap + QUEUESIZE;  // 增加容量
-	nq->head = 0;
-	nq->tail = q->cap;
-	// 复制哈希表
-	memcpy(nq->hash, q->hash, sizeof(nq->hash));
-	memset(q->hash, 0, sizeof(q->hash));
+expand_queue(struct queue *q) {
+	int cap = q->cap * 2;
+	struct netpack * nq = skynet_malloc(cap * sizeof(struct netpack));
 	// 复制队列数据
 	int i;
 	for (i=0;i<q->cap;i++) {
 		int idx = (q->head + i) % q->cap;
-		nq->queue[i] = q->queue[idx];
+		nq[i] = q->queue[idx];
 	}
-	q->head = q->tail = 0;
-	lua_replace(L,1);  // 替换原队列
+	skynet_free(q->queue);
+	q->queue = nq;
+	q->head = 0;
+	q->tail = q->cap;
+	q->cap = cap;
 }
 
 // 推送数据到队列
 static void
 push_data(lua_State *L, int fd, void *buffer, int size, int clone) {
 	if (clone) {
-		// 需要克隆数据
-		void * tmp = skynet_malloc(size);
+		// 需要克隆数据，从socket读缓冲池分配，和socket消息的缓冲区一起复用
+		void * tmp = skynet_socket_alloc(size);
 		memcpy(tmp, buffer, size);
 		buffer = tmp;
 	}
@@ -188,61 +264,89 @@ push_data(lua_State *L, int fd, void *buffer, int size, int clone) {
 	np->size = size;
 	if (q->head == q->tail) {
 		// 队列已满，需要扩展
-		expand_queue(L, q);
+		expand_queue(q);
 	}
 }
 
-// 保存未完成的包
+// 保存未完成的包，优先复用回收的结构
 static struct uncomplete *
 save_uncomplete(lua_State *L, int fd) {
 	struct queue *q = get_queue(L);
-	int h = hash_fd(fd);  // 计算哈希值
-	struct uncomplete * uc = skynet_malloc(sizeof(struct uncomplete));
+	struct uncomplete * uc = q->freelist;
+	if (uc) {
+		q->freelist = uc->next;
+		--q->nfree;
+	} else {
+		uc = skynet_malloc(sizeof(struct uncomplete));
+	}
 	memset(uc, 0, sizeof(*uc));
-	uc->next = q->hash[h];  // 插入到链表头
 	uc->pack.id = fd;
-	q->hash[h] = uc;
+	insert_uncomplete(q, uc);
 
 	return uc;
 }
 
-// 读取包大小（大端序）
-static inline int
-read_size(uint8_t * buffer) {
-	int r = (int)buffer[0] << 8 | (int)buffer[1];  // 大端序转换
-	return r;
+// 没有创建队列时使用默认的分包方式：2字节大端长度头
+static const struct framing default_framing = { FRAMING_LENGTH, 2, 0, 0xffff };
+
+// 返回错误，由上层关闭连接
+static int
+push_error(lua_State *L, int fd, const char * err) {
+	lua_pushvalue(L, lua_upvalueindex(TYPE_ERROR));
+	lua_pushinteger(L, fd);
+	lua_pushstring(L, err);
+	return 4;
 }
 
-// 处理更多数据包（递归处理多个包）
-static void
-push_more(lua_State *L, int fd, uint8_t *buffer, int size) {
-	if (size == 1) {
-		// 只有一个字节，保存为不完整包的头部
-		struct uncomplete * uc = save_uncomplete(L, fd);
-		uc->read = -1;        // 标记为读取头部状态
-		uc->header = *buffer; // 保存头部字节
-		return;
-	}
-	int pack_size = read_size(buffer);  // 读取包大小
-	buffer += 2;  // 跳过大小字段
-	size -= 2;
-
-	if (size < pack_size) {
-		// 数据不完整，保存到不完整包中
-		struct uncomplete * uc = save_uncomplete(L, fd);
-		uc->read = size;                           // 已读取的字节数
-		uc->pack.size = pack_size;                 // 包的总大小
-		uc->pack.buffer = skynet_malloc(pack_size); // 分配缓冲区
-		memcpy(uc->pack.buffer, buffer, size);     // 复制已有数据
-		return;
-	}
-	push_data(L, fd, buffer, pack_size, 1);  // 推送完整的数据包
-
-	buffer += pack_size;  // 移动到下一个包
-	size -= pack_size;
-	if (size > 0) {
-		push_more(L, fd, buffer, size);  // 递归处理剩余数据
+// 处理更多数据包，完整的包压入队列，剩余不完整的部分保存到不完整包中
+// base是socket消息的缓冲区，最后一个包正好到缓冲区末尾时把它移到base开头直接交出去，*keep置1表示缓冲区已经交给包
+// 出错时返回错误信息，否则返回NULL
+static const char *
+push_more(lua_State *L, int fd, const struct framing *f, uint8_t *buffer, int size, uint8_t *base, int *keep) {
+	while (size > 0) {
+		struct frame fr;
+		int hsz = framing_parse(f, buffer, size, &fr);
+		if (hsz < 0) {
+			return "Invalid frame header";
+		}
+		if (hsz == 0) {
+			// 包头不完整，缓存已收到的部分
+			struct uncomplete * uc = save_uncomplete(L, fd);
+			uc->read = -1;
+			uc->header = size;
+			memcpy(uc->head, buffer, size);
+			return NULL;
+		}
+		buffer += hsz;
+		size -= hsz;
+		if (size < fr.size) {
+			// 数据不完整，保存到不完整包中
+			struct uncomplete * uc = save_uncomplete(L, fd);
+			uc->read = size;                           // 已读取的字节数
+			uc->frame = fr;
+			uc->pack.size = fr.size;                   // 包的总大小
+			uc->pack.buffer = skynet_socket_alloc(fr.size);  // 从读缓冲池分配缓冲区
+			memcpy(uc->pack.buffer, buffer, size);     // 复制已有数据
+			return NULL;
+		}
+		if (fr.kind == FRAME_CLOSE) {
+			return "websocket close";
+		}
+		if (fr.kind == FRAME_DATA) {
+			framing_unmask(&fr, buffer, fr.size, 0);
+			if (size == fr.size) {
+				// 前面的包都已经复制出去了，最后一个包就地移到缓冲区开头，不用再分配
+				memmove(base, buffer, size);
+				push_data(L, fd, base, size, 0);
+				*keep = 1;
+				return NULL;
+			}
+			push_data(L, fd, buffer, fr.size, 1);  // 推送完整的数据包
+		}
+		buffer += fr.size;  // 移动到下一个包
+		size -= fr.size;
 	}
+	return NULL;
 }
 
 // 关闭不完整的连接，释放相关资源
@@ -251,117 +355,181 @@ close_uncomplete(lua_State *L, int fd) {
 	struct queue *q = lua_touserdata(L,1);
 	struct uncomplete * uc = find_uncomplete(q, fd);  // 查找不完整包
 	if (uc) {
-		skynet_free(uc->pack.buffer);  // 释放缓冲区
-		skynet_free(uc);               // 释放不完整包结构
+		skynet_socket_recycle(uc->pack.buffer, uc->pack.size);  // 缓冲区放回读缓冲池
+		free_uncomplete(q, uc);        // 回收不完整包结构
 	}
 }
 
 // 过滤数据的核心函数（处理不完整包的拼接）
 static int
-filter_data_(lua_State *L, int fd, uint8_t * buffer, int size) {
+filter_data_(lua_State *L, int fd, uint8_t * buffer, int size, int *keep) {
+	uint8_t * base = buffer;
 	struct queue *q = lua_touserdata(L,1);
+	// 还没有队列时使用默认的分包方式
+	struct framing f = q ? q->framing : default_framing;
+	// 记下队列位置，用来判断是否有新的完整包入队
+	int head = q ? q->head : 0;
+	int tail = q ? q->tail : 0;
 	struct uncomplete * uc = find_uncomplete(q, fd);  // 查找不完整包
 	if (uc) {
 		// fill uncomplete
 		// 填充不完整包
 		if (uc->read < 0) {
 			// read size
-			// 读取包大小
-			assert(uc->read == -1);
-			int pack_size = *buffer;           // 低字节
-			pack_size |= uc->header << 8 ;     // 高字节（之前保存的）
-			++buffer;
-			--size;
-			uc->pack.size = pack_size;                 // 设置包大小
-			uc->pack.buffer = skynet_malloc(pack_size); // 分配缓冲区
-			uc->read = 0;                              // 重置读取位置
+			// 补齐包头
+			int n = FRAMING_MAXHEADER - uc->header;
+			if (n > size)
+				n = size;
+			memcpy(uc->head + uc->header, buffer, n);
+			int hsz = framing_parse(&f, uc->head, uc->header + n, &uc->frame);
+			if (hsz == 0) {
+				// 包头仍然不完整
+				uc->header += n;
+				insert_uncomplete(q, uc);  // 重新插入哈希表
+				return 1;
+			}
+			if (hsz < 0) {
+				free_uncomplete(q, uc);
+				return push_error(L, fd, "Invalid frame header");
+			}
+			hsz -= uc->header;   // 本次数据中属于包头的字节数
+			buffer += hsz;
+			size -= hsz;
+			uc->pack.size = uc->frame.size;                 // 设置包大小
+			uc->pack.buffer = skynet_socket_alloc(uc->pack.size); // 从读缓冲池分配缓冲区
+			uc->read = 0;                                   // 重置读取位置
 		}
 		int need = uc->pack.size - uc->read;  // 还需要的字节数
 		if (size < need) {
 			// 数据仍然不够，继续保存
 			memcpy(uc->pack.buffer + uc->read, buffer, size);
 			uc->read += size;
-			int h = hash_fd(fd);
-			uc->next = q->hash[h];  // 重新插入哈希表
-			q->hash[h] = uc;
+			insert_uncomplete(q, uc);  // 重新插入哈希表
 			return 1;
 		}
 		// 数据足够完成这个包
 		memcpy(uc->pack.buffer + uc->read, buffer, need);
 		buffer += need;
 		size -= need;
-		if (size == 0) {
-			// 正好完成一个包
-			lua_pushvalue(L, lua_upvalueindex(TYPE_DATA));
-			lua_pushinteger(L, fd);
-			lua_pushlightuserdata(L, uc->pack.buffer);
-			lua_pushinteger(L, uc->pack.size);
-			skynet_free(uc);  // 释放不完整包结构
-			return 5;
+		struct netpack pack = uc->pack;
+		struct frame fr = uc->frame;
+		free_uncomplete(q, uc);  // 回收不完整包结构
+		if (fr.kind != FRAME_DATA) {
+			// 控制帧不交给上层
+			skynet_socket_recycle(pack.buffer, pack.size);
+			if (fr.kind == FRAME_CLOSE) {
+				return push_error(L, fd, "websocket close");
+			}
+			if (size == 0) {
+				return 1;
+			}
+		} else {
+			framing_unmask(&fr, pack.buffer, pack.size, 0);
+			if (size == 0) {
+				// 正好完成一个包
+				lua_pushvalue(L, lua_upvalueindex(TYPE_DATA));
+				lua_pushinteger(L, fd);
+				lua_pushlightuserdata(L, pack.buffer);
+				lua_pushinteger(L, pack.size);
+				return 5;
+			}
+			// more data
+			// 还有更多数据，先推送完成的包
+			push_data(L, fd, pack.buffer, pack.size, 0);
 		}
-		// more data
-		// 还有更多数据
-		push_data(L, fd, uc->pack.buffer, uc->pack.size, 0);  // 推送完成的包
-		skynet_free(uc);                                      // 释放不完整包结构
-		push_more(L, fd, buffer, size);                       // 处理剩余数据
-		lua_pushvalue(L, lua_upvalueindex(TYPE_MORE));
-		return 2;
 	} else {
 		// 没有不完整包，处理新数据
-		if (size == 1) {
-			// 只有一个字节，保存为不完整包头部
-			struct uncomplete * uc = save_uncomplete(L, fd);
-			uc->read = -1;        // 标记为读取头部状态
-			uc->header = *buffer; // 保存头部字节
-			return 1;
-		}
-		int pack_size = read_size(buffer);  // 读取包大小
-		buffer+=2;
-		size-=2;
-
-		if (size < pack_size) {
-			// 数据不完整，保存为不完整包
-			struct uncomplete * uc = save_uncomplete(L, fd);
-			uc->read = size;                           // 已读取字节数
-			uc->pack.size = pack_size;                 // 包总大小
-			uc->pack.buffer = skynet_malloc(pack_size); // 分配缓冲区
-			memcpy(uc->pack.buffer, buffer, size);     // 复制数据
-			return 1;
-		}
-		if (size == pack_size) {
+		struct frame fr;
+		int hsz = framing_parse(&f, buffer, size, &fr);
+		if (hsz > 0 && fr.kind == FRAME_DATA && hsz + fr.size == size) {
 			// just one package
 			// 正好一个完整包
+			// 去掉包头后就地交出socket消息的缓冲区，不再分配新的
+			size -= hsz;
+			framing_unmask(&fr, buffer + hsz, size, 0);
+			memmove(base, buffer + hsz, size);
 			lua_pushvalue(L, lua_upvalueindex(TYPE_DATA));
 			lua_pushinteger(L, fd);
-			void * result = skynet_malloc(pack_size);  // 分配结果缓冲区
-			memcpy(result, buffer, size);              // 复制数据
-			lua_pushlightuserdata(L, result);
+			lua_pushlightuserdata(L, base);
 			lua_pushinteger(L, size);
+			*keep = 1;
 			return 5;
 		}
-		// more data
-		// 有多个包
-		push_data(L, fd, buffer, pack_size, 1);  // 推送第一个包
-		buffer += pack_size;
-		size -= pack_size;
-		push_more(L, fd, buffer, size);          // 处理剩余数据
-		lua_pushvalue(L, lua_upvalueindex(TYPE_MORE));
-		return 2;
 	}
+	const char * err = push_more(L, fd, &f, buffer, size, base, keep);  // 处理剩余数据
+	if (err) {
+		return push_error(L, fd, err);
+	}
+	q = lua_touserdata(L,1);
+	if (q == NULL || (q->head == head && q->tail == tail)) {
+		// 没有新的完整包
+		return 1;
+	}
+	lua_pushvalue(L, lua_upvalueindex(TYPE_MORE));
+	return 2;
 }
 
 // 过滤数据的包装函数（负责释放缓冲区）
 static inline int
 filter_data(lua_State *L, int fd, uint8_t * buffer, int size) {
-	int ret = filter_data_(L, fd, buffer, size);
+	int keep = 0;
+	int ret = filter_data_(L, fd, buffer, size, &keep);
 	// buffer is the data of socket message, it malloc at socket_server.c : function forward_message .
 	// it should be free before return,
 	// 缓冲区是套接字消息的数据，在 socket_server.c 的 forward_message 函数中分配
-	// 返回前应该释放
-	skynet_free(buffer);
+	// 返回前应该释放，放回读缓冲池；如果最后一个包直接用了这个缓冲区，由包的使用者释放
+	if (!keep)
+		skynet_socket_recycle(buffer, size);
 	return ret;
 }
 
+// 过滤批量消息中的每条数据，完整的包都压入队列
+// 出错的连接放在 fd->错误信息 的表中一起返回，同一批里这个连接后面的数据丢弃
+static int
+filter_batch(lua_State *L, struct skynet_socket_message *item, int n) {
+	lua_pushnil(L);	// 错误表，位置2
+	int more = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		int fd = item[i].id;
+		if (!lua_isnil(L, 2)) {
+			if (lua_rawgeti(L, 2, fd) != LUA_TNIL) {
+				lua_pop(L, 1);
+				skynet_socket_recycle(item[i].buffer, item[i].ud);
+				continue;
+			}
+			lua_pop(L, 1);
+		}
+		int top = lua_gettop(L);
+		int ret = filter_data(L, fd, (uint8_t *)item[i].buffer, item[i].ud);
+		switch (ret) {
+		case 5:
+			// 单独的完整包也放进队列
+			push_data(L, fd, lua_touserdata(L, top+3), (int)lua_tointeger(L, top+4), 0);
+			more = 1;
+			break;
+		case 4:
+			if (lua_isnil(L, 2)) {
+				lua_newtable(L);
+				lua_replace(L, 2);
+			}
+			lua_pushvalue(L, top+3);
+			lua_rawseti(L, 2, fd);
+			break;
+		case 2:
+			more = 1;
+			break;
+		}
+		lua_settop(L, top);
+	}
+	if (!more && lua_isnil(L, 2)) {
+		return 1;
+	}
+	lua_pushvalue(L, lua_upvalueindex(TYPE_BATCH));
+	lua_insert(L, 2);
+	return 3;
+}
+
 // 推送字符串到 Lua 栈
 static void
 pushstring(lua_State *L, const char * msg, int size) {
@@ -381,6 +549,7 @@ pushstring(lua_State *L, const char * msg, int size) {
 		integer type
 		integer fd
 		string msg | lightuserdata/integer
+	批量消息返回 queue "batch" errors，errors 是 fd->错误信息 的表或者nil
  */
 // Lua 接口：过滤套接字消息
 static int
@@ -404,6 +573,9 @@ lfilter(lua_State *L) {
 		assert(size == -1);	// never padding string
 		                    // 从不填充字符串
 		return filter_data(L, message->id, (uint8_t *)buffer, message->ud);
+	case SKYNET_SOCKET_TYPE_BATCH:
+		// 数据紧跟在消息头后面，message->id 是数量
+		return filter_batch(L, (struct skynet_socket_message *)(message+1), message->id);
 	case SKYNET_SOCKET_TYPE_CONNECT:
 		// 连接建立
 		lua_pushvalue(L, lua_upvalueindex(TYPE_INIT));
@@ -522,6 +694,58 @@ lpack(lua_State *L) {
 	return 2;
 }
 
+/*
+	string spec
+	string msg | lightuserdata/integer
+
+	按 spec 指定的分包方式打包数据
+ */
+static int
+lpackframe(lua_State *L) {
+	struct framing f;
+	const char * spec = luaL_checkstring(L, 1);
+	if (framing_init(&f, spec, FRAMING_DEFAULTMAX)) {
+		return luaL_error(L, "Invalid framing : %s", spec);
+	}
+	size_t len;
+	const char * ptr = tolstring(L, &len, 2);
+	if (len > (size_t)f.max) {
+		return luaL_error(L, "Invalid size (too long) of data : %d", (int)len);
+	}
+	uint8_t header[FRAMING_MAXHEADER];
+	int hsz = framing_write(&f, header, len);
+	uint8_t * buffer = skynet_malloc(len + hsz);
+	memcpy(buffer, header, hsz);
+	memcpy(buffer+hsz, ptr, len);
+
+	lua_pushlightuserdata(L, buffer);
+	lua_pushinteger(L, len + hsz);
+
+	return 2;
+}
+
+/*
+	string spec
+	integer hint
+	return
+		userdata queue
+
+	创建使用指定分包方式的队列，作为 filter 的第一个参数
+	hint 是预计的连接数，用来决定未完成包哈希表的初始大小
+ */
+static int
+lnew(lua_State *L) {
+	struct framing f;
+	const char * spec = luaL_optstring(L, 1, NULL);
+	int hint = luaL_optinteger(L, 2, 0);
+	if (framing_init(&f, spec, FRAMING_DEFAULTMAX)) {
+		return luaL_error(L, "Invalid framing : %s", spec);
+	}
+	struct queue *q = new_queue(L, hint);
+	q->framing = f;
+	return 1;
+}
+
 // Lua 接口：用户数据转字符串
 static int
 ltostring(lua_State *L) {
@@ -543,12 +767,20 @@ luaopen_skynet_netpack(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "pop", lpop },           // 弹出数据包
 		{ "pack", lpack },         // 打包数据
+		{ "packframe", lpackframe }, // 按指定分包方式打包数据
+		{ "new", lnew },           // 创建指定分包方式的队列
 		{ "clear", lclear },       // 清理队列
 		{ "tostring", ltostring }, // 转换为字符串
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
 
+	// 队列被回收时释放哈希表和环形队列的内存
+	luaL_newmetatable(L, "SKYNET_NETPACK");
+	lua_pushcfunction(L, lrelease);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
 	// the order is same with macros : TYPE_* (defined top)
 	// 顺序与顶部定义的 TYPE_* 宏相同
 	lua_pushliteral(L, "data");     // TYPE_DATA
@@ -558,9 +790,10 @@ luaopen_skynet_netpack(lua_State *L) {
 	lua_pushliteral(L, "close");    // TYPE_CLOSE
 	lua_pushliteral(L, "warning");  // TYPE_WARNING
 	lua_pushliteral(L, "init");     // TYPE_INIT
+	lua_pushliteral(L, "batch");    // TYPE_BATCH
 
-	// 创建 filter 函数（带7个上值）
-	lua_pushcclosure(L, lfilter, 7);
+	// 创建 filter 函数（带8个上值）
+	lua_pushcclosure(L, lfilter, 8);
 	lua_setfield(L, -2, "filter");
 
 	return 1;
@@ -0,0 +1,598 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+	Redis RESP2/RESP3 协议的编码和解码，见 skynet/db/redis.lua
+ */
+
+#define MAXDEPTH 64
+
+struct reply {
+	const char * buf;
+	size_t sz;
+	size_t pos;
+	size_t need;	// 数据不完整时，至少还缺的字节数
+	int err;	// 遇到错误回复
+};
+
+// 读一行，返回行首，len 为不含 \r\n 的长度；不完整时返回 NULL
+static const char *
+readline(struct reply *r, size_t *len) {
+	const char * p = r->buf + r->pos;
+	size_t left = r->sz - r->pos;
+	const char * nl = memchr(p, '\n', left);
+	if (nl == NULL) {
+		r->need = 1;
+		return NULL;
+	}
+	*len = nl - p;
+	if (*len == 0 || p[*len - 1] != '\r') {
+		r->need = 0;
+		return NULL;
+	}
+	--*len;
+	r->pos += *len + 2;
+	return p;
+}
+
+static long long
+tolength(lua_State *L, const char *p, size_t len) {
+	char tmp[32];
+	if (len == 0 || len >= sizeof(tmp))
+		luaL_error(L, "Invalid redis reply");
+	memcpy(tmp, p, len);
+	tmp[len] = 0;
+	char * end;
+	long long v = strtoll(tmp, &end, 10);
+	if (*end != 0)
+		luaL_error(L, "Invalid redis reply");
+	return v;
+}
+
+static int decode(lua_State *L, struct reply *r, int depth);
+
+// 解码 n 个值，放入栈顶的表，map 时成对作为键值
+static int
+decode_aggregate(lua_State *L, struct reply *r, long long n, int map, int depth) {
+	long long i;
+	if (map) {
+		lua_createtable(L, 0, n > 64 ? 64 : (int)n);
+		for (i=0;i<n;i++) {
+			if (!decode(L, r, depth+1))
+				return 0;
+			if (!decode(L, r, depth+1))
+				return 0;
+			if (lua_isnil(L, -2)) {
+				lua_pop(L, 2);
+			} else {
+				lua_rawset(L, -3);
+			}
+		}
+	} else {
+		lua_createtable(L, n > 1024 ? 1024 : (int)n, 0);
+		for (i=0;i<n;i++) {
+			if (!decode(L, r, depth+1))
+				return 0;
+			lua_rawseti(L, -2, (lua_Integer)i+1);
+		}
+	}
+	return 1;
+}
+
+// 成功时把值压栈并返回 1 ，不完整返回 0
+static int
+decode(lua_State *L, struct reply *r, int depth) {
+	if (depth > MAXDEPTH)
+		return luaL_error(L, "Redis reply is too deep");
+	luaL_checkstack(L, 4, NULL);
+	size_t len;
+	const char * line = readline(r, &len);
+	if (line == NULL) {
+		if (r->need == 0)
+			return luaL_error(L, "Invalid redis reply");
+		return 0;
+	}
+	const char * data = line + 1;
+	size_t dlen = len - 1;
+	switch (line[0]) {
+	case '+':	// simple string
+		lua_pushlstring(L, data, dlen);
+		return 1;
+	case '-':	// error
+		r->err = 1;
+		lua_pushlstring(L, data, dlen);
+		return 1;
+	case ':':	// integer
+		lua_pushinteger(L, (lua_Integer)tolength(L, data, dlen));
+		return 1;
+	case '$':	// bulk string
+	case '!':	// blob error
+	case '=': {	// verbatim string
+		long long n = tolength(L, data, dlen);
+		if (n < 0) {
+			lua_pushnil(L);
+			return 1;
+		}
+		size_t left = r->sz - r->pos;
+		if (left < (size_t)n + 2) {
+			r->need = (size_t)n + 2 - left;
+			return 0;
+		}
+		const char * p = r->buf + r->pos;
+		r->pos += n + 2;
+		if (line[0] == '=' && n >= 4) {
+			// 去掉 "txt:" 这样的格式前缀
+			p += 4;
+			n -= 4;
+		} else if (line[0] == '!') {
+			r->err = 1;
+		}
+		lua_pushlstring(L, p, n);
+		return 1;
+	}
+	case '*':	// array
+	case '~':	// set
+	case '>': {	// push
+		long long n = tolength(L, data, dlen);
+		if (n < 0) {
+			lua_pushnil(L);
+			return 1;
+		}
+		return decode_aggregate(L, r, n, 0, depth);
+	}
+	case '%': {	// map
+		long long n = tolength(L, data, dlen);
+		return decode_aggregate(L, r, n, 1, depth);
+	}
+	case '|': {	// attribute ，丢弃后读后面的值
+		long long n = tolength(L, data, dlen);
+		if (!decode_aggregate(L, r, n, 1, depth))
+			return 0;
+		lua_pop(L, 1);
+		return decode(L, r, depth+1);
+	}
+	case '_':	// null
+		lua_pushnil(L);
+		return 1;
+	case '#':	// boolean
+		lua_pushboolean(L, dlen > 0 && data[0] == 't');
+		return 1;
+	case ',': {	// double
+		lua_pushlstring(L, data, dlen);
+		if (lua_stringtonumber(L, lua_tostring(L, -1))) {
+			lua_replace(L, -2);
+		} else if (dlen == 3 && memcmp(data, "inf", 3) == 0) {
+			lua_pushnumber(L, HUGE_VAL);
+			lua_replace(L, -2);
+		} else if (dlen == 4 && memcmp(data, "-inf", 4) == 0) {
+			lua_pushnumber(L, -HUGE_VAL);
+			lua_replace(L, -2);
+		}
+		return 1;
+	}
+	case '(':	// big number ，放不下时保留字符串
+		lua_pushlstring(L, data, dlen);
+		if (lua_stringtonumber(L, lua_tostring(L, -1))) {
+			lua_replace(L, -2);
+		}
+		return 1;
+	default:
+		return luaL_error(L, "Invalid redis reply type %c", line[0]);
+	}
+}
+
+/*
+	string buffer
+	integer pos
+	return ok, value, nextpos ; 不完整时返回 nil, need
+	ok 为 false 表示回复（或数组中的某个元素）是错误
+ */
+static int
+ldecode(lua_State *L) {
+	struct reply r;
+	r.buf = luaL_checklstring(L, 1, &r.sz);
+	r.pos = (size_t)luaL_optinteger(L, 2, 1) - 1;
+	r.need = 0;
+	r.err = 0;
+	if (r.pos > r.sz)
+		return luaL_error(L, "Invalid pos");
+	lua_settop(L, 2);
+	if (!decode(L, &r, 0)) {
+		lua_settop(L, 2);
+		lua_pushnil(L);
+		lua_pushinteger(L, r.need);
+		return 2;
+	}
+	lua_pushboolean(L, !r.err);
+	lua_replace(L, 1);
+	lua_replace(L, 2);
+	lua_pushinteger(L, r.pos + 1);
+	return 3;
+}
+
+// 分块到达的大回复，先用 scanner 逐块确认完整，再一次解码，避免每块都从头解码
+// 只有带长度的头部才缓存（类型加长度），简单类型的行不管多长都直接跳到 \n
+struct scanner {
+	int depth;
+	long long bulk;	// 还要跳过的 bulk 字节（含 \r\n）
+	int skip;	// 正在跳过一个简单类型的行
+	char last;	// 跳过时的前一个字符，用来检查 \r\n
+	int linelen;
+	char line[32];
+	long long remain[MAXDEPTH+1];	// 每层还剩的元素个数
+	char attr[MAXDEPTH+1];	// 这一层是 attribute ，完成后不算作上层的元素
+};
+
+static void
+scanner_init(struct scanner *sc) {
+	sc->depth = 0;
+	sc->bulk = 0;
+	sc->skip = 0;
+	sc->linelen = 0;
+	sc->remain[0] = 1;
+	sc->attr[0] = 0;
+}
+
+// 完成一个元素，返回 1 表示整个回复完整
+static int
+scanner_done(struct scanner *sc) {
+	for (;;) {
+		if (--sc->remain[sc->depth] > 0)
+			return 0;
+		if (sc->depth == 0)
+			return 1;
+		int attr = sc->attr[sc->depth];
+		--sc->depth;
+		if (attr)
+			return 0;
+	}
+}
+
+static int
+scanner_push(lua_State *L, struct scanner *sc, long long n, int attr) {
+	if (sc->depth >= MAXDEPTH)
+		return luaL_error(L, "Redis reply is too deep");
+	++sc->depth;
+	sc->remain[sc->depth] = n;
+	sc->attr[sc->depth] = attr;
+	return 0;
+}
+
+static int
+simple_type(char type) {
+	switch (type) {
+	case '+': case '-': case ':': case '_': case '#': case ',': case '(':
+		return 1;
+	}
+	return 0;
+}
+
+// 处理一行带长度的头部，返回 1 表示整个回复完整
+static int
+scanner_line(lua_State *L, struct scanner *sc) {
+	char type = sc->line[0];
+	long long n = tolength(L, sc->line + 1, sc->linelen - 1);
+	switch (type) {
+	case '$': case '!': case '=':
+		if (n < 0)
+			return scanner_done(sc);
+		sc->bulk = n + 2;
+		return 0;
+	case '*': case '~': case '>':
+		if (n <= 0)
+			return scanner_done(sc);
+		return scanner_push(L, sc, n, 0);
+	case '%':
+		if (n <= 0)
+			return scanner_done(sc);
+		return scanner_push(L, sc, n * 2, 0);
+	case '|':
+		if (n > 0)
+			scanner_push(L, sc, n * 2, 1);
+		return 0;
+	}
+	return luaL_error(L, "Invalid redis reply type %c", type);
+}
+
+/*
+	userdata scanner
+	string chunk
+	boolean init : 新回复的第一块
+	return 回复在这一块中结束的位置（字节数），不完整时返回 nil
+ */
+static int
+lscan(lua_State *L) {
+	struct scanner * sc = luaL_checkudata(L, 1, "REDIS_SCANNER");
+	size_t sz;
+	const char * p = luaL_checklstring(L, 2, &sz);
+	if (lua_toboolean(L, 3))
+		scanner_init(sc);
+	size_t i = 0;
+	while (i < sz) {
+		if (sc->bulk > 0) {
+			size_t left = sz - i;
+			if ((long long)left < sc->bulk) {
+				sc->bulk -= left;
+				break;
+			}
+			i += sc->bulk;
+			sc->bulk = 0;
+			if (scanner_done(sc)) {
+				lua_pushinteger(L, i);
+				return 1;
+			}
+			continue;
+		}
+		char c = p[i++];
+		if (sc->skip) {
+			if (c != '\n') {
+				sc->last = c;
+				continue;
+			}
+			if (sc->last != '\r')
+				return luaL_error(L, "Invalid redis reply");
+			sc->skip = 0;
+			if (scanner_done(sc)) {
+				lua_pushinteger(L, i);
+				return 1;
+			}
+			continue;
+		}
+		if (c != '\n') {
+			if (sc->linelen == 0 && simple_type(c)) {
+				sc->skip = 1;
+				sc->last = c;
+				continue;
+			}
+			if (sc->linelen >= (int)sizeof(sc->line))
+				return luaL_error(L, "Invalid redis reply");
+			sc->line[sc->linelen++] = c;
+			continue;
+		}
+		if (sc->linelen < 2 || sc->line[sc->linelen-1] != '\r')
+			return luaL_error(L, "Invalid redis reply");
+		sc->linelen--;
+		int done = scanner_line(L, sc);
+		sc->linelen = 0;
+		if (done) {
+			lua_pushinteger(L, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+lscanner(lua_State *L) {
+	struct scanner * sc = lua_newuserdatauv(L, sizeof(*sc), 0);
+	scanner_init(sc);
+	luaL_newmetatable(L, "REDIS_SCANNER");
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int
+formatlength(char *tmp, char type, size_t n) {
+	int len = 0;
+	tmp[len++] = type;
+	char digits[24];
+	int d = 0;
+	do {
+		digits[d++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (d > 0) {
+		tmp[len++] = digits[--d];
+	}
+	tmp[len++] = '\r';
+	tmp[len++] = '\n';
+	return len;
+}
+
+static void
+addlength(luaL_Buffer *b, char type, size_t n) {
+	char tmp[32];
+	luaL_addlstring(b, tmp, formatlength(tmp, type, n));
+}
+
+/*
+	编码并弹出栈顶的值
+	使用 buffer 时 buffer 之上不能有别的值，所以转换出的字符串先放在 buffer 下面的 scratch 位置
+ */
+static void
+addvalue(lua_State *L, luaL_Buffer *b, int scratch) {
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		luaL_addstring(b, "$-1\r\n");
+		return;
+	}
+	luaL_tolstring(L, -1, NULL);
+	lua_replace(L, scratch);
+	lua_pop(L, 1);
+	size_t sz;
+	const char * str = lua_tolstring(L, scratch, &sz);
+	addlength(b, '$', sz);
+	luaL_addlstring(b, str, sz);
+	luaL_addlstring(b, "\r\n", 2);
+}
+
+// 把栈上 index 处的表（可以有 n 字段）编码成一条命令，prefix 不为空时作为命令名
+static void
+addcommand(lua_State *L, luaL_Buffer *b, const char *prefix, size_t psz, int index, int scratch) {
+	lua_Integer n;
+	if (lua_getfield(L, index, "n") == LUA_TNUMBER) {
+		n = lua_tointeger(L, -1);
+	} else {
+		n = luaL_len(L, index);
+	}
+	lua_pop(L, 1);
+	addlength(b, '*', n + (prefix ? 1 : 0));
+	if (prefix) {
+		addlength(b, '$', psz);
+		luaL_addlstring(b, prefix, psz);
+		luaL_addlstring(b, "\r\n", 2);
+	}
+	lua_Integer i;
+	for (i=1;i<=n;i++) {
+		lua_geti(L, index, i);
+		addvalue(L, b, scratch);
+	}
+}
+
+/*
+	string cmd
+	table args / value
+	return string
+ */
+static int
+lencode(lua_State *L) {
+	size_t sz;
+	const char * cmd = luaL_checklstring(L, 1, &sz);
+	// 3 号位置是 scratch
+	lua_settop(L, 3);
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	switch (lua_type(L, 2)) {
+	case LUA_TNIL:
+		addlength(&b, '*', 1);
+		addlength(&b, '$', sz);
+		luaL_addlstring(&b, cmd, sz);
+		luaL_addlstring(&b, "\r\n", 2);
+		break;
+	case LUA_TTABLE:
+		addcommand(L, &b, cmd, sz, 2, 3);
+		break;
+	default:
+		addlength(&b, '*', 2);
+		addlength(&b, '$', sz);
+		luaL_addlstring(&b, cmd, sz);
+		luaL_addlstring(&b, "\r\n", 2);
+		lua_pushvalue(L, 2);
+		addvalue(L, &b, 3);
+		break;
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+	table ops : { { cmd, args... }, ... }
+	return string ，整个 pipeline 一次写出
+ */
+static int
+lpipeline(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_Integer n = luaL_len(L, 1);
+	// 每条命令放在 buffer 下面的 2 号位置， 3 号位置是 scratch
+	lua_settop(L, 3);
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	lua_Integer i;
+	for (i=1;i<=n;i++) {
+		lua_geti(L, 1, i);
+		if (!lua_istable(L, -1))
+			luaL_error(L, "Invalid pipeline command %d", (int)i);
+		lua_replace(L, 2);
+		addcommand(L, &b, NULL, 0, 2, 3);
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+// Redis Cluster 用的 CRC16 (XMODEM) ，见 skynet/db/redis/cluster.lua
+static const uint16_t crc16tab[256] = {
+	0x0000,0x1021,0x2042,0x3063,0x4084,0x50a5,0x60c6,0x70e7,
+	0x8108,0x9129,0xa14a,0xb16b,0xc18c,0xd1ad,0xe1ce,0xf1ef,
+	0x1231,0x0210,0x3273,0x2252,0x52b5,0x4294,0x72f7,0x62d6,
+	0x9339,0x8318,0xb37b,0xa35a,0xd3bd,0xc39c,0xf3ff,0xe3de,
+	0x2462,0x3443,0x0420,0x1401,0x64e6,0x74c7,0x44a4,0x5485,
+	0xa56a,0xb54b,0x8528,0x9509,0xe5ee,0xf5cf,0xc5ac,0xd58d,
+	0x3653,0x2672,0x1611,0x0630,0x76d7,0x66f6,0x5695,0x46b4,
+	0xb75b,0xa77a,0x9719,0x8738,0xf7df,0xe7fe,0xd79d,0xc7bc,
+	0x48c4,0x58e5,0x6886,0x78a7,0x0840,0x1861,0x2802,0x3823,
+	0xc9cc,0xd9ed,0xe98e,0xf9af,0x8948,0x9969,0xa90a,0xb92b,
+	0x5af5,0x4ad4,0x7ab7,0x6a96,0x1a71,0x0a50,0x3a33,0x2a12,
+	0xdbfd,0xcbdc,0xfbbf,0xeb9e,0x9b79,0x8b58,0xbb3b,0xab1a,
+	0x6ca6,0x7c87,0x4ce4,0x5cc5,0x2c22,0x3c03,0x0c60,0x1c41,
+	0xedae,0xfd8f,0xcdec,0xddcd,0xad2a,0xbd0b,0x8d68,0x9d49,
+	0x7e97,0x6eb6,0x5ed5,0x4ef4,0x3e13,0x2e32,0x1e51,0x0e70,
+	0xff9f,0xefbe,0xdfdd,0xcffc,0xbf1b,0xaf3a,0x9f59,0x8f78,
+	0x9188,0x81a9,0xb1ca,0xa1eb,0xd10c,0xc12d,0xf14e,0xe16f,
+	0x1080,0x00a1,0x30c2,0x20e3,0x5004,0x4025,0x7046,0x6067,
+	0x83b9,0x9398,0xa3fb,0xb3da,0xc33d,0xd31c,0xe37f,0xf35e,
+	0x02b1,0x1290,0x22f3,0x32d2,0x4235,0x5214,0x6277,0x7256,
+	0xb5ea,0xa5cb,0x95a8,0x8589,0xf56e,0xe54f,0xd52c,0xc50d,
+	0x34e2,0x24c3,0x14a0,0x0481,0x7466,0x6447,0x5424,0x4405,
+	0xa7db,0xb7fa,0x8799,0x97b8,0xe75f,0xf77e,0xc71d,0xd73c,
+	0x26d3,0x36f2,0x0691,0x16b0,0x6657,0x7676,0x4615,0x5634,
+	0xd94c,0xc96d,0xf90e,0xe92f,0x99c8,0x89e9,0xb98a,0xa9ab,
+	0x5844,0x4865,0x7806,0x6827,0x18c0,0x08e1,0x3882,0x28a3,
+	0xcb7d,0xdb5c,0xeb3f,0xfb1e,0x8bf9,0x9bd8,0xabbb,0xbb9a,
+	0x4a75,0x5a54,0x6a37,0x7a16,0x0af1,0x1ad0,0x2ab3,0x3a92,
+	0xfd2e,0xed0f,0xdd6c,0xcd4d,0xbdaa,0xad8b,0x9de8,0x8dc9,
+	0x7c26,0x6c07,0x5c64,0x4c45,0x3ca2,0x2c83,0x1ce0,0x0cc1,
+	0xef1f,0xff3e,0xcf5d,0xdf7c,0xaf9b,0xbfba,0x8fd9,0x9ff8,
+	0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0,
+};
+
+static uint16_t
+crc16(const char *buf, size_t sz) {
+	uint16_t crc = 0;
+	size_t i;
+	for (i=0;i<sz;i++) {
+		crc = (crc << 8) ^ crc16tab[((crc >> 8) ^ (uint8_t)buf[i]) & 0xff];
+	}
+	return crc;
+}
+
+static int
+lcrc16(lua_State *L) {
+	size_t sz;
+	const char * buf = luaL_checklstring(L, 1, &sz);
+	lua_pushinteger(L, crc16(buf, sz));
+	return 1;
+}
+
+/*
+	string key
+	return slot
+
+	如果 key 中有非空的 {...} ，只对第一个 { 和它之后第一个 } 之间的内容求 hash
+ */
+static int
+lkeyslot(lua_State *L) {
+	size_t sz;
+	const char * key = luaL_checklstring(L, 1, &sz);
+	const char * s = memchr(key, '{', sz);
+	if (s) {
+		size_t start = s - key + 1;
+		const char * e = memchr(key + start, '}', sz - start);
+		if (e && e != key + start) {
+			key += start;
+			sz = e - key;
+		}
+	}
+	lua_pushinteger(L, crc16(key, sz) & 16383);
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_skynet_redis_core(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "decode", ldecode },
+		{ "encode", lencode },
+		{ "pipeline", lpipeline },
+		{ "scanner", lscanner },
+		{ "scan", lscan },
+		{ "crc16", lcrc16 },
+		{ "keyslot", lkeyslot },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
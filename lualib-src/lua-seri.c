@@ -6,6 +6,8 @@
 #define LUA_LIB
 
 #include "skynet_malloc.h"
+#include "skynet.h"
+#include "atomic.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -16,6 +18,12 @@
 
 // 数据类型定义
 #define TYPE_NIL 0          // nil 类型
+// hibits 0 : nil，其他为数组部分紧凑编码的表，数组长度（整数）之后是每个元素定长的原始数据，再之后同 TYPE_TABLE 的哈希部分
+#define TYPE_PACKED_INT8 1
+#define TYPE_PACKED_INT16 2
+#define TYPE_PACKED_INT32 3
+#define TYPE_PACKED_INT64 4
+#define TYPE_PACKED_REAL 5
 #define TYPE_BOOLEAN 1      // 布尔类型
 // hibits 0 false 1 true
 // 高位 0 表示 false，1 表示 true
@@ -30,30 +38,73 @@
 #define TYPE_NUMBER_REAL 8  // 实数
 
 #define TYPE_USERDATA 3     // 用户数据类型
+// hibits 0 : lightuserdata, 1 : 共享缓冲区，消息持有它的一个引用，只在本进程内有效
+#define TYPE_USERDATA_POINTER 0
+#define TYPE_USERDATA_SHAREDBUF 1
 #define TYPE_SHORT_STRING 4 // 短字符串类型
 // hibits 0~31 : len
 // 高位 0~31: 长度
 #define TYPE_LONG_STRING 5  // 长字符串类型
 #define TYPE_TABLE 6        // 表类型
+#define TYPE_SHAPE 7        // 按键布局(shape)编码的表，只在本进程内有效
+// hibits 同 TYPE_TABLE 为数组长度，之后是 shape id，数组部分，再按 shape 的键的顺序排列的值
 
 #define MAX_COOKIE 32       // 最大 cookie 值
+#define PACKED_MIN 16       // 数组部分全是整数或全是浮点数，且至少这么长时紧凑编码
 #define COMBINE_TYPE(t,v) ((t) | (v) << 3)  // 组合类型和值
 
-#define BLOCK_SIZE 128      // 块大小
+#define BLOCK_SIZE 256      // 栈上缓冲区大小
 #define MAX_DEPTH 32        // 最大深度
+#define SCRATCH_MAX (64*1024)  // 线程缓存的临时缓冲区上限
 
-// 内存块结构，用于链式存储序列化数据
-struct block {
-	struct block * next;        // 指向下一个块
-	char buffer[BLOCK_SIZE];    // 数据缓冲区
-};
+#define SHAPE_MAX 0x10000   // 进程内最多登记的 shape 数，满了以后按普通的表编码
+#define SHAPE_KEYS 64       // 一个 shape 最多的键数
+#define SHAPE_HASH 4096     // shape 哈希桶数
+#define SHAPE_CACHE 256     // 每个线程的 shape 缓存大小
 
-// 写入块结构，用于序列化时的数据写入
+// 写入块结构，用于序列化时的数据写入：先写栈上的缓冲区，写满后换成堆上可增长的连续缓冲区
 struct write_block {
-	struct block * head;        // 头块指针
-	struct block * current;     // 当前块指针
+	char * buffer;              // 当前缓冲区，stack 或堆内存
 	int len;                    // 总长度
-	int ptr;                    // 当前位置指针
+	int cap;                    // 缓冲区容量
+	int shape;                  // 是否用 shape 编码表
+	struct sharedref * ref;     // 写入的共享缓冲区，打包成功后由消息持有它们的引用
+	char stack[BLOCK_SIZE];     // 栈上缓冲区
+};
+
+struct shape_key {
+	const char * str;
+	int len;
+};
+
+// 一种表的键布局：键全是字符串的哈希部分，按遍历顺序排列。登记后不再修改也不释放
+struct shape {
+	struct shape * next;        // 同一个哈希桶里的下一个
+	uint32_t hash;
+	int id;
+	int n;                      // 键数
+	struct shape_key key[1];    // 键的字符串紧跟在结构后面
+};
+
+static ATOM_POINTER shape_bucket[SHAPE_HASH];   // 按哈希查找 shape，只会在链表头插入
+static ATOM_POINTER shape_index[SHAPE_MAX];     // 按 id 查找 shape
+static ATOM_INT shape_count;
+static __thread struct shape * shape_cache[SHAPE_CACHE];
+
+#define SHAREDBUF_META "SKYNET_SHAREDBUF"
+
+// 共享缓冲区：不可修改的一块内存，按引用计数在服务间传递，打包和解包时都不复制内容
+struct sharedbuf {
+	ATOM_INT reference;         // 原子引用计数，每个 Lua 对象和每条还没释放的消息各持有一个
+	size_t sz;
+	char data[1];
+};
+
+// 一条消息里的共享缓冲区，消息释放时（见 skynet_message_finalizer）放掉它们的引用
+struct sharedref {
+	int n;
+	int cap;
+	struct sharedbuf * buf[1];
 };
 
 // 读取块结构，用于反序列化时的数据读取
@@ -61,67 +112,79 @@ struct read_block {
 	char * buffer;              // 数据缓冲区
 	int len;                    // 缓冲区长度
 	int ptr;                    // 当前读取位置
+	int ref;                    // 是否持有引用的消息，其他内存里不能有共享缓冲区
 };
 
-// 分配一个新的内存块
-inline static struct block *
-blk_alloc(void) {
-	struct block *b = skynet_malloc(sizeof(struct block));
-	b->next = NULL;
-	return b;
+// 每个工作线程缓存一块用过的堆缓冲区，较大的消息打包时直接接着用，不必每次重新分配
+// 打包过程中（例如 __pairs 里又调用了 pack）取走的缓冲区不在这里，嵌套的打包会自己分配
+static __thread char * scratch_buffer = NULL;
+static __thread int scratch_size = 0;
+
+// 扩充写入缓冲区，至少再容纳 sz 字节
+static void
+wb_expand(struct write_block *b, int sz) {
+	int need = b->len + sz;
+	int cap;
+	char * buffer;
+	if (b->buffer == b->stack) {
+		buffer = scratch_buffer;
+		cap = scratch_size;
+		scratch_buffer = NULL;
+		scratch_size = 0;
+	} else {
+		buffer = b->buffer;
+		cap = b->cap;
+	}
+	if (cap < need) {
+		if (cap == 0)
+			cap = BLOCK_SIZE * 4;
+		while (cap < need)
+			cap *= 2;
+		buffer = skynet_realloc(buffer, cap);
+	}
+	if (b->buffer == b->stack) {
+		memcpy(buffer, b->stack, b->len);
+	}
+	b->buffer = buffer;
+	b->cap = cap;
 }
 
 // 向写入块中推入数据
 inline static void
 wb_push(struct write_block *b, const void *buf, int sz) {
-	const char * buffer = buf;
-	if (b->ptr == BLOCK_SIZE) {  // 当前块已满
-_again:
-		// 分配新块并链接
-		b->current = b->current->next = blk_alloc();
-		b->ptr = 0;
-	}
-	if (b->ptr <= BLOCK_SIZE - sz) {
-		// 当前块有足够空间，直接复制
-		memcpy(b->current->buffer + b->ptr, buffer, sz);
-		b->ptr+=sz;
-		b->len+=sz;
-	} else {
-		// 当前块空间不足，需要分割数据
-		int copy = BLOCK_SIZE - b->ptr;
-		memcpy(b->current->buffer + b->ptr, buffer, copy);
-		buffer += copy;
-		b->len += copy;
-		sz -= copy;
-		goto _again;  // 继续处理剩余数据
+	if (b->len + sz > b->cap) {
+		wb_expand(b, sz);
 	}
+	memcpy(b->buffer + b->len, buf, sz);
+	b->len += sz;
 }
 
 // 初始化写入块
 static void
-wb_init(struct write_block *wb , struct block *b) {
-	wb->head = b;
-	assert(b->next == NULL);
+wb_init(struct write_block *wb) {
+	wb->buffer = wb->stack;
 	wb->len = 0;
-	wb->current = wb->head;
-	wb->ptr = 0;
+	wb->cap = BLOCK_SIZE;
+	wb->shape = 0;
+	wb->ref = NULL;
 }
 
-// 释放写入块的内存
+// 释放写入块的内存，堆缓冲区留给本线程下次打包用
 static void
 wb_free(struct write_block *wb) {
-	struct block *blk = wb->head;
-	blk = blk->next;	// the first block is on stack
-	                    // 第一个块在栈上，不需要释放
-	while (blk) {
-		struct block * next = blk->next;
-		skynet_free(blk);
-		blk = next;
-	}
-	wb->head = NULL;
-	wb->current = NULL;
-	wb->ptr = 0;
+	if (wb->buffer != wb->stack) {
+		if (scratch_buffer == NULL && wb->cap <= SCRATCH_MAX) {
+			scratch_buffer = wb->buffer;
+			scratch_size = wb->cap;
+		} else {
+			skynet_free(wb->buffer);
+		}
+	}
+	wb->buffer = wb->stack;
 	wb->len = 0;
+	wb->cap = BLOCK_SIZE;
+	skynet_free(wb->ref);
+	wb->ref = NULL;
 }
 
 // 初始化读取块
@@ -130,6 +193,7 @@ rball_init(struct read_block * rb, char * buffer, int size) {
 	rb->buffer = buffer;
 	rb->len = size;
 	rb->ptr = 0;
+	rb->ref = 0;
 }
 
 // 从读取块中读取指定大小的数据
@@ -216,6 +280,24 @@ wb_pointer(struct write_block *wb, void *v) {
 	wb_push(wb, &v, sizeof(v));
 }
 
+// 写入共享缓冲区，先记下来，打包成功后消息才持有它的引用（见 seri）
+static void
+wb_sharedbuf(struct write_block *wb, struct sharedbuf *buf) {
+	uint8_t n = COMBINE_TYPE(TYPE_USERDATA, TYPE_USERDATA_SHAREDBUF);
+	wb_push(wb, &n, 1);
+	wb_push(wb, &buf, sizeof(buf));
+	struct sharedref * r = wb->ref;
+	if (r == NULL || r->n >= r->cap) {
+		int cap = r ? r->cap * 2 : 4;
+		r = skynet_realloc(r, sizeof(*r) + (cap - 1) * sizeof(r->buf[0]));
+		if (wb->ref == NULL)
+			r->n = 0;
+		r->cap = cap;
+		wb->ref = r;
+	}
+	r->buf[r->n++] = buf;
+}
+
 // 写入字符串，根据长度选择短字符串或长字符串格式
 static inline void
 wb_string(struct write_block *wb, const char *str, int len) {
@@ -249,6 +331,149 @@ wb_string(struct write_block *wb, const char *str, int len) {
 // 前向声明：打包单个值的函数
 static void pack_one(lua_State *L, struct write_block *b, int index, int depth);
 
+static int
+shape_equal(struct shape *s, uint32_t hash, struct shape_key *key, int n) {
+	if (s->hash != hash || s->n != n)
+		return 0;
+	int i;
+	for (i=0;i<n;i++) {
+		if (s->key[i].len != key[i].len || memcmp(s->key[i].str, key[i].str, key[i].len) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+static struct shape *
+shape_find(struct shape *s, uint32_t hash, struct shape_key *key, int n) {
+	while (s) {
+		if (shape_equal(s, hash, key, n))
+			return s;
+		s = s->next;
+	}
+	return NULL;
+}
+
+// 查找或登记一个 shape，登记满了返回 NULL
+static struct shape *
+shape_intern(uint32_t hash, struct shape_key *key, int n) {
+	struct shape **cache = &shape_cache[hash % SHAPE_CACHE];
+	if (*cache && shape_equal(*cache, hash, key, n))
+		return *cache;
+	ATOM_POINTER *bucket = &shape_bucket[hash % SHAPE_HASH];
+	struct shape *head = (struct shape *)ATOM_LOAD(bucket);
+	struct shape *s = shape_find(head, hash, key, n);
+	if (s == NULL) {
+		if (ATOM_LOAD(&shape_count) >= SHAPE_MAX)
+			return NULL;
+		int id = ATOM_FINC(&shape_count);
+		if (id >= SHAPE_MAX)
+			return NULL;
+		int i;
+		size_t sz = sizeof(struct shape) + (n - 1) * sizeof(struct shape_key);
+		size_t keysz = 0;
+		for (i=0;i<n;i++) {
+			keysz += key[i].len + 1;
+		}
+		s = skynet_malloc(sz + keysz);
+		char * str = (char *)s + sz;
+		s->hash = hash;
+		s->id = id;
+		s->n = n;
+		for (i=0;i<n;i++) {
+			memcpy(str, key[i].str, key[i].len);
+			str[key[i].len] = '\0';
+			s->key[i].str = str;
+			s->key[i].len = key[i].len;
+			str += key[i].len + 1;
+		}
+		ATOM_STORE(&shape_index[id], (uintptr_t)s);
+		for (;;) {
+			s->next = head;
+			if (ATOM_CAS_POINTER(bucket, (uintptr_t)head, (uintptr_t)s))
+				break;
+			// 别的线程先插入了，它可能正好登记了同一个 shape；这时本次分配的 id 就浪费掉
+			struct shape *newhead = (struct shape *)ATOM_LOAD(bucket);
+			struct shape *other = shape_find(newhead, hash, key, n);
+			if (other) {
+				ATOM_STORE(&shape_index[id], (uintptr_t)NULL);
+				skynet_free(s);
+				s = other;
+				break;
+			}
+			head = newhead;
+		}
+	}
+	*cache = s;
+	return s;
+}
+
+// 按 shape 编码表；表的哈希部分不全是字符串键时返回 0，由调用者按普通的表编码
+static int
+wb_table_shape(lua_State *L, struct write_block *wb, int index, int depth) {
+	struct shape_key key[SHAPE_KEYS];
+	if (!lua_checkstack(L, SHAPE_KEYS + LUA_MINSTACK))
+		return 0;
+	int array_size = lua_rawlen(L,index);
+	int top = lua_gettop(L);
+	uint32_t hash = 2166136261u;
+	int n = 0;
+	// 遍历一次，值按顺序留在栈上，编码时不必再遍历
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		int type = lua_type(L, -2);
+		if (type == LUA_TNUMBER && lua_isinteger(L, -2)) {
+			lua_Integer x = lua_tointeger(L, -2);
+			if (x>0 && x<=array_size) {
+				lua_pop(L, 1);
+				continue;
+			}
+		}
+		if (type != LUA_TSTRING || n >= SHAPE_KEYS) {
+			lua_settop(L, top);
+			return 0;
+		}
+		size_t sz;
+		// 键的字符串由表引用着，编码期间一直有效
+		const char * str = lua_tolstring(L, -2, &sz);
+		key[n].str = str;
+		key[n].len = (int)sz;
+		++n;
+		size_t i;
+		for (i=0;i<sz;i++) {
+			hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+		}
+		hash = (hash ^ 0xff) * 16777619u;
+		lua_insert(L, -2);
+	}
+	struct shape * s;
+	if (n == 0 || (s = shape_intern(hash, key, n)) == NULL) {
+		lua_settop(L, top);
+		return 0;
+	}
+
+	uint8_t t;
+	if (array_size >= MAX_COOKIE-1) {
+		t = COMBINE_TYPE(TYPE_SHAPE, MAX_COOKIE-1);
+		wb_push(wb, &t, 1);
+		wb_integer(wb, array_size);
+	} else {
+		t = COMBINE_TYPE(TYPE_SHAPE, array_size);
+		wb_push(wb, &t, 1);
+	}
+	wb_integer(wb, s->id);
+	int i;
+	for (i=1;i<=array_size;i++) {
+		lua_rawgeti(L,index,i);
+		pack_one(L, wb, -1, depth);
+		lua_pop(L,1);
+	}
+	for (i=1;i<=n;i++) {
+		pack_one(L, wb, top + i, depth);
+	}
+	lua_settop(L, top);
+	return 1;
+}
+
 // 写入表的数组部分
 static int
 wb_table_array(lua_State *L, struct write_block * wb, int index, int depth) {
@@ -275,6 +500,103 @@ wb_table_array(lua_State *L, struct write_block * wb, int index, int depth) {
 	return array_size;
 }
 
+static void wb_table_hash(lua_State *L, struct write_block * wb, int index, int depth, int array_size);
+
+static inline int
+packed_width(int cookie) {
+	switch (cookie) {
+	case TYPE_PACKED_INT8:
+		return 1;
+	case TYPE_PACKED_INT16:
+		return 2;
+	case TYPE_PACKED_INT32:
+		return 4;
+	default:
+		return 8;
+	}
+}
+
+// 数组部分全是整数（按最大的元素选择宽度）或全是浮点数时紧凑编码，否则返回 0 由调用者按普通的表编码
+// 只遍历一次：元素先按 8 字节写到缓冲区的空闲部分（头部之后），确定宽度后再原地压缩
+static int
+wb_table_packed(lua_State *L, struct write_block *wb, int index, int depth) {
+	int array_size = lua_rawlen(L,index);
+	if (array_size < PACKED_MIN || array_size > (0x7fffffff - wb->len) / 8 - 16)
+		return 0;
+	int head = 16;	// 类型和数组长度最多 10 字节
+	if (wb->len + head + array_size * 8 > wb->cap) {
+		wb_expand(wb, head + array_size * 8);
+	}
+	char * data = wb->buffer + wb->len + head;
+	lua_rawgeti(L, index, 1);
+	int real = !lua_isinteger(L, -1);
+	lua_pop(L, 1);
+	lua_Integer min = 0, max = 0;
+	int i;
+	for (i=0;i<array_size;i++) {
+		if (lua_rawgeti(L, index, i+1) != LUA_TNUMBER || lua_isinteger(L, -1) == real) {
+			lua_pop(L, 1);
+			return 0;
+		}
+		if (real) {
+			double v = lua_tonumber(L, -1);
+			memcpy(data + i * 8, &v, 8);
+		} else {
+			int64_t v = lua_tointeger(L, -1);
+			memcpy(data + i * 8, &v, 8);
+			if (v < min)
+				min = v;
+			else if (v > max)
+				max = v;
+		}
+		lua_pop(L, 1);
+	}
+	int cookie;
+	if (real)
+		cookie = TYPE_PACKED_REAL;
+	else if (min >= INT8_MIN && max <= INT8_MAX)
+		cookie = TYPE_PACKED_INT8;
+	else if (min >= INT16_MIN && max <= INT16_MAX)
+		cookie = TYPE_PACKED_INT16;
+	else if (min >= INT32_MIN && max <= INT32_MAX)
+		cookie = TYPE_PACKED_INT32;
+	else
+		cookie = TYPE_PACKED_INT64;
+	uint8_t n = COMBINE_TYPE(TYPE_NIL, cookie);
+	wb_push(wb, &n, 1);
+	wb_integer(wb, array_size);
+
+	// 头部写在 data 之前，不会扩充缓冲区；目标位置总在源位置之前，可以从前往后压缩
+	char * p = wb->buffer + wb->len;
+	int width = packed_width(cookie);
+	switch (cookie) {
+	case TYPE_PACKED_INT8:
+	case TYPE_PACKED_INT16:
+	case TYPE_PACKED_INT32:
+		for (i=0;i<array_size;i++) {
+			int64_t v;
+			memcpy(&v, data + i * 8, 8);
+			if (width == 1) {
+				int8_t v8 = (int8_t)v;
+				memcpy(p + i, &v8, 1);
+			} else if (width == 2) {
+				int16_t v16 = (int16_t)v;
+				memcpy(p + i * 2, &v16, 2);
+			} else {
+				int32_t v32 = (int32_t)v;
+				memcpy(p + i * 4, &v32, 4);
+			}
+		}
+		break;
+	default:
+		memmove(p, data, array_size * 8);
+		break;
+	}
+	wb->len += array_size * width;
+	wb_table_hash(L, wb, index, depth, array_size);
+	return 1;
+}
+
 // 写入表的哈希部分
 static void
 wb_table_hash(lua_State *L, struct write_block * wb, int index, int depth, int array_size) {
@@ -342,6 +664,10 @@ wb_table(lua_State *L, struct write_block *wb, int index, int depth) {
 	if (luaL_getmetafield(L, index, "__pairs") != LUA_TNIL) {
 		// 表有 __pairs 元方法，使用元方法处理
 		return wb_table_metapairs(L, wb, index, depth);
+	} else if (wb_table_packed(L, wb, index, depth)) {
+		return 0;
+	} else if (wb->shape && wb_table_shape(L, wb, index, depth)) {
+		return 0;
 	} else {
 		// 标准表处理：先处理数组部分，再处理哈希部分
 		int array_size = wb_table_array(L, wb, index, depth);
@@ -387,6 +713,15 @@ pack_one(lua_State *L, struct write_block *b, int index, int depth) {
 	case LUA_TLIGHTUSERDATA:
 		wb_pointer(b, lua_touserdata(L,index));
 		break;
+	case LUA_TUSERDATA: {
+		struct sharedbuf ** box = luaL_testudata(L, index, SHAREDBUF_META);
+		if (box == NULL || *box == NULL) {
+			wb_free(b);
+			luaL_error(L, "Unsupport type %s to serialize", lua_typename(L, type));
+		}
+		wb_sharedbuf(b, *box);
+		break;
+	}
 	case LUA_TTABLE: {
 		if (index < 0) {
 			index = lua_gettop(L) + index + 1;
@@ -495,6 +830,25 @@ get_pointer(lua_State *L, struct read_block *rb) {
 	return userdata;
 }
 
+static void sharedbuf_push(lua_State *L, struct sharedbuf *buf);
+
+// 读取共享缓冲区，新的 Lua 对象持有自己的引用，消息的引用在消息释放时放掉，所以可以解包多次
+static void
+get_sharedbuf(lua_State *L, struct read_block *rb) {
+	struct sharedbuf * buf;
+	const void * v = rb_read(rb,sizeof(buf));
+	if (v == NULL) {
+		invalid_stream(L,rb);
+	}
+	if (!rb->ref) {
+		// 复制出来的内存或者从其他进程收到的数据里的指针都不能用
+		invalid_stream(L,rb);
+	}
+	memcpy(&buf, v, sizeof(buf));
+	ATOM_FINC(&buf->reference);
+	sharedbuf_push(L, buf);
+}
+
 // 读取指定长度的缓冲区数据并推入 Lua 栈
 static void
 get_buffer(lua_State *L, struct read_block *rb, int len) {
@@ -508,6 +862,83 @@ get_buffer(lua_State *L, struct read_block *rb, int len) {
 // 前向声明：反序列化单个值的函数
 static void unpack_one(lua_State *L, struct read_block *rb);
 
+// 反序列化表的哈希部分，表在栈顶
+static void
+unpack_hash(lua_State *L, struct read_block *rb) {
+	for (;;) {
+		unpack_one(L,rb);  // 读取键
+		if (lua_isnil(L,-1)) {
+			// nil 键表示哈希部分结束
+			lua_pop(L,1);
+			return;
+		}
+		unpack_one(L,rb);  // 读取值
+		lua_rawset(L,-3);  // 设置键值对
+	}
+}
+
+// 反序列化数组部分紧凑编码的表
+static void
+unpack_packed(lua_State *L, struct read_block *rb, int cookie) {
+	if (cookie > TYPE_PACKED_REAL) {
+		invalid_stream(L,rb);
+	}
+	const uint8_t * t = (const uint8_t *)rb_read(rb, 1);
+	if (t==NULL || (*t & 7) != TYPE_NUMBER || (*t >> 3) == TYPE_NUMBER_REAL) {
+		invalid_stream(L,rb);
+	}
+	lua_Integer array_size = get_integer(L,rb,*t >> 3);
+	int width = packed_width(cookie);
+	if (array_size < 0 || array_size > rb->len / width) {
+		invalid_stream(L,rb);
+	}
+	const char * p = (const char *)rb_read(rb, (int)array_size * width);
+	luaL_checkstack(L,LUA_MINSTACK,NULL);
+	lua_createtable(L,(int)array_size,0);
+	int i;
+	switch (cookie) {
+	case TYPE_PACKED_INT8:
+		for (i=1;i<=array_size;i++) {
+			lua_pushinteger(L, (int8_t)p[i-1]);
+			lua_rawseti(L,-2,i);
+		}
+		break;
+	case TYPE_PACKED_INT16:
+		for (i=1;i<=array_size;i++,p+=2) {
+			int16_t v;
+			memcpy(&v, p, 2);
+			lua_pushinteger(L, v);
+			lua_rawseti(L,-2,i);
+		}
+		break;
+	case TYPE_PACKED_INT32:
+		for (i=1;i<=array_size;i++,p+=4) {
+			int32_t v;
+			memcpy(&v, p, 4);
+			lua_pushinteger(L, v);
+			lua_rawseti(L,-2,i);
+		}
+		break;
+	case TYPE_PACKED_INT64:
+		for (i=1;i<=array_size;i++,p+=8) {
+			int64_t v;
+			memcpy(&v, p, 8);
+			lua_pushinteger(L, v);
+			lua_rawseti(L,-2,i);
+		}
+		break;
+	default:
+		for (i=1;i<=array_size;i++,p+=8) {
+			double v;
+			memcpy(&v, p, 8);
+			lua_pushnumber(L, v);
+			lua_rawseti(L,-2,i);
+		}
+		break;
+	}
+	unpack_hash(L, rb);
+}
+
 // 反序列化表数据
 static void
 unpack_table(lua_State *L, struct read_block *rb, int array_size) {
@@ -536,15 +967,51 @@ unpack_table(lua_State *L, struct read_block *rb, int array_size) {
 	}
 
 	// 反序列化哈希部分
-	for (;;) {
-		unpack_one(L,rb);  // 读取键
-		if (lua_isnil(L,-1)) {
-			// nil 键表示哈希部分结束
-			lua_pop(L,1);
-			return;
+	unpack_hash(L, rb);
+}
+
+// 反序列化按 shape 编码的表
+static void
+unpack_shape(lua_State *L, struct read_block *rb, int array_size) {
+	if (array_size == MAX_COOKIE-1) {
+		uint8_t type;
+		const uint8_t * t = (const uint8_t *)rb_read(rb, sizeof(type));
+		if (t==NULL) {
+			invalid_stream(L,rb);
 		}
-		unpack_one(L,rb);  // 读取值
-		lua_rawset(L,-3);  // 设置键值对
+		type = *t;
+		int cookie = type >> 3;
+		if ((type & 7) != TYPE_NUMBER || cookie == TYPE_NUMBER_REAL) {
+			invalid_stream(L,rb);
+		}
+		array_size = get_integer(L,rb,cookie);
+	}
+	uint8_t type;
+	const uint8_t * t = (const uint8_t *)rb_read(rb, sizeof(type));
+	if (t==NULL || (*t & 7) != TYPE_NUMBER || (*t >> 3) == TYPE_NUMBER_REAL) {
+		invalid_stream(L,rb);
+	}
+	type = *t;
+	lua_Integer id = get_integer(L,rb,type >> 3);
+	struct shape * s = NULL;
+	if (id >= 0 && id < SHAPE_MAX) {
+		s = (struct shape *)ATOM_LOAD(&shape_index[id]);
+	}
+	if (s == NULL) {
+		invalid_stream(L,rb);
+	}
+	luaL_checkstack(L,LUA_MINSTACK,NULL);
+	lua_createtable(L,array_size,s->n);  // 键数已知，一次分配好哈希部分
+
+	int i;
+	for (i=1;i<=array_size;i++) {
+		unpack_one(L,rb);
+		lua_rawseti(L,-2,i);
+	}
+	for (i=0;i<s->n;i++) {
+		lua_pushlstring(L, s->key[i].str, s->key[i].len);
+		unpack_one(L,rb);
+		lua_rawset(L,-3);
 	}
 }
 
@@ -553,7 +1020,11 @@ static void
 push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 	switch(type) {
 	case TYPE_NIL:
-		lua_pushnil(L);
+		if (cookie == 0) {
+			lua_pushnil(L);
+		} else {
+			unpack_packed(L,rb,cookie);
+		}
 		break;
 	case TYPE_BOOLEAN:
 		lua_pushboolean(L,cookie);
@@ -568,7 +1039,11 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 		}
 		break;
 	case TYPE_USERDATA:
-		lua_pushlightuserdata(L,get_pointer(L,rb));
+		if (cookie == TYPE_USERDATA_SHAREDBUF) {
+			get_sharedbuf(L,rb);
+		} else {
+			lua_pushlightuserdata(L,get_pointer(L,rb));
+		}
 		break;
 	case TYPE_SHORT_STRING:
 		// 短字符串，长度在 cookie 中
@@ -604,6 +1079,10 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 		unpack_table(L,rb,cookie);
 		break;
 	}
+	case TYPE_SHAPE: {
+		unpack_shape(L,rb,cookie);
+		break;
+	}
 	default: {
 		invalid_stream(L,rb);
 		break;
@@ -623,24 +1102,26 @@ unpack_one(lua_State *L, struct read_block *rb) {
 	push_value(L, rb, type & 0x7, type>>3);  // 解析类型和值
 }
 
-// 将链式块数据序列化为连续内存
+static void sharedref_release(void *ud);
+
+// 把写入块中的数据复制到一块恰好大小的内存里，这是打包时唯一一次给消息分配内存
+// 写入过共享缓冲区时，消息持有它们的引用，释放消息时放掉：末尾多留出释放回调的位置，返回的大小包括它
 static void
-seri(lua_State *L, struct block *b, int len) {
-	uint8_t * buffer = skynet_malloc(len);  // 分配连续内存
-	uint8_t * ptr = buffer;
-	int sz = len;
-	while(len>0) {
-		if (len >= BLOCK_SIZE) {
-			// 复制完整块
-			memcpy(ptr, b->buffer, BLOCK_SIZE);
-			ptr += BLOCK_SIZE;
-			len -= BLOCK_SIZE;
-			b = b->next;
-		} else {
-			// 复制剩余数据
-			memcpy(ptr, b->buffer, len);
-			break;
+seri(lua_State *L, struct write_block *wb) {
+	struct sharedref * r = wb->ref;
+	size_t sz = wb->len;
+	if (r) {
+		sz += SKYNET_MESSAGE_FINALIZER;
+	}
+	uint8_t * buffer = skynet_slab_alloc(sz);
+	memcpy(buffer, wb->buffer, wb->len);
+	if (r) {
+		int i;
+		for (i=0;i<r->n;i++) {
+			ATOM_FINC(&r->buf[i]->reference);
 		}
+		skynet_message_finalizer(buffer, sz, sharedref_release, r);
+		wb->ref = NULL;
 	}
 
 	// 返回缓冲区指针和大小
@@ -676,6 +1157,11 @@ luaseri_unpack(lua_State *L) {
 	lua_settop(L,1);
 	struct read_block rb;
 	rball_init(&rb, buffer, len);
+	if (lua_type(L,1) != LUA_TSTRING && skynet_message_finalized(buffer, len)) {
+		// 末尾是释放回调，不是数据
+		rb.len -= SKYNET_MESSAGE_FINALIZER;
+		rb.ref = 1;
+	}
 
 	// 循环反序列化所有值
 	int i;
@@ -701,15 +1187,130 @@ luaseri_unpack(lua_State *L) {
 // Lua 接口：序列化函数
 LUAMOD_API int
 luaseri_pack(lua_State *L) {
-	struct block temp;
-	temp.next = NULL;
 	struct write_block wb;
-	wb_init(&wb, &temp);
+	wb_init(&wb);
 	pack_from(L,&wb,0);  // 序列化栈上的所有参数
-	assert(wb.head == &temp);
-	seri(L, &temp, wb.len);  // 转换为连续内存
+	seri(L, &wb);  // 复制到消息内存
 
-	wb_free(&wb);  // 释放临时块
+	wb_free(&wb);  // 释放临时缓冲区
 
 	return 2;  // 返回缓冲区指针和大小
 }
+
+// Lua 接口：和 luaseri_pack 一样，但键全是字符串的表按 shape 编码，
+// 键的布局登记在进程内共享的 shape 表里，消息只带 shape id 和值。
+// 这样的消息只能在本进程内解包，不能发往 cluster 或者存下来
+LUAMOD_API int
+luaseri_packshape(lua_State *L) {
+	struct write_block wb;
+	wb_init(&wb);
+	wb.shape = 1;
+	pack_from(L,&wb,0);
+	seri(L, &wb);
+
+	wb_free(&wb);
+
+	return 2;
+}
+
+static void
+sharedbuf_release(struct sharedbuf *buf) {
+	if (ATOM_FDEC(&buf->reference) <= 1) {
+		skynet_free(buf);
+	}
+}
+
+static void
+sharedref_release(void *ud) {
+	struct sharedref * r = ud;
+	int i;
+	for (i=0;i<r->n;i++) {
+		sharedbuf_release(r->buf[i]);
+	}
+	skynet_free(r);
+}
+
+static int
+sharedbuf_gc(lua_State *L) {
+	struct sharedbuf ** box = lua_touserdata(L, 1);
+	if (*box) {
+		sharedbuf_release(*box);
+		*box = NULL;
+	}
+	return 0;
+}
+
+static int
+sharedbuf_len(lua_State *L) {
+	struct sharedbuf ** box = luaL_checkudata(L, 1, SHAREDBUF_META);
+	lua_pushinteger(L, (lua_Integer)(*box)->sz);
+	return 1;
+}
+
+// buf:tostring([i [, j]]) 按 string.sub 的规则取出一段，只有这里才复制内容
+static int
+sharedbuf_tostring(lua_State *L) {
+	struct sharedbuf ** box = luaL_checkudata(L, 1, SHAREDBUF_META);
+	struct sharedbuf * buf = *box;
+	lua_Integer sz = (lua_Integer)buf->sz;
+	lua_Integer i = luaL_optinteger(L, 2, 1);
+	lua_Integer j = luaL_optinteger(L, 3, -1);
+	if (i < 0)
+		i = (i < -sz) ? 1 : sz + i + 1;
+	else if (i == 0)
+		i = 1;
+	if (j < 0)
+		j = sz + j + 1;
+	else if (j > sz)
+		j = sz;
+	if (i > j) {
+		lua_pushliteral(L, "");
+	} else {
+		lua_pushlstring(L, buf->data + i - 1, (size_t)(j - i + 1));
+	}
+	return 1;
+}
+
+// 把一个引用交给新的 Lua 对象
+static void
+sharedbuf_push(lua_State *L, struct sharedbuf *buf) {
+	struct sharedbuf ** box = lua_newuserdatauv(L, sizeof(*box), 0);
+	*box = buf;
+	if (luaL_newmetatable(L, SHAREDBUF_META)) {
+		luaL_Reg l[] = {
+			{ "__gc", sharedbuf_gc },
+			{ "__len", sharedbuf_len },
+			{ "__tostring", sharedbuf_tostring },
+			{ "tostring", sharedbuf_tostring },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+}
+
+// Lua 接口：用字符串或者 (lightuserdata, size) 创建共享缓冲区，内容只在这里复制一次。
+// 打包时只写入指针，消息持有一个引用直到被释放，每次解包得到的对象各持有一个引用。
+// 带着它的消息不能离开本进程，也不能复制：发往其他节点、多个目标或者打包成字符串都会被拒绝
+LUAMOD_API int
+luaseri_sharedbuffer(lua_State *L) {
+	const char * data;
+	size_t sz;
+	if (lua_type(L,1) == LUA_TSTRING) {
+		data = lua_tolstring(L,1,&sz);
+	} else {
+		data = lua_touserdata(L,1);
+		sz = (size_t)luaL_checkinteger(L,2);
+		if (data == NULL && sz > 0)
+			return luaL_error(L, "sharedbuffer null pointer");
+	}
+	struct sharedbuf * buf = skynet_malloc(sizeof(*buf) + sz);
+	ATOM_INIT(&buf->reference, 1);
+	buf->sz = sz;
+	memcpy(buf->data, data, sz);
+	buf->data[sz] = '\0';
+	sharedbuf_push(L, buf);
+	return 1;
+}
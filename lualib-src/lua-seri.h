@@ -8,6 +8,12 @@
 // 打包 Lua 值为二进制数据
 int luaseri_pack(lua_State *L);
 
+// 打包 Lua 值，键全是字符串的表按进程内共享的 shape 编码，只能在本进程内解包
+int luaseri_packshape(lua_State *L);
+
+// 创建共享缓冲区，打包时按引用传递，不复制内容
+int luaseri_sharedbuffer(lua_State *L);
+
 // 从二进制数据解包为 Lua 值
 int luaseri_unpack(lua_State *L);
 
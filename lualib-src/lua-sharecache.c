@@ -0,0 +1,513 @@
+#define LUA_LIB
+
+#include "skynet.h"
+#include "skynet_malloc.h"
+#include "spinlock.h"
+#include "atomic.h"
+#include "lua-seri.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+	节点内所有服务共享的键值缓存，见 lualib/skynet/sharecache.lua
+
+	按名字创建，创建后一直存在到进程退出，任何服务都可以直接读写，不需要消息往返。
+	键按散列分到多个分片，每个分片一把自旋锁、一张散列表和一条 LRU 链，
+	不同分片的读写互不影响。值用 skynet.pack 的格式序列化后保存，
+	读取时只在锁内增加引用计数，解包在锁外进行。
+	每个分片的键数和字节数超过上限时从 LRU 链尾淘汰，过期的键在访问时删除。
+ */
+
+#define SHARECACHE_SHARD 16
+#define SHARECACHE_MAXKEYS (64 * 1024)
+#define SHARECACHE_MAXBYTES (64 * 1024 * 1024)
+
+struct value {
+	ATOM_INT reference;
+	int sz;
+	void * msg;		// skynet.pack 的结果
+};
+
+struct entry {
+	struct entry * hnext;	// 散列链
+	struct entry * prev;	// LRU 链，prev 方向是最近访问的
+	struct entry * next;
+	uint64_t hash;
+	uint64_t expire;	// 0 表示不过期
+	struct value * v;
+	size_t cost;		// 计入分片字节数的大小
+	size_t keysz;
+	char key[1];
+};
+
+struct shard {
+	struct spinlock lock;
+	struct entry ** bucket;
+	int size;		// 散列表大小，2 的幂
+	int count;
+	size_t bytes;
+	struct entry * head;	// 最近访问的
+	struct entry * tail;	// 最先淘汰的
+	uint64_t hit;
+	uint64_t miss;
+	uint64_t set;
+	uint64_t evict;
+	uint64_t expired;
+	char pad[64];		// 避免相邻分片的锁在同一个缓存行
+};
+
+struct sharecache {
+	struct sharecache * next;
+	char * name;
+	int nshard;		// 2 的幂
+	int max_keys;		// 每个分片的上限
+	size_t max_bytes;
+	uint32_t ttl;		// 默认的过期时间（厘秒），0 表示不过期
+	struct shard shard[1];
+};
+
+static ATOM_POINTER G = 0;	// 所有缓存的链表，只增加
+
+static uint64_t
+hash_key(const char *key, size_t sz) {
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ull;
+	size_t i;
+	for (i=0;i<sz;i++) {
+		h ^= (uint8_t)key[i];
+		h *= 0x100000001b3ull;
+	}
+	return h ^ (h >> 29);
+}
+
+static inline struct shard *
+get_shard(struct sharecache *c, uint64_t hash) {
+	return &c->shard[(hash >> 32) & (c->nshard - 1)];
+}
+
+static void
+value_release(struct value *v) {
+	if (ATOM_FDEC(&v->reference) <= 1) {
+		skynet_message_free(v->msg, v->sz);
+		skynet_free(v);
+	}
+}
+
+static void
+entry_free(struct entry *e) {
+	value_release(e->v);
+	skynet_free(e);
+}
+
+static struct entry **
+find_link(struct shard *s, uint64_t hash, const char *key, size_t sz) {
+	struct entry ** link = &s->bucket[hash & (s->size - 1)];
+	struct entry * e;
+	while ((e = *link)) {
+		if (e->hash == hash && e->keysz == sz && memcmp(e->key, key, sz) == 0)
+			break;
+		link = &e->hnext;
+	}
+	return link;
+}
+
+static void
+lru_remove(struct shard *s, struct entry *e) {
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		s->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		s->tail = e->prev;
+}
+
+static void
+lru_push(struct shard *s, struct entry *e) {
+	e->prev = NULL;
+	e->next = s->head;
+	if (s->head)
+		s->head->prev = e;
+	else
+		s->tail = e;
+	s->head = e;
+}
+
+// 从散列表和 LRU 链中摘下 e，由调用者释放
+static void
+shard_unlink(struct shard *s, struct entry *e) {
+	struct entry ** link = find_link(s, e->hash, e->key, e->keysz);
+	*link = e->hnext;
+	lru_remove(s, e);
+	s->count--;
+	s->bytes -= e->cost;
+}
+
+static void
+shard_rehash(struct shard *s) {
+	int size = s->size * 2;
+	struct entry ** bucket = skynet_malloc(size * sizeof(*bucket));
+	memset(bucket, 0, size * sizeof(*bucket));
+	int i;
+	for (i=0;i<s->size;i++) {
+		struct entry * e = s->bucket[i];
+		while (e) {
+			struct entry * next = e->hnext;
+			struct entry ** slot = &bucket[e->hash & (size - 1)];
+			e->hnext = *slot;
+			*slot = e;
+			e = next;
+		}
+	}
+	skynet_free(s->bucket);
+	s->bucket = bucket;
+	s->size = size;
+}
+
+// 淘汰到不超过上限为止，淘汰的项用 hnext 串起来返回，在锁外释放
+static struct entry *
+shard_evict(struct sharecache *c, struct shard *s) {
+	struct entry * list = NULL;
+	while (s->tail && (s->count > c->max_keys || s->bytes > c->max_bytes)) {
+		struct entry * e = s->tail;
+		shard_unlink(s, e);
+		s->evict++;
+		e->hnext = list;
+		list = e;
+	}
+	return list;
+}
+
+static void
+free_list(struct entry *e) {
+	while (e) {
+		struct entry * next = e->hnext;
+		entry_free(e);
+		e = next;
+	}
+}
+
+static struct sharecache *
+cache_new(const char *name, int nshard, int max_keys, size_t max_bytes, uint32_t ttl) {
+	int n = 1;
+	while (n < nshard)
+		n *= 2;
+	struct sharecache * c = skynet_malloc(sizeof(*c) + (n - 1) * sizeof(struct shard));
+	memset(c, 0, sizeof(*c) + (n - 1) * sizeof(struct shard));
+	c->name = skynet_malloc(strlen(name) + 1);
+	strcpy(c->name, name);
+	c->nshard = n;
+	c->max_keys = (max_keys + n - 1) / n;
+	c->max_bytes = (max_bytes + n - 1) / n;
+	c->ttl = ttl;
+	int i;
+	for (i=0;i<n;i++) {
+		struct shard * s = &c->shard[i];
+		spinlock_init(&s->lock);
+		s->size = 16;
+		s->bucket = skynet_malloc(s->size * sizeof(struct entry *));
+		memset(s->bucket, 0, s->size * sizeof(struct entry *));
+	}
+	return c;
+}
+
+static void
+cache_delete(struct sharecache *c) {
+	int i;
+	for (i=0;i<c->nshard;i++) {
+		struct shard * s = &c->shard[i];
+		struct entry * e = s->head;
+		while (e) {
+			struct entry * next = e->next;
+			entry_free(e);
+			e = next;
+		}
+		skynet_free(s->bucket);
+		spinlock_destroy(&s->lock);
+	}
+	skynet_free(c->name);
+	skynet_free(c);
+}
+
+static struct sharecache *
+cache_find(struct sharecache *c, const char *name) {
+	while (c) {
+		if (strcmp(c->name, name) == 0)
+			return c;
+		c = c->next;
+	}
+	return NULL;
+}
+
+static struct sharecache *
+check_cache(lua_State *L) {
+	struct sharecache * c = lua_touserdata(L, 1);
+	if (c == NULL)
+		luaL_error(L, "Need a sharecache");
+	return c;
+}
+
+/*
+	string name, integer max_keys, integer max_bytes, integer ttl, integer shard
+	return lightuserdata
+	同名的缓存已经存在时返回它，参数以第一次创建的为准
+ */
+static int
+lnew(lua_State *L) {
+	const char * name = luaL_checkstring(L, 1);
+	lua_Integer max_keys = luaL_optinteger(L, 2, SHARECACHE_MAXKEYS);
+	lua_Integer max_bytes = luaL_optinteger(L, 3, SHARECACHE_MAXBYTES);
+	lua_Integer ttl = luaL_optinteger(L, 4, 0);
+	lua_Integer nshard = luaL_optinteger(L, 5, SHARECACHE_SHARD);
+	luaL_argcheck(L, max_keys > 0 && max_keys <= INT32_MAX, 2, "Invalid max_keys");
+	luaL_argcheck(L, max_bytes > 0, 3, "Invalid max_bytes");
+	luaL_argcheck(L, ttl >= 0 && ttl <= UINT32_MAX, 4, "Invalid ttl");
+	luaL_argcheck(L, nshard > 0 && nshard <= 1024, 5, "Invalid shard");
+
+	struct sharecache * c = NULL;
+	for (;;) {
+		struct sharecache * list = (struct sharecache *)ATOM_LOAD(&G);
+		struct sharecache * exist = cache_find(list, name);
+		if (exist) {
+			if (c)
+				cache_delete(c);
+			c = exist;
+			break;
+		}
+		if (c == NULL)
+			c = cache_new(name, (int)nshard, (int)max_keys, (size_t)max_bytes, (uint32_t)ttl);
+		c->next = list;
+		if (ATOM_CAS_POINTER(&G, (uintptr_t)list, (uintptr_t)c))
+			break;
+		// 其他线程同时创建了缓存，重新检查名字
+	}
+	lua_pushlightuserdata(L, c);
+	return 1;
+}
+
+static int
+unpack_value(lua_State *L) {
+	struct value * v = lua_touserdata(L, 1);
+	lua_settop(L, 0);
+	lua_pushcfunction(L, luaseri_unpack);
+	lua_pushlightuserdata(L, v->msg);
+	lua_pushinteger(L, v->sz);
+	lua_call(L, 2, 1);
+	return 1;
+}
+
+/*
+	lightuserdata cache, string key
+	return value (nil when it's missing or expired)
+ */
+static int
+lget(lua_State *L) {
+	struct sharecache * c = check_cache(L);
+	size_t sz;
+	const char * key = luaL_checklstring(L, 2, &sz);
+	uint64_t hash = hash_key(key, sz);
+	struct shard * s = get_shard(c, hash);
+	struct entry * expired = NULL;
+	struct value * v = NULL;
+
+	spinlock_lock(&s->lock);
+	struct entry * e = *find_link(s, hash, key, sz);
+	if (e) {
+		if (e->expire && e->expire <= skynet_now()) {
+			shard_unlink(s, e);
+			s->expired++;
+			expired = e;
+		} else {
+			if (e != s->head) {
+				lru_remove(s, e);
+				lru_push(s, e);
+			}
+			v = e->v;
+			ATOM_FINC(&v->reference);
+		}
+	}
+	if (v)
+		s->hit++;
+	else
+		s->miss++;
+	spinlock_unlock(&s->lock);
+
+	if (expired)
+		entry_free(expired);
+	if (v == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	// 解包出错时也要释放引用
+	lua_pushcfunction(L, unpack_value);
+	lua_pushlightuserdata(L, v);
+	int err = lua_pcall(L, 1, 1, 0);
+	value_release(v);
+	if (err != LUA_OK)
+		return lua_error(L);
+	return 1;
+}
+
+/*
+	lightuserdata cache, string key, value, integer ttl
+	value 为 nil 时删除，ttl 省略时用缓存的默认值，0 表示不过期
+ */
+static int
+lset(lua_State *L) {
+	struct sharecache * c = check_cache(L);
+	size_t sz;
+	const char * key = luaL_checklstring(L, 2, &sz);
+	lua_Integer ttl = luaL_optinteger(L, 4, c->ttl);
+	luaL_argcheck(L, ttl >= 0, 4, "Invalid ttl");
+	uint64_t hash = hash_key(key, sz);
+	struct shard * s = get_shard(c, hash);
+
+	if (lua_isnoneornil(L, 3)) {
+		spinlock_lock(&s->lock);
+		struct entry * e = *find_link(s, hash, key, sz);
+		if (e)
+			shard_unlink(s, e);
+		spinlock_unlock(&s->lock);
+		if (e)
+			entry_free(e);
+		lua_pushboolean(L, e != NULL);
+		return 1;
+	}
+
+	lua_pushcfunction(L, luaseri_pack);
+	lua_pushvalue(L, 3);
+	lua_call(L, 1, 2);
+	struct value * v = skynet_malloc(sizeof(*v));
+	ATOM_INIT(&v->reference, 1);
+	v->msg = lua_touserdata(L, -2);
+	v->sz = (int)lua_tointeger(L, -1);
+	lua_pop(L, 2);
+
+	struct entry * n = skynet_malloc(sizeof(*n) + sz);
+	n->hash = hash;
+	n->expire = ttl ? skynet_now() + ttl : 0;
+	n->v = v;
+	n->cost = sizeof(*n) + sz + v->sz;
+	n->keysz = sz;
+	memcpy(n->key, key, sz);
+	n->key[sz] = '\0';
+
+	spinlock_lock(&s->lock);
+	struct entry ** link = find_link(s, hash, key, sz);
+	struct entry * old = *link;
+	if (old) {
+		// 换上新的项，旧的在锁外释放
+		n->hnext = old->hnext;
+		*link = n;
+		lru_remove(s, old);
+		s->bytes -= old->cost;
+	} else {
+		n->hnext = *link;
+		*link = n;
+		s->count++;
+	}
+	lru_push(s, n);
+	s->bytes += n->cost;
+	s->set++;
+	struct entry * evicted = shard_evict(c, s);
+	if (s->count > s->size)
+		shard_rehash(s);
+	spinlock_unlock(&s->lock);
+
+	if (old)
+		entry_free(old);
+	free_list(evicted);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+	lightuserdata cache
+	删除所有的键
+ */
+static int
+lclear(lua_State *L) {
+	struct sharecache * c = check_cache(L);
+	int i;
+	for (i=0;i<c->nshard;i++) {
+		struct shard * s = &c->shard[i];
+		spinlock_lock(&s->lock);
+		struct entry * e = s->head;
+		memset(s->bucket, 0, s->size * sizeof(struct entry *));
+		s->head = s->tail = NULL;
+		s->count = 0;
+		s->bytes = 0;
+		spinlock_unlock(&s->lock);
+		while (e) {
+			struct entry * next = e->next;
+			entry_free(e);
+			e = next;
+		}
+	}
+	return 0;
+}
+
+static void
+set_field(lua_State *L, const char *name, lua_Integer v) {
+	lua_pushinteger(L, v);
+	lua_setfield(L, -2, name);
+}
+
+/*
+	lightuserdata cache
+	return { keys, bytes, hit, miss, set, evict, expired, shard, max_keys, max_bytes, ttl }
+ */
+static int
+lstat(lua_State *L) {
+	struct sharecache * c = check_cache(L);
+	uint64_t keys = 0, bytes = 0, hit = 0, miss = 0, set = 0, evict = 0, expired = 0;
+	int i;
+	for (i=0;i<c->nshard;i++) {
+		struct shard * s = &c->shard[i];
+		spinlock_lock(&s->lock);
+		keys += s->count;
+		bytes += s->bytes;
+		hit += s->hit;
+		miss += s->miss;
+		set += s->set;
+		evict += s->evict;
+		expired += s->expired;
+		spinlock_unlock(&s->lock);
+	}
+	lua_createtable(L, 0, 11);
+	set_field(L, "keys", (lua_Integer)keys);
+	set_field(L, "bytes", (lua_Integer)bytes);
+	set_field(L, "hit", (lua_Integer)hit);
+	set_field(L, "miss", (lua_Integer)miss);
+	set_field(L, "set", (lua_Integer)set);
+	set_field(L, "evict", (lua_Integer)evict);
+	set_field(L, "expired", (lua_Integer)expired);
+	set_field(L, "shard", c->nshard);
+	set_field(L, "max_keys", (lua_Integer)c->max_keys * c->nshard);
+	set_field(L, "max_bytes", (lua_Integer)(c->max_bytes * c->nshard));
+	set_field(L, "ttl", c->ttl);
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_skynet_sharecache_core(lua_State *L) {
+	luaL_checkversion(L);
+
+	luaL_Reg l[] = {
+		{ "new", lnew },
+		{ "get", lget },
+		{ "set", lset },
+		{ "clear", lclear },
+		{ "stat", lstat },
+		{ NULL, NULL },
+	};
+
+	luaL_newlib(L,l);
+
+	return 1;
+}
@@ -0,0 +1,454 @@
+#define LUA_LIB
+
+#include "skynet.h"
+#include "skynet_malloc.h"
+#include "spinlock.h"
+#include "atomic.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+	节点内所有服务共享的计数器，见 lualib/skynet/sharecounter.lua
+
+	按名字创建，创建后一直存在到进程退出。计数器、仪表和位集的读写都是一条原子操作，
+	可以在任何服务里直接调用，不需要发消息给一个计数服务。
+	滑动窗口的速率计数器按秒分桶，用一把自旋锁保护。
+ */
+
+#define KIND_COUNTER 1
+#define KIND_GAUGE 2
+#define KIND_BITSET 3
+#define KIND_RATE 4
+
+#define BITSET_MAX (64 * 1024 * 1024)
+#define RATE_MAXWINDOW 3600
+#define WORD_BITS (int)(sizeof(unsigned long) * 8)
+
+struct object {
+	struct object * next;
+	int kind;
+	char * name;
+};
+
+// 计数器和仪表，仪表还记录最大值
+struct counter {
+	struct object header;
+	ATOM_ULONG value;
+	ATOM_ULONG peak;
+	char pad[64];		// 避免两个计数器在同一个缓存行
+};
+
+struct bitset {
+	struct object header;
+	int bits;
+	int words;		// 每个字是一个 unsigned long
+	ATOM_ULONG word[1];
+};
+
+struct rate_slot {
+	uint64_t sec;
+	int64_t count;
+};
+
+struct rate {
+	struct object header;
+	struct spinlock lock;
+	int window;		// 秒，每秒一个桶
+	struct rate_slot slot[1];
+};
+
+static ATOM_POINTER G = 0;	// 所有对象的链表，只增加
+
+static struct object *
+object_find(struct object *obj, const char *name) {
+	while (obj) {
+		if (strcmp(obj->name, name) == 0)
+			return obj;
+		obj = obj->next;
+	}
+	return NULL;
+}
+
+static void
+object_delete(struct object *obj) {
+	if (obj->kind == KIND_RATE)
+		spinlock_destroy(&((struct rate *)obj)->lock);
+	skynet_free(obj->name);
+	skynet_free(obj);
+}
+
+static struct object *
+object_new(int kind, const char *name, int size) {
+	size_t sz;
+	switch (kind) {
+	case KIND_BITSET:
+		sz = sizeof(struct bitset) + ((size + WORD_BITS - 1) / WORD_BITS - 1) * sizeof(ATOM_ULONG);
+		break;
+	case KIND_RATE:
+		sz = sizeof(struct rate) + (size - 1) * sizeof(struct rate_slot);
+		break;
+	default:
+		sz = sizeof(struct counter);
+		break;
+	}
+	struct object * obj = skynet_malloc(sz);
+	memset(obj, 0, sz);
+	obj->kind = kind;
+	obj->name = skynet_malloc(strlen(name) + 1);
+	strcpy(obj->name, name);
+	int i;
+	switch (kind) {
+	case KIND_BITSET: {
+		struct bitset * b = (struct bitset *)obj;
+		b->bits = size;
+		b->words = (size + WORD_BITS - 1) / WORD_BITS;
+		for (i=0;i<b->words;i++)
+			ATOM_INIT(&b->word[i], 0);
+		break;
+	}
+	case KIND_RATE: {
+		struct rate * r = (struct rate *)obj;
+		spinlock_init(&r->lock);
+		r->window = size;
+		break;
+	}
+	default: {
+		struct counter * c = (struct counter *)obj;
+		ATOM_INIT(&c->value, 0);
+		ATOM_INIT(&c->peak, 0);
+		break;
+	}
+	}
+	return obj;
+}
+
+// 同名的对象已经存在时返回它，参数以第一次创建的为准
+static struct object *
+object_query(lua_State *L, int kind, const char *name, int size) {
+	struct object * obj = NULL;
+	for (;;) {
+		struct object * list = (struct object *)ATOM_LOAD(&G);
+		struct object * exist = object_find(list, name);
+		if (exist) {
+			if (obj)
+				object_delete(obj);
+			if (exist->kind != kind)
+				luaL_error(L, "%s exists with another type", name);
+			return exist;
+		}
+		if (obj == NULL)
+			obj = object_new(kind, name, size);
+		obj->next = list;
+		if (ATOM_CAS_POINTER(&G, (uintptr_t)list, (uintptr_t)obj))
+			return obj;
+	}
+}
+
+static void *
+check_object(lua_State *L, int kind) {
+	struct object * obj = lua_touserdata(L, 1);
+	if (obj == NULL)
+		luaL_error(L, "Need a shared counter");
+	if (obj->kind != kind && !(kind == KIND_COUNTER && obj->kind == KIND_GAUGE))
+		luaL_error(L, "Invalid type of %s", obj->name);
+	return obj;
+}
+
+static int
+lcounter(lua_State *L) {
+	const char * name = luaL_checkstring(L, 1);
+	lua_pushlightuserdata(L, object_query(L, KIND_COUNTER, name, 0));
+	return 1;
+}
+
+static int
+lgauge(lua_State *L) {
+	const char * name = luaL_checkstring(L, 1);
+	lua_pushlightuserdata(L, object_query(L, KIND_GAUGE, name, 0));
+	return 1;
+}
+
+/*
+	string name, integer bits
+ */
+static int
+lbitset(lua_State *L) {
+	const char * name = luaL_checkstring(L, 1);
+	lua_Integer bits = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, bits > 0 && bits <= BITSET_MAX, 2, "Invalid bits");
+	lua_pushlightuserdata(L, object_query(L, KIND_BITSET, name, (int)bits));
+	return 1;
+}
+
+/*
+	string name, integer window (in second)
+ */
+static int
+lrate(lua_State *L) {
+	const char * name = luaL_checkstring(L, 1);
+	lua_Integer window = luaL_optinteger(L, 2, 60);
+	luaL_argcheck(L, window > 0 && window <= RATE_MAXWINDOW, 2, "Invalid window");
+	lua_pushlightuserdata(L, object_query(L, KIND_RATE, name, (int)window));
+	return 1;
+}
+
+static void
+update_peak(struct counter *c, unsigned long v) {
+	if (c->header.kind != KIND_GAUGE)
+		return;
+	for (;;) {
+		unsigned long peak = ATOM_LOAD(&c->peak);
+		if ((long)v <= (long)peak || ATOM_CAS_ULONG(&c->peak, peak, v))
+			return;
+	}
+}
+
+/*
+	counter, integer n (default 1)
+	return the new value
+ */
+static int
+ladd(lua_State *L) {
+	struct counter * c = check_object(L, KIND_COUNTER);
+	unsigned long n = (unsigned long)luaL_optinteger(L, 2, 1);
+	unsigned long v = ATOM_FADD(&c->value, n) + n;
+	update_peak(c, v);
+	lua_pushinteger(L, (lua_Integer)(long)v);
+	return 1;
+}
+
+static int
+lget(lua_State *L) {
+	struct counter * c = check_object(L, KIND_COUNTER);
+	lua_pushinteger(L, (lua_Integer)(long)ATOM_LOAD(&c->value));
+	return 1;
+}
+
+/*
+	counter, integer v
+	return the old value
+ */
+static int
+lset(lua_State *L) {
+	struct counter * c = check_object(L, KIND_COUNTER);
+	unsigned long v = (unsigned long)luaL_checkinteger(L, 2);
+	unsigned long old;
+	do {
+		old = ATOM_LOAD(&c->value);
+	} while (!ATOM_CAS_ULONG(&c->value, old, v));
+	update_peak(c, v);
+	lua_pushinteger(L, (lua_Integer)(long)old);
+	return 1;
+}
+
+/*
+	counter, integer old, integer new
+	return true if the value was old and is set to new
+ */
+static int
+lcas(lua_State *L) {
+	struct counter * c = check_object(L, KIND_COUNTER);
+	unsigned long oval = (unsigned long)luaL_checkinteger(L, 2);
+	unsigned long nval = (unsigned long)luaL_checkinteger(L, 3);
+	// ATOM_CAS_ULONG 可能假失败，值没有变时重试
+	while (!ATOM_CAS_ULONG(&c->value, oval, nval)) {
+		if (ATOM_LOAD(&c->value) != oval) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+	}
+	update_peak(c, nval);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+	gauge
+	return the peak value, and reset it to the current value
+ */
+static int
+lpeak(lua_State *L) {
+	struct counter * c = check_object(L, KIND_GAUGE);
+	unsigned long peak;
+	do {
+		peak = ATOM_LOAD(&c->peak);
+	} while (!ATOM_CAS_ULONG(&c->peak, peak, ATOM_LOAD(&c->value)));
+	lua_pushinteger(L, (lua_Integer)(long)peak);
+	return 1;
+}
+
+static struct bitset *
+check_bit(lua_State *L, unsigned long *mask, int *idx) {
+	struct bitset * b = check_object(L, KIND_BITSET);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, i >= 0 && i < b->bits, 2, "Out of range");
+	*idx = (int)(i / WORD_BITS);
+	*mask = 1ul << (i % WORD_BITS);
+	return b;
+}
+
+/*
+	bitset, integer i (0 based)
+	return the old bit
+ */
+static int
+lbitset_set(lua_State *L) {
+	unsigned long mask;
+	int idx;
+	struct bitset * b = check_bit(L, &mask, &idx);
+	lua_pushboolean(L, (ATOM_FOR(&b->word[idx], mask) & mask) != 0);
+	return 1;
+}
+
+static int
+lbitset_clear(lua_State *L) {
+	unsigned long mask;
+	int idx;
+	struct bitset * b = check_bit(L, &mask, &idx);
+	lua_pushboolean(L, (ATOM_FAND(&b->word[idx], ~mask) & mask) != 0);
+	return 1;
+}
+
+static int
+lbitset_test(lua_State *L) {
+	unsigned long mask;
+	int idx;
+	struct bitset * b = check_bit(L, &mask, &idx);
+	lua_pushboolean(L, (ATOM_LOAD(&b->word[idx]) & mask) != 0);
+	return 1;
+}
+
+/*
+	bitset
+	return the number of bits set
+ */
+static int
+lbitset_count(lua_State *L) {
+	struct bitset * b = check_object(L, KIND_BITSET);
+	lua_Integer n = 0;
+	int i;
+	for (i=0;i<b->words;i++) {
+		n += __builtin_popcountl(ATOM_LOAD(&b->word[i]));
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+/*
+	bitset
+	set the first clear bit, and return its index, or nil if all the bits are set
+ */
+static int
+lbitset_acquire(lua_State *L) {
+	struct bitset * b = check_object(L, KIND_BITSET);
+	int i;
+	for (i=0;i<b->words;i++) {
+		unsigned long w = ATOM_LOAD(&b->word[i]);
+		while (~w) {
+			unsigned long mask = ~w & (w + 1);	// 最低的 0 位
+			int bit = __builtin_ctzl(mask);
+			if (i * WORD_BITS + bit >= b->bits)
+				break;
+			unsigned long old = ATOM_FOR(&b->word[i], mask);
+			if (!(old & mask)) {
+				lua_pushinteger(L, i * WORD_BITS + bit);
+				return 1;
+			}
+			// 被其他线程抢先了
+			w = old | mask;
+		}
+	}
+	return 0;
+}
+
+/*
+	rate, integer n (default 1)
+ */
+static int
+lrate_add(lua_State *L) {
+	struct rate * r = check_object(L, KIND_RATE);
+	lua_Integer n = luaL_optinteger(L, 2, 1);
+	uint64_t sec = skynet_now() / 100;
+	struct rate_slot * s = &r->slot[sec % r->window];
+	spinlock_lock(&r->lock);
+	if (s->sec != sec) {
+		s->sec = sec;
+		s->count = 0;
+	}
+	s->count += n;
+	spinlock_unlock(&r->lock);
+	return 0;
+}
+
+/*
+	rate
+	return the sum in the window (the current second included), the window
+ */
+static int
+lrate_sum(lua_State *L) {
+	struct rate * r = check_object(L, KIND_RATE);
+	uint64_t sec = skynet_now() / 100;
+	int64_t sum = 0;
+	int i;
+	spinlock_lock(&r->lock);
+	for (i=0;i<r->window;i++) {
+		struct rate_slot * s = &r->slot[i];
+		if (s->count && sec - s->sec < (uint64_t)r->window)
+			sum += s->count;
+	}
+	spinlock_unlock(&r->lock);
+	lua_pushinteger(L, sum);
+	lua_pushinteger(L, r->window);
+	return 2;
+}
+
+/*
+	return { name = value } , the counters and gauges, the number of bits set of the bitsets, the sum of the rates
+ */
+static int
+llist(lua_State *L) {
+	struct object * obj = (struct object *)ATOM_LOAD(&G);
+	lua_newtable(L);
+	while (obj) {
+		lua_pushcfunction(L, obj->kind == KIND_BITSET ? lbitset_count : obj->kind == KIND_RATE ? lrate_sum : lget);
+		lua_pushlightuserdata(L, obj);
+		lua_call(L, 1, 1);
+		lua_setfield(L, -2, obj->name);
+		obj = obj->next;
+	}
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_skynet_sharecounter_core(lua_State *L) {
+	luaL_checkversion(L);
+
+	luaL_Reg l[] = {
+		{ "counter", lcounter },
+		{ "gauge", lgauge },
+		{ "bitset", lbitset },
+		{ "rate", lrate },
+		{ "add", ladd },
+		{ "get", lget },
+		{ "set", lset },
+		{ "cas", lcas },
+		{ "peak", lpeak },
+		{ "bitset_set", lbitset_set },
+		{ "bitset_clear", lbitset_clear },
+		{ "bitset_test", lbitset_test },
+		{ "bitset_count", lbitset_count },
+		{ "bitset_acquire", lbitset_acquire },
+		{ "rate_add", lrate_add },
+		{ "rate_sum", lrate_sum },
+		{ "list", llist },
+		{ NULL, NULL },
+	};
+
+	luaL_newlib(L,l);
+
+	return 1;
+}
@@ -8,6 +8,8 @@
 #include <assert.h>
 #include "atomic.h"
 
+#include "lobject.h"
+
 // 键类型定义
 #define KEYTYPE_INTEGER 0  // 整数键
 #define KEYTYPE_STRING 1   // 字符串键
@@ -58,12 +60,21 @@ struct state {
 struct table {
 	int sizearray;       // 数组部分大小
 	int sizehash;        // 哈希部分大小
+	int sizebucket;      // 完美哈希的桶数量
 	uint8_t *arraytype;  // 数组类型数组
 	union value * array; // 数组值数组
 	struct node * hash;  // 哈希节点数组
+	uint32_t * disp;     // 完美哈希每个桶的偏移，NULL 表示用冲突链
 	lua_State * L;       // Lua 状态机
 };
 
+// 构造完美哈希时收集的键
+struct hashkey {
+	uint32_t keyhash;
+	int slot;	// 放入的槽位
+	int chain;	// 放不下的桶里，链上的下一个键，-1 表示没有
+};
+
 // 上下文结构
 struct context {
 	lua_State * L;       // Lua 状态机
@@ -104,19 +115,27 @@ countsize(lua_State *L, int sizearray) {
 	return n;
 }
 
-// 计算字符串哈希值
+// 计算字符串哈希值（只用于长字符串，每个字节都参与计算，避免采样带来的大量冲突）
 static uint32_t
 calchash(const char * str, size_t l) {
 	uint32_t h = (uint32_t)l;  // 初始哈希值为字符串长度
 	size_t l1;
-	size_t step = (l >> 5) + 1;  // 步长
-	// 按步长采样字符计算哈希
-	for (l1 = l; l1 >= step; l1 -= step) {
+	for (l1 = l; l1 > 0; l1--) {
 		h = h ^ ((h<<5) + (h>>2) + (uint8_t)(str[l1 - 1]));
 	}
 	return h;
 }
 
+// 短字符串直接用 Lua 缓存的哈希值（所有 lua_State 共用同一个种子），长字符串用 calchash
+static uint32_t
+stringhash(lua_State *L, int index, const char *str, size_t sz) {
+	const TString * ts = (const TString *)lua_topointer(L, index);
+	if (ts->tt == LUA_VSHRSTR) {
+		return ts->hash;
+	}
+	return calchash(str, sz);
+}
+
 // 获取字符串在字符串表中的索引
 static int
 stringindex(struct context *ctx, const char * str, size_t sz) {
@@ -230,7 +249,7 @@ ishashkey(struct context * ctx, lua_State *L, int index, int *key, uint32_t *key
 		// 字符串键
 		size_t sz = 0;
 		const char * s = lua_tolstring(L, index, &sz);
-		*keyhash = calchash(s, sz);           // 计算哈希值
+		*keyhash = stringhash(L, index, s, sz);  // 计算哈希值
 		*key = stringindex(ctx, s, sz);       // 获取字符串索引
 		*keytype = KEYTYPE_STRING;
 	}
@@ -310,6 +329,239 @@ fillcolliding(lua_State *L, struct context *ctx) {
 	}
 }
 
+#define PERFECT_DIRECT 0x80000000  // 偏移直接记录槽位（单个键的桶，或者放不下而链起来的桶）
+#define PERFECT_MAXTRY 1024
+
+static inline uint32_t
+perfect_mix(uint32_t h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+// 连续的整数键也要均匀分到各个桶
+static inline int
+perfect_bucket(uint32_t keyhash, int nb) {
+	return perfect_mix(keyhash ^ 0x5bd1e995) % nb;
+}
+
+// 一次探测得到键的槽位
+static inline int
+perfect_slot(const struct table *tbl, uint32_t keyhash) {
+	uint32_t d = tbl->disp[perfect_bucket(keyhash, tbl->sizebucket)];
+	if (d & PERFECT_DIRECT) {
+		return d & ~PERFECT_DIRECT;
+	}
+	return perfect_mix(keyhash + d * 0x9e3779b9) % tbl->sizehash;
+}
+
+// 为桶 b 找一个让所有键都落在空槽的偏移，找不到时返回 0
+// k 中的键哈希值各不相同
+static int
+perfect_place(struct table *tbl, struct hashkey *keys, const int *k, int sz, uint8_t *used, int b) {
+	int n = tbl->sizehash;
+	int i;
+	uint32_t d;
+	for (d=0;d<PERFECT_MAXTRY;d++) {
+		for (i=0;i<sz;i++) {
+			int slot = perfect_mix(keys[k[i]].keyhash + d * 0x9e3779b9) % n;
+			if (used[slot])
+				break;
+			used[slot] = 1;
+			keys[k[i]].slot = slot;
+		}
+		if (i == sz) {
+			tbl->disp[b] = d;
+			return 1;
+		}
+		// 撤销这次尝试
+		while (--i >= 0) {
+			used[keys[k[i]].slot] = 0;
+		}
+	}
+	return 0;
+}
+
+static int
+take_freeslot(uint8_t *used, int *freeslot) {
+	while (used[*freeslot])
+		++*freeslot;
+	used[*freeslot] = 1;
+	return *freeslot;
+}
+
+// 用 hash and displace 构造最小完美哈希：键按桶分组，从大桶开始为每个桶找一个让所有键都落在空槽的偏移
+// 少数放不下的桶放进空槽，用 next 链起来；哈希值和前面的键相同的键也链在那个键后面
+static int
+perfect_build(struct table *tbl, struct hashkey *keys, uint8_t *used) {
+	int n = tbl->sizehash;
+	int nb = tbl->sizebucket;
+	int i, j;
+	// size[b] 桶的键数, order 按键数从大到小排列的桶, first[b] .. first[b+1] 是桶 b 在 bykey 中的键
+	int * size = (int *)calloc(nb * 4 + 1 + n, sizeof(int));
+	if (size == NULL)
+		return 0;
+	int * order = size + nb;
+	int * first = order + nb;
+	int * pos = first + nb + 1;
+	int * bykey = pos + nb;
+	int maxsize = 0;
+	for (i=0;i<n;i++) {
+		keys[i].chain = -1;
+		int b = perfect_bucket(keys[i].keyhash, nb);
+		if (++size[b] > maxsize)
+			maxsize = size[b];
+	}
+	first[0] = 0;
+	for (i=0;i<nb;i++) {
+		first[i+1] = first[i] + size[i];
+		pos[i] = first[i];
+	}
+	for (i=0;i<n;i++) {
+		bykey[pos[perfect_bucket(keys[i].keyhash, nb)]++] = i;
+	}
+	// 计数排序，键数多的桶在前
+	int * start = (int *)calloc(maxsize + 2, sizeof(int));
+	if (start == NULL) {
+		free(size);
+		return 0;
+	}
+	for (i=0;i<nb;i++) {
+		++start[maxsize - size[i] + 1];
+	}
+	for (i=1;i<=maxsize+1;i++) {
+		start[i] += start[i-1];
+	}
+	for (i=0;i<nb;i++) {
+		order[start[maxsize - size[i]]++] = i;
+	}
+	free(start);
+	memset(used, 0, n);
+	memset(tbl->disp, 0, nb * sizeof(uint32_t));	// 空桶也要能查找（查不到）
+	int freeslot = 0;
+	int ndup = 0;
+	for (i=0;i<nb;i++) {
+		int b = order[i];
+		int sz = size[b];
+		int * k = bykey + first[b];
+		if (sz == 0)
+			break;
+		// 哈希值重复的键移到桶的末尾，先不放
+		int unique = sz;
+		for (j=1;j<unique;j++) {
+			int p;
+			for (p=0;p<j;p++) {
+				if (keys[k[p]].keyhash == keys[k[j]].keyhash)
+					break;
+			}
+			if (p < j) {
+				int tmp = k[j];
+				k[j] = k[--unique];
+				k[unique] = tmp;
+				--j;
+			}
+		}
+		ndup += sz - unique;
+		if (unique == 1) {
+			keys[k[0]].slot = take_freeslot(used, &freeslot);
+			tbl->disp[b] = PERFECT_DIRECT | keys[k[0]].slot;
+		} else if (!perfect_place(tbl, keys, k, unique, used, b)) {
+			for (j=0;j<unique;j++) {
+				keys[k[j]].slot = take_freeslot(used, &freeslot);
+				if (j > 0) {
+					keys[k[j-1]].chain = k[j];
+				}
+			}
+			tbl->disp[b] = PERFECT_DIRECT | keys[k[0]].slot;
+		}
+	}
+	if (ndup > 0) {
+		// 重复的键链在哈希值相同的第一个键后面
+		for (i=0;i<nb;i++) {
+			int b = order[i];
+			int sz = size[b];
+			int * k = bykey + first[b];
+			if (sz == 0)
+				break;
+			for (j=1;j<sz;j++) {
+				int p;
+				for (p=0;p<j;p++) {
+					if (keys[k[p]].keyhash == keys[k[j]].keyhash)
+						break;
+				}
+				if (p < j) {
+					int dup = k[j];
+					keys[dup].slot = take_freeslot(used, &freeslot);
+					keys[dup].chain = keys[k[p]].chain;
+					keys[k[p]].chain = dup;
+				}
+			}
+		}
+	}
+	free(size);
+	return 1;
+}
+
+// 收集哈希部分的键，构造完美哈希，按槽位填充
+static int
+fillperfect(lua_State *L, struct context *ctx) {
+	struct table * tbl = ctx->tbl;
+	int n = tbl->sizehash;
+	int nb = (n + 1) / 2;
+	struct hashkey * keys = (struct hashkey *)malloc(n * sizeof(*keys));
+	uint8_t * used = (uint8_t *)malloc(n);
+	tbl->disp = (uint32_t *)malloc(nb * sizeof(uint32_t));
+	tbl->sizebucket = nb;
+	int ok = keys && used && tbl->disp;
+	int i = 0;
+	if (ok) {
+		lua_pushnil(L);
+		while (lua_next(L, 1) != 0) {
+			int key;
+			int keytype;
+			if (ishashkey(ctx, L, -2, &key, &keys[i].keyhash, &keytype)) {
+				++i;
+			}
+			lua_pop(L, 1);
+		}
+		ok = perfect_build(tbl, keys, used);
+	}
+	free(used);
+	if (!ok) {
+		free(keys);
+		free(tbl->disp);
+		tbl->disp = NULL;
+		tbl->sizebucket = 0;
+		return 0;
+	}
+	// 第二遍遍历的顺序和第一遍相同
+	i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 1) != 0) {
+		int key;
+		int keytype;
+		uint32_t keyhash;
+		if (!ishashkey(ctx, L, -2, &key, &keyhash, &keytype)) {
+			setarray(ctx, L, -1, key);
+		} else {
+			struct hashkey * hk = &keys[i++];
+			struct node * n = &tbl->hash[hk->slot];
+			n->key = key;
+			n->keytype = keytype;
+			n->keyhash = keyhash;
+			n->next = hk->chain < 0 ? -1 : keys[hk->chain].slot;
+			n->nocolliding = 0;
+			setvalue(ctx, L, -1, n);
+		}
+		lua_pop(L, 1);
+	}
+	free(keys);
+	return 1;
+}
+
 // table need convert
 // struct context * ctx
 // 需要转换的表
@@ -356,8 +608,10 @@ convtable(lua_State *L) {
 		}
 		tbl->sizehash = sizehash;
 
-		fillnocolliding(L, ctx);  // 填充无冲突项
-		fillcolliding(L, ctx);    // 填充冲突项
+		if (!fillperfect(L, ctx)) {
+			fillnocolliding(L, ctx);  // 填充无冲突项
+			fillcolliding(L, ctx);    // 填充冲突项
+		}
 	} else {
 		// 只有数组部分
 		int i;
@@ -393,6 +647,7 @@ delete_tbl(struct table *tbl) {
 	free(tbl->arraytype);  // 释放数组类型数组
 	free(tbl->array);      // 释放数组值数组
 	free(tbl->hash);       // 释放哈希表
+	free(tbl->disp);       // 释放完美哈希偏移
 	free(tbl);             // 释放表结构本身
 }
 
@@ -570,9 +825,15 @@ static struct node *
 lookup_key(struct table *tbl, uint32_t keyhash, int key, int keytype, const char *str, size_t sz) {
 	if (tbl->sizehash == 0)
 		return NULL;
-	struct node *n = &tbl->hash[keyhash % tbl->sizehash];
-	if (keyhash != n->keyhash && n->nocolliding)
-		return NULL;
+	struct node *n;
+	if (tbl->disp) {
+		// 完美哈希一般只需要探测一次，只有放不下的桶才有 next 链
+		n = &tbl->hash[perfect_slot(tbl, keyhash)];
+	} else {
+		n = &tbl->hash[keyhash % tbl->sizehash];
+		if (keyhash != n->keyhash && n->nocolliding)
+			return NULL;
+	}
 	for (;;) {
 		if (keyhash == n->keyhash) {
 			if (n->keytype == KEYTYPE_INTEGER) {
@@ -625,7 +886,7 @@ lindexconf(lua_State *L) {
 	} else {
 		// 字符串键
 		str = luaL_checklstring(L, 2, &sz);
-		keyhash = calchash(str, sz);  // 计算哈希值
+		keyhash = stringhash(L, 2, str, sz);  // 计算哈希值
 		keytype = KEYTYPE_STRING;
 	}
 
@@ -702,7 +963,7 @@ lnextkey(lua_State *L) {
 		keytype = KEYTYPE_INTEGER;
 	} else {
 		str = luaL_checklstring(L, 2, &sz);
-		keyhash = calchash(str, sz);
+		keyhash = stringhash(L, 2, str, sz);
 		keytype = KEYTYPE_STRING;
 	}
 
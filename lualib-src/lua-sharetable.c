@@ -8,9 +8,9 @@
 
 #ifdef makeshared
 
-// 递归标记表为共享
+// 递归标记表为共享，keys 为统计字符串键出现次数的表（栈上的绝对索引）
 static void
-mark_shared(lua_State *L) {
+mark_shared(lua_State *L, int keys) {
 	if (lua_type(L, -1) != LUA_TTABLE) {
 		luaL_error(L, "Not a table, it's a %s.", lua_typename(L, lua_type(L, -1)));
 	}
@@ -18,7 +18,7 @@ mark_shared(lua_State *L) {
 	if (isshared(t))
 		return;  // 已经是共享表
 	makeshared(t);  // 标记为共享
-	luaL_checkstack(L, 4, NULL);
+	luaL_checkstack(L, 6, NULL);
 	if (lua_getmetatable(L, -1)) {
 		luaL_error(L, "Can't share metatable");
 	}
@@ -32,7 +32,7 @@ mark_shared(lua_State *L) {
 			int t = lua_type(L, idx);
 			switch (t) {
 			case LUA_TTABLE:
-				mark_shared(L);  // 递归处理嵌套表
+				mark_shared(L, keys);  // 递归处理嵌套表
 				break;
 			case LUA_TNUMBER:
 			case LUA_TBOOLEAN:
@@ -49,6 +49,15 @@ mark_shared(lua_State *L) {
 				break;
 			case LUA_TSTRING:
 				lua_sharestring(L, idx);  // 共享字符串
+				if (i == 1) {
+					// 键，计数
+					lua_pushvalue(L, idx);
+					lua_pushvalue(L, -1);
+					lua_Integer n = (lua_rawget(L, keys) == LUA_TNUMBER) ? lua_tointeger(L, -1) : 0;
+					lua_pop(L, 1);
+					lua_pushinteger(L, n + 1);
+					lua_rawset(L, keys);
+				}
 				break;
 			default:
 				luaL_error(L, "Invalid type [%s]", lua_typename(L, t));
@@ -77,7 +86,18 @@ make_matrix(lua_State *L) {
 	// turn off gc , because marking shared will prevent gc mark.
 	// 关闭 GC，因为标记共享会阻止 GC 标记
 	lua_gc(L, LUA_GCSTOP, 0);
-	mark_shared(L);  // 标记为共享
+	lua_newtable(L);
+	lua_insert(L, -2);
+	int keys = lua_gettop(L) - 1;
+	mark_shared(L, keys);  // 标记为共享
+	// 在多个表中出现的键（字段名）放进进程级的字符串池，只出现一次的（如 id）不放
+	lua_pushnil(L);
+	while (lua_next(L, keys) != 0) {
+		if (lua_tointeger(L, -1) > 1)
+			lua_poolstring(L, -2);
+		lua_pop(L, 1);
+	}
+	lua_remove(L, keys);
 	Table * t = (Table *)lua_topointer(L, -1);
 	lua_pushlightuserdata(L, t);  // 返回表指针
 	return 1;
@@ -0,0 +1,411 @@
+#define LUA_LIB
+
+#include "skynet.h"
+#include "atomic.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+	同一台机器上两个进程之间的共享内存通道，见 lualib/skynet/shmchannel.lua
+
+	一个共享内存文件里有两个单生产者单消费者的字节环，每个方向一个，
+	创建方（side 0）写环 0 读环 1，打开方（side 1）写环 1 读环 0。
+	每一方有一个门铃（命名管道 path.0 和 path.1，分别由 side 1 和 side 0 读），
+	只在对方睡眠（读空了，或者等待写入的空间）时才敲门铃，忙的时候数据不经过内核。
+	门铃的读端交给 socket_server（socket.bind），敲门铃就是一条 socket 消息。
+ */
+
+#define SHMRING_MAGIC 0x534b5252	// "SKRR"
+#define SHMRING_MIN (64 * 1024)
+#define METANAME "SHMRING"
+
+struct ring {
+	ATOM_ULONG head;        // 写入的总字节数，只有写方修改
+	char pad1[64 - sizeof(ATOM_ULONG)];
+	ATOM_ULONG tail;        // 读出的总字节数，只有读方修改
+	char pad2[64 - sizeof(ATOM_ULONG)];
+	ATOM_INT rsleep;        // 读方读空了要睡眠，写方写入后敲门铃
+	ATOM_INT wsleep;        // 写方在等待空间，读方读出后敲门铃
+	char pad3[64 - 2 * sizeof(ATOM_INT)];
+};
+
+struct segment {
+	uint32_t magic;
+	uint32_t capacity;      // 每个环的大小，2 的幂
+	ATOM_INT pid[2];        // 两方的进程号，打开方连上之前 pid[1] 为 0
+	char pad[64 - 8 - 2 * sizeof(ATOM_INT)];
+	struct ring ring[2];
+	// 之后是环 0 和环 1 的数据
+};
+
+struct shmring {
+	struct segment *seg;
+	size_t mapsize;
+	int side;
+	int bell_read;          // 自己的门铃（读端），交给 socket_server 之后为 -1
+	int bell_write;         // 对方的门铃（写端）
+	char path[256];
+};
+
+static inline char *
+ring_data(struct segment *seg, int idx) {
+	return (char *)(seg + 1) + (size_t)idx * seg->capacity;
+}
+
+static void
+ring_bell(struct shmring *r) {
+	char c = 0;
+	// 管道满了说明对方已经有没处理的门铃，忽略
+	ssize_t n = write(r->bell_write, &c, 1);
+	(void)n;
+}
+
+static struct shmring *
+check_ring(lua_State *L) {
+	struct shmring *r = luaL_checkudata(L, 1, METANAME);
+	if (r->seg == NULL)
+		luaL_error(L, "shmring %s is closed", r->path);
+	return r;
+}
+
+static void
+bell_path(char *buf, size_t sz, const char *path, int idx) {
+	snprintf(buf, sz, "%s.%c", path, '0' + idx);
+}
+
+static int
+open_bells(struct shmring *r) {
+	char tmp[sizeof(r->path) + 4];
+	// 命名管道用 O_RDWR 打开，不会等待另一端，也不会读到 EOF
+	bell_path(tmp, sizeof(tmp), r->path, r->side);
+	r->bell_read = open(tmp, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	bell_path(tmp, sizeof(tmp), r->path, 1 - r->side);
+	r->bell_write = open(tmp, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	return r->bell_read >= 0 && r->bell_write >= 0;
+}
+
+static void
+close_ring(struct shmring *r) {
+	if (r->seg) {
+		munmap(r->seg, r->mapsize);
+		r->seg = NULL;
+	}
+	if (r->bell_read >= 0) {
+		close(r->bell_read);
+		r->bell_read = -1;
+	}
+	if (r->bell_write >= 0) {
+		close(r->bell_write);
+		r->bell_write = -1;
+	}
+}
+
+static int
+lgc(lua_State *L) {
+	struct shmring *r = luaL_checkudata(L, 1, METANAME);
+	close_ring(r);
+	return 0;
+}
+
+static struct shmring *
+new_ring(lua_State *L, const char *path, int side) {
+	size_t sz = strlen(path);
+	if (sz + 4 > sizeof(((struct shmring *)0)->path))
+		luaL_error(L, "shmring path %s is too long", path);
+	struct shmring *r = lua_newuserdatauv(L, sizeof(*r), 0);
+	memset(r, 0, sizeof(*r));
+	r->side = side;
+	r->bell_read = -1;
+	r->bell_write = -1;
+	memcpy(r->path, path, sz + 1);
+	luaL_setmetatable(L, METANAME);
+	return r;
+}
+
+static void
+unlink_all(const char *path) {
+	char tmp[256 + 4];
+	unlink(path);
+	bell_path(tmp, sizeof(tmp), path, 0);
+	unlink(tmp);
+	bell_path(tmp, sizeof(tmp), path, 1);
+	unlink(tmp);
+}
+
+// create(path, capacity)  创建共享内存文件和两个门铃，返回 side 0
+static int
+lcreate(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer cap = luaL_optinteger(L, 2, 1024 * 1024);
+	uint32_t capacity = SHMRING_MIN;
+	while (capacity < cap && capacity < 0x40000000)
+		capacity *= 2;
+	struct shmring *r = new_ring(L, path, 0);
+	char tmp[sizeof(r->path) + 4];
+	int i;
+	for (i=0;i<2;i++) {
+		bell_path(tmp, sizeof(tmp), path, i);
+		if (mkfifo(tmp, 0600) != 0) {
+			int err = errno;
+			unlink_all(path);
+			return luaL_error(L, "shmring mkfifo %s : %s", tmp, strerror(err));
+		}
+	}
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		int err = errno;
+		unlink_all(path);
+		return luaL_error(L, "shmring create %s : %s", path, strerror(err));
+	}
+	size_t mapsize = sizeof(struct segment) + (size_t)capacity * 2;
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, mapsize) == 0) {
+		p = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	int err = errno;
+	close(fd);
+	if (p == MAP_FAILED) {
+		unlink_all(path);
+		return luaL_error(L, "shmring map %s : %s", path, strerror(err));
+	}
+	struct segment *seg = p;
+	memset(seg, 0, sizeof(*seg));
+	seg->capacity = capacity;
+	ATOM_STORE(&seg->pid[0], (int)getpid());
+	ATOM_STORE(&seg->pid[1], 0);
+	for (i=0;i<2;i++) {
+		ATOM_STORE(&seg->ring[i].head, 0);
+		ATOM_STORE(&seg->ring[i].tail, 0);
+		ATOM_STORE(&seg->ring[i].rsleep, 0);
+		ATOM_STORE(&seg->ring[i].wsleep, 0);
+	}
+	seg->magic = SHMRING_MAGIC;
+	r->seg = seg;
+	r->mapsize = mapsize;
+	if (!open_bells(r)) {
+		err = errno;
+		close_ring(r);
+		unlink_all(path);
+		return luaL_error(L, "shmring open doorbell %s : %s", path, strerror(err));
+	}
+	return 1;
+}
+
+// attach(path)  打开对方创建的通道（side 1），打开之后文件就删掉了，两方退出后内存自动释放
+static int
+lattach(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	struct shmring *r = new_ring(L, path, 1);
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		return luaL_error(L, "shmring open %s : %s", path, strerror(errno));
+	}
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(struct segment)) {
+		p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (p == MAP_FAILED) {
+		return luaL_error(L, "shmring map %s failed", path);
+	}
+	struct segment *seg = p;
+	r->seg = seg;
+	r->mapsize = st.st_size;
+	if (seg->magic != SHMRING_MAGIC || sizeof(struct segment) + (size_t)seg->capacity * 2 != r->mapsize) {
+		close_ring(r);
+		return luaL_error(L, "shmring %s is invalid", path);
+	}
+	if (!open_bells(r)) {
+		int err = errno;
+		close_ring(r);
+		return luaL_error(L, "shmring open doorbell %s : %s", path, strerror(err));
+	}
+	unlink_all(path);
+	ATOM_STORE(&seg->pid[1], (int)getpid());
+	return 1;
+}
+
+// 对方已经打开了通道
+static int
+lattached(lua_State *L) {
+	struct shmring *r = check_ring(L);
+	lua_pushboolean(L, ATOM_LOAD(&r->seg->pid[1 - r->side]) != 0);
+	return 1;
+}
+
+// 对方进程还在
+static int
+lalive(lua_State *L) {
+	struct shmring *r = check_ring(L);
+	int pid = ATOM_LOAD(&r->seg->pid[1 - r->side]);
+	lua_pushboolean(L, pid != 0 && (kill(pid, 0) == 0 || errno == EPERM));
+	return 1;
+}
+
+/*
+	write(string) 或 write(lightuserdata, sz)
+	全部写入返回 true，空间不够时一个字节也不写，返回 false，读方腾出空间之后会敲门铃
+ */
+static int
+lwrite(lua_State *L) {
+	struct shmring *r = check_ring(L);
+	const char *data;
+	size_t sz;
+	if (lua_type(L, 2) == LUA_TLIGHTUSERDATA) {
+		data = lua_touserdata(L, 2);
+		sz = (size_t)luaL_checkinteger(L, 3);
+	} else {
+		data = luaL_checklstring(L, 2, &sz);
+	}
+	struct segment *seg = r->seg;
+	uint32_t cap = seg->capacity;
+	if (sz > cap)
+		return luaL_error(L, "shmring write %d bytes, more than the capacity %d", (int)sz, (int)cap);
+	struct ring *ring = &seg->ring[r->side];
+	unsigned long head = ATOM_LOAD(&ring->head);
+	if (head - ATOM_LOAD(&ring->tail) + sz > cap) {
+		// 先登记等待，再检查一次，避免读方在两者之间读完而不敲门铃
+		ATOM_STORE(&ring->wsleep, 1);
+		if (head - ATOM_LOAD(&ring->tail) + sz > cap) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		ATOM_STORE(&ring->wsleep, 0);
+	}
+	char *buf = ring_data(seg, r->side);
+	uint32_t pos = head & (cap - 1);
+	uint32_t n = cap - pos;
+	if (n >= sz) {
+		memcpy(buf + pos, data, sz);
+	} else {
+		memcpy(buf + pos, data, n);
+		memcpy(buf, data + n, sz - n);
+	}
+	ATOM_STORE(&ring->head, head + sz);
+	if (ATOM_LOAD(&ring->rsleep) && ATOM_CAS(&ring->rsleep, 1, 0)) {
+		ring_bell(r);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// read()  读出所有的数据，没有数据返回 nil
+static int
+lread(lua_State *L) {
+	struct shmring *r = check_ring(L);
+	struct segment *seg = r->seg;
+	int idx = 1 - r->side;
+	struct ring *ring = &seg->ring[idx];
+	unsigned long tail = ATOM_LOAD(&ring->tail);
+	unsigned long head = ATOM_LOAD(&ring->head);
+	if (head == tail)
+		return 0;
+	uint32_t cap = seg->capacity;
+	size_t sz = head - tail;
+	const char *buf = ring_data(seg, idx);
+	uint32_t pos = tail & (cap - 1);
+	uint32_t n = cap - pos;
+	if (n >= sz) {
+		lua_pushlstring(L, buf + pos, sz);
+	} else {
+		luaL_Buffer b;
+		luaL_buffinitsize(L, &b, sz);
+		luaL_addlstring(&b, buf + pos, n);
+		luaL_addlstring(&b, buf, sz - n);
+		luaL_pushresult(&b);
+	}
+	ATOM_STORE(&ring->tail, head);
+	if (ATOM_LOAD(&ring->wsleep) && ATOM_CAS(&ring->wsleep, 1, 0)) {
+		ring_bell(r);
+	}
+	return 1;
+}
+
+/*
+	sleep()  准备睡眠：登记之后再检查一次，这时已经有数据就取消登记，返回 false（不要睡眠）
+	之后对方写入时会敲门铃
+ */
+static int
+lsleep(lua_State *L) {
+	struct shmring *r = check_ring(L);
+	struct ring *ring = &r->seg->ring[1 - r->side];
+	ATOM_STORE(&ring->rsleep, 1);
+	if (ATOM_LOAD(&ring->head) != ATOM_LOAD(&ring->tail)) {
+		ATOM_STORE(&ring->rsleep, 0);
+		lua_pushboolean(L, 0);
+	} else {
+		lua_pushboolean(L, 1);
+	}
+	return 1;
+}
+
+// doorbell()  返回自己门铃的读端，调用者（socket.bind）负责关闭
+static int
+ldoorbell(lua_State *L) {
+	struct shmring *r = check_ring(L);
+	if (r->bell_read < 0)
+		return luaL_error(L, "shmring doorbell of %s is taken", r->path);
+	lua_pushinteger(L, r->bell_read);
+	r->bell_read = -1;
+	return 1;
+}
+
+// close()  创建方还没有被打开时，顺便删除文件
+static int
+lclose(lua_State *L) {
+	struct shmring *r = luaL_checkudata(L, 1, METANAME);
+	if (r->seg && r->side == 0 && ATOM_LOAD(&r->seg->pid[1]) == 0) {
+		unlink_all(r->path);
+	}
+	close_ring(r);
+	return 0;
+}
+
+static int
+lpath(lua_State *L) {
+	struct shmring *r = luaL_checkudata(L, 1, METANAME);
+	lua_pushstring(L, r->path);
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_skynet_shmring(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "create", lcreate },
+		{ "attach", lattach },
+		{ NULL, NULL },
+	};
+	luaL_Reg m[] = {
+		{ "write", lwrite },
+		{ "read", lread },
+		{ "sleep", lsleep },
+		{ "doorbell", ldoorbell },
+		{ "attached", lattached },
+		{ "alive", lalive },
+		{ "close", lclose },
+		{ "path", lpath },
+		{ NULL, NULL },
+	};
+	if (luaL_newmetatable(L, METANAME)) {
+		luaL_newlib(L, m);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lgc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+	luaL_newlib(L, l);
+	return 1;
+}
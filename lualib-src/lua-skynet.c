@@ -2,6 +2,8 @@
 
 #include "skynet.h"
 #include "lua-seri.h"
+#include "skynet_env.h"
+#include "skynet_timer.h"
 
 // 终端颜色控制码
 #define KNRM  "\x1B[0m"  // 正常颜色
@@ -9,6 +11,7 @@
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <lstate.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -156,6 +159,8 @@ lcallback(lua_State *L) {
 
 	// 设置回调函数（转发模式或普通模式）
 	skynet_callback(context, cb_ctx, (forward)?(_forward_pre):(_cb_pre));
+	// 普通模式处理完总会释放消息，可以直接接收共享消息；转发模式会保留消息
+	skynet_command(context, "SHAREDMSG", forward ? "off" : NULL);
 	return 0;
 }
 
@@ -222,8 +227,8 @@ lintcommand(lua_State *L) {
 	char tmp[64];	// for integer parm
 	                // 用于整数参数的临时缓冲区
 	if (lua_gettop(L) == 2) {
-		if (lua_isnumber(L, 2)) {
-			// 整数参数转换为字符串
+		if (lua_isinteger(L, 2)) {
+			// 整数参数转换为字符串，其他值（包括浮点数，如TIMEOUT的小数厘秒）按字符串传递
 			int32_t n = (int32_t)luaL_checkinteger(L,2);
 			sprintf(tmp, "%d", n);
 			parm = tmp;
@@ -327,9 +332,9 @@ send_message(lua_State *L, int source, int idx_type) {
 		luaL_error(L, "invalid param %s", lua_typename(L, lua_type(L,idx_type+2)));
 	}
 	if (session < 0) {
-		if (session == -2) {
-			// package is too large
-			// 包太大
+		if (session == -2 || session == -3) {
+			// package is too large, or the message queue of destination is full
+			// 包太大，或目标服务的消息队列超过背压阈值
 			lua_pushboolean(L, 0);
 			return 1;
 		}
@@ -360,6 +365,82 @@ lsend(lua_State *L) {
 	return send_message(L, 0, 2);  // 源地址为0（当前服务）
 }
 
+/*
+	table addresses (uint32 or string)
+	integer type
+	integer session (nil : alloc a session for each address)
+	string message
+	 lightuserdata message_ptr
+	 integer len
+
+	把同一个消息发给多个地址。消息只复制一次，声明过SHAREDMSG的服务共用这一份（见skynet_sendmulti）；
+	lightuserdata 消息由这里释放。返回和地址一一对应的会话表，发送失败的位置是 false
+ */
+// Lua 接口：发送同一个消息给多个服务
+static int
+lsendmulti(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int type = luaL_checkinteger(L, 2);
+	int session = 0;
+	if (lua_isnil(L, 3)) {
+		type |= PTYPE_TAG_ALLOCSESSION;
+	} else {
+		session = luaL_checkinteger(L, 3);
+	}
+	void * msg;
+	size_t sz;
+	switch (lua_type(L, 4)) {
+	case LUA_TSTRING:
+		msg = (void *)lua_tolstring(L, 4, &sz);
+		if (sz == 0) {
+			msg = NULL;
+		}
+		break;
+	case LUA_TLIGHTUSERDATA:
+		msg = lua_touserdata(L, 4);
+		sz = (size_t)luaL_checkinteger(L, 5);
+		type |= PTYPE_TAG_DONTCOPY;
+		if (skynet_message_finalized(msg, sz)) {
+			skynet_message_free(msg, sz);
+			return luaL_error(L, "sharedbuffer can't be sent to multiple services");
+		}
+		break;
+	default:
+		return luaL_error(L, "invalid param %s", lua_typename(L, lua_type(L,4)));
+	}
+	int n = (int)lua_rawlen(L, 1);
+	uint32_t tmp[64];
+	uint32_t * dest = tmp;
+	int * result;
+	if (n > (int)(sizeof(tmp) / (sizeof(uint32_t) + sizeof(int)))) {
+		dest = lua_newuserdatauv(L, n * (sizeof(uint32_t) + sizeof(int)), 0);
+	}
+	result = (int *)(dest + n);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_rawgeti(L, 1, i+1);
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			// 只能发给本节点的服务，名字在这里解析
+			dest[i] = skynet_queryname(context, lua_tostring(L, -1));
+		} else {
+			dest[i] = (uint32_t)lua_tointeger(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	skynet_sendmulti(context, 0, dest, n, type, session, msg, sz, result);
+	lua_createtable(L, n, 0);
+	for (i=0;i<n;i++) {
+		if (result[i] < 0) {
+			lua_pushboolean(L, 0);
+		} else {
+			lua_pushinteger(L, result[i]);
+		}
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
 /*
 	uint32 address
 	 string address
@@ -422,6 +503,26 @@ ltostring(lua_State *L) {
 	return 1;
 }
 
+/*
+	lightuserdata msg
+	integer sz
+
+	return lightuserdata
+
+	复制正在处理的消息，处理完以后还要用的时候（例如被时间片推迟的消息）用它，再用 trash 释放
+ */
+static int
+lcopy(lua_State *L) {
+	void * msg = lua_touserdata(L,1);
+	size_t sz = (size_t)luaL_checkinteger(L,2);
+	if (msg == NULL || sz == 0) {
+		lua_pushlightuserdata(L, NULL);
+	} else {
+		lua_pushlightuserdata(L, skynet_message_copy(msg, sz));
+	}
+	return 1;
+}
+
 // Lua 接口：获取服务的 harbor 信息
 static int
 lharbor(lua_State *L) {
@@ -441,6 +542,11 @@ lpackstring(lua_State *L) {
 	luaseri_pack(L);  // 调用序列化函数
 	char * str = (char *)lua_touserdata(L, -2);  // 获取序列化后的数据
 	int sz = lua_tointeger(L, -1);                // 获取数据大小
+	if (skynet_message_finalized(str, sz)) {
+		// 字符串不能持有共享缓冲区的引用
+		skynet_message_free(str, sz);
+		return luaL_error(L, "sharedbuffer can't be packed into a string");
+	}
 	lua_pushlstring(L, str, sz);                  // 创建字符串
 	skynet_free(str);  // 释放临时数据
 	return 1;
@@ -456,8 +562,8 @@ ltrash(lua_State *L) {
 	}
 	case LUA_TLIGHTUSERDATA: {
 		void * msg = lua_touserdata(L,1);  // 获取用户数据指针
-		luaL_checkinteger(L,2);            // 检查大小参数
-		skynet_free(msg);                  // 释放内存
+		size_t sz = (size_t)luaL_checkinteger(L,2);  // 检查大小参数
+		skynet_message_free(msg, sz);      // 释放内存
 		break;
 	}
 	default:
@@ -467,6 +573,127 @@ ltrash(lua_State *L) {
 	return 0;
 }
 
+// 合并的消息可能被推迟处理（见 skynet.lua 的时间片），那时是复制出来的字符串
+static const void *
+batchdata(lua_State *L, int index) {
+	if (lua_type(L, index) == LUA_TSTRING)
+		return lua_tostring(L, index);
+	return lua_touserdata(L, index);
+}
+
+/*
+	lightuserdata msg (or string)
+	integer sz
+	integer index
+
+	从合并的超时消息中取出第index个session（从0开始），超出范围返回nil
+ */
+// Lua 接口：读取合并超时消息中的session
+static int
+ltimersession(lua_State *L) {
+	const int * session = batchdata(L, 1);
+	int sz = luaL_checkinteger(L, 2);
+	int index = luaL_checkinteger(L, 3);
+	if (session == NULL || index < 0 || index >= sz / (int)sizeof(int)) {
+		return 0;
+	}
+	lua_pushinteger(L, session[index]);
+	return 1;
+}
+
+/*
+	table responses { session, msg, sz, ... } (msg is a string or lightuserdata)
+
+	把发给同一个服务的多个响应打包成一条消息，每个响应是 int32 session、uint32 长度和数据，
+	lightuserdata 的响应在这里释放。返回 lightuserdata 和长度
+ */
+// Lua 接口：合并多个响应
+static int
+lpackresponse(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int n = (int)lua_rawlen(L, 1);
+	size_t total = 0;
+	int i;
+	for (i=1;i+1<=n;i+=3) {
+		size_t sz;
+		lua_rawgeti(L, 1, i+1);
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			lua_tolstring(L, -1, &sz);
+		} else {
+			lua_rawgeti(L, 1, i+2);
+			sz = (size_t)lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		total += sizeof(int32_t) + sizeof(uint32_t) + sz;
+	}
+	char * buffer = skynet_malloc(total);
+	char * ptr = buffer;
+	for (i=1;i+1<=n;i+=3) {
+		lua_rawgeti(L, 1, i);
+		int32_t session = (int32_t)lua_tointeger(L, -1);
+		lua_rawgeti(L, 1, i+1);
+		const void * msg;
+		size_t sz;
+		int owned = 0;
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			msg = lua_tolstring(L, -1, &sz);
+		} else {
+			msg = lua_touserdata(L, -1);
+			lua_rawgeti(L, 1, i+2);
+			sz = (size_t)lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			owned = 1;
+		}
+		uint32_t len = (uint32_t)sz;
+		memcpy(ptr, &session, sizeof(session));
+		memcpy(ptr + sizeof(session), &len, sizeof(len));
+		ptr += sizeof(session) + sizeof(len);
+		if (sz > 0) {
+			memcpy(ptr, msg, sz);
+			ptr += sz;
+		}
+		if (owned) {
+			skynet_free((void *)msg);
+		}
+		lua_pop(L, 2);
+	}
+	lua_pushlightuserdata(L, buffer);
+	lua_pushinteger(L, (lua_Integer)total);
+	return 2;
+}
+
+/*
+	lightuserdata msg (or string)
+	integer sz
+	integer offset
+
+	从合并的响应消息中取出 offset 处的响应，返回 session、数据指针、长度和下一个响应的 offset；到末尾返回 nil
+ */
+// Lua 接口：读取合并响应消息中的一个响应
+static int
+lresponsebatch(lua_State *L) {
+	const char * msg = batchdata(L, 1);
+	size_t sz = (size_t)luaL_checkinteger(L, 2);
+	size_t offset = (size_t)luaL_checkinteger(L, 3);
+	int32_t session;
+	uint32_t len;
+	if (msg == NULL || offset + sizeof(session) + sizeof(len) > sz) {
+		return 0;
+	}
+	memcpy(&session, msg + offset, sizeof(session));
+	memcpy(&len, msg + offset + sizeof(session), sizeof(len));
+	offset += sizeof(session) + sizeof(len);
+	if (len > sz - offset) {
+		return luaL_error(L, "Invalid response batch");
+	}
+	lua_pushinteger(L, session);
+	lua_pushlightuserdata(L, (void *)(msg + offset));
+	lua_pushinteger(L, len);
+	lua_pushinteger(L, (lua_Integer)(offset + len));
+	return 4;
+}
+
 // Lua 接口：获取当前时间（skynet 时间）
 static int
 lnow(lua_State *L) {
@@ -482,6 +709,240 @@ lhpc(lua_State *L) {
 	return 1;
 }
 
+// Lua 接口：当前线程的 CPU 时间（微秒），见 skynet.cpustat
+static int
+lthreadtime(lua_State *L) {
+	lua_pushinteger(L, skynet_thread_time());
+	return 1;
+}
+
+// Lua 接口：单调时钟，微秒
+// linux 下 clock_gettime(CLOCK_MONOTONIC) 走 vDSO，不进内核，可以高频调用
+static int
+lusec(lua_State *L) {
+	lua_pushinteger(L, get_time() / 1000);
+	return 1;
+}
+
+// Lua 接口：环境变量的版本，不加锁，见 skynet_env_version
+static int
+lenvversion(lua_State *L) {
+	lua_pushinteger(L, skynet_env_version());
+	return 1;
+}
+
+// Lua 接口：当前协程的栈有多少个槽位，协程回收时用来丢掉调用过很深的协程
+static int
+lstacksize(lua_State *L) {
+	lua_pushinteger(L, stacksize(L));
+	return 1;
+}
+
+/*
+	会话表：以 session 为键的开放寻址哈希表，值存放在 uservalue 表预先分配好的数组部分。
+	session 是递增分配的，用低位做下标，在途的 session 跨度小于容量时互不冲突。
+	删除只把槽位标成空闲(-session，供遍历时定位)，查找最多探测 probe 个槽位，
+	所以只有在途数量增长时才需要重建，不会像 Lua 表那样在请求进出时反复 rehash。
+ */
+#define SESSIONMAP_MIN 64
+
+struct sessionmap {
+	int cap;      // 槽位数，2 的幂
+	int n;        // 有效键数
+	int probe;    // 插入时出现过的最长探测距离
+	int *key;     // > 0 session，0 或 < 0 空闲（< 0 是被删除的 session）
+};
+
+static int
+sessionmap_find(struct sessionmap *m, int session) {
+	int mask = m->cap - 1;
+	int i = session & mask;
+	int d;
+	for (d=0;d<=m->probe;d++) {
+		if (m->key[i] == session)
+			return i;
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+static int
+sessionmap_session(lua_State *L, int idx) {
+	int isnum;
+	lua_Integer session = lua_tointegerx(L, idx, &isnum);
+	if (!isnum || session <= 0 || session > 0x7fffffff)
+		return 0;
+	return (int)session;
+}
+
+static int
+sessionmap_slot(struct sessionmap *m, int session) {
+	int mask = m->cap - 1;
+	int i = session & mask;
+	int d = 0;
+	while (m->key[i] > 0) {
+		i = (i + 1) & mask;
+		++d;
+	}
+	if (d > m->probe)
+		m->probe = d;
+	return i;
+}
+
+// 按有效键数重建，值表换成新的数组
+static void
+sessionmap_rehash(lua_State *L, struct sessionmap *m) {
+	struct sessionmap old = *m;
+	int cap = SESSIONMAP_MIN;
+	while (cap < (m->n + 1) * 2)
+		cap *= 2;
+	m->key = skynet_malloc(cap * sizeof(int));
+	memset(m->key, 0, cap * sizeof(int));
+	m->cap = cap;
+	m->probe = 0;
+	lua_getiuservalue(L, 1, 1);
+	lua_createtable(L, cap, 0);
+	int i;
+	for (i=0;i<old.cap;i++) {
+		int k = old.key[i];
+		if (k > 0) {
+			int j = sessionmap_slot(m, k);
+			m->key[j] = k;
+			lua_rawgeti(L, -2, i+1);
+			lua_rawseti(L, -2, j+1);
+		}
+	}
+	lua_setiuservalue(L, 1, 1);
+	lua_pop(L, 1);
+	skynet_free(old.key);
+}
+
+static int
+lsessionmap_index(lua_State *L) {
+	struct sessionmap *m = lua_touserdata(L, 1);
+	int session = sessionmap_session(L, 2);
+	int i;
+	if (session == 0 || (i = sessionmap_find(m, session)) < 0)
+		return 0;
+	lua_getiuservalue(L, 1, 1);
+	lua_rawgeti(L, -1, i+1);
+	return 1;
+}
+
+static int
+lsessionmap_newindex(lua_State *L) {
+	struct sessionmap *m = lua_touserdata(L, 1);
+	int session = sessionmap_session(L, 2);
+	if (session == 0) {
+		if (lua_isnil(L, 3))
+			return 0;
+		return luaL_error(L, "Invalid session %s", luaL_tolstring(L, 2, NULL));
+	}
+	int i = sessionmap_find(m, session);
+	if (lua_isnil(L, 3)) {
+		if (i >= 0) {
+			m->key[i] = -session;
+			--m->n;
+			lua_getiuservalue(L, 1, 1);
+			lua_pushnil(L);
+			lua_rawseti(L, -2, i+1);
+		}
+		return 0;
+	}
+	if (i < 0) {
+		if ((m->n + 1) * 4 > m->cap * 3 || m->probe >= m->cap / 4)
+			sessionmap_rehash(L, m);
+		i = sessionmap_slot(m, session);
+		m->key[i] = session;
+		++m->n;
+	}
+	lua_getiuservalue(L, 1, 1);
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, -2, i+1);
+	return 0;
+}
+
+static int
+lsessionmap_next(lua_State *L) {
+	struct sessionmap *m = luaL_checkudata(L, 1, "SKYNET_SESSIONMAP");
+	int i = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		// 遍历中删掉的键留下了 -session，也要能找到它的位置
+		int session = sessionmap_session(L, 2);
+		int mask = m->cap - 1;
+		int d;
+		if (session == 0)
+			return luaL_error(L, "invalid key to 'next'");
+		i = session & mask;
+		for (d=0;;d++) {
+			if (d > m->probe)
+				return luaL_error(L, "invalid key to 'next'");
+			if (m->key[i] == session || m->key[i] == -session)
+				break;
+			i = (i + 1) & mask;
+		}
+		++i;
+	}
+	lua_getiuservalue(L, 1, 1);
+	for (;i<m->cap;i++) {
+		if (m->key[i] > 0) {
+			lua_pushinteger(L, m->key[i]);
+			lua_rawgeti(L, -2, i+1);
+			return 2;
+		}
+	}
+	return 0;
+}
+
+static int
+lsessionmap_pairs(lua_State *L) {
+	lua_pushcfunction(L, lsessionmap_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static int
+lsessionmap_len(lua_State *L) {
+	struct sessionmap *m = lua_touserdata(L, 1);
+	lua_pushinteger(L, m->n);
+	return 1;
+}
+
+static int
+lsessionmap_gc(lua_State *L) {
+	struct sessionmap *m = lua_touserdata(L, 1);
+	skynet_free(m->key);
+	m->key = NULL;
+	return 0;
+}
+
+// Lua 接口：创建一张会话表，用法和以 session 为键的普通表一样
+static int
+lsessionmap(lua_State *L) {
+	struct sessionmap *m = lua_newuserdatauv(L, sizeof(*m), 1);
+	m->cap = SESSIONMAP_MIN;
+	m->n = 0;
+	m->probe = 0;
+	m->key = skynet_malloc(m->cap * sizeof(int));
+	memset(m->key, 0, m->cap * sizeof(int));
+	lua_createtable(L, m->cap, 0);
+	lua_setiuservalue(L, -2, 1);
+	if (luaL_newmetatable(L, "SKYNET_SESSIONMAP")) {
+		luaL_Reg l[] = {
+			{ "__index", lsessionmap_index },
+			{ "__newindex", lsessionmap_newindex },
+			{ "__pairs", lsessionmap_pairs },
+			{ "__len", lsessionmap_len },
+			{ "__gc", lsessionmap_gc },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
 #define MAX_LEVEL 3  // 最大跟踪层级
 
 // 源码信息结构
@@ -565,6 +1026,7 @@ luaopen_skynet_core(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "send" , lsend },                    // 发送消息
 		{ "genid", lgenid },                   // 生成会话ID
+		{ "sendmulti", lsendmulti },           // 发送同一个消息给多个服务
 		{ "redirect", lredirect },             // 重定向消息
 		{ "command" , lcommand },              // 执行命令
 		{ "intcommand", lintcommand },         // 执行返回整数的命令
@@ -582,9 +1044,20 @@ luaopen_skynet_core(lua_State *L) {
 		{ "tostring", ltostring },      // 地址转字符串
 		{ "pack", luaseri_pack },       // 序列化打包
 		{ "unpack", luaseri_unpack },   // 序列化解包
+		{ "packshape", luaseri_packshape }, // 按 shape 序列化打包，只在本进程内有效
+		{ "sharedbuffer", luaseri_sharedbuffer }, // 共享缓冲区，按引用打包
 		{ "packstring", lpackstring },  // 字符串打包
 		{ "trash" , ltrash },           // 垃圾回收
+		{ "copy", lcopy },              // 复制消息，用 trash 释放
 		{ "now", lnow },                // 当前时间
+		{ "timersession", ltimersession }, // 读取合并超时消息中的session
+		{ "packresponse", lpackresponse }, // 合并发给同一个服务的多个响应
+		{ "responsebatch", lresponsebatch }, // 读取合并响应消息中的一个响应
+		{ "stacksize", lstacksize },    // 当前协程的栈大小
+		{ "sessionmap", lsessionmap },  // 创建以 session 为键的会话表
+		{ "envversion", lenvversion },	// 环境变量的版本
+		{ "usec", lusec },	// 单调时钟（微秒）
+		{ "thread_time", lthreadtime },	// 线程 CPU 时间（微秒）
 		{ "hpc", lhpc },	// getHPCounter
 		                    // 高精度计数器
 		{ NULL, NULL },
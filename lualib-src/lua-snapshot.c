@@ -0,0 +1,68 @@
+#define LUA_LIB
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+	只读映射快照文件，见 lualib/skynet/snapshot.lua
+	同一台机器上的多个进程通过页缓存共享这份数据，重启后的进程不需要再读一遍
+ */
+
+// Lua 接口：映射整个文件，返回指针和长度
+static int
+lmmap(lua_State *L) {
+	const char * filename = luaL_checkstring(L, 1);
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return luaL_error(L, "Can't open %s : %s", filename, strerror(errno));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return luaL_error(L, "Can't stat %s : %s", filename, strerror(errno));
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return luaL_error(L, "Empty snapshot file %s", filename);
+	}
+	void * p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return luaL_error(L, "Can't mmap %s : %s", filename, strerror(errno));
+	}
+	lua_pushlightuserdata(L, p);
+	lua_pushinteger(L, st.st_size);
+	return 2;
+}
+
+// Lua 接口：解除映射，参数为 mmap 返回的指针和长度
+static int
+lunmap(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	void * p = lua_touserdata(L, 1);
+	size_t size = (size_t)luaL_checkinteger(L, 2);
+	munmap(p, size);
+	return 0;
+}
+
+LUAMOD_API int
+luaopen_skynet_snapshot_core(lua_State *L) {
+	luaL_checkversion(L);
+
+	luaL_Reg l[] = {
+		{ "mmap", lmmap },
+		{ "unmap", lunmap },
+		{ NULL, NULL },
+	};
+
+	luaL_newlib(L,l);
+
+	return 1;
+}
@@ -16,6 +16,11 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 #include "skynet.h"
 #include "skynet_socket.h"
@@ -35,6 +40,8 @@ struct buffer_node {
 struct socket_buffer {
 	int size;
 	int offset;
+	int id;	// 设置了读水位的socket，消费的字节数要告诉socket线程，否则为-1
+	uint64_t pushed;	// 一共收到的字节数，减去size就是已经消费的字节数
 	struct buffer_node *head;
 	struct buffer_node *tail;
 };
@@ -47,7 +54,7 @@ lfreepool(lua_State *L) {
 	for (i=0;i<sz;i++) {
 		struct buffer_node *node = &pool[i];
 		if (node->msg) {
-			skynet_free(node->msg);
+			skynet_socket_recycle(node->msg, node->sz);
 			node->msg = NULL;
 		}
 	}
@@ -77,6 +84,8 @@ lnewbuffer(lua_State *L) {
 	struct socket_buffer * sb = lua_newuserdatauv(L, sizeof(*sb), 0);
 	sb->size = 0;
 	sb->offset = 0;
+	sb->id = -1;
+	sb->pushed = 0;
 	sb->head = NULL;
 	sb->tail = NULL;
 	
@@ -147,12 +156,21 @@ lpushbuffer(lua_State *L) {
 		sb->tail = free_node;
 	}
 	sb->size += sz;
+	sb->pushed += sz;
 
 	lua_pushinteger(L, sb->size);
 
 	return 1;
 }
 
+// 设置了读水位时，把消费的字节数告诉socket线程
+static inline void
+report_consumed(struct socket_buffer *sb) {
+	if (sb->id >= 0) {
+		skynet_socket_consumed(NULL, sb->id, sb->pushed - sb->size);
+	}
+}
+
 static void
 return_free_node(lua_State *L, int pool, struct socket_buffer *sb) {
 	struct buffer_node *free_node = sb->head;
@@ -164,7 +182,7 @@ return_free_node(lua_State *L, int pool, struct socket_buffer *sb) {
 	lua_rawgeti(L,pool,1);
 	free_node->next = lua_touserdata(L,-1);
 	lua_pop(L,1);
-	skynet_free(free_node->msg);
+	skynet_socket_recycle(free_node->msg, free_node->sz);
 	free_node->msg = NULL;
 
 	free_node->sz = 0;
@@ -251,6 +269,7 @@ lpopbuffer(lua_State *L) {
 	} else {
 		pop_lstring(L,sb,sz,0);
 		sb->size -= sz;
+		report_consumed(sb);
 	}
 	lua_pushinteger(L, sb->size);
 
@@ -294,6 +313,7 @@ lreadall(lua_State *L) {
 	}
 	luaL_pushresult(&b);
 	sb->size = 0;
+	report_consumed(sb);
 	return 1;
 }
 
@@ -352,6 +372,7 @@ lreadline(lua_State *L) {
 			} else {
 				pop_lstring(L, sb, i+seplen, seplen);
 				sb->size -= i+seplen;
+				report_consumed(sb);
 			}
 			return 1;
 		}
@@ -368,6 +389,354 @@ lreadline(lua_State *L) {
 	return 0;
 }
 
+/*
+	在 buffer_node 链表上原地解析字段，不需要先把数据拷贝成 Lua 字符串
+	格式是 string.unpack 的子集 :
+		< > = 字节序 , b B h H i[n] I[n] l L j J T 整数 , s[n] 长度前缀的字符串 , c[n] 定长字符串 , x 跳过一个字节
+ */
+
+struct buffer_cursor {
+	struct buffer_node *node;
+	int offset;	// 在 node 中的偏移
+	int size;	// 剩余的字节数
+};
+
+static void
+cursor_read(struct buffer_cursor *c, char *dst, int n) {
+	c->size -= n;
+	while (n > 0) {
+		int bytes = c->node->sz - c->offset;
+		if (bytes > n)
+			bytes = n;
+		if (dst) {
+			memcpy(dst, c->node->msg + c->offset, bytes);
+			dst += bytes;
+		}
+		c->offset += bytes;
+		n -= bytes;
+		if (c->offset == c->node->sz && c->node->next) {
+			c->node = c->node->next;
+			c->offset = 0;
+		}
+	}
+}
+
+static void
+cursor_pushstring(lua_State *L, struct buffer_cursor *c, int n) {
+	if (c->node->sz - c->offset >= n) {
+		// 在同一个 node 中，直接生成字符串
+		lua_pushlstring(L, c->node->msg + c->offset, n);
+		cursor_read(c, NULL, n);
+		return;
+	}
+	luaL_Buffer b;
+	char * p = luaL_buffinitsize(L, &b, n);
+	cursor_read(c, p, n);
+	luaL_pushresultsize(&b, n);
+}
+
+static int
+format_size(lua_State *L, const char **fmt, int df) {
+	const char *f = *fmt;
+	if (*f < '0' || *f > '9')
+		return df;
+	int n = 0;
+	while (*f >= '0' && *f <= '9') {
+		n = n * 10 + (*f - '0');
+		if (n > 0x10000)
+			break;
+		++f;
+	}
+	*fmt = f;
+	return n;
+}
+
+static lua_Integer
+unpack_int(const uint8_t *buf, int size, int little, int issigned) {
+	lua_Unsigned v = 0;
+	int i;
+	for (i=0;i<size;i++) {
+		v = (v << 8) | buf[little ? size - 1 - i : i];
+	}
+	if (issigned && size < (int)sizeof(lua_Integer)) {
+		lua_Unsigned mask = (lua_Unsigned)1 << (size * 8 - 1);
+		v = (v ^ mask) - mask;
+	}
+	return (lua_Integer)v;
+}
+
+static int
+native_little(void) {
+	const union { int i; char c; } u = { 1 };
+	return u.c;
+}
+
+/*
+	按格式 fmt 从 c 解析，结果压入栈中
+	返回 0 表示成功 ; 否则返回还需要的总字节数 (从开始算起)，这时已压入的值由调用者清除
+ */
+static int
+cursor_unpack(lua_State *L, struct buffer_cursor *c, const char *fmt) {
+	int little = native_little();
+	int total = c->size;
+	uint8_t tmp[8];
+	luaL_checkstack(L, (int)strlen(fmt), NULL);
+	while (*fmt) {
+		char opt = *fmt++;
+		int size = 0;
+		int issigned = 0;
+		switch (opt) {
+		case ' ': continue;
+		case '<': little = 1; continue;
+		case '>': little = 0; continue;
+		case '=': little = native_little(); continue;
+		case 'b': issigned = 1;	// fall through
+		case 'B': size = 1; break;
+		case 'h': issigned = 1;	// fall through
+		case 'H': size = 2; break;
+		case 'i': issigned = 1;	// fall through
+		case 'I': size = format_size(L, &fmt, 4); break;
+		case 'l': case 'j': issigned = 1;	// fall through
+		case 'L': case 'J': case 'T': size = 8; break;
+		case 'x':
+			if (c->size < 1)
+				return total - c->size + 1;
+			cursor_read(c, NULL, 1);
+			continue;
+		case 'c': {
+			int n = format_size(L, &fmt, -1);
+			if (n < 0)
+				return luaL_error(L, "missing size for format option 'c'");
+			if (c->size < n)
+				return total - c->size + n;
+			cursor_pushstring(L, c, n);
+			continue;
+		}
+		case 's': {
+			int n = format_size(L, &fmt, 8);
+			if (n < 1 || n > 8)
+				return luaL_error(L, "invalid size %d for format option 's'", n);
+			if (c->size < n)
+				return total - c->size + n;
+			cursor_read(c, (char *)tmp, n);
+			lua_Integer len = unpack_int(tmp, n, little, 0);
+			if (len < 0 || len > 0x7fffffff - total)
+				return luaL_error(L, "invalid string length %I", len);
+			if (c->size < len)
+				return total - c->size + (int)len;
+			cursor_pushstring(L, c, (int)len);
+			continue;
+		}
+		default:
+			return luaL_error(L, "invalid format option '%c'", opt);
+		}
+		if (size < 1 || size > 8)
+			return luaL_error(L, "integral size %d out of limits [1,8]", size);
+		if (c->size < size)
+			return total - c->size + size;
+		cursor_read(c, (char *)tmp, size);
+		lua_pushinteger(L, unpack_int(tmp, size, little, issigned));
+	}
+	return 0;
+}
+
+// 丢弃 sb 中前 sz 个字节，pool 在栈的 2 号位置
+static void
+skip_buffer(lua_State *L, struct socket_buffer *sb, int sz) {
+	sb->size -= sz;
+	while (sz > 0) {
+		struct buffer_node *current = sb->head;
+		int bytes = current->sz - sb->offset;
+		if (bytes > sz) {
+			sb->offset += sz;
+			break;
+		}
+		sz -= bytes;
+		return_free_node(L,2,sb);
+	}
+	report_consumed(sb);
+}
+
+/*
+	userdata send_buffer
+	table pool , nil for peek
+	string format
+
+	return values...
+	or false, the bytes required
+ */
+static int
+lbufferunpack(lua_State *L) {
+	struct socket_buffer * sb = lua_touserdata(L, 1);
+	if (sb == NULL) {
+		return luaL_error(L, "Need buffer object at param 1");
+	}
+	bool peek = !lua_istable(L, 2);
+	const char * fmt = luaL_checkstring(L, 3);
+	int top = lua_gettop(L);
+	// 缓冲区为空时也要按格式算出需要的字节数
+	struct buffer_node empty = { NULL, 0, NULL };
+	struct buffer_cursor c = { sb->head ? sb->head : &empty, sb->offset, sb->size };
+	int need = cursor_unpack(L, &c, fmt);
+	if (need) {
+		lua_settop(L, top);
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, need);
+		return 2;
+	}
+	if (!peek) {
+		skip_buffer(L, sb, sb->size - c.size);
+	}
+	return lua_gettop(L) - top;
+}
+
+/*
+	可以重复使用的读缓冲区，见 socket.readinto
+ */
+struct read_buffer {
+	char * data;
+	int size;
+	int cap;
+};
+
+static int
+lreadbuffer_gc(lua_State *L) {
+	struct read_buffer *rb = lua_touserdata(L, 1);
+	skynet_free(rb->data);
+	rb->data = NULL;
+	rb->size = 0;
+	rb->cap = 0;
+	return 0;
+}
+
+static void
+readbuffer_reserve(struct read_buffer *rb, int sz) {
+	if (sz <= rb->cap)
+		return;
+	int cap = rb->cap ? rb->cap : 64;
+	while (cap < sz)
+		cap *= 2;
+	skynet_free(rb->data);
+	rb->data = skynet_malloc(cap);
+	rb->cap = cap;
+}
+
+static int
+lreadbuffer_size(lua_State *L) {
+	struct read_buffer *rb = luaL_checkudata(L, 1, "socket_readbuffer");
+	lua_pushinteger(L, rb->size);
+	return 1;
+}
+
+// 返回 lightuserdata 和长度，可以传给 skynet.unpack 等接受指针的函数，在下次 readinto 前有效
+static int
+lreadbuffer_ptr(lua_State *L) {
+	struct read_buffer *rb = luaL_checkudata(L, 1, "socket_readbuffer");
+	lua_pushlightuserdata(L, rb->data);
+	lua_pushinteger(L, rb->size);
+	return 2;
+}
+
+// 和 string.sub 相同的参数
+static int
+lreadbuffer_tostring(lua_State *L) {
+	struct read_buffer *rb = luaL_checkudata(L, 1, "socket_readbuffer");
+	lua_Integer i = luaL_optinteger(L, 2, 1);
+	lua_Integer j = luaL_optinteger(L, 3, -1);
+	if (i < 0)
+		i = rb->size + i + 1;
+	if (j < 0)
+		j = rb->size + j + 1;
+	if (i < 1)
+		i = 1;
+	if (j > rb->size)
+		j = rb->size;
+	if (i > j) {
+		lua_pushliteral(L, "");
+	} else {
+		lua_pushlstring(L, rb->data + i - 1, j - i + 1);
+	}
+	return 1;
+}
+
+// 和 string.unpack 相同，返回解析出的值和下一个位置，数据不够时抛出错误
+static int
+lreadbuffer_unpack(lua_State *L) {
+	struct read_buffer *rb = luaL_checkudata(L, 1, "socket_readbuffer");
+	const char * fmt = luaL_checkstring(L, 2);
+	lua_Integer pos = luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, pos >= 1 && pos <= (lua_Integer)rb->size + 1, 3, "initial position out of string");
+	struct buffer_node node = { rb->data, rb->size, NULL };
+	struct buffer_cursor c = { &node, (int)pos - 1, rb->size - (int)pos + 1 };
+	int top = lua_gettop(L);
+	if (cursor_unpack(L, &c, fmt)) {
+		return luaL_error(L, "data string too short");
+	}
+	lua_pushinteger(L, rb->size - c.size + 1);
+	return lua_gettop(L) - top;
+}
+
+static int
+lnewreadbuffer(lua_State *L) {
+	int cap = luaL_optinteger(L, 1, 0);
+	struct read_buffer *rb = lua_newuserdatauv(L, sizeof(*rb), 0);
+	rb->data = NULL;
+	rb->size = 0;
+	rb->cap = 0;
+	if (cap > 0)
+		readbuffer_reserve(rb, cap);
+	if (luaL_newmetatable(L, "socket_readbuffer")) {
+		luaL_Reg l[] = {
+			{ "size", lreadbuffer_size },
+			{ "ptr", lreadbuffer_ptr },
+			{ "tostring", lreadbuffer_tostring },
+			{ "unpack", lreadbuffer_unpack },
+			{ NULL, NULL },
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lreadbuffer_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, lreadbuffer_size);
+		lua_setfield(L, -2, "__len");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/*
+	userdata send_buffer
+	table pool
+	userdata read_buffer
+	integer sz
+
+	return true if sz bytes are moved into read_buffer
+ */
+static int
+lreadinto(lua_State *L) {
+	struct socket_buffer * sb = lua_touserdata(L, 1);
+	if (sb == NULL) {
+		return luaL_error(L, "Need buffer object at param 1");
+	}
+	luaL_checktype(L,2,LUA_TTABLE);
+	struct read_buffer *rb = luaL_checkudata(L, 3, "socket_readbuffer");
+	int sz = luaL_checkinteger(L, 4);
+	luaL_argcheck(L, sz >= 0, 4, "negative size");
+	if (sb->size < sz) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	readbuffer_reserve(rb, sz);
+	if (sz > 0) {
+		struct buffer_cursor c = { sb->head, sb->offset, sb->size };
+		cursor_read(&c, rb->data, sz);
+		skip_buffer(L, sb, sz);
+	}
+	rb->size = sz;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
 static int
 lstr2p(lua_State *L) {
 	size_t sz = 0;
@@ -386,6 +755,7 @@ lstr2p(lua_State *L) {
 	integer size
 
 	return type n1 n2 ptr_or_string
+	批量消息返回 type n 0 lightuserdata，用batchitem取出每条数据
 */
 static int
 lunpack(lua_State *L) {
@@ -395,7 +765,9 @@ lunpack(lua_State *L) {
 	lua_pushinteger(L, message->type);
 	lua_pushinteger(L, message->id);
 	lua_pushinteger(L, message->ud);
-	if (message->buffer == NULL) {
+	if (message->type == SKYNET_SOCKET_TYPE_BATCH) {
+		lua_pushlightuserdata(L, message+1);
+	} else if (message->buffer == NULL) {
 		lua_pushlstring(L, (char *)(message+1),size - sizeof(*message));
 	} else {
 		lua_pushlightuserdata(L, message->buffer);
@@ -488,6 +860,20 @@ llisten(lua_State *L) {
 	int port = luaL_checkinteger(L,2);
 	int backlog = luaL_optinteger(L,3,BACKLOG);
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	if (lua_toboolean(L, 4)) {
+		// reuseport: 每个socket线程各监听一次，返回所有的监听socket
+		int id[skynet_socket_shards()];
+		int n = skynet_socket_listen_reuseport(ctx, host, port, backlog, id);
+		if (n < 0) {
+			return luaL_error(L, "Listen error");
+		}
+		int i;
+		luaL_checkstack(L, n, NULL);
+		for (i=0;i<n;i++) {
+			lua_pushinteger(L, id[i]);
+		}
+		return n;
+	}
 	int id = skynet_socket_listen(ctx, host,port,backlog);
 	if (id < 0) {
 		return luaL_error(L, "Listen error");
@@ -578,25 +964,169 @@ get_buffer(lua_State *L, int index, struct socket_sendbuffer *buf) {
 	}
 }
 
+// 字符串数组作为分段缓冲区发送，省去拼接；段数太多或者有非字符串时返回0，交给get_buffer拼接
+// 字符串由表引用，发送期间不会被回收
+#define MAX_SEGMENT 64
+
+static int
+get_iovec(lua_State *L, int index, struct socket_sendbuffer *buf, struct iovec iov[MAX_SEGMENT]) {
+	if (lua_type(L, index) != LUA_TTABLE)
+		return 0;
+	lua_Integer n = luaL_len(L, index);
+	if (n <= 0 || n > MAX_SEGMENT)
+		return 0;
+	int i;
+	for (i=0;i<n;i++) {
+		size_t len;
+		if (lua_rawgeti(L, index, i+1) != LUA_TSTRING) {
+			lua_pop(L, 1);
+			return 0;
+		}
+		iov[i].iov_base = (void *)lua_tolstring(L, -1, &len);
+		iov[i].iov_len = len;
+		lua_pop(L, 1);
+	}
+	buf->type = SOCKET_BUFFER_IOVEC;
+	buf->buffer = iov;
+	buf->sz = (size_t)n;
+	return 1;
+}
+
 static int
 lsend(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
 	int id = luaL_checkinteger(L, 1);
 	struct socket_sendbuffer buf;
+	struct iovec iov[MAX_SEGMENT];
 	buf.id = id;
-	get_buffer(L, 2, &buf);
+	if (!get_iovec(L, 2, &buf, iov))
+		get_buffer(L, 2, &buf);
 	int err = skynet_socket_sendbuffer(ctx, &buf);
 	lua_pushboolean(L, !err);
 	return 1;
 }
 
+// sendfile(id, filename [, offset [, size]])
+// 文件在调用的服务中打开，fd交给socket线程用sendfile发送，不经过lua字符串
+static int
+lsendfile(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	const char * filename = luaL_checkstring(L, 2);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	lua_Integer size = luaL_optinteger(L, 4, -1);
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || offset < 0 || offset > st.st_size) {
+		close(fd);
+		lua_pushboolean(L, 0);
+		lua_pushliteral(L, "Invalid offset");
+		return 2;
+	}
+	if (size < 0 || size > st.st_size - offset) {
+		size = st.st_size - offset;
+	}
+	if (size == 0) {
+		close(fd);
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	int err = skynet_socket_sendfile(ctx, id, fd, offset, size);
+	lua_pushboolean(L, !err);
+	return 1;
+}
+
+// broadcast({id, ...}, msg [, sz])
+// 数据只复制一次，由socket线程挂到每个socket的写队列，返回排队的socket数量
+static int
+lbroadcast(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int n = lua_rawlen(L, 1);
+	int tmp[256];
+	int * id = tmp;
+	if (n > sizeof(tmp)/sizeof(tmp[0])) {
+		id = lua_newuserdatauv(L, n * sizeof(int), 0);
+	}
+	int i;
+	int bad = 0;
+	for (i=0;i<n;i++) {
+		lua_rawgeti(L, 1, i+1);
+		int isnum;
+		id[i] = lua_tointegerx(L, -1, &isnum);
+		lua_pop(L, 1);
+		if (!isnum) {
+			bad = i+1;
+			break;
+		}
+	}
+	struct socket_sendbuffer buf;
+	buf.id = 0;
+	get_buffer(L, 2, &buf);
+	if (bad) {
+		// 缓冲区的所有权已经交出，出错之前释放
+		skynet_socket_sharedbuffer_release(skynet_socket_sharedbuffer(ctx, &buf));
+		return luaL_error(L, "Invalid socket id at %d", bad);
+	}
+	int count = skynet_socket_broadcast(ctx, id, n, &buf);
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+static int
+lfreeshared(lua_State *L) {
+	struct socket_sharedbuffer ** sb = lua_touserdata(L, 1);
+	if (*sb) {
+		skynet_socket_sharedbuffer_release(*sb);
+		*sb = NULL;
+	}
+	return 0;
+}
+
+// sharedbuffer(msg [, sz])
+// 数据复制一次到引用计数的缓冲区，用sendshared发送时不再复制，userdata回收时释放引用
+static int
+lsharedbuffer(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	struct socket_sendbuffer buf;
+	buf.id = 0;
+	struct socket_sharedbuffer ** sb = lua_newuserdatauv(L, sizeof(*sb), 0);
+	*sb = NULL;
+	if (luaL_newmetatable(L, "socket_sharedbuffer")) {
+		lua_pushcfunction(L, lfreeshared);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	get_buffer(L, 1, &buf);
+	*sb = skynet_socket_sharedbuffer(ctx, &buf);
+	return 1;
+}
+
+// sendshared(id, sharedbuffer)
+static int
+lsendshared(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	struct socket_sharedbuffer ** sb = luaL_checkudata(L, 2, "socket_sharedbuffer");
+	int err = skynet_socket_sendshared(ctx, id, *sb);
+	lua_pushboolean(L, !err);
+	return 1;
+}
+
 static int
 lsendlow(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
 	int id = luaL_checkinteger(L, 1);
 	struct socket_sendbuffer buf;
+	struct iovec iov[MAX_SEGMENT];
 	buf.id = id;
-	get_buffer(L, 2, &buf);
+	if (!get_iovec(L, 2, &buf, iov))
+		get_buffer(L, 2, &buf);
 	int err = skynet_socket_sendbuffer_lowpriority(ctx, &buf);
 	lua_pushboolean(L, !err);
 	return 1;
@@ -635,6 +1165,106 @@ lnodelay(lua_State *L) {
 	return 0;
 }
 
+/*
+	userdata send_buffer
+	integer id
+	integer high , 0 for off
+	integer low
+ */
+static int
+lwatermark(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	struct socket_buffer * sb = lua_touserdata(L, 1);
+	if (sb == NULL) {
+		return luaL_error(L, "Need buffer object at param 1");
+	}
+	int id = luaL_checkinteger(L, 2);
+	int high = luaL_checkinteger(L, 3);
+	int low = luaL_optinteger(L, 4, high / 2);
+	luaL_argcheck(L, high >= 0 && low >= 0 && low < (high ? high : 1), 4, "need 0 <= low < high");
+	sb->id = high > 0 ? id : -1;
+	skynet_socket_consumed(ctx, id, sb->pushed - sb->size);
+	skynet_socket_watermark(ctx, id, high, low);
+	return 0;
+}
+
+static int
+admission_field(lua_State *L, int index, const char *key) {
+	int v = 0;
+	if (lua_getfield(L, index, key) != LUA_TNIL) {
+		v = luaL_checkinteger(L, -1);
+		luaL_argcheck(L, v >= 0, index, key);
+	}
+	lua_pop(L, 1);
+	return v;
+}
+
+/*
+	integer id
+	table conf { max, ip_max, rate, ip_rate, read_bytes, read_packets } , nil or 0 for unlimited
+ */
+static int
+ladmission(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	struct socket_admission_conf conf;
+	conf.max_conn = admission_field(L, 2, "max");
+	conf.ip_conn = admission_field(L, 2, "ip_max");
+	conf.accept_rate = admission_field(L, 2, "rate");
+	conf.ip_rate = admission_field(L, 2, "ip_rate");
+	conf.read_bytes = admission_field(L, 2, "read_bytes");
+	conf.read_packets = admission_field(L, 2, "read_packets");
+	skynet_socket_admission(ctx, id, &conf);
+	return 0;
+}
+
+/*
+	lightuserdata items (unpack 返回的批量数据)
+	integer i (从1开始)
+
+	return id size ptr
+ */
+static int
+lbatchitem(lua_State *L) {
+	struct skynet_socket_message *item = lua_touserdata(L, 1);
+	int i = luaL_checkinteger(L, 2);
+	if (item == NULL || i < 1) {
+		return luaL_error(L, "Invalid batch item %d", i);
+	}
+	item += i - 1;
+	lua_pushinteger(L, item->id);
+	lua_pushinteger(L, item->ud);
+	lua_pushlightuserdata(L, item->buffer);
+	return 3;
+}
+
+static int
+lbatch(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	int enable = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
+	skynet_socket_batch(ctx, id, enable);
+	return 0;
+}
+
+static int
+lcoalesce(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	int enable = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
+	skynet_socket_coalesce(ctx, id, enable);
+	return 0;
+}
+
+static int
+lflush(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	skynet_socket_flush(ctx, id);
+	return 0;
+}
+
 static int
 ludp(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -675,6 +1305,16 @@ ludp_connect(lua_State *L) {
 	return 0;
 }
 
+static int
+lreliable(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	if (skynet_socket_reliable(ctx, id)) {
+		return luaL_error(L, "reliable udp failed");
+	}
+	return 0;
+}
+
 static int
 ludp_dial(lua_State *L){
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -767,6 +1407,8 @@ getinfo(lua_State *L, struct socket_info *si) {
 		lua_setfield(L, -2, "type");
 		lua_pushinteger(L, si->read);
 		lua_setfield(L, -2, "accept");
+		lua_pushinteger(L, si->limited);
+		lua_setfield(L, -2, "limited");
 		lua_pushinteger(L, si->rtime);
 		lua_setfield(L, -2, "rtime");
 		if (si->name[0]) {
@@ -802,6 +1444,18 @@ getinfo(lua_State *L, struct socket_info *si) {
 	lua_setfield(L, -2, "rtime");
 	lua_pushinteger(L, si->wtime);
 	lua_setfield(L, -2, "wtime");
+	lua_pushinteger(L, si->nread);
+	lua_setfield(L, -2, "nread");
+	lua_pushinteger(L, si->nwrite);
+	lua_setfield(L, -2, "nwrite");
+	lua_pushinteger(L, si->wbuffer_peak);
+	lua_setfield(L, -2, "wbuffer_peak");
+	lua_pushinteger(L, si->eagain);
+	lua_setfield(L, -2, "eagain");
+	lua_pushinteger(L, si->warntime);
+	lua_setfield(L, -2, "warntime");
+	lua_pushinteger(L, si->limited);
+	lua_setfield(L, -2, "limited");
 	lua_pushboolean(L, si->reading);
 	lua_setfield(L, -2, "reading");
 	lua_pushboolean(L, si->writing);
@@ -827,6 +1481,95 @@ linfo(lua_State *L) {
 	return 1;
 }
 
+static void
+push_histogram(lua_State *L, const uint64_t *h, const char *name) {
+	lua_getfield(L, -1, name);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_createtable(L, SOCKET_STAT_HISTOGRAM, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, name);
+	}
+	int i;
+	for (i=0;i<SOCKET_STAT_HISTOGRAM;i++) {
+		lua_geti(L, -1, i+1);
+		lua_Integer v = lua_tointeger(L, -1) + h[i];
+		lua_pop(L, 1);
+		lua_pushinteger(L, v);
+		lua_seti(L, -2, i+1);
+	}
+	lua_pop(L, 1);
+}
+
+static void
+add_field(lua_State *L, const char *name, lua_Integer v) {
+	lua_getfield(L, -1, name);
+	v += lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	lua_pushinteger(L, v);
+	lua_setfield(L, -2, name);
+}
+
+// 把一个分片的统计合并到 result[handle] 里
+static void
+getstat(lua_State *L, struct socket_service_stat *st) {
+	if (lua_geti(L, -1, st->handle) == LUA_TNIL) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_seti(L, -3, st->handle);
+	}
+	add_field(L, "socket", st->nsocket);
+	add_field(L, "read", st->read);
+	add_field(L, "write", st->write);
+	add_field(L, "nread", st->nread);
+	add_field(L, "nwrite", st->nwrite);
+	add_field(L, "eagain", st->eagain);
+	add_field(L, "warntime", st->warntime);
+	lua_getfield(L, -1, "wbuffer_peak");
+	if (lua_isnil(L, -1) || lua_tointeger(L, -1) < st->wbuffer_peak) {
+		lua_pushinteger(L, st->wbuffer_peak);
+		lua_setfield(L, -3, "wbuffer_peak");
+	}
+	lua_pop(L, 1);
+	push_histogram(L, st->rhistogram, "rhistogram");
+	push_histogram(L, st->whistogram, "whistogram");
+	lua_pop(L, 1);
+}
+
+/*
+	[handle]
+	return { [handle] = { socket, read, write, nread, nwrite, eagain, warntime, wbuffer_peak, rhistogram, whistogram } }
+	or the stat of handle
+ */
+static int
+lservicestat(lua_State *L) {
+	lua_Integer handle = luaL_optinteger(L, 1, 0);
+	int n = 64;
+	struct socket_service_stat *stat;
+	int count;
+	for (;;) {
+		stat = skynet_malloc(n * sizeof(*stat));
+		count = skynet_socket_service_stat(stat, n);
+		if (count <= n)
+			break;
+		skynet_free(stat);
+		n = count * 2;
+	}
+	lua_newtable(L);
+	int i;
+	for (i=0;i<count;i++) {
+		if (handle == 0 || stat[i].handle == handle) {
+			getstat(L, &stat[i]);
+		}
+	}
+	skynet_free(stat);
+	if (handle) {
+		lua_geti(L, -1, handle);
+	}
+	return 1;
+}
+
 static int
 lresolve(lua_State *L) {
 	const char * host = luaL_checkstring(L, 1);
@@ -866,11 +1609,16 @@ luaopen_skynet_socketdriver(lua_State *L) {
 		{ "readall", lreadall },
 		{ "clear", lclearbuffer },
 		{ "readline", lreadline },
+		{ "bufferunpack", lbufferunpack },
+		{ "readbuffer", lnewreadbuffer },
+		{ "readinto", lreadinto },
 		{ "str2p", lstr2p },
 		{ "header", lheader },
 		{ "info", linfo },
+		{ "stat", lservicestat },
 
 		{ "unpack", lunpack },
+		{ "batchitem", lbatchitem },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
@@ -881,16 +1629,26 @@ luaopen_skynet_socketdriver(lua_State *L) {
 		{ "listen", llisten },
 		{ "send", lsend },
 		{ "lsend", lsendlow },
+		{ "sendfile", lsendfile },
+		{ "broadcast", lbroadcast },
+		{ "sharedbuffer", lsharedbuffer },
+		{ "sendshared", lsendshared },
 		{ "bind", lbind },
 		{ "start", lstart },
 		{ "pause", lpause },
 		{ "nodelay", lnodelay },
+		{ "coalesce", lcoalesce },
+		{ "batch", lbatch },
+		{ "watermark", lwatermark },
+		{ "admission", ladmission },
+		{ "flush", lflush },
 		{ "udp", ludp },
 		{ "udp_connect", ludp_connect },
 		{ "udp_dial", ludp_dial},
 		{ "udp_listen", ludp_listen},
 		{ "udp_send", ludp_send },
 		{ "udp_address", ludp_address },
+		{ "reliable", lreliable },
 		{ "resolve", lresolve },
 		{ NULL, NULL },
 	};
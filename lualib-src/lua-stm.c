@@ -15,14 +15,24 @@
 struct stm_object {
 	struct rwlock lock;     // 读写锁
 	ATOM_INT reference;     // 原子引用计数
+	ATOM_INT version;       // 每次写入（更新、追加增量、释放）都加一，读者没有变化时只读这个值
 	struct stm_copy * copy; // 数据副本指针
 };
 
+// 追加在副本后的增量，只由写者追加，随副本一起释放
+struct stm_delta {
+	ATOM_POINTER next;   // 下一个增量
+	uint32_t sz;
+	void * msg;
+};
+
 // STM 数据副本结构
 struct stm_copy {
 	ATOM_INT reference;  // 原子引用计数
 	uint32_t sz;         // 数据大小
 	void * msg;          // 数据指针
+	ATOM_POINTER delta;  // 第一个增量
+	struct stm_delta * tail;	// 最后一个增量，只有写者使用
 };
 
 // msg should alloc by skynet_malloc
@@ -34,6 +44,8 @@ stm_newcopy(void * msg, int32_t sz) {
 	ATOM_INIT(&copy->reference, 1);  // 初始引用计数为1
 	copy->sz = sz;
 	copy->msg = msg;
+	ATOM_INIT(&copy->delta, 0);
+	copy->tail = NULL;
 
 	return copy;
 }
@@ -44,6 +56,7 @@ stm_new(void * msg, int32_t sz) {
 	struct stm_object * obj = skynet_malloc(sizeof(*obj));
 	rwlock_init(&obj->lock);         // 初始化读写锁
 	ATOM_INIT(&obj->reference , 1);  // 初始引用计数为1
+	ATOM_INIT(&obj->version, 0);
 	obj->copy = stm_newcopy(msg, sz); // 创建初始副本
 
 	return obj;
@@ -56,6 +69,13 @@ stm_releasecopy(struct stm_copy *copy) {
 		return;
 	if (ATOM_FDEC(&copy->reference) <= 1) {
 		// 引用计数降到0，释放资源
+		struct stm_delta * d = (struct stm_delta *)ATOM_LOAD(&copy->delta);
+		while (d) {
+			struct stm_delta * next = (struct stm_delta *)ATOM_LOAD(&d->next);
+			skynet_free(d->msg);
+			skynet_free(d);
+			d = next;
+		}
 		skynet_free(copy->msg);
 		skynet_free(copy);
 	}
@@ -70,6 +90,7 @@ stm_release(struct stm_object *obj) {
 	// 写者释放 STM 对象，所以释放最后的副本
 	stm_releasecopy(obj->copy);
 	obj->copy = NULL;
+	ATOM_FINC(&obj->version);
 	if (ATOM_FDEC(&obj->reference) > 1) {
 		// stm object grab by readers, reset the copy to NULL.
 		// STM 对象被读者持有，将副本重置为 NULL
@@ -124,11 +145,30 @@ stm_update(struct stm_object *obj, void *msg, int32_t sz) {
 	rwlock_wlock(&obj->lock);
 	struct stm_copy *oldcopy = obj->copy;
 	obj->copy = copy;
+	ATOM_FINC(&obj->version);
 	rwlock_wunlock(&obj->lock);
 
 	stm_releasecopy(oldcopy);
 }
 
+// 在当前副本后追加一个增量，不复制整个数据；读者在下次读取时依次应用
+static void
+stm_append(struct stm_object *obj, void *msg, int32_t sz) {
+	struct stm_delta * d = skynet_malloc(sizeof(*d));
+	ATOM_INIT(&d->next, 0);
+	d->sz = sz;
+	d->msg = msg;
+	// 只有写者会修改 obj->copy 和 tail
+	struct stm_copy * copy = obj->copy;
+	if (copy->tail) {
+		ATOM_STORE(&copy->tail->next, (uintptr_t)d);
+	} else {
+		ATOM_STORE(&copy->delta, (uintptr_t)d);
+	}
+	copy->tail = d;
+	ATOM_FINC(&obj->version);
+}
+
 // lua binding
 
 struct boxstm {
@@ -143,18 +183,12 @@ lcopy(lua_State *L) {
 	return 1;
 }
 
+static void * getmsg(lua_State *L, int index, size_t *sz);
+
 static int
 lnewwriter(lua_State *L) {
-	void * msg;
 	size_t sz;
-	if (lua_isuserdata(L,1)) {
-		msg = lua_touserdata(L, 1);
-		sz = (size_t)luaL_checkinteger(L, 2);
-	} else {
-		const char * tmp = luaL_checklstring(L,1,&sz);
-		msg = skynet_malloc(sz);
-		memcpy(msg, tmp, sz);
-	}
+	void * msg = getmsg(L, 1, &sz);
 	struct boxstm * box = lua_newuserdatauv(L, sizeof(*box), 0);
 	box->obj = stm_new(msg,sz);
 	lua_pushvalue(L, lua_upvalueindex(1));
@@ -172,27 +206,49 @@ ldeletewriter(lua_State *L) {
 	return 0;
 }
 
+static void *
+getmsg(lua_State *L, int index, size_t *sz) {
+	void * msg;
+	if (lua_isuserdata(L, index)) {
+		msg = lua_touserdata(L, index);
+		*sz = (size_t)luaL_checkinteger(L, index+1);
+	} else {
+		const char * tmp = luaL_checklstring(L,index,sz);
+		msg = skynet_malloc(*sz);
+		memcpy(msg, tmp, *sz);
+	}
+	return msg;
+}
+
 static int
 lupdate(lua_State *L) {
 	struct boxstm * box = lua_touserdata(L, 1);
-	void * msg;
 	size_t sz;
-	if (lua_isuserdata(L, 2)) {
-		msg = lua_touserdata(L, 2);
-		sz = (size_t)luaL_checkinteger(L, 3);
-	} else {
-		const char * tmp = luaL_checklstring(L,2,&sz);
-		msg = skynet_malloc(sz);
-		memcpy(msg, tmp, sz);
-	}
+	void * msg = getmsg(L, 2, &sz);
 	stm_update(box->obj, msg, sz);
 
 	return 0;
 }
 
+// stm.append(writer, msg, sz) 追加增量
+static int
+lappend(lua_State *L) {
+	struct boxstm * box = lua_touserdata(L, 1);
+	if (box == NULL || box->obj == NULL) {
+		return luaL_error(L, "Need a stm writer");
+	}
+	size_t sz;
+	void * msg = getmsg(L, 2, &sz);
+	stm_append(box->obj, msg, sz);
+
+	return 0;
+}
+
 struct boxreader {
 	struct stm_object *obj;
 	struct stm_copy *lastcopy;
+	struct stm_delta *lastdelta;	// 已经应用过的最后一个增量
+	int version;	// 上次读取时对象的版本
 };
 
 static int
@@ -200,6 +256,8 @@ lnewreader(lua_State *L) {
 	struct boxreader * box = lua_newuserdatauv(L, sizeof(*box), 0);
 	box->obj = lua_touserdata(L, 1);
 	box->lastcopy = NULL;
+	box->lastdelta = NULL;
+	box->version = 0;
 	lua_pushvalue(L, lua_upvalueindex(1));
 	lua_setmetatable(L, -2);
 
@@ -217,48 +275,92 @@ ldeletereader(lua_State *L) {
 	return 0;
 }
 
+// 调用 func(msg, sz, ud) ，之前调用的返回值被丢弃
+static void
+callreader(lua_State *L, int func, void *msg, uint32_t sz) {
+	lua_settop(L, 4);
+	lua_pushvalue(L, func);
+	lua_pushlightuserdata(L, msg);
+	lua_pushinteger(L, sz);
+	lua_pushvalue(L, 3);
+	lua_call(L, 3, LUA_MULTRET);
+}
+
+// 应用 lastdelta 之后的增量，返回应用的个数
+static int
+applydelta(lua_State *L, struct boxreader *box) {
+	struct stm_delta * d;
+	if (box->lastdelta) {
+		d = (struct stm_delta *)ATOM_LOAD(&box->lastdelta->next);
+	} else {
+		d = (struct stm_delta *)ATOM_LOAD(&box->lastcopy->delta);
+	}
+	int n = 0;
+	while (d) {
+		if (lua_type(L, 4) != LUA_TFUNCTION) {
+			luaL_error(L, "Need a patch function for the delta");
+		}
+		box->lastdelta = d;
+		callreader(L, 4, d->msg, d->sz);
+		++n;
+		d = (struct stm_delta *)ATOM_LOAD(&d->next);
+	}
+	return n;
+}
+
+// reader(f, ud, patch) 有新副本时调用 f(msg, sz, ud) ，再对之后的每个增量调用 patch(msg, sz, ud)
+// 返回 true 和最后一次调用的返回值；没有变化返回 false
 static int
 lread(lua_State *L) {
 	struct boxreader * box = lua_touserdata(L, 1);
 	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 4);
 
-	struct stm_copy * copy = stm_copy(box->obj);
-	if (copy == box->lastcopy) {
-		// not update
-		stm_releasecopy(copy);
+	// 没有变化时只读一次版本号，不加锁也不修改引用计数
+	int version = ATOM_LOAD(&box->obj->version);
+	if (box->lastcopy && version == box->version) {
 		lua_pushboolean(L, 0);
 		return 1;
 	}
+	box->version = version;
 
-	stm_releasecopy(box->lastcopy);
-	box->lastcopy = copy;
-	if (copy) {
-		lua_settop(L, 3);
-		lua_replace(L, 1);
-		lua_settop(L, 2);
-		lua_pushlightuserdata(L, copy->msg);
-		lua_pushinteger(L, copy->sz);
-		lua_pushvalue(L, 1);
-		lua_call(L, 3, LUA_MULTRET);
-		lua_pushboolean(L, 1);
-		lua_replace(L, 1);
-		return lua_gettop(L);
-	} else {
+	struct stm_copy * copy = stm_copy(box->obj);
+	if (copy == box->lastcopy) {
+		// 副本没变，只有追加的增量
+		stm_releasecopy(copy);
+		if (copy == NULL || applydelta(L, box) == 0) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+	} else if (copy == NULL) {
+		// 写者已经释放，保留最后的副本，之前交给 f 的 msg 仍然有效
 		lua_pushboolean(L, 0);
 		return 1;
+	} else {
+		stm_releasecopy(box->lastcopy);
+		box->lastcopy = copy;
+		box->lastdelta = NULL;
+		callreader(L, 2, copy->msg, copy->sz);
+		applydelta(L, box);
 	}
+	lua_pushboolean(L, 1);
+	lua_replace(L, 4);
+	return lua_gettop(L) - 3;
 }
 
 // STM 模块初始化函数
 LUAMOD_API int
 luaopen_skynet_stm(lua_State *L) {
 	luaL_checkversion(L);
-	lua_createtable(L, 0, 3);
+	lua_createtable(L, 0, 4);
 
 	// 添加 copy 函数
 	lua_pushcfunction(L, lcopy);
 	lua_setfield(L, -2, "copy");
 
+	lua_pushcfunction(L, lappend);
+	lua_setfield(L, -2, "append");
+
 	// 创建写者元表和函数
 	luaL_Reg writer[] = {
 		{ "new", lnewwriter },  // 创建新写者
@@ -0,0 +1,90 @@
+#define LUA_LIB
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <stdio.h>
+
+#include "skynet.h"
+#include "skynet_trace.h"
+
+static const char * type_name[] = {
+	"text", "response", "multicast", "client", "system", "harbor", "socket", "error",
+	"queue", "debug", "lua", "snax", "trace", "log",
+};
+
+// Lua 接口：开启或关闭消息分发跟踪，不带参数时只查询，返回之前的状态
+static int
+lenable(lua_State *L) {
+	int on = -1;
+	if (!lua_isnoneornil(L, 1)) {
+		on = lua_toboolean(L, 1);
+	}
+	lua_pushboolean(L, skynet_trace_enable(on));
+	return 1;
+}
+
+static void
+add_event(void *ud, int thread, const struct skynet_trace_event *ev, int n) {
+	luaL_Buffer *b = ud;
+	char tmp[256];
+	int i;
+	int sz = snprintf(tmp, sizeof(tmp),
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}},\n",
+		thread, thread);
+	luaL_addlstring(b, tmp, sz);
+	for (i=0;i<n;i++) {
+		const struct skynet_trace_event *e = &ev[i];
+		char type[32];
+		if (e->type < 0) {
+			snprintf(type, sizeof(type), "batch %d", -e->type);
+		} else if (e->type < (int)(sizeof(type_name)/sizeof(type_name[0]))) {
+			snprintf(type, sizeof(type), "%s", type_name[e->type]);
+		} else {
+			snprintf(type, sizeof(type), "%d", e->type);
+		}
+		// ts 和 dur 的单位是微秒
+		sz = snprintf(tmp, sizeof(tmp),
+			"{\"name\":\":%08x\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+			"\"args\":{\"source\":\":%08x\",\"session\":%d,\"size\":%u}},\n",
+			e->destination, type, thread, e->start / 1000.0, e->cost / 1000.0,
+			e->source, e->session, e->size);
+		luaL_addlstring(b, tmp, sz);
+	}
+}
+
+/*
+	return string, integer : Chrome/Perfetto 的 JSON 格式 (Trace Event Format)，记录数量
+	每个线程是一个 tid ，每次分发是一个 "X" 事件，名字是处理消息的服务
+ */
+static int
+lchrome(lua_State *L) {
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "{\"traceEvents\":[\n");
+	int n = skynet_trace_foreach(add_event, &b);
+	// 去掉最后一个逗号
+	if (luaL_bufflen(&b) > 2 && luaL_buffaddr(&b)[luaL_bufflen(&b) - 2] == ',') {
+		luaL_buffsub(&b, 2);
+		luaL_addchar(&b, '\n');
+	}
+	luaL_addstring(&b, "],\"displayTimeUnit\":\"ns\"}\n");
+	luaL_pushresult(&b);
+	lua_pushinteger(L, n);
+	return 2;
+}
+
+LUAMOD_API int
+luaopen_skynet_tracering(lua_State *L) {
+	luaL_checkversion(L);
+
+	luaL_Reg l[] = {
+		{ "enable", lenable },	// 开启或关闭跟踪
+		{ "chrome", lchrome },	// 导出所有线程的记录
+		{ NULL, NULL },
+	};
+
+	luaL_newlib(L,l);
+
+	return 1;
+}
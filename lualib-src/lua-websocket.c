@@ -0,0 +1,205 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+	WebSocket (RFC 6455) 的帧，见 http/websocket.lua
+ */
+
+#define MAX_HEADER 14
+
+// 用 4 字节的 key 异或 sz 字节，src 和 dst 可以相同
+static void
+maskcopy(uint8_t *dst, const uint8_t *src, size_t sz, const uint8_t key[4]) {
+	uint32_t k;
+	memcpy(&k, key, 4);
+	size_t i = 0;
+#if defined(__SSE2__)
+	__m128i m = _mm_set1_epi32((int)k);
+	for (; i + 16 <= sz; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, m));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(k));
+	for (; i + 16 <= sz; i += 16) {
+		vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), m));
+	}
+#endif
+	// 内存中的字节顺序和 key 相同，和大小端无关
+	uint64_t k8 = (uint64_t)k << 32 | k;
+	for (; i + 8 <= sz; i += 8) {
+		uint64_t v;
+		memcpy(&v, src + i, 8);
+		v ^= k8;
+		memcpy(dst + i, &v, 8);
+	}
+	// i 是 4 的倍数
+	for (; i < sz; i++) {
+		dst[i] = src[i] ^ key[i & 3];
+	}
+}
+
+/*
+	string buffer
+	integer pos
+	integer maxsize : payload 的上限，可选
+	return nextpos, fin, opcode, rsv1, payload ：payload 已经去掉掩码
+		nil : 不完整
+		nil, n : 头部完整，还差 n 字节
+		false, err : payload 超过 maxsize
+ */
+static int
+lframe(lua_State *L) {
+	size_t sz;
+	const uint8_t * buf = (const uint8_t *)luaL_checklstring(L, 1, &sz);
+	lua_Integer pos = luaL_optinteger(L, 2, 1);
+	luaL_argcheck(L, pos >= 1 && (size_t)pos <= sz + 1, 2, "position out of range");
+	uint64_t maxsize = (uint64_t)luaL_optinteger(L, 3, -1);
+	const uint8_t * p = buf + pos - 1;
+	size_t left = sz - (size_t)(pos - 1);
+	if (left < 2)
+		return 0;
+	int mask = p[1] & 0x80;
+	uint64_t len = p[1] & 0x7f;
+	size_t head = 2;
+	if (len == 126) {
+		head = 4;
+		if (left < head)
+			return 0;
+		len = (uint64_t)p[2] << 8 | p[3];
+	} else if (len == 127) {
+		head = 10;
+		if (left < head)
+			return 0;
+		int i;
+		len = 0;
+		for (i=0;i<8;i++) {
+			len = len << 8 | p[2+i];
+		}
+	}
+	if (len > maxsize || len > (uint64_t)(SIZE_MAX - MAX_HEADER)) {
+		lua_pushboolean(L, 0);
+		lua_pushliteral(L, "payload_len is too large");
+		return 2;
+	}
+	const uint8_t * key = p + head;
+	if (mask)
+		head += 4;
+	size_t total = head + (size_t)len;
+	if (left < total) {
+		if (left < head)
+			return 0;
+		lua_pushnil(L);
+		lua_pushinteger(L, total - left);
+		return 2;
+	}
+	lua_pushinteger(L, pos + total);
+	lua_pushboolean(L, p[0] & 0x80);
+	lua_pushinteger(L, p[0] & 0x0f);
+	lua_pushboolean(L, p[0] & 0x40);
+	if (mask && len > 0) {
+		luaL_Buffer b;
+		uint8_t * out = (uint8_t *)luaL_buffinitsize(L, &b, (size_t)len);
+		maskcopy(out, p + head, (size_t)len, key);
+		luaL_pushresultsize(&b, (size_t)len);
+	} else {
+		lua_pushlstring(L, (const char *)p + head, (size_t)len);
+	}
+	return 5;
+}
+
+/*
+	integer opcode
+	string payload (可选)
+	boolean fin : 默认 true
+	boolean rsv1 : permessage-deflate 压缩过的消息
+	integer maskkey : 32 位的掩码，可选
+	return string : 整个帧
+ */
+static int
+lpack(lua_State *L) {
+	lua_Integer op = luaL_checkinteger(L, 1);
+	size_t sz = 0;
+	const char * payload = luaL_optlstring(L, 2, "", &sz);
+	int fin = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+	int rsv1 = lua_toboolean(L, 4);
+	int mask = !lua_isnoneornil(L, 5);
+	uint8_t key[4];
+	if (mask) {
+		lua_Integer k = luaL_checkinteger(L, 5);
+		key[0] = (uint8_t)(k >> 24);
+		key[1] = (uint8_t)(k >> 16);
+		key[2] = (uint8_t)(k >> 8);
+		key[3] = (uint8_t)k;
+	}
+	luaL_Buffer b;
+	uint8_t * p = (uint8_t *)luaL_buffinitsize(L, &b, MAX_HEADER + sz);
+	size_t head = 2;
+	p[0] = (fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | (op & 0x0f);
+	if (sz < 126) {
+		p[1] = (uint8_t)sz;
+	} else if (sz <= 0xffff) {
+		p[1] = 126;
+		p[2] = (uint8_t)(sz >> 8);
+		p[3] = (uint8_t)sz;
+		head = 4;
+	} else {
+		p[1] = 127;
+		int i;
+		uint64_t len = sz;
+		for (i=7;i>=0;i--) {
+			p[2+i] = (uint8_t)len;
+			len >>= 8;
+		}
+		head = 10;
+	}
+	if (mask) {
+		p[1] |= 0x80;
+		memcpy(p + head, key, 4);
+		head += 4;
+		maskcopy(p + head, (const uint8_t *)payload, sz, key);
+	} else {
+		memcpy(p + head, payload, sz);
+	}
+	luaL_pushresultsize(&b, head + sz);
+	return 1;
+}
+
+/*
+	string data
+	string key : 4 字节
+	return string
+ */
+static int
+lmask(lua_State *L) {
+	size_t sz, keysz;
+	const char * data = luaL_checklstring(L, 1, &sz);
+	const char * key = luaL_checklstring(L, 2, &keysz);
+	luaL_argcheck(L, keysz == 4, 2, "need 4 bytes key");
+	luaL_Buffer b;
+	uint8_t * out = (uint8_t *)luaL_buffinitsize(L, &b, sz);
+	maskcopy(out, (const uint8_t *)data, sz, (const uint8_t *)key);
+	luaL_pushresultsize(&b, sz);
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_skynet_websocket_core(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "frame", lframe },
+		{ "pack", lpack },
+		{ "mask", lmask },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
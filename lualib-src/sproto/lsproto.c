@@ -405,6 +405,27 @@ expand_buffer(lua_State *L, int osz, int nsz) {
 	return output;
 }
 
+// 把 tbl_index 处的 table 编码进 buffer，空间不够返回负数
+static int
+encode_table(lua_State *L, struct sproto_type *st, int tbl_index, void *buffer, int sz) {
+	struct encode_ud self;
+	int top = lua_gettop(L);
+	int r;
+	self.L = L;
+	self.st = st;
+	self.tbl_index = tbl_index;
+	self.array_tag = NULL;
+	self.array_index = 0;
+	self.deep = 0;
+	self.map_entry = 0;
+	self.iter_func = 0;
+	self.iter_table = 0;
+	self.iter_key = 0;
+	r = sproto_encode(st, buffer, sz, encode, &self);
+	lua_settop(L, top);
+	return r;
+}
+
 /*
 	lightuserdata sproto_type
 	table source
@@ -413,7 +434,6 @@ expand_buffer(lua_State *L, int osz, int nsz) {
  */
 static int
 lencode(lua_State *L) {
-	struct encode_ud self;
 	void * buffer = lua_touserdata(L, lua_upvalueindex(1));
 	int sz = lua_tointeger(L, lua_upvalueindex(2));
 	int tbl_index = 2;
@@ -423,22 +443,9 @@ lencode(lua_State *L) {
 		lua_pushstring(L, "");
 		return 1;	// response nil
 	}
-	self.L = L;
-	self.st = st;
-	self.tbl_index = tbl_index;
+	lua_settop(L, tbl_index);
 	for (;;) {
-		int r;
-		self.array_tag = NULL;
-		self.array_index = 0;
-		self.deep = 0;
-
-		lua_settop(L, tbl_index);
-		self.map_entry = 0;
-		self.iter_func = 0;
-		self.iter_table = 0;
-		self.iter_key = 0;
-
-		r = sproto_encode(st, buffer, sz, encode, &self);
+		int r = encode_table(L, st, tbl_index, buffer, sz);
 		if (r<0) {
 			buffer = expand_buffer(L, sz, sz*2);
 			sz *= 2;
@@ -526,7 +533,8 @@ decode(const struct sproto_arg *args) {
 			}
 			sub.result_index = self->map_entry;
 		} else {
-			lua_newtable(L);
+			// 按字段数预分配，避免解码时 table 反复 rehash
+			lua_createtable(L, 0, sproto_fieldcount(args->subtype));
 			sub.result_index = lua_gettop(L);
 		}
 		sub.deep = self->deep + 1;
@@ -595,6 +603,27 @@ decode(const struct sproto_arg *args) {
 	return 0;
 }
 
+// 把 buffer 解码进 index 处的 table，返回解码的字节数
+static int
+decode_table(lua_State *L, struct sproto_type *st, const void *buffer, int sz, int index) {
+	struct decode_ud self;
+	int r;
+	self.L = L;
+	self.result_index = index;
+	self.array_index = 0;
+	self.array_tag = NULL;
+	self.deep = 0;
+	self.mainindex_tag = -1;
+	self.key_index = 0;
+	self.map_entry = 0;
+	r = sproto_decode(st, buffer, sz, decode, &self);
+	if (r < 0) {
+		return luaL_error(L, "decode error");
+	}
+	lua_settop(L, index);
+	return r;
+}
+
 static const void *
 getbuffer(lua_State *L, int index, size_t *sz) {
 	const void * buffer = NULL;
@@ -621,7 +650,6 @@ static int
 ldecode(lua_State *L) {
 	struct sproto_type * st = lua_touserdata(L, 1);
 	const void * buffer;
-	struct decode_ud self;
 	size_t sz;
 	int r;
 	if (st == NULL) {
@@ -631,23 +659,60 @@ ldecode(lua_State *L) {
 	sz = 0;
 	buffer = getbuffer(L, 2, &sz);
 	if (!lua_istable(L, -1)) {
-		lua_newtable(L);
+		lua_createtable(L, 0, sproto_fieldcount(st));
 	}
-	self.L = L;
-	self.result_index = lua_gettop(L);
-	self.array_index = 0;
-	self.array_tag = NULL;
-	self.deep = 0;
-	self.mainindex_tag = -1;
-	self.key_index = 0;
-	self.map_entry = 0;
-	r = sproto_decode(st, buffer, (int)sz, decode, &self);
+	r = decode_table(L, st, buffer, (int)sz, lua_gettop(L));
+	lua_pushinteger(L, r);
+	return 2;
+}
+
+struct decodefield_ud {
+	struct decode_ud d;	// must be the first
+	const char * name;
+};
+
+static int
+decode_field(const struct sproto_arg *args) {
+	struct decodefield_ud * self = args->ud;
+	if (strcmp(args->tagname, self->name) != 0)
+		return 0;
+	return decode(args);
+}
+
+/*
+	lightuserdata sproto_type
+	string fieldname
+	string source	/  (lightuserdata , integer)
+	return value of the field, other fields are skipped without decoding
+ */
+static int
+ldecodefield(lua_State *L) {
+	struct sproto_type * st = lua_touserdata(L, 1);
+	struct decodefield_ud self;
+	const void * buffer;
+	size_t sz;
+	int r;
+	if (st == NULL) {
+		return 0;
+	}
+	self.name = luaL_checkstring(L, 2);
+	sz = 0;
+	buffer = getbuffer(L, 3, &sz);
+	lua_newtable(L);
+	self.d.L = L;
+	self.d.result_index = lua_gettop(L);
+	self.d.array_index = 0;
+	self.d.array_tag = NULL;
+	self.d.deep = 0;
+	self.d.mainindex_tag = -1;
+	self.d.key_index = 0;
+	self.d.map_entry = 0;
+	r = sproto_decode(st, buffer, (int)sz, decode_field, &self);
 	if (r < 0) {
 		return luaL_error(L, "decode error");
 	}
-	lua_settop(L, self.result_index);
-	lua_pushinteger(L, r);
-	return 2;
+	lua_getfield(L, self.d.result_index, self.name);
+	return 1;
 }
 
 static int
@@ -766,6 +831,14 @@ lprotocol(lua_State *L) {
  */
 static struct sproto * G_sproto[MAX_GLOBALSPROTO];
 
+static void
+poolname(void *ud, const char *name) {
+	lua_State *L = ud;
+	lua_pushstring(L, name);
+	lua_poolstring(L, -1);
+	lua_pop(L, 1);
+}
+
 static int
 lsaveproto(lua_State *L) {
 	struct sproto * sp = lua_touserdata(L, 1);
@@ -775,6 +848,8 @@ lsaveproto(lua_State *L) {
 	}
 	/* TODO : release old object (memory leak now, but thread safe)*/
 	G_sproto[index] = sp;
+	// 共享给所有服务的协议，把名字放进进程级的短字符串池
+	sproto_names(sp, poolname, L);
 	return 0;
 }
 
@@ -878,6 +953,336 @@ ldefault(lua_State *L) {
 	return 1;
 }
 
+/*
+	RPC host : 解析包头、按 tag 查协议、记录发出的请求等待的响应类型，都在 C 里完成。
+	包头是 package 类型（type/session/ud），编解码时复用函数 upvalue 里的 table，
+	打包用函数自己的缓冲区，每个请求不用分配闭包和中间字符串。
+ */
+
+#define HOST_METANAME "SPROTO_HOST"
+
+struct host_slot {
+	lua_Integer session;
+	struct sproto_type *response;	// NULL 表示响应没有内容
+	int used;
+};
+
+struct sproto_host {
+	struct sproto *sp;
+	struct sproto_type *package;
+	int n;
+	int cap;	// 槽数，2的幂；线性探测
+	struct host_slot *slot;
+};
+
+static inline int
+host_hash(struct sproto_host *h, lua_Integer session) {
+	uint64_t x = (uint64_t)session * 0x9E3779B97F4A7C15ull;
+	return (int)(x >> 32) & (h->cap - 1);
+}
+
+static void
+host_insert(struct sproto_host *h, lua_Integer session, struct sproto_type *response);
+
+static void
+host_rehash(struct sproto_host *h, int cap) {
+	struct host_slot *old = h->slot;
+	int ocap = h->cap;
+	int i;
+	h->slot = (struct host_slot *)calloc(cap, sizeof(struct host_slot));
+	h->cap = cap;
+	h->n = 0;
+	for (i=0;i<ocap;i++) {
+		if (old[i].used)
+			host_insert(h, old[i].session, old[i].response);
+	}
+	free(old);
+}
+
+static void
+host_insert(struct sproto_host *h, lua_Integer session, struct sproto_type *response) {
+	int i;
+	if ((h->n + 1) * 4 > h->cap * 3) {
+		host_rehash(h, h->cap ? h->cap * 2 : 16);
+	}
+	i = host_hash(h, session);
+	while (h->slot[i].used && h->slot[i].session != session) {
+		i = (i + 1) & (h->cap - 1);
+	}
+	if (!h->slot[i].used) {
+		h->slot[i].used = 1;
+		h->slot[i].session = session;
+		++h->n;
+	}
+	h->slot[i].response = response;
+}
+
+// 取出并删除 session，找不到返回 0
+static int
+host_remove(struct sproto_host *h, lua_Integer session, struct sproto_type **response) {
+	int i, j;
+	if (h->n == 0)
+		return 0;
+	i = host_hash(h, session);
+	while (h->slot[i].session != session || !h->slot[i].used) {
+		if (!h->slot[i].used)
+			return 0;
+		i = (i + 1) & (h->cap - 1);
+	}
+	*response = h->slot[i].response;
+	--h->n;
+	// 后移删除：把后面探测链上的槽挪回来，不留墓碑
+	j = i;
+	for (;;) {
+		int k;
+		j = (j + 1) & (h->cap - 1);
+		if (!h->slot[j].used)
+			break;
+		k = host_hash(h, h->slot[j].session);
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			h->slot[i] = h->slot[j];
+			i = j;
+		}
+	}
+	h->slot[i].used = 0;
+	return 1;
+}
+
+static int
+lhost_gc(lua_State *L) {
+	struct sproto_host *h = luaL_checkudata(L, 1, HOST_METANAME);
+	free(h->slot);
+	h->slot = NULL;
+	h->cap = 0;
+	h->n = 0;
+	return 0;
+}
+
+/*
+	lightuserdata sproto
+	lightuserdata sproto_type (package)
+	return host userdata
+ */
+static int
+lnewhost(lua_State *L) {
+	struct sproto *sp = lua_touserdata(L, 1);
+	struct sproto_type *package = lua_touserdata(L, 2);
+	struct sproto_host *h;
+	if (sp == NULL) {
+		return luaL_argerror(L, 1, "Need a sproto object");
+	}
+	if (package == NULL) {
+		return luaL_argerror(L, 2, "Need a sproto_type object");
+	}
+	h = (struct sproto_host *)lua_newuserdata(L, sizeof(*h));
+	h->sp = sp;
+	h->package = package;
+	h->n = 0;
+	h->cap = 0;
+	h->slot = NULL;
+	luaL_getmetatable(L, HOST_METANAME);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+// 按名字或 tag 查协议
+static int
+host_prototag(lua_State *L, struct sproto *sp, int index) {
+	int tag;
+	if (lua_type(L, index) == LUA_TNUMBER) {
+		tag = (int)lua_tointeger(L, index);
+		if (sproto_protoname(sp, tag) == NULL)
+			return luaL_error(L, "%d not found", tag);
+	} else {
+		const char * name = luaL_checkstring(L, index);
+		tag = sproto_prototag(sp, name);
+		if (tag < 0)
+			return luaL_error(L, "%s not found", name);
+	}
+	return tag;
+}
+
+// 设置 upvalue 3 的包头 table，压在栈顶
+static int
+host_header(lua_State *L, int tag, int session, int ud) {
+	lua_pushvalue(L, lua_upvalueindex(3));
+	if (tag >= 0)
+		lua_pushinteger(L, tag);
+	else
+		lua_pushnil(L);
+	lua_setfield(L, -2, "type");
+	lua_pushvalue(L, session);
+	lua_setfield(L, -2, "session");
+	lua_pushvalue(L, ud);
+	lua_setfield(L, -2, "ud");
+	return lua_gettop(L);
+}
+
+// 编码包头和内容（content 为 NULL 时只有包头），打包后压入字符串；编码和打包都在 upvalue 的缓冲区里
+static int
+host_pack(lua_State *L, struct sproto_type *package, int header, struct sproto_type *content, int args) {
+	void * buffer = lua_touserdata(L, lua_upvalueindex(1));
+	int sz = lua_tointeger(L, lua_upvalueindex(2));
+	if (content && lua_isnil(L, args)) {
+		lua_newtable(L);
+		lua_replace(L, args);
+	}
+	for (;;) {
+		int hsz, csz = 0, n, bytes;
+		size_t maxsz;
+		hsz = encode_table(L, package, header, buffer, sz);
+		if (hsz >= 0 && content) {
+			csz = encode_table(L, content, args, (char *)buffer + hsz, sz - hsz);
+		}
+		if (hsz < 0 || csz < 0) {
+			buffer = expand_buffer(L, sz, sz*2);
+			sz = lua_tointeger(L, lua_upvalueindex(2));
+			continue;
+		}
+		n = hsz + csz;
+		// 打包的结果放在编码结果的后面
+		maxsz = (n + 2047) / 2048 * 2 + n + 2;
+		if (n + maxsz > (size_t)sz) {
+			buffer = expand_buffer(L, sz, n + maxsz);
+			sz = lua_tointeger(L, lua_upvalueindex(2));
+			continue;
+		}
+		bytes = sproto_pack(buffer, n, (char *)buffer + n, maxsz);
+		if (bytes > maxsz) {
+			return luaL_error(L, "packing error, return size = %d", bytes);
+		}
+		lua_pushlstring(L, (char *)buffer + n, bytes);
+		return 1;
+	}
+}
+
+/*
+	userdata host
+	string msg / (lightuserdata , integer)
+
+	request : return "REQUEST", name, args, session, ud, tag
+	response : return "RESPONSE", session, args, ud
+ */
+static int
+lhost_dispatch(lua_State *L) {
+	struct sproto_host *h = luaL_checkudata(L, 1, HOST_METANAME);
+	size_t sz = 0;
+	const void * msg = getbuffer(L, 2, &sz);
+	void * buffer = lua_touserdata(L, lua_upvalueindex(1));
+	int osz = lua_tointeger(L, lua_upvalueindex(2));
+	int r = sproto_unpack(msg, sz, buffer, osz);
+	int header, hsz;
+	if (r < 0)
+		return luaL_error(L, "Invalid unpack stream");
+	if (r > osz) {
+		buffer = expand_buffer(L, osz, r);
+		r = sproto_unpack(msg, sz, buffer, r);
+		if (r < 0)
+			return luaL_error(L, "Invalid unpack stream");
+	}
+	lua_settop(L, 1);
+	lua_pushnil(L);
+	header = host_header(L, -1, 2, 2);	// 清掉上次的 type/session/ud
+	hsz = decode_table(L, h->package, buffer, r, header);
+	lua_getfield(L, header, "type");
+	if (!lua_isnil(L, -1)) {
+		int tag = (int)lua_tointeger(L, -1);
+		const char * name = sproto_protoname(h->sp, tag);
+		struct sproto_type * request;
+		if (name == NULL)
+			return luaL_error(L, "%d not found", tag);
+		request = sproto_protoquery(h->sp, tag, SPROTO_REQUEST);
+		lua_pushliteral(L, "REQUEST");
+		lua_pushstring(L, name);
+		if (request) {
+			lua_createtable(L, 0, sproto_fieldcount(request));
+			decode_table(L, request, (const char *)buffer + hsz, r - hsz, lua_gettop(L));
+		} else {
+			lua_pushnil(L);
+		}
+		lua_getfield(L, header, "session");
+		lua_getfield(L, header, "ud");
+		lua_pushinteger(L, tag);
+		return 6;
+	} else {
+		struct sproto_type * response;
+		lua_Integer session;
+		int isnum;
+		lua_pushliteral(L, "RESPONSE");
+		lua_getfield(L, header, "session");
+		session = lua_tointegerx(L, -1, &isnum);
+		if (!isnum)
+			return luaL_error(L, "session not found");
+		if (!host_remove(h, session, &response))
+			return luaL_error(L, "Unknown session");
+		if (response) {
+			lua_createtable(L, 0, sproto_fieldcount(response));
+			decode_table(L, response, (const char *)buffer + hsz, r - hsz, lua_gettop(L));
+		} else {
+			lua_pushnil(L);
+		}
+		lua_getfield(L, header, "ud");
+		return 4;
+	}
+}
+
+/*
+	userdata host
+	string name / integer tag
+	integer session
+	table args
+	ud
+
+	return the response packet of a request
+ */
+static int
+lhost_response(lua_State *L) {
+	struct sproto_host *h = luaL_checkudata(L, 1, HOST_METANAME);
+	int tag = host_prototag(L, h->sp, 2);
+	struct sproto_type * response = sproto_protoquery(h->sp, tag, SPROTO_RESPONSE);
+	int header;
+	lua_settop(L, 5);
+	header = host_header(L, -1, 3, 5);
+	return host_pack(L, h->package, header, response, 4);
+}
+
+/*
+	userdata host
+	lightuserdata sproto (of the remote side)
+	string name / integer tag
+	table args
+	integer session (nil : no response)
+	ud
+
+	return the request packet, the session waits for the response type
+ */
+static int
+lhost_request(lua_State *L) {
+	struct sproto_host *h = luaL_checkudata(L, 1, HOST_METANAME);
+	struct sproto *sp = lua_touserdata(L, 2);
+	int tag, header;
+	if (sp == NULL) {
+		return luaL_argerror(L, 2, "Need a sproto object");
+	}
+	tag = host_prototag(L, sp, 3);
+	lua_settop(L, 6);
+	if (!lua_isnil(L, 5)) {
+		lua_Integer session = luaL_checkinteger(L, 5);
+		host_insert(h, session, sproto_protoquery(sp, tag, SPROTO_RESPONSE));
+	}
+	header = host_header(L, tag, 5, 6);
+	return host_pack(L, h->package, header, sproto_protoquery(sp, tag, SPROTO_REQUEST), 4);
+}
+
+static void
+pushfunction_withheader(lua_State *L, const char * name, lua_CFunction func) {
+	lua_newuserdata(L, ENCODE_BUFFERSIZE);
+	lua_pushinteger(L, ENCODE_BUFFERSIZE);
+	lua_createtable(L, 0, 3);
+	lua_pushcclosure(L, func, 3);
+	lua_setfield(L, -2, name);
+}
+
 LUAMOD_API int
 luaopen_sproto_core(lua_State *L) {
 #ifdef luaL_checkversion
@@ -889,15 +1294,25 @@ luaopen_sproto_core(lua_State *L) {
 		{ "dumpproto", ldumpproto },
 		{ "querytype", lquerytype },
 		{ "decode", ldecode },
+		{ "decodefield", ldecodefield },
 		{ "protocol", lprotocol },
 		{ "loadproto", lloadproto },
 		{ "saveproto", lsaveproto },
 		{ "default", ldefault },
+		{ "host", lnewhost },
 		{ NULL, NULL },
 	};
+	if (luaL_newmetatable(L, HOST_METANAME)) {
+		lua_pushcfunction(L, lhost_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
 	luaL_newlib(L,l);
 	pushfunction_withbuffer(L, "encode", lencode);
 	pushfunction_withbuffer(L, "pack", lpack);
 	pushfunction_withbuffer(L, "unpack", lunpack);
+	pushfunction_withheader(L, "host_dispatch", lhost_dispatch);
+	pushfunction_withheader(L, "host_response", lhost_response);
+	pushfunction_withheader(L, "host_request", lhost_request);
 	return 1;
 }
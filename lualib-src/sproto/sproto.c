@@ -4,6 +4,16 @@
 #include <assert.h>
 #include "msvcint.h"
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define SPROTO_SHUFFLE
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define SPROTO_SHUFFLE
+#endif
+
 #include "sproto.h"
 
 #define CHUNK_SIZE 1000
@@ -54,6 +64,9 @@ struct sproto {
 	int protocol_n;
 	struct sproto_type * type;
 	struct protocol * proto;
+	// sorted by name, immutable after sproto_create so it can be shared by services
+	struct sproto_type ** type_index;
+	struct protocol ** proto_index;
 };
 
 static void
@@ -421,6 +434,44 @@ import_protocol(struct sproto *s, struct protocol *p, const uint8_t * stream) {
 	return result;
 }
 
+static int
+compare_type(const void *a, const void *b) {
+	const struct sproto_type * ta = *(const struct sproto_type * const *)a;
+	const struct sproto_type * tb = *(const struct sproto_type * const *)b;
+	return strcmp(ta->name, tb->name);
+}
+
+static int
+compare_protocol(const void *a, const void *b) {
+	const struct protocol * pa = *(const struct protocol * const *)a;
+	const struct protocol * pb = *(const struct protocol * const *)b;
+	return strcmp(pa->name, pb->name);
+}
+
+static struct sproto *
+build_index(struct sproto *s) {
+	int i;
+	if (s->type_n > 0) {
+		s->type_index = pool_alloc(&s->memory, s->type_n * sizeof(*s->type_index));
+		if (s->type_index == NULL)
+			return NULL;
+		for (i=0;i<s->type_n;i++) {
+			s->type_index[i] = &s->type[i];
+		}
+		qsort(s->type_index, s->type_n, sizeof(*s->type_index), compare_type);
+	}
+	if (s->protocol_n > 0) {
+		s->proto_index = pool_alloc(&s->memory, s->protocol_n * sizeof(*s->proto_index));
+		if (s->proto_index == NULL)
+			return NULL;
+		for (i=0;i<s->protocol_n;i++) {
+			s->proto_index[i] = &s->proto[i];
+		}
+		qsort(s->proto_index, s->protocol_n, sizeof(*s->proto_index), compare_protocol);
+	}
+	return s;
+}
+
 static struct sproto *
 create_from_bundle(struct sproto *s, const uint8_t * stream, size_t sz) {
 	const uint8_t * content;
@@ -466,6 +517,9 @@ create_from_bundle(struct sproto *s, const uint8_t * stream, size_t sz) {
 			return NULL;
 		}
 	}
+	if (build_index(s) == NULL) {
+		return NULL;
+	}
 
 	return s;
 }
@@ -572,10 +626,17 @@ sproto_dump(struct sproto *s) {
 // query
 int
 sproto_prototag(const struct sproto *sp, const char * name) {
-	int i;
-	for (i=0;i<sp->protocol_n;i++) {
-		if (strcmp(name, sp->proto[i].name) == 0) {
-			return sp->proto[i].tag;
+	int begin = 0, end = sp->protocol_n;
+	while(begin<end) {
+		int mid = (begin+end)/2;
+		int c = strcmp(name, sp->proto_index[mid]->name);
+		if (c==0) {
+			return sp->proto_index[mid]->tag;
+		}
+		if (c > 0) {
+			begin = mid+1;
+		} else {
+			end = mid;
 		}
 	}
 	return -1;
@@ -629,10 +690,17 @@ sproto_protoname(const struct sproto *sp, int proto) {
 
 struct sproto_type *
 sproto_type(const struct sproto *sp, const char * type_name) {
-	int i;
-	for (i=0;i<sp->type_n;i++) {
-		if (strcmp(type_name, sp->type[i].name) == 0) {
-			return &sp->type[i];
+	int begin = 0, end = sp->type_n;
+	while(begin<end) {
+		int mid = (begin+end)/2;
+		int c = strcmp(type_name, sp->type_index[mid]->name);
+		if (c==0) {
+			return sp->type_index[mid];
+		}
+		if (c > 0) {
+			begin = mid+1;
+		} else {
+			end = mid;
 		}
 	}
 	return NULL;
@@ -643,6 +711,26 @@ sproto_name(struct sproto_type * st) {
 	return st->name;
 }
 
+int
+sproto_fieldcount(const struct sproto_type * st) {
+	return st->n;
+}
+
+void
+sproto_names(const struct sproto *sp, sproto_namecb cb, void *ud) {
+	int i,j;
+	for (i=0;i<sp->type_n;i++) {
+		const struct sproto_type *st = &sp->type[i];
+		cb(ud, st->name);
+		for (j=0;j<st->n;j++) {
+			cb(ud, st->f[j].name);
+		}
+	}
+	for (i=0;i<sp->protocol_n;i++) {
+		cb(ud, sp->proto[i].name);
+	}
+}
+
 static struct field *
 findtag(const struct sproto_type *st, int tag) {
 	int begin, end;
@@ -1276,12 +1364,97 @@ sproto_decode(const struct sproto_type *st, const void * data, int size, sproto_
 
 // 0 pack
 
+// bit i is set when src[i] is not zero
+static inline int
+nonzero_mask(const uint8_t *src) {
+#if defined(__SSE2__)
+	__m128i v = _mm_loadl_epi64((const __m128i *)src);
+	int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	return ~zero & 0xff;
+#elif defined(SPROTO_SHUFFLE)
+	static const uint8_t bits[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x8_t v = vld1_u8(src);
+	return vaddv_u8(vand_u8(vtst_u8(v, v), vld1_u8(bits)));
+#else
+	int header = 0;
+	int i;
+	for (i=0;i<8;i++) {
+		header |= (src[i] != 0) << i;
+	}
+	return header;
+#endif
+}
+
+#ifdef SPROTO_SHUFFLE
+
+// Shuffle tables indexed by the segment header, 0x80 selects a zero byte.
+
+#define BITCOUNT(h) (((h)&1)+((h)>>1&1)+((h)>>2&1)+((h)>>3&1)+((h)>>4&1)+((h)>>5&1)+((h)>>6&1)+((h)>>7&1))
+#define BEFORE(h,i) BITCOUNT((h) & ((1<<(i))-1))
+#define ISNTH(h,i,j) ((((h)>>(i))&1) && BEFORE(h,i) == (j))
+
+// Output byte i comes from the packed byte BEFORE(h,i)
+#define EXPAND_BYTE(h,i) (((h)>>(i)&1) ? BEFORE(h,i) : 0x80)
+#define EXPAND(h) { EXPAND_BYTE(h,0), EXPAND_BYTE(h,1), EXPAND_BYTE(h,2), EXPAND_BYTE(h,3), \
+	EXPAND_BYTE(h,4), EXPAND_BYTE(h,5), EXPAND_BYTE(h,6), EXPAND_BYTE(h,7) }
+
+// Packed byte j comes from the j-th non-zero byte
+#define COMPRESS_BYTE(h,j) (BITCOUNT(h) > (j) ? \
+	ISNTH(h,1,j)*1 + ISNTH(h,2,j)*2 + ISNTH(h,3,j)*3 + ISNTH(h,4,j)*4 + \
+	ISNTH(h,5,j)*5 + ISNTH(h,6,j)*6 + ISNTH(h,7,j)*7 : 0x80)
+#define COMPRESS(h) { COMPRESS_BYTE(h,0), COMPRESS_BYTE(h,1), COMPRESS_BYTE(h,2), COMPRESS_BYTE(h,3), \
+	COMPRESS_BYTE(h,4), COMPRESS_BYTE(h,5), COMPRESS_BYTE(h,6), COMPRESS_BYTE(h,7) }
+
+#define ROW4(F,h) F(h), F(h+1), F(h+2), F(h+3)
+#define ROW16(F,h) ROW4(F,h), ROW4(F,h+4), ROW4(F,h+8), ROW4(F,h+12)
+#define ROW64(F,h) ROW16(F,h), ROW16(F,h+16), ROW16(F,h+32), ROW16(F,h+48)
+#define ROW256(F) ROW64(F,0), ROW64(F,64), ROW64(F,128), ROW64(F,192)
+
+static const uint8_t expand_shuffle[256][8] = { ROW256(EXPAND) };
+static const uint8_t compress_shuffle[256][8] = { ROW256(COMPRESS) };
+
+// 8 bytes of src are picked by shuffle into dst
+static inline void
+shuffle8(uint8_t *dst, const uint8_t *src, const uint8_t *shuffle) {
+#if defined(__SSSE3__)
+	__m128i v = _mm_loadl_epi64((const __m128i *)src);
+	__m128i m = _mm_loadl_epi64((const __m128i *)shuffle);
+	_mm_storel_epi64((__m128i *)dst, _mm_shuffle_epi8(v, m));
+#else
+	vst1_u8(dst, vtbl1_u8(vld1_u8(src), vld1_u8(shuffle)));
+#endif
+}
+
+#endif
+
 static int
 pack_seg(const uint8_t *src, uint8_t * buffer, int sz, int n) {
 	uint8_t header = 0;
 	int notzero = 0;
 	int i;
 	uint8_t * obuffer = buffer;
+	if (sz > 8) {
+		// Enough space for the whole segment, compact it without branches.
+		// The bytes after the last non-zero one are overwritten by the next segment.
+		header = nonzero_mask(src);
+#ifdef SPROTO_SHUFFLE
+		shuffle8(buffer + 1, src, compress_shuffle[header]);
+		notzero = BITCOUNT(header);
+#else
+		for (i=0;i<8;i++) {
+			buffer[1+notzero] = src[i];
+			notzero += (header >> i) & 1;
+		}
+#endif
+		if ((notzero == 7 || notzero == 6) && n > 0) {
+			notzero = 8;
+		}
+		if (notzero == 8) {
+			return n > 0 ? 8 : 10;
+		}
+		*buffer = header;
+		return notzero + 1;
+	}
 	++buffer;
 	--sz;
 	if (sz < 0)
@@ -1408,6 +1581,17 @@ sproto_unpack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
 			buffer += n;
 			src += n;
 			size += n;
+#ifdef SPROTO_SHUFFLE
+		} else if (srcsz >= 8 && bufsz >= 8) {
+			// Both sides have a whole segment
+			int n = BITCOUNT(header);
+			shuffle8(buffer, src, expand_shuffle[header]);
+			src += n;
+			srcsz -= n;
+			buffer += 8;
+			bufsz -= 8;
+			size += 8;
+#endif
 		} else {
 			int i;
 			for (i=0;i<8;i++) {
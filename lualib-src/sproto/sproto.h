@@ -66,5 +66,10 @@ int sproto_encode(const struct sproto_type *, void * buffer, int size, sproto_ca
 // for debug use
 void sproto_dump(struct sproto *);
 const char * sproto_name(struct sproto_type *);
+// 字段个数，用于预分配解码出的 table
+int sproto_fieldcount(const struct sproto_type *);
+// 遍历所有类型名、字段名和协议名
+typedef void (*sproto_namecb)(void *ud, const char *name);
+void sproto_names(const struct sproto *, sproto_namecb cb, void *ud);
 
 #endif
@@ -0,0 +1,885 @@
+local skynet = require "skynet"
+local core = require "skynet.http2.core"
+local internal = require "http.internal"
+
+local string = string
+local table = table
+local math = math
+local pairs = pairs
+local ipairs = ipairs
+local type = type
+local tostring = tostring
+local tonumber = tonumber
+local pcall = pcall
+local error = error
+local setmetatable = setmetatable
+local coroutine = coroutine
+
+--[[
+	HTTP/2 (RFC 7540) over an interface { read, write }, plain or tls.
+
+	http2.serve(interface, handler, bodylimit)
+		serves the streams of one connection, each request runs handler in its
+		own coroutine. handler is the same as httpd.serve.
+	http2.connect(interface, authority, scheme)
+		returns a connection, conn:request(...) can be called by many coroutines
+		at the same time, the requests are multiplexed as streams.
+
+	Frames and HPACK are in skynet.http2.core.
+]]
+
+local http2 = {}
+
+local PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+-- frame types
+local DATA = 0x0
+local HEADERS = 0x1
+local PRIORITY = 0x2
+local RST_STREAM = 0x3
+local SETTINGS = 0x4
+local PUSH_PROMISE = 0x5
+local PING = 0x6
+local GOAWAY = 0x7
+local WINDOW_UPDATE = 0x8
+local CONTINUATION = 0x9
+
+-- flags
+local END_STREAM = 0x1
+local ACK = 0x1
+local END_HEADERS = 0x4
+local PADDED = 0x8
+local PRIORITY_FLAG = 0x20
+
+-- settings
+local SETTINGS_HEADER_TABLE_SIZE = 0x1
+local SETTINGS_ENABLE_PUSH = 0x2
+local SETTINGS_MAX_CONCURRENT_STREAMS = 0x3
+local SETTINGS_INITIAL_WINDOW_SIZE = 0x4
+local SETTINGS_MAX_FRAME_SIZE = 0x5
+
+-- error codes
+local NO_ERROR = 0x0
+local PROTOCOL_ERROR = 0x1
+local FLOW_CONTROL_ERROR = 0x3
+local FRAME_SIZE_ERROR = 0x6
+local REFUSED_STREAM = 0x7
+local CANCEL = 0x8
+local COMPRESSION_ERROR = 0x9
+
+local DEFAULT_WINDOW = 65535
+local MAX_WINDOW = 0x7fffffff
+local DEFAULT_FRAME = 16384
+local RECV_WINDOW = 1024 * 1024	-- our window of the connection and each stream
+local MAX_STREAMS = 128
+local HEADER_BLOCK_LIMIT = 256 * 1024
+
+-- connection-specific fields are not allowed in http/2
+local hop_by_hop = {
+	connection = true,
+	["keep-alive"] = true,
+	["proxy-connection"] = true,
+	["transfer-encoding"] = true,
+	upgrade = true,
+	host = true,
+	["content-length"] = true,
+}
+
+local conn = {}
+conn.__index = conn
+
+local function new_conn(interface, reader, server, bodylimit, stream)
+	return setmetatable({
+		_write = interface.write,
+		_reader = reader or internal.reader(interface.read),
+		_server = server,
+		_encoder = core.encoder(),
+		_decoder = core.decoder(),
+		_streams = {},
+		_next_id = server and 2 or 1,
+		_last_id = 0,	-- the last stream opened by the peer
+		_active = 0,
+		_send_window = DEFAULT_WINDOW,
+		_recv_consumed = 0,
+		_window_waiting = {},
+		_stream_waiting = {},
+		_peer_window = DEFAULT_WINDOW,	-- initial send window of the streams
+		_peer_frame = DEFAULT_FRAME,
+		_peer_streams = 100,	-- until the SETTINGS of the peer
+		_bodylimit = bodylimit,
+		_stream = stream,
+		closed = false,
+		goaway = false,
+	}, conn)
+end
+
+-- a connection error, the connection is closed with GOAWAY
+local function fail(self, code, msg)
+	self._error_code = code
+	error(msg)
+end
+
+local function wakeup(s)
+	local co = s.co
+	if co then
+		s.co = nil
+		skynet.wakeup(co)
+	end
+end
+
+local function wakeup_all(list)
+	for _, co in ipairs(list) do
+		skynet.wakeup(co)
+	end
+end
+
+local function wait(list)
+	local co = coroutine.running()
+	list[#list+1] = co
+	skynet.wait(co)
+end
+
+function conn:_send(data)
+	if self.closed then
+		error "http2 connection closed"
+	end
+	self._write(data)
+end
+
+function conn:_wakeup_window()
+	local list = self._window_waiting
+	if list[1] then
+		self._window_waiting = {}
+		wakeup_all(list)
+	end
+end
+
+function conn:_start()
+	local settings = string.pack(">I2I4I2I4I2I4",
+		SETTINGS_MAX_CONCURRENT_STREAMS, MAX_STREAMS,
+		SETTINGS_INITIAL_WINDOW_SIZE, RECV_WINDOW,
+		SETTINGS_ENABLE_PUSH, 0)
+	local data = core.pack(SETTINGS, 0, 0, settings)
+		.. core.pack(WINDOW_UPDATE, 0, 0, string.pack(">I4", RECV_WINDOW - DEFAULT_WINDOW))
+	if not self._server then
+		data = PREFACE .. data
+	end
+	self._write(data)
+end
+
+function conn:_open(id)
+	local s = { id = id, send_window = self._peer_window, body = {}, size = 0, consumed = 0 }
+	self._streams[id] = s
+	self._active = self._active + 1
+	return s
+end
+
+function conn:_close_stream(s)
+	if self._streams[s.id] == s then
+		self._streams[s.id] = nil
+		self._active = self._active - 1
+		local co = table.remove(self._stream_waiting, 1)
+		if co then
+			skynet.wakeup(co)
+		end
+	end
+end
+
+function conn:_reset(s, code)
+	s.reset = true
+	s.done = true
+	self:_close_stream(s)
+	pcall(self._send, self, core.pack(RST_STREAM, 0, s.id, string.pack(">I4", code)))
+	wakeup(s)
+	self:_wakeup_window()
+end
+
+-- HEADERS and CONTINUATION in one write, the header block can't be interleaved
+function conn:_headers(id, list, endstream)
+	local block = self._encoder:encode(list)
+	local max = self._peer_frame
+	local flags = endstream and END_STREAM or 0
+	local n = #block
+	if n <= max then
+		self:_send(core.pack(HEADERS, flags | END_HEADERS, id, block))
+		return
+	end
+	local out = { core.pack(HEADERS, flags, id, block:sub(1, max)) }
+	local pos = max + 1
+	while pos <= n do
+		local e = pos + max - 1
+		out[#out+1] = core.pack(CONTINUATION, e >= n and END_HEADERS or 0, id, block:sub(pos, e))
+		pos = e + 1
+	end
+	self:_send(table.concat(out))
+end
+
+-- send DATA frames within the flow control windows, wait for WINDOW_UPDATE if they are used up
+function conn:_data(s, data, endstream)
+	local n = #data
+	local pos = 1
+	while true do
+		if s.reset or self.closed then
+			error(string.format("http2 stream %d closed", s.id))
+		end
+		local remain = n - pos + 1
+		local len = math.min(remain, self._send_window, s.send_window, self._peer_frame)
+		if len > 0 or remain == 0 then
+			local last = len == remain
+			local chunk = (pos == 1 and last) and data or data:sub(pos, pos + len - 1)
+			self:_send(core.pack(DATA, (endstream and last) and END_STREAM or 0, s.id, chunk))
+			self._send_window = self._send_window - len
+			s.send_window = s.send_window - len
+			pos = pos + len
+			if last then
+				return
+			end
+		else
+			wait(self._window_waiting)
+		end
+	end
+end
+
+local function strip_padding(self, payload)
+	local padding = payload:byte(1)
+	if not padding or padding >= #payload then
+		fail(self, PROTOCOL_ERROR, "invalid http2 padding")
+	end
+	return payload:sub(2, #payload - padding)
+end
+
+-- give the window back when half of it is consumed
+function conn:_consume_stream(s, len)
+	local consumed = s.consumed + len
+	if consumed >= RECV_WINDOW // 2 then
+		self:_send(core.pack(WINDOW_UPDATE, 0, s.id, string.pack(">I4", consumed)))
+		consumed = 0
+	end
+	s.consumed = consumed
+end
+
+function conn:_consume(s, len)
+	local consumed = self._recv_consumed + len
+	if consumed >= RECV_WINDOW // 2 then
+		self:_send(core.pack(WINDOW_UPDATE, 0, 0, string.pack(">I4", consumed)))
+		consumed = 0
+	end
+	self._recv_consumed = consumed
+	if s then
+		self:_consume_stream(s, len)
+	end
+end
+
+local function split_pseudo(header)
+	local pseudo = {}
+	for k, v in pairs(header) do
+		if k:byte(1) == 58 then	-- ':'
+			pseudo[k] = v
+		end
+	end
+	for k in pairs(pseudo) do
+		header[k] = nil
+	end
+	-- cookie may be split into fields
+	if type(header.cookie) == "table" then
+		header.cookie = table.concat(header.cookie, "; ")
+	end
+	return pseudo
+end
+
+function conn:_remote_end(s)
+	s.remote_end = true
+	if self._server then
+		if s.stream then
+			wakeup(s)
+		elseif not s.reset then
+			self:_serve_stream(s)
+		end
+	else
+		s.done = true
+		wakeup(s)
+	end
+	if s.local_end then
+		self:_close_stream(s)
+	end
+end
+
+function conn:_headers_received(id, flags, block)
+	local ok, header = pcall(self._decoder.decode, self._decoder, block, {})
+	if not ok then
+		fail(self, COMPRESSION_ERROR, header)
+	end
+	local s = self._streams[id]
+	if s == nil then
+		if not self._server or id % 2 == 0 or id <= self._last_id then
+			-- trailers of a reset stream
+			return
+		end
+		self._last_id = id
+		if self.goaway or self._active >= MAX_STREAMS then
+			self:_send(core.pack(RST_STREAM, 0, id, string.pack(">I4", REFUSED_STREAM)))
+			return
+		end
+		s = self:_open(id)
+		s.header = header
+		if self._stream then
+			-- the handler reads the body as it comes
+			s.stream = true
+			s.head, s.tail = 1, 0	-- the queue of the payloads not read
+			self:_serve_stream(s)
+		end
+	elseif s.header == nil then
+		local status = tonumber(header[":status"])
+		if status and status >= 100 and status < 200 and status ~= 101 then
+			-- interim response
+			return
+		end
+		s.header = header
+	else
+		-- trailers
+		for k, v in pairs(header) do
+			s.header[k] = v
+		end
+	end
+	if flags & END_STREAM ~= 0 then
+		self:_remote_end(s)
+	end
+end
+
+local frame = {}
+
+frame[DATA] = function(self, flags, id, payload)
+	if id == 0 then
+		fail(self, PROTOCOL_ERROR, "http2 DATA on stream 0")
+	end
+	local len = #payload
+	if flags & PADDED ~= 0 then
+		payload = strip_padding(self, payload)
+	end
+	local s = self._streams[id]
+	if s == nil or s.remote_end or s.header == nil then
+		-- the stream is closed or reset by us, count the connection window only
+		self:_consume(nil, len)
+		return
+	end
+	local ended = flags & END_STREAM ~= 0
+	if s.stream then
+		-- the window of the stream is given back when the handler reads the payload
+		self:_consume(nil, len)
+		if not ended and len > #payload then
+			self:_consume_stream(s, len - #payload)
+		end
+	else
+		self:_consume(not ended and s or nil, len)
+	end
+	if #payload > 0 then
+		s.size = s.size + #payload
+		if self._bodylimit and s.size > self._bodylimit then
+			s.toolarge = true
+		elseif s.stream then
+			local tail = s.tail + 1
+			s.body[tail] = payload
+			s.tail = tail
+		else
+			s.body[#s.body+1] = payload
+		end
+		if s.stream then
+			wakeup(s)
+		end
+	end
+	if ended then
+		self:_remote_end(s)
+	end
+end
+
+frame[HEADERS] = function(self, flags, id, payload)
+	if id == 0 then
+		fail(self, PROTOCOL_ERROR, "http2 HEADERS on stream 0")
+	end
+	if flags & PADDED ~= 0 then
+		payload = strip_padding(self, payload)
+	end
+	if flags & PRIORITY_FLAG ~= 0 then
+		if #payload < 5 then
+			fail(self, FRAME_SIZE_ERROR, "invalid http2 HEADERS")
+		end
+		payload = payload:sub(6)
+	end
+	if flags & END_HEADERS == 0 then
+		self._continuation = { id = id, flags = flags, parts = { payload }, size = #payload }
+		return
+	end
+	self:_headers_received(id, flags, payload)
+end
+
+frame[CONTINUATION] = function(self, flags, id, payload)
+	local c = self._continuation
+	if c == nil or c.id ~= id then
+		fail(self, PROTOCOL_ERROR, "unexpected http2 CONTINUATION")
+	end
+	c.size = c.size + #payload
+	if c.size > HEADER_BLOCK_LIMIT then
+		fail(self, PROTOCOL_ERROR, "http2 header block too large")
+	end
+	c.parts[#c.parts+1] = payload
+	if flags & END_HEADERS ~= 0 then
+		self._continuation = nil
+		self:_headers_received(id, c.flags, table.concat(c.parts))
+	end
+end
+
+frame[PRIORITY] = function() end
+
+frame[RST_STREAM] = function(self, flags, id, payload)
+	local s = self._streams[id]
+	if s then
+		local code = string.unpack(">I4", payload)
+		s.reset = true
+		s.done = true
+		-- the server may stop the upload after the whole response
+		if not (code == NO_ERROR and s.remote_end and not self._server) then
+			s.err = string.format("http2 stream %d reset by peer, error %d", id, code)
+		end
+		self:_close_stream(s)
+		wakeup(s)
+		self:_wakeup_window()
+	end
+end
+
+frame[SETTINGS] = function(self, flags, id, payload)
+	if id ~= 0 then
+		fail(self, PROTOCOL_ERROR, "http2 SETTINGS on a stream")
+	end
+	if flags & ACK ~= 0 then
+		return
+	end
+	if #payload % 6 ~= 0 then
+		fail(self, FRAME_SIZE_ERROR, "invalid http2 SETTINGS")
+	end
+	for i = 1, #payload, 6 do
+		local k, v = string.unpack(">I2I4", payload, i)
+		if k == SETTINGS_HEADER_TABLE_SIZE then
+			self._encoder:resize(v)
+		elseif k == SETTINGS_INITIAL_WINDOW_SIZE then
+			if v > MAX_WINDOW then
+				fail(self, FLOW_CONTROL_ERROR, "invalid http2 initial window")
+			end
+			local delta = v - self._peer_window
+			self._peer_window = v
+			for _, s in pairs(self._streams) do
+				s.send_window = s.send_window + delta
+			end
+		elseif k == SETTINGS_MAX_FRAME_SIZE then
+			if v < DEFAULT_FRAME or v > 16777215 then
+				fail(self, PROTOCOL_ERROR, "invalid http2 max frame size")
+			end
+			self._peer_frame = v
+		elseif k == SETTINGS_MAX_CONCURRENT_STREAMS then
+			self._peer_streams = v
+		end
+	end
+	self:_send(core.pack(SETTINGS, ACK, 0))
+	self:_wakeup_window()
+	local list = self._stream_waiting
+	self._stream_waiting = {}
+	wakeup_all(list)
+end
+
+frame[PUSH_PROMISE] = function(self)
+	-- we set SETTINGS_ENABLE_PUSH to 0
+	fail(self, PROTOCOL_ERROR, "http2 PUSH_PROMISE is disabled")
+end
+
+frame[PING] = function(self, flags, id, payload)
+	if #payload ~= 8 then
+		fail(self, FRAME_SIZE_ERROR, "invalid http2 PING")
+	end
+	if flags & ACK == 0 then
+		self:_send(core.pack(PING, ACK, 0, payload))
+	end
+end
+
+frame[GOAWAY] = function(self, flags, id, payload)
+	local last = string.unpack(">I4", payload) & 0x7fffffff
+	self.goaway = true
+	-- the streams after last are not processed, and can be retried
+	for sid, s in pairs(self._streams) do
+		if sid > last and (sid % 2 == 0) == self._server then
+			s.done = true
+			s.err = "http2 connection goaway"
+			self:_close_stream(s)
+			wakeup(s)
+		end
+	end
+	self:_wakeup_window()
+	local list = self._stream_waiting
+	self._stream_waiting = {}
+	wakeup_all(list)
+end
+
+frame[WINDOW_UPDATE] = function(self, flags, id, payload)
+	if #payload ~= 4 then
+		fail(self, FRAME_SIZE_ERROR, "invalid http2 WINDOW_UPDATE")
+	end
+	local inc = string.unpack(">I4", payload) & 0x7fffffff
+	if id == 0 then
+		if inc == 0 or self._send_window + inc > MAX_WINDOW then
+			fail(self, FLOW_CONTROL_ERROR, "invalid http2 WINDOW_UPDATE")
+		end
+		self._send_window = self._send_window + inc
+	else
+		local s = self._streams[id]
+		if s then
+			s.send_window = s.send_window + inc
+		end
+	end
+	self:_wakeup_window()
+end
+
+function conn:_dispatch()
+	local t, flags, id, payload = self._reader:head(core.frame)
+	if not t then
+		fail(self, FRAME_SIZE_ERROR, "http2 frame too large")
+	end
+	if self._continuation and t ~= CONTINUATION then
+		fail(self, PROTOCOL_ERROR, "http2 header block is interrupted")
+	end
+	local f = frame[t]
+	if f then
+		f(self, flags, id, payload)
+	end
+end
+
+function conn:_loop()
+	local ok, err = pcall(function()
+		while true do
+			self:_dispatch()
+		end
+	end)
+	if self._error_code then
+		pcall(self._send, self, core.pack(GOAWAY, 0, 0, string.pack(">I4I4", self._last_id, self._error_code)))
+	end
+	self.closed = true
+	for _, s in pairs(self._streams) do
+		s.done = true
+		s.err = s.err or tostring(err)
+		wakeup(s)
+	end
+	self._streams = {}
+	self._active = 0
+	self:_wakeup_window()
+	local list = self._stream_waiting
+	self._stream_waiting = {}
+	wakeup_all(list)
+	return err
+end
+
+local function header_list(list, header)
+	if header then
+		for k, v in pairs(header) do
+			k = k:lower()
+			if not hop_by_hop[k] then
+				if type(v) == "table" then
+					for _, v in ipairs(v) do
+						list[#list+1] = k
+						list[#list+1] = tostring(v)
+					end
+				else
+					list[#list+1] = k
+					list[#list+1] = tostring(v)
+				end
+			end
+		end
+	end
+	return list
+end
+
+function conn:_respond(s, statuscode, bodyfunc, header)
+	local t = type(bodyfunc)
+	if t == "table" and bodyfunc.cached then
+		-- a cached response of httpd.cache
+		local c = bodyfunc.cached
+		return self:_respond(s, c.status, c.body, c.header)
+	end
+	local list = header_list({ ":status", tostring(statuscode) }, header)
+	if t == "table" then
+		-- a file of httpd.static
+		list[#list+1] = "content-length"
+		list[#list+1] = tostring(bodyfunc.size)
+		local empty = bodyfunc.head or bodyfunc.size == 0
+		self:_headers(s.id, list, empty)
+		if not empty then
+			local chunks = internal.filechunks(bodyfunc)
+			local chunk = chunks()
+			while chunk do
+				local nextchunk = chunks()
+				self:_data(s, chunk, nextchunk == nil)
+				chunk = nextchunk
+			end
+		end
+	elseif t == "string" then
+		list[#list+1] = "content-length"
+		list[#list+1] = tostring(#bodyfunc)
+		self:_headers(s.id, list, bodyfunc == "")
+		if bodyfunc ~= "" then
+			self:_data(s, bodyfunc, true)
+		end
+	elseif t == "function" then
+		self:_headers(s.id, list, false)
+		while true do
+			local chunk = bodyfunc()
+			if chunk == nil then
+				self:_data(s, "", true)
+				break
+			elseif chunk ~= "" then
+				self:_data(s, chunk, false)
+			end
+		end
+	else
+		self:_headers(s.id, list, true)
+	end
+	s.local_end = true
+	if s.remote_end then
+		self:_close_stream(s)
+	elseif not s.done then
+		-- the handler didn't read all of the body, stop the client
+		self:_reset(s, NO_ERROR)
+	end
+end
+
+-- the request body in stream mode, the same methods as the body of http.internal
+local body = {}
+body.__index = body
+
+function body:__call()
+	return self:read()
+end
+
+function body:read()
+	if self.failed then
+		error(self.failed)
+	end
+	local s = self._s
+	while true do
+		if s.toolarge then
+			self.finished = true
+			self.failed = "Body too large"
+			error(self.failed)
+		end
+		local head = s.head
+		local piece = s.body[head]
+		if piece then
+			s.body[head] = nil
+			s.head = head + 1
+			self.size = self.size + #piece
+			if not s.remote_end and not s.done then
+				self._conn:_consume_stream(s, #piece)
+			end
+			return piece
+		end
+		if s.remote_end then
+			self.finished = true
+			return
+		end
+		if s.done then
+			self.finished = true
+			self.failed = s.err or "Invalid body"
+			error(self.failed)
+		end
+		s.co = coroutine.running()
+		skynet.wait(s.co)
+	end
+end
+
+function body:readall()
+	local result = {}
+	for piece in self do
+		result[#result+1] = piece
+	end
+	return table.concat(result)
+end
+
+function body:drain()
+	return self.finished and not self.failed
+end
+
+function conn:_serve_stream(s)
+	local header = s.header
+	local pseudo = split_pseudo(header)
+	if pseudo[":authority"] and header.host == nil then
+		header.host = pseudo[":authority"]
+	end
+	local method, url = pseudo[":method"], pseudo[":path"]
+	local content
+	local toolarge = s.toolarge
+	if s.stream then
+		content = setmetatable({ _s = s, _conn = self, size = 0, finished = false }, body)
+		local length = tonumber(header["content-length"])
+		toolarge = self._bodylimit and length and length > self._bodylimit
+	else
+		content = table.concat(s.body)
+		s.body = nil
+	end
+	local handler = self._handler
+	skynet.fork(function()
+		local ok, statuscode, bodyfunc, rheader
+		if not method or not url then
+			ok, statuscode = true, 400
+		elseif toolarge then
+			ok, statuscode = true, 413
+		else
+			ok, statuscode, bodyfunc, rheader = pcall(handler, url, method, header, content)
+			if not ok then
+				if s.stream and content.failed then
+					statuscode = content.failed == "Body too large" and 413 or 400
+				else
+					skynet.error(string.format("http2 stream %d: %s", s.id, statuscode))
+					statuscode = 500
+				end
+				bodyfunc, rheader = nil, nil
+			end
+		end
+		local ok, err = pcall(self._respond, self, s, statuscode, bodyfunc, rheader)
+		if not ok and not s.reset and not self.closed then
+			skynet.error(string.format("http2 stream %d: %s", s.id, err))
+			self:_reset(s, CANCEL)
+		end
+	end)
+end
+
+--[[
+	reader : the buffered reader of httpd which has read the request line of
+	the preface (with prior knowledge), or nil when the connection starts
+	with the preface (after tls ALPN "h2").
+
+	stream : true to pass the body to the handler as an iterator, like
+	httpd.serve. The handler of each stream starts when the header arrives,
+	and the flow control window of the stream is given back as it reads.
+
+	return true when the client closed the connection, or false, err
+]]
+function http2.serve(interface, handler, bodylimit, reader, stream)
+	local self = new_conn(interface, reader, true, bodylimit, stream)
+	self._handler = handler
+	local ok, preface = pcall(function()
+		local r = self._reader
+		if reader then
+			return "PRI * HTTP/2.0\r\n\r\n" .. r:read(6)
+		else
+			return r:read(#PREFACE)
+		end
+	end)
+	if not ok then
+		return false, preface
+	end
+	if preface ~= PREFACE then
+		return false, "invalid http2 preface"
+	end
+	ok = pcall(self._start, self)
+	if not ok then
+		return false, "http2 connection closed"
+	end
+	local err = self:_loop()
+	if self._error_code and self._error_code ~= NO_ERROR then
+		return false, err
+	end
+	return true
+end
+
+-- authority is the host[:port] of the server, scheme is "https" or "http"
+function http2.connect(interface, authority, scheme)
+	local self = new_conn(interface, nil, false)
+	self._authority = authority
+	self._scheme = scheme or "https"
+	self:_start()
+	skynet.fork(self._loop, self)
+	return self
+end
+
+-- how many requests can be in flight
+function conn:capacity()
+	if self.closed or self.goaway then
+		return 0
+	end
+	return self._peer_streams
+end
+
+--[[
+	return statuscode, body, header
+
+	timeout (in 1/100s) cancels this stream only. recvheader is filled with the
+	response header like httpc.request.
+]]
+function conn:request(method, url, header, content, timeout)
+	while not self.closed and not self.goaway and self._active >= self._peer_streams do
+		wait(self._stream_waiting)
+	end
+	if self.closed or self.goaway then
+		error "http2 connection closed"
+	end
+	local id = self._next_id
+	self._next_id = id + 2
+	local s = self:_open(id)
+	local list = { ":method", method, ":scheme", self._scheme, ":authority", self._authority, ":path", url }
+	if header then
+		for k, v in pairs(header) do
+			if k:lower() == "host" then
+				list[6] = v
+			end
+		end
+	end
+	header_list(list, header)
+	local nobody = content == nil or content == ""
+	local iterator = not nobody and type(content) ~= "string"
+	if not nobody and not iterator then
+		list[#list+1] = "content-length"
+		list[#list+1] = tostring(#content)
+	end
+	if timeout then
+		skynet.timeout(timeout, function()
+			if not s.done then
+				s.err = "http2 request timeout"
+				self:_reset(s, CANCEL)
+			end
+		end)
+	end
+	local ok, err = pcall(function()
+		self:_headers(id, list, nobody)
+		if iterator then
+			for piece in content do
+				self:_data(s, piece, false)
+			end
+			self:_data(s, "", true)
+		elseif not nobody then
+			self:_data(s, content, true)
+		end
+	end)
+	if not ok then
+		if not s.done then
+			s.err = err
+			self:_reset(s, CANCEL)
+		end
+	end
+	s.local_end = true
+	if s.remote_end then
+		self:_close_stream(s)
+	end
+	if not s.done then
+		s.co = coroutine.running()
+		skynet.wait(s.co)
+	end
+	if s.err then
+		error(s.err)
+	end
+	local rheader = s.header
+	local pseudo = split_pseudo(rheader)
+	return tonumber(pseudo[":status"]), table.concat(s.body), rheader
+end
+
+function conn:close()
+	if not self.closed then
+		pcall(self._send, self, core.pack(GOAWAY, 0, 0, string.pack(">I4I4", self._last_id, NO_ERROR)))
+	end
+end
+
+return http2
@@ -1,13 +1,19 @@
 local skynet = require "skynet"
 local socket = require "http.sockethelper"
 local internal = require "http.internal"
+local http2 = require "http.http2"
+local core = require "skynet.http.core"
 local dns = require "skynet.dns"
+local skynet_socket = require "skynet.socket"
 
 local string = string
 local table = table
 local pcall = pcall
 local error = error
 local pairs = pairs
+local ipairs = ipairs
+local tonumber = tonumber
+local coroutine = coroutine
 
 local httpc = {}
 
@@ -38,7 +44,7 @@ local function check_protocol(host)
 end
 
 local SSLCTX_CLIENT = nil
-local function gen_interface(protocol, fd, hostname)
+local function gen_interface(protocol, fd, hostname, alpn)
 	if protocol == "http" then
 		return {
 			init = nil,
@@ -53,19 +59,25 @@ local function gen_interface(protocol, fd, hostname)
 		local tls = require "http.tlshelper"
 		SSLCTX_CLIENT = SSLCTX_CLIENT or tls.newctx()
 		local tls_ctx = tls.newtls("client", SSLCTX_CLIENT, hostname)
+		if alpn then
+			tls_ctx:set_alpn(alpn)
+		end
 		return {
 			init = tls.init_requestfunc(fd, tls_ctx),
 			close = tls.closefunc(tls_ctx),
 			read = tls.readfunc(fd, tls_ctx),
 			write = tls.writefunc(fd, tls_ctx),
 			readall = tls.readallfunc(fd, tls_ctx),
+			alpn = function()
+				return tls_ctx:alpn()
+			end,
 		}
 	else
 		error(string.format("Invalid protocol: %s", protocol))
 	end
 end
 
-local function connect(host, timeout)
+local function connect(host, timeout, alpn)
 	local protocol
 	protocol, host = check_protocol(host)
 	local hostaddr, port = host:match"([^:]+):?(%d*)$"
@@ -86,7 +98,7 @@ local function connect(host, timeout)
 		error(string.format("%s connect error host:%s, port:%s, timeout:%s", protocol, hostaddr, port, timeout))
 	end
 	-- print("protocol hostname port", protocol, hostname, port)
-	local interface = gen_interface(protocol, fd, hostname)
+	local interface = gen_interface(protocol, fd, hostname, alpn)
 	if timeout then
 		skynet.timeout(timeout, function()
 			if not interface.finish then
@@ -97,7 +109,7 @@ local function connect(host, timeout)
 	if interface.init then
 		interface.init(host)
 	end
-	return fd, interface, host
+	return fd, interface, host, protocol
 end
 
 local function close_interface(interface, fd)
@@ -109,7 +121,328 @@ local function close_interface(interface, fd)
 	end
 end
 
+--[[
+	Keep-alive connections, shared by all the coroutines of this service.
+
+	httpc.pool {
+		max = 8,	-- connections to one host
+		pipeline = 1,	-- requests in flight on one connection, > 1 to pipeline them
+		idle = 6000,	-- close the connections idle for longer, in 1/100s
+		http2 = nil,	-- true to negotiate h2 by tls ALPN, "h2c" for plain http/2 with prior knowledge
+	}
+
+	Then httpc.request (get, post) and httpc.head reuse the connections of the
+	host, and the requests over max * pipeline of one host wait for a free slot.
+	An http/2 connection takes all the requests of the host up to the
+	concurrent streams the server allows.
+	httpc.pool(nil) turns it off. httpc.request_stream always uses its own connection.
+]]
+
+local pool_conf
+local pools = {}
+
+-- safe to send again when a reused connection was closed by the server
+local idempotent = { GET = true, HEAD = true, PUT = true, DELETE = true, OPTIONS = true, TRACE = true }
+
+local function close_conn(c)
+	if not c.broken then
+		c.broken = true
+		close_interface(c.interface, c.fd)
+	end
+	-- the pipelined requests see c.broken
+	local queue = c.queue
+	c.queue = {}
+	for _, co in ipairs(queue) do
+		skynet.wakeup(co)
+	end
+end
+
+local function remove_conn(p, c)
+	local conns = p.conns
+	for i = 1, #conns do
+		if conns[i] == c then
+			table.remove(conns, i)
+			return
+		end
+	end
+end
+
+local function wakeup_waiting(p)
+	local co = table.remove(p.waiting, 1)
+	if co then
+		skynet.wakeup(co)
+	end
+end
+
+local H2_ALPN = { "h2", "http/1.1" }
+
+local function new_conn(hostname, conf)
+	local fd, interface, host, protocol = connect(hostname, httpc.timeout, conf.http2 == true and H2_ALPN or nil)
+	-- the connect timeout is over, each request sets its own
+	interface.finish = true
+	local h2
+	if (interface.alpn and interface.alpn() == "h2") or (protocol == "http" and conf.http2 == "h2c") then
+		h2 = http2.connect(interface, host, protocol)
+	end
+	return {
+		h2 = h2,
+		fd = fd,
+		interface = interface,
+		host = host,
+		reader = internal.reader(interface.read),
+		n = 0,	-- requests in flight
+		requests = 0,
+		last = skynet.now(),
+		queue = {},	-- the pipelined requests waiting to read their response
+		reading = false,
+	}
+end
+
+local function sweep(p, conf)
+	local now = skynet.now()
+	local conns = p.conns
+	for i = #conns, 1, -1 do
+		local c = conns[i]
+		if c.n == 0 and (c.broken or skynet_socket.disconnected(c.fd) or now - c.last >= conf.idle
+			or (c.h2 and c.h2:capacity() == 0)) then
+			table.remove(conns, i)
+			close_conn(c)
+		end
+	end
+end
+
+local function sweep_later(p, conf)
+	if p.sweeping then
+		return
+	end
+	p.sweeping = true
+	skynet.timeout(conf.idle, function()
+		p.sweeping = false
+		sweep(p, conf)
+		if p.conns[1] then
+			sweep_later(p, conf)
+		end
+	end)
+end
+
+local function capacity(c, conf)
+	if c.h2 then
+		return c.h2:capacity()
+	end
+	return conf.pipeline
+end
+
+local function acquire(p, conf)
+	while true do
+		sweep(p, conf)
+		-- an http/2 connection with free streams, or the least loaded one
+		local best
+		for _, c in ipairs(p.conns) do
+			if not c.broken then
+				if c.h2 and c.n < capacity(c, conf) then
+					best = c
+					break
+				elseif best == nil or c.n < best.n then
+					best = c
+				end
+			end
+		end
+		if best == nil or (best.n > 0 and not best.h2) then
+			if conf.http2 and p.connecting > 0 then
+				-- the connection being opened may multiplex, wait for it
+				best = nil
+			elseif #p.conns + p.connecting < conf.max then
+				p.connecting = p.connecting + 1
+				local ok, c = pcall(new_conn, p.hostname, conf)
+				p.connecting = p.connecting - 1
+				if not ok then
+					wakeup_waiting(p)
+					error(c)
+				end
+				table.insert(p.conns, c)
+				best = c
+			elseif best and best.n >= capacity(best, conf) then
+				best = nil
+			end
+		end
+		if best then
+			best.n = best.n + 1
+			if best.h2 and best.n < capacity(best, conf) then
+				-- more streams left for the next waiting request
+				wakeup_waiting(p)
+			end
+			return best
+		end
+		local co = coroutine.running()
+		table.insert(p.waiting, co)
+		skynet.wait(co)
+	end
+end
+
+local function release(p, c, keep, conf)
+	c.n = c.n - 1
+	c.requests = c.requests + 1
+	c.last = skynet.now()
+	if not keep then
+		close_conn(c)
+	end
+	if c.broken then
+		if c.n == 0 then
+			remove_conn(p, c)
+		end
+	elseif c.n == 0 then
+		sweep_later(p, conf)
+	end
+	wakeup_waiting(p)
+end
+
+local function read_response(c, method, recvheader)
+	local r = c.reader
+	local code, httpver, header
+	repeat
+		code, httpver, header = r:head(core.response)
+		if not code then
+			error("Invalid HTTP response header")
+		end
+		-- skip the interim responses, such as 100 Continue
+	until code >= 200 or code == 101
+	local keep = code ~= 101 and internal.keepalive(httpver, header)
+	local body
+	local mode = header["transfer-encoding"]
+	if method == "HEAD" or code == 204 or code == 304 or code < 200 then
+		body = ""
+	elseif mode == "chunked" then
+		body, header = internal.readchunked(r, nil, header)
+		if not body then
+			error("Invalid response body")
+		end
+	elseif mode and mode ~= "identity" then
+		error ("Unsupport transfer-encoding")
+	else
+		local length = header["content-length"]
+		if length then
+			length = tonumber(length)
+			if not length then
+				error("Invalid content-length")
+			end
+			body = length > 0 and r:read(length) or ""
+		else
+			-- no content-length, read all
+			body = r:rest() .. (c.interface.readall() or "")
+			keep = false
+		end
+	end
+	if recvheader then
+		for k,v in pairs(header) do
+			recvheader[k] = v
+		end
+	end
+	return code, body, keep
+end
+
+local function conn_request(c, timeout, method, url, recvheader, header, content)
+	if c.h2 then
+		local code, body, rheader = c.h2:request(method, url, header, content, timeout)
+		if recvheader then
+			for k,v in pairs(rheader) do
+				recvheader[k] = v
+			end
+		end
+		return code, body, true
+	end
+	local done
+	if timeout then
+		skynet.timeout(timeout, function()
+			if not done and not c.broken then
+				socket.shutdown(c.fd)
+			end
+		end)
+	end
+	local ok, err = pcall(internal.write_request, c.interface.write, method, c.host, url, header, content)
+	if not ok then
+		done = true
+		close_conn(c)
+		error(err)
+	end
+	-- the responses come in the order of the requests
+	if c.reading then
+		local co = coroutine.running()
+		table.insert(c.queue, co)
+		skynet.wait(co)
+	else
+		c.reading = true
+	end
+	if c.broken then
+		done = true
+		error(string.format("connection to %s closed", c.host))
+	end
+	local ok, code, body, keep = pcall(read_response, c, method, recvheader)
+	done = true
+	if not ok then
+		close_conn(c)
+		error(code)
+	end
+	local co = table.remove(c.queue, 1)
+	if co then
+		skynet.wakeup(co)
+	else
+		c.reading = false
+	end
+	return code, body, keep
+end
+
+local function pooled_request(conf, method, hostname, url, recvheader, header, content)
+	local p = pools[hostname]
+	if p == nil then
+		p = { hostname = hostname, conns = {}, connecting = 0, waiting = {} }
+		pools[hostname] = p
+	end
+	-- an iterator of the body can't be read twice
+	local retry = idempotent[method] and (content == nil or type(content) == "string")
+	while true do
+		local c = acquire(p, conf)
+		local reused = c.requests > 0 and c.n == 1
+		local ok, code, body, keep = pcall(conn_request, c, httpc.timeout, method, url, recvheader, header, content)
+		-- a failed stream doesn't break the http/2 connection
+		release(p, c, (ok and keep) or (c.h2 and not c.h2.closed), conf)
+		if ok then
+			return code, body
+		end
+		if not (retry and reused) then
+			error(code)
+		end
+		retry = false
+	end
+end
+
+function httpc.pool(conf)
+	if conf then
+		pool_conf = {
+			max = conf.max or 8,
+			pipeline = conf.pipeline or 1,
+			idle = conf.idle or 6000,
+			http2 = conf.http2,
+		}
+	else
+		pool_conf = nil
+		for _, p in pairs(pools) do
+			for _, c in ipairs(p.conns) do
+				if c.n == 0 then
+					close_conn(c)
+				end
+			end
+		end
+		pools = {}
+	end
+end
+
+-- content can be an iterator (a function, or the body of httpd in stream mode)
+-- returning the pieces and nil at the end, to upload without keeping it in memory.
+-- It's sent chunked, or as it is when header has content-length.
 function httpc.request(method, hostname, url, recvheader, header, content)
+	if pool_conf then
+		return pooled_request(pool_conf, method, hostname, url, recvheader, header, content)
+	end
 	local fd, interface, host = connect(hostname, httpc.timeout)
 	local ok , statuscode, body , header = pcall(internal.request, interface, method, host, url, recvheader, header, content)
 	if ok then
@@ -124,6 +457,9 @@ function httpc.request(method, hostname, url, recvheader, header, content)
 end
 
 function httpc.head(hostname, url, recvheader, header, content)
+	if pool_conf then
+		return (pooled_request(pool_conf, "HEAD", hostname, url, recvheader, header, content))
+	end
 	local fd, interface, host = connect(hostname, httpc.timeout)
 	local ok , statuscode = pcall(internal.request, interface, "HEAD", host, url, recvheader, header, content)
 	close_interface(interface, fd)
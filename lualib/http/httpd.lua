@@ -1,4 +1,6 @@
 local internal = require "http.internal"
+local http2 = require "http.http2"
+local core = require "skynet.http.core"
 
 local string = string
 local type = type
@@ -7,6 +9,7 @@ local tonumber = tonumber
 local pcall = pcall
 local ipairs = ipairs
 local pairs = pairs
+local table = table
 
 local httpd = {}
 
@@ -53,26 +56,24 @@ local http_status_msg = {
 	[505] = "HTTP Version not supported",
 }
 
-local function readall(readbytes, bodylimit)
-	local tmpline = {}
-	local body = internal.recvheader(readbytes, tmpline, "")
-	if not body then
-		return 413	-- Request Entity Too Large
+-- Buffered reader of one connection, the pipelined requests are kept for the next read_request
+httpd.reader = internal.reader
+
+local DRAIN_LIMIT = 64 * 1024
+
+local function expect_continue(httpver, header)
+	local expect = header.expect
+	return httpver >= 1.1 and type(expect) == "string" and expect:lower() == "100-continue"
+end
+
+local function readall(r, bodylimit, stream)
+	local method, url, httpver, header = r:head(core.request)
+	if not method then
+		return url	-- 400 or 413
 	end
-	local request = assert(tmpline[1])
-	local method, url, httpver = request:match "^(%a+)%s+(.-)%s+HTTP/([%d%.]+)$"
-	assert(method and url and httpver)
-	httpver = assert(tonumber(httpver))
 	if httpver < 1.0 or httpver > 1.1 then
-		return 505	-- HTTP Version not supported
-	end
-	local header = internal.parseheader(tmpline,2,{})
-	if not header then
-		return 400	-- Bad request
-	end
-	local length = header["content-length"]
-	if length then
-		length = tonumber(length)
+		-- the preface of http/2 with prior knowledge is PRI * HTTP/2.0
+		return 505, url, method, header, "", httpver	-- HTTP Version not supported
 	end
 	local mode = header["transfer-encoding"]
 	if mode then
@@ -81,58 +82,130 @@ local function readall(readbytes, bodylimit)
 		end
 	end
 
-	if mode == "chunked" then
-		body, header = internal.recvchunkedbody(readbytes, bodylimit, header, body)
+	local body
+	if stream then
+		local length
+		if mode ~= "chunked" then
+			length = header["content-length"]
+			if length then
+				length = tonumber(length)
+				if not length then
+					return 400
+				end
+				if bodylimit and length > bodylimit then
+					return 413
+				end
+			end
+		end
+		local start
+		if type(stream) == "function" and expect_continue(httpver, header) then
+			start = function()
+				stream "HTTP/1.1 100 Continue\r\n\r\n"
+			end
+		end
+		body = internal.body(r, header, mode ~= "chunked" and (length or 0) or nil, bodylimit, start)
+	elseif mode == "chunked" then
+		body, header = internal.readchunked(r, bodylimit, header)
 		if not body then
 			return 413
 		end
 	else
 		-- identity mode
+		local length = header["content-length"]
 		if length then
+			length = tonumber(length)
+			if not length then
+				return 400
+			end
+		end
+		if length and length > 0 then
 			if bodylimit and length > bodylimit then
 				return 413
 			end
-			if #body >= length then
-				body = body:sub(1,length)
-			else
-				local padding = readbytes(length - #body)
-				body = body .. padding
-			end
+			body = r:read(length)
+		else
+			body = ""
 		end
 	end
 
-	return 200, url, method, header, body
+	return 200, url, method, header, body, httpver
 end
 
-function httpd.read_request(...)
-	local ok, code, url, method, header, body = pcall(readall, ...)
+--[[
+	readbytes is a read function, or a reader from httpd.reader for a keep-alive connection.
+
+	stream : true to return the body as an iterator instead of a string, see
+	M.body in http/internal.lua. The body is read while the caller iterates it,
+	and should be read to the end before the next request of the connection.
+	stream can be the write function of the connection, then it answers
+	"Expect: 100-continue" when the body is read first.
+]]
+function httpd.read_request(readbytes, bodylimit, stream)
+	if type(readbytes) == "function" then
+		readbytes = httpd.reader(readbytes)
+	end
+	local ok, code, url, method, header, body, httpver = pcall(readall, readbytes, bodylimit, stream)
 	if ok then
-		return code, url, method, header, body
+		return code, url, method, header, body, httpver
 	else
 		return nil, code
 	end
 end
 
-local function writeall(writefunc, statuscode, bodyfunc, header)
-	local statusline = string.format("HTTP/1.1 %03d %s\r\n", statuscode, http_status_msg[statuscode] or "")
-	writefunc(statusline)
+-- whether the connection should be kept after this request
+httpd.keepalive = internal.keepalive
+
+local function response_head(statuscode, header, connection)
+	local out = { string.format("HTTP/1.1 %03d %s\r\n", statuscode, http_status_msg[statuscode] or "") }
+	local n = 1
 	if header then
 		for k,v in pairs(header) do
 			if type(v) == "table" then
 				for _,v in ipairs(v) do
-					writefunc(string.format("%s: %s\r\n", k,v))
+					n = n + 1
+					out[n] = string.format("%s: %s\r\n", k,v)
 				end
 			else
-				writefunc(string.format("%s: %s\r\n", k,v))
+				n = n + 1
+				out[n] = string.format("%s: %s\r\n", k,v)
 			end
 		end
 	end
+	if type(connection) == "string" then
+		n = n + 1
+		out[n] = "connection: " .. connection .. "\r\n"
+	end
+	return out, n
+end
+
+-- a response of httpd.cache : the same bytes for every keep-alive connection of http/1.1
+local function write_cached(writefunc, c, connection, interface)
+	if connection == true then
+		if interface and interface.sendshared and c.shared then
+			interface.sendshared(c.shared)
+		else
+			writefunc(c.data)
+		end
+	else
+		local out = response_head(c.status, c.header, connection)
+		out[#out+1] = c.tail
+		writefunc(table.concat(out))
+	end
+end
+
+local function writeall(writefunc, statuscode, bodyfunc, header, connection, interface)
 	local t = type(bodyfunc)
+	if t == "table" and bodyfunc.cached then
+		return write_cached(writefunc, bodyfunc.cached, connection, interface)
+	end
+	local out, n = response_head(statuscode, header, connection)
 	if t == "string" then
-		writefunc(string.format("content-length: %d\r\n\r\n", #bodyfunc))
-		writefunc(bodyfunc)
+		out[n+1] = string.format("content-length: %d\r\n\r\n", #bodyfunc)
+		out[n+2] = bodyfunc
+		writefunc(table.concat(out))
 	elseif t == "function" then
-		writefunc("transfer-encoding: chunked\r\n")
+		out[n+1] = "transfer-encoding: chunked\r\n"
+		writefunc(table.concat(out))
 		while true do
 			local s = bodyfunc()
 			if s then
@@ -145,14 +218,319 @@ local function writeall(writefunc, statuscode, bodyfunc, header)
 				break
 			end
 		end
+	elseif t == "table" then
+		-- a file of httpd.static, the headers are written before it
+		out[n+1] = string.format("content-length: %d\r\n\r\n", bodyfunc.size)
+		writefunc(table.concat(out))
+		if bodyfunc.head or bodyfunc.size == 0 then
+			return
+		end
+		if interface and interface.sendfile then
+			interface.sendfile(bodyfunc.file, bodyfunc.offset or 0, bodyfunc.size)
+		else
+			for s in internal.filechunks(bodyfunc) do
+				writefunc(s)
+			end
+		end
 	else
 		assert(t == "nil")
-		writefunc("\r\n")
+		if connection and statuscode >= 200 and statuscode ~= 204 and statuscode ~= 304 then
+			-- the client can't read until close on a kept connection
+			out[n+1] = "content-length: 0\r\n"
+		end
+		out[#out+1] = "\r\n"
+		writefunc(table.concat(out))
 	end
 end
 
+--[[
+	httpd.write_response(writefunc, statuscode, body, header, connection, interface)
+
+	body is a string, an iterator for the chunked encoding, nil, or a table :
+	{ file = filename, offset = 0, size = n, head = false } from httpd.static,
+	sent by interface.sendfile(filename, offset, size) if there is one (plain sockets, see
+	sockethelper.sendfilefunc), or read by skynet.fileio ; or the cached response of httpd.cache,
+	sent by interface.sendshared(buffer) (sockethelper.sendsharedfunc) without copying it.
+]]
 function httpd.write_response(...)
 	return pcall(writeall, ...)
 end
 
+--[[
+	Serve the requests on one connection until it's closed, or the client
+	doesn't want keep-alive.
+
+	handler(url, method, header, body) returns statuscode, bodyfunc, header,
+	the same as httpd.write_response. The responses of the pipelined requests
+	are written together when there is nothing more to read.
+
+	HTTP/2 is served by http.http2 when tls negotiated "h2" (interface.alpn
+	returns the protocol), or the client starts with the http/2 preface.
+
+	stream : true to pass the body to the handler as an iterator (see
+	httpd.read_request), so a large upload is not kept in memory. If the
+	handler doesn't read all of it, a small rest is dropped, otherwise the
+	connection is closed after the response.
+
+	return true when the connection is finished normally, or false, err
+]]
+function httpd.serve(interface, handler, bodylimit, stream)
+	if interface.alpn and interface.alpn() == "h2" then
+		return http2.serve(interface, handler, bodylimit, nil, stream)
+	end
+	local write = interface.write
+	local out = {}
+	local function flush()
+		if out[1] then
+			local s = table.concat(out)
+			out = {}
+			write(s)
+		end
+	end
+	local function collect(s)
+		out[#out+1] = s
+	end
+	local r = httpd.reader(function(sz)
+		flush()
+		return interface.read(sz)
+	end)
+	if stream then
+		-- 100 Continue is written after the responses before
+		stream = function(s)
+			flush()
+			write(s)
+		end
+	end
+	while true do
+		local code, url, method, header, body, httpver = httpd.read_request(r, bodylimit, stream)
+		if code == 505 and method == "PRI" and url == "*" and httpver == 2 then
+			local ok, err = pcall(flush)
+			if not ok then
+				return false, err
+			end
+			return http2.serve(interface, handler, bodylimit, r, stream and true)
+		end
+		if not code then
+			-- closed by the client between two requests
+			local closed = not r:pending()
+			if pcall(flush) and closed then
+				return true
+			end
+			return false, url
+		end
+		local keep, statuscode, bodyfunc, rheader, failure
+		if code ~= 200 then
+			keep, statuscode = false, code
+		else
+			keep = httpd.keepalive(httpver, header)
+			local ok
+			ok, statuscode, bodyfunc, rheader = pcall(handler, url, method, header, body)
+			if not ok then
+				failure = statuscode
+				keep, statuscode, bodyfunc, rheader = false, 500, nil, nil
+				if stream and body.failed then
+					statuscode = body.failed == "Body too large" and 413 or 400
+				end
+			elseif stream and keep then
+				keep = body:drain(DRAIN_LIMIT)
+			end
+		end
+		local connection
+		if not keep then
+			connection = "close"
+		elseif httpver < 1.1 then
+			connection = "keep-alive"
+		else
+			connection = true
+		end
+		local ok, err
+		local t = type(bodyfunc)
+		if t == "function" or t == "table" then
+			-- the files and shared buffers are sent by the socket directly, after the responses collected
+			ok, err = pcall(flush)
+			if ok then
+				ok, err = httpd.write_response(write, statuscode, bodyfunc, rheader, connection, interface)
+			end
+		else
+			ok, err = httpd.write_response(collect, statuscode, bodyfunc, rheader, connection)
+		end
+		if not ok then
+			pcall(flush)
+			return false, err
+		end
+		if not keep then
+			ok, err = pcall(flush)
+			if not ok then
+				return false, err
+			end
+			if failure then
+				return false, failure
+			end
+			return true
+		end
+	end
+end
+
+local mime_types = {
+	html = "text/html; charset=utf-8",
+	htm = "text/html; charset=utf-8",
+	txt = "text/plain; charset=utf-8",
+	css = "text/css; charset=utf-8",
+	js = "text/javascript; charset=utf-8",
+	json = "application/json",
+	xml = "application/xml",
+	wasm = "application/wasm",
+	pdf = "application/pdf",
+	zip = "application/zip",
+	png = "image/png",
+	jpg = "image/jpeg",
+	jpeg = "image/jpeg",
+	gif = "image/gif",
+	webp = "image/webp",
+	svg = "image/svg+xml",
+	ico = "image/x-icon",
+	woff = "font/woff",
+	woff2 = "font/woff2",
+	mp3 = "audio/mpeg",
+	mp4 = "video/mp4",
+}
+
+local function http_date(t)
+	return os.date("!%a, %d %b %Y %H:%M:%S GMT", t)
+end
+
+--[[
+	A handler serving the files under root for GET and HEAD, with ETag and Last-Modified
+	(304 for If-None-Match / If-Modified-Since). The file is sent with sendfile when the
+	interface has sendfile. opts :
+		prefix = "/static/"	-- the url prefix mapped to root, "/" by default
+		index = "index.html"	-- for a directory
+		max_age = 3600	-- cache-control max-age in seconds
+		mime = { ext = "type" }	-- more content types
+	It returns nil for the urls without prefix, so it can be chained before another handler.
+]]
+function httpd.static(root, opts)
+	opts = opts or {}
+	local fileio = require "skynet.fileio"
+	local urllib = require "http.url"
+	local prefix = opts.prefix or "/"
+	local index = opts.index or "index.html"
+	local cache_control = opts.max_age and string.format("max-age=%d", opts.max_age)
+	local mime = setmetatable(opts.mime or {}, { __index = mime_types })
+	return function(url, method, header)
+		local path = urllib.parse(url)
+		if path:sub(1, #prefix) ~= prefix then
+			return
+		end
+		if method ~= "GET" and method ~= "HEAD" then
+			return 405, nil, { allow = "GET, HEAD" }
+		end
+		path = path:sub(#prefix + 1)
+		if path:find("\0", 1, true) then
+			return 400
+		end
+		for name in path:gmatch "[^/]+" do
+			if name == ".." then
+				return 403
+			end
+		end
+		local filename = root .. "/" .. path
+		local st = fileio.stat(filename)
+		if st and st.type == "directory" then
+			filename = filename:gsub("/*$", "/") .. index
+			st = fileio.stat(filename)
+		end
+		if not st or st.type ~= "file" then
+			return 404
+		end
+		local etag = string.format('"%x-%x"', st.mtime, st.size)
+		local modified = http_date(st.mtime)
+		local rheader = {
+			etag = etag,
+			["last-modified"] = modified,
+			["cache-control"] = cache_control,
+		}
+		local match = header["if-none-match"]
+		if match then
+			if match == "*" or match:find(etag, 1, true) then
+				return 304, nil, rheader
+			end
+		elseif header["if-modified-since"] == modified then
+			return 304, nil, rheader
+		end
+		rheader["content-type"] = mime[filename:match "%.(%w+)$" or ""] or "application/octet-stream"
+		return 200, { file = filename, size = st.size, head = method == "HEAD" }, rheader
+	end
+end
+
+--[[
+	Wrap handler with a cache of its 200 responses to GET, keyed by url. The response is built once
+	in an immutable shared buffer, and sent to every keep-alive connection without copying. opts :
+		ttl = 100	-- in 1/100s
+		max = 1024	-- urls, the oldest half is dropped when it's full
+		key = function(url, header) return url end	-- nil for not cached
+]]
+function httpd.cache(handler, opts)
+	opts = opts or {}
+	local skynet = require "skynet"
+	local socket = require "skynet.socket"
+	local singleflight = require "skynet.singleflight"
+	local ttl = opts.ttl or 100
+	local max = opts.max or 1024
+	local keyf = opts.key
+	local new, old, count = {}, {}, 0
+	local flight = singleflight.new()
+
+	local function store(key, statuscode, rbody, rheader)
+		local out = response_head(statuscode, rheader)
+		local tail = string.format("content-length: %d\r\n\r\n", #rbody) .. rbody
+		out[#out+1] = tail
+		local data = table.concat(out)
+		local c = {
+			status = statuscode,
+			header = rheader,
+			body = rbody,
+			tail = tail,
+			data = data,
+			shared = socket.sharedbuffer(data),
+			expire = skynet.now() + ttl,
+		}
+		if new[key] == nil then
+			if count >= max / 2 then
+				old, new, count = new, {}, 0
+			end
+			count = count + 1
+		end
+		new[key] = c
+		return c
+	end
+
+	return function(url, method, header, body)
+		local key = method == "GET" and (keyf and keyf(url, header) or url)
+		if not key then
+			return handler(url, method, header, body)
+		end
+		local c = new[key] or old[key]
+		if c and c.expire > skynet.now() then
+			return c.status, { cached = c }
+		end
+		-- the concurrent misses of a url wait for one call of handler
+		local result
+		c = flight:call(key, function()
+			local statuscode, rbody, rheader = handler(url, method, header, body)
+			if statuscode == 200 and type(rbody) == "string" then
+				return store(key, statuscode, rbody, rheader)
+			end
+			result = table.pack(statuscode, rbody, rheader)
+		end)
+		if c then
+			return c.status, { cached = c }
+		elseif result then
+			return table.unpack(result, 1, result.n)
+		end
+		-- not cacheable, the response of another request can't be shared
+		return handler(url, method, header, body)
+	end
+end
+
 return httpd
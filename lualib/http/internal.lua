@@ -6,6 +6,9 @@ local pcall = pcall
 local assert = assert
 local error = error
 local pairs = pairs
+local ipairs = ipairs
+local setmetatable = setmetatable
+local core = require "skynet.http.core"
 
 local M = {}
 
@@ -147,6 +150,280 @@ function M.recvchunkedbody(readbytes, bodylimit, header, body)
 	return result, header
 end
 
+-- Buffered reader of one connection. The bytes after a message stay in the
+-- buffer, so the pipelined messages are not lost.
+local reader = {}
+reader.__index = reader
+
+-- data : the bytes read already, optional
+function M.reader(readbytes, data)
+	return setmetatable({ _read = readbytes, _buf = data or "", _pos = 1 }, reader)
+end
+
+-- read sz more bytes, or what's available if sz is nil
+function reader:fill(sz)
+	local data = self._read(sz)
+	if self._pos > #self._buf then
+		self._buf = data
+	else
+		self._buf = self._buf:sub(self._pos) .. data
+	end
+	self._pos = 1
+end
+
+function reader:read(sz)
+	local buf = self._buf
+	local pos = self._pos
+	local n = #buf - pos + 1
+	if n >= sz then
+		self._pos = pos + sz
+		return buf:sub(pos, pos + sz - 1)
+	end
+	self._buf = ""
+	self._pos = 1
+	return buf:sub(pos) .. self._read(sz - n)
+end
+
+-- take all the buffered bytes
+function reader:rest()
+	local s = self._buf:sub(self._pos)
+	self._buf = ""
+	self._pos = 1
+	return s
+end
+
+-- true if some bytes of the next message are buffered already
+function reader:pending()
+	return self._pos <= #self._buf
+end
+
+-- parse the message head with core.request or core.response (or a frame),
+-- return nil, code (400 or 413) if it's invalid.
+-- The parser returns nil, n when it knows n more bytes are needed.
+function reader:head(parse, ...)
+	while true do
+		local nextpos, a, b, c, d = parse(self._buf, self._pos, ...)
+		if nextpos then
+			self._pos = nextpos
+			return a, b, c, d
+		elseif nextpos == false then
+			return nil, a
+		end
+		self:fill(a)
+	end
+end
+
+-- the size line of the next chunk, nil if it's invalid.
+-- step : read byte by byte to leave the chunk data in the socket buffer
+local function chunk_size(r, step)
+	while true do
+		local sz, nextpos = core.chunk(r._buf, r._pos)
+		if sz then
+			r._pos = nextpos
+			return sz
+		elseif sz == false then
+			return
+		end
+		r:fill(step)
+	end
+end
+
+-- the trailer after the last chunk, false if it's invalid
+local function chunk_trailer(r, header)
+	while true do
+		local nextpos = core.header(r._buf, r._pos, header)
+		if nextpos then
+			r._pos = nextpos
+			return true
+		elseif nextpos == false then
+			return false
+		end
+		r:fill()
+	end
+end
+
+function M.readchunked(r, bodylimit, header)
+	local result = {}
+	local size = 0
+	while true do
+		local sz = chunk_size(r)
+		if not sz then
+			return
+		end
+		if sz == 0 then
+			break
+		end
+		size = size + sz
+		if bodylimit and size > bodylimit then
+			return
+		end
+		result[#result+1] = r:read(sz)
+		if r:read(2) ~= "\r\n" then
+			return
+		end
+	end
+	if not chunk_trailer(r, header) then
+		return
+	end
+	return table.concat(result), header
+end
+
+--[[
+	Streaming body of a message (content-length or chunked) on a reader.
+
+	body:read() returns the next piece (up to BODY_CHUNK bytes), or nil at the end
+	for piece in body do ... end
+	body:readall() returns the rest in one string
+
+	Only the pieces asked for are read, and skynet.socket pauses the socket
+	when its buffer is full, so a slow reader holds the peer back. The read
+	errors raise "Invalid body" or "Body too large"; after them the connection
+	can't be reused.
+]]
+local BODY_CHUNK = 64 * 1024
+
+local body = {}
+body.__index = body
+
+function body:__call()
+	return self:read()
+end
+
+-- length : content-length, or nil for chunked. The trailer is added into header.
+-- start : called before the first read, for 100-continue
+function M.body(r, header, length, bodylimit, start)
+	return setmetatable({
+		_reader = r,
+		_header = header,
+		_left = length or 0,	-- bytes left of the body or the current chunk
+		_chunked = length == nil,
+		_limit = bodylimit,
+		_start = start,
+		size = 0,	-- bytes read
+		finished = length == 0,
+	}, body)
+end
+
+local function body_error(self, err)
+	self.finished = true
+	self.failed = err
+	error(err)
+end
+
+function body:read()
+	if self.finished then
+		if self.failed then
+			error(self.failed)
+		end
+		return
+	end
+	local start = self._start
+	if start then
+		self._start = nil
+		start()
+	end
+	local r = self._reader
+	if self._left == 0 then
+		-- chunked, the next chunk
+		if self.size > 0 and r:read(2) ~= "\r\n" then
+			body_error(self, "Invalid body")
+		end
+		local sz = chunk_size(r, 1)
+		if not sz then
+			body_error(self, "Invalid body")
+		end
+		if sz == 0 then
+			if not chunk_trailer(r, self._header) then
+				body_error(self, "Invalid body")
+			end
+			self.finished = true
+			return
+		end
+		self._left = sz
+	end
+	local limit = self._limit
+	if limit and self.size + self._left > limit then
+		body_error(self, "Body too large")
+	end
+	-- read exactly, so the rest is kept in the socket buffer which pauses the socket when it's full
+	local s = r:read(self._left < BODY_CHUNK and self._left or BODY_CHUNK)
+	self._left = self._left - #s
+	self.size = self.size + #s
+	if self._left == 0 and not self._chunked then
+		self.finished = true
+	end
+	return s
+end
+
+function body:readall()
+	local result = {}
+	for s in self do
+		result[#result+1] = s
+	end
+	return table.concat(result)
+end
+
+-- drop the rest if it's known to be at most limit bytes, return true if the body is finished.
+-- A body waiting for 100-continue is not drained, the client may not send it at all.
+function body:drain(limit)
+	if self.finished then
+		return not self.failed
+	end
+	if self._start or self._chunked or self._left > limit then
+		return false
+	end
+	return (pcall(self.readall, self))
+end
+
+local function has_token(value, token)
+	if type(value) == "table" then
+		for _, v in ipairs(value) do
+			if has_token(v, token) then
+				return true
+			end
+		end
+		return false
+	end
+	for v in value:gmatch "[^,%s]+" do
+		if v:lower() == token then
+			return true
+		end
+	end
+	return false
+end
+
+-- whether the connection should be kept after this message
+function M.keepalive(httpver, header)
+	local connection = header.connection
+	if httpver >= 1.1 then
+		return not (connection and has_token(connection, "close"))
+	else
+		return connection ~= nil and has_token(connection, "keep-alive")
+	end
+end
+
+local FILE_CHUNK = 64 * 1024
+
+-- the file body of a response ({ file = filename, offset = , size = }, see httpd.static) as an iterator,
+-- read by skynet.fileio when the connection can't use sendfile (tls, http/2)
+function M.filechunks(f)
+	local fileio = require "skynet.fileio"
+	local offset = f.offset or 0
+	local left = f.size
+	return function()
+		if left <= 0 then
+			return
+		end
+		local data, err = fileio.read(f.file, offset, left < FILE_CHUNK and left or FILE_CHUNK)
+		if not data or data == "" then
+			error(err or ("File truncated : " .. f.file))
+		end
+		offset = offset + #data
+		left = left - #data
+		return data
+	end
+end
+
 local function recvbody(interface, code, header, body)
 	local length = header["content-length"]
 	if length then
@@ -169,9 +446,7 @@ local function recvbody(interface, code, header, body)
 	return body
 end
 
-function M.request(interface, method, host, url, recvheader, header, content)
-	local read = interface.read
-	local write = interface.write
+function M.write_request(write, method, host, url, header, content)
 	local header_content = ""
 	if header then
 		if not header.Host then
@@ -184,7 +459,31 @@ function M.request(interface, method, host, url, recvheader, header, content)
 		header_content = string.format("host:%s\r\n",host)
 	end
 
-	if content then
+	if content ~= nil and type(content) ~= "string" then
+		-- an iterator (function or M.body) returns the pieces of the body, and nil at the end
+		local length
+		if header then
+			for k, v in pairs(header) do
+				if k:lower() == "content-length" then
+					length = tonumber(v)
+				end
+			end
+		end
+		if length then
+			write(string.format("%s %s HTTP/1.1\r\n%s\r\n", method, url, header_content))
+			for s in content do
+				write(s)
+			end
+		else
+			write(string.format("%s %s HTTP/1.1\r\n%stransfer-encoding:chunked\r\n\r\n", method, url, header_content))
+			for s in content do
+				if s ~= "" then
+					write(string.format("%x\r\n%s\r\n", #s, s))
+				end
+			end
+			write("0\r\n\r\n")
+		end
+	elseif content then
 		local data
 		if header and header["transfer-encoding"] == "chunked" then
 			data = string.format("%s %s HTTP/1.1\r\n%s\r\n", method, url, header_content)
@@ -197,6 +496,11 @@ function M.request(interface, method, host, url, recvheader, header, content)
 		local request_header = string.format("%s %s HTTP/1.1\r\n%sContent-length:0\r\n\r\n", method, url, header_content)
 		write(request_header)
 	end
+end
+
+function M.request(interface, method, host, url, recvheader, header, content)
+	local read = interface.read
+	M.write_request(interface.write, method, host, url, header, content)
 
 	local tmpline = {}
 	local body = M.recvheader(read, tmpline, "")
@@ -307,50 +611,65 @@ local function stream_all(stream)
 	return body
 end
 
+-- a large chunk is returned in pieces up to BODY_CHUNK
 local function stream_chunked(stream)
 	local read = stream._interface.read
-	local sz, body = chunksize(read, stream._body)
-	if not sz then
-		stream.connected = false
-		stream:close()
-		return
-	end
-
-	if sz == 0 then
-		-- last chunk
-		local tmpline = {}
-		body = M.recvheader(read, tmpline, body)
-		if not body then
+	local body = stream._body
+	local left = stream._chunk_left
+	if not left then
+		local sz
+		sz, body = chunksize(read, body)
+		if not sz then
 			stream.connected = false
 			stream:close()
 			return
 		end
 
-		M.parseheader(tmpline,1, stream.header)
+		if sz == 0 then
+			-- last chunk
+			local tmpline = {}
+			body = M.recvheader(read, tmpline, body)
+			if not body then
+				stream.connected = false
+				stream:close()
+				return
+			end
+
+			M.parseheader(tmpline,1, stream.header)
 
-		stream._reading = stream.close
-		stream.connected = nil
-		return ""
+			stream._reading = stream.close
+			stream.connected = nil
+			return ""
+		end
+		left = sz
 	end
 
-	local n = #body
-	local remain
-
-	if n >= sz then
-		remain = body:sub(sz+1)
-		body = body:sub(1,sz)
+	local n = left < BODY_CHUNK and left or BODY_CHUNK
+	if body == "" then
+		-- read exactly, the rest is kept in the socket buffer
+		body = read(n)
+	end
+	local piece
+	if #body > n then
+		piece = body:sub(1, n)
+		body = body:sub(n+1)
 	else
-		body = body .. read(sz - n)
-		remain = ""
+		piece = body
+		body = ""
 	end
-	remain = readcrln(read, remain)
-	if not remain then
-		stream.connected = false
-		stream:close()
-		return
+	left = left - #piece
+	if left == 0 then
+		body = readcrln(read, body)
+		if not body then
+			stream.connected = false
+			stream:close()
+			return
+		end
+		left = nil
 	end
-	stream._body = remain
-	return body
+	stream._chunk_left = left
+	stream._body = body
+	return piece
 end
 
 function M.response_stream(interface, code, body, header)
@@ -82,6 +82,24 @@ function sockethelper.writefunc(fd)
 	end
 end
 
+-- interface.sendfile and interface.sendshared of httpd, for the plain sockets only
+function sockethelper.sendfilefunc(fd)
+	return function(filename, offset, size)
+		local ok, err = socket.sendfile(fd, filename, offset, size)
+		if not ok then
+			error(socket_error("sendfile failed fd = " .. fd .. " " .. tostring(err)))
+		end
+	end
+end
+
+function sockethelper.sendsharedfunc(fd)
+	return function(buffer)
+		if not socket.sendshared(fd, buffer) then
+			error(socket_error("write failed fd = " .. fd))
+		end
+	end
+end
+
 function sockethelper.connect(host, port, timeout)
 	local fd, err
 	local is_time_out = false
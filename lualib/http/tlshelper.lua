@@ -60,10 +60,17 @@ function tlshelper.readfunc(fd, tls_ctx)
             read_buff = ""
             return s
         else
-            while #read_buff < sz do
-                local ds = readfunc()
-                local s = tls_ctx:read(ds)
-                read_buff = read_buff .. s
+            -- collect the pieces and concat once, large bodies would be copied again on every record otherwise
+            local n = #read_buff
+            if n < sz then
+                local parts = { read_buff }
+                while n < sz do
+                    local ds = readfunc()
+                    local s = tls_ctx:read(ds)
+                    parts[#parts+1] = s
+                    n = n + #s
+                end
+                read_buff = table.concat(parts)
             end
             local  s = string.sub(read_buff, 1, sz)
             read_buff = string.sub(read_buff, sz+1, #read_buff)
@@ -88,8 +95,15 @@ function tlshelper.readallfunc(fd, tls_ctx)
     end
 end
 
-function tlshelper.newctx()
-    return c.newctx()
+-- with a name, every service gets the same SSL_CTX (set_cert is applied by the first one)
+function tlshelper.newctx(name)
+    return c.newctx(name)
+end
+
+-- process wide handshake counters: cache_hit/cache_miss of the client session cache,
+-- client_resumed/client_full, server_resumed/server_full
+function tlshelper.stat()
+    return c.stat()
 end
 
 function tlshelper.newtls(method, ssl_ctx, hostname)
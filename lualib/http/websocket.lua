@@ -1,4 +1,5 @@
 local internal = require "http.internal"
+local wscore = require "skynet.websocket.core"
 local socket = require "skynet.socket"
 local crypt = require "skynet.crypt"
 local httpd = require "http.httpd"
@@ -18,6 +19,9 @@ local pcall = pcall
 local debug = debug
 local table = table
 local tonumber = tonumber
+local ipairs = ipairs
+local type = type
+local math = math
 
 local M = {}
 
@@ -34,28 +38,166 @@ local function _isws_closed(id)
     return not ws_pool[id]
 end
 
-local function reader_with_payload(self, payload)
-    local sz_payload = #payload
-    if sz_payload == 0 then
-        return
+-- the frames are parsed from the buffer of the reader, payload is read after the handshake
+local function start_reader(self, payload)
+    self.reader = internal.reader(self.read, payload)
+end
+
+--[[
+    permessage-deflate (RFC 7692), needs lualib-src/ldeflate.c (DEFLATE_MODULE=ldeflate in Makefile)
+
+    options.deflate = true, or {
+        level = 1,  -- zlib level, 1 is fast; default is zlib's default
+        server_no_context_takeover = true,  -- reset the server's window after each message
+        client_no_context_takeover = true,  -- ask the client to reset its window
+        server_max_window_bits = 10,    -- 9 - 15, the server's window is 2^n bytes
+        client_max_window_bits = 10,    -- ask the client for a smaller window
+    }
+
+    Each connection keeps a deflate state (about 2^(n+2) + 256K bytes, much less
+    with the small windows) and an inflate state (32K) unless there is no context
+    takeover.
+]]
+
+local deflate_params = {
+    server_no_context_takeover = true,
+    client_no_context_takeover = true,
+    server_max_window_bits = true,
+    client_max_window_bits = true,
+}
+
+local function parse_extensions(value)
+    if type(value) == "table" then
+        value = table.concat(value, ",")
+    end
+    local list = {}
+    for ext in value:gmatch "[^,]+" do
+        local name
+        local params = {}
+        for item in ext:gmatch "[^;]+" do
+            item = item:match "^%s*(.-)%s*$"
+            if name == nil then
+                name = item
+            else
+                local k, v = item:match '^([^=]-)%s*=%s*"?([^"]*)"?$'
+                if k then
+                    params[k] = v
+                else
+                    params[item] = true
+                end
+            end
+        end
+        list[#list+1] = { name = name, params = params }
     end
-    local read = self.read
-    function self.read (sz)
-        if sz == nil or sz == sz_payload then
-            self.read = read
-            return payload
+    return list
+end
+
+-- zlib can't deflate with a 256 bytes window, so 8 is refused
+local function window_bits(v)
+    local n = tonumber(v)
+    if n and n >= 9 and n <= 15 and n == math.floor(n) then
+        return n
+    end
+end
+
+local function enable_deflate(self, conf, bits, nocontext, peer_nocontext)
+    local ldeflate = require "ldeflate"
+    self.deflater = ldeflate.deflater(conf.level, bits, nocontext)
+    self.inflater = ldeflate.inflater(self.mode == "server" and MAX_FRAME_SIZE or nil, peer_nocontext)
+end
+
+-- return the Sec-WebSocket-Extensions of the response, or nil to decline
+local function accept_deflate(self, conf, value)
+    for _, ext in ipairs(parse_extensions(value)) do
+        local p = ext.params
+        local ok = ext.name == "permessage-deflate"
+        for k in pairs(p) do
+            if not deflate_params[k] then
+                ok = false
+            end
         end
-        if sz < sz_payload then
-            local ret = payload:sub(1, sz)
-            payload = payload:sub(sz + 1)
-            sz_payload = #payload
-            return ret
+        local server_bits = conf.server_max_window_bits or 15
+        if ok and p.server_max_window_bits then
+            local n = window_bits(p.server_max_window_bits)
+            if n then
+                server_bits = math.min(server_bits, n)
+            else
+                ok = false
+            end
+        end
+        local client_bits
+        if ok and p.client_max_window_bits then
+            -- the client supports the limit, without a value it can be any
+            local n = p.client_max_window_bits == true and 15 or window_bits(p.client_max_window_bits)
+            if n then
+                client_bits = conf.client_max_window_bits and math.min(conf.client_max_window_bits, n)
+            else
+                ok = false
+            end
+        end
+        if ok then
+            local server_nocontext = p.server_no_context_takeover or conf.server_no_context_takeover
+            local client_nocontext = p.client_no_context_takeover or conf.client_no_context_takeover
+            enable_deflate(self, conf, server_bits, server_nocontext, client_nocontext)
+            local resp = { "permessage-deflate" }
+            if server_nocontext then
+                resp[#resp+1] = "server_no_context_takeover"
+            end
+            if client_nocontext then
+                resp[#resp+1] = "client_no_context_takeover"
+            end
+            if p.server_max_window_bits or server_bits < 15 then
+                resp[#resp+1] = "server_max_window_bits=" .. server_bits
+            end
+            if client_bits then
+                resp[#resp+1] = "client_max_window_bits=" .. client_bits
+            end
+            return table.concat(resp, "; ")
         end
-        self.read = read
-        return payload .. read(sz - sz_payload)
     end
 end
 
+local function offer_deflate(conf)
+    local offer = { "permessage-deflate" }
+    if conf.server_no_context_takeover then
+        offer[#offer+1] = "server_no_context_takeover"
+    end
+    if conf.client_no_context_takeover then
+        offer[#offer+1] = "client_no_context_takeover"
+    end
+    if conf.server_max_window_bits then
+        offer[#offer+1] = "server_max_window_bits=" .. conf.server_max_window_bits
+    end
+    if conf.client_max_window_bits then
+        offer[#offer+1] = "client_max_window_bits=" .. conf.client_max_window_bits
+    end
+    return table.concat(offer, "; ")
+end
+
+local function agree_deflate(self, conf, value)
+    local list = parse_extensions(value)
+    local ext = list[1]
+    if #list ~= 1 or ext.name ~= "permessage-deflate" then
+        error("websocket handshake invalid Sec-WebSocket-Extensions")
+    end
+    local p = ext.params
+    for k in pairs(p) do
+        if not deflate_params[k] then
+            error("websocket handshake invalid Sec-WebSocket-Extensions")
+        end
+    end
+    local client_bits = conf.client_max_window_bits or 15
+    if p.client_max_window_bits then
+        client_bits = window_bits(p.client_max_window_bits)
+        if not client_bits or not conf.client_max_window_bits then
+            error("websocket handshake invalid client_max_window_bits")
+        end
+    end
+    enable_deflate(self, conf, client_bits,
+        p.client_no_context_takeover or conf.client_no_context_takeover,
+        p.server_no_context_takeover)
+end
+
 local function write_handshake(self, host, url, header)
     local key = crypt.base64encode(crypt.randomkey()..crypt.randomkey())
     local request_header = {
@@ -70,13 +212,17 @@ local function write_handshake(self, host, url, header)
             request_header[k] = v
         end
     end
+    local deflate_conf = self.deflate_conf
+    if deflate_conf then
+        request_header["Sec-WebSocket-Extensions"] = offer_deflate(deflate_conf)
+    end
 
     local recvheader = {}
     local code, payload = internal.request(self, "GET", host, url, recvheader, request_header)
     if code ~= 101 then
         error(string.format("websocket handshake error: code[%s] info:%s", code, payload))
     end
-    reader_with_payload(self, payload)
+    start_reader(self, payload)
 
     if not recvheader["upgrade"] or recvheader["upgrade"]:lower() ~= "websocket" then
         error("websocket handshake upgrade must websocket")
@@ -96,19 +242,28 @@ local function write_handshake(self, host, url, header)
     if sw_key ~= crypt.sha1(key .. guid) then
         error("websocket handshake invalid Sec-WebSocket-Accept")
     end
+
+    local extensions = recvheader["sec-websocket-extensions"]
+    if extensions then
+        if not deflate_conf then
+            error("websocket handshake unexpected Sec-WebSocket-Extensions")
+        end
+        agree_deflate(self, deflate_conf, extensions)
+    end
 end
 
 local function read_handshake(self, upgrade_ops)
     local header, method, url
     if upgrade_ops then
         header, method, url = upgrade_ops.header, upgrade_ops.method, upgrade_ops.url
+        start_reader(self)
     else
         local tmpline = {}
         local payload = internal.recvheader(self.read, tmpline, "")
         if not payload then
             return 413
         end
-        reader_with_payload(self, payload)
+        start_reader(self, payload)
 
         local request = assert(tmpline[1])
         local httpver
@@ -173,6 +328,14 @@ local function read_handshake(self, upgrade_ops)
     -- read 'x-real-ip' header from nginx
     self.real_ip = header["x-real-ip"]
 
+    local extensions = header["sec-websocket-extensions"]
+    if extensions and self.deflate_conf then
+        local accepted = accept_deflate(self, self.deflate_conf, extensions)
+        if accepted then
+            sub_pro = sub_pro .. "Sec-WebSocket-Extensions: " .. accepted .. "\r\n"
+        end
+    end
+
     -- response handshake
     local accept = crypt.base64encode(crypt.sha1(sw_key .. self.guid))
     local resp = "HTTP/1.1 101 Switching Protocols\r\n"..
@@ -208,33 +371,9 @@ local op_code = {
     [0x0A]     = "pong",
 }
 
-local function write_frame(self, op, payload_data, masking_key)
-    payload_data = payload_data or ""
-    local payload_len = #payload_data
-    local op_v = assert(op_code[op])
-    local v1 = 0x80 | op_v -- fin is 1 with opcode
-    local s
-    local mask = masking_key and 0x80 or 0x00
-    -- mask set to 0
-    if payload_len < 126 then
-        s = string.pack("I1I1", v1, mask | payload_len)
-    elseif payload_len <= 0xffff then
-        s = string.pack("I1I1>I2", v1, mask | 126, payload_len)
-    else
-        s = string.pack("I1I1>I8", v1, mask | 127, payload_len)
-    end
-    self.write(s)
-
-    -- write masking_key
-    if masking_key then
-        s = string.pack(">I4", masking_key)
-        self.write(s)
-        payload_data = crypt.xor_str(payload_data, s)
-    end
-
-    if payload_len > 0 then
-        self.write(payload_data)
-    end
+-- one write for the whole frame, compressed is for the rsv1 bit of permessage-deflate
+local function write_frame(self, op, payload_data, masking_key, compressed)
+    self.write(wscore.pack(assert(op_code[op]), payload_data, true, compressed, masking_key))
 end
 
 
@@ -249,34 +388,25 @@ local function read_close(payload_data)
 end
 
 
+-- return fin, op, payload (unmasked), rsv1
 local function read_frame(self)
-    local s = self.read(2)
-    local v1, v2 = string.unpack("I1I1", s)
-    local fin  = (v1 & 0x80) ~= 0
-    -- unused flag
-    -- local rsv1 = (v1 & 0x40) ~= 0
-    -- local rsv2 = (v1 & 0x20) ~= 0
-    -- local rsv3 = (v1 & 0x10) ~= 0
-    local op   =  v1 & 0x0f
-    local mask = (v2 & 0x80) ~= 0
-    local payload_len = (v2 & 0x7f)
-    if payload_len == 126 then
-        s = self.read(2)
-        payload_len = string.unpack(">I2", s)
-    elseif payload_len == 127 then
-        s = self.read(8)
-        payload_len = string.unpack(">I8", s)
-    end
-
-    if self.mode == "server" and payload_len > MAX_FRAME_SIZE then
-        error("payload_len is too large")
-    end
-
-    -- print(string.format("fin:%s, op:%s, mask:%s, payload_len:%s", fin, op_code[op], mask, payload_len))
-    local masking_key = mask and self.read(4) or false
-    local payload_data = payload_len>0 and self.read(payload_len) or ""
-    payload_data = masking_key and crypt.xor_str(payload_data, masking_key) or payload_data
-    return fin, assert(op_code[op]), payload_data
+    local fin, op, rsv1, payload_data = self.reader:head(wscore.frame, self.mode == "server" and MAX_FRAME_SIZE or nil)
+    if fin == nil then
+        error(op)
+    end
+    return fin, assert(op_code[op]), payload_data, rsv1
+end
+
+-- rsv1 of the first frame marks a compressed message
+local function decode_message(self, data, compressed)
+    if compressed then
+        local inflater = self.inflater
+        if not inflater then
+            error("rsv1 is set without permessage-deflate")
+        end
+        return inflater:inflate(data)
+    end
+    return data
 end
 
 
@@ -296,13 +426,13 @@ local function resolve_accept(self, options)
     try_handle(self, "handshake", header, url)
     local recv_count = 0
     local recv_buf = {}
-    local first_op
+    local first_op, compressed
     while true do
         if _isws_closed(self.id) then
             try_handle(self, "close")
             return
         end
-        local fin, op, payload_data = read_frame(self)
+        local fin, op, payload_data, rsv1 = read_frame(self)
         if op == "close" then
             local code, reason = read_close(payload_data)
             write_frame(self, "close")
@@ -314,8 +444,11 @@ local function resolve_accept(self, options)
         elseif op == "pong" then
             try_handle(self, "pong")
         else
+            if #recv_buf == 0 then
+                compressed = rsv1
+            end
             if fin and #recv_buf == 0 then
-                try_handle(self, "message", payload_data, op)
+                try_handle(self, "message", decode_message(self, payload_data, compressed), op)
             else
                 recv_buf[#recv_buf+1] = payload_data
                 recv_count = recv_count + #payload_data
@@ -325,7 +458,7 @@ local function resolve_accept(self, options)
                 first_op = first_op or op
                 if fin then
                     local s = table.concat(recv_buf)
-                    try_handle(self, "message", s, first_op)
+                    try_handle(self, "message", decode_message(self, s, compressed), first_op)
                     recv_buf = {}  -- clear recv_buf
                     recv_count = 0
                     first_op = nil
@@ -392,11 +525,12 @@ local function _new_server_ws(socket_id, handle, protocol)
     elseif protocol == "wss" then
         local tls = require "http.tlshelper"
         if not SSLCTX_SERVER then
-            SSLCTX_SERVER = tls.newctx()
             -- gen cert and key
             -- openssl req -x509 -newkey rsa:2048 -days 3650 -nodes -keyout server-key.pem -out server-cert.pem
             local certfile = skynet.getenv("certfile") or "./server-cert.pem"
             local keyfile = skynet.getenv("keyfile") or "./server-key.pem"
+            -- share one SSL_CTX with the other services using the same cert
+            SSLCTX_SERVER = tls.newctx("server:" .. certfile)
             SSLCTX_SERVER:set_cert(certfile, keyfile)
         end
         local tls_ctx = tls.newtls("server", SSLCTX_SERVER)
@@ -436,6 +570,10 @@ function M.accept(socket_id, handle, protocol, addr, options)
     protocol = protocol or "ws"
     local ws_obj = _new_server_ws(socket_id, handle, protocol)
     ws_obj.addr = addr
+    local deflate_conf = options and options.deflate
+    if deflate_conf then
+        ws_obj.deflate_conf = deflate_conf == true and {} or deflate_conf
+    end
     local on_warning = handle and handle["warning"]
     if on_warning then
         local isok = pcall(socket.warning, socket_id, function(id, sz)
@@ -470,7 +608,8 @@ function M.accept(socket_id, handle, protocol, addr, options)
 end
 
 
-function M.connect(url, header, timeout)
+-- options.deflate : see permessage-deflate above
+function M.connect(url, header, timeout, options)
     local protocol, host, uri = string.match(url, "^(wss?)://([^/]+)(.*)$")
     if protocol ~= "wss" and protocol ~= "ws" then
         error(string.format("invalid protocol: %s", protocol))
@@ -491,6 +630,10 @@ function M.connect(url, header, timeout)
     local socket_id = sockethelper.connect(host_addr, host_port, timeout)
     local ws_obj = _new_client_ws(socket_id, protocol, hostname)
     ws_obj.addr = host
+    local deflate_conf = options and options.deflate
+    if deflate_conf then
+        ws_obj.deflate_conf = deflate_conf == true and {} or deflate_conf
+    end
     
     local is_ok,err = pcall(write_handshake, ws_obj, host_addr, uri, header)
     if not is_ok then
@@ -503,23 +646,26 @@ end
 
 function M.read(id)
     local ws_obj = assert(ws_pool[id])
-    local recv_buf
+    local recv_buf, compressed
     while true do
-        local fin, op, payload_data = read_frame(ws_obj)
+        local fin, op, payload_data, rsv1 = read_frame(ws_obj)
         if op == "close" then
             _close_websocket(ws_obj)
             return false, payload_data
         elseif op == "ping" then
             write_frame(ws_obj, "pong", payload_data)
         elseif op ~= "pong" then  -- op is frame, text binary
+            if not recv_buf then
+                compressed = rsv1
+            end
             if fin and not recv_buf then
-                return payload_data
+                return decode_message(ws_obj, payload_data, compressed)
             else
                 recv_buf = recv_buf or {}
                 recv_buf[#recv_buf+1] = payload_data
                 if fin then
                     local s = table.concat(recv_buf)
-                    return s
+                    return decode_message(ws_obj, s, compressed)
                 end
             end
         end
@@ -531,7 +677,12 @@ function M.write(id, data, fmt, masking_key)
     local ws_obj = assert(ws_pool[id])
     fmt = fmt or "text"
     assert(fmt == "text" or fmt == "binary")
-    write_frame(ws_obj, fmt, data, masking_key)
+    local deflater = ws_obj.deflater
+    if deflater then
+        write_frame(ws_obj, fmt, deflater:deflate(data), masking_key, true)
+    else
+        write_frame(ws_obj, fmt, data, masking_key)
+    end
 end
 
 
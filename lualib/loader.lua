@@ -7,21 +7,37 @@ SERVICE_NAME = args[1]
 
 local main, pattern
 
-local err = {}
-for pat in string.gmatch(LUA_SERVICE, "([^;]+);*") do
-	local filename = string.gsub(pat, "?", SERVICE_NAME)
-	local f, msg = loadfile(filename)
-	if not f then
-		table.insert(err, msg)
-	else
-		pattern = pat
-		main = f
-		break
+-- The resolved filename is shared by all the services ( see codecache.searchpath ),
+-- so only the first start of a service probes the patterns.
+local codecache = require "skynet.codecache"
+local filename = codecache.searchpath(SERVICE_NAME, LUA_SERVICE, "")
+if filename then
+	for pat in string.gmatch(LUA_SERVICE, "([^;]+);*") do
+		if (string.gsub(pat, "?", SERVICE_NAME)) == filename then
+			main = loadfile(filename)
+			pattern = pat
+			break
+		end
 	end
 end
 
 if not main then
-	error(table.concat(err, "\n"))
+	-- Not found or failed to load, search again to report every error
+	local err = {}
+	for pat in string.gmatch(LUA_SERVICE, "([^;]+);*") do
+		local filename = string.gsub(pat, "?", SERVICE_NAME)
+		local f, msg = loadfile(filename)
+		if not f then
+			table.insert(err, msg)
+		else
+			pattern = pat
+			main = f
+			break
+		end
+	end
+	if not main then
+		error(table.concat(err, "\n"))
+	end
 end
 
 LUA_SERVICE = nil
@@ -18,11 +18,79 @@ local traceback = debug.traceback
 local cresume = coroutine.resume
 local running_thread = nil
 local init_thread = nil
+local init_pending = nil	-- requests came before the start function, see skynet.start
+
+-- see skynet.cpustat
+local thread_time = c.thread_time
+local cpustat	-- label -> { cpu, resume, task } , nil : off
+local cpu_label = setmetatable({}, { __mode = "k" })	-- coroutine -> label of its current task
+local cpu_co = setmetatable({}, { __mode = "k" })	-- coroutine -> { cpu, resume } of its current task
+local cpu_child = 0	-- the time of the nested resumes, not counted in the outer coroutine
+
+local function cpu_account(co, start, child, ...)
+	local t = thread_time() - start
+	local self = t - cpu_child
+	cpu_child = child + t
+	local label = cpu_label[co] or "unknown"
+	local s = cpustat and cpustat[label]
+	if s then
+		s.cpu = s.cpu + self
+		s.resume = s.resume + 1
+	elseif cpustat then
+		cpustat[label] = { cpu = self, resume = 1, task = 0 }
+	end
+	local cs = cpu_co[co]
+	if cs then
+		cs.cpu = cs.cpu + self
+		cs.resume = cs.resume + 1
+	else
+		cpu_co[co] = { cpu = self, resume = 1 }
+	end
+	return ...
+end
 
 local function coroutine_resume(co, ...)
 	running_thread = co
+	if cpustat then
+		local child = cpu_child
+		cpu_child = 0
+		return cpu_account(co, thread_time(), child, cresume(co, ...))
+	end
 	return cresume(co, ...)
 end
+
+-- a new task of co
+local function cpu_task(co, label)
+	cpu_label[co] = label
+	cpu_co[co] = nil
+	local s = cpustat[label]
+	if s then
+		s.task = s.task + 1
+	else
+		cpustat[label] = { cpu = 0, resume = 0, task = 1 }
+	end
+end
+
+local function cpu_dispatch(co, name, session, source, cmd, ...)
+	if type(cmd) == "string" and #cmd <= 64 and cmd:find "^[%w_%.:]+$" then
+		cpu_task(co, name .. "." .. cmd)
+	else
+		cpu_task(co, name)
+	end
+	return coroutine_resume(co, session, source, cmd, ...)
+end
+
+local func_label = setmetatable({}, { __mode = "k" })
+
+local function cpu_func(co, f)
+	local label = func_label[f]
+	if label == nil then
+		local info = debug.getinfo(f, "S")
+		label = info.short_src .. ":" .. info.linedefined
+		func_label[f] = label
+	end
+	cpu_task(co, label)
+end
 local coroutine_yield = coroutine.yield
 local coroutine_create = coroutine.create
 
@@ -42,6 +110,8 @@ local skynet = {
 	PTYPE_LUA = 10,
 	PTYPE_SNAX = 11,
 	PTYPE_TRACE = 12,	-- use for debug trace
+	PTYPE_LOG = 13,	-- structured log, see skynet.log
+	PTYPE_MEMORY = 14,	-- memory pressure, see skynet.memory_callback
 }
 
 -- code cache
@@ -57,7 +127,9 @@ function skynet.register_protocol(class)
 	proto[id] = class
 end
 
-local session_id_coroutine = {}
+-- session -> waiting coroutine (or "BREAK", or the ticker of skynet.tick), kept in a C open-addressing table indexed by session,
+-- so that a large number of calls in flight doesn't rehash it again and again
+local session_id_coroutine = c.sessionmap()
 local session_coroutine_id = {}
 local session_coroutine_address = {}
 local session_coroutine_tracetag = {}
@@ -66,13 +138,22 @@ local unresponse = {}
 local wakeup_queue = {}
 local sleep_session = {}
 
-local watching_session = {}
+local watching_session = c.sessionmap()	-- session -> address called
 local error_queue = {}
 local fork_queue = { h = 1, t = 0 }
 
-local auxsend, auxtimeout, auxwait
+-- see skynet.timeslice. The coroutine yielded by the time slice hook resumes by a timeout 0 of its own,
+-- the other messages came before it are kept in preempt_pending, so a handler is still atomic to the others.
+local preempted = require("skynet.vm").preempted
+local preempt_co
+local preempt_session
+local preempt_pending = {}	-- { prototype, msg, sz, session, source }
+local preempt_count = 0
+
+local auxsend, auxtimeout, auxwait, auxsendmulti
 do ---- avoid session rewind conflict
 	local csend = c.send
+	local csendmulti = c.sendmulti
 	local cintcommand = c.intcommand
 	local dangerzone
 	local dangerzone_size = 0x1000
@@ -134,12 +215,30 @@ do ---- avoid session rewind conflict
 		return session
 	end
 
-	local function auxtimeout_checkconflict(timeout)
-		local session = cintcommand("TIMEOUT", timeout)
+	local function auxtimeout_checkconflict(timeout, cmd)
+		local session = cintcommand(cmd or "TIMEOUT", timeout)
 		checkconflict(session)
 		return session
 	end
 
+	-- in dangerzone, send one by one so that every new session is checked
+	local function auxsendmulti_checkconflict(addrs, proto, msg, sz)
+		if type(msg) ~= "string" then
+			local str = c.tostring(msg, sz)
+			c.trash(msg, sz)
+			msg = str
+		end
+		local sessions = {}
+		for i = 1, #addrs do
+			local session = csend(addrs[i], proto, nil, msg)
+			if session then
+				checkconflict(session)
+			end
+			sessions[i] = session or false
+		end
+		return sessions
+	end
+
 	local function auxwait_checkconflict()
 		local session = c.genid()
 		checkconflict(session)
@@ -155,8 +254,8 @@ do ---- avoid session rewind conflict
 		return session
 	end
 
-	local function auxtimeout_checkrewind(timeout)
-		local session = cintcommand("TIMEOUT", timeout)
+	local function auxtimeout_checkrewind(timeout, cmd)
+		local session = cintcommand(cmd or "TIMEOUT", timeout)
 		if session and session > dangerzone_low and session <= dangerzone_up then
 			-- enter dangerzone
 			set_checkconflict(session)
@@ -164,6 +263,22 @@ do ---- avoid session rewind conflict
 		return session
 	end
 
+	local function auxsendmulti_checkrewind(addrs, proto, msg, sz)
+		local sessions = csendmulti(addrs, proto, nil, msg, sz)
+		local last
+		for i = #sessions, 1, -1 do
+			if sessions[i] then
+				last = sessions[i]
+				break
+			end
+		end
+		if last and last > dangerzone_low and last <= dangerzone_up then
+			-- enter dangerzone
+			set_checkconflict(last)
+		end
+		return sessions
+	end
+
 	local function auxwait_checkrewind()
 		local session = c.genid()
 		if session > dangerzone_low and session <= dangerzone_up then
@@ -177,6 +292,7 @@ do ---- avoid session rewind conflict
 		auxsend = auxsend_checkrewind
 		auxtimeout = auxtimeout_checkrewind
 		auxwait = auxwait_checkrewind
+		auxsendmulti = auxsendmulti_checkrewind
 	end
 
 	set_checkconflict = function(session)
@@ -184,12 +300,27 @@ do ---- avoid session rewind conflict
 		auxsend = auxsend_checkconflict
 		auxtimeout = auxtimeout_checkconflict
 		auxwait = auxwait_checkconflict
+		auxsendmulti = auxsendmulti_checkconflict
 	end
 
 	-- in safezone at the beginning
 	set_checkrewind()
 end
 
+-- remove the timer of session from the timing wheel, returns true if it will never fire
+local function cancel_timeout(session)
+	return c.intcommand("UNTIMEOUT", session) ~= nil
+end
+
+-- mark a session whose waiting coroutine is gone : cancel the timer if we can, or ignore the response later
+local function break_session(session)
+	if cancel_timeout(session) then
+		session_id_coroutine[session] = nil
+	else
+		session_id_coroutine[session] = "BREAK"
+	end
+end
+
 do ---- request/select
 	local function send_requests(self)
 		local sessions = {}
@@ -296,7 +427,7 @@ do ---- request/select
 			self._request = 0
 		end
 		if self._timeout then
-			session_id_coroutine[self._timeout] = "BREAK"
+			break_session(self._timeout)
 			self._timeout = nil
 		end
 	end
@@ -367,10 +498,15 @@ end
 -- coroutine reuse
 
 local coroutine_pool = setmetatable({}, { __mode = "kv" })
+local coroutine_pool_max = 1024	-- keep at most so many idle coroutines
+local coroutine_stack_max = 1024	-- don't keep a coroutine whose stack grew over so many slots
+local coroutine_stat = { hit = 0, miss = 0, drop = 0 }
 
-local function co_create(f)
+-- labelf : the function to label the task for skynet.cpustat, f by default, false if the caller labels it
+local function co_create(f, labelf)
 	local co = tremove(coroutine_pool)
 	if co == nil then
+		coroutine_stat.miss = coroutine_stat.miss + 1
 		co = coroutine_create(function(...)
 			f(...)
 			while true do
@@ -396,6 +532,11 @@ local function co_create(f)
 
 				-- recycle co into pool
 				f = nil
+				if #coroutine_pool >= coroutine_pool_max or c.stacksize() > coroutine_stack_max then
+					-- let it die, the caller (suspend) still sees "SUSPEND"
+					coroutine_stat.drop = coroutine_stat.drop + 1
+					return "SUSPEND"
+				end
 				coroutine_pool[#coroutine_pool+1] = co
 				-- recv new main function f
 				f = coroutine_yield "SUSPEND"
@@ -403,14 +544,39 @@ local function co_create(f)
 			end
 		end)
 	else
+		coroutine_stat.hit = coroutine_stat.hit + 1
 		-- pass the main function f to coroutine, and restore running thread
+		-- it's not counted by skynet.cpustat, as the coroutine may still have the label of its last task
 		local running = running_thread
-		coroutine_resume(co, f)
+		running_thread = co
+		cresume(co, f)
 		running_thread = running
 	end
+	if cpustat and labelf ~= false then
+		cpu_func(co, labelf or f)
+	end
 	return co
 end
 
+-- Set the limits of the coroutine pool ( nil keeps the current value ), returns the statistics :
+-- pool : idle coroutines, hit / miss : co_create reused one / created one, drop : not recycled because of the limits
+function skynet.coroutine_pool(max, stack_max)
+	coroutine_pool_max = max or coroutine_pool_max
+	coroutine_stack_max = stack_max or coroutine_stack_max
+	while #coroutine_pool > coroutine_pool_max do
+		local co = tremove(coroutine_pool)
+		coroutine.close(co)
+	end
+	return {
+		pool = #coroutine_pool,
+		max = coroutine_pool_max,
+		stack_max = coroutine_stack_max,
+		hit = coroutine_stat.hit,
+		miss = coroutine_stat.miss,
+		drop = coroutine_stat.drop,
+	}
+end
+
 local function dispatch_wakeup()
 	while true do
 		local token = tremove(wakeup_queue,1)
@@ -420,7 +586,7 @@ local function dispatch_wakeup()
 				local co = session_id_coroutine[session]
 				local tag = session_coroutine_tracetag[co]
 				if tag then c.trace(tag, "resume") end
-				session_id_coroutine[session] = "BREAK"
+				break_session(session)
 				return suspend(co, coroutine_resume(co, false, "BREAK", nil, session))
 			end
 		else
@@ -461,7 +627,15 @@ function suspend(co, result, command)
 		-- See skynet.coutine for detail
 		error("Call skynet.coroutine.yield out of skynet.coroutine.resume\n" .. traceback(co))
 	elseif command == nil then
-		-- debug trace
+		if preempted() then
+			-- the time slice is used up, requeue the service
+			local session = auxtimeout(0)
+			session_id_coroutine[session] = co
+			preempt_co = co
+			preempt_session = session
+			preempt_count = preempt_count + 1
+		end
+		-- or debug trace
 		return
 	else
 		error("Unknown command : " .. command .. "\n" .. traceback(co))
@@ -477,7 +651,7 @@ function skynet.trace_timeout(on)
 		co = co_create(function()
 			timeout_traceback[co] = nil
 			func()
-		end)
+		end, func)
 		local info = string.format("TIMER %d+%d : ", skynet.now(), ti)
 		timeout_traceback[co] = traceback(info, 3)
 		return co
@@ -487,19 +661,67 @@ function skynet.trace_timeout(on)
 		co_create_for_timeout = trace_coroutine
 	else
 		timeout_traceback = nil
-		co_create_for_timeout = co_create
+		co_create_for_timeout = nil	-- co_create
 	end
 end
 
 skynet.trace_timeout(false)	-- turn off by default
 
+local timeout_session = setmetatable({}, { __mode = "k" })
+
 function skynet.timeout(ti, func)
 	local session = auxtimeout(ti)
 	assert(session)
-	local co = co_create_for_timeout(func, ti)
+	local co
+	if co_create_for_timeout then
+		co = co_create_for_timeout(func, ti)
+	else
+		co = co_create(func)
+	end
 	assert(session_id_coroutine[session] == nil)
 	session_id_coroutine[session] = co
-	return co	-- for debug
+	timeout_session[co] = session
+	return co	-- for debug, or skynet.canceltimeout
+end
+
+-- Call func every ti (in 1/100s, fractional for the high resolution timer, see skynet.timeout) in a new coroutine.
+-- The timer node is reused by the timing wheel, each period costs only one message. The periods are counted from
+-- the first expiration, so the delay of a message doesn't move the next ones. Returns the ticker for skynet.canceltick.
+function skynet.tick(ti, func)
+	assert(type(ti) == "number" and ti > 0, "Need a positive interval")
+	local session = auxtimeout(ti, "TICK")
+	assert(session)
+	local ticker = { session = session, func = func, interval = ti }
+	session_id_coroutine[session] = ticker
+	return ticker
+end
+
+-- stop a ticker, returns false if it's stopped already
+function skynet.canceltick(ticker)
+	local session = ticker.session
+	if ticker.func == nil or session_id_coroutine[session] ~= ticker then
+		return false
+	end
+	cancel_timeout(session)
+	-- the ticker stays as a tombstone (func == nil) and the ticks still arriving are ignored.
+	-- A tick being dispatched by the timer thread may come after the cancel, so it's removed by a timeout
+	-- from the timing wheel, which the timer thread dispatches after that tick. (timeout 0 is sent at once)
+	ticker.func = nil
+	skynet.timeout(1, function()
+		session_id_coroutine[session] = nil
+	end)
+	return true
+end
+
+-- cancel a timeout created by skynet.timeout before it fires, returns true if func will not be called
+function skynet.canceltimeout(co)
+	local session = timeout_session[co]
+	if session == nil or session_id_coroutine[session] ~= co then
+		return false
+	end
+	timeout_session[co] = nil
+	break_session(session)
+	return true
 end
 
 local function suspend_sleep(session, token)
@@ -540,6 +762,18 @@ function skynet.wait(token)
 	session_id_coroutine[session] = nil
 end
 
+-- Park the running thread without a session, until skynet.unpark. It's the primitive of skynet.queue
+function skynet.park()
+	return coroutine_yield "SUSPEND"
+end
+
+-- The parked thread resumes from the fork queue, right after the current message
+function skynet.unpark(co)
+	local t = fork_queue.t + 1
+	fork_queue.t = t
+	fork_queue[t] = co
+end
+
 function skynet.killthread(thread)
 	local session
 	-- find session
@@ -586,6 +820,8 @@ function skynet.killthread(thread)
 		session_id_coroutine[session] = "BREAK"
 		watching_session[session] = nil
 	else
+		-- a sleeping or timeout thread, drop its timer
+		cancel_timeout(session)
 		session_id_coroutine[session] = nil
 	end
 	for k,v in pairs(sleep_session) do
@@ -608,6 +844,7 @@ end
 
 skynet.now = c.now
 skynet.hpc = c.hpc	-- high performance counter
+skynet.usec = c.usec	-- monotonic clock in microseconds, cheap enough for hot paths (no syscall on linux)
 
 local traceid = 0
 function skynet.trace(info)
@@ -644,8 +881,42 @@ function skynet.time()
 	return skynet.now()/100 + (starttime or skynet.starttime())
 end
 
+-- see skynet.batchresponse
+local response_batch	-- address -> { session, msg, sz, ... } waiting for the end of this dispatch, nil : off
+
+local function send_response(address, session, msg, sz)
+	local ret = c.send(address, skynet.PTYPE_RESPONSE, session, msg, sz)
+	if ret then
+		return true
+	elseif ret == false then
+		-- If the package is too large, returns false. so we should report error back
+		c.send(address, skynet.PTYPE_ERROR, session, "")
+	end
+	return false
+end
+
+-- send the responses queued by skynet.ret, the ones to the same address in one message
+local function flush_response()
+	for address, list in pairs(response_batch) do
+		response_batch[address] = nil
+		if #list == 3 then
+			send_response(address, list[1], list[2], list[3] or nil)
+		else
+			local ret = c.send(address, skynet.PTYPE_RESPONSE, 0, c.packresponse(list))
+			if ret == false then
+				for i = 1, #list, 3 do
+					c.send(address, skynet.PTYPE_ERROR, list[i], "")
+				end
+			end
+		end
+	end
+end
+
 function skynet.exit()
 	fork_queue = { h = 1, t = 0 }	-- no fork coroutine can be execute after skynet.exit
+	if response_batch then
+		flush_response()
+	end
 	skynet.send(".launcher","lua","REMOVE",skynet.self(), false)
 	-- report the sources that call me
 	for co, session in pairs(session_coroutine_id) do
@@ -680,12 +951,32 @@ function skynet.exit()
 	coroutine_yield "QUIT"
 end
 
+-- The env can't be changed once set, so the values are cached forever.
+-- A missing key is cached with the env version, and looked up again after any setenv.
+local env_cache = {}
+local env_missing = {}
+
 function skynet.getenv(key)
-	return (c.command("GETENV",key))
+	local v = env_cache[key]
+	if v then
+		return v
+	end
+	local version = c.envversion()
+	if env_missing[key] == version then
+		return
+	end
+	v = c.command("GETENV",key)
+	if v then
+		env_cache[key] = v
+		env_missing[key] = nil
+	else
+		env_missing[key] = version
+	end
+	return v
 end
 
 function skynet.setenv(key, value)
-	assert(c.command("GETENV",key) == nil, "Can't setenv exist key : " .. key)
+	assert(skynet.getenv(key) == nil, "Can't setenv exist key : " .. key)
 	c.command("SETENV",key .. " " ..value)
 end
 
@@ -699,6 +990,13 @@ function skynet.rawsend(addr, typename, msg, sz)
 	return c.send(addr, p.id, 0 , msg, sz)
 end
 
+-- Send the same message to every address in addrs. It's packed and copied once, and services that
+-- accept shared messages (lua services not in forward mode) read the same copy.
+function skynet.sendmulti(addrs, typename, ...)
+	local p = proto[typename]
+	return c.sendmulti(addrs, p.id, 0, p.pack(...))
+end
+
 skynet.genid = assert(c.genid)
 
 skynet.redirect = function(dest,source,typename,...)
@@ -708,6 +1006,17 @@ end
 skynet.pack = assert(c.pack)
 skynet.packstring = assert(c.packstring)
 skynet.unpack = assert(c.unpack)
+-- Like skynet.pack, but tables whose hash keys are all strings carry a shape id (interned in this
+-- process) instead of the key strings. skynet.unpack reads both. Messages packed this way must not
+-- leave the process (cluster, harbor, storage). Use it with rawsend/rawcall :
+-- skynet.rawsend(addr, "lua", skynet.packshape("move", { uid = uid, x = x, y = y }))
+skynet.packshape = assert(c.packshape)
+-- skynet.sharedbuffer(str) copies str once into a refcounted immutable buffer. skynet.pack sends it
+-- as a pointer, and the receiver's skynet.unpack returns a buffer object over the same memory;
+-- #buf is its size and buf:tostring([i [, j]]) copies out (a part of) it. The message holds the
+-- buffer until it is freed, so it may be unpacked any number of times, or never. Such a message
+-- can't be copied : packstring, sendmulti and multicast raise an error, sends to other nodes fail.
+skynet.sharedbuffer = assert(c.sharedbuffer)
 skynet.tostring = assert(c.tostring)
 skynet.trash = assert(c.trash)
 
@@ -733,10 +1042,54 @@ function skynet.call(addr, typename, ...)
 	local session = auxsend(addr, p.id , p.pack(...))
 	if session == nil then
 		error("call to invalid address " .. skynet.address(addr))
+	elseif session == false then
+		error("call to " .. skynet.address(addr) .. " rejected (package too large or message queue full)")
+	end
+	return p.unpack(yield_call(addr, session))
+end
+
+-- Like skynet.call, but the request expires in ti (in 1/100 sec) : if the callee has not begun to handle it by then,
+-- the callee drops it and the call raises an error, instead of doing the work for a caller that gave up. See skynet.ttl
+function skynet.callttl(ti, addr, typename, ...)
+	local tag = session_coroutine_tracetag[running_thread]
+	if tag then
+		c.trace(tag, "call", 2)
+		c.send(addr, skynet.PTYPE_TRACE, 0, tag)
+	end
+
+	local p = proto[typename]
+	local msg, sz = p.pack(...)
+	local last = c.intcommand("TTL", ti)
+	local ok, session = pcall(auxsend, addr, p.id, msg, sz)
+	c.intcommand("TTL", last)
+	if not ok then
+		error(session)
+	elseif session == nil then
+		error("call to invalid address " .. skynet.address(addr))
+	elseif session == false then
+		error("call to " .. skynet.address(addr) .. " rejected (package too large or message queue full)")
 	end
 	return p.unpack(yield_call(addr, session))
 end
 
+-- skynet.callttl for a packed message, returns the raw response as skynet.rawcall does
+function skynet.rawcallttl(ti, addr, typename, msg, sz)
+	local tag = session_coroutine_tracetag[running_thread]
+	if tag then
+		c.trace(tag, "call", 2)
+		c.send(addr, skynet.PTYPE_TRACE, 0, tag)
+	end
+	local p = proto[typename]
+	local last = c.intcommand("TTL", ti)
+	local ok, session = pcall(auxsend, addr, p.id, msg, sz)
+	c.intcommand("TTL", last)
+	if not ok then
+		error(session)
+	end
+	assert(session, "call to invalid address")
+	return yield_call(addr, session)
+end
+
 function skynet.rawcall(addr, typename, msg, sz)
 	local tag = session_coroutine_tracetag[running_thread]
 	if tag then
@@ -748,6 +1101,17 @@ function skynet.rawcall(addr, typename, msg, sz)
 	return yield_call(addr, session)
 end
 
+-- Wait for the response of a session from skynet.genid, sent by C code on behalf of this service
+-- ( see skynet.fileio ). Returns msg, sz ; the message is freed after the calling thread yields.
+function skynet.waitresponse(session)
+	session_id_coroutine[session] = running_thread
+	local succ, msg, sz = coroutine_yield "SUSPEND"
+	if not succ then
+		error "call failed"
+	end
+	return msg, sz
+end
+
 function skynet.tracecall(tag, addr, typename, msg, sz)
 	c.trace(tag, "tracecall begin")
 	c.send(addr, skynet.PTYPE_TRACE, 0, tag)
@@ -758,6 +1122,79 @@ function skynet.tracecall(tag, addr, typename, msg, sz)
 	return msg, sz
 end
 
+-- Call every address in addrs with the same request, packed once, and wait for all of them in the
+-- calling coroutine. Set addrs.timeout (in 1/100 sec) to stop waiting early.
+-- Returns resp, timeout : resp[i] is table.pack(results) of addrs[i], false if the call failed,
+-- or nil if it had not answered before the timeout.
+function skynet.callmulti(addrs, typename, ...)
+	local p = proto[typename]
+	local n = #addrs
+	local tag = session_coroutine_tracetag[running_thread]
+	if tag then
+		c.trace(tag, "callmulti", 2)
+		for i = 1, n do
+			c.send(addrs[i], skynet.PTYPE_TRACE, 0, tag)
+		end
+	end
+	local sessions = auxsendmulti(addrs, p.id, p.pack(...))
+	local resp = {}
+	local index = {}	-- session -> index in addrs
+	local pending = 0
+	for i = 1, n do
+		local session = sessions[i]
+		if session then
+			index[session] = i
+			watching_session[session] = addrs[i]
+			session_id_coroutine[session] = running_thread
+			pending = pending + 1
+		else
+			resp[i] = false
+		end
+	end
+	local timeout_session
+	if pending > 0 and addrs.timeout then
+		timeout_session = auxtimeout(addrs.timeout)
+		session_id_coroutine[timeout_session] = running_thread
+	end
+	while pending > 0 do
+		local succ, msg, sz, session = coroutine_yield "SUSPEND"
+		if session == timeout_session then
+			timeout_session = nil
+			for s in pairs(index) do
+				if resp[index[s]] == nil then
+					session_id_coroutine[s] = "BREAK"
+					watching_session[s] = nil
+				end
+			end
+			return resp, true
+		end
+		watching_session[session] = nil
+		local i = index[session]
+		if succ then
+			resp[i] = tpack(p.unpack(msg, sz))
+		else
+			resp[i] = false
+		end
+		pending = pending - 1
+	end
+	if timeout_session then
+		break_session(timeout_session)
+	end
+	return resp
+end
+
+-- When on, skynet.ret doesn't send at once : responses are sent when the current message (and the
+-- forks it wakes) has been handled, and the ones to the same local service go in one message.
+-- So responses may arrive after other messages sent meanwhile, and skynet.ret always returns true.
+function skynet.batchresponse(on)
+	if on then
+		response_batch = response_batch or {}
+	elseif response_batch then
+		flush_response()
+		response_batch = nil
+	end
+end
+
 function skynet.ret(msg, sz)
 	msg = msg or ""
 	local tag = session_coroutine_tracetag[running_thread]
@@ -774,14 +1211,24 @@ function skynet.ret(msg, sz)
 		return false	-- send don't need ret
 	end
 	local co_address = session_coroutine_address[running_thread]
-	local ret = c.send(co_address, skynet.PTYPE_RESPONSE, co_session, msg, sz)
-	if ret then
-		return true
-	elseif ret == false then
-		-- If the package is too large, returns false. so we should report error back
-		c.send(co_address, skynet.PTYPE_ERROR, co_session, "")
+	if response_batch then
+		local list = response_batch[co_address]
+		if list == nil then
+			local _, remote = c.harbor(co_address)
+			if not remote then
+				list = {}
+				response_batch[co_address] = list
+			end
+		end
+		if list then
+			local n = #list
+			list[n+1] = co_session
+			list[n+2] = msg
+			list[n+3] = sz or false
+			return true
+		end
 	end
-	return false
+	return send_response(co_address, co_session, msg, sz)
 end
 
 function skynet.context()
@@ -888,7 +1335,7 @@ function skynet.fork(func,...)
 		co = co_create(func)
 	else
 		local args = { ... }
-		co = co_create(function() func(table.unpack(args,1,n)) end)
+		co = co_create(function() func(table.unpack(args,1,n)) end, func)
 	end
 	local t = fork_queue.t + 1
 	fork_queue.t = t
@@ -898,19 +1345,110 @@ end
 
 local trace_source = {}
 
+local function dispatch_response(session, source, msg, sz)
+	local co = session_id_coroutine[session]
+	if co == "BREAK" then
+		session_id_coroutine[session] = nil
+	elseif co == nil then
+		unknown_response(session, source, msg, sz)
+	elseif type(co) == "table" then
+		-- skynet.tick, the session lives till it's canceled
+		if co.func then
+			co = co_create(co.func)
+			suspend(co, coroutine_resume(co))
+		end
+	else
+		local tag = session_coroutine_tracetag[co]
+		if tag then c.trace(tag, "resume") end
+		session_id_coroutine[session] = nil
+		suspend(co, coroutine_resume(co, true, msg, sz, session))
+	end
+end
+
+-- The message is freed once dispatch returns, so a deferred one is kept as a copy (freed after replay).
+-- owned : forward mode (see skynet.forward_type), the handler takes over the message and the core doesn't free it,
+-- so the original is freed here and the replayed copy is left to the handler.
+local function preempt_defer(prototype, msg, sz, session, source, owned)
+	if msg then
+		local copy = c.copy(msg, sz)
+		if owned then
+			c.trash(msg, sz)
+		end
+		msg = copy
+	end
+	preempt_pending[#preempt_pending+1] = { prototype, msg, sz, session, source, owned }
+end
+
+-- timeouts expired at the same tick, packed into one message by the timer (see TIMERBATCH)
+local function dispatch_timeout(msg, sz)
+	local err
+	local i = 0
+	while true do
+		local session = c.timersession(msg, sz, i)
+		if session == nil then
+			break
+		end
+		i = i + 1
+		if preempt_co then
+			-- the rest of the batch waits for the preempted coroutine
+			preempt_defer(1, nil, 0, session, 0)
+		else
+			local ok, e = pcall(dispatch_response, session, 0, nil, 0)
+			if not ok then
+				err = err and (err .. "\n" .. tostring(e)) or tostring(e)
+			end
+		end
+	end
+	if err then
+		error(err)
+	end
+end
+
+-- responses to several sessions from one service, packed into one message (see skynet.batchresponse)
+local function dispatch_response_batch(source, msg, sz)
+	local err
+	local offset = 0
+	while true do
+		local session, data, len, next_offset = c.responsebatch(msg, sz, offset)
+		if session == nil then
+			break
+		end
+		offset = next_offset
+		if preempt_co then
+			preempt_defer(1, data, len, session, source)
+		else
+			local ok, e = pcall(dispatch_response, session, source, data, len)
+			if not ok then
+				err = err and (err .. "\n" .. tostring(e)) or tostring(e)
+			end
+		end
+	end
+	if err then
+		error(err)
+	end
+end
+
+local memory_callback
+
+-- the service crossed its soft memory limit ( reason "soft" ) or the node is short of memory ( "node" )
+local function memory_pressure(reason)
+	local before = collectgarbage "count"
+	local mem = skynet.compact()
+	skynet.error(string.format("Memory pressure (%s) : collect %.2f M -> %.2f M", reason, before / 1024, mem / (1024 * 1024)))
+	if memory_callback then
+		skynet.fork(memory_callback, reason, mem)
+	end
+end
+
 local function raw_dispatch_message(prototype, msg, sz, session, source)
 	-- skynet.PTYPE_RESPONSE = 1, read skynet.h
 	if prototype == 1 then
-		local co = session_id_coroutine[session]
-		if co == "BREAK" then
-			session_id_coroutine[session] = nil
-		elseif co == nil then
-			unknown_response(session, source, msg, sz)
+		if session == 0 and source == 0 then
+			dispatch_timeout(msg, sz)
+		elseif session == 0 then
+			dispatch_response_batch(source, msg, sz)
 		else
-			local tag = session_coroutine_tracetag[co]
-			if tag then c.trace(tag, "resume") end
-			session_id_coroutine[session] = nil
-			suspend(co, coroutine_resume(co, true, msg, sz, session))
+			dispatch_response(session, source, msg, sz)
 		end
 	else
 		local p = proto[prototype]
@@ -918,6 +1456,8 @@ local function raw_dispatch_message(prototype, msg, sz, session, source)
 			if prototype == skynet.PTYPE_TRACE then
 				-- trace next request
 				trace_source[source] = c.tostring(msg,sz)
+			elseif prototype == skynet.PTYPE_MEMORY then
+				memory_pressure(c.tostring(msg,sz))
 			elseif session ~= 0 then
 				c.send(source, skynet.PTYPE_ERROR, session, "")
 			else
@@ -928,7 +1468,7 @@ local function raw_dispatch_message(prototype, msg, sz, session, source)
 
 		local f = p.dispatch
 		if f then
-			local co = co_create(f)
+			local co = co_create(f, false)	-- labeled by cpu_dispatch
 			session_coroutine_id[co] = session
 			session_coroutine_address[co] = source
 			local traceflag = p.trace
@@ -948,7 +1488,14 @@ local function raw_dispatch_message(prototype, msg, sz, session, source)
 					skynet.trace()
 				end
 			end
-			suspend(co, coroutine_resume(co, session,source, p.unpack(msg,sz)))
+			if cpustat then
+				suspend(co, cpu_dispatch(co, p.name, session, source, p.unpack(msg,sz)))
+			else
+				suspend(co, coroutine_resume(co, session,source, p.unpack(msg,sz)))
+			end
+		elseif init_pending then
+			-- the start function hasn't set the dispatch yet, keep the request till it returns
+			init_pending[#init_pending+1] = { prototype, c.tostring(msg,sz), session, source }
 		else
 			trace_source[source] = nil
 			if session ~= 0 then
@@ -960,31 +1507,74 @@ local function raw_dispatch_message(prototype, msg, sz, session, source)
 	end
 end
 
-function skynet.dispatch_message(...)
-	local succ, err = pcall(raw_dispatch_message,...)
-	while true do
+-- see skynet.gcpolicy
+local gc_idle	-- KB per collector step when the message queue is empty, nil : off
+local gc_busy	-- step anyway after so many messages without an empty queue
+local gc_count = 0
+
+local function gc_idle_step()
+	gc_count = gc_count + 1
+	if gc_count >= gc_busy or c.intcommand("STAT", "mqlen") == 0 then
+		gc_count = 0
+		collectgarbage("step", gc_idle)
+	end
+end
+
+local function join_error(succ, err, e)
+	if succ then
+		return false, tostring(e)
+	else
+		return false, tostring(err) .. "\n" .. tostring(e)
+	end
+end
+
+-- owned : the handler takes over msg (forward mode, see skynet.forward_type)
+function skynet.dispatch_message(prototype, msg, sz, session, source, owned)
+	if preempt_co then
+		if prototype ~= 1 or session ~= preempt_session then
+			preempt_defer(prototype, msg, sz, session, source, owned)
+			return
+		end
+		preempt_co = nil
+		preempt_session = nil
+	end
+	local succ, err = pcall(raw_dispatch_message, prototype, msg, sz, session, source)
+	if gc_idle then
+		gc_idle_step()
+	end
+	while not preempt_co do
 		if fork_queue.h > fork_queue.t then
 			-- queue is empty
 			fork_queue.h = 1
 			fork_queue.t = 0
-			break
-		end
-		-- pop queue
-		local h = fork_queue.h
-		local co = fork_queue[h]
-		fork_queue[h] = nil
-		fork_queue.h = h + 1
-
-		local fork_succ, fork_err = pcall(suspend,co,coroutine_resume(co))
-		if not fork_succ then
-			if succ then
-				succ = false
-				err = tostring(fork_err)
-			else
-				err = tostring(err) .. "\n" .. tostring(fork_err)
+			-- then the messages deferred by the time slice, in order
+			local m = tremove(preempt_pending, 1)
+			if m == nil then
+				break
+			end
+			local ok, e = pcall(raw_dispatch_message, m[1], m[2], m[3], m[4], m[5])
+			if m[2] and not m[6] then
+				c.trash(m[2], m[3])
+			end
+			if not ok then
+				succ, err = join_error(succ, err, e)
+			end
+		else
+			-- pop queue
+			local h = fork_queue.h
+			local co = fork_queue[h]
+			fork_queue[h] = nil
+			fork_queue.h = h + 1
+
+			local fork_succ, fork_err = pcall(suspend,co,coroutine_resume(co))
+			if not fork_succ then
+				succ, err = join_error(succ, err, fork_err)
 			end
 		end
 	end
+	if response_batch and next(response_batch) then
+		flush_response()
+	end
 	assert(succ, tostring(err))
 end
 
@@ -992,6 +1582,19 @@ function skynet.newservice(name, ...)
 	return skynet.call(".launcher", "lua" , "LAUNCH", "snlua", name, ...)
 end
 
+-- n services of the same name and arguments, started in parallel. returns an array of addresses
+function skynet.newservices(n, name, ...)
+	assert(math.type(n) == "integer" and n > 0)
+	return skynet.call(".launcher", "lua" , "LAUNCHN", n, "snlua", name, ...)
+end
+
+-- Start the services of a dependency graph, each one as soon as its dependencies are ready,
+-- the independent ones init in parallel. See STARTUP in service/service_mgr.lua for the graph.
+-- Returns { name = address }
+function skynet.startup(graph)
+	return assert(skynet.call(".service", "lua", "STARTUP", graph))
+end
+
 function skynet.uniqueservice(global, ...)
 	if global == true then
 		return assert(skynet.call(".service", "lua", "GLAUNCH", ...))
@@ -1059,6 +1662,22 @@ skynet.init = skynet_require.init
 -- skynet.pcall is deprecated, use pcall directly
 skynet.pcall = pcall
 
+local function replay_pending(failed)
+	local pending = init_pending
+	init_pending = nil
+	for _, m in ipairs(pending) do
+		local prototype, msg, session, source = m[1], m[2], m[3], m[4]
+		if not failed then
+			local ok, err = pcall(raw_dispatch_message, prototype, msg, #msg, session, source)
+			if not ok then
+				skynet.error(tostring(err))
+			end
+		elseif session ~= 0 then
+			c.send(source, skynet.PTYPE_ERROR, session, "")
+		end
+	end
+end
+
 function skynet.init_service(start)
 	local function main()
 		skynet_require.init_all()
@@ -1067,6 +1686,9 @@ function skynet.init_service(start)
 	local ok, err = xpcall(main, traceback)
 	if not ok then
 		skynet.error("init service failed: " .. tostring(err))
+		if init_pending then
+			replay_pending(true)
+		end
 		skynet.send(".launcher","lua", "ERROR")
 		skynet.exit()
 	else
@@ -1074,11 +1696,16 @@ function skynet.init_service(start)
 	end
 end
 
+-- Requests come before the start function returns ( the first message of a lazy service, for example ) are
+-- dispatched after it, if their dispatch function is not set yet.
 function skynet.start(start_func)
 	c.callback(skynet.dispatch_message)
+	c.command("TIMERBATCH")
+	init_pending = {}
 	init_thread = skynet.timeout(0, function()
 		skynet.init_service(start_func)
 		init_thread = nil
+		replay_pending()
 	end)
 end
 
@@ -1090,13 +1717,26 @@ function skynet.mqlen()
 	return c.intcommand("STAT", "mqlen")
 end
 
+-- skynet.stat "gc" returns a table : the bytes allocated by the VM (total and per second),
+-- and the count, total and worst time (in seconds) of the collector steps and the full collections,
+-- and the bytes freed by the background thread with lua_bgsweep
+-- skynet.stat "strpool" returns the count and the bytes of the strings in the pool, see skynet.poolstring
 function skynet.stat(what)
+	if what == "gc" then
+		return require("skynet.vm").gcstat()
+	elseif what == "preempt" then
+		return preempt_count
+	elseif what == "strpool" then
+		return require("skynet.vm").poolstat()
+	end
 	return c.intcommand("STAT", what)
 end
 
 local function task_traceback(co)
 	if co == "BREAK" then
 		return co
+	elseif type(co) == "table" then
+		return string.format("TICK %s : %s", co.interval, tostring(co.func))
 	elseif timeout_traceback and timeout_traceback[co] then
 		return timeout_traceback[co]
 	else
@@ -1173,11 +1813,160 @@ function skynet.term(service)
 	return _error_dispatch(0, service)
 end
 
-function skynet.memlimit(bytes)
-	debug.getregistry().memlimit = bytes
+local gc_policy
+
+-- A task running longer than ms in one resume yields by itself (0 turns it off), and the service is requeued
+-- behind the others. The messages came before it resumes are deferred, so handlers are still atomic to each other.
+-- The default is lua_timeslice (or lua_timeslice_<name>) in config. Returns the previous value.
+function skynet.timeslice(ms)
+	return require("skynet.vm").timeslice(ms)
+end
+
+-- Set the collector of this service, the fields are optional :
+--   mode = "generational" ( minormul, majormul ) or "incremental" ( pause, stepmul, stepsize ),
+--   idle = KB : stop the automatic collector, and step it by idle KB when the message queue is empty,
+--   busy = N : with idle, step after N messages even if the queue never gets empty (default 100).
+-- Returns the previous policy.
+function skynet.gcpolicy(policy)
+	if gc_policy == nil then
+		-- see lua_gc in service_snlua.c
+		gc_policy = { mode = skynet.getenv "lua_gc" == "incremental" and "incremental" or "generational" }
+	end
+	local old = gc_policy
+	if policy == nil then
+		return old
+	end
+	local mode = policy.mode or old.mode
+	if mode == "generational" then
+		collectgarbage("generational", policy.minormul or 0, policy.majormul or 0)
+	elseif mode == "incremental" then
+		collectgarbage("incremental", policy.pause or 0, policy.stepmul or 0, policy.stepsize or 0)
+	else
+		error("Invalid gc mode " .. tostring(mode))
+	end
+	local idle = policy.idle
+	if idle and idle > 0 then
+		gc_idle = idle
+		gc_busy = policy.busy or 100
+		gc_count = 0
+		collectgarbage "stop"
+	elseif gc_idle then
+		gc_idle = nil
+		collectgarbage "restart"
+	end
+	gc_policy = { mode = mode, idle = gc_idle, busy = gc_idle and gc_busy }
+	for k, v in pairs(policy) do
+		if gc_policy[k] == nil then
+			gc_policy[k] = v
+		end
+	end
+	return old
+end
+
+-- Put short strings (or the string keys of tables) into the string pool of the process. Every service
+-- creating one of them later references the pooled copy instead of allocating its own, and the pooled
+-- copies compare equal to the old ones without comparing the bytes. The pool is immutable and lives until
+-- the process exits, so use it for the names shared by many services (protocol fields, commands, config keys).
+-- The sproto schemas saved by sprotoloader, the keys of sharetable and datasheet are pooled automatically.
+-- Returns the number of strings in the pool among them.
+function skynet.poolstring(...)
+	return require("skynet.vm").poolstring(...)
+end
+
+-- Collect all garbage, drop the pooled coroutines and give the free memory of the VM back to the allocator
+-- ( with lua_arena = "service", the pages go back to the system ). Returns the bytes the VM still uses.
+function skynet.compact()
+	while #coroutine_pool > 0 do
+		coroutine.close(tremove(coroutine_pool))
+	end
+	return require("skynet.vm").compact()
+end
+
+local hibernate_interval	-- ticks, nil : off
+local hibernate_running
+
+-- Compact the service once it has received no message for seconds ( checked every seconds, so it takes
+-- up to twice as long ), again after each busy period. The VM stays, the next message is dispatched as usual.
+-- hibernate(nil) turns it off.
+function skynet.hibernate(seconds)
+	hibernate_interval = seconds and math.max(1, math.floor(seconds * 100))
+	if hibernate_interval == nil or hibernate_running then
+		return
+	end
+	hibernate_running = true
+	local last = c.intcommand("STAT", "message")
+	local compacted = false
+	local function check()
+		if hibernate_interval == nil then
+			hibernate_running = nil
+			return
+		end
+		local count = c.intcommand("STAT", "message")
+		-- only the timer of the last check came
+		if count - last == 1 then
+			if not compacted then
+				compacted = true
+				skynet.compact()
+			end
+		else
+			compacted = false
+		end
+		last = count
+		skynet.timeout(hibernate_interval, check)
+	end
+	skynet.timeout(hibernate_interval, check)
+end
+
+-- Set the memory limit of this service in bytes before skynet.start, instead of the config memlimit_<name> or memlimit
+-- ( "hard[,soft]", with an optional K/M/G suffix ). Allocations fail above the hard limit ; above the soft limit,
+-- the service collects all garbage once and calls the memory callback, again after it drops below 7/8 of it.
+function skynet.memlimit(bytes, soft)
+	local reg = debug.getregistry()
+	reg.memlimit = bytes
+	reg.memsoft = soft
 	skynet.memlimit = nil	-- set only once
 end
 
+-- f(reason, bytes) runs in a new coroutine after an emergency collection, bytes is the memory the VM still uses.
+-- reason is "soft" for the soft limit, or "node" when the node uses more than the config memory_governor
+-- and this service is one of the largest. Release caches here. Returns the previous callback.
+function skynet.memory_callback(f)
+	local old = memory_callback
+	memory_callback = f
+	return old
+end
+
+-- Turn on (flag true) or off (flag false) the cpu accounting of the coroutines, nil keeps it.
+-- Returns nil when it's off, or the statistics and the tasks not finished yet :
+--	{ [label] = { cpu = microseconds, resume = n, task = n } } , { [thread] = { label, cpu = microseconds, resume = n } }
+-- A request is labeled by its protocol and the first argument of the message if it's a name ( "lua.GET" ),
+-- the others ( fork, timeout ) by the function ( "service/foo.lua:12" ). The time is the thread cpu time
+-- measured around every resume, the nested resumes are not counted in the outer one.
+function skynet.cpustat(flag)
+	if flag == true then
+		if not cpustat then
+			cpustat = {}
+			cpu_child = 0
+		end
+	elseif flag == false then
+		cpustat = nil
+	end
+	if not cpustat then
+		return
+	end
+	local pooled = {}
+	for _, co in ipairs(coroutine_pool) do
+		pooled[co] = true
+	end
+	local tasks = {}
+	for co, s in pairs(cpu_co) do
+		if not pooled[co] and coroutine.status(co) == "suspended" then
+			tasks[co] = { cpu_label[co] or "unknown", cpu = s.cpu, resume = s.resume }
+		end
+	end
+	return cpustat, tasks
+end
+
 -- Inject internal debug framework
 local debug = require "skynet.debug"
 debug.init(skynet, {
@@ -0,0 +1,40 @@
+local core = require "skynet.aoi.core"
+
+--[[
+	Area of interest in a grid, the sets are computed and the packets are sent in C.
+
+	local aoi = require "skynet.aoi"
+	local space = aoi.new { width = 4096, height = 4096, cell = 32, view = 64 }
+	space:enter(id, x, y, fd)	-- fd is the socket of the client (optional), return #enter
+	space:move(id, x, y)	-- return #enter, #leave, #move
+	space:leave(id)	-- return #leave
+	space:setfd(id, fd) ; space:get(id)	-- x, y, fd
+	space:view(id [, t])	-- t, n : the ids of the entities seeing id
+
+	An entity sees the others within view (rounded up to whole cells) around its cell, and they see it.
+	Each enter/move/leave keeps three sets until the next one:
+		"enter" : the entities seeing each other from now on
+		"leave" : the entities not seeing each other any more
+		"move" : the entities seeing it before and after
+		"view" : enter + move
+	space:ids(set [, t])	-- t, n : the ids of a set, t is reused to avoid the garbage
+	space:send(set, msg)	-- send msg (a string) to the sockets of a set
+	space:broadcast(id, msg)	-- send msg to the sockets of the entities seeing id
+
+	send and broadcast copy msg once for all the sockets (see socket.broadcast), so msg must be
+	framed as the clients expect, ie. string.pack(">s2", msg) for the gate.
+
+	space:move(id, x, y)
+	space:send("move", pack_move(id, x, y))
+	space:send("enter", pack_appear(id))
+	space:send("leave", pack_disappear(id))
+	for _, other in ipairs(space:ids("enter", tmp)) do ... end	-- tell id the new entities
+]]
+
+local aoi = {}
+
+function aoi.new(conf)
+	return core.new(conf.width, conf.height, conf.cell, conf.view or conf.cell)
+end
+
+return aoi
@@ -1,4 +1,5 @@
 local skynet = require "skynet"
+local core = require "skynet.cluster.core"
 
 local clusterd
 local cluster = {}
@@ -42,8 +43,21 @@ end
 
 setmetatable(task_queue, { __index = get_queue } )
 
+-- clusterd publishes the senders of the connected nodes in a route table shared by the process
+local function route_sender(node)
+	if rawget(task_queue, node) then
+		-- the queued requests go first
+		return
+	end
+	local s = core.route("sender", node)
+	if s then
+		sender[node] = s
+	end
+	return s
+end
+
 local function get_sender(node)
-	local s = sender[node]
+	local s = sender[node] or route_sender(node)
 	if not s then
 		local q = task_queue[node]
 		local task = coroutine.running()
@@ -59,7 +73,7 @@ cluster.get_sender = get_sender
 
 function cluster.call(node, address, ...)
 	-- skynet.pack(...) will free by cluster.core.packrequest
-	local s = sender[node]
+	local s = sender[node] or route_sender(node)
 	if not s then
 		local task = skynet.packstring(address, ...)
 		return skynet.call(get_sender(node), "lua", "req", repack(skynet.unpack(task)))
@@ -67,16 +81,62 @@ function cluster.call(node, address, ...)
 	return skynet.call(s, "lua", "req", address, skynet.pack(...))
 end
 
+-- Like cluster.call, but raises an error after ti (in 1/100 sec). The rest of the deadline goes with the request :
+-- the node rejects it if it has expired before being handled, and passes it to the callee as skynet.callttl does.
+-- When the caller gives up, the node is told to cancel the request ; the work already begun is not stopped.
+function cluster.callttl(ti, node, address, ...)
+	local s = sender[node] or route_sender(node)
+	if not s then
+		local start = skynet.now()
+		local task = skynet.packstring(address, ...)
+		s = get_sender(node)
+		ti = ti - (skynet.now() - start)
+		if ti <= 0 then
+			error(string.format("cluster call %s timeout", node))
+		end
+		return skynet.call(s, "lua", "reqttl", ti, repack(skynet.unpack(task)))
+	end
+	return skynet.call(s, "lua", "reqttl", ti, address, skynet.pack(...))
+end
+
 function cluster.send(node, address, ...)
 	-- push is the same with req, but no response
-	local s = sender[node]
+	local s = sender[node] or route_sender(node)
 	if not s then
 		table.insert(task_queue[node], skynet.packstring(address, ...))
 	else
-		skynet.send(sender[node], "lua", "push", address, skynet.pack(...))
+		skynet.send(s, "lua", "push", address, skynet.pack(...))
 	end
 end
 
+-- Call address in node with the arguments ... , and send the data returned by iter() (a string each time, nil at the end)
+-- as a stream. The callee gets a stream object as the last argument and reads the chunks by cluster.readstream,
+-- so neither side holds the whole data in memory. The caller waits when the callee falls behind by a window of chunks.
+function cluster.stream(node, address, iter, ...)
+	local s = get_sender(node)
+	local session = skynet.call(s, "lua", "streambegin", address, skynet.pack(...))
+	local ok, err = pcall(function()
+		while true do
+			local chunk = iter()
+			if chunk == nil then
+				break
+			end
+			skynet.call(s, "lua", "streamchunk", session, chunk)
+		end
+	end)
+	-- always end the stream, the callee may be waiting for it
+	local ret = table.pack(skynet.call(s, "lua", "streamend", session))
+	if not ok then
+		error(err)
+	end
+	return table.unpack(ret, 1, ret.n)
+end
+
+-- Read the next chunk of a stream, nil at the end. It can be used as : for chunk in cluster.readstream, stream do ... end
+function cluster.readstream(stream)
+	return skynet.call(stream.agent, "lua", "read", stream.session)
+end
+
 function cluster.open(port, maxclient)
 	if type(port) == "string" then
 		return skynet.call(clusterd, "lua", "listen", port, nil, maxclient)
@@ -2,17 +2,105 @@ local skynet = require "skynet"
 
 local datacenter = {}
 
-function datacenter.get(...)
-	return skynet.call("DATACENTER", "lua", "QUERY", ...)
+local shards
+
+-- The shard (1..n) of a top-level key, datacenterd uses it too for the requests from old clients.
+-- A float key with an integral value is the same table key as the integer, so it goes to the same shard.
+function datacenter.shard_index(n, key)
+	if type(key) == "string" then
+		-- FNV-1a
+		local h = 2166136261
+		for i = 1, #key do
+			h = ((h ~ key:byte(i)) * 16777619) & 0xffffffff
+		end
+		return h % n + 1
+	end
+	key = math.tointeger(key)
+	if key then
+		return key % n + 1
+	else
+		return 1
+	end
 end
 
-function datacenter.set(...)
-	return skynet.call("DATACENTER", "lua", "UPDATE", ...)
+-- keys are hashed across the shards by the top-level key
+local function shard(key)
+	if shards == nil then
+		shards = skynet.call("DATACENTER", "lua", "SHARDS")
+	end
+	if key == nil or shards[2] == nil then
+		return shards[1]
+	end
+	return shards[datacenter.shard_index(#shards, key)]
 end
 
-function datacenter.wait(...)
-	return skynet.call("DATACENTER", "lua", "WAIT", ...)
+function datacenter.get(key, ...)
+	return skynet.call(shard(key), "lua", "QUERY", key, ...)
 end
 
-return datacenter
+function datacenter.set(key, ...)
+	return skynet.call(shard(key), "lua", "UPDATE", key, ...)
+end
+
+function datacenter.wait(key, ...)
+	return skynet.call(shard(key), "lua", "WAIT", key, ...)
+end
+
+-- local read cache: cache[addr][key] is the whole subtree of a top-level key
+local cache = {}
+
+local function query(db, key, ...)
+	if db == nil or key == nil then
+		return db
+	else
+		return query(db[key], ...)
+	end
+end
+
+local NIL = {}
+
+-- one long-poll per shard invalidates the cached keys changed on it
+local function watch(addr, c, version)
+	while true do
+		local v, keys = skynet.call(addr, "lua", "WATCH", version)
+		version = v
+		if keys == true then
+			for k in pairs(c) do
+				c[k] = nil
+			end
+		else
+			for _, k in ipairs(keys) do
+				c[k] = nil
+			end
+		end
+	end
+end
 
+-- Like datacenter.get, but keeps the top-level key in a local cache which is
+-- invalidated when it changes. The returned tables are shared by the cache,
+-- don't modify them.
+function datacenter.cached(key, ...)
+	local addr = shard(key)
+	local c = cache[addr]
+	if c == nil then
+		c = {}
+		cache[addr] = c
+		local version = skynet.call(addr, "lua", "CQUERY")
+		skynet.fork(watch, addr, c, version)
+	end
+	local d = c[key]
+	if d == nil then
+		local _
+		_, d = skynet.call(addr, "lua", "CQUERY", key)
+		if d == nil then
+			d = NIL
+		end
+		c[key] = d
+	end
+	if d == NIL then
+		return
+	end
+	return query(d, ...)
+end
+
+return datacenter
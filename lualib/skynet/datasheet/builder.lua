@@ -5,8 +5,8 @@ local service = require "skynet.service"
 
 local builder = {}
 
-local cache = {}
-local dataset = {}
+local cache = {}	-- pointer : string or the size of mapped file, keep data alive until collected
+local dataset = {}	-- name : { pointer = pointer, id = file id }
 local address
 
 local unique_id = 0
@@ -18,50 +18,91 @@ end
 local function monitor(pointer)
 	skynet.fork(function()
 		skynet.call(address, "lua", "collect", pointer)
-		for k,v in pairs(cache) do
-			if v == pointer then
-				cache[k] = nil
-				return
-			end
+		local v = cache[pointer]
+		cache[pointer] = nil
+		if type(v) == "number" then
+			core.unmap(pointer, v)
 		end
 	end)
 end
 
-local function dumpsheet(v)
+local dumpopts	-- see builder.option
+
+local function dumpsheet(v, indexes)
 	if type(v) == "string" then
 		return v
 	else
-		return dump.dump(v)
+		return dump.dump(v, indexes, dumpopts)
 	end
 end
 
-function builder.new(name, v)
-	assert(dataset[name] == nil)
-	local datastring = unique_string(dumpsheet(v))
-	local pointer = core.stringpointer(datastring)
-	skynet.call(address, "lua", "update", name, pointer)
-	cache[datastring] = pointer
-	dataset[name] = datastring
-	monitor(pointer)
+local function lastversion(name)
+	local d = assert(dataset[name])
+	local v = cache[d.pointer]
+	if type(v) == "number" then
+		return core.tostring(d.pointer, v)
+	end
+	return v
 end
 
-function builder.update(name, v)
-	local lastversion = assert(dataset[name])
-	local newversion = dumpsheet(v)
-	local diff = unique_string(dump.diff(lastversion, newversion))
-	local pointer = core.stringpointer(diff)
+local function publish(name, pointer, data, id)
+	-- the field names are shared by all the readers, see skynet.poolstring
+	core.poolkeys(pointer)
 	skynet.call(address, "lua", "update", name, pointer)
-	cache[diff] = pointer
-	local lp = assert(cache[lastversion])
-	skynet.send(address, "lua", "release", lp)
-	dataset[name] = diff
+	cache[pointer] = data
+	local last = dataset[name]
+	if last then
+		skynet.send(address, "lua", "release", last.pointer)
+	end
+	dataset[name] = { pointer = pointer, id = id }
 	monitor(pointer)
 end
 
-function builder.compile(v)
-	return dump.dump(v)
+-- indexes declares the secondary indexes, see skynet.datasheet.dump
+function builder.new(name, v, indexes)
+	assert(dataset[name] == nil)
+	local datastring = unique_string(dumpsheet(v, indexes))
+	publish(name, core.stringpointer(datastring), datastring)
+end
+
+function builder.update(name, v, indexes)
+	local newversion = dumpsheet(v, indexes)
+	local diff = unique_string(dump.diff(lastversion(name), newversion))
+	publish(name, core.stringpointer(diff), diff)
+end
+
+-- Map a file made by skynet.datasheet.dump.save, create or update the datasheet without parsing it.
+-- Updating is O(1) only if the file is a diff of the current version, otherwise it's diffed here.
+function builder.load(name, filename)
+	local pointer, size, id, base = core.mmap(filename)
+	local last = dataset[name]
+	if last == nil or last.id == base then
+		publish(name, pointer, size, id)
+	else
+		local ok, diff = pcall(dump.diff, lastversion(name), core.tostring(pointer, size))
+		core.unmap(pointer, size)
+		assert(ok, diff)
+		diff = unique_string(diff)
+		publish(name, core.stringpointer(diff), diff)
+	end
+end
+
+function builder.compile(v, indexes, opts)
+	return dump.dump(v, indexes, opts or dumpopts)
 end
 
+-- How the strings of the datasheets built later are stored :
+--	{ strpool = true } : in the string pool of the node, the same string is stored once for all the datasheets
+--		(of all the builders). The pool never shrinks, use it when the strings are mostly stable across updates.
+--	{ compress = true } : the common prefixes (such as the directories of paths) are stored once in each datasheet.
+-- Reading a string never decompresses the datasheet. The strings are stored in place by default.
+function builder.option(opts)
+	dumpopts = opts
+end
+
+-- The number of strings and the bytes in the string pool
+builder.poolstat = core.poolstat
+
 local function datasheet_service()
 
 local skynet = require "skynet"
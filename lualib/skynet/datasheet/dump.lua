@@ -1,11 +1,25 @@
 --[[ file format
+file :
+  char[4] "SKDS"
+  int32 format (1)
+  int32 id
+  int32 base id (0 for a full build)
+  int32 size of document
+  document
+
 document :
-  int32 strtbloffset
+  int32 strtbloffset (the high bits are the flags of strings)
   int32 n
   int32*n index table
   table*n
   strings
 
+strings : the string values are offsets in it, each is a zero terminated string, or by flags
+  0x80000000 pool : the string values are ids of the string pool shared by the node (skynet.datasheet.core.intern),
+    and there are no strings in the document. Only for the documents built in memory.
+  0x40000000 prefix : an entry starting with \1 is an int32 offset of its prefix (a plain entry) and the suffix,
+    \2 escapes an entry starting with \1 or \2.
+
 table:
   int32 array
   int32 dict
@@ -31,6 +45,15 @@ type: (enum)
   3 boolean
   4 table
   5 string
+  6 secondary indexes (table index, only the first kvpair of the root)
+
+secondary indexes : { name = index table, ... }
+
+index table : { keys, starts, records, slots }
+  keys : sorted keys, integers before strings
+  starts : records[starts[i] .. starts[i+1]-1] are the records of keys[i]
+  records : table index of the records
+  slots : hash slots (position of key, 0 for empty), 0 for a sorted only index
 ]]
 
 local ctd = {}
@@ -38,17 +61,172 @@ local math = math
 local table = table
 local string = string
 
-function ctd.dump(root)
+-- The same hash in lua-datasheet.c
+local function hashkey(k)
+	if math.type(k) == "integer" then
+		return (k * 2654435761) & 0xffffffff
+	end
+	local h = 2166136261
+	for i = 1, #k do
+		h = ((h ~ k:byte(i)) * 16777619) & 0xffffffff
+	end
+	return h
+end
+
+local function keyless(a, b)
+	local ia, ib = math.type(a) == "integer", math.type(b) == "integer"
+	if ia ~= ib then
+		return ia
+	end
+	return a < b
+end
+
+local STRTBL_POOL = 0x80000000
+local STRTBL_PREFIX = 0x40000000
+local STRTBL_OFFSET = 0x3fffffff
+
+-- Common prefixes (up to a separator) of the paths and keys, shared by at least two strings
+local PREFIX_MIN = 6
+local SEPARATOR = "[/%.:_%-]"
+
+-- the longest prefix in the set
+local function prefixof(s, prefixes)
+	local pos = #s
+	while pos >= PREFIX_MIN do
+		pos = s:find(SEPARATOR .. "[^/%.:_%-]*$", 1)
+		if not pos then
+			return
+		end
+		local p = s:sub(1, pos)
+		if prefixes[p] then
+			return p
+		end
+		s = s:sub(1, pos - 1)
+		pos = #s
+	end
+end
+
+local function collect_prefix(root, indexes)
+	local count = {}
+	local visited = {}
+	local function add(s)
+		for pos in s:gmatch("()" .. SEPARATOR) do
+			if pos >= PREFIX_MIN then
+				local p = s:sub(1, pos)
+				count[p] = (count[p] or 0) + 1
+			end
+		end
+	end
+	local function walk(t)
+		if visited[t] then
+			return
+		end
+		visited[t] = true
+		for k, v in pairs(t) do
+			if type(k) == "string" and not visited[k] then
+				visited[k] = true
+				add(k)
+			end
+			if type(v) == "string" then
+				if not visited[v] then
+					visited[v] = true
+					add(v)
+				end
+			elseif type(v) == "table" then
+				walk(v)
+			end
+		end
+	end
+	walk(root)
+	for name in pairs(indexes or {}) do
+		add(name)
+	end
+	local prefix = {}
+	for p, n in pairs(count) do
+		if n > 1 then
+			prefix[p] = true
+		end
+	end
+	return prefix
+end
+
+-- indexes : { name = { from = key or { key path from root } , field = field name, kind = "hash" or "sorted" } }
+-- opts : { strpool = true } put the strings in the string pool of the node (only for skynet.datasheet.builder),
+--	or { compress = true } store the common prefixes of the strings once in the document
+function ctd.dump(root, indexes, opts)
 	local doc = {
 		table_n = 0,
 		table = {},
 		strings = {},
 		offset = 0,
+		ref = {},	-- table : table index
 	}
+	local strpool = opts and opts.strpool
+	local compress = opts and opts.compress and not strpool
+	local intern = strpool and require("skynet.datasheet.core").intern
+	local prefixes = compress and collect_prefix(root, indexes)
+	local plain = {}	-- the offsets of plain entries, for the prefixes
+	local function encode_table(array_n, types, array, kvs)
+		local typeset = table.concat(types)
+		local align = string.rep("\0", (4 - #typeset & 3) & 3)
+		local tmp = {
+			string.pack("<i4i4", array_n, #kvs),
+			typeset,
+			align,
+			table.concat(array),
+			table.concat(kvs),
+		}
+		return table.concat(tmp)
+	end
+	local function new_table(array_n, types, array, kvs)
+		local index = doc.table_n + 1
+		doc.table_n = index
+		doc.table[index] = encode_table(array_n, types, array, kvs)
+		return index
+	end
+	local function add_entry(entry)
+		local offset = doc.offset
+		doc.offset = offset + #entry
+		table.insert(doc.strings, entry)
+		return offset
+	end
+	local function plain_offset(p)
+		local offset = plain[p]
+		if not offset then
+			offset = add_entry(p .. "\0")
+			plain[p] = offset
+		end
+		return offset
+	end
+	local function string_offset(v)
+		local offset = doc.strings[v]
+		if offset then
+			return offset
+		end
+		if strpool then
+			offset = intern(v)
+		elseif compress then
+			local c = v:byte(1)
+			local p = prefixof(v, prefixes)
+			if p and p:byte(1) ~= 1 and p:byte(1) ~= 2 then
+				offset = add_entry(string.pack("<Bi4z", 1, plain_offset(p), v:sub(#p + 1)))
+			elseif c == 1 or c == 2 then
+				offset = add_entry("\2" .. v .. "\0")
+			else
+				offset = plain_offset(v)
+			end
+		else
+			offset = add_entry(v .. "\0")
+		end
+		doc.strings[v] = offset
+		return offset
+	end
+	local dump_indexes
 	local function dump_table(t)
 		local index = doc.table_n + 1
 		doc.table_n = index
 		doc.table[index] = false	-- place holder
+		doc.ref[t] = index
 		local array_n = 0
 		local array = {}
 		local kvs = {}
@@ -71,14 +249,7 @@ function ctd.dump(root)
 					return '\3', "\0\0\0\0"
 				end
 			elseif t == "string" then
-				local offset = doc.strings[v]
-				if not offset then
-					offset = doc.offset
-					doc.offset = offset + #v + 1
-					doc.strings[v] = offset
-					table.insert(doc.strings, v)
-				end
-				return '\5', string.pack("<I4", offset)
+				return '\5', string.pack("<I4", string_offset(v))
 			else
 				error ("Unsupport value " .. tostring(v))
 			end
@@ -98,19 +269,120 @@ function ctd.dump(root)
 				assert(ik and ik > 0 and ik <= array_n)
 			end
 		end
-		-- encode table
-		local typeset = table.concat(types)
-		local align = string.rep("\0", (4 - #typeset & 3) & 3)
-		local tmp = {
-			string.pack("<i4i4", array_n, #kvs),
-			typeset,
-			align,
-			table.concat(array),
-			table.concat(kvs),
-		}
-		doc.table[index] = table.concat(tmp)
+		if t == root and indexes then
+			-- all the records are dumped, the indexes is the first kvpair of root
+			table.insert(types, array_n + 1, '\6')
+			table.insert(kvs, 1, string.pack("<I4i4", string_offset "", dump_indexes() - 1))
+		end
+		doc.table[index] = encode_table(array_n, types, array, kvs)
 		return index
 	end
+	local function int_table(list)
+		local types = {}
+		local values = {}
+		for i, v in ipairs(list) do
+			types[i] = '\1'
+			values[i] = string.pack("<i4", v)
+		end
+		return new_table(#list, types, values, {})
+	end
+	local function dump_index(name, spec)
+		local c = root
+		local from = spec.from
+		if type(from) ~= "table" then
+			from = { from }
+		end
+		for _, k in ipairs(from) do
+			c = c[k]
+			assert(type(c) == "table", "Invalid index from " .. name)
+		end
+		local field = assert(spec.field, "Need index field")
+		local keys = {}
+		local group = {}
+		for _, record in pairs(c) do
+			if type(record) == "table" then
+				local k = record[field]
+				if k ~= nil then
+					k = math.tointeger(k) or k
+					if math.type(k) == "integer" then
+						assert(k <= 0x7FFFFFFF and k >= -(0x7FFFFFFF+1), "Index key out of range")
+					elseif type(k) ~= "string" then
+						error (string.format("Invalid index key %s in %s", tostring(k), name))
+					end
+					local g = group[k]
+					if not g then
+						g = {}
+						group[k] = g
+						table.insert(keys, k)
+					end
+					table.insert(g, doc.ref[record] - 1)
+				end
+			end
+		end
+		table.sort(keys, keyless)
+		local key_types = {}
+		local key_values = {}
+		local starts = {}
+		local records = {}
+		for i, k in ipairs(keys) do
+			if type(k) == "string" then
+				key_types[i], key_values[i] = '\5', string.pack("<I4", string_offset(k))
+			else
+				key_types[i], key_values[i] = '\1', string.pack("<i4", k)
+			end
+			starts[i] = #records + 1
+			local g = group[k]
+			table.sort(g)
+			table.move(g, 1, #g, #records + 1, records)
+		end
+		starts[#keys + 1] = #records + 1
+		local record_types = {}
+		for i = 1, #records do
+			record_types[i] = '\4'
+			records[i] = string.pack("<i4", records[i])
+		end
+		local slots = 0
+		local kind = spec.kind or "hash"
+		if kind == "hash" then
+			local n = 1
+			while n < #keys * 2 do
+				n = n * 2
+			end
+			local slot = {}
+			for i = 1, n do
+				slot[i] = 0
+			end
+			for i, k in ipairs(keys) do
+				local h = hashkey(k) & (n - 1)
+				while slot[h + 1] ~= 0 do
+					h = (h + 1) & (n - 1)
+				end
+				slot[h + 1] = i
+			end
+			slots = int_table(slot) - 1
+		else
+			assert(kind == "sorted", "Invalid index kind")
+		end
+		local keys_index = new_table(#keys, key_types, key_values, {}) - 1
+		local starts_index = int_table(starts) - 1
+		local records_index = new_table(#records, record_types, records, {}) - 1
+		return new_table(4, { '\4', '\4', '\4', slots == 0 and '\1' or '\4' },
+			{ string.pack("<i4i4i4i4", keys_index, starts_index, records_index, slots) }, {})
+	end
+	function dump_indexes()
+		local names = {}
+		for name in pairs(indexes) do
+			table.insert(names, name)
+		end
+		table.sort(names)
+		local types = {}
+		local kvs = {}
+		for i, name in ipairs(names) do
+			types[i] = '\4'
+			kvs[i] = string.pack("<I4i4", string_offset(name), dump_index(name, indexes[name]) - 1)
+		end
+		return new_table(0, types, {}, kvs)
+	end
 	dump_table(root)
 	-- encode document
 	local index = {}
@@ -119,22 +391,50 @@ function ctd.dump(root)
 		index[i] = string.pack("<I4", offset)
 		offset = offset + #v
 	end
+	local strtbl = 4 + 4 + 4 * doc.table_n + offset
+	assert(strtbl <= STRTBL_OFFSET, "The datasheet is too large")
+	if strpool then
+		strtbl = strtbl | STRTBL_POOL
+	elseif compress then
+		strtbl = strtbl | STRTBL_PREFIX
+	end
 	local tmp = {
-		string.pack("<I4", 4 + 4 + 4 * doc.table_n + offset),
+		string.pack("<I4", strtbl),
 		string.pack("<I4", doc.table_n),
 		table.concat(index),
 		table.concat(doc.table),
-		table.concat(doc.strings, "\0"),
-		"\0",
+		table.concat(doc.strings),
 	}
 	return table.concat(tmp)
 end
 
+-- returns function(string offset) : string
+local function string_reader(v, stringtbl)
+	if stringtbl & STRTBL_POOL ~= 0 then
+		return require("skynet.datasheet.core").poolstring
+	end
+	local prefix = stringtbl & STRTBL_PREFIX ~= 0
+	stringtbl = (stringtbl & STRTBL_OFFSET) + 1
+	return function(sindex)
+		local pos = stringtbl + sindex
+		if prefix then
+			local c = v:byte(pos)
+			if c == 1 then
+				local p, suffix = string.unpack("<i4z", v, pos + 1)
+				return string.unpack("z", v, stringtbl + p) .. suffix
+			elseif c == 2 then
+				pos = pos + 1
+			end
+		end
+		return (string.unpack("z", v, pos))
+	end
+end
+
 function ctd.undump(v)
 	local stringtbl, n = string.unpack("<I4I4",v)
 	local index = { string.unpack("<" .. string.rep("I4", n), v, 9) }
 	local header = 4 + 4 + 4 * n + 1
-	stringtbl = stringtbl + 1
+	local getstring = string_reader(v, stringtbl)
 	local tblidx = {}
 	local function decode(n)
 		local toffset = index[n+1] + header
@@ -156,7 +456,9 @@ function ctd.undump(v)
 				return decode(tindex)
 			elseif t == 5 then -- string
 				local sindex = string.unpack("<I4", v, off)
-				return (string.unpack("z", v, stringtbl + sindex))
+				return getstring(sindex)
+			elseif t == 6 then -- secondary indexes, invisible
+				return nil
 			else
 				error (string.format("Invalid data at %d (%d)", off, t))
 			end
@@ -167,7 +469,7 @@ function ctd.undump(v)
 		for i=1,dict do
 			local sindex = string.unpack("<I4", v, offset)
 			offset = offset + 4
-			local key = string.unpack("z", v, stringtbl + sindex)
+			local key = getstring(sindex)
 			result[key] = value(types[array + i])
 		end
 		tblidx[result] = n
@@ -222,7 +524,7 @@ function ctd.diff(last, current)
 		local hlen = (array + dict + 8 + 3) & ~3
 		local hastable = false
 		for _, v in ipairs(types) do
-			if v == 4 then -- table
+			if v == 4 or v == 6 then -- table or indexes
 				hastable = true
 				break
 			end
@@ -239,7 +541,7 @@ function ctd.diff(last, current)
 			end
 		end
 		for i = 1, dict do
-			if types[i + array] == 4 then -- table
+			if types[i + array] == 4 or types[i + array] == 6 then -- table or indexes
 				values[array + i * 2] = map[values[array + i * 2]]
 			end
 		end
@@ -263,9 +565,49 @@ function ctd.diff(last, current)
 	for i = 0, n - 1 do
 		table.insert(tmp, remap(i))
 	end
-	table.insert(tmp, string.sub(current, stringtbl+1))
+	table.insert(tmp, string.sub(current, (stringtbl & STRTBL_OFFSET) + 1))
 
 	return table.concat(tmp)
 end
 
+local FILE_HEADER = "<c4I4I4I4I4"
+local FILE_FORMAT = 1
+
+-- Read a file made by ctd.save, returns document, id, base id
+function ctd.load(filename)
+	local f = assert(io.open(filename, "rb"))
+	local data = f:read "a"
+	f:close()
+	local magic, format, id, base, size = string.unpack(FILE_HEADER, data)
+	assert(magic == "SKDS" and format == FILE_FORMAT, "Invalid datasheet file")
+	local doc = data:sub(string.packsize(FILE_HEADER) + 1)
+	assert(#doc == size, "Broken datasheet file")
+	return doc, id, base
+end
+
+-- Build a file offline, skynet.datasheet.builder.load can mmap it.
+-- If basefile is given, the file is a diff of it, so the datasheets loaded from basefile can be updated in place.
+-- The file is written to a temporary file and renamed, never overwrite a mapped file.
+function ctd.save(filename, root, basefile, indexes, opts)
+	assert(not (opts and opts.strpool), "The string pool can't be saved")
+	local doc = type(root) == "string" and root or ctd.dump(root, indexes, opts)
+	assert(string.unpack("<I4", doc) & STRTBL_POOL == 0, "The string pool can't be saved")
+	local base = 0
+	if basefile then
+		local last
+		last, base = ctd.load(basefile)
+		doc = ctd.diff(last, doc)
+	end
+	local id
+	repeat
+		id = math.random(1, 0xffffffff)
+	until id ~= base
+	local tmpname = filename .. ".tmp"
+	local f = assert(io.open(tmpname, "wb"))
+	f:write(string.pack(FILE_HEADER, "SKDS", FILE_FORMAT, id, base, #doc), doc)
+	f:close()
+	assert(os.rename(tmpname, filename))
+	return id
+end
+
 return ctd
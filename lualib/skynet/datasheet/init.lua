@@ -72,4 +72,9 @@ function datasheet.query(name)
 	return t.object
 end
 
+-- Find records by the secondary indexes declared in builder, t is any table of the datasheet.
+-- lookup returns all the records of key, range returns an array of the records with key in [lo, hi].
+datasheet.lookup = core.lookup
+datasheet.range = core.range
+
 return datasheet
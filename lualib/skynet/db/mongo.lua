@@ -14,6 +14,7 @@ local table = table
 local bson_encode =	bson.encode
 local bson_encode_order	= bson.encode_order
 local bson_decode =	bson.decode
+local bson_view = bson.view
 local bson_int64 = bson.int64
 local empty_bson = bson_encode {}
 
@@ -141,6 +142,9 @@ local function mongo_auth(mongoc)
 		end
 		local rs_data =	mongoc:runCommand("ismaster")
 		if rs_data.ok == 1 then
+			local limits = mongoc.__limits
+			limits.max_message = rs_data.maxMessageSizeBytes or limits.max_message
+			limits.max_batch = rs_data.maxWriteBatchSize or limits.max_batch
 			if rs_data.hosts then
 				local backup = {}
 				for	_, v in	ipairs(rs_data.hosts) do
@@ -164,7 +168,41 @@ local function mongo_auth(mongoc)
 	end
 end
 
-function mongo.client( conf	)
+-- A set of channels used as one, each request goes to the channel with the
+-- least outstanding requests. The cursors live in the server, so getMore
+-- can be sent on any of them.
+local channel_pool = {}
+local channel_pool_meta = {
+	__index = channel_pool,
+}
+
+function channel_pool:request(request, response, padding)
+	local best
+	for _, c in ipairs(self) do
+		if best == nil or self.__outstanding[c] < self.__outstanding[best] then
+			best = c
+		end
+	end
+	if response == nil then
+		return best:request(request, nil, padding)
+	end
+	local outstanding = self.__outstanding
+	outstanding[best] = outstanding[best] + 1
+	local ok, result = pcall(best.request, best, request, response, padding)
+	outstanding[best] = outstanding[best] - 1
+	if not ok then
+		error(result)
+	end
+	return result
+end
+
+function channel_pool:close()
+	for _, c in ipairs(self) do
+		c:close()
+	end
+end
+
+local function new_client(conf, limits)
 	local first	= conf
 	local backup = nil
 	if conf.rs then
@@ -178,6 +216,7 @@ function mongo.client( conf	)
 		password = first.password,
 		authmod = first.authmod,
 		authdb = first.authdb,
+		__limits = limits,
 	}
 
 	obj.__id = 0
@@ -195,6 +234,40 @@ function mongo.client( conf	)
 	return obj
 end
 
+-- conf.pool_size : connections of the client, default 1
+function mongo.client( conf	)
+	local limits = {
+		-- the defaults of mongod, updated by ismaster
+		max_message = 48000000,
+		max_batch = 100000,
+	}
+	local size = conf.pool_size or 1
+	if size <= 1 then
+		return new_client(conf, limits)
+	end
+	-- every channel does its own auth by a client of itself
+	local pool = { __outstanding = {} }
+	local first
+	for i = 1, size do
+		local c = new_client(conf, limits)
+		first = first or c
+		pool[i] = c.__sock
+		pool.__outstanding[c.__sock] = 0
+	end
+	local obj = {
+		host = first.host,
+		port = first.port,
+		username = first.username,
+		password = first.password,
+		authmod = first.authmod,
+		authdb = first.authdb,
+		__limits = limits,
+		__id = 0,
+		__sock = setmetatable(pool, channel_pool_meta),
+	}
+	return setmetatable(obj, client_meta)
+end
+
 function mongo_client:getDB(dbname)
 	local db = {
 		connection = self,
@@ -385,41 +458,145 @@ function mongo_db:auth(user, pass)
 	return auth_func(self, user, pass)
 end
 
-function mongo_db:runCommand(cmd,cmd_v,...)
-	local conn = self.connection
+local OP_MSG = 2013
+
+-- The packets are built in place, reused by all the requests of the service
+local packet = bson.buffer()
+
+-- flags 2 (moreToCome) is a request without response
+-- lazy returns a bson view of the reply instead of a table
+-- identifier and docs are the optional document sequence of OP_MSG
+-- ... is the command, see bson.encode_order
+local function request(db, flags, lazy, identifier, docs, ...)
+	local conn = db.connection
 	local request_id = conn:genId()
 	local sock = conn.__sock
-	local bson_cmd
+	packet:reset()
+	packet:int32(0)	-- message length
+	packet:int32(request_id)
+	packet:int32(0)	-- response to
+	packet:int32(OP_MSG)
+	packet:int32(flags)
+	packet:int8(0)	-- section 0 : the command
+	packet:encode_order(...)
+	if identifier then
+		packet:int8(1)	-- section 1 : document sequence
+		local offset = packet:size()
+		packet:int32(0)
+		packet:cstring(identifier)
+		for i = 1, #docs do
+			packet:append(docs[i])
+		end
+		packet:length(offset)
+	end
+	packet:length(0)
+	-- the socket frees msg
+	local msg, sz = packet:pack()
+	if flags == 2 then
+		sock:request(msg, nil, sz)
+		return {ok=1} -- fake successful response
+	end
+	-- we must hold	req	(req.data),	because	req.document is	a lightuserdata, it's a	pointer	to the string (req.data)
+	local req =	sock:request(msg, request_id, sz)
+	local doc =	req.document
+	if lazy then
+		-- the view holds req.data
+		return bson_view(doc, req.data)
+	end
+	return bson_decode(doc)
+end
+
+function mongo_db:runCommand(cmd,cmd_v,...)
 	if not cmd_v then
 		-- ensure cmd remains in first place
-		bson_cmd = bson_encode_order(cmd,1, "$db", self.name)
+		return request(self, 0, false, nil, nil, cmd, 1, "$db", self.name)
 	else
-		bson_cmd = bson_encode_order(cmd,cmd_v, "$db", self.name, ...)
+		return request(self, 0, false, nil, nil, cmd, cmd_v, "$db", self.name, ...)
 	end
+end
 
-	local pack = driver.op_msg(request_id, 0, bson_cmd)
-	-- we must hold	req	(req.data),	because	req.document is	a lightuserdata, it's a	pointer	to the string (req.data)
-	local req =	sock:request(pack, request_id)
-	local doc =	req.document
-	return bson_decode(doc)
+-- raw returns a bson view of the reply, see request
+local function command(db, raw, cmd, cmd_v, ...)
+	return request(db, 0, raw, nil, nil, cmd, cmd_v, "$db", db.name, ...)
 end
 
 --- send command without response
 function mongo_db:send_command(cmd, cmd_v, ...)
-	local conn = self.connection
-	local request_id = conn:genId()
-	local sock = conn.__sock
-	local bson_cmd
 	if not cmd_v then
 		-- ensure cmd remains in first place
-		bson_cmd = bson_encode_order(cmd, 1, "$db", self.name, "writeConcern", {w=0})
+		return request(self, 2, false, nil, nil, cmd, 1, "$db", self.name, "writeConcern", {w=0})
 	else
-		bson_cmd = bson_encode_order(cmd, cmd_v, "$db", self.name, "writeConcern", {w=0}, ...)
+		return request(self, 2, false, nil, nil, cmd, cmd_v, "$db", self.name, "writeConcern", {w=0}, ...)
 	end
+end
+
+local function write_chunk(db, safe, cmd, collection, field, docs)
+	if safe then
+		return request(db, 0, false, field, docs, cmd, collection, "$db", db.name)
+	else
+		return request(db, 2, false, field, docs, cmd, collection, "$db", db.name, "writeConcern", {w=0})
+	end
+end
+
+-- the space for the command document in a message
+local MESSAGE_RESERVED = 16 * 1024
+
+local function merge_result(r, chunk, offset)
+	r.n = (r.n or 0) + (chunk.n or 0)
+	if chunk.nModified then
+		r.nModified = (r.nModified or 0) + chunk.nModified
+	end
+	for _, field in ipairs { "writeErrors", "upserted" } do
+		local list = chunk[field]
+		if list then
+			local to = r[field] or {}
+			r[field] = to
+			for _, v in ipairs(list) do
+				v.index = v.index + offset
+				to[#to+1] = v
+			end
+		end
+	end
+	r.writeConcernError = r.writeConcernError or chunk.writeConcernError
+end
 
-	local pack = driver.op_msg(request_id, 2, bson_cmd)
-	sock:request(pack)
-	return {ok=1} -- fake successful response
+-- Send the encoded documents of insert/update/delete as a document sequence
+-- named field, split by the max message size and the max write batch size.
+-- The results of the chunks are merged, and an ordered write stops at the
+-- first chunk with errors. safe is false for the writes without response.
+function mongo_db:write_documents(safe, cmd, collection, field, docs)
+	local limits = self.connection.__limits
+	local max_size = limits.max_message - MESSAGE_RESERVED
+	local n = #docs
+	if n <= limits.max_batch then
+		local size = 0
+		for i = 1, n do
+			size = size + #docs[i]
+		end
+		if size <= max_size then
+			return write_chunk(self, safe, cmd, collection, field, docs)
+		end
+	end
+	local result = { ok = 1 }
+	local i = 1
+	while i <= n do
+		local chunk = {}
+		local size = 0
+		repeat
+			size = size + #docs[i]
+			chunk[#chunk+1] = docs[i]
+			i = i + 1
+		until i > n or #chunk >= limits.max_batch or size + #docs[i] > max_size
+		local r = write_chunk(self, safe, cmd, collection, field, chunk)
+		if r.ok ~= 1 then
+			return r
+		end
+		merge_result(result, r, i - 1 - #chunk)
+		if r.writeErrors then
+			break
+		end
+	end
+	return result
 end
 
 function mongo_db:getCollection(collection)
@@ -439,16 +616,16 @@ function mongo_collection:insert(doc)
 	if doc._id == nil then
 		doc._id	= bson.objectid()
 	end
-	self.database:send_command("insert", self.name, "documents", {bson_encode(doc)})
+	self.database:write_documents(false, "insert", self.name, "documents", {bson_encode(doc)})
 end
 
 function mongo_collection:safe_insert(doc)
-	local r = self.database:runCommand("insert", self.name, "documents", {bson_encode(doc)})
+	local r = self.database:write_documents(true, "insert", self.name, "documents", {bson_encode(doc)})
 	return werror(r)
 end
 
 function mongo_collection:raw_safe_insert(doc)
-	local r = self.database:runCommand("insert", self.name, "documents", {doc})
+	local r = self.database:write_documents(true, "insert", self.name, "documents", {doc})
 	return werror(r)
 end
 
@@ -460,7 +637,7 @@ function mongo_collection:batch_insert(docs)
 		docs[i]	= bson_encode(docs[i])
 	end
 
-	self.database:send_command("insert", self.name, "documents", docs)
+	self.database:write_documents(false, "insert", self.name, "documents", docs)
 end
 
 mongo_collection.insert_many = mongo_collection.batch_insert
@@ -473,14 +650,14 @@ function mongo_collection:safe_batch_insert(docs)
 		docs[i] = bson_encode(docs[i])
 	end
 
-	local r = self.database:runCommand("insert", self.name, "documents", docs)
+	local r = self.database:write_documents(true, "insert", self.name, "documents", docs)
 	return werror(r)
 end
 
 mongo_collection.safe_insert_many = mongo_collection.safe_batch_insert
 
 function mongo_collection:update(query,update,upsert,multi)
-	self.database:send_command("update", self.name, "updates", {bson_encode({
+	self.database:write_documents(false, "update", self.name, "updates", {bson_encode({
 		q = query,
 		u = update,
 		upsert = upsert,
@@ -489,7 +666,7 @@ function mongo_collection:update(query,update,upsert,multi)
 end
 
 function mongo_collection:safe_update(query, update, upsert, multi)
-	local r = self.database:runCommand("update", self.name, "updates", {bson_encode({
+	local r = self.database:write_documents(true, "update", self.name, "updates", {bson_encode({
 		q = query,
 		u = update,
 		upsert = upsert,
@@ -509,7 +686,7 @@ function mongo_collection:batch_update(updates)
 		})
 	end
 
-	self.database:send_command("update", self.name, "updates", updates_tb)
+	self.database:write_documents(false, "update", self.name, "updates", updates_tb)
 end
 
 function mongo_collection:safe_batch_update(updates)
@@ -523,24 +700,24 @@ function mongo_collection:safe_batch_update(updates)
 		})
 	end
 
-	local r = self.database:runCommand("update", self.name, "updates", updates_tb)
+	local r = self.database:write_documents(true, "update", self.name, "updates", updates_tb)
 	return werror(r)
 end
 
 function mongo_collection:raw_safe_update(update)
-	local r = self.database:runCommand("update", self.name, "updates", {update})
+	local r = self.database:write_documents(true, "update", self.name, "updates", {update})
 	return werror(r)
 end
 
 function mongo_collection:delete(query, single)
-	self.database:send_command("delete", self.name, "deletes", {bson_encode({
+	self.database:write_documents(false, "delete", self.name, "deletes", {bson_encode({
 		q = query,
 		limit = single and 1 or 0,
 	})})
 end
 
 function mongo_collection:safe_delete(query, single)
-	local r = self.database:runCommand("delete", self.name, "deletes", {bson_encode({
+	local r = self.database:write_documents(true, "delete", self.name, "deletes", {bson_encode({
 		q = query,
 		limit = single and 1 or 0,
 	})})
@@ -555,22 +732,37 @@ function mongo_collection:safe_batch_delete(deletes, single)
 			limit = single and 1 or 0,
 		})
 	end
-	local r = self.database:runCommand("delete", self.name, "deletes", delete_tb)
+	local r = self.database:write_documents(true, "delete", self.name, "deletes", delete_tb)
 	return werror(r)
 end
 
 function mongo_collection:raw_safe_delete(delete)
-	local r = self.database:runCommand("delete", self.name, "deletes", {delete})
+	local r = self.database:write_documents(true, "delete", self.name, "deletes", {delete})
 	return werror(r)
 end
 
-function mongo_collection:findOne(query, projection)
-	local r = self.database:runCommand("find", self.name, "filter", query and bson_encode(query) or empty_bson,
-		"limit", 1, "projection", projection and bson_encode(projection) or empty_bson)
+-- If lazy is true, returns a bson view (see bson.view) of the document, the
+-- fields are decoded when they are read. If lazy is "raw", returns the bson
+-- string of the document, see mongo_cursor:raw.
+function mongo_collection:findOne(query, projection, lazy)
+	local database = self.database
+	local r
+	if lazy then
+		r = request(database, 0, true, nil, nil, "find", self.name, "$db", database.name,
+			"filter", query and bson_encode(query) or empty_bson,
+			"limit", 1, "projection", projection and bson_encode(projection) or empty_bson)
+	else
+		r = database:runCommand("find", self.name, "filter", query and bson_encode(query) or empty_bson,
+			"limit", 1, "projection", projection and bson_encode(projection) or empty_bson)
+	end
 	if r.ok ~= 1 then
 		error(r.errmsg or "Reply from mongod error")
 	end
-	return r.cursor.firstBatch[1]
+	local doc = r.cursor.firstBatch[1]
+	if lazy == "raw" and doc then
+		return tostring(doc)
+	end
+	return doc
 end
 
 function mongo_collection:find(query, projection)
@@ -796,6 +988,61 @@ function mongo_collection:aggregate(pipeline, options)
 	} ,	aggregate_cursor_meta)
 end
 
+-- disable/enable the prefetch of the next batch, enabled by default
+function mongo_cursor:prefetch(enable)
+	self.__noprefetch = not enable
+	return self
+end
+
+-- next() returns the bson string of the documents instead of tables, for the
+-- proxy services forwarding the results : the replies are not decoded, and the
+-- strings are copied as they are by skynet.pack. Call bson.decode(doc) in the
+-- final consumer.
+function mongo_cursor:raw(enable)
+	self.__raw = enable ~= false
+	return self
+end
+
+local function getmore(coll, cursor_id, raw)
+	return command(coll.database, raw, "getMore", bson_int64(cursor_id), "collection", coll.name)
+end
+
+-- Send getMore for the next batch at once, so the round trip overlaps the
+-- processing of the current batch.
+local function prefetch(self)
+	local cursor_id = self.__cursor
+	if self.__noprefetch or not cursor_id or cursor_id <= 0 then
+		return
+	end
+	local p = {}
+	self.__prefetch = p
+	skynet.fork(function()
+		p.ok, p.response = pcall(getmore, self.__collection, cursor_id, self.__raw)
+		p.done = true
+		local co = p.co
+		if co then
+			p.co = nil
+			skynet.wakeup(co)
+		end
+	end)
+end
+
+local function next_batch(self)
+	local p = self.__prefetch
+	if p == nil then
+		return getmore(self.__collection, self.__cursor, self.__raw)
+	end
+	self.__prefetch = nil
+	if not p.done then
+		p.co = coroutine.running()
+		skynet.wait(p.co)
+	end
+	if not p.ok then
+		error(p.response)
+	end
+	return p.response
+end
+
 function mongo_cursor:hasNext()
 	if self.__ptr == nil then
 		if self.__document == nil then
@@ -806,12 +1053,11 @@ function mongo_cursor:hasNext()
 		local database = self.__collection.database
 		if self.__data == nil then
 			local name = self.__collection.name
-			response = database:runCommand("find", name, "filter", self.__query, "sort", self.__sort,
+			response = command(database, self.__raw, "find", name, "filter", self.__query, "sort", self.__sort,
 				"projection", self.__projection, add_opt(self, "skip", "limit", "hint", "maxTimeMS"))
 		else
 			if self.__cursor  and self.__cursor > 0 then
-				local name = self.__collection.name
-				response = database:runCommand("getMore", bson_int64(self.__cursor), "collection", name)
+				response = next_batch(self)
 			else
 				-- no more
 				self.__document	= nil
@@ -848,6 +1094,7 @@ function mongo_cursor:hasNext()
 			return false
 		end
 
+		prefetch(self)
 		return true
 	end
 
@@ -863,11 +1110,16 @@ function mongo_cursor:next()
 	if self.__ptr >	#self.__document then
 		self.__ptr = nil
 	end
+	if self.__raw then
+		return tostring(r)
+	end
 
 	return r
 end
 
 function mongo_cursor:close()
+	-- the prefetched batch is dropped
+	self.__prefetch = nil
 	if self.__cursor and self.__cursor > 0 then
 		local coll = self.__collection
 		coll.database:send_command("killCursors", coll.name, "cursors", {bson_int64(self.__cursor)})
@@ -933,13 +1185,13 @@ function aggregate_cursor:hasNext()
 		local database = self.__collection.database
 		if self.__data == nil then
 			if self.__options then
-				ret = database:runCommand("aggregate", name, "pipeline", format_pipeline(self, true), table.unpack(self.__options))
+				ret = command(database, self.__raw, "aggregate", name, "pipeline", format_pipeline(self, true), table.unpack(self.__options))
 			else
-				ret = database:runCommand("aggregate", name, "pipeline", format_pipeline(self, true), "cursor", empty_bson)
+				ret = command(database, self.__raw, "aggregate", name, "pipeline", format_pipeline(self, true), "cursor", empty_bson)
 			end
 		else
 			if self.__cursor  and self.__cursor > 0 then
-				ret = database:runCommand("getMore", bson_int64(self.__cursor), "collection", name)
+				ret = next_batch(self)
 			else
 				-- no more
 				self.__document	= nil
@@ -976,6 +1228,7 @@ function aggregate_cursor:hasNext()
 			return false
 		end
 
+		prefetch(self)
 		return true
 	end
 
@@ -987,5 +1240,7 @@ aggregate_cursor.skip = mongo_cursor.skip
 aggregate_cursor.limit = mongo_cursor.limit
 aggregate_cursor.next = mongo_cursor.next
 aggregate_cursor.close = mongo_cursor.close
+aggregate_cursor.prefetch = mongo_cursor.prefetch
+aggregate_cursor.raw = mongo_cursor.raw
 
 return mongo
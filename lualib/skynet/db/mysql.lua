@@ -6,8 +6,10 @@
 
 -- protocol detail: https://mariadb.com/kb/en/clientserver-protocol/
 
+local skynet = require "skynet"
 local socketchannel = require "skynet.socketchannel"
 local crypt = require "skynet.crypt"
+local core = require "skynet.mysql.core"
 
 local sub = string.sub
 local strgsub = string.gsub
@@ -82,85 +84,31 @@ local COM_STMT_EXECUTE = "\x17"
 local COM_STMT_CLOSE = "\x19"
 local COM_STMT_RESET = "\x1a"
 local CURSOR_TYPE_NO_CURSOR = 0x00
+local ER_UNKNOWN_STMT_HANDLER = 1243
 local SERVER_MORE_RESULTS_EXISTS = 8
 
 local mt = {__index = _M}
 
--- mysql field value type converters
-local converters = {}
-
-for i = 0x01, 0x05 do
-    -- tiny, short, long, float, double
-    converters[i] = tonumber
-end
-converters[0x08] = tonumber -- long long
-converters[0x09] = tonumber -- int24
-converters[0x0d] = tonumber -- year
-converters[0xf6] = tonumber -- newdecimal
-
 local function _get_byte1(data, i)
     return strbyte(data, i), i + 1
 end
 
-local function _get_int1(data, i, is_signed)
-    if not is_signed then
-        return strunpack("<I1", data, i)
-    end
-    return strunpack("<i1", data, i)
-end
-
 local function _get_byte2(data, i)
     return strunpack("<I2", data, i)
 end
 
-local function _get_int2(data, i, is_signed)
-    if not is_signed then
-        return strunpack("<I2", data, i)
-    end
-    return strunpack("<i2", data, i)
-end
-
 local function _get_byte3(data, i)
     return strunpack("<I3", data, i)
 end
 
-local function _get_int3(data, i, is_signed)
-    if not is_signed then
-        return strunpack("<I3", data, i)
-    end
-    return strunpack("<i3", data, i)
-end
-
 local function _get_byte4(data, i)
     return strunpack("<I4", data, i)
 end
 
-local function _get_int4(data, i, is_signed)
-    if not is_signed then
-        return strunpack("<I4", data, i)
-    end
-    return strunpack("<i4", data, i)
-end
-
 local function _get_byte8(data, i)
     return strunpack("<I8", data, i)
 end
 
-local function _get_int8(data, i, is_signed)
-    if not is_signed then
-        return strunpack("<I8", data, i)
-    end
-    return strunpack("<i8", data, i)
-end
-
-local function _get_float(data, i)
-    return strunpack("<f", data, i)
-end
-
-local function _get_double(data, i)
-    return strunpack("<d", data, i)
-end
-
 local function _set_byte2(n)
     return strpack("<I2", n)
 end
@@ -392,31 +340,16 @@ local function _parse_field_packet(data)
     return col
 end
 
-local function _parse_row_data_packet(data, cols, compact)
-    local value, col, conv
-    local pos = 1
-    local ncols = #cols
-    local row = {}
-
-    for i = 1, ncols do
-        value, pos = _from_length_coded_str(data, pos)
-        col = cols[i]
-
-        if value ~= nil then
-            conv = converters[col.type]
-            if conv then
-                value = conv(value)
-            end
-        end
-
-        if compact then
-            row[i] = value
-        else
-            row[col.name] = value
-        end
+-- 每列两个字节：类型和是否有符号，行由 lua-mysql.c 解码
+local function _row_layout(cols)
+    local layout = {}
+    local names = {}
+    for i = 1, #cols do
+        local col = cols[i]
+        layout[i] = strchar(col.type, col.is_signed and 1 or 0)
+        names[i] = col.name
     end
-
-    return row
+    return table.concat(layout), names
 end
 
 local function _recv_field_packet(self, sock)
@@ -514,6 +447,9 @@ local function _mysql_login(self, user, password, charset, database, on_connect)
         )
         local authpacket = _compose_packet(self, req)
         sockchannel:request(authpacket, dispatch_resp)
+        -- prepared statements belong to the old connection
+        self.stmt_cache = {}
+        self.stmt_count = 0
         if on_connect then
             on_connect(self)
         end
@@ -611,7 +547,42 @@ local function _compose_stmt_execute(self, stmt, cursor_type, args)
     return _compose_packet(self, cmd_packet)
 end
 
-local function read_result(self, sock)
+--[[
+    行不解码，和列的信息一起拼成一个字符串，由 mysql.decode 解码（见 lua-mysql.c 的 decode）
+    binary 为 1 时是二进制协议的行
+]]
+local function _read_raw_rows(self, sock, binary, layout, names)
+    local compact = self.compact
+    local buf = { strpack("<BBs2", binary, compact and 1 or 0, layout) }
+    local n = 1
+    if not compact then
+        for i = 1, #names do
+            n = n + 1
+            buf[n] = strpack("<s2", names[i])
+        end
+    end
+    while true do
+        local packet, typ, err = _recv_packet(self, sock)
+        if not packet then
+            return nil, err
+        end
+        if typ == "EOF" then
+            local warning_count, status_flags = _parse_eof_packet(packet)
+            local raw = table.concat(buf)
+            if status_flags & SERVER_MORE_RESULTS_EXISTS ~= 0 then
+                return raw, "again"
+            end
+            return raw
+        end
+        buf[n + 1] = strpack("<I4", #packet)
+        buf[n + 2] = packet
+        n = n + 2
+    end
+end
+
+-- onrow 不为空时，每行交给 onrow 而不保存在结果里
+-- raw 为真时，行不解码，见 _read_raw_rows
+local function read_result(self, sock, onrow, raw)
     local packet, typ, err = _recv_packet(self, sock)
     if not packet then
         return nil, err
@@ -663,7 +634,14 @@ local function read_result(self, sock)
 
     -- typ == 'EOF'
 
-    local compact = self.compact
+    local layout, names = _row_layout(cols)
+    if raw then
+        return _read_raw_rows(self, sock, 0, layout, names)
+    end
+    if self.compact then
+        names = nil
+    end
+    local textrow = core.textrow
     local rows = {}
     local i = 0
     while true do
@@ -687,16 +665,20 @@ local function read_result(self, sock)
 
         -- typ == 'DATA'
 
-        i = i + 1
-        rows[i] = _parse_row_data_packet(packet, cols, compact)
+        if onrow then
+            onrow(textrow(packet, layout, names))
+        else
+            i = i + 1
+            rows[i] = textrow(packet, layout, names)
+        end
     end
 
     return rows
 end
 
-local function _query_resp(self)
+local function _query_resp(self, raw)
     return function(sock)
-        local res, err, errno, sqlstate = read_result(self, sock)
+        local res, err, errno, sqlstate = read_result(self, sock, nil, raw)
         if not res then
             local badresult = {}
             badresult.badresult = true
@@ -712,7 +694,7 @@ local function _query_resp(self)
         multiresultset.multiresultset = true
         local i = 2
         while err == "again" do
-            res, err, errno, sqlstate = read_result(self, sock)
+            res, err, errno, sqlstate = read_result(self, sock, nil, raw)
             if not res then
                 multiresultset.badresult = true
                 multiresultset.err = err
@@ -736,6 +718,9 @@ function _M.connect(opts)
     end
     self._max_packet_size = max_packet_size
     self.compact = opts.compact_arrays
+    self.stmt_cache = {}
+    self.stmt_count = 0
+    self.stmt_cache_max = opts.max_prepared or 256
 
     local database = opts.database or ""
     local user = opts.user or ""
@@ -769,6 +754,143 @@ function _M.query(self, query)
     return sockchannel:request(querypacket, self.query_resp)
 end
 
+--[[
+    和 query 一样，但结果集的行不解码，是一个字符串（多个结果集时是它们的数组），
+    用于只转发结果的代理服务：字符串由 skynet.pack 原样复制，最终的使用者调用
+    mysql.decode(res) 得到行的数组。没有结果集的语句和出错时返回的表同 query
+]]
+function _M.rawquery(self, query)
+    local querypacket = _compose_query(self, query)
+    local sockchannel = self.sockchannel
+    if not self.rawquery_resp then
+        self.rawquery_resp = _query_resp(self, true)
+    end
+    return sockchannel:request(querypacket, self.rawquery_resp)
+end
+
+_M.decode = core.decode
+
+--[[
+    逐行读取查询结果，整个结果集不会同时留在内存里
+        for row in db:rows(sql) do ... end
+    行按 batch（默认 256）一批交给迭代器，读完一批前连接上的读取会暂停；
+    多个结果集的行依次返回，出错时抛出错误。
+    必须在泛型 for 里使用，提前 break 时剩余的行会被丢弃
+]]
+function _M.rows(self, query, batch)
+    batch = batch or 256
+    local buf = {}
+    local ready -- a batch for the iterator
+    local done, failure, closed
+    local reader, consumer -- the waiting coroutines
+
+    -- clear before wakeup, a second wakeup would resume the coroutine from its next wait
+    local function wakeup_reader()
+        local co = reader
+        if co then
+            reader = nil
+            skynet.wakeup(co)
+        end
+    end
+
+    local function wakeup_consumer()
+        local co = consumer
+        if co then
+            consumer = nil
+            skynet.wakeup(co)
+        end
+    end
+
+    local function put(rows)
+        while ready and not closed do
+            reader = coroutine.running()
+            skynet.wait(reader)
+        end
+        if not closed then
+            ready = rows
+            wakeup_consumer()
+        end
+    end
+
+    local function onrow(row)
+        if closed then
+            return
+        end
+        local n = #buf + 1
+        buf[n] = row
+        if n >= batch then
+            local rows = buf
+            buf = {}
+            put(rows)
+        end
+    end
+
+    local function finish(err)
+        failure = err
+        done = true
+        wakeup_consumer()
+    end
+
+    local function resp(sock)
+        local res, err, errno, sqlstate = read_result(self, sock, onrow)
+        while res and err == "again" do
+            res, err, errno, sqlstate = read_result(self, sock, onrow)
+        end
+        if buf[1] then
+            put(buf)
+            buf = {}
+        end
+        if not res then
+            finish(strformat("errno:%s, msg:%s,sqlstate:%s", errno, err, sqlstate))
+        else
+            finish()
+        end
+        return true
+    end
+
+    skynet.fork(function()
+        local ok, err = pcall(self.sockchannel.request, self.sockchannel, _compose_query(self, query), resp)
+        if not ok then
+            finish(tostring(err))
+        end
+    end)
+
+    local rows, index
+    local function iter()
+        while true do
+            if rows then
+                index = index + 1
+                local row = rows[index]
+                if row ~= nil then
+                    return row
+                end
+                rows = nil
+            end
+            if ready then
+                rows, index = ready, 0
+                ready = nil
+                wakeup_reader()
+            elseif done then
+                if failure then
+                    error(failure)
+                end
+                return
+            else
+                consumer = coroutine.running()
+                skynet.wait(consumer)
+            end
+        end
+    end
+
+    local closer = setmetatable({}, { __close = function()
+        closed = true
+        ready = nil
+        wakeup_reader()
+    end })
+
+    return iter, nil, nil, closer
+end
+
 local function read_prepare_result(self, sock)
     local resp = {}
     local packet, typ, err = _recv_packet(self, sock)
@@ -834,110 +956,7 @@ function _M.prepare(self, sql)
     return sockchannel:request(querypacket, self.prepare_resp)
 end
 
-local function _get_datetime(data, pos)
-    local len, year, month, day, hour, minute, second
-    local value
-    len, pos = _from_length_coded_bin(data, pos)
-    if len == 7 then
-        year, month, day, hour, minute, second, pos = string.unpack("<I2BBBBB", data, pos)
-        value = strformat("%04d-%02d-%02d %02d:%02d:%02d", year, month, day, hour, minute, second)
-    elseif len == 4 then
-        year, month, day, pos = string.unpack("<I2BB", data, pos)
-        value = strformat("%04d-%02d-%02d %02d:%02d:%02d", year, month, day, 0, 0, 0)
-    else
-        value = "2017-09-09 20:08:09"
-        --unsupported format
-        pos = pos + len
-    end
-    return value, pos
-end
-
-local function _get_date(data, pos)
-    local len, year, month, day
-    local value
-    len, pos = _from_length_coded_bin(data, pos)
-    if len == 4 then
-        year, month, day, pos = string.unpack("<I2BB", data, pos)
-        value = strformat("%04d-%02d-%02d", year, month, day)
-    else
-        --unsupported format
-        error("_get_date()error,unsupported date format, len is " .. len)
-    end
-    return value, pos
-end
-
--- 字段类型参考 https://dev.mysql.com/doc/dev/mysql-server/8.0.12/binary__log__types_8h.html enum_field_types 枚举类型定义
-local _binary_parser = {
-    [0x01] = _get_int1,
-    [0x02] = _get_int2,
-    [0x03] = _get_int4,
-    [0x04] = _get_float,
-    [0x05] = _get_double,
-    [0x07] = _get_datetime,
-    [0x08] = _get_int8,
-    [0x09] = _get_int3,
-    [0x0a] = _get_date,
-    [0x0c] = _get_datetime,
-    [0x0f] = _from_length_coded_str,
-    [0x10] = _from_length_coded_str,
-    [0xf5] = _from_length_coded_str,
-    [0xf9] = _from_length_coded_str,
-    [0xfa] = _from_length_coded_str,
-    [0xfb] = _from_length_coded_str,
-    [0xfc] = _from_length_coded_str,
-    [0xfd] = _from_length_coded_str,
-    [0xfe] = _from_length_coded_str
-}
-
-local function _parse_row_data_binary(data, cols, compact)
-    local ncols = #cols
-    -- 空位图,前两个bit系统保留 (列数量 + 7 + 2) / 8
-    local null_count = (ncols + 9) // 8
-    local pos = 2 + null_count
-    local value
-
-    --空字段表
-    local null_fields = {}
-    local field_index = 1
-    local byte
-    for i = 2, pos - 1 do
-        byte = strbyte(data, i)
-        for j = 0, 7 do
-            if field_index > 2 then
-                if byte & (1 << j) == 0 then
-                    null_fields[field_index - 2] = false
-                else
-                    null_fields[field_index - 2] = true
-                end
-            end
-            field_index = field_index + 1
-        end
-    end
-
-    local row = {}
-    local parser
-    for i = 1, ncols do
-        local col = cols[i]
-        local typ = col.type
-        local name = col.name
-        if not null_fields[i] then
-            parser = _binary_parser[typ]
-            if not parser then
-                error("_parse_row_data_binary()error,unsupported field type " .. typ)
-            end
-            value, pos = parser(data, pos, col.is_signed)
-            if compact then
-                row[i] = value
-            else
-                row[name] = value
-            end
-        end
-    end
-
-    return row
-end
-
-local function read_execute_result(self, sock)
+local function read_execute_result(self, sock, raw)
     local packet, typ, err = _recv_packet(self, sock)
     if not packet then
         return nil, err
@@ -988,11 +1007,21 @@ local function read_execute_result(self, sock)
         return {}
     end
 
-    local compact = self.compact
+    local layout, names = _row_layout(cols)
+    if raw then
+        return _read_raw_rows(self, sock, 1, layout, names)
+    end
+    if self.compact then
+        names = nil
+    end
+    local binaryrow = core.binaryrow
     local rows = {}
-    local row
+    local i = 0
     while true do
         packet, typ, err = _recv_packet(self, sock)
+        if not packet then
+            return nil, err
+        end
         if typ == "EOF" then
             local warning_count, status_flags = _parse_eof_packet(packet)
             if status_flags & SERVER_MORE_RESULTS_EXISTS ~= 0 then
@@ -1000,19 +1029,16 @@ local function read_execute_result(self, sock)
             end
             break
         end
-        row = _parse_row_data_binary(packet, cols, compact)
-        if not col then
-            break
-        end
-        table.insert(rows, row)
+        i = i + 1
+        rows[i] = binaryrow(packet, layout, names)
     end
 
     return rows
 end
 
-local function _execute_resp(self)
+local function _execute_resp(self, raw)
     return function(sock)
-        local res, err, errno, sqlstate = read_execute_result(self, sock)
+        local res, err, errno, sqlstate = read_execute_result(self, sock, raw)
         if not res then
             local badresult = {}
             badresult.badresult = true
@@ -1028,7 +1054,7 @@ local function _execute_resp(self)
         mulitresultset.mulitresultset = true
         local i = 2
         while err == "again" do
-            res, err, errno, sqlstate = read_execute_result(self, sock)
+            res, err, errno, sqlstate = read_execute_result(self, sock, raw)
             if not res then
                 mulitresultset.badresult = true
                 mulitresultset.err = err
@@ -1043,8 +1069,63 @@ local function _execute_resp(self)
     end
 end
 
+local function _cached_stmt(self, sql)
+    local cache = self.stmt_cache
+    local stmt = cache[sql]
+    if stmt then
+        return stmt
+    end
+    stmt = _M.prepare(self, sql)
+    if stmt.badresult then
+        return nil, stmt
+    end
+    local old = cache[sql]
+    if old then
+        -- prepared by another coroutine at the same time
+        _M.stmt_close(self, stmt)
+        return old
+    end
+    if self.stmt_count >= self.stmt_cache_max then
+        local k, v = next(cache)
+        cache[k] = nil
+        self.stmt_count = self.stmt_count - 1
+        _M.stmt_close(self, v)
+    end
+    cache[sql] = stmt
+    self.stmt_count = self.stmt_count + 1
+    return stmt
+end
+
+local _execute
+
+local function execute(self, raw, stmt, ...)
+    if type(stmt) ~= "string" then
+        return _execute(self, raw, stmt, ...)
+    end
+    local sql = stmt
+    local s, err = _cached_stmt(self, sql)
+    if not s then
+        return err
+    end
+    local res = _execute(self, raw, s, ...)
+    if res.badresult and res.errno == ER_UNKNOWN_STMT_HANDLER then
+        -- the statement is gone (reconnected or evicted), prepare again
+        if self.stmt_cache[sql] == s then
+            self.stmt_cache[sql] = nil
+            self.stmt_count = self.stmt_count - 1
+        end
+        s, err = _cached_stmt(self, sql)
+        if not s then
+            return err
+        end
+        res = _execute(self, raw, s, ...)
+    end
+    return res
+end
+
 --[[
-    执行预处理语句
+    执行预处理语句，stmt 可以是 prepare 返回的句柄，也可以是 sql 字符串；
+    用字符串时，语句在连接上准备一次并缓存，断线重连后自动重新准备
     失败返回字段
         errno
         badresult
@@ -1052,6 +1133,15 @@ end
         err
 ]]
 function _M.execute(self, stmt, ...)
+    return execute(self, false, stmt, ...)
+end
+
+-- 同 execute，但结果集的行不解码，见 rawquery
+function _M.rawexecute(self, stmt, ...)
+    return execute(self, true, stmt, ...)
+end
+
+function _execute(self, raw, stmt, ...)
     local querypacket, er = _compose_stmt_execute(self, stmt, CURSOR_TYPE_NO_CURSOR, table.pack(...))
     if not querypacket then
         return {
@@ -1061,6 +1151,12 @@ function _M.execute(self, stmt, ...)
         }
     end
     local sockchannel = self.sockchannel
+    if raw then
+        if not self.rawexecute_resp then
+            self.rawexecute_resp = _execute_resp(self, true)
+        end
+        return sockchannel:request(querypacket, self.rawexecute_resp)
+    end
     if not self.execute_resp then
         self.execute_resp = _execute_resp(self)
     end
@@ -0,0 +1,55 @@
+local skynet = require "skynet"
+
+--[[
+	A pool of mysql connections in its own service.
+
+	local pool = mysqlpool.new {
+		host = "127.0.0.1", user = "root", password = "", database = "test",
+		size = 4,		-- connections
+		ping_interval = 3000,	-- health check, in 1/100s
+		max_batch = nil,	-- bytes of one multi-statement query in pool:batch
+	}
+	pool:query "select 1"
+	pool:execute("select * from t where id = ?", id)	-- prepared and cached on each connection
+	pool:batch { "insert ...", "update ...", ... }	-- one round trip
+
+	Requests go to the healthy connection with the least outstanding requests,
+	and requests on one connection are pipelined.
+]]
+
+local mysqlpool = {}
+local pool = {}
+local pool_mt = { __index = pool }
+
+function mysqlpool.new(opts)
+	local addr = skynet.newservice "mysqlpoold"
+	skynet.call(addr, "lua", "init", opts)
+	return mysqlpool.bind(addr)
+end
+
+-- use a pool created by another service
+function mysqlpool.bind(addr)
+	return setmetatable({ addr = addr }, pool_mt)
+end
+
+function pool:query(sql)
+	return skynet.call(self.addr, "lua", "query", sql)
+end
+
+function pool:execute(sql, ...)
+	return skynet.call(self.addr, "lua", "execute", sql, ...)
+end
+
+function pool:batch(list)
+	return skynet.call(self.addr, "lua", "batch", list)
+end
+
+function pool:stat()
+	return skynet.call(self.addr, "lua", "stat")
+end
+
+function pool:close()
+	skynet.call(self.addr, "lua", "close")
+end
+
+return mysqlpool
@@ -1,4 +1,5 @@
 local socketchannel = require "skynet.socketchannel"
+local core = require "skynet.redis.core"
 
 local tostring = tostring
 local tonumber = tonumber
@@ -10,6 +11,10 @@ local ipairs = ipairs
 local type = type
 local select = select
 local pairs = pairs
+local decode = core.decode
+local encode = core.encode
+local scan = core.scan
+local scan_new = core.scanner
 
 
 local redis = {}
@@ -20,52 +25,46 @@ local meta = {
 }
 
 ---------- redis response
-local redcmd = {}
 
-redcmd[36] = function(fd, data) -- '$'
-	local bytes = tonumber(data)
-	if bytes < 0 then
-		return true,nil
-	end
-	local firstline = fd:read(bytes+2)
-	return true,string.sub(firstline,1,-3)
-end
-
-redcmd[43] = function(fd, data) -- '+'
-	return true,data
-end
-
-redcmd[45] = function(fd, data) -- '-'
-	return false,data
-end
+-- Replies are decoded in C from a per connection buffer, the bytes after a
+-- reply are kept for the next one. A reply that arrives in many chunks is
+-- scanned chunk by chunk and decoded once it's complete.
+local function new_reader()
+	local buf, pos = "", 1
+	local scanner = scan_new()
+	local reader = {}
 
-redcmd[58] = function(fd, data) -- ':'
-	-- todo: return string later
-	return true, tonumber(data)
-end
-
-local function read_response(fd)
-	local result = fd:readline "\r\n"
-	local firstchar = string.byte(result)
-	local data = string.sub(result,2)
-	return redcmd[firstchar](fd,data)
-end
-
-redcmd[42] = function(fd, data)	-- '*'
-	local n = tonumber(data)
-	if n < 0 then
-		return true, nil
+	function reader.reset()
+		buf, pos = "", 1
 	end
-	local bulk = {}
-	local noerr = true
-	for i = 1,n do
-		local ok, v = read_response(fd)
-		if not ok then
-			noerr = false
+
+	function reader.read(fd)
+		local ok, v, nextpos = decode(buf, pos)
+		if ok ~= nil then
+			pos = nextpos
+			return ok, v
+		end
+		local part = pos == 1 and buf or buf:sub(pos)
+		if #part < 0x10000 then
+			-- v is the bytes still missing
+			local data = v > 0x10000 and fd:read(v) or fd:read()
+			buf = part .. data
+			pos = 1
+			return reader.read(fd)
 		end
-		bulk[i] = v
+		local parts = { part }
+		scan(scanner, part, true)
+		repeat
+			local data = fd:read()
+			parts[#parts+1] = data
+		until scan(scanner, data)
+		buf = table.concat(parts)
+		pos = 1
+		ok, v, pos = decode(buf, pos)
+		return ok, v
 	end
-	return noerr, bulk
+
+	return reader
 end
 
 -------------------
@@ -77,160 +76,86 @@ end
 
 -- msg could be any type of value
 
-local function make_cache(f)
-	return setmetatable({}, {
-		__mode = "kv",
-		__index = f,
-	})
-end
-
-local header_cache = make_cache(function(t,k)
-		local s = "\r\n$" .. k .. "\r\n"
-		t[k] = s
-		return s
-	end)
-
-local command_cache = make_cache(function(t,cmd)
-		local s = "\r\n$"..#cmd.."\r\n"..cmd:upper()
-		t[cmd] = s
-		return s
-	end)
-
-local count_cache = make_cache(function(t,k)
-		local s = "*" .. k
-		t[k] = s
-		return s
-	end)
-
-local command_np_cache = make_cache(function(t, cmd)
-		local s = "*1" .. command_cache[cmd] .. "\r\n"
-		t[cmd] = s
-		return s
-	end)
-
-local function compose_message(cmd, msg)
-	if msg == nil then
-		return command_np_cache[cmd]
-	end
-
-	local t = type(msg)
-	local lines = {}
-
-	if t == "table" then
-		local n = msg.n or #msg
-		lines[1] = count_cache[n+1]
-		lines[2] = command_cache[cmd]
-		local idx = 3
-		for i = 1, n do
-			local v = msg[i]
-			if v == nil then
-				lines[idx] = "\r\n$-1"
-				idx = idx + 1
-			else
-				v= tostring(v)
-				lines[idx] = header_cache[#v]
-				lines[idx+1] = v
-				idx = idx + 2
-			end
-		end
-		lines[idx] = "\r\n"
-	else
-		msg = tostring(msg)
-		lines[1] = "*2"
-		lines[2] = command_cache[cmd]
-		lines[3] = header_cache[#msg]
-		lines[4] = msg
-		lines[5] = "\r\n"
-	end
-
-	return lines
-end
-
-local function redis_login(conf)
+local function redis_login(conf, reader)
 	local auth = conf.auth
 	local db = conf.db
-	if auth == nil and db == nil then
-		return
-	end
 	if auth then
 		if conf.username then
 			auth = { conf.username, auth }
 		end
 	end
 	return function(so)
+		-- drop the bytes left by the last connection
+		reader.reset()
+		local read_response = reader.read
 		if auth then
-			so:request(compose_message("AUTH", auth), read_response)
+			so:request(encode("AUTH", auth), read_response)
 		end
 		if db then
-			so:request(compose_message("SELECT", db), read_response)
+			so:request(encode("SELECT", db), read_response)
+		end
+		if conf.on_connect then
+			-- run again after each reconnection, e.g. CLIENT TRACKING, see skynet.db.redis.cache
+			conf.on_connect(function(cmd, ...)
+				return so:request(encode(cmd, table.pack(...)), read_response)
+			end)
 		end
 	end
 end
 
 function redis.connect(db_conf)
+	local reader = new_reader()
 	local channel = socketchannel.channel {
 		host = db_conf.host,
 		port = db_conf.port or 6379,
-		auth = redis_login(db_conf),
+		auth = redis_login(db_conf, reader),
 		nodelay = true,
 		overload = db_conf.overload,
 	}
 	-- try connect first only once
 	channel:connect(true)
-	return setmetatable( { channel }, meta )
+	return setmetatable( { channel, reader.read }, meta )
 end
 
 setmetatable(command, { __index = function(t,k)
 	local cmd = string.upper(k)
 	local f = function (self, v, ...)
 		if v == nil then
-			return self[1]:request(compose_message(cmd), read_response)
+			return self[1]:request(encode(cmd), self[2])
 		elseif type(v) == "table" then
-			return self[1]:request(compose_message(cmd, v), read_response)
+			return self[1]:request(encode(cmd, v), self[2])
 		else
-			return self[1]:request(compose_message(cmd, table.pack(v, ...)), read_response)
+			return self[1]:request(encode(cmd, table.pack(v, ...)), self[2])
 		end
 	end
 	t[k] = f
 	return f
 end})
 
-local function read_boolean(so)
-	local ok, result = read_response(so)
-	return ok, result ~= 0
-end
-
 function command:exists(key)
-	local fd = self[1]
-	return fd:request(compose_message ("EXISTS", key), read_boolean)
+	local read_response = self[2]
+	return self[1]:request(encode("EXISTS", key), function(so)
+		local ok, result = read_response(so)
+		return ok, result ~= 0
+	end)
 end
 
 function command:sismember(key, value)
-	local fd = self[1]
-	return fd:request(compose_message ("SISMEMBER", table.pack(key, value)), read_boolean)
-end
-
-local function compose_table(lines, msg)
-	local tinsert = table.insert
-	tinsert(lines, count_cache[#msg])
-	for _,v in ipairs(msg) do
-		v = tostring(v)
-		tinsert(lines,header_cache[#v])
-		tinsert(lines,v)
-	end
-	tinsert(lines, "\r\n")
-	return lines
+	local read_response = self[2]
+	return self[1]:request(encode("SISMEMBER", table.pack(key, value)), function(so)
+		local ok, result = read_response(so)
+		return ok, result ~= 0
+	end)
 end
 
+-- All the commands are sent in one write, and the replies are read back to
+-- back from the connection buffer.
 function command:pipeline(ops,resp)
 	assert(ops and #ops > 0, "pipeline is null")
 
 	local fd = self[1]
-
-	local cmds = {}
-	for _, cmd in ipairs(ops) do
-		compose_table(cmds, cmd)
-	end
+	local read_response = self[2]
+	local cmds = core.pipeline(ops)
 
 	if resp then
 		return fd:request(cmds, function (fd)
@@ -263,30 +188,30 @@ local watchmeta = {
 	end,
 }
 
-local function watch_login(conf, obj)
-	local login_auth = redis_login(conf)
+local function watch_login(conf, obj, reader)
+	local login_auth = redis_login(conf, reader)
 	return function(so)
-		if login_auth then
-			login_auth(so)
-		end
+		login_auth(so)
 		for k in pairs(obj.__psubscribe) do
-			so:request(compose_message ("PSUBSCRIBE", k))
+			so:request(encode("PSUBSCRIBE", k))
 		end
 		for k in pairs(obj.__subscribe) do
-			so:request(compose_message("SUBSCRIBE", k))
+			so:request(encode("SUBSCRIBE", k))
 		end
 	end
 end
 
 function redis.watch(db_conf)
+	local reader = new_reader()
 	local obj = {
 		__subscribe = {},
 		__psubscribe = {},
+		__read = reader.read,
 	}
 	local channel = socketchannel.channel {
 		host = db_conf.host,
 		port = db_conf.port or 6379,
-		auth = watch_login(db_conf, obj),
+		auth = watch_login(db_conf, obj, reader),
 		nodelay = true,
 	}
 	obj.__sock = channel
@@ -307,7 +232,7 @@ local function watch_func( name )
 		local so = self.__sock
 		for i = 1, select("#", ...) do
 			local v = select(i, ...)
-			so:request(compose_message(NAME, v))
+			so:request(encode(NAME, v))
 		end
 	end
 end
@@ -320,7 +245,7 @@ watch_func "punsubscribe"
 function watch:message()
 	local so = self.__sock
 	while true do
-		local ret = so:response(read_response)
+		local ret = so:response(self.__read)
 		local ttype , channel, data , data2 = ret[1], ret[2], ret[3], ret[4]
 		if ttype == "message" then
 			return data, channel
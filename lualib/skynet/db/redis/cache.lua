@@ -0,0 +1,215 @@
+-- Client-side caching of redis reads, invalidated by the server (CLIENT TRACKING, redis >= 6)
+--
+--	local rediscache = require "skynet.db.redis.cache"
+--	local c = rediscache.new({ host = "127.0.0.1", port = 6379 }, { max = 10000, prefix = { "cfg:" } })
+--	c:get "cfg:item"	-- the first read goes to redis, the others are served locally until the key changes
+--	c:hget("player:1", "name")
+--	c:read("zrange", "rank", 0, 9)	-- any read command whose first argument is the key
+--	c.db:set("cfg:item", "v2")	-- the connection for writes (and the reads not to be cached)
+--
+-- The reads are tracked by redis on the data connection, and the invalidations are redirected to a second
+-- connection subscribing __redis__:invalidate (it works with RESP2). prefix turns on the broadcasting mode:
+-- every change of the keys with these prefixes is sent, and redis keeps no per key state.
+-- After any reconnection the local cache is dropped, as the invalidations may be lost.
+-- The cache lives in the service calling new, with at most max keys (two generations, the older is dropped).
+-- The cached tables (hgetall, etc.) are shared by the readers, don't modify them.
+
+local skynet = require "skynet"
+local redis = require "skynet.db.redis"
+local singleflight = require "skynet.singleflight"
+
+local NIL = {}	-- a nil reply is cached too
+
+local cache = {}
+local cache_mt = { __index = cache }
+
+local rediscache = {}
+
+local function tracking_args(self)
+	local args = { "TRACKING", "on", "REDIRECT", self.redirect }
+	if self.prefix then
+		args[#args+1] = "BCAST"
+		for _, p in ipairs(self.prefix) do
+			args[#args+1] = "PREFIX"
+			args[#args+1] = p
+		end
+	end
+	return args
+end
+
+local function drop_all(self)
+	self.new, self.old = {}, {}
+	self.count = 0
+	self.inflight = {}
+	self.flight = singleflight.new()
+	self.counter.flush = self.counter.flush + 1
+end
+
+local function invalidate(self, key)
+	if self.new[key] then
+		self.new[key] = nil
+		self.count = self.count - 1
+	end
+	self.old[key] = nil
+	-- the reply of a read in flight may be older than this invalidation, don't cache it or share it with the new readers
+	local inflight = self.inflight[key]
+	if inflight then
+		self.inflight[key] = nil
+		for sub in pairs(inflight) do
+			self.flight:forget(key .. "\0" .. sub)
+		end
+	end
+	self.counter.invalidate = self.counter.invalidate + 1
+end
+
+local function listen(self)
+	while not self.closed do
+		local ok, keys, channel = pcall(self.watch.message, self.watch)
+		if self.closed then
+			break
+		end
+		if not ok then
+			skynet.error("redis cache invalidation : " .. tostring(keys))
+			drop_all(self)
+			skynet.sleep(100)
+		elseif channel == "__redis__:invalidate" then
+			if type(keys) == "table" then
+				for _, key in ipairs(keys) do
+					invalidate(self, key)
+				end
+			else
+				-- FLUSHDB / FLUSHALL
+				drop_all(self)
+			end
+		end
+	end
+end
+
+function rediscache.new(db_conf, opts)
+	opts = opts or {}
+	local self = setmetatable({
+		max = opts.max or 10000,
+		prefix = opts.prefix,
+		new = {},
+		old = {},
+		count = 0,
+		inflight = {},	-- key -> { sub = true } , the reads in flight
+		flight = singleflight.new(),
+		counter = { hit = 0, miss = 0, invalidate = 0, flush = 0 },
+	}, cache_mt)
+
+	local watch_conf = setmetatable({
+		on_connect = function(request)
+			self.redirect = request("CLIENT", "ID")
+			drop_all(self)
+			if self.db then
+				-- the data connection is alive, redirect its invalidations to the new id
+				self.db:client(tracking_args(self))
+			end
+		end,
+	}, { __index = db_conf })
+	self.watch = redis.watch(watch_conf)
+	self.watch:subscribe "__redis__:invalidate"
+
+	local data_conf = setmetatable({
+		on_connect = function(request)
+			request("CLIENT", table.unpack(tracking_args(self)))
+			drop_all(self)
+		end,
+	}, { __index = db_conf })
+	self.db = redis.connect(data_conf)
+	skynet.fork(listen, self)
+	return self
+end
+
+local function fetch(self, sub, cmd, key, ...)
+	local inflight = self.inflight[key]
+	if inflight == nil then
+		inflight = {}
+		self.inflight[key] = inflight
+	end
+	inflight[sub] = true
+	local ok, v = pcall(self.db[cmd], self.db, key, ...)
+	inflight[sub] = nil
+	if self.inflight[key] ~= inflight then
+		-- invalidated during the request
+		assert(ok, v)
+		return v
+	end
+	if next(inflight) == nil then
+		self.inflight[key] = nil
+	end
+	assert(ok, v)
+	local entry = self.new[key]
+	if entry == nil then
+		if self.count >= self.max then
+			self.old = self.new
+			self.new = {}
+			self.count = 0
+		end
+		entry = {}
+		self.new[key] = entry
+		self.count = self.count + 1
+	end
+	if v == nil then
+		entry[sub] = NIL
+	else
+		entry[sub] = v
+	end
+	return v
+end
+
+function cache:read(cmd, key, ...)
+	local sub = select("#", ...) == 0 and cmd or table.concat({ cmd, ... }, "\0")
+	local entry = self.new[key]
+	if entry == nil then
+		entry = self.old[key]
+		if entry then
+			-- move it to the new generation
+			self.old[key] = nil
+			self.new[key] = entry
+			self.count = self.count + 1
+		end
+	end
+	if entry then
+		local v = entry[sub]
+		if v ~= nil then
+			self.counter.hit = self.counter.hit + 1
+			if v == NIL then
+				return nil
+			end
+			return v
+		end
+	end
+	self.counter.miss = self.counter.miss + 1
+	-- the concurrent misses of the same read share one request
+	return self.flight:call(key .. "\0" .. sub, fetch, self, sub, cmd, key, ...)
+end
+
+function cache:get(key)
+	return self:read("get", key)
+end
+
+function cache:hget(key, field)
+	return self:read("hget", key, field)
+end
+
+function cache:hgetall(key)
+	return self:read("hgetall", key)
+end
+
+function cache:stat()
+	local s = { keys = self.count }
+	for k, v in pairs(self.counter) do
+		s[k] = v
+	end
+	return s
+end
+
+function cache:disconnect()
+	self.closed = true
+	self.db:disconnect()
+	self.watch:disconnect()
+end
+
+return rediscache
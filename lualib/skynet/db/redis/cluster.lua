@@ -3,10 +3,11 @@
 
 local skynet = require "skynet"
 local redis = require "skynet.db.redis"
-local crc16 = require "skynet.db.redis.crc16"
+local core = require "skynet.redis.core"
 
-local RedisClusterHashSlots = 16384
 local RedisClusterRequestTTL = 16
+-- Min interval of CLUSTER SLOTS refreshes triggered by MOVED, in 1/100s
+local RedisClusterRefreshInterval = 100
 
 local sync = {
 	once = {
@@ -58,6 +59,7 @@ function _M.new(startup_nodes,opt,onmessage)
 		connections = {},
 		opt = opt,
 		refresh_table_asap = false,
+		refresh_time = 0,
 
 		-- for subscribe/publish
 		__onmessage = onmessage,
@@ -94,8 +96,9 @@ end
 -- Contact the startup nodes and try to fetch the hash slots -> instances
 -- map in order to initialize the @slots hash.
 function rediscluster:initialize_slots_cache()
-	self.slots = {}
-	self.nodes = {}
+	-- the requests during the refresh still use the old cache
+	local slots = {}
+	local nodes = {}
 	for _,startup_node in ipairs(self.startup_nodes) do
 		local ok = pcall(function ()
 			local conn = self:get_connection(startup_node)
@@ -121,9 +124,9 @@ function rediscluster:initialize_slots_cache()
 					self:set_node_name(slave_node)
 					table.insert(master_node.slaves,slave_node)
 				end
-				table.insert(self.nodes,master_node)
+				table.insert(nodes,master_node)
 				for slot=tonumber(result[1]),tonumber(result[2]) do
-					self.slots[slot] = master_node
+					slots[slot] = master_node
 				end
 			end
 			self.refresh_table_asap = false
@@ -133,6 +136,22 @@ function rediscluster:initialize_slots_cache()
 			break
 		end
 	end
+	self.slots = slots
+	self.nodes = nodes
+	self.refresh_time = skynet.now()
+end
+
+-- Refresh the slots cache after MOVED replies. The concurrent callers share
+-- one CLUSTER SLOTS request, and the refreshes are at least
+-- RedisClusterRefreshInterval apart, so a resharding doesn't cause a refresh
+-- for every redirected request. The slot of each MOVED reply is updated at
+-- once anyway.
+function rediscluster:refresh_slots_cache()
+	if skynet.now() - self.refresh_time < RedisClusterRefreshInterval then
+		return
+	end
+	local ok, err = sync.once.Do(self, self.initialize_slots_cache, self)
+	assert(ok, err)
 end
 
 -- Flush the cache, mostly useful for debugging when we want to force
@@ -142,19 +161,12 @@ function rediscluster:flush_slots_cache()
 end
 
 -- Return the hash slot from the key.
+-- Only hash what is inside {...} if there is such a pattern in the key.
+-- Note that the specification requires the content that is between
+-- the first { and the first } after the first {. If we found {} without
+-- nothing in the middle, the whole key is hashed as usually.
 function rediscluster:keyslot(key)
-	-- Only hash what is inside {...} if there is such a pattern in the key.
-	-- Note that the specification requires the content that is between
-	-- the first { and the first } after the first {. If we found {} without
-	-- nothing in the middle, the whole key is hashed as usually.
-	local startpos = string.find(key,"{",1,true)
-	if startpos then
-		local endpos = string.find(key,"}",startpos+1,true)
-		if endpos and endpos ~= startpos + 1 then
-			key = string.sub(key,startpos+1,endpos-1)
-		end
-	end
-	return crc16(key) % RedisClusterHashSlots
+	return core.keyslot(tostring(key))
 end
 
 -- Return the first key in the command arguments.
@@ -327,7 +339,7 @@ function rediscluster:call(...)
 	end
 
 	if self.refresh_table_asap then
-		self:initialize_slots_cache()
+		self:refresh_slots_cache()
 	end
 	local ttl = RedisClusterRequestTTL	-- Max number of redirections
 	local err
@@ -407,6 +419,124 @@ function rediscluster:call(...)
 	error(string.format("Too many Cluster redirections?,maybe node is disconnected (last error: %q)",err))
 end
 
+-- Pipeline the commands which may be on different nodes.
+-- ops is a list of {cmd, args...}. The commands are grouped by the node of
+-- their key slot, and each group is sent as one redis pipeline, all the
+-- groups in parallel. The commands failed with MOVED/ASK or a socket error
+-- are retried one by one with rediscluster:call.
+-- If resp is given, the result of each command is appended to it as
+-- {ok = ok, out = out}, in the order of ops. Or returns the last result.
+function rediscluster:pipeline(ops, resp)
+	assert(ops and #ops > 0, "pipeline is null")
+	if self.refresh_table_asap then
+		self:refresh_slots_cache()
+	end
+
+	local groups = {}	-- node name -> { node = node, index = {}, ops = {} }
+	local random_group
+	for i, op in ipairs(ops) do
+		local key = self:get_key_from_command(op)
+		if not key then
+			error("No way to dispatch this command to Redis Cluster: " .. tostring(op[1]))
+		end
+		local node = self.slots[self:keyslot(key)]
+		local g
+		if node then
+			g = groups[node.name]
+			if not g then
+				g = { node = node, index = {}, ops = {} }
+				groups[node.name] = g
+			end
+		else
+			-- unknown slot, call them one by one
+			random_group = random_group or { index = {}, ops = {} }
+			g = random_group
+		end
+		table.insert(g.index, i)
+		table.insert(g.ops, op)
+	end
+
+	local result = {}
+	local function send(g)
+		local r = {}
+		local ok, err = pcall(function()
+			local conn = self:get_connection(g.node)
+			conn:pipeline(g.ops, r)
+		end)
+		for j, i in ipairs(g.index) do
+			local v = r[j]
+			if not ok then
+				result[i] = { ok = false, out = tostring(err), retry = true }
+			elseif v == nil then
+				result[i] = { ok = false, out = "no reply in the pipeline", retry = true }
+			elseif not v.ok and type(v.out) == "string" and (v.out:find "^MOVED " or v.out:find "^ASK ") then
+				result[i] = { ok = false, out = v.out, retry = true }
+			else
+				result[i] = v
+			end
+		end
+	end
+
+	local co = coroutine.running()
+	local n = 0
+	for _, g in pairs(groups) do
+		n = n + 1
+	end
+	local waiting = n > 1
+	local send_err
+	for _, g in pairs(groups) do
+		if waiting then
+			skynet.fork(function()
+				-- the caller waits for every group, an error is raised to it after all are done
+				local ok, err = pcall(send, g)
+				if not ok then
+					send_err = send_err or err
+				end
+				n = n - 1
+				if n == 0 then
+					skynet.wakeup(co)
+				end
+			end)
+		else
+			send(g)
+		end
+	end
+	if waiting then
+		skynet.wait(co)
+		if send_err then
+			error(send_err)
+		end
+	end
+
+	if random_group then
+		for _, i in ipairs(random_group.index) do
+			result[i] = { retry = true }
+		end
+	end
+	for i, op in ipairs(ops) do
+		local v = result[i]
+		if v.retry then
+			local ok, out = pcall(self.call, self, table.unpack(op))
+			if not ok then
+				out = string.match(tostring(out), ".+:%d+:%s(.*)$") or out
+			end
+			result[i] = { ok = ok, out = out }
+		end
+	end
+
+	if resp then
+		for i = 1, #ops do
+			table.insert(resp, result[i])
+		end
+		return true, resp
+	end
+	local last = result[#ops]
+	if not last.ok then
+		error(last.out)
+	end
+	return last.out
+end
+
 function rediscluster:get_watch_connection_by_slot(slot)
 	if not self.slots[slot] then
 		self:initialize_slots_cache()
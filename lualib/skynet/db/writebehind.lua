@@ -0,0 +1,72 @@
+local skynet = require "skynet"
+
+--[[
+	A write-behind cache in its own service : the writes are coalesced by key in memory,
+	and flushed to the database in batches.
+
+	local wb = writebehind.new {
+		backend = "mysql",	-- "mysql", "redis", or the name of a module returning function(conf) -> { flush = f(batch), close = f() }
+		db = { host = "127.0.0.1", user = "root", password = "", database = "game" },	-- passed to mysql.connect / redis.connect
+		table = "player",	-- mysql : the table, and its primary key column
+		key = "id",
+		prefix = "player:",	-- redis : key prefix, table values are hashes (HSET), the others are strings (SET)
+		interval = 100,		-- flush every interval (in 1/100s)
+		batch = 1000,		-- or as soon as so many keys are dirty
+		max_keys = 10000,	-- wb:set blocks when so many keys are dirty, until a flush frees them
+		retry = 100,		-- wait before retrying a failed flush (in 1/100s)
+	}
+	wb:set(id, { gold = 100 })	-- table values are patches, merged with the pending ones of the same key
+	wb:set(id, { level = 2 })	-- one row is written : gold = 100, level = 2
+	wb:delete(id)
+	local value, reset = wb:pending(id)	-- read your own writes before they reach the db
+	wb:flush()	-- wait until everything written so far is in the db
+	wb:close()	-- flush and exit, call it before the node shuts down
+
+	The writes of one key reach the db in the order they are made : there is one flush at a time,
+	a delete before a patch in the same batch is executed first, and a failed batch is retried
+	under the newer writes.
+]]
+
+local writebehind = {}
+local cache = {}
+local cache_mt = { __index = cache }
+
+function writebehind.new(opts)
+	local addr = skynet.newservice "writebehindd"
+	skynet.call(addr, "lua", "init", opts)
+	return writebehind.bind(addr)
+end
+
+-- use a cache created by another service
+function writebehind.bind(addr)
+	return setmetatable({ addr = addr }, cache_mt)
+end
+
+-- It returns at once unless max_keys is reached
+function cache:set(key, value)
+	skynet.call(self.addr, "lua", "set", key, value)
+end
+
+function cache:delete(key)
+	skynet.call(self.addr, "lua", "delete", key)
+end
+
+-- The value not flushed yet of key : nil if there is nothing pending,
+-- reset is true when the key is deleted (value is nil) or replaced by value before writing it
+function cache:pending(key)
+	return skynet.call(self.addr, "lua", "pending", key)
+end
+
+function cache:flush()
+	return skynet.call(self.addr, "lua", "flush")
+end
+
+function cache:stat()
+	return skynet.call(self.addr, "lua", "stat")
+end
+
+function cache:close()
+	skynet.call(self.addr, "lua", "close")
+end
+
+return writebehind
@@ -35,12 +35,83 @@ local function init(skynet, export)
 			gcing = false
 		end
 
+		function dbgcmd.GCSTAT()
+			skynet.ret(skynet.pack(skynet.stat "gc"))
+		end
+
+		function dbgcmd.GCPOLICY(policy)
+			if policy then
+				skynet.gcpolicy(policy)
+			end
+			skynet.ret(skynet.pack(skynet.gcpolicy()))
+		end
+
+		-- CPU sampling, see profile.sample in service_snlua.c
+		function dbgcmd.CPUPROF(count)
+			local profile = require "skynet.profile"
+			skynet.ret(skynet.pack(profile.sample(count)))
+		end
+
+		function dbgcmd.CPUSAMPLES()
+			local profile = require "skynet.profile"
+			skynet.ret(skynet.pack(profile.samples()))
+		end
+
+		-- flag : true / false turns on / off the cpu accounting, see skynet.cpustat
+		function dbgcmd.CPUSTAT(flag)
+			local stat, tasks = skynet.cpustat(flag)
+			if stat then
+				local t = {}
+				for co, v in pairs(tasks) do
+					t[tostring(co)] = v
+				end
+				tasks = t
+			end
+			skynet.ret(skynet.pack(stat, tasks))
+		end
+
 		function dbgcmd.STAT()
 			local stat = {}
 			stat.task = skynet.task()
 			stat.mqlen = skynet.stat "mqlen"
 			stat.cpu = skynet.stat "cpu"
 			stat.message = skynet.stat "message"
+			stat.weight = skynet.stat "weight"
+			stat.dropped = skynet.stat "dropped"
+			stat.stall = skynet.stat "stall"
+			local inline = skynet.stat "inline"
+			if inline > 0 then
+				stat.inline = inline
+			end
+			local expired = skynet.stat "expired"
+			if expired > 0 then
+				stat.expired = expired
+			end
+			local preempt = skynet.stat "preempt"
+			if preempt > 0 then
+				stat.preempt = preempt
+			end
+			if skynet.stat "latency" == 1 then
+				stat.wait_p99 = skynet.stat "wait_p99"
+				stat.cost_p99 = skynet.stat "cost_p99"
+			end
+			skynet.ret(skynet.pack(stat))
+		end
+
+		local latency_stat = { "count", "mean", "p50", "p90", "p99", "p99.9", "max" }
+
+		function dbgcmd.LATENCY(flag)
+			if flag then
+				require "skynet.manager"
+				skynet.latency(flag)
+			end
+			local stat = {}
+			if skynet.stat "latency" == 1 then
+				for _, what in ipairs(latency_stat) do
+					stat["wait_" .. what] = skynet.stat("wait_" .. what)
+					stat["cost_" .. what] = skynet.stat("cost_" .. what)
+				end
+			end
 			skynet.ret(skynet.pack(stat))
 		end
 
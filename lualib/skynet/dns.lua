@@ -72,10 +72,16 @@ local MAX_LABEL_LEN = 63
 local MAX_PACKET_LEN = 2048
 local DNS_HEADER_LEN = 12
 local TIMEOUT = 30 * 100	-- 30 seconds
+local MAX_SERVERS = 3	-- MAXNS of resolv.conf
+local NEGATIVE_TTL = 5 * 60 * 100	-- the limit of caching NXDOMAIN/NODATA, RFC 2308 section 5
+local FAILURE_TTL = 30 * 100	-- caching server failure or timeout, RFC 2308 section 7
+local STALE_TTL = 30 * 100	-- an expired answer is still returned while it's refreshed
+local FAILURE_WAIT = 100	-- wait for the other servers after a server failure
 
 local QTYPE = {
 	A = 1,
 	CNAME = 5,
+	SOA = 6,
 	AAAA = 28,
 }
 
@@ -83,12 +89,20 @@ local QCLASS = {
 	IN = 1,
 }
 
-local weak = {__mode = "kv"}
+local RCODE = {
+	NOERROR = 0,
+	NXDOMAIN = 3,
+}
+
+-- CACHE[qtype][name] = { answers = , err = , expire = , ttl = }, err for a negative answer
 local CACHE = {}
 
 local dns = {}
-local request_pool = {}
+local request_pool = {}	-- tid -> request
+local query_pool = {}	-- qtype -> name -> request, the callers of one name share the query
 local local_hosts -- local static table lookup for hostnames
+local shared = skynet.getenv "dns_shared" == "true"	-- use the cache of service dnsd
+local dnsd
 
 dns.DEFAULT_HOSTS = "/etc/hosts"
 dns.DEFAULT_RESOLV_CONF = "/etc/resolv.conf"
@@ -159,23 +173,41 @@ local function parse_resolv_conf()
 		return
 	end
 
-	local server
+	local servers = {}
 	for line in f:lines() do
-		server = line:match("^%s*nameserver%s+([^#;%s]+)")
-		if server then
-			break
+		local server = line:match("^%s*nameserver%s+([^#;%s]+)")
+		if server and #servers < MAX_SERVERS then
+			servers[#servers+1] = server
 		end
 	end
 	f:close()
-	return server
+	if servers[1] then
+		return servers
+	end
 end
 
-function dns.flush()
-	CACHE[QTYPE.A] = setmetatable({},weak)
-	CACHE[QTYPE.AAAA] = setmetatable({},weak)
+local function init_cache()
+	CACHE[QTYPE.A] = {}
+	CACHE[QTYPE.AAAA] = {}
+	query_pool[QTYPE.A] = query_pool[QTYPE.A] or {}
+	query_pool[QTYPE.AAAA] = query_pool[QTYPE.AAAA] or {}
 end
 
-dns.flush()
+init_cache()
+
+local function shared_service()
+	if not dnsd then
+		dnsd = skynet.uniqueservice "dnsd"
+	end
+	return dnsd
+end
+
+function dns.flush()
+	init_cache()
+	if shared then
+		skynet.send(shared_service(), "lua", "FLUSH")
+	end
+end
 
 local function verify_domain_name(name)
 	if #name > MAX_DOMAIN_LEN then
@@ -301,12 +333,34 @@ local function unpack_rdata(qtype, chunk)
 end
 
 local dns_server = {
-	fd = nil,
-	address = nil,
-	port = nil,
+	list = nil,	-- { { address = , port = , fd = }, ... }
+	open = false,
 	retire = nil,
 }
 
+local function finish(req)
+	request_pool[req.tid] = nil
+	query_pool[req.qtype][req.name] = nil
+	for _, co in ipairs(req.waiting) do
+		skynet.wakeup(co)
+	end
+end
+
+-- no answer from any server, keep the old answers if there are
+local function fail(req, err)
+	local entry = CACHE[req.qtype][req.name]
+	local now = skynet.now()
+	if entry and entry.answers then
+		entry.expire = now + FAILURE_TTL
+		entry.ttl = FAILURE_TTL
+		req.answers = entry.answers
+	else
+		CACHE[req.qtype][req.name] = { err = err, expire = now + FAILURE_TTL, ttl = FAILURE_TTL }
+		req.err = err
+	end
+	finish(req)
+end
+
 local function resolve(content)
 	if #content < DNS_HEADER_LEN then
 		-- drop
@@ -314,10 +368,36 @@ local function resolve(content)
 		return
 	end
 	local answer_header,left = unpack_header(content)
+	local req = request_pool[answer_header.tid]
+	if not req then
+		-- the req may be timeout, or answered by another server
+		return
+	end
 	-- verify answer
 	assert(answer_header.qdcount == 1, "malformed packet")
 
 	local question,left = unpack_question(content, left)
+	if question.name:lower() ~= req.name or question.atype ~= req.qtype then
+		skynet.error("Recv an invalid name when dns query")
+		return
+	end
+
+	local rcode = answer_header.flags & 0xf
+	if rcode ~= RCODE.NOERROR and rcode ~= RCODE.NXDOMAIN then
+		-- SERVFAIL or REFUSED, wait for the other servers for a while, they may be down
+		req.pending = req.pending - 1
+		if req.pending == 0 then
+			fail(req, "server failure")
+		elseif not req.failed then
+			req.failed = true
+			skynet.timeout(FAILURE_WAIT, function()
+				if request_pool[req.tid] == req then
+					fail(req, "server failure")
+				end
+			end)
+		end
+		return
+	end
 
 	local ttl
 	local answer
@@ -341,71 +421,119 @@ local function resolve(content)
 		end
 	end
 
+	local now = skynet.now()
+	if ttl then
+		-- at least 1 second, or a hot name with TTL 0 would be queried on every call
+		ttl = math.max(ttl, 1) * 100
+	end
 	if answers_ipv4 then
-		CACHE[QTYPE.A][question.name] = { answers = answers_ipv4, ttl = skynet.now() + ttl * 100 }
+		CACHE[QTYPE.A][req.name] = { answers = answers_ipv4, expire = now + ttl, ttl = ttl }
 	end
 
 	if answers_ipv6 then
-		CACHE[QTYPE.AAAA][question.name] = { answers = answers_ipv6, ttl = skynet.now() + ttl * 100 }
+		CACHE[QTYPE.AAAA][req.name] = { answers = answers_ipv6, expire = now + ttl, ttl = ttl }
 	end
 
-	local resp = request_pool[answer_header.tid]
-	if not resp then
-		-- the resp may be timeout
-		return
+	local answers = req.qtype == QTYPE.A and answers_ipv4 or answers_ipv6
+	if answers then
+		req.answers = answers
+	else
+		-- NXDOMAIN or NODATA, cached for the TTL of SOA in the authority section
+		local negative_ttl
+		for i=1, answer_header.nscount do
+			answer, left = unpack_answer(content, left)
+			if answer.atype == QTYPE.SOA and #answer.rdata >= 4 then
+				-- MINIMUM is the last field of SOA
+				local minimum = string.unpack(">I4", answer.rdata, #answer.rdata - 3)
+				negative_ttl = math.min(answer.ttl, minimum) * 100
+			end
+		end
+		req.err = rcode == RCODE.NXDOMAIN and "no such name" or "no answer"
+		if negative_ttl then
+			negative_ttl = math.min(negative_ttl, NEGATIVE_TTL)
+			CACHE[req.qtype][req.name] = { err = req.err, expire = now + negative_ttl, ttl = negative_ttl }
+		end
 	end
 
-	if question.name ~= resp.name then
-		skynet.error("Recv an invalid name when dns query")
-	end
+	finish(req)
+end
 
-	local r = CACHE[resp.qtype][resp.name]
-	if r then
-		resp.answers = r.answers
+local function close_server()
+	if dns_server.open then
+		dns_server.open = false
+		for _, server in ipairs(dns_server.list) do
+			local fd = server.fd
+			if fd then
+				server.fd = nil
+				socket.close(fd)
+				skynet.error(string.format("Udp server close %s:%s (%d)", server.address, server.port, fd))
+			end
+		end
 	end
-
-	skynet.wakeup(resp.co)
 end
 
 local function connect_server()
-	local fd = socket.udp(function(str, from)
-		resolve(str)
-	end)
-
-	if not dns_server.address then
-		dns_server.address = parse_resolv_conf()
-		dns_server.port = 53
+	if not dns_server.list then
+		local list = {}
+		for _, address in ipairs(parse_resolv_conf() or {}) do
+			list[#list+1] = { address = address, port = 53 }
+		end
+		dns_server.list = list
+	end
+
+	assert(dns_server.list[1], "Call dns.server first")
+
+	local err
+	for _, server in ipairs(dns_server.list) do
+		local fd = socket.udp(function(str, from)
+			resolve(str)
+		end)
+		local ok
+		ok, err = pcall(socket.udp_connect, fd, server.address, server.port)
+		if ok then
+			server.fd = fd
+			dns_server.open = true
+			skynet.error(string.format("Udp server open %s:%s (%d)", server.address, server.port, fd))
+		else
+			socket.close(fd)
+			skynet.error(string.format("Udp server %s:%s : %s", server.address, server.port, err))
+		end
 	end
-
-	assert(dns_server.address, "Call dns.server first")
-
-	local ok, err = pcall(socket.udp_connect,fd, dns_server.address, dns_server.port)
-	if not ok then
-		socket.close(fd)
+	if not dns_server.open then
 		error(err)
 	end
+end
 
-	dns_server.fd = fd
-	skynet.error(string.format("Udp server open %s:%s (%d)", dns_server.address, dns_server.port, fd))
+-- drop the entries expired long ago
+local function sweep_cache()
+	local now = skynet.now()
+	for _, cache in pairs(CACHE) do
+		for name, entry in pairs(cache) do
+			if entry.expire + STALE_TTL < now then
+				cache[name] = nil
+			end
+		end
+	end
 end
 
 local DNS_SERVER_RETIRE = 60 * 100
 local function touch_server()
 	dns_server.retire = skynet.now()
-	if dns_server.fd then
+	if dns_server.open then
 		return
 	end
 
 	connect_server()
+	local list = dns_server.list
 
 	local function check_alive()
+		if list ~= dns_server.list or not dns_server.open then
+			-- changed by dns.server
+			return
+		end
+		sweep_cache()
 		if skynet.now() > dns_server.retire + DNS_SERVER_RETIRE then
-			local fd = dns_server.fd
-			if fd then
-				dns_server.fd = nil
-				socket.close(fd)
-				skynet.error(string.format("Udp server close %s:%s (%d)", dns_server.address, dns_server.port, fd))
-			end
+			close_server()
 		else
 			skynet.timeout( 2 * DNS_SERVER_RETIRE, check_alive)
 		end
@@ -414,48 +542,95 @@ local function touch_server()
 	skynet.timeout( 2 * DNS_SERVER_RETIRE, check_alive)
 end
 
+-- server : an address or a list of addresses, the queries are sent to all of them and the first answer wins.
+-- nil for the nameservers in resolv.conf
 function dns.server(server, port)
-	dns_server.address = server
-	dns_server.port = port or 53
+	if shared then
+		skynet.send(shared_service(), "lua", "SERVER", server, port)
+		return
+	end
+	close_server()
+	if server == nil then
+		dns_server.list = nil
+		return
+	end
+	if type(server) ~= "table" then
+		server = { server }
+	end
+	local list = {}
+	for i, address in ipairs(server) do
+		list[i] = { address = address, port = port or 53 }
+	end
+	dns_server.list = list
 end
 
-local function lookup_cache(name, qtype, ignorettl)
-	local result = CACHE[qtype][name]
-	if result then
-		if ignorettl or (result.ttl > skynet.now()) then
-			return result.answers
+-- send the query to all the servers, or join the query of the same name
+local function query(name, qtype)
+	local req = query_pool[qtype][name]
+	if not req then
+		touch_server()
+		local question_header = {
+			tid = gen_tid(),
+			flags = 0x100, -- flags: 00000001 00000000, set RD
+			qdcount = 1,
+		}
+		local packet = pack_header(question_header) .. pack_question(name, qtype, QCLASS.IN)
+		req = {
+			name = name,
+			tid = question_header.tid,
+			qtype = qtype,
+			pending = 0,	-- the servers not answered
+			waiting = {},
+		}
+		for _, server in ipairs(dns_server.list) do
+			if server.fd then
+				socket.write(server.fd, packet)
+				req.pending = req.pending + 1
+			end
 		end
+		request_pool[req.tid] = req
+		query_pool[qtype][name] = req
+		skynet.timeout(TIMEOUT, function()
+			if request_pool[req.tid] == req then
+				skynet.error(string.format("DNS query %s timeout", name))
+				fail(req, "timeout")
+			end
+		end)
 	end
+	local co = coroutine.running()
+	table.insert(req.waiting, co)
+	skynet.wait(co)
+	return req
 end
 
-local function suspend(tid, name, qtype)
-	local req = {
-		name = name,
-		tid = tid,
-		qtype = qtype,
-		co = coroutine.running(),
-	}
-	request_pool[tid] = req
-	skynet.fork(function()
-		skynet.sleep(TIMEOUT)
-		local req = request_pool[tid]
-		if req then
-			-- cancel tid
-			skynet.error(string.format("DNS query %s timeout", name))
-			request_pool[tid] = nil
-			skynet.wakeup(req.co)
-		end
-	end)
-	skynet.wait(req.co)
-	request_pool[tid] = nil
-	if not req.answers then
-		local answers = lookup_cache(name, qtype, true)
-		if answers then
-			return answers[1], answers
+local function refresh(name, qtype)
+	if not query_pool[qtype][name] then
+		skynet.fork(function()
+			local ok, err = pcall(query, name, qtype)
+			if not ok then
+				skynet.error(string.format("DNS refresh %s : %s", name, err))
+			end
+		end)
+	end
+end
+
+-- An answer in the last tenth of its TTL is refreshed before it expires, and an expired one
+-- is still returned for STALE_TTL while it's refreshed, so the hot names never wait for a query.
+local function lookup_cache(name, qtype)
+	local entry = CACHE[qtype][name]
+	if entry then
+		local left = entry.expire - skynet.now()
+		if entry.answers then
+			if left > -STALE_TTL then
+				if left < entry.ttl // 10 then
+					refresh(name, qtype)
+				end
+				return entry
+			end
+		elseif left > 0 then
+			return entry
 		end
-		error "timeout or no answer"
 	end
-	return req.answers[1], req.answers
 end
 
 -- lookup local static table
@@ -479,22 +654,31 @@ local function local_resolve(name, ipv6)
 	return nil
 end
 
+-- lookup the cache of dnsd, and keep its answers until they expire
+local function shared_resolve(name, ipv6)
+	local qtype = ipv6 and QTYPE.AAAA or QTYPE.A
+	local entry = CACHE[qtype][name]
+	if entry and entry.expire > skynet.now() then
+		return entry.answers[1], entry.answers
+	end
+	local answers, left = skynet.call(shared_service(), "lua", "RESOLVE", name, ipv6)
+	if not answers then
+		error(left)
+	end
+	if left > 0 then
+		CACHE[qtype][name] = { answers = answers, expire = skynet.now() + left }
+	end
+	return answers[1], answers
+end
+
 -- lookup dns server
 local function remote_resolve(name, ipv6)
 	local qtype = ipv6 and QTYPE.AAAA or QTYPE.A
-	local answers = lookup_cache(name, qtype)
-	if answers then
-		return answers[1], answers
+	local result = lookup_cache(name, qtype) or query(name, qtype)
+	if result.answers then
+		return result.answers[1], result.answers
 	end
-	local question_header = {
-		tid = gen_tid(),
-		flags = 0x100, -- flags: 00000001 00000000, set RD
-		qdcount = 1,
-	}
-	local req = pack_header(question_header) .. pack_question(name, qtype, QCLASS.IN)
-	touch_server()
-	socket.write(dns_server.fd, req)
-	return suspend(question_header.tid, name, qtype)
+	error(result.err)
 end
 
 function dns.resolve(name, ipv6)
@@ -516,7 +700,25 @@ function dns.resolve(name, ipv6)
 		return answer, answers
 	end
 
+	if shared then
+		return shared_resolve(name, ipv6)
+	end
 	return remote_resolve(name, ipv6)
 end
 
+-- the ticks before the cached answers of name expire, 0 if there isn't
+function dns.ttl(name, ipv6)
+	local entry = CACHE[ipv6 and QTYPE.AAAA or QTYPE.A][name:lower()]
+	if entry and entry.answers then
+		return math.max(entry.expire - skynet.now(), 0)
+	end
+	return 0
+end
+
+-- true to resolve by the cache of service dnsd shared by the services of this node,
+-- the default is dns_shared in config
+function dns.shared(enable)
+	shared = enable
+end
+
 return dns
@@ -0,0 +1,59 @@
+local skynet = require "skynet"
+local core = require "skynet.fileio.core"
+
+--[[
+	Asynchronous file I/O. The requests run in a pool of I/O threads shared by the whole node,
+	and the calling coroutine waits for the response like skynet.call, so a slow disk never blocks a worker thread.
+	config :
+		fileio_thread = 4	-- the number of I/O threads, 2 by default ; the first service using fileio starts them
+	Every function returns nil, errmsg on failure :
+		fileio.read(filename [, offset, size])	-- the content as a string
+		fileio.write(filename, data [, sync])	-- truncate or create, fsync before return if sync
+		fileio.append(filename, data [, sync])
+		fileio.fsync(filename)
+		fileio.stat(filename)	-- { size = , mtime = , type = "file" | "directory" | "other" }
+		fileio.list(dirname)	-- the names in the directory, without "." and ".."
+	fileio.info() returns the number of I/O threads and the queued requests.
+]]
+
+local fileio = {}
+
+local self
+
+local function request(f, ...)
+	if self == nil then
+		core.start(tonumber(skynet.getenv "fileio_thread") or 2)
+		self = skynet.self()
+	end
+	local session = skynet.genid()
+	f(self, session, ...)
+	return core.result(skynet.waitresponse(session))
+end
+
+function fileio.read(filename, offset, size)
+	return request(core.read, filename, offset, size)
+end
+
+function fileio.write(filename, data, sync)
+	return request(core.write, filename, data, false, sync)
+end
+
+function fileio.append(filename, data, sync)
+	return request(core.write, filename, data, true, sync)
+end
+
+function fileio.fsync(filename)
+	return request(core.fsync, filename)
+end
+
+function fileio.stat(filename)
+	return request(core.stat, filename)
+end
+
+function fileio.list(dirname)
+	return request(core.list, dirname)
+end
+
+fileio.info = core.info
+
+return fileio
@@ -0,0 +1,69 @@
+local skynet = require "skynet"
+local core = require "skynet.journal.core"
+
+--[[
+	Message journal of a service. After journal.open, every message the service receives (except socket messages)
+	is appended to a binary journal by a writer thread shared by the node, so dispatching never waits for the disk.
+	The service saves a snapshot of its state from time to time ; a restarted service loads the snapshot and replays
+	the messages journaled after it.
+	config :
+		journalpath = "./journal"	-- the directory of the journal files, "." by default
+	The files are journalpath/name.journal and journalpath/name.snapshot .
+		journal.open(name)	-- start journaling the messages of this service, continue an existing journal
+		journal.snapshot(data)	-- data is a string ; returns the seq of the last message included by the snapshot
+		journal.close()
+		journal.load(name)	-- returns the snapshot data (or nil) and an iterator over the messages after it :
+			for seq, source, typename, session, msg in iter do ... end
+			msg is a string, ie. skynet.unpack(msg) for lua messages.
+	Call load before open, the journal is truncated after each snapshot.
+	Records are not fsynced, the journal survives a crash of the service or the process but not of the system.
+]]
+
+local journal = {}
+
+local function filenames(name)
+	local path = skynet.getenv "journalpath" or "."
+	return path .. "/" .. name .. ".journal", path .. "/" .. name .. ".snapshot"
+end
+
+function journal.open(name)
+	core.open(filenames(name))
+end
+
+function journal.close()
+	core.close()
+end
+
+function journal.snapshot(data)
+	return core.snapshot(data)
+end
+
+local typenames = {}
+for k, v in pairs(skynet) do
+	if type(k) == "string" and k:sub(1, 6) == "PTYPE_" then
+		typenames[v] = k:sub(7):lower()
+	end
+end
+
+function journal.load(name)
+	local snapshot_seq, snapshot, content = core.load(filenames(name))
+	if content == nil then
+		return snapshot, function() end
+	end
+	local pos = 4
+	local function iter()
+		while true do
+			local next_pos, seq, source, ptype, session, msg = core.record(content, pos)
+			if next_pos == nil then
+				return
+			end
+			pos = next_pos
+			if seq > snapshot_seq then
+				return seq, source, typenames[ptype] or ptype, session, msg
+			end
+		end
+	end
+	return snapshot, iter
+end
+
+return journal
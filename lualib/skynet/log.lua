@@ -0,0 +1,137 @@
+local skynet = require "skynet"
+local c = require "skynet.core"
+
+local select = select
+local type = type
+local tostring = tostring
+local pack = skynet.pack
+
+--[[
+	Structured log with levels.
+
+	log.info(fmt, ...) checks the level first, so a filtered message costs one
+	comparison. An enabled message is sent to the logger unformatted: the
+	arguments are packed by lua-seri and the logger renders them, so
+	string.format doesn't run in the service.
+
+	fmt supports %s %d %i %u %x %X %o %c %f %e %g %a %q and %% with flags,
+	width and precision, the extra arguments are appended separated by spaces.
+	Tables and other non-scalar values are passed by tostring.
+
+	The default level is the config log_level ("debug", "info", "warn" or
+	"error"), or "info".
+
+	A logger service written in lua (logservice = "snlua") can register
+	log.protocol and render the message by log.render.
+]]
+
+local log = {}
+
+local LEVEL = { debug = 1, info = 2, warn = 3, error = 4 }
+local NAME = { "DEBUG", "INFO", "WARN", "ERROR" }
+
+log.PTYPE = skynet.PTYPE_LOG
+
+local current = LEVEL[skynet.getenv "log_level" or "info"] or LEVEL.info
+
+-- set the level of this service, return the old one
+function log.level(name)
+	local old = NAME[current]:lower()
+	if name then
+		current = assert(LEVEL[name], "Invalid log level")
+	end
+	return old
+end
+
+local function scalar(...)
+	local n = select("#", ...)
+	for i = 1, n do
+		local t = type((select(i, ...)))
+		if t ~= "string" and t ~= "number" and t ~= "boolean" and t ~= "nil" then
+			local args = { ... }
+			for j = i, n do
+				local v = args[j]
+				t = type(v)
+				if t ~= "string" and t ~= "number" and t ~= "boolean" and t ~= "nil" then
+					args[j] = tostring(v)
+				end
+			end
+			return table.unpack(args, 1, n)
+		end
+	end
+	return ...
+end
+
+local function send(level, ...)
+	c.send(".logger", skynet.PTYPE_LOG, 0, pack(level, scalar(...)))
+end
+
+for name, level in pairs(LEVEL) do
+	log[name] = function(...)
+		if level >= current then
+			send(level, ...)
+		end
+	end
+end
+
+-- whether a level is enabled, to skip the work of preparing the arguments
+function log.enabled(name)
+	return LEVEL[name] >= current
+end
+
+local function render_one(v)
+	if type(v) == "string" then
+		return v
+	end
+	return tostring(v)
+end
+
+-- render a message of log.protocol to text, the same as the logger service
+function log.render(level, fmt, ...)
+	local text
+	local n = select("#", ...)
+	if type(fmt) == "string" then
+		local args = { ... }
+		local i = 0
+		text = fmt:gsub("%%([-+ #0]*%d*%.?%d*)([sdiuxXocfeEgGaAq%%])", function(spec, conv)
+			if conv == "%" then
+				return "%"
+			end
+			i = i + 1
+			local v = args[i]
+			if conv == "s" or conv == "q" then
+				return string.format("%" .. spec .. "s", render_one(v))
+			elseif conv == "u" then
+				conv = "d"
+			end
+			if type(v) ~= "number" then
+				return render_one(v)
+			end
+			if conv == "d" or conv == "i" or conv == "x" or conv == "X" or conv == "o" or conv == "c" then
+				v = math.tointeger(v) or v
+				if math.type(v) ~= "integer" then
+					return render_one(v)
+				end
+			end
+			return string.format("%" .. spec .. conv, v)
+		end)
+		for j = i + 1, n do
+			text = text .. " " .. render_one(args[j])
+		end
+	else
+		local t = { render_one(fmt) }
+		for j = 1, n do
+			t[j+1] = render_one((select(j, ...)))
+		end
+		text = table.concat(t, " ")
+	end
+	return "[" .. (NAME[level] or "?") .. "] " .. text
+end
+
+log.protocol = {
+	name = "log",
+	id = skynet.PTYPE_LOG,
+	unpack = skynet.unpack,
+}
+
+return log
@@ -20,6 +20,16 @@ function skynet.launch(...)
 	end
 end
 
+-- Like skynet.launch, but the service is initialized when the first message comes ( in the thread of its sender ),
+-- a service killed before it gets any message costs only a handle and a message queue.
+-- It returns without waiting for the initialization, the errors go to the log.
+function skynet.lazylaunch(...)
+	local addr = c.command("LAZYLAUNCH", table.concat({...}," "))
+	if addr then
+		return tonumber(string.sub(addr , 2), 16)
+	end
+end
+
 function skynet.kill(name)
 	local addr = number_address(name)
 	if addr then
@@ -33,6 +43,73 @@ function skynet.abort()
 	c.command("ABORT")
 end
 
+-- bind current service to an exclusive worker thread, which only drains the message queue of this service
+-- returns false if it's already exclusive
+function skynet.exclusive()
+	return c.command("EXCLUSIVE") ~= nil
+end
+
+-- turn on priority lanes of current service : response, error and system messages are dispatched before others
+function skynet.mqpriority()
+	c.command("MQPRIORITY")
+end
+
+-- set the backpressure limit of current service : skynet.send to it fails when the queue length reaches limit
+-- (0 means unlimited, responses are never rejected). returns the previous limit, query only if limit is nil
+function skynet.mqlimit(limit)
+	return c.intcommand("MQLIMIT", limit or -1)
+end
+
+-- set the ttl (in 1/100 sec, 0 means never expire) of the messages sent by current service : the receiver drops the ones
+-- not handled in time, and answers the dropped requests with an error ( counted by skynet.stat "expired" of the receiver ).
+-- responses never expire. returns the previous ttl, query only if ti is nil. see also skynet.callttl
+function skynet.ttl(ti)
+	return c.intcommand("TTL", ti or -1)
+end
+
+-- resize the worker thread pool of this node at runtime, up to thread_max in config. returns the number of workers,
+-- query only if n is nil. removed workers hand their services to the others and sleep, they are reused when it grows
+function skynet.worker(n)
+	return c.intcommand("WORKER", n or 0)
+end
+
+-- switch the message queue of current service to lock-free mode (multi-producer, single-consumer ring)
+-- returns the ring size, or 0 if it's already in lock-free mode
+function skynet.mqring(size)
+	return c.intcommand("MQRING", size or 0)
+end
+
+-- histograms of queue wait and handler time of current service, flag is "on", "off" or "reset"
+-- read them by skynet.stat "wait_p99", "cost_max", "cost_mean", "wait_count" ... (in seconds)
+function skynet.latency(flag)
+	if flag == true then
+		flag = "on"
+	elseif flag == false then
+		flag = "off"
+	end
+	c.command("LATENCY", flag or "on")
+end
+
+-- let the worker thread of a caller run the requests to current service directly when it's idle,
+-- instead of queueing them (see context_inline in skynet_server.c). for the services called frequently, such as a room called by agents.
+-- the count of inline requests is skynet.stat "inline"
+function skynet.inline(on)
+	c.command("INLINE", on == false and "off" or "on")
+end
+
+-- move a service (current service by default) into a scheduling group defined by sched_group in config,
+-- such as sched_group = "batch:10" , the services in group batch get 10/110 of the cpu when the workers are busy.
+-- returns the group name of current service without arguments
+function skynet.group(name, service)
+	if name == nil then
+		return c.command("GROUP")
+	end
+	if service then
+		name = name .. " " .. skynet.address(service)
+	end
+	return c.command("GROUP", name) ~= nil
+end
+
 local function globalname(name, handle)
 	local c = string.sub(name,1,1)
 	assert(c ~= ':')
@@ -65,12 +142,12 @@ end
 local dispatch_message = skynet.dispatch_message
 
 function skynet.forward_type(map, start_func)
-	c.callback(function(ptype, msg, sz, ...)
+	c.callback(function(ptype, msg, sz, session, source)
 		local prototype = map[ptype]
 		if prototype then
-			dispatch_message(prototype, msg, sz, ...)
+			dispatch_message(prototype, msg, sz, session, source, true)
 		else
-			local ok, err = pcall(dispatch_message, ptype, msg, sz, ...)
+			local ok, err = pcall(dispatch_message, ptype, msg, sz, session, source)
 			c.trash(msg, sz)
 			if not ok then
 				error(err)
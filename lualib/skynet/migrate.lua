@@ -0,0 +1,93 @@
+local skynet = require "skynet"
+local cluster = require "skynet.cluster"
+local debug = require "skynet.debug"
+local c = require "skynet.core"
+
+--[[
+	Move a service to another cluster node without losing the messages sent to it.
+	In the service :
+		migrate.register(dump, load, ...)
+			dump() returns the state as values that skynet.pack can serialize,
+			load(...) receives them in the new instance, after its start function ;
+			the new instance is launched on the target node by SERVICE_NAME with the arguments ... .
+	On every node accepting migrated services :
+		migrate.open()	-- after cluster.open, registers the cluster name "@migrate"
+	Anywhere on the node of the service :
+		migrate.move(address, node)	-- returns the address of the new instance in node
+	While the state is transferred, the requests to the service are queued. Then the service forwards them,
+	sets a redirect of its handle to a local cluster proxy of the new instance and exits : the requests still
+	in its queue and all those sent to the old handle later go to the proxy, the responses go back to the callers.
+	The proxy forwards lua (and snax) messages only. The pending calls of the service itself are lost,
+	move a service when it's idle. The local names of the service are removed, the cached handles keep working.
+]]
+
+local migrate = {}
+
+local dump_state, load_state, launch_args
+
+local function request_type(prototype)
+	return prototype ~= skynet.PTYPE_RESPONSE and prototype ~= skynet.PTYPE_ERROR
+end
+
+local function migrate_to(node)
+	local pending = {}
+	local forward	-- the proxy of the new instance
+	-- pause : keep the requests, dispatch the responses (the cluster call below waits for one)
+	c.callback(function(prototype, msg, sz, session, source)
+		if request_type(prototype) then
+			local data = c.tostring(msg, sz)
+			if forward then
+				c.redirect(forward, source, prototype, session, data)
+			else
+				table.insert(pending, { prototype, session, source, data })
+			end
+		else
+			skynet.dispatch_message(prototype, msg, sz, session, source)
+		end
+	end)
+	local ok, addr = pcall(function()
+		local state = skynet.packstring(dump_state())
+		return cluster.call(node, "@migrate", "spawn", SERVICE_NAME, launch_args, state)
+	end)
+	if ok then
+		ok, forward = pcall(cluster.proxy, node, addr)
+	end
+	if not ok then
+		-- resume, the queued requests are dispatched after the messages already in the queue
+		c.callback(skynet.dispatch_message)
+		for _, m in ipairs(pending) do
+			c.redirect(skynet.self(), m[3], m[1], m[2], m[4])
+		end
+		error(addr)
+	end
+	for _, m in ipairs(pending) do
+		c.redirect(forward, m[3], m[1], m[2], m[4])
+	end
+	c.command("REDIRECT", skynet.address(forward))
+	skynet.error(string.format("Migrate to %s %s", node, skynet.address(addr)))
+	skynet.retpack(addr)
+	skynet.exit()
+end
+
+local function restore(state)
+	load_state(skynet.unpack(state))
+	skynet.ret()
+end
+
+function migrate.register(dump, load, ...)
+	dump_state = assert(dump)
+	load_state = assert(load)
+	launch_args = table.pack(...)
+	debug.reg_debugcmd("MIGRATE", migrate_to)
+	debug.reg_debugcmd("RESTORE", restore)
+end
+
+function migrate.open()
+	cluster.register("migrate", skynet.uniqueservice "migrated")
+end
+
+function migrate.move(address, node)
+	return skynet.call(address, "debug", "MIGRATE", node)
+end
+
+return migrate
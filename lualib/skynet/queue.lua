@@ -2,19 +2,25 @@ local skynet = require "skynet"
 local coroutine = coroutine
 local xpcall = xpcall
 local traceback = debug.traceback
-local table = table
 
 function skynet.queue()
 	local current_thread
 	local ref = 0
-	local thread_queue = {}
+	local thread_queue	-- the waiting threads, created when the queue is contended
+	local head, tail = 1, 0
 
 	local function xpcall_ret(ok, ...)
 		ref = ref - 1
 		if ref == 0 then
-			current_thread = table.remove(thread_queue,1)
-			if current_thread then
-				skynet.wakeup(current_thread)
+			if head <= tail then
+				-- hand over to the next thread, it resumes right after the current message
+				current_thread = thread_queue[head]
+				thread_queue[head] = nil
+				head = head + 1
+				skynet.unpark(current_thread)
+			else
+				current_thread = nil
+				head, tail = 1, 0
 			end
 		end
 		assert(ok, (...))
@@ -24,8 +30,12 @@ function skynet.queue()
 	return function(f, ...)
 		local thread = coroutine.running()
 		if current_thread and current_thread ~= thread then
-			table.insert(thread_queue, thread)
-			skynet.wait()
+			if not thread_queue then
+				thread_queue = {}
+			end
+			tail = tail + 1
+			thread_queue[tail] = thread
+			skynet.park()
 			assert(ref == 0)	-- current_thread == thread
 		end
 		current_thread = thread
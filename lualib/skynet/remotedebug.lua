@@ -6,6 +6,7 @@ local table = table
 local debug = debug
 local coroutine = coroutine
 local sethook = debugchannel.sethook
+local breakhook = debugchannel.breakhook
 
 
 local M = {}
@@ -78,6 +79,17 @@ local ctx_skynet = debug.getinfo(skynet.start,"S").short_src	-- skip when enter
 local ctx_term = debug.getinfo(run_cmd, "S").short_src	-- term when get here
 local ctx_active = {}
 
+local break_hook
+
+-- hooks of the coroutine go back to the breakpoint hook ( or nothing ) when it leaves step mode
+local function unwatch_hook(co)
+	if next(debugchannel.breakpoints()) then
+		breakhook(co, break_hook)
+	else
+		sethook(co)
+	end
+end
+
 local linehook
 local function skip_hook(mode)
 	local co = coroutine.running()
@@ -110,7 +122,7 @@ function linehook(mode, line)
 			ctx.filename = debug.getinfo(2, "S").short_src
 			if ctx.filename == ctx_term then
 				ctx_active[co] = nil
-				sethook()
+				unwatch_hook(co)
 				change_prompt(string.format(":%08x>", skynet.self()))
 				return
 			end
@@ -120,6 +132,74 @@ function linehook(mode, line)
 	end
 end
 
+-- called by the C hook only when a breakpoint ( and its condition ) hits in a coroutine
+function break_hook(_, line)
+	if next(ctx_active) then
+		-- another coroutine is stopped
+		return
+	end
+	local co = coroutine.running()
+	local filename = debug.getinfo(2, "S").short_src
+	ctx_active[co] = { filename = filename, breakpoint = true }
+	change_prompt(string.format("%s(%d)>", filename, line))
+	return true	-- yield
+end
+
+-- the coroutines of this service : the running one, the idle ones in the pool and the suspended ones.
+-- new coroutines inherit the hook of their creator.
+local function all_threads()
+	local threads = { [coroutine.running()] = true }
+	local pool = replace_upvalue(skynet.coroutine_pool, "coroutine_pool")
+	if pool then
+		for _, co in ipairs(pool) do
+			threads[co] = true
+		end
+	end
+	local sessions = replace_upvalue(skynet.killthread, "session_id_coroutine")
+	if sessions then
+		for _, co in pairs(sessions) do
+			if type(co) == "thread" then
+				threads[co] = true
+			end
+		end
+	end
+	local fork_queue = replace_upvalue(skynet.killthread, "fork_queue")
+	if fork_queue then
+		for i = fork_queue.h, fork_queue.t do
+			threads[fork_queue[i]] = true
+		end
+	end
+	for co in pairs(ctx_active) do
+		threads[co] = nil
+	end
+	return threads
+end
+
+local function set_break(source, line, cond)
+	debugchannel.breakpoint(source, assert(tonumber(line), "Need line"), cond)
+	for co in pairs(all_threads()) do
+		if coroutine.status(co) ~= "dead" then
+			breakhook(co, break_hook)
+		end
+	end
+end
+
+local function clear_break(source, line)
+	local n = debugchannel.clearbreak(source, tonumber(line))
+	if not next(debugchannel.breakpoints()) then
+		for co in pairs(all_threads()) do
+			sethook(co)
+		end
+	end
+	return n
+end
+
+local function list_break()
+	for i, v in ipairs(debugchannel.breakpoints()) do
+		print(i, v)
+	end
+end
+
 local function add_watch_hook()
 	local co = coroutine.running()
 	local ctx = {}
@@ -159,10 +239,28 @@ local function watch_proto(protoname, cond)
 end
 
 local function remove_watch()
-	for co in pairs(ctx_active) do
+	debugchannel.clearbreak()
+	for co in pairs(all_threads()) do
 		sethook(co)
 	end
+	local active = ctx_active
 	ctx_active = {}
+	for co in pairs(active) do
+		sethook(co)
+	end
+	-- let the stopped coroutine go on
+	for co in pairs(active) do
+		skynet_suspend(co, skynet_resume(co))
+	end
+end
+
+-- step from a breakpoint : switch the coroutine to the line hook
+local function step_hook(co, ctx)
+	if ctx.breakpoint then
+		ctx.breakpoint = nil
+		ctx.needupdate = true
+		sethook(co, linehook, "crl")
+	end
 end
 
 local dbgcmd = {}
@@ -170,17 +268,19 @@ local dbgcmd = {}
 function dbgcmd.s(co)
 	local ctx = ctx_active[co]
 	ctx.next_mode = false
+	step_hook(co, ctx)
 	skynet_suspend(co, skynet_resume(co))
 end
 
 function dbgcmd.n(co)
 	local ctx = ctx_active[co]
 	ctx.next_mode = true
+	step_hook(co, ctx)
 	skynet_suspend(co, skynet_resume(co))
 end
 
 function dbgcmd.c(co)
-	sethook(co)
+	unwatch_hook(co)
 	ctx_active[co] = nil
 	change_prompt(string.format(":%08x>", skynet.self()))
 	skynet_suspend(co, skynet_resume(co))
@@ -192,11 +292,17 @@ local function hook_dispatch(dispatcher, resp, fd, channel)
 	print = gen_print(fd)
 	local env = {
 		print = print,
-		watch = watch_proto
+		watch = watch_proto,
+		bp = set_break,
+		clear = clear_break,
+		bl = list_break,
 	}
 
 	local watch_env = {
-		print = print
+		print = print,
+		bp = set_break,
+		clear = clear_break,
+		bl = list_break,
 	}
 
 	local function watch_cmd(cmd)
@@ -15,6 +15,39 @@ local context = {
 	[mainthread] = {},
 }
 
+-- package.searchpath with the resolved filename shared by all the services ( see codecache.searchpath ).
+-- A cached file removed later is searched again.
+local codecache = require "skynet.codecache"
+
+local function searchpath(name, path)
+	local filename, err = codecache.searchpath(name, path)
+	if filename then
+		local f, msg = loadfile(filename)
+		if f then
+			return filename, f
+		end
+		local again = package.searchpath(name, path)
+		if again == nil or again == filename then
+			return filename, nil, msg
+		end
+		filename = again
+		return filename, loadfile(filename)
+	end
+	return nil, nil, err
+end
+
+-- Replace the lua searcher of require, the C searcher is unchanged.
+package.searchers[2] = function(name)
+	local filename, f, err = searchpath(name, package.path)
+	if not filename then
+		return err
+	end
+	if not f then
+		error(string.format("error loading module '%s' from file '%s':\n\t%s", name, filename, err), 0)
+	end
+	return f, filename
+end
+
 do
 	local require = _G.require
 	local loaded = package.loaded
@@ -31,12 +64,7 @@ do
 			return require(name)
 		end
 
-		local filename = package.searchpath(name, package.path)
-		if not filename then
-			return require(name)
-		end
-
-		local modfunc = loadfile(filename)
+		local filename, modfunc = searchpath(name, package.path)
 		if not modfunc then
 			return require(name)
 		end
@@ -105,6 +133,20 @@ function M.init_all()
 	context[mainthread] = nil
 end
 
+-- Run f in the current coroutine as a service main function ( see service/warm.lua ),
+-- the functions registered by skynet.init() during f run after f returns.
+function M.main(f, ...)
+	local co = coroutine.running()
+	local old_init_list = context[co]
+	local init_list = {}
+	context[co] = init_list
+	f(...)
+	context[co] = old_init_list
+	for _, f in ipairs(init_list) do
+		f()
+	end
+end
+
 function M.init(f)
 	assert(type(f) == "function")
 	local co = coroutine.running()
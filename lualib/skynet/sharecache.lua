@@ -0,0 +1,61 @@
+local core = require "skynet.sharecache.core"
+
+--[[
+	A node-wide key-value cache, read and written by every service directly, without messages.
+
+	local sharecache = require "skynet.sharecache"
+	local c = sharecache.new("player", {
+		max_keys = 65536,	-- LRU eviction beyond these limits
+		max_bytes = 64 * 1024 * 1024,	-- the packed values and the keys
+		ttl = 0,	-- the default time to live (in 1/100s), 0 for never
+		shard = 16,	-- the keys are spread over the shards, one lock per shard
+	})
+	c:set("1001", { name = "alice", level = 10 })
+	c:set("1002", value, 500)	-- expires after 5s
+	local v = c:get "1001"	-- a fresh copy of the value, or nil
+	c:delete "1001"
+	c:stat()	-- { keys, bytes, hit, miss, set, evict, expired, ... }
+
+	The cache is created by the first sharecache.new of its name (the later calls in any service get
+	the same cache and ignore opts), and lives until the node exits. The values are packed as skynet.pack
+	does, so they must be serializable, and reading a key unpacks a new copy of its value.
+	The keys are strings (integers are converted). The expired keys are removed when they are read,
+	or evicted as the others.
+]]
+
+local sharecache = {}
+local cache = {}
+local cache_mt = { __index = cache }
+
+local get = core.get
+local set = core.set
+
+function sharecache.new(name, opts)
+	opts = opts or {}
+	local obj = core.new(name, opts.max_keys, opts.max_bytes, opts.ttl, opts.shard)
+	return setmetatable({ __obj = obj }, cache_mt)
+end
+
+function cache:get(key)
+	return get(self.__obj, key)
+end
+
+-- value nil deletes the key, ttl nil uses the default of the cache
+function cache:set(key, value, ttl)
+	return set(self.__obj, key, value, ttl)
+end
+
+-- return true if key was in the cache
+function cache:delete(key)
+	return set(self.__obj, key)
+end
+
+function cache:clear()
+	core.clear(self.__obj)
+end
+
+function cache:stat()
+	return core.stat(self.__obj)
+end
+
+return sharecache
@@ -0,0 +1,90 @@
+local core = require "skynet.sharecounter.core"
+
+--[[
+	Named counters shared by all the services of the node, updated by atomic instructions
+	without sending messages to a counter service.
+
+	local sharecounter = require "skynet.sharecounter"
+	local online = sharecounter.gauge "online"
+	online:add(1)	-- return the new value
+	online:add(-1)
+	online:get()
+	online:peak()	-- the maximum since the last call of peak
+
+	local req = sharecounter.counter "request"
+	req:add()
+	req:set(0)	-- return the old value
+	req:cas(old, new)	-- return true if it was old
+
+	local slots = sharecounter.bitset("room", 1024)	-- the bits are 0 based
+	local i = slots:acquire()	-- set the first clear bit and return its index, nil if all set
+	slots:clear(i)	-- return the old bit
+	slots:set(i) ; slots:test(i) ; slots:count()
+
+	local login = sharecounter.rate("login", 60)	-- a window of 60 seconds
+	login:add()
+	login:sum()	-- the sum in the last 60 seconds
+
+	sharecounter.list()	-- { name = value } of all
+
+	The objects are created by the first call of its name (the later calls get the same object
+	and ignore the size), and live until the node exits.
+]]
+
+local sharecounter = {}
+
+local counter = {
+	add = core.add,
+	get = core.get,
+	set = core.set,
+	cas = core.cas,
+	peak = core.peak,
+}
+
+local bitset = {
+	set = core.bitset_set,
+	clear = core.bitset_clear,
+	test = core.bitset_test,
+	count = core.bitset_count,
+	acquire = core.bitset_acquire,
+}
+
+local rate = {
+	add = core.rate_add,
+	sum = core.rate_sum,
+}
+
+-- The objects are lightuserdata, the methods are the C functions taking it as the first argument
+local function wrap(methods)
+	local mt = {}
+	for k, f in pairs(methods) do
+		mt[k] = function(self, ...)
+			return f(self[1], ...)
+		end
+	end
+	return { __index = mt }
+end
+
+local counter_mt = wrap(counter)
+local bitset_mt = wrap(bitset)
+local rate_mt = wrap(rate)
+
+function sharecounter.counter(name)
+	return setmetatable({ core.counter(name) }, counter_mt)
+end
+
+function sharecounter.gauge(name)
+	return setmetatable({ core.gauge(name) }, counter_mt)
+end
+
+function sharecounter.bitset(name, bits)
+	return setmetatable({ core.bitset(name, bits) }, bitset_mt)
+end
+
+function sharecounter.rate(name, window)
+	return setmetatable({ core.rate(name, window) }, rate_mt)
+end
+
+sharecounter.list = core.list
+
+return sharecounter
@@ -68,4 +68,52 @@ function sharemap.reader(typename, stmcpy)
 	return setmetatable(obj, { __index = data, __newindex = error })
 end
 
+local NIL = {}
+
+local function lazyload(msg, sz, self)
+	-- msg is valid until the next update, the reader holds the copy
+	self.__msg = msg
+	self.__sz = sz
+	local cache = self.__data
+	for k in pairs(cache) do
+		cache[k] = nil
+	end
+end
+
+function sharemap:lazyupdate()
+	return self.__obj(lazyload, self)
+end
+
+-- A reader decodes fields from the shared buffer on first access,
+-- the untouched fields are never decoded.
+function sharemap.lazyreader(typename, stmcpy)
+	local sp = loadsp()
+	local stmobj = stm.newcopy(stmcpy)
+	local cache = {}
+	local obj = {
+		__typename = typename,
+		__obj = stmobj,
+		__data = cache,
+		update = sharemap.lazyupdate,
+	}
+	stmobj(lazyload, obj)
+
+	return setmetatable(obj, {
+		__index = function(_, k)
+			local v = cache[k]
+			if v == nil then
+				v = sp:decodefield(typename, k, obj.__msg, obj.__sz)
+				if v == nil then
+					v = NIL
+				end
+				cache[k] = v
+			end
+			if v ~= NIL then
+				return v
+			end
+		end,
+		__newindex = error,
+	})
+end
+
 return sharemap
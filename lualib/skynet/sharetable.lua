@@ -11,6 +11,8 @@ local function sharetable_service()
 	local matrix = {}	-- all the matrix
 	local files = {}	-- filename : matrix
 	local clients = {}
+	local base = {}	-- ptr : the matrix it's patched from, it shares the unchanged subtables of the base
+	local derived = {}	-- ptr : number of the matrices patched from it
 
 	local sharetable = {}
 
@@ -20,9 +22,22 @@ local function sharetable_service()
 		end
 		local ptr = m:getptr()
 		local ref = matrix[ptr]
-		if ref == nil or ref.count == 0 then
+		if (ref == nil or ref.count == 0) and derived[ptr] == nil then
 			matrix[ptr] = nil
 			m:close()
+			local b = base[ptr]
+			if b then
+				-- the base is an old version, close it when no one uses it
+				base[ptr] = nil
+				local bptr = b:getptr()
+				local n = derived[bptr] - 1
+				if n == 0 then
+					derived[bptr] = nil
+					close_matrix(b)
+				else
+					derived[bptr] = n
+				end
+			end
 		end
 	end
 
@@ -56,6 +71,63 @@ local function sharetable_service()
 		skynet.ret()
 	end
 
+	-- the same as loadtable, but the buffer is owned by the caller (a mapped file of skynet.snapshot)
+	function sharetable.loadbuffer(source, filename, ptr, len)
+		loadtable(filename, ptr, len)
+		skynet.ret()
+	end
+
+	-- copy the tables on the path of each change, the others are shared with the base matrix
+	local PATCH = [=[
+		local clone, root, unpack, ptr, len = ...
+		local changes = unpack(ptr, len)
+		local copied = {}
+		local function copy(v)
+			local t = {}
+			if type(v) == "table" then
+				for k, v in pairs(v) do
+					t[k] = v
+				end
+			end
+			copied[t] = true
+			return t
+		end
+		root = copy(clone(root))
+		for _, c in ipairs(changes) do
+			local path, value = c[1], c[2]
+			local n = #path
+			assert(n > 0, "Empty path")
+			local t = root
+			for i = 1, n-1 do
+				local k = path[i]
+				local v = t[k]
+				if not copied[v] then
+					v = copy(v)
+					t[k] = v
+				end
+				t = v
+			end
+			t[path[n]] = value
+		end
+		return root
+	]=]
+
+	local function patchtable(filename, ptr, len)
+		local b = assert(files[filename], "No sharetable to patch")
+		local m = core.matrix(PATCH, core.clone, b:getptr(), skynet.unpack, ptr, len)
+		local bptr = b:getptr()
+		base[m:getptr()] = b
+		derived[bptr] = (derived[bptr] or 0) + 1
+		files[filename] = m
+	end
+
+	function sharetable.patch(source, filename, ptr, len)
+		local ok, err = pcall(patchtable, filename, ptr, len)
+		skynet.trash(ptr, len)
+		assert(ok, err)
+		skynet.ret()
+	end
+
 	local function query_file(source, filename)
 		local m = files[filename]
 		local ptr = m:getptr()
@@ -128,8 +200,7 @@ local function sharetable_service()
 						if files[ref.filename] ~= ref.matrix then
 							-- It's a history version
 							skynet.error(string.format("Delete a version (%s) of %s", ptr, ref.filename))
-							ref.matrix:close()
-							matrix[ptr] = nil
+							close_matrix(ref.matrix)
 						end
 					end
 				end
@@ -216,6 +287,19 @@ function sharetable.loadtable(filename, tbl)
 	skynet.call(sharetable.address, "lua", "loadtable", filename, skynet.pack(tbl))
 end
 
+-- Load a table from a buffer of skynet.pack, the caller frees the buffer after the call returns.
+function sharetable.loadbuffer(filename, ptr, len)
+	skynet.call(sharetable.address, "lua", "loadbuffer", filename, ptr, len)
+end
+
+-- Make a new version of filename with a few changes : { { path, value }, ... }
+-- path is a list of keys from the root, value nil removes the key.
+-- The unchanged subtables are shared with the old version, so sharetable.update replaces only the changed ones.
+function sharetable.patch(filename, changes)
+	assert(type(changes) == "table")
+	skynet.call(sharetable.address, "lua", "patch", filename, skynet.pack(changes))
+end
+
 
 local RECORD = {}
 function sharetable.query(filename)
@@ -232,6 +316,60 @@ function sharetable.query(filename)
 	end
 end
 
+-- Proxies of the shared tables. sharetable.update redirects them to the new version in place,
+-- without scanning the service, so the cost is proportional to the change.
+local PROXY = {}	-- filename : the shared table under the root proxy
+local proxy_target = setmetatable({}, { __mode = "k" })	-- proxy : shared table
+local proxy_cache = setmetatable({}, { __mode = "v" })	-- shared table : proxy
+local EMPTY = {}
+local proxy_mt = {}
+
+local function proxy_of(t)
+	local p = proxy_cache[t]
+	if not p then
+		p = setmetatable({}, proxy_mt)
+		proxy_target[p] = t
+		proxy_cache[t] = p
+	end
+	return p
+end
+
+function proxy_mt:__index(k)
+	local v = proxy_target[self][k]
+	if type(v) == "table" then
+		return proxy_of(v)
+	end
+	return v
+end
+
+function proxy_mt.__newindex()
+	error "Can't change a sharetable proxy"
+end
+
+function proxy_mt:__len()
+	return #proxy_target[self]
+end
+
+function proxy_mt:__pairs()
+	local t = proxy_target[self]
+	return function(_, k)
+		local nk, v = next(t, k)
+		if type(v) == "table" then
+			v = proxy_of(v)
+		end
+		return nk, v
+	end, self, nil
+end
+
+function sharetable.proxy(filename)
+	local newptr = skynet.call(sharetable.address, "lua", "query", filename)
+	if newptr then
+		local t = core.clone(newptr)
+		PROXY[filename] = t
+		return proxy_of(t)
+	end
+end
+
 function sharetable.queryall(filenamelist)
     local list, t, map = {}
     local ptrList = skynet.call(sharetable.address, "lua", "queryall", filenamelist)
@@ -266,19 +404,37 @@ local function insert_replace(old_t, new_t, replace_map)
     for k, ov in pairs(old_t) do
         if type(ov) == "table" then
             local nv = new_t[k]
-            if nv == nil then
-                nv = NILOBJ
+            -- a patched version shares the unchanged subtables, skip them
+            if nv ~= ov then
+                if nv == nil then
+                    nv = NILOBJ
+                end
+                assert(replace_map[ov] == nil)
+                replace_map[ov] = nv
+                nv = type(nv) == "table" and nv or NILOBJ
+                insert_replace(ov, nv, replace_map)
             end
-            assert(replace_map[ov] == nil)
-            replace_map[ov] = nv
-            nv = type(nv) == "table" and nv or NILOBJ
-            insert_replace(ov, nv, replace_map)
         end
     end
     replace_map[old_t] = new_t
     return replace_map
 end
 
+local function redirect_proxy(replace_map)
+    for old_t, new_t in pairs(replace_map) do
+        local p = proxy_cache[old_t]
+        if p then
+            proxy_cache[old_t] = nil
+            if type(new_t) == "table" and new_t ~= NILOBJ then
+                proxy_target[p] = new_t
+                proxy_cache[new_t] = p
+            else
+                proxy_target[p] = EMPTY
+            end
+        end
+    end
+end
+
 
 local function resolve_replace(replace_map)
     local match = {}
@@ -476,21 +632,38 @@ end
 function sharetable.update(...)
 	local names = {...}
 	local replace_map = {}
+	local scan = false
 	for _, name in ipairs(names) do
 		local map = RECORD[name]
+		local proxy_root = PROXY[name]
+		local new_t
 		if map then
-			local new_t = sharetable.query(name)
+			new_t = sharetable.query(name)
 			for old_t,_ in pairs(map) do
 				if old_t ~= new_t then
 					insert_replace(old_t, new_t, replace_map)
                     map[old_t] = nil
+					scan = true
 				end
 			end
 		end
+		if proxy_root then
+			if new_t == nil then
+				new_t = core.clone(skynet.call(sharetable.address, "lua", "query", name))
+			end
+			if proxy_root ~= new_t and replace_map[proxy_root] == nil then
+				insert_replace(proxy_root, new_t, replace_map)
+			end
+			PROXY[name] = new_t
+		end
 	end
 
     if next(replace_map) then
-        resolve_replace(replace_map)
+        redirect_proxy(replace_map)
+        if scan then
+            -- the tables returned by sharetable.query may be referenced anywhere
+            resolve_replace(replace_map)
+        end
     end
 end
 
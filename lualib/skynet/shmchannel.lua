@@ -0,0 +1,139 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+local shmring = require "skynet.shmring"
+
+-- A channel of two shared memory rings between two skynet processes on the same host (see lualib-src/lua-shmring.c).
+-- It carries the packages with a 2 bytes big-endian size header, the same byte stream as the cluster protocol on tcp.
+-- The rings are read and written directly; the doorbell, a fifo bound by socket.bind, wakes the peer only when it sleeps.
+
+local shmchannel = {}
+local channel = {}
+local channel_meta = { __index = channel }
+
+local function new_channel(ring)
+	return setmetatable({
+		__ring = ring,
+		__path = ring:path(),
+		__queue = {},	-- the packages not written when the ring is full
+		__closed = false,
+		__bell = false,
+	}, channel_meta)
+end
+
+-- The creator side. The path should be in /dev/shm, size is the bytes of each ring (64K at least).
+function shmchannel.create(path, size)
+	return new_channel(shmring.create(path, size))
+end
+
+-- The other side, the files are removed after it's attached.
+function shmchannel.attach(path)
+	return new_channel(shmring.attach(path))
+end
+
+function channel:path()
+	return self.__path
+end
+
+-- Wait for the peer to attach, for ti (in 1/100s) at most.
+function channel:wait_attach(ti)
+	local ring = self.__ring
+	for _ = 1, ti do
+		if self.__closed then
+			return false
+		end
+		if ring:attached() then
+			return true
+		end
+		skynet.sleep(1)
+	end
+	return not self.__closed and ring:attached()
+end
+
+function channel:alive()
+	return not self.__closed and self.__ring:alive()
+end
+
+local function flush(self)
+	local queue = self.__queue
+	local ring = self.__ring
+	local n = #queue
+	local i = 1
+	while i <= n and ring:write(queue[i]) do
+		i = i + 1
+	end
+	if i > 1 then
+		table.move(queue, i, n, 1)
+		for j = n - i + 2, n do
+			queue[j] = nil
+		end
+	end
+end
+
+-- Write a package (with the size header), it's queued when the ring is full.
+function channel:write(pkg)
+	if self.__closed then
+		error "shmchannel closed"
+	end
+	local queue = self.__queue
+	if queue[1] or not self.__ring:write(pkg) then
+		queue[#queue + 1] = pkg
+	end
+end
+
+-- dispatch(pkg) is called with each package (without the size header) from the peer, in the reader coroutine,
+-- so it should not block.
+function channel:start(dispatch)
+	local ring = self.__ring
+	local fd = ring:doorbell()
+	skynet.fork(function()
+		local bell = socket.bind(fd)
+		self.__bell = bell
+		local last = ""
+		while not self.__closed do
+			local data = ring:read()
+			if self.__queue[1] then
+				flush(self)
+			end
+			if data then
+				if last ~= "" then
+					data = last .. data
+				end
+				local pos = 1
+				local len = #data
+				while len - pos >= 1 do
+					local sz = (data:byte(pos) << 8) | data:byte(pos + 1)
+					if len - pos + 1 < sz + 2 then
+						break
+					end
+					dispatch(data:sub(pos + 2, pos + 1 + sz))
+					pos = pos + 2 + sz
+				end
+				last = data:sub(pos)
+			elseif ring:sleep() then
+				-- read the bells, the writer rings it after the data is written or the space is freed
+				if not socket.read(bell) then
+					break
+				end
+			end
+		end
+		if self.__bell then
+			self.__bell = false
+			socket.close(bell)
+		end
+	end)
+end
+
+function channel:close()
+	if self.__closed then
+		return
+	end
+	self.__closed = true
+	local bell = self.__bell
+	if bell then
+		self.__bell = false
+		socket.close(bell)
+	end
+	self.__ring:close()
+end
+
+return shmchannel
@@ -0,0 +1,71 @@
+local skynet = require "skynet"
+local coroutine = coroutine
+local setmetatable = setmetatable
+local pcall = pcall
+local error = error
+local table = table
+
+--[[
+	Collapse the concurrent calls with the same key into one :
+
+	local singleflight = require "skynet.singleflight"
+	local flight = singleflight.new()
+	local v = flight:call(key, load_from_db, key)
+
+	The first caller of a key runs f(...), the callers of the same key before it returns
+	wait (parked without a session, see skynet.park) and get the same results, or the same error.
+	The results are shared, don't modify them. A call after f returns runs f again,
+	flight:forget(key) lets the next call run f again before it returns.
+]]
+
+local singleflight = {}
+
+local group = {}
+local group_mt = { __index = group }
+
+function singleflight.new()
+	return setmetatable({ flight = {} }, group_mt)
+end
+
+local function unpack_result(r)
+	if r[1] then
+		return table.unpack(r, 2, r.n)
+	end
+	error(r[2], 0)
+end
+
+local function finish(self, key, c, ...)
+	if self.flight[key] == c then
+		self.flight[key] = nil
+	end
+	local r = table.pack(...)
+	c.result = r
+	for i = 1, #c do
+		skynet.unpark(c[i])
+	end
+	return unpack_result(r)
+end
+
+function group:call(key, f, ...)
+	local c = self.flight[key]
+	if c then
+		c[#c+1] = coroutine.running()
+		skynet.park()
+		return unpack_result(c.result)
+	end
+	c = {}
+	self.flight[key] = c
+	return finish(self, key, c, pcall(f, ...))
+end
+
+function group:forget(key)
+	self.flight[key] = nil
+end
+
+-- the number of callers waiting for key, nil if it's not in flight
+function group:waiting(key)
+	local c = self.flight[key]
+	return c and #c
+end
+
+return singleflight
@@ -0,0 +1,131 @@
+local skynet = require "skynet"
+local core = require "skynet.snapshot.core"
+
+--[[
+	Snapshot of the read-only state built at startup, so a restarted node maps it instead of building it again.
+	config :
+		snapshot = "./snapshot"		-- an existing directory
+		snapshot_version = "1.2.3"	-- change it when the data or the code changes, e.g. the build id of a deploy
+	Each item is built by its function the first time and saved in the directory,
+	then the later starts with the same version load the file :
+		snapshot.datasheet(name, function() return t end, indexes)	-- mapped without parsing, see datasheet.builder.load
+		snapshot.sharetable(name, function() return t end)	-- unpacked from the mapped file
+		snapshot.sproto(index, filename or function() return text end)	-- the binary schema, skips the parser
+	The files of an old version are never read, remove them when they are useless.
+	Without snapshot in config, the functions only build and load the data.
+]]
+
+local snapshot = {}
+
+local directory = skynet.getenv "snapshot"
+local version = skynet.getenv "snapshot_version" or "0"
+
+local function escape(s)
+	return (s:gsub("[^%w%.%-_]", function(c) return string.format("%%%02X", c:byte()) end))
+end
+
+local function path(kind, name)
+	if directory then
+		return string.format("%s/%s-%s-%s", directory, escape(version), kind, escape(tostring(name)))
+	end
+end
+
+local function exist(filename)
+	local f = io.open(filename, "rb")
+	if f then
+		f:close()
+		return true
+	end
+	return false
+end
+
+-- The file is written to a temporary file and renamed, never overwrite a mapped file.
+local function save(filename, data)
+	local tmpname = filename .. ".tmp"
+	local f = assert(io.open(tmpname, "wb"))
+	f:write(data)
+	f:close()
+	assert(os.rename(tmpname, filename))
+end
+
+-- Returns true if the snapshot is loaded, a broken file is built again.
+local function restore(filename, load, ...)
+	if not filename or not exist(filename) then
+		return false
+	end
+	local ok, err = pcall(load, filename, ...)
+	if ok then
+		return true
+	end
+	skynet.error(string.format("Snapshot %s is broken : %s", filename, err))
+	os.remove(filename)
+	return false
+end
+
+function snapshot.datasheet(name, build, indexes)
+	local builder = require "skynet.datasheet.builder"
+	local filename = path("datasheet", name)
+	if restore(filename, function(filename) builder.load(name, filename) end) then
+		return
+	end
+	local doc = builder.compile(build(), indexes)
+	if filename then
+		local dump = require "skynet.datasheet.dump"
+		dump.save(filename, doc)
+	end
+	builder.new(name, doc)
+end
+
+local function loadbuffer(filename, name)
+	local sharetable = require "skynet.sharetable"
+	local ptr, size = core.mmap(filename)
+	local ok, err = pcall(sharetable.loadbuffer, name, ptr, size)
+	core.unmap(ptr, size)
+	assert(ok, err)
+end
+
+function snapshot.sharetable(name, build)
+	local filename = path("sharetable", name)
+	if restore(filename, loadbuffer, name) then
+		return
+	end
+	local tbl = build()
+	if filename then
+		local msg, sz = skynet.pack(tbl)
+		local data = skynet.tostring(msg, sz)
+		skynet.trash(msg, sz)
+		save(filename, data)
+	end
+	local sharetable = require "skynet.sharetable"
+	sharetable.loadtable(name, tbl)
+end
+
+local function loadsproto(filename, index)
+	local loader = require "sprotoloader"
+	local f = assert(io.open(filename, "rb"))
+	local bin = f:read "a"
+	f:close()
+	loader.save(bin, index)
+end
+
+function snapshot.sproto(index, source)
+	local filename = path("sproto", index)
+	if restore(filename, loadsproto, index) then
+		return
+	end
+	local text
+	if type(source) == "function" then
+		text = source()
+	else
+		local f = assert(io.open(source), "Can't open sproto file")
+		text = f:read "a"
+		f:close()
+	end
+	local bin = require "sprotoparser".parse(text)
+	if filename then
+		save(filename, bin)
+	end
+	require "sprotoloader".save(bin, index)
+end
+
+return snapshot
@@ -17,6 +17,9 @@ local socket_pool = setmetatable( -- store all socket object
 )
 
 local socket_onclose = {}
+local listen_group = {}	-- reuseport listen: first id -> ids of the listeners, one per socket thread
+local coalesce_socket = {}	-- id -> true or timer ticks, sockets in coalesce mode
+local coalesce_pending = {}	-- coalescing sockets written in this dispatch
 local socket_message = {}
 
 local function wakeup(s)
@@ -76,7 +79,7 @@ socket_message[1] = function(id, size, data)
 		-- read size
 		if sz >= rr then
 			s.read_required = nil
-			if sz > BUFFER_LIMIT then
+			if sz > BUFFER_LIMIT and not s.watermark then
 				pause_socket(s, sz)
 			end
 			wakeup(s)
@@ -91,12 +94,12 @@ socket_message[1] = function(id, size, data)
 			-- read line
 			if driver.readline(s.buffer,nil,rr) then
 				s.read_required = nil
-				if sz > BUFFER_LIMIT then
+				if sz > BUFFER_LIMIT and not s.watermark then
 					pause_socket(s, sz)
 				end
 				wakeup(s)
 			end
-		elseif sz > BUFFER_LIMIT and not s.pause then
+		elseif sz > BUFFER_LIMIT and not s.pause and not s.watermark then
 			pause_socket(s, sz)
 		end
 	end
@@ -198,6 +201,23 @@ socket_message[7] = function(id, size)
 	end
 end
 
+-- SKYNET_SOCKET_TYPE_BATCH = 8, the data of n sockets in one message, see socket.batch
+-- An error of one item doesn't stop the rest, their buffers would be lost with the message.
+socket_message[8] = function(n, _, items)
+	local data = socket_message[1]
+	local batchitem = driver.batchitem
+	local err
+	for i = 1, n do
+		local ok, e = pcall(data, batchitem(items, i))
+		if not ok then
+			err = err and (err .. "\n" .. tostring(e)) or tostring(e)
+		end
+	end
+	if err then
+		error(err)
+	end
+end
+
 skynet.register_protocol {
 	name = "socket",
 	id = skynet.PTYPE_SOCKET,	-- PTYPE_SOCKET = 6
@@ -208,6 +228,10 @@ skynet.register_protocol {
 }
 
 local function connect(id, func)
+	if id < 0 then
+		-- no free socket slot (see socket_max in config)
+		return nil, "too many sockets"
+	end
 	local newbuffer
 	if func == nil then
 		newbuffer = driver.buffer()
@@ -255,6 +279,14 @@ function socket.stdin()
 end
 
 function socket.start(id, func)
+	local group = listen_group[id]
+	if group then
+		for i = 2, #group do
+			local sid = group[i]
+			driver.start(sid)
+			assert(connect(sid, func))
+		end
+	end
 	driver.start(id)
 	return connect(id, func)
 end
@@ -281,10 +313,19 @@ function socket.close_fd(id)
 end
 
 function socket.close(id)
+	local group = listen_group[id]
+	if group then
+		listen_group[id] = nil
+		for i = 2, #group do
+			socket.close(group[i])
+		end
+	end
 	local s = socket_pool[id]
 	if s == nil then
 		return
 	end
+	coalesce_socket[id] = nil
+	coalesce_pending[id] = nil
 	driver.close(id)
 	if s.connected then
 		s.pause = false -- Do not resume this fd if it paused.
@@ -380,6 +421,58 @@ function socket.readline(id, sep)
 	end
 end
 
+local function buffer_unpack(s, fmt, ok, ...)
+	if ok ~= false then
+		return ok, ...
+	end
+	if s.closing or not s.connected then
+		return false
+	end
+	assert(not s.read_required)
+	s.read_required = ...	-- the bytes required
+	suspend(s)
+	return buffer_unpack(s, fmt, driver.bufferunpack(s.buffer, s.pool, fmt))
+end
+
+-- Unpack the fields of fmt from the socket in place, without a string for each field.
+-- fmt is a subset of string.unpack : < > = b B h H i[n] I[n] l L j J T s[n] c[n] x
+-- Returns the values, or false if the socket is closed before all the bytes arrive.
+function socket.unpack(id, fmt)
+	local s = socket_pool[id]
+	assert(s)
+	return buffer_unpack(s, fmt, driver.bufferunpack(s.buffer, s.pool, fmt))
+end
+
+-- The same as socket.unpack, but never blocks and doesn't consume the bytes.
+-- Returns the values, or false and the bytes required.
+function socket.peek(id, fmt)
+	local s = socket_pool[id]
+	assert(s)
+	return driver.bufferunpack(s.buffer, nil, fmt)
+end
+
+-- A reusable buffer for socket.readinto, buf:unpack(fmt, pos) / buf:tostring(i, j) / buf:ptr() -> ptr, size
+socket.readbuffer = driver.readbuffer
+
+-- Read sz bytes into buf (made by socket.readbuffer), returns sz or false if the socket is closed.
+function socket.readinto(id, buf, sz)
+	local s = socket_pool[id]
+	assert(s)
+	if driver.readinto(s.buffer, s.pool, buf, sz) then
+		return sz
+	end
+	if s.closing or not s.connected then
+		return false
+	end
+	assert(not s.read_required)
+	s.read_required = sz
+	suspend(s)
+	if driver.readinto(s.buffer, s.pool, buf, sz) then
+		return sz
+	end
+	return false
+end
+
 function socket.block(id)
 	local s = socket_pool[id]
 	if not s or not s.connected then
@@ -391,8 +484,81 @@ function socket.block(id)
 	return s.connected
 end
 
-socket.write = assert(driver.send)
-socket.lwrite = assert(driver.lsend)
+local coalesce_flushing = false
+
+local function coalesce_flush()
+	for id in pairs(coalesce_pending) do
+		if coalesce_socket[id] == true then
+			coalesce_pending[id] = nil
+			driver.flush(id)
+		end
+	end
+	coalesce_flushing = false
+end
+
+local function coalesce_timeout(id)
+	return function()
+		if coalesce_pending[id] then
+			coalesce_pending[id] = nil
+			driver.flush(id)
+		end
+	end
+end
+
+local function coalesce_write(send)
+	return function(id, ...)
+		local r = send(id, ...)
+		local mode = coalesce_socket[id]
+		if mode and not coalesce_pending[id] then
+			coalesce_pending[id] = true
+			if mode ~= true then
+				-- timeout 0 queues the flush after the messages already waiting for this service
+				skynet.timeout(mode, coalesce_timeout(id))
+			elseif not coalesce_flushing then
+				-- the forked coroutine runs after the current message is dispatched
+				coalesce_flushing = true
+				skynet.fork(coalesce_flush)
+			end
+		end
+		return r
+	end
+end
+
+-- socket.write(id, { header, body, ... }) sends the strings as one package.
+-- When the socket can be written directly, they go out in one writev without concatenation.
+socket.write = coalesce_write(assert(driver.send))
+socket.lwrite = coalesce_write(assert(driver.lsend))
+
+-- In coalesce mode, the data written by socket.write/lwrite stays in the send buffer
+-- and goes out in one writev at the end of the current dispatch, or by socket.flush(id).
+-- enable can also be "drain" : flush when the message queue of this service is empty,
+-- or a number : flush N ms after the first write.
+-- The socket layer sends anyway when 64K is buffered.
+function socket.coalesce(id, enable)
+	if enable == nil then
+		enable = true
+	elseif enable == "drain" then
+		enable = 0
+	elseif type(enable) == "number" then
+		enable = math.max(1, (enable + 9) // 10)	-- ms to timer ticks
+	end
+	driver.coalesce(id, enable and true)
+	coalesce_socket[id] = enable or nil
+	if not enable then
+		coalesce_pending[id] = nil
+	end
+end
+
+function socket.flush(id)
+	coalesce_pending[id] = nil
+	driver.flush(id)
+end
+-- socket.sendfile(id, filename [, offset [, size]]) streams a file after the data already written
+socket.sendfile = assert(driver.sendfile)
+-- socket.sharedbuffer(str) copies str once into an immutable buffer, socket.sendshared(id, buffer) queues it
+-- without copying again, for the data sent many times such as cached responses
+socket.sharedbuffer = assert(driver.sharedbuffer)
+socket.sendshared = assert(driver.sendshared)
 socket.header = assert(driver.header)
 
 function socket.invalid(id)
@@ -406,21 +572,38 @@ function socket.disconnected(id)
 	end
 end
 
-function socket.listen(host, port, backlog)
+-- If reuseport is true, every socket thread listens on the port with SO_REUSEPORT
+-- and accepts its own connections. The returned id stands for all of them in
+-- socket.start and socket.close.
+function socket.listen(host, port, backlog, reuseport)
 	if port == nil then
 		host, port = string.match(host, "([^:]+):(.+)$")
 		port = tonumber(port)
 	end
-	local id = driver.listen(host, port, backlog)
-	local s = {
-		id = id,
-		connected = false,
-		listen = true,
-	}
-	assert(socket_pool[id] == nil)
-	socket_pool[id] = s
-	suspend(s)
-	return id, s.addr, s.port
+	local ids = { driver.listen(host, port, backlog, reuseport) }
+	-- register all the listeners before waiting, their open messages may come in any order
+	for _, id in ipairs(ids) do
+		assert(socket_pool[id] == nil)
+		socket_pool[id] = {
+			id = id,
+			connected = false,
+			connecting = true,
+			listen = true,
+		}
+	end
+	for _, id in ipairs(ids) do
+		local s = socket_pool[id]
+		if not s.connected and s.connecting == true then
+			suspend(s)
+		end
+		s.connecting = nil
+	end
+	local id = ids[1]
+	local first = socket_pool[id]
+	if #ids > 1 then
+		listen_group[id] = ids
+	end
+	return id, first.addr, first.port
 end
 
 -- abandon use to forward socket id to other service
@@ -440,6 +623,32 @@ function socket.limit(id, limit)
 	s.buffer_limit = limit
 end
 
+-- Flow control in the socket thread : it stops reading the socket when the bytes not consumed by this service
+-- (in the buffer or still in the message queue) reach high, and reads again when they drop to low (default high/2).
+-- There is no pause/resume command for each read between the watermarks, and it replaces the pause at BUFFER_LIMIT.
+-- low must be smaller than the bytes of any single read (socket.read(id, sz) waits for sz bytes). high = 0 turns it off.
+function socket.watermark(id, high, low)
+	local s = assert(socket_pool[id])
+	assert(s.buffer, "Need a socket without callback")
+	driver.watermark(s.buffer, id, high, low)
+	s.watermark = high > 0 or nil
+end
+
+-- Admission control in the socket thread. On a listen socket (set it before start) the new connections over
+-- max (connections alive), ip_max (connections per ip), rate (accepted per second) or ip_rate (accepted per second per ip)
+-- are closed at once and never reach this service; socket.info shows the count as "limited".
+-- read_bytes and read_packets (per second) throttle the reads of the accepted sockets, or of a tcp socket given by id.
+-- Absent or 0 means unlimited. With reuseport each listen socket has its own counters.
+function socket.admission(id, conf)
+	driver.admission(id, conf)
+end
+
+-- The data read in one round of the socket thread for this service is delivered in one message.
+-- Enable it on a listen socket before start, the accepted sockets are in batch mode too.
+function socket.batch(id, enable)
+	driver.batch(id, enable ~= false)
+end
+
 ---------------------- UDP
 
 local function create_udp_object(id, cb)
@@ -483,9 +692,20 @@ function socket.udp_dial(addr, port, callback)
 	return id
 end
 
+-- Reliable udp : call it right after socket.udp/udp_listen/udp_dial, before sending anything.
+-- Each message sent (socket.write or socket.sendto) is acked and retransmitted by the socket thread,
+-- and the callback receives whole messages in order, one session per peer address.
+-- The peer must turn on reliable mode too. A connected socket is closed when its peer is unreachable.
+function socket.reliable(id)
+	local obj = socket_pool[id]
+	assert(obj and obj.protocol == "UDP")
+	driver.reliable(id)
+end
+
 socket.sendto = assert(driver.udp_send)
 socket.udp_address = assert(driver.udp_address)
 socket.netstat = assert(driver.info)
+socket.stat = assert(driver.stat)
 socket.resolve = assert(driver.resolve)
 
 function socket.warning(id, callback)
@@ -32,6 +32,9 @@ function socket_channel.channel(desc)
 		__response = desc.response,	-- It's for session mode
 		__request = {},	-- request seq { response func or session }	-- It's for order mode
 		__thread = {}, -- coroutine seq or session->coroutine map
+		__head = 1,	-- the queue of order mode is __request/__thread [__head, __tail]
+		__tail = 0,
+		__batch = {},	-- coroutine -> batch of sessions, see channel:batch
 		__result = {}, -- response result { coroutine -> result }
 		__result_data = {},
 		__connecting = {},
@@ -39,6 +42,7 @@ function socket_channel.channel(desc)
 		__closed = false,
 		__authcoroutine = false,
 		__nodelay = desc.nodelay,
+		__coalesce = desc.coalesce,	-- see socket.coalesce
 		__overload_notify = desc.overload,
 		__overload = false,
 		__socket_meta = channel_socket_meta,
@@ -73,16 +77,17 @@ local function wakeup_all(self, errmsg)
 	if self.__response then
 		for k,co in pairs(self.__thread) do
 			self.__thread[k] = nil
-			self.__result[co] = socket_error
-			self.__result_data[co] = errmsg
-			skynet.wakeup(co)
+			-- a batch waits for many sessions, wake it up once
+			if self.__result[co] ~= socket_error then
+				self.__result[co] = socket_error
+				self.__result_data[co] = errmsg
+				skynet.wakeup(co)
+			end
 		end
 	else
-		for i = 1, #self.__request do
-			self.__request[i] = nil
-		end
-		for i = 1, #self.__thread do
+		for i = self.__head, self.__tail do
 			local co = self.__thread[i]
+			self.__request[i] = nil
 			self.__thread[i] = nil
 			if co then	-- ignore the close signal
 				self.__result[co] = socket_error
@@ -90,6 +95,8 @@ local function wakeup_all(self, errmsg)
 				skynet.wakeup(co)
 			end
 		end
+		self.__head = 1
+		self.__tail = 0
 	end
 end
 
@@ -100,7 +107,34 @@ local function dispatch_by_session(self)
 		local ok , session, result_ok, result_data, padding = pcall(response, self.__sock)
 		if ok and session then
 			local co = self.__thread[session]
-			if co then
+			local batch = co and self.__batch[co]
+			if batch then
+				if padding and result_ok then
+					local result = batch.padding[session] or {}
+					batch.padding[session] = result
+					table.insert(result, result_data)
+				else
+					self.__thread[session] = nil
+					local result = batch.padding[session]
+					if result then
+						batch.padding[session] = nil
+						if result_ok then
+							table.insert(result, result_data)
+							result_data = result
+						end
+					end
+					batch.result[batch.index[session]] = { ok = result_ok, out = result_data }
+					batch.n = batch.n - 1
+					if batch.n == 0 then
+						self.__result[co] = true
+						skynet.wakeup(co)
+					end
+				end
+				if not self.__sock then
+					wakeup_all(self, "channel_closed")
+					break
+				end
+			elseif co then
 				if padding and result_ok then
 					-- If padding is true, append result_data to a table (self.__result_data[co])
 					local result = self.__result_data[co] or {}
@@ -138,8 +172,17 @@ end
 
 local function pop_response(self)
 	while self.__sock do
-		local func,co = table.remove(self.__request, 1), table.remove(self.__thread, 1)
-		if func then
+		local head = self.__head
+		if head <= self.__tail then
+			local func, co = self.__request[head], self.__thread[head]
+			self.__request[head] = nil
+			self.__thread[head] = nil
+			if head == self.__tail then
+				self.__head = 1
+				self.__tail = 0
+			else
+				self.__head = head + 1
+			end
 			return func, co
 		end
 		self.__wait_response = coroutine.running()
@@ -163,8 +206,10 @@ local function push_response(self, response, co)
 		self.__thread[response] = co
 	else
 		-- response is a function, push it to __request
-		table.insert(self.__request, response)
-		table.insert(self.__thread, co)
+		local tail = self.__tail + 1
+		self.__tail = tail
+		self.__request[tail] = response
+		self.__thread[tail] = co
 		if self.__wait_response then
 			skynet.wakeup(self.__wait_response)
 			self.__wait_response = nil
@@ -311,6 +356,9 @@ local function connect_once(self)
 		if self.__nodelay then
 			socketdriver.nodelay(fd)
 		end
+		if self.__coalesce then
+			socket.coalesce(fd, self.__coalesce)
+		end
 
 		-- register overload warning
 
@@ -508,6 +556,22 @@ local function sock_err(self)
 end
 
 function channel:request(request, response, padding)
+	if type(padding) == "number" then
+		-- request is a buffer (lightuserdata) of padding bytes, the socket frees it
+		local ok, err = pcall(block_connect, self, true)
+		if not ok then
+			skynet.trash(request, padding)
+			error(err)
+		end
+		if not socket_write(self.__sock[1], request, padding) then
+			sock_err(self)
+		end
+		if response == nil then
+			return
+		end
+		return wait_for_response(self, response)
+	end
+
 	assert(block_connect(self, true))	-- connect once
 	local fd = self.__sock[1]
 
@@ -537,6 +601,65 @@ function channel:request(request, response, padding)
 	return wait_for_response(self, response)
 end
 
+local function batch_response(responses, n)
+	return function(sock)
+		local result = {}
+		for i = 1, n do
+			local response = type(responses) == "table" and responses[i] or responses
+			local ok, data = get_response(response, sock)
+			result[i] = { ok = ok, out = data }
+		end
+		return true, result
+	end
+end
+
+local function wait_for_batch(self, sessions, n)
+	local co = coroutine.running()
+	local index = {}
+	for i = 1, n do
+		index[sessions[i]] = i
+		self.__thread[sessions[i]] = co
+	end
+	local batch = { n = n, index = index, result = {}, padding = {} }
+	self.__batch[co] = batch
+	skynet.wait(co)
+	self.__batch[co] = nil
+
+	local result = self.__result[co]
+	self.__result[co] = nil
+	local result_data = self.__result_data[co]
+	self.__result_data[co] = nil
+
+	if result == socket_error then
+		for i = 1, n do
+			if self.__thread[sessions[i]] == co then
+				self.__thread[sessions[i]] = nil
+			end
+		end
+		error(result_data or socket_error)
+	end
+	return batch.result
+end
+
+-- Send many requests in one write and wait for all the responses, returns { { ok = , out = }, ... } in the order of requests.
+-- In order mode, responses is a response function for all the requests or a list of them,
+-- the replies are parsed back to back in the dispatch thread and the caller is waked up once.
+-- In session mode, responses is the list of sessions.
+function channel:batch(requests, responses)
+	local n = #requests
+	assert(n > 0, "Empty batch")
+	assert(block_connect(self, true))	-- connect once
+	if not socket_write(self.__sock[1], requests) then
+		sock_err(self)
+	end
+	if self.__response then
+		assert(type(responses) == "table" and #responses == n, "Need a session for each request")
+		return wait_for_batch(self, responses, n)
+	else
+		return wait_for_response(self, batch_response(responses, n))
+	end
+end
+
 function channel:response(response)
 	assert(block_connect(self))
 
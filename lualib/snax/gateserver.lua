@@ -5,11 +5,16 @@ local socketdriver = require "skynet.socketdriver"
 local gateserver = {}
 
 local socket	-- listen socket
+local listen_socket = {}	-- all listen sockets, more than one with reuseport
 local queue		-- message queue
 local maxclient	-- max client
 local client_number = 0
 local CMD = setmetatable({}, { __gc = function() netpack.clear(queue) end })
 local nodelay = false
+local framing = "S"
+
+local group = {}	-- name -> { list = { fd, ... }, index = { [fd] = i } }
+local membership = {}	-- fd -> { [name] = true }
 
 local connection = {}
 -- true : connected
@@ -30,6 +35,68 @@ function gateserver.closeclient(fd)
 	end
 end
 
+function gateserver.join(name, fd)
+	local g = group[name]
+	if not g then
+		g = { list = {}, index = {} }
+		group[name] = g
+	end
+	if g.index[fd] then
+		return
+	end
+	local n = #g.list + 1
+	g.list[n] = fd
+	g.index[fd] = n
+	local m = membership[fd]
+	if not m then
+		m = {}
+		membership[fd] = m
+	end
+	m[name] = true
+end
+
+function gateserver.leave(name, fd)
+	local g = group[name]
+	local i = g and g.index[fd]
+	if not i then
+		return
+	end
+	-- swap with the last one
+	local list = g.list
+	local n = #list
+	local last = list[n]
+	list[i] = last
+	g.index[last] = i
+	list[n] = nil
+	g.index[fd] = nil
+	if n == 1 then
+		group[name] = nil
+	end
+	local m = membership[fd]
+	m[name] = nil
+	if next(m) == nil then
+		membership[fd] = nil
+	end
+end
+
+function gateserver.leaveall(fd)
+	local m = membership[fd]
+	if m then
+		for name in pairs(m) do
+			gateserver.leave(name, fd)
+		end
+	end
+end
+
+-- The message is framed once, and the socket threads queue the same buffer to every connection in the group.
+function gateserver.broadcast(name, msg, sz)
+	local g = group[name]
+	if g then
+		return socketdriver.broadcast(g.list, netpack.packframe(framing, msg, sz))
+	end
+	return 0
+end
+
 function gateserver.start(handler)
 	assert(handler.message)
 	assert(handler.connect)
@@ -42,23 +109,60 @@ function gateserver.start(handler)
 		local port = assert(conf.port)
 		maxclient = conf.maxclient or 1024
 		nodelay = conf.nodelay
+		-- conf.framing e.g. "L", "4:le:1048576", "varint", "ws" ; see service-src/framing.h
+		framing = conf.framing or framing
+		-- the uncomplete package table is sized by maxclient
+		queue = netpack.new(framing, maxclient)
 		skynet.error(string.format("Listen on %s:%d", address, port))
-		socket = socketdriver.listen(address, port, conf.backlog)
+		-- sharded gates listen on the same port with SO_REUSEPORT, one listen socket per socket thread
+		local reuseport = conf.reuseport or (conf.shard or 1) > 1
+		local ids = { socketdriver.listen(address, port, conf.backlog, reuseport) }
+		socket = ids[1]
+		for _, id in ipairs(ids) do
+			listen_socket[id] = true
+		end
 		listen_context.co = coroutine.running()
 		listen_context.fd = socket
 		skynet.wait(listen_context.co)
 		conf.address = listen_context.addr
 		conf.port = listen_context.port
 		listen_context = nil
-		socketdriver.start(socket)
+		for _, id in ipairs(ids) do
+			if conf.batch then
+				-- the data of all the connections read in one round of the socket thread comes in one message
+				socketdriver.batch(id, true)
+			end
+			if conf.admission then
+				-- e.g. { max = 10000, ip_max = 16, ip_rate = 5, read_bytes = 65536 } ; see socket.admission
+				socketdriver.admission(id, conf.admission)
+			end
+			socketdriver.start(id)
+		end
 		if handler.open then
 			return handler.open(source, conf)
 		end
 	end
 
-	function CMD.close()
+	function CMD.close(source)
 		assert(socket)
-		socketdriver.close(socket)
+		for id in pairs(listen_socket) do
+			socketdriver.close(id)
+		end
+		if handler.close then
+			handler.close(source)
+		end
+	end
+
+	function CMD.join(source, name, fd)
+		gateserver.join(name, fd)
+	end
+
+	function CMD.leave(source, name, fd)
+		gateserver.leave(name, fd)
+	end
+
+	function CMD.broadcast(source, name, msg)
+		return gateserver.broadcast(name, msg)
 	end
 
 	local MSG = {}
@@ -89,6 +193,15 @@ function gateserver.start(handler)
 
 	MSG.more = dispatch_queue
 
+	function MSG.batch(errors)
+		if errors then
+			for fd, msg in pairs(errors) do
+				MSG.error(fd, msg)
+			end
+		end
+		dispatch_queue()
+	end
+
 	function MSG.open(fd, msg)
 		client_number = client_number + 1
 		if client_number >= maxclient then
@@ -103,21 +216,25 @@ function gateserver.start(handler)
 	end
 
 	function MSG.close(fd)
-		if fd ~= socket then
+		if not listen_socket[fd] then
 			client_number = client_number - 1
 			if connection[fd] then
 				connection[fd] = false	-- close read
 			end
+			gateserver.leaveall(fd)
 			if handler.disconnect then
 				handler.disconnect(fd)
 			end
 		else
-			socket = nil
+			listen_socket[fd] = nil
+			if next(listen_socket) == nil then
+				socket = nil
+			end
 		end
 	end
 
 	function MSG.error(fd, msg)
-		if fd == socket then
+		if listen_socket[fd] then
 			skynet.error("gateserver accept error:",msg)
 		else
 			socketdriver.shutdown(fd)
@@ -134,10 +251,9 @@ function gateserver.start(handler)
 	end
 
 	function MSG.init(id, addr, port)
-		if listen_context then
+		if listen_context and id == listen_context.fd then
 			local co = listen_context.co
 			if co then
-				assert(id == listen_context.fd)
 				listen_context.addr = addr
 				listen_context.port = port
 				skynet.wakeup(co)
@@ -30,6 +30,12 @@ Error Code:
 
 Success:
 	200 base64(subid)
+
+Config:
+	instance : the number of slaves at start (default 8)
+	max_instance : launch more slaves when all of them are busy, up to max_instance (default instance)
+	slave_queue : a slave is busy when it has slave_queue logins in progress (default 32)
+	scale_interval : the extra slaves idle for scale_interval seconds exit (default 60)
 ]]
 
 local socket_error = {}
@@ -52,29 +58,14 @@ local function launch_slave(auth_handler)
 		-- If the attacker send large package, close the socket
 		socket.limit(fd, 8192)
 
-		local challenge = crypt.randomkey()
-		write("auth", fd, crypt.base64encode(challenge).."\n")
-
-		local handshake = assert_socket("auth", socket.readline(fd), fd)
-		local clientkey = crypt.base64decode(handshake)
-		if #clientkey ~= 8 then
-			error "Invalid client key"
-		end
-		local serverkey = crypt.randomkey()
-		write("auth", fd, crypt.base64encode(crypt.dhexchange(serverkey)).."\n")
-
-		local secret = crypt.dhsecret(clientkey, serverkey)
-
-		local response = assert_socket("auth", socket.readline(fd), fd)
-		local hmac = crypt.hmac64(challenge, secret)
-
-		if hmac ~= crypt.base64decode(response) then
-			error "challenge failed"
-		end
-
-		local etoken = assert_socket("auth", socket.readline(fd),fd)
-
-		local token = crypt.desdecode(secret, crypt.base64decode(etoken))
+		-- step 1-7 in C, see crypt.handshake
+		local handshake, challenge = crypt.handshake()
+		write("auth", fd, challenge)
+		-- client key -> server key
+		write("auth", fd, handshake:feed(assert_socket("auth", socket.readline(fd), fd)))
+		-- hmac
+		handshake:feed(assert_socket("auth", socket.readline(fd), fd))
+		local token, secret = handshake:feed(assert_socket("auth", socket.readline(fd), fd))
 
 		local ok, server, uid =  pcall(auth_handler,token)
 
@@ -113,9 +104,9 @@ end
 
 local user_login = {}
 
-local function accept(conf, s, fd, addr)
+local function accept(conf, call_slave, fd, addr)
 	-- call slave auth
-	local ok, server, uid, secret = skynet.call(s, "lua",  fd, addr)
+	local ok, server, uid, secret = call_slave(fd, addr)
 	-- slave will accept(start) fd, so we can write to fd later
 
 	if not ok then
@@ -150,28 +141,101 @@ end
 local function launch_master(conf)
 	local instance = conf.instance or 8
 	assert(instance > 0)
+	local max_instance = math.max(conf.max_instance or instance, instance)
+	local slave_queue = conf.slave_queue or 32
+	local scale_interval = (conf.scale_interval or 60) * 100
 	local host = conf.host or "0.0.0.0"
 	local port = assert(tonumber(conf.port))
 	local slave = {}
-	local balance = 1
+	local load = {}	-- slave -> logins in progress
+	local idle = {}	-- slave -> the time it becomes idle
+	local launching = false
 
 	skynet.dispatch("lua", function(_,source,command, ...)
 		skynet.ret(skynet.pack(conf.command_handler(command, ...)))
 	end)
 
+	local function add_slave()
+		local s = skynet.newservice(SERVICE_NAME)
+		table.insert(slave, s)
+		load[s] = 0
+		idle[s] = skynet.now()
+		return s
+	end
+
 	for i=1,instance do
-		table.insert(slave, skynet.newservice(SERVICE_NAME))
+		add_slave()
+	end
+
+	-- the slave with the least logins in progress, launch one more when all of them are busy
+	local function choose_slave()
+		local s = slave[1]
+		local n = load[s]
+		for i = 2, #slave do
+			local c = slave[i]
+			if load[c] < n then
+				s = c
+				n = load[c]
+			end
+		end
+		if n >= slave_queue and #slave < max_instance and not launching then
+			launching = true
+			skynet.fork(function()
+				local ok, err = pcall(add_slave)
+				launching = false
+				if ok then
+					skynet.error(string.format("login slave scale up : %d", #slave))
+				else
+					skynet.error("launch login slave failed : " .. tostring(err))
+				end
+			end)
+		end
+		return s
+	end
+
+	-- the slaves more than instance exit when they are idle for scale_interval
+	local function scale_down()
+		while true do
+			skynet.sleep(scale_interval)
+			local now = skynet.now()
+			for i = #slave, 1, -1 do
+				if #slave <= instance then
+					break
+				end
+				local s = slave[i]
+				if load[s] == 0 and now - idle[s] >= scale_interval then
+					table.remove(slave, i)
+					load[s] = nil
+					idle[s] = nil
+					skynet.kill(s)
+					skynet.error(string.format("login slave scale down : %d", #slave))
+				end
+			end
+		end
+	end
+	if max_instance > instance then
+		skynet.fork(scale_down)
 	end
 
 	skynet.error(string.format("login server listen at : %s %d", host, port))
 	local id = socket.listen(host, port)
-	socket.start(id , function(fd, addr)
-		local s = slave[balance]
-		balance = balance + 1
-		if balance > #slave then
-			balance = 1
+	local function call_slave(fd, addr)
+		local s = choose_slave()
+		load[s] = load[s] + 1
+		local r = table.pack(pcall(skynet.call, s, "lua", fd, addr))
+		local n = load[s] - 1
+		load[s] = n
+		if n == 0 then
+			idle[s] = skynet.now()
+		end
+		if not r[1] then
+			error(r[2])
 		end
-		local ok, err = pcall(accept, conf, s, fd, addr)
+		return table.unpack(r, 2, r.n)
+	end
+
+	socket.start(id , function(fd, addr)
+		local ok, err = pcall(accept, conf, call_slave, fd, addr)
 		if not ok then
 			if err ~= socket_error then
 				skynet.error(string.format("invalid client (fd = %d) error = %s", fd, err))
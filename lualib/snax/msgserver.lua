@@ -3,6 +3,7 @@ local gateserver = require "snax.gateserver"
 local netpack = require "skynet.netpack"
 local crypt = require "skynet.crypt"
 local socketdriver = require "skynet.socketdriver"
+local core = require "skynet.msgserver.core"
 local assert = assert
 local b64encode = crypt.base64encode
 local b64decode = crypt.base64decode
@@ -67,6 +68,7 @@ Supported skynet command:
 
 Config for server.start:
 	conf.expired_number : the number of the response message cached after sending out (default is 128)
+	conf.cache_size : the max bytes of the response cache of each user (default is 65536), the cache grows when needed
 	conf.login_handler(uid, secret) -> subid : the function when a new user login, alloc a subid for it. (may call by login server)
 	conf.logout_handler(uid, subid) : the functon when a user logout. (may call by agent)
 	conf.kick_handler(uid, subid) : the functon when a user logout. (may call by login server)
@@ -85,6 +87,8 @@ skynet.register_protocol {
 local user_online = {}
 local handshake = {}
 local connection = {}
+local expired_number = 128
+local cache_size = 65536
 
 function server.userid(username)
 	-- base64(uid)@base64(server)#base64(subid)
@@ -114,7 +118,8 @@ function server.login(username, secret)
 		version = 0,
 		index = 0,
 		username = username,
-		response = {},	-- response cache
+		response = core.cache(expired_number, cache_size),	-- response cache, see lualib-src/lua-msgserver.c
+		pending = {},	-- session -> { fd = return fd, version = version }, the requests without response
 	}
 end
 
@@ -126,7 +131,8 @@ function server.ip(username)
 end
 
 function server.start(conf)
-	local expired_number = conf.expired_number or 128
+	expired_number = conf.expired_number or expired_number
+	cache_size = conf.cache_size or cache_size
 
 	local handler = {}
 
@@ -218,90 +224,66 @@ function server.start(conf)
 
 	local request_handler = assert(conf.request_handler)
 
-	-- u.response is a struct { return_fd , response, version, index }
-	local function retire_response(u)
-		if u.index >= expired_number * 2 then
-			local max = 0
-			local response = u.response
-			for k,p in pairs(response) do
-				if p[1] == nil then
-					-- request complete, check expired
-					if p[4] < expired_number then
-						response[k] = nil
-					else
-						p[4] = p[4] - expired_number
-						if p[4] > max then
-							max = p[4]
-						end
-					end
-				end
-			end
-			u.index = max + 1
-		end
-	end
-
-	local function do_request(fd, message)
+	local function do_request(fd, session, message)
 		local u = assert(connection[fd], "invalid fd")
-		local session = string.unpack(">I4", message, -4)
-		message = message:sub(1,-5)
-		local p = u.response[session]
+		local p = u.pending[session]
 		if p then
-			-- session can be reuse in the same connection
-			if p[3] == u.version then
-				local last = u.response[session]
-				u.response[session] = nil
-				p = nil
-				if last[2] == nil then
-					local error_msg = string.format("Conflict session %s", crypt.hexencode(session))
-					skynet.error(error_msg)
-					error(error_msg)
-				end
+			if p.version == u.version then
+				local error_msg = string.format("Conflict session %s", crypt.hexencode(string.pack(">I4", session)))
+				skynet.error(error_msg)
+				error(error_msg)
 			end
+			-- already request, but response is not ready, change return fd.
+			p.fd = fd
+			p.version = u.version
+			return
 		end
-
-		if p == nil then
-			p = { fd }
-			u.response[session] = p
-			local ok, result = pcall(request_handler, u.username, message)
-			-- NOTICE: YIELD here, socket may close.
-			result = result or ""
-			if not ok then
-				skynet.error(result)
-				result = string.pack(">BI4", 0, session)
+		local cache = u.response
+		local version = cache:find(session)
+		if version then
+			if version == u.version then
+				-- session can be reuse in the same connection
+				cache:remove(session)
 			else
-				result = result .. string.pack(">BI4", 1, session)
-			end
-
-			p[2] = string.pack(">s2",result)
-			p[3] = u.version
-			p[4] = u.index
-		else
-			-- update version/index, change return fd.
-			-- resend response.
-			p[1] = fd
-			p[3] = u.version
-			p[4] = u.index
-			if p[2] == nil then
-				-- already request, but response is not ready
+				-- resend response, update version
+				local msg, sz = cache:resend(session, u.version)
+				if connection[fd] then
+					socketdriver.send(fd, msg, sz)
+				else
+					skynet.trash(msg, sz)
+				end
 				return
 			end
 		end
-		u.index = u.index + 1
-		-- the return fd is p[1] (fd may change by multi request) check connect
-		fd = p[1]
+
+		p = { fd = fd, version = u.version }
+		u.pending[session] = p
+		local ok, result = pcall(request_handler, u.username, message)
+		-- NOTICE: YIELD here, socket may close.
+		u.pending[session] = nil
+		if not ok then
+			skynet.error(result)
+		end
+		local msg, sz = cache:push(session, p.version, ok, result)
+		-- the return fd is p.fd (fd may change by multi request) check connect
+		fd = p.fd
 		if connection[fd] then
-			socketdriver.send(fd, p[2])
+			socketdriver.send(fd, msg, sz)
+		else
+			skynet.trash(msg, sz)
 		end
-		p[1] = nil
-		retire_response(u)
 	end
 
 	local function request(fd, msg, sz)
-		local message = netpack.tostring(msg, sz)
-		local ok, err = pcall(do_request, fd, message)
+		-- the session is the last 4 bytes, msg is freed
+		local ok, session, message = pcall(core.request, msg, sz)
+		local err = session
+		if ok then
+			ok, err = pcall(do_request, fd, session, message)
+		end
 		-- not atomic, may yield
 		if not ok then
-			skynet.error(string.format("Invalid package %s : %s", err, message))
+			skynet.error(string.format("Invalid package %s : %s", err, message or ""))
 			if connection[fd] then
 				gateserver.closeclient(fd)
 			end
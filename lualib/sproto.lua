@@ -23,12 +23,21 @@ function sproto.new(bin)
 	return setmetatable(self, sproto_mt)
 end
 
+-- The C object saved by sprotoloader is never released, so one wrapper per VM is enough
+local shared = {}
+
 function sproto.sharenew(cobj)
-	local self = {
+	local self = shared[cobj]
+	if self then
+		return self
+	end
+	-- the schema is immutable and the lookups are bounded by it, so keep them all
+	self = {
 		__cobj = cobj,
-		__tcache = setmetatable( {} , weak_mt ),
-		__pcache = setmetatable( {} , weak_mt ),
+		__tcache = {},
+		__pcache = {},
 	}
+	shared[cobj] = self
 	return setmetatable(self, sproto_nogc)
 end
 
@@ -40,10 +49,11 @@ end
 
 function sproto:host( packagename )
 	packagename = packagename or  "package"
+	local package = assert(core.querytype(self.__cobj, packagename), "type package not found")
 	local obj = {
 		__proto = self,
-		__package = assert(core.querytype(self.__cobj, packagename), "type package not found"),
-		__session = {},
+		__package = package,
+		__host = core.host(self.__cobj, package),	-- the sessions waiting for response are kept in it
 	}
 	return setmetatable(obj, host_mt)
 end
@@ -77,6 +87,11 @@ function sproto:decode(typename, ...)
 	return core.decode(st, ...)
 end
 
+function sproto:decodefield(typename, field, ...)
+	local st = querytype(self, typename)
+	return core.decodefield(st, field, ...)
+end
+
 function sproto:pencode(typename, tbl)
 	local st = querytype(self, typename)
 	return core.pack(core.encode(st, tbl))
@@ -178,74 +193,42 @@ function sproto:default(typename, type)
 	end
 end
 
-local header_tmp = {}
+local host_dispatch = core.host_dispatch
+local host_response = core.host_response
+local host_request = core.host_request
 
-local function gen_response(self, response, session)
+local function gen_response(h, tag, session)
 	return function(args, ud)
-		header_tmp.type = nil
-		header_tmp.session = session
-		header_tmp.ud = ud
-		local header = core.encode(self.__package, header_tmp)
-		if response then
-			local content = core.encode(response, args)
-			return core.pack(header .. content)
-		else
-			return core.pack(header)
-		end
+		return host_response(h, tag, session, args, ud)
 	end
 end
 
 function host:dispatch(...)
-	local bin = core.unpack(...)
-	header_tmp.type = nil
-	header_tmp.session = nil
-	header_tmp.ud = nil
-	local header, size = core.decode(self.__package, bin, header_tmp)
-	local content = bin:sub(size + 1)
-	if header.type then
-		-- request
-		local proto = queryproto(self.__proto, header.type)
-		local result
-		if proto.request then
-			result = core.decode(proto.request, content)
-		end
-		if header_tmp.session then
-			return "REQUEST", proto.name, result, gen_response(self, proto.response, header_tmp.session), header.ud
-		else
-			return "REQUEST", proto.name, result, nil, header.ud
-		end
-	else
-		-- response
-		local session = assert(header_tmp.session, "session not found")
-		local response = assert(self.__session[session], "Unknown session")
-		self.__session[session] = nil
-		if response == true then
-			return "RESPONSE", session, nil, header.ud
-		else
-			local result = core.decode(response, content)
-			return "RESPONSE", session, result, header.ud
-		end
+	local t, name, result, session, ud, tag = host_dispatch(self.__host, ...)
+	if t == "REQUEST" and session then
+		return t, name, result, gen_response(self.__host, tag, session), ud
 	end
+	-- "REQUEST", name, result, nil, ud or "RESPONSE", session, result, ud
+	return t, name, result, session, ud
+end
+
+-- Like dispatch, but a request returns its session (and tag) instead of a response function, so no closure is
+-- created for it. Pack the response by host:response(name or tag, session, args, ud)
+--	"REQUEST", name, args, session, ud, tag
+--	"RESPONSE", session, args, ud
+function host:rawdispatch(...)
+	return host_dispatch(self.__host, ...)
+end
+
+function host:response(name, session, args, ud)
+	return host_response(self.__host, name, session, args, ud)
 end
 
 function host:attach(sp)
+	local h = self.__host
+	local cobj = sp.__cobj
 	return function(name, args, session, ud)
-		local proto = queryproto(sp, name)
-		header_tmp.type = proto.tag
-		header_tmp.session = session
-		header_tmp.ud = ud
-		local header = core.encode(self.__package, header_tmp)
-
-		if session then
-			self.__session[session] = proto.response or true
-		end
-
-		if proto.request then
-			local content = core.encode(proto.request, args)
-			return core.pack(header ..  content)
-		else
-			return core.pack(header)
-		end
+		return host_request(h, cobj, name, args, session, ud)
 	end
 end
 
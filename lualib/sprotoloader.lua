@@ -17,6 +17,8 @@ function loader.save(bin, index)
 	core.saveproto(sp, index)
 end
 
+-- The type and protocol indices are built once in the C object and shared by all services,
+-- the lua object is created once per service.
 function loader.load(index)
 	local sp = core.loadproto(index)
 	--  no __gc in metatable
@@ -5,6 +5,8 @@
 #include <string.h>
 #include <assert.h>
 
+#include "framing.h"
+
 #define MESSAGEPOOL 1023  // 消息池大小，每个池包含1023个消息节点
 
 // 消息节点结构，用于存储单个数据块
@@ -16,7 +18,8 @@ struct message {
 
 // 数据缓冲区结构，用于管理消息链表
 struct databuffer {
-	int header;          // 消息头长度（2或4字节）
+	int header;          // 已解析出的消息体长度
+	struct frame frame;  // 当前消息的帧头，frame.header为0表示尚未解析
 	int offset;          // 当前消息节点的读取偏移量
 	int size;            // 缓冲区中剩余的总数据大小
 	struct message * head; // 消息链表头指针
@@ -61,7 +64,7 @@ _return_message(struct databuffer *db, struct messagepool *mp) {
 	} else {
 		db->head = m->next;         // 移动头指针到下一个节点
 	}
-	skynet_free(m->buffer);         // 释放消息数据缓冲区
+	skynet_socket_recycle(m->buffer, m->size); // 数据缓冲区放回socket读缓冲池
 	m->buffer = NULL;               // 清空缓冲区指针
 	m->size = 0;                    // 重置大小
 	m->next = mp->freelist;         // 将节点加入空闲链表
@@ -139,24 +142,57 @@ databuffer_push(struct databuffer *db, struct messagepool *mp, void *data, int s
 	}
 }
 
-// 读取并解析消息头，返回消息体长度
+// 复制缓冲区开头最多sz字节但不消耗，返回实际复制的字节数
 static int
-databuffer_readheader(struct databuffer *db, struct messagepool *mp, int header_size) {
-	if (db->header == 0) {
-		// parser header (2 or 4)
-		// 解析消息头（2字节或4字节）
-		if (db->size < header_size) {
-			return -1;  // 数据不足，无法读取完整头部
+databuffer_peek(struct databuffer *db, uint8_t *buffer, int sz) {
+	if (sz > db->size)
+		sz = db->size;
+	struct message *m = db->head;
+	int offset = db->offset;
+	int n = 0;
+	while (n < sz) {
+		int bsz = m->size - offset;
+		if (bsz > sz - n)
+			bsz = sz - n;
+		memcpy(buffer + n, m->buffer + offset, bsz);
+		n += bsz;
+		offset = 0;
+		m = m->next;
+	}
+	return n;
+}
+
+// 丢弃缓冲区开头的sz字节
+static void
+databuffer_skip(struct databuffer *db, struct messagepool *mp, int sz) {
+	assert(db->size >= sz);
+	db->size -= sz;
+	while (sz > 0) {
+		int bsz = db->head->size - db->offset;
+		if (bsz > sz) {
+			db->offset += sz;
+			return;
 		}
-		uint8_t plen[4];
-		databuffer_read(db,mp,(char *)plen,header_size);
-		// big-endian
-		// 大端字节序解析头部长度
-		if (header_size == 2) {
-			db->header = plen[0] << 8 | plen[1];  // 2字节头部
-		} else {
-			db->header = plen[0] << 24 | plen[1] << 16 | plen[2] << 8 | plen[3];  // 4字节头部
+		_return_message(db, mp);
+		db->offset = 0;
+		sz -= bsz;
+	}
+}
+
+// 读取并解析消息头，返回消息体长度；-1 表示数据不足，-2 表示帧头非法
+static int
+databuffer_readheader(struct databuffer *db, struct messagepool *mp, const struct framing *f) {
+	if (db->frame.header == 0) {
+		uint8_t head[FRAMING_MAXHEADER];
+		int n = databuffer_peek(db, head, FRAMING_MAXHEADER);
+		int hsz = framing_parse(f, head, n, &db->frame);
+		if (hsz == 0) {
+			return -1;  // 数据不足，无法读取完整头部
+		} else if (hsz < 0) {
+			return -2;
 		}
+		databuffer_skip(db, mp, hsz);
+		db->header = db->frame.size;
 	}
 	if (db->size < db->header)
 		return -1;  // 消息体数据不完整
@@ -167,6 +203,7 @@ databuffer_readheader(struct databuffer *db, struct messagepool *mp, int header_
 static inline void
 databuffer_reset(struct databuffer *db) {
 	db->header = 0;  // 清空已解析的消息头长度
+	db->frame.header = 0;
 }
 
 // 清空数据缓冲区，释放所有消息节点
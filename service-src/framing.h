@@ -0,0 +1,221 @@
+#ifndef skynet_framing_h
+#define skynet_framing_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// 分包方式
+#define FRAMING_LENGTH 0     // 定长长度头（1~4字节，大端或小端）
+#define FRAMING_VARINT 1     // varint 长度头（每字节7位，低位在前）
+#define FRAMING_WEBSOCKET 2  // websocket 帧（握手需在此之前完成）
+
+#define FRAMING_MAXHEADER 14          // 头部最大字节数（websocket: 2 + 8 + 4）
+#define FRAMING_DEFAULTMAX 0xffffff   // 默认最大包长（16M - 1）
+
+// 帧类型
+#define FRAME_DATA 0   // 数据帧，交给上层
+#define FRAME_SKIP 1   // 控制帧（ping/pong），丢弃负载
+#define FRAME_CLOSE 2  // websocket close 帧
+
+// 分包配置
+struct framing {
+	int type;          // FRAMING_*
+	int header;        // 定长头的字节数
+	int littleendian;  // 定长头是否小端
+	int max;           // 包体最大长度
+};
+
+// 解析出的一个帧头
+struct frame {
+	int header;        // 头部字节数，0 表示尚未解析
+	int size;          // 负载长度
+	int kind;          // FRAME_*
+	int masked;        // 负载是否带掩码
+	uint8_t mask[4];   // websocket 掩码
+};
+
+/*
+	spec 格式：style[:option]...
+	style : S (2字节) | L (4字节) | 1 | 2 | 3 | 4 | varint | ws
+	option : be | le | 最大包长
+	例如 "4:le:1048576" , "varint:65536" , "ws"
+	spec 为空时等同于 "S" 。返回 0 成功，-1 格式错误
+ */
+static int
+framing_init(struct framing *f, const char *spec, int max) {
+	f->type = FRAMING_LENGTH;
+	f->header = 2;
+	f->littleendian = 0;
+	f->max = max;
+	if (spec && spec[0]) {
+		char tmp[64];
+		size_t len = strlen(spec);
+		if (len >= sizeof(tmp))
+			return -1;
+		memcpy(tmp, spec, len + 1);
+		char *p = tmp;
+		char *style = strsep(&p, ":");
+		if (strcmp(style, "S") == 0) {
+			f->header = 2;
+		} else if (strcmp(style, "L") == 0) {
+			f->header = 4;
+		} else if (style[0] >= '1' && style[0] <= '4' && style[1] == '\0') {
+			f->header = style[0] - '0';
+		} else if (strcmp(style, "varint") == 0) {
+			f->type = FRAMING_VARINT;
+		} else if (strcmp(style, "ws") == 0) {
+			f->type = FRAMING_WEBSOCKET;
+		} else {
+			return -1;
+		}
+		char *opt;
+		while ((opt = strsep(&p, ":")) != NULL) {
+			if (strcmp(opt, "le") == 0) {
+				f->littleendian = 1;
+			} else if (strcmp(opt, "be") == 0) {
+				f->littleendian = 0;
+			} else {
+				char *end;
+				long v = strtol(opt, &end, 10);
+				if (*end != '\0' || v <= 0 || v > 0x7fffffff)
+					return -1;
+				f->max = (int)v;
+			}
+		}
+	}
+	// 定长头能表示的长度有限
+	if (f->type == FRAMING_LENGTH && f->header < 4) {
+		int limit = (1 << (8 * f->header)) - 1;
+		if (f->max > limit)
+			f->max = limit;
+	}
+	return 0;
+}
+
+// 解析帧头，返回头部字节数；0 表示数据不足，-1 表示帧头非法或超过最大包长
+static inline int
+framing_parse(const struct framing *f, const uint8_t *buf, int sz, struct frame *fr) {
+	uint64_t len = 0;
+	int i, n;
+	fr->kind = FRAME_DATA;
+	fr->masked = 0;
+	switch (f->type) {
+	case FRAMING_LENGTH:
+		n = f->header;
+		if (sz < n)
+			return 0;
+		for (i=0;i<n;i++) {
+			len = len << 8 | buf[f->littleendian ? n-1-i : i];
+		}
+		break;
+	case FRAMING_VARINT:
+		for (i=0;;i++) {
+			if (i >= 5)
+				return -1;
+			if (i >= sz)
+				return 0;
+			len |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+			if ((buf[i] & 0x80) == 0)
+				break;
+		}
+		n = i + 1;
+		break;
+	case FRAMING_WEBSOCKET: {
+		if (sz < 2)
+			return 0;
+		// 没有协商扩展，RSV 位必须为 0
+		if (buf[0] & 0x70)
+			return -1;
+		int opcode = buf[0] & 0xf;
+		if (opcode == 0x8) {
+			fr->kind = FRAME_CLOSE;
+		} else if (opcode & 0x8) {
+			fr->kind = FRAME_SKIP;
+		}
+		fr->masked = buf[1] >> 7;
+		len = buf[1] & 0x7f;
+		n = 2;
+		if (len == 126) {
+			n = 4;
+			if (sz < n)
+				return 0;
+			len = buf[2] << 8 | buf[3];
+		} else if (len == 127) {
+			n = 10;
+			if (sz < n)
+				return 0;
+			len = 0;
+			for (i=2;i<10;i++) {
+				len = len << 8 | buf[i];
+			}
+		}
+		if (fr->masked) {
+			if (sz < n + 4)
+				return 0;
+			memcpy(fr->mask, buf + n, 4);
+			n += 4;
+		}
+		break;
+	}
+	default:
+		return -1;
+	}
+	if (len > (uint64_t)f->max)
+		return -1;
+	fr->header = n;
+	fr->size = (int)len;
+	return n;
+}
+
+// 去掉负载的掩码，offset 是 data 在负载中的起始位置
+static inline void
+framing_unmask(const struct frame *fr, uint8_t *data, int sz, int offset) {
+	if (!fr->masked)
+		return;
+	int i;
+	for (i=0;i<sz;i++) {
+		data[i] ^= fr->mask[(offset + i) & 3];
+	}
+}
+
+// 写入长度为 len 的包头（服务端发出的 websocket 帧不带掩码），返回头部字节数
+static inline int
+framing_write(const struct framing *f, uint8_t *buf, size_t len) {
+	int i, n;
+	switch (f->type) {
+	case FRAMING_LENGTH:
+		n = f->header;
+		for (i=0;i<n;i++) {
+			buf[f->littleendian ? i : n-1-i] = (len >> (8 * i)) & 0xff;
+		}
+		return n;
+	case FRAMING_VARINT:
+		n = 0;
+		while (len >= 0x80) {
+			buf[n++] = (len & 0x7f) | 0x80;
+			len >>= 7;
+		}
+		buf[n++] = len;
+		return n;
+	case FRAMING_WEBSOCKET:
+		buf[0] = 0x82;  // FIN + binary
+		if (len < 126) {
+			buf[1] = len;
+			return 2;
+		} else if (len < 0x10000) {
+			buf[1] = 126;
+			buf[2] = (len >> 8) & 0xff;
+			buf[3] = len & 0xff;
+			return 4;
+		}
+		buf[1] = 127;
+		for (i=0;i<8;i++) {
+			buf[9-i] = ((uint64_t)len >> (8 * i)) & 0xff;
+		}
+		return 10;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef skynet_lzblock_h
+#define skynet_lzblock_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+	LZ4 块格式的压缩和解压（不带帧头），用于集群和 harbor 链路上的大消息。
+	每个序列：token(高4位字面量长度，低4位匹配长度-4) [长度扩展] 字面量 偏移(2字节小端) [长度扩展]
+	最后一个序列只有字面量。
+ */
+
+#define LZ_MINMATCH 4
+#define LZ_HASHLOG 13
+#define LZ_LASTLITERALS 5    // 最后5个字节必须是字面量
+#define LZ_MFLIMIT 12        // 匹配不能从最后12个字节开始
+#define LZ_MAXOFFSET 65535
+
+// 压缩结果的最大长度
+static inline size_t
+lz_bound(size_t sz) {
+	return sz + sz / 255 + 16;
+}
+
+// 压缩数据 sz 字节最多解压出的长度，每个长度扩展字节最多表示 255 字节，声明的原始长度超过它一定是坏数据
+static inline size_t
+lz_maxorig(size_t sz) {
+	return sz * 255 + 16;
+}
+
+static inline uint32_t
+lz_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ_HASHLOG);
+}
+
+static inline uint8_t *
+lz_putlength(uint8_t *op, size_t len) {
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+// 压缩 sz 字节到 dest，返回压缩后的长度；超过 cap 时返回 0
+static size_t
+lz_compress(const void *source, size_t sz, void *dest, size_t cap) {
+	const uint8_t *src = (const uint8_t *)source;
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *iend = src + sz;
+	uint8_t *op = (uint8_t *)dest;
+	uint8_t *oend = op + cap;
+	if (sz >= LZ_MFLIMIT + 1) {
+		const uint8_t *mflimit = iend - LZ_MFLIMIT;
+		const uint8_t *matchlimit = iend - LZ_LASTLITERALS;
+		uint32_t table[1 << LZ_HASHLOG];	// 位置+1，0 表示空
+		memset(table, 0, sizeof(table));
+		while (ip < mflimit) {
+			uint32_t seq = lz_read32(ip);
+			uint32_t h = lz_hash(seq);
+			uint32_t ref = table[h];
+			uint32_t pos = (uint32_t)(ip - src);
+			table[h] = pos + 1;
+			if (ref == 0 || pos + 1 - ref > LZ_MAXOFFSET || lz_read32(src + ref - 1) != seq) {
+				// 没有匹配的数据越长，跳得越快
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+			const uint8_t *match = src + ref - 1;
+			while (ip > anchor && match > src && ip[-1] == match[-1]) {
+				--ip;
+				--match;
+			}
+			const uint8_t *p = ip + LZ_MINMATCH;
+			const uint8_t *m = match + LZ_MINMATCH;
+			while (p < matchlimit && *p == *m) {
+				++p;
+				++m;
+			}
+			size_t litlen = ip - anchor;
+			size_t mlen = p - ip - LZ_MINMATCH;
+			if ((size_t)(oend - op) < 1 + litlen / 255 + 1 + litlen + 2 + mlen / 255 + 1)
+				return 0;
+			uint8_t *token = op++;
+			*token = (uint8_t)((litlen >= 15 ? 15 : litlen) << 4);
+			if (litlen >= 15)
+				op = lz_putlength(op, litlen - 15);
+			memcpy(op, anchor, litlen);
+			op += litlen;
+			size_t offset = ip - match;
+			*op++ = offset & 0xff;
+			*op++ = (offset >> 8) & 0xff;
+			*token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+			if (mlen >= 15)
+				op = lz_putlength(op, mlen - 15);
+			ip = p;
+			anchor = ip;
+		}
+	}
+	size_t litlen = iend - anchor;
+	if ((size_t)(oend - op) < 1 + litlen / 255 + 1 + litlen)
+		return 0;
+	uint8_t *token = op++;
+	*token = (uint8_t)((litlen >= 15 ? 15 : litlen) << 4);
+	if (litlen >= 15)
+		op = lz_putlength(op, litlen - 15);
+	memcpy(op, anchor, litlen);
+	op += litlen;
+	return op - (uint8_t *)dest;
+}
+
+// 解压到 dest，返回解压后的长度；数据非法或超过 cap 时返回 -1
+static long
+lz_decompress(const void *source, size_t sz, void *dest, size_t cap) {
+	const uint8_t *ip = (const uint8_t *)source;
+	const uint8_t *iend = ip + sz;
+	uint8_t *op = (uint8_t *)dest;
+	uint8_t *oend = op + cap;
+	for (;;) {
+		if (ip >= iend)
+			return -1;
+		unsigned token = *ip++;
+		size_t len = token >> 4;
+		if (len == 15) {
+			unsigned b;
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend)
+			break;	// 最后一个序列只有字面量
+		if (iend - ip < 2)
+			return -1;
+		size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dest))
+			return -1;
+		len = token & 15;
+		if (len == 15) {
+			unsigned b;
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += LZ_MINMATCH;
+		if (len > (size_t)(oend - op))
+			return -1;
+		const uint8_t *m = op - offset;
+		if (offset >= len) {
+			memcpy(op, m, len);
+			op += len;
+		} else {
+			// 重叠的匹配要逐字节复制
+			size_t i;
+			for (i=0;i<len;i++) {
+				op[i] = m[i];
+			}
+			op += len;
+		}
+	}
+	return op - (uint8_t *)dest;
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include "skynet.h"
 #include "skynet_socket.h"
+#include "skynet_mq.h"
 #include "databuffer.h"
 #include "hashid.h"
 
@@ -10,7 +11,13 @@
 #include <stdio.h>
 #include <stdarg.h>
 
+#ifdef GATE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
 #define BACKLOG 128  // 监听队列的最大长度
+#define TLS_RECORD_SIZE 16384  // 一个tls记录的最大明文长度
 
 // 连接结构，表示一个客户端连接
 struct connection {
@@ -19,6 +26,11 @@ struct connection {
 	uint32_t client;              // 客户端服务的句柄
 	char remote_name[32];         // 远程客户端地址信息
 	struct databuffer buffer;     // 数据缓冲区，用于存储接收的数据
+#ifdef GATE_TLS
+	SSL *ssl;                     // tls会话（开启tls时），收到的数据解密后再分包
+	char *pending;                // 握手完成前要发给客户端的明文
+	int pending_sz;
+#endif
 };
 
 // 网关结构，管理所有客户端连接
@@ -28,15 +40,203 @@ struct gate {
 	uint32_t watchdog;            // 看门狗服务句柄，用于监控连接状态
 	uint32_t broker;              // 代理服务句柄，用于转发消息
 	int client_tag;               // 客户端消息类型标签
-	int header_size;              // 消息头大小（2或4字节）
+	struct framing framing;       // 分包方式（长度头、varint或websocket）
 	int max_connection;           // 最大连接数
 	struct hashid hash;           // 哈希表，用于快速查找连接
 	struct connection *conn;      // 连接数组
 	// todo: save message pool ptr for release
 	// 待办：保存消息池指针用于释放
 	struct messagepool mp;        // 消息池，用于管理消息节点的内存分配
+#ifdef GATE_TLS
+	SSL_CTX *tls;                 // 所有连接共用的tls配置（证书、会话缓存和ticket密钥），NULL表示不开启tls
+#endif
 };
 
+#ifdef GATE_TLS
+
+/*
+ * tls终结：每个连接一个SSL对象，读写都通过内存BIO，socket仍由skynet的socket线程收发
+ * 解密后的数据和明文连接一样分包转发给agent；发给客户端的数据必须经过gate（PTYPE_CLIENT消息）才能加密，
+ * agent不能再直接socket.write
+ */
+
+static void
+tls_error(struct gate *g, int id, const char *what) {
+	char buf[256];
+	unsigned long err = ERR_get_error();
+	if (err) {
+		ERR_error_string_n(err, buf, sizeof(buf));
+	} else {
+		strcpy(buf, "unknown");
+	}
+	ERR_clear_error();
+	skynet_error(g->ctx, "[gate] tls %s error on %d : %s", what, id, buf);
+}
+
+static int
+tls_init(struct gate *g, const char *cert, const char *key) {
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL) {
+		tls_error(g, -1, "SSL_CTX_new");
+		return 1;
+	}
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1) {
+		tls_error(g, -1, cert);
+		SSL_CTX_free(ctx);
+		return 1;
+	}
+	if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+		tls_error(g, -1, key);
+		SSL_CTX_free(ctx);
+		return 1;
+	}
+	// 断线重连的客户端用会话缓存或ticket恢复会话，省掉完整握手；ticket密钥在这个SSL_CTX内共享
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"skynet.gate", 11);
+	// 空闲连接释放读写缓冲区，大量长连接时节省内存
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+	g->tls = ctx;
+	return 0;
+}
+
+static int
+tls_accept(struct gate *g, struct connection *c) {
+	SSL *ssl = SSL_new(g->tls);
+	if (ssl == NULL)
+		return 1;
+	BIO *in = BIO_new(BIO_s_mem());
+	BIO *out = BIO_new(BIO_s_mem());
+	if (in == NULL || out == NULL) {
+		BIO_free(in);
+		BIO_free(out);
+		SSL_free(ssl);
+		return 1;
+	}
+	BIO_set_mem_eof_return(in, -1);
+	BIO_set_mem_eof_return(out, -1);
+	SSL_set_bio(ssl, in, out);
+	SSL_set_accept_state(ssl);
+	c->ssl = ssl;
+	return 0;
+}
+
+static void
+tls_release(struct connection *c) {
+	if (c->ssl) {
+		SSL_free(c->ssl);   // BIO随SSL一起释放
+		c->ssl = NULL;
+	}
+	skynet_free(c->pending);
+	c->pending = NULL;
+	c->pending_sz = 0;
+}
+
+// 把待发送的密文交给socket
+static void
+tls_flush(struct gate *g, struct connection *c) {
+	BIO *out = SSL_get_wbio(c->ssl);
+	int pending = (int)BIO_ctrl_pending(out);
+	if (pending <= 0)
+		return;
+	char *buf = skynet_malloc(pending);
+	int n = BIO_read(out, buf, pending);
+	if (n <= 0) {
+		skynet_free(buf);
+		return;
+	}
+	skynet_socket_send(g->ctx, c->id, buf, n);
+}
+
+static int
+tls_write(struct gate *g, struct connection *c, const void *msg, int sz) {
+	int n = SSL_write(c->ssl, msg, sz);
+	if (n != sz) {
+		tls_error(g, c->id, "SSL_write");
+		return 1;
+	}
+	return 0;
+}
+
+// 发送明文给客户端，握手完成前先缓存
+static void
+tls_send(struct gate *g, struct connection *c, const void *msg, int sz) {
+	if (!SSL_is_init_finished(c->ssl)) {
+		c->pending = skynet_realloc(c->pending, c->pending_sz + sz);
+		memcpy(c->pending + c->pending_sz, msg, sz);
+		c->pending_sz += sz;
+		return;
+	}
+	if (tls_write(g, c, msg, sz)) {
+		skynet_socket_close(g->ctx, c->id);
+		return;
+	}
+	tls_flush(g, c);
+}
+
+static void dispatch_message(struct gate *g, struct connection *c, int id, void * data, int sz);
+
+// 收到密文：推进握手，解密出的明文交给dispatch_message分包
+static void
+tls_recv(struct gate *g, struct connection *c, int id, void *data, int sz) {
+	int n = BIO_write(SSL_get_rbio(c->ssl), data, sz);
+	skynet_socket_recycle(data, sz);
+	if (n != sz) {
+		tls_error(g, id, "BIO_write");
+		skynet_socket_close(g->ctx, id);
+		return;
+	}
+	if (!SSL_is_init_finished(c->ssl)) {
+		int ret = SSL_do_handshake(c->ssl);
+		if (ret <= 0) {
+			int err = SSL_get_error(c->ssl, ret);
+			if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+				tls_error(g, id, "handshake");
+				tls_flush(g, c);   // 发出alert
+				skynet_socket_close(g->ctx, id);
+				return;
+			}
+		}
+		if (!SSL_is_init_finished(c->ssl)) {
+			tls_flush(g, c);
+			return;
+		}
+		if (c->pending) {
+			int err = tls_write(g, c, c->pending, c->pending_sz);
+			skynet_free(c->pending);
+			c->pending = NULL;
+			c->pending_sz = 0;
+			if (err) {
+				skynet_socket_close(g->ctx, id);
+				return;
+			}
+		}
+	}
+	char buf[TLS_RECORD_SIZE];
+	for (;;) {
+		n = SSL_read(c->ssl, buf, sizeof(buf));
+		if (n <= 0) {
+			int err = SSL_get_error(c->ssl, n);
+			if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+				break;
+			if (err != SSL_ERROR_ZERO_RETURN) {
+				tls_error(g, id, "SSL_read");
+			}
+			// 对方发送了close_notify或者出错
+			tls_flush(g, c);
+			skynet_socket_close(g->ctx, id);
+			return;
+		}
+		// databuffer用完会把缓冲区放回socket读缓冲池，所以也从池中分配
+		void *plain = skynet_socket_alloc(n);
+		memcpy(plain, buf, n);
+		dispatch_message(g, c, id, plain, n);
+	}
+	// 握手的最后一步和TLS1.3的会话ticket
+	tls_flush(g, c);
+}
+
+#endif
+
 // 创建网关实例
 struct gate *
 gate_create(void) {
@@ -57,6 +257,9 @@ gate_release(struct gate *g) {
 		if (c->id >=0) {
 			skynet_socket_close(ctx, c->id);  // 关闭socket连接
 		}
+#ifdef GATE_TLS
+		tls_release(c);
+#endif
 	}
 	// 关闭监听socket
 	if (g->listen_id >= 0) {
@@ -65,6 +268,11 @@ gate_release(struct gate *g) {
 	messagepool_free(&g->mp);  // 释放消息池
 	hashid_clear(&g->hash);    // 清理哈希表
 	skynet_free(g->conn);      // 释放连接数组
+#ifdef GATE_TLS
+	if (g->tls) {
+		SSL_CTX_free(g->tls);
+	}
+#endif
 	skynet_free(g);            // 释放网关结构体
 }
 
@@ -198,6 +406,7 @@ _forward(struct gate *g, struct connection * c, int size) {
 		// 有代理服务，转发给代理
 		void * temp = skynet_malloc(size);
 		databuffer_read(&c->buffer,&g->mp,(char *)temp, size);  // 从缓冲区读取数据
+		framing_unmask(&c->buffer.frame, temp, size, 0);
 		skynet_send(ctx, 0, g->broker, g->client_tag | PTYPE_TAG_DONTCOPY, fd, temp, size);  // 发送给代理服务
 		return;
 	}
@@ -205,12 +414,14 @@ _forward(struct gate *g, struct connection * c, int size) {
 		// 有专门的代理服务，转发给代理
 		void * temp = skynet_malloc(size);
 		databuffer_read(&c->buffer,&g->mp,(char *)temp, size);  // 从缓冲区读取数据
+		framing_unmask(&c->buffer.frame, temp, size, 0);
 		skynet_send(ctx, c->client, c->agent, g->client_tag | PTYPE_TAG_DONTCOPY, fd , temp, size);  // 发送给代理服务
 	} else if (g->watchdog) {
 		// 没有代理服务，发送给看门狗处理
 		char * tmp = skynet_malloc(size + 32);
 		int n = snprintf(tmp,32,"%d data ",c->id);  // 添加连接ID前缀
 		databuffer_read(&c->buffer,&g->mp,tmp+n,size);  // 读取数据到缓冲区
+		framing_unmask(&c->buffer.frame, (uint8_t *)tmp+n, size, 0);
 		skynet_send(ctx, 0, g->watchdog, PTYPE_TEXT | PTYPE_TAG_DONTCOPY, fd, tmp, size + n);  // 发送给看门狗
 	}
 }
@@ -221,22 +432,35 @@ dispatch_message(struct gate *g, struct connection *c, int id, void * data, int
 	databuffer_push(&c->buffer,&g->mp, data, sz);  // 将数据添加到连接的缓冲区
 	for (;;) {
 		// 尝试读取消息头，获取消息体长度
-		int size = databuffer_readheader(&c->buffer, &g->mp, g->header_size);
-		if (size < 0) {
+		int size = databuffer_readheader(&c->buffer, &g->mp, &g->framing);
+		if (size == -1) {
 			return;  // 数据不足，等待更多数据
-		} else if (size > 0) {
-			if (size >= 0x1000000) {
-				// 消息过大（超过16M），关闭连接
-				struct skynet_context * ctx = g->ctx;
-				databuffer_clear(&c->buffer,&g->mp);  // 清空缓冲区
-				skynet_socket_close(ctx, id);         // 关闭连接
-				skynet_error(ctx, "Recv socket message > 16M");
-				return;
-			} else {
+		}
+		struct skynet_context * ctx = g->ctx;
+		if (size < 0) {
+			// 帧头非法或消息超过最大长度，关闭连接
+			databuffer_clear(&c->buffer,&g->mp);  // 清空缓冲区
+			skynet_socket_close(ctx, id);         // 关闭连接
+			skynet_error(ctx, "Recv invalid frame or socket message > %d", g->framing.max);
+			return;
+		}
+		switch (c->buffer.frame.kind) {
+		case FRAME_CLOSE:
+			// websocket close 帧，关闭连接
+			databuffer_clear(&c->buffer,&g->mp);
+			skynet_socket_close(ctx, id);
+			return;
+		case FRAME_SKIP:
+			// ping/pong 等控制帧，丢弃负载
+			databuffer_skip(&c->buffer, &g->mp, size);
+			break;
+		default:
+			if (size > 0) {
 				_forward(g, c, size);           // 转发完整消息
-				databuffer_reset(&c->buffer);  // 重置缓冲区状态，准备读取下一条消息
 			}
+			break;
 		}
+		databuffer_reset(&c->buffer);  // 重置缓冲区状态，准备读取下一条消息
 	}
 }
 
@@ -250,6 +474,12 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 		int id = hashid_lookup(&g->hash, message->id);  // 查找连接ID
 		if (id>=0) {
 			struct connection *c = &g->conn[id];
+#ifdef GATE_TLS
+			if (c->ssl) {
+				tls_recv(g, c, message->id, message->buffer, message->ud);  // 先解密
+				break;
+			}
+#endif
 			dispatch_message(g, c, message->id, message->buffer, message->ud);  // 分发消息数据
 		} else {
 			// 未知连接，丢弃消息并关闭连接
@@ -281,6 +511,9 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 		if (id>=0) {
 			struct connection *c = &g->conn[id];
 			databuffer_clear(&c->buffer,&g->mp);  // 清空数据缓冲区
+#ifdef GATE_TLS
+			tls_release(c);
+#endif
 			memset(c, 0, sizeof(*c));             // 重置连接结构
 			c->id = -1;                           // 标记为无效连接
 			_report(g, "%d close", message->id);  // 向看门狗报告连接关闭
@@ -304,6 +537,13 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 			c->id = message->ud;                      // 设置连接ID
 			memcpy(c->remote_name, message+1, sz);   // 复制远程地址信息
 			c->remote_name[sz] = '\0';               // 添加字符串结束符
+#ifdef GATE_TLS
+			if (g->tls && tls_accept(g, c)) {
+				tls_error(g, c->id, "SSL_new");
+				skynet_socket_close(ctx, c->id);  // 随后的CLOSE消息回收连接槽位
+				break;
+			}
+#endif
 			_report(g, "%d open %d %s:0",c->id, c->id, c->remote_name);  // 向看门狗报告新连接
 			skynet_error(ctx, "socket open: %x", c->id);  // 记录连接打开日志
 		}
@@ -336,6 +576,13 @@ _cb(struct skynet_context * ctx, void * ud, int type, int session, uint32_t sour
 		uint32_t uid = idbuf[0] | idbuf[1] << 8 | idbuf[2] << 16 | idbuf[3] << 24;  // 小端字节序解析连接ID
 		int id = hashid_lookup(&g->hash, uid);  // 查找连接
 		if (id>=0) {
+#ifdef GATE_TLS
+			struct connection *c = &g->conn[id];
+			if (c->ssl) {
+				tls_send(g, c, msg, (int)sz-4);  // 加密后发送，密文另外分配
+				break;
+			}
+#endif
 			// don't send id (last 4 bytes)
 			// 不发送id（最后4字节）
 			skynet_socket_send(ctx, uid, (void*)msg, sz-4);  // 发送数据到客户端连接
@@ -356,6 +603,20 @@ _cb(struct skynet_context * ctx, void * ud, int type, int session, uint32_t sour
 	return 0;  // 返回0表示正常处理完成
 }
 
+// 批量消息处理：一次处理框架取出的一批消息，逐条交给_cb
+// 需要保留的消息（已交给socket发送）将data置为NULL，避免被框架释放
+void
+gate_batch(struct gate *g, struct skynet_context * ctx, struct skynet_message * msg, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		int type = (int)(msg[i].sz >> MESSAGE_TYPE_SHIFT);
+		size_t sz = msg[i].sz & MESSAGE_TYPE_MASK;
+		if (_cb(ctx, g, type, msg[i].session, msg[i].source, msg[i].data, sz)) {
+			msg[i].data = NULL;
+		}
+	}
+}
+
 // 启动监听服务，解析地址并创建监听socket
 static int
 start_listen(struct gate *g, char * listen_addr) {
@@ -398,9 +659,11 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 	char watchdog[sz];  // 看门狗服务名
 	char binding[sz];   // 绑定地址
 	int client_tag = 0; // 客户端消息标签
-	char header;        // 消息头类型（S=2字节，L=4字节）
-	// 解析参数：消息头类型 看门狗服务 绑定地址 客户端标签 最大连接数
-	int n = sscanf(parm, "%c %s %s %d %d", &header, watchdog, binding, &client_tag, &max);
+	char header[sz];    // 分包方式（S=2字节，L=4字节，其余见framing.h）
+	char cert[sz];      // tls证书链文件（可选）
+	char key[sz];       // tls私钥文件
+	// 解析参数：分包方式 看门狗服务 绑定地址 客户端标签 最大连接数 [证书 私钥]
+	int n = sscanf(parm, "%s %s %s %d %d %s %s", header, watchdog, binding, &client_tag, &max, cert, key);
 	if (n<4) {
 		skynet_error(ctx, "Invalid gate parm %s",parm);
 		return 1;  // 参数格式错误
@@ -409,9 +672,9 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 		skynet_error(ctx, "Need max connection");
 		return 1;  // 最大连接数必须大于0
 	}
-	if (header != 'S' && header !='L') {
-		skynet_error(ctx, "Invalid data header style");
-		return 1;  // 消息头类型只能是S或L
+	if (framing_init(&g->framing, header, FRAMING_DEFAULTMAX)) {
+		skynet_error(ctx, "Invalid data header style %s", header);
+		return 1;  // 分包方式格式错误
 	}
 
 	if (client_tag == 0) {
@@ -429,6 +692,20 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 
 	g->ctx = ctx;  // 设置上下文
 
+	if (n == 6) {
+		skynet_error(ctx, "Need tls private key");
+		return 1;
+	}
+	if (n == 7) {
+#ifdef GATE_TLS
+		if (tls_init(g, cert, key))
+			return 1;
+#else
+		skynet_error(ctx, "gate is built without tls, turn on TLS_MODULE in Makefile");
+		return 1;
+#endif
+	}
+
 	hashid_init(&g->hash, max);  // 初始化哈希表
 	g->conn = skynet_malloc(max * sizeof(struct connection));  // 分配连接数组
 	memset(g->conn, 0, max *sizeof(struct connection));        // 清零连接数组
@@ -440,7 +717,6 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 	}
 
 	g->client_tag = client_tag;                    // 设置客户端消息标签
-	g->header_size = header=='S' ? 2 : 4;          // 设置消息头大小
 
 	skynet_callback(ctx,g,_cb);  // 注册消息回调函数
 
@@ -2,6 +2,8 @@
 #include "skynet_harbor.h"
 #include "skynet_socket.h"
 #include "skynet_handle.h"
+#include "skynet_mq.h"
+#include "lzblock.h"
 
 /*
 	harbor listen the PTYPE_HARBOR (in text)
@@ -17,6 +19,13 @@
 	如果fd断开连接，向slave发送PTYPE_TEXT消息。D id
 	If we don't known a globalname, send message to slave in PTYPE_TEXT. Q name
 	如果我们不知道全局名称，向slave发送PTYPE_TEXT消息。Q name
+
+	Each message on the wire is a big endian 4 bytes length (the first byte is 0) , content and cookie.
+	每个消息是大端序4字节长度（第一个字节是0）、内容和消息头。
+	If harbor_compress is set in config, the messages not smaller than it are compressed,
+	and the first byte of length is 1 , the content is a big endian 4 bytes original size and the compressed content and cookie.
+	配置了 harbor_compress 时，不小于这个长度的消息压缩发送，长度的第一个字节是1，
+	内容是大端序4字节原始长度加上压缩后的内容和消息头。所有节点的配置要一致。
  */
 
 #include <stdio.h>
@@ -27,8 +36,11 @@
 #include <stdint.h>
 #include <unistd.h>
 
-#define HASH_SIZE 4096           // 哈希表大小
+#define HASH_SIZE 256            // 名字哈希表的初始大小，名字多了按倍数扩展
+#define NAME_QUERY_TTL 100       // 未解析的名字在这段时间（1/100秒）内不重复查询
 #define DEFAULT_QUEUE_SIZE 1024  // 默认队列大小
+#define SEND_BUFFER_SIZE 4096    // 出站缓冲区的初始大小
+#define SEND_FLUSH_SIZE (64*1024) // 出站缓冲区积攒到这么多就立即发出，不等批次结束
 
 // 12 is sizeof(struct remote_message_header)
 // 12是远程消息头的大小
@@ -68,12 +80,15 @@ struct keyvalue {
 	char key[GLOBALNAME_LENGTH];             // 全局名称键
 	uint32_t hash;                           // 哈希值
 	uint32_t value;                          // 服务句柄值
+	uint64_t query;                          // 未解析时，下次可以再向slave查询的时间
 	struct harbor_msg_queue * queue;         // 等待该名称解析的消息队列
 };
 
 // 哈希映射结构，管理全局名称映射
 struct hashmap {
-	struct keyvalue *node[HASH_SIZE];        // 哈希桶数组
+	int size;                                // 哈希桶数量，2的幂
+	int count;                               // 名字数量
+	struct keyvalue **node;                  // 哈希桶数组
 };
 
 // 从节点连接状态定义
@@ -92,6 +107,10 @@ struct slave {
 	int read;                            // 已读取字节数
 	uint8_t size[4];                     // 消息大小缓冲区
 	char * recv_buffer;                  // 接收缓冲区
+	char * send_buffer;                  // 本批次积攒的出站数据，发出时整块交给socket
+	size_t send_sz;                      // 出站数据大小
+	size_t send_cap;                     // 出站缓冲区容量
+	bool pending;                        // 是否在待发送列表中
 };
 
 // harbor主结构，管理整个集群通信
@@ -101,6 +120,10 @@ struct harbor {
 	uint32_t slave;                      // 从节点服务句柄
 	struct hashmap * map;                // 全局名称映射表
 	struct slave s[REMOTE_MAX];          // 远程节点数组
+	bool batching;                       // 正在批量处理消息，出站数据到批次结束时再发送
+	int npending;                        // 有出站数据的节点数量
+	int pending[REMOTE_MAX];             // 有出站数据的节点ID
+	uint32_t compress;                   // 压缩阈值，0 表示不压缩
 };
 
 // hash table
@@ -179,12 +202,24 @@ release_queue(struct harbor_msg_queue *queue) {
 	skynet_free(queue);        // 释放队列结构
 }
 
+// 计算名字的哈希值，异或后再打散，避免前缀相同的名字集中在少数桶里
+static inline uint32_t
+hash_name(const char name[GLOBALNAME_LENGTH]) {
+	const uint32_t *ptr = (const uint32_t *)name;
+	uint32_t h = ptr[0] ^ (ptr[1] * 0x9e3779b1) ^ (ptr[2] * 0x85ebca6b) ^ (ptr[3] * 0xc2b2ae35);
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
 // 在哈希表中搜索指定名称的键值对
 static struct keyvalue *
 hash_search(struct hashmap * hash, const char name[GLOBALNAME_LENGTH]) {
-	uint32_t *ptr = (uint32_t*) name;
-	uint32_t h = ptr[0] ^ ptr[1] ^ ptr[2] ^ ptr[3];  // 计算哈希值
-	struct keyvalue * node = hash->node[h % HASH_SIZE];  // 获取哈希桶
+	uint32_t h = hash_name(name);  // 计算哈希值
+	struct keyvalue * node = hash->node[h & (hash->size - 1)];  // 获取哈希桶
 	while (node) {
 		if (node->hash == h && strncmp(node->key, name, GLOBALNAME_LENGTH) == 0) {
 			return node;
@@ -216,19 +251,45 @@ hash_erase(struct hashmap * hash, char name[GLOBALNAME_LENGTH) {
 }
 */
 
+// 哈希桶数量翻倍，节点按保存的哈希值重新挂到新桶上
+static void
+hash_expand(struct hashmap * hash) {
+	int size = hash->size * 2;
+	struct keyvalue ** node = skynet_malloc(size * sizeof(struct keyvalue *));
+	memset(node, 0, size * sizeof(struct keyvalue *));
+	int i;
+	for (i=0;i<hash->size;i++) {
+		struct keyvalue * kv = hash->node[i];
+		while (kv) {
+			struct keyvalue * next = kv->next;
+			struct keyvalue ** pkv = &node[kv->hash & (size - 1)];
+			kv->next = *pkv;
+			*pkv = kv;
+			kv = next;
+		}
+	}
+	skynet_free(hash->node);
+	hash->node = node;
+	hash->size = size;
+}
+
 // 向哈希表中插入新的键值对
 static struct keyvalue *
 hash_insert(struct hashmap * hash, const char name[GLOBALNAME_LENGTH]) {
-	uint32_t *ptr = (uint32_t *)name;
-	uint32_t h = ptr[0] ^ ptr[1] ^ ptr[2] ^ ptr[3];  // 计算哈希值
-	struct keyvalue ** pkv = &hash->node[h % HASH_SIZE];  // 获取哈希桶位置
+	if (hash->count >= hash->size) {
+		hash_expand(hash);  // 负载因子到1时扩展
+	}
+	uint32_t h = hash_name(name);  // 计算哈希值
+	struct keyvalue ** pkv = &hash->node[h & (hash->size - 1)];  // 获取哈希桶位置
 	struct keyvalue * node = skynet_malloc(sizeof(*node));  // 分配新节点
 	memcpy(node->key, name, GLOBALNAME_LENGTH);  // 复制键名
 	node->next = *pkv;    // 链表头插法
 	node->queue = NULL;   // 初始化队列为空
 	node->hash = h;       // 保存哈希值
 	node->value = 0;      // 初始化值为0
+	node->query = 0;      // 还没有查询过
 	*pkv = node;          // 更新哈希桶头指针
+	++hash->count;
 
 	return node;
 }
@@ -237,7 +298,10 @@ hash_insert(struct hashmap * hash, const char name[GLOBALNAME_LENGTH]) {
 static struct hashmap *
 hash_new() {
 	struct hashmap * h = skynet_malloc(sizeof(struct hashmap));
-	memset(h,0,sizeof(*h));  // 清零所有哈希桶
+	h->size = HASH_SIZE;
+	h->count = 0;
+	h->node = skynet_malloc(HASH_SIZE * sizeof(struct keyvalue *));
+	memset(h->node,0,HASH_SIZE * sizeof(struct keyvalue *));  // 清零所有哈希桶
 	return h;
 }
 
@@ -245,7 +309,7 @@ hash_new() {
 static void
 hash_delete(struct hashmap *hash) {
 	int i;
-	for (i=0;i<HASH_SIZE;i++) {
+	for (i=0;i<hash->size;i++) {
 		// 遍历每个哈希桶
 		struct keyvalue * node = hash->node[i];
 		while (node) {
@@ -255,6 +319,7 @@ hash_delete(struct hashmap *hash) {
 			node = next;
 		}
 	}
+	skynet_free(hash->node);  // 释放哈希桶数组
 	skynet_free(hash);  // 释放哈希表结构
 }
 
@@ -274,6 +339,10 @@ close_harbor(struct harbor *h, int id) {
 		release_queue(s->queue);  // 释放消息队列
 		s->queue = NULL;
 	}
+	skynet_free(s->send_buffer);  // 丢弃没有发出的数据
+	s->send_buffer = NULL;
+	s->send_sz = 0;
+	s->send_cap = 0;
 }
 
 // 报告harbor节点下线
@@ -378,28 +447,99 @@ forward_local_messsage(struct harbor *h, void *msg, int sz) {
 	}
 }
 
+// 把节点积攒的出站数据整块交给socket，缓冲区的所有权一起交出
+static void
+flush_remote(struct harbor *h, int id) {
+	struct slave *s = &h->s[id];
+	if (s->send_sz == 0 || s->fd == 0)
+		return;
+	struct socket_sendbuffer tmp;
+	tmp.id = s->fd;                       // socket文件描述符
+	tmp.type = SOCKET_BUFFER_MEMORY;      // 由socket释放
+	tmp.buffer = s->send_buffer;          // 发送缓冲区
+	tmp.sz = s->send_sz;                  // 总大小
+	s->send_buffer = NULL;
+	s->send_sz = 0;
+	s->send_cap = 0;
+
+	// ignore send error, because if the connection is broken, the mainloop will recv a message.
+	// 忽略发送错误，因为如果连接断开，主循环会收到消息
+	skynet_socket_sendbuffer(h->ctx, &tmp);
+}
+
+// 发出本批次所有节点积攒的数据
+static void
+flush_pending(struct harbor *h) {
+	int i;
+	for (i=0;i<h->npending;i++) {
+		int id = h->pending[i];
+		h->s[id].pending = false;
+		flush_remote(h, id);
+	}
+	h->npending = 0;
+}
+
+// 压缩出站缓冲区中 offset 处刚写入的 sz 字节的消息，返回消息现在的长度（不含4字节长度前缀）
+// 压缩后没有变小就保持原样
+static size_t
+compress_remote(struct slave *s, size_t offset, size_t sz) {
+	size_t need = offset + 4 + sz + 4 + lz_bound(sz);
+	if (need > s->send_cap) {
+		size_t cap = s->send_cap * 2;
+		while (cap < need)
+			cap *= 2;
+		s->send_buffer = skynet_realloc(s->send_buffer, cap);
+		s->send_cap = cap;
+	}
+	uint8_t * sendbuf = (uint8_t *)s->send_buffer + offset;
+	// 压缩结果先放在原消息之后，变小了再移到原来的位置
+	uint8_t * dest = sendbuf + 4 + sz;
+	size_t cap = sz - 4;
+	if (cap > 0xffffff - 4)
+		cap = 0xffffff - 4;   // 长度只有3个字节
+	size_t csz = lz_compress(sendbuf + 4, sz, dest + 4, cap);
+	if (csz == 0)
+		return sz;
+	to_bigendian(dest, (uint32_t)sz);   // 原始长度
+	memmove(sendbuf + 4, dest, csz + 4);
+	to_bigendian(sendbuf, (uint32_t)(csz + 4));
+	sendbuf[0] = 1;   // 压缩标记
+	return csz + 4;
+}
+
 // 发送远程消息
+// 消息追加到节点的出站缓冲区，同一批次发往同一节点的消息合并成一次socket发送
 static void
-send_remote(struct skynet_context * ctx, int fd, const char * buffer, size_t sz, struct remote_message_header * cookie) {
+send_remote(struct harbor *h, int id, const char * buffer, size_t sz, struct remote_message_header * cookie) {
 	size_t sz_header = sz+sizeof(*cookie);  // 计算总大小（消息+头）
 	if (sz_header > UINT32_MAX) {
-		skynet_error(ctx, "remote message from :%08x to :%08x is too large.", cookie->source, cookie->destination);
+		skynet_error(h->ctx, "remote message from :%08x to :%08x is too large.", cookie->source, cookie->destination);
 		return;
 	}
-	uint8_t sendbuf[sz_header+4];  // 分配发送缓冲区（包含4字节长度前缀）
+	struct slave *s = &h->s[id];
+	size_t need = s->send_sz + sz_header + 4;  // 包含4字节长度前缀
+	if (need > s->send_cap) {
+		size_t cap = s->send_cap ? s->send_cap * 2 : SEND_BUFFER_SIZE;
+		while (cap < need)
+			cap *= 2;
+		s->send_buffer = skynet_realloc(s->send_buffer, cap);
+		s->send_cap = cap;
+	}
+	uint8_t * sendbuf = (uint8_t *)s->send_buffer + s->send_sz;
 	to_bigendian(sendbuf, (uint32_t)sz_header);  // 写入消息长度（大端序）
 	memcpy(sendbuf+4, buffer, sz);               // 复制消息内容
 	header_to_message(cookie, sendbuf+4+sz);     // 写入消息头到末尾
+	if (h->compress && sz_header >= h->compress) {
+		sz_header = compress_remote(s, s->send_sz, sz_header);
+	}
+	s->send_sz += 4 + sz_header;
 
-	struct socket_sendbuffer tmp;
-	tmp.id = fd;                          // socket文件描述符
-	tmp.type = SOCKET_BUFFER_RAWPOINTER;  // 原始指针类型
-	tmp.buffer = sendbuf;                 // 发送缓冲区
-	tmp.sz = sz_header+4;                 // 总大小
-
-	// ignore send error, because if the connection is broken, the mainloop will recv a message.
-	// 忽略发送错误，因为如果连接断开，主循环会收到消息
-	skynet_socket_sendbuffer(ctx, &tmp);
+	if (!h->batching || s->send_sz >= SEND_FLUSH_SIZE) {
+		flush_remote(h, id);
+	} else if (!s->pending) {
+		s->pending = true;
+		h->pending[h->npending++] = id;
+	}
 }
 
 // 分发名称队列中的消息
@@ -410,8 +550,7 @@ dispatch_name_queue(struct harbor *h, struct keyvalue * node) {
 	int harbor_id = handle >> HANDLE_REMOTE_SHIFT;  // 提取harbor ID
 	struct skynet_context * context = h->ctx;
 	struct slave *s = &h->s[harbor_id];
-	int fd = s->fd;
-	if (fd == 0) {
+	if (s->fd == 0) {
 		// 连接不存在
 		if (s->status == STATUS_DOWN) {
 			// harbor节点已下线，丢弃消息
@@ -449,7 +588,7 @@ dispatch_name_queue(struct harbor *h, struct keyvalue * node) {
 	struct harbor_msg * m;
 	while ((m = pop_queue(queue)) != NULL) {
 		m->header.destination |= (handle & HANDLE_MASK);  // 设置完整的目标地址
-		send_remote(context, fd, m->buffer, m->size, &m->header);  // 发送远程消息
+		send_remote(h, harbor_id, m->buffer, m->size, &m->header);  // 发送远程消息
 		skynet_free(m->buffer);  // 释放消息缓冲区
 	}
 }
@@ -458,8 +597,7 @@ dispatch_name_queue(struct harbor *h, struct keyvalue * node) {
 static void
 dispatch_queue(struct harbor *h, int id) {
 	struct slave *s = &h->s[id];
-	int fd = s->fd;
-	assert(fd != 0);  // 确保连接存在
+	assert(s->fd != 0);  // 确保连接存在
 
 	struct harbor_msg_queue *queue = s->queue;
 	if (queue == NULL)
@@ -468,13 +606,30 @@ dispatch_queue(struct harbor *h, int id) {
 	// 发送队列中的所有消息
 	struct harbor_msg * m;
 	while ((m = pop_queue(queue)) != NULL) {
-		send_remote(h->ctx, fd, m->buffer, m->size, &m->header);  // 发送远程消息
+		send_remote(h, id, m->buffer, m->size, &m->header);  // 发送远程消息
 		skynet_free(m->buffer);  // 释放消息缓冲区
 	}
 	release_queue(queue);  // 释放队列
 	s->queue = NULL;
 }
 
+// 解压一个压缩的消息，返回新分配的缓冲区，数据非法时返回 NULL
+static char *
+decompress_remote(const uint8_t * buffer, int length, int *sz) {
+	if (length < 4)
+		return NULL;
+	uint32_t orig = buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+	if (orig < HEADER_COOKIE_LENGTH || orig > INT32_MAX)
+		return NULL;
+	char * msg = skynet_malloc(orig);
+	if (lz_decompress(buffer + 4, length - 4, msg, orig) != (long)orig) {
+		skynet_free(msg);
+		return NULL;
+	}
+	*sz = (int)orig;
+	return msg;
+}
+
 // 处理socket接收到的数据
 static void
 push_socket_data(struct harbor *h, const struct skynet_socket_message * message) {
@@ -523,6 +678,37 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 			// 继续处理
 		}
 		case STATUS_HEADER: {
+			// 一次读到的多个完整消息直接在读缓冲区里解析，只为每个消息复制一次内容
+			while (s->read == 0 && size >= 4) {
+				if (buffer[0] > 1) {
+					skynet_error(h->ctx, "Message is too long from harbor %d", id);
+					close_harbor(h,id);
+					return;
+				}
+				int length = buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+				if (size - 4 < length)
+					break;
+				// 消息转发后由接收者释放，必须单独分配
+				char * msg;
+				int sz = length;
+				if (buffer[0] == 0) {
+					msg = skynet_malloc(length);
+					memcpy(msg, buffer + 4, length);
+				} else {
+					msg = decompress_remote(buffer + 4, length, &sz);
+					if (msg == NULL) {
+						skynet_error(h->ctx, "Invalid compressed message from harbor %d", id);
+						close_harbor(h,id);
+						return;
+					}
+				}
+				forward_local_messsage(h, msg, sz);
+				buffer += 4 + length;
+				size -= 4 + length;
+			}
+			if (size == 0)
+				return;
+			// 剩下不完整的消息，按原来的方式缓存
 			// big endian 4 bytes length, the first one must be 0.
 			// 大端序4字节长度，第一个字节必须是0
 			int need = 4 - s->read;  // 还需要读取的字节数
@@ -537,7 +723,7 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 				buffer += need;
 				size -= need;
 
-				if (s->size[0] != 0) {
+				if (s->size[0] > 1) {
 					// 消息长度超出限制
 					skynet_error(h->ctx, "Message is too long from harbor %d", id);
 					close_harbor(h,id);
@@ -564,7 +750,21 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 			}
 			// 数据足够，读取完整消息
 			memcpy(s->recv_buffer + s->read, buffer, need);
-			forward_local_messsage(h, s->recv_buffer, s->length);  // 转发本地消息
+			if (s->size[0] == 0) {
+				forward_local_messsage(h, s->recv_buffer, s->length);  // 转发本地消息
+			} else {
+				// 压缩的消息
+				int sz;
+				char * msg = decompress_remote((const uint8_t *)s->recv_buffer, s->length, &sz);
+				skynet_free(s->recv_buffer);
+				s->recv_buffer = NULL;
+				if (msg == NULL) {
+					skynet_error(h->ctx, "Invalid compressed message from harbor %d", id);
+					close_harbor(h,id);
+					return;
+				}
+				forward_local_messsage(h, msg, sz);
+			}
 			s->length = 0;
 			s->read = 0;
 			s->recv_buffer = NULL;
@@ -636,7 +836,7 @@ remote_send_handle(struct harbor *h, uint32_t source, uint32_t destination, int
 		cookie.source = source;
 		cookie.destination = (destination & HANDLE_MASK) | ((uint32_t)type << HANDLE_REMOTE_SHIFT);
 		cookie.session = (uint32_t)session;
-		send_remote(context, s->fd, msg,sz,&cookie);
+		send_remote(h, harbor_id, msg,sz,&cookie);
 	}
 
 	return 0;
@@ -659,11 +859,15 @@ remote_send_name(struct harbor *h, uint32_t source, const char name[GLOBALNAME_L
 		header.destination = type << HANDLE_REMOTE_SHIFT;
 		header.session = (uint32_t)session;
 		push_queue(node->queue, (void *)msg, sz, &header);
-		// 向slave服务查询名称
-		char query[2+GLOBALNAME_LENGTH+1] = "Q ";
-		query[2+GLOBALNAME_LENGTH] = 0;
-		memcpy(query+2, name, GLOBALNAME_LENGTH);
-		skynet_send(h->ctx, 0, h->slave, PTYPE_TEXT, 0, query, strlen(query));
+		// 向slave服务查询名称，同一个名字在NAME_QUERY_TTL内只查询一次
+		uint64_t now = skynet_now();
+		if (now >= node->query) {
+			node->query = now + NAME_QUERY_TTL;
+			char query[2+GLOBALNAME_LENGTH+1] = "Q ";
+			query[2+GLOBALNAME_LENGTH] = 0;
+			memcpy(query+2, name, GLOBALNAME_LENGTH);
+			skynet_send(h->ctx, 0, h->slave, PTYPE_TEXT, 0, query, strlen(query));
+		}
 		return 1;
 	} else {
 		// 名称已解析，直接按句柄发送
@@ -831,6 +1035,21 @@ mainloop(struct skynet_context * context, void * ud, int type, int session, uint
 	}
 }
 
+// harbor服务的批量消息处理函数，mainloop总是自行处理消息内存
+// 批次中发往同一节点的消息合并在一起，批次结束时每个节点一次发出
+void
+harbor_batch(struct harbor *h, struct skynet_context * ctx, struct skynet_message * msg, int n) {
+	int i;
+	h->batching = true;
+	for (i=0;i<n;i++) {
+		int type = (int)(msg[i].sz >> MESSAGE_TYPE_SHIFT);
+		size_t sz = msg[i].sz & MESSAGE_TYPE_MASK;
+		mainloop(ctx, h, type, msg[i].session, msg[i].source, msg[i].data, sz);
+	}
+	h->batching = false;
+	flush_pending(h);
+}
+
 // harbor服务的初始化函数
 int
 harbor_init(struct harbor *h, struct skynet_context *ctx, const char * args) {
@@ -844,6 +1063,10 @@ harbor_init(struct harbor *h, struct skynet_context *ctx, const char * args) {
 	}
 	h->id = harbor_id;    // 设置harbor节点ID
 	h->slave = slave;     // 设置slave服务句柄
+	const char * compress = skynet_command(ctx, "GETENV", "harbor_compress");
+	if (compress) {
+		h->compress = (uint32_t)strtoul(compress, NULL, 10);  // 压缩阈值
+	}
 	if (harbor_id == 0) {
 		// 如果是主harbor节点，关闭所有远程连接
 		close_all_remotes(h);
@@ -1,10 +1,40 @@
 #include "skynet.h"
+#include "atomic.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+/*
+	配置 logger_buffer = 4 (MB) 时为异步模式：
+	logger 服务把日志格式化后写入环形缓冲区 (单生产者单消费者，无锁) ，
+	由专门的写线程成批写文件。缓冲区满时丢弃日志并计数，由写线程补写一行说明。
+	logger_flush 是最长的刷新间隔 (毫秒，默认 100) ，积累 FLUSH_SIZE 字节时立即刷新。
+	日志轮转 (SIGHUP) 时也由写线程重新打开文件。
+ */
+
+#define FLUSH_SIZE (64 * 1024)    // 积累到这么多字节时唤醒写线程
+#define DEFAULT_FLUSH_MS 100
+
+// 异步模式的环形缓冲区和写线程
+struct logger_async {
+	char * buffer;
+	size_t cap;                 // 2 的幂
+	ATOM_SIZET head;            // 已写入的字节总数，只由 logger 服务修改
+	ATOM_SIZET tail;            // 已落盘的字节总数，只由写线程修改
+	ATOM_SIZET dropped;         // 丢弃的日志条数
+	ATOM_INT sleeping;          // 写线程正在等待
+	ATOM_INT reopen;            // 需要重新打开文件
+	ATOM_INT quit;
+	int flush_ms;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
 
 // 日志服务结构，用于管理日志文件的写入
 struct logger {
@@ -12,6 +42,9 @@ struct logger {
 	char * filename;    // 日志文件名
 	uint32_t starttime; // 服务启动时间
 	int close;          // 是否需要关闭文件句柄的标志
+	time_t cachesec;    // timestr 对应的秒
+	char timestr[64];   // 缓存的时间字符串，同一秒内不再格式化
+	struct logger_async * async;
 };
 
 // 创建日志服务实例
@@ -21,31 +54,591 @@ logger_create(void) {
 	inst->handle = NULL;    // 初始化文件句柄为空
 	inst->close = 0;        // 初始化关闭标志为0
 	inst->filename = NULL;  // 初始化文件名为空
+	inst->cachesec = -1;
+	inst->async = NULL;
 
 	return inst;
 }
 
+// 进程直接退出 (比如 bootstrap 失败) 时也要写完缓冲区
+static struct logger * G_ASYNC = NULL;
+
+static void async_stop(struct logger *inst);
+
+static void
+async_atexit(void) {
+	struct logger * inst = G_ASYNC;
+	if (inst) {
+		async_stop(inst);
+	}
+}
+
 // 释放日志服务实例及其资源
 void
 logger_release(struct logger * inst) {
-	if (inst->close) {
+	if (inst->async) {
+		async_stop(inst);
+	}
+	if (inst->close && inst->handle) {
 		fclose(inst->handle);  // 如果需要关闭文件，则关闭文件句柄
 	}
 	skynet_free(inst->filename);  // 释放文件名内存
 	skynet_free(inst);            // 释放日志实例内存
 }
 
-#define SIZETIMEFMT	250  // 时间格式字符串的最大长度
-
-// 生成时间字符串，返回毫秒部分
+// 生成时间戳前缀 "日/月/年 时:分:秒.厘秒 " ，返回长度
 static int
-timestring(struct logger *inst, char tmp[SIZETIMEFMT]) {
+timestring(struct logger *inst, char *tmp, size_t sz) {
 	uint64_t now = skynet_now();                    // 获取当前时间（厘秒）
 	time_t ti = now/100 + inst->starttime;          // 转换为秒并加上启动时间
-	struct tm info;
-	(void)localtime_r(&ti,&info);                   // 转换为本地时间结构
-	strftime(tmp, SIZETIMEFMT, "%d/%m/%y %H:%M:%S", &info);  // 格式化时间字符串
-	return now % 100;                               // 返回毫秒部分（0-99）
+	if (ti != inst->cachesec) {
+		struct tm info;
+		(void)localtime_r(&ti,&info);               // 转换为本地时间结构
+		strftime(inst->timestr, sizeof(inst->timestr), "%d/%m/%y %H:%M:%S", &info);  // 格式化时间字符串
+		inst->cachesec = ti;
+	}
+	return snprintf(tmp, sz, "%s.%02d ", inst->timestr, (int)(now % 100));
+}
+
+// 写线程把 [tail, head) 写入文件
+static void
+async_write(struct logger *inst, size_t head, size_t tail) {
+	struct logger_async * a = inst->async;
+	while (tail != head) {
+		size_t offset = tail & (a->cap - 1);
+		size_t n = head - tail;
+		if (n > a->cap - offset) {
+			n = a->cap - offset;
+		}
+		if (inst->handle) {
+			fwrite(a->buffer + offset, n, 1, inst->handle);
+		}
+		tail += n;
+		ATOM_STORE(&a->tail, tail);
+	}
+}
+
+static void *
+async_thread(void *ud) {
+	struct logger * inst = ud;
+	struct logger_async * a = inst->async;
+	size_t reported = 0;
+	for (;;) {
+		int quit = ATOM_LOAD(&a->quit);
+		size_t head = ATOM_LOAD(&a->head);
+		size_t tail = ATOM_LOAD(&a->tail);
+		if (head != tail) {
+			async_write(inst, head, tail);
+		}
+		size_t dropped = ATOM_LOAD(&a->dropped);
+		if (inst->handle) {
+			if (dropped != reported) {
+				fprintf(inst->handle, "[logger] %zu messages dropped, the buffer is full\n", dropped - reported);
+				reported = dropped;
+			}
+			if (head != tail || quit) {
+				fflush(inst->handle);
+			}
+		}
+		if (ATOM_LOAD(&a->reopen)) {
+			ATOM_STORE(&a->reopen, 0);
+			// 失败时 handle 为 NULL ，之后的日志都被丢弃，直到下次成功打开
+			if (inst->handle) {
+				inst->handle = freopen(inst->filename, "a", inst->handle);
+			} else {
+				inst->handle = fopen(inst->filename, "a");
+			}
+		}
+		if (quit) {
+			if (ATOM_LOAD(&a->head) == ATOM_LOAD(&a->tail)) {
+				break;
+			}
+			continue;
+		}
+		if (ATOM_LOAD(&a->head) - ATOM_LOAD(&a->tail) >= FLUSH_SIZE) {
+			continue;
+		}
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += (long)(a->flush_ms % 1000) * 1000000;
+		ts.tv_sec += a->flush_ms / 1000 + ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		pthread_mutex_lock(&a->lock);
+		ATOM_STORE(&a->sleeping, 1);
+		if (!ATOM_LOAD(&a->quit) && !ATOM_LOAD(&a->reopen)) {
+			pthread_cond_timedwait(&a->cond, &a->lock, &ts);
+		}
+		ATOM_STORE(&a->sleeping, 0);
+		pthread_mutex_unlock(&a->lock);
+	}
+	return NULL;
+}
+
+static void
+async_wakeup(struct logger_async *a) {
+	pthread_mutex_lock(&a->lock);
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+}
+
+static void
+async_stop(struct logger *inst) {
+	struct logger_async * a = inst->async;
+	G_ASYNC = NULL;
+	ATOM_STORE(&a->quit, 1);
+	async_wakeup(a);
+	pthread_join(a->thread, NULL);
+	pthread_mutex_destroy(&a->lock);
+	pthread_cond_destroy(&a->cond);
+	skynet_free(a->buffer);
+	skynet_free(a);
+	inst->async = NULL;
+}
+
+static int
+async_start(struct logger *inst, size_t cap, int flush_ms) {
+	struct logger_async * a = skynet_malloc(sizeof(*a));
+	size_t sz = 4096;
+	while (sz < cap) {
+		sz *= 2;
+	}
+	a->buffer = skynet_malloc(sz);
+	a->cap = sz;
+	ATOM_INIT(&a->head, 0);
+	ATOM_INIT(&a->tail, 0);
+	ATOM_INIT(&a->dropped, 0);
+	ATOM_INIT(&a->sleeping, 0);
+	ATOM_INIT(&a->reopen, 0);
+	ATOM_INIT(&a->quit, 0);
+	a->flush_ms = flush_ms > 0 ? flush_ms : DEFAULT_FLUSH_MS;
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	inst->async = a;
+	if (pthread_create(&a->thread, NULL, async_thread, inst) != 0) {
+		pthread_mutex_destroy(&a->lock);
+		pthread_cond_destroy(&a->cond);
+		skynet_free(a->buffer);
+		skynet_free(a);
+		inst->async = NULL;
+		return 1;
+	}
+	if (G_ASYNC == NULL) {
+		static int registered = 0;
+		if (!registered) {
+			registered = 1;
+			atexit(async_atexit);
+		}
+		G_ASYNC = inst;
+	}
+	return 0;
+}
+
+static void
+ring_copy(struct logger_async *a, size_t pos, const void *data, size_t sz) {
+	size_t offset = pos & (a->cap - 1);
+	size_t n = a->cap - offset;
+	if (n >= sz) {
+		memcpy(a->buffer + offset, data, sz);
+	} else {
+		memcpy(a->buffer + offset, data, n);
+		memcpy(a->buffer, (const char *)data + n, sz - n);
+	}
+}
+
+// 异步模式下写入一条日志，缓冲区不够时丢弃
+static void
+async_log(struct logger *inst, uint32_t source, const void * msg, size_t sz) {
+	struct logger_async * a = inst->async;
+	char prefix[128];
+	int n = 0;
+	if (inst->filename) {
+		n = timestring(inst, prefix, sizeof(prefix));
+	}
+	n += snprintf(prefix + n, sizeof(prefix) - n, "[:%08x] ", source);
+	size_t head = ATOM_LOAD(&a->head);
+	size_t pending = head - ATOM_LOAD(&a->tail);
+	size_t total = n + sz + 1;
+	if (total > a->cap - pending) {
+		ATOM_FINC(&a->dropped);
+		if (ATOM_LOAD(&a->sleeping)) {
+			async_wakeup(a);
+		}
+		return;
+	}
+	ring_copy(a, head, prefix, n);
+	ring_copy(a, head + n, msg, sz);
+	ring_copy(a, head + n + sz, "\n", 1);
+	ATOM_STORE(&a->head, head + total);
+	if (pending < FLUSH_SIZE && pending + total >= FLUSH_SIZE && ATOM_LOAD(&a->sleeping)) {
+		async_wakeup(a);
+	}
+}
+
+// 写一行日志
+static void
+log_line(struct logger *inst, uint32_t source, const void * msg, size_t sz) {
+	if (inst->async) {
+		async_log(inst, source, msg, sz);
+		return;
+	}
+	// 处理文本消息：写入日志内容
+	if (inst->filename) {
+		// 如果有文件名，添加时间戳（精确到厘秒）
+		char tmp[128];
+		timestring(inst, tmp, sizeof(tmp));
+		fputs(tmp, inst->handle);
+	}
+	fprintf(inst->handle, "[:%08x] ", source);  // 写入消息源服务的句柄
+	fwrite(msg, sz , 1, inst->handle);          // 写入日志消息内容
+	fprintf(inst->handle, "\n");               // 添加换行符
+	fflush(inst->handle);                      // 立即刷新缓冲区，确保日志及时写入
+}
+
+/*
+	PTYPE_LOG : lualib/skynet/log.lua 用 lua-seri 打包的 level, fmt, ...
+	参数只有 nil, boolean, number, string ，在这里按 fmt 格式化。
+	类型编码见 lualib-src/lua-seri.c
+ */
+
+#define SERI_NIL 0
+#define SERI_BOOLEAN 1
+#define SERI_NUMBER 2
+#define SERI_SHORT_STRING 4
+#define SERI_LONG_STRING 5
+
+#define SERI_NUMBER_ZERO 0
+#define SERI_NUMBER_BYTE 1
+#define SERI_NUMBER_WORD 2
+#define SERI_NUMBER_DWORD 4
+#define SERI_NUMBER_QWORD 6
+#define SERI_NUMBER_REAL 8
+
+#define MAX_LOGARG 64
+
+struct logarg {
+	int type;	// SERI_NIL, SERI_BOOLEAN, SERI_NUMBER, SERI_SHORT_STRING (所有的字符串)
+	int real;
+	int64_t i;
+	double d;
+	const char * s;
+	size_t len;
+};
+
+struct logbuf {
+	char * ptr;
+	size_t sz;
+	size_t cap;
+	char init[1024];
+};
+
+static void
+logbuf_reserve(struct logbuf *b, size_t sz) {
+	if (b->sz + sz <= b->cap)
+		return;
+	size_t cap = b->cap * 2;
+	while (cap < b->sz + sz) {
+		cap *= 2;
+	}
+	char * ptr = skynet_malloc(cap);
+	memcpy(ptr, b->ptr, b->sz);
+	if (b->ptr != b->init) {
+		skynet_free(b->ptr);
+	}
+	b->ptr = ptr;
+	b->cap = cap;
+}
+
+static void
+logbuf_add(struct logbuf *b, const char *s, size_t sz) {
+	logbuf_reserve(b, sz);
+	memcpy(b->ptr + b->sz, s, sz);
+	b->sz += sz;
+}
+
+static void
+logbuf_printf(struct logbuf *b, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(b->ptr + b->sz, b->cap - b->sz, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if ((size_t)n >= b->cap - b->sz) {
+		logbuf_reserve(b, n + 1);
+		va_start(ap, fmt);
+		vsnprintf(b->ptr + b->sz, b->cap - b->sz, fmt, ap);
+		va_end(ap);
+	}
+	b->sz += n;
+}
+
+static int
+read_arg(const uint8_t **ptr, const uint8_t *end, struct logarg *a) {
+	const uint8_t * p = *ptr;
+	if (p >= end)
+		return -1;
+	int type = *p & 7;
+	int cookie = *p >> 3;
+	++p;
+	a->type = type;
+	switch (type) {
+	case SERI_NIL:
+		break;
+	case SERI_BOOLEAN:
+		a->i = cookie;
+		break;
+	case SERI_NUMBER: {
+		static const int size[] = {
+			[SERI_NUMBER_ZERO] = 0, [SERI_NUMBER_BYTE] = 1, [SERI_NUMBER_WORD] = 2,
+			[SERI_NUMBER_DWORD] = 4, [SERI_NUMBER_QWORD] = 8, [SERI_NUMBER_REAL] = 8,
+		};
+		if (cookie > SERI_NUMBER_REAL || (cookie != SERI_NUMBER_ZERO && size[cookie] == 0))
+			return -1;
+		if (end - p < size[cookie])
+			return -1;
+		a->real = 0;
+		switch (cookie) {
+		case SERI_NUMBER_ZERO:
+			a->i = 0;
+			break;
+		case SERI_NUMBER_BYTE:
+			a->i = *p;
+			break;
+		case SERI_NUMBER_WORD: {
+			uint16_t v;
+			memcpy(&v, p, 2);
+			a->i = v;
+			break;
+		}
+		case SERI_NUMBER_DWORD: {
+			int32_t v;
+			memcpy(&v, p, 4);
+			a->i = v;
+			break;
+		}
+		case SERI_NUMBER_QWORD:
+			memcpy(&a->i, p, 8);
+			break;
+		case SERI_NUMBER_REAL:
+			memcpy(&a->d, p, 8);
+			a->real = 1;
+			break;
+		}
+		p += size[cookie];
+		break;
+	}
+	case SERI_SHORT_STRING:
+	case SERI_LONG_STRING: {
+		size_t len = cookie;
+		if (type == SERI_LONG_STRING) {
+			if (cookie == 2) {
+				uint16_t v;
+				if (end - p < 2)
+					return -1;
+				memcpy(&v, p, 2);
+				len = v;
+				p += 2;
+			} else if (cookie == 4) {
+				uint32_t v;
+				if (end - p < 4)
+					return -1;
+				memcpy(&v, p, 4);
+				len = v;
+				p += 4;
+			} else {
+				return -1;
+			}
+		}
+		if ((size_t)(end - p) < len)
+			return -1;
+		a->type = SERI_SHORT_STRING;
+		a->s = (const char *)p;
+		a->len = len;
+		p += len;
+		break;
+	}
+	default:
+		// table 等在 log.lua 里已经 tostring
+		return -1;
+	}
+	*ptr = p;
+	return 0;
+}
+
+// 同 lua 的 tostring
+static void
+add_value(struct logbuf *b, const struct logarg *a) {
+	switch (a->type) {
+	case SERI_NIL:
+		logbuf_add(b, "nil", 3);
+		break;
+	case SERI_BOOLEAN:
+		if (a->i) {
+			logbuf_add(b, "true", 4);
+		} else {
+			logbuf_add(b, "false", 5);
+		}
+		break;
+	case SERI_NUMBER:
+		if (a->real) {
+			size_t sz = b->sz;
+			logbuf_printf(b, "%.14g", a->d);
+			// 看起来像整数时加上 .0
+			if (strspn(b->ptr + sz, "-0123456789") == b->sz - sz) {
+				logbuf_add(b, ".0", 2);
+			}
+		} else {
+			logbuf_printf(b, "%lld", (long long)a->i);
+		}
+		break;
+	default:
+		logbuf_add(b, a->s, a->len);
+		break;
+	}
+}
+
+static void
+add_format(struct logbuf *b, const char *fmt, size_t sz, struct logarg *args, int n) {
+	const char * end = fmt + sz;
+	int arg = 0;
+	while (fmt < end) {
+		const char * pct = memchr(fmt, '%', end - fmt);
+		if (pct == NULL) {
+			logbuf_add(b, fmt, end - fmt);
+			break;
+		}
+		logbuf_add(b, fmt, pct - fmt);
+		// %[flags][width][.precision]conv
+		const char * p = pct + 1;
+		while (p < end && *p && strchr("-+ #0", *p)) ++p;
+		while (p < end && *p >= '0' && *p <= '9') ++p;
+		if (p < end && *p == '.') {
+			++p;
+			while (p < end && *p >= '0' && *p <= '9') ++p;
+		}
+		if (p >= end || p - pct > 16) {
+			logbuf_add(b, pct, end - pct);
+			break;
+		}
+		char conv = *p;
+		fmt = p + 1;
+		if (conv == '%') {
+			logbuf_add(b, "%", 1);
+			continue;
+		}
+		if (strchr("sqdiuxXocfFeEgGaA", conv) == NULL) {
+			logbuf_add(b, pct, fmt - pct);
+			continue;
+		}
+		if (arg >= n) {
+			logbuf_add(b, "nil", 3);
+			continue;
+		}
+		struct logarg * a = &args[arg++];
+		char spec[24];
+		int specsz = (int)(p - pct);
+		memcpy(spec, pct, specsz);
+		if (conv == 's' || conv == 'q') {
+			if (specsz == 1) {
+				// 没有宽度和精度，直接复制，字符串中可以有 \0
+				add_value(b, a);
+				continue;
+			}
+			struct logbuf tmp;
+			tmp.ptr = tmp.init;
+			tmp.sz = 0;
+			tmp.cap = sizeof(tmp.init);
+			add_value(&tmp, a);
+			logbuf_add(&tmp, "", 1);
+			spec[specsz] = 's';
+			spec[specsz+1] = 0;
+			logbuf_printf(b, spec, tmp.ptr);
+			if (tmp.ptr != tmp.init) {
+				skynet_free(tmp.ptr);
+			}
+			continue;
+		}
+		if (a->type != SERI_NUMBER) {
+			add_value(b, a);
+			continue;
+		}
+		if (strchr("diuxXoc", conv)) {
+			long long v;
+			if (a->real) {
+				if (a->d != (double)(long long)a->d) {
+					// 没有整数表示
+					add_value(b, a);
+					continue;
+				}
+				v = (long long)a->d;
+			} else {
+				v = a->i;
+			}
+			if (conv == 'c') {
+				spec[specsz] = 'c';
+				spec[specsz+1] = 0;
+				logbuf_printf(b, spec, (int)v);
+			} else {
+				spec[specsz] = 'l';
+				spec[specsz+1] = 'l';
+				spec[specsz+2] = conv == 'u' ? 'd' : conv;
+				spec[specsz+3] = 0;
+				logbuf_printf(b, spec, v);
+			}
+		} else {
+			spec[specsz] = conv;
+			spec[specsz+1] = 0;
+			logbuf_printf(b, spec, a->real ? a->d : (double)a->i);
+		}
+	}
+	// 多余的参数用空格分隔
+	for (;arg<n;arg++) {
+		logbuf_add(b, " ", 1);
+		add_value(b, &args[arg]);
+	}
+}
+
+static void
+log_structured(struct logger *inst, uint32_t source, const void * msg, size_t sz) {
+	static const char * level_name[] = { "?", "DEBUG", "INFO", "WARN", "ERROR" };
+	const uint8_t * p = msg;
+	const uint8_t * end = p + sz;
+	struct logarg level;
+	struct logarg args[MAX_LOGARG];
+	int n = 0;
+	struct logbuf b;
+	b.ptr = b.init;
+	b.sz = 0;
+	b.cap = sizeof(b.init);
+	if (read_arg(&p, end, &level) != 0 || level.type != SERI_NUMBER || level.real) {
+		logbuf_printf(&b, "[logger] invalid structured log of %zu bytes", sz);
+	} else {
+		while (p < end && n < MAX_LOGARG) {
+			if (read_arg(&p, end, &args[n]) != 0)
+				break;
+			++n;
+		}
+		int lv = (level.i >= 1 && level.i <= 4) ? (int)level.i : 0;
+		logbuf_printf(&b, "[%s] ", level_name[lv]);
+		if (n > 0 && args[0].type == SERI_SHORT_STRING) {
+			add_format(&b, args[0].s, args[0].len, args + 1, n - 1);
+		} else {
+			int i;
+			for (i=0;i<n;i++) {
+				if (i > 0) {
+					logbuf_add(&b, " ", 1);
+				}
+				add_value(&b, &args[i]);
+			}
+		}
+		if (p < end) {
+			logbuf_add(&b, " ...", 4);
+		}
+	}
+	log_line(inst, source, b.ptr, b.sz);
+	if (b.ptr != b.init) {
+		skynet_free(b.ptr);
+	}
 }
 
 // 日志服务的消息回调函数，处理系统消息和文本日志消息
@@ -56,21 +649,20 @@ logger_cb(struct skynet_context * context, void *ud, int type, int session, uint
 	case PTYPE_SYSTEM:
 		// 处理系统消息：重新打开日志文件（用于日志轮转）
 		if (inst->filename) {
-			inst->handle = freopen(inst->filename, "a", inst->handle);  // 以追加模式重新打开文件
+			if (inst->async) {
+				// 由写线程重新打开，不阻塞 logger 服务
+				ATOM_STORE(&inst->async->reopen, 1);
+				async_wakeup(inst->async);
+			} else {
+				inst->handle = freopen(inst->filename, "a", inst->handle);  // 以追加模式重新打开文件
+			}
 		}
 		break;
 	case PTYPE_TEXT:
-		// 处理文本消息：写入日志内容
-		if (inst->filename) {
-			// 如果有文件名，添加时间戳
-			char tmp[SIZETIMEFMT];
-			int csec = timestring(ud, tmp);                           // 生成时间字符串
-			fprintf(inst->handle, "%s.%02d ", tmp, csec);             // 写入时间戳（精确到厘秒）
-		}
-		fprintf(inst->handle, "[:%08x] ", source);  // 写入消息源服务的句柄
-		fwrite(msg, sz , 1, inst->handle);          // 写入日志消息内容
-		fprintf(inst->handle, "\n");               // 添加换行符
-		fflush(inst->handle);                      // 立即刷新缓冲区，确保日志及时写入
+		log_line(inst, source, msg, sz);
+		break;
+	case PTYPE_LOG:
+		log_structured(inst, source, msg, sz);
 		break;
 	}
 
@@ -96,6 +688,17 @@ logger_init(struct logger * inst, struct skynet_context *ctx, const char * parm)
 		inst->handle = stdout;
 	}
 	if (inst->handle) {
+		const char * buffer = skynet_command(ctx, "GETENV", "logger_buffer");
+		if (buffer) {
+			size_t mb = strtoul(buffer, NULL, 10);
+			if (mb > 0) {
+				const char * flush = skynet_command(ctx, "GETENV", "logger_flush");
+				int flush_ms = flush ? (int)strtol(flush, NULL, 10) : 0;
+				if (async_start(inst, mb * 1024 * 1024, flush_ms)) {
+					return 1;
+				}
+			}
+		}
 		skynet_callback(ctx, inst, logger_cb);  // 注册消息回调函数
 		return 0;  // 初始化成功
 	}
@@ -1,5 +1,7 @@
 #include "skynet.h"
 #include "atomic.h"
+#include "malloc_hook.h"
+#include "spinlock.h"
 
 #include <lua.h>
 #include <lualib.h>
@@ -10,6 +12,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #if defined(__APPLE__)
 #include <mach/task.h>
@@ -23,6 +27,46 @@
 
 #define MEMORY_WARNING_REPORT (1024 * 1024 * 32)  // 内存警告阈值：32MB
 
+// 虚拟机的分配和回收统计，见 skynet.stat "gc"
+struct gc_stat {
+	uint64_t alloc;             // 累计分配的字节数（扩大的部分也算）
+	uint64_t rate;              // 最近一个统计窗口里每秒分配的字节数
+	uint64_t window_alloc;      // 窗口开始时的alloc
+	uint64_t window_start;      // 窗口开始的时间（微秒），0表示还没有开始
+	uint64_t begin;             // 当前这次回收开始的时间
+	int depth;                  // 回收的嵌套层数，终结器里可能再调用collectgarbage
+	int kind;                   // 最外层回收的类型 LUA_GCHOOKSTEP/LUA_GCHOOKFULL
+	uint64_t count[2];          // 回收步和完整回收的次数
+	uint64_t time[2];           // 累计耗时（微秒）
+	uint64_t max[2];            // 单次最长耗时（微秒）
+};
+
+/*
+ * 后台释放（lua_bgsweep）：回收步里清扫出的死对象，以及关闭虚拟机时释放的内存，攒成一批交给一个后台线程释放，
+ * 大堆的回收不再在服务所在的工作线程上调用free。清扫本身（遍历对象、翻转颜色）仍在服务线程：
+ * 增量回收和Lua代码交错执行（新建对象、复活将死的字符串、写屏障），对象链表不能同时交给别的线程。
+ * 交出去的内存立即从服务的内存统计中扣除；开启lua_pool时小块回到内存池，不经过这里。
+ */
+#define BGFREE_BATCH 1024
+#define BGFREE_BYTES (1024 * 1024)  // 攒够这么多字节也交出去，大块不在服务里压着
+
+struct bgfree_batch {
+	struct bgfree_batch *next;
+	ATOM_INT *inflight;         // 服务用独立的arena时，释放完减一；否则为NULL
+	int flags;                  // skynet_lalloc_free的参数
+	int n;
+	size_t bytes;
+	void *ptr[BGFREE_BATCH];
+};
+
+struct bgfree {
+	int enable;
+	int closing;                // 正在关闭虚拟机
+	struct bgfree_batch *batch; // 正在攒的一批
+	ATOM_INT inflight;          // 交给后台线程还没有释放完的批数（只在用独立的arena时计数）
+	uint64_t bytes;             // 累计交给后台线程的字节数
+};
+
 // snlua服务结构，封装Lua虚拟机和相关状态
 struct snlua {
 	lua_State * L;              // 主Lua虚拟机状态
@@ -32,8 +76,111 @@ struct snlua {
 	size_t mem_limit;           // 内存使用限制
 	lua_State * activeL;        // 当前活跃的Lua状态（可能是协程）
 	ATOM_INT trap;              // 原子陷阱标志，用于中断Lua执行
+	ATOM_INT dump;              // 输出调用栈的请求，和trap一样 0->1->-1 设置，钩子里 -1->0
+	int arena;                  // skynet_lalloc_open返回的arena标志，0表示默认分配
+	uint32_t handle;            // 服务句柄，用来按服务统计虚拟机的内存
+	struct sample_ring * sampler; // CPU采样记录，没有开启过采样时为NULL
+	int resuming;               // 嵌套在lua_resumeX里的层数，大于0时服务正在执行Lua代码
+	size_t mem_soft;            // 内存软限制，超过时通知服务回收，0表示没有
+	int soft_notified;          // 超过软限制后已经通知过，回落到软限制的7/8以下时清除
+	size_t mem_counted;         // 已经计入内存调控合计的内存
+	struct snlua *gov_prev;     // 内存调控的服务链表
+	struct snlua *gov_next;
+	struct lua_pool *pool;      // 小块内存池，没有开启lua_pool时为NULL
+	size_t mem_backend;         // 从skynet_lalloc取得的内存（开启lua_pool时内存池按页计）
+	struct gc_stat gc;          // 分配和回收的统计
+	int slice;                  // 时间片（微秒），一次lua_resume超过它时让出任务协程，0表示不限制
+	uint64_t slice_start;       // 最外层lua_resume开始的时间
+	int preempted;              // 任务协程被时间片钩子让出，由 skynet.vm.preempted 取走
+	struct bgfree bg;           // 后台释放，见lua_bgsweep
 };
 
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_once_t once;
+	struct bgfree_batch *list;
+} BGFREE = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_ONCE_INIT, NULL };
+
+static void *
+bgfree_thread(void *ud) {
+	for (;;) {
+		pthread_mutex_lock(&BGFREE.lock);
+		while (BGFREE.list == NULL)
+			pthread_cond_wait(&BGFREE.cond, &BGFREE.lock);
+		struct bgfree_batch *b = BGFREE.list;
+		BGFREE.list = NULL;
+		pthread_mutex_unlock(&BGFREE.lock);
+		while (b) {
+			struct bgfree_batch *next = b->next;
+			ATOM_INT *inflight = b->inflight;
+			int i;
+			for (i=0;i<b->n;i++) {
+				skynet_lalloc_free(b->ptr[i], b->flags);
+			}
+			skynet_free(b);
+			// 之后服务可能马上销毁arena并释放snlua，不能再访问它
+			if (inflight)
+				ATOM_FDEC(inflight);
+			b = next;
+		}
+	}
+	return NULL;
+}
+
+static void
+bgfree_start_thread(void) {
+	pthread_t pid;
+	if (pthread_create(&pid, NULL, bgfree_thread, NULL) == 0) {
+		pthread_detach(pid);
+	}
+}
+
+// 把攒的一批交给后台线程
+static void
+bgfree_submit(struct snlua *l) {
+	struct bgfree_batch *b = l->bg.batch;
+	if (b == NULL)
+		return;
+	l->bg.batch = NULL;
+	if (l->arena) {
+		b->inflight = &l->bg.inflight;
+		ATOM_FINC(&l->bg.inflight);
+	}
+	pthread_mutex_lock(&BGFREE.lock);
+	b->next = BGFREE.list;
+	BGFREE.list = b;
+	pthread_cond_signal(&BGFREE.cond);
+	pthread_mutex_unlock(&BGFREE.lock);
+}
+
+static void
+bgfree_push(struct snlua *l, void *ptr, size_t sz) {
+	struct bgfree_batch *b = l->bg.batch;
+	if (b == NULL) {
+		b = skynet_malloc(sizeof(*b));
+		b->next = NULL;
+		b->inflight = NULL;
+		b->flags = l->arena;
+		b->n = 0;
+		b->bytes = 0;
+		l->bg.batch = b;
+	}
+	b->ptr[b->n++] = ptr;
+	b->bytes += sz;
+	l->bg.bytes += sz;
+	if (b->n == BGFREE_BATCH || b->bytes >= BGFREE_BYTES)
+		bgfree_submit(l);
+}
+
+// 等后台线程释放完这个服务交出去的内存，销毁或整理arena之前调用
+static void
+bgfree_wait(struct snlua *l) {
+	bgfree_submit(l);
+	while (ATOM_LOAD(&l->bg.inflight) > 0)
+		usleep(100);
+}
+
 // LUA_CACHELIB may defined in patched lua for shared proto
 // LUA_CACHELIB 可能在修补的lua中定义，用于共享原型
 #ifdef LUA_CACHELIB
@@ -54,11 +201,16 @@ codecache(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "clear", cleardummy },  // 清理缓存（空实现）
 		{ "mode", cleardummy },   // 设置模式（空实现）
+		{ "clearpath", cleardummy },  // 清理路径缓存（空实现）
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);                    // 创建新的库表
 	lua_getglobal(L, "loadfile");        // 获取全局loadfile函数
 	lua_setfield(L, -2, "loadfile");     // 设置为库的loadfile字段
+	lua_getglobal(L, "package");         // 没有路径缓存，直接用package.searchpath
+	lua_getfield(L, -1, "searchpath");
+	lua_setfield(L, -3, "searchpath");
+	lua_pop(L, 1);
 	return 1;  // 返回库表
 }
 
@@ -72,18 +224,210 @@ signal_hook(lua_State *L, lua_Debug *ar) {
 	struct snlua *l = (struct snlua *)ud; // 转换为snlua结构
 
 	lua_sethook (L, NULL, 0, 0);  // 清除钩子函数
+	if (ATOM_LOAD(&l->dump)) {
+		// 等待设置钩子的线程完成（l->dump == -1）
+		while (ATOM_LOAD(&l->dump) > 0) ;
+		if (ATOM_CAS(&l->dump, -1, 0)) {
+			// 监控线程发现服务处理一条消息太久，输出正在运行的协程的调用栈
+			luaL_traceback(L, L, "stall", 0);
+			skynet_error(l->ctx, "%s", lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	}
 	if (ATOM_LOAD(&l->trap)) {
 		ATOM_STORE(&l->trap , 0);     // 重置陷阱标志
 		luaL_error(L, "signal 0");    // 抛出Lua错误，中断执行
 	}
 }
 
-// 切换活跃的Lua状态，并设置信号钩子
+/*
+ * CPU采样：一个采样线程按各服务的间隔，给正在运行Lua代码的服务的活跃协程装一次性的计数钩子，
+ * 钩子在下一条Lua指令时记下调用栈（含C函数帧），按火焰图的折叠格式（从根到叶，用;分隔）
+ * 写进环形缓冲，新的覆盖旧的。不采样时不装钩子，没有额外开销；
+ * 正在C函数里的时间算到调用它的Lua函数上。已经装了别的钩子（如调试器）的协程不采样。
+ */
+#define SAMPLE_RING 1024
+#define SAMPLE_STACK 256
+#define SAMPLE_DEPTH 32
+#define SAMPLE_IDLE 100000          // 没有服务在采样时，采样线程每100ms看一次
+
+struct sample_ring {
+	struct spinlock lock;       // 保护activeL，采样线程读，服务线程在switchL里写
+	int interval;               // 采样间隔（微秒），0表示已停止
+	uint64_t next;              // 下次采样的时间
+	struct snlua *next_l;       // 采样线程的服务链表
+	unsigned int n;             // 累计采样次数
+	char stack[SAMPLE_RING][SAMPLE_STACK];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_once_t once;
+	struct snlua *list;
+} SAMPLER = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT, NULL };
+
+static uint64_t
+sample_now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * MICROSEC + ti.tv_nsec / 1000;
+}
+
 static void
-switchL(lua_State *L, struct snlua *l) {
-	l->activeL = L;  // 设置当前活跃的Lua状态
-	if (ATOM_LOAD(&l->trap)) {
-		// 如果设置了陷阱，安装信号钩子，每执行1条指令就检查一次
+sample_frame(luaL_Buffer *b, lua_State *L, lua_Debug *ar) {
+	if (ar->name) {
+		luaL_addstring(b, ar->name);
+		luaL_addchar(b, '@');
+	}
+	if (*ar->what == 'C') {
+		luaL_addstring(b, "[C]");
+	} else {
+		lua_pushfstring(L, "%s:%d", ar->short_src, ar->linedefined);
+		luaL_addvalue(b);
+	}
+}
+
+/*
+ * 时间片：开启后，进入最外层lua_resume（恢复某个任务协程）时给它装计数钩子，每执行SLICE_COUNT条指令
+ * 看一次时间，超过时间片就在钩子里让出这个协程并设置preempted。skynet.lua 发现后给自己发一个0超时，
+ * 在它回来之前推迟其它消息，于是工作线程先去处理别的服务，这个服务重新排队后接着执行。
+ * 嵌套的协程（如 skynet.coroutine）不被打断；C函数里的时间要等回到Lua代码才能发现。
+ */
+#define SLICE_COUNT 10000
+
+static void
+slice_hook(lua_State *L, lua_Debug *ar) {
+	void *ud = NULL;
+	lua_getallocf(L, &ud);
+	struct snlua *l = (struct snlua *)ud;
+	if (ATOM_LOAD(&l->trap) || ATOM_LOAD(&l->dump)) {
+		signal_hook(L, ar);
+		return;
+	}
+	if (l->slice > 0 && l->resuming == 1 && L == l->activeL && lua_isyieldable(L)
+		&& sample_now() - l->slice_start >= (uint64_t)l->slice) {
+		l->preempted = 1;
+		lua_yield(L, 0);
+	}
+}
+
+static void
+sample_hook(lua_State *L, lua_Debug *ar) {
+	void *ud = NULL;
+	lua_getallocf(L, &ud);
+	struct snlua *l = (struct snlua *)ud;
+	if (ATOM_LOAD(&l->trap) || ATOM_LOAD(&l->dump)) {
+		signal_hook(L, ar);
+		return;
+	}
+	// 每次只采一个样，开启时间片时换回时间片钩子
+	if (l->slice > 0)
+		lua_sethook(L, slice_hook, LUA_MASKCOUNT, SLICE_COUNT);
+	else
+		lua_sethook(L, NULL, 0, 0);
+	struct sample_ring *r = l->sampler;
+	if (r == NULL || r->interval == 0)
+		return;
+	lua_Debug frame[SAMPLE_DEPTH];
+	int depth = 0;
+	while (depth < SAMPLE_DEPTH && lua_getstack(L, depth, &frame[depth])) {
+		lua_getinfo(L, "Sn", &frame[depth]);
+		++depth;
+	}
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	int i;
+	for (i=depth-1;i>=0;i--) {
+		sample_frame(&b, L, &frame[i]);
+		if (i > 0)
+			luaL_addchar(&b, ';');
+	}
+	luaL_pushresult(&b);
+	size_t sz;
+	const char *stack = lua_tolstring(L, -1, &sz);
+	if (sz >= SAMPLE_STACK) {
+		// 太深的栈保留靠近叶子的部分
+		stack += sz - (SAMPLE_STACK - 1);
+	}
+	char *slot = r->stack[r->n++ % SAMPLE_RING];
+	memcpy(slot, stack, strlen(stack) + 1);
+	lua_pop(L, 1);
+}
+
+static void *
+sample_thread(void *ud) {
+	for (;;) {
+		uint64_t now = sample_now();
+		uint64_t wait = SAMPLE_IDLE;
+		pthread_mutex_lock(&SAMPLER.lock);
+		struct snlua *l;
+		for (l = SAMPLER.list; l; l = l->sampler->next_l) {
+			struct sample_ring *r = l->sampler;
+			if (now >= r->next) {
+				spinlock_lock(&r->lock);
+				lua_Hook hook = lua_gethook(l->activeL);
+				if (l->resuming > 0 && (hook == NULL || hook == slice_hook)) {
+					lua_sethook(l->activeL, sample_hook, LUA_MASKCOUNT, 1);
+				}
+				spinlock_unlock(&r->lock);
+				r->next = now + r->interval;
+			}
+			if (r->next - now < wait)
+				wait = r->next - now;
+		}
+		pthread_mutex_unlock(&SAMPLER.lock);
+		usleep(wait);
+	}
+	return NULL;
+}
+
+static void
+sample_start_thread(void) {
+	pthread_t pid;
+	if (pthread_create(&pid, NULL, sample_thread, NULL) == 0) {
+		pthread_detach(pid);
+	}
+}
+
+// 把服务从采样线程的链表中摘掉
+static void
+sample_unlink(struct snlua *l) {
+	pthread_mutex_lock(&SAMPLER.lock);
+	struct snlua **p = &SAMPLER.list;
+	while (*p) {
+		if (*p == l) {
+			*p = l->sampler->next_l;
+			break;
+		}
+		p = &(*p)->sampler->next_l;
+	}
+	pthread_mutex_unlock(&SAMPLER.lock);
+}
+
+// 切换活跃的Lua状态，并设置信号钩子；running为进入(1)或离开(-1)lua_resume
+static void
+switchL(lua_State *L, struct snlua *l, int running) {
+	struct sample_ring *r = l->sampler;
+	if (r && r->interval) {
+		spinlock_lock(&r->lock);
+		l->activeL = L;
+		l->resuming += running;
+		spinlock_unlock(&r->lock);
+	} else {
+		l->activeL = L;  // 设置当前活跃的Lua状态
+		l->resuming += running;
+	}
+	malloc_profile_lua(l->handle, L);  // 堆采样时记录这个Lua状态的调用栈
+	if (l->slice > 0 && running > 0 && l->resuming == 1) {
+		// 恢复任务协程，重新计时；不覆盖别的钩子（如调试器）
+		lua_Hook hook = lua_gethook(L);
+		if (hook == NULL || hook == slice_hook) {
+			l->slice_start = sample_now();
+			lua_sethook(L, slice_hook, LUA_MASKCOUNT, SLICE_COUNT);
+		}
+	}
+	if (ATOM_LOAD(&l->trap) || ATOM_LOAD(&l->dump)) {
+		// 如果设置了陷阱或要输出调用栈，安装信号钩子，每执行1条指令就检查一次
 		lua_sethook(L, signal_hook, LUA_MASKCOUNT, 1);
 	}
 }
@@ -94,14 +438,16 @@ lua_resumeX(lua_State *L, lua_State *from, int nargs, int *nresults) {
 	void *ud = NULL;
 	lua_getallocf(L, &ud);                // 获取分配器用户数据
 	struct snlua *l = (struct snlua *)ud; // 转换为snlua结构
-	switchL(L, l);                        // 切换到目标Lua状态
+	switchL(L, l, 1);                     // 切换到目标Lua状态
 	int err = lua_resume(L, from, nargs, nresults);  // 恢复协程执行
 	if (ATOM_LOAD(&l->trap)) {
 		// wait for lua_sethook. (l->trap == -1)
 		// 等待lua_sethook完成（l->trap == -1）
 		while (ATOM_LOAD(&l->trap) >= 0) ;
 	}
-	switchL(from, l);  // 切换回原来的Lua状态
+	// 同样等待输出调用栈的钩子设置完成
+	while (ATOM_LOAD(&l->dump) > 0) ;
+	switchL(from, l, -1);  // 切换回原来的Lua状态
 	return err;        // 返回执行结果
 }
 
@@ -372,6 +718,73 @@ lstop(lua_State *L) {
 	return 1;  // 返回总时间
 }
 
+// 开始或停止CPU采样：profile.sample(interval)，interval为采样间隔的微秒数，0为停止；返回之前的间隔
+static int
+lsample(lua_State *L) {
+	void *ud = NULL;
+	lua_getallocf(L, &ud);
+	struct snlua *l = (struct snlua *)ud;
+	int interval = (int)luaL_checkinteger(L, 1);
+	if (interval < 0)
+		return luaL_error(L, "Invalid sample interval %d", interval);
+	if (interval > 0 && interval < 100)
+		interval = 100;
+	struct sample_ring *r = l->sampler;
+	int old = r ? r->interval : 0;
+	if (interval > 0 && old == 0) {
+		if (r == NULL) {
+			r = skynet_malloc(sizeof(*r));
+			memset(r, 0, sizeof(*r) - sizeof(r->stack));
+			spinlock_init(&r->lock);
+			l->sampler = r;
+		}
+		// 重新开始采样时丢掉旧的记录
+		r->n = 0;
+		r->next = 0;
+		pthread_once(&SAMPLER.once, sample_start_thread);
+		spinlock_lock(&r->lock);
+		r->interval = interval;
+		spinlock_unlock(&r->lock);
+		pthread_mutex_lock(&SAMPLER.lock);
+		r->next_l = SAMPLER.list;
+		SAMPLER.list = l;
+		pthread_mutex_unlock(&SAMPLER.lock);
+	} else if (interval > 0) {
+		r->interval = interval;
+	} else if (old > 0) {
+		sample_unlink(l);
+		r->interval = 0;
+	}
+	lua_pushinteger(L, old);
+	return 1;
+}
+
+// 汇总环形缓冲里的采样：返回 { [折叠的调用栈] = 次数 } 和累计采样次数
+static int
+lsamples(lua_State *L) {
+	void *ud = NULL;
+	lua_getallocf(L, &ud);
+	struct snlua *l = (struct snlua *)ud;
+	struct sample_ring *r = l->sampler;
+	lua_newtable(L);
+	if (r == NULL) {
+		lua_pushinteger(L, 0);
+		return 2;
+	}
+	unsigned int n = r->n < SAMPLE_RING ? r->n : SAMPLE_RING;
+	unsigned int i;
+	for (i=0;i<n;i++) {
+		lua_pushstring(L, r->stack[i]);
+		lua_pushvalue(L, -1);
+		lua_Integer c = (lua_rawget(L, -3) == LUA_TNUMBER) ? lua_tointeger(L, -1) : 0;
+		lua_pop(L, 1);
+		lua_pushinteger(L, c + 1);
+		lua_rawset(L, -3);
+	}
+	lua_pushinteger(L, r->n);
+	return 2;
+}
+
 // 初始化性能分析库
 static int
 init_profile(lua_State *L) {
@@ -380,6 +793,8 @@ init_profile(lua_State *L) {
 		{ "stop", lstop },             // 停止性能分析
 		{ "resume", luaB_coresume },   // 带性能分析的协程恢复
 		{ "wrap", luaB_cowrap },       // 协程包装器
+		{ "sample", lsample },         // 开始或停止CPU采样
+		{ "samples", lsamples },       // 汇总CPU采样
 		{ NULL, NULL },
 	};
 	luaL_newlibtable(L,l);
@@ -400,6 +815,169 @@ init_profile(lua_State *L) {
 	return 1;
 }
 
+/// 服务休眠，见 skynet.hibernate
+
+// 完整回收，再把虚拟机在分配器中缓存的空闲内存还回去，返回之后虚拟机使用的内存
+static int
+lcompact(lua_State *L) {
+	struct snlua *l;
+	lua_getallocf(L, (void **)&l);
+	lua_gc(L, LUA_GCCOLLECT);
+	// 第一遍执行过终结器的对象要再回收一遍
+	lua_gc(L, LUA_GCCOLLECT);
+	bgfree_wait(l);
+	skynet_lalloc_trim(l->arena);
+	lua_pushinteger(L, (lua_Integer)l->mem);
+	return 1;
+}
+
+/// 回收统计，见 skynet.stat "gc"
+
+// 每个统计窗口至少一秒，在回收结束和查询时结算
+static void
+gc_window(struct gc_stat *g, uint64_t now) {
+	if (g->window_start == 0) {
+		g->window_start = now;
+		g->window_alloc = g->alloc;
+	} else if (now - g->window_start >= MICROSEC) {
+		g->rate = (g->alloc - g->window_alloc) * MICROSEC / (now - g->window_start);
+		g->window_start = now;
+		g->window_alloc = g->alloc;
+	}
+}
+
+// 在回收器里调用，不能分配内存，也不能调用Lua
+static void
+gc_hook(void *ud, int what, int done) {
+	struct snlua *l = ud;
+	struct gc_stat *g = &l->gc;
+	if (!done) {
+		if (g->depth++ == 0) {
+			g->kind = what;
+			g->begin = sample_now();
+		}
+		return;
+	}
+	if (--g->depth > 0)
+		return;
+	bgfree_submit(l);  // 这一步清扫出的内存不等攒满
+	uint64_t now = sample_now();
+	uint64_t t = now - g->begin;
+	g->count[g->kind]++;
+	g->time[g->kind] += t;
+	if (t > g->max[g->kind])
+		g->max[g->kind] = t;
+	gc_window(g, now);
+}
+
+/*
+	return table
+		alloc : 累计分配的字节数
+		alloc_rate : 每秒分配的字节数（最近一个至少一秒的窗口）
+		step / step_time / step_max : 回收步的次数，累计和最长的耗时（秒）
+		full / full_time / full_max : 完整回收（collectgarbage "collect" 或内存不足时）的次数和耗时
+		bgfree : 开启lua_bgsweep时，累计交给后台线程释放的字节数
+ */
+static int
+lgcstat(lua_State *L) {
+	struct snlua *l;
+	lua_getallocf(L, (void **)&l);
+	struct gc_stat *g = &l->gc;
+	gc_window(g, sample_now());
+	lua_createtable(L, 0, 9);
+	lua_pushinteger(L, (lua_Integer)g->alloc);
+	lua_setfield(L, -2, "alloc");
+	lua_pushinteger(L, (lua_Integer)g->rate);
+	lua_setfield(L, -2, "alloc_rate");
+	static const char * names[2][3] = {
+		{ "step", "step_time", "step_max" },
+		{ "full", "full_time", "full_max" },
+	};
+	int i;
+	for (i=0;i<2;i++) {
+		lua_pushinteger(L, (lua_Integer)g->count[i]);
+		lua_setfield(L, -2, names[i][0]);
+		lua_pushnumber(L, (double)g->time[i] / MICROSEC);
+		lua_setfield(L, -2, names[i][1]);
+		lua_pushnumber(L, (double)g->max[i] / MICROSEC);
+		lua_setfield(L, -2, names[i][2]);
+	}
+	lua_pushinteger(L, (lua_Integer)l->bg.bytes);
+	lua_setfield(L, -2, "bgfree");
+	return 1;
+}
+
+// timeslice([ms]) 设置时间片（毫秒，0关闭），返回原来的值
+static int
+ltimeslice(lua_State *L) {
+	struct snlua *l;
+	lua_getallocf(L, (void **)&l);
+	lua_pushnumber(L, (double)l->slice / 1000);
+	if (!lua_isnoneornil(L, 1)) {
+		lua_Number ms = luaL_checknumber(L, 1);
+		l->slice = ms > 0 ? (int)(ms * 1000) : 0;
+	}
+	return 1;
+}
+
+// 返回上一次让出是否由时间片引起，并清除标记
+static int
+lpreempted(lua_State *L) {
+	struct snlua *l;
+	lua_getallocf(L, (void **)&l);
+	lua_pushboolean(L, l->preempted);
+	l->preempted = 0;
+	return 1;
+}
+
+// poolstring(...) 把短字符串（或表中的字符串键）放进进程级的字符串池，返回放入的个数
+static int
+lpoolstring(lua_State *L) {
+	int n = 0;
+	int top = lua_gettop(L);
+	int i;
+	for (i=1;i<=top;i++) {
+		if (lua_type(L, i) == LUA_TTABLE) {
+			lua_pushnil(L);
+			while (lua_next(L, i) != 0) {
+				lua_pop(L, 1);
+				if (lua_type(L, -1) == LUA_TSTRING)
+					n += lua_poolstring(L, -1);
+			}
+		} else {
+			luaL_checktype(L, i, LUA_TSTRING);
+			n += lua_poolstring(L, i);
+		}
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+// 字符串池的字符串数和字节数
+static int
+lpoolstat(lua_State *L) {
+	size_t bytes;
+	int n = lua_poolstat(&bytes);
+	lua_pushinteger(L, n);
+	lua_pushinteger(L, (lua_Integer)bytes);
+	return 2;
+}
+
+static int
+init_vm(lua_State *L) {
+	luaL_Reg l[] = {
+		{ "compact", lcompact },       // 回收并归还空闲内存
+		{ "gcstat", lgcstat },         // 分配和回收的统计
+		{ "timeslice", ltimeslice },   // 设置时间片
+		{ "preempted", lpreempted },   // 是否被时间片让出
+		{ "poolstring", lpoolstring }, // 放进进程级的字符串池
+		{ "poolstat", lpoolstat },     // 字符串池的统计
+		{ NULL, NULL },
+	};
+	luaL_newlib(L,l);
+	return 1;
+}
+
 /// end of coroutine
 /// 协程部分结束
 
@@ -438,6 +1016,7 @@ init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t s
 	lua_State *L = l->L;
 	l->ctx = ctx;  // 设置上下文
 	lua_gc(L, LUA_GCSTOP, 0);  // 停止垃圾回收
+	lua_setgchook(L, gc_hook, l);  // 统计回收的次数和耗时
 	lua_pushboolean(L, 1);  /* signal for libraries to ignore env. vars. */
 	/* 向库发出忽略环境变量的信号 */
 	lua_setfield(L, LUA_REGISTRYINDEX, "LUA_NOENV");
@@ -460,8 +1039,16 @@ init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t s
 	lua_setfield(L, LUA_REGISTRYINDEX, "skynet_context");
 	luaL_requiref(L, "skynet.codecache", codecache , 0);  // 加载代码缓存库
 	lua_pop(L,1);
+	luaL_requiref(L, "skynet.vm", init_vm, 0);  // 虚拟机内存的回收
+	lua_pop(L,1);
 
-	lua_gc(L, LUA_GCGEN, 0, 0);  // 启用分代垃圾回收
+	// 配置lua_gc选择回收模式，默认分代；服务可以再用skynet.gcpolicy调整
+	const char *gcmode = optstring(ctx, "lua_gc", "generational");
+	if (strcmp(gcmode, "incremental") == 0) {
+		lua_gc(L, LUA_GCINC, 0, 0, 0);  // 启用增量垃圾回收
+	} else {
+		lua_gc(L, LUA_GCGEN, 0, 0);  // 启用分代垃圾回收
+	}
 
 	// 设置Lua路径相关的全局变量
 	const char *path = optstring(ctx, "lua_path","./lualib/?.lua;./lualib/?/init.lua");
@@ -496,15 +1083,23 @@ init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t s
 		return 1;
 	}
 	lua_settop(L,0);  // 清空栈
-	// 检查是否设置了内存限制
+	// 检查是否设置了内存限制（代替配置的默认值）
 	if (lua_getfield(L, LUA_REGISTRYINDEX, "memlimit") == LUA_TNUMBER) {
 		size_t limit = lua_tointeger(L, -1);  // 获取内存限制值
 		l->mem_limit = limit;                 // 设置内存限制
+		l->mem_soft = 0;
 		skynet_error(ctx, "Set memory limit to %.2f M", (float)limit / (1024 * 1024));
 		lua_pushnil(L);
 		lua_setfield(L, LUA_REGISTRYINDEX, "memlimit");  // 清除注册表中的memlimit
 	}
 	lua_pop(L, 1);  // 弹出栈顶元素
+	if (lua_getfield(L, LUA_REGISTRYINDEX, "memsoft") == LUA_TNUMBER) {
+		l->mem_soft = lua_tointeger(L, -1);
+		skynet_error(ctx, "Set memory soft limit to %.2f M", (float)l->mem_soft / (1024 * 1024));
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "memsoft");
+	}
+	lua_pop(L, 1);
 
 	lua_gc(L, LUA_GCRESTART, 0);
 
@@ -525,19 +1120,292 @@ launch_cb(struct skynet_context * context, void *ud, int type, int session, uint
 	return 0;
 }
 
-// snlua服务的初始化函数
-int
-snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
-	int sz = strlen(args);
-	char * tmp = skynet_malloc(sz);  // 分配参数内存
-	memcpy(tmp, args, sz);           // 复制参数
-	skynet_callback(ctx, l , launch_cb);  // 设置启动回调
-	const char * self = skynet_command(ctx, "REG", NULL);  // 获取自己的句柄
-	uint32_t handle_id = strtoul(self+1, NULL, 16);       // 解析句柄ID
-	// it must be first message
-	// 这必须是第一条消息
-	skynet_send(ctx, 0, handle_id, PTYPE_TAG_DONTCOPY,0, tmp, sz);  // 发送启动消息给自己
-	return 0;
+/*
+ * 内存调控：所有snlua虚拟机的内存合计（按GOVERNOR_STEP的粒度更新）加上malloc_hook统计的C内存，
+ * 超过配置memory_governor时，给虚拟机内存最大的GOVERNOR_TOP个服务发PTYPE_MEMORY消息，
+ * 让它们完整回收一遍并回调服务（见skynet.memory_callback），每秒最多一次。
+ * 服务的软限制也用同样的消息通知，数据是原因："soft"或"node"
+ */
+#define GOVERNOR_STEP (64 * 1024)
+#define GOVERNOR_TOP 8
+#define GOVERNOR_INTERVAL 100       // skynet_now的单位是1/100秒
+
+static struct {
+	pthread_mutex_t lock;       // 保护服务链表
+	struct snlua *list;
+	ATOM_SIZET total;           // 虚拟机内存合计
+	ATOM_SIZET last;            // 上次调控的时间
+	ATOM_INT init;              // 已经读过配置
+	size_t threshold;           // 0表示不开启
+} GOVERNOR = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+// 解析内存大小，可以带K、M、G后缀
+static size_t
+parse_size(const char *str, const char **end) {
+	char *e;
+	size_t sz = strtoull(str, &e, 10);
+	switch (*e) {
+	case 'K': case 'k': sz <<= 10; ++e; break;
+	case 'M': case 'm': sz <<= 20; ++e; break;
+	case 'G': case 'g': sz <<= 30; ++e; break;
+	}
+	if (end)
+		*end = e;
+	return sz;
+}
+
+static void
+memory_notify(struct skynet_context *ctx, uint32_t handle, const char *reason) {
+	skynet_send(ctx, 0, handle, PTYPE_MEMORY, 0, (void *)reason, strlen(reason));
+}
+
+static void
+governor_link(struct snlua *l) {
+	pthread_mutex_lock(&GOVERNOR.lock);
+	l->gov_prev = NULL;
+	l->gov_next = GOVERNOR.list;
+	if (GOVERNOR.list)
+		GOVERNOR.list->gov_prev = l;
+	GOVERNOR.list = l;
+	pthread_mutex_unlock(&GOVERNOR.lock);
+}
+
+static void
+governor_unlink(struct snlua *l) {
+	pthread_mutex_lock(&GOVERNOR.lock);
+	if (l->gov_prev)
+		l->gov_prev->gov_next = l->gov_next;
+	else if (GOVERNOR.list == l)
+		GOVERNOR.list = l->gov_next;
+	if (l->gov_next)
+		l->gov_next->gov_prev = l->gov_prev;
+	l->gov_prev = l->gov_next = NULL;
+	pthread_mutex_unlock(&GOVERNOR.lock);
+}
+
+// 节点的内存超过阈值时，找出虚拟机内存最大的几个服务通知它们回收
+static void
+governor_check(struct snlua *l) {
+	size_t used = ATOM_LOAD(&GOVERNOR.total) + malloc_used_memory();
+	if (used < GOVERNOR.threshold)
+		return;
+	size_t now = (size_t)skynet_now();
+	size_t last = ATOM_LOAD(&GOVERNOR.last);
+	if (now - last < GOVERNOR_INTERVAL || !ATOM_CAS_SIZET(&GOVERNOR.last, last, now))
+		return;
+	uint32_t handle[GOVERNOR_TOP];
+	size_t mem[GOVERNOR_TOP];
+	int n = 0;
+	pthread_mutex_lock(&GOVERNOR.lock);
+	struct snlua *s;
+	for (s = GOVERNOR.list; s; s = s->gov_next) {
+		// 其他服务的mem只是粗略地读一下
+		size_t m = s->mem;
+		if (n == GOVERNOR_TOP && m <= mem[n-1])
+			continue;
+		int i = (n < GOVERNOR_TOP) ? n++ : n - 1;
+		while (i > 0 && mem[i-1] < m) {
+			mem[i] = mem[i-1];
+			handle[i] = handle[i-1];
+			--i;
+		}
+		mem[i] = m;
+		handle[i] = s->handle;
+	}
+	pthread_mutex_unlock(&GOVERNOR.lock);
+	skynet_error(l->ctx, "Memory governor : node uses %.2f M, collect %d services", (float)used / (1024 * 1024), n);
+	int i;
+	for (i=0;i<n;i++) {
+		memory_notify(l->ctx, handle[i], "node");
+	}
+}
+
+// 把虚拟机内存的变化计入合计
+static void
+governor_count(struct snlua *l) {
+	ATOM_FADD(&GOVERNOR.total, l->mem - l->mem_counted);
+	l->mem_counted = l->mem;
+	if (GOVERNOR.threshold && l->ctx) {
+		governor_check(l);
+	}
+}
+
+/*
+ * 虚拟机私有的小块内存池（配置 lua_pool 或 lua_pool_<服务名>）
+ * 不超过POOL_MAX字节的块按16字节一档从私有的页中切出，块没有头部，空闲块串在每档的空闲链表上。
+ * Lua释放和重新分配时总是给出原来的大小，所以按大小就能知道块是不是来自内存池。
+ * 虚拟机只在一个线程里运行，不需要加锁；页在服务退出时整个释放，服务的内存统计按页更新。
+ */
+
+#define POOL_CLASS 16
+#define POOL_MAX (POOL_CLASS * 16)     // 256字节
+#define POOL_PAGE (8 * 1024)
+
+struct pool_page {
+	struct pool_page *next;
+	void *pad;                  // 块按16字节对齐
+};
+
+struct lua_pool {
+	void *freelist[POOL_CLASS];
+	char *ptr[POOL_CLASS];      // 当前页中尚未切出的部分
+	char *end[POOL_CLASS];
+	struct pool_page *page;
+};
+
+static void *
+backend_alloc(struct snlua *l, void *ptr, size_t osize, size_t nsize) {
+	void *ret;
+	if (nsize == 0 && ptr && l->bg.enable && (l->gc.depth > 0 || l->bg.closing)) {
+		bgfree_push(l, ptr, osize);  // 回收器里的释放交给后台线程
+		ret = NULL;
+	} else if (l->arena)
+		ret = skynet_lalloc_x(ptr, osize, nsize, l->arena);  // 服务独立的arena
+	else
+		ret = skynet_lalloc(ptr, osize, nsize);  // 调用实际的内存分配函数
+	if (ret || nsize == 0) {
+		ptrdiff_t delta = (ptrdiff_t)nsize - (ptr ? (ptrdiff_t)osize : 0);
+		l->mem_backend += delta;
+		if (l->handle)
+			skynet_lalloc_account(l->handle, delta);
+	}
+	return ret;
+}
+
+static inline int
+pool_class(size_t sz) {
+	return (int)((sz - 1) >> 4);
+}
+
+static void *
+pool_alloc(struct snlua *l, size_t sz) {
+	struct lua_pool *p = l->pool;
+	int c = pool_class(sz);
+	void *ret = p->freelist[c];
+	if (ret) {
+		p->freelist[c] = *(void **)ret;
+		return ret;
+	}
+	size_t bsz = (size_t)(c + 1) << 4;
+	if (p->ptr[c] + bsz > p->end[c]) {
+		struct pool_page *page = backend_alloc(l, NULL, 0, POOL_PAGE);
+		if (page == NULL)
+			return NULL;
+		page->next = p->page;
+		p->page = page;
+		p->ptr[c] = (char *)(page + 1);
+		p->end[c] = (char *)page + POOL_PAGE;
+	}
+	ret = p->ptr[c];
+	p->ptr[c] += bsz;
+	return ret;
+}
+
+static inline void
+pool_free(struct lua_pool *p, void *ptr, size_t sz) {
+	int c = pool_class(sz);
+	*(void **)ptr = p->freelist[c];
+	p->freelist[c] = ptr;
+}
+
+// 块的大小跨过POOL_MAX时要在内存池和skynet_lalloc之间搬动，释放时才能按大小找到它的来处
+static void *
+pool_realloc(struct snlua *l, void *ptr, size_t osize, size_t nsize) {
+	if (ptr == NULL) {
+		if (nsize == 0)
+			return NULL;
+		return nsize <= POOL_MAX ? pool_alloc(l, nsize) : backend_alloc(l, NULL, 0, nsize);
+	}
+	if (osize > POOL_MAX) {
+		if (nsize > POOL_MAX || nsize == 0)
+			return backend_alloc(l, ptr, osize, nsize);
+		void *ret = pool_alloc(l, nsize);
+		if (ret) {
+			memcpy(ret, ptr, nsize);
+			backend_alloc(l, ptr, osize, 0);
+		}
+		return ret;
+	}
+	if (nsize == 0) {
+		pool_free(l->pool, ptr, osize);
+		return NULL;
+	}
+	if (nsize <= POOL_MAX && pool_class(nsize) == pool_class(osize))
+		return ptr;
+	void *ret = nsize <= POOL_MAX ? pool_alloc(l, nsize) : backend_alloc(l, NULL, 0, nsize);
+	if (ret) {
+		memcpy(ret, ptr, osize < nsize ? osize : nsize);
+		pool_free(l->pool, ptr, osize);
+	}
+	return ret;
+}
+
+// 虚拟机关闭以后调用
+static void
+pool_release(struct snlua *l) {
+	struct lua_pool *p = l->pool;
+	if (p == NULL)
+		return;
+	struct pool_page *page = p->page;
+	while (page) {
+		struct pool_page *next = page->next;
+		backend_alloc(l, page, POOL_PAGE, 0);
+		page = next;
+	}
+	skynet_free(p);
+	l->pool = NULL;
+}
+
+// 读开关配置 <option>_<服务名> 或 <option>
+static int
+switch_config(struct skynet_context *ctx, const char *option, const char *name) {
+	char key[64];
+	snprintf(key, sizeof(key), "%s_%s", option, name);
+	const char *v = skynet_command(ctx, "GETENV", key);
+	if (v == NULL) {
+		v = skynet_command(ctx, "GETENV", option);
+	}
+	return v && (strcmp(v, "true") == 0 || strcmp(v, "on") == 0);
+}
+
+// 读配置 lua_timeslice_<服务名> 或 lua_timeslice ：时间片（毫秒）
+static int
+slice_config(struct skynet_context *ctx, const char *name) {
+	char key[64];
+	snprintf(key, sizeof(key), "lua_timeslice_%s", name);
+	const char *v = skynet_command(ctx, "GETENV", key);
+	if (v == NULL) {
+		v = skynet_command(ctx, "GETENV", "lua_timeslice");
+	}
+	if (v == NULL)
+		return 0;
+	double ms = strtod(v, NULL);
+	return ms > 0 ? (int)(ms * 1000) : 0;
+}
+
+// 读配置 memory_governor（节点的内存阈值）和服务的默认内存限制 memlimit_<服务名> 或 memlimit ："硬限制[,软限制]"
+static void
+memory_config(struct snlua *l, struct skynet_context *ctx, const char *name) {
+	if (!ATOM_LOAD(&GOVERNOR.init)) {
+		const char *threshold = skynet_command(ctx, "GETENV", "memory_governor");
+		if (threshold) {
+			GOVERNOR.threshold = parse_size(threshold, NULL);
+		}
+		ATOM_STORE(&GOVERNOR.init, 1);
+	}
+	char key[64];
+	snprintf(key, sizeof(key), "memlimit_%s", name);
+	const char *limit = skynet_command(ctx, "GETENV", key);
+	if (limit == NULL) {
+		limit = skynet_command(ctx, "GETENV", "memlimit");
+	}
+	if (limit) {
+		const char *e;
+		l->mem_limit = parse_size(limit, &e);
+		if (*e == ',') {
+			l->mem_soft = parse_size(e + 1, NULL);
+		}
+	}
 }
 
 // Lua内存分配器，跟踪内存使用并实施限制
@@ -556,12 +1424,75 @@ lalloc(void * ud, void *ptr, size_t osize, size_t nsize) {
 			return NULL;      // 分配失败
 		}
 	}
+	if (ptr == NULL) {
+		l->gc.alloc += nsize;  // ptr为NULL时osize是对象类型
+	} else if (nsize > osize) {
+		l->gc.alloc += nsize - osize;
+	}
+	if (l->mem_soft) {
+		if (l->mem > l->mem_soft) {
+			if (!l->soft_notified && l->ctx) {
+				l->soft_notified = 1;
+				memory_notify(l->ctx, l->handle, "soft");
+			}
+		} else if (l->soft_notified && l->mem < l->mem_soft - l->mem_soft / 8) {
+			l->soft_notified = 0;
+		}
+	}
+	if (l->mem - l->mem_counted + GOVERNOR_STEP > GOVERNOR_STEP * 2) {
+		// 和计入的值相差超过GOVERNOR_STEP（无符号数的差，两个方向都算）
+		governor_count(l);
+	}
 	if (l->mem > l->mem_report) {
 		// 内存使用超过报告阈值，发出警告
 		l->mem_report *= 2;   // 下次报告阈值翻倍
 		skynet_error(l->ctx, "Memory warning %.2f M", (float)l->mem / (1024 * 1024));
 	}
-	return skynet_lalloc(ptr, osize, nsize);  // 调用实际的内存分配函数
+	if (l->pool)
+		return pool_realloc(l, ptr, osize, nsize);
+	return backend_alloc(l, ptr, osize, nsize);
+}
+
+// snlua服务的初始化函数
+int
+snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
+	int sz = strlen(args);
+	// 服务名是第一个参数；开启lua_arena时用新arena重建还没有使用的虚拟机
+	char name[32];
+	int n = strcspn(args, " ");
+	if (n >= sizeof(name))
+		n = sizeof(name) - 1;
+	memcpy(name, args, n);
+	name[n] = '\0';
+	int arena = skynet_lalloc_open(name);
+	int pool = switch_config(ctx, "lua_pool", name);
+	if (arena || pool) {
+		lua_close(l->L);
+		l->arena = arena;
+		if (pool) {
+			l->pool = skynet_malloc(sizeof(*l->pool));
+			memset(l->pool, 0, sizeof(*l->pool));
+		}
+		l->L = lua_newstate(lalloc, l);
+	}
+	memory_config(l, ctx, name);
+	l->slice = slice_config(ctx, name);
+	if (switch_config(ctx, "lua_bgsweep", name)) {
+		pthread_once(&BGFREE.once, bgfree_start_thread);
+		l->bg.enable = 1;
+	}
+	char * tmp = skynet_malloc(sz);  // 分配参数内存
+	memcpy(tmp, args, sz);           // 复制参数
+	skynet_callback(ctx, l , launch_cb);  // 设置启动回调
+	const char * self = skynet_command(ctx, "REG", NULL);  // 获取自己的句柄
+	uint32_t handle_id = strtoul(self+1, NULL, 16);       // 解析句柄ID
+	l->handle = handle_id;
+	skynet_lalloc_account(handle_id, l->mem_backend);     // 之前创建虚拟机用的内存
+	governor_link(l);
+	// it must be first message
+	// 这必须是第一条消息
+	skynet_send(ctx, 0, handle_id, PTYPE_TAG_DONTCOPY,0, tmp, sz);  // 发送启动消息给自己
+	return 0;
 }
 
 // 创建snlua服务实例
@@ -574,13 +1505,28 @@ snlua_create(void) {
 	l->L = lua_newstate(lalloc, l);            // 创建Lua虚拟机，使用自定义分配器
 	l->activeL = NULL;                         // 初始无活跃Lua状态
 	ATOM_INIT(&l->trap , 0);                   // 初始化陷阱标志
+	ATOM_INIT(&l->dump , 0);
+	ATOM_INIT(&l->bg.inflight, 0);
 	return l;
 }
 
 // 释放snlua实例
 void
 snlua_release(struct snlua *l) {
+	governor_unlink(l);
+	l->ctx = NULL;    // 服务正在删除，关闭虚拟机时不再发通知
+	l->bg.closing = 1;
 	lua_close(l->L);  // 关闭Lua虚拟机
+	pool_release(l);  // 内存池的页在arena之前释放
+	bgfree_wait(l);   // 后台线程释放完才能销毁arena
+	ATOM_FSUB(&GOVERNOR.total, l->mem_counted);
+	malloc_profile_lua(0, NULL);
+	if (l->sampler) {
+		if (l->sampler->interval)
+			sample_unlink(l);
+		skynet_free(l->sampler);
+	}
+	skynet_lalloc_close(l->arena);  // 释放服务独立的arena
 	skynet_free(l);   // 释放snlua结构体
 }
 
@@ -602,5 +1548,15 @@ snlua_signal(struct snlua *l, int signal) {
 		}
 	} else if (signal == 1) {
 		skynet_error(l->ctx, "Current Memory %.3fK", (float)l->mem / 1024);
+	} else if (signal == 2) {
+		// 信号2：在下一条Lua指令时输出调用栈，不中断执行
+		if (l->resuming == 0) {
+			skynet_error(l->ctx, "stall : not in lua, blocked in C");
+			return;
+		}
+		if (!ATOM_CAS(&l->dump, 0, 1))
+			return;
+		lua_sethook (l->activeL, signal_hook, LUA_MASKCOUNT, 1);
+		ATOM_CAS(&l->dump, 1, -1);
 	}
 }
@@ -47,6 +47,17 @@ skynet.start(function()
 		end)
 	end
 
+	local startup = skynet.getenv "startup"
+	if startup then
+		local ok, err = pcall(function()
+			local graph = assert(loadfile(startup))()
+			skynet.startup(graph)
+		end)
+		if not ok then
+			skynet.error(err)
+		end
+	end
+
 	pcall(skynet.newservice,skynet.getenv "start" or "main")
 	skynet.exit()
 end)
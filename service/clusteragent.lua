@@ -1,6 +1,7 @@
 local skynet = require "skynet"
 local socket = require "skynet.socket"
 local cluster = require "skynet.cluster.core"
+local shmchannel = require "skynet.shmchannel"
 local ignoreret = skynet.ignoreret
 
 local clusterd, gate, fd = ...
@@ -9,31 +10,17 @@ gate = tonumber(gate)
 fd = tonumber(fd)
 
 local large_request = {}
-local inquery_name = {}
+local stream_request = {}	-- session -> queue of the chunks not read yet, and the acks waiting for them
 local register_name
 
+-- clusterd publishes the registered names in the shared route table, read it directly
 local register_name_mt = { __index =
 	function(self, name)
-		local waitco = inquery_name[name]
-		if waitco then
-			local co = coroutine.running()
-			table.insert(waitco, co)
-			skynet.wait(co)
-			return rawget(register_name, name)
-		else
-			waitco = {}
-			inquery_name[name] = waitco
-
-			local addr = skynet.call(clusterd, "lua", "queryname", name:sub(2))	-- name must be '@xxxx'
-			if addr then
-				register_name[name] = addr
-			end
-			inquery_name[name] = nil
-			for _, co in ipairs(waitco) do
-				skynet.wakeup(co)
-			end
-			return addr
+		local addr = cluster.route("name", name:sub(2))	-- name must be '@xxxx'
+		if addr then
+			register_name[name] = addr
 		end
+		return addr
 	end
 }
 
@@ -43,17 +30,221 @@ end
 new_register_name()
 
 local tracetag
+local deadline	-- the expire time (skynet.now) of the next request, set by the deadline package
+local calling = {}	-- session -> true, the requests with a deadline being handled, they can be canceled
+local compress_response	-- the threshold of compressed response, set by the option package of the sender
+local shm	-- the shared memory channel from the sender on the same host, confirmed by the sender
+local shm_attached	-- the channel attached, waiting for the confirm of the sender
 
-local function dispatch_request(_,_,addr, session, msg, sz, padding, is_push)
-	ignoreret()	-- session is fd, don't call skynet.ret
+-- via is the shared memory channel which the request comes from, nil for the tcp connection.
+-- The sender has failed the requests in a channel closed, their responses are dropped.
+local function write_response(via, response)
+	if not via then
+		socket.write(fd, response)
+	elseif via == shm then
+		via:write(response)
+	end
+end
+
+local function send_response(via, session, ok, msg, sz)
+	local response
+	if ok then
+		response = cluster.packresponse(session, true, msg, sz, compress_response)
+		if type(response) == "table" then
+			for _, v in ipairs(response) do
+				if not via then
+					socket.lwrite(fd, v)
+				elseif via == shm then
+					via:write(v)
+				end
+			end
+		else
+			write_response(via, response)
+		end
+	else
+		response = cluster.packresponse(session, false, msg)
+		write_response(via, response)
+	end
+end
+
+-- The sender waits for the ack before sending too many chunks, it's answered when the chunks before it are read
+local function stream_ack(via, ack)
+	write_response(via, cluster.packresponse(ack, true, ""))
+end
+
+-- A stream request calls the address with the arguments and a stream object appended,
+-- the callee reads the chunks by cluster.readstream as they arrive, instead of receiving one large message.
+local function dispatch_stream(via, addr, session, msg, sz, kind)
+	if kind == "begin" then
+		local s = { head = 1, tail = 0, ack = {}, via = via }
+		stream_request[session] = s
+		local args = table.pack(skynet.unpack(msg, sz))
+		skynet.trash(msg, sz)
+		if cluster.isname(addr) then
+			addr = register_name[addr]
+		end
+		local ok
+		if addr then
+			args.n = args.n + 1
+			args[args.n] = { agent = skynet.self(), session = session }
+			ok, msg, sz = pcall(skynet.rawcall, addr, "lua", skynet.pack(table.unpack(args, 1, args.n)))
+		else
+			ok, msg = false, "Invalid name"
+		end
+		-- the chunks not read are dropped
+		s.done = true
+		for i = s.head, s.tail do
+			s[i] = nil
+			local ack = s.ack[i]
+			if ack then
+				s.ack[i] = nil
+				stream_ack(s.via, ack)
+			end
+		end
+		s.head = s.tail + 1
+		if s.reader then
+			skynet.wakeup(s.reader)
+		end
+		if not s.closed then
+			-- the sender waits for the response after the end of stream,
+			-- and msg from rawcall is valid only before yield
+			if ok then
+				msg, sz = skynet.tostring(msg, sz), nil
+			end
+			s.waiter = coroutine.running()
+			skynet.wait(s.waiter)
+		end
+		stream_request[session] = nil
+		send_response(via, session, ok, msg, sz)
+	else
+		local s = stream_request[session]
+		if s then
+			if kind == "end" then
+				s.closed = true
+				if s.waiter then
+					skynet.wakeup(s.waiter)
+				end
+			elseif kind == "ack" then
+				-- msg is the ack session
+				if s.head <= s.tail then
+					s.ack[s.tail] = msg
+				else
+					stream_ack(via, msg)
+				end
+			elseif not s.done then
+				s.tail = s.tail + 1
+				s[s.tail] = msg
+			end
+			if s.reader then
+				skynet.wakeup(s.reader)
+			end
+		elseif kind == "ack" then
+			stream_ack(via, msg)
+		end
+	end
+end
+
+local function read_stream(session)
+	local s = stream_request[session]
+	if not s then
+		return
+	end
+	while s.head > s.tail and not s.closed and not s.done do
+		s.reader = coroutine.running()
+		skynet.wait(s.reader)
+		s.reader = nil
+	end
+	if s.head <= s.tail then
+		local i = s.head
+		local chunk = s[i]
+		s[i] = nil
+		s.head = i + 1
+		local ack = s.ack[i]
+		if ack then
+			s.ack[i] = nil
+			stream_ack(s.via, ack)
+		end
+		return chunk
+	end
+end
+
+-- The caller has given up : the request not handled yet is dropped, and the response is sent now,
+-- so the sender doesn't wait for it. The work already begun can't be stopped, its response is dropped.
+local function cancel_request(via, session)
+	if large_request[session] then
+		large_request[session] = nil
+	elseif calling[session] then
+		calling[session] = nil
+	else
+		return
+	end
+	write_response(via, cluster.packresponse(session, false, "canceled"))
+end
+
+local dispatch_package
+
+-- The channel is used after the sender confirms it, the sender may give up waiting before it's attached.
+local function attach_shm(path)
+	local ok, c = pcall(shmchannel.attach, path)
+	if not ok then
+		skynet.error(c)
+		return
+	end
+	if shm_attached then
+		shm_attached:close()
+	end
+	shm_attached = c
+end
+
+local function confirm_shm(path, confirm)
+	local c = shm_attached
+	if not c or c:path() ~= path then
+		return
+	end
+	shm_attached = nil
+	if not confirm then
+		c:close()
+		return
+	end
+	if shm then
+		shm:close()
+	end
+	shm = c
+	c:start(function(pkg)
+		skynet.fork(dispatch_package, c, cluster.unpackrequest(pkg))
+	end)
+end
+
+function dispatch_package(via, addr, session, msg, sz, padding, is_push, stream)
+	if stream then
+		return dispatch_stream(via, addr, session, msg, sz, stream)
+	end
 	if session == nil then
-		-- trace
-		tracetag = addr
+		if addr == false then
+			if sz == "shm" then
+				return attach_shm(msg)
+			elseif sz == "shmconfirm" then
+				return confirm_shm(msg, true)
+			elseif sz == "shmabandon" then
+				return confirm_shm(msg, false)
+			elseif sz == "deadline" then
+				deadline = skynet.now() + msg
+				return
+			elseif sz == "cancel" then
+				return cancel_request(via, msg)
+			end
+			-- option
+			compress_response = msg
+		else
+			-- trace
+			tracetag = addr
+		end
 		return
 	end
 	if padding then
-		local req = large_request[session] or { addr = addr , is_push = is_push, tracetag = tracetag }
+		local req = large_request[session] or { addr = addr , is_push = is_push, tracetag = tracetag, deadline = deadline }
 		tracetag = nil
+		deadline = nil
 		large_request[session] = req
 		cluster.append(req, msg, sz)
 		return
@@ -61,6 +252,7 @@ local function dispatch_request(_,_,addr, session, msg, sz, padding, is_push)
 		local req = large_request[session]
 		if req then
 			tracetag = req.tracetag
+			deadline = req.deadline
 			large_request[session] = nil
 			cluster.append(req, msg, sz)
 			msg,sz = cluster.concat(req)
@@ -69,12 +261,15 @@ local function dispatch_request(_,_,addr, session, msg, sz, padding, is_push)
 		end
 		if not msg then
 			tracetag = nil
+			deadline = nil
 			local response = cluster.packresponse(session, false, "Invalid large req")
-			socket.write(fd, response)
+			write_response(via, response)
 			return
 		end
 	end
-	local ok, response
+	local ok
+	local expire = deadline
+	deadline = nil
 	if addr == 0 then
 		local name = skynet.unpack(msg, sz)
 		skynet.trash(msg, sz)
@@ -95,6 +290,21 @@ local function dispatch_request(_,_,addr, session, msg, sz, padding, is_push)
 			if is_push then
 				skynet.rawsend(addr, "lua", msg, sz)
 				return	-- no response
+			elseif expire then
+				-- the rest of the deadline goes with the local call, the callee drops it when expired in its queue
+				local ti = expire - skynet.now()
+				tracetag = nil
+				if ti <= 0 then
+					skynet.trash(msg, sz)
+					ok, msg, sz = false, "deadline exceeded"
+				else
+					calling[session] = true
+					ok , msg, sz = pcall(skynet.rawcallttl, ti, addr, "lua", msg, sz)
+					if not calling[session] then
+						return	-- canceled
+					end
+					calling[session] = nil
+				end
 			else
 				if tracetag then
 					ok , msg, sz = pcall(skynet.tracecall, tracetag, addr, "lua", msg, sz)
@@ -108,19 +318,12 @@ local function dispatch_request(_,_,addr, session, msg, sz, padding, is_push)
 			msg = "Invalid name"
 		end
 	end
-	if ok then
-		response = cluster.packresponse(session, true, msg, sz)
-		if type(response) == "table" then
-			for _, v in ipairs(response) do
-				socket.lwrite(fd, v)
-			end
-		else
-			socket.write(fd, response)
-		end
-	else
-		response = cluster.packresponse(session, false, msg)
-		socket.write(fd, response)
-	end
+	send_response(via, session, ok, msg, sz)
+end
+
+local function dispatch_request(_,_, ...)
+	ignoreret()	-- session is fd, don't call skynet.ret
+	return dispatch_package(nil, ...)
 end
 
 skynet.start(function()
@@ -136,10 +339,18 @@ skynet.start(function()
 
 	skynet.dispatch("lua", function(_,source, cmd, ...)
 		if cmd == "exit" then
+			if shm then
+				shm:close()
+			end
+			if shm_attached then
+				shm_attached:close()
+			end
 			socket.close_fd(fd)
 			skynet.exit()
 		elseif cmd == "namechange" then
 			new_register_name()
+		elseif cmd == "read" then
+			skynet.ret(skynet.pack(read_stream(...)))
 		else
 			skynet.error(string.format("Invalid command %s from %s", cmd, skynet.address(source)))
 		end
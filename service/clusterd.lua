@@ -42,7 +42,7 @@ local function open_channel(t, key)
 		local host, port = string.match(address, "([^:]+):(.*)$")
 		c = node_sender[key]
 		if c == nil then
-			c = skynet.newservice("clustersender", key, nodename, host, port)
+			c = skynet.newservice("clustersender", key, nodename, host, port, config.lanes or 1, tostring(config.coalesce), config.compress or 0, tostring(config.shm))
 			if node_sender[key] then
 				-- double check
 				skynet.kill(c)
@@ -57,6 +57,8 @@ local function open_channel(t, key)
 		if succ then
 			t[key] = c
 			ct.channel = c
+			-- cluster.call/send in other services find the sender in the route table without asking clusterd
+			cluster.setroute("sender", key, c)
                         node_sender_closed[key] = nil
 		else
 			err = string.format("changenode [%s] (%s:%s) failed", key, host, port)
@@ -206,10 +208,12 @@ function command.register(source, name, addr)
 	local old_name = register_name[addr]
 	if old_name then
 		register_name[old_name] = nil
+		cluster.setroute("name", old_name)
 		clearnamecache()
 	end
 	register_name[addr] = name
 	register_name[name] = addr
+	cluster.setroute("name", name, addr)
 	skynet.ret(nil)
 	skynet.error(string.format("Register [%s] :%08x", name, addr))
 end
@@ -221,6 +225,7 @@ function command.unregister(_, name)
 	local addr = register_name[name]
 	register_name[addr] = nil
 	register_name[name] = nil
+	cluster.setroute("name", name)
 	clearnamecache()
 	skynet.ret(nil)
 	skynet.error(string.format("Unregister [%s] :%08x", name, addr))
@@ -2,18 +2,82 @@ local skynet = require "skynet"
 local sc = require "skynet.socketchannel"
 local socket = require "skynet.socket"
 local cluster = require "skynet.cluster.core"
+local shmchannel = require "skynet.shmchannel"
 
-local channel
 local session = 1
-local node, nodename, init_host, init_port = ...
+local node, nodename, init_host, init_port, nlane, coalesce, compress, shm_size = ...
+
+-- Each lane is a socketchannel with its own connection to the node.
+-- With more than one lane, the last one carries the multi-part (large) requests,
+-- and the others are picked by the target address, so a large message doesn't block the small ones.
+-- The messages to one address keep their order in each size class only : a small message sent after a large one
+-- to the same address may arrive first. Use one lane if the order across the sizes matters.
+nlane = tonumber(nlane) or 1
+
+-- The requests written to a lane are coalesced into one write (see socket.coalesce).
+-- By default they are flushed when the sender has no more queued messages;
+-- __coalesce = N flushes N ms after the first write, and false turns it off.
+if coalesce == nil or coalesce == "nil" then
+	coalesce = "drain"
+elseif coalesce == "false" then
+	coalesce = nil
+elseif coalesce == "true" then
+	coalesce = true
+else
+	coalesce = tonumber(coalesce) or coalesce
+end
+
+-- The requests (and the responses, told by the option package after connected)
+-- not smaller than __compress bytes are compressed.
+compress = tonumber(compress) or 0
+
+-- When the node is on the same host (a loopback address), __shm = true (or the ring size in bytes) moves all the
+-- requests to a shared memory channel after connected, see lualib/skynet/shmchannel.lua.
+-- The tcp connection stays, and it's used again if the channel is not accepted in 1 second or the node is gone.
+if shm_size == "true" then
+	shm_size = 1024 * 1024
+else
+	shm_size = tonumber(shm_size)
+end
+
+local lanes = {}
+local shm	-- the shared memory lane, false if it's not available, nil if not negotiated yet
+
+local function select_lane(addr, padding)
+	if shm_size and shm == nil then
+		-- connect the first lane, and negotiate the shared memory in auth
+		lanes[1]:connect(true)
+	end
+	if shm then
+		return shm
+	end
+	if nlane == 1 then
+		return lanes[1]
+	end
+	if padding then
+		return lanes[nlane]
+	end
+	local h
+	if type(addr) == "number" then
+		h = addr
+	else
+		h = #addr
+		for i = 1, #addr do
+			h = (h * 31 + addr:byte(i)) & 0x7fffffff
+		end
+	end
+	return lanes[h % (nlane - 1) + 1]
+end
 
 local command = {}
 
-local function send_request(addr, msg, sz)
+-- ttl and req are given by command.reqttl, the lane and the session of the request are kept in req for the cancel
+local function send_request(addr, msg, sz, ttl, req)
 	-- msg is a local pointer, cluster.packrequest will free it
 	local current_session = session
-	local request, new_session, padding = cluster.packrequest(addr, session, msg, sz)
+	local request, new_session, padding = cluster.packrequest(addr, session, msg, sz, compress)
 	session = new_session
+	local channel = select_lane(addr, padding)
 
 	local tracetag = skynet.tracetag()
 	if tracetag then
@@ -26,6 +90,11 @@ local function send_request(addr, msg, sz)
 		skynet.tracelog(tracetag, string.format("cluster %s", node))
 		channel:request(cluster.packtrace(tracetag))
 	end
+	if ttl then
+		channel:request(cluster.packdeadline(ttl))
+		req.channel = channel
+		req.session = current_session
+	end
 	return channel:request(request, current_session, padding)
 end
 
@@ -43,13 +112,243 @@ function command.req(...)
 	end
 end
 
+local function rawpack(...)
+	return ...
+end
+
+-- Like req, but the caller gives up after ttl (in 1/100 sec). The node is told the deadline with the request,
+-- and told to cancel it when the caller gives up ; the late response is dropped.
+function command.reqttl(ttl, addr, msg, sz)
+	local response = skynet.response(rawpack)
+	local req = {}
+	local timer = skynet.timeout(ttl, function()
+		local r = response
+		response = nil
+		r(false)
+		if req.channel then
+			pcall(req.channel.request, req.channel, cluster.packcancel(req.session))
+		end
+	end)
+	local ok, msg = pcall(send_request, addr, msg, sz, ttl, req)
+	local r = response
+	if not r then
+		return
+	end
+	response = nil
+	skynet.canceltimeout(timer)
+	if ok then
+		if type(msg) == "table" then
+			r(true, cluster.concat(msg))
+		else
+			r(true, msg)
+		end
+	else
+		skynet.error(msg)
+		r(false)
+	end
+end
+
 function command.push(addr, msg, sz)
-	local request, new_session, padding = cluster.packpush(addr, session, msg, sz)
+	local request, new_session, padding = cluster.packpush(addr, session, msg, sz, compress)
 	if padding then	-- is multi push
 		session = new_session
 	end
 
-	channel:request(request, nil, padding)
+	select_lane(addr, padding):request(request, nil, padding)
+end
+
+-- All the packages of a stream go through one lane in low priority, so they keep their order.
+-- An ack request follows every STREAM_WINDOW/2 chunks, the node answers it when the callee has read the chunks before it,
+-- and the caller of cluster.stream waits for the previous ack, so no more than STREAM_WINDOW chunks are not acknowledged.
+local STREAM_WINDOW = 16
+local stream_lane = {}	-- session -> { channel, count (chunks since the last ack request), acking, waiting, err }
+local nopadding = {}
+
+function command.streambegin(addr, msg, sz)
+	local current_session = session
+	local ok, request, new_session = pcall(cluster.packstream, addr, session, msg, sz)
+	if not ok then
+		skynet.error(request)
+		skynet.response()(false)
+		return
+	end
+	session = new_session
+	local channel = select_lane(addr, true)
+	stream_lane[current_session] = { channel = channel, count = 0, acking = 0 }
+	channel:request(request, nil, nopadding)
+	skynet.ret(skynet.pack(current_session))
+end
+
+function command.streamchunk(stream_session, chunk)
+	local s = stream_lane[stream_session]
+	if s.err then
+		skynet.error(s.err)
+		skynet.response()(false)
+		return
+	end
+	local channel = s.channel
+	local request = cluster.packchunk(stream_session, chunk)
+	if type(request) == "table" then
+		channel:request(table.remove(request, 1), nil, request)
+	else
+		channel:request(request, nil, nopadding)
+	end
+	s.count = s.count + 1
+	if s.count < STREAM_WINDOW // 2 then
+		skynet.ret()
+		return
+	end
+	s.count = 0
+	local ack_session = session
+	local ack_request
+	ack_request, session = cluster.packstreamack(stream_session, ack_session)
+	local response = skynet.response()
+	if s.acking == 0 then
+		response(true)
+	else
+		-- the previous ack is not answered yet, the caller waits for it
+		s.waiting = response
+	end
+	s.acking = s.acking + 1
+	local ok, err = pcall(channel.request, channel, ack_request, ack_session)
+	s.acking = s.acking - 1
+	if not ok then
+		s.err = err
+	end
+	local r = s.waiting
+	if r then
+		s.waiting = nil
+		if not ok then
+			skynet.error(err)
+		end
+		r(ok)
+	end
+end
+
+function command.streamend(stream_session)
+	local channel = stream_lane[stream_session].channel
+	stream_lane[stream_session] = nil
+	local ok, msg = pcall(channel.request, channel, cluster.packchunk(stream_session), stream_session, nopadding)
+	if ok then
+		if type(msg) == "table" then
+			skynet.ret(cluster.concat(msg))
+		else
+			skynet.ret(msg)
+		end
+	else
+		skynet.error(msg)
+		skynet.response()(false)
+	end
+end
+
+-- The shared memory lane has the same request method as the socket channel
+local shm_lane = {}
+local shm_lane_meta = { __index = shm_lane }
+
+local function shm_close(lane, err)
+	if shm == lane then
+		shm = false
+	end
+	lane.channel:close()
+	local wait = lane.wait
+	lane.wait = {}
+	for _, w in pairs(wait) do
+		w.ok = false
+		w.data = err
+		skynet.wakeup(w.co)
+	end
+end
+
+function shm_lane:request(request, response, padding)
+	local w
+	if response then
+		w = { co = coroutine.running() }
+		self.wait[response] = w
+	end
+	local c = self.channel
+	c:write(request)
+	if padding then
+		for _, v in ipairs(padding) do
+			c:write(v)
+		end
+	end
+	if w then
+		skynet.wait(w.co)
+		assert(w.ok, w.data)
+		return w.data
+	end
+end
+
+local function shm_response(lane, pkg)
+	local session, ok, data, padding = cluster.unpackresponse(pkg)
+	local w = lane.wait[session]
+	if not w then
+		skynet.error("cluster: unknown shm session :", session)
+		return
+	end
+	if padding and ok then
+		local parts = w.parts or {}
+		w.parts = parts
+		parts[#parts+1] = data
+	else
+		lane.wait[session] = nil
+		w.ok = ok
+		if ok and w.parts then
+			table.insert(w.parts, data)
+			data = w.parts
+		end
+		w.data = data
+		skynet.wakeup(w.co)
+	end
+end
+
+local shm_serial = 0
+
+local loopback = { ["127.0.0.1"] = true, ["localhost"] = true, ["::1"] = true }
+
+local function shm_negotiate(channel)
+	if shm then
+		-- reconnected, the node may be restarted
+		shm_close(shm, "cluster shm channel closed")
+	end
+	-- the requests wait for the negotiation in select_lane
+	shm = nil
+	if not loopback[channel.__host] then
+		shm = false
+		return
+	end
+	shm_serial = shm_serial + 1
+	local path = string.format("/dev/shm/skynet-%s-%08x-%d", cluster.nodename(), skynet.self(), shm_serial)
+	local ok, c = pcall(shmchannel.create, path, shm_size)
+	if not ok then
+		skynet.error(c)
+		shm = false
+		return
+	end
+	channel:request(cluster.packshm(path))
+	-- the node uses the channel after the confirm, and closes it if it's attached after we give up
+	if not c:wait_attach(100) then
+		skynet.error(string.format("cluster: %s doesn't accept shm, use tcp", node))
+		channel:request(cluster.packshm(path, false))
+		c:close()
+		shm = false
+		return
+	end
+	channel:request(cluster.packshm(path, true))
+	local lane = setmetatable({ channel = c, wait = {} }, shm_lane_meta)
+	c:start(function(pkg)
+		shm_response(lane, pkg)
+	end)
+	shm = lane
+	skynet.fork(function()
+		while shm == lane do
+			skynet.sleep(100)
+			if shm == lane and not c:alive() then
+				skynet.error(string.format("cluster: shm of %s is gone, use tcp", node))
+				shm_close(lane, "cluster shm peer is gone")
+			end
+		end
+	end)
 end
 
 local function read_response(sock)
@@ -60,22 +359,45 @@ end
 
 function command.changenode(host, port)
 	if not host then
-		skynet.error(string.format("Close cluster sender %s:%d", channel.__host, channel.__port))
-		channel:close()
+		skynet.error(string.format("Close cluster sender %s:%d", lanes[1].__host, lanes[1].__port))
+		if shm then
+			shm_close(shm, "cluster sender closed")
+		end
+		shm = nil
+		for _, channel in ipairs(lanes) do
+			channel:close()
+		end
 	else
-		channel:changehost(host, tonumber(port))
-		channel:connect(true)
+		if shm then
+			shm_close(shm, "cluster node changed")
+		end
+		shm = nil
+		for _, channel in ipairs(lanes) do
+			channel:changehost(host, tonumber(port))
+			channel:connect(true)
+		end
 	end
 	skynet.ret(skynet.pack(nil))
 end
 
 skynet.start(function()
-	channel = sc.channel {
+	for i = 1, nlane do
+		lanes[i] = sc.channel {
 			host = init_host,
 			port = tonumber(init_port),
 			response = read_response,
+			auth = (compress > 0 or (shm_size and i == 1)) and function(channel)
+				if compress > 0 then
+					channel:request(cluster.packoption(compress))
+				end
+				if shm_size and i == 1 then
+					shm_negotiate(channel)
+				end
+			end,
 			nodelay = true,
+			coalesce = coalesce,
 		}
+	end
 	skynet.dispatch("lua", function(session , source, cmd, ...)
 		local f = assert(command[cmd])
 		f(...)
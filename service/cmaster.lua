@@ -23,6 +23,9 @@ local socket = require "skynet.socket"
 			'C' : CONNECT slave_id slave_address
 			'N' : NAME globalname address
 			'D' : DISCONNECT slave_id
+
+	After 'W', master sends 'N' for every registered global name, so the slave
+	knows all the names before it is ready and needn't query them one by one.
 ]]
 
 local slave_node = {}
@@ -63,6 +66,14 @@ local function handshake(fd)
 		error(string.format("Slave %d already register on %s", slave_id, slave_node[slave_id].addr))
 	end
 	report_slave(fd, slave_id, slave_addr)
+	-- prefetch all the global names in one write
+	local names = {}
+	for name, address in pairs(global_name) do
+		table.insert(names, pack_package("N", name, address))
+	end
+	if #names > 0 then
+		socket.write(fd, names)
+	end
 	slave_node[slave_id] = {
 		fd = fd,
 		id = slave_id,
@@ -8,6 +8,8 @@ local slaves = {}
 local connect_queue = {}
 local globalname = {}
 local queryname = {}
+local negative = {}	-- name -> time of the last master query that found nothing
+local NEGATIVE_TTL = 100	-- don't ask master again for an unknown name within 1s
 local harbor = {}
 local harbor_service
 local monitor = {}
@@ -89,6 +91,7 @@ local function monitor_master(master_fd)
 				end
 			elseif t == 'N' then
 				globalname[id_name] = address
+				negative[id_name] = nil
 				response_name(id_name)
 				if connect_queue == nil then
 					skynet.redirect(harbor_service, address, "harbor", 0, "N " .. id_name)
@@ -156,7 +159,14 @@ local function monitor_harbor(master_fd)
 			if globalname[arg] then
 				skynet.redirect(harbor_service, globalname[arg], "harbor", 0, "N " .. arg)
 			else
-				socket.write(master_fd, pack_package("Q", arg))
+				-- all the names are prefetched at handshake and new ones are pushed by master,
+				-- so an unknown name is cached as negative for a while.
+				local now = skynet.now()
+				local last = negative[arg]
+				if not last or now - last >= NEGATIVE_TTL then
+					negative[arg] = now
+					socket.write(master_fd, pack_package("Q", arg))
+				end
 			end
 		elseif t == 'D' then
 			-- harbor down
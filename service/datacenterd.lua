@@ -1,10 +1,22 @@
 local skynet = require "skynet"
+local datacenter = require "skynet.datacenter"
+
+local role = ...	-- nil for the DATACENTER master, "shard" for the others
 
 local command = {}
 local database = {}
 local wait_queue = {}
 local mode = {}
 
+local shards	-- master only: shard addresses, shards[1] is the master itself
+
+-- change log for client caches: log[v] is the top-level key changed in version v
+local LOGMAX = 4096
+local version = 0
+local log = {}
+local watchers = {}
+local watchers_check = 64	-- drop the watchers of the dead services when there are so many
+
 local function query(db, key, ...)
 	if db == nil or key == nil then
 		return db
@@ -57,12 +69,26 @@ local function wakeup(db, key1, ...)
 	end
 end
 
-function command.UPDATE(...)
-	local ret, value = update(database, ...)
+local function changed(key)
+	version = version + 1
+	log[version] = key
+	log[version - LOGMAX] = nil
+	if next(watchers) then
+		local w = watchers
+		watchers = {}
+		for _, response in ipairs(w) do
+			response(true, version, { key })
+		end
+	end
+end
+
+function command.UPDATE(key, ...)
+	changed(key)
+	local ret, value = update(database, key, ...)
 	if ret ~= nil or value == nil then
 		return ret
 	end
-	local q = wakeup(wait_queue, ...)
+	local q = wakeup(wait_queue, key, ...)
 	if q then
 		for _, response in ipairs(q) do
 			response(true,value)
@@ -93,18 +119,81 @@ local function waitfor(db, key1, key2, ...)
 	end
 end
 
+-- query for a client cache, returns the version the value belongs to
+function command.CQUERY(...)
+	return version, command.QUERY(...)
+end
+
+function command.SHARDS()
+	return shards
+end
+
+local function watch(v)
+	if v < version then
+		if v < version - LOGMAX then
+			-- too old, drop the whole cache
+			return version
+		end
+		local keys = {}
+		local set = {}
+		for i = v + 1, version do
+			local k = log[i]
+			if not set[k] then
+				set[k] = true
+				keys[#keys+1] = k
+			end
+		end
+		skynet.ret(skynet.pack(version, keys))
+	else
+		local n = #watchers
+		if n >= watchers_check then
+			-- the response of a dead service is dropped (see skynet.response), it can't be answered
+			local alive = {}
+			for i = 1, n do
+				local response = watchers[i]
+				if response("TEST") then
+					alive[#alive+1] = response
+				end
+			end
+			watchers = alive
+			watchers_check = math.max(64, #alive * 2)
+		end
+		table.insert(watchers, skynet.response())
+	end
+end
+
 skynet.start(function()
-	skynet.dispatch("lua", function (_, _, cmd, ...)
-		if cmd == "WAIT" then
-			local ret = command.QUERY(...)
+	if role == nil then
+		local n = math.tointeger(tonumber(skynet.getenv "datacenter_shard")) or 1
+		shards = { skynet.self() }
+		for i = 2, n do
+			shards[i] = skynet.newservice(SERVICE_NAME, "shard")
+		end
+	end
+	skynet.dispatch("lua", function (_, _, cmd, key, ...)
+		if shards and shards[2] and key ~= nil and cmd ~= "WATCH" then
+			-- requests from old clients which don't know the shards
+			local s = shards[datacenter.shard_index(#shards, key)]
+			if s ~= skynet.self() then
+				skynet.ret(skynet.tostring(skynet.rawcall(s, "lua", skynet.pack(cmd, key, ...))))
+				return
+			end
+		end
+		if cmd == "WATCH" then
+			local v = watch(key)
+			if v then
+				skynet.ret(skynet.pack(v, true))
+			end
+		elseif cmd == "WAIT" then
+			local ret = command.QUERY(key, ...)
 			if ret ~= nil then
 				skynet.ret(skynet.pack(ret))
 			else
-				waitfor(wait_queue, ...)
+				waitfor(wait_queue, key, ...)
 			end
 		else
 			local f = assert(command[cmd])
-			skynet.ret(skynet.pack(f(...)))
+			skynet.ret(skynet.pack(f(key, ...)))
 		end
 	end)
 end)
@@ -4,6 +4,8 @@ local core = require "skynet.core"
 local socket = require "skynet.socket"
 local snax = require "skynet.snax"
 local memory = require "skynet.memory"
+local tracering = require "skynet.tracering"
+local metrics = require "skynet.metrics"
 local httpd = require "http.httpd"
 local sockethelper = require "http.sockethelper"
 
@@ -145,14 +147,21 @@ function COMMAND.help()
 		help = "This help message",
 		list = "List all the service",
 		stat = "Dump all stats",
+		top = "top [cpu|msg|mqlen|mem|dmem] [seconds] [rows] [times] : refresh the busiest services every seconds (default cpu 1 20 10), read from the C counters without messages to them",
 		info = "info address : get service infomation",
 		exit = "exit address : kill a lua service",
 		kill = "kill address : kill service",
 		mem = "mem : show memory status",
 		gc = "gc : force every lua service do garbage collect",
+		gcstat = "gcstat : show the allocation rate, gc steps and the worst gc stall of every lua service",
+		cpuprof = "cpuprof address [us|off] : sample the lua stack of a service every us microseconds (default 10000)",
+		cpustat = "cpustat address [on|off] [n] : the coroutine tasks (by message or function) using the most cpu time in a lua service",
+		cpufold = "cpufold address : dump cpu samples of a service as folded stacks for flamegraph.pl",
+		gcpolicy = "gcpolicy address [generational|incremental] [idle=KB] [busy=N] [pause=N] ... : show or set the gc policy of a lua service",
 		start = "lanuch a new lua service",
 		snax = "lanuch a new snax service",
-		clearcache = "clear lua code cache",
+		clearcache = "clear lua code cache and resolved paths",
+		clearpath = "clear resolved paths of lua services and modules, after adding a file that shadows an old one",
 		service = "List unique service",
 		task = "task address : show service task detail",
 		uniqtask = "task address : show service unique task detail",
@@ -164,12 +173,20 @@ function COMMAND.help()
 		signal = "signal address sig",
 		cmem = "Show C memory info",
 		jmem = "Show jemalloc mem stats",
+		jpurge = "jpurge [arena] : return unused pages of jemalloc arenas (all by default) to the system, show how much it releases",
 		ping = "ping address",
 		call = "call address ...",
 		trace = "trace address [proto] [on|off]",
+		latency = "latency address [on|off|reset] : histograms of queue wait and handler time of a service (in seconds)",
 		netstat = "netstat : show netstat",
+		sockstat = "sockstat [address] : show socket stat of services",
 		profactive = "profactive [on|off] : active/deactive jemalloc heap profilling",
 		dumpheap = "dumpheap : dump heap profilling",
+		heapsample = "heapsample [bytes|off] : sample a C allocation every bytes, tagged with service and call site",
+		heaptop = "heaptop [address|all] [n] : top n sites of sampled live C memory per service",
+		worker = "worker [n] : show or resize the worker threads (up to thread_max in config)",
+		tracering = "tracering [on|off] : record every dispatched message in the ring of each worker thread",
+		tracedump = "tracedump [filename] : write the trace rings as a Chrome/Perfetto trace (default trace.json)",
 		killtask = "killtask address threadname : threadname listed by task",
 		dbgcmd = "run address debug command",
 		getenv = "getenv name : skynet.getenv(name)",
@@ -181,6 +198,10 @@ function COMMAND.clearcache()
 	codecache.clear()
 end
 
+function COMMAND.clearpath()
+	codecache.clearpath()
+end
+
 function COMMAND.start(...)
 	local ok, addr = pcall(skynet.newservice, ...)
 	if ok then
@@ -231,6 +252,15 @@ local function adjust_address(address)
 	return address
 end
 
+-- adjust_address keeps ":xxxxxxxx" as a string, the C side wants the handle number
+local function adjust_handle(address)
+	address = adjust_address(address)
+	if type(address) == "string" then
+		address = assert(tonumber(address:sub(2), 16), "Need an address")
+	end
+	return address
+end
+
 function COMMAND.list()
 	return skynet.call(".launcher", "lua", "LIST")
 end
@@ -263,6 +293,96 @@ function COMMAND.gc(ti)
 	return skynet.call(".launcher", "lua", "GC", timeout(ti))
 end
 
+function COMMAND.gcstat(ti)
+	return skynet.call(".launcher", "lua", "GCSTAT", timeout(ti))
+end
+
+-- gcpolicy address [mode] [key=value] ... , see skynet.gcpolicy
+function COMMAND.gcpolicy(address, ...)
+	address = adjust_address(address)
+	local policy
+	for _, v in ipairs {...} do
+		policy = policy or {}
+		local key, value = v:match "^(%w+)=(.+)$"
+		if key then
+			policy[key] = assert(math.tointeger(tonumber(value)), "Need an integer")
+		else
+			policy.mode = v
+		end
+	end
+	return skynet.call(address, "debug", "GCPOLICY", policy)
+end
+
+function COMMAND.cpuprof(address, interval)
+	address = adjust_address(address)
+	if interval == "off" then
+		interval = 0
+	end
+	interval = math.tointeger(tonumber(interval or 10000))
+	assert(interval, "Need an interval in microseconds")
+	skynet.call(address, "debug", "CPUPROF", interval)
+	if interval == 0 then
+		return "cpu sample is off"
+	end
+	return "cpu sample every " .. interval .. "us"
+end
+
+-- output is in the folded format of flamegraph.pl : "root;...;leaf count"
+function COMMAND.cpufold(address)
+	address = adjust_address(address)
+	local stacks = skynet.call(address, "debug", "CPUSAMPLES")
+	local lines = {}
+	for stack, count in pairs(stacks) do
+		table.insert(lines, { stack, count })
+	end
+	table.sort(lines, function(a, b) return a[2] > b[2] end)
+	for i, v in ipairs(lines) do
+		lines[i] = v[1] .. " " .. v[2]
+	end
+	return table.concat(lines, "\n")
+end
+
+-- cpustat address [on|off] [n] : the top n (default 10) labels and unfinished tasks by cpu time
+function COMMAND.cpustat(address, flag, n)
+	address = adjust_address(address)
+	if flag == "on" then
+		flag = true
+	elseif flag == "off" then
+		flag = false
+	else
+		n = flag
+		flag = nil
+	end
+	n = math.tointeger(tonumber(n or 10))
+	local stat, tasks = skynet.call(address, "debug", "CPUSTAT", flag)
+	if not stat then
+		return "cpustat is off"
+	end
+	local function top(t, fmt)
+		local list = {}
+		for k, v in pairs(t) do
+			table.insert(list, { k, v })
+		end
+		table.sort(list, function(a, b) return a[2].cpu > b[2].cpu end)
+		local lines = {}
+		for i = 1, math.min(n, #list) do
+			lines[i] = fmt(list[i][1], list[i][2])
+		end
+		return lines
+	end
+	local lines = top(stat, function(label, v)
+		return string.format("%s\tcpu:%.3fms\tresume:%d\ttask:%d", label, v.cpu / 1000, v.resume, v.task)
+	end)
+	local running = top(tasks, function(co, v)
+		return string.format("%s %s\tcpu:%.3fms\tresume:%d", co, v[1], v.cpu / 1000, v.resume)
+	end)
+	if #running > 0 then
+		table.insert(lines, "-- unfinished tasks")
+		table.move(running, 1, #running, #lines + 1, lines)
+	end
+	return table.concat(lines, "\n")
+end
+
 function COMMAND.exit(address)
 	skynet.send(adjust_address(address), "debug", "EXIT")
 end
@@ -372,12 +492,35 @@ function COMMAND.cmem()
 	return tmp
 end
 
+local function purge_info(tmp, stat)
+	local last = stat.last_arena < 0 and "all arenas" or "arena " .. stat.last_arena
+	tmp["purge.last"] = string.format("%11d  %8.2f Mb from %s in %d us", stat.last_bytes, stat.last_bytes/1048576, last, stat.last_usec)
+	tmp["purge.total"] = string.format("%11d  %8.2f Mb in %d purges", stat.bytes, stat.bytes/1048576, stat.count)
+end
+
 function COMMAND.jmem()
 	local info = memory.jestat()
 	local tmp = {}
 	for k,v in pairs(info) do
 		tmp[k] = string.format("%11d  %8.2f Mb", v, v/1048576)
 	end
+	purge_info(tmp, memory.purgestat())
+	return tmp
+end
+
+function COMMAND.jpurge(arena)
+	if arena then
+		arena = assert(math.tointeger(tonumber(arena)), "Need an arena id")
+	end
+	local released = memory.purge(arena)
+	local stat = memory.purgestat()
+	local dirty, muzzy = memory.decay()
+	local tmp = {
+		released = string.format("%11d  %8.2f Mb", released, released/1048576),
+		decay = string.format("dirty %d ms, muzzy %d ms", dirty, muzzy),
+		idle = stat.interval > 0 and string.format("every %d ms", stat.interval) or "off",
+	}
+	purge_info(tmp, stat)
 	return tmp
 end
 
@@ -417,6 +560,80 @@ function COMMANDX.call(cmd)
 	return rets
 end
 
+local function human_size(size)
+	local a = math.abs(size)
+	if a < 1024 then
+		return string.format("%d", size)
+	elseif a < 1024 * 1024 then
+		return string.format("%.1fK", size / 1024)
+	elseif a < 1024 * 1024 * 1024 then
+		return string.format("%.1fM", size / (1024 * 1024))
+	end
+	return string.format("%.2fG", size / (1024 * 1024 * 1024))
+end
+
+local TOP_COLUMN = { cpu = true, msg = true, mqlen = true, mem = true, dmem = true }
+
+-- The counters are sampled from C (skynet.metrics and the malloc hook), only the names come from the launcher.
+function COMMANDX.top(cmd)
+	local column = cmd[2] or "cpu"
+	assert(TOP_COLUMN[column], "Invalid column " .. column)
+	local interval = tonumber(cmd[3]) or 1
+	local rows = math.tointeger(tonumber(cmd[4])) or 20
+	local times = math.tointeger(tonumber(cmd[5])) or 10
+	assert(interval > 0 and rows > 0 and times > 0, "Invalid arguments")
+	local fd = cmd.fd
+	local function sample()
+		return metrics.services(), memory.info(), skynet.hpc()
+	end
+	local last_stat, last_mem, last_time = sample()
+	for i = 1, times do
+		skynet.sleep(interval * 100)
+		local stat, mem, now = sample()
+		local names = skynet.call(".launcher", "lua", "LIST")
+		local elapsed = (now - last_time) / 1e9
+		local list = {}
+		local total_cpu, total_msg = 0, 0
+		for handle, st in pairs(stat) do
+			local last = last_stat[handle]
+			local m = mem[handle] or 0
+			local item = {
+				handle = handle,
+				cpu = last and (st.cpu - last.cpu) / elapsed * 100 or 0,
+				msg = last and (st.message - last.message) / elapsed or 0,
+				mqlen = st.mqlen,
+				mem = m,
+				dmem = m - (last_mem[handle] or m),
+			}
+			total_cpu = total_cpu + item.cpu
+			total_msg = total_msg + item.msg
+			list[#list+1] = item
+		end
+		table.sort(list, function(a, b)
+			local x, y = a[column], b[column]
+			if x ~= y then
+				return x > y
+			end
+			return a.handle < b.handle
+		end)
+		local node = metrics.node()
+		local out = {
+			string.format("top %d/%d  services %d  workers %d (sleep %d)  globalmq %d  cpu %.1f%%  msg %.0f/s  sorted by %s",
+				i, times, #list, node.worker, node.sleep, node.globalmq, total_cpu, total_msg, column),
+			string.format("%-10s %7s %9s %7s %9s %9s  %s", "address", "cpu%", "msg/s", "mqlen", "mem", "dmem", "name"),
+		}
+		for j = 1, math.min(rows, #list) do
+			local item = list[j]
+			local addr = skynet.address(item.handle)
+			out[#out+1] = string.format("%-10s %7.1f %9.0f %7d %9s %9s  %s", addr, item.cpu, item.msg, item.mqlen,
+				human_size(item.mem), item.dmem == 0 and "" or human_size(item.dmem), names[addr] or "")
+		end
+		out[#out+1] = ""
+		socket.write(fd, table.concat(out, "\n") .. "\n")
+		last_stat, last_mem, last_time = stat, mem, now
+	end
+end
+
 local function bytes(size)
 	if size == nil or size == 0 then
 		return
@@ -452,10 +669,16 @@ local function convert_stat(info)
 	info.read = bytes(info.read)
 	info.write = bytes(info.write)
 	info.wbuffer = bytes(info.wbuffer)
+	info.wbuffer_peak = bytes(info.wbuffer_peak)
 	info.rtime = time(info.rtime)
 	info.wtime = time(info.wtime)
 end
 
+function COMMAND.latency(address, flag)
+	address = adjust_address(address)
+	return skynet.call(address, "debug", "LATENCY", flag)
+end
+
 function COMMAND.netstat()
 	local stat = socket.netstat()
 	for _, info in ipairs(stat) do
@@ -464,6 +687,59 @@ function COMMAND.netstat()
 	return stat
 end
 
+function COMMAND.sockstat(address)
+	local list = {}
+	local function convert(handle, info)
+		info.read = bytes(info.read)
+		info.write = bytes(info.write)
+		info.wbuffer_peak = bytes(info.wbuffer_peak)
+		info.rhistogram = table.concat(info.rhistogram, " ")
+		info.whistogram = table.concat(info.whistogram, " ")
+		list[skynet.address(handle)] = info
+	end
+	if address then
+		address = adjust_handle(address)
+		local info = socket.stat(address)
+		if info then
+			convert(address, info)
+		end
+	else
+		for handle, info in pairs(socket.stat()) do
+			convert(handle, info)
+		end
+	end
+	return list
+end
+
+function COMMAND.heapsample(interval)
+	if interval ~= nil then
+		if interval == "off" then
+			interval = 0
+		end
+		interval = assert(math.tointeger(tonumber(interval)), "Need an interval in bytes")
+		memory.heapsample(interval)
+	end
+	interval = memory.heapsample()
+	if interval == 0 then
+		return "heap sample is off"
+	end
+	return "heap sample every " .. bytes(interval)
+end
+
+function COMMAND.heaptop(address, n)
+	local handle = address and address ~= "all" and adjust_handle(address) or nil
+	n = tonumber(n) or 10
+	local list = {}
+	for h, info in pairs(memory.heaptop(handle, n)) do
+		local addr = skynet.address(h)
+		list[addr] = string.format("%s in %d blocks", bytes(info.bytes), info.count)
+		for i, site in ipairs(info.sites) do
+			list[string.format("%s #%02d", addr, i)] = string.format("%s %d %s", bytes(site.bytes), site.count, site.site)
+		end
+	end
+	return list
+end
+
 function COMMAND.dumpheap()
 	memory.dumpheap()
 end
@@ -479,6 +755,28 @@ function COMMAND.profactive(flag)
 	return "heap profilling is ".. (active and "active" or "deactive")
 end
 
+function COMMAND.worker(n)
+	local count = core.intcommand("WORKER", tonumber(n) or 0)
+	return "worker threads : " .. count
+end
+
+function COMMAND.tracering(flag)
+	if flag ~= nil then
+		tracering.enable(toboolean(flag))
+	end
+	return "trace ring is " .. (tracering.enable() and "on" or "off")
+end
+
+-- open it by chrome://tracing or https://ui.perfetto.dev
+function COMMAND.tracedump(filename)
+	filename = filename or "trace.json"
+	local json, n = tracering.chrome()
+	local f = assert(io.open(filename, "wb"))
+	f:write(json)
+	f:close()
+	return string.format("%d messages in %s", n, filename)
+end
+
 function COMMAND.getenv(name)
 	local value = skynet.getenv(name)
 	return {[name]=tostring(value)}
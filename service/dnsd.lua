@@ -0,0 +1,40 @@
+local skynet = require "skynet"
+local dns = require "skynet.dns"
+
+-- The dns cache shared by the services of this node, when dns_shared = "true" in config.
+-- The lookups of one name from all the services share one query, see lualib/skynet/dns.lua
+
+dns.shared(false)
+
+local command = {}
+
+-- return answers and the ticks before they expire, or false, err
+function command.RESOLVE(name, ipv6)
+	local ok, ip, answers = pcall(dns.resolve, name, ipv6)
+	if not ok then
+		return false, ip
+	end
+	if not ip then
+		return false, answers
+	end
+	return answers or { ip }, dns.ttl(name, ipv6)
+end
+
+function command.SERVER(server, port)
+	dns.server(server, port)
+end
+
+function command.FLUSH()
+	dns.flush()
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session, _, cmd, ...)
+		local f = assert(command[cmd])
+		if session == 0 then
+			f(...)
+		else
+			skynet.ret(skynet.pack(f(...)))
+		end
+	end)
+end)
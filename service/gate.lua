@@ -4,6 +4,23 @@ local gateserver = require "snax.gateserver"
 local watchdog
 local connection = {}	-- fd -> connection : { fd , client, agent , ip, mode }
 
+-- Sharded mode (conf.shard = N) : the gate opened by the watchdog (master) launches N-1 more gates,
+-- all listening on the same port with SO_REUSEPORT. Each gate owns the connections it accepts.
+-- Shards report socket events through the master, so the master knows the owner of every fd
+-- before the watchdog sees it, and routes forward/accept/kick to the owner.
+local master	-- shard only : the master gate
+local shards = {}	-- master only : the other gates
+local owner = {}	-- master only : fd -> shard gate
+
+-- report socket event to watchdog
+local function report(...)
+	if master then
+		skynet.send(master, "lua", "shard", ...)
+	else
+		skynet.send(watchdog, "lua", "socket", ...)
+	end
+end
+
 skynet.register_protocol {
 	name = "client",
 	id = skynet.PTYPE_CLIENT,
@@ -13,9 +30,32 @@ local handler = {}
 
 function handler.open(source, conf)
 	watchdog = conf.watchdog or source
+	master = conf.master
+	local n = conf.shard or 1
+	if n > 1 and not master then
+		for i = 2, n do
+			local c = {}
+			for k,v in pairs(conf) do
+				c[k] = v
+			end
+			c.shard = nil
+			c.reuseport = true
+			c.master = skynet.self()
+			c.watchdog = watchdog
+			local gate = skynet.newservice(SERVICE_NAME)
+			skynet.call(gate, "lua", "open", c)
+			shards[#shards+1] = gate
+		end
+	end
 	return conf.address, conf.port
 end
 
+function handler.close(source)
+	for _, gate in ipairs(shards) do
+		skynet.call(gate, "lua", "close")
+	end
+end
+
 function handler.message(fd, msg, sz)
 	-- recv a package, forward it
 	local c = connection[fd]
@@ -24,7 +64,7 @@ function handler.message(fd, msg, sz)
 		-- It's safe to redirect msg directly , gateserver framework will not free msg.
 		skynet.redirect(agent, c.client, "client", fd, msg, sz)
 	else
-		skynet.send(watchdog, "lua", "socket", "data", fd, skynet.tostring(msg, sz))
+		report("data", fd, skynet.tostring(msg, sz))
 		-- skynet.tostring will copy msg to a string, so we must free msg here.
 		skynet.trash(msg,sz)
 	end
@@ -36,7 +76,7 @@ function handler.connect(fd, addr)
 		ip = addr,
 	}
 	connection[fd] = c
-	skynet.send(watchdog, "lua", "socket", "open", fd, addr)
+	report("open", fd, addr)
 end
 
 local function unforward(c)
@@ -56,21 +96,37 @@ end
 
 function handler.disconnect(fd)
 	close_fd(fd)
-	skynet.send(watchdog, "lua", "socket", "close", fd)
+	report("close", fd)
 end
 
 function handler.error(fd, msg)
 	close_fd(fd)
-	skynet.send(watchdog, "lua", "socket", "error", fd, msg)
+	report("error", fd, msg)
 end
 
 function handler.warning(fd, size)
-	skynet.send(watchdog, "lua", "socket", "warning", fd, size)
+	report("warning", fd, size)
 end
 
 local CMD = {}
 
+-- master only : socket event from a shard
+function CMD.shard(source, event, fd, ...)
+	if event == "open" then
+		owner[fd] = source
+	elseif event == "close" or event == "error" then
+		owner[fd] = nil
+		-- groups are kept in the master
+		gateserver.leaveall(fd)
+	end
+	skynet.send(watchdog, "lua", "socket", event, fd, ...)
+end
+
 function CMD.forward(source, fd, client, address)
+	local gate = owner[fd]
+	if gate then
+		return skynet.call(gate, "lua", "forward", fd, client, address or source)
+	end
 	local c = assert(connection[fd])
 	unforward(c)
 	c.client = client or 0
@@ -79,12 +135,20 @@ function CMD.forward(source, fd, client, address)
 end
 
 function CMD.accept(source, fd)
+	local gate = owner[fd]
+	if gate then
+		return skynet.call(gate, "lua", "accept", fd)
+	end
 	local c = assert(connection[fd])
 	unforward(c)
 	gateserver.openclient(fd)
 end
 
 function CMD.kick(source, fd)
+	local gate = owner[fd]
+	if gate then
+		return skynet.call(gate, "lua", "kick", fd)
+	end
 	gateserver.closeclient(fd)
 end
 
@@ -14,6 +14,49 @@ end
 
 local NORET = {}
 
+-- warmpool : keep this many snlua services (service/warm.lua) with skynet loaded,
+-- and hand them to skynet.newservice instead of starting a lua vm from scratch
+local warmpool = math.tointeger(tonumber(skynet.getenv "warmpool")) or 0
+local warm_ready = {}	-- array of { address, response }, waiting in command.WARM
+local warm_starting = {}	-- address -> true, launched but not ready yet
+
+local function warm_fill()
+	local n = #warm_ready
+	for _ in pairs(warm_starting) do
+		n = n + 1
+	end
+	for i = n + 1, warmpool do
+		local inst = skynet.launch("snlua", "warm", skynet.self())
+		if not inst then
+			break
+		end
+		services[inst] = "snlua warm"
+		warm_starting[inst] = true
+	end
+end
+
+local function warm_remove(handle)
+	warm_starting[handle] = nil
+	for i, w in ipairs(warm_ready) do
+		if w[1] == handle then
+			table.remove(warm_ready, i)
+			break
+		end
+	end
+end
+
+function command.WARM(address)
+	if warm_starting[address] then
+		warm_starting[address] = nil
+		table.insert(warm_ready, { address, skynet.response() })
+		return NORET
+	end
+	-- killed while starting, or the pool is off
+	skynet.kill(address)
+	services[address] = nil
+	return NORET
+end
+
 function command.LIST()
 	local list = {}
 	for k,v in pairs(services) do
@@ -51,6 +94,10 @@ function command.STAT(addr, ti)
 	return list_srv(ti, function(v) return v end, "STAT")
 end
 
+function command.GCSTAT(addr, ti)
+	return list_srv(ti, function(v) return v end, "GCSTAT")
+end
+
 function command.KILL(_, handle)
 	skynet.kill(handle)
 	local ret = { [skynet.address(handle)] = tostring(services[handle]) }
@@ -78,6 +125,7 @@ end
 
 function command.REMOVE(_, handle, kill)
 	services[handle] = nil
+	warm_remove(handle)
 	local response = instance[handle]
 	if response then
 		-- instance is dead
@@ -90,11 +138,18 @@ function command.REMOVE(_, handle, kill)
 	return NORET
 end
 
-local function launch_service(service, ...)
+local function launch_service(cold, response, service, ...)
 	local param = table.concat({...}, " ")
-	local inst = skynet.launch(service, param)
+	local inst
+	if not cold and service == "snlua" and #warm_ready > 0 then
+		local w = table.remove(warm_ready)
+		inst = w[1]
+		w[2](true, param)
+		warm_fill()
+	else
+		inst = skynet.launch(service, param)
+	end
 	local session = skynet.context()
-	local response = skynet.response()
 	if inst then
 		services[inst] = service .. " " .. param
 		instance[inst] = response
@@ -107,12 +162,48 @@ local function launch_service(service, ...)
 end
 
 function command.LAUNCH(_, service, ...)
-	launch_service(service, ...)
+	launch_service(false, skynet.response(), service, ...)
+	return NORET
+end
+
+-- Launch n services of the same type without waiting for each other : they init in parallel
+-- on the workers, and the caller gets all the addresses when every one of them is ready.
+-- If any of them fails, the others are killed and the call fails.
+function command.LAUNCHN(_, n, service, ...)
+	local response = skynet.response()
+	local list = {}
+	local pending = n
+	local failed = false
+	local function ready(i, ok, address)
+		if ok and address then
+			list[i] = address
+		else
+			failed = true
+		end
+		pending = pending - 1
+		if pending > 0 then
+			return
+		end
+		if failed then
+			for _, address in pairs(list) do
+				skynet.kill(address)
+			end
+			response(false)
+		else
+			response(true, list)
+		end
+	end
+	for i = 1, n do
+		launch_service(false, function(...)
+			ready(i, ...)
+		end, service, ...)
+	end
 	return NORET
 end
 
 function command.LOGLAUNCH(_, service, ...)
-	local inst = launch_service(service, ...)
+	-- log from the very beginning, so never use a warm one
+	local inst = launch_service(true, skynet.response(), service, ...)
 	if inst then
 		core.command("LOGON", skynet.address(inst))
 	end
@@ -122,6 +213,14 @@ end
 function command.ERROR(address)
 	-- see serivce-src/service_lua.c
 	-- init failed
+	if warm_starting[address] then
+		-- don't respawn a warm service that can't start, the preload is probably wrong
+		if warmpool > 0 then
+			skynet.error("warm service init failed, turn off warmpool")
+			warmpool = 0
+		end
+		warm_remove(address)
+	end
 	local response = instance[address]
 	if response then
 		response(false)
@@ -182,4 +281,6 @@ skynet.dispatch("lua", function(session, address, cmd , ...)
 	end
 end)
 
-skynet.start(function() end)
+skynet.start(function()
+	warm_fill()
+end)
@@ -0,0 +1,604 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+local driver = require "skynet.socketdriver"
+require "skynet.manager"
+
+--[[
+	Load generator for gate / websocket / udp services and the cluster protocol.
+
+	skynet.call(loadgen, "lua", "run", opts) returns the result table, or start it from
+	the config (or debug_console) with key=value pairs, which prints the result as a line of json :
+
+		skynet.newservice("loadgen", "run", "proto=tcp", "host=127.0.0.1", "port=8888", "connections=1000")
+
+	opts :
+		proto       "tcp" (2 bytes big-endian size header, as gate), "websocket", "udp" or "cluster"
+		host, port  the target (proto websocket : url = "ws://host:port/path")
+		framing     tcp only, "size" (default) or "line"
+		connections number of connections (coroutines for cluster), default 100
+		messages    requests of each connection, default 100
+		duration    seconds, stop sending at the time instead of after `messages`
+		size        payload bytes, default 64
+		pipeline    requests in flight on each connection, default 1
+		rate        requests per second of each connection, 0 (default) sends as fast as the replies come back.
+		            The latency is measured from the scheduled time, so a slow server isn't hidden by a slow sender.
+		timeout     seconds without any reply before a connection is given up, default 5
+		workers     services that share the connections, default 1
+		script      module name : returns { request = function(conn, seq, size) return payload end }
+		node, address   cluster only, the target of cluster.call(node, address, "echo", payload)
+
+	Every request must be answered by one reply in order, except udp whose replies echo the
+	first 8 bytes (the sequence in hex) of the request. CMD.listen starts echo servers of each proto,
+	and a loadgen registered by cluster.register is an echo target for proto cluster.
+]]
+
+local args = table.pack(...)
+
+local hpc = skynet.hpc
+
+-- log-linear histogram of microseconds, 8 buckets for each power of 2 (like skynet_histogram.h)
+
+local function hindex(v)
+	if v < 8 then
+		return v
+	end
+	local e = 3
+	while v >> (e + 1) ~= 0 do
+		e = e + 1
+	end
+	return (e - 2) * 8 + ((v >> (e - 3)) & 7)
+end
+
+local function hupper(index)
+	if index < 8 then
+		return index
+	end
+	local e = index // 8 + 2
+	return ((9 + index % 8) << (e - 3)) - 1
+end
+
+local function new_stat()
+	return {
+		connected = 0,
+		errors = 0,
+		timeouts = 0,
+		requests = 0,
+		responses = 0,
+		bytes_out = 0,
+		bytes_in = 0,
+		sum = 0,
+		max = 0,
+		connect_max = 0,
+		first = math.maxinteger,	-- time of the first request
+		last = 0,	-- time of the last reply
+		bucket = {},
+	}
+end
+
+local function record(stat, now, nsec)
+	if now > stat.last then
+		stat.last = now
+	end
+	local us = math.floor(nsec / 1000)
+	local idx = hindex(us)
+	stat.bucket[idx] = (stat.bucket[idx] or 0) + 1
+	stat.responses = stat.responses + 1
+	stat.sum = stat.sum + us
+	if us > stat.max then
+		stat.max = us
+	end
+end
+
+local function merge(stat, s)
+	for k, v in pairs(s) do
+		if k == "bucket" then
+			for idx, n in pairs(v) do
+				stat.bucket[idx] = (stat.bucket[idx] or 0) + n
+			end
+		elseif k == "max" or k == "connect_max" or k == "last" then
+			stat[k] = math.max(stat[k], v)
+		elseif k == "first" then
+			stat.first = math.min(stat.first, v)
+		else
+			stat[k] = stat[k] + v
+		end
+	end
+end
+
+local function percentile(stat, p)
+	local count = stat.responses
+	if count == 0 then
+		return 0
+	end
+	local rank = math.max(1, math.min(count, math.floor(p / 100 * count + 0.5)))
+	local index = {}
+	for idx in pairs(stat.bucket) do
+		index[#index + 1] = idx
+	end
+	table.sort(index)
+	local n = 0
+	for _, idx in ipairs(index) do
+		n = n + stat.bucket[idx]
+		if n >= rank then
+			return math.min(hupper(idx), stat.max)
+		end
+	end
+	return stat.max
+end
+
+-- transports : connect(opts) returns an object with send(payload), recv() -> payload or nil, close()
+
+local transport = {}
+
+function transport.tcp(opts)
+	local id = assert(socket.open(opts.host, opts.port))
+	driver.nodelay(id)
+	local conn = {}
+	if opts.framing == "line" then
+		function conn.send(payload)
+			socket.write(id, payload .. "\n")
+		end
+		function conn.recv()
+			return socket.readline(id)
+		end
+	else
+		function conn.send(payload)
+			socket.write(id, string.pack(">s2", payload))
+		end
+		function conn.recv()
+			local h = socket.read(id, 2)
+			if not h then
+				return
+			end
+			local sz = h:byte(1) * 256 + h:byte(2)
+			if sz == 0 then
+				return ""
+			end
+			return socket.read(id, sz)
+		end
+	end
+	function conn.close()
+		socket.close(id)
+	end
+	return conn
+end
+
+function transport.websocket(opts)
+	local websocket = require "http.websocket"
+	local url = opts.url or string.format("ws://%s:%d/", opts.host, opts.port)
+	local id = websocket.connect(url)
+	local fmt = opts.binary and "binary" or "text"
+	local conn = {}
+	function conn.send(payload)
+		websocket.write(id, payload, fmt)
+	end
+	function conn.recv()
+		local ok, data = pcall(websocket.read, id)
+		if ok and data then
+			return data
+		end
+	end
+	function conn.close()
+		if not websocket.is_close(id) then
+			pcall(websocket.close, id)
+		end
+	end
+	return conn
+end
+
+function transport.udp(opts)
+	local queue = {}
+	local waiting
+	local closed
+	local id = socket.udp(function(str)
+		queue[#queue + 1] = str
+		if waiting then
+			local co = waiting
+			waiting = nil
+			skynet.wakeup(co)
+		end
+	end)
+	socket.udp_connect(id, opts.host, opts.port)
+	local conn = { unordered = true }
+	function conn.send(payload)
+		socket.write(id, payload)
+	end
+	function conn.recv()
+		while #queue == 0 do
+			if closed then
+				return
+			end
+			waiting = coroutine.running()
+			skynet.wait(waiting)
+		end
+		return table.remove(queue, 1)
+	end
+	function conn.close()
+		closed = true
+		socket.close(id)
+		if waiting then
+			local co = waiting
+			waiting = nil
+			skynet.wakeup(co)
+		end
+	end
+	return conn
+end
+
+-- text, so it's fine for line framing and websocket text frames
+local function default_request(conn, seq, size)
+	return string.format("%08x", seq) .. string.rep("x", size - 8)
+end
+
+-- one connection : the sender and the receiver are two coroutines
+local function run_conn(opts, i, stat, request, start)
+	local c0 = hpc()
+	local ok, conn = pcall(transport[opts.proto], opts)
+	if not ok then
+		skynet.error("loadgen connect :", conn)
+		stat.errors = stat.errors + 1
+		return
+	end
+	stat.connected = stat.connected + 1
+	stat.connect_max = math.max(stat.connect_max, hpc() - c0)
+
+	local fifo = {}
+	local pending = {}
+	local head, tail = 1, 0
+	local inflight = 0
+	local sending = true
+	local blocked
+	local last = hpc()
+	local done = false
+	local interval = opts.rate > 0 and 1e9 / opts.rate
+
+	skynet.fork(function()
+		while sending or inflight > 0 do
+			local data = conn.recv()
+			if not data then
+				break
+			end
+			local t0
+			if conn.unordered then
+				local seq = tonumber(data:sub(1, 8), 16)
+				t0 = pending[seq]
+				pending[seq] = nil
+			else
+				t0 = fifo[head]
+				fifo[head] = nil
+				head = head + 1
+			end
+			last = hpc()
+			if t0 then
+				stat.bytes_in = stat.bytes_in + #data
+				record(stat, last, last - t0)
+				inflight = inflight - 1
+			end
+			if blocked then
+				local co = blocked
+				blocked = nil
+				skynet.wakeup(co)
+			end
+		end
+		done = true
+		if blocked then
+			local co = blocked
+			blocked = nil
+			skynet.wakeup(co)
+		end
+	end)
+
+	-- give up when no reply comes back for opts.timeout seconds
+	skynet.fork(function()
+		while not done do
+			skynet.sleep(50)
+			if inflight > 0 and hpc() - last > opts.timeout * 1e9 then
+				stat.timeouts = stat.timeouts + inflight
+				inflight = 0
+				sending = false
+				conn.close()
+				break
+			end
+		end
+	end)
+
+	local deadline = opts.duration and start + opts.duration * 1e9
+	local conn_start = hpc()
+	local seq = 0
+	while not done do
+		if seq >= opts.messages and not deadline then
+			break
+		end
+		local t0
+		if interval then
+			t0 = conn_start + seq * interval
+			local now = hpc()
+			if t0 - now >= 10000000 then
+				skynet.sleep(math.floor((t0 - now) / 10000000))
+			end
+		end
+		while inflight >= opts.pipeline and not done do
+			blocked = coroutine.running()
+			skynet.wait(blocked)
+		end
+		if done then
+			break
+		end
+		-- a request sent late counts from the scheduled time, one sent early (sleep is in 10ms steps) from now
+		local now = hpc()
+		t0 = t0 and math.min(t0, now) or now
+		if seq == 0 and t0 < stat.first then
+			stat.first = t0
+		end
+		if deadline and t0 >= deadline then
+			break
+		end
+		seq = seq + 1
+		local payload = request(i, seq, opts.size)
+		if inflight == 0 then
+			last = hpc()
+		end
+		if conn.unordered then
+			pending[seq] = t0
+		else
+			tail = tail + 1
+			fifo[tail] = t0
+		end
+		inflight = inflight + 1
+		stat.requests = stat.requests + 1
+		stat.bytes_out = stat.bytes_out + #payload
+		local ok = pcall(conn.send, payload)
+		if not ok then
+			break
+		end
+	end
+	sending = false
+	while not done do
+		if inflight == 0 then
+			conn.close()
+		end
+		skynet.sleep(1)
+	end
+	conn.close()
+end
+
+local function run_cluster(opts, i, stat, request, start)
+	local cluster = require "skynet.cluster"
+	stat.connected = stat.connected + 1
+	local deadline = opts.duration and start + opts.duration * 1e9
+	local seq = 0
+	while deadline or seq < opts.messages do
+		local t0 = hpc()
+		if deadline and t0 >= deadline then
+			break
+		end
+		if seq == 0 and t0 < stat.first then
+			stat.first = t0
+		end
+		seq = seq + 1
+		local payload = request(i, seq, opts.size)
+		stat.requests = stat.requests + 1
+		stat.bytes_out = stat.bytes_out + #payload
+		local ok, reply = pcall(cluster.call, opts.node, opts.address, "echo", payload)
+		if not ok then
+			stat.errors = stat.errors + 1
+			break
+		end
+		stat.bytes_in = stat.bytes_in + #reply
+		local now = hpc()
+		record(stat, now, now - t0)
+	end
+end
+
+local function run_part(opts, first, last)
+	local request = opts.script and require(opts.script).request or default_request
+	local stat = new_stat()
+	local start = hpc()
+	local f = opts.proto == "cluster" and run_cluster or run_conn
+	local co = coroutine.running()
+	local n = last - first + 1
+	for i = first, last do
+		skynet.fork(function()
+			local ok, err = pcall(f, opts, i, stat, request, start)
+			if not ok then
+				skynet.error("loadgen :", err)
+				stat.errors = stat.errors + 1
+			end
+			n = n - 1
+			if n == 0 then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	if n > 0 then
+		skynet.wait(co)
+	end
+	return stat
+end
+
+local function normalize(opts)
+	local o = {}
+	for k, v in pairs(opts) do
+		o[k] = tonumber(v) or v
+	end
+	assert(o.proto == "cluster" or transport[o.proto], "invalid proto")
+	o.connections = o.connections or 100
+	o.messages = o.messages or 100
+	o.size = math.max(o.size or 64, 8)
+	o.pipeline = o.pipeline or 1
+	o.rate = o.rate or 0
+	o.timeout = o.timeout or 5
+	o.workers = o.workers or 1
+	o.binary = o.binary == true or o.binary == "true"
+	return o
+end
+
+local CMD = {}
+
+function CMD.run_part(opts, first, last)
+	return run_part(opts, first, last)
+end
+
+function CMD.run(opts)
+	opts = normalize(opts)
+	local start = hpc()
+	local stat
+	local workers = math.min(opts.workers, opts.connections)
+	if workers <= 1 then
+		stat = run_part(opts, 1, opts.connections)
+	else
+		stat = new_stat()
+		local per = opts.connections // workers
+		local first = 1
+		local reqs = skynet.request()
+		local services = {}
+		for w = 1, workers do
+			local last = w == workers and opts.connections or first + per - 1
+			local s = skynet.newservice(SERVICE_NAME)
+			services[w] = s
+			reqs:add { s, "lua", "run_part", opts, first, last }
+			first = last + 1
+		end
+		for _, resp in reqs:select() do
+			merge(stat, resp[1])
+		end
+		for _, s in ipairs(services) do
+			skynet.kill(s)
+		end
+	end
+	local sec = (hpc() - start) / 1e9
+	-- the rate of replies doesn't count the time of connecting
+	local active = stat.responses > 0 and (stat.last - stat.first) / 1e9 or sec
+	return {
+		proto = opts.proto,
+		connections = stat.connected,
+		errors = stat.errors,
+		timeouts = stat.timeouts,
+		requests = stat.requests,
+		responses = stat.responses,
+		bytes_out = stat.bytes_out,
+		bytes_in = stat.bytes_in,
+		sec = sec,
+		qps = stat.responses / active,
+		connect_max_ms = stat.connect_max / 1e6,
+		mean_ms = stat.responses > 0 and stat.sum / stat.responses / 1000 or 0,
+		p50_ms = percentile(stat, 50) / 1000,
+		p90_ms = percentile(stat, 90) / 1000,
+		p99_ms = percentile(stat, 99) / 1000,
+		p999_ms = percentile(stat, 99.9) / 1000,
+		max_ms = stat.max / 1000,
+	}
+end
+
+-- echo servers for the baseline of each proto, return the port
+
+local function listen_tcp(host, port, framing)
+	local id, _, real = socket.listen(host, port, 1024)
+	socket.start(id, function(fd)
+		socket.start(fd)
+		driver.nodelay(fd)
+		skynet.fork(function()
+			while true do
+				if framing == "line" then
+					local line = socket.readline(fd)
+					if not line then
+						break
+					end
+					socket.write(fd, line .. "\n")
+				else
+					local h = socket.read(fd, 2)
+					if not h then
+						break
+					end
+					local sz = h:byte(1) * 256 + h:byte(2)
+					local body = sz > 0 and socket.read(fd, sz) or ""
+					if not body then
+						break
+					end
+					socket.write(fd, h .. body)
+				end
+			end
+			socket.close(fd)
+		end)
+	end)
+	return real
+end
+
+local function listen_websocket(host, port)
+	local websocket = require "http.websocket"
+	local handle = {}
+	function handle.message(id, msg, msg_type)
+		websocket.write(id, msg, msg_type)
+	end
+	local id, _, real = socket.listen(host, port, 1024)
+	socket.start(id, function(fd, addr)
+		skynet.fork(websocket.accept, fd, handle, "ws", addr)
+	end)
+	return real
+end
+
+local function listen_udp(host, port)
+	assert(port ~= 0, "udp needs a port")
+	local id
+	id = socket.udp(function(str, from)
+		socket.sendto(id, from, str)
+	end, host, port)
+	return port
+end
+
+function CMD.listen(proto, host, port, framing)
+	host = host or "127.0.0.1"
+	port = port or 0
+	if proto == "tcp" then
+		return listen_tcp(host, port, framing)
+	elseif proto == "websocket" then
+		return listen_websocket(host, port)
+	elseif proto == "udp" then
+		return listen_udp(host, port)
+	end
+	error("invalid proto " .. tostring(proto))
+end
+
+function CMD.echo(...)
+	return ...
+end
+
+local function tojson(r)
+	local keys = {}
+	for k in pairs(r) do
+		keys[#keys + 1] = k
+	end
+	table.sort(keys)
+	local out = {}
+	for i, k in ipairs(keys) do
+		local v = r[k]
+		if type(v) == "string" then
+			out[i] = string.format('"%s":"%s"', k, v)
+		elseif math.type(v) == "integer" then
+			out[i] = string.format('"%s":%d', k, v)
+		else
+			out[i] = string.format('"%s":%.3f', k, v)
+		end
+	end
+	return "{" .. table.concat(out, ",") .. "}"
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, ...)
+		local f = assert(CMD[cmd], cmd)
+		skynet.ret(skynet.pack(f(...)))
+	end)
+	if args[1] == "run" then
+		local opts = {}
+		for i = 2, args.n do
+			local kv = args[i]
+			local k, v = kv:match "^([%w_]+)=(.*)$"
+			assert(k, kv)
+			opts[k] = v
+		end
+		skynet.fork(function()
+			print(tojson(CMD.run(opts)))
+			skynet.exit()
+		end)
+	end
+end)
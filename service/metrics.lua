@@ -0,0 +1,139 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+local memory = require "skynet.memory"
+local metrics = require "skynet.metrics"
+local httpd = require "http.httpd"
+local sockethelper = require "http.sockethelper"
+
+--[[
+	Prometheus text format exporter : skynet.newservice("metrics", [ip], port)
+	GET /metrics on the port. The counters are read from C directly, so a scrape
+	doesn't send messages to the other services or change their state.
+]]
+
+local arg = table.pack(...)
+assert(arg.n <= 2)
+local ip = (arg.n == 2 and arg[1] or "127.0.0.1")
+local port = tonumber(arg[arg.n])
+
+local string = string
+local table = table
+
+local jemalloc	-- false when skynet is built without jemalloc
+
+local function escape(s)
+	return (s:gsub('[\\"\n]', { ["\\"] = "\\\\", ['"'] = '\\"', ["\n"] = "\\n" }))
+end
+
+local function collect()
+	local out = {}
+	local n = 0
+	local help
+	local function metric(name, mtype, text)
+		n = n + 1
+		out[n] = string.format("# HELP %s %s\n# TYPE %s %s\n", name, text, name, mtype)
+		help = name
+	end
+	local function value(v, labels)
+		n = n + 1
+		if labels then
+			out[n] = string.format("%s{%s} %s\n", help, labels, v)
+		else
+			out[n] = string.format("%s %s\n", help, v)
+		end
+	end
+
+	local node = metrics.node()
+	metric("skynet_workers", "gauge", "Number of worker threads")
+	value(node.worker)
+	metric("skynet_workers_sleeping", "gauge", "Number of worker threads waiting for messages")
+	value(node.sleep)
+	metric("skynet_workers_busy", "gauge", "Number of worker threads dispatching messages")
+	value(node.worker - node.sleep)
+	metric("skynet_worker_wakeups_total", "counter", "Wakeups of sleeping worker threads")
+	value(node.wakeup)
+	metric("skynet_worker_wakeup_seconds_total", "counter", "Latency from signaling to running of the woken worker threads")
+	value(node.wakeup_nsec / 1e9)
+	metric("skynet_global_queue_length", "gauge", "Message queues waiting in the global run queue")
+	value(node.globalmq)
+	metric("skynet_local_queue_length", "gauge", "Message queues waiting in the run queues of workers")
+	value(node.localmq)
+	metric("skynet_timers", "gauge", "Timers in the timer wheel")
+	value(node.timer)
+	metric("skynet_services", "gauge", "Number of services")
+	value(node.service)
+
+	local names = skynet.call(".launcher", "lua", "LIST")
+	local services = metrics.services()
+	local labels = {}
+	for handle in pairs(services) do
+		local addr = skynet.address(handle)
+		local name = names[addr]
+		if name then
+			labels[handle] = string.format('address="%s",name="%s"', addr, escape(name))
+		else
+			labels[handle] = string.format('address="%s"', addr)
+		end
+	end
+	local function each(name, mtype, text, field, list)
+		metric(name, mtype, text)
+		for handle, s in pairs(list) do
+			local l = labels[handle] or string.format('address="%s"', skynet.address(handle))
+			value(s[field], l)
+		end
+	end
+	each("skynet_service_queue_length", "gauge", "Length of the message queue of the service", "mqlen", services)
+	each("skynet_service_messages_total", "counter", "Messages dispatched to the service", "message", services)
+	each("skynet_service_dropped_total", "counter", "Messages rejected by the backpressure limit of the service", "dropped", services)
+	each("skynet_service_expired_total", "counter", "Messages dropped by the service because they expired before being handled", "expired", services)
+	each("skynet_service_stalls_total", "counter", "Reports of the monitor that a message is handled longer than monitor_stall", "stall", services)
+	each("skynet_service_cpu_seconds_total", "counter", "CPU time of the service (when profile is on)", "cpu", services)
+
+	local sockets = socket.stat()
+	each("skynet_service_sockets", "gauge", "Sockets owned by the service", "socket", sockets)
+	each("skynet_socket_read_bytes_total", "counter", "Bytes read from the sockets of the service", "read", sockets)
+	each("skynet_socket_write_bytes_total", "counter", "Bytes written to the sockets of the service", "write", sockets)
+	each("skynet_socket_eagain_total", "counter", "Writes blocked by full kernel send buffers", "eagain", sockets)
+
+	metric("skynet_memory_bytes", "gauge", "C memory allocated by services")
+	value(memory.total())
+	metric("skynet_memory_blocks", "gauge", "C memory blocks allocated by services")
+	value(memory.block())
+	for k, v in pairs(jemalloc and memory.jestat() or {}) do
+		-- stats.allocated -> skynet_jemalloc_allocated_bytes
+		local name = "skynet_jemalloc_" .. k:match "[^.]+$" .. "_bytes"
+		metric(name, "gauge", "jemalloc " .. k)
+		value(v)
+	end
+	return table.concat(out)
+end
+
+local function handle(url, method)
+	if method ~= "GET" then
+		return 405
+	end
+	if url ~= "/metrics" and url:sub(1, 9) ~= "/metrics?" then
+		return 404
+	end
+	return 200, collect(), { ["content-type"] = "text/plain; version=0.0.4; charset=utf-8" }
+end
+
+skynet.start(function()
+	jemalloc = memory.jestat()["stats.allocated"] ~= 0
+	local listen_socket, ip, port = socket.listen(ip, port)
+	skynet.error("Start metrics at " .. ip .. ":" .. port)
+	socket.start(listen_socket, function(id, addr)
+		socket.start(id)
+		skynet.fork(function()
+			local interface = {
+				read = sockethelper.readfunc(id),
+				write = sockethelper.writefunc(id),
+			}
+			local ok, err = httpd.serve(interface, handle, 8192)
+			if not ok and err ~= sockethelper.socket_error then
+				skynet.error(string.format("metrics %s : %s", addr, err))
+			end
+			socket.close(id)
+		end)
+	end)
+end)
@@ -0,0 +1,22 @@
+local skynet = require "skynet"
+
+-- Launch the services migrated from other nodes, see skynet.migrate
+
+local command = {}
+
+function command.spawn(name, args, state)
+	local addr = skynet.newservice(name, table.unpack(args, 1, args.n))
+	local ok, err = pcall(skynet.call, addr, "debug", "RESTORE", state)
+	if not ok then
+		skynet.kill(addr)
+		error(err)
+	end
+	return addr
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, ...)
+		local f = assert(command[cmd], cmd)
+		skynet.retpack(f(...))
+	end)
+end)
@@ -5,8 +5,7 @@ local datacenter = require "skynet.datacenter"
 local harbor_id = skynet.harbor(skynet.self())
 
 local command = {}
-local channel = {}
-local channel_n = {}
+local channel = {}	-- channel id -> subscriber set of local services (mc.newgroup)
 local channel_remote = {}
 local channel_id = harbor_id
 local NORET = {}
@@ -19,13 +18,65 @@ end
 
 local node_address = setmetatable({}, { __index = get_address })
 
+-- The messages to the remote nodes are batched : the publishes queued for a node until the
+-- timeout(0) message behind them is dispatched are sent as one multicast message of session 0
+-- (channels are never 0 across nodes, the low 8 bits are the harbor id), see mc.unpackbatch.
+-- A single publish is sent as before, the channel id in the session field.
+local BATCH = 0
+local pending = {}	-- node -> { n, channel, source, msg, records... }
+local flushing = false
+
+local function send_pending(node)
+	local p = pending[node]
+	if p == nil then
+		return
+	end
+	pending[node] = nil
+	if p.n == 1 then
+		skynet.redirect(node_address[node], p.source, "multicast", p.channel, p.msg)
+	else
+		skynet.redirect(node_address[node], 0, "multicast", BATCH, table.concat(p))
+	end
+end
+
+local function flush()
+	flushing = false
+	for node in pairs(pending) do
+		send_pending(node)
+	end
+end
+
+local function record(channel, source, msg)
+	return string.pack("<I4I4s4", channel, source, msg)
+end
+
+-- forward multicast message (a string) to a node
+local function remote_publish(node, channel, source, msg)
+	local p = pending[node]
+	if p == nil then
+		pending[node] = { n = 1, channel = channel, source = source, msg = msg }
+		if not flushing then
+			flushing = true
+			skynet.timeout(0, flush)
+		end
+		return
+	end
+	local n = p.n
+	if n == 1 then
+		p[1] = record(p.channel, p.source, p.msg)
+		p.msg = nil
+	end
+	n = n + 1
+	p[n] = record(channel, source, msg)
+	p.n = n
+end
+
 -- new LOCAL channel , The low 8bit is the same with harbor_id
 function command.NEW()
 	while channel[channel_id] do
 		channel_id = mc.nextid(channel_id)
 	end
-	channel[channel_id] = {}
-	channel_n[channel_id] = 0
+	channel[channel_id] = mc.newgroup()
 	local ret = channel_id
 	channel_id = mc.nextid(channel_id)
 	return ret
@@ -34,7 +85,6 @@ end
 -- MUST call by the owner node of channel, delete a remote channel
 function command.DELR(source, c)
 	channel[c] = nil
-	channel_n[c] = nil
 	return NORET
 end
 
@@ -43,27 +93,23 @@ end
 function command.DEL(source, c)
 	local node = c % 256
 	if node ~= harbor_id then
+		send_pending(node)
 		skynet.send(node_address[node], "lua", "DEL", c)
 		return NORET
 	end
 	local remote = channel_remote[c]
 	channel[c] = nil
-	channel_n[c] = nil
 	channel_remote[c] = nil
 	if remote then
 		for node in pairs(remote) do
+			send_pending(node)
 			skynet.send(node_address[node], "lua", "DELR", c)
 		end
 	end
 	return NORET
 end
 
--- forward multicast message to a node (channel id use the session field)
-local function remote_publish(node, channel, source, ...)
-	skynet.redirect(node_address[node], source, "multicast", channel, ...)
-end
-
--- publish a message, for local node, use the message pointer (call mc.bind to add the reference)
+-- publish a message, for local node, mc.publish sends the message pointer to every subscriber and binds the reference
 -- for remote node, call remote_publish. (call mc.unpack and skynet.tostring to convert message pointer to string)
 local function publish(c , source, pack, size)
 	local remote = channel_remote[c]
@@ -77,29 +123,37 @@ local function publish(c , source, pack, size)
 	end
 
 	local group = channel[c]
-	if group == nil or next(group) == nil then
+	if group == nil then
 		-- dead channel, delete the pack. mc.bind returns the pointer in pack and free the pack (struct mc_package **)
 		local pack = mc.bind(pack, 1)
 		mc.close(pack)
 		return
 	end
-	local msg = skynet.tostring(pack, size)	-- copy (pack,size) to a string
-	mc.bind(pack, channel_n[c])	-- mc.bind will free the pack(struct mc_package **)
-	for k in pairs(group) do
-		-- the msg is a pointer to the real message, publish pointer in local is ok.
-		skynet.redirect(k, source, "multicast", c , msg)
-	end
+	-- the fan-out loop is in C, and the pack is freed when the group is empty
+	mc.publish(group, source, c, pack, size)
 end
 
 skynet.register_protocol {
 	name = "multicast",
 	id = skynet.PTYPE_MULTICAST,
 	unpack = function(msg, sz)
-		return mc.packremote(msg, sz)
+		return msg, sz
 	end,
-	dispatch = function (...)
+	dispatch = function (session, source, msg, sz)
 		skynet.ignoreret()
-		publish(...)
+		if session ~= BATCH then
+			publish(session, source, mc.packremote(msg, sz))
+			return
+		end
+		local offset = 0
+		while true do
+			local c, from, pack, size, nextoffset = mc.unpackbatch(msg, sz, offset)
+			if c == nil then
+				break
+			end
+			publish(c, from, pack, size)
+			offset = nextoffset
+		end
 	end,
 }
 
@@ -110,7 +164,10 @@ function command.PUB(source, c, pack, size)
 	local node = c % 256
 	if node ~= harbor_id then
 		-- remote publish
-		remote_publish(node, c, source, mc.remote(pack))
+		local msg, sz = mc.remote(pack)
+		local str = skynet.tostring(msg, sz)
+		skynet.trash(msg, sz)
+		remote_publish(node, c, source, str)
 	else
 		publish(c, source, pack,size)
 	end
@@ -142,20 +199,19 @@ function command.SUB(source, c)
 	if node ~= harbor_id then
 		-- remote group
 		if channel[c] == nil then
+			send_pending(node)
 			if skynet.call(node_address[node], "lua", "SUBR", c) then
 				return
 			end
 			if channel[c] == nil then
 				-- double check, because skynet.call whould yield, other SUB may occur.
-				channel[c] = {}
-				channel_n[c] = 0
+				channel[c] = mc.newgroup()
 			end
 		end
 	end
 	local group = channel[c]
-	if group and not group[source] then
-		channel_n[c] = channel_n[c] + 1
-		group[source] = true
+	if group then
+		group:add(source)
 	end
 end
 
@@ -171,17 +227,13 @@ end
 -- Unsubscribe a channel, if the subscriber is empty and the channel is remote, send USUBR to the channel owner
 function command.USUB(source, c)
 	local group = assert(channel[c])
-	if group[source] then
-		group[source] = nil
-		channel_n[c] = channel_n[c] - 1
-		if channel_n[c] == 0 then
-			local node = c % 256
-			if node ~= harbor_id then
-				-- remote group
-				channel[c] = nil
-				channel_n[c] = nil
-				skynet.send(node_address[node], "lua", "USUBR", c)
-			end
+	if group:remove(source) and group:count() == 0 then
+		local node = c % 256
+		if node ~= harbor_id then
+			-- remote group
+			channel[c] = nil
+			send_pending(node)
+			skynet.send(node_address[node], "lua", "USUBR", c)
 		end
 	end
 	return NORET
@@ -0,0 +1,139 @@
+local skynet = require "skynet"
+local mysql = require "skynet.db.mysql"
+
+local conf
+local conns = {}	-- { db = mysql object, outstanding = n, healthy = bool }
+
+local command = {}
+
+-- least outstanding requests, the healthy connections first
+local function choose()
+	local best
+	for _, c in ipairs(conns) do
+		if best == nil
+			or (c.healthy and not best.healthy)
+			or (c.healthy == best.healthy and c.outstanding < best.outstanding) then
+			best = c
+		end
+	end
+	return best
+end
+
+local function request(method, ...)
+	local c = choose()
+	c.outstanding = c.outstanding + 1
+	local ok, res = pcall(c.db[method], c.db, ...)
+	c.outstanding = c.outstanding - 1
+	if not ok then
+		c.healthy = false
+		error(res)
+	end
+	return res
+end
+
+function command.query(sql)
+	return request("query", sql)
+end
+
+function command.execute(sql, ...)
+	return request("execute", sql, ...)
+end
+
+-- Join the statements into multi-statement queries, so a batch of small
+-- writes costs one round trip for each max_batch bytes.
+function command.batch(list)
+	local results = {}
+	local n = 0
+	local i = 1
+	while i <= #list do
+		local size = 0
+		local j = i
+		repeat
+			size = size + #list[j] + 1
+			j = j + 1
+		until j > #list or size + #list[j] > conf.max_batch
+		local res = request("query", table.concat(list, ";", i, j - 1))
+		if res.multiresultset then
+			for k = 1, #res do
+				n = n + 1
+				results[n] = res[k]
+			end
+			if res.badresult then
+				-- the rest of this chunk is not executed
+				results.badresult = true
+				results.err = res.err
+				results.errno = res.errno
+				results.sqlstate = res.sqlstate
+				return results
+			end
+		else
+			n = n + 1
+			results[n] = res
+			if res.badresult then
+				results.badresult = true
+				results.err = res.err
+				results.errno = res.errno
+				results.sqlstate = res.sqlstate
+				return results
+			end
+		end
+		i = j
+	end
+	return results
+end
+
+function command.stat()
+	local s = {}
+	for i, c in ipairs(conns) do
+		s[i] = { outstanding = c.outstanding, healthy = c.healthy }
+	end
+	return s
+end
+
+local function health_check()
+	while true do
+		skynet.sleep(conf.ping_interval)
+		for _, c in ipairs(conns) do
+			-- the busy connections are known to be alive
+			if c.outstanding == 0 then
+				c.outstanding = 1
+				local ok, res = pcall(c.db.ping, c.db)
+				c.outstanding = c.outstanding - 1
+				local healthy = ok and not res.badresult
+				if healthy ~= c.healthy then
+					skynet.error(string.format("mysql connection to %s:%s %s", conf.host, conf.port or 3306, healthy and "recovered" or "failed"))
+					c.healthy = healthy
+				end
+			end
+		end
+	end
+end
+
+function command.init(opts)
+	conf = opts
+	conf.max_batch = opts.max_batch or 1024 * 1024 - 1024
+	conf.ping_interval = opts.ping_interval or 3000
+	for i = 1, opts.size or 4 do
+		conns[i] = {
+			db = mysql.connect(opts),
+			outstanding = 0,
+			healthy = true,
+		}
+	end
+	skynet.fork(health_check)
+end
+
+function command.close()
+	for _, c in ipairs(conns) do
+		c.db:disconnect()
+	end
+	skynet.ret()
+	skynet.exit()
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, ...)
+		local f = assert(command[cmd])
+		skynet.ret(skynet.pack(f(...)))
+	end)
+end)
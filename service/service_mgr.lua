@@ -95,6 +95,148 @@ function cmd.QUERY(service_name, subname)
 	end
 end
 
+-- The startup graph : an array of { name = "db", service = "dbd", args = { ... }, deps = { "config", ... }, unique = true }
+-- service defaults to name, unique launches it as skynet.uniqueservice(service, ...) does.
+local function startup_plan(graph)
+	local nodes = {}
+	for _, v in ipairs(graph) do
+		local name = assert(v.name or v.service, "startup service needs a name")
+		assert(nodes[name] == nil, "duplicate startup service " .. name)
+		nodes[name] = {
+			name = name,
+			service = v.service or name,
+			args = v.args or {},
+			deps = v.deps or {},
+			unique = v.unique,
+			dependents = {},
+		}
+	end
+	local state = {}
+	local function visit(name, from)
+		local n = nodes[name]
+		if n == nil then
+			error(string.format("startup service %s depends on unknown %s", from, name))
+		end
+		if state[name] == "visiting" then
+			error("startup graph has a cycle at " .. name)
+		elseif state[name] == nil then
+			state[name] = "visiting"
+			for _, d in ipairs(n.deps) do
+				visit(d, name)
+			end
+			state[name] = "done"
+		end
+	end
+	for name, n in pairs(nodes) do
+		visit(name)
+		n.wait = #n.deps
+		for _, d in ipairs(n.deps) do
+			table.insert(nodes[d].dependents, n)
+		end
+	end
+	return nodes
+end
+
+-- The chain of services ending at the last ready one, each started by the last ready of its dependencies
+local function critical_path(nodes)
+	local last
+	for _, n in pairs(nodes) do
+		if n.ready and (last == nil or n.ready > last.ready) then
+			last = n
+		end
+	end
+	local path = {}
+	while last do
+		table.insert(path, 1, string.format("%s %.1fms", last.name, (last.ready - last.start) / 1000000))
+		local prev
+		for _, d in ipairs(last.deps) do
+			d = nodes[d]
+			if prev == nil or d.ready > prev.ready then
+				prev = d
+			end
+		end
+		last = prev
+	end
+	return table.concat(path, " > ")
+end
+
+-- Start the services of the graph in parallel : each one as soon as all its dependencies are ready.
+-- Returns { name = address }, and logs the time of each one and the critical path.
+-- If any one fails, the services depending on it are not started, and it raises an error after the others are ready.
+function cmd.STARTUP(graph)
+	local nodes = startup_plan(graph)
+	local co = coroutine.running()
+	local begin = skynet.hpc()
+	local pending = 0
+	local result = {}
+	local failed = {}
+	local start
+
+	local function skip(n, reason)
+		if n.skipped then
+			return
+		end
+		n.skipped = true
+		pending = pending - 1
+		table.insert(failed, string.format("%s (%s)", n.name, reason))
+		for _, d in ipairs(n.dependents) do
+			skip(d, "depends on " .. n.name)
+		end
+	end
+
+	local function launch(n)
+		n.start = skynet.hpc()
+		local ok, addr
+		if n.unique then
+			ok, addr = pcall(cmd.LAUNCH, n.service, table.unpack(n.args))
+		else
+			ok, addr = pcall(skynet.newservice, n.service, table.unpack(n.args))
+		end
+		if ok and addr then
+			n.ready = skynet.hpc()
+			result[n.name] = addr
+			skynet.error(string.format("startup %s %s : %.1fms (at %.1fms)", n.name, skynet.address(addr),
+				(n.ready - n.start) / 1000000, (n.start - begin) / 1000000))
+			pending = pending - 1
+			for _, d in ipairs(n.dependents) do
+				d.wait = d.wait - 1
+				if d.wait == 0 and not d.skipped then
+					start(d)
+				end
+			end
+		else
+			skip(n, tostring(addr or "init failed"))
+		end
+		if pending == 0 then
+			skynet.wakeup(co)
+		end
+	end
+
+	function start(n)
+		skynet.fork(launch, n)
+	end
+
+	for _, n in pairs(nodes) do
+		pending = pending + 1
+	end
+	if pending == 0 then
+		return result
+	end
+	for _, n in pairs(nodes) do
+		if n.wait == 0 then
+			start(n)
+		end
+	end
+	skynet.wait(co)
+
+	skynet.error(string.format("startup %d services in %.1fms, critical path : %s",
+		#graph, (skynet.hpc() - begin) / 1000000, critical_path(nodes)))
+	if #failed > 0 then
+		error("startup failed : " .. table.concat(failed, ", "))
+	end
+	return result
+end
+
 local function list_service()
 	local result = {}
 	for k,v in pairs(service) do
@@ -0,0 +1,84 @@
+-- A pre-warmed snlua service, see warmpool in launcher.lua.
+-- It loads skynet and the modules listed in warmpool_preload, then waits in the launcher
+-- until a skynet.newservice hands it a service name, and runs that service in place.
+
+local skynet = require "skynet"
+local skynet_require = require "skynet.require"
+
+local launcher = tonumber(...)
+
+local preload = skynet.getenv "warmpool_preload"
+if preload then
+	for name in string.gmatch(preload, "[^,%s]+") do
+		require(name)
+	end
+end
+
+-- loader.lua puts the service path of warm.lua in front of package.path
+local lua_path = package.path
+if SERVICE_PATH and lua_path:sub(1, #SERVICE_PATH + 6) == SERVICE_PATH .. "?.lua;" then
+	lua_path = lua_path:sub(#SERVICE_PATH + 7)
+end
+
+-- the same search as loader.lua
+local function load_service(name)
+	local luaservice = skynet.getenv "luaservice" or "./service/?.lua"
+	local filename = skynet.cache.searchpath(name, luaservice, "")
+	if filename then
+		for pat in string.gmatch(luaservice, "([^;]+);*") do
+			if (string.gsub(pat, "?", name)) == filename then
+				local f = loadfile(filename)
+				if f then
+					return f, pat
+				end
+				break
+			end
+		end
+	end
+	local err = {}
+	for pat in string.gmatch(luaservice, "([^;]+);*") do
+		local filename = string.gsub(pat, "?", name)
+		local f, msg = loadfile(filename)
+		if f then
+			return f, pat
+		end
+		table.insert(err, msg)
+	end
+	error(table.concat(err, "\n"))
+end
+
+local function become(param)
+	local args = {}
+	for word in string.gmatch(param, "%S+") do
+		table.insert(args, word)
+	end
+	skynet.error("LAUNCH snlua " .. param)
+
+	SERVICE_NAME = args[1]
+	local main, pattern = load_service(SERVICE_NAME)
+	local service_path = string.match(pattern, "(.*/)[^/?]+$")
+	if service_path then
+		service_path = string.gsub(service_path, "?", args[1])
+		package.path = service_path .. "?.lua;" .. lua_path
+		SERVICE_PATH = service_path
+	else
+		package.path = lua_path
+		SERVICE_PATH = string.match(pattern, "(.*/).+$")
+	end
+
+	-- run the start function of the service here, inside our own init, so launcher gets one LAUNCHOK
+	local start_func
+	local start = skynet.start
+	skynet.start = function(f)
+		start_func = f
+	end
+	skynet_require.main(main, select(2, table.unpack(args)))
+	skynet.start = start
+	if start_func then
+		start_func()
+	end
+end
+
+skynet.start(function()
+	become(skynet.call(launcher, "lua", "WARM"))
+end)
@@ -0,0 +1,355 @@
+local skynet = require "skynet"
+local queue = require "skynet.queue"
+
+local conf
+local store
+local dirty = {}	-- key -> { value = v, reset = bool } , not flushed yet
+local ndirty = 0
+local inflight	-- the batch being flushed
+local blocked = {}	-- key -> the number of writers of this key waiting for max_keys
+local waiting = {}	-- the coroutines waiting for max_keys, in order
+local closed
+local cs = queue()	-- one flush at a time
+local flusher_token = {}
+local stat = { flush = 0, keys = 0, statements = 0, coalesced = 0, errors = 0 }
+
+local backend = {}
+
+local function sql_value(mysql, v)
+	local t = type(v)
+	if t == "number" then
+		return math.type(v) == "integer" and tostring(v) or string.format("%.17g", v)
+	elseif t == "boolean" then
+		return v and "1" or "0"
+	else
+		return mysql.quote_sql_str(tostring(v))
+	end
+end
+
+-- multi-row INSERT ... ON DUPLICATE KEY UPDATE for the rows with the same columns,
+-- the statements are joined into multi-statement queries of max_query bytes
+function backend.mysql(conf)
+	local mysql = require "skynet.db.mysql"
+	local db = mysql.connect(conf.db)
+	local tbl = "`" .. assert(conf.table) .. "`"
+	local key = "`" .. (conf.key or "id") .. "`"
+	local max_rows = conf.max_rows or 500
+	local max_query = conf.max_query or 1024 * 1024 - 1024
+
+	local function query(sql)
+		local res = db:query(sql)
+		if res.badresult then
+			error(string.format("mysql error %s : %s", res.errno, res.err))
+		end
+	end
+
+	local function flush(batch)
+		local deletes = {}
+		local groups = {}	-- columns -> { cols = { names }, rows... }
+		for k, e in pairs(batch) do
+			if e.reset then
+				deletes[#deletes+1] = sql_value(mysql, k)
+			end
+			local v = e.value
+			if v ~= nil then
+				assert(type(v) == "table", "Need a table of columns")
+				local cols = {}
+				for c in pairs(v) do
+					cols[#cols+1] = c
+				end
+				table.sort(cols)
+				local sig = table.concat(cols, ",")
+				local g = groups[sig]
+				if g == nil then
+					g = { cols = cols }
+					groups[sig] = g
+				end
+				local row = { sql_value(mysql, k) }
+				for i, c in ipairs(cols) do
+					row[i+1] = sql_value(mysql, v[c])
+				end
+				g[#g+1] = "(" .. table.concat(row, ",") .. ")"
+			end
+		end
+		-- the deletes go first, a key deleted and written again in one batch is reset
+		local stmts = {}
+		for i = 1, #deletes, max_rows do
+			stmts[#stmts+1] = string.format("DELETE FROM %s WHERE %s IN (%s)", tbl, key,
+				table.concat(deletes, ",", i, math.min(i + max_rows - 1, #deletes)))
+		end
+		for _, g in pairs(groups) do
+			local names = { key }
+			local update = {}
+			for i, c in ipairs(g.cols) do
+				names[i+1] = "`" .. c .. "`"
+				update[i] = string.format("`%s`=VALUES(`%s`)", c, c)
+			end
+			if #update == 0 then
+				update[1] = key .. "=" .. key
+			end
+			local head = string.format("INSERT INTO %s (%s) VALUES ", tbl, table.concat(names, ","))
+			local tail = " ON DUPLICATE KEY UPDATE " .. table.concat(update, ",")
+			for i = 1, #g, max_rows do
+				stmts[#stmts+1] = head .. table.concat(g, ",", i, math.min(i + max_rows - 1, #g)) .. tail
+			end
+		end
+		local i = 1
+		while i <= #stmts do
+			local size = #stmts[i]
+			local j = i + 1
+			while j <= #stmts and size + #stmts[j] + 1 <= max_query do
+				size = size + #stmts[j] + 1
+				j = j + 1
+			end
+			query(table.concat(stmts, ";", i, j - 1))
+			i = j
+		end
+		return #stmts
+	end
+
+	return {
+		flush = flush,
+		close = function() db:disconnect() end,
+	}
+end
+
+-- DEL / HSET / SET in pipelines of max_ops commands
+function backend.redis(conf)
+	local redis = require "skynet.db.redis"
+	local db = redis.connect(conf.db)
+	local prefix = conf.prefix or ""
+	local max_ops = conf.max_ops or 1000
+
+	local function flush(batch)
+		local ops = {}
+		for k, e in pairs(batch) do
+			local rk = prefix .. k
+			if e.reset then
+				ops[#ops+1] = { "DEL", rk }
+			end
+			local v = e.value
+			if type(v) == "table" then
+				local op = { "HSET", rk }
+				for f, x in pairs(v) do
+					op[#op+1] = f
+					op[#op+1] = tostring(x)
+				end
+				if #op > 2 then
+					ops[#ops+1] = op
+				end
+			elseif v ~= nil then
+				ops[#ops+1] = { "SET", rk, tostring(v) }
+			end
+		end
+		for i = 1, #ops, max_ops do
+			local resp = {}
+			db:pipeline(table.move(ops, i, math.min(i + max_ops - 1, #ops), 1, {}), resp)
+			for _, r in ipairs(resp) do
+				if not r.ok then
+					error("redis error : " .. tostring(r.out))
+				end
+			end
+		end
+		return #ops
+	end
+
+	return {
+		flush = flush,
+		close = function() db:disconnect() end,
+	}
+end
+
+-- the write e after the write old of the same key
+local function merge(old, e)
+	if e.reset then
+		return e
+	end
+	local v = e.value
+	local ov = old.value
+	if type(v) ~= "table" or type(ov) ~= "table" then
+		return { value = v, reset = old.reset }
+	end
+	for f, x in pairs(v) do
+		ov[f] = x
+	end
+	return old
+end
+
+local function kick()
+	skynet.wakeup(flusher_token)
+end
+
+local function write(key, e)
+	local old = dirty[key]
+	if old then
+		dirty[key] = merge(old, e)
+		stat.coalesced = stat.coalesced + 1
+	else
+		dirty[key] = e
+		ndirty = ndirty + 1
+		if ndirty >= conf.batch then
+			kick()
+		end
+	end
+end
+
+-- Only the new keys are limited by max_keys, and once a writer waits, the writers after it
+-- of the same key wait too, so they can't overtake it.
+local function admit(key)
+	if closed then
+		error "write-behind cache closed"
+	end
+	if (dirty[key] == nil and (ndirty >= conf.max_keys or #waiting > 0)) or blocked[key] then
+		local co = coroutine.running()
+		blocked[key] = (blocked[key] or 0) + 1
+		waiting[#waiting+1] = co
+		kick()
+		skynet.wait(co)
+		local n = blocked[key] - 1
+		blocked[key] = n > 0 and n or nil
+	end
+end
+
+-- wake up the writers in order, each of them adds at most one key
+local function release()
+	local n = math.min(#waiting, conf.max_keys - ndirty)
+	if n <= 0 then
+		return
+	end
+	for i = 1, n do
+		skynet.wakeup(waiting[i])
+	end
+	table.move(waiting, n + 1, #waiting + n, 1)
+end
+
+local function flush_once()
+	if ndirty == 0 then
+		release()
+		return true
+	end
+	local batch = dirty
+	dirty = {}
+	ndirty = 0
+	inflight = batch
+	local ok, res = pcall(store.flush, batch)
+	inflight = nil
+	if not ok then
+		-- put the batch back, under the writes made during the flush
+		for k, e in pairs(batch) do
+			local newer = dirty[k]
+			if newer then
+				dirty[k] = merge(e, newer)
+			else
+				dirty[k] = e
+				ndirty = ndirty + 1
+			end
+		end
+		stat.errors = stat.errors + 1
+		skynet.error("write-behind flush failed : " .. tostring(res))
+		return false, res
+	end
+	stat.flush = stat.flush + 1
+	stat.statements = stat.statements + (tonumber(res) or 0)
+	for _ in pairs(batch) do
+		stat.keys = stat.keys + 1
+	end
+	release()
+	return true
+end
+
+local function flusher()
+	while not closed do
+		if ndirty < conf.batch and #waiting == 0 then
+			skynet.sleep(conf.interval, flusher_token)
+		else
+			-- let the writers released by the last flush run
+			skynet.yield()
+		end
+		if not closed and not cs(flush_once) then
+			skynet.sleep(conf.retry)
+		end
+	end
+end
+
+local command = {}
+
+function command.init(opts)
+	conf = opts
+	conf.interval = opts.interval or 100
+	conf.batch = opts.batch or 1000
+	conf.max_keys = math.max(opts.max_keys or 10000, conf.batch)
+	conf.retry = opts.retry or 100
+	local b = opts.backend or "mysql"
+	local create = backend[b] or require(b)
+	store = create(opts)
+	skynet.fork(flusher)
+end
+
+function command.set(key, value)
+	assert(value ~= nil)
+	admit(key)
+	write(key, { value = value })
+end
+
+function command.delete(key)
+	admit(key)
+	write(key, { reset = true })
+end
+
+function command.pending(key)
+	local e = inflight and inflight[key]
+	local d = dirty[key]
+	if d == nil then
+		if e then
+			return e.value, e.reset
+		end
+		return
+	end
+	if e and not d.reset and type(d.value) == "table" and type(e.value) == "table" then
+		-- the patch in flight and the newer one, without touching either
+		local v = {}
+		for f, x in pairs(e.value) do
+			v[f] = x
+		end
+		for f, x in pairs(d.value) do
+			v[f] = x
+		end
+		return v, e.reset
+	end
+	return d.value, d.reset or (e and e.reset)
+end
+
+-- everything written before is in the db when it returns true
+function command.flush()
+	return cs(flush_once)
+end
+
+function command.stat()
+	local s = { dirty = ndirty, waiting = #waiting }
+	for k, v in pairs(stat) do
+		s[k] = v
+	end
+	return s
+end
+
+function command.close()
+	closed = true
+	kick()
+	repeat
+		if cs(flush_once) then
+			skynet.yield()
+		else
+			skynet.sleep(conf.retry)
+		end
+	until ndirty == 0 and #waiting == 0
+	store.close()
+	skynet.ret()
+	skynet.exit()
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, ...)
+		local f = assert(command[cmd])
+		skynet.ret(skynet.pack(f(...)))
+	end)
+end)
@@ -34,6 +34,7 @@
 #define ATOM_FADD(ptr,n) __sync_fetch_and_add(ptr, n)                           // 获取并加
 #define ATOM_FSUB(ptr,n) __sync_fetch_and_sub(ptr, n)                           // 获取并减
 #define ATOM_FAND(ptr,n) __sync_fetch_and_and(ptr, n)                           // 获取并按位与
+#define ATOM_FOR(ptr,n) __sync_fetch_and_or(ptr, n)                             // 获取并按位或
 
 #else
 
@@ -100,6 +101,7 @@ ATOM_CAS_POINTER(STD_ atomic_uintptr_t *ptr, uintptr_t oval, uintptr_t nval) {
 #define ATOM_FADD(ptr,n) STD_ atomic_fetch_add(ptr, atomic_value_type_(ptr, n)) // 获取并加
 #define ATOM_FSUB(ptr,n) STD_ atomic_fetch_sub(ptr, atomic_value_type_(ptr, n)) // 获取并减
 #define ATOM_FAND(ptr,n) STD_ atomic_fetch_and(ptr, atomic_value_type_(ptr, n)) // 获取并按位与
+#define ATOM_FOR(ptr,n) STD_ atomic_fetch_or(ptr, atomic_value_type_(ptr, n))   // 获取并按位或
 
 #endif
 
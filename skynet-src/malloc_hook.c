@@ -3,21 +3,36 @@
  * 提供内存使用统计和调试功能，支持按服务统计内存使用量
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// dladdr 和 Dl_info 需要 _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <lua.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <lauxlib.h>
 
 #include "malloc_hook.h"
 #include "skynet.h"
 #include "atomic.h"
+#include "spinlock.h"
+#include "skynet_timer.h"
+#include "skynet_probe.h"
 
 // turn on MEMORY_CHECK can do more memory check, such as double free
 // 开启MEMORY_CHECK可以进行更多内存检查，如双重释放检测
 // #define MEMORY_CHECK
 
+// build with SKYNET_DEFINES=-DMEMORY_NOCOOKIE to drop the per-allocation cookie,
+// per-service totals then come from the lua allocator of snlua services only
+// 定义MEMORY_NOCOOKIE时不在每个内存块前加cookie，按服务的统计只来自snlua服务的Lua分配器
+
 // 内存标签定义
 #define MEMORY_ALLOCTAG 0x20140605  // 分配内存标签
 #define MEMORY_FREETAG 0x0badf00d   // 释放内存标签
@@ -53,6 +68,13 @@ struct mem_cookie {
 // 内存统计数组，按handle的低16位索引
 static struct mem_data mem_stats[SLOT_SIZE];
 
+// Lua虚拟机的arena模式（配置lua_arena）
+#define LUA_ARENA_NONE 0
+#define LUA_ARENA_SERVICE 1     // 每个服务一个arena，服务退出时整个销毁
+#define LUA_ARENA_CLASS 2       // 同名服务共用一个arena，最后一个退出时把空闲页还给系统
+
+static int lua_arena_mode = LUA_ARENA_NONE;
+
 
 #ifndef NOUSE_JEMALLOC
 
@@ -74,9 +96,11 @@ get_allocated_field(uint32_t handle) {
 	struct mem_data *data = &mem_stats[h];
 	uint32_t old_handle = data->handle;
 	ssize_t old_alloc = (ssize_t)data->allocated;
-	if(old_handle == 0 || old_alloc <= 0) {
+	if(old_handle != handle && (old_handle == 0 || old_alloc <= 0)) {
 		// data->allocated may less than zero, because it may not count at start.
 		// data->allocated可能小于零，因为在开始时可能没有计数
+		// 同一个服务的负值不清零：内存可能在别的线程释放，释放先合并进来，
+		// 分配还留在原线程的缓存里，等它合并后就会抵消
 		if(!ATOM_CAS_ULONG(&data->handle, old_handle, handle)) {
 			return 0;
 		}
@@ -90,6 +114,89 @@ get_allocated_field(uint32_t handle) {
 	return &data->allocated;
 }
 
+/*
+ * 线程本地的统计缓存
+ * 分配和释放先累加在本线程里，由malloc_fold（或者累计MEM_FOLD_OPS次操作后）合并到全局统计，
+ * 这样每次分配不再需要原子操作，也不会在mem_stats上产生伪共享
+ */
+#define MEM_CACHE_SLOT 16
+#define MEM_FOLD_OPS 1024
+
+struct mem_cache {
+	ssize_t used;
+	ssize_t block;
+	int ops;
+	uint32_t handle[MEM_CACHE_SLOT];
+	ssize_t allocated[MEM_CACHE_SLOT];
+};
+
+static __thread struct mem_cache mem_cache;
+
+// 把一个服务的累计值合并到mem_stats
+static inline void
+fold_allocated(uint32_t handle, ssize_t n) {
+	ATOM_SIZET * allocated = get_allocated_field(handle);
+	if(allocated) {
+		ATOM_FADD(allocated, (size_t)n);
+	}
+}
+
+void
+malloc_fold(void) {
+	struct mem_cache *c = &mem_cache;
+	int i;
+	if (c->used != 0 || c->block != 0) {
+		ATOM_FADD(&_used_memory, (size_t)c->used);
+		ATOM_FADD(&_memory_block, (size_t)c->block);
+		c->used = 0;
+		c->block = 0;
+	}
+	for (i=0;i<MEM_CACHE_SLOT;i++) {
+		if (c->allocated[i] != 0) {
+			fold_allocated(c->handle[i], c->allocated[i]);
+			c->allocated[i] = 0;
+		}
+	}
+	c->ops = 0;
+}
+
+/*
+ * 记录一个服务的内存变化
+ * @param handle: 内存所属的服务handle
+ * @param n: 增加（释放时为负）的字节数
+ */
+inline static void
+update_service_stat(uint32_t handle, ssize_t n) {
+	struct mem_cache *c = &mem_cache;
+	int slot = handle & (MEM_CACHE_SLOT - 1);
+	if (c->handle[slot] != handle) {
+		if (c->allocated[slot] != 0) {
+			fold_allocated(c->handle[slot], c->allocated[slot]);
+		}
+		c->handle[slot] = handle;
+		c->allocated[slot] = n;
+	} else {
+		c->allocated[slot] += n;
+	}
+}
+
+// 记录内存总量的变化
+inline static void
+update_total_stat(ssize_t n, int block) {
+	struct mem_cache *c = &mem_cache;
+	c->used += n;
+	c->block += block;
+	if (++c->ops >= MEM_FOLD_OPS) {
+		malloc_fold();
+	}
+}
+
+inline static void
+update_xmalloc_stat(uint32_t handle, ssize_t n, int block) {
+	update_service_stat(handle, n);
+	update_total_stat(n, block);
+}
+
 /*
  * 更新内存分配统计信息
  * @param handle: 分配内存的服务handle
@@ -97,12 +204,7 @@ get_allocated_field(uint32_t handle) {
  */
 inline static void
 update_xmalloc_stat_alloc(uint32_t handle, size_t __n) {
-	ATOM_FADD(&_used_memory, __n);     // 增加全局内存使用量
-	ATOM_FINC(&_memory_block);         // 增加内存块计数
-	ATOM_SIZET * allocated = get_allocated_field(handle);
-	if(allocated) {
-		ATOM_FADD(allocated, __n);     // 增加服务的内存使用量
-	}
+	update_xmalloc_stat(handle, (ssize_t)__n, 1);
 }
 
 /*
@@ -112,16 +214,125 @@ update_xmalloc_stat_alloc(uint32_t handle, size_t __n) {
  */
 inline static void
 update_xmalloc_stat_free(uint32_t handle, size_t __n) {
-	ATOM_FSUB(&_used_memory, __n);     // 减少全局内存使用量
-	ATOM_FDEC(&_memory_block);         // 减少内存块计数
-	ATOM_SIZET * allocated = get_allocated_field(handle);
-	if(allocated) {
-		ATOM_FSUB(allocated, __n);     // 减少服务的内存使用量
+	update_xmalloc_stat(handle, -(ssize_t)__n, -1);
+}
+
+/*
+ * 按服务的堆采样
+ * 平均每分配interval字节采样一块C内存，记下所属服务、调用者地址，
+ * 在snlua服务里还记下当时正在运行的Lua调用栈。被采样的块在cookie_size的最高位做标记，
+ * 释放时据此删除记录，所以记录里始终是还没有释放的内存，用来找泄漏的服务和分配位置。
+ * Lua虚拟机自己的内存不走cookie，不参与采样（按服务的总量见snlua的内存统计）。
+ */
+
+#define MEMORY_SAMPLED 0x80000000u  // cookie_size的最高位：这块内存有采样记录
+#define PROFILE_HASH 4096
+#define PROFILE_STACK 128           // 记录Lua调用栈的长度
+#define PROFILE_DEPTH 4             // 记录Lua调用栈的层数
+
+struct mem_sample {
+	struct mem_sample *next;
+	void *ptr;
+	size_t size;
+	uint32_t handle;
+	void *caller;
+	char stack[PROFILE_STACK];
+};
+
+static ATOM_SIZET _profile_interval = 0;
+static ATOM_INT _profile_init = 0;
+static struct spinlock _profile_lock;
+static struct mem_sample * _profile_hash[PROFILE_HASH];
+static size_t _profile_count = 0;
+
+static __thread ssize_t _profile_countdown = 0;
+static __thread uint32_t _profile_handle = 0;
+static __thread lua_State * _profile_L = NULL;
+
+static inline int
+profile_hash(void *ptr) {
+	return (int)(((uintptr_t)ptr >> 4) & (PROFILE_HASH - 1));
+}
+
+static inline bool
+profile_sample(size_t sz) {
+	size_t interval = ATOM_LOAD(&_profile_interval);
+	if (interval == 0)
+		return false;
+	_profile_countdown -= (ssize_t)sz;
+	if (_profile_countdown > 0)
+		return false;
+	_profile_countdown += (ssize_t)interval;
+	if (_profile_countdown <= 0)
+		_profile_countdown = (ssize_t)interval;
+	return true;
+}
+
+// 记下当前线程正在运行的Lua调用栈，只在分配发生在同一个服务里时可信
+static void
+profile_stack(uint32_t handle, char *buf) {
+	buf[0] = '\0';
+	lua_State *L = _profile_L;
+	if (L == NULL || handle == 0 || handle != _profile_handle)
+		return;
+	lua_Debug ar;
+	int level;
+	size_t n = 0;
+	for (level = 0; level < PROFILE_DEPTH && lua_getstack(L, level, &ar); level++) {
+		if (lua_getinfo(L, "Sl", &ar) == 0 || ar.currentline < 0)
+			continue;
+		int r = snprintf(buf + n, PROFILE_STACK - n, "%s%s:%d", n ? ";" : "", ar.short_src, ar.currentline);
+		if (r < 0 || (size_t)r >= PROFILE_STACK - n) {
+			buf[n] = '\0';
+			break;
+		}
+		n += r;
+	}
+}
+
+static void
+profile_record(void *ptr, size_t sz, uint32_t handle, void *caller) {
+	struct mem_sample *s = je_malloc(sizeof(*s));
+	if (s == NULL)
+		return;
+	s->ptr = ptr;
+	s->size = sz;
+	s->handle = handle;
+	s->caller = caller;
+	profile_stack(handle, s->stack);
+	int h = profile_hash(ptr);
+	spinlock_lock(&_profile_lock);
+	s->next = _profile_hash[h];
+	_profile_hash[h] = s;
+	++_profile_count;
+	spinlock_unlock(&_profile_lock);
+}
+
+static void
+profile_remove(void *ptr) {
+	struct mem_sample **p = &_profile_hash[profile_hash(ptr)];
+	struct mem_sample *s;
+	spinlock_lock(&_profile_lock);
+	while ((s = *p) != NULL) {
+		if (s->ptr == ptr) {
+			*p = s->next;
+			--_profile_count;
+			break;
+		}
+		p = &s->next;
 	}
+	spinlock_unlock(&_profile_lock);
+	je_free(s);
+}
+
+void
+malloc_profile_lua(uint32_t handle, lua_State *L) {
+	_profile_handle = handle;
+	_profile_L = L;
 }
 
 inline static void*
-fill_prefix(char* ptr, size_t sz, uint32_t cookie_size) {
+fill_prefix(char* ptr, size_t sz, uint32_t cookie_size, void *caller) {
 	uint32_t handle = skynet_current_handle();
 	struct mem_cookie *p = (struct mem_cookie *)ptr;
 	char * ret = ptr + cookie_size;
@@ -131,6 +342,10 @@ fill_prefix(char* ptr, size_t sz, uint32_t cookie_size) {
 	p->dogtag = MEMORY_ALLOCTAG;
 #endif
 	update_xmalloc_stat_alloc(handle, sz);
+	if (profile_sample(sz)) {
+		profile_record(ret, sz, handle, caller);
+		cookie_size |= MEMORY_SAMPLED;
+	}
 	memcpy(ret - sizeof(uint32_t), &cookie_size, sizeof(cookie_size));
 	return ret;
 }
@@ -139,12 +354,17 @@ inline static uint32_t
 get_cookie_size(char *ptr) {
 	uint32_t cookie_size;
 	memcpy(&cookie_size, ptr - sizeof(cookie_size), sizeof(cookie_size));
-	return cookie_size;
+	return cookie_size & ~MEMORY_SAMPLED;
 }
 
 inline static void*
 clean_prefix(char* ptr) {
-	uint32_t cookie_size = get_cookie_size(ptr);
+	uint32_t cookie_size;
+	memcpy(&cookie_size, ptr - sizeof(cookie_size), sizeof(cookie_size));
+	if (cookie_size & MEMORY_SAMPLED) {
+		profile_remove(ptr);
+		cookie_size &= ~MEMORY_SAMPLED;
+	}
 	struct mem_cookie *p = (struct mem_cookie *)(ptr - cookie_size);
 	uint32_t handle = p->handle;
 #ifdef MEMORY_CHECK
@@ -203,6 +423,359 @@ mallctl_int64(const char* name, size_t* newval) {
 	return v;
 }
 
+/*
+ * 创建一个新的jemalloc arena
+ * @return: arena编号，失败返回-1
+ */
+int
+malloc_arena_create(void) {
+	unsigned arena = 0;
+	size_t len = sizeof(arena);
+	if (je_mallctl("arenas.create", &arena, &len, NULL, 0)) {
+		return -1;
+	}
+	return (int)arena;
+}
+
+/*
+ * 将当前线程绑定到指定的jemalloc arena
+ * @param arena: arena编号
+ * @return: 成功返回0
+ */
+int
+malloc_thread_arena(int arena) {
+	unsigned a = (unsigned)arena;
+	return je_mallctl("thread.arena", NULL, NULL, &a, sizeof(a));
+}
+
+#define LUA_CLASS_MAX 64
+#define LUA_CLASS_NAME 32
+
+// 按服务名共用的arena
+struct lua_class {
+	char name[LUA_CLASS_NAME];
+	int arena;
+	int n;          // 正在使用的服务数量
+};
+
+static struct {
+	struct spinlock lock;
+	int n;
+	struct lua_class c[LUA_CLASS_MAX];
+} LUA_CLASS;
+
+// 在启动任何服务之前调用
+void
+malloc_lua_arena(const char *mode) {
+	spinlock_init(&LUA_CLASS.lock);
+	LUA_CLASS.n = 0;
+	if (mode == NULL || strcmp(mode, "none") == 0) {
+		lua_arena_mode = LUA_ARENA_NONE;
+	} else if (strcmp(mode, "service") == 0) {
+		lua_arena_mode = LUA_ARENA_SERVICE;
+	} else if (strcmp(mode, "class") == 0) {
+		lua_arena_mode = LUA_ARENA_CLASS;
+	} else {
+		skynet_error(NULL, "Unknown lua_arena mode %s, use none", mode);
+		lua_arena_mode = LUA_ARENA_NONE;
+	}
+}
+
+// 找到（或创建）服务名对应的arena，失败返回-1
+static int
+lua_class_arena(const char *name) {
+	int i;
+	int arena = -1;
+	spinlock_lock(&LUA_CLASS.lock);
+	for (i=0;i<LUA_CLASS.n;i++) {
+		struct lua_class *c = &LUA_CLASS.c[i];
+		if (strcmp(c->name, name) == 0) {
+			++c->n;
+			arena = c->arena;
+			break;
+		}
+	}
+	if (arena < 0 && LUA_CLASS.n < LUA_CLASS_MAX) {
+		arena = malloc_arena_create();
+		if (arena >= 0) {
+			struct lua_class *c = &LUA_CLASS.c[LUA_CLASS.n++];
+			snprintf(c->name, sizeof(c->name), "%s", name);
+			c->arena = arena;
+			c->n = 1;
+		}
+	}
+	spinlock_unlock(&LUA_CLASS.lock);
+	return arena;
+}
+
+static void
+lua_class_release(int arena) {
+	int i;
+	int purge = 0;
+	spinlock_lock(&LUA_CLASS.lock);
+	for (i=0;i<LUA_CLASS.n;i++) {
+		struct lua_class *c = &LUA_CLASS.c[i];
+		if (c->arena == arena) {
+			purge = (--c->n == 0);
+			break;
+		}
+	}
+	spinlock_unlock(&LUA_CLASS.lock);
+	if (purge) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "arena.%d.purge", arena);
+		je_mallctl(cmd, NULL, NULL, NULL, 0);
+	}
+}
+
+/*
+ * 为名为name的服务的Lua虚拟机准备arena和tcache
+ * 返回mallocx的标志，由skynet_lalloc_x使用；0表示没有开启lua_arena，用默认的分配方式
+ * 每个虚拟机有自己的tcache，服务的消息是串行处理的，所以不用加锁；缓存里只有这个arena的内存，销毁arena前先销毁tcache
+ */
+int
+skynet_lalloc_open(const char *name) {
+	int arena;
+	switch (lua_arena_mode) {
+	case LUA_ARENA_SERVICE:
+		arena = malloc_arena_create();
+		break;
+	case LUA_ARENA_CLASS:
+		arena = lua_class_arena(name);
+		break;
+	default:
+		return 0;
+	}
+	if (arena < 0) {
+		return 0;
+	}
+	int flags = MALLOCX_ARENA(arena);
+	unsigned tcache;
+	size_t len = sizeof(tcache);
+	if (je_mallctl("tcache.create", &tcache, &len, NULL, 0) == 0) {
+		flags |= MALLOCX_TCACHE(tcache);
+	} else {
+		flags |= MALLOCX_TCACHE_NONE;
+	}
+	return flags;
+}
+
+void *
+skynet_lalloc_x(void *ptr, size_t osize, size_t nsize, int flags) {
+	SKYNET_PROBE3(lalloc, ptr, osize, nsize);
+	if (nsize == 0) {
+		if (ptr)
+			je_dallocx(ptr, flags);
+		return NULL;
+	} else if (ptr == NULL) {
+		return je_mallocx(nsize, flags);
+	} else {
+		return je_rallocx(ptr, nsize, flags);
+	}
+}
+
+// 可以在其他线程调用：虚拟机的tcache只属于服务线程，这里不经过它
+void
+skynet_lalloc_free(void *ptr, int flags) {
+	if (flags == 0)
+		raw_free(ptr);
+	else
+		je_dallocx(ptr, MALLOCX_TCACHE_NONE);
+}
+
+// 虚拟机关闭以后调用，按服务分配的arena整个销毁
+void
+skynet_lalloc_close(int flags) {
+	if (flags == 0)
+		return;
+	// 按MALLOCX_ARENA和MALLOCX_TCACHE的编码取回arena和tcache
+	int arena = ((flags >> 20) & 0xfff) - 1;
+	int tcache = ((flags >> 8) & 0xfff) - 2;
+	if (tcache >= 0) {
+		unsigned tc = tcache;
+		je_mallctl("tcache.destroy", NULL, NULL, &tc, sizeof(tc));
+	}
+	if (lua_arena_mode == LUA_ARENA_SERVICE) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "arena.%d.destroy", arena);
+		je_mallctl(cmd, NULL, NULL, NULL, 0);
+	} else {
+		lua_class_release(arena);
+	}
+}
+
+void
+skynet_lalloc_trim(int flags) {
+	if (flags == 0)
+		return;
+	int arena = ((flags >> 20) & 0xfff) - 1;
+	int tcache = ((flags >> 8) & 0xfff) - 2;
+	if (tcache >= 0) {
+		unsigned tc = tcache;
+		je_mallctl("tcache.flush", NULL, NULL, &tc, sizeof(tc));
+	}
+	// 同名服务共用的arena还在被其他服务使用，由jemalloc按时间衰减归还
+	if (lua_arena_mode == LUA_ARENA_SERVICE) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "arena.%d.purge", arena);
+		je_mallctl(cmd, NULL, NULL, NULL, 0);
+	}
+}
+
+/*
+ * jemalloc的整理：后台线程，dirty和muzzy页的衰减时间（配置jemalloc_background和jemalloc_decay），
+ * 以及空闲的工作线程每隔jemalloc_purge毫秒让一个arena（轮流）按衰减时间归还内存。
+ * jemalloc只在分配时顺便衰减，不再分配的arena不会归还；每次只整理一个arena，避免一次归还太多造成停顿
+ */
+struct malloc_purge {
+	struct spinlock lock;       // 保护stat
+	int interval;               // 空闲整理的间隔（毫秒），0为关闭
+	ATOM_ULONG next;            // 下次空闲整理的时间（纳秒）
+	ATOM_INT busy;              // 同时只有一个线程整理
+	unsigned arena;             // 下次空闲整理的arena
+	struct malloc_purge_stat stat;
+};
+
+static struct malloc_purge PURGE;
+
+// arena（MALLCTL_ARENAS_ALL为所有）中dirty和muzzy页的字节数
+static size_t
+arena_unused(unsigned arena) {
+	uint64_t epoch = 1;
+	size_t len = sizeof(epoch);
+	je_mallctl("epoch", &epoch, &len, &epoch, len);	// 刷新统计
+	char name[64];
+	size_t dirty = 0, muzzy = 0, page = 0;
+	len = sizeof(size_t);
+	snprintf(name, sizeof(name), "stats.arenas.%u.pdirty", arena);
+	je_mallctl(name, &dirty, &len, NULL, 0);
+	snprintf(name, sizeof(name), "stats.arenas.%u.pmuzzy", arena);
+	je_mallctl(name, &muzzy, &len, NULL, 0);
+	je_mallctl("arenas.page", &page, &len, NULL, 0);
+	return (dirty + muzzy) * page;
+}
+
+// cmd为purge（全部归还）或decay（按衰减时间归还），返回归还的字节数
+static size_t
+arena_purge(unsigned arena, const char *cmd) {
+	uint64_t start = skynet_monotonic_time();
+	size_t before = arena_unused(arena);
+	char name[64];
+	snprintf(name, sizeof(name), "arena.%u.%s", arena, cmd);
+	if (je_mallctl(name, NULL, NULL, NULL, 0) != 0) {
+		// arena不存在（或者已经销毁）
+		return 0;
+	}
+	size_t after = arena_unused(arena);
+	size_t bytes = before > after ? before - after : 0;
+	uint64_t cost = (skynet_monotonic_time() - start) / 1000;
+	spinlock_lock(&PURGE.lock);
+	++PURGE.stat.count;
+	PURGE.stat.bytes += bytes;
+	PURGE.stat.last_bytes = bytes;
+	PURGE.stat.last_arena = arena == MALLCTL_ARENAS_ALL ? -1 : (int)arena;
+	PURGE.stat.last_usec = cost;
+	spinlock_unlock(&PURGE.lock);
+	return bytes;
+}
+
+size_t
+malloc_purge(int arena) {
+	return arena_purge(arena < 0 ? MALLCTL_ARENAS_ALL : (unsigned)arena, "purge");
+}
+
+void
+malloc_purge_idle(void) {
+	int interval = PURGE.interval;
+	if (interval <= 0)
+		return;
+	uint64_t now = skynet_monotonic_time();
+	if (now < ATOM_LOAD(&PURGE.next) || !ATOM_CAS(&PURGE.busy, 0, 1))
+		return;
+	ATOM_STORE(&PURGE.next, now + (uint64_t)interval * 1000000);
+	unsigned narenas = 0;
+	size_t len = sizeof(narenas);
+	if (je_mallctl("arenas.narenas", &narenas, &len, NULL, 0) == 0 && narenas > 0) {
+		unsigned arena = PURGE.arena++ % narenas;
+		arena_purge(arena, "decay");
+	}
+	ATOM_STORE(&PURGE.busy, 0);
+}
+
+static void
+set_decay(const char *what, ssize_t ms) {
+	char name[64];
+	snprintf(name, sizeof(name), "arenas.%s_decay_ms", what);
+	// 新arena的默认值
+	if (je_mallctl(name, NULL, NULL, &ms, sizeof(ms)) != 0) {
+		skynet_error(NULL, "jemalloc : can't set %s to %zd", name, ms);
+		return;
+	}
+	unsigned narenas = 0;
+	size_t len = sizeof(narenas);
+	je_mallctl("arenas.narenas", &narenas, &len, NULL, 0);
+	unsigned i;
+	for (i=0;i<narenas;i++) {
+		snprintf(name, sizeof(name), "arena.%u.%s_decay_ms", i, what);
+		je_mallctl(name, NULL, NULL, &ms, sizeof(ms));
+	}
+}
+
+static ssize_t
+get_decay(const char *what) {
+	char name[64];
+	ssize_t ms = 0;
+	size_t len = sizeof(ms);
+	snprintf(name, sizeof(name), "arenas.%s_decay_ms", what);
+	je_mallctl(name, &ms, &len, NULL, 0);
+	return ms;
+}
+
+void
+malloc_decay(ssize_t *dirty, ssize_t *muzzy) {
+	if (*dirty >= -1)
+		set_decay("dirty", *dirty);
+	if (*muzzy >= -1)
+		set_decay("muzzy", *muzzy);
+	*dirty = get_decay("dirty");
+	*muzzy = get_decay("muzzy");
+}
+
+void
+malloc_purge_stat(struct malloc_purge_stat *stat) {
+	spinlock_lock(&PURGE.lock);
+	*stat = PURGE.stat;
+	spinlock_unlock(&PURGE.lock);
+	stat->interval = PURGE.interval;
+}
+
+void
+malloc_purge_config(int background, const char *decay, int interval) {
+	spinlock_init(&PURGE.lock);
+	PURGE.stat.last_arena = -1;
+	if (background) {
+		bool enable = true;
+		if (je_mallctl("background_thread", NULL, NULL, &enable, sizeof(enable)) != 0) {
+			skynet_error(NULL, "jemalloc : can't enable background thread");
+		}
+	}
+	if (decay) {
+		// "dirty[,muzzy]" 毫秒，-1为不衰减
+		ssize_t dirty = -2, muzzy = -2;
+		char *end;
+		dirty = strtol(decay, &end, 10);
+		if (*end == ',') {
+			muzzy = strtol(end + 1, &end, 10);
+		}
+		if (*end != '\0' || end == decay) {
+			skynet_error(NULL, "Invalid jemalloc_decay %s", decay);
+		} else {
+			malloc_decay(&dirty, &muzzy);
+		}
+	}
+	PURGE.interval = interval > 0 ? interval : 0;
+}
+
 int
 mallctl_opt(const char* name, int* newval) {
 	int v = 0;
@@ -221,6 +794,276 @@ mallctl_opt(const char* name, int* newval) {
 	return v;
 }
 
+/*
+ * 消息负载的定长小块分配器
+ * 从一段预留的地址空间按64K页切出16到256字节的5种定长块，每页只放一种规格。
+ * 每个线程为每种规格保留一个弹匣（magazine），分配和释放通常不加锁；
+ * 弹匣空了从全局仓库（depot）取一批，满了还回一批，仓库的操作是O(1)的。
+ * 消息通常在一个线程分配、在另一个线程释放，块会随批次在线程间流动，不要求还给分配它的线程。
+ * skynet_free/skynet_realloc按地址范围识别这些块。
+ */
+
+#define SLAB_CLASS 5
+#define SLAB_MIN_SHIFT 4                    // 最小块16字节
+#define SLAB_MAX (16 << (SLAB_CLASS - 1))   // 最大块256字节
+#define SLAB_PAGE_SHIFT 16                  // 64K页
+#define SLAB_PAGE_SIZE (1 << SLAB_PAGE_SHIFT)
+#define SLAB_PAGES 4096                     // 共预留256M地址空间，用到才占物理内存
+#define SLAB_REGION ((size_t)SLAB_PAGES << SLAB_PAGE_SHIFT)
+#define SLAB_BATCH 32                       // 线程与仓库之间一次转移的块数
+#define SLAB_MAGAZINE (SLAB_BATCH * 2)
+
+struct slab_node {
+	struct slab_node *next;     // 批次内的下一块
+	struct slab_node *batch;    // 仅批次的第一块使用：仓库里的下一批
+};
+
+struct slab_depot {
+	struct spinlock lock;
+	struct slab_node *batch;
+	char *page_ptr;             // 当前页中尚未切出的部分
+	char *page_end;
+};
+
+struct slab_magazine {
+	int n;
+	void * obj[SLAB_MAGAZINE];
+};
+
+static char * _slab_base = NULL;
+static ATOM_INT _slab_next_page = 0;
+static uint8_t _slab_page_class[SLAB_PAGES];
+static struct slab_depot _slab_depot[SLAB_CLASS];
+static __thread struct slab_magazine _slab_magazine[SLAB_CLASS];
+
+static bool
+slab_init(void) {
+	static ATOM_INT init = 0;   // 0:未初始化 1:初始化中 2:完成 3:失败
+	for (;;) {
+		int state = ATOM_LOAD(&init);
+		if (state == 2)
+			return true;
+		if (state == 3)
+			return false;
+		if (state == 0 && ATOM_CAS(&init, 0, 1)) {
+			int i;
+			for (i=0;i<SLAB_CLASS;i++) {
+				spinlock_init(&_slab_depot[i].lock);
+			}
+			void * p = mmap(NULL, SLAB_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (p == MAP_FAILED) {
+				ATOM_STORE(&init, 3);
+				return false;
+			}
+			_slab_base = p;
+			ATOM_STORE(&init, 2);
+			return true;
+		}
+	}
+}
+
+static inline bool
+slab_owns(void *ptr) {
+	return _slab_base && (size_t)((char *)ptr - _slab_base) < SLAB_REGION;
+}
+
+static inline int
+slab_class(size_t sz) {
+	int c = 0;
+	while ((size_t)(1 << (c + SLAB_MIN_SHIFT)) < sz)
+		++c;
+	return c;
+}
+
+static inline size_t
+slab_size(void *ptr) {
+	size_t page = (size_t)((char *)ptr - _slab_base) >> SLAB_PAGE_SHIFT;
+	return (size_t)1 << (_slab_page_class[page] + SLAB_MIN_SHIFT);
+}
+
+// 弹匣空了：从仓库取一批，仓库也空就切一页新的，返回取到的块数
+static int
+slab_refill(int c, struct slab_magazine *m) {
+	struct slab_depot *d = &_slab_depot[c];
+	size_t sz = (size_t)1 << (c + SLAB_MIN_SHIFT);
+	struct slab_node *b;
+	spinlock_lock(&d->lock);
+	b = d->batch;
+	if (b) {
+		d->batch = b->batch;
+		spinlock_unlock(&d->lock);
+		while (b) {
+			m->obj[m->n++] = b;
+			b = b->next;
+		}
+		return m->n;
+	}
+	if (d->page_ptr == d->page_end) {
+		int page = ATOM_FINC(&_slab_next_page);
+		if (page >= SLAB_PAGES) {
+			spinlock_unlock(&d->lock);
+			return 0;
+		}
+		_slab_page_class[page] = c;
+		d->page_ptr = _slab_base + ((size_t)page << SLAB_PAGE_SHIFT);
+		d->page_end = d->page_ptr + SLAB_PAGE_SIZE;
+	}
+	while (m->n < SLAB_BATCH && d->page_ptr < d->page_end) {
+		m->obj[m->n++] = d->page_ptr;
+		d->page_ptr += sz;
+	}
+	spinlock_unlock(&d->lock);
+	return m->n;
+}
+
+static void
+slab_free(void *ptr) {
+	size_t page = (size_t)((char *)ptr - _slab_base) >> SLAB_PAGE_SHIFT;
+	int c = _slab_page_class[page];
+	struct slab_magazine *m = &_slab_magazine[c];
+	update_total_stat(-((ssize_t)1 << (c + SLAB_MIN_SHIFT)), -1);
+	if (m->n == SLAB_MAGAZINE) {
+		// 弹匣满了：把后一半串成一批还给仓库
+		struct slab_node *b = NULL;
+		int i;
+		for (i=SLAB_MAGAZINE-SLAB_BATCH;i<SLAB_MAGAZINE;i++) {
+			struct slab_node *node = m->obj[i];
+			node->next = b;
+			b = node;
+		}
+		m->n -= SLAB_BATCH;
+		struct slab_depot *d = &_slab_depot[c];
+		spinlock_lock(&d->lock);
+		b->batch = d->batch;
+		d->batch = b;
+		spinlock_unlock(&d->lock);
+	}
+	m->obj[m->n++] = ptr;
+}
+
+void *
+skynet_slab_alloc(size_t sz) {
+	if (sz == 0 || sz > SLAB_MAX || !slab_init())
+		return skynet_malloc(sz);
+	int c = slab_class(sz);
+	struct slab_magazine *m = &_slab_magazine[c];
+	if (m->n == 0 && slab_refill(c, m) == 0) {
+		// 预留的地址空间用完了
+		return skynet_malloc(sz);
+	}
+	update_total_stat((ssize_t)1 << (c + SLAB_MIN_SHIFT), 1);
+	return m->obj[--m->n];
+}
+
+// 小块不能原地扩展，挪到普通内存里
+static void *
+slab_realloc(void *ptr, size_t size) {
+	void *newptr = skynet_malloc(size);
+	size_t sz = slab_size(ptr);
+	memcpy(newptr, ptr, sz < size ? sz : size);
+	slab_free(ptr);
+	return newptr;
+}
+
+#ifdef MEMORY_NOCOOKIE
+
+#ifdef MEMORY_CHECK
+#error "MEMORY_CHECK needs the memory cookie"
+#endif
+
+/*
+ * 不在内存块前加cookie：总量用jemalloc记录的块大小统计，
+ * C内存不再按服务统计，按服务的统计来自Lua虚拟机的分配器（见skynet_lalloc_account）
+ */
+
+void
+skynet_lalloc_account(uint32_t handle, ptrdiff_t delta) {
+	update_service_stat(handle, delta);
+}
+
+void *
+skynet_malloc(size_t size) {
+	void* ptr = je_malloc(size);
+	if(!ptr) malloc_oom(size);
+	update_total_stat(je_sallocx(ptr, 0), 1);
+	return ptr;
+}
+
+void *
+skynet_realloc(void *ptr, size_t size) {
+	if (ptr == NULL) return skynet_malloc(size);
+	if (slab_owns(ptr)) return slab_realloc(ptr, size);
+	ssize_t osize = je_sallocx(ptr, 0);
+	void *newptr = je_realloc(ptr, size);
+	if(!newptr) malloc_oom(size);
+	update_total_stat((ssize_t)je_sallocx(newptr, 0) - osize, 0);
+	return newptr;
+}
+
+void
+skynet_free(void *ptr) {
+	if (ptr == NULL) return;
+	if (slab_owns(ptr)) {
+		slab_free(ptr);
+		return;
+	}
+	update_total_stat(-(ssize_t)je_sallocx(ptr, 0), -1);
+	je_free(ptr);
+}
+
+void *
+skynet_calloc(size_t nmemb, size_t size) {
+	void* ptr = je_calloc(nmemb, size);
+	if(!ptr) malloc_oom(nmemb * size);
+	update_total_stat(je_sallocx(ptr, 0), 1);
+	return ptr;
+}
+
+void *
+skynet_memalign(size_t alignment, size_t size) {
+	void* ptr = je_memalign(alignment, size);
+	if(!ptr) malloc_oom(size);
+	update_total_stat(je_sallocx(ptr, 0), 1);
+	return ptr;
+}
+
+void *
+skynet_aligned_alloc(size_t alignment, size_t size) {
+	void* ptr = je_aligned_alloc(alignment, size);
+	if(!ptr) malloc_oom(size);
+	update_total_stat(je_sallocx(ptr, 0), 1);
+	return ptr;
+}
+
+int
+skynet_posix_memalign(void **memptr, size_t alignment, size_t size) {
+	int err = je_posix_memalign(memptr, alignment, size);
+	if (err) malloc_oom(size);
+	update_total_stat(je_sallocx(*memptr, 0), 1);
+	return err;
+}
+
+size_t
+malloc_profile(size_t *interval) {
+	if (interval && *interval) {
+		skynet_error(NULL, "Heap sample needs the memory cookie, build without MEMORY_NOCOOKIE");
+	}
+	return 0;
+}
+
+int
+malloc_profile_dump(lua_State *L) {
+	lua_newtable(L);
+	return 1;
+}
+
+#else
+
+void
+skynet_lalloc_account(uint32_t handle, ptrdiff_t delta) {
+	// 有cookie时C内存已经按服务统计，Lua虚拟机的内存不计入
+}
+
 // hook : malloc, realloc, free, calloc
 // 钩子函数：malloc, realloc, free, calloc
 
@@ -228,23 +1071,28 @@ void *
 skynet_malloc(size_t size) {
 	void* ptr = je_malloc(size + PREFIX_SIZE);
 	if(!ptr) malloc_oom(size);
-	return fill_prefix(ptr, size, PREFIX_SIZE);
+	return fill_prefix(ptr, size, PREFIX_SIZE, __builtin_return_address(0));
 }
 
 void *
 skynet_realloc(void *ptr, size_t size) {
 	if (ptr == NULL) return skynet_malloc(size);
+	if (slab_owns(ptr)) return slab_realloc(ptr, size);
 
 	uint32_t cookie_size = get_cookie_size(ptr);
 	void* rawptr = clean_prefix(ptr);
 	void *newptr = je_realloc(rawptr, size+cookie_size);
 	if(!newptr) malloc_oom(size);
-	return fill_prefix(newptr, size, cookie_size);
+	return fill_prefix(newptr, size, cookie_size, __builtin_return_address(0));
 }
 
 void
 skynet_free(void *ptr) {
 	if (ptr == NULL) return;
+	if (slab_owns(ptr)) {
+		slab_free(ptr);
+		return;
+	}
 	void* rawptr = clean_prefix(ptr);
 	je_free(rawptr);
 }
@@ -254,7 +1102,7 @@ skynet_calloc(size_t nmemb, size_t size) {
 	uint32_t cookie_n = (PREFIX_SIZE+size-1)/size;
 	void* ptr = je_calloc(nmemb + cookie_n, size);
 	if(!ptr) malloc_oom(nmemb * size);
-	return fill_prefix(ptr, nmemb * size, cookie_n * size);
+	return fill_prefix(ptr, nmemb * size, cookie_n * size, __builtin_return_address(0));
 }
 
 static inline uint32_t
@@ -277,7 +1125,7 @@ skynet_memalign(size_t alignment, size_t size) {
 	uint32_t cookie_size = alignment_cookie_size(alignment);
 	void* ptr = je_memalign(alignment, size + cookie_size);
 	if(!ptr) malloc_oom(size);
-	return fill_prefix(ptr, size, cookie_size);
+	return fill_prefix(ptr, size, cookie_size, __builtin_return_address(0));
 }
 
 void *
@@ -285,7 +1133,7 @@ skynet_aligned_alloc(size_t alignment, size_t size) {
 	uint32_t cookie_size = alignment_cookie_size(alignment);
 	void* ptr = je_aligned_alloc(alignment, size + cookie_size);
 	if(!ptr) malloc_oom(size);
-	return fill_prefix(ptr, size, cookie_size);
+	return fill_prefix(ptr, size, cookie_size, __builtin_return_address(0));
 }
 
 int
@@ -293,10 +1141,164 @@ skynet_posix_memalign(void **memptr, size_t alignment, size_t size) {
 	uint32_t cookie_size = alignment_cookie_size(alignment);
 	int err = je_posix_memalign(memptr, alignment, size + cookie_size);
 	if (err) malloc_oom(size);
-	fill_prefix(*memptr, size, cookie_size);
+	fill_prefix(*memptr, size, cookie_size, __builtin_return_address(0));
 	return err;
 }
 
+size_t
+malloc_profile(size_t *interval) {
+	if (interval) {
+		while (ATOM_LOAD(&_profile_init) != 2) {
+			if (ATOM_CAS(&_profile_init, 0, 1)) {
+				spinlock_init(&_profile_lock);
+				ATOM_STORE(&_profile_init, 2);
+			}
+		}
+		ATOM_STORE(&_profile_interval, *interval);
+	}
+	return ATOM_LOAD(&_profile_interval);
+}
+
+struct mem_site {
+	uint32_t handle;
+	int index;          // 第一条采样在数组中的位置
+	size_t bytes;       // 按采样间隔估计的字节数
+	size_t count;       // 估计的块数
+};
+
+static int
+sample_compar(const void *a, const void *b) {
+	const struct mem_sample *sa = a;
+	const struct mem_sample *sb = b;
+	if (sa->handle != sb->handle)
+		return sa->handle < sb->handle ? -1 : 1;
+	int r = strcmp(sa->stack, sb->stack);
+	if (r)
+		return r;
+	if (sa->caller != sb->caller)
+		return (uintptr_t)sa->caller < (uintptr_t)sb->caller ? -1 : 1;
+	return 0;
+}
+
+static int
+site_compar(const void *a, const void *b) {
+	const struct mem_site *sa = a;
+	const struct mem_site *sb = b;
+	if (sa->handle != sb->handle)
+		return sa->handle < sb->handle ? -1 : 1;
+	if (sa->bytes != sb->bytes)
+		return sa->bytes > sb->bytes ? -1 : 1;
+	return 0;
+}
+
+static void
+push_site(lua_State *L, struct mem_sample *s) {
+	if (s->stack[0]) {
+		lua_pushstring(L, s->stack);
+		return;
+	}
+	Dl_info info;
+	if (dladdr(s->caller, &info) && info.dli_sname) {
+		lua_pushfstring(L, "%s+%d", info.dli_sname, (int)((char *)s->caller - (char *)info.dli_saddr));
+	} else {
+		lua_pushfstring(L, "%p", s->caller);
+	}
+}
+
+/*
+ * 按服务汇总还没有释放的采样：memory.heaptop([handle [, n]])
+ * 返回 { [handle] = { bytes =, count =, sites = { { site =, bytes =, count = }, ... } } }，
+ * 每个服务按字节数从大到小列出前n个分配位置（默认10个）
+ */
+int
+malloc_profile_dump(lua_State *L) {
+	uint32_t handle = (uint32_t)luaL_optinteger(L, 1, 0);
+	int top = (int)luaL_optinteger(L, 2, 10);
+	size_t interval = ATOM_LOAD(&_profile_interval);
+	struct mem_sample *samples = NULL;
+	size_t n = 0;
+	int i;
+	lua_newtable(L);
+	if (ATOM_LOAD(&_profile_init) != 2)
+		return 1;
+	// 在锁里只做复制，这里不能分配会被采样的内存
+	spinlock_lock(&_profile_lock);
+	if (_profile_count > 0) {
+		samples = je_malloc(_profile_count * sizeof(*samples));
+	}
+	if (samples) {
+		for (i=0;i<PROFILE_HASH;i++) {
+			struct mem_sample *s;
+			for (s = _profile_hash[i]; s; s = s->next) {
+				if (handle == 0 || s->handle == handle) {
+					samples[n++] = *s;
+				}
+			}
+		}
+	}
+	spinlock_unlock(&_profile_lock);
+	if (n == 0) {
+		je_free(samples);
+		return 1;
+	}
+	qsort(samples, n, sizeof(*samples), sample_compar);
+	struct mem_site *sites = je_malloc(n * sizeof(*sites));
+	if (sites == NULL) {
+		je_free(samples);
+		return luaL_error(L, "Out of memory");
+	}
+	size_t nsite = 0;
+	size_t j;
+	for (j=0;j<n;j++) {
+		struct mem_sample *s = &samples[j];
+		// 小于采样间隔的块，每条采样代表interval字节
+		size_t bytes = s->size > interval ? s->size : interval;
+		if (nsite == 0 || sample_compar(&samples[sites[nsite-1].index], s) != 0) {
+			struct mem_site *site = &sites[nsite++];
+			site->handle = s->handle;
+			site->index = (int)j;
+			site->bytes = 0;
+			site->count = 0;
+		}
+		sites[nsite-1].bytes += bytes;
+		sites[nsite-1].count += s->size ? (bytes + s->size - 1) / s->size : 1;
+	}
+	qsort(sites, nsite, sizeof(*sites), site_compar);
+	for (j=0;j<nsite;) {
+		uint32_t h = sites[j].handle;
+		size_t bytes = 0, count = 0;
+		int rank = 0;
+		lua_newtable(L);	// sites
+		for (;j<nsite && sites[j].handle == h; j++) {
+			bytes += sites[j].bytes;
+			count += sites[j].count;
+			if (rank < top) {
+				lua_createtable(L, 0, 3);
+				push_site(L, &samples[sites[j].index]);
+				lua_setfield(L, -2, "site");
+				lua_pushinteger(L, sites[j].bytes);
+				lua_setfield(L, -2, "bytes");
+				lua_pushinteger(L, sites[j].count);
+				lua_setfield(L, -2, "count");
+				lua_rawseti(L, -2, ++rank);
+			}
+		}
+		lua_createtable(L, 0, 3);
+		lua_insert(L, -2);
+		lua_setfield(L, -2, "sites");
+		lua_pushinteger(L, bytes);
+		lua_setfield(L, -2, "bytes");
+		lua_pushinteger(L, count);
+		lua_setfield(L, -2, "count");
+		lua_rawseti(L, -2, h);
+	}
+	je_free(sites);
+	je_free(samples);
+	return 1;
+}
+
+#endif
+
 #else
 
 // for skynet_lalloc use
@@ -333,6 +1335,109 @@ mallctl_cmd(const char* name) {
 	return 0;
 }
 
+int
+malloc_arena_create(void) {
+	return -1;
+}
+
+int
+malloc_thread_arena(int arena) {
+	return -1;
+}
+
+void
+malloc_fold(void) {
+}
+
+void
+skynet_lalloc_account(uint32_t handle, ptrdiff_t delta) {
+}
+
+void
+malloc_lua_arena(const char *mode) {
+	if (mode && strcmp(mode, "none") != 0) {
+		skynet_error(NULL, "No jemalloc : lua_arena %s is ignored", mode);
+	}
+	lua_arena_mode = LUA_ARENA_NONE;
+}
+
+int
+skynet_lalloc_open(const char *name) {
+	return 0;
+}
+
+void *
+skynet_lalloc_x(void *ptr, size_t osize, size_t nsize, int flags) {
+	return skynet_lalloc(ptr, osize, nsize);
+}
+
+void
+skynet_lalloc_free(void *ptr, int flags) {
+	raw_free(ptr);
+}
+
+void
+skynet_lalloc_close(int flags) {
+}
+
+void
+skynet_lalloc_trim(int flags) {
+}
+
+size_t
+malloc_purge(int arena) {
+	return 0;
+}
+
+void
+malloc_purge_idle(void) {
+}
+
+void
+malloc_decay(ssize_t *dirty, ssize_t *muzzy) {
+	if (*dirty >= -1 || *muzzy >= -1) {
+		skynet_error(NULL, "No jemalloc : decay is ignored");
+	}
+	*dirty = *muzzy = 0;
+}
+
+void
+malloc_purge_stat(struct malloc_purge_stat *stat) {
+	memset(stat, 0, sizeof(*stat));
+	stat->last_arena = -1;
+}
+
+void
+malloc_purge_config(int background, const char *decay, int interval) {
+	if (background || decay || interval > 0) {
+		skynet_error(NULL, "No jemalloc : jemalloc_background, jemalloc_decay and jemalloc_purge are ignored");
+	}
+}
+
+void
+malloc_profile_lua(uint32_t handle, lua_State *L) {
+}
+
+size_t
+malloc_profile(size_t *interval) {
+	if (interval && *interval) {
+		skynet_error(NULL, "No jemalloc : heap sample is ignored");
+	}
+	return 0;
+}
+
+int
+malloc_profile_dump(lua_State *L) {
+	lua_newtable(L);
+	return 1;
+}
+
+// free不是我们的钩子，分不出小块，直接用普通内存
+void *
+skynet_slab_alloc(size_t sz) {
+	return skynet_malloc(sz);
+}
+
 #endif
 
 size_t
@@ -345,6 +1450,16 @@ malloc_memory_block(void) {
 	return ATOM_LOAD(&_memory_block);
 }
 
+/*
+ * 读取一个槽位的统计值
+ * 各线程缓存合并的先后不定，槽位可能暂时是负数，读取时按0处理
+ */
+static inline size_t
+slot_allocated(struct mem_data *data) {
+	ssize_t n = (ssize_t)data->allocated;
+	return n > 0 ? (size_t)n : 0;
+}
+
 void
 dump_c_mem() {
 	int i;
@@ -352,9 +1467,10 @@ dump_c_mem() {
 	skynet_error(NULL, "dump all service mem:");
 	for(i=0; i<SLOT_SIZE; i++) {
 		struct mem_data* data = &mem_stats[i];
-		if(data->handle != 0 && data->allocated != 0) {
-			total += data->allocated;
-			skynet_error(NULL, ":%08x -> %zdkb %db", data->handle, data->allocated >> 10, (int)(data->allocated % 1024));
+		size_t allocated = slot_allocated(data);
+		if(data->handle != 0 && allocated != 0) {
+			total += allocated;
+			skynet_error(NULL, ":%08x -> %zdkb %db", data->handle, allocated >> 10, (int)(allocated % 1024));
 		}
 	}
 	skynet_error(NULL, "+total: %zdkb",total >> 10);
@@ -362,6 +1478,7 @@ dump_c_mem() {
 
 void *
 skynet_lalloc(void *ptr, size_t osize, size_t nsize) {
+	SKYNET_PROBE3(lalloc, ptr, osize, nsize);
 	if (nsize == 0) {
 		raw_free(ptr);
 		return NULL;
@@ -376,8 +1493,9 @@ dump_mem_lua(lua_State *L) {
 	lua_newtable(L);
 	for(i=0; i<SLOT_SIZE; i++) {
 		struct mem_data* data = &mem_stats[i];
-		if(data->handle != 0 && data->allocated != 0) {
-			lua_pushinteger(L, data->allocated);
+		size_t allocated = slot_allocated(data);
+		if(data->handle != 0 && allocated != 0) {
+			lua_pushinteger(L, allocated);
 			lua_rawseti(L, -2, (lua_Integer)data->handle);
 		}
 	}
@@ -391,7 +1509,7 @@ malloc_current_memory(void) {
 	for(i=0; i<SLOT_SIZE; i++) {
 		struct mem_data* data = &mem_stats[i];
 		if(data->handle == (uint32_t)handle && data->allocated != 0) {
-			return (size_t) data->allocated;
+			return slot_allocated(data);
 		}
 	}
 	return 0;
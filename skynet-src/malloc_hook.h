@@ -8,6 +8,8 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <lua.h>
 
 /*
@@ -43,6 +45,51 @@ extern bool mallctl_bool(const char* name, bool* newval);
 // 执行控制命令
 extern int mallctl_cmd(const char* name);
 
+// 创建新的jemalloc arena，返回arena编号（不使用jemalloc时返回-1）
+extern int malloc_arena_create(void);
+
+// 将当前线程绑定到指定的arena
+extern int malloc_thread_arena(int arena);
+
+// 把本线程累计的内存统计合并到全局统计，线程空闲时调用
+extern void malloc_fold(void);
+
+// 设置Lua虚拟机的arena模式：none、service（每个服务一个arena）或class（同名服务共用），在启动服务前调用
+extern void malloc_lua_arena(const char *mode);
+
+// 堆采样：interval非NULL时设置平均每多少字节采样一块C内存（0为关闭），返回当前的采样间隔
+extern size_t malloc_profile(size_t *interval);
+
+// 登记当前线程上服务handle正在运行的Lua状态，采样时用它记录Lua调用栈；L为NULL时取消
+extern void malloc_profile_lua(uint32_t handle, lua_State *L);
+
+// Lua接口：按服务汇总还没有释放的采样，参数为 [handle [, n]]
+extern int malloc_profile_dump(lua_State *L);
+
+// jemalloc整理的统计
+struct malloc_purge_stat {
+	size_t count;       // 整理次数
+	size_t bytes;       // 累计归还的字节数
+	size_t last_bytes;  // 最后一次归还的字节数
+	int last_arena;     // 最后一次整理的arena，-1为所有arena
+	int interval;       // 空闲整理的间隔（毫秒），0为关闭
+	uint64_t last_usec; // 最后一次整理的耗时（微秒）
+};
+
+// 启动时设置jemalloc的后台线程，衰减时间 "dirty[,muzzy]"（毫秒，NULL为不修改），空闲整理的间隔（毫秒，0为关闭）
+extern void malloc_purge_config(int background, const char *decay, int interval);
+
+// 立即归还arena（<0为所有arena）的dirty和muzzy页，返回归还的字节数
+extern size_t malloc_purge(int arena);
+
+// 工作线程空闲时调用，到了间隔就让一个arena按衰减时间归还内存
+extern void malloc_purge_idle(void);
+
+// 设置衰减时间（毫秒，-1为不衰减，小于-1为不修改），返回当前的值
+extern void malloc_decay(ssize_t *dirty, ssize_t *muzzy);
+
+extern void malloc_purge_stat(struct malloc_purge_stat *stat);
+
 // 转储C内存使用情况
 extern void dump_c_mem(void);
 
@@ -0,0 +1,488 @@
+/*
+ * rudp.c - 可靠UDP协议
+ *
+ * 数据包由一个或多个片段拼成，数字都是大端序：
+ *   数据 : cmd(1)=1 conv(4) seq(4) una(4) frg(1) len(2) 数据(len)
+ *   确认 : cmd(1)=2 conv(4) una(4) seq(4)
+ * 两个方向的数据流各自独立，conv由发送方选定。数据片的seq从0开始递增，
+ * frg是这条消息后面还有几片。收到数据片就回复确认：una是下一个期待的seq，之前的都已收到。
+ * 发送方按RTT估计超时重传，被后面的确认跳过两次的片提前重传。
+ * 数据片里的una是发送方最早没有确认的seq，之前的都已经交出去了：
+ * 接收方没有这个conv的状态时（新的会话，或者空闲被丢弃了）从这里开始接收。
+ * 一条消息的各片frg必须依次减一，不符合的对端是坏的，丢掉它的接收状态，这个conv不再接收。
+ */
+
+#include "skynet.h"
+#include "rudp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CMD_DATA 1
+#define CMD_ACK 2
+
+#define DATA_HEADER 16
+#define ACK_SIZE 13
+#define MAX_PAYLOAD (RUDP_MTU - DATA_HEADER)
+
+#define WINDOW 128              // 等待确认的片的seq范围
+#define RTO_INIT 200            // 毫秒
+#define RTO_MIN 30
+#define RTO_MAX 5000
+#define FASTACK 2               // 被跳过几次后提前重传
+#define DEADLINK 20             // 一片超时重传这么多次还没有确认，认为对端不可达
+#define OLDCONV 4               // 记住最近用过的几个conv，它们迟到的包不会重置接收状态
+
+struct segment {
+	struct segment * next;
+	uint32_t seq;
+	int frg;
+	int len;
+	int xmit;               // 发送次数
+	int timeout;            // 超时重传的次数
+	int fastack;            // 被后面的确认跳过的次数
+	uint32_t rto;
+	uint64_t resend;        // 下次重传的时间
+	uint64_t ts;            // 最近一次发送的时间
+	uint8_t data[1];
+};
+
+struct seglist {
+	struct segment * head;
+	struct segment * tail;
+	int n;
+};
+
+struct rudp {
+	// 发送
+	uint32_t snd_conv;
+	uint32_t snd_next;      // 下一个分配的seq
+	struct seglist queue;   // 还没有进入窗口的片
+	struct seglist flight;  // 发出后等待确认的片，按seq排序
+	int32_t srtt;
+	int32_t rttvar;
+	uint32_t rto;
+	int dead;
+	// 接收
+	uint32_t rcv_conv;      // 0表示还没有收到过数据
+	uint32_t old_conv[OLDCONV];
+	int old_index;
+	uint32_t rcv_next;      // 下一个期待的seq
+	int rcv_frg;            // 最后进入order的片的frg，大于0时下一片必须是它减一
+	struct seglist order;   // 按顺序到齐的片，等待rudp_recv
+	struct seglist early;   // 提前到达的片，按seq排序
+	uint32_t * ack;         // 等待发出的确认
+	int ack_n;
+	int ack_cap;
+	// 输出
+	uint8_t buffer[RUDP_MTU];
+	int sz;
+};
+
+static inline int32_t
+seqdiff(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b);
+}
+
+static inline void
+write_u16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static inline void
+write_u32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static inline uint16_t
+read_u16(const uint8_t *p) {
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t
+read_u32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static struct segment *
+segment_new(int len) {
+	struct segment * s = skynet_malloc(sizeof(*s) + len);
+	memset(s, 0, sizeof(*s));
+	s->len = len;
+	return s;
+}
+
+static void
+list_push(struct seglist *l, struct segment *s) {
+	s->next = NULL;
+	if (l->tail) {
+		l->tail->next = s;
+	} else {
+		l->head = s;
+	}
+	l->tail = s;
+	++l->n;
+}
+
+static struct segment *
+list_pop(struct seglist *l) {
+	struct segment * s = l->head;
+	if (s) {
+		l->head = s->next;
+		if (l->head == NULL)
+			l->tail = NULL;
+		--l->n;
+	}
+	return s;
+}
+
+static void
+list_clear(struct seglist *l) {
+	struct segment * s;
+	while ((s = list_pop(l)))
+		skynet_free(s);
+}
+
+struct rudp *
+rudp_new(uint32_t conv) {
+	struct rudp * r = skynet_malloc(sizeof(*r));
+	memset(r, 0, sizeof(*r));
+	r->snd_conv = conv;
+	r->rto = RTO_INIT;
+	return r;
+}
+
+void
+rudp_delete(struct rudp *r) {
+	list_clear(&r->queue);
+	list_clear(&r->flight);
+	list_clear(&r->order);
+	list_clear(&r->early);
+	skynet_free(r->ack);
+	skynet_free(r);
+}
+
+int
+rudp_send(struct rudp *r, const void *buffer, int sz) {
+	if (sz < 0 || sz > RUDP_MAX_MESSAGE)
+		return -1;
+	int n = (sz + MAX_PAYLOAD - 1) / MAX_PAYLOAD;
+	if (n == 0)
+		n = 1;  // 空消息也占一片
+	const uint8_t * p = buffer;
+	int i;
+	for (i=0;i<n;i++) {
+		int len = sz > MAX_PAYLOAD ? MAX_PAYLOAD : sz;
+		struct segment * s = segment_new(len);
+		memcpy(s->data, p, len);
+		s->frg = n - i - 1;
+		list_push(&r->queue, s);
+		p += len;
+		sz -= len;
+	}
+	return 0;
+}
+
+static void
+update_rtt(struct rudp *r, int32_t rtt) {
+	if (rtt < 0)
+		return;
+	if (r->srtt == 0) {
+		r->srtt = rtt;
+		r->rttvar = rtt / 2;
+	} else {
+		int32_t delta = rtt - r->srtt;
+		if (delta < 0)
+			delta = -delta;
+		r->rttvar = (3 * r->rttvar + delta) / 4;
+		r->srtt = (7 * r->srtt + rtt) / 8;
+		if (r->srtt < 1)
+			r->srtt = 1;
+	}
+	uint32_t rto = r->srtt + (4 * r->rttvar > 10 ? 4 * r->rttvar : 10);
+	if (rto < RTO_MIN)
+		rto = RTO_MIN;
+	else if (rto > RTO_MAX)
+		rto = RTO_MAX;
+	r->rto = rto;
+}
+
+static void
+input_ack(struct rudp *r, uint32_t una, uint32_t seq, uint64_t now) {
+	struct segment ** p = &r->flight.head;
+	struct segment * last = NULL;
+	while (*p) {
+		struct segment * s = *p;
+		if (seqdiff(s->seq, una) < 0 || s->seq == seq) {
+			if (s->seq == seq && s->xmit == 1) {
+				// 只用没有重传过的片估计RTT
+				update_rtt(r, (int32_t)(now - s->ts));
+			}
+			*p = s->next;
+			--r->flight.n;
+			skynet_free(s);
+		} else {
+			if (seqdiff(s->seq, seq) < 0)
+				++s->fastack;
+			last = s;
+			p = &s->next;
+		}
+	}
+	r->flight.tail = last;
+}
+
+static void
+push_ack(struct rudp *r, uint32_t seq) {
+	if (r->ack_n >= r->ack_cap) {
+		r->ack_cap = r->ack_cap ? r->ack_cap * 2 : 16;
+		r->ack = skynet_realloc(r->ack, r->ack_cap * sizeof(uint32_t));
+	}
+	r->ack[r->ack_n++] = seq;
+}
+
+// 丢掉接收状态，当前的conv记入old_conv，它迟到的包不再接收
+static void
+drop_receive(struct rudp *r) {
+	if (r->rcv_conv) {
+		r->old_conv[r->old_index] = r->rcv_conv;
+		r->old_index = (r->old_index + 1) % OLDCONV;
+	}
+	list_clear(&r->order);
+	list_clear(&r->early);
+	r->ack_n = 0;
+	r->rcv_conv = 0;
+	r->rcv_frg = 0;
+}
+
+// 按顺序到齐的片放进order，frg不连续时丢掉这片和整个接收状态，返回-1
+static int
+order_push(struct rudp *r, struct segment *s) {
+	if (r->rcv_frg > 0 && s->frg != r->rcv_frg - 1) {
+		skynet_free(s);
+		drop_receive(r);
+		return -1;
+	}
+	r->rcv_frg = s->frg;
+	list_push(&r->order, s);
+	++r->rcv_next;
+	return 0;
+}
+
+// 把提前到达的片中接上的移到order
+static void
+move_early(struct rudp *r) {
+	struct segment * s;
+	while ((s = r->early.head) && s->seq == r->rcv_next) {
+		list_pop(&r->early);
+		if (order_push(r, s))
+			return;
+	}
+}
+
+static int
+old_conv(struct rudp *r, uint32_t conv) {
+	int i;
+	for (i=0;i<OLDCONV;i++) {
+		if (r->old_conv[i] == conv)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+input_data(struct rudp *r, uint32_t conv, uint32_t seq, uint32_t una, int frg, const uint8_t *data, int len) {
+	if (conv != r->rcv_conv) {
+		// 对端重启后换了conv，之前的conv迟到的包丢掉
+		if (old_conv(r, conv))
+			return;
+		drop_receive(r);
+		r->rcv_conv = conv;
+		r->rcv_next = una;
+	}
+	int32_t d = seqdiff(seq, r->rcv_next);
+	if (d >= WINDOW * 2)
+		return; // 超出窗口，不确认，等发送方重传
+	push_ack(r, seq);
+	if (d < 0)
+		return; // 重复的
+	struct segment * s = segment_new(len);
+	memcpy(s->data, data, len);
+	s->seq = seq;
+	s->frg = frg;
+	if (d == 0) {
+		if (order_push(r, s) == 0)
+			move_early(r);
+		return;
+	}
+	// 按seq插入early
+	struct segment ** p = &r->early.head;
+	while (*p && seqdiff((*p)->seq, seq) < 0) {
+		p = &(*p)->next;
+	}
+	if (*p && (*p)->seq == seq) {
+		skynet_free(s);
+		return;
+	}
+	s->next = *p;
+	*p = s;
+	if (s->next == NULL)
+		r->early.tail = s;
+	++r->early.n;
+}
+
+int
+rudp_input(struct rudp *r, const uint8_t *buffer, int sz, uint64_t now) {
+	while (sz > 0) {
+		switch (buffer[0]) {
+		case CMD_DATA: {
+			if (sz < DATA_HEADER)
+				return -1;
+			uint32_t conv = read_u32(buffer + 1);
+			uint32_t seq = read_u32(buffer + 5);
+			uint32_t una = read_u32(buffer + 9);
+			int frg = buffer[13];
+			int len = read_u16(buffer + 14);
+			if (conv == 0 || len > MAX_PAYLOAD || sz < DATA_HEADER + len || seqdiff(seq, una) < 0)
+				return -1;
+			input_data(r, conv, seq, una, frg, buffer + DATA_HEADER, len);
+			buffer += DATA_HEADER + len;
+			sz -= DATA_HEADER + len;
+			break;
+		}
+		case CMD_ACK: {
+			if (sz < ACK_SIZE)
+				return -1;
+			uint32_t conv = read_u32(buffer + 1);
+			if (conv == r->snd_conv) {
+				input_ack(r, read_u32(buffer + 5), read_u32(buffer + 9), now);
+			}
+			buffer += ACK_SIZE;
+			sz -= ACK_SIZE;
+			break;
+		}
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+rudp_peek(struct rudp *r) {
+	struct segment * s = r->order.head;
+	if (s == NULL || r->order.n < s->frg + 1)
+		return -1;
+	int sz = 0;
+	int i;
+	int n = s->frg;
+	for (i=0;i<=n;i++) {
+		sz += s->len;
+		s = s->next;
+	}
+	return sz;
+}
+
+int
+rudp_recv(struct rudp *r, void *buffer) {
+	int sz = rudp_peek(r);
+	if (sz < 0)
+		return -1;
+	uint8_t * p = buffer;
+	int n = r->order.head->frg;
+	int i;
+	for (i=0;i<=n;i++) {
+		struct segment * s = list_pop(&r->order);
+		memcpy(p, s->data, s->len);
+		p += s->len;
+		skynet_free(s);
+	}
+	return sz;
+}
+
+static void
+output_reserve(struct rudp *r, int sz, rudp_output output, void *ud) {
+	if (r->sz + sz > RUDP_MTU) {
+		output(ud, r->buffer, r->sz);
+		r->sz = 0;
+	}
+}
+
+static void
+output_segment(struct rudp *r, struct segment *s, rudp_output output, void *ud) {
+	output_reserve(r, DATA_HEADER + s->len, output, ud);
+	uint8_t * p = r->buffer + r->sz;
+	p[0] = CMD_DATA;
+	write_u32(p + 1, r->snd_conv);
+	write_u32(p + 5, s->seq);
+	write_u32(p + 9, r->flight.head->seq);
+	p[13] = (uint8_t)s->frg;
+	write_u16(p + 14, (uint16_t)s->len);
+	memcpy(p + DATA_HEADER, s->data, s->len);
+	r->sz += DATA_HEADER + s->len;
+}
+
+void
+rudp_update(struct rudp *r, uint64_t now, rudp_output output, void *ud) {
+	int i;
+	// 确认
+	for (i=0;i<r->ack_n;i++) {
+		output_reserve(r, ACK_SIZE, output, ud);
+		uint8_t * p = r->buffer + r->sz;
+		p[0] = CMD_ACK;
+		write_u32(p + 1, r->rcv_conv);
+		write_u32(p + 5, r->rcv_next);
+		write_u32(p + 9, r->ack[i]);
+		r->sz += ACK_SIZE;
+	}
+	r->ack_n = 0;
+	// 新数据进入窗口，从最早没有确认的片算起
+	while (r->queue.head && (r->flight.head == NULL || seqdiff(r->snd_next, r->flight.head->seq) < WINDOW)) {
+		struct segment * s = list_pop(&r->queue);
+		s->seq = r->snd_next++;
+		list_push(&r->flight, s);
+	}
+	// 首次发送、超时重传和提前重传
+	struct segment * s;
+	for (s = r->flight.head; s; s = s->next) {
+		int send = 0;
+		if (s->xmit == 0) {
+			s->rto = r->rto;
+			send = 1;
+		} else if (now >= s->resend) {
+			s->rto += s->rto / 2;
+			if (s->rto > RTO_MAX)
+				s->rto = RTO_MAX;
+			if (++s->timeout > DEADLINK)
+				r->dead = 1;
+			send = 1;
+		} else if (s->fastack >= FASTACK && now - s->ts >= (uint64_t)r->srtt) {
+			// 提前重传，一个RTT内最多一次
+			send = 1;
+		}
+		if (send) {
+			++s->xmit;
+			s->fastack = 0;
+			s->ts = now;
+			s->resend = now + s->rto;
+			output_segment(r, s, output, ud);
+		}
+	}
+	if (r->sz > 0) {
+		output(ud, r->buffer, r->sz);
+		r->sz = 0;
+	}
+}
+
+int
+rudp_pending(struct rudp *r) {
+	return r->queue.n + r->flight.n + r->order.n + r->early.n + r->ack_n;
+}
+
+int
+rudp_dead(struct rudp *r) {
+	return r->dead;
+}
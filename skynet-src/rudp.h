@@ -0,0 +1,47 @@
+/*
+ * rudp.h - 可靠UDP协议
+ * 一个对端的会话，只处理协议，不关心socket：
+ * 收到的数据包交给rudp_input，按顺序到齐的消息用rudp_peek/rudp_recv取出，
+ * 要发的数据包在rudp_update时通过回调输出。socket_server用它实现可靠UDP的socket
+ */
+
+#ifndef skynet_rudp_h
+#define skynet_rudp_h
+
+#include <stdint.h>
+
+#define RUDP_MTU 1400                   // 输出的数据包不超过这个大小
+#define RUDP_MAX_FRAGMENT 255           // 一条消息最多分成多少片
+#define RUDP_MAX_MESSAGE ((RUDP_MTU - 16) * RUDP_MAX_FRAGMENT)   // 消息的最大长度
+
+struct rudp;
+
+// 输出一个数据包
+typedef void (*rudp_output)(void *ud, const uint8_t *buffer, int sz);
+
+// 新会话，conv是本端发出的数据流的标识，不为0，重启后要用不同的conv，对端据此丢掉旧的接收状态
+struct rudp * rudp_new(uint32_t conv);
+void rudp_delete(struct rudp *);
+
+// 发送一条消息，复制数据，太长时返回-1
+int rudp_send(struct rudp *, const void *buffer, int sz);
+
+// 收到一个数据包，now是毫秒时间，格式错误返回-1
+int rudp_input(struct rudp *, const uint8_t *buffer, int sz, uint64_t now);
+
+// 下一条按顺序到齐的消息的长度，没有时返回-1
+int rudp_peek(struct rudp *);
+
+// 取出下一条消息复制到buffer（至少rudp_peek的长度），返回长度，没有时返回-1
+int rudp_recv(struct rudp *, void *buffer);
+
+// 发出确认、新数据和超时重传的数据
+void rudp_update(struct rudp *, uint64_t now, rudp_output output, void *ud);
+
+// 还没有完成的数据片数：排队、等待确认、收到了还没有取出的，以及要回复的确认，为0时会话可以丢弃
+int rudp_pending(struct rudp *);
+
+// 重传次数超过上限，对端已经不可达
+int rudp_dead(struct rudp *);
+
+#endif
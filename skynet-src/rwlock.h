@@ -1,12 +1,96 @@
 /*
  * rwlock.h - skynet读写锁实现头文件
  * 提供跨平台的读写锁实现，支持原子操作和pthread两种方式
+ * 编译时加-DRWLOCK_SHARDED使用读者分片的实现（见下），和spinlock.h的选项一样需要所有模块一致
  */
 
 #ifndef SKYNET_RWLOCK_H
 #define SKYNET_RWLOCK_H
 
-#ifndef USE_PTHREAD_LOCK
+#if !defined(USE_PTHREAD_LOCK) && defined(RWLOCK_SHARDED)
+
+/*
+ * 读者分片的读写锁（编译时加-DRWLOCK_SHARDED）
+ * 读计数按线程分散到RWLOCK_SHARD个独立的缓存行上，读锁只修改自己线程对应的计数，
+ * 读多写少（如handle名字查找）时多个线程同时加读锁不会争用同一个缓存行；
+ * 代价是写锁要检查所有分片，结构体也大很多（每个分片一个缓存行）
+ */
+
+#include "atomic.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#ifndef RWLOCK_SHARD
+#define RWLOCK_SHARD 16
+#endif
+
+#define RWLOCK_CACHELINE 64
+
+struct rwlock_shard {
+	ATOM_INT read;   // 这个分片的读锁计数
+	char pad[RWLOCK_CACHELINE - sizeof(ATOM_INT)];
+};
+
+struct rwlock {
+	ATOM_INT write;  // 写锁状态（0=未锁定，1=已锁定）
+	char pad[RWLOCK_CACHELINE - sizeof(ATOM_INT)];
+	struct rwlock_shard shard[RWLOCK_SHARD];
+};
+
+/*
+ * 当前线程的分片，用线程id散列，同一线程在任何模块里都得到同一个分片（加锁和解锁可能不在同一个文件）
+ */
+static inline ATOM_INT *
+rwlock_shard_(struct rwlock *lock) {
+	uint64_t id = (uintptr_t)pthread_self();
+	id = (id >> 12) * 0x9E3779B97F4A7C15ull;
+	return &lock->shard[(id >> 32) % RWLOCK_SHARD].read;
+}
+
+static inline void
+rwlock_init(struct rwlock *lock) {
+	int i;
+	ATOM_INIT(&lock->write, 0);
+	for (i=0;i<RWLOCK_SHARD;i++) {
+		ATOM_INIT(&lock->shard[i].read, 0);
+	}
+}
+
+static inline void
+rwlock_rlock(struct rwlock *lock) {
+	ATOM_INT *read = rwlock_shard_(lock);
+	for (;;) {
+		while(ATOM_LOAD(&lock->write)) {}
+		ATOM_FINC(read);
+		if (ATOM_LOAD(&lock->write)) {
+			ATOM_FDEC(read);
+		} else {
+			break;
+		}
+	}
+}
+
+static inline void
+rwlock_wlock(struct rwlock *lock) {
+	int i;
+	while (!ATOM_CAS(&lock->write, 0, 1)) {}
+	// 等待每个分片的读者离开
+	for (i=0;i<RWLOCK_SHARD;i++) {
+		while(ATOM_LOAD(&lock->shard[i].read)) {}
+	}
+}
+
+static inline void
+rwlock_wunlock(struct rwlock *lock) {
+	ATOM_STORE(&lock->write, 0);
+}
+
+static inline void
+rwlock_runlock(struct rwlock *lock) {
+	ATOM_FDEC(rwlock_shard_(lock));
+}
+
+#elif !defined(USE_PTHREAD_LOCK)
 
 /*
  * 使用原子操作实现读写锁
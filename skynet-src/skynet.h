@@ -27,6 +27,9 @@
 #define PTYPE_RESERVED_DEBUG 9  // 调试保留类型
 #define PTYPE_RESERVED_LUA 10   // Lua保留类型
 #define PTYPE_RESERVED_SNAX 11  // SNAX保留类型
+// read lualib/skynet/log.lua
+#define PTYPE_LOG 13            // 结构化日志，lua-seri 打包的级别、格式串和参数，由 logger 格式化
+#define PTYPE_MEMORY 14         // 内存压力通知，数据是原因 "soft" 或 "node"，见 skynet.memory_callback
 
 // 消息标签定义
 #define PTYPE_TAG_DONTCOPY 0x10000      // 不复制消息数据标签
@@ -49,8 +52,30 @@ const char * skynet_command(struct skynet_context * context, const char * cmd ,
 uint32_t skynet_queryname(struct skynet_context * context, const char * name);
 
 // 消息发送（通过handle）
+// 返回session；-1表示目标无效，-2表示消息过大，-3表示目标队列超过背压阈值被拒绝
 int skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * msg, size_t sz);
 
+// 把同一个消息发给n个handle，data只复制一次（DONTCOPY时接管data）。
+// 声明过SHAREDMSG的本地服务共用这一份负载，最后一个处理完的释放它；其他目标各自复制一份。
+// type带PTYPE_TAG_ALLOCSESSION时为每个目标分配会话，否则都用session。
+// result（可以为NULL）按目标依次填入会话或skynet_send的错误码，返回发送成功的数量
+int skynet_sendmulti(struct skynet_context * context, uint32_t source, const uint32_t * destination, int n, int type, int session, void * msg, size_t sz, int * result);
+
+// 消息负载末尾为释放回调留出的字节数（见skynet_message_finalizer）
+#define SKYNET_MESSAGE_FINALIZER (2 * sizeof(void *))
+
+// 给消息负载登记释放回调：消息被释放时（处理完、丢弃、过期或者发送失败）先调用finalize(ud)。
+// 回调记在负载最后SKYNET_MESSAGE_FINALIZER字节里（sz包括这部分），由调用者留出。
+// 负载里带着引用（见lua-seri的sharedbuffer），所以它不能被复制，也不能发往其他节点或者多个目标
+void skynet_message_finalizer(void *data, size_t sz, void (*finalize)(void *ud), void *ud);
+// data登记过释放回调时返回1，复制出去的字节不算
+int skynet_message_finalized(const void *data, size_t sz);
+// 释放消息负载（skynet_malloc分配），调用登记过的释放回调。持有消息负载的代码都应该用它代替skynet_free，
+// 用skynet_free释放的只是不调用回调，负载带着的引用不会归还
+void skynet_message_free(void *data, size_t sz);
+// 复制一份消息负载，登记过的释放回调转给复制出的这份，原来的那份照常释放。复制出的用skynet_message_free释放
+void * skynet_message_copy(void *data, size_t sz);
+
 // 消息发送（通过名称）
 int skynet_sendname(struct skynet_context * context, uint32_t source, const char * destination , int type, int session, void * msg, size_t sz);
 
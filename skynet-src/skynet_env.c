@@ -1,48 +1,99 @@
 /*
  * skynet_env.c - skynet环境变量管理模块
- * 使用Lua状态机管理全局环境变量，提供线程安全的读写接口
+ * 环境变量只能新增不能修改，存放在开放寻址的哈希表中，读不加锁
  */
 
 #include "skynet.h"
 #include "skynet_env.h"
+#include "skynet_imp.h"
 #include "spinlock.h"
-
-#include <lua.h>
-#include <lauxlib.h>
+#include "atomic.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
+#define ENV_INIT_SIZE 64
+
+/*
+ * 哈希表的一项
+ * 写者先写value，最后写key发布这一项，读者看到key时value已经可见
+ */
+struct env_entry {
+	ATOM_POINTER key;
+	const char * value;
+};
+
+// 哈希表，负载不超过一半，所以探测总能遇到空位
+struct env_table {
+	int cap;        // 2的幂
+	struct env_entry e[1];
+};
+
 /*
  * skynet环境变量管理器结构体
- * 使用Lua虚拟机存储环境变量，提供线程安全访问
+ * 只有写者需要加锁；扩容时复制出新表再发布，旧表不释放，读者可能还在用（总大小不超过当前表）
  */
 struct skynet_env {
-	struct spinlock lock;   // 自旋锁，保护并发访问
-	lua_State *L;           // Lua状态机，存储环境变量
+	struct spinlock lock;   // 自旋锁，保护并发写
+	ATOM_POINTER table;     // 当前的哈希表
+	ATOM_INT version;       // 每设置一个变量加一
+	int n;                  // 变量数量
 };
 
 // 全局环境变量管理器实例
 static struct skynet_env *E = NULL;
 
+static inline uint32_t
+env_hash(const char *key) {
+	uint32_t h = 2166136261u;
+	while (*key) {
+		h ^= (uint8_t)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct env_table *
+env_newtable(int cap) {
+	size_t sz = sizeof(struct env_table) + (cap - 1) * sizeof(struct env_entry);
+	struct env_table *t = skynet_malloc(sz);
+	t->cap = cap;
+	int i;
+	for (i=0;i<cap;i++) {
+		ATOM_INIT(&t->e[i].key, 0);
+		t->e[i].value = NULL;
+	}
+	return t;
+}
+
+// 查找key所在的项，没有时返回探测到的空位
+static struct env_entry *
+env_slot(struct env_table *t, const char *key) {
+	int mask = t->cap - 1;
+	int i = env_hash(key) & mask;
+	for (;;) {
+		struct env_entry *e = &t->e[i];
+		const char * k = (const char *)ATOM_LOAD(&e->key);
+		if (k == NULL || strcmp(k, key) == 0)
+			return e;
+		i = (i + 1) & mask;
+	}
+}
+
 /*
  * 获取环境变量值
+ * 不加锁，返回的字符串一直有效
  * @param key: 环境变量名
  * @return: 环境变量值，不存在返回NULL
  */
 const char *
 skynet_getenv(const char *key) {
-	SPIN_LOCK(E)
-
-	lua_State *L = E->L;
-
-	lua_getglobal(L, key);                      // 获取全局变量
-	const char * result = lua_tostring(L, -1);  // 转换为字符串
-	lua_pop(L, 1);                              // 弹出栈顶元素
-
-	SPIN_UNLOCK(E)
-
-	return result;
+	struct env_table *t = (struct env_table *)ATOM_LOAD(&E->table);
+	struct env_entry *e = env_slot(t, key);
+	if (ATOM_LOAD(&e->key) == 0)
+		return NULL;
+	return e->value;
 }
 
 /*
@@ -55,23 +106,54 @@ void
 skynet_setenv(const char *key, const char *value) {
 	SPIN_LOCK(E)
 
-	lua_State *L = E->L;
-	lua_getglobal(L, key);          // 检查变量是否已存在
-	assert(lua_isnil(L, -1));       // 确保变量不存在（只能设置新变量）
-	lua_pop(L,1);                   // 弹出nil值
-	lua_pushstring(L,value);        // 压入新值
-	lua_setglobal(L,key);           // 设置全局变量
+	struct env_table *t = (struct env_table *)ATOM_LOAD(&E->table);
+	struct env_entry *e = env_slot(t, key);
+	assert(ATOM_LOAD(&e->key) == 0);    // 确保变量不存在（只能设置新变量）
+
+	if ((E->n + 1) * 2 > t->cap) {
+		// 复制到大一倍的新表，写好后再发布
+		struct env_table *nt = env_newtable(t->cap * 2);
+		int i;
+		for (i=0;i<t->cap;i++) {
+			const char * k = (const char *)ATOM_LOAD(&t->e[i].key);
+			if (k) {
+				struct env_entry *ne = env_slot(nt, k);
+				ne->value = t->e[i].value;
+				ATOM_STORE(&ne->key, (uintptr_t)k);
+			}
+		}
+		e = env_slot(nt, key);
+		e->value = skynet_strdup(value);
+		ATOM_STORE(&e->key, (uintptr_t)skynet_strdup(key));
+		ATOM_STORE(&E->table, (uintptr_t)nt);
+	} else {
+		e->value = skynet_strdup(value);
+		ATOM_STORE(&e->key, (uintptr_t)skynet_strdup(key));
+	}
+	++E->n;
+	ATOM_FINC(&E->version);
 
 	SPIN_UNLOCK(E)
 }
 
+/*
+ * 环境变量的版本，每设置一个变量加一
+ * 变量不会修改，上层缓存的值一直有效，只有缓存的"不存在"需要用版本检查
+ */
+int
+skynet_env_version() {
+	return ATOM_LOAD(&E->version);
+}
+
 /*
  * 初始化环境变量系统
- * 创建Lua状态机和管理器实例
+ * 创建管理器实例和空的哈希表
  */
 void
 skynet_env_init() {
 	E = skynet_malloc(sizeof(*E));
 	SPIN_INIT(E)  // 初始化自旋锁
-	E->L = luaL_newstate();
+	ATOM_INIT(&E->table, (uintptr_t)env_newtable(ENV_INIT_SIZE));
+	ATOM_INIT(&E->version, 0);
+	E->n = 0;
 }
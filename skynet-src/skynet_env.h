@@ -1,6 +1,6 @@
 /*
  * skynet_env.h - skynet环境变量管理头文件
- * 提供基于Lua的环境变量存储和访问接口
+ * 提供环境变量的存储和访问接口，读不加锁
  */
 
 #ifndef SKYNET_ENV_H
@@ -20,9 +20,13 @@ const char * skynet_getenv(const char *key);
  */
 void skynet_setenv(const char *key, const char *value);
 
+/*
+ * 环境变量的版本，每设置一个变量加一，读不加锁
+ */
+int skynet_env_version();
+
 /*
  * 初始化环境变量系统
- * 创建Lua状态机用于存储环境变量
  */
 void skynet_env_init();
 
@@ -99,5 +99,6 @@ skynet_error(struct skynet_context * context, const char *msg, ...) {
 	smsg.session = 0;
 	smsg.data = data;
 	smsg.sz = len | ((size_t)PTYPE_TEXT << MESSAGE_TYPE_SHIFT);  // 文本类型消息
+	smsg.deadline = 0;
 	skynet_context_push(logger, &smsg);
 }
@@ -9,6 +9,7 @@
 #include "skynet_imp.h"
 #include "skynet_server.h"
 #include "rwlock.h"
+#include "atomic.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -16,6 +17,9 @@
 
 #define DEFAULT_SLOT_SIZE 4        // 默认槽位大小
 #define MAX_SLOT_SIZE 0x40000000   // 最大槽位大小
+#define DEFAULT_NAME_BUCKET 16     // 名称哈希索引的默认桶数量
+#define REDIRECT_BUCKET 256        // 重定向表的桶数量
+#define MIGRATE_STEP 64            // 扩容后每次注册或注销时迁移的旧槽位数量
 
 /*
  * 服务名称映射结构体
@@ -24,6 +28,36 @@
 struct handle_name {
 	char * name;        // 服务名称
 	uint32_t handle;    // 对应的handle
+	uint32_t hash;      // 名称的哈希值
+};
+
+// 名称哈希索引中桶的特殊值，其余值为名称数组下标+1
+#define NAME_EMPTY 0
+#define NAME_DELETED -1
+
+/*
+ * 服务上下文槽位数组
+ * skynet_handle_grab不加锁读取槽位，所以扩容后旧数组不能立即释放，
+ * 通过prev串起来一直保留（总大小不超过当前数组），读者最多读到过期的指针，
+ * 再由skynet_context_trygrab校验引用计数和handle
+ *
+ * 扩容不一次性搬迁：新数组发布后，旧数组作为old继续参与查找，
+ * 之后每次注册和注销顺带把MIGRATE_STEP个旧槽位复制到新数组，全部复制完之后old置空。
+ * 复制时旧数组中的指针不清除（注销时两边都清除），所以查找时当前数组没有就再查old，总能在一边找到
+ */
+struct handle_slot {
+	int size;                           // 槽位数量，总是2的幂
+	struct handle_slot *prev;           // 扩容前的旧数组
+	ATOM_POINTER ctx[1];                // 服务上下文指针（struct skynet_context *）
+};
+
+/*
+ * 重定向条目：服务迁移到别的节点之后，发给旧handle的请求转给target（本地的代理服务）
+ */
+struct handle_redirect {
+	uint32_t handle;
+	uint32_t target;
+	struct handle_redirect *next;
 };
 
 /*
@@ -31,21 +65,209 @@ struct handle_name {
  * 管理所有服务的handle分配和名称映射
  */
 struct handle_storage {
-	struct rwlock lock;                 // 读写锁，保护并发访问
+	struct rwlock lock;                 // 读写锁，保护写操作和名称映射；handle查找不加锁
 
 	uint32_t harbor;                    // 节点ID（高8位）
 	uint32_t handle_index;              // 下一个可分配的handle索引
-	int slot_size;                      // 槽位数组大小
-	struct skynet_context ** slot;     // 服务上下文槽位数组
+	ATOM_POINTER slot;                  // 当前槽位数组（struct handle_slot *）
+	ATOM_POINTER old;                   // 还在迁移中的上一个槽位数组，NULL表示没有
+	int migrate;                        // old中下一个要迁移的位置
 
 	int name_cap;                       // 名称数组容量
 	int name_count;                     // 当前名称数量
-	struct handle_name *name;           // 名称映射数组
+	struct handle_name *name;           // 名称映射数组（紧凑、无序）
+	int name_bucket;                    // 哈希索引的桶数量，总是2的幂
+	int name_deleted;                   // 哈希索引中删除标记的数量
+	int *name_index;                    // 开放寻址（线性探测）的哈希索引
+	ATOM_INT name_version;              // 名称被删除的次数，用于使查找缓存失效
+
+	ATOM_INT redirect_count;            // 重定向条目数量，为0时查找不加锁
+	struct handle_redirect *redirect[REDIRECT_BUCKET];  // 重定向表，按handle散列
 };
 
 // 全局handle存储实例
 static struct handle_storage *H = NULL;
 
+// 分配一个全空的槽位数组
+static struct handle_slot *
+slot_new(int size, struct handle_slot *prev) {
+	struct handle_slot *slot = skynet_malloc(sizeof(*slot) + (size - 1) * sizeof(slot->ctx[0]));
+	slot->size = size;
+	slot->prev = prev;
+	int i;
+	for (i=0;i<size;i++) {
+		ATOM_INIT(&slot->ctx[i], (uintptr_t)NULL);
+	}
+	return slot;
+}
+
+static inline struct skynet_context *
+slot_get(struct handle_slot *slot, uint32_t handle) {
+	return (struct skynet_context *)ATOM_LOAD(&slot->ctx[handle & (slot->size-1)]);
+}
+
+/*
+ * 计算名称的哈希值（FNV-1a）
+ */
+static uint32_t
+name_hash(const char * name) {
+	uint32_t h = 2166136261u;
+	const unsigned char * p = (const unsigned char *)name;
+	while (*p) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * 在哈希索引中查找名称所在的桶
+ * @return: 桶的位置，未找到返回-1
+ */
+static int
+name_bucket(struct handle_storage *s, const char * name, uint32_t hash) {
+	int mask = s->name_bucket - 1;
+	int i = hash & mask;
+	for (;;) {
+		int index = s->name_index[i];
+		if (index == NAME_EMPTY)
+			return -1;
+		if (index != NAME_DELETED) {
+			struct handle_name *n = &s->name[index-1];
+			if (n->hash == hash && strcmp(n->name, name) == 0)
+				return i;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+/*
+ * 查找第index个名称条目在哈希索引中的桶
+ */
+static int
+name_bucket_of(struct handle_storage *s, int index) {
+	int mask = s->name_bucket - 1;
+	int i = s->name[index].hash & mask;
+	while (s->name_index[i] != index + 1) {
+		assert(s->name_index[i] != NAME_EMPTY);
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+/*
+ * 重建哈希索引，同时清除所有删除标记
+ * @param size: 新的桶数量，必须是2的幂
+ */
+static void
+name_rehash(struct handle_storage *s, int size) {
+	skynet_free(s->name_index);
+	s->name_bucket = size;
+	s->name_deleted = 0;
+	s->name_index = skynet_malloc(size * sizeof(int));
+	memset(s->name_index, 0, size * sizeof(int));
+	int i;
+	for (i=0;i<s->name_count;i++) {
+		int b = s->name[i].hash & (size - 1);
+		while (s->name_index[b] != NAME_EMPTY) {
+			b = (b + 1) & (size - 1);
+		}
+		s->name_index[b] = i + 1;
+	}
+}
+
+/*
+ * 删除第index个名称条目，调用者需持有写锁
+ * 用数组最后一个条目填补空位，保持名称数组紧凑
+ */
+static void
+name_remove(struct handle_storage *s, int index) {
+	int b = name_bucket_of(s, index);
+	s->name_index[b] = NAME_DELETED;
+	++s->name_deleted;
+	skynet_free(s->name[index].name);
+	int last = --s->name_count;
+	if (index != last) {
+		// 被移动条目的桶仍然指向last，改为新位置
+		s->name_index[name_bucket_of(s, last)] = index + 1;
+		s->name[index] = s->name[last];
+	}
+}
+
+/*
+ * 设置或者删除（target为0）handle的重定向，需要持有写锁
+ */
+static void
+redirect_set(struct handle_storage *s, uint32_t handle, uint32_t target) {
+	if (target == 0 && ATOM_LOAD(&s->redirect_count) == 0)
+		return;
+	struct handle_redirect **p = &s->redirect[handle % REDIRECT_BUCKET];
+	while (*p) {
+		struct handle_redirect *r = *p;
+		if (r->handle == handle) {
+			if (target) {
+				r->target = target;
+			} else {
+				*p = r->next;
+				skynet_free(r);
+				ATOM_FDEC(&s->redirect_count);
+			}
+			return;
+		}
+		p = &r->next;
+	}
+	if (target) {
+		struct handle_redirect *r = skynet_malloc(sizeof(*r));
+		r->handle = handle;
+		r->target = target;
+		r->next = NULL;
+		*p = r;
+		ATOM_FINC(&s->redirect_count);
+	}
+}
+
+/*
+ * 把old中最多n个槽位复制到当前数组，n<0表示全部，调用者需持有写锁
+ */
+static void
+slot_migrate(struct handle_storage *s, int n) {
+	struct handle_slot *old = (struct handle_slot *)ATOM_LOAD(&s->old);
+	if (old == NULL)
+		return;
+	struct handle_slot *slot = (struct handle_slot *)ATOM_LOAD(&s->slot);
+	int i;
+	for (i=s->migrate; i<old->size && n != 0; i++, n--) {
+		struct skynet_context *c = (struct skynet_context *)ATOM_LOAD(&old->ctx[i]);
+		if (c) {
+			uint32_t handle;
+			// 刚注册的上下文，注册者在释放写锁之后才写入handle，很快就能读到
+			while ((handle = skynet_context_handle(c)) == 0)
+				;
+			ATOM_STORE(&slot->ctx[handle & (slot->size - 1)], (uintptr_t)c);
+		}
+	}
+	s->migrate = i;
+	if (i >= old->size) {
+		ATOM_STORE(&s->old, (uintptr_t)NULL);
+	}
+}
+
+/*
+ * 槽位hash在当前数组中是否空闲：还没有迁移的旧槽位如果会搬到这里，也算占用
+ */
+static int
+slot_free(struct handle_storage *s, struct handle_slot *slot, int hash) {
+	if (ATOM_LOAD(&slot->ctx[hash]) != (uintptr_t)NULL)
+		return 0;
+	struct handle_slot *old = (struct handle_slot *)ATOM_LOAD(&s->old);
+	if (old) {
+		struct skynet_context *c = slot_get(old, hash);
+		if (c && (skynet_context_handle(c) & (slot->size - 1)) == (uint32_t)hash)
+			return 0;
+	}
+	return 1;
+}
+
 /*
  * 注册服务上下文，分配新的handle
  * 使用哈希表存储服务上下文，当哈希冲突时自动扩容
@@ -57,45 +279,48 @@ skynet_handle_register(struct skynet_context *ctx) {
 	struct handle_storage *s = H;
 
 	rwlock_wlock(&s->lock);  // 获取写锁
+	slot_migrate(s, MIGRATE_STEP);
 
 	for (;;) {
 		int i;
+		struct handle_slot *slot = (struct handle_slot *)ATOM_LOAD(&s->slot);
 		uint32_t handle = s->handle_index;
 		// 在当前槽位大小范围内查找空闲位置
-		for (i=0;i<s->slot_size;i++,handle++) {
+		for (i=0;i<slot->size;i++,handle++) {
 			if (handle > HANDLE_MASK) {
 				// 0 is reserved
 				// handle 0 被系统保留，从1开始分配
 				handle = 1;
 			}
-			int hash = handle & (s->slot_size-1);  // 计算哈希值
-			if (s->slot[hash] == NULL) {
+			int hash = handle & (slot->size-1);  // 计算哈希值
+			if (slot_free(s, slot, hash)) {
 				// 找到空闲槽位，注册服务
-				s->slot[hash] = ctx;
+				// ctx->handle在返回后才设置，在此之前无锁读者的handle校验不会通过
+				ATOM_STORE(&slot->ctx[hash], (uintptr_t)ctx);
 				s->handle_index = handle + 1;
 
+				handle |= s->harbor;  // 添加节点ID到handle高位
+				// handle被复用，旧服务的重定向不再有效
+				redirect_set(s, handle, 0);
+
 				rwlock_wunlock(&s->lock);
 
-				handle |= s->harbor;  // 添加节点ID到handle高位
 				return handle;
 			}
 		}
 		// 槽位已满，需要扩容（容量翻倍）
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
-
-		// 重新哈希所有现有服务到新的槽位数组
-		for (i=0;i<s->slot_size;i++) {
-			if (s->slot[i]) {
-				int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-				assert(new_slot[hash] == NULL);
-				new_slot[hash] = s->slot[i];
-			}
+		if (ATOM_LOAD(&s->old)) {
+			// 上一次扩容还没有迁移完（正常情况下注册数量远不到这里就迁移完了）
+			slot_migrate(s, -1);
+			continue;
 		}
-		skynet_free(s->slot);
-		s->slot = new_slot;
-		s->slot_size *= 2;  // 容量翻倍
+		assert((slot->size*2 - 1) <= HANDLE_MASK);
+		struct handle_slot *new_slot = slot_new(slot->size * 2, slot);
+
+		// 先发布old再发布新数组，现有的服务之后逐步迁移，旧数组保留给可能仍在读取的线程
+		s->migrate = 0;
+		ATOM_STORE(&s->old, (uintptr_t)slot);
+		ATOM_STORE(&s->slot, (uintptr_t)new_slot);
 	}
 }
 
@@ -111,30 +336,39 @@ skynet_handle_retire(uint32_t handle) {
 	struct handle_storage *s = H;
 
 	rwlock_wlock(&s->lock);  // 获取写锁
-
-	uint32_t hash = handle & (s->slot_size-1);  // 计算哈希值
-	struct skynet_context * ctx = s->slot[hash];
+	slot_migrate(s, MIGRATE_STEP);
+
+	struct handle_slot *slot = (struct handle_slot *)ATOM_LOAD(&s->slot);
+	struct handle_slot *old = (struct handle_slot *)ATOM_LOAD(&s->old);
+	uint32_t hash = handle & (slot->size-1);  // 计算哈希值
+	struct skynet_context * ctx = (struct skynet_context *)ATOM_LOAD(&slot->ctx[hash]);
+	if (ctx == NULL || skynet_context_handle(ctx) != handle) {
+		ctx = old ? slot_get(old, handle) : NULL;
+	}
 
 	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
-		// 找到对应的服务，从槽位中移除
-		s->slot[hash] = NULL;
+		// 找到对应的服务，从槽位中移除，还在迁移时旧数组中的也要清除
+		if (ATOM_LOAD(&slot->ctx[hash]) == (uintptr_t)ctx) {
+			ATOM_STORE(&slot->ctx[hash], (uintptr_t)NULL);
+		}
+		if (old && slot_get(old, handle) == ctx) {
+			ATOM_STORE(&old->ctx[handle & (old->size-1)], (uintptr_t)NULL);
+		}
 		ret = 1;
 
 		// 清理该handle对应的所有名称映射
+		// 从后往前删除，填补空位的条目来自数组末尾，都已经检查过
 		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
+		int removed = 0;
+		for (i=s->name_count-1; i>=0; --i) {
 			if (s->name[i].handle == handle) {
-				// 释放名称字符串内存
-				skynet_free(s->name[i].name);
-				continue;  // 跳过这个条目
-			} else if (i!=j) {
-				// 压缩数组，移除空隙
-				s->name[j] = s->name[i];
+				name_remove(s, i);
+				removed = 1;
 			}
-			++j;
 		}
-		s->name_count = j;  // 更新名称数量
+		if (removed) {
+			ATOM_FINC(&s->name_version);
+		}
 	} else {
 		ctx = NULL;
 	}
@@ -158,13 +392,17 @@ skynet_handle_retire(uint32_t handle) {
 void
 skynet_handle_retireall() {
 	struct handle_storage *s = H;
+	rwlock_wlock(&s->lock);
+	slot_migrate(s, -1);
+	rwlock_wunlock(&s->lock);
 	for (;;) {
 		int n=0;  // 活跃服务计数
 		int i;
 		// 遍历所有槽位
-		for (i=0;i<s->slot_size;i++) {
+		for (i=0;i<((struct handle_slot *)ATOM_LOAD(&s->slot))->size;i++) {
 			rwlock_rlock(&s->lock);  // 获取读锁
-			struct skynet_context * ctx = s->slot[i];
+			struct handle_slot *slot = (struct handle_slot *)ATOM_LOAD(&s->slot);
+			struct skynet_context * ctx = i < slot->size ? (struct skynet_context *)ATOM_LOAD(&slot->ctx[i]) : NULL;
 			uint32_t handle = 0;
 			if (ctx) {
 				handle = skynet_context_handle(ctx);
@@ -181,35 +419,96 @@ skynet_handle_retireall() {
 	}
 }
 
+/*
+ * 列出所有服务的handle
+ * @param handles: 输出数组
+ * @param n: 数组大小，服务总数超过n时只写入前n个
+ * @return: 服务总数
+ */
+int
+skynet_handle_list(uint32_t *handles, int n) {
+	struct handle_storage *s = H;
+	int count = 0;
+	int i;
+	rwlock_wlock(&s->lock);
+	slot_migrate(s, -1);	// 只需要遍历当前数组
+	struct handle_slot *slot = (struct handle_slot *)ATOM_LOAD(&s->slot);
+	for (i=0;i<slot->size;i++) {
+		struct skynet_context * ctx = (struct skynet_context *)ATOM_LOAD(&slot->ctx[i]);
+		if (ctx) {
+			if (count < n) {
+				handles[count] = skynet_context_handle(ctx);
+			}
+			++count;
+		}
+	}
+	rwlock_wunlock(&s->lock);
+	return count;
+}
+
 /*
  * 通过handle获取服务上下文（增加引用计数）
- * 在读锁保护下查找服务，并增加引用计数防止被释放
+ * 不加锁：只读取一次槽位指针，再由skynet_context_trygrab在引用计数不为0时递增，
+ * 并校验handle，过期或被复用的上下文都会被拒绝
+ * 扩容时old先于新数组发布、迁移完才置空，所以读到新数组之后再读old，读到NULL时新数组已经包含全部服务
  * @param handle: 要查找的服务handle
  * @return: 服务上下文指针，未找到返回NULL
  */
 struct skynet_context *
 skynet_handle_grab(uint32_t handle) {
-	struct handle_storage *s = H;
-	struct skynet_context * result = NULL;
-
-	rwlock_rlock(&s->lock);  // 获取读锁
-
-	uint32_t hash = handle & (s->slot_size-1);  // 计算哈希值
-	struct skynet_context * ctx = s->slot[hash];
-	if (ctx && skynet_context_handle(ctx) == handle) {
-		// 找到匹配的服务，增加引用计数
-		result = ctx;
-		skynet_context_grab(result);
+	struct handle_slot *slot = (struct handle_slot *)ATOM_LOAD(&H->slot);
+	struct handle_slot *old = (struct handle_slot *)ATOM_LOAD(&H->old);
+	struct skynet_context * ctx = slot_get(slot, handle);
+	if (ctx && skynet_context_trygrab(ctx, handle)) {
+		return ctx;
 	}
+	if (old) {
+		ctx = slot_get(old, handle);
+		if (ctx && skynet_context_trygrab(ctx, handle)) {
+			return ctx;
+		}
+	}
+	return NULL;
+}
 
-	rwlock_runlock(&s->lock);  // 释放读锁
+/*
+ * 设置handle的重定向，target为0时删除
+ * 服务迁移走之前设置，它退出之后发给它的请求（包括队列中剩下的）都转给target；
+ * handle被新服务复用时自动删除
+ */
+void
+skynet_handle_redirect(uint32_t handle, uint32_t target) {
+	rwlock_wlock(&H->lock);
+	redirect_set(H, handle, target);
+	rwlock_wunlock(&H->lock);
+}
 
-	return result;
+/*
+ * 查找handle的重定向目标，没有返回0
+ * 只在发送失败时调用，没有任何重定向时不加锁
+ */
+uint32_t
+skynet_handle_redirected(uint32_t handle) {
+	struct handle_storage *s = H;
+	if (ATOM_LOAD(&s->redirect_count) == 0)
+		return 0;
+	uint32_t target = 0;
+	rwlock_rlock(&s->lock);
+	struct handle_redirect *r = s->redirect[handle % REDIRECT_BUCKET];
+	while (r) {
+		if (r->handle == handle) {
+			target = r->target;
+			break;
+		}
+		r = r->next;
+	}
+	rwlock_runlock(&s->lock);
+	return target;
 }
 
 /*
  * 通过名称查找handle
- * 使用二分查找在有序的名称数组中查找指定名称
+ * 在开放寻址的哈希索引中查找，平均O(1)
  * @param name: 要查找的服务名称
  * @return: 对应的handle，未找到返回0
  */
@@ -220,26 +519,9 @@ skynet_handle_findname(const char * name) {
 	rwlock_rlock(&s->lock);  // 获取读锁
 
 	uint32_t handle = 0;
-
-	// 二分查找算法
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			// 找到匹配的名称
-			handle = n->handle;
-			break;
-		}
-		if (c<0) {
-			// 目标名称在右半部分
-			begin = mid + 1;
-		} else {
-			// 目标名称在左半部分
-			end = mid - 1;
-		}
+	int b = name_bucket(s, name, name_hash(name));
+	if (b >= 0) {
+		handle = s->name[s->name_index[b]-1].handle;
 	}
 
 	rwlock_runlock(&s->lock);  // 释放读锁
@@ -248,47 +530,17 @@ skynet_handle_findname(const char * name) {
 }
 
 /*
- * 在指定位置之前插入名称映射
- * 如果数组容量不足会自动扩容，保持数组的有序性
- * @param s: handle存储结构
- * @param name: 服务名称字符串
- * @param handle: 对应的handle
- * @param before: 插入位置索引
+ * 获取名称表的版本号
+ * 每次有名称被删除（服务退出）时递增，调用者可以据此判断缓存的查找结果是否仍然有效
  */
-static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	if (s->name_count >= s->name_cap) {
-		// 容量不足，扩容为原来的2倍
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		struct handle_name * n = skynet_malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		// 复制插入位置之前的元素
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
-		}
-		// 复制插入位置之后的元素（留出一个位置）
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
-		}
-		skynet_free(s->name);
-		s->name = n;
-	} else {
-		// 容量足够，直接移动元素
-		int i;
-		for (i=s->name_count;i>before;i--) {
-			s->name[i] = s->name[i-1];
-		}
-	}
-	// 插入新的名称映射
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+int
+skynet_handle_nameversion(void) {
+	return ATOM_LOAD(&H->name_version);
 }
 
 /*
- * 插入名称映射到有序数组中
- * 使用二分查找确定插入位置，保持数组有序
+ * 插入名称映射
+ * 名称追加到紧凑数组末尾，再写入哈希索引；装载率（含删除标记）超过1/2时重建索引
  * @param s: handle存储结构
  * @param name: 要插入的服务名称
  * @param handle: 对应的handle
@@ -296,35 +548,47 @@ _insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int b
  */
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
-	// 二分查找确定插入位置
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			// 名称已存在，插入失败
-			return NULL;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+	uint32_t hash = name_hash(name);
+	if (name_bucket(s, name, hash) >= 0) {
+		// 名称已存在，插入失败
+		return NULL;
+	}
+	if (s->name_count >= s->name_cap) {
+		// 容量不足，扩容为原来的2倍
+		s->name_cap *= 2;
+		assert(s->name_cap <= MAX_SLOT_SIZE);
+		s->name = skynet_realloc(s->name, s->name_cap * sizeof(struct handle_name));
 	}
 	// 复制名称字符串
 	char * result = skynet_strdup(name);
-
-	// 在确定的位置插入名称映射
-	_insert_name_before(s, result, handle, begin);
+	int index = s->name_count++;
+	s->name[index].name = result;
+	s->name[index].handle = handle;
+	s->name[index].hash = hash;
+
+	if ((s->name_count + s->name_deleted) * 2 > s->name_bucket) {
+		int size = s->name_bucket;
+		while (s->name_count * 2 > size) {
+			size *= 2;
+		}
+		name_rehash(s, size);
+	} else {
+		int b = hash & (s->name_bucket - 1);
+		while (s->name_index[b] > 0) {
+			b = (b + 1) & (s->name_bucket - 1);
+		}
+		if (s->name_index[b] == NAME_DELETED) {
+			--s->name_deleted;
+		}
+		s->name_index[b] = index + 1;
+	}
 
 	return result;
 }
 
 /*
  * 为handle绑定名称
- * 在写锁保护下将名称和handle的映射关系插入到有序数组中
+ * 在写锁保护下将名称和handle的映射关系插入名称表
  * @param handle: 要绑定名称的handle
  * @param name: 要绑定的名称
  * @return: 成功返回复制的名称字符串，失败返回NULL
@@ -351,9 +615,9 @@ skynet_handle_init(int harbor) {
 	struct handle_storage * s = skynet_malloc(sizeof(*H));
 
 	// 初始化槽位数组
-	s->slot_size = DEFAULT_SLOT_SIZE;
-	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *));
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));
+	ATOM_INIT(&s->slot, (uintptr_t)slot_new(DEFAULT_SLOT_SIZE, NULL));
+	ATOM_INIT(&s->old, (uintptr_t)NULL);
+	s->migrate = 0;
 
 	// 初始化读写锁
 	rwlock_init(&s->lock);
@@ -362,10 +626,16 @@ skynet_handle_init(int harbor) {
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;  // 从1开始分配handle
 
-	// 初始化名称数组
+	// 初始化名称数组和哈希索引
 	s->name_cap = 2;
 	s->name_count = 0;
 	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name));
+	s->name_index = NULL;
+	name_rehash(s, DEFAULT_NAME_BUCKET);
+	ATOM_INIT(&s->name_version, 0);
+
+	ATOM_INIT(&s->redirect_count, 0);
+	memset(s->redirect, 0, sizeof(s->redirect));
 
 	H = s;  // 设置全局实例
 
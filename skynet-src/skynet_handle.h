@@ -31,6 +31,19 @@ struct skynet_context * skynet_handle_grab(uint32_t handle);
 // 注销所有handle
 void skynet_handle_retireall();
 
+// 列出所有服务的handle，最多写入n个，返回服务总数
+int skynet_handle_list(uint32_t *handles, int n);
+
+/*
+ * handle重定向（服务迁移，见lualib/skynet/migrate.lua）
+ */
+
+// 设置handle退出后请求的转发目标，target为0时删除
+void skynet_handle_redirect(uint32_t handle, uint32_t target);
+
+// 查找handle的转发目标，没有返回0
+uint32_t skynet_handle_redirected(uint32_t handle);
+
 /*
  * handle名称管理
  */
@@ -38,6 +51,9 @@ void skynet_handle_retireall();
 // 通过名称查找handle
 uint32_t skynet_handle_findname(const char * name);
 
+// 名称表版本号，有名称被删除时递增，用于使名称查找缓存失效
+int skynet_handle_nameversion(void);
+
 // 为handle绑定名称
 const char * skynet_handle_namehandle(uint32_t handle, const char *name);
 
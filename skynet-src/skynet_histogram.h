@@ -0,0 +1,86 @@
+/*
+ * skynet_histogram.h - 对数分桶的直方图（HDR风格）
+ * 每个2的幂区间分成8个桶，相对误差不超过12.5%，记录和查询都是O(1)的简单运算
+ * 只由一个线程写入，其他线程读取时允许看到不完整的统计
+ */
+
+#ifndef SKYNET_HISTOGRAM_H
+#define SKYNET_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 44       // 超过 2^44 纳秒（约4.9小时）的值计入最后一个桶
+#define HISTOGRAM_SIZE ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+struct skynet_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[HISTOGRAM_SIZE];
+};
+
+static inline void
+histogram_reset(struct skynet_histogram *h) {
+	memset(h, 0, sizeof(*h));
+}
+
+static inline int
+histogram_index(uint64_t v) {
+	if (v < HISTOGRAM_SUB)
+		return (int)v;
+	int e = 63 - __builtin_clzll(v);
+	if (e >= HISTOGRAM_MAX_BITS)
+		return HISTOGRAM_SIZE - 1;
+	return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB + (int)((v >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+// 桶中最大的值
+static inline uint64_t
+histogram_upper(int index) {
+	if (index < HISTOGRAM_SUB)
+		return index;
+	int e = index / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+	uint64_t m = HISTOGRAM_SUB + index % HISTOGRAM_SUB + 1;
+	return (m << (e - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+static inline void
+histogram_add(struct skynet_histogram *h, uint64_t v) {
+	++h->bucket[histogram_index(v)];
+	++h->count;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/*
+ * 百分位数
+ * @param p: 0-100
+ * @return: 不小于p%的记录的值（所在桶的上界，不超过最大值），没有记录时返回0
+ */
+static inline uint64_t
+histogram_percentile(const struct skynet_histogram *h, double p) {
+	uint64_t count = h->count;
+	if (count == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(p / 100.0 * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > count)
+		rank = count;
+	uint64_t n = 0;
+	int i;
+	for (i=0;i<HISTOGRAM_SIZE;i++) {
+		n += h->bucket[i];
+		if (n >= rank) {
+			uint64_t v = histogram_upper(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+#endif
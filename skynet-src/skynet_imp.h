@@ -7,6 +7,7 @@
 #define SKYNET_IMP_H
 
 #include <string.h>
+#include <stdint.h>
 
 /*
  * skynet配置结构体
@@ -14,13 +15,37 @@
  */
 struct skynet_config {
 	int thread;                 // 工作线程数量
+	int thread_max;             // 工作线程数量的上限，运行时可以增加到这个数量，默认等于thread
+	int thread_min;             // 不为0时按负载自动伸缩工作线程，不少于这个数量
 	int harbor;                 // 节点ID（用于集群）
 	int profile;                // 是否启用性能分析
+	int latency;                // 是否为所有服务开启延迟统计
 	const char * daemon;        // 守护进程PID文件路径
 	const char * module_path;   // 模块搜索路径
 	const char * bootstrap;     // 启动脚本路径
 	const char * logger;        // 日志服务名称
 	const char * logservice;    // 日志服务类型
+	const char * weight;        // 工作线程调度权重策略：default/adaptive/逗号分隔的权重列表
+	int weight_budget;          // 自适应调度的时间预算（微秒）
+	const char * worker_affinity;   // 工作线程绑定的CPU列表，如 "0-7,16"
+	const char * socket_affinity;   // socket线程绑定的CPU列表
+	const char * timer_affinity;    // 定时器线程绑定的CPU列表
+	const char * monitor_affinity;  // 监控线程绑定的CPU列表
+	int numa;                   // 是否开启NUMA模式
+	int mq_limit;               // 消息队列默认背压阈值，0表示不限制
+	const char * sched_group;   // 调度组 "name:share,..."，见skynet_mq_group_init
+	int timer_resolution;       // 定时器滴答长度（毫秒），默认10
+	const char * socket_poll;   // socket事件模型：epoll/kqueue（默认）或uring
+	int socket_thread;          // socket线程数量，每个线程负责一个socket分片，默认1
+	int busypoll;               // 忙轮询（微秒）：socket线程阻塞等待、空闲的工作线程休眠之前自旋的时间，0表示关闭
+	int socket_max;             // 最多的socket数量，0表示每个分片65536
+	const char * lua_arena;     // Lua服务的jemalloc arena：none（默认）、service或class
+	int jemalloc_background;    // 是否开启jemalloc的后台线程
+	const char * jemalloc_decay;    // dirty和muzzy页的衰减时间 "dirty[,muzzy]"（毫秒）
+	int jemalloc_purge;         // 空闲的工作线程整理arena的间隔（毫秒），0表示不整理
+	int trace_ring;             // 每个工作线程记录的消息分发数量，0表示启动时不开启跟踪
+	int monitor_stall;          // 一条消息处理超过多少毫秒时报告，默认5000
+	int monitor_traceback;      // 报告时是否输出Lua服务的调用栈，默认开启
 };
 
 // 线程类型定义
@@ -36,6 +61,27 @@ struct skynet_config {
  */
 void skynet_start(struct skynet_config * config);
 
+/*
+ * 获取工作线程的唤醒统计
+ * @param count: 唤醒次数
+ * @param nsec: 从发出唤醒到工作线程恢复运行的累计延迟（纳秒）
+ */
+void skynet_wakeup_stat(uint64_t *count, uint64_t *nsec);
+
+/*
+ * 获取工作线程的状态（参考值）
+ * @param count: 工作线程数量
+ * @param sleep: 正在休眠的数量
+ */
+void skynet_worker_stat(int *count, int *sleep);
+
+/*
+ * 调整工作线程的数量，不超过配置项thread_max
+ * @param n: 新的数量，不大于0时只查询
+ * @return: 调整后的数量
+ */
+int skynet_worker_resize(int n);
+
 /*
  * 字符串复制工具函数（指定长度）
  * 类似于POSIX strndup函数
@@ -0,0 +1,324 @@
+/*
+ * skynet_journal.c - 服务的消息日志
+ * 服务线程只把消息复制成一条记录放进队列，写线程成批写入文件，每批之后fflush。
+ * 只防服务和进程崩溃，普通记录不fsync；快照写完fsync之后才改名，保证快照文件总是完整的
+ */
+
+#include "skynet.h"
+#include "skynet_journal.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REC_DATA 0
+#define REC_SNAPSHOT 1
+#define REC_CLOSE 2
+
+struct skynet_journal {
+	FILE *f;                // 只在写线程中使用（打开之后）
+	char *filename;
+	char *snapshot;
+	uint64_t seq;           // 最后分配的seq，只在服务线程中使用
+	int error;              // 写失败过，不再重复报告
+};
+
+struct record {
+	struct record *next;
+	struct skynet_journal *j;
+	int kind;
+	uint64_t seq;           // REC_SNAPSHOT
+	size_t sz;
+	uint8_t data[1];
+};
+
+struct journal_writer {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct record *head;
+	struct record *tail;
+	int started;
+	int exit;
+	pthread_t thread;
+};
+
+static struct journal_writer W = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	NULL,
+	NULL,
+	0,
+	0,
+};
+
+static void
+write_error(struct skynet_journal *j, const char *what) {
+	if (!j->error) {
+		j->error = 1;
+		skynet_error(NULL, "journal %s : %s error", j->filename, what);
+	}
+}
+
+static void
+write_snapshot(struct skynet_journal *j, struct record *r) {
+	size_t sz = strlen(j->snapshot);
+	char tmp[sz + 5];
+	memcpy(tmp, j->snapshot, sz);
+	memcpy(tmp + sz, ".tmp", 5);
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		skynet_error(NULL, "journal snapshot %s : open error", tmp);
+		return;
+	}
+	int ok = fwrite(JOURNAL_SNAPSHOT_MAGIC, 4, 1, f) == 1
+		&& fwrite(&r->seq, sizeof(r->seq), 1, f) == 1
+		&& (r->sz == 0 || fwrite(r->data, r->sz, 1, f) == 1)
+		&& fflush(f) == 0
+		&& fsync(fileno(f)) == 0;
+	if (fclose(f) != 0)
+		ok = 0;
+	if (!ok || rename(tmp, j->snapshot) != 0) {
+		skynet_error(NULL, "journal snapshot %s : write error", j->snapshot);
+		unlink(tmp);
+		return;
+	}
+	// 快照已经包含了之前的所有记录。截断失败也没有关系，加载时按seq跳过
+	if (fflush(j->f) != 0 || ftruncate(fileno(j->f), 4) != 0) {
+		write_error(j, "truncate");
+	}
+}
+
+static void
+close_journal(struct skynet_journal *j) {
+	if (fclose(j->f) != 0) {
+		write_error(j, "close");
+	}
+	skynet_free(j->filename);
+	skynet_free(j->snapshot);
+	skynet_free(j);
+}
+
+static void *
+thread_writer(void *p) {
+	for (;;) {
+		pthread_mutex_lock(&W.lock);
+		while (W.head == NULL && !W.exit) {
+			pthread_cond_wait(&W.cond, &W.lock);
+		}
+		struct record *r = W.head;
+		W.head = W.tail = NULL;
+		pthread_mutex_unlock(&W.lock);
+		if (r == NULL)
+			break;
+		struct skynet_journal *last = NULL;
+		while (r) {
+			struct record *next = r->next;
+			struct skynet_journal *j = r->j;
+			if (last && last != j && fflush(last->f) != 0) {
+				write_error(last, "write");
+			}
+			last = j;
+			switch (r->kind) {
+			case REC_DATA:
+				if (fwrite(r->data, r->sz, 1, j->f) != 1) {
+					write_error(j, "write");
+				}
+				break;
+			case REC_SNAPSHOT:
+				write_snapshot(j, r);
+				break;
+			case REC_CLOSE:
+				close_journal(j);
+				last = NULL;
+				break;
+			}
+			skynet_free(r);
+			r = next;
+		}
+		if (last && fflush(last->f) != 0) {
+			write_error(last, "write");
+		}
+	}
+	return NULL;
+}
+
+static void
+push_record(struct record *r) {
+	r->next = NULL;
+	pthread_mutex_lock(&W.lock);
+	if (W.tail) {
+		W.tail->next = r;
+	} else {
+		W.head = r;
+	}
+	W.tail = r;
+	pthread_cond_signal(&W.cond);
+	pthread_mutex_unlock(&W.lock);
+}
+
+static struct record *
+new_record(struct skynet_journal *j, int kind, size_t sz) {
+	struct record *r = skynet_malloc(sizeof(*r) + sz);
+	r->j = j;
+	r->kind = kind;
+	r->seq = 0;
+	r->sz = sz;
+	return r;
+}
+
+static int
+start_writer(void) {
+	int err = 0;
+	pthread_mutex_lock(&W.lock);
+	if (!W.started) {
+		if (pthread_create(&W.thread, NULL, thread_writer, NULL) == 0) {
+			W.started = 1;
+		} else {
+			err = 1;
+		}
+	}
+	pthread_mutex_unlock(&W.lock);
+	return err;
+}
+
+static char *
+dupstr(const char *str) {
+	size_t sz = strlen(str);
+	char *s = skynet_malloc(sz + 1);
+	memcpy(s, str, sz + 1);
+	return s;
+}
+
+// 快照的seq，没有快照返回0
+static uint64_t
+snapshot_seq(const char *snapshot) {
+	FILE *f = fopen(snapshot, "rb");
+	if (f == NULL)
+		return 0;
+	char magic[4];
+	uint64_t seq = 0;
+	if (fread(magic, 4, 1, f) != 1 || memcmp(magic, JOURNAL_SNAPSHOT_MAGIC, 4) != 0
+		|| fread(&seq, sizeof(seq), 1, f) != 1) {
+		seq = 0;
+	}
+	fclose(f);
+	return seq;
+}
+
+// 检查已有的日志，返回完整记录的长度，last是最后一条记录的seq，格式不对返回-1
+static long
+scan_journal(FILE *f, uint64_t *last) {
+	if (fseek(f, 0, SEEK_END) != 0)
+		return -1;
+	long size = ftell(f);
+	if (size == 0)
+		return 0;
+	rewind(f);
+	char magic[4];
+	if (size < 4 || fread(magic, 4, 1, f) != 1 || memcmp(magic, JOURNAL_MAGIC, 4) != 0)
+		return -1;
+	long pos = 4;
+	uint8_t header[JOURNAL_HEADER];
+	while (pos + JOURNAL_HEADER <= size) {
+		if (fseek(f, pos, SEEK_SET) != 0 || fread(header, JOURNAL_HEADER, 1, f) != 1)
+			break;
+		uint32_t sz;
+		uint64_t seq;
+		memcpy(&sz, header, sizeof(sz));
+		memcpy(&seq, header + 4, sizeof(seq));
+		if (pos + JOURNAL_HEADER + (long)sz > size)
+			break;
+		*last = seq;
+		pos += JOURNAL_HEADER + sz;
+	}
+	return pos;
+}
+
+struct skynet_journal *
+skynet_journal_open(const char *filename, const char *snapshot) {
+	if (start_writer()) {
+		skynet_error(NULL, "journal %s : can't start writer thread", filename);
+		return NULL;
+	}
+	FILE *f = fopen(filename, "a+b");
+	if (f == NULL) {
+		skynet_error(NULL, "journal %s : open error", filename);
+		return NULL;
+	}
+	uint64_t last = 0;
+	long valid = scan_journal(f, &last);
+	if (valid < 0) {
+		skynet_error(NULL, "journal %s : invalid format", filename);
+		fclose(f);
+		return NULL;
+	}
+	// 丢掉末尾没写完的记录（上次崩溃时留下的）
+	if (ftruncate(fileno(f), valid) != 0) {
+		skynet_error(NULL, "journal %s : truncate error", filename);
+		fclose(f);
+		return NULL;
+	}
+	if (valid == 0 && (fwrite(JOURNAL_MAGIC, 4, 1, f) != 1 || fflush(f) != 0)) {
+		skynet_error(NULL, "journal %s : write error", filename);
+		fclose(f);
+		return NULL;
+	}
+	uint64_t seq = snapshot_seq(snapshot);
+	struct skynet_journal *j = skynet_malloc(sizeof(*j));
+	j->f = f;
+	j->filename = dupstr(filename);
+	j->snapshot = dupstr(snapshot);
+	j->seq = last > seq ? last : seq;
+	j->error = 0;
+	return j;
+}
+
+void
+skynet_journal_close(struct skynet_journal *j) {
+	push_record(new_record(j, REC_CLOSE, 0));
+}
+
+void
+skynet_journal_append(struct skynet_journal *j, uint32_t source, int type, int session, const void *data, size_t sz) {
+	struct record *r = new_record(j, REC_DATA, JOURNAL_HEADER + sz);
+	uint32_t size = (uint32_t)sz;
+	uint64_t seq = ++j->seq;
+	int32_t t = type;
+	int32_t s = session;
+	uint8_t *p = r->data;
+	memcpy(p, &size, 4);
+	memcpy(p + 4, &seq, 8);
+	memcpy(p + 12, &source, 4);
+	memcpy(p + 16, &t, 4);
+	memcpy(p + 20, &s, 4);
+	if (sz > 0) {
+		memcpy(p + JOURNAL_HEADER, data, sz);
+	}
+	push_record(r);
+}
+
+uint64_t
+skynet_journal_snapshot(struct skynet_journal *j, const void *data, size_t sz) {
+	struct record *r = new_record(j, REC_SNAPSHOT, sz);
+	uint64_t seq = j->seq;
+	r->seq = seq;
+	if (sz > 0) {
+		memcpy(r->data, data, sz);
+	}
+	push_record(r);
+	return seq;
+}
+
+void
+skynet_journal_exit(void) {
+	pthread_mutex_lock(&W.lock);
+	int started = W.started;
+	W.exit = 1;
+	pthread_cond_signal(&W.cond);
+	pthread_mutex_unlock(&W.lock);
+	if (started) {
+		pthread_join(W.thread, NULL);
+	}
+}
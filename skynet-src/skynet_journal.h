@@ -0,0 +1,56 @@
+/*
+ * skynet_journal.h - 服务的消息日志
+ * 按顺序记下服务收到的每条消息（二进制，追加写），配合服务自己保存的快照，
+ * 服务崩溃重启后可以从快照开始重放消息恢复状态。文件由一个单独的写线程写入，不占用工作线程
+ */
+
+#ifndef skynet_journal_h
+#define skynet_journal_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * 日志文件 : "SKJ1" 后面是一条条记录
+ *   size(4) seq(8) source(4) type(4) session(4) 数据(size)
+ * 快照文件 : "SKS1" seq(8) 数据
+ *   快照包含了seq以及之前的所有消息，日志中seq不大于它的记录都已经过时
+ * 数字都是本机字节序
+ */
+#define JOURNAL_MAGIC "SKJ1"
+#define JOURNAL_SNAPSHOT_MAGIC "SKS1"
+#define JOURNAL_HEADER 24
+
+struct skynet_journal;
+
+/*
+ * 打开日志，文件不存在时创建
+ * 已有的日志继续写下去：丢掉末尾没写完的记录，seq接着日志和快照中最大的seq
+ * @return: 失败返回NULL
+ */
+struct skynet_journal * skynet_journal_open(const char *filename, const char *snapshot);
+
+/*
+ * 关闭日志，已经记下的消息由写线程写完之后释放
+ */
+void skynet_journal_close(struct skynet_journal *);
+
+/*
+ * 记下一条消息，复制数据交给写线程
+ * 只能在服务自己的线程中调用（分发消息时）
+ */
+void skynet_journal_append(struct skynet_journal *, uint32_t source, int type, int session, const void *data, size_t sz);
+
+/*
+ * 保存快照，它包含了到目前为止记下的所有消息的效果
+ * 写线程把快照写到临时文件、fsync之后改名，再截断日志
+ * @return: 快照的seq
+ */
+uint64_t skynet_journal_snapshot(struct skynet_journal *, const void *data, size_t sz);
+
+/*
+ * 等待写线程写完所有日志后退出（进程退出前调用）
+ */
+void skynet_journal_exit(void);
+
+#endif
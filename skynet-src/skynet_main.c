@@ -219,6 +219,8 @@ main(int argc, char *argv[]) {
 
 	// 从环境变量中获取各项配置，设置到config结构中
 	config.thread =  optint("thread",8);                                    // 工作线程数量，默认8个
+	config.thread_max = optint("thread_max", 0);                            // 工作线程数量上限，默认等于thread
+	config.thread_min = optint("thread_min", 0);                            // 自动伸缩的下限，0表示不伸缩
 	config.module_path = optstring("cpath","./cservice/?.so");              // C模块搜索路径
 	config.harbor = optint("harbor", 1);                                    // 节点ID，用于集群
 	config.bootstrap = optstring("bootstrap","snlua bootstrap");            // 启动服务命令
@@ -226,6 +228,28 @@ main(int argc, char *argv[]) {
 	config.logger = optstring("logger", NULL);                              // 日志服务参数
 	config.logservice = optstring("logservice", "logger");                  // 日志服务名称
 	config.profile = optboolean("profile", 1);                              // 是否开启性能分析
+	config.latency = optboolean("latency", 0);                              // 是否开启延迟统计
+	config.weight = optstring("weight", "default");                         // 工作线程调度权重策略
+	config.weight_budget = optint("weight_budget", WEIGHT_BUDGET_DEFAULT);  // 自适应调度的时间预算（微秒）
+	config.worker_affinity = optstring("worker_affinity", NULL);            // 工作线程CPU绑定
+	config.socket_affinity = optstring("socket_affinity", NULL);            // socket线程CPU绑定
+	config.timer_affinity = optstring("timer_affinity", NULL);              // 定时器线程CPU绑定
+	config.monitor_affinity = optstring("monitor_affinity", NULL);          // 监控线程CPU绑定
+	config.numa = optboolean("numa", 0);                                    // NUMA模式
+	config.mq_limit = optint("mq_limit", 0);                                // 消息队列背压阈值
+	config.sched_group = optstring("sched_group", NULL);                    // 调度组及其份额
+	config.timer_resolution = optint("timer_resolution", 10);               // 定时器精度（毫秒）
+	config.socket_poll = optstring("socket_poll", NULL);                    // socket事件模型
+	config.socket_thread = optint("socket_thread", 1);                      // socket线程数量
+	config.busypoll = optint("busypoll", 0);                                // 忙轮询的时间（微秒）
+	config.socket_max = optint("socket_max", 0);                            // 最多的socket数量
+	config.lua_arena = optstring("lua_arena", "none");                      // Lua服务的jemalloc arena
+	config.jemalloc_background = optboolean("jemalloc_background", 0);      // jemalloc的后台线程
+	config.jemalloc_decay = optstring("jemalloc_decay", NULL);              // jemalloc的衰减时间
+	config.jemalloc_purge = optint("jemalloc_purge", 0);                    // 空闲时整理arena的间隔（毫秒）
+	config.trace_ring = optint("trace_ring", 0);                            // 消息分发跟踪的环形缓冲区大小
+	config.monitor_stall = optint("monitor_stall", 5000);                   // 消息处理超时报告的阈值（毫秒）
+	config.monitor_traceback = optboolean("monitor_traceback", 1);          // 超时报告时输出调用栈
 
 	// 通过config结构中的内容，开始正式启动skynet
 	skynet_start(&config);
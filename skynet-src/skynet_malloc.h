@@ -7,6 +7,7 @@
 #define skynet_malloc_h
 
 #include <stddef.h>
+#include <stdint.h>
 
 // 内存分配函数宏定义（可重定向到自定义实现）
 #define skynet_malloc malloc                    // 内存分配
@@ -36,6 +37,21 @@ void skynet_free(void *ptr);
 // Lua专用内存分配器接口
 void * skynet_lalloc(void *ptr, size_t osize, size_t nsize);	// use for lua
 
+// 按配置lua_arena为名为name的服务准备独立的jemalloc arena，返回传给skynet_lalloc_x的标志，0表示用skynet_lalloc
+int skynet_lalloc_open(const char *name);
+void * skynet_lalloc_x(void *ptr, size_t osize, size_t nsize, int flags);
+// 释放skynet_lalloc_x分配的内存，可以在服务线程以外的线程调用
+void skynet_lalloc_free(void *ptr, int flags);
+// Lua虚拟机关闭后释放arena
+void skynet_lalloc_close(int flags);
+// 服务空闲时调用，把虚拟机缓存的空闲内存还给arena，按服务分配的arena再把空闲页还给系统
+void skynet_lalloc_trim(int flags);
+// 以MEMORY_NOCOOKIE编译时，按服务统计Lua虚拟机的内存变化（代替C内存的按服务统计）；否则什么也不做
+void skynet_lalloc_account(uint32_t handle, ptrdiff_t delta);
+
+// 为消息负载分配内存：不超过256字节的从定长小块池分配（需要jemalloc的钩子），用skynet_free释放
+void * skynet_slab_alloc(size_t sz);
+
 // 分配指定对齐要求的内存
 void * skynet_memalign(size_t alignment, size_t size);
 
@@ -8,6 +8,7 @@
 #include "skynet_imp.h"
 #include "skynet_module.h"
 #include "spinlock.h"
+#include "atomic.h"
 
 #include <assert.h>
 #include <string.h>
@@ -16,15 +17,18 @@
 #include <stdint.h>
 #include <stdio.h>
 
-#define MAX_MODULE_TYPE 32  // 最大模块类型数量
+#ifndef MAX_MODULE_TYPE
+#define MAX_MODULE_TYPE 32  // 最大模块类型数量（不含静态链接的模块），可以用 -DMAX_MODULE_TYPE=n 修改
+#endif
 
 /*
  * 模块管理器结构体
  * 管理所有已加载的C服务模块
+ * 读不加锁：写者先填好 m[count]，再增加 count 发布，已发布的项不再修改
  */
 struct modules {
-	int count;                                  // 已加载的模块数量
-	struct spinlock lock;                       // 自旋锁，保护并发访问
+	ATOM_INT count;                             // 已加载的模块数量
+	struct spinlock lock;                       // 自旋锁，只保护加载新模块
 	const char * path;                          // 模块搜索路径
 	struct skynet_module m[MAX_MODULE_TYPE];    // 模块数组
 };
@@ -32,6 +36,50 @@ struct modules {
 // 全局模块管理器实例
 static struct modules * M = NULL;
 
+/*
+ * 静态链接进 skynet 的模块，编译时用 STATIC_CSERVICE 选择（见 Makefile），
+ * 对应的 -DSKYNET_STATIC_xxx 打开这里的表项。查询时先查这张表，不需要 dlopen 。
+ * 可选的接口用弱符号声明，模块没有实现时为 NULL 。
+ */
+#define STATIC_MODULE_DECLARE(name) \
+	int name##_init(void * inst, struct skynet_context *, const char * parm); \
+	void * name##_create(void) __attribute__((weak)); \
+	void name##_release(void * inst) __attribute__((weak)); \
+	void name##_signal(void * inst, int signal) __attribute__((weak)); \
+	void name##_batch(void * inst, struct skynet_context *, struct skynet_message * msg, int n) __attribute__((weak));
+
+#define STATIC_MODULE(name) \
+	{ #name, NULL, name##_create, name##_init, name##_release, name##_signal, name##_batch },
+
+#ifdef SKYNET_STATIC_snlua
+STATIC_MODULE_DECLARE(snlua)
+#endif
+#ifdef SKYNET_STATIC_logger
+STATIC_MODULE_DECLARE(logger)
+#endif
+#ifdef SKYNET_STATIC_gate
+STATIC_MODULE_DECLARE(gate)
+#endif
+#ifdef SKYNET_STATIC_harbor
+STATIC_MODULE_DECLARE(harbor)
+#endif
+
+static const struct skynet_module static_modules[] = {
+#ifdef SKYNET_STATIC_snlua
+	STATIC_MODULE(snlua)
+#endif
+#ifdef SKYNET_STATIC_logger
+	STATIC_MODULE(logger)
+#endif
+#ifdef SKYNET_STATIC_gate
+	STATIC_MODULE(gate)
+#endif
+#ifdef SKYNET_STATIC_harbor
+	STATIC_MODULE(harbor)
+#endif
+	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
 /*
  * 尝试打开指定名称的动态库
  * 在配置的搜索路径中查找并加载动态库
@@ -93,7 +141,13 @@ _try_open(struct modules *m, const char * name) {
 static struct skynet_module *
 _query(const char * name) {
 	int i;
-	for (i=0;i<M->count;i++) {
+	for (i=0;static_modules[i].name;i++) {
+		if (strcmp(static_modules[i].name,name)==0) {
+			return (struct skynet_module *)&static_modules[i];
+		}
+	}
+	int n = ATOM_LOAD(&M->count);
+	for (i=0;i<n;i++) {
 		if (strcmp(M->m[i].name,name)==0) {
 			return &M->m[i];
 		}
@@ -133,6 +187,7 @@ open_sym(struct skynet_module *mod) {
 	mod->init = get_api(mod, "_init");
 	mod->release = get_api(mod, "_release");
 	mod->signal = get_api(mod, "_signal");
+	mod->batch = get_api(mod, "_batch");
 
 	return mod->init == NULL;
 }
@@ -147,8 +202,8 @@ skynet_module_query(const char * name) {
 
 	result = _query(name); // double check 双重检查
 
-	if (result == NULL && M->count < MAX_MODULE_TYPE) {
-		int index = M->count;
+	int index = ATOM_LOAD(&M->count);
+	if (result == NULL && index < MAX_MODULE_TYPE) {
 		void * dl = _try_open(M,name);
 		if (dl) {
 			M->m[index].name = name;
@@ -156,7 +211,7 @@ skynet_module_query(const char * name) {
 
 			if (open_sym(&M->m[index]) == 0) {
 				M->m[index].name = skynet_strdup(name);
-				M->count ++;
+				ATOM_STORE(&M->count, index + 1);   // 填好后再发布
 				result = &M->m[index];
 			}
 		}
@@ -198,7 +253,7 @@ skynet_module_instance_signal(struct skynet_module *m, void *inst, int signal) {
 void
 skynet_module_init(const char *path) {
 	struct modules *m = skynet_malloc(sizeof(*m));
-	m->count = 0;
+	ATOM_INIT(&m->count, 0);
 	m->path = skynet_strdup(path);
 
 	SPIN_INIT(m)
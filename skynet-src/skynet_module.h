@@ -8,6 +8,7 @@
 
 // 前向声明
 struct skynet_context;
+struct skynet_message;
 
 /*
  * 模块接口函数类型定义
@@ -25,6 +26,10 @@ typedef void (*skynet_dl_release)(void * inst);
 // 发送信号给模块实例
 typedef void (*skynet_dl_signal)(void * inst, int signal);
 
+// 批量处理消息（可选）：一次处理n条消息
+// 需要保留消息内存时将msg[i].data置为NULL，其余非NULL的data由框架释放
+typedef void (*skynet_dl_batch)(void * inst, struct skynet_context *, struct skynet_message * msg, int n);
+
 /*
  * 模块描述结构体
  * 包含模块的基本信息和接口函数指针
@@ -36,6 +41,7 @@ struct skynet_module {
 	skynet_dl_init init;        // 初始化函数指针
 	skynet_dl_release release;  // 释放函数指针
 	skynet_dl_signal signal;    // 信号处理函数指针
+	skynet_dl_batch batch;      // 批量处理函数指针（可为NULL）
 };
 
 /*
@@ -23,8 +23,13 @@ struct skynet_monitor {
 	int check_version;      // 上次检查时的版本号
 	uint32_t source;        // 消息来源服务handle
 	uint32_t destination;   // 消息目标服务handle
+	uint64_t since;         // 第一次看到当前版本号的时间（毫秒）
+	uint64_t report;        // 下次报告的时间（毫秒），0表示还没有报告过
 };
 
+// snlua 收到这个信号后，在下一条 Lua 指令时输出正在运行的协程的调用栈
+#define STALL_SIGNAL 2
+
 /*
  * 创建新的监控器实例
  * @return: 新创建的监控器指针
@@ -61,20 +66,36 @@ skynet_monitor_trigger(struct skynet_monitor *sm, uint32_t source, uint32_t dest
 
 /*
  * 检查监控器状态，检测是否存在死循环
- * 如果版本号在两次检查间没有变化，说明消息处理可能陷入死循环
+ * 版本号从上次变化起超过stall毫秒没有变化，说明一条消息处理了太久，之后每隔stall毫秒再报告一次
+ * 检查的间隔越短，计时越准，误差不超过一个检查间隔
  * @param sm: 监控器实例
+ * @param now: 当前时间（毫秒）
+ * @param stall: 超时阈值（毫秒）
+ * @param traceback: 是否让服务输出调用栈
  */
 void
-skynet_monitor_check(struct skynet_monitor *sm) {
-	if (sm->version == sm->check_version) {
-		// 版本号未变化，可能存在死循环
-		if (sm->destination) {
-			// 标记目标服务为无限循环状态
-			skynet_context_endless(sm->destination);
-			skynet_error(NULL, "error: A message from [ :%08x ] to [ :%08x ] maybe in an endless loop (version = %d)", sm->source , sm->destination, sm->version);
-		}
-	} else {
+skynet_monitor_check(struct skynet_monitor *sm, uint64_t now, int stall, int traceback) {
+	int version = ATOM_LOAD(&sm->version);
+	if (version != sm->check_version) {
 		// 版本号已变化，更新检查版本号
-		sm->check_version = sm->version;
+		sm->check_version = version;
+		sm->since = now;
+		sm->report = 0;
+		return;
+	}
+	// 版本号未变化，可能存在死循环
+	uint32_t destination = sm->destination;
+	if (destination == 0)
+		return;
+	if (sm->report == 0) {
+		sm->report = sm->since + stall;
 	}
+	if (now < sm->report)
+		return;
+	sm->report = now + stall;
+	// 标记目标服务为无限循环状态，第一次报告时要求输出调用栈
+	int first = now - sm->since < (uint64_t)stall * 2;
+	skynet_context_endless(destination, (traceback && first) ? STALL_SIGNAL : -1);
+	skynet_error(NULL, "error: A message from [ :%08x ] to [ :%08x ] maybe in an endless loop (version = %d, %d ms)",
+		sm->source , destination, version, (int)(now - sm->since));
 }
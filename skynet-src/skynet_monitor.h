@@ -36,7 +36,10 @@ void skynet_monitor_trigger(struct skynet_monitor *, uint32_t source, uint32_t d
  * 执行监控检查
  * 检查是否有服务陷入死循环
  * @param monitor: 监控器实例指针
+ * @param now: 当前时间（毫秒）
+ * @param stall: 处理一条消息超过多少毫秒时报告
+ * @param traceback: 报告时是否让服务输出调用栈
  */
-void skynet_monitor_check(struct skynet_monitor *);
+void skynet_monitor_check(struct skynet_monitor *, uint64_t now, int stall, int traceback);
 
 #endif
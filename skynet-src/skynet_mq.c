@@ -6,7 +6,12 @@
 #include "skynet.h"
 #include "skynet_mq.h"
 #include "skynet_handle.h"
+#include "skynet_timer.h"
+#include "skynet_probe.h"
 #include "spinlock.h"
+#include "atomic.h"
+
+#include <pthread.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,8 +19,10 @@
 #include <assert.h>
 #include <stdbool.h>
 
-#define DEFAULT_QUEUE_SIZE 64   // 默认队列大小
+#define DEFAULT_QUEUE_SIZE 64   // 默认队列大小，收缩时不低于它
+#define INIT_QUEUE_SIZE 8       // 第一条消息到来时分配的数组大小，之后满了再翻倍
 #define MAX_GLOBAL_MQ 0x10000   // 全局队列最大大小
+#define MAX_LOCAL_MQ 64         // 工作线程本地队列的最大长度，超出后溢出到全局队列
 
 // 消息队列状态标志
 // 0 means mq is not in global mq.
@@ -25,6 +32,41 @@
 
 #define MQ_IN_GLOBAL 1
 #define MQ_OVERLOAD 1024        // 过载阈值
+#define MQ_RING_DEFAULT 1024    // 无锁环形缓冲区的默认容量
+#define MQ_PRIORITY_STREAK 16   // 高优先级通道连续弹出的上限，超过后让出一条普通消息，防止饿死
+
+/*
+ * 无锁环形缓冲区的槽位
+ * seq为槽位序号：等于写入位置时可写，等于写入位置+1时可读
+ */
+struct mq_slot {
+	ATOM_SIZET seq;
+	struct skynet_message msg;
+};
+
+/*
+ * 多生产者单消费者的有界无锁环形缓冲区
+ * 生产者通过CAS争夺tail，消费者只有一个（处理该服务的工作线程），head无需同步
+ */
+struct mq_ring {
+	size_t mask;                    // 容量-1，容量总是2的幂
+	ATOM_SIZET tail;                // 下一个写入位置
+	size_t head;                    // 下一个读取位置（仅消费者访问）
+	struct mq_slot slot[1];
+};
+
+/*
+ * 独占工作线程的调度信息
+ * 独占队列不进入任何运行队列，被调度时直接唤醒它的独占线程
+ */
+struct mq_exclusive {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int ready;                      // 队列已被调度，等待独占线程处理
+	uint64_t ready_time;            // 被调度时的单调时钟（纳秒）
+	uint64_t wakeup;                // 被调度的次数
+	uint64_t wait;                  // 从被调度到开始处理的累计等待时间（纳秒）
+};
 
 /*
  * 消息队列结构体
@@ -37,11 +79,26 @@ struct message_queue {
 	int head;                       // 队列头部索引
 	int tail;                       // 队列尾部索引
 	int release;                    // 释放标志
-	int in_global;                  // 是否在全局队列中
+	ATOM_INT in_global;             // 是否在全局队列中
 	int overload;                   // 过载计数
 	int overload_threshold;         // 过载阈值
 	struct skynet_message *queue;   // 消息数组
 	struct message_queue *next;     // 全局队列中的下一个节点
+	int owner;                      // 最近一次处理该队列的工作线程id，-1表示尚未被处理
+	ATOM_POINTER ring;              // 无锁模式下的环形缓冲区，NULL表示使用加锁模式
+	ATOM_INT pending;               // 无锁模式下溢出到加锁数组中的消息数量
+	ATOM_POINTER exclusive;         // 独占工作线程的调度信息，NULL表示由普通工作线程调度
+	ATOM_INT priority;              // 是否开启优先级通道
+	ATOM_INT hlength;               // 高优先级通道中的消息数量
+	int hcap;                       // 高优先级通道容量
+	int hhead;                      // 高优先级通道头部索引
+	int htail;                      // 高优先级通道尾部索引
+	int hstreak;                    // 高优先级通道连续弹出次数（仅消费者访问）
+	struct skynet_message *hqueue;  // 高优先级通道消息数组（受q->lock保护）
+	ATOM_INT limit;                 // 背压阈值：队列长度达到该值后拒绝普通消息，0表示不限制
+	ATOM_INT dropped;               // 因背压被拒绝的消息数量
+	ATOM_INT stamp;                 // 入队时记录时间戳
+	ATOM_INT group;                 // 所属的调度组，0为默认组
 };
 
 /*
@@ -52,20 +109,66 @@ struct global_queue {
 	struct message_queue *head;     // 队列头部
 	struct message_queue *tail;     // 队列尾部
 	struct spinlock lock;           // 自旋锁，保护全局队列操作
+	int length;                     // 队列中的服务队列数量（无锁读取仅作参考）
+	int node;                       // 本地队列所属工作线程的NUMA节点
 };
 
 // 全局消息队列实例
 static struct global_queue *Q = NULL;
 
+// 每个工作线程的本地运行队列，结构与全局队列相同，锁只在窃取时才会产生竞争
+static struct global_queue *LQ = NULL;
+static int LQ_COUNT = 0;
+// 在用的工作线程数量，id不小于它的线程被移除了，不再往它的本地队列推入
+static ATOM_INT LQ_ACTIVE;
+
+// 新建队列的默认背压阈值，0表示不限制
+static int LIMIT = 0;
+
+#define MAX_GROUP 8             // 调度组的最大数量（包括默认组）
+#define GROUP_NAME 16           // 调度组名称的最大长度（包括结尾的0）
+#define GROUP_SHARE 100         // 默认组的份额
+#define GROUP_LAG 20000         // 空闲过的组最多落后的虚拟时间，防止它积攒的份额在恢复后独占工作线程
+
 /*
- * 将消息队列推入全局队列
- * 当服务有消息需要处理时，将其队列加入全局队列等待工作线程处理
- * @param queue: 要推入的消息队列
+ * 调度组
+ * 每个组的服务队列在组自己的运行队列中排队（默认组使用全局队列和工作线程的本地队列），
+ * 工作线程按加权公平排队选组：虚拟时间 = 消耗的CPU时间（微秒） * GROUP_SHARE / 份额，
+ * 取虚拟时间最小且有待处理队列的组。份额为0的组只在其他组都没有消息时才被处理。
  */
-void
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q= Q;
+struct sched_group {
+	char name[GROUP_NAME];
+	int share;                      // 份额，0表示只使用空闲的CPU
+	ATOM_ULONG vtime;               // 虚拟时间
+	ATOM_ULONG cpu;                 // 累计消耗的CPU时间（微秒）
+	struct global_queue q;          // 本组的运行队列，默认组不使用
+};
 
+static struct sched_group GROUP[MAX_GROUP];
+static int GROUP_COUNT = 1;
+static ATOM_ULONG VCLOCK;           // 被处理的组中最大的虚拟时间
+
+/*
+ * 尝试把in_global从0置为MQ_IN_GLOBAL，成功者负责将队列推入运行队列
+ * ATOM_CAS允许伪失败，所以在标志仍为0时需要重试
+ * @return: 1表示由调用者负责调度该队列
+ */
+static inline int
+mq_schedule(struct message_queue *q) {
+	while (ATOM_LOAD(&q->in_global) == 0) {
+		if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * 将消息队列推入指定的运行队列尾部
+ * @param q: 运行队列（全局或本地）
+ * @param queue: 要推入的消息队列
+ */
+static void
+runqueue_push(struct global_queue *q, struct message_queue * queue) {
 	SPIN_LOCK(q)
 	assert(queue->next == NULL);
 	if(q->tail) {
@@ -76,18 +179,17 @@ skynet_globalmq_push(struct message_queue * queue) {
 		// 队列为空，设置为头尾节点
 		q->head = q->tail = queue;
 	}
+	++q->length;
 	SPIN_UNLOCK(q)
 }
 
 /*
- * 从全局队列弹出一个消息队列
- * 工作线程调用此函数获取有消息待处理的服务队列
- * @return: 消息队列指针，如果全局队列为空则返回NULL
+ * 从指定的运行队列头部弹出一个消息队列
+ * @param q: 运行队列（全局或本地）
+ * @return: 消息队列指针，如果运行队列为空则返回NULL
  */
-struct message_queue *
-skynet_globalmq_pop() {
-	struct global_queue *q = Q;
-
+static struct message_queue *
+runqueue_pop(struct global_queue *q) {
 	SPIN_LOCK(q)
 	struct message_queue *mq = q->head;
 	if(mq) {
@@ -99,12 +201,338 @@ skynet_globalmq_pop() {
 			q->tail = NULL;
 		}
 		mq->next = NULL;  // 清除链表指针
+		--q->length;
 	}
 	SPIN_UNLOCK(q)
 
 	return mq;
 }
 
+int
+skynet_globalmq_length(int *local) {
+	if (local) {
+		int i;
+		int n = 0;
+		for (i=0;i<LQ_COUNT;i++) {
+			n += LQ[i].length;
+		}
+		*local = n;
+	}
+	return Q->length;
+}
+
+/*
+ * 将消息队列推入运行队列
+ * 如果该队列最近被某个工作线程处理过，则推回那个线程的本地队列，使其缓存保持热度；
+ * 新创建的服务队列或本地队列已满时，推入全局队列
+ * @param queue: 要推入的消息队列
+ */
+void
+skynet_globalmq_push(struct message_queue * queue) {
+	struct mq_exclusive *e = (struct mq_exclusive *)ATOM_LOAD(&queue->exclusive);
+	if (e) {
+		// 独占队列直接交给它的独占线程，不进入运行队列
+		pthread_mutex_lock(&e->mutex);
+		e->ready = 1;
+		e->ready_time = skynet_monotonic_time();
+		pthread_cond_signal(&e->cond);
+		pthread_mutex_unlock(&e->mutex);
+		return;
+	}
+	int group = ATOM_LOAD(&queue->group);
+	if (group > 0) {
+		runqueue_push(&GROUP[group].q, queue);
+		return;
+	}
+	int owner = queue->owner;
+	if (owner >= 0 && owner < ATOM_LOAD(&LQ_ACTIVE)) {
+		struct global_queue *lq = &LQ[owner];
+		if (lq->length < MAX_LOCAL_MQ) {
+			runqueue_push(lq, queue);
+			return;
+		}
+	}
+	runqueue_push(Q, queue);
+}
+
+/*
+ * 从全局队列弹出一个消息队列
+ * @return: 消息队列指针，如果全局队列为空则返回NULL
+ */
+struct message_queue *
+skynet_globalmq_pop() {
+	return runqueue_pop(Q);
+}
+
+/*
+ * 从其他工作线程的本地队列窃取一个消息队列
+ * 从id的下一个线程开始轮询，跳过长度为0的本地队列以避免无谓的加锁
+ * @param id: 当前工作线程id
+ * @return: 窃取到的消息队列，没有可窃取的则返回NULL
+ */
+static struct message_queue *
+steal_queue(int id) {
+	int i;
+	int node = LQ[id].node;
+	// 先窃取同一NUMA节点的线程，服务的内存和缓存仍在本节点
+	for (i=1;i<LQ_COUNT;i++) {
+		struct global_queue *victim = &LQ[(id + i) % LQ_COUNT];
+		if (victim->node == node && victim->length > 0) {
+			struct message_queue *mq = runqueue_pop(victim);
+			if (mq)
+				return mq;
+		}
+	}
+	for (i=1;i<LQ_COUNT;i++) {
+		struct global_queue *victim = &LQ[(id + i) % LQ_COUNT];
+		if (victim->node != node && victim->length > 0) {
+			struct message_queue *mq = runqueue_pop(victim);
+			if (mq)
+				return mq;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * 设置在用的工作线程数量（见skynet_worker_resize）
+ * 被移除的线程的本地队列由它自己交出（skynet_mq_worker_retire），之后还残留的会被其他线程窃取
+ */
+void
+skynet_mq_worker_count(int n) {
+	ATOM_STORE(&LQ_ACTIVE, n < LQ_COUNT ? n : LQ_COUNT);
+}
+
+/*
+ * 被移除的工作线程把本地队列中的服务队列都移到全局队列
+ */
+void
+skynet_mq_worker_retire(int worker) {
+	if (worker < 0 || worker >= LQ_COUNT)
+		return;
+	struct message_queue *mq;
+	while ((mq = runqueue_pop(&LQ[worker]))) {
+		runqueue_push(Q, mq);
+	}
+}
+
+/*
+ * 设置工作线程所属的NUMA节点，窃取时优先选择同节点的线程
+ * @param worker: 工作线程id
+ * @param node: NUMA节点编号
+ */
+void
+skynet_mq_worker_node(int worker, int node) {
+	if (worker >= 0 && worker < LQ_COUNT) {
+		LQ[worker].node = node;
+	}
+}
+
+/*
+ * 为工作线程选取默认组的下一个待处理的消息队列
+ * 依次尝试：本地队列 -> 全局队列 -> 窃取其他线程的本地队列
+ * 选中的队列会记录当前线程为其owner，之后被重新填充时会推回本线程的本地队列
+ * @param id: 工作线程id
+ * @return: 消息队列指针，没有待处理的队列则返回NULL
+ */
+static struct message_queue *
+default_pop(int id) {
+	struct message_queue *mq = NULL;
+	if (id >= 0 && id < LQ_COUNT) {
+		mq = runqueue_pop(&LQ[id]);
+		if (mq == NULL) {
+			mq = runqueue_pop(Q);
+			if (mq == NULL) {
+				mq = steal_queue(id);
+			}
+		}
+		if (mq) {
+			mq->owner = id;
+		}
+	} else {
+		mq = runqueue_pop(Q);
+	}
+	return mq;
+}
+
+// 组的虚拟时间，空闲过的组落后太多时先追上来
+static unsigned long
+group_vtime(struct sched_group *g) {
+	unsigned long v = ATOM_LOAD(&g->vtime);
+	unsigned long c = ATOM_LOAD(&VCLOCK);
+	if (v + GROUP_LAG < c) {
+		v = c - GROUP_LAG;
+		ATOM_STORE(&g->vtime, v);
+	}
+	return v;
+}
+
+/*
+ * 按加权公平排队选组：默认组和有待处理队列的加权组中虚拟时间最小的优先，
+ * 选中的组没有队列时依次退回到其他组，份额为0的组最后
+ */
+static struct message_queue *
+group_pop(int id) {
+	struct sched_group *best = NULL;
+	unsigned long bv = 0;
+	int i;
+	for (i=1;i<GROUP_COUNT;i++) {
+		struct sched_group *g = &GROUP[i];
+		if (g->share > 0 && g->q.length > 0) {
+			unsigned long v = group_vtime(g);
+			if (best == NULL || v < bv) {
+				best = g;
+				bv = v;
+			}
+		}
+	}
+	struct message_queue *mq;
+	if (best && bv < group_vtime(&GROUP[0])) {
+		mq = runqueue_pop(&best->q);
+		if (mq)
+			return mq;
+	}
+	mq = default_pop(id);
+	if (mq)
+		return mq;
+	// 默认组没有消息，剩下的CPU交给其他组
+	for (i=1;i<GROUP_COUNT;i++) {
+		struct sched_group *g = &GROUP[i];
+		if (g->share > 0 && g->q.length > 0 && (mq = runqueue_pop(&g->q)))
+			return mq;
+	}
+	for (i=1;i<GROUP_COUNT;i++) {
+		struct sched_group *g = &GROUP[i];
+		if (g->share == 0 && g->q.length > 0 && (mq = runqueue_pop(&g->q)))
+			return mq;
+	}
+	return NULL;
+}
+
+/*
+ * 为工作线程选取下一个待处理的消息队列
+ * 没有配置调度组时只有默认组，见default_pop；否则按组的份额选择，见group_pop
+ * @param id: 工作线程id
+ * @return: 消息队列指针，没有待处理的队列则返回NULL
+ */
+struct message_queue *
+skynet_localmq_pop(int id) {
+	if (GROUP_COUNT > 1) {
+		return group_pop(id);
+	}
+	return default_pop(id);
+}
+
+/*
+ * 按配置创建调度组，格式为 "name:share,name:share"，"default:share" 修改默认组的份额（默认100）
+ * @return: 0表示成功，-1表示格式错误
+ */
+int
+skynet_mq_group_init(const char *config) {
+	if (config == NULL)
+		return 0;
+	const char *p = config;
+	while (*p) {
+		while (*p == ',' || *p == ' ')
+			++p;
+		if (*p == '\0')
+			break;
+		const char *colon = strchr(p, ':');
+		if (colon == NULL || colon == p || colon - p >= GROUP_NAME)
+			return -1;
+		char *endptr;
+		long share = strtol(colon + 1, &endptr, 10);
+		if (endptr == colon + 1 || share < 0 || (*endptr && *endptr != ','))
+			return -1;
+		struct sched_group *g;
+		if (colon - p == 7 && memcmp(p, "default", 7) == 0) {
+			if (share == 0)
+				return -1;
+			g = &GROUP[0];
+		} else {
+			if (GROUP_COUNT >= MAX_GROUP)
+				return -1;
+			g = &GROUP[GROUP_COUNT++];
+			memcpy(g->name, p, colon - p);
+			g->name[colon - p] = '\0';
+			SPIN_INIT(&g->q);
+		}
+		g->share = (int)share;
+		p = endptr;
+	}
+	return 0;
+}
+
+/*
+ * 按名称查找调度组
+ * @return: 组的id，找不到返回-1
+ */
+int
+skynet_mq_groupid(const char *name) {
+	int i;
+	for (i=0;i<GROUP_COUNT;i++) {
+		if (strcmp(GROUP[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * 查询调度组的状态
+ * @return: 组的名称，id超出范围返回NULL
+ */
+const char *
+skynet_mq_group_stat(int id, int *share, uint64_t *cpu) {
+	if (id < 0 || id >= GROUP_COUNT)
+		return NULL;
+	struct sched_group *g = &GROUP[id];
+	if (share)
+		*share = g->share;
+	if (cpu)
+		*cpu = ATOM_LOAD(&g->cpu);
+	return g->name;
+}
+
+/*
+ * 把队列移到调度组，下一次被调度时生效
+ * @param group: 组的id，小于0时只查询
+ * @return: 原来所在的组
+ */
+int
+skynet_mq_group(struct message_queue *q, int group) {
+	int last = ATOM_LOAD(&q->group);
+	if (group >= 0 && group < GROUP_COUNT) {
+		ATOM_STORE(&q->group, group);
+	}
+	return last;
+}
+
+// 是否配置了调度组，没有时不需要统计每次分发的消耗
+int
+skynet_mq_grouped(void) {
+	return GROUP_COUNT > 1;
+}
+
+/*
+ * 记录队列所属的组消耗的CPU时间，推进组的虚拟时间
+ * @param usec: 一次分发消耗的CPU时间（微秒）
+ */
+void
+skynet_mq_charge(struct message_queue *q, uint64_t usec) {
+	struct sched_group *g = &GROUP[ATOM_LOAD(&q->group)];
+	ATOM_FADD(&g->cpu, (unsigned long)usec);
+	if (g->share == 0)
+		return;
+	unsigned long delta = (unsigned long)(usec * GROUP_SHARE / g->share);
+	unsigned long v = ATOM_FADD(&g->vtime, delta) + delta;
+	unsigned long c = ATOM_LOAD(&VCLOCK);
+	while (v > c) {
+		if (ATOM_CAS_ULONG(&VCLOCK, c, v))
+			break;
+		c = ATOM_LOAD(&VCLOCK);
+	}
+}
+
 /*
  * 创建新的消息队列
  * 为指定handle的服务创建消息队列
@@ -115,7 +543,7 @@ struct message_queue *
 skynet_mq_create(uint32_t handle) {
 	struct message_queue *q = skynet_malloc(sizeof(*q));
 	q->handle = handle;                                    // 设置所属服务handle
-	q->cap = DEFAULT_QUEUE_SIZE;                           // 设置初始容量
+	q->cap = 0;                                            // 消息数组在第一次推入时才分配
 	q->head = 0;                                           // 初始化头部索引
 	q->tail = 0;                                           // 初始化尾部索引
 	SPIN_INIT(q)                                           // 初始化自旋锁
@@ -125,12 +553,27 @@ skynet_mq_create(uint32_t handle) {
 	// 队列创建时（总是在服务创建和服务初始化之间），
 	// 设置in_global标志避免将其推入全局队列
 	// 如果服务初始化成功，skynet_context_new会调用skynet_mq_push将其推入全局队列
-	q->in_global = MQ_IN_GLOBAL;
+	ATOM_INIT(&q->in_global, MQ_IN_GLOBAL);
 	q->release = 0;                                        // 释放标志
 	q->overload = 0;                                       // 过载计数
 	q->overload_threshold = MQ_OVERLOAD;                   // 过载阈值
-	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap);  // 分配消息数组
+	q->queue = NULL;                                       // 收不到消息的服务不占用消息数组
 	q->next = NULL;                                        // 链表指针
+	q->owner = -1;                                         // 尚未被任何工作线程处理
+	ATOM_INIT(&q->ring, (uintptr_t)NULL);                  // 默认使用加锁模式
+	ATOM_INIT(&q->pending, 0);
+	ATOM_INIT(&q->exclusive, (uintptr_t)NULL);
+	ATOM_INIT(&q->priority, 0);
+	ATOM_INIT(&q->hlength, 0);
+	q->hcap = 0;
+	q->hhead = 0;
+	q->htail = 0;
+	q->hstreak = 0;
+	q->hqueue = NULL;
+	ATOM_INIT(&q->limit, LIMIT);
+	ATOM_INIT(&q->dropped, 0);
+	ATOM_INIT(&q->stamp, 0);
+	ATOM_INIT(&q->group, 0);
 
 	return q;
 }
@@ -143,7 +586,15 @@ static void
 _release(struct message_queue *q) {
 	assert(q->next == NULL);  // 确保队列不在链表中
 	SPIN_DESTROY(q)           // 销毁自旋锁
+	skynet_free((void *)ATOM_LOAD(&q->ring));  // 释放无锁环形缓冲区
+	struct mq_exclusive *e = (struct mq_exclusive *)ATOM_LOAD(&q->exclusive);
+	if (e) {
+		pthread_mutex_destroy(&e->mutex);
+		pthread_cond_destroy(&e->cond);
+		skynet_free(e);
+	}
 	skynet_free(q->queue);    // 释放消息数组
+	skynet_free(q->hqueue);   // 释放高优先级通道
 	skynet_free(q);           // 释放队列结构体
 }
 
@@ -165,6 +616,12 @@ skynet_mq_handle(struct message_queue *q) {
  */
 int
 skynet_mq_length(struct message_queue *q) {
+	int hlength = ATOM_LOAD(&q->hlength);
+	struct mq_ring *r = (struct mq_ring *)ATOM_LOAD(&q->ring);
+	if (r) {
+		// 无锁模式：环形缓冲区长度加上溢出数组长度，无需加锁
+		return (int)(ATOM_LOAD(&r->tail) - r->head) + ATOM_LOAD(&q->pending) + hlength;
+	}
 	int head, tail,cap;
 
 	SPIN_LOCK(q)
@@ -175,10 +632,10 @@ skynet_mq_length(struct message_queue *q) {
 
 	if (head <= tail) {
 		// 正常情况：尾部在头部之后
-		return tail - head;
+		return tail - head + hlength;
 	}
 	// 环形队列回绕情况
-	return tail + cap - head;
+	return tail + cap - head + hlength;
 }
 
 /*
@@ -197,6 +654,222 @@ skynet_mq_overload(struct message_queue *q) {
 	return 0;
 }
 
+/*
+ * 向环形缓冲区写入一条消息（多生产者）
+ * @return: 1表示成功，0表示缓冲区已满
+ */
+static int
+ring_push(struct mq_ring *r, struct skynet_message *message) {
+	size_t pos = ATOM_LOAD(&r->tail);
+	struct mq_slot *slot;
+	for (;;) {
+		slot = &r->slot[pos & r->mask];
+		size_t seq = ATOM_LOAD(&slot->seq);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			// 槽位可写，争夺该写入位置
+			if (ATOM_CAS_SIZET(&r->tail, pos, pos + 1))
+				break;
+			pos = ATOM_LOAD(&r->tail);
+		} else if (dif < 0) {
+			// 槽位尚未被消费者读走，缓冲区已满
+			return 0;
+		} else {
+			// 其他生产者已经占用了该位置
+			pos = ATOM_LOAD(&r->tail);
+		}
+	}
+	slot->msg = *message;
+	ATOM_STORE(&slot->seq, pos + 1);   // 发布消息
+	return 1;
+}
+
+/*
+ * 检查环形缓冲区头部是否有已发布的消息（仅消费者调用）
+ */
+static inline int
+ring_ready(struct mq_ring *r) {
+	struct mq_slot *slot = &r->slot[r->head & r->mask];
+	return ATOM_LOAD(&slot->seq) == r->head + 1;
+}
+
+/*
+ * 从环形缓冲区读取一条消息（单消费者）
+ * @return: 1表示成功，0表示缓冲区为空
+ */
+static int
+ring_pop(struct mq_ring *r, struct skynet_message *message) {
+	size_t pos = r->head;
+	struct mq_slot *slot = &r->slot[pos & r->mask];
+	if (ATOM_LOAD(&slot->seq) != pos + 1)
+		return 0;
+	*message = slot->msg;
+	ATOM_STORE(&slot->seq, pos + r->mask + 1);   // 释放槽位给下一轮写入
+	r->head = pos + 1;
+	return 1;
+}
+
+/*
+ * 收缩消息数组容量，调用者需持有q->lock
+ * 长度低于容量的1/4时容量减半，队列为空时直接恢复默认容量。
+ * 扩容发生在数组满时，两者之间留有滞后区间，避免长度在临界值附近波动时反复扩缩。
+ * @param length: 当前数组中的消息数量
+ */
+static void
+shrink_queue(struct message_queue *q, int length) {
+	if (q->cap <= DEFAULT_QUEUE_SIZE || length >= q->cap / 4)
+		return;
+	int cap = length == 0 ? DEFAULT_QUEUE_SIZE : q->cap / 2;
+	struct skynet_message *new_queue = skynet_malloc(sizeof(struct skynet_message) * cap);
+	int i;
+	for (i=0;i<length;i++) {
+		new_queue[i] = q->queue[(q->head + i) % q->cap];
+	}
+	q->head = 0;
+	q->tail = length;
+	q->cap = cap;
+	skynet_free(q->queue);
+	q->queue = new_queue;
+}
+
+/*
+ * 从加锁数组中弹出一条消息，调用者需持有q->lock
+ */
+static int
+array_pop(struct message_queue *q, struct skynet_message *message) {
+	if (q->head == q->tail)
+		return 0;
+	*message = q->queue[q->head++];
+	if (q->head >= q->cap) {
+		q->head = 0;
+	}
+	int length = q->tail - q->head;
+	if (length < 0) {
+		length += q->cap;
+	}
+	shrink_queue(q, length);
+	return 1;
+}
+
+/*
+ * 判断消息是否走高优先级通道：响应、错误和系统消息
+ */
+static inline int
+is_priority(struct skynet_message *message) {
+	int type = (int)(message->sz >> MESSAGE_TYPE_SHIFT);
+	return type == PTYPE_RESPONSE || type == PTYPE_ERROR || type == PTYPE_SYSTEM;
+}
+
+/*
+ * 从高优先级通道弹出一条消息，调用者需持有q->lock
+ */
+static int
+high_pop(struct message_queue *q, struct skynet_message *message) {
+	if (q->hhead == q->htail)
+		return 0;
+	*message = q->hqueue[q->hhead++];
+	if (q->hhead >= q->hcap) {
+		q->hhead = 0;
+	}
+	ATOM_FDEC(&q->hlength);
+	return 1;
+}
+
+/*
+ * 向高优先级通道推入一条消息，调用者需持有q->lock
+ * 通道数组在第一次使用时分配，满时容量翻倍
+ */
+static void
+high_push(struct message_queue *q, struct skynet_message *message) {
+	if (q->hqueue == NULL) {
+		q->hcap = DEFAULT_QUEUE_SIZE;
+		q->hqueue = skynet_malloc(sizeof(struct skynet_message) * q->hcap);
+	}
+	q->hqueue[q->htail] = *message;
+	if (++ q->htail >= q->hcap) {
+		q->htail = 0;
+	}
+	if (q->hhead == q->htail) {
+		struct skynet_message *new_queue = skynet_malloc(sizeof(struct skynet_message) * q->hcap * 2);
+		int i;
+		for (i=0;i<q->hcap;i++) {
+			new_queue[i] = q->hqueue[(q->hhead + i) % q->hcap];
+		}
+		q->hhead = 0;
+		q->htail = q->hcap;
+		q->hcap *= 2;
+		skynet_free(q->hqueue);
+		q->hqueue = new_queue;
+	}
+	ATOM_FINC(&q->hlength);
+}
+
+/*
+ * 优先弹出高优先级通道中的消息
+ * 连续弹出MQ_PRIORITY_STREAK条后让普通通道处理一条，避免普通消息饿死
+ * @return: 1表示已弹出
+ */
+static int
+priority_pop(struct message_queue *q, struct skynet_message *message) {
+	if (ATOM_LOAD(&q->hlength) > 0 && q->hstreak < MQ_PRIORITY_STREAK) {
+		int ok;
+		SPIN_LOCK(q)
+		ok = high_pop(q, message);
+		SPIN_UNLOCK(q)
+		if (ok) {
+			++q->hstreak;
+			return 1;
+		}
+	}
+	q->hstreak = 0;
+	return 0;
+}
+
+/*
+ * 无锁模式下弹出一条消息
+ * 先读环形缓冲区，为空时再读溢出数组，从而保证同一生产者的消息顺序。
+ * 队列为空时先清除in_global再重新检查，避免与生产者的CAS产生丢失唤醒。
+ */
+static int
+lockfree_pop(struct message_queue *q, struct mq_ring *r, struct skynet_message *message) {
+	for (;;) {
+		if (ring_pop(r, message))
+			break;
+		if (ATOM_LOAD(&q->pending) > 0 || ATOM_LOAD(&q->hlength) > 0) {
+			int ok;
+			SPIN_LOCK(q)
+			ok = array_pop(q, message);
+			if (ok) {
+				ATOM_FDEC(&q->pending);
+			} else {
+				// 普通通道已空，处理被饥饿保护跳过的高优先级消息
+				ok = high_pop(q, message);
+			}
+			SPIN_UNLOCK(q)
+			if (ok)
+				break;
+		}
+		// reset overload_threshold when queue is empty
+		q->overload_threshold = MQ_OVERLOAD;
+		ATOM_STORE(&q->in_global, 0);
+		if (!ring_ready(r) && ATOM_LOAD(&q->pending) == 0 && ATOM_LOAD(&q->hlength) == 0) {
+			return 1;
+		}
+		// 清除标志期间有新消息到达，重新获得调度权后继续弹出；
+		// 如果生产者已经抢先把队列推入了全局队列，则交给下一个工作线程处理
+		if (!mq_schedule(q)) {
+			return 1;
+		}
+	}
+
+	int length = skynet_mq_length(q);
+	while (length > q->overload_threshold) {
+		q->overload = length;
+		q->overload_threshold *= 2;
+	}
+	return 0;
+}
+
 /*
  * 从消息队列弹出一条消息
  * @param q: 消息队列
@@ -205,6 +878,13 @@ skynet_mq_overload(struct message_queue *q) {
  */
 int
 skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
+	if (ATOM_LOAD(&q->priority) && priority_pop(q, message)) {
+		return 0;
+	}
+	struct mq_ring *r = (struct mq_ring *)ATOM_LOAD(&q->ring);
+	if (r) {
+		return lockfree_pop(q, r, message);
+	}
 	int ret = 1;  // 默认返回1（队列为空）
 	SPIN_LOCK(q)
 
@@ -232,15 +912,20 @@ skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
 			q->overload = length;
 			q->overload_threshold *= 2;
 		}
+		shrink_queue(q, length);
+	} else if (high_pop(q, message)) {
+		// 普通通道已空，处理被饥饿保护跳过的高优先级消息
+		ret = 0;
 	} else {
 		// reset overload_threshold when queue is empty
 		// 队列为空时重置过载阈值
 		q->overload_threshold = MQ_OVERLOAD;
+		shrink_queue(q, 0);
 	}
 
 	if (ret) {
 		// 队列为空，标记不在全局队列中
-		q->in_global = 0;
+		ATOM_STORE(&q->in_global, 0);
 	}
 	
 	SPIN_UNLOCK(q)
@@ -248,6 +933,80 @@ skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
 	return ret;
 }
 
+/*
+ * 在已持有调度权的前提下再取一条消息，队列为空时不清除in_global
+ * 弹出顺序与skynet_mq_pop一致
+ * @return: 1表示已弹出，0表示暂无消息
+ */
+static int
+mq_trypop(struct message_queue *q, struct mq_ring *r, struct skynet_message *message) {
+	int ok;
+	if (ATOM_LOAD(&q->priority) && priority_pop(q, message)) {
+		return 1;
+	}
+	if (r && ring_pop(r, message)) {
+		return 1;
+	}
+	SPIN_LOCK(q)
+	ok = array_pop(q, message);
+	if (ok) {
+		if (r) {
+			ATOM_FDEC(&q->pending);
+		}
+	} else {
+		ok = high_pop(q, message);
+	}
+	SPIN_UNLOCK(q)
+	return ok;
+}
+
+/*
+ * 批量弹出消息，最多弹出n条
+ * 普通模式下只加一次锁就复制出一批消息；无锁或优先级模式下第一条经由skynet_mq_pop弹出，
+ * 其余消息逐条读取。只有一条都没有弹出时才会清除in_global，语义与skynet_mq_pop相同。
+ * @param msgs: 输出数组，容量不小于n
+ * @return: 实际弹出的消息数量，0表示队列为空
+ */
+int
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *msgs, int n) {
+	struct mq_ring *r = (struct mq_ring *)ATOM_LOAD(&q->ring);
+	int i = 0;
+	if (r || ATOM_LOAD(&q->priority)) {
+		if (n <= 0 || skynet_mq_pop(q, &msgs[0]))
+			return 0;
+		for (i=1;i<n;i++) {
+			if (!mq_trypop(q, r, &msgs[i]))
+				break;
+		}
+		return i;
+	}
+
+	SPIN_LOCK(q)
+	while (i < n && array_pop(q, &msgs[i])) {
+		++i;
+	}
+	while (i < n && high_pop(q, &msgs[i])) {
+		++i;
+	}
+	if (i > 0) {
+		int length = q->tail - q->head;
+		if (length < 0) {
+			length += q->cap;
+		}
+		while (length > q->overload_threshold) {
+			q->overload = length;
+			q->overload_threshold *= 2;
+		}
+	} else {
+		q->overload_threshold = MQ_OVERLOAD;
+		shrink_queue(q, 0);
+		ATOM_STORE(&q->in_global, 0);
+	}
+	SPIN_UNLOCK(q)
+
+	return i;
+}
+
 /*
  * 扩展消息队列容量
  * 当队列满时，将容量扩大一倍
@@ -278,8 +1037,33 @@ expand_queue(struct message_queue *q) {
 void
 skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	assert(message);
+	SKYNET_PROBE4(mq__push, q->handle, message->source, message->session, message->sz);
+	message->stamp = ATOM_LOAD(&q->stamp) ? skynet_monotonic_time() : 0;
+	struct mq_ring *r = (struct mq_ring *)ATOM_LOAD(&q->ring);
+	// 无锁模式下，溢出数组为空时直接写入环形缓冲区；
+	// 溢出数组不为空时必须排在其后，否则同一生产者的消息可能乱序
+	if (ATOM_LOAD(&q->priority) && is_priority(message)) {
+		// 响应和系统消息进入高优先级通道，不必排在大量普通消息之后
+		SPIN_LOCK(q)
+		high_push(q, message);
+		if (mq_schedule(q)) {
+			skynet_globalmq_push(q);
+		}
+		SPIN_UNLOCK(q)
+		return;
+	}
+	if (r && ATOM_LOAD(&q->pending) == 0 && ring_push(r, message)) {
+		if (mq_schedule(q)) {
+			skynet_globalmq_push(q);
+		}
+		return;
+	}
 	SPIN_LOCK(q)
 
+	if (q->queue == NULL) {
+		q->cap = INIT_QUEUE_SIZE;
+		q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap);
+	}
 	// 将消息放入队列尾部
 	q->queue[q->tail] = *message;
 	if (++ q->tail >= q->cap) {
@@ -291,21 +1075,247 @@ skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 		expand_queue(q);
 	}
 
+	if (ATOM_LOAD(&q->ring)) {
+		// 无锁模式下，该数组作为环形缓冲区满时的溢出链
+		ATOM_FINC(&q->pending);
+	}
+
 	// 如果队列不在全局队列中，则将其加入全局队列
-	if (q->in_global == 0) {
-		q->in_global = MQ_IN_GLOBAL;
+	if (mq_schedule(q)) {
 		skynet_globalmq_push(q);
 	}
 	
 	SPIN_UNLOCK(q)
 }
 
+/*
+ * 为消息队列开启无锁多生产者单消费者模式
+ * 开启后发送方通过CAS写入有界环形缓冲区，不再争夺q->lock；
+ * 缓冲区满时退回原有的加锁数组（由expand_queue扩容）作为溢出链。
+ * 应由队列所属服务自身调用（即唯一的消费者），开启后不可关闭。
+ * @param q: 消息队列
+ * @param size: 环形缓冲区容量，向上取整为2的幂，<=0时使用默认值
+ * @return: 实际容量，已处于无锁模式时返回0
+ */
+int
+skynet_mq_ring(struct message_queue *q, int size) {
+	if (ATOM_LOAD(&q->ring))
+		return 0;
+	if (size <= 0)
+		size = MQ_RING_DEFAULT;
+	size_t cap = 2;
+	while (cap < (size_t)size)
+		cap *= 2;
+	struct mq_ring *r = skynet_malloc(sizeof(*r) + sizeof(struct mq_slot) * (cap - 1));
+	size_t i;
+	for (i=0;i<cap;i++) {
+		ATOM_INIT(&r->slot[i].seq, i);
+	}
+	r->mask = cap - 1;
+	ATOM_INIT(&r->tail, 0);
+	r->head = 0;
+
+	SPIN_LOCK(q)
+	// 已经在加锁数组中的消息视为溢出消息，保证其先于环形缓冲区中的消息被处理
+	int length = q->tail - q->head;
+	if (length < 0)
+		length += q->cap;
+	ATOM_STORE(&q->pending, length);
+	ATOM_STORE(&q->ring, (uintptr_t)r);
+	SPIN_UNLOCK(q)
+
+	return (int)cap;
+}
+
+/*
+ * 为消息队列开启优先级通道
+ * 开启后响应（PTYPE_RESPONSE）、错误（PTYPE_ERROR）和系统消息（PTYPE_SYSTEM）进入高优先级通道，
+ * skynet_mq_pop优先处理它们，使等待skynet.call的协程更快恢复。
+ * 注意：开启后这些消息可能越过同一来源更早发出的普通消息。
+ * @param q: 消息队列
+ */
+void
+skynet_mq_priority(struct message_queue *q) {
+	ATOM_STORE(&q->priority, 1);
+}
+
+/*
+ * 将消息队列设为独占模式
+ * 之后该队列被调度时不再进入运行队列，而是唤醒调用skynet_mq_exclusive_wait的独占线程。
+ * 应由队列当前的调度者（正在处理该服务消息的线程）调用，
+ * 调用者处理完当前批次后需要再调用skynet_globalmq_push把队列交给独占线程。
+ * @param q: 消息队列
+ * @return: 0表示成功，-1表示已经是独占模式
+ */
+int
+skynet_mq_exclusive(struct message_queue *q) {
+	if (ATOM_LOAD(&q->exclusive))
+		return -1;
+	struct mq_exclusive *e = skynet_malloc(sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	pthread_mutex_init(&e->mutex, NULL);
+	pthread_cond_init(&e->cond, NULL);
+	ATOM_STORE(&q->exclusive, (uintptr_t)e);
+	return 0;
+}
+
+/*
+ * 检查消息队列是否为独占模式
+ */
+int
+skynet_mq_isexclusive(struct message_queue *q) {
+	return ATOM_LOAD(&q->exclusive) != 0;
+}
+
+/*
+ * 独占线程等待队列被调度
+ * 返回后调用者获得该队列的处理权，直到skynet_mq_pop返回队列为空
+ * @param q: 独占模式的消息队列
+ */
+void
+skynet_mq_exclusive_wait(struct message_queue *q) {
+	struct mq_exclusive *e = (struct mq_exclusive *)ATOM_LOAD(&q->exclusive);
+	assert(e);
+	pthread_mutex_lock(&e->mutex);
+	while (!e->ready) {
+		pthread_cond_wait(&e->cond, &e->mutex);
+	}
+	e->ready = 0;
+	uint64_t now = skynet_monotonic_time();
+	++e->wakeup;
+	if (now > e->ready_time) {
+		e->wait += now - e->ready_time;
+	}
+	pthread_mutex_unlock(&e->mutex);
+}
+
+/*
+ * 获取独占队列的调度统计
+ * @param q: 消息队列
+ * @param wakeup: 输出被调度次数
+ * @param wait: 输出从被调度到开始处理的累计等待时间（纳秒）
+ * @return: 0表示成功，-1表示不是独占模式
+ */
+int
+skynet_mq_exclusive_stat(struct message_queue *q, uint64_t *wakeup, uint64_t *wait) {
+	struct mq_exclusive *e = (struct mq_exclusive *)ATOM_LOAD(&q->exclusive);
+	if (e == NULL)
+		return -1;
+	pthread_mutex_lock(&e->mutex);
+	*wakeup = e->wakeup;
+	*wait = e->wait;
+	pthread_mutex_unlock(&e->mutex);
+	return 0;
+}
+
+/*
+ * 设置队列的背压阈值
+ * 队列长度达到阈值后，skynet_mq_full对普通消息返回1，由发送方拒绝这些消息
+ * @param limit: 阈值，0表示不限制；小于0时只查询不修改
+ * @return: 设置前的阈值
+ */
+int
+skynet_mq_limit(struct message_queue *q, int limit) {
+	if (limit < 0)
+		return ATOM_LOAD(&q->limit);
+	int last = ATOM_LOAD(&q->limit);
+	ATOM_STORE(&q->limit, limit);
+	return last;
+}
+
+/*
+ * 检查队列是否因背压拒绝该消息
+ * 响应、错误和系统消息总是被接受，否则等待响应的协程会永远挂起
+ * @return: 1表示应拒绝（同时累加拒绝计数），0表示可以投递
+ */
+int
+skynet_mq_full(struct message_queue *q, struct skynet_message *message) {
+	int limit = ATOM_LOAD(&q->limit);
+	if (limit <= 0 || is_priority(message))
+		return 0;
+	if (skynet_mq_length(q) < limit)
+		return 0;
+	ATOM_FINC(&q->dropped);
+	return 1;
+}
+
+// 获取因背压被拒绝的消息数量
+int
+skynet_mq_dropped(struct message_queue *q) {
+	return ATOM_LOAD(&q->dropped);
+}
+
+int
+skynet_mq_stamp(struct message_queue *q, int on) {
+	int last = ATOM_LOAD(&q->stamp);
+	ATOM_STORE(&q->stamp, on);
+	return last;
+}
+
+/*
+ * 取得一个空闲队列的调度权，用于在发送方的线程中直接处理一条消息（见skynet_send的内联调用）
+ * 只接受默认调度组中加锁模式、非独占、未释放且为空（没有被任何线程调度）的队列；
+ * 成功后in_global被置位，期间到达的消息只入队不调度，由skynet_mq_unclaim交出
+ * @return: 1表示成功
+ */
+int
+skynet_mq_claim(struct message_queue *q) {
+	if (ATOM_LOAD(&q->ring) || ATOM_LOAD(&q->exclusive) || ATOM_LOAD(&q->in_global) || ATOM_LOAD(&q->group))
+		return 0;
+	int ok = 0;
+	SPIN_LOCK(q)
+	if (!q->release && q->head == q->tail && ATOM_LOAD(&q->hlength) == 0) {
+		ok = ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL);
+	}
+	SPIN_UNLOCK(q)
+	return ok;
+}
+
+/*
+ * 交出skynet_mq_claim取得的调度权
+ * 期间有新消息、服务退出或者切换了无锁/独占模式时，把队列推入运行队列交给工作线程
+ */
+void
+skynet_mq_unclaim(struct message_queue *q) {
+	SPIN_LOCK(q)
+	if (q->head == q->tail && ATOM_LOAD(&q->hlength) == 0 && !q->release
+		&& !ATOM_LOAD(&q->ring) && !ATOM_LOAD(&q->exclusive)) {
+		ATOM_STORE(&q->in_global, 0);
+		SPIN_UNLOCK(q)
+		return;
+	}
+	SPIN_UNLOCK(q)
+	skynet_globalmq_push(q);
+}
+
+/*
+ * 初始化全局消息队列和每个工作线程的本地运行队列
+ * @param worker: 工作线程数量的上限
+ * @param limit: 新建队列的默认背压阈值，0表示不限制
+ */
 void 
-skynet_mq_init() {
+skynet_mq_init(int worker, int limit) {
+	LIMIT = limit;
+	strcpy(GROUP[0].name, "default");
+	GROUP[0].share = GROUP_SHARE;
+	ATOM_INIT(&GROUP[0].vtime, 0);
+	ATOM_INIT(&GROUP[0].cpu, 0);
+	ATOM_INIT(&VCLOCK, 0);
 	struct global_queue *q = skynet_malloc(sizeof(*q));
 	memset(q,0,sizeof(*q));
 	SPIN_INIT(q);
 	Q=q;
+
+	if (worker > 0) {
+		int i;
+		LQ = skynet_malloc(sizeof(struct global_queue) * worker);
+		memset(LQ, 0, sizeof(struct global_queue) * worker);
+		for (i=0;i<worker;i++) {
+			SPIN_INIT(&LQ[i]);
+		}
+		LQ_COUNT = worker;
+	}
+	ATOM_INIT(&LQ_ACTIVE, LQ_COUNT);
 }
 
 void 
@@ -313,7 +1323,7 @@ skynet_mq_mark_release(struct message_queue *q) {
 	SPIN_LOCK(q)
 	assert(q->release == 0);
 	q->release = 1;
-	if (q->in_global != MQ_IN_GLOBAL) {
+	if (mq_schedule(q)) {
 		skynet_globalmq_push(q);
 	}
 	SPIN_UNLOCK(q)
@@ -330,6 +1340,11 @@ _drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
 
 void 
 skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
+	if (ATOM_LOAD(&q->exclusive)) {
+		// 独占队列只能由它的独占线程释放，这里只负责唤醒它
+		skynet_globalmq_push(q);
+		return;
+	}
 	SPIN_LOCK(q)
 	
 	if (q->release) {
@@ -340,3 +1355,19 @@ skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
 		SPIN_UNLOCK(q)
 	}
 }
+
+/*
+ * 独占线程释放消息队列
+ * @return: 1表示队列已被释放（之后不能再访问q），0表示服务尚未释放上下文
+ */
+int
+skynet_mq_exclusive_release(struct message_queue *q, message_drop drop_func, void *ud) {
+	SPIN_LOCK(q)
+	if (q->release) {
+		SPIN_UNLOCK(q)
+		_drop_queue(q, drop_func, ud);
+		return 1;
+	}
+	SPIN_UNLOCK(q)
+	return 0;
+}
@@ -18,6 +18,8 @@ struct skynet_message {
 	int session;      // 会话ID
 	void * data;      // 消息数据指针
 	size_t sz;        // 消息大小（高8位编码消息类型）
+	uint64_t stamp;   // 入队时的单调时钟（纳秒），只在开启了时间戳的队列中设置，否则为0
+	uint64_t deadline; // 过期时间（单调时钟纳秒），过期的消息在分发前被丢弃，0表示不过期，见skynet_send
 };
 
 // type is encoding in skynet_message.sz high 8bit
@@ -26,6 +28,10 @@ struct skynet_message {
 #define MESSAGE_TYPE_MASK (SIZE_MAX >> 8)
 // 消息类型位移
 #define MESSAGE_TYPE_SHIFT ((sizeof(size_t)-1) * 8)
+// 大小的最高位标记共享消息：data指向多个接收者共用、按引用计数释放的负载（见skynet_sendmulti）
+#define MESSAGE_SHARED ((size_t)1 << (MESSAGE_TYPE_SHIFT - 1))
+// 消息大小的上限掩码（不含共享标记）
+#define MESSAGE_SIZE_MASK (MESSAGE_TYPE_MASK >> 1)
 
 // 前向声明
 struct message_queue;
@@ -40,6 +46,21 @@ void skynet_globalmq_push(struct message_queue * queue);
 // 从全局队列弹出消息队列
 struct message_queue * skynet_globalmq_pop(void);
 
+// 全局队列中等待调度的服务队列数量，local为所有工作线程本地队列中的数量（参考值）
+int skynet_globalmq_length(int *local);
+
+// 为工作线程取下一个消息队列（本地队列 -> 全局队列 -> 窃取）
+struct message_queue * skynet_localmq_pop(int worker);
+
+// 设置工作线程所属的NUMA节点
+void skynet_mq_worker_node(int worker, int node);
+
+// 设置在用的工作线程数量，被移除的线程不再接收推回本地队列的服务
+void skynet_mq_worker_count(int n);
+
+// 被移除的工作线程把本地队列交给全局队列
+void skynet_mq_worker_retire(int worker);
+
 /*
  * 消息队列生命周期管理
  */
@@ -67,9 +88,41 @@ uint32_t skynet_mq_handle(struct message_queue *);
 // 从消息队列弹出消息（成功返回0）
 int skynet_mq_pop(struct message_queue *q, struct skynet_message *message);
 
+// 批量弹出最多n条消息，返回实际数量，0表示队列为空
+int skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *msgs, int n);
+
 // 向消息队列推入消息
 void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
 
+// 开启无锁多生产者单消费者模式，返回环形缓冲区容量（已开启时返回0）
+int skynet_mq_ring(struct message_queue *q, int size);
+
+// 开启优先级通道：响应、错误和系统消息优先于普通消息被处理
+void skynet_mq_priority(struct message_queue *q);
+
+// 取得空闲队列的调度权（成功返回1），用于在发送方线程中直接处理消息
+int skynet_mq_claim(struct message_queue *q);
+// 交出skynet_mq_claim取得的调度权，期间有新消息时推入运行队列
+void skynet_mq_unclaim(struct message_queue *q);
+/*
+ * 独占工作线程
+ */
+
+// 将消息队列设为独占模式（成功返回0）
+int skynet_mq_exclusive(struct message_queue *q);
+
+// 检查消息队列是否为独占模式
+int skynet_mq_isexclusive(struct message_queue *q);
+
+// 独占线程等待队列被调度
+void skynet_mq_exclusive_wait(struct message_queue *q);
+
+// 获取独占队列的调度统计（不是独占模式时返回-1）
+int skynet_mq_exclusive_stat(struct message_queue *q, uint64_t *wakeup, uint64_t *wait);
+
+// 独占线程释放消息队列（已释放返回1）
+int skynet_mq_exclusive_release(struct message_queue *q, message_drop drop_func, void *ud);
+
 /*
  * 消息队列状态查询（用于调试）
  */
@@ -81,9 +134,43 @@ int skynet_mq_length(struct message_queue *q);
 // 检查消息队列是否过载
 int skynet_mq_overload(struct message_queue *q);
 
+/*
+ * 背压控制
+ */
+
+// 设置背压阈值（0表示不限制，小于0只查询），返回原阈值
+int skynet_mq_limit(struct message_queue *q, int limit);
+
+// 队列超过背压阈值且消息不是响应、错误或系统消息时返回1
+int skynet_mq_full(struct message_queue *q, struct skynet_message *message);
+
+// 因背压被拒绝的消息数量
+int skynet_mq_dropped(struct message_queue *q);
+
+// 开启或关闭入队时间戳（用于统计排队时间），返回原来的状态
+int skynet_mq_stamp(struct message_queue *q, int on);
+
+/*
+ * 调度组：工作线程按组的份额（加权公平排队）选择待处理的服务队列，见skynet_mq.c
+ */
+// 按配置 "name:share,name:share" 创建调度组（成功返回0）
+int skynet_mq_group_init(const char *config);
+// 按名称查找调度组，返回组的id，找不到返回-1
+int skynet_mq_groupid(const char *name);
+// 查询调度组的份额和累计消耗的CPU时间（微秒），返回组的名称，id超出范围返回NULL
+const char * skynet_mq_group_stat(int id, int *share, uint64_t *cpu);
+// 把队列移到调度组（group小于0时只查询），返回原来的组
+int skynet_mq_group(struct message_queue *q, int group);
+// 是否配置了调度组
+int skynet_mq_grouped(void);
+// 记录一次分发消耗的CPU时间（微秒）
+void skynet_mq_charge(struct message_queue *q, uint64_t usec);
+
 /*
  * 消息队列系统初始化
+ * @param worker: 工作线程数量的上限，每个工作线程拥有一个本地运行队列
+ * @param limit: 新建队列的默认背压阈值，0表示不限制
  */
-void skynet_mq_init();
+void skynet_mq_init(int worker, int limit);
 
 #endif
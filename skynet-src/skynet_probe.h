@@ -0,0 +1,44 @@
+/*
+ * skynet_probe.h - 静态跟踪点（USDT）
+ * 有<sys/sdt.h>（systemtap-sdt-dev）时自动开启，每个跟踪点只是一条nop指令，没有挂上bpftrace时几乎没有开销；
+ * 编译时加-DNOUSE_SDT关闭。用法见examples/bpftrace，列出所有跟踪点：bpftrace -l 'usdt:./skynet:*'
+ *
+ * 跟踪点（provider为skynet）：
+ *   dispatch__begin(handle, source, type, session, sz)   服务开始处理一条消息，批量处理时type为负的消息数量
+ *   dispatch__end(handle, type, session)                 处理完毕
+ *   mq__push(handle, source, session, sz)                消息进入服务的消息队列，sz的高8位是消息类型
+ *   send(source, destination, type, session, sz)         skynet_send
+ *   timer__add(handle, session, time)                    添加定时器，time为延迟的滴答数
+ *   timer__dispatch(handle, count)                       定时器到期，向服务发出count条超时消息
+ *   socket__event(shard, type, id, ud)                   socket线程向服务转发一个事件，type见socket_server.h
+ *   socket__read(id, n, size)                            从tcp连接读到n字节，size为读缓冲区大小
+ *   lalloc(ptr, osize, nsize)                            Lua虚拟机的内存分配
+ */
+
+#ifndef SKYNET_PROBE_H
+#define SKYNET_PROBE_H
+
+#if !defined(NOUSE_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SKYNET_PROBE_ENABLE
+#endif
+#endif
+
+#ifdef SKYNET_PROBE_ENABLE
+
+#define SKYNET_PROBE2(name, a, b) DTRACE_PROBE2(skynet, name, a, b)
+#define SKYNET_PROBE3(name, a, b, c) DTRACE_PROBE3(skynet, name, a, b, c)
+#define SKYNET_PROBE4(name, a, b, c, d) DTRACE_PROBE4(skynet, name, a, b, c, d)
+#define SKYNET_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(skynet, name, a, b, c, d, e)
+
+#else
+
+#define SKYNET_PROBE2(name, a, b) ((void)0)
+#define SKYNET_PROBE3(name, a, b, c) ((void)0)
+#define SKYNET_PROBE4(name, a, b, c, d) ((void)0)
+#define SKYNET_PROBE5(name, a, b, c, d, e) ((void)0)
+
+#endif
+
+#endif
@@ -15,16 +15,23 @@
 #include "skynet_monitor.h"
 #include "skynet_imp.h"
 #include "skynet_log.h"
+#include "skynet_journal.h"
+#include "skynet_trace.h"
+#include "skynet_probe.h"
+#include "skynet_histogram.h"
 #include "spinlock.h"
 #include "atomic.h"
 
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <inttypes.h>
 
 // 调用检查相关宏定义，用于调试模式下检测重入调用
 #ifdef CALLING_CHECK
@@ -45,9 +52,38 @@
 
 #endif
 
+#define NAME_CACHE_SIZE 4   // 每个服务缓存的名称查找结果数量
+
+/*
+ * 名称查找缓存，只由处理该服务的线程访问
+ * version与skynet_handle_nameversion不一致时说明有名称被删除，缓存失效
+ */
+struct name_cache {
+	int version;
+	uint32_t handle;                    // 0表示空
+	char name[GLOBALNAME_LENGTH];
+};
+
+/*
+ * 服务的延迟统计，开启后每条消息记录一次
+ */
+struct skynet_latency {
+	struct skynet_histogram wait;       // 消息从入队到开始处理的时间（纳秒）
+	struct skynet_histogram cost;       // 处理消息的时间（纳秒），批量分发时每批记录一次
+};
+
+/*
+ * 服务上下文中不常用的部分，第一次用到时才分配（见context_cold），只由处理该服务的线程访问
+ */
+struct context_cold {
+	char result[32];                    // 命令执行结果缓冲区
+	struct name_cache name_cache[NAME_CACHE_SIZE];  // 最近查找过的本地名称
+};
+
 /*
  * skynet服务上下文结构体
  * 每个服务实例对应一个context，包含服务的所有状态信息
+ * 字段按大小排列以减少填充，不常用的放在context_cold中，空闲的服务只占用很少的内存
  */
 struct skynet_context {
 	void * instance;                    // 服务实例指针，指向具体的服务对象
@@ -55,17 +91,31 @@ struct skynet_context {
 	void * cb_ud;                       // 回调函数的用户数据
 	skynet_cb cb;                       // 消息处理回调函数
 	struct message_queue *queue;        // 服务的消息队列
-	ATOM_POINTER logfile;               // 日志文件指针（原子操作）
-	uint64_t cpu_cost;                  // in microsec CPU消耗时间（微秒）
-	uint64_t cpu_start;                 // in microsec CPU开始时间（微秒）
-	char result[32];                    // 命令执行结果缓冲区
 	uint32_t handle;                    // 服务的唯一标识符
 	int session_id;                     // 会话ID，用于消息的请求-响应配对
 	ATOM_INT ref;                       // 引用计数（原子操作）
-	size_t message_count;               // 处理的消息数量统计
+	int weight;                         // 最近一次分发时使用的调度权重
+	int batch;                          // 最近一次分发批次中处理的消息数量
+	ATOM_INT stall;                     // 被监控线程发现处理一条消息超时的次数
+	ATOM_INT lazy;                      // 延迟启动的状态，见context_activate
+	int ttl;                            // 本服务发出的消息的有效期（1/100秒），0表示不过期，见send_deadline
+	int expired;                        // 过期后被丢弃的消息数量
 	bool init;                          // 是否已初始化
 	bool endless;                       // 是否为无限循环服务（用于监控）
 	bool profile;                       // 是否开启性能分析
+	bool timer_batch;                   // 同一时刻到期的多个超时合并为一条消息
+	bool shared_msg;                    // 处理消息时从不保留data，可以直接接收共享消息
+	bool inline_call;                   // 允许发送方的线程直接处理发给本服务的请求，见context_inline
+	size_t message_count;               // 处理的消息数量统计
+	size_t inline_count;                // 在发送方线程中处理的请求数量
+	uint64_t cpu_cost;                  // in microsec CPU消耗时间（微秒）
+	uint64_t cpu_start;                 // in microsec CPU开始时间（微秒）
+	ATOM_POINTER logfile;               // 日志文件指针（原子操作）
+	struct skynet_latency *latency;     // 延迟统计，NULL表示未开启
+	struct skynet_journal *journal;     // 消息日志，NULL表示未开启，只在服务自己的线程中设置
+	char *lazy_param;                   // 延迟启动时保存的初始化参数
+	struct context_cold *cold;          // 不常用的部分，NULL表示还没有用到
+	struct skynet_context *free_next;   // 空闲链表中的下一个上下文
 
 	CHECKCALLING_DECL                   // 调用检查相关字段
 };
@@ -80,6 +130,10 @@ struct skynet_node {
 	uint32_t monitor_exit;              // 监控退出的服务handle
 	pthread_key_t handle_key;           // 线程本地存储键，存储当前线程处理的服务handle
 	bool profile;                       // default is on 是否开启性能分析（默认开启）
+	bool latency;                       // 新服务是否默认开启延迟统计
+	uint64_t weight_budget;             // 自适应调度时单次分发允许占用工作线程的CPU时间（微秒）
+	struct spinlock free_lock;          // 保护空闲上下文链表
+	struct skynet_context *free_ctx;    // 已删除的上下文，内存不归还给分配器，供新服务复用
 };
 
 // 全局节点实例
@@ -153,6 +207,205 @@ struct drop_t {
 	uint32_t handle;  // 丢弃消息的服务handle
 };
 
+/*
+ * 共享消息的负载：头部之后紧跟数据，data指针指向数据部分
+ * 每条还在队列中或正在处理的共享消息持有一个引用，最后一个释放时整块释放
+ */
+struct shared_message {
+	ATOM_INT ref;
+	size_t sz;
+};
+
+static struct shared_message *
+shared_new(const void * data, size_t sz) {
+	struct shared_message * sm = skynet_malloc(sizeof(*sm) + sz + 1);
+	ATOM_INIT(&sm->ref, 1);
+	sm->sz = sz;
+	char * payload = (char *)(sm + 1);
+	if (sz > 0) {
+		memcpy(payload, data, sz);
+	}
+	payload[sz] = '\0';
+	return sm;
+}
+
+static inline void *
+shared_data(struct shared_message *sm) {
+	return sm + 1;
+}
+
+static void
+shared_release(void * data) {
+	struct shared_message * sm = (struct shared_message *)data - 1;
+	if (ATOM_FDEC(&sm->ref) <= 1) {
+		skynet_free(sm);
+	}
+}
+
+/*
+ * 登记了释放回调的消息负载（见skynet_message_finalizer）：负载最后SKYNET_MESSAGE_FINALIZER字节是trailer，
+ * 记着回调所在的finalizer和一个由它和负载地址算出的校验值。
+ * 释放消息时只读一下末尾的trailer，不查表也不加锁；复制到别处的字节地址不同，校验不过。
+ * finalizer只在空闲链表上复用，从不释放，所以校验碰巧通过时去读它也是安全的，还要它指回这块负载才算数
+ */
+struct finalizer {
+	struct finalizer * next;
+	ATOM_POINTER data;
+	void (*finalize)(void *ud);
+	void * ud;
+};
+
+struct message_trailer {
+	struct finalizer * f;
+	uintptr_t check;
+};
+
+static struct {
+	struct spinlock lock;
+	struct finalizer * freelist;
+} F;
+
+static inline uintptr_t
+trailer_check(const void *data, const struct finalizer *f) {
+	uintptr_t h = ((uintptr_t)data ^ ((uintptr_t)f << 1) ^ (uintptr_t)&F) * (uintptr_t)0x9e3779b97f4a7c15ull;
+	return h ^ (h >> 29);
+}
+
+static inline void
+trailer_write(void *data, size_t sz, struct finalizer *f) {
+	struct message_trailer t;
+	t.f = f;
+	t.check = trailer_check(data, f);
+	memcpy((char *)data + sz - sizeof(t), &t, sizeof(t));
+}
+
+// 负载末尾是有效的trailer时返回它的finalizer，否则返回NULL
+static inline struct finalizer *
+trailer_find(const void *data, size_t sz) {
+	struct message_trailer t;
+	if (data == NULL || sz < sizeof(t))
+		return NULL;
+	memcpy(&t, (const char *)data + sz - sizeof(t), sizeof(t));
+	if (t.check != trailer_check(data, t.f) || ATOM_LOAD(&t.f->data) != (uintptr_t)data)
+		return NULL;
+	return t.f;
+}
+
+static void
+finalizer_delete(struct finalizer *f) {
+	ATOM_STORE(&f->data, 0);
+	spinlock_lock(&F.lock);
+	f->next = F.freelist;
+	F.freelist = f;
+	spinlock_unlock(&F.lock);
+}
+
+void
+skynet_message_finalizer(void *data, size_t sz, void (*finalize)(void *ud), void *ud) {
+	assert(sz >= SKYNET_MESSAGE_FINALIZER);
+	spinlock_lock(&F.lock);
+	struct finalizer * f = F.freelist;
+	if (f) {
+		F.freelist = f->next;
+	}
+	spinlock_unlock(&F.lock);
+	if (f == NULL) {
+		f = skynet_malloc(sizeof(*f));
+	}
+	f->next = NULL;
+	f->finalize = finalize;
+	f->ud = ud;
+	ATOM_STORE(&f->data, (uintptr_t)data);
+	trailer_write(data, sz, f);
+}
+
+void *
+skynet_message_copy(void *data, size_t sz) {
+	char * copy = skynet_slab_alloc(sz + 1);
+	memcpy(copy, data, sz);
+	copy[sz] = '\0';
+	struct finalizer * f = trailer_find(data, sz);
+	if (f) {
+		// 回调转给复制出的这份，原来那份的trailer作废
+		ATOM_STORE(&f->data, (uintptr_t)copy);
+		trailer_write(copy, sz, f);
+		memset((char *)data + sz - sizeof(struct message_trailer), 0, sizeof(struct message_trailer));
+	}
+	return copy;
+}
+
+int
+skynet_message_finalized(const void *data, size_t sz) {
+	return trailer_find(data, sz) != NULL;
+}
+
+void
+skynet_message_free(void *data, size_t sz) {
+	struct finalizer * f = trailer_find(data, sz);
+	if (f) {
+		f->finalize(f->ud);
+		finalizer_delete(f);
+	}
+	skynet_free(data);
+}
+
+// 释放消息的data，共享消息只放掉一个引用
+static inline void
+message_free(struct skynet_message *msg) {
+	if (msg->sz & MESSAGE_SHARED) {
+		shared_release(msg->data);
+	} else {
+		skynet_message_free(msg->data, msg->sz & MESSAGE_SIZE_MASK);
+	}
+}
+
+// 把共享消息换成独占的一份，和skynet_send复制出的消息一样用skynet_free释放
+static void
+shared_unshare(struct skynet_message *msg) {
+	size_t sz = msg->sz & MESSAGE_SIZE_MASK;
+	char * data = skynet_slab_alloc(sz + 1);
+	memcpy(data, msg->data, sz + 1);
+	shared_release(msg->data);
+	msg->data = data;
+	msg->sz &= ~MESSAGE_SHARED;
+}
+
+#define LAZY_NONE 0     // 已经初始化（或者不是延迟启动的服务）
+#define LAZY_WAIT 1     // 还没有初始化，等待第一条消息
+#define LAZY_INIT 2     // 正在初始化
+
+static void context_activate(struct skynet_context *ctx);
+
+/*
+ * 服务已经退出时，发给它的消息的转发目标（见skynet_handle_redirect），没有返回0
+ * 只转发请求，响应和错误属于旧服务发出的请求，转走也没有人处理
+ */
+static uint32_t
+redirect_target(uint32_t handle, struct skynet_message *msg) {
+	int type = (int)(msg->sz >> MESSAGE_TYPE_SHIFT);
+	if (type == PTYPE_RESPONSE || type == PTYPE_ERROR)
+		return 0;
+	return skynet_handle_redirected(handle);
+}
+
+/*
+ * 查找接收消息的服务，服务已经迁移走时换成重定向的目标
+ */
+static struct skynet_context *
+grab_receiver(uint32_t handle, struct skynet_message *msg) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		uint32_t target = redirect_target(handle, msg);
+		if (target) {
+			ctx = skynet_handle_grab(target);
+		}
+	}
+	if (ctx && ATOM_LOAD(&ctx->lazy) != LAZY_NONE) {
+		context_activate(ctx);
+	}
+	return ctx;
+}
+
 /*
  * 丢弃消息的回调函数
  * 当服务退出时，其消息队列中的剩余消息会被丢弃，并向发送方报告错误
@@ -162,40 +415,119 @@ struct drop_t {
 static void
 drop_message(struct skynet_message *msg, void *ud) {
 	struct drop_t *d = ud;
-	skynet_free(msg->data);  // 释放消息数据
 	uint32_t source = d->handle;
 	assert(source);
+	// 服务迁移走了，队列中剩下的请求转给它的新地址
+	uint32_t target = redirect_target(source, msg);
+	if (target) {
+		if (msg->sz & MESSAGE_SHARED) {
+			shared_unshare(msg);
+		}
+		if (skynet_context_push(target, msg) == 0)
+			return;
+	}
+	message_free(msg);  // 释放消息数据
 	// report error to the message source
 	// 向消息发送方报告错误
 	skynet_send(NULL, source, msg->source, PTYPE_ERROR, msg->session, NULL, 0);
 }
 
 /*
- * 创建新的服务上下文
- * @param name: 服务模块名称
- * @param param: 传递给服务的初始化参数
- * @return: 成功返回服务上下文指针，失败返回NULL
+ * 分配服务上下文
+ * skynet_handle_grab不加锁读取槽位，可能拿到已删除上下文的指针，
+ * 所以上下文内存是类型稳定的：删除后放入空闲链表复用，而不是归还给分配器。
+ * 空闲上下文的引用计数为0，handle为0，skynet_context_trygrab会拒绝它们
  */
-struct skynet_context *
-skynet_context_new(const char * name, const char *param) {
-	// 查找指定名称的服务模块
-	struct skynet_module * mod = skynet_module_query(name);
+static struct skynet_context *
+context_alloc(void) {
+	struct skynet_context * ctx;
+	spinlock_lock(&G_NODE.free_lock);
+	ctx = G_NODE.free_ctx;
+	if (ctx) {
+		G_NODE.free_ctx = ctx->free_next;
+	}
+	spinlock_unlock(&G_NODE.free_lock);
+	if (ctx == NULL) {
+		ctx = skynet_malloc(sizeof(*ctx));
+		ctx->handle = 0;
+		ATOM_INIT(&ctx->ref, 0);
+	}
+	ctx->free_next = NULL;
+	return ctx;
+}
 
-	if (mod == NULL)
-		return NULL;
+static void
+context_free(struct skynet_context *ctx) {
+	ctx->handle = 0;
+	spinlock_lock(&G_NODE.free_lock);
+	ctx->free_next = G_NODE.free_ctx;
+	G_NODE.free_ctx = ctx;
+	spinlock_unlock(&G_NODE.free_lock);
+}
 
-	// 创建服务实例
-	void *inst = skynet_module_instance_create(mod);
-	if (inst == NULL)
-		return NULL;
+// 取得上下文的不常用部分，第一次调用时分配
+static struct context_cold *
+context_cold(struct skynet_context *ctx) {
+	if (ctx->cold == NULL) {
+		ctx->cold = skynet_malloc(sizeof(struct context_cold));
+		memset(ctx->cold, 0, sizeof(struct context_cold));
+	}
+	return ctx->cold;
+}
+
+/*
+ * 开启或关闭服务的延迟统计
+ * 只能在服务自身处理消息时或初始化之前调用
+ */
+static void
+latency_enable(struct skynet_context *ctx, int on) {
+	skynet_mq_stamp(ctx->queue, on);
+	if (on) {
+		if (ctx->latency == NULL) {
+			ctx->latency = skynet_malloc(sizeof(struct skynet_latency));
+			histogram_reset(&ctx->latency->wait);
+			histogram_reset(&ctx->latency->cost);
+		}
+	} else {
+		skynet_free(ctx->latency);
+		ctx->latency = NULL;
+	}
+}
+
+// 本线程正在初始化的延迟启动服务，它的初始化函数给自己发消息时不用等待
+static __thread struct skynet_context * activating_ctx = NULL;
 
-	// 分配并初始化服务上下文
-	struct skynet_context * ctx = skynet_malloc(sizeof(*ctx));
+/*
+ * 调用服务实例的初始化函数，成功后把消息队列加入全局队列
+ * @return: 成功返回0；失败时注销handle，返回-1
+ */
+static int
+context_init(struct skynet_context *ctx, const char *name, const char *param) {
+	CHECKCALLING_BEGIN(ctx)
+	int r = skynet_module_instance_init(ctx->mod, ctx->instance, ctx, param);  // 调用服务的初始化函数
+	CHECKCALLING_END(ctx)
+	if (r == 0) {
+		ctx->init = true;  // 标记为已初始化
+		skynet_globalmq_push(ctx->queue);  // 将消息队列加入全局队列
+		skynet_error(ctx, "LAUNCH %s %s", name, param ? param : "");
+		return 0;
+	}
+	skynet_error(ctx, "error: launch %s FAILED", name);
+	return -1;
+}
+
+/*
+ * 分配并初始化服务上下文，注册handle，创建消息队列（此时还不在全局队列中）
+ * 返回的上下文有两个引用：一个属于handle，一个属于调用者
+ */
+static struct skynet_context *
+context_create(struct skynet_module *mod, void *inst) {
+	struct skynet_context * ctx = context_alloc();
 	CHECKCALLING_INIT(ctx)  // 初始化调用检查
 
 	ctx->mod = mod;                                    // 设置服务模块
 	ctx->instance = inst;                              // 设置服务实例
-	ATOM_INIT(&ctx->ref , 2);                         // 初始化引用计数为2
+	ATOM_STORE(&ctx->ref , 2);                        // 初始化引用计数为2
 	ctx->cb = NULL;                                    // 消息回调函数
 	ctx->cb_ud = NULL;                                 // 回调用户数据
 	ctx->session_id = 0;                               // 会话ID
@@ -208,31 +540,59 @@ skynet_context_new(const char * name, const char *param) {
 	ctx->cpu_start = 0;                                // CPU开始时间
 	ctx->message_count = 0;                            // 消息计数
 	ctx->profile = G_NODE.profile;                     // 性能分析开关
+	ctx->weight = 0;                                   // 调度权重
+	ctx->batch = 0;                                    // 分发批次大小
+	ctx->cold = NULL;                                  // 命令结果和名称缓存，用到时才分配
+	ctx->timer_batch = false;                          // 超时消息合并
+	ctx->shared_msg = false;                           // 接收共享消息
+	ctx->latency = NULL;                               // 延迟统计
+	ATOM_INIT(&ctx->stall, 0);                         // 超时次数
+	ctx->journal = NULL;                               // 消息日志
+	ATOM_INIT(&ctx->lazy, LAZY_NONE);                  // 延迟启动
+	ctx->lazy_param = NULL;
+	ctx->inline_call = false;                          // 内联调用
+	ctx->inline_count = 0;
+	ctx->ttl = 0;                                      // 消息有效期
+	ctx->expired = 0;
 	// Should set to 0 first to avoid skynet_handle_retireall get an uninitialized handle
 	// 必须先设置为0，避免skynet_handle_retireall获取到未初始化的handle
 	ctx->handle = 0;
 	ctx->handle = skynet_handle_register(ctx);         // 注册服务handle
-	struct message_queue * queue = ctx->queue = skynet_mq_create(ctx->handle);  // 创建消息队列
-	// init function maybe use ctx->handle, so it must init at last
-	// 初始化函数可能会使用ctx->handle，所以必须最后初始化
+	ctx->queue = skynet_mq_create(ctx->handle);        // 创建消息队列
+	if (G_NODE.latency) {
+		latency_enable(ctx, 1);
+	}
 	context_inc();  // 增加服务计数
+	return ctx;
+}
 
-	CHECKCALLING_BEGIN(ctx)
-	int r = skynet_module_instance_init(mod, inst, ctx, param);  // 调用服务的初始化函数
-	CHECKCALLING_END(ctx)
-	if (r == 0) {
-		// 初始化成功
-		struct skynet_context * ret = skynet_context_release(ctx);
-		if (ret) {
-			ctx->init = true;  // 标记为已初始化
-		}
-		skynet_globalmq_push(queue);  // 将消息队列加入全局队列
-		if (ret) {
-			skynet_error(ret, "LAUNCH %s %s", name, param ? param : "");
-		}
-		return ret;
+/*
+ * 创建新的服务上下文
+ * @param name: 服务模块名称
+ * @param param: 传递给服务的初始化参数
+ * @return: 成功返回服务上下文指针，失败返回NULL
+ */
+struct skynet_context *
+skynet_context_new(const char * name, const char *param) {
+	// 查找指定名称的服务模块
+	struct skynet_module * mod = skynet_module_query(name);
+
+	if (mod == NULL)
+		return NULL;
+
+	// 创建服务实例
+	void *inst = skynet_module_instance_create(mod);
+	if (inst == NULL)
+		return NULL;
+
+	struct skynet_context * ctx = context_create(mod, inst);
+	// init function maybe use ctx->handle, so it must init at last
+	// 初始化函数可能会使用ctx->handle，所以必须最后初始化
+	if (context_init(ctx, name, param) == 0) {
+		// 初始化时服务可能已经退出了
+		return skynet_context_release(ctx);
 	} else {
-		skynet_error(ctx, "error: launch %s FAILED", name);
+		struct message_queue * queue = ctx->queue;
 		uint32_t handle = ctx->handle;
 		skynet_context_release(ctx);
 		skynet_handle_retire(handle);
@@ -242,6 +602,57 @@ skynet_context_new(const char * name, const char *param) {
 	}
 }
 
+/*
+ * 延迟启动的服务：先只注册handle、创建消息队列，服务实例在第一条消息发来时才创建并初始化（见context_activate）。
+ * 收不到消息就退出的服务几乎没有开销。不等服务初始化就返回，初始化失败时服务直接退出
+ * @return: 成功返回服务的handle，模块不存在返回0
+ */
+uint32_t
+skynet_context_lazy(const char * name, const char *param) {
+	struct skynet_module * mod = skynet_module_query(name);
+	if (mod == NULL)
+		return 0;
+	struct skynet_context * ctx = context_create(mod, NULL);
+	ctx->lazy_param = param ? skynet_strdup(param) : NULL;
+	ATOM_STORE(&ctx->lazy, LAZY_WAIT);
+	uint32_t handle = ctx->handle;
+	skynet_context_release(ctx);
+	return handle;
+}
+
+/*
+ * 延迟启动的服务收到第一条消息之前，在发送者的线程中创建并初始化服务实例。
+ * 初始化函数发出的消息（如snlua的启动消息）在队列中排在前面；同时发来的其他消息等初始化完成后再放进队列
+ */
+static void
+context_activate(struct skynet_context *ctx) {
+	if (!ATOM_CAS(&ctx->lazy, LAZY_WAIT, LAZY_INIT)) {
+		while (ATOM_LOAD(&ctx->lazy) == LAZY_INIT && activating_ctx != ctx) {
+			sched_yield();
+		}
+		return;
+	}
+	struct skynet_context * prev = activating_ctx;
+	activating_ctx = ctx;
+	const char * name = ctx->mod->name;
+	ctx->instance = skynet_module_instance_create(ctx->mod);
+	int r = -1;
+	if (ctx->instance) {
+		r = context_init(ctx, name, ctx->lazy_param);
+	} else {
+		skynet_error(ctx, "error: launch %s FAILED", name);
+	}
+	activating_ctx = prev;
+	skynet_free(ctx->lazy_param);
+	ctx->lazy_param = NULL;
+	ATOM_STORE(&ctx->lazy, LAZY_NONE);
+	if (r) {
+		// 和正常退出的服务一样，由工作线程释放消息队列，发来的消息返回错误
+		skynet_globalmq_push(ctx->queue);
+		skynet_handle_retire(ctx->handle);
+	}
+}
+
 /*
  * 为服务上下文生成新的会话ID
  * 会话ID用于消息的请求-响应配对，始终为正数
@@ -271,6 +682,31 @@ skynet_context_grab(struct skynet_context *ctx) {
 	ATOM_FINC(&ctx->ref);  // 原子操作增加引用计数
 }
 
+/*
+ * 尝试增加一个可能已过期的上下文的引用计数，供无锁查找使用
+ * 只在引用计数不为0时递增，成功后再校验handle，防止拿到已被复用的上下文
+ * @param ctx: 从槽位中读到的上下文（内存总是有效的，见context_alloc）
+ * @param handle: 期望的handle
+ * @return: 1表示成功并持有一个引用，0表示上下文已删除或不属于该handle
+ */
+int
+skynet_context_trygrab(struct skynet_context *ctx, uint32_t handle) {
+	if (handle == 0)
+		return 0;
+	for (;;) {
+		int ref = ATOM_LOAD(&ctx->ref);
+		if (ref == 0)
+			return 0;
+		if (ATOM_CAS(&ctx->ref, ref, ref + 1))
+			break;
+	}
+	if (ctx->handle != handle) {
+		skynet_context_release(ctx);
+		return 0;
+	}
+	return 1;
+}
+
 /*
  * 保留服务上下文
  * 增加引用计数但减少全局服务计数，用于在系统关闭时保留特殊服务
@@ -298,12 +734,25 @@ delete_context(struct skynet_context *ctx) {
 	if (f) {
 		fclose(f);
 	}
+	if (ctx->journal) {
+		skynet_journal_close(ctx->journal);
+	}
 	// 释放服务实例
-	skynet_module_instance_release(ctx->mod, ctx->instance);
+	if (ctx->instance) {
+		skynet_module_instance_release(ctx->mod, ctx->instance);
+	}
 	// 标记消息队列为待释放状态
 	skynet_mq_mark_release(ctx->queue);
+	if (ATOM_LOAD(&ctx->lazy) == LAZY_WAIT) {
+		// 延迟启动的服务没有收到过消息就退出了，队列从来没有进过全局队列
+		skynet_free(ctx->lazy_param);
+		skynet_globalmq_push(ctx->queue);
+	}
+	skynet_free(ctx->latency);
+	skynet_free(ctx->cold);
+	ctx->cold = NULL;
 	CHECKCALLING_DESTROY(ctx)  // 销毁调用检查
-	skynet_free(ctx);          // 释放上下文内存
+	context_free(ctx);         // 回收上下文内存
 	context_dec();             // 减少全局服务计数
 }
 
@@ -323,6 +772,44 @@ skynet_context_release(struct skynet_context *ctx) {
 	return ctx;  // 上下文仍然有效
 }
 
+/*
+ * 向服务投递一批同时到期的超时事件
+ * 服务开启了合并（TIMERBATCH）且多于一个时，打包成一条source和session都为0的响应消息，
+ * 数据是int类型的session数组；否则每个session一条普通的响应消息
+ * @param handle: 目标服务的handle
+ * @param session: session数组
+ * @param n: session数量
+ * @return: 成功返回0，服务不存在返回-1
+ */
+int
+skynet_context_pushtimeout(uint32_t handle, int *session, int n) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	struct skynet_message message;
+	message.source = 0;
+	message.deadline = 0;
+	if (n > 1 && ctx->timer_batch) {
+		size_t sz = n * sizeof(int);
+		message.session = 0;
+		message.data = skynet_malloc(sz);
+		memcpy(message.data, session, sz);
+		message.sz = sz | (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+		skynet_mq_push(ctx->queue, &message);
+	} else {
+		int i;
+		for (i=0;i<n;i++) {
+			message.session = session[i];
+			message.data = NULL;
+			message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+			skynet_mq_push(ctx->queue, &message);
+		}
+	}
+	skynet_context_release(ctx);
+	return 0;
+}
+
 /*
  * 向指定handle的服务推送消息
  * 通过handle查找服务上下文，将消息推入其消息队列
@@ -332,7 +819,7 @@ skynet_context_release(struct skynet_context *ctx) {
  */
 int
 skynet_context_push(uint32_t handle, struct skynet_message *message) {
-	struct skynet_context * ctx = skynet_handle_grab(handle);
+	struct skynet_context * ctx = grab_receiver(handle, message);
 	if (ctx == NULL) {
 		return -1;  // 服务不存在
 	}
@@ -342,65 +829,336 @@ skynet_context_push(uint32_t handle, struct skynet_message *message) {
 	return 0;
 }
 
+/*
+ * 工作线程当前分发的消息，内联调用结束后恢复监控器的记录
+ */
+struct dispatch_thread {
+	struct skynet_monitor *sm;      // 本线程的监控器，独占线程为NULL
+	uint32_t source;                // 正在处理的消息的来源
+	int depth;                      // 内联调用的嵌套层数
+};
+
+static __thread struct dispatch_thread D;
+
+/*
+ * 同一个工作线程连续分发同一个服务的消息时缓存的时钟
+ * 上一条消息结束的时间就是下一条开始的时间，每条消息只读一次时钟（线程CPU时间要系统调用）
+ * 0表示还没有读过
+ */
+struct dispatch_clock {
+	uint64_t cpu;       // skynet_thread_time
+	uint64_t mono;      // skynet_monotonic_time
+};
+
+static void dispatch_message(struct skynet_context *ctx, struct skynet_message *msg, struct dispatch_clock *clock);
+
+/*
+ * 内联调用：caller正在本线程中处理消息，它发出的请求的接收者ctx开启了inline_call且空闲（队列为空，
+ * 没有被任何线程调度）时，取得ctx的调度权直接在本线程中处理这条请求，不经过消息队列和运行队列。
+ * 调度权和普通分发一样是排他的，期间发给ctx的消息照常入队，交出调度权时再调度，所以同一服务的消息仍然串行。
+ * 只内联一层，ctx再发出的请求走消息队列；响应照常进入caller的队列，caller处理完当前消息后接着处理。
+ * @return: 1表示已经处理（消息的所有权转给了ctx），0表示需要入队
+ */
+static int
+context_inline(struct skynet_context *caller, struct skynet_context *ctx, struct skynet_message *msg) {
+	if (!ctx->inline_call || caller == NULL || caller == ctx || D.depth > 0)
+		return 0;
+	int type = (int)(msg->sz >> MESSAGE_TYPE_SHIFT);
+	if (msg->session == 0 || type == PTYPE_RESPONSE || type == PTYPE_ERROR || type == PTYPE_SYSTEM)
+		return 0;
+	// 只在caller自己的分发过程中内联，定时器、网络线程等发出的消息照常入队
+	if (skynet_current_handle() != caller->handle)
+		return 0;
+	if (!ctx->init || ctx->cb == NULL || ctx->mod->batch || ATOM_LOAD(&ctx->lazy) != LAZY_NONE)
+		return 0;
+	if (!skynet_mq_claim(ctx->queue))
+		return 0;
+
+	++D.depth;
+	uint32_t source = D.source;
+	struct dispatch_clock clock = { 0, 0 };
+	if (caller->profile && !ctx->profile) {
+		clock.cpu = skynet_thread_time();
+	}
+	msg->stamp = 0;
+	++ctx->inline_count;
+	if (D.sm) {
+		skynet_monitor_trigger(D.sm, msg->source, ctx->handle);
+	}
+	dispatch_message(ctx, msg, &clock);
+	if (D.sm) {
+		skynet_monitor_trigger(D.sm, source, caller->handle);
+	}
+	D.source = source;
+	pthread_setspecific(G_NODE.handle_key, (void *)(uintptr_t)(caller->handle));
+	if (caller->profile) {
+		// 从caller本条消息的CPU时间中扣除ctx的处理时间
+		if (ctx->profile) {
+			caller->cpu_start += clock.cpu - ctx->cpu_start;
+		} else {
+			caller->cpu_start += skynet_thread_time() - clock.cpu;
+		}
+	}
+	--D.depth;
+
+	skynet_mq_unclaim(ctx->queue);
+	return 1;
+}
+
+/*
+ * 服务间发送消息时使用的推送，在skynet_context_push的基础上检查目标队列的背压阈值
+ * caller是发送方，接收方允许时可以在本线程中直接处理，见context_inline
+ * @return: 0表示成功，-1表示服务不存在，-3表示目标队列已满被拒绝
+ */
+static int
+context_send(struct skynet_context *caller, uint32_t handle, struct skynet_message *message) {
+	struct skynet_context * ctx = grab_receiver(handle, message);
+	if (ctx == NULL) {
+		return -1;
+	}
+	int ret = 0;
+	if (skynet_mq_full(ctx->queue, message)) {
+		ret = -3;
+	} else if (!context_inline(caller, ctx, message)) {
+		skynet_mq_push(ctx->queue, message);
+	}
+	skynet_context_release(ctx);
+
+	return ret;
+}
+
+int
+skynet_context_stat(uint32_t handle, struct skynet_service_stat *stat) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return 0;
+	}
+	stat->mqlen = skynet_mq_length(ctx->queue);
+	stat->dropped = skynet_mq_dropped(ctx->queue);
+	stat->message = ctx->message_count;
+	stat->cpu = ctx->cpu_cost;
+	stat->stall = ATOM_LOAD(&ctx->stall);
+	stat->expired = ctx->expired;
+	skynet_context_release(ctx);
+	return 1;
+}
+
 void 
-skynet_context_endless(uint32_t handle) {
+skynet_context_endless(uint32_t handle, int signal) {
 	struct skynet_context * ctx = skynet_handle_grab(handle);
 	if (ctx == NULL) {
 		return;
 	}
 	ctx->endless = true;
+	ATOM_FINC(&ctx->stall);
+	if (signal >= 0) {
+		// 信号函数是线程安全的，见 cmd_signal
+		skynet_module_instance_signal(ctx->mod, ctx->instance, signal);
+	}
 	skynet_context_release(ctx);
 }
 
-int 
-skynet_isremote(struct skynet_context * ctx, uint32_t handle, int * harbor) {
-	int ret = skynet_harbor_message_isremote(handle);
-	if (harbor) {
-		*harbor = (int)(handle >> HANDLE_REMOTE_SHIFT);
+int 
+skynet_isremote(struct skynet_context * ctx, uint32_t handle, int * harbor) {
+	int ret = skynet_harbor_message_isremote(handle);
+	if (harbor) {
+		*harbor = (int)(handle >> HANDLE_REMOTE_SHIFT);
+	}
+	return ret;
+}
+
+/*
+ * 发送方设置了有效期（见cmd_ttl）时，计算消息的过期时间，响应和错误消息不会过期
+ * @return: 单调时钟（纳秒），0表示不过期
+ */
+static inline uint64_t
+send_deadline(struct skynet_context *ctx, int type) {
+	if (ctx == NULL || ctx->ttl <= 0 || type == PTYPE_RESPONSE || type == PTYPE_ERROR)
+		return 0;
+	return skynet_monotonic_time() + (uint64_t)ctx->ttl * 10000000;
+}
+
+/*
+ * 丢弃过期的消息：发送方早已不再等待（例如调用已经超时），处理它只会加重过载
+ * 请求（session不为0）回复一条错误消息，让还在等待的调用方得到失败而不是一直挂起
+ * @return: 消息过期并已丢弃返回true
+ */
+static bool
+message_expired(struct skynet_context *ctx, struct skynet_message *msg) {
+	if (msg->deadline == 0 || skynet_monotonic_time() <= msg->deadline)
+		return false;
+	++ctx->expired;
+	message_free(msg);
+	if (msg->session != 0) {
+		skynet_send(ctx, 0, msg->source, PTYPE_ERROR, msg->session, NULL, 0);
+	}
+	return true;
+}
+
+/*
+ * 分发消息到服务
+ * 调用服务的消息处理回调函数，处理性能统计和日志记录
+ * @param ctx: 服务上下文
+ * @param msg: 要分发的消息
+ * @param clock: 本批消息的时钟缓存
+ */
+static void
+dispatch_message(struct skynet_context *ctx, struct skynet_message *msg, struct dispatch_clock *clock) {
+	assert(ctx->init);  // 确保服务已初始化
+	if (msg->deadline && message_expired(ctx, msg))
+		return;
+	CHECKCALLING_BEGIN(ctx)
+	// 设置当前线程处理的服务handle到线程本地存储
+	pthread_setspecific(G_NODE.handle_key, (void *)(uintptr_t)(ctx->handle));
+
+	// 不接收共享消息的服务（例如转发模式）可能保留data，先换成独占的一份
+	if ((msg->sz & MESSAGE_SHARED) && !ctx->shared_msg) {
+		shared_unshare(msg);
+	}
+	int shared = (msg->sz & MESSAGE_SHARED) != 0;
+
+	// 解析消息类型和大小
+	int type = msg->sz >> MESSAGE_TYPE_SHIFT;
+	size_t sz = msg->sz & MESSAGE_SIZE_MASK;
+
+	// 如果开启了日志，记录消息
+	FILE *f = (FILE *)ATOM_LOAD(&ctx->logfile);
+	if (f) {
+		skynet_log_output(f, msg->source, type, msg->session, msg->data, sz);
+	}
+	// socket消息的数据在另一块内存里，重放也没有意义，不记录
+	if (ctx->journal && type != PTYPE_SOCKET) {
+		skynet_journal_append(ctx->journal, msg->source, type, msg->session, msg->data, sz);
+	}
+
+	++ctx->message_count;  // 增加消息计数
+	SKYNET_PROBE5(dispatch__begin, ctx->handle, msg->source, type, msg->session, sz);
+	int reserve_msg;
+	uint64_t trace = skynet_trace_begin();
+	struct skynet_latency *latency = ctx->latency;
+	uint64_t begin = 0;
+	if (latency) {
+		begin = clock->mono ? clock->mono : skynet_monotonic_time();
+		// 开启统计之前入队的消息没有时间戳
+		if (msg->stamp && begin > msg->stamp) {
+			histogram_add(&latency->wait, begin - msg->stamp);
+		}
+	}
+
+	if (ctx->profile) {
+		// 开启性能分析时，记录CPU消耗时间
+		ctx->cpu_start = clock->cpu ? clock->cpu : skynet_thread_time();
+		reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
+		clock->cpu = skynet_thread_time();
+		ctx->cpu_cost += clock->cpu - ctx->cpu_start;
+	} else {
+		// 直接调用消息处理回调
+		reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
+	}
+	skynet_trace_end(trace, msg->source, ctx->handle, type, msg->session, sz);
+	SKYNET_PROBE3(dispatch__end, ctx->handle, type, msg->session);
+	// 回调中可能关闭了统计，重新开启时缓存的时间已经过时
+	if (latency && latency == ctx->latency) {
+		clock->mono = skynet_monotonic_time();
+		histogram_add(&latency->cost, clock->mono - begin);
+	} else {
+		clock->mono = 0;
+	}
+
+	if (shared) {
+		if (reserve_msg) {
+			skynet_error(ctx, "error: Shared message from %x can't be reserved", msg->source);
+		}
+		shared_release(msg->data);
+	} else if (!reserve_msg) {
+		// 如果服务不保留消息数据，则释放内存
+		skynet_message_free(msg->data, msg->sz & MESSAGE_SIZE_MASK);
 	}
-	return ret;
+	CHECKCALLING_END(ctx)
 }
 
 /*
- * 分发消息到服务
- * 调用服务的消息处理回调函数，处理性能统计和日志记录
+ * 批量分发消息到服务
+ * 调用模块导出的xxx_batch函数一次处理多条消息，性能统计以整批为单位
+ * 服务需要保留的消息由其将data置为NULL，其余消息内存在这里释放
  * @param ctx: 服务上下文
- * @param msg: 要分发的消息
+ * @param msg: 消息数组
+ * @param n: 消息数量
  */
 static void
-dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
-	assert(ctx->init);  // 确保服务已初始化
+dispatch_message_batch(struct skynet_context *ctx, struct skynet_message *msg, int n) {
+	assert(ctx->init);
+	int i, j = 0;
+	// 先去掉过期的消息
+	for (i=0;i<n;i++) {
+		if (msg[i].deadline && message_expired(ctx, &msg[i]))
+			continue;
+		msg[j++] = msg[i];
+	}
+	n = j;
+	if (n == 0)
+		return;
 	CHECKCALLING_BEGIN(ctx)
-	// 设置当前线程处理的服务handle到线程本地存储
 	pthread_setspecific(G_NODE.handle_key, (void *)(uintptr_t)(ctx->handle));
 
-	// 解析消息类型和大小
-	int type = msg->sz >> MESSAGE_TYPE_SHIFT;
-	size_t sz = msg->sz & MESSAGE_TYPE_MASK;
-
-	// 如果开启了日志，记录消息
+	// 批量处理的模块直接拿到消息数组，共享消息先换成独占的一份
+	for (i=0;i<n;i++) {
+		if (msg[i].sz & MESSAGE_SHARED) {
+			shared_unshare(&msg[i]);
+		}
+	}
 	FILE *f = (FILE *)ATOM_LOAD(&ctx->logfile);
 	if (f) {
-		skynet_log_output(f, msg->source, type, msg->session, msg->data, sz);
+		for (i=0;i<n;i++) {
+			skynet_log_output(f, msg[i].source, (int)(msg[i].sz >> MESSAGE_TYPE_SHIFT), msg[i].session, msg[i].data, msg[i].sz & MESSAGE_TYPE_MASK);
+		}
+	}
+	if (ctx->journal) {
+		for (i=0;i<n;i++) {
+			int type = (int)(msg[i].sz >> MESSAGE_TYPE_SHIFT);
+			if (type != PTYPE_SOCKET) {
+				skynet_journal_append(ctx->journal, msg[i].source, type, msg[i].session, msg[i].data, msg[i].sz & MESSAGE_SIZE_MASK);
+			}
+		}
 	}
 
-	++ctx->message_count;  // 增加消息计数
-	int reserve_msg;
+	ctx->message_count += n;
+	SKYNET_PROBE5(dispatch__begin, ctx->handle, msg[0].source, -n, msg[0].session, msg[0].sz & MESSAGE_SIZE_MASK);
+	uint64_t trace = skynet_trace_begin();
+	struct skynet_latency *latency = ctx->latency;
+	uint64_t begin = 0;
+	if (latency) {
+		begin = skynet_monotonic_time();
+		for (i=0;i<n;i++) {
+			if (msg[i].stamp && begin > msg[i].stamp) {
+				histogram_add(&latency->wait, begin - msg[i].stamp);
+			}
+		}
+	}
 
 	if (ctx->profile) {
-		// 开启性能分析时，记录CPU消耗时间
 		ctx->cpu_start = skynet_thread_time();
-		reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
+		ctx->mod->batch(ctx->instance, ctx, msg, n);
 		uint64_t cost_time = skynet_thread_time() - ctx->cpu_start;
 		ctx->cpu_cost += cost_time;
 	} else {
-		// 直接调用消息处理回调
-		reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
+		ctx->mod->batch(ctx->instance, ctx, msg, n);
+	}
+	if (trace) {
+		// 整批记录为一条，类型为负的消息数量
+		size_t sz = 0;
+		for (i=0;i<n;i++) {
+			sz += msg[i].sz & MESSAGE_SIZE_MASK;
+		}
+		skynet_trace_end(trace, msg[0].source, ctx->handle, -n, msg[0].session, sz);
+	}
+	SKYNET_PROBE3(dispatch__end, ctx->handle, -n, msg[0].session);
+	if (latency && latency == ctx->latency) {
+		histogram_add(&latency->cost, skynet_monotonic_time() - begin);
 	}
 
-	if (!reserve_msg) {
-		// 如果服务不保留消息数据，则释放内存
-		skynet_free(msg->data);
+	for (i=0;i<n;i++) {
+		skynet_message_free(msg[i].data, msg[i].sz & MESSAGE_SIZE_MASK);
 	}
 	CHECKCALLING_END(ctx)
 }
@@ -415,16 +1173,57 @@ skynet_context_dispatchall(struct skynet_context * ctx) {
 	// for skynet_error
 	struct skynet_message msg;
 	struct message_queue *q = ctx->queue;
+	struct dispatch_clock clock = { 0, 0 };
 	// 处理队列中的所有消息
 	while (!skynet_mq_pop(q,&msg)) {
-		dispatch_message(ctx, &msg);
+		dispatch_message(ctx, &msg, &clock);
+	}
+}
+
+/*
+ * 自适应调度下计算本次分发的消息数量
+ * 以队列长度为上限，再根据该服务的平均消息耗时（cpu_cost/message_count）
+ * 限制在weight_budget时间预算以内；未开启profile时无法得知耗时，取队列长度的一半
+ * @param ctx: 服务上下文
+ * @param q: 服务的消息队列（已弹出第一条消息）
+ * @return: 本次分发的消息总数（包括已弹出的一条）
+ */
+static int
+adaptive_batch(struct skynet_context *ctx, struct message_queue *q) {
+	int n = skynet_mq_length(q) + 1;
+	if (!ctx->profile) {
+		return (n >> 1) + 1;
+	}
+	if (ctx->message_count > 0 && ctx->cpu_cost > 0) {
+		uint64_t avg = ctx->cpu_cost / ctx->message_count;
+		if (avg == 0)
+			avg = 1;
+		uint64_t limit = G_NODE.weight_budget / avg;
+		if (limit < 1)
+			limit = 1;
+		if ((uint64_t)n > limit)
+			n = (int)limit;
+	}
+	return n;
+}
+
+/*
+ * 配置了调度组时，把本次分发消耗的CPU时间记到服务所在的组
+ * 没有开启profile的服务用经过的时间代替
+ */
+static inline void
+charge_group(struct skynet_context *ctx, struct message_queue *q, uint64_t cost_start, uint64_t mono_start) {
+	if (ctx->profile) {
+		skynet_mq_charge(q, ctx->cpu_cost - cost_start);
+	} else if (mono_start) {
+		skynet_mq_charge(q, (skynet_monotonic_time() - mono_start) / 1000);
 	}
 }
 
 struct message_queue * 
-skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue *q, int weight) {
+skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue *q, int weight, int worker) {
 	if (q == NULL) {
-		q = skynet_globalmq_pop();
+		q = skynet_localmq_pop(worker);
 		if (q==NULL)
 			return NULL;
 	}
@@ -435,43 +1234,90 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 	if (ctx == NULL) {
 		struct drop_t d = { handle };
 		skynet_mq_release(q, drop_message, &d);
-		return skynet_globalmq_pop();
+		return skynet_localmq_pop(worker);
 	}
 
 	int i,n=1;
 	struct skynet_message msg;
-
-	for (i=0;i<n;i++) {
+	struct dispatch_clock clock = { 0, 0 };
+	uint64_t cost_start = ctx->cpu_cost;
+	int grouped = skynet_mq_grouped();
+	uint64_t mono_start = (grouped && !ctx->profile) ? skynet_monotonic_time() : 0;
+	ctx->weight = weight;
+
+	if (ctx->mod->batch && ctx->cb) {
+		// 模块提供了批量接口：一次取出一批消息交给服务，不再按权重逐条分发
+		struct skynet_message msgs[DISPATCH_BATCH];
+		n = skynet_mq_pop_batch(q, msgs, DISPATCH_BATCH);
+		if (n == 0) {
+			skynet_context_release(ctx);
+			return skynet_localmq_pop(worker);
+		}
+		ctx->batch = n;
+		int overload = skynet_mq_overload(q);
+		if (overload) {
+			skynet_error(ctx, "error: May overload, message queue length = %d", overload);
+		}
+		skynet_monitor_trigger(sm, msgs[0].source , handle);
+		D.sm = sm;
+		D.source = msgs[0].source;
+		dispatch_message_batch(ctx, msgs, n);
+		skynet_monitor_trigger(sm, 0,0);
+	} else for (i=0;i<n;i++) {
 		if (skynet_mq_pop(q,&msg)) {
+			if (grouped) {
+				charge_group(ctx, q, cost_start, mono_start);
+			}
 			skynet_context_release(ctx);
-			return skynet_globalmq_pop();
-		} else if (i==0 && weight >= 0) {
-			n = skynet_mq_length(q);
-			n >>= weight;
+			return skynet_localmq_pop(worker);
+		} else if (i==0) {
+			if (weight >= 0) {
+				n = skynet_mq_length(q);
+				n >>= weight;
+			} else if (weight == WEIGHT_ADAPTIVE) {
+				n = adaptive_batch(ctx, q);
+			}
 		}
+		ctx->batch = i + 1;
 		int overload = skynet_mq_overload(q);
 		if (overload) {
 			skynet_error(ctx, "error: May overload, message queue length = %d", overload);
 		}
 
 		skynet_monitor_trigger(sm, msg.source , handle);
+		D.sm = sm;
+		D.source = msg.source;
 
 		if (ctx->cb == NULL) {
-			skynet_free(msg.data);
+			message_free(&msg);
 		} else {
-			dispatch_message(ctx, &msg);
+			dispatch_message(ctx, &msg, &clock);
 		}
 
 		skynet_monitor_trigger(sm, 0,0);
+
+		if (weight == WEIGHT_ADAPTIVE && ctx->profile && ctx->cpu_cost - cost_start >= G_NODE.weight_budget) {
+			// 该服务占用工作线程的时间已超出预算，让出给其他服务
+			break;
+		}
 	}
 
 	assert(q == ctx->queue);
-	struct message_queue *nq = skynet_globalmq_pop();
+	if (grouped) {
+		charge_group(ctx, q, cost_start, mono_start);
+	}
+	if (skynet_mq_isexclusive(q)) {
+		// 服务在本批次中切换到了独占线程，把处理权交给它
+		skynet_context_release(ctx);
+		skynet_globalmq_push(q);
+		return skynet_localmq_pop(worker);
+	}
+	struct message_queue *nq = skynet_localmq_pop(worker);
 	if (nq) {
 		// If global mq is not empty , push q back, and return next queue (nq)
 		// Else (global mq is empty or block, don't push q back, and return q again (for next dispatch)
-		// 如果全局消息队列不为空，将当前队列推回，返回下一个队列
-		// 否则（全局队列为空或阻塞），不推回当前队列，继续返回当前队列用于下次分发
+		// 如果运行队列（本地、全局或可窃取的）不为空，将当前队列推回本线程的本地队列，返回下一个队列
+		// 否则（运行队列为空或阻塞），不推回当前队列，继续返回当前队列用于下次分发
 		skynet_globalmq_push(q);
 		q = nq;
 	} 
@@ -480,6 +1326,78 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 	return q;
 }
 
+/*
+ * 独占工作线程
+ * 只处理一个服务的消息队列，不访问任何运行队列，服务退出后线程结束
+ * @param p: 独占模式的消息队列
+ */
+static void *
+thread_exclusive(void *p) {
+	struct message_queue *q = p;
+	uint32_t handle = skynet_mq_handle(q);
+	skynet_initthread(THREAD_WORKER);
+	for (;;) {
+		skynet_mq_exclusive_wait(q);
+		struct skynet_context * ctx;
+		for (;;) {
+			ctx = skynet_handle_grab(handle);
+			if (ctx)
+				break;
+			struct drop_t d = { handle };
+			if (skynet_mq_exclusive_release(q, drop_message, &d)) {
+				return NULL;
+			}
+			// 服务已经退出，但上下文还被其他地方引用，稍后再检查
+			usleep(1000);
+		}
+		struct skynet_message msg;
+		// 队列空了之后线程会等待，下一轮重新读时钟
+		struct dispatch_clock clock = { 0, 0 };
+		while (!skynet_mq_pop(q, &msg)) {
+			int overload = skynet_mq_overload(q);
+			if (overload) {
+				skynet_error(ctx, "error: May overload, message queue length = %d", overload);
+			}
+			D.source = msg.source;
+			if (ctx->cb == NULL) {
+				message_free(&msg);
+			} else {
+				dispatch_message(ctx, &msg, &clock);
+			}
+		}
+		// 队列已空，in_global被清除，下次有消息时会再次唤醒本线程
+		skynet_context_release(ctx);
+	}
+}
+
+/*
+ * 带缓存的本地名称查找
+ * 按名称长度和首字符直接映射到一个缓存项，长名称不缓存
+ * @param context: 当前服务，可以为NULL（不使用缓存）
+ * @param name: 不带'.'前缀的名称
+ */
+static uint32_t
+findname_cached(struct skynet_context * context, const char * name) {
+	if (context == NULL)
+		return skynet_handle_findname(name);
+	size_t len = strlen(name);
+	if (len >= GLOBALNAME_LENGTH)
+		return skynet_handle_findname(name);
+	struct name_cache *c = &context_cold(context)->name_cache[(len + (unsigned char)name[0]) % NAME_CACHE_SIZE];
+	// 先读版本号再查找，期间如果有名称被删除，下次检查时版本号不一致
+	int version = skynet_handle_nameversion();
+	if (c->handle && c->version == version && memcmp(c->name, name, len + 1) == 0) {
+		return c->handle;
+	}
+	uint32_t handle = skynet_handle_findname(name);
+	if (handle) {
+		c->version = version;
+		c->handle = handle;
+		memcpy(c->name, name, len + 1);
+	}
+	return handle;
+}
+
 static void
 copy_name(char name[GLOBALNAME_LENGTH], const char * addr) {
 	int i;
@@ -497,7 +1415,7 @@ skynet_queryname(struct skynet_context * context, const char * name) {
 	case ':':
 		return strtoul(name+1,NULL,16);
 	case '.':
-		return skynet_handle_findname(name + 1);
+		return findname_cached(context, name + 1);
 	}
 	skynet_error(context, "error: Don't support query global name %s",name);
 	return 0;
@@ -530,16 +1448,58 @@ cmd_timeout(struct skynet_context * context, const char * param) {
 	char * session_ptr = NULL;
 	int ti = strtol(param, &session_ptr, 10);
 	int session = skynet_context_newsession(context);
-	skynet_timeout(context->handle, ti, session);
-	sprintf(context->result, "%d", session);
-	return context->result;
+	if (*session_ptr == '.') {
+		// fractional centisecond, for the high resolution timer
+		double t = strtod(param, NULL);
+		skynet_timeout_ms(context->handle, (int)(t * 10 + 0.5), session);
+	} else {
+		skynet_timeout(context->handle, ti, session);
+	}
+	sprintf(context->cold->result, "%d", session);
+	return context->cold->result;
+}
+
+// 周期定时器，参数和TIMEOUT相同（厘秒，可以有小数），每个周期收到一条session相同的超时消息，用UNTIMEOUT取消
+static const char *
+cmd_tick(struct skynet_context * context, const char * param) {
+	double t = strtod(param, NULL);
+	if (t > 0x7fffffff / 10)
+		t = 0x7fffffff / 10;
+	int session = skynet_context_newsession(context);
+	skynet_timeout_periodic(context->handle, (int)(t * 10 + 0.5), session);
+	sprintf(context->cold->result, "%d", session);
+	return context->cold->result;
+}
+
+static const char *
+cmd_untimeout(struct skynet_context * context, const char * param) {
+	int session = strtol(param, NULL, 10);
+	if (skynet_timeout_cancel(context->handle, session)) {
+		// the timer has fired (or never existed), the response message will still arrive
+		return NULL;
+	}
+	sprintf(context->cold->result, "%d", session);
+	return context->cold->result;
+}
+
+static const char *
+cmd_timerbatch(struct skynet_context * context, const char * param) {
+	context->timer_batch = true;
+	return NULL;
+}
+
+// 服务声明处理消息时从不保留data（回调总是返回0），skynet_sendmulti可以把共享负载直接发给它；参数为"off"时取消
+static const char *
+cmd_sharedmsg(struct skynet_context * context, const char * param) {
+	context->shared_msg = !(param && strcmp(param, "off") == 0);
+	return NULL;
 }
 
 static const char *
 cmd_reg(struct skynet_context * context, const char * param) {
 	if (param == NULL || param[0] == '\0') {
-		sprintf(context->result, ":%x", context->handle);
-		return context->result;
+		sprintf(context->cold->result, ":%x", context->handle);
+		return context->cold->result;
 	} else if (param[0] == '.') {
 		return skynet_handle_namehandle(context->handle, param + 1);
 	} else {
@@ -553,8 +1513,8 @@ cmd_query(struct skynet_context * context, const char * param) {
 	if (param[0] == '.') {
 		uint32_t handle = skynet_handle_findname(param+1);
 		if (handle) {
-			sprintf(context->result, ":%x", handle);
-			return context->result;
+			sprintf(context->cold->result, ":%x", handle);
+			return context->cold->result;
 		}
 	}
 	return NULL;
@@ -622,8 +1582,26 @@ cmd_launch(struct skynet_context * context, const char * param) {
 	if (inst == NULL) {
 		return NULL;
 	} else {
-		id_to_hex(context->result, inst->handle);
-		return context->result;
+		id_to_hex(context->cold->result, inst->handle);
+		return context->cold->result;
+	}
+}
+
+// 和LAUNCH一样，但服务在收到第一条消息时才初始化，见skynet_context_lazy
+static const char *
+cmd_lazylaunch(struct skynet_context * context, const char * param) {
+	size_t sz = strlen(param);
+	char tmp[sz+1];
+	strcpy(tmp,param);
+	char * args = tmp;
+	char * mod = strsep(&args, " \t\r\n");
+	args = strsep(&args, "\r\n");
+	uint32_t handle = skynet_context_lazy(mod,args);
+	if (handle == 0) {
+		return NULL;
+	} else {
+		id_to_hex(context->cold->result, handle);
+		return context->cold->result;
 	}
 }
 
@@ -653,8 +1631,8 @@ cmd_setenv(struct skynet_context * context, const char * param) {
 static const char *
 cmd_starttime(struct skynet_context * context, const char * param) {
 	uint32_t sec = skynet_starttime();
-	sprintf(context->result,"%u",sec);
-	return context->result;
+	sprintf(context->cold->result,"%u",sec);
+	return context->cold->result;
 }
 
 static const char *
@@ -670,8 +1648,8 @@ cmd_monitor(struct skynet_context * context, const char * param) {
 		if (G_NODE.monitor_exit) {
 			// return current monitor serivce
 			// 返回当前监控服务
-			sprintf(context->result, ":%x", G_NODE.monitor_exit);
-			return context->result;
+			sprintf(context->cold->result, ":%x", G_NODE.monitor_exit);
+			return context->cold->result;
 		}
 		return NULL;
 	} else {
@@ -681,35 +1659,114 @@ cmd_monitor(struct skynet_context * context, const char * param) {
 	return NULL;
 }
 
+/*
+ * 延迟统计的查询
+ * wait_ 为排队时间， cost_ 为处理时间，后缀为 count, mean, max 或百分位数 p50, p99, p99.9 等
+ * 时间单位为秒
+ */
+static int
+stat_latency(struct skynet_context * context, const char * param) {
+	struct skynet_histogram *h;
+	if (strncmp(param, "wait_", 5) == 0) {
+		h = &context->latency->wait;
+	} else if (strncmp(param, "cost_", 5) == 0) {
+		h = &context->latency->cost;
+	} else {
+		return 0;
+	}
+	const char * what = param + 5;
+	double t;
+	if (strcmp(what, "count") == 0) {
+		sprintf(context->cold->result, "%" PRIu64, h->count);
+		return 1;
+	} else if (strcmp(what, "mean") == 0) {
+		t = h->count ? (double)h->sum / h->count : 0;
+	} else if (strcmp(what, "max") == 0) {
+		t = (double)h->max;
+	} else if (what[0] == 'p') {
+		char * endptr = NULL;
+		double p = strtod(what + 1, &endptr);
+		if (endptr == what + 1 || *endptr != '\0' || p < 0 || p > 100)
+			return 0;
+		t = (double)histogram_percentile(h, p);
+	} else {
+		return 0;
+	}
+	sprintf(context->cold->result, "%.9f", t / 1000000000.0);
+	return 1;
+}
+
 static const char *
 cmd_stat(struct skynet_context * context, const char * param) {
 	if (strcmp(param, "mqlen") == 0) {
 		int len = skynet_mq_length(context->queue);
-		sprintf(context->result, "%d", len);
+		sprintf(context->cold->result, "%d", len);
 	} else if (strcmp(param, "endless") == 0) {
 		if (context->endless) {
-			strcpy(context->result, "1");
+			strcpy(context->cold->result, "1");
 			context->endless = false;
 		} else {
-			strcpy(context->result, "0");
+			strcpy(context->cold->result, "0");
 		}
 	} else if (strcmp(param, "cpu") == 0) {
 		double t = (double)context->cpu_cost / 1000000.0;	// microsec 微秒
-		sprintf(context->result, "%lf", t);
+		sprintf(context->cold->result, "%lf", t);
 	} else if (strcmp(param, "time") == 0) {
 		if (context->profile) {
 			uint64_t ti = skynet_thread_time() - context->cpu_start;
 			double t = (double)ti / 1000000.0;	// microsec 微秒
-			sprintf(context->result, "%lf", t);
+			sprintf(context->cold->result, "%lf", t);
 		} else {
-			strcpy(context->result, "0");
+			strcpy(context->cold->result, "0");
 		}
 	} else if (strcmp(param, "message") == 0) {
-		sprintf(context->result, "%zu", context->message_count);
+		sprintf(context->cold->result, "%zu", context->message_count);
+	} else if (strcmp(param, "weight") == 0) {
+		// 调度权重：-1每次一条，>=0处理队列长度>>weight条，-2为自适应
+		sprintf(context->cold->result, "%d", context->weight);
+	} else if (strcmp(param, "batch") == 0) {
+		sprintf(context->cold->result, "%d", context->batch);
+	} else if (strcmp(param, "dropped") == 0) {
+		// 因背压被拒绝投递到本服务的消息数量
+		sprintf(context->cold->result, "%d", skynet_mq_dropped(context->queue));
+	} else if (strcmp(param, "exclusive") == 0) {
+		// 独占线程被唤醒的次数，非独占服务返回0
+		uint64_t wakeup = 0, wait = 0;
+		skynet_mq_exclusive_stat(context->queue, &wakeup, &wait);
+		sprintf(context->cold->result, "%" PRIu64, wakeup);
+	} else if (strcmp(param, "exclusive_wait") == 0) {
+		// 独占线程从被调度到开始处理的累计等待时间（秒）
+		uint64_t wakeup = 0, wait = 0;
+		skynet_mq_exclusive_stat(context->queue, &wakeup, &wait);
+		sprintf(context->cold->result, "%lf", (double)wait / 1000000000.0);
+	} else if (strcmp(param, "wakeup") == 0) {
+		// 整个节点的工作线程唤醒次数
+		uint64_t count, nsec;
+		skynet_wakeup_stat(&count, &nsec);
+		sprintf(context->cold->result, "%" PRIu64, count);
+	} else if (strcmp(param, "wakeup_cost") == 0) {
+		// 整个节点的工作线程唤醒累计延迟（秒）
+		uint64_t count, nsec;
+		skynet_wakeup_stat(&count, &nsec);
+		sprintf(context->cold->result, "%lf", (double)nsec / 1000000000.0);
+	} else if (strcmp(param, "stall") == 0) {
+		// 处理一条消息超过 monitor_stall 毫秒的次数
+		sprintf(context->cold->result, "%d", ATOM_LOAD(&context->stall));
+	} else if (strcmp(param, "inline") == 0) {
+		// 在发送方线程中直接处理的请求数量
+		sprintf(context->cold->result, "%zu", context->inline_count);
+	} else if (strcmp(param, "expired") == 0) {
+		// 过期后被丢弃的消息数量
+		sprintf(context->cold->result, "%d", context->expired);
+	} else if (strcmp(param, "latency") == 0) {
+		// 是否开启了延迟统计
+		strcpy(context->cold->result, context->latency ? "1" : "0");
+	} else if (context->latency && stat_latency(context, param)) {
+		// wait_xxx 或 cost_xxx ，见 stat_latency
 	} else {
-		context->result[0] = '\0';
+		context->cold->result[0] = '\0';
 	}
-	return context->result;
+	return context->cold->result;
 }
 
 static const char *
@@ -777,14 +1834,176 @@ cmd_signal(struct skynet_context * context, const char * param) {
 	return NULL;
 }
 
+static const char *
+cmd_mqring(struct skynet_context * context, const char * param) {
+	int size = 0;
+	if (param && param[0]) {
+		size = strtol(param, NULL, 10);
+	}
+	int cap = skynet_mq_ring(context->queue, size);
+	sprintf(context->cold->result, "%d", cap);
+	return context->cold->result;
+}
+
+static const char *
+cmd_mqpriority(struct skynet_context * context, const char * param) {
+	skynet_mq_priority(context->queue);
+	return NULL;
+}
+
+static const char *
+cmd_mqlimit(struct skynet_context * context, const char * param) {
+	int limit = -1;
+	if (param && param[0]) {
+		limit = strtol(param, NULL, 10);
+	}
+	sprintf(context->cold->result, "%d", skynet_mq_limit(context->queue, limit));
+	return context->cold->result;
+}
+
+/*
+ * TTL ti
+ * 设置本服务之后发出的消息的有效期（1/100秒，0表示不过期），过期还没被处理的消息会被接收方丢弃（见message_expired）
+ * ti小于0时只查询，返回原来的有效期
+ */
+static const char *
+cmd_ttl(struct skynet_context * context, const char * param) {
+	int ttl = -1;
+	if (param && param[0]) {
+		ttl = strtol(param, NULL, 10);
+	}
+	sprintf(context->cold->result, "%d", context->ttl);
+	if (ttl >= 0) {
+		context->ttl = ttl;
+	}
+	return context->cold->result;
+}
+
+/*
+ * WORKER n
+ * 调整整个节点的工作线程数量（不超过配置项thread_max），n不大于0时只查询，返回调整后的数量
+ */
+static const char *
+cmd_worker(struct skynet_context * context, const char * param) {
+	int n = 0;
+	if (param && param[0]) {
+		n = strtol(param, NULL, 10);
+	}
+	sprintf(context->cold->result, "%d", skynet_worker_resize(n));
+	return context->cold->result;
+}
+
+/*
+ * INLINE on|off
+ * 允许发送方的工作线程在本服务空闲时直接处理发给它的请求（见context_inline），适合调用频繁的服务对
+ */
+static const char *
+cmd_inline(struct skynet_context * context, const char * param) {
+	context->inline_call = (param == NULL || strcmp(param, "off") != 0);
+	return NULL;
+}
+
+/*
+ * GROUP [name [:handle]]
+ * 把服务（默认是自己）移到调度组（见skynet_mq.c和配置项sched_group），没有参数时返回自己所在组的名称
+ */
+static const char *
+cmd_group(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		const char * name = skynet_mq_group_stat(skynet_mq_group(context->queue, -1), NULL, NULL);
+		strcpy(context->cold->result, name);
+		return context->cold->result;
+	}
+	char name[32];
+	size_t sz = strcspn(param, " ");
+	if (sz >= sizeof(name))
+		return NULL;
+	memcpy(name, param, sz);
+	name[sz] = '\0';
+	int group = skynet_mq_groupid(name);
+	if (group < 0) {
+		skynet_error(context, "error: Unknown scheduling group %s", name);
+		return NULL;
+	}
+	uint32_t handle = context->handle;
+	if (param[sz] == ' ') {
+		handle = tohandle(context, param + sz + 1);
+		if (handle == 0)
+			return NULL;
+	}
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL)
+		return NULL;
+	skynet_mq_group(ctx->queue, group);
+	skynet_context_release(ctx);
+	strcpy(context->cold->result, name);
+	return context->cold->result;
+}
+
+/*
+ * REDIRECT :target
+ * 服务迁移到别的节点之前调用，退出之后发给它的请求都转给target（代理服务）；没有参数时取消
+ */
+static const char *
+cmd_redirect(struct skynet_context * context, const char * param) {
+	uint32_t target = 0;
+	if (param && param[0]) {
+		target = tohandle(context, param);
+		if (target == 0)
+			return NULL;
+	}
+	skynet_handle_redirect(context->handle, target);
+	return NULL;
+}
+
+// on, off 或 reset （清空记录）
+static const char *
+cmd_latency(struct skynet_context * context, const char * param) {
+	if (param == NULL || strcmp(param, "on") == 0) {
+		latency_enable(context, 1);
+	} else if (strcmp(param, "reset") == 0) {
+		if (context->latency) {
+			histogram_reset(&context->latency->wait);
+			histogram_reset(&context->latency->cost);
+		}
+	} else if (strcmp(param, "off") == 0) {
+		latency_enable(context, 0);
+	}
+	return NULL;
+}
+
+static const char *
+cmd_exclusive(struct skynet_context * context, const char * param) {
+	if (skynet_mq_exclusive(context->queue)) {
+		// already exclusive
+		return NULL;
+	}
+	pthread_t pid;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&pid, &attr, thread_exclusive, context->queue)) {
+		fprintf(stderr, "Create exclusive thread failed");
+		exit(1);
+	}
+	pthread_attr_destroy(&attr);
+	sprintf(context->cold->result, ":%x", context->handle);
+	return context->cold->result;
+}
+
 static struct command_func cmd_funcs[] = {
 	{ "TIMEOUT", cmd_timeout },
+	{ "UNTIMEOUT", cmd_untimeout },
+	{ "TICK", cmd_tick },
+	{ "TIMERBATCH", cmd_timerbatch },
+	{ "SHAREDMSG", cmd_sharedmsg },
 	{ "REG", cmd_reg },
 	{ "QUERY", cmd_query },
 	{ "NAME", cmd_name },
 	{ "EXIT", cmd_exit },
 	{ "KILL", cmd_kill },
 	{ "LAUNCH", cmd_launch },
+	{ "LAZYLAUNCH", cmd_lazylaunch },
 	{ "GETENV", cmd_getenv },
 	{ "SETENV", cmd_setenv },
 	{ "STARTTIME", cmd_starttime },
@@ -794,6 +2013,16 @@ static struct command_func cmd_funcs[] = {
 	{ "LOGON", cmd_logon },
 	{ "LOGOFF", cmd_logoff },
 	{ "SIGNAL", cmd_signal },
+	{ "MQRING", cmd_mqring },
+	{ "EXCLUSIVE", cmd_exclusive },
+	{ "MQPRIORITY", cmd_mqpriority },
+	{ "MQLIMIT", cmd_mqlimit },
+	{ "LATENCY", cmd_latency },
+	{ "REDIRECT", cmd_redirect },
+	{ "INLINE", cmd_inline },
+	{ "GROUP", cmd_group },
+	{ "TTL", cmd_ttl },
+	{ "WORKER", cmd_worker },
 	{ NULL, NULL },
 };
 
@@ -802,6 +2031,7 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 	struct command_func * method = &cmd_funcs[0];
 	while(method->name) {
 		if (strcmp(cmd, method->name) == 0) {
+			context_cold(context);	// 命令的结果写在context->cold->result中
 			return method->func(context, param);
 		}
 		++method;
@@ -822,7 +2052,7 @@ _filter_args(struct skynet_context * context, int type, int *session, void ** da
 	}
 
 	if (needcopy && *data) {
-		char * msg = skynet_malloc(*sz+1);
+		char * msg = skynet_slab_alloc(*sz+1);
 		memcpy(msg, *data, *sz);
 		msg[*sz] = '\0';
 		*data = msg;
@@ -833,7 +2063,7 @@ _filter_args(struct skynet_context * context, int type, int *session, void ** da
 
 int
 skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * data, size_t sz) {
-	if ((sz & MESSAGE_TYPE_MASK) != sz) {
+	if ((sz & MESSAGE_SIZE_MASK) != sz) {
 		skynet_error(context, "error: The message to %x is too large", destination);
 		if (type & PTYPE_TAG_DONTCOPY) {
 			skynet_free(data);
@@ -845,17 +2075,23 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 	if (source == 0) {
 		source = context->handle;
 	}
+	SKYNET_PROBE5(send, source, destination, type & 0xff, session, sz & MESSAGE_SIZE_MASK);
 
 	if (destination == 0) {
 		if (data) {
 			skynet_error(context, "error: Destination address can't be 0");
-			skynet_free(data);
+			skynet_message_free(data, sz & MESSAGE_SIZE_MASK);
 			return -1;
 		}
 
 		return session;
 	}
 	if (skynet_harbor_message_isremote(destination)) {
+		if (skynet_message_finalized(data, sz & MESSAGE_SIZE_MASK)) {
+			skynet_error(context, "error: The message to %x holds references, it can't leave the process", destination);
+			skynet_message_free(data, sz & MESSAGE_SIZE_MASK);
+			return -1;
+		}
 		struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
 		rmsg->destination.handle = destination;
 		rmsg->message = data;
@@ -868,15 +2104,97 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 		smsg.session = session;
 		smsg.data = data;
 		smsg.sz = sz;
+		smsg.deadline = send_deadline(context, sz >> MESSAGE_TYPE_SHIFT);
 
-		if (skynet_context_push(destination, &smsg)) {
-			skynet_free(data);
-			return -1;
+		int ret = context_send(context, destination, &smsg);
+		if (ret) {
+			skynet_message_free(data, sz & MESSAGE_SIZE_MASK);
+			return ret;
 		}
 	}
 	return session;
 }
 
+int
+skynet_sendmulti(struct skynet_context * context, uint32_t source, const uint32_t * destination, int n, int type, int session, void * data, size_t sz, int * result) {
+	int i;
+	int count = 0;
+	if ((sz & MESSAGE_SIZE_MASK) != sz) {
+		skynet_error(context, "error: The message to %d destinations is too large", n);
+		if (type & PTYPE_TAG_DONTCOPY) {
+			skynet_free(data);
+		}
+		if (result) {
+			for (i=0;i<n;i++) {
+				result[i] = -2;
+			}
+		}
+		return 0;
+	}
+	if (source == 0) {
+		source = context->handle;
+	}
+	if ((type & PTYPE_TAG_DONTCOPY) && skynet_message_finalized(data, sz)) {
+		// 负载带着引用，复制出的每一份都不持有它们
+		skynet_error(context, "error: The message to %d destinations holds references, it can't be shared", n);
+		skynet_message_free(data, sz);
+		if (result) {
+			for (i=0;i<n;i++) {
+				result[i] = -1;
+			}
+		}
+		return 0;
+	}
+	// 发送者自己持有一个引用，发完再放掉，中途不会被接收者释放
+	struct shared_message * sm = shared_new(data, sz);
+	if (type & PTYPE_TAG_DONTCOPY) {
+		skynet_message_free(data, sz);
+	}
+	void * payload = shared_data(sm);
+	int allocsession = type & PTYPE_TAG_ALLOCSESSION;
+	int copytype = type & ~(PTYPE_TAG_DONTCOPY);
+	type &= 0xff;
+	for (i=0;i<n;i++) {
+		uint32_t des = destination[i];
+		int ret;
+		struct skynet_context * ctx = NULL;
+		if (des != 0 && !skynet_harbor_message_isremote(des)) {
+			ctx = skynet_handle_grab(des);
+		}
+		if (des == 0) {
+			ret = -1;
+		} else if (ctx && ctx->shared_msg) {
+			struct skynet_message smsg;
+			smsg.source = source;
+			smsg.session = allocsession ? skynet_context_newsession(context) : session;
+			smsg.data = payload;
+			smsg.sz = sz | MESSAGE_SHARED | (size_t)type << MESSAGE_TYPE_SHIFT;
+			smsg.deadline = send_deadline(context, type);
+			if (skynet_mq_full(ctx->queue, &smsg)) {
+				ret = -3;
+			} else {
+				ATOM_FINC(&sm->ref);
+				skynet_mq_push(ctx->queue, &smsg);
+				ret = smsg.session;
+			}
+		} else {
+			// 远程、不存在或者可能保留data的服务，按skynet_send的方式各复制一份
+			ret = skynet_send(context, source, des, copytype, session, payload, sz);
+		}
+		if (ctx) {
+			skynet_context_release(ctx);
+		}
+		if (ret >= 0) {
+			++count;
+		}
+		if (result) {
+			result[i] = ret;
+		}
+	}
+	shared_release(payload);
+	return count;
+}
+
 int
 skynet_sendname(struct skynet_context * context, uint32_t source, const char * addr , int type, int session, void * data, size_t sz) {
 	if (source == 0) {
@@ -886,21 +2204,26 @@ skynet_sendname(struct skynet_context * context, uint32_t source, const char * a
 	if (addr[0] == ':') {
 		des = strtoul(addr+1, NULL, 16);
 	} else if (addr[0] == '.') {
-		des = skynet_handle_findname(addr + 1);
+		des = findname_cached(context, addr + 1);
 		if (des == 0) {
 			if (type & PTYPE_TAG_DONTCOPY) {
-				skynet_free(data);
+				skynet_message_free(data, sz);
 			}
 			return -1;
 		}
 	} else {
-		if ((sz & MESSAGE_TYPE_MASK) != sz) {
+		if ((sz & MESSAGE_SIZE_MASK) != sz) {
 			skynet_error(context, "error: The message to %s is too large", addr);
 			if (type & PTYPE_TAG_DONTCOPY) {
 				skynet_free(data);
 			}
 			return -2;
 		}
+		if (skynet_message_finalized(data, sz)) {
+			skynet_error(context, "error: The message to %s holds references, it can't leave the process", addr);
+			skynet_message_free(data, sz);
+			return -1;
+		}
 		_filter_args(context, type, &session, (void **)&data, &sz);
 
 		struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
@@ -922,6 +2245,18 @@ skynet_context_handle(struct skynet_context *ctx) {
 	return ctx->handle;
 }
 
+/*
+ * 设置服务的消息日志，之前的日志被关闭，NULL表示关闭
+ * 只能在服务自己的线程中调用（处理消息时），分发消息也在这个线程中读它
+ */
+void
+skynet_context_journal(struct skynet_context *ctx, struct skynet_journal *j) {
+	if (ctx->journal) {
+		skynet_journal_close(ctx->journal);
+	}
+	ctx->journal = j;
+}
+
 void 
 skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb) {
 	context->cb = cb;
@@ -935,6 +2270,7 @@ skynet_context_send(struct skynet_context * ctx, void * msg, size_t sz, uint32_t
 	smsg.session = session;
 	smsg.data = msg;
 	smsg.sz = sz | (size_t)type << MESSAGE_TYPE_SHIFT;
+	smsg.deadline = 0;
 
 	skynet_mq_push(ctx->queue, &smsg);
 }
@@ -943,6 +2279,9 @@ void
 skynet_globalinit(void) {
 	ATOM_INIT(&G_NODE.total , 0);
 	G_NODE.monitor_exit = 0;
+	spinlock_init(&G_NODE.free_lock);
+	spinlock_init(&F.lock);
+	G_NODE.free_ctx = NULL;
 	G_NODE.init = 1;
 	if (pthread_key_create(&G_NODE.handle_key, NULL)) {
 		fprintf(stderr, "pthread_key_create failed");
@@ -968,3 +2307,15 @@ void
 skynet_profile_enable(int enable) {
 	G_NODE.profile = (bool)enable;
 }
+
+void
+skynet_latency_enable(int enable) {
+	G_NODE.latency = (bool)enable;
+}
+
+void
+skynet_weight_budget(int microsec) {
+	if (microsec <= 0)
+		microsec = WEIGHT_BUDGET_DEFAULT;
+	G_NODE.weight_budget = (uint64_t)microsec;
+}
@@ -9,6 +9,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+// 自适应调度权重：由队列长度、消息耗时和已占用时间决定每次分发的消息数量
+#define WEIGHT_ADAPTIVE -2
+// 自适应调度的默认时间预算（微秒）
+#define WEIGHT_BUDGET_DEFAULT 1000
+// 提供批量接口的服务每次分发最多处理的消息数量
+#define DISPATCH_BATCH 64
+
 // 前向声明
 struct skynet_context;
 struct skynet_message;
@@ -20,10 +27,15 @@ struct skynet_monitor;
 
 // 创建新的服务上下文
 struct skynet_context * skynet_context_new(const char * name, const char * parm);
+// 延迟启动的服务，收到第一条消息时才创建服务实例并初始化，返回handle，失败返回0
+uint32_t skynet_context_lazy(const char * name, const char * parm);
 
 // 增加服务引用计数
 void skynet_context_grab(struct skynet_context *);
 
+// 引用计数不为0且handle匹配时增加引用（供无锁查找使用），成功返回1
+int skynet_context_trygrab(struct skynet_context *, uint32_t handle);
+
 // 保留服务上下文
 void skynet_context_reserve(struct skynet_context *ctx);
 
@@ -33,17 +45,39 @@ struct skynet_context * skynet_context_release(struct skynet_context *);
 // 获取服务handle
 uint32_t skynet_context_handle(struct skynet_context *);
 
+struct skynet_journal;
+// 设置服务的消息日志（见skynet_journal.h），关闭之前的日志，只能在服务自己的线程中调用
+void skynet_context_journal(struct skynet_context *, struct skynet_journal *);
+
+/*
+ * 服务的运行统计
+ */
+struct skynet_service_stat {
+	int mqlen;              // 消息队列长度
+	int dropped;            // 因背压被拒绝的消息数量
+	size_t message;         // 处理的消息数量
+	uint64_t cpu;           // CPU消耗时间（微秒），未开启profile时为0
+	int stall;              // 处理消息超时的次数
+	int expired;            // 过期后被丢弃的消息数量
+};
+
+// 读取服务的运行统计，服务不存在时返回0
+int skynet_context_stat(uint32_t handle, struct skynet_service_stat *stat);
+
 // 向指定handle推送消息
 int skynet_context_push(uint32_t handle, struct skynet_message *message);
 
+// 投递一批同时到期的超时事件（定时器线程使用）
+int skynet_context_pushtimeout(uint32_t handle, int *session, int n);
+
 // 发送消息
 void skynet_context_send(struct skynet_context * context, void * msg, size_t sz, uint32_t source, int type, int session);
 
 // 创建新的会话ID
 int skynet_context_newsession(struct skynet_context *);
 
-// 消息分发处理（返回下一个队列）
-struct message_queue * skynet_context_message_dispatch(struct skynet_monitor *, struct message_queue *, int weight);	// return next queue
+// 消息分发处理（返回下一个队列），worker为当前工作线程id
+struct message_queue * skynet_context_message_dispatch(struct skynet_monitor *, struct message_queue *, int weight, int worker);	// return next queue
 
 // 获取当前活跃服务总数
 int skynet_context_total();
@@ -51,8 +85,8 @@ int skynet_context_total();
 // 分发服务的所有消息（用于退出前的错误输出）
 void skynet_context_dispatchall(struct skynet_context * context);	// for skynet_error output before exit
 
-// 标记服务为无限循环状态（用于监控）
-void skynet_context_endless(uint32_t handle);	// for monitor
+// 标记服务为无限循环状态（用于监控），并累计超时次数；signal不小于0时同时给服务发信号
+void skynet_context_endless(uint32_t handle, int signal);
 
 /*
  * 全局初始化接口
@@ -70,4 +104,10 @@ void skynet_initthread(int m);
 // 启用/禁用性能分析
 void skynet_profile_enable(int enable);
 
+// 新服务是否默认开启延迟统计（排队时间和处理时间的直方图）
+void skynet_latency_enable(int enable);
+
+// 设置自适应调度的时间预算（微秒）
+void skynet_weight_budget(int microsec);
+
 #endif
@@ -10,31 +10,102 @@
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_harbor.h"
+#include "skynet_probe.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-// 全局socket服务器实例
-static struct socket_server * SOCKET_SERVER = NULL;
+#include "atomic.h"
+
+// 全局socket服务器实例，每个socket线程一个分片
+static struct socket_server ** SOCKET_SERVER = NULL;
+static int SOCKET_N = 0;
+static ATOM_INT SOCKET_NEXT;    // 新建的socket轮流分配到各个分片
+
+// 批量模式下一个消息最多合并的数据数量
+#define BATCH_MAX 64
+
+// 发给同一个服务、还没有投递的数据
+struct socket_batch {
+	uint32_t handle;
+	int n;
+	struct skynet_socket_message item[BATCH_MAX];
+};
+
+// 每个分片积攒的批量数据，只在分片自己的socket线程中使用
+struct batch_list {
+	int n;
+	int cap;
+	struct socket_batch **b;
+};
+
+static struct batch_list * SOCKET_BATCH_LIST = NULL;
+
+// socket ID所在的分片
+static inline struct socket_server *
+socket_shard(int id) {
+	return SOCKET_SERVER[(unsigned)id % SOCKET_N];
+}
+
+// 为新建的socket选择一个分片
+static inline struct socket_server *
+socket_next() {
+	if (SOCKET_N == 1)
+		return SOCKET_SERVER[0];
+	return SOCKET_SERVER[(unsigned)ATOM_FINC(&SOCKET_NEXT) % SOCKET_N];
+}
 
 /*
  * 初始化socket系统
  * 创建socket服务器实例
+ * @param poll: 事件模型名称，不支持时退回平台默认的epoll/kqueue
+ * @param n: 分片数量（socket线程数量）
+ * @param max: 进程最多的socket数量，平均分给各个分片，0表示每个分片用默认值
  */
 void
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create(skynet_now());
+skynet_socket_init(const char *poll, int n, int max) {
+	if (socket_server_backend(poll)) {
+		skynet_error(NULL, "socket_poll %s is not supported, use the default", poll);
+	}
+	if (n < 1)
+		n = 1;
+	SOCKET_SERVER = skynet_malloc(n * sizeof(struct socket_server *));
+	SOCKET_BATCH_LIST = skynet_malloc(n * sizeof(struct batch_list));
+	memset(SOCKET_BATCH_LIST, 0, n * sizeof(struct batch_list));
+	SOCKET_N = n;
+	ATOM_INIT(&SOCKET_NEXT, 0);
+	int per = max > 0 ? (max + n - 1) / n : 0;
+	int i;
+	for (i=0;i<n;i++) {
+		SOCKET_SERVER[i] = socket_server_create(skynet_now(), per);
+	}
+	socket_server_group(SOCKET_SERVER, n);
+}
+
+/*
+ * 设置socket线程阻塞等待之前忙轮询的时间（见socket_server_busypoll）
+ * @param usec: 微秒，0表示不忙轮询
+ */
+void
+skynet_socket_busypoll(int usec) {
+	int i;
+	for (i=0;i<SOCKET_N;i++) {
+		socket_server_busypoll(SOCKET_SERVER[i], usec);
+	}
 }
 
 /*
  * 退出socket系统
- * 通知socket服务器准备退出
+ * 通知所有socket线程准备退出
  */
 void
 skynet_socket_exit() {
-	socket_server_exit(SOCKET_SERVER);
+	int i;
+	for (i=0;i<SOCKET_N;i++) {
+		socket_server_exit(SOCKET_SERVER[i]);
+	}
 }
 
 /*
@@ -43,8 +114,21 @@ skynet_socket_exit() {
  */
 void
 skynet_socket_free() {
-	socket_server_release(SOCKET_SERVER);
+	int i;
+	for (i=0;i<SOCKET_N;i++) {
+		socket_server_release(SOCKET_SERVER[i]);
+		struct batch_list *bl = &SOCKET_BATCH_LIST[i];
+		int j;
+		for (j=0;j<bl->n;j++) {
+			skynet_free(bl->b[j]);
+		}
+		skynet_free(bl->b);
+	}
+	skynet_free(SOCKET_SERVER);
 	SOCKET_SERVER = NULL;
+	skynet_free(SOCKET_BATCH_LIST);
+	SOCKET_BATCH_LIST = NULL;
+	SOCKET_N = 0;
 }
 
 /*
@@ -53,7 +137,11 @@ skynet_socket_free() {
  */
 void
 skynet_socket_updatetime() {
-	socket_server_updatetime(SOCKET_SERVER, skynet_now());
+	uint64_t now = skynet_now();
+	int i;
+	for (i=0;i<SOCKET_N;i++) {
+		socket_server_updatetime(SOCKET_SERVER[i], now);
+	}
 }
 
 // mainloop thread
@@ -73,7 +161,7 @@ forward_message(int type, bool padding, struct socket_message * result) {
 			result->data = "";
 		}
 	}
-	sm = (struct skynet_socket_message *)skynet_malloc(sz);
+	sm = (struct skynet_socket_message *)skynet_slab_alloc(sz);
 	sm->type = type;
 	sm->id = result->id;
 	sm->ud = result->ud;
@@ -89,6 +177,7 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	message.session = 0;
 	message.data = sm;
 	message.sz = sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
+	message.deadline = 0;
 	
 	if (skynet_context_push((uint32_t)result->opaque, &message)) {
 		// todo: report somewhere to close socket
@@ -100,16 +189,137 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	}
 }
 
+/*
+ * 批量投递
+ * 同一轮事件里发给同一个服务的数据合并成一个SKYNET_SOCKET_TYPE_BATCH消息，
+ * 消息头后面紧跟id个SKYNET_SOCKET_TYPE_DATA的skynet_socket_message
+ * 只有一条数据时仍然按SKYNET_SOCKET_TYPE_DATA投递
+ */
+static void
+batch_flush(struct socket_batch *b) {
+	int n = b->n;
+	if (n == 0)
+		return;
+	b->n = 0;
+	struct skynet_message message;
+	message.source = 0;
+	message.session = 0;
+	message.deadline = 0;
+	size_t sz = sizeof(struct skynet_socket_message);
+	struct skynet_socket_message *sm;
+	if (n == 1) {
+		sm = (struct skynet_socket_message *)skynet_slab_alloc(sz);
+		*sm = b->item[0];
+	} else {
+		sz += n * sizeof(struct skynet_socket_message);
+		sm = (struct skynet_socket_message *)skynet_malloc(sz);
+		sm->type = SKYNET_SOCKET_TYPE_BATCH;
+		sm->id = n;
+		sm->ud = 0;
+		sm->buffer = NULL;
+		memcpy(sm+1, b->item, n * sizeof(struct skynet_socket_message));
+	}
+	message.data = sm;
+	message.sz = sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
+	if (skynet_context_push(b->handle, &message)) {
+		int i;
+		for (i=0;i<n;i++) {
+			skynet_free(b->item[i].buffer);
+		}
+		skynet_free(sm);
+	}
+}
+
+static struct socket_batch *
+batch_find(struct batch_list *bl, uint32_t handle) {
+	int i;
+	for (i=0;i<bl->n;i++) {
+		if (bl->b[i]->handle == handle)
+			return bl->b[i];
+	}
+	return NULL;
+}
+
+// 批量模式的数据先留在目标服务的列表中，满了再投递
+static void
+batch_push(struct batch_list *bl, struct socket_message *result) {
+	uint32_t handle = (uint32_t)result->opaque;
+	struct socket_batch *b = batch_find(bl, handle);
+	if (b == NULL) {
+		if (bl->n >= bl->cap) {
+			int cap = bl->cap ? bl->cap * 2 : 4;
+			struct socket_batch **nb = skynet_malloc(cap * sizeof(struct socket_batch *));
+			if (bl->n > 0)
+				memcpy(nb, bl->b, bl->n * sizeof(struct socket_batch *));
+			skynet_free(bl->b);
+			bl->b = nb;
+			bl->cap = cap;
+		}
+		b = skynet_malloc(sizeof(*b));
+		b->handle = handle;
+		b->n = 0;
+		bl->b[bl->n++] = b;
+	}
+	struct skynet_socket_message *sm = &b->item[b->n++];
+	sm->type = SKYNET_SOCKET_TYPE_DATA;
+	sm->id = result->id;
+	sm->ud = result->ud;
+	sm->buffer = result->data;
+	if (b->n == BATCH_MAX) {
+		batch_flush(b);
+	}
+}
+
+// 同一个socket的其它事件不能越过之前留下的数据
+static inline void
+batch_before(struct batch_list *bl, struct socket_message *result) {
+	if (bl->n > 0) {
+		struct socket_batch *b = batch_find(bl, (uint32_t)result->opaque);
+		if (b)
+			batch_flush(b);
+	}
+}
+
+// 一轮事件结束，发出所有留下的数据，这一轮没有数据的服务从列表中去掉
+static void
+batch_flushall(struct batch_list *bl) {
+	int i = 0;
+	while (i < bl->n) {
+		struct socket_batch *b = bl->b[i];
+		if (b->n == 0) {
+			skynet_free(b);
+			bl->b[i] = bl->b[--bl->n];
+		} else {
+			batch_flush(b);
+			++i;
+		}
+	}
+}
+
 int 
-skynet_socket_poll() {
-	struct socket_server *ss = SOCKET_SERVER;
+skynet_socket_poll(int shard) {
+	struct socket_server *ss = SOCKET_SERVER[shard];
 	assert(ss);
+	struct batch_list *bl = &SOCKET_BATCH_LIST[shard];
 	struct socket_message result;
 	int more = 1;
 	int type = socket_server_poll(ss, &result, &more);
 	switch (type) {
+	case SOCKET_BATCH:
+		batch_push(bl, &result);
+		return -1;
+	case SOCKET_IDLE:
+		batch_flushall(bl);
+		return 1;
 	case SOCKET_EXIT:
+		batch_flushall(bl);
 		return 0;
+	default:
+		batch_before(bl, &result);
+		SKYNET_PROBE4(socket__event, shard, type, result.id, result.ud);
+		break;
+	}
+	switch (type) {
 	case SOCKET_DATA:
 		forward_message(SKYNET_SOCKET_TYPE_DATA, false, &result);
 		break;
@@ -143,88 +353,196 @@ skynet_socket_poll() {
 
 int
 skynet_socket_sendbuffer(struct skynet_context *ctx, struct socket_sendbuffer *buffer) {
-	return socket_server_send(SOCKET_SERVER, buffer);
+	return socket_server_send(socket_shard(buffer->id), buffer);
 }
 
 int
 skynet_socket_sendbuffer_lowpriority(struct skynet_context *ctx, struct socket_sendbuffer *buffer) {
-	return socket_server_send_lowpriority(SOCKET_SERVER, buffer);
+	return socket_server_send_lowpriority(socket_shard(buffer->id), buffer);
+}
+
+int
+skynet_socket_sendfile(struct skynet_context *ctx, int id, int fd, int64_t offset, int64_t size) {
+	return socket_server_sendfile(socket_shard(id), id, fd, offset, size);
+}
+
+int
+skynet_socket_broadcast(struct skynet_context *ctx, const int *id, int n, struct socket_sendbuffer *buffer) {
+	struct socket_sharedbuffer *sb = socket_server_sharedbuffer(SOCKET_SERVER[0], buffer);
+	int count = 0;
+	if (SOCKET_N == 1) {
+		count = socket_server_broadcast(SOCKET_SERVER[0], sb, id, n);
+	} else if (n > 0) {
+		// 按分片拆开，每个分片一个请求，共享同一个缓冲区
+		int * tmp = skynet_malloc(n * sizeof(int));
+		int i, j;
+		for (i=0;i<SOCKET_N;i++) {
+			int m = 0;
+			for (j=0;j<n;j++) {
+				if ((unsigned)id[j] % SOCKET_N == i)
+					tmp[m++] = id[j];
+			}
+			if (m > 0)
+				count += socket_server_broadcast(SOCKET_SERVER[i], sb, tmp, m);
+		}
+		skynet_free(tmp);
+	}
+	socket_server_sharedbuffer_release(sb);
+	return count;
+}
+
+struct socket_sharedbuffer *
+skynet_socket_sharedbuffer(struct skynet_context *ctx, struct socket_sendbuffer *buffer) {
+	return socket_server_sharedbuffer(SOCKET_SERVER[0], buffer);
+}
+
+void
+skynet_socket_sharedbuffer_release(struct socket_sharedbuffer *sb) {
+	socket_server_sharedbuffer_release(sb);
+}
+
+int
+skynet_socket_sendshared(struct skynet_context *ctx, int id, struct socket_sharedbuffer *sb) {
+	return socket_server_broadcast(socket_shard(id), sb, &id, 1) == 1 ? 0 : -1;
 }
 
 int 
 skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
+	return socket_server_listen(socket_next(), source, host, port, backlog);
+}
+
+/*
+ * 在每个分片中以SO_REUSEPORT各监听一次同一个端口
+ * @param id: 输出每个分片的监听socket ID，长度至少为skynet_socket_shards()
+ * @return: 监听socket的数量，失败返回-1（已经创建的监听socket会被关闭）
+ */
+int
+skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog, int *id) {
+	uint32_t source = skynet_context_handle(ctx);
+	int i;
+	for (i=0;i<SOCKET_N;i++) {
+		id[i] = socket_server_listen_reuseport(SOCKET_SERVER[i], source, host, &port, backlog);
+		if (id[i] < 0) {
+			int j;
+			for (j=0;j<i;j++) {
+				socket_server_close(SOCKET_SERVER[j], source, id[j]);
+			}
+			return -1;
+		}
+	}
+	return SOCKET_N;
+}
+
+// socket分片（socket线程）的数量
+int
+skynet_socket_shards() {
+	return SOCKET_N;
 }
 
 int 
 skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_connect(SOCKET_SERVER, source, host, port);
+	return socket_server_connect(socket_next(), source, host, port);
 }
 
 int 
 skynet_socket_bind(struct skynet_context *ctx, int fd) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_bind(SOCKET_SERVER, source, fd);
+	return socket_server_bind(socket_next(), source, fd);
 }
 
 void 
 skynet_socket_close(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_close(SOCKET_SERVER, source, id);
+	socket_server_close(socket_shard(id), source, id);
 }
 
 void 
 skynet_socket_shutdown(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_shutdown(SOCKET_SERVER, source, id);
+	socket_server_shutdown(socket_shard(id), source, id);
 }
 
 void 
 skynet_socket_start(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_start(SOCKET_SERVER, source, id);
+	socket_server_start(socket_shard(id), source, id);
 }
 
 void
 skynet_socket_pause(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_pause(SOCKET_SERVER, source, id);
+	socket_server_pause(socket_shard(id), source, id);
 }
 
 
 void
 skynet_socket_nodelay(struct skynet_context *ctx, int id) {
-	socket_server_nodelay(SOCKET_SERVER, id);
+	socket_server_nodelay(socket_shard(id), id);
+}
+
+void
+skynet_socket_coalesce(struct skynet_context *ctx, int id, int enable) {
+	socket_server_coalesce(socket_shard(id), id, enable);
+}
+
+void
+skynet_socket_flush(struct skynet_context *ctx, int id) {
+	socket_server_flush(socket_shard(id), id);
+}
+
+void
+skynet_socket_batch(struct skynet_context *ctx, int id, int enable) {
+	socket_server_batch(socket_shard(id), id, enable);
+}
+
+void
+skynet_socket_watermark(struct skynet_context *ctx, int id, int high, int low) {
+	socket_server_watermark(socket_shard(id), id, high, low);
+}
+
+void
+skynet_socket_admission(struct skynet_context *ctx, int id, const struct socket_admission_conf *conf) {
+	socket_server_admission(socket_shard(id), id, conf);
+}
+
+void
+skynet_socket_consumed(struct skynet_context *ctx, int id, uint64_t consumed) {
+	socket_server_consumed(socket_shard(id), id, consumed);
 }
 
 int 
 skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_udp(SOCKET_SERVER, source, addr, port);
+	return socket_server_udp(socket_next(), source, addr, port);
 }
 
 int
 skynet_socket_udp_dial(struct skynet_context *ctx, const char * addr, int port){
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_udp_dial(SOCKET_SERVER, source, addr, port);
+	return socket_server_udp_dial(socket_next(), source, addr, port);
 }
 
 int
 skynet_socket_udp_listen(struct skynet_context *ctx, const char * addr, int port){
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_udp_listen(SOCKET_SERVER, source, addr, port);
+	return socket_server_udp_listen(socket_next(), source, addr, port);
 }
 
 int 
 skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port) {
-	return socket_server_udp_connect(SOCKET_SERVER, id, addr, port);
+	return socket_server_udp_connect(socket_shard(id), id, addr, port);
+}
+
+int
+skynet_socket_reliable(struct skynet_context *ctx, int id) {
+	return socket_server_reliable(socket_shard(id), id);
 }
 
 int 
 skynet_socket_udp_sendbuffer(struct skynet_context *ctx, const char * address, struct socket_sendbuffer *buffer) {
-	return socket_server_udp_send(SOCKET_SERVER, (const struct socket_udp_address *)address, buffer);
+	return socket_server_udp_send(socket_shard(buffer->id), (const struct socket_udp_address *)address, buffer);
 }
 
 const char *
@@ -237,10 +555,43 @@ skynet_socket_udp_address(struct skynet_socket_message *msg, int *addrsz) {
 	sm.opaque = 0;
 	sm.ud = msg->ud;
 	sm.data = msg->buffer;
-	return (const char *)socket_server_udp_address(SOCKET_SERVER, &sm, addrsz);
+	return (const char *)socket_server_udp_address(socket_shard(sm.id), &sm, addrsz);
 }
 
 struct socket_info *
 skynet_socket_info() {
-	return socket_server_info(SOCKET_SERVER);
+	struct socket_info *si = NULL;
+	int i;
+	for (i=SOCKET_N-1;i>=0;i--) {
+		struct socket_info *head = socket_server_info(SOCKET_SERVER[i]);
+		if (head) {
+			struct socket_info *tail = head;
+			while (tail->next)
+				tail = tail->next;
+			tail->next = si;
+			si = head;
+		}
+	}
+	return si;
+}
+
+int
+skynet_socket_service_stat(struct socket_service_stat *stat, int n) {
+	int count = 0;
+	int i;
+	for (i=0;i<SOCKET_N;i++) {
+		int left = n > count ? n - count : 0;
+		count += socket_server_service_stat(SOCKET_SERVER[i], stat + (n > count ? count : n), left);
+	}
+	return count;
+}
+
+void
+skynet_socket_recycle(void *buffer, int sz) {
+	socket_server_recycle(buffer, sz);
+}
+
+void *
+skynet_socket_alloc(int sz) {
+	return socket_server_alloc(sz);
 }
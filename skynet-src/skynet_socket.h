@@ -20,6 +20,7 @@ struct skynet_context;
 #define SKYNET_SOCKET_TYPE_ERROR 5      // 错误消息
 #define SKYNET_SOCKET_TYPE_UDP 6        // UDP消息
 #define SKYNET_SOCKET_TYPE_WARNING 7    // 警告消息
+#define SKYNET_SOCKET_TYPE_BATCH 8      // 批量数据：id是数量，消息头后面紧跟id个SKYNET_SOCKET_TYPE_DATA消息
 
 /*
  * skynet socket消息结构体
@@ -36,8 +37,11 @@ struct skynet_socket_message {
  * socket系统管理
  */
 
-// 初始化socket系统
-void skynet_socket_init();
+// 初始化socket系统，poll为事件模型名称，NULL使用平台默认；n为socket线程（分片）数量
+void skynet_socket_init(const char *poll, int n, int max);
+
+// socket线程阻塞等待之前忙轮询的时间（微秒），0表示不忙轮询
+void skynet_socket_busypoll(int usec);
 
 // 退出socket系统
 void skynet_socket_exit();
@@ -45,8 +49,8 @@ void skynet_socket_exit();
 // 释放socket系统资源
 void skynet_socket_free();
 
-// 轮询socket事件
-int skynet_socket_poll();
+// 轮询第shard个分片的socket事件，每个socket线程负责一个分片
+int skynet_socket_poll(int shard);
 
 // 更新socket系统时间
 void skynet_socket_updatetime();
@@ -61,9 +65,26 @@ int skynet_socket_sendbuffer(struct skynet_context *ctx, struct socket_sendbuffe
 // 低优先级发送数据缓冲区
 int skynet_socket_sendbuffer_lowpriority(struct skynet_context *ctx, struct socket_sendbuffer *buffer);
 
+// 发送文件片段，fd的所有权交给socket服务器
+int skynet_socket_sendfile(struct skynet_context *ctx, int id, int fd, int64_t offset, int64_t size);
+
+// 把同一份数据发给n个socket，数据只复制一次，返回排队的socket数量
+int skynet_socket_broadcast(struct skynet_context *ctx, const int *id, int n, struct socket_sendbuffer *buffer);
+
+// 不变的共享缓冲区（比如缓存的应答），创建时复制一次，之后每次发送只增加引用
+struct socket_sharedbuffer * skynet_socket_sharedbuffer(struct skynet_context *ctx, struct socket_sendbuffer *buffer);
+void skynet_socket_sharedbuffer_release(struct socket_sharedbuffer *sb);
+int skynet_socket_sendshared(struct skynet_context *ctx, int id, struct socket_sharedbuffer *sb);
+
 // 监听TCP端口
 int skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog);
 
+// 在每个socket分片中以SO_REUSEPORT监听同一端口，id输出各分片的监听socket，返回数量，失败返回-1
+int skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog, int *id);
+
+// socket分片（socket线程）的数量
+int skynet_socket_shards();
+
 // 连接到TCP服务器
 int skynet_socket_connect(struct skynet_context *ctx, const char *host, int port);
 
@@ -85,6 +106,20 @@ void skynet_socket_pause(struct skynet_context *ctx, int id);
 // 设置TCP无延迟选项
 void skynet_socket_nodelay(struct skynet_context *ctx, int id);
 
+// 合并发送模式，写入的数据等到flush时一次发出
+void skynet_socket_coalesce(struct skynet_context *ctx, int id, int enable);
+void skynet_socket_flush(struct skynet_context *ctx, int id);
+
+// 批量投递模式，同一轮事件里发给同一个服务的数据合并成一个SKYNET_SOCKET_TYPE_BATCH消息，见socket_server_batch
+void skynet_socket_batch(struct skynet_context *ctx, int id, int enable);
+
+// 读水位，见socket_server_watermark
+void skynet_socket_watermark(struct skynet_context *ctx, int id, int high, int low);
+void skynet_socket_consumed(struct skynet_context *ctx, int id, uint64_t consumed);
+
+// 准入控制和读限速，见socket_server_admission
+void skynet_socket_admission(struct skynet_context *ctx, int id, const struct socket_admission_conf *conf);
+
 /*
  * UDP通信接口
  */
@@ -107,12 +142,23 @@ int skynet_socket_udp_sendbuffer(struct skynet_context *ctx, const char * addres
 // 获取UDP消息的地址信息
 const char * skynet_socket_udp_address(struct skynet_socket_message *, int *addrsz);
 
+// 把UDP socket转为可靠UDP
+int skynet_socket_reliable(struct skynet_context *ctx, int id);
+
 /*
  * socket信息查询
  */
 
 // 获取socket信息
 struct socket_info * skynet_socket_info();
+// 按服务汇总的socket统计，每个分片各有一项，同一个服务可能出现多次；返回项数，大于n时需要更大的数组
+int skynet_socket_service_stat(struct socket_service_stat *stat, int n);
+
+// 回收SKYNET_SOCKET_TYPE_DATA消息的数据缓冲区，sz是消息的ud，读数据时可以复用；也可以直接用skynet_free释放
+void skynet_socket_recycle(void *buffer, int sz);
+
+// 从读缓冲池分配至少sz字节，用完后可以用skynet_socket_recycle放回
+void * skynet_socket_alloc(int sz);
 
 // legacy APIs
 /*
@@ -3,6 +3,11 @@
  * 负责初始化各个子系统、创建和管理工作线程
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// pthread_setaffinity_np 和 cpu_set_t 需要 _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "skynet.h"
 #include "skynet_server.h"
 #include "skynet_imp.h"
@@ -14,6 +19,11 @@
 #include "skynet_socket.h"
 #include "skynet_daemon.h"
 #include "skynet_harbor.h"
+#include "skynet_trace.h"
+#include "skynet_journal.h"
+#include "malloc_hook.h"
+#include "spinlock.h"
+#include "atomic.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -22,19 +32,79 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <sched.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#define USE_FUTEX_PARK
+#define USE_THREAD_AFFINITY
+#endif
+
+#define MAX_AFFINITY_CPU 1024   // CPU列表中允许的最大CPU编号
+#define MAX_NUMA_NODE 64        // 支持的最大NUMA节点数
+
+/*
+ * 工作线程的休眠槽
+ * 每个工作线程独立休眠，唤醒时只影响被选中的线程，避免惊群和全局互斥锁争用
+ * Linux下使用futex，其他平台使用每线程独立的互斥锁和条件变量
+ */
+struct worker_park {
+	ATOM_INT state;                 // 1表示休眠中，0表示已被唤醒（futex字）
+	ATOM_ULONG wake_time;           // 唤醒方发出唤醒时的单调时钟（纳秒）
+	int retired;                    // 线程被移除后在这里休眠（不在parked栈中），由skynet_worker_resize重新启用
+#ifndef USE_FUTEX_PARK
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+/*
+ * CPU集合，用于线程绑定
+ */
+struct cpu_set {
+	int n;                          // CPU数量
+	int cpu[MAX_AFFINITY_CPU];      // CPU编号列表
+};
+
+struct worker_parm;
 
 /*
  * 监控器结构体，用于管理所有工作线程
+ * 工作线程的数量可以在运行时调整（见skynet_worker_resize），数组都按上限max分配，
+ * id不小于count的线程被移除，休眠在自己的休眠槽中；线程只在第一次用到时创建，之后不会退出
  */
 struct monitor {
-	int count;                      // 工作线程总数
-	struct skynet_monitor ** m;     // 每个工作线程对应的监控器数组
-	pthread_cond_t cond;            // 条件变量，用于线程间同步
-	pthread_mutex_t mutex;          // 互斥锁，保护共享数据
+	int count;                      // 工作线程数量（不含被移除的）
+	int max;                        // 工作线程数量的上限（配置项thread_max）
+	int min;                        // 自动伸缩的下限（配置项thread_min），0表示不自动伸缩
+	ATOM_INT created;               // 已创建的工作线程数量
+	pthread_t * pid;                // 已创建的工作线程
+	struct worker_parm * wp;        // 每个工作线程的参数
+	struct skynet_monitor ** m;     // 每个工作线程对应的监控器数组，创建线程时分配
+	struct worker_park * park;      // 每个工作线程的休眠槽
+	int * parked;                   // 休眠线程id栈，栈顶为最近休眠的线程（缓存最热）
+	struct spinlock lock;           // 保护count、parked、sleep、retired和quit
+	pthread_mutex_t resize;         // 串行化skynet_worker_resize
 	int sleep;                      // 当前睡眠的线程数量
 	int quit;                       // 退出标志
+	int stall;                      // 处理一条消息超过多少毫秒时报告
+	int traceback;                  // 报告时是否让服务输出调用栈
+	int spin;                       // 忙轮询模式下空闲线程休眠前自旋的时间（微秒），0表示不自旋
+	ATOM_INT spinning;              // 正在自旋的线程数量（最多一个），有它时不需要唤醒休眠的线程
+	struct cpu_set * cpu;           // 工作线程绑定的CPU列表，n为0表示不绑定
+	struct cpu_set * node;          // NUMA模式下每个节点的CPU列表
+	int nodes;                      // NUMA节点数量，0表示未开启
+	int arena[MAX_NUMA_NODE];       // 每个NUMA节点的jemalloc arena
 };
 
+// 唤醒统计：唤醒次数和从发出唤醒到工作线程恢复运行的累计延迟（纳秒）
+static ATOM_ULONG WAKEUP_COUNT;
+static ATOM_ULONG WAKEUP_NSEC;
+
+// 运行中的监控器，供 skynet_worker_stat 和 skynet_worker_resize 使用
+static struct monitor * M = NULL;
+
 /*
  * 工作线程参数结构体
  */
@@ -42,6 +112,15 @@ struct worker_parm {
 	struct monitor *m;              // 指向监控器的指针
 	int id;                         // 线程ID
 	int weight;                     // 工作权重，决定每次处理的消息数量
+	int arena;                      // NUMA模式下绑定的jemalloc arena，-1表示不绑定
+};
+
+/*
+ * socket线程参数结构体
+ */
+struct socket_parm {
+	struct monitor *m;              // 指向监控器的指针
+	int shard;                      // 负责的socket分片
 };
 
 // 全局信号标志，用于处理SIGHUP信号
@@ -75,21 +154,254 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 	}
 }
 
+/*
+ * 初始化工作线程休眠槽
+ */
+static void
+park_init(struct worker_park *p) {
+	ATOM_INIT(&p->state, 0);
+	ATOM_INIT(&p->wake_time, 0);
+#ifndef USE_FUTEX_PARK
+	if (pthread_mutex_init(&p->mutex, NULL)) {
+		fprintf(stderr, "Init mutex error");
+		exit(1);
+	}
+	if (pthread_cond_init(&p->cond, NULL)) {
+		fprintf(stderr, "Init cond error");
+		exit(1);
+	}
+#endif
+}
+
+static void
+park_destroy(struct worker_park *p) {
+#ifndef USE_FUTEX_PARK
+	pthread_mutex_destroy(&p->mutex);
+	pthread_cond_destroy(&p->cond);
+#else
+	(void)p;
+#endif
+}
+
+/*
+ * 工作线程休眠，直到被唤醒方把state清零
+ * 调用前state已在monitor锁内置为1并入栈，所以唤醒不会丢失
+ */
+static void
+park_wait(struct worker_park *p) {
+#ifdef USE_FUTEX_PARK
+	while (ATOM_LOAD(&p->state) == 1) {
+		syscall(SYS_futex, (int *)&p->state, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+	}
+#else
+	pthread_mutex_lock(&p->mutex);
+	while (ATOM_LOAD(&p->state) == 1) {
+		pthread_cond_wait(&p->cond, &p->mutex);
+	}
+	pthread_mutex_unlock(&p->mutex);
+#endif
+}
+
+/*
+ * 唤醒一个已经出栈的休眠线程
+ */
+static void
+park_wake(struct worker_park *p) {
+	ATOM_STORE(&p->wake_time, skynet_monotonic_time());
+#ifdef USE_FUTEX_PARK
+	ATOM_STORE(&p->state, 0);
+	syscall(SYS_futex, (int *)&p->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&p->mutex);
+	ATOM_STORE(&p->state, 0);
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+#endif
+}
+
+/*
+ * 解析CPU列表字符串，格式与Linux cpulist相同，如 "0-3,8,10-11"
+ * @param str: CPU列表字符串，NULL或空串表示不绑定
+ * @param set: 输出的CPU集合
+ * @return: CPU数量，格式错误时退出进程
+ */
+static int
+parse_cpuset(const char *str, struct cpu_set *set) {
+	set->n = 0;
+	if (str == NULL)
+		return 0;
+	const char *p = str;
+	while (*p) {
+		char *endptr;
+		long from = strtol(p, &endptr, 10);
+		long to = from;
+		if (endptr == p)
+			goto _error;
+		p = endptr;
+		if (*p == '-') {
+			++p;
+			to = strtol(p, &endptr, 10);
+			if (endptr == p)
+				goto _error;
+			p = endptr;
+		}
+		if (from < 0 || to < from || to >= MAX_AFFINITY_CPU)
+			goto _error;
+		for (;from <= to; from++) {
+			if (set->n < MAX_AFFINITY_CPU) {
+				set->cpu[set->n++] = (int)from;
+			}
+		}
+		while (*p == ',' || *p == ' ')
+			++p;
+	}
+	return set->n;
+_error:
+	fprintf(stderr, "Invalid cpu list : %s\n", str);
+	exit(1);
+}
+
+/*
+ * 将线程绑定到一组CPU上
+ * @param thread: 线程
+ * @param cpu: CPU编号数组
+ * @param n: CPU数量，0表示不绑定
+ */
+static void
+bind_thread(pthread_t thread, const int *cpu, int n) {
+	if (n <= 0)
+		return;
+#ifdef USE_THREAD_AFFINITY
+	cpu_set_t cs;
+	CPU_ZERO(&cs);
+	int i;
+	for (i=0;i<n;i++) {
+		CPU_SET(cpu[i], &cs);
+	}
+	int err = pthread_setaffinity_np(thread, sizeof(cs), &cs);
+	if (err) {
+		skynet_error(NULL, "error: Set thread affinity failed (%s)", strerror(err));
+	}
+#else
+	skynet_error(NULL, "error: Thread affinity is not supported on this platform");
+#endif
+}
+
+/*
+ * 读取每个NUMA节点的CPU列表（/sys/devices/system/node/nodeN/cpulist）
+ * @param node: 输出的各节点CPU集合
+ * @return: NUMA节点数量，无法获取时返回0
+ */
+static int
+numa_nodes(struct cpu_set *node) {
+	int n;
+	for (n=0;n<MAX_NUMA_NODE;n++) {
+		char path[64];
+		char line[1024];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			break;
+		if (fgets(line, sizeof(line), f) == NULL) {
+			line[0] = '\0';
+		}
+		fclose(f);
+		line[strcspn(line, "\r\n")] = '\0';
+		parse_cpuset(line, &node[n]);
+	}
+	return n;
+}
+
+/*
+ * 查找CPU所在的NUMA节点
+ * @return: 节点编号，找不到时返回0
+ */
+static int
+cpu_node(struct cpu_set *node, int nodes, int cpu) {
+	int i,j;
+	for (i=0;i<nodes;i++) {
+		for (j=0;j<node[i].n;j++) {
+			if (node[i].cpu[j] == cpu)
+				return i;
+		}
+	}
+	return 0;
+}
+
 /*
  * 唤醒睡眠中的工作线程
+ * 只唤醒一个线程，并且选择最近休眠的那个（栈顶），它的缓存最可能还是热的
+ * 有线程在自旋时（忙轮询模式）不唤醒
  * @param m: 监控器指针
  * @param busy: 当前忙碌的线程数量
  */
 static void
 wakeup(struct monitor *m, int busy) {
+	if (ATOM_LOAD(&m->spinning)) {
+		// 自旋中的线程马上会取走新的消息，比唤醒休眠的线程快
+		return;
+	}
 	if (m->sleep >= m->count - busy) {
-		// signal sleep worker, "spurious wakeup" is harmless
-		// 如果睡眠线程数量足够多，则唤醒一个线程
-		// "虚假唤醒"是无害的
-		pthread_cond_signal(&m->cond);
+		int id = -1;
+		SPIN_LOCK(m)
+		if (m->sleep > 0) {
+			id = m->parked[--m->sleep];
+		}
+		SPIN_UNLOCK(m)
+		if (id >= 0) {
+			park_wake(&m->park[id]);
+		}
 	}
 }
 
+/*
+ * 唤醒所有睡眠中和被移除的工作线程（退出时使用）
+ */
+static void
+wakeup_all(struct monitor *m) {
+	int n;
+	int id[m->max];
+	SPIN_LOCK(m)
+	m->quit = 1;
+	n = m->sleep;
+	memcpy(id, m->parked, n * sizeof(int));
+	m->sleep = 0;
+	int i, created = ATOM_LOAD(&m->created);
+	for (i=0;i<created;i++) {
+		if (m->park[i].retired) {
+			m->park[i].retired = 0;
+			id[n++] = i;
+		}
+	}
+	SPIN_UNLOCK(m)
+	for (i=0;i<n;i++) {
+		park_wake(&m->park[id[i]]);
+	}
+}
+
+/*
+ * 获取工作线程的唤醒统计
+ * @param count: 输出唤醒次数
+ * @param nsec: 输出从发出唤醒到线程恢复运行的累计延迟（纳秒）
+ */
+void
+skynet_wakeup_stat(uint64_t *count, uint64_t *nsec) {
+	*count = ATOM_LOAD(&WAKEUP_COUNT);
+	*nsec = ATOM_LOAD(&WAKEUP_NSEC);
+}
+
+void
+skynet_worker_stat(int *count, int *sleep) {
+	struct monitor * m = M;
+	if (m == NULL) {
+		*count = 0;
+		*sleep = 0;
+		return;
+	}
+	*count = m->count;
+	*sleep = m->sleep;
+}
+
 /*
  * socket线程函数
  * 负责处理网络I/O事件，轮询socket状态
@@ -98,10 +410,11 @@ wakeup(struct monitor *m, int busy) {
  */
 static void *
 thread_socket(void *p) {
-	struct monitor * m = p;
+	struct socket_parm *sp = p;
+	struct monitor * m = sp->m;
 	skynet_initthread(THREAD_SOCKET);  // 初始化线程类型为socket线程
 	for (;;) {
-		int r = skynet_socket_poll();  // 轮询socket事件
+		int r = skynet_socket_poll(sp->shard);  // 轮询本分片的socket事件
 		if (r==0)
 			break;  // 没有更多socket事件，退出
 		if (r<0) {
@@ -120,19 +433,83 @@ thread_socket(void *p) {
 static void
 free_monitor(struct monitor *m) {
 	int i;
-	int n = m->count;
+	int created = ATOM_LOAD(&m->created);
 	// 删除所有线程监控器
-	for (i=0;i<n;i++) {
+	for (i=0;i<created;i++) {
 		skynet_monitor_delete(m->m[i]);
 	}
+	for (i=0;i<m->max;i++) {
+		park_destroy(&m->park[i]);
+	}
 	// 销毁同步原语
-	pthread_mutex_destroy(&m->mutex);
-	pthread_cond_destroy(&m->cond);
+	SPIN_DESTROY(m)
+	pthread_mutex_destroy(&m->resize);
 	// 释放内存
+	skynet_free(m->pid);
+	skynet_free(m->wp);
 	skynet_free(m->m);
+	skynet_free(m->park);
+	skynet_free(m->parked);
+	skynet_free(m->cpu);
+	skynet_free(m->node);
 	skynet_free(m);
 }
 
+/*
+ * 自动伸缩（配置了thread_min时）：监控线程每次检查时采样，每个周期（AUTOSCALE_PERIOD毫秒）决定一次
+ * 整个周期都没有线程休眠并且运行队列中有服务在等待，增加一个工作线程；
+ * 连续AUTOSCALE_SHRINK个周期都至少有两个线程在休眠，减少一个
+ */
+#define AUTOSCALE_SAMPLE 100
+#define AUTOSCALE_PERIOD 1000
+#define AUTOSCALE_SHRINK 5
+
+struct autoscale {
+	uint64_t start;                 // 本周期开始的时间（毫秒）
+	int samples;                    // 本周期的采样次数
+	int busy;                       // 没有线程休眠并且运行队列不为空的次数
+	int idle;                       // 至少两个线程休眠的次数
+	int quiet;                      // 连续空闲的周期数
+};
+
+static void
+autoscale(struct monitor *m, struct autoscale *as, uint64_t now) {
+	int local;
+	int pending = skynet_globalmq_length(&local) + local;
+	int sleep = m->sleep;
+	++as->samples;
+	if (sleep == 0 && pending > 0)
+		++as->busy;
+	else if (sleep >= 2)
+		++as->idle;
+	if (as->start == 0) {
+		as->start = now;
+		return;
+	}
+	if (now - as->start < AUTOSCALE_PERIOD)
+		return;
+	int count = m->count;
+	if (as->busy == as->samples) {
+		as->quiet = 0;
+		if (count < m->max) {
+			skynet_worker_resize(count + 1);
+		}
+	} else if (as->idle == as->samples) {
+		if (++as->quiet >= AUTOSCALE_SHRINK) {
+			as->quiet = 0;
+			if (count > m->min) {
+				skynet_worker_resize(count - 1);
+			}
+		}
+	} else {
+		as->quiet = 0;
+	}
+	as->start = now;
+	as->samples = 0;
+	as->busy = 0;
+	as->idle = 0;
+}
+
 /*
  * 监控线程函数
  * 负责监控所有工作线程的状态，检测死锁等异常情况
@@ -143,20 +520,32 @@ static void *
 thread_monitor(void *p) {
 	struct monitor * m = p;
 	int i;
-	int n = m->count;
+	// 检查间隔是阈值的1/5，所以报告时的实际耗时误差不超过20%
+	int interval = m->stall / 5;
+	if (interval < 10)
+		interval = 10;
+	else if (interval > 1000)
+		interval = 1000;
+	if (m->min > 0 && interval > AUTOSCALE_SAMPLE) {
+		// 自动伸缩需要更密的采样
+		interval = AUTOSCALE_SAMPLE;
+	}
+	struct autoscale as;
+	memset(&as, 0, sizeof(as));
 	skynet_initthread(THREAD_MONITOR);  // 初始化线程类型为监控线程
 	for (;;) {
 		CHECK_ABORT  // 检查是否应该退出
 		// 检查所有工作线程的状态
+		uint64_t now = skynet_monotonic_time() / 1000000;
+		int n = ATOM_LOAD(&m->created);
 		for (i=0;i<n;i++) {
-			skynet_monitor_check(m->m[i]);
+			skynet_monitor_check(m->m[i], now, m->stall, m->traceback);
 		}
-		// 每5秒检查一次
-		// 使用循环分开调用是为了更快的触发 abort
-		for (i=0;i<5;i++) {
-			CHECK_ABORT
-			sleep(1);
+		if (m->min > 0) {
+			autoscale(m, &as, now);
 		}
+		// 间隔不超过1秒，可以很快的触发 abort
+		usleep(interval * 1000);
 	}
 
 	return NULL;
@@ -175,6 +564,7 @@ signal_hup() {
 	smsg.session = 0;
 	smsg.data = NULL;
 	smsg.sz = (size_t)PTYPE_SYSTEM << MESSAGE_TYPE_SHIFT;
+	smsg.deadline = 0;
 	// 查找logger服务
 	uint32_t logger = skynet_handle_findname("logger");
 	if (logger) {
@@ -198,7 +588,8 @@ thread_timer(void *p) {
 		skynet_socket_updatetime(); // 更新socket超时时间
 		CHECK_ABORT                 // 检查是否应该退出
 		wakeup(m,m->count-1);       // 唤醒工作线程处理定时器事件
-		usleep(2500);               // 休眠2.5毫秒，控制定时器精度
+		malloc_fold();              // 合并本线程的内存统计
+		skynet_timer_sleep();       // 休眠到下一次更新，间隔取决于定时器精度
 		if (SIG) {
 			signal_hup();           // 处理SIGHUP信号
 			SIG = 0;
@@ -209,13 +600,53 @@ thread_timer(void *p) {
 	skynet_socket_exit();           // 通知socket线程退出
 	// wakeup all worker thread
 	// 唤醒所有工作线程退出
-	pthread_mutex_lock(&m->mutex);
-	m->quit = 1;
-	pthread_cond_broadcast(&m->cond);
-	pthread_mutex_unlock(&m->mutex);
+	wakeup_all(m);
 	return NULL;
 }
 
+/*
+ * 忙轮询模式下，空闲的工作线程在休眠之前自旋一段时间，期间有消息就直接处理，省掉唤醒的延迟
+ * 同时只有一个线程自旋，其他的照常休眠
+ * @return: 自旋期间取到的消息队列，没有返回NULL
+ */
+static struct message_queue *
+worker_spin(struct monitor *m, struct skynet_monitor *sm, int weight, int id) {
+	if (!ATOM_CAS(&m->spinning, 0, 1))
+		return NULL;
+	struct message_queue *q = NULL;
+	uint64_t deadline = skynet_monotonic_time() + (uint64_t)m->spin * 1000;
+	while (!m->quit && id < m->count) {
+		q = skynet_context_message_dispatch(sm, NULL, weight, id);
+		if (q || skynet_monotonic_time() >= deadline)
+			break;
+		// CPU不够分时让出来，不和要处理消息的线程抢
+		sched_yield();
+	}
+	ATOM_STORE(&m->spinning, 0);
+	if (q == NULL) {
+		// 不再自旋后，这期间到达的消息不会唤醒别的线程，休眠之前再检查一次
+		q = skynet_context_message_dispatch(sm, NULL, weight, id);
+	}
+	return q;
+}
+
+/*
+ * 被移除的工作线程把本地队列交给全局队列，然后休眠到被重新启用或者退出
+ */
+static void
+worker_retire(struct monitor *m, struct worker_park *park, int id) {
+	skynet_mq_worker_retire(id);
+	SPIN_LOCK(m)
+	if (m->quit || id < m->count) {
+		SPIN_UNLOCK(m)
+		return;
+	}
+	ATOM_STORE(&park->state, 1);
+	park->retired = 1;
+	SPIN_UNLOCK(m)
+	park_wait(park);
+}
+
 /*
  * 工作线程函数
  * 负责处理服务的消息队列，执行具体的业务逻辑
@@ -229,100 +660,318 @@ thread_worker(void *p) {
 	int weight = wp->weight;                // 工作权重
 	struct monitor *m = wp->m;              // 监控器
 	struct skynet_monitor *sm = m->m[id];   // 该线程对应的监控器
+	struct worker_park *park = &m->park[id];// 该线程的休眠槽
 	skynet_initthread(THREAD_WORKER);       // 初始化线程类型为工作线程
+	if (wp->arena >= 0) {
+		// NUMA模式下，使用本节点的arena分配内存
+		malloc_thread_arena(wp->arena);
+	}
 	struct message_queue * q = NULL;        // 当前处理的消息队列
 	while (!m->quit) {
+		if (id >= m->count) {
+			// 本线程被移除了，手上的队列推回运行队列，由其他线程处理
+			if (q) {
+				skynet_globalmq_push(q);
+				q = NULL;
+			}
+			malloc_fold();
+			worker_retire(m, park, id);
+			continue;
+		}
 		// 分发消息，处理服务的消息队列
-		q = skynet_context_message_dispatch(sm, q, weight);
+		q = skynet_context_message_dispatch(sm, q, weight, id);
+		if (q == NULL && m->spin > 0) {
+			q = worker_spin(m, sm, weight, id);
+		}
 		if (q == NULL) {
-			// 没有消息需要处理，进入睡眠状态
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;  // 增加睡眠线程计数
-				// "spurious wakeup" is harmless,
-				// because skynet_context_message_dispatch() can be call at any time.
-				// "虚假唤醒"是无害的，因为skynet_context_message_dispatch()可以随时调用
-				if (!m->quit)
-					pthread_cond_wait(&m->cond, &m->mutex);  // 等待被唤醒
-				-- m->sleep;  // 减少睡眠线程计数
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
+			// 没有消息需要处理，进入睡眠状态，睡眠前合并本线程的内存统计，到时间就整理一个arena
+			malloc_fold();
+			malloc_purge_idle();
+			// "spurious wakeup" is harmless,
+			// because skynet_context_message_dispatch() can be call at any time.
+			// "虚假唤醒"是无害的，因为skynet_context_message_dispatch()可以随时调用
+			SPIN_LOCK(m)
+			if (m->quit) {
+				SPIN_UNLOCK(m)
+				break;
+			}
+			if (id >= m->count) {
+				SPIN_UNLOCK(m)
+				continue;
+			}
+			ATOM_STORE(&park->state, 1);
+			m->parked[m->sleep++] = id;  // 入栈，增加睡眠线程计数
+			SPIN_UNLOCK(m)
+
+			park_wait(park);  // 等待被唤醒，唤醒方已将本线程出栈
+
+			uint64_t wake_time = ATOM_LOAD(&park->wake_time);
+			uint64_t now = skynet_monotonic_time();
+			ATOM_FINC(&WAKEUP_COUNT);
+			if (now > wake_time) {
+				ATOM_FADD(&WAKEUP_NSEC, now - wake_time);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * 根据配置生成每个工作线程的调度权重
+ * default  : 使用内置的权重表（按线程序号分配-1,0,1,2,3）
+ * adaptive : 所有线程使用自适应调度
+ * 数字列表 : 如 "-1,0,1,1"，依次分配给各线程，线程数多于列表长度时重复最后一项
+ * @param policy: 权重策略字符串
+ * @param thread: 工作线程数量
+ * @param w: 输出的权重数组
+ */
+static void
+init_weight(const char *policy, int thread, int *w) {
+	/*
+	 * 工作线程权重配置
+	 * -1: 每次只处理一条消息
+	 *  0: 处理队列中的全部消息
+	 *  1: 处理队列中消息数量的1/2
+	 *  2: 处理队列中消息数量的1/4
+	 *  3: 处理队列中消息数量的1/8
+	 */
+	static int weight[] = {
+		-1, -1, -1, -1, 0, 0, 0, 0,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		2, 2, 2, 2, 2, 2, 2, 2,
+		3, 3, 3, 3, 3, 3, 3, 3, };
+	int i;
+	if (policy == NULL || strcmp(policy, "default") == 0) {
+		for (i=0;i<thread;i++) {
+			if (i < sizeof(weight)/sizeof(weight[0])) {
+				w[i]= weight[i];  // 使用预定义权重
+			} else {
+				w[i] = 0;         // 超出范围的线程使用权重0
+			}
+		}
+	} else if (strcmp(policy, "adaptive") == 0) {
+		for (i=0;i<thread;i++) {
+			w[i] = WEIGHT_ADAPTIVE;
+		}
+	} else {
+		const char *p = policy;
+		int last = 0;
+		for (i=0;i<thread;i++) {
+			if (*p) {
+				char *endptr = NULL;
+				long v = strtol(p, &endptr, 10);
+				if (endptr == p || v < WEIGHT_ADAPTIVE || v > 31) {
+					fprintf(stderr, "Invalid weight config : %s\n", policy);
 					exit(1);
 				}
+				last = (int)v;
+				p = endptr;
+				while (*p == ',' || *p == ' ')
+					++p;
 			}
+			w[i] = last;
 		}
 	}
-	return NULL;
+}
+
+/*
+ * 创建第i个工作线程，按配置绑定CPU和NUMA节点
+ * 调用者保证i等于已创建的数量，并且不会同时创建
+ */
+static void
+worker_create(struct monitor *m, int i) {
+	struct worker_parm *wp = &m->wp[i];
+	struct cpu_set *cs = m->cpu;
+	int n = -1;
+	if (m->nodes > 0) {
+		if (cs->n > 0) {
+			n = cpu_node(m->node, m->nodes, cs->cpu[i % cs->n]);
+		} else {
+			n = i % m->nodes;
+		}
+		wp->arena = m->arena[n];
+		skynet_mq_worker_node(i, n);
+	}
+	m->m[i] = skynet_monitor_new();
+	create_thread(&m->pid[i], thread_worker, wp);
+	if (cs->n > 0) {
+		bind_thread(m->pid[i], &cs->cpu[i % cs->n], 1);
+	} else if (n >= 0) {
+		// 没有指定工作线程的CPU时，绑定到所属节点的全部CPU上
+		bind_thread(m->pid[i], m->node[n].cpu, m->node[n].n);
+	}
+	ATOM_STORE(&m->created, i + 1);
+}
+
+/*
+ * 调整工作线程的数量（1到thread_max之间）
+ * 增加时先唤醒被移除的线程，不够再创建新的；减少时id大的线程交出本地队列后休眠，不会退出
+ * @param n: 新的数量，不大于0时只查询
+ * @return: 调整后的数量
+ */
+int
+skynet_worker_resize(int n) {
+	struct monitor *m = M;
+	if (m == NULL)
+		return 0;
+	if (n <= 0)
+		return m->count;
+	if (n > m->max)
+		n = m->max;
+	pthread_mutex_lock(&m->resize);
+	int wake[m->max];
+	int nwake = 0;
+	int i, j = 0;
+	SPIN_LOCK(m)
+	if (m->quit) {
+		SPIN_UNLOCK(m)
+		pthread_mutex_unlock(&m->resize);
+		return m->count;
+	}
+	int last = m->count;
+	int created = ATOM_LOAD(&m->created);
+	m->count = n;
+	skynet_mq_worker_count(n);
+	// 休眠中被移除的线程要醒来交出本地队列
+	for (i=0;i<m->sleep;i++) {
+		int id = m->parked[i];
+		if (id >= n) {
+			wake[nwake++] = id;
+		} else {
+			m->parked[j++] = id;
+		}
+	}
+	m->sleep = j;
+	for (i=0;i<n && i<created;i++) {
+		if (m->park[i].retired) {
+			m->park[i].retired = 0;
+			wake[nwake++] = i;
+		}
+	}
+	SPIN_UNLOCK(m)
+	for (i=0;i<nwake;i++) {
+		park_wake(&m->park[wake[i]]);
+	}
+	for (i=created;i<n;i++) {
+		worker_create(m, i);
+	}
+	pthread_mutex_unlock(&m->resize);
+	if (n != last) {
+		skynet_error(NULL, "Worker threads : %d -> %d", last, n);
+	}
+	return n;
 }
 
 /*
  * 启动所有线程
  * 创建监控线程、定时器线程、socket线程和工作线程
  * @param thread: 工作线程数量
+ * @param config: 配置（工作线程上限、调度权重策略、线程CPU绑定、NUMA模式）
  */
 static void
-start(int thread) {
-	pthread_t pid[thread+3];  // 存储所有线程ID，包括3个系统线程和N个工作线程
+start(int thread, struct skynet_config *config) {
+	int nsocket = config->socket_thread;
+	int sys = 2 + nsocket;    // 系统线程数量：监控、定时器和nsocket个socket线程
+	pthread_t pid[sys];       // 系统线程ID，工作线程的在monitor中
+	struct socket_parm sp[nsocket];
+	int max = config->thread_max;
 
 	// 创建并初始化监控器
 	struct monitor *m = skynet_malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
-	m->count = thread;  // 工作线程总数
+	m->count = thread;  // 工作线程数量
+	m->max = max;
+	m->min = config->thread_min;
+	ATOM_INIT(&m->created, 0);
 	m->sleep = 0;       // 初始睡眠线程数为0
+	m->stall = config->monitor_stall > 0 ? config->monitor_stall : 5000;
+	m->traceback = config->monitor_traceback;
+	m->spin = config->busypoll > 0 ? config->busypoll : 0;
+	ATOM_INIT(&m->spinning, 0);
 
-	// 为每个工作线程分配一个监控器
-	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
+	// 按上限分配每个工作线程的监控器、休眠槽和参数，监控器在创建线程时分配
+	m->pid = skynet_malloc(max * sizeof(pthread_t));
+	m->wp = skynet_malloc(max * sizeof(struct worker_parm));
+	m->m = skynet_malloc(max * sizeof(struct skynet_monitor *));
+	m->park = skynet_malloc(max * sizeof(struct worker_park));
+	m->parked = skynet_malloc(max * sizeof(int));
 	int i;
-	for (i=0;i<thread;i++) {
-		m->m[i] = skynet_monitor_new();
+	int weight[max];
+	init_weight(config->weight, max, weight);
+	for (i=0;i<max;i++) {
+		m->m[i] = NULL;
+		park_init(&m->park[i]);
+		m->park[i].retired = 0;
+		m->wp[i].m = m;
+		m->wp[i].id = i;
+		m->wp[i].weight = weight[i];
+		m->wp[i].arena = -1;
 	}
-	// 初始化互斥锁
-	if (pthread_mutex_init(&m->mutex, NULL)) {
+	SPIN_INIT(m)
+	if (pthread_mutex_init(&m->resize, NULL)) {
 		fprintf(stderr, "Init mutex error");
 		exit(1);
 	}
-	// 初始化条件变量
-	if (pthread_cond_init(&m->cond, NULL)) {
-		fprintf(stderr, "Init cond error");
-		exit(1);
-	}
+	skynet_mq_worker_count(thread);
+	M = m;
 
 	// 创建系统线程
 	create_thread(&pid[0], thread_monitor, m);  // 监控线程
 	create_thread(&pid[1], thread_timer, m);    // 定时器线程
-	create_thread(&pid[2], thread_socket, m);   // socket线程
+	for (i=0;i<nsocket;i++) {
+		sp[i].m = m;
+		sp[i].shard = i;
+		create_thread(&pid[2+i], thread_socket, &sp[i]);   // socket线程
+	}
 
-	/*
-	 * 工作线程权重配置
-	 * -1: 每次只处理一条消息
-	 *  0: 处理队列中的全部消息
-	 *  1: 处理队列中消息数量的1/2
-	 *  2: 处理队列中消息数量的1/4
-	 *  3: 处理队列中消息数量的1/8
-	 */
-	static int weight[] = {
-		-1, -1, -1, -1, 0, 0, 0, 0,
-		1, 1, 1, 1, 1, 1, 1, 1,
-		2, 2, 2, 2, 2, 2, 2, 2,
-		3, 3, 3, 3, 3, 3, 3, 3, };
-	struct worker_parm wp[thread];
-	// 创建工作线程
-	for (i=0;i<thread;i++) {
-		wp[i].m = m;
-		wp[i].id = i;
-		if (i < sizeof(weight)/sizeof(weight[0])) {
-			wp[i].weight= weight[i];  // 使用预定义权重
+	// 每类线程可以绑定到一组CPU上
+	struct cpu_set * cs = skynet_malloc(sizeof(*cs));
+	bind_thread(pid[0], cs->cpu, parse_cpuset(config->monitor_affinity, cs));
+	bind_thread(pid[1], cs->cpu, parse_cpuset(config->timer_affinity, cs));
+	parse_cpuset(config->socket_affinity, cs);
+	for (i=0;i<nsocket;i++) {
+		if (nsocket == 1 || cs->n < nsocket) {
+			bind_thread(pid[2+i], cs->cpu, cs->n);
 		} else {
-			wp[i].weight = 0;         // 超出范围的线程使用权重0
+			// CPU足够时每个socket线程绑定到一个CPU上
+			bind_thread(pid[2+i], &cs->cpu[i], 1);
+		}
+	}
+
+	// 工作线程的CPU列表：每个工作线程依次绑定到列表中的一个CPU上
+	parse_cpuset(config->worker_affinity, cs);
+	m->cpu = cs;
+
+	// NUMA模式：每个工作线程属于一个节点，优先窃取同节点线程的队列，并使用本节点的jemalloc arena
+	if (config->numa) {
+		m->node = skynet_malloc(sizeof(struct cpu_set) * MAX_NUMA_NODE);
+		m->nodes = numa_nodes(m->node);
+		if (m->nodes == 0) {
+			skynet_error(NULL, "error: Can't read numa nodes, numa mode is disabled");
+		}
+		for (i=0;i<m->nodes;i++) {
+			m->arena[i] = malloc_arena_create();
 		}
-		create_thread(&pid[i+3], thread_worker, &wp[i]);
 	}
 
-	// 等待所有线程结束
-	for (i=0;i<thread+3;i++) {
+	// 创建工作线程，和运行时增加的线程一样串行创建
+	pthread_mutex_lock(&m->resize);
+	for (i=ATOM_LOAD(&m->created);i<m->count;i++) {
+		worker_create(m, i);
+	}
+	pthread_mutex_unlock(&m->resize);
+
+	// 等待所有线程结束，系统线程都退出后不会再创建工作线程
+	for (i=0;i<sys;i++) {
 		pthread_join(pid[i], NULL);
 	}
+	int created = ATOM_LOAD(&m->created);
+	for (i=0;i<created;i++) {
+		pthread_join(m->pid[i], NULL);
+	}
 
 	// 清理监控器资源
+	M = NULL;
 	free_monitor(m);
 }
 
@@ -370,6 +1019,66 @@ bootstrap(struct skynet_context * logger, const char * cmdline) {
  * 初始化所有子系统，创建logger服务，启动引导服务，启动所有线程
  * @param config: 配置结构体指针
  */
+#if defined(SPINLOCK_FUTEX) && !defined(USE_PTHREAD_LOCK) && defined(__linux__)
+
+/*
+ * spinlock.h中自适应锁的休眠和唤醒
+ */
+void
+spinlock_wait_(ATOM_INT *ptr, int v) {
+	syscall(SYS_futex, ptr, FUTEX_WAIT_PRIVATE, v, NULL, NULL, 0);
+}
+
+void
+spinlock_wake_(ATOM_INT *ptr) {
+	syscall(SYS_futex, ptr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#endif
+
+#ifdef SPINLOCK_STAT
+
+ATOM_POINTER spinlock_site_;
+
+/*
+ * 输出各加锁位置的争用统计（编译时加-DSPINLOCK_STAT），按等待的总次数排序，忽略从没争用过的位置
+ */
+static int
+lockstat_cmp(const void *a, const void *b) {
+	unsigned long sa = ATOM_LOAD(&(*(struct spinlock_site * const *)a)->spin);
+	unsigned long sb = ATOM_LOAD(&(*(struct spinlock_site * const *)b)->spin);
+	return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+static void
+lockstat_report(void) {
+	int n = 0;
+	struct spinlock_site *s;
+	for (s = (struct spinlock_site *)ATOM_LOAD(&spinlock_site_); s; s = s->next)
+		++n;
+	if (n == 0)
+		return;
+	struct spinlock_site **sites = skynet_malloc(n * sizeof(*sites));
+	n = 0;
+	for (s = (struct spinlock_site *)ATOM_LOAD(&spinlock_site_); s; s = s->next) {
+		if (ATOM_LOAD(&s->contended))
+			sites[n++] = s;
+	}
+	qsort(sites, n, sizeof(*sites), lockstat_cmp);
+	fprintf(stderr, "Lock contention (%d sites):\n", n);
+	fprintf(stderr, "%12s %12s %14s  site\n", "acquire", "contended", "spin");
+	int i;
+	for (i=0;i<n;i++) {
+		s = sites[i];
+		fprintf(stderr, "%12lu %12lu %14lu  %s:%d\n",
+			(unsigned long)ATOM_LOAD(&s->acquire), (unsigned long)ATOM_LOAD(&s->contended),
+			(unsigned long)ATOM_LOAD(&s->spin), s->file, s->line);
+	}
+	skynet_free(sites);
+}
+
+#endif
+
 void
 skynet_start(struct skynet_config * config) {
 	// register SIGHUP for log file reopen
@@ -390,11 +1099,29 @@ skynet_start(struct skynet_config * config) {
 	// 初始化各个子系统
 	skynet_harbor_init(config->harbor);        // 初始化节点管理器
 	skynet_handle_init(config->harbor);        // 初始化handle存储器
-	skynet_mq_init();                          // 初始化全局消息队列
+	if (config->thread < 1)
+		config->thread = 1;
+	if (config->thread_max < config->thread)
+		config->thread_max = config->thread;
+	if (config->thread_min > config->thread_max)
+		config->thread_min = config->thread_max;
+	skynet_mq_init(config->thread_max, config->mq_limit); // 初始化全局消息队列和工作线程本地队列（按线程数量上限）
+	if (skynet_mq_group_init(config->sched_group)) {
+		fprintf(stderr, "Invalid sched_group %s\n", config->sched_group);
+		exit(1);
+	}
 	skynet_module_init(config->module_path);   // 初始化C模块管理器，设置查找路径
-	skynet_timer_init();                       // 初始化全局时间系统
-	skynet_socket_init();                      // 初始化socket管理器
+	skynet_timer_init(config->timer_resolution); // 初始化全局时间系统
+	if (config->socket_thread < 1)
+		config->socket_thread = 1;
+	skynet_socket_init(config->socket_poll, config->socket_thread, config->socket_max); // 初始化socket管理器，每个socket线程一个分片
+	skynet_socket_busypoll(config->busypoll);  // 忙轮询模式
 	skynet_profile_enable(config->profile);   // 设置是否开启性能分析
+	skynet_latency_enable(config->latency);   // 设置新服务是否开启延迟统计
+	skynet_weight_budget(config->weight_budget); // 设置自适应调度的时间预算
+	malloc_lua_arena(config->lua_arena);      // 设置Lua服务的arena模式
+	malloc_purge_config(config->jemalloc_background, config->jemalloc_decay, config->jemalloc_purge);
+	skynet_trace_init(config->trace_ring);    // 初始化消息分发跟踪
 
 	// 创建logger服务
 	struct skynet_context *ctx = skynet_context_new(config->logservice, config->logger);
@@ -410,12 +1137,16 @@ skynet_start(struct skynet_config * config) {
 	bootstrap(ctx, config->bootstrap);
 
 	// 启动所有线程（监控、定时器、socket、工作线程）
-	start(config->thread);
+	start(config->thread, config);
 
 	// harbor_exit may call socket send, so it should exit before socket_free
 	// 清理工作：harbor_exit可能会调用socket发送，所以应该在socket_free之前退出
 	skynet_harbor_exit();
 	skynet_socket_free();
+	skynet_journal_exit();     // 写完服务退出时关闭的消息日志
+#ifdef SPINLOCK_STAT
+	lockstat_report();
+#endif
 	if (config->daemon) {
 		daemon_exit(config->daemon);
 	}
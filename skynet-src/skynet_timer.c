@@ -10,6 +10,7 @@
 #include "skynet_mq.h"
 #include "skynet_server.h"
 #include "skynet_handle.h"
+#include "skynet_probe.h"
 #include "spinlock.h"
 
 #include <time.h>
@@ -17,6 +18,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 
 // 定时器执行函数类型定义
 typedef void (*timer_execute_func)(void *ud,void *arg);
@@ -28,6 +30,9 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_LEVEL (1 << TIME_LEVEL_SHIFT)  // 各级时间轮大小（64）
 #define TIME_NEAR_MASK (TIME_NEAR-1)        // 近期时间轮掩码（255）
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)      // 各级时间轮掩码（63）
+#define TIMER_HASH_DEFAULT 256              // 取消索引的默认桶数量
+#define TIMER_RESOLUTION_DEFAULT 10         // 默认每个滴答10毫秒（1厘秒）
+#define TIMER_SHARD 16                      // 添加定时器用的分片数量
 
 /*
  * 定时器事件结构体
@@ -41,10 +46,20 @@ struct timer_event {
 /*
  * 定时器节点结构体
  * 时间轮中的基本节点，包含过期时间和链表指针
+ * 链表是双向的，并且节点记录所在的链表，取消时可以O(1)摘除
  */
+struct link_list;
+
 struct timer_node {
 	struct timer_node *next;    // 链表中的下一个节点
+	struct timer_node *prev;    // 链表中的上一个节点（第一个节点指向链表头）
+	struct link_list *list;     // 所在的时间轮槽位
+	struct timer_node *hnext;   // 取消索引中同一个桶的下一个节点
+	struct timer_node *rnext;   // 正在分发的周期定时器链表，分发后重新加入时间轮
 	uint32_t expire;            // 过期时间（相对时间）
+	uint32_t interval;          // 周期（滴答），0表示一次性定时器；创建后不再修改
+	int cancelled;              // 周期定时器在分发期间被取消，分发后释放
+	int dead;                   // 周期定时器的目标服务已经退出，分发后释放
 };
 
 /*
@@ -56,6 +71,16 @@ struct link_list {
 	struct timer_node *tail;    // 链表尾指针
 };
 
+/*
+ * 定时器分片
+ * 工作线程添加定时器时只锁所在分片，节点先挂在pending链表上（expire为相对时间），
+ * 定时器线程每个滴答把所有分片合并进时间轮
+ */
+struct timer_shard {
+	struct spinlock lock;
+	struct link_list pending;
+};
+
 /*
  * 定时器系统结构体
  * 实现分层时间轮的核心数据结构
@@ -63,11 +88,18 @@ struct link_list {
 struct timer {
 	struct link_list near[TIME_NEAR];       // 近期时间轮（256个槽，处理0-255的时间）
 	struct link_list t[4][TIME_LEVEL];      // 4级时间轮（每级64个槽）
-	struct spinlock lock;                   // 自旋锁，保护定时器操作
+	struct spinlock lock;                   // 自旋锁，保护时间轮和取消索引，只有定时器线程和取消操作使用
+	struct timer_shard shard[TIMER_SHARD];  // 添加定时器用的分片，按handle选择
 	uint32_t time;                          // 当前时间（定时器滴答）
 	uint32_t starttime;                     // 系统启动时间
-	uint64_t current;                       // 当前时间（毫秒）
-	uint64_t current_point;                 // 当前时间点
+	uint64_t current;                       // 当前时间（厘秒，从starttime的整秒起算）
+	uint64_t current_point;                 // 上次更新时的单调时钟（滴答）
+	uint64_t current_base;                  // 启动时current的值
+	uint64_t tick;                          // 启动以来走过的滴答数
+	int resolution;                         // 每个滴答的毫秒数（1、2、5或10）
+	struct timer_node **hash;               // 取消索引：按(handle, session)查找仍在时间轮中的节点
+	int hash_size;                          // 索引桶数量，总是2的幂
+	int hash_count;                         // 索引中的节点数量
 };
 
 // 全局定时器实例
@@ -84,11 +116,100 @@ link_clear(struct link_list *list) {
 
 static inline void
 link(struct link_list *list,struct timer_node *node) {
+	node->prev = list->tail;
+	node->list = list;
 	list->tail->next = node;
 	list->tail = node;
 	node->next=0;
 }
 
+// 从所在的槽位链表中摘除节点
+static inline void
+unlink_node(struct timer_node *node) {
+	struct link_list *list = node->list;
+	node->prev->next = node->next;
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		list->tail = node->prev;
+	}
+	node->list = NULL;
+}
+
+static inline struct timer_event *
+node_event(struct timer_node *node) {
+	return (struct timer_event *)(node+1);
+}
+
+static inline int
+hash_index(struct timer *T, uint32_t handle, int session) {
+	uint32_t h = handle * 2654435761u ^ (uint32_t)session;
+	return (int)(h & (T->hash_size - 1));
+}
+
+// 取消索引的节点数超过桶数量时扩容一倍
+static void
+hash_expand(struct timer *T) {
+	int size = T->hash_size * 2;
+	struct timer_node **hash = skynet_malloc(size * sizeof(struct timer_node *));
+	memset(hash, 0, size * sizeof(struct timer_node *));
+	int old_size = T->hash_size;
+	struct timer_node **old = T->hash;
+	T->hash = hash;
+	T->hash_size = size;
+	int i;
+	for (i=0;i<old_size;i++) {
+		struct timer_node *node = old[i];
+		while (node) {
+			struct timer_node *next = node->hnext;
+			struct timer_event *event = node_event(node);
+			int idx = hash_index(T, event->handle, event->session);
+			node->hnext = hash[idx];
+			hash[idx] = node;
+			node = next;
+		}
+	}
+	skynet_free(old);
+}
+
+static void
+hash_insert(struct timer *T, struct timer_node *node) {
+	if (T->hash_count >= T->hash_size) {
+		hash_expand(T);
+	}
+	struct timer_event *event = node_event(node);
+	int idx = hash_index(T, event->handle, event->session);
+	node->hnext = T->hash[idx];
+	T->hash[idx] = node;
+	++T->hash_count;
+}
+
+/*
+ * 在取消索引中查找并移除节点
+ * @param node: 要移除的节点；为NULL时按handle和session查找
+ * @return: 移除的节点，未找到返回NULL
+ */
+static struct timer_node *
+hash_remove(struct timer *T, struct timer_node *node, uint32_t handle, int session) {
+	if (node) {
+		struct timer_event *event = node_event(node);
+		handle = event->handle;
+		session = event->session;
+	}
+	struct timer_node **p = &T->hash[hash_index(T, handle, session)];
+	while (*p) {
+		struct timer_node *n = *p;
+		struct timer_event *event = node_event(n);
+		if (n == node || (node == NULL && event->handle == handle && event->session == session)) {
+			*p = n->hnext;
+			--T->hash_count;
+			return n;
+		}
+		p = &n->hnext;
+	}
+	return NULL;
+}
+
 static void
 add_node(struct timer *T,struct timer_node *node) {
 	uint32_t time=node->expire;
@@ -118,17 +239,42 @@ add_node(struct timer *T,struct timer_node *node) {
  * @param time: 延迟时间（相对时间）
  */
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
+timer_add(struct timer *T,void *arg,size_t sz,int time,uint32_t interval) {
 	// 分配定时器节点，节点后面紧跟事件数据
 	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
 	memcpy(node+1,arg,sz);  // 复制事件数据到节点后面
+	node->expire=time;      // 先记录相对时间，合并时换算成绝对过期时间
+	node->interval=interval;
+	node->cancelled=0;
+	node->dead=0;
+	SKYNET_PROBE3(timer__add, ((struct timer_event *)arg)->handle, ((struct timer_event *)arg)->session, time);
+
+	struct timer_shard *shard = &T->shard[((struct timer_event *)arg)->handle % TIMER_SHARD];
+	SPIN_LOCK(shard);
+	link(&shard->pending,node);
+	SPIN_UNLOCK(shard);
+}
 
-	SPIN_LOCK(T);
-
-	node->expire=time+T->time;  // 设置绝对过期时间
-	add_node(T,node);           // 将节点添加到合适的时间轮槽位
-
-	SPIN_UNLOCK(T);
+/*
+ * 把各分片中新添加的定时器合并进时间轮，需要持有T->lock
+ * 合并发生在本滴答执行之前，T->time与添加时看到的值相同，过期时间不变
+ */
+static void
+timer_merge(struct timer *T) {
+	int i;
+	for (i=0;i<TIMER_SHARD;i++) {
+		struct timer_shard *shard = &T->shard[i];
+		SPIN_LOCK(shard);
+		struct timer_node *current = link_clear(&shard->pending);
+		SPIN_UNLOCK(shard);
+		while (current) {
+			struct timer_node *next = current->next;
+			current->expire += T->time;
+			add_node(T,current);    // 将节点添加到合适的时间轮槽位
+			hash_insert(T,current); // 加入取消索引
+			current = next;
+		}
+	}
 }
 
 /*
@@ -179,31 +325,86 @@ timer_shift(struct timer *T) {
 	}
 }
 
+// 用于按目标服务合并到期事件的临时记录
+struct timer_expire {
+	uint32_t handle;
+	int session;
+	int index;          // 在链表中的顺序，保证同一服务的事件按添加顺序投递
+	struct timer_node *periodic;  // 周期定时器的节点，一次性的为NULL
+};
+
+static int
+compare_expire(const void *a, const void *b) {
+	const struct timer_expire *ea = a;
+	const struct timer_expire *eb = b;
+	if (ea->handle != eb->handle)
+		return ea->handle < eb->handle ? -1 : 1;
+	return ea->index - eb->index;
+}
+
 /*
  * 分发定时器事件列表
  * 将到期的定时器转换为消息发送给对应的服务
+ * 同一时刻到期的定时器按目标服务合并，每个服务只查找一次，
+ * 开启了合并的服务（TIMERBATCH）只收到一条消息
+ * 一次性定时器的节点在这里释放，周期定时器的节点由timer_execute重新加入时间轮，
+ * 目标服务已经退出时标记dead
  * @param current: 定时器节点链表头
  */
 static inline void
 dispatch_list(struct timer_node *current) {
-	do {
-		// 获取定时器事件数据
-		struct timer_event * event = (struct timer_event *)(current+1);
-
-		// 构造定时器消息
-		struct skynet_message message;
-		message.source = 0;                                           // 来源为0（系统）
-		message.session = event->session;                             // 会话ID
-		message.data = NULL;                                          // 无数据
-		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;    // 响应类型消息
-
-		skynet_context_push(event->handle, &message);  // 发送消息到目标服务
-
+	if (current->next == NULL) {
+		int session = node_event(current)->session;
+		SKYNET_PROBE2(timer__dispatch, node_event(current)->handle, 1);
+		int err = skynet_context_pushtimeout(node_event(current)->handle, &session, 1);
+		if (current->interval == 0) {
+			skynet_free(current);
+		} else if (err) {
+			current->dead = 1;
+		}
+		return;
+	}
+	int n = 0;
+	struct timer_node *node;
+	for (node = current; node; node = node->next) {
+		++n;
+	}
+	struct timer_expire *expire = skynet_malloc(n * sizeof(*expire));
+	int *session = skynet_malloc(n * sizeof(int));
+	int i = 0;
+	while (current) {
+		struct timer_event * event = node_event(current);
+		expire[i].handle = event->handle;
+		expire[i].session = event->session;
+		expire[i].index = i;
+		expire[i].periodic = current->interval ? current : NULL;
+		++i;
 		// 释放定时器节点
 		struct timer_node * temp = current;
 		current=current->next;
-		skynet_free(temp);
-	} while (current);
+		if (temp->interval == 0)
+			skynet_free(temp);
+	}
+	qsort(expire, n, sizeof(*expire), compare_expire);
+	int begin = 0;
+	while (begin < n) {
+		uint32_t handle = expire[begin].handle;
+		int count = 0;
+		for (i = begin; i < n && expire[i].handle == handle; i++) {
+			session[count++] = expire[i].session;
+		}
+		SKYNET_PROBE2(timer__dispatch, handle, count);
+		if (skynet_context_pushtimeout(handle, session, count)) {
+			int j;
+			for (j = begin; j < i; j++) {
+				if (expire[j].periodic)
+					expire[j].periodic->dead = 1;
+			}
+		}
+		begin = i;
+	}
+	skynet_free(session);
+	skynet_free(expire);
 }
 
 /*
@@ -216,11 +417,38 @@ timer_execute(struct timer *T) {
 	
 	while (T->near[idx].head.next) {
 		struct timer_node *current = link_clear(&T->near[idx]);
+		// 即将触发的一次性节点不能再被取消，解锁前从取消索引中移除
+		// 周期节点留在索引里，分发期间的取消只做标记
+		struct timer_node *periodic = NULL;
+		struct timer_node *node;
+		for (node = current; node; node = node->next) {
+			if (node->interval) {
+				node->rnext = periodic;
+				periodic = node;
+			} else {
+				hash_remove(T, node, 0, 0);
+			}
+			node->list = NULL;
+		}
 		SPIN_UNLOCK(T);
 		// dispatch_list don't need lock T
 		// dispatch_list不需要锁定T
 		dispatch_list(current);
 		SPIN_LOCK(T);
+		while (periodic) {
+			node = periodic;
+			periodic = node->rnext;
+			if (node->cancelled) {
+				skynet_free(node);
+			} else if (node->dead) {
+				hash_remove(T, node, 0, 0);
+				skynet_free(node);
+			} else {
+				// 从上次的过期时间起算，不受分发和服务处理的延迟影响，不会漂移
+				node->expire += node->interval;
+				add_node(T, node);
+			}
+		}
 	}
 }
 
@@ -228,6 +456,8 @@ static void
 timer_update(struct timer *T) {
 	SPIN_LOCK(T);
 
+	timer_merge(T);
+
 	// try to dispatch timeout 0 (rare condition)
 	// 尝试分发超时时间为0的定时器（罕见情况）
 	timer_execute(T);
@@ -258,20 +488,34 @@ timer_create_timer() {
 	}
 
 	SPIN_INIT(r)
+	for (i=0;i<TIMER_SHARD;i++) {
+		SPIN_INIT(&r->shard[i])
+		link_clear(&r->shard[i].pending);
+	}
 
 	r->current = 0;
+	r->hash_size = TIMER_HASH_DEFAULT;
+	r->hash_count = 0;
+	r->hash = skynet_malloc(r->hash_size * sizeof(struct timer_node *));
+	memset(r->hash, 0, r->hash_size * sizeof(struct timer_node *));
 
 	return r;
 }
 
-int
-skynet_timeout(uint32_t handle, int time, int session) {
-	if (time <= 0) {
+/*
+ * 按滴答数添加超时事件
+ * @param time: 滴答数，不超过INT_MAX
+ * @param interval: 周期（滴答），0表示一次性
+ */
+static int
+timeout_tick(uint32_t handle, int time, int session, uint32_t interval) {
+	if (time <= 0 && interval == 0) {
 		struct skynet_message message;
 		message.source = 0;
 		message.session = session;
 		message.data = NULL;
 		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+		message.deadline = 0;
 
 		if (skynet_context_push(handle, &message)) {
 			return -1;
@@ -280,12 +524,79 @@ skynet_timeout(uint32_t handle, int time, int session) {
 		struct timer_event event;
 		event.handle = handle;
 		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(TI, &event, sizeof(event), time, interval);
 	}
 
 	return session;
 }
 
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	int64_t tick = (int64_t)time * 10 / TI->resolution;
+	return timeout_tick(handle, tick > INT_MAX ? INT_MAX : (int)tick, session, 0);
+}
+
+// 毫秒换算成滴答，向上取整，定时器不会早于要求的时间触发
+static inline int
+ms_tick(int ms) {
+	return ms <= 0 ? 0 : (ms + TI->resolution - 1) / TI->resolution;
+}
+
+int
+skynet_timeout_ms(uint32_t handle, int ms, int session) {
+	return timeout_tick(handle, ms_tick(ms), session, 0);
+}
+
+int
+skynet_timeout_periodic(uint32_t handle, int ms, int session) {
+	int tick = ms_tick(ms);
+	if (tick <= 0)
+		tick = 1;
+	return timeout_tick(handle, tick, session, tick);
+}
+
+/*
+ * 取消尚未触发的定时器
+ * 节点从时间轮和取消索引中摘除后立即释放，这个定时器不会再产生消息
+ * @return: 0表示成功，-1表示定时器不存在（已经触发或从未添加）
+ */
+int
+skynet_timeout_cancel(uint32_t handle, int session) {
+	struct timer *T = TI;
+	struct timer_shard *shard = &T->shard[handle % TIMER_SHARD];
+	// 加锁顺序与timer_merge相同：先T后分片，节点不会在两者之间丢失
+	SPIN_LOCK(T);
+	SPIN_LOCK(shard);
+	struct timer_node *node = shard->pending.head.next;
+	while (node) {
+		struct timer_event *event = node_event(node);
+		if (event->handle == handle && event->session == session)
+			break;
+		node = node->next;
+	}
+	if (node) {
+		unlink_node(node);
+	}
+	SPIN_UNLOCK(shard);
+	if (node == NULL) {
+		node = hash_remove(T, NULL, handle, session);
+		if (node) {
+			if (node->list == NULL) {
+				// 周期定时器正在分发，由timer_execute在分发后释放
+				node->cancelled = 1;
+				SPIN_UNLOCK(T);
+				return 0;
+			}
+			unlink_node(node);
+		}
+	}
+	SPIN_UNLOCK(T);
+	if (node == NULL)
+		return -1;
+	skynet_free(node);
+	return 0;
+}
+
 // centisecond: 1/100 second
 // 厘秒：1/100秒
 static void
@@ -296,14 +607,15 @@ systime(uint32_t *sec, uint32_t *cs) {
 	*cs = (uint32_t)(ti.tv_nsec / 10000000);
 }
 
+// 单调时钟，以滴答为单位
 static uint64_t
 gettime() {
 	uint64_t t;
 	struct timespec ti;
 	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
-	return t;
+	t = (uint64_t)ti.tv_sec * 1000;
+	t += ti.tv_nsec / 1000000;
+	return t / TI->resolution;
 }
 
 void
@@ -315,7 +627,8 @@ skynet_updatetime(void) {
 	} else if (cp != TI->current_point) {
 		uint32_t diff = (uint32_t)(cp - TI->current_point);
 		TI->current_point = cp;
-		TI->current += diff;
+		TI->tick += diff;
+		TI->current = TI->current_base + TI->tick * TI->resolution / 10;
 		int i;
 		for (i=0;i<diff;i++) {
 			timer_update(TI);
@@ -333,15 +646,63 @@ skynet_now(void) {
 	return TI->current;
 }
 
+/*
+ * 定时器线程在两次更新之间休眠
+ * 默认精度下沿用2.5毫秒的相对休眠；高精度模式下用clock_nanosleep睡到下一个滴答的边界，
+ * 绝对时间唤醒不会累积误差，抖动只取决于系统调度
+ */
+void
+skynet_timer_sleep(void) {
+	if (TI->resolution >= TIMER_RESOLUTION_DEFAULT) {
+		struct timespec ti = { 0, 2500000 };
+		nanosleep(&ti, NULL);
+		return;
+	}
+#if defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME) && !defined(__APPLE__)
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	uint64_t ms = (uint64_t)ti.tv_sec * 1000 + ti.tv_nsec / 1000000;
+	ms = (ms / TI->resolution + 1) * TI->resolution;
+	ti.tv_sec = ms / 1000;
+	ti.tv_nsec = (ms % 1000) * 1000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ti, NULL) != 0) {
+		// interrupted by signal, sleep again
+	}
+#else
+	struct timespec ti = { 0, TI->resolution * 250000 };
+	nanosleep(&ti, NULL);
+#endif
+}
+
+int
+skynet_timer_resolution(void) {
+	return TI->resolution;
+}
+
+/*
+ * 初始化定时器系统
+ * @param resolution: 每个滴答的毫秒数，必须能整除10，否则使用默认的10毫秒
+ */
 void 
-skynet_timer_init(void) {
+skynet_timer_init(int resolution) {
 	TI = timer_create_timer();
+	if (resolution <= 0 || resolution > TIMER_RESOLUTION_DEFAULT || TIMER_RESOLUTION_DEFAULT % resolution != 0) {
+		resolution = TIMER_RESOLUTION_DEFAULT;
+	}
+	TI->resolution = resolution;
 	uint32_t current = 0;
 	systime(&TI->starttime, &current);
 	TI->current = current;
+	TI->current_base = current;
+	TI->tick = 0;
 	TI->current_point = gettime();
 }
 
+int
+skynet_timer_count(void) {
+	return TI->hash_count;
+}
+
 // for profile
 
 #define NANOSEC 1000000000
@@ -354,3 +715,11 @@ skynet_thread_time(void) {
 
 	return (uint64_t)ti.tv_sec * MICROSEC + (uint64_t)ti.tv_nsec / (NANOSEC / MICROSEC);
 }
+
+uint64_t
+skynet_monotonic_time(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+
+	return (uint64_t)ti.tv_sec * NANOSEC + (uint64_t)ti.tv_nsec;
+}
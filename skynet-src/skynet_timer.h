@@ -18,6 +18,30 @@
  */
 int skynet_timeout(uint32_t handle, int time, int session);
 
+/*
+ * 添加毫秒精度的超时事件
+ * 实际精度取决于定时器的滴答长度（timer_resolution配置），不足一个滴答时向上取整
+ * @param ms: 超时时间（毫秒）
+ */
+int skynet_timeout_ms(uint32_t handle, int ms, int session);
+
+/*
+ * 添加周期定时器
+ * 每隔ms毫秒（向上取整到滴答，至少一个滴答）向服务发送一条session相同的超时消息，
+ * 节点在时间轮中重复使用，下次过期时间从上次的过期时间起算，不会漂移
+ * 用skynet_timeout_cancel取消
+ */
+int skynet_timeout_periodic(uint32_t handle, int ms, int session);
+
+/*
+ * 取消超时事件
+ * 从时间轮中移除尚未触发的定时器，不会再发送超时消息
+ * @param handle: 目标服务handle
+ * @param session: skynet_timeout返回的会话ID
+ * @return: 成功返回0，定时器已触发或不存在返回-1
+ */
+int skynet_timeout_cancel(uint32_t handle, int session);
+
 /*
  * 更新系统时间
  * 处理到期的定时器事件
@@ -37,9 +61,33 @@ uint32_t skynet_starttime(void);
  */
 uint64_t skynet_thread_time(void);	// for profile, in micro second
 
+/*
+ * 获取单调时钟时间
+ * 用于统计延迟
+ * @return: 单调时钟时间（纳秒）
+ */
+uint64_t skynet_monotonic_time(void);	// in nano second
+
+/*
+ * 定时器线程两次更新之间的休眠
+ */
+void skynet_timer_sleep(void);
+
+/*
+ * 获取定时器滴答长度
+ * @return: 每个滴答的毫秒数
+ */
+int skynet_timer_resolution(void);
+
+/*
+ * 时间轮中的定时器数量（参考值，不包括本滴答新添加还未合并的）
+ */
+int skynet_timer_count(void);
+
 /*
  * 初始化定时器系统
+ * @param resolution: 每个滴答的毫秒数（1、2、5或10）
  */
-void skynet_timer_init(void);
+void skynet_timer_init(int resolution);
 
 #endif
@@ -0,0 +1,149 @@
+/*
+ * skynet_trace.c - 消息分发跟踪
+ * 每个分发消息的线程第一次记录时分配自己的环形缓冲区，只有本线程写入，不需要加锁
+ * 读取方先读写入位置，复制记录后再读一次，丢弃期间可能被覆盖的部分
+ */
+
+#include "skynet.h"
+#include "skynet_trace.h"
+#include "spinlock.h"
+#include "atomic.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_SIZE 16384
+#define MAX_RING 1024
+
+struct trace_ring {
+	ATOM_SIZET index;       // 下一条记录的序号，只增不减
+	int thread;             // 线程编号，按分配的顺序
+	size_t mask;
+	struct skynet_trace_event ev[1];
+};
+
+struct trace_global {
+	struct spinlock lock;
+	ATOM_INT enable;
+	int size;
+	int n;
+	struct trace_ring * ring[MAX_RING];
+};
+
+static struct trace_global G_TRACE;
+static __thread struct trace_ring * R = NULL;
+
+static inline uint64_t
+now_ns(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
+
+void
+skynet_trace_init(int size) {
+	SPIN_INIT(&G_TRACE)
+	int sz = DEFAULT_SIZE;
+	if (size > 0) {
+		sz = 1;
+		while (sz < size)
+			sz *= 2;
+	}
+	G_TRACE.size = sz;
+	ATOM_INIT(&G_TRACE.enable, size > 0);
+}
+
+int
+skynet_trace_enable(int on) {
+	int old = ATOM_LOAD(&G_TRACE.enable);
+	if (on >= 0) {
+		ATOM_STORE(&G_TRACE.enable, on ? 1 : 0);
+	}
+	return old;
+}
+
+uint64_t
+skynet_trace_begin(void) {
+	if (!ATOM_LOAD(&G_TRACE.enable))
+		return 0;
+	return now_ns();
+}
+
+static struct trace_ring *
+new_ring(void) {
+	int sz = G_TRACE.size;
+	struct trace_ring * r = skynet_malloc(sizeof(*r) + (sz - 1) * sizeof(struct skynet_trace_event));
+	memset(r, 0, sizeof(*r));
+	ATOM_INIT(&r->index, 0);
+	r->mask = sz - 1;
+	SPIN_LOCK(&G_TRACE)
+	if (G_TRACE.n >= MAX_RING) {
+		SPIN_UNLOCK(&G_TRACE)
+		skynet_free(r);
+		return NULL;
+	}
+	r->thread = G_TRACE.n;
+	G_TRACE.ring[G_TRACE.n++] = r;
+	SPIN_UNLOCK(&G_TRACE)
+	return r;
+}
+
+void
+skynet_trace_end(uint64_t start, uint32_t source, uint32_t destination, int type, int session, size_t sz) {
+	if (start == 0)
+		return;
+	struct trace_ring * r = R;
+	if (r == NULL) {
+		// 线程退出后缓冲区仍然保留，读取方可以拿到它最后的记录
+		r = R = new_ring();
+		if (r == NULL)
+			return;
+	}
+	uint64_t cost = now_ns() - start;
+	size_t index = ATOM_LOAD(&r->index);
+	struct skynet_trace_event * ev = &r->ev[index & r->mask];
+	ev->start = start;
+	ev->cost = cost > UINT32_MAX ? UINT32_MAX : (uint32_t)cost;
+	ev->source = source;
+	ev->destination = destination;
+	ev->session = session;
+	ev->size = sz > UINT32_MAX ? UINT32_MAX : (uint32_t)sz;
+	ev->type = type;
+	ATOM_STORE(&r->index, index + 1);
+}
+
+int
+skynet_trace_foreach(void (*cb)(void *ud, int thread, const struct skynet_trace_event *ev, int n), void *ud) {
+	SPIN_LOCK(&G_TRACE)
+	int n = G_TRACE.n;
+	SPIN_UNLOCK(&G_TRACE)
+	if (n == 0)
+		return 0;
+	size_t size = G_TRACE.size;
+	struct skynet_trace_event * tmp = skynet_malloc(size * sizeof(*tmp));
+	int total = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		struct trace_ring * r = G_TRACE.ring[i];
+		size_t last = ATOM_LOAD(&r->index);
+		size_t base = last > size ? last - size : 0;
+		size_t k;
+		for (k=base;k<last;k++) {
+			tmp[k-base] = r->ev[k & r->mask];
+		}
+		// 复制期间写入方可能覆盖了前面的记录，正在写的那条也不可用
+		size_t index = ATOM_LOAD(&r->index);
+		size_t first = base;
+		if (index + 1 > size && index + 1 - size > first) {
+			first = index + 1 - size;
+		}
+		if (first < last) {
+			int count = (int)(last - first);
+			cb(ud, r->thread, tmp + (first - base), count);
+			total += count;
+		}
+	}
+	skynet_free(tmp);
+	return total;
+}
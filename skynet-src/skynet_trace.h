@@ -0,0 +1,58 @@
+/*
+ * skynet_trace.h - 消息分发跟踪
+ * 每个工作线程一个环形缓冲区，记录分发的每条消息，开销低，可以在线上常开
+ */
+
+#ifndef SKYNET_TRACE_H
+#define SKYNET_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * 一次消息分发的记录
+ */
+struct skynet_trace_event {
+	uint64_t start;         // 开始分发的时间（单调时钟，纳秒）
+	uint32_t cost;          // 处理耗时（纳秒），超过4秒的按4秒计
+	uint32_t source;        // 消息来源服务handle
+	uint32_t destination;   // 处理消息的服务handle
+	int session;            // 会话ID
+	uint32_t size;          // 消息大小
+	int type;               // 消息类型，批量分发时为负的消息数量
+};
+
+/*
+ * 初始化跟踪系统
+ * @param size: 每个线程的环形缓冲区能保存的记录数，向上取整到2的幂；0表示启动时不开启
+ */
+void skynet_trace_init(int size);
+
+/*
+ * 开启或关闭跟踪
+ * @param on: 1开启，0关闭，-1只查询
+ * @return: 之前的状态
+ */
+int skynet_trace_enable(int on);
+
+/*
+ * 消息分发开始前调用
+ * @return: 当前时间（纳秒），没有开启跟踪时返回0
+ */
+uint64_t skynet_trace_begin(void);
+
+/*
+ * 消息分发结束后调用，把记录写入本线程的环形缓冲区
+ * @param start: skynet_trace_begin的返回值，为0时什么都不做
+ */
+void skynet_trace_end(uint64_t start, uint32_t source, uint32_t destination, int type, int session, size_t sz);
+
+/*
+ * 逐个读取所有线程的记录，读取时不阻塞写入方，已经被覆盖的记录会被丢弃
+ * @param cb: 对每个线程调用一次，thread 为线程编号，ev 为按时间排列的 n 条记录
+ * @param ud: 传给cb的参数
+ * @return: 记录总数
+ */
+int skynet_trace_foreach(void (*cb)(void *ud, int thread, const struct skynet_trace_event *ev, int n), void *ud);
+
+#endif
@@ -12,6 +12,8 @@
 #define SOCKET_BUFFER_MEMORY 0      // 内存缓冲区
 #define SOCKET_BUFFER_OBJECT 1      // 对象缓冲区
 #define SOCKET_BUFFER_RAWPOINTER 2  // 原始指针缓冲区
+// 分段缓冲区：buffer指向struct iovec数组，sz是段数。和原始指针一样，各段内存属于调用者
+#define SOCKET_BUFFER_IOVEC 3
 
 /*
  * socket发送缓冲区结构体
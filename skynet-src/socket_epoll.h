@@ -1,6 +1,7 @@
 /*
  * socket_epoll.h - Linux epoll事件模型实现头文件
  * 提供基于epoll的高性能I/O多路复用接口
+ * 开启io_uring后端时（见socket_uring.h），io_uring实例的调用转交给sp_uring_*
  */
 
 #ifndef poll_socket_epoll_h
@@ -15,6 +16,17 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 
+#include "socket_uring.h"
+
+// 边缘触发模式（socket_poll = "epoll_et"），只用于socket，唤醒描述符和监听socket仍然是水平触发
+// 省掉了有数据没读完时每一轮的epoll_wait，以及每次开关写事件之外的epoll_ctl
+static bool EPOLL_ET = false;
+
+static bool
+sp_edge() {
+	return EPOLL_ET;
+}
+
 /*
  * 检查epoll文件描述符是否无效
  * @param efd: epoll文件描述符
@@ -31,6 +43,13 @@ sp_invalid(int efd) {
  */
 static int
 sp_create() {
+#ifdef SOCKET_URING
+	if (URING_ENABLE) {
+		int fd = sp_uring_create();
+		if (fd != -1)
+			return fd;
+	}
+#endif
 	return epoll_create(1024);
 }
 
@@ -40,11 +59,18 @@ sp_create() {
  */
 static void
 sp_release(int efd) {
+#ifdef SOCKET_URING
+	struct sp_uring *U = sp_uring(efd);
+	if (U) {
+		sp_uring_release(U);
+		return;
+	}
+#endif
 	close(efd);
 }
 
 /*
- * 向epoll实例添加socket
+ * 向epoll实例添加socket，边缘触发模式下有ud的都先按边缘触发加入，之后由sp_enable决定
  * @param efd: epoll文件描述符
  * @param sock: socket文件描述符
  * @param ud: 用户数据指针
@@ -52,8 +78,16 @@ sp_release(int efd) {
  */
 static int
 sp_add(int efd, int sock, void *ud) {
+#ifdef SOCKET_URING
+	struct sp_uring *U = sp_uring(efd);
+	if (U)
+		return sp_uring_add(U, sock, ud);
+#endif
 	struct epoll_event ev;
 	ev.events = EPOLLIN;  // 默认监听读事件
+	if (EPOLL_ET && ud) {
+		ev.events |= EPOLLET | EPOLLRDHUP;
+	}
 	ev.data.ptr = ud;
 	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) == -1) {
 		return 1;
@@ -68,6 +102,13 @@ sp_add(int efd, int sock, void *ud) {
  */
 static void
 sp_del(int efd, int sock) {
+#ifdef SOCKET_URING
+	struct sp_uring *U = sp_uring(efd);
+	if (U) {
+		sp_uring_del(U, sock);
+		return;
+	}
+#endif
 	epoll_ctl(efd, EPOLL_CTL_DEL, sock , NULL);
 }
 
@@ -78,12 +119,22 @@ sp_del(int efd, int sock) {
  * @param ud: 用户数据指针
  * @param read_enable: 是否启用读事件监听
  * @param write_enable: 是否启用写事件监听
+ * @param edge: 边缘触发模式下是否用边缘触发
  * @return: 成功返回0，失败返回1
  */
 static int
-sp_enable(int efd, int sock, void *ud, bool read_enable, bool write_enable) {
+sp_enable(int efd, int sock, void *ud, bool read_enable, bool write_enable, bool edge) {
+#ifdef SOCKET_URING
+	struct sp_uring *U = sp_uring(efd);
+	if (U)
+		return sp_uring_enable(U, sock, ud, read_enable, write_enable);
+#endif
 	struct epoll_event ev;
 	ev.events = (read_enable ? EPOLLIN : 0) | (write_enable ? EPOLLOUT : 0);
+	if (EPOLL_ET && edge) {
+		// 修改时内核会重新检查状态，打开读写时已经就绪的也会通知一次
+		ev.events |= EPOLLET | EPOLLRDHUP;
+	}
 	ev.data.ptr = ud;
 	if (epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev) == -1) {
 		return 1;
@@ -96,12 +147,18 @@ sp_enable(int efd, int sock, void *ud, bool read_enable, bool write_enable) {
  * @param efd: epoll文件描述符
  * @param e: 事件数组
  * @param max: 最大事件数量
+ * @param block: 是否阻塞等待
  * @return: 实际事件数量
  */
 static int
-sp_wait(int efd, struct event *e, int max) {
+sp_wait(int efd, struct event *e, int max, bool block) {
+#ifdef SOCKET_URING
+	struct sp_uring *U = sp_uring(efd);
+	if (U)
+		return sp_uring_wait(U, e, max, block);
+#endif
 	struct epoll_event ev[max];
-	int n = epoll_wait(efd , ev, max, -1);  // 阻塞等待事件
+	int n = epoll_wait(efd , ev, max, block ? -1 : 0);  // 阻塞等待事件
 	int i;
 	for (i=0;i<n;i++) {
 		e[i].s = ev[i].data.ptr;
@@ -110,6 +167,7 @@ sp_wait(int efd, struct event *e, int max) {
 		e[i].read = (flag & EPOLLIN) != 0;    // 可读事件
 		e[i].error = (flag & EPOLLERR) != 0;  // 错误事件
 		e[i].eof = (flag & EPOLLHUP) != 0;    // 连接断开事件
+		e[i].rdhup = (flag & EPOLLRDHUP) != 0;  // 对方关闭写
 	}
 
 	return n;
@@ -29,12 +29,52 @@ struct socket_info {
 	uint64_t rtime;             // 最后读取时间
 	uint64_t wtime;             // 最后写入时间
 	int64_t wbuffer;            // 写缓冲区大小
+	int64_t wbuffer_peak;       // 写缓冲区的最大值
+	uint64_t nread;             // 读取次数（UDP是数据包数）
+	uint64_t nwrite;            // 写入次数
+	uint64_t eagain;            // 内核发送缓冲区满的次数
+	uint64_t warntime;          // 写缓冲区超过WARNING_SIZE的累计时间
+	uint64_t limited;           // 监听socket：准入控制拒绝的连接数；TCP连接：因读限速暂停读的次数
 	uint8_t reading;            // 是否正在读取
 	uint8_t writing;            // 是否正在写入
 	char name[128];             // socket名称或地址信息
 	struct socket_info *next;   // 链表指针，用于管理多个socket信息
 };
 
+// 读写长度直方图的格数，第i格统计长度在 [2^(i+5), 2^(i+6)) 之间的读写，首尾两格包括更短和更长的
+#define SOCKET_STAT_HISTOGRAM 12
+
+/*
+ * 按服务汇总的socket统计
+ * 每个分片按拥有socket的服务分别计数，查询时不需要遍历socket槽
+ */
+struct socket_service_stat {
+	uint32_t handle;            // 拥有socket的服务
+	int nsocket;                // 当前拥有的socket数量
+	uint64_t read;              // 已读取字节数
+	uint64_t write;             // 已写入字节数
+	uint64_t nread;             // 读取次数
+	uint64_t nwrite;            // 写入次数
+	uint64_t eagain;            // 内核发送缓冲区满的次数
+	uint64_t warntime;          // 各socket写缓冲区超过WARNING_SIZE的累计时间之和
+	int64_t wbuffer_peak;       // 单个socket写缓冲区的最大值
+	uint64_t rhistogram[SOCKET_STAT_HISTOGRAM];    // 读取长度直方图
+	uint64_t whistogram[SOCKET_STAT_HISTOGRAM];    // 写入长度直方图
+};
+
+/*
+ * 监听socket的准入控制和连接的读限速，见socket_server_admission，0表示不限制
+ * 速率都是令牌桶，允许突发一秒的量
+ */
+struct socket_admission_conf {
+	int max_conn;       // 从这个监听socket接受的、还没有关闭的连接数上限
+	int ip_conn;        // 每个ip的连接数上限
+	int accept_rate;    // 每秒接受的连接数
+	int ip_rate;        // 每个ip每秒接受的连接数
+	int read_bytes;     // 每个连接每秒读入的字节数，超过时socket线程暂停读这个连接
+	int read_packets;   // 每个连接每秒读的次数（即投递给服务的消息数）
+};
+
 /*
  * socket信息管理接口
  */
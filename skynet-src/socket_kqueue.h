@@ -100,10 +100,11 @@ sp_add(int kfd, int sock, void *ud) {
  * @param ud: 用户数据指针
  * @param read_enable: 是否启用读事件监听
  * @param write_enable: 是否启用写事件监听
+ * @param edge: 不支持边缘触发，忽略
  * @return: 成功返回0，失败返回非0
  */
 static int
-sp_enable(int kfd, int sock, void *ud, bool read_enable, bool write_enable) {
+sp_enable(int kfd, int sock, void *ud, bool read_enable, bool write_enable, bool edge) {
 	int ret = 0;
 	struct kevent ke;
 	// 设置读事件状态
@@ -124,12 +125,14 @@ sp_enable(int kfd, int sock, void *ud, bool read_enable, bool write_enable) {
  * @param kfd: kqueue文件描述符
  * @param e: 事件数组
  * @param max: 最大事件数量
+ * @param block: 是否阻塞等待
  * @return: 实际事件数量
  */
 static int
-sp_wait(int kfd, struct event *e, int max) {
+sp_wait(int kfd, struct event *e, int max, bool block) {
 	struct kevent ev[max];
-	int n = kevent(kfd, NULL, 0, ev, max, NULL);  // 阻塞等待事件
+	struct timespec zero = { 0, 0 };
+	int n = kevent(kfd, NULL, 0, ev, max, block ? NULL : &zero);  // 阻塞等待事件
 
 	int i;
 	for (i=0;i<n;i++) {
@@ -140,6 +143,7 @@ sp_wait(int kfd, struct event *e, int max) {
 		e[i].read = (filter == EVFILT_READ);              // 可读事件
 		e[i].error = (ev[i].flags & EV_ERROR) != 0;       // 错误事件
 		e[i].eof = eof;                                   // 连接断开事件
+		e[i].rdhup = false;
 	}
 
 	return n;
@@ -159,4 +163,10 @@ sp_nonblocking(int fd) {
 	fcntl(fd, F_SETFL, flag | O_NONBLOCK);
 }
 
+// kqueue的socket事件都是水平触发
+static bool
+sp_edge() {
+	return false;
+}
+
 #endif
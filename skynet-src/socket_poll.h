@@ -22,6 +22,7 @@ struct event {
 	bool write;     // 可写事件
 	bool error;     // 错误事件
 	bool eof;       // 连接结束事件
+	bool rdhup;     // 对方关闭了写（只在边缘触发模式下设置）
 };
 
 /*
@@ -44,15 +45,18 @@ static int sp_add(poll_fd fd, int sock, void *ud);
 // 从轮询实例删除socket
 static void sp_del(poll_fd fd, int sock);
 
-// 启用/禁用socket事件监听
-static int sp_enable(poll_fd, int sock, void *ud, bool read_enable, bool write_enable);
+// 启用/禁用socket事件监听，edge为false时即使在边缘触发模式下也用水平触发（例如监听socket）
+static int sp_enable(poll_fd, int sock, void *ud, bool read_enable, bool write_enable, bool edge);
 
-// 等待事件发生
-static int sp_wait(poll_fd, struct event *e, int max);
+// 等待事件发生，block为false时不等待，立即返回已经发生的事件（忙轮询使用）
+static int sp_wait(poll_fd, struct event *e, int max, bool block);
 
 // 设置socket为非阻塞模式
 static void sp_nonblocking(int sock);
 
+// socket的事件是否边缘触发：只在状态变化时通知一次，可读时要读到没有数据为止
+static bool sp_edge();
+
 /*
  * 平台相关实现包含
  * 根据编译平台自动选择最优的事件模型
@@ -4,15 +4,24 @@
  * 使用epoll/kqueue等系统调用实现事件驱动的网络处理
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// recvmmsg 和 sendmmsg 需要 _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "skynet.h"
 
 #include "socket_server.h"
 #include "socket_poll.h"
 #include "atomic.h"
 #include "spinlock.h"
+#include "rudp.h"
+#include "skynet_probe.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
@@ -22,13 +31,42 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
 
 // 系统配置常量
 #define MAX_INFO 128            // 最大信息长度
-// MAX_SOCKET will be 2^MAX_SOCKET_P
-#define MAX_SOCKET_P 16         // socket数量的幂次（MAX_SOCKET = 2^MAX_SOCKET_P）
+#define DEFAULT_SOCKET_P 16     // 每个分片默认的socket数量 2^16
+#define MAX_SOCKET_P 24         // 每个分片socket数量的上限 2^24，id中至少还要留几位标签
+#define SLOT_PAGE_P 10          // socket槽按页分配，每页 2^10 个，用到时才分配
 #define MAX_EVENT 64            // 每次poll的最大事件数
+#define CTRL_QUEUE_SIZE 4096    // 控制命令队列的初始大小（字节）
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define MAX_IOV IOV_MAX         // 每次writev最多合并的缓冲区数
+#else
+#define MAX_IOV 1024
+#endif
 #define MIN_READ_BUFFER 64      // 最小读缓冲区大小
+#define READ_BUDGET (256 * 1024)    // 连续读一个socket的配额（字节），用完后先处理其他socket
+
+// 读水位的状态，见socket_server_watermark
+#define RB_READING 0            // 正常读
+#define RB_PAUSED 1             // 未消费的数据超过高水位，socket线程停止了读
+#define RB_RESUMING 2           // 服务消费到低水位以下，已经请求socket线程恢复
+
+// 准入控制，见socket_server_admission
+#define ADMISSION_HASH 1024     // 按ip计数的哈希表大小
+#define ADMISSION_IP_MAX 65536  // 最多跟踪的ip数，满了以后新的ip被拒绝
+
+// 读缓冲池，按2的幂分级，读缓冲区的大小总是其中一级
+#define BUFFER_POOL_MIN 6               // 最小一级 2^6 (MIN_READ_BUFFER)
+#define BUFFER_POOL_MAX 20              // 最大一级 2^20，更大的缓冲区不缓存
+#define BUFFER_POOL_BYTES (1<<20)       // 每一级最多缓存的字节数
 
 // socket类型定义
 #define SOCKET_TYPE_INVALID 0           // 无效socket
@@ -42,15 +80,15 @@
 #define SOCKET_TYPE_PACCEPT 8           // 预接受状态
 #define SOCKET_TYPE_BIND 9              // 绑定状态
 
-#define MAX_SOCKET (1<<MAX_SOCKET_P)    // 最大socket数量
-
 // 优先级定义
 #define PRIORITY_HIGH 0         // 高优先级
 #define PRIORITY_LOW 1          // 低优先级
 
 // ID相关宏定义
-#define HASH_ID(id) (((unsigned)id) % MAX_SOCKET)   // 计算socket ID的哈希值
-#define ID_TAG16(id) ((id>>MAX_SOCKET_P) & 0xffff)  // 提取ID的标签部分
+// 多个分片时 id % nshard 是分片编号，id / nshard 是分片内的编号
+// 分片内编号的低slot_p位是槽的下标，更高的位是标签，用来区分复用同一个槽的socket
+#define HASH_ID(ss, id) (((unsigned)(id) / (ss)->nshard) & ((ss)->max_socket - 1))   // 计算socket ID的哈希值
+#define ID_TAG16(ss, id) ((((unsigned)(id) / (ss)->nshard) >> (ss)->slot_p) & 0xffff)  // 提取ID的标签部分
 
 // 协议类型定义
 #define PROTOCOL_TCP 0          // TCP协议
@@ -62,6 +100,11 @@
 
 #define MAX_UDP_PACKAGE 65535
 
+#ifdef __linux__
+#define UDP_MMSG                // 使用recvmmsg/sendmmsg批量收发UDP数据包
+#define UDP_BATCH 16            // 每次系统调用最多收发的数据包数
+#endif
+
 // EAGAIN and EWOULDBLOCK may be not the same value.
 // EAGAIN和EWOULDBLOCK可能不是同一个值
 #if (EAGAIN != EWOULDBLOCK)
@@ -71,15 +114,23 @@
 #endif
 
 #define WARNING_SIZE (1024*1024)
+#define COALESCE_SIZE (64*1024)
+
+#define OWNER_HASH 256
 
 #define USEROBJECT ((size_t)(-1))
 
+#define RUDP_HASH 64            // 可靠UDP每个socket的会话哈希桶数
+#define RUDP_IDLE 60000         // 可靠UDP的会话空闲这么多毫秒后丢弃
+
 struct write_buffer {
 	struct write_buffer * next;
 	const void *buffer;
 	char *ptr;
 	size_t sz;
 	bool userobject;
+	bool file;          // 发送文件的缓冲区，是一个write_buffer_file
+	bool shared;        // buffer是广播用的socket_sharedbuffer
 };
 
 struct write_buffer_udp {
@@ -87,6 +138,20 @@ struct write_buffer_udp {
 	uint8_t udp_address[UDP_ADDRESS_SIZE];
 };
 
+// 用sendfile发送的文件片段，sz是剩余的字节数，发送完后关闭fd
+struct write_buffer_file {
+	struct write_buffer buffer;
+	int fd;
+	off_t offset;
+};
+
+// 广播用的共享缓冲区，每个引用它的写缓冲区持有一个引用
+struct socket_sharedbuffer {
+	ATOM_INT ref;
+	size_t sz;
+	char data[1];
+};
+
 struct wb_list {
 	struct write_buffer * head;
 	struct write_buffer * tail;
@@ -97,6 +162,61 @@ struct socket_stat {
 	uint64_t wtime;
 	uint64_t read;
 	uint64_t write;
+	uint64_t nread;
+	uint64_t nwrite;
+	uint64_t eagain;
+	uint64_t warntime;      // 写缓冲区超过WARNING_SIZE的累计时间
+	uint64_t warnstart;     // 这次超过WARNING_SIZE的开始时间
+	int64_t wb_peak;
+	uint64_t limited;       // 监听socket拒绝的连接数，或者连接因读限速暂停的次数
+	bool warning;           // 写缓冲区现在是否超过WARNING_SIZE
+};
+
+/*
+ * 一个服务在本分片里拥有的socket的汇总统计，按服务句柄放在socket_server的哈希表里
+ * 写入的计数可能在工作线程直接发送时更新，所以用原子操作；其余的只在socket线程中更新
+ * 最后一个socket关闭时释放，增删和查询都在owner_lock里进行
+ */
+struct socket_owner {
+	struct socket_owner *next;
+	uintptr_t opaque;
+	int nsocket;
+	uint64_t read;
+	uint64_t nread;
+	uint64_t eagain;
+	uint64_t warntime;
+	int64_t wb_peak;
+	ATOM_ULONG write;
+	ATOM_ULONG nwrite;
+	uint64_t rhistogram[SOCKET_STAT_HISTOGRAM];
+	ATOM_ULONG whistogram[SOCKET_STAT_HISTOGRAM];
+};
+
+/*
+ * 一个ip在某个监听socket上的连接数和接受速率
+ * 连接数为0以后不马上释放，等令牌桶满了再释放，否则断开重连就能绕过速率限制
+ */
+struct admission_ip {
+	struct admission_ip *next;
+	uint8_t addr[16];       // ipv4映射为::ffff:a.b.c.d
+	int conn;
+	int64_t token;
+	uint64_t time;
+};
+
+/*
+ * 监听socket的准入控制，接受的连接可能交给其他分片，在那里关闭，所以计数要加锁
+ * 监听socket和每个接受的连接各持有一个引用
+ */
+struct socket_admission {
+	struct spinlock lock;
+	int ref;
+	struct socket_admission_conf conf;
+	int conn;               // 接受的、还没有关闭的连接数
+	int64_t token;          // 接受速率的令牌桶，见token_refill
+	uint64_t time;
+	int nip;
+	struct admission_ip *ip[ADMISSION_HASH];
 };
 
 struct socket {
@@ -105,6 +225,7 @@ struct socket {
 	struct wb_list low;
 	int64_t wb_size;
 	struct socket_stat stat;
+	struct socket_owner *owner;     // 拥有socket的服务的汇总统计，修改时持有socket_lock
 	ATOM_ULONG sending;
 	int fd;
 	int id;
@@ -113,35 +234,123 @@ struct socket {
 	bool reading;
 	bool writing;
 	bool closing;
+	bool reuseport;     // SO_REUSEPORT监听的分片之一，接受的连接留在本分片
+	bool coalesce;      // 合并发送：数据先留在写缓冲区，直到flush或者积累到COALESCE_SIZE
+	bool batch;         // 读到的数据以SOCKET_BATCH返回，由上层合并投递，监听socket的设置由接受的连接继承
+	bool reliable;      // 可靠UDP，发送都交给socket线程，见socket_server_reliable
 	ATOM_INT udpconnecting;
 	int64_t warn_size;
 	union {
 		int size;
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
 	} p;
+	int read_avg;       // 最近读取字节数的滑动平均，用来决定什么时候缩小读缓冲区
+	int read_burst;     // 这一轮连续读到的字节数，见read_budget
+	int rb_high;        // 读水位，见socket_server_watermark，0表示不限制
+	int rb_low;
+	uint64_t rb_base;   // 当前的服务开始接收之前读到的字节数 (stat.read)
+	ATOM_ULONG rb_consumed; // 服务已经消费的字节数，由服务写入
+	ATOM_INT rb_state;  // RB_READING RB_PAUSED RB_RESUMING
 	struct spinlock dw_lock;
 	int dw_offset;
 	const void * dw_buffer;
 	size_t dw_size;
+	struct rudp_host *rudp;     // 可靠UDP的会话，只在socket线程中使用
+	struct socket_admission *admission; // 监听socket的准入控制，或者接受这个连接的监听socket的
+	struct admission_ip *admission_ip;  // 这个连接计入的ip
+	int rl_bytes;       // 读限速（每秒字节数和读次数），0表示不限制，见throttle_read
+	int rl_packets;
+	int64_t rl_btoken;
+	int64_t rl_ptoken;
+	uint64_t rl_time;
+	uint64_t rl_until;  // 限速暂停读到这个时间
+	bool throttled;     // 因读限速暂停了读，在socket_server的throttle链表里
+	struct socket *throttle_next;
+};
+
+/*
+ * 控制命令队列
+ * 多个线程写入、socket线程读出的字节队列，每条命令是 type(1) len(1) 数据(len)
+ * 写入时只在socket线程等待事件时才写唤醒描述符，大多数命令不需要系统调用
+ */
+struct ctrl_queue {
+	struct spinlock lock;
+	uint8_t *buffer;
+	int cap;
+	int head;
+	int tail;
+};
+
+union sockaddr_all {
+	struct sockaddr s;
+	struct sockaddr_in v4;
+	struct sockaddr_in6 v6;
+};
+
+#ifdef UDP_MMSG
+// recvmmsg一次读到的数据包，逐个交给socket_server_poll返回
+struct udp_batch {
+	int id;                 // 数据包所属的socket
+	int n;                  // 读到的数量
+	int index;              // 下一个要返回的数据包
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	union sockaddr_all addr[UDP_BATCH];
+	uint8_t buffer[UDP_BATCH][MAX_UDP_PACKAGE];
+};
+#endif
+
+struct ready_socket {
+	struct socket *s;
+	int id;             // 处理之前socket可能已经关闭，槽位被新的连接复用，用id校验
 };
 
 struct socket_server {
 	volatile uint64_t time;
 	int reserve_fd;	// for EMFILE
 	// 为EMFILE错误预留的文件描述符
-	int recvctrl_fd;
+	int recvctrl_fd;        // 唤醒socket线程的文件描述符（linux下是eventfd，与sendctrl_fd相同；其他平台是管道）
 	int sendctrl_fd;
+	struct ctrl_queue cmd;  // 其他线程发给socket线程的控制命令
+	ATOM_INT cmd_count;     // 队列中的命令数量
+	ATOM_INT sleeping;      // socket线程是否正在（或即将）等待事件，只有这时才需要唤醒
 	int checkctrl;
+	int batched;        // 上次等待事件之后返回过SOCKET_BATCH，等待前先返回SOCKET_IDLE
+	int busypoll;       // 阻塞等待事件之前忙轮询的时间（微秒），0表示直接阻塞
 	poll_fd event_fd;
 	ATOM_INT alloc_id;
+	int shard;                          // 本实例的分片编号
+	int nshard;                         // 分片数量，单实例时为1
+	int accept_next;                    // 下一个接收新连接的分片（只在本实例的socket线程中使用）
+	struct socket_server **group;       // 所有分片，新接受的连接轮流交给各个分片
 	int event_n;
 	int event_index;
 	struct socket_object_interface soi;
 	struct event ev[MAX_EVENT];
-	struct socket slot[MAX_SOCKET];
+	struct ready_socket ready[MAX_EVENT];   // 边缘触发模式下用完配额还没读完的socket，下一轮不等待直接读
+	int ready_n;
+	struct socket_sharedbuffer *bc_buffer;  // 报告了错误或警告、还没有处理完的广播，下次轮询从bc_index继续
+	int *bc_id;
+	int bc_n;
+	int bc_index;
+	int slot_p;                         // 每个分片最多 2^slot_p 个socket
+	int max_socket;
+	ATOM_POINTER *page;                 // socket槽的页表，每页 2^SLOT_PAGE_P 个槽，页分配后不会移动或释放
+	struct socket invalid_slot;         // 没有分配的页里的id都指向这个无效的槽
 	char buffer[MAX_INFO];
+	struct spinlock owner_lock;
+	struct socket_owner *owner[OWNER_HASH];     // 按服务句柄汇总的统计
+	struct rudp_host *rudp;             // 打开了可靠模式的UDP socket
+	ATOM_INT rudp_count;
+	ATOM_INT rudp_tick;                 // 已经发出了'Z'命令，还没有处理
+	struct socket *throttle;            // 因读限速暂停读的连接，只在socket线程中使用
+	ATOM_INT throttle_count;
+	ATOM_INT throttle_tick;             // 已经发出了'J'命令，还没有处理
+#ifdef UDP_MMSG
+	struct udp_batch udp;
+#else
 	uint8_t udpbuffer[MAX_UDP_PACKAGE];
-	fd_set rfds;
+#endif
 };
 
 struct request_open {
@@ -177,6 +386,7 @@ struct request_listen {
 	int id;
 	int fd;
 	uintptr_t opaque;
+	int reuseport;
 	// char host[1];
 	// 主机名（变长）
 };
@@ -185,6 +395,11 @@ struct request_bind {
 	int id;
 	int fd;
 	uintptr_t opaque;
+	int batch;      // 转交的新连接继承监听socket的批量模式
+	int rl_bytes;   // 和读限速
+	int rl_packets;
+	struct socket_admission *admission;     // 已经计入了准入控制的连接数
+	struct admission_ip *admission_ip;
 };
 
 struct request_resumepause {
@@ -198,6 +413,17 @@ struct request_setopt {
 	int value;
 };
 
+struct request_watermark {
+	int id;
+	int high;
+	int low;
+};
+
+struct request_admission {
+	int id;
+	struct socket_admission_conf conf;
+};
+
 struct request_udp {
 	int id;
 	int fd;
@@ -212,6 +438,19 @@ struct request_dial_udp {
 	uint8_t address[UDP_ADDRESS_SIZE];
 };
 
+struct request_sendfile {
+	int id;
+	int fd;
+	int64_t offset;
+	int64_t size;
+};
+
+struct request_broadcast {
+	struct socket_sharedbuffer * buffer;
+	int n;
+	int * id;	// 由socket线程释放
+};
+
 /*
 	The first byte is TYPE
 	R Resume socket
@@ -229,6 +468,14 @@ struct request_dial_udp {
 	N client dial to UDP host port
 	T Set opt
 	U Create UDP socket
+	F Send file
+	G Set coalesce mode
+	M Broadcast package
+	Q Set batch mode
+	E Enable reliable udp
+	Z Reliable udp tick
+	I Set admission control
+	J Resume the throttled sockets
  */
 /*
 	第一个字节是类型
@@ -247,6 +494,14 @@ struct request_dial_udp {
 	N 客户端拨号到UDP主机端口
 	T 设置选项
 	U 创建UDP socket
+	F 发送文件
+	G 设置合并发送模式
+	M 广播包
+	Q 设置批量投递模式
+	E 打开可靠UDP
+	Z 可靠UDP的定时驱动
+	I 设置准入控制
+	J 恢复读限速到期的连接
  */
 
 struct request_package {
@@ -262,19 +517,17 @@ struct request_package {
 		struct request_bind bind;
 		struct request_resumepause resumepause;
 		struct request_setopt setopt;
+		struct request_watermark watermark;
+		struct request_admission admission;
 		struct request_udp udp;
 		struct request_setudp set_udp;
 		struct request_dial_udp dial_udp;
+		struct request_sendfile sendfile;
+		struct request_broadcast broadcast;
 	} u;
 	uint8_t dummy[256];
 };
 
-union sockaddr_all {
-	struct sockaddr s;
-	struct sockaddr_in v4;
-	struct sockaddr_in6 v6;
-};
-
 struct send_object {
 	const void * buffer;
 	size_t sz;
@@ -388,11 +641,23 @@ send_object_init_from_sendbuffer(struct socket_server *ss, struct send_object *s
 	}
 }
 
+// 释放共享缓冲区的一个引用
+void
+socket_server_sharedbuffer_release(struct socket_sharedbuffer *sb) {
+	if (ATOM_FDEC(&sb->ref) == 1) {
+		FREE(sb);
+	}
+}
+
 // 释放写缓冲区
 // 根据用户对象标志选择释放方式
 static inline void
 write_buffer_free(struct socket_server *ss, struct write_buffer *wb) {
-	if (wb->userobject) {
+	if (wb->file) {
+		close(((struct write_buffer_file *)wb)->fd);
+	} else if (wb->shared) {
+		socket_server_sharedbuffer_release((struct socket_sharedbuffer *)wb->buffer);
+	} else if (wb->userobject) {
 		ss->soi.free((void *)wb->buffer);
 	} else {
 		FREE((void *)wb->buffer);
@@ -408,17 +673,76 @@ socket_keepalive(int fd) {
 	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keepalive , sizeof(keepalive));
 }
 
+// 清空写缓冲区列表
+// 将头部和尾部指针设为NULL
+static inline void
+clear_wb_list(struct wb_list *list) {
+	list->head = NULL;
+	list->tail = NULL;
+}
+
+// 槽下标对应的socket，页还没有分配时返回NULL
+static inline struct socket *
+slot_index(struct socket_server *ss, int i) {
+	struct socket *page = (struct socket *)ATOM_LOAD(&ss->page[i >> SLOT_PAGE_P]);
+	if (page == NULL)
+		return NULL;
+	return &page[i & ((1 << SLOT_PAGE_P) - 1)];
+}
+
+// id对应的socket槽，所在的页没有分配时返回一个无效的槽，调用者用socket_invalid检查
+static inline struct socket *
+socket_slot(struct socket_server *ss, int id) {
+	struct socket *s = slot_index(ss, HASH_ID(ss, id));
+	return s ? s : &ss->invalid_slot;
+}
+
+static void
+slot_init(struct socket *s) {
+	memset(s, 0, sizeof(*s));
+	s->id = -1;
+	ATOM_INIT(&s->type, SOCKET_TYPE_INVALID);
+	clear_wb_list(&s->high);
+	clear_wb_list(&s->low);
+	spinlock_init(&s->dw_lock);
+}
+
+// 分配下标i所在的页（可能在多个线程中同时调用）
+static struct socket *
+slot_alloc(struct socket_server *ss, int i) {
+	struct socket *s = slot_index(ss, i);
+	if (s)
+		return s;
+	int n = 1 << SLOT_PAGE_P;
+	struct socket *page = MALLOC(n * sizeof(struct socket));
+	int j;
+	for (j=0;j<n;j++) {
+		slot_init(&page[j]);
+	}
+	if (!ATOM_CAS_POINTER(&ss->page[i >> SLOT_PAGE_P], (uintptr_t)0, (uintptr_t)page)) {
+		// 其他线程已经分配了这一页
+		for (j=0;j<n;j++) {
+			spinlock_destroy(&page[j].dw_lock);
+		}
+		FREE(page);
+	}
+	return slot_index(ss, i);
+}
+
 // 预留socket ID
 // 在socket槽中找到空闲位置并分配ID
 static int
 reserve_id(struct socket_server *ss) {
 	int i;
-	for (i=0;i<MAX_SOCKET;i++) {
+	for (i=0;i<ss->max_socket;i++) {
 		int id = ATOM_FINC(&(ss->alloc_id))+1;
-		if (id < 0) {
+		if (id < 0 || id > (0x7fffffff - ss->shard) / ss->nshard) {
 			id = ATOM_FAND(&(ss->alloc_id), 0x7fffffff) & 0x7fffffff;
+			id %= 0x7fffffff / ss->nshard;
 		}
-		struct socket *s = &ss->slot[HASH_ID(id)];
+		// 分片内的编号换算成全局的socket ID
+		id = id * ss->nshard + ss->shard;
+		struct socket *s = slot_alloc(ss, HASH_ID(ss, id));
 		int type_invalid = ATOM_LOAD(&s->type);
 		if (type_invalid == SOCKET_TYPE_INVALID) {
 			if (ATOM_CAS(&s->type, type_invalid, SOCKET_TYPE_RESERVE)) {
@@ -441,18 +765,167 @@ reserve_id(struct socket_server *ss) {
 	return -1;
 }
 
-// 清空写缓冲区列表
-// 将头部和尾部指针设为NULL
-static inline void
-clear_wb_list(struct wb_list *list) {
-	list->head = NULL;
-	list->tail = NULL;
+// 唤醒socket线程用的文件描述符：linux下用eventfd（读写是同一个描述符），其他平台用管道
+static int
+doorbell_open(int fd[2]) {
+#ifdef __linux__
+	int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+		return -1;
+	fd[0] = fd[1] = efd;
+#else
+	if (pipe(fd))
+		return -1;
+	sp_nonblocking(fd[0]);
+	sp_nonblocking(fd[1]);
+#endif
+	return 0;
+}
+
+static void
+doorbell_close(int fd[2]) {
+	close(fd[0]);
+	if (fd[1] != fd[0])
+		close(fd[1]);
+}
+
+// 选择事件模型
+// io_uring实例创建失败时sp_create会退回epoll
+int
+socket_server_backend(const char *name) {
+	if (name == NULL || strcmp(name, "epoll") == 0 || strcmp(name, "kqueue") == 0) {
+#ifdef SOCKET_URING
+		URING_ENABLE = false;
+#endif
+		return 0;
+	}
+#ifdef __linux__
+	if (strcmp(name, "epoll_et") == 0) {
+#ifdef SOCKET_URING
+		URING_ENABLE = false;
+#endif
+		EPOLL_ET = true;
+		return 0;
+	}
+#endif
+#ifdef SOCKET_URING
+	if (strcmp(name, "uring") == 0) {
+		URING_ENABLE = true;
+		return 0;
+	}
+#endif
+	return -1;
 }
 
 // 创建socket服务器
 // 初始化socket服务器结构，设置事件循环和管道
+/*
+ * 读缓冲池
+ * socket线程从池中取读缓冲区，服务处理完SKYNET_SOCKET_TYPE_DATA消息后通过socket_server_recycle放回，
+ * 稳定状态下读数据不需要分配内存。没有放回池中（直接skynet_free）的缓冲区也是正确的，只是不能复用。
+ */
+struct buffer_pool {
+	struct spinlock lock;
+	int n;
+	void * head;    // 空闲缓冲区链表，每个缓冲区开头保存下一个的指针
+};
+
+static struct buffer_pool BUFFER_POOL[BUFFER_POOL_MAX - BUFFER_POOL_MIN + 1];
+
+static void
+buffer_pool_init() {
+	static int init = 0;
+	if (init)
+		return;
+	init = 1;
+	int i;
+	for (i=0;i<=BUFFER_POOL_MAX - BUFFER_POOL_MIN;i++) {
+		spinlock_init(&BUFFER_POOL[i].lock);
+		BUFFER_POOL[i].n = 0;
+		BUFFER_POOL[i].head = NULL;
+	}
+}
+
+// 能容纳sz字节的最小一级，超过最大一级时返回-1
+static inline int
+buffer_class(int sz) {
+	int c = 0;
+	while ((1 << (c + BUFFER_POOL_MIN)) < sz) {
+		if (++c > BUFFER_POOL_MAX - BUFFER_POOL_MIN)
+			return -1;
+	}
+	return c;
+}
+
+// sz必须是2的幂
+static void *
+buffer_alloc(int sz) {
+	int c = buffer_class(sz);
+	if (c >= 0) {
+		struct buffer_pool *bp = &BUFFER_POOL[c];
+		spinlock_lock(&bp->lock);
+		void * buffer = bp->head;
+		if (buffer) {
+			bp->head = *(void **)buffer;
+			--bp->n;
+		}
+		spinlock_unlock(&bp->lock);
+		if (buffer)
+			return buffer;
+	}
+	return MALLOC(sz);
+}
+
+// 从读缓冲池分配至少sz字节，大小向上取到2的幂，以后可以用socket_server_recycle放回
+void *
+socket_server_alloc(int sz) {
+	int c = buffer_class(sz);
+	if (c >= 0)
+		sz = 1 << (c + BUFFER_POOL_MIN);
+	return buffer_alloc(sz);
+}
+
+// sz是消息中的数据长度，读缓冲区的实际大小是不小于sz的2的幂
+void
+socket_server_recycle(void *buffer, int sz) {
+	if (buffer == NULL)
+		return;
+	int c = buffer_class(sz);
+	if (c >= 0) {
+		struct buffer_pool *bp = &BUFFER_POOL[c];
+		int cap = BUFFER_POOL_BYTES >> (c + BUFFER_POOL_MIN);
+		spinlock_lock(&bp->lock);
+		if (bp->n < cap) {
+			*(void **)buffer = bp->head;
+			bp->head = buffer;
+			++bp->n;
+			buffer = NULL;
+		}
+		spinlock_unlock(&bp->lock);
+	}
+	FREE(buffer);
+}
+
+#ifdef UDP_MMSG
+static void
+udp_batch_init(struct udp_batch *b) {
+	int i;
+	b->id = 0;
+	b->n = 0;
+	b->index = 0;
+	memset(b->msg, 0, sizeof(b->msg));
+	for (i=0;i<UDP_BATCH;i++) {
+		b->iov[i].iov_base = b->buffer[i];
+		b->iov[i].iov_len = MAX_UDP_PACKAGE;
+		b->msg[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msg[i].msg_hdr.msg_iovlen = 1;
+		b->msg[i].msg_hdr.msg_name = &b->addr[i];
+	}
+}
+#endif
+
 struct socket_server *
-socket_server_create(uint64_t time) {
+socket_server_create(uint64_t time, int max_socket) {
 	int i;
 	int fd[2];
 	poll_fd efd = sp_create();
@@ -460,7 +933,7 @@ socket_server_create(uint64_t time) {
 		skynet_error(NULL, "socket-server error: create event pool failed.");
 		return NULL;
 	}
-	if (pipe(fd)) {
+	if (doorbell_open(fd)) {
 		sp_release(efd);
 		skynet_error(NULL, "socket-server error: create socket pair failed.");
 		return NULL;
@@ -469,43 +942,105 @@ socket_server_create(uint64_t time) {
 		// add recvctrl_fd to event poll
 		// 将recvctrl_fd添加到事件轮询
 		skynet_error(NULL, "socket-server error: can't add server fd to event pool.");
-		close(fd[0]);
-		close(fd[1]);
+		doorbell_close(fd);
 		sp_release(efd);
 		return NULL;
 	}
 
+	buffer_pool_init();
+
 	struct socket_server *ss = MALLOC(sizeof(*ss));
 	ss->time = time;
 	ss->event_fd = efd;
 	ss->recvctrl_fd = fd[0];
 	ss->sendctrl_fd = fd[1];
+	spinlock_init(&ss->cmd.lock);
+	ss->cmd.cap = CTRL_QUEUE_SIZE;
+	ss->cmd.buffer = MALLOC(ss->cmd.cap);
+	ss->cmd.head = 0;
+	ss->cmd.tail = 0;
+	ATOM_INIT(&ss->cmd_count, 0);
+	ATOM_INIT(&ss->sleeping, 0);
 	ss->checkctrl = 1;
+	ss->batched = 0;
+	ss->busypoll = 0;
+	ss->ready_n = 0;
+	ss->bc_buffer = NULL;
+	ss->bc_id = NULL;
+	ss->bc_n = 0;
+	ss->bc_index = 0;
 	ss->reserve_fd = dup(1);	// reserve an extra fd for EMFILE
 	// 为EMFILE错误预留一个额外的文件描述符
 
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
-		ATOM_INIT(&s->type, SOCKET_TYPE_INVALID);
-		clear_wb_list(&s->high);
-		clear_wb_list(&s->low);
-		spinlock_init(&s->dw_lock);
+	if (max_socket <= 0)
+		max_socket = 1 << DEFAULT_SOCKET_P;
+	ss->slot_p = SLOT_PAGE_P;
+	while ((1 << ss->slot_p) < max_socket && ss->slot_p < MAX_SOCKET_P)
+		++ss->slot_p;
+	ss->max_socket = 1 << ss->slot_p;
+	int npage = ss->max_socket >> SLOT_PAGE_P;
+	ss->page = MALLOC(npage * sizeof(ATOM_POINTER));
+	for (i=0;i<npage;i++) {
+		ATOM_INIT(&ss->page[i], (uintptr_t)0);
 	}
+	slot_init(&ss->invalid_slot);
 	ATOM_INIT(&ss->alloc_id , 0);
+	ss->shard = 0;
+	ss->nshard = 1;
+	ss->accept_next = 0;
+	ss->group = NULL;
 	ss->event_n = 0;
 	ss->event_index = 0;
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds);
-	assert(ss->recvctrl_fd < FD_SETSIZE);
+	spinlock_init(&ss->owner_lock);
+	memset(ss->owner, 0, sizeof(ss->owner));
+	ss->rudp = NULL;
+	ATOM_INIT(&ss->rudp_count, 0);
+	ATOM_INIT(&ss->rudp_tick, 0);
+	ss->throttle = NULL;
+	ATOM_INIT(&ss->throttle_count, 0);
+	ATOM_INIT(&ss->throttle_tick, 0);
+#ifdef UDP_MMSG
+	udp_batch_init(&ss->udp);
+#endif
 
 	return ss;
 }
 
+// 设置阻塞等待事件之前忙轮询的时间（微秒），在socket线程启动之前调用
+void
+socket_server_busypoll(struct socket_server *ss, int usec) {
+	ss->busypoll = usec > 0 ? usec : 0;
+}
+
+// 把多个socket服务器组成一组分片，必须在分配任何socket之前调用
+void
+socket_server_group(struct socket_server **group, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		group[i]->shard = i;
+		group[i]->nshard = n;
+		group[i]->group = n > 1 ? group : NULL;
+	}
+}
+
+static void send_request(struct socket_server *ss, struct request_package *request, char type, int len);
+
 // 更新socket服务器时间
 // 设置当前时间戳用于统计
 void
 socket_server_updatetime(struct socket_server *ss, uint64_t time) {
 	ss->time = time;
+	if (ATOM_LOAD(&ss->rudp_count) > 0 && ATOM_CAS(&ss->rudp_tick, 0, 1)) {
+		// 驱动可靠UDP的重传，上一个tick的命令还没有处理时不再发
+		struct request_package request;
+		send_request(ss, &request, 'Z', 0);
+	}
+	if (ATOM_LOAD(&ss->throttle_count) > 0 && ATOM_CAS(&ss->throttle_tick, 0, 1)) {
+		// 恢复读限速到期的连接
+		struct request_package request;
+		send_request(ss, &request, 'J', 0);
+	}
 }
 
 // 释放写缓冲区列表
@@ -535,6 +1070,7 @@ free_buffer(struct socket_server *ss, struct socket_sendbuffer *buf) {
 		ss->soi.free(buffer);
 		break;
 	case SOCKET_BUFFER_RAWPOINTER:
+	case SOCKET_BUFFER_IOVEC:
 		break;
 	}
 }
@@ -557,6 +1093,22 @@ clone_buffer(struct socket_sendbuffer *buf, size_t *sz) {
 		void * tmp = MALLOC(*sz);
 		memcpy(tmp, buf->buffer, *sz);
 		return tmp;
+	case SOCKET_BUFFER_IOVEC: {
+		// 各段拼接成一块内存，只在不能直接写完时才复制
+		const struct iovec *iov = buf->buffer;
+		size_t i, total = 0;
+		for (i=0;i<buf->sz;i++) {
+			total += iov[i].iov_len;
+		}
+		char * tmp = MALLOC(total);
+		char * ptr = tmp;
+		for (i=0;i<buf->sz;i++) {
+			memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+			ptr += iov[i].iov_len;
+		}
+		*sz = total;
+		return tmp;
+	}
 	}
 	// never get here
 	// 永远不会到达这里
@@ -564,6 +1116,117 @@ clone_buffer(struct socket_sendbuffer *buf, size_t *sz) {
 	return NULL;
 }
 
+// 找到（或创建）服务的汇总统计，并计入一个socket
+static struct socket_owner *
+owner_attach(struct socket_server *ss, uintptr_t opaque) {
+	struct socket_owner **slot = &ss->owner[opaque % OWNER_HASH];
+	spinlock_lock(&ss->owner_lock);
+	struct socket_owner *o = *slot;
+	while (o && o->opaque != opaque)
+		o = o->next;
+	if (o == NULL) {
+		o = MALLOC(sizeof(*o));
+		memset(o, 0, sizeof(*o));
+		o->opaque = opaque;
+		o->next = *slot;
+		*slot = o;
+	}
+	++o->nsocket;
+	spinlock_unlock(&ss->owner_lock);
+	return o;
+}
+
+// socket不再属于这个服务，服务没有socket时释放汇总统计
+static void
+owner_detach(struct socket_server *ss, struct socket_owner *o) {
+	spinlock_lock(&ss->owner_lock);
+	if (--o->nsocket == 0) {
+		struct socket_owner **slot = &ss->owner[o->opaque % OWNER_HASH];
+		while (*slot != o)
+			slot = &(*slot)->next;
+		*slot = o->next;
+		FREE(o);
+	}
+	spinlock_unlock(&ss->owner_lock);
+}
+
+// 结束写缓冲区超过WARNING_SIZE的计时
+static inline void
+stat_warn_end(struct socket_server *ss, struct socket *s) {
+	if (s->stat.warning) {
+		uint64_t t = ss->time - s->stat.warnstart;
+		s->stat.warning = false;
+		s->stat.warntime += t;
+		s->owner->warntime += t;
+	}
+}
+
+static void rudp_host_delete(struct socket_server *ss, struct rudp_host *h);
+
+/*
+	令牌桶：令牌以1/100为单位，每1/100秒补充rate，最多积累一秒的量，每接受一个连接（读一个字节）消耗100
+	elapsed是距离上次补充的1/100秒数
+ */
+static inline int64_t
+token_refill(int64_t token, uint64_t elapsed, int rate) {
+	int64_t full = (int64_t)rate * 100;
+	if (elapsed >= 100)
+		return full;
+	token += (int64_t)elapsed * rate;
+	return token > full ? full : token;
+}
+
+// 释放准入控制的一个引用，conn表示是接受的连接（而不是监听socket）
+// 连接可能在其他分片关闭，所以要加锁
+static void
+admission_release(struct socket_admission *a, struct admission_ip *ip, bool conn) {
+	spinlock_lock(&a->lock);
+	if (conn) {
+		--a->conn;
+		if (ip)
+			--ip->conn;
+	}
+	int ref = --a->ref;
+	spinlock_unlock(&a->lock);
+	if (ref > 0)
+		return;
+	int i;
+	for (i=0;i<ADMISSION_HASH;i++) {
+		struct admission_ip *p = a->ip[i];
+		while (p) {
+			struct admission_ip *next = p->next;
+			FREE(p);
+			p = next;
+		}
+	}
+	spinlock_destroy(&a->lock);
+	FREE(a);
+}
+
+// 设置读限速，令牌桶从满的开始
+static void
+throttle_reset(struct socket_server *ss, struct socket *s, int bytes, int packets) {
+	s->rl_bytes = bytes;
+	s->rl_packets = packets;
+	s->rl_btoken = (int64_t)bytes * 100;
+	s->rl_ptoken = (int64_t)packets * 100;
+	s->rl_time = ss->time;
+}
+
+// 从读限速的链表中去掉
+static void
+throttle_cancel(struct socket_server *ss, struct socket *s) {
+	if (!s->throttled)
+		return;
+	struct socket **pp = &ss->throttle;
+	while (*pp != s)
+		pp = &(*pp)->throttle_next;
+	*pp = s->throttle_next;
+	s->throttle_next = NULL;
+	s->throttled = false;
+	ATOM_FDEC(&ss->throttle_count);
+}
+
 // 强制关闭socket
 // 清理socket资源并发送关闭消息
 static void
@@ -580,6 +1243,22 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	free_wb_list(ss,&s->high);
 	free_wb_list(ss,&s->low);
 	sp_del(ss->event_fd, s->fd);
+#ifdef UDP_MMSG
+	if (ss->udp.id == s->id) {
+		// 丢弃还没有返回的数据包，避免交给之后复用这个id的socket
+		ss->udp.n = ss->udp.index = 0;
+	}
+#endif
+	if (s->rudp) {
+		rudp_host_delete(ss, s->rudp);
+		s->rudp = NULL;
+	}
+	throttle_cancel(ss, s);
+	if (s->admission) {
+		admission_release(s->admission, s->admission_ip, type != SOCKET_TYPE_LISTEN && type != SOCKET_TYPE_PLISTEN);
+		s->admission = NULL;
+		s->admission_ip = NULL;
+	}
 	socket_lock(l);
 	if (type != SOCKET_TYPE_BIND) {
 		if (close(s->fd) < 0) {
@@ -587,6 +1266,11 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 		}
 	}
 	ATOM_STORE(&s->type, SOCKET_TYPE_INVALID);
+	if (s->owner) {
+		stat_warn_end(ss, s);
+		owner_detach(ss, s->owner);
+		s->owner = NULL;
+	}
 	if (s->dw_buffer) {
 		struct socket_sendbuffer tmp;
 		tmp.buffer = s->dw_buffer;
@@ -605,8 +1289,13 @@ void
 socket_server_release(struct socket_server *ss) {
 	int i;
 	struct socket_message dummy;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
+	for (i=0;i<ss->max_socket;i++) {
+		struct socket *s = slot_index(ss, i);
+		if (s == NULL) {
+			// 跳过没有分配的页
+			i |= (1 << SLOT_PAGE_P) - 1;
+			continue;
+		}
 		struct socket_lock l;
 		socket_lock_init(s, &l);
 		if (ATOM_LOAD(&s->type) != SOCKET_TYPE_RESERVE) {
@@ -614,8 +1303,23 @@ socket_server_release(struct socket_server *ss) {
 		}
 		spinlock_destroy(&s->dw_lock);
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
+	if (ss->bc_buffer) {
+		socket_server_sharedbuffer_release(ss->bc_buffer);
+		FREE(ss->bc_id);
+	}
+	for (i=0;i<ss->max_socket >> SLOT_PAGE_P;i++) {
+		FREE((void *)ATOM_LOAD(&ss->page[i]));
+	}
+	FREE(ss->page);
+	spinlock_destroy(&ss->invalid_slot.dw_lock);
+	for (i=0;i<OWNER_HASH;i++) {
+		assert(ss->owner[i] == NULL);
+	}
+	spinlock_destroy(&ss->owner_lock);
+	int fd[2] = { ss->recvctrl_fd, ss->sendctrl_fd };
+	doorbell_close(fd);
+	FREE(ss->cmd.buffer);
+	spinlock_destroy(&ss->cmd.lock);
 	sp_release(ss->event_fd);
 	if (ss->reserve_fd >= 0)
 		close(ss->reserve_fd);
@@ -630,13 +1334,20 @@ check_wb_list(struct wb_list *s) {
 	assert(s->tail == NULL);
 }
 
+// 监听socket始终水平触发：accept失败（EMFILE、id用完、超过准入限制）时连接还留在backlog里，下次轮询要能再收到事件
+static inline bool
+socket_edge(struct socket *s) {
+	uint8_t type = ATOM_LOAD(&s->type);
+	return type != SOCKET_TYPE_LISTEN && type != SOCKET_TYPE_PLISTEN;
+}
+
 // 启用或禁用写事件
 // 修改epoll/kqueue事件监听状态
 static inline int
 enable_write(struct socket_server *ss, struct socket *s, bool enable) {
 	if (s->writing != enable) {
 		s->writing = enable;
-		return sp_enable(ss->event_fd, s->fd, s, s->reading, enable);
+		return sp_enable(ss->event_fd, s->fd, s, s->reading, enable, socket_edge(s));
 	}
 	return 0;
 }
@@ -647,7 +1358,7 @@ static inline int
 enable_read(struct socket_server *ss, struct socket *s, bool enable) {
 	if (s->reading != enable) {
 		s->reading = enable;
-		return sp_enable(ss->event_fd, s->fd, s, enable, s->writing);
+		return sp_enable(ss->event_fd, s->fd, s, enable, s->writing, socket_edge(s));
 	}
 	return 0;
 }
@@ -656,7 +1367,7 @@ enable_read(struct socket_server *ss, struct socket *s, bool enable) {
 // 初始化socket并添加到事件循环
 static struct socket *
 new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque, bool reading) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	assert(ATOM_LOAD(&s->type) == SOCKET_TYPE_RESERVE);
 
 	if (sp_add(ss->event_fd, fd, s)) {
@@ -669,9 +1380,27 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	s->reading = true;
 	s->writing = false;
 	s->closing = false;
-	ATOM_INIT(&s->sending , ID_TAG16(id) << 16 | 0);
+	s->reuseport = false;
+	s->coalesce = false;
+	s->batch = false;
+	s->reliable = false;
+	s->rudp = NULL;
+	s->admission = NULL;
+	s->admission_ip = NULL;
+	s->rl_bytes = 0;
+	s->rl_packets = 0;
+	s->throttled = false;
+	s->throttle_next = NULL;
+	ATOM_INIT(&s->sending , ID_TAG16(ss, id) << 16 | 0);
 	s->protocol = protocol;
 	s->p.size = MIN_READ_BUFFER;
+	s->read_avg = MIN_READ_BUFFER;
+	s->read_burst = 0;
+	s->rb_high = 0;
+	s->rb_low = 0;
+	s->rb_base = 0;
+	ATOM_INIT(&s->rb_consumed, 0);
+	ATOM_INIT(&s->rb_state, RB_READING);
 	s->opaque = opaque;
 	s->wb_size = 0;
 	s->warn_size = 0;
@@ -684,14 +1413,51 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 		ATOM_STORE(&s->type , SOCKET_TYPE_INVALID);
 		return NULL;
 	}
+	s->owner = owner_attach(ss, opaque);
 	return s;
 }
 
+// socket转给另一个服务（在socket_lock里调用，避免工作线程直接发送时用到释放的统计）
+static void
+owner_change(struct socket_server *ss, struct socket *s, uintptr_t opaque) {
+	if (s->owner->opaque != opaque) {
+		stat_warn_end(ss, s);
+		owner_detach(ss, s->owner);
+		s->owner = owner_attach(ss, opaque);
+	}
+}
+
+// 读写长度在直方图中的位置
+static inline int
+stat_histogram(int n) {
+	int i = 0;
+	n >>= 6;
+	while (n && i < SOCKET_STAT_HISTOGRAM - 1) {
+		n >>= 1;
+		++i;
+	}
+	return i;
+}
+
 // 统计读取字节数
 // 更新socket读取统计和时间戳
 static inline void
 stat_read(struct socket_server *ss, struct socket *s, int n) {
+	struct socket_owner *o = s->owner;
 	s->stat.read += n;
+	++s->stat.nread;
+	s->stat.rtime = ss->time;
+	o->read += n;
+	++o->nread;
+	++o->rhistogram[stat_histogram(n)];
+}
+
+// 统计accept
+// 监听socket自己的read和nread记录接受的连接数；不计入服务的汇总，否则每个连接都会算成一次1字节的读
+static inline void
+stat_accept(struct socket_server *ss, struct socket *s) {
+	++s->stat.read;
+	++s->stat.nread;
 	s->stat.rtime = ss->time;
 }
 
@@ -699,8 +1465,38 @@ stat_read(struct socket_server *ss, struct socket *s, int n) {
 // 更新socket写入统计和时间戳
 static inline void
 stat_write(struct socket_server *ss, struct socket *s, int n) {
+	struct socket_owner *o = s->owner;
 	s->stat.write += n;
+	++s->stat.nwrite;
 	s->stat.wtime = ss->time;
+	ATOM_FADD(&o->write, n);
+	ATOM_FINC(&o->nwrite);
+	ATOM_FINC(&o->whistogram[stat_histogram(n)]);
+}
+
+// 内核发送缓冲区满了（EAGAIN或者只写出一部分）
+static inline void
+stat_eagain(struct socket *s) {
+	++s->stat.eagain;
+	++s->owner->eagain;
+}
+
+// 写缓冲区大小变化后更新最大值和超过WARNING_SIZE的计时
+static inline void
+stat_queue(struct socket_server *ss, struct socket *s) {
+	if (s->wb_size > s->stat.wb_peak) {
+		s->stat.wb_peak = s->wb_size;
+		if (s->wb_size > s->owner->wb_peak)
+			s->owner->wb_peak = s->wb_size;
+	}
+	if (s->wb_size >= WARNING_SIZE) {
+		if (!s->stat.warning) {
+			s->stat.warning = true;
+			s->stat.warnstart = ss->time;
+		}
+	} else {
+		stat_warn_end(ss, s);
+	}
 }
 
 // 打开socket连接
@@ -770,6 +1566,8 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 	} else {
 		if (enable_write(ss, ns, true)) {
 			result->data = "enable write failed";
+			owner_detach(ss, ns->owner);
+			ns->owner = NULL;
 			goto _failed;
 		}
 		ATOM_STORE(&ns->type , SOCKET_TYPE_CONNECTING);
@@ -782,7 +1580,7 @@ _failed:
 		close(sock);
 	freeaddrinfo( ai_list );
 _failed_getaddrinfo:
-	ATOM_STORE(&ss->slot[HASH_ID(id)].type, SOCKET_TYPE_INVALID);
+	ATOM_STORE(&socket_slot(ss, id)->type, SOCKET_TYPE_INVALID);
 	return SOCKET_ERR;
 }
 
@@ -824,36 +1622,128 @@ close_write(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	}
 }
 
-// 发送TCP数据列表
-// 遍历写缓冲区列表发送TCP数据
+// 把列表中的缓冲区填入iov，从iov[n]开始，最多填到MAX_IOV个，遇到文件停止，返回填充后的数量
+// 整个列表都填入时*all为true
 static int
-send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
-	while (list->head) {
+gather_list(struct wb_list *list, struct iovec *iov, int n, bool *all) {
+	struct write_buffer *wb;
+	for (wb = list->head; wb && n < MAX_IOV && !wb->file; wb = wb->next) {
+		iov[n].iov_base = wb->ptr;
+		iov[n].iov_len = wb->sz;
+		++n;
+	}
+	*all = (wb == NULL);
+	return n;
+}
+
+// 发送列表头部的文件，返回发送的字节数，0表示文件已经读完，-1表示出错（errno）
+static ssize_t
+send_file(struct socket *s, struct write_buffer_file *wf) {
+	size_t sz = wf->buffer.sz;
+#ifdef __linux__
+	return sendfile(s->fd, wf->fd, &wf->offset, sz);
+#else
+	char tmp[16384];
+	if (sz > sizeof(tmp))
+		sz = sizeof(tmp);
+	ssize_t n = pread(wf->fd, tmp, sz, wf->offset);
+	if (n <= 0)
+		return n;
+	n = write(s->fd, tmp, n);
+	if (n > 0)
+		wf->offset += n;
+	return n;
+#endif
+}
+
+// 从列表头部去掉已经发送的sz字节，释放发送完的缓冲区，返回列表之外剩余的字节数
+static size_t
+consume_list(struct socket_server *ss, struct wb_list *list, size_t sz) {
+	while (list->head && sz > 0) {
 		struct write_buffer * tmp = list->head;
-		for (;;) {
-			ssize_t sz = write(s->fd, tmp->ptr, tmp->sz);
+		if (sz < tmp->sz) {
+			tmp->ptr += sz;
+			tmp->sz -= sz;
+			return 0;
+		}
+		sz -= tmp->sz;
+		list->head = tmp->next;
+		write_buffer_free(ss,tmp);
+	}
+	if (list->head == NULL) {
+		list->tail = NULL;
+	}
+	return sz;
+}
+
+// 发送TCP数据列表
+// 遍历写缓冲区列表发送TCP数据
+static int
+send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
+	// 发送高优先级列表时把低优先级列表接在后面，字节顺序与分两次发送相同
+	struct wb_list *low = (list == &s->high) ? &s->low : NULL;
+	struct iovec iov[MAX_IOV];
+	for (;;) {
+		struct write_buffer *head = list->head;
+		if (head && head->file) {
+			struct write_buffer_file *wf = (struct write_buffer_file *)head;
+			ssize_t sz = send_file(s, wf);
 			if (sz < 0) {
 				switch(errno) {
 				case EINTR:
 					continue;
 				case AGAIN_WOULDBLOCK:
+					stat_eagain(s);
 					return -1;
 				}
 				return close_write(ss, s, l, result);
 			}
 			stat_write(ss,s,(int)sz);
-			s->wb_size -= sz;
-			if (sz != tmp->sz) {
-				tmp->ptr += sz;
-				tmp->sz -= sz;
-				return -1;
+			head->sz -= sz;
+			if (sz == 0 || head->sz == 0) {
+				// 发送完成（或者文件比请求的短）
+				list->head = head->next;
+				if (list->head == NULL)
+					list->tail = NULL;
+				write_buffer_free(ss, head);
 			}
+			continue;
+		}
+		bool all;
+		int n = gather_list(list, iov, 0, &all);
+		if (low && all) {
+			n = gather_list(low, iov, n, &all);
+		}
+		if (n == 0)
 			break;
+		size_t total = 0;
+		int i;
+		for (i=0;i<n;i++) {
+			total += iov[i].iov_len;
+		}
+		ssize_t sz = writev(s->fd, iov, n);
+		if (sz < 0) {
+			switch(errno) {
+			case EINTR:
+				continue;
+			case AGAIN_WOULDBLOCK:
+				stat_eagain(s);
+				return -1;
+			}
+			return close_write(ss, s, l, result);
+		}
+		stat_write(ss,s,(int)sz);
+		s->wb_size -= sz;
+		size_t left = consume_list(ss, list, sz);
+		if (low && left > 0) {
+			consume_list(ss, low, left);
+		}
+		if ((size_t)sz != total) {
+			// 内核缓冲区满了，低优先级列表的头部可能只发送了一部分，由send_buffer_调用raise_uncomplete处理
+			stat_eagain(s);
+			return -1;
 		}
-		list->head = tmp->next;
-		write_buffer_free(ss,tmp);
 	}
-	list->tail = NULL;
 
 	return -1;
 }
@@ -899,6 +1789,67 @@ drop_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struc
 
 // 发送UDP数据列表
 // 遍历写缓冲区列表发送UDP数据包
+#ifdef UDP_MMSG
+static int
+send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	union sockaddr_all sa[UDP_BATCH];
+	while (list->head) {
+		// 收集地址合法的连续数据包，一次sendmmsg发出
+		int n = 0;
+		struct write_buffer * tmp;
+		for (tmp = list->head; tmp && n < UDP_BATCH; tmp = tmp->next) {
+			struct write_buffer_udp * udp = (struct write_buffer_udp *)tmp;
+			socklen_t sasz = udp_socket_address(s, udp->udp_address, &sa[n]);
+			if (sasz == 0)
+				break;
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			memset(&msg[n], 0, sizeof(msg[n]));
+			msg[n].msg_hdr.msg_name = &sa[n];
+			msg[n].msg_hdr.msg_namelen = sasz;
+			msg[n].msg_hdr.msg_iov = &iov[n];
+			msg[n].msg_hdr.msg_iovlen = 1;
+			++n;
+		}
+		if (n == 0) {
+			skynet_error(NULL, "socket-server : udp (%d) error: type mismatch.", s->id);
+			drop_udp(ss, s, list, list->head);
+			return -1;
+		}
+		int sent = sendmmsg(s->fd, msg, n, 0);
+		if (sent < 0) {
+			switch(errno) {
+			case AGAIN_WOULDBLOCK:
+				stat_eagain(s);
+			case EINTR:
+				return -1;
+			}
+			skynet_error(NULL, "socket-server : udp (%d) sendto error %s.",s->id, strerror(errno));
+			drop_udp(ss, s, list, list->head);
+			return -1;
+		}
+		int i;
+		for (i=0;i<sent;i++) {
+			tmp = list->head;
+			stat_write(ss,s,tmp->sz);
+			s->wb_size -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
+		}
+		if (sent < n) {
+			// 发送缓冲区满了，等下次可写
+			stat_eagain(s);
+			break;
+		}
+	}
+	if (list->head == NULL)
+		list->tail = NULL;
+
+	return -1;
+}
+#else
 static int
 send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
 	while (list->head) {
@@ -914,8 +1865,9 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 		int err = sendto(s->fd, tmp->ptr, tmp->sz, 0, &sa.s, sasz);
 		if (err < 0) {
 			switch(errno) {
-			case EINTR:
 			case AGAIN_WOULDBLOCK:
+				stat_eagain(s);
+			case EINTR:
 				return -1;
 			}
 			skynet_error(NULL, "socket-server : udp (%d) sendto error %s.",s->id, strerror(errno));
@@ -931,6 +1883,7 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 
 	return -1;
 }
+#endif
 
 // 发送数据列表
 // 根据协议类型选择TCP或UDP发送方式
@@ -1016,7 +1969,8 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 	if (s->high.head == NULL) {
 		// step 2
 		// 步骤2
-		if (s->low.head != NULL) {
+		// TCP的低优先级列表已经在步骤1中和高优先级列表一起发送过
+		if (s->low.head != NULL && s->protocol != PROTOCOL_TCP) {
 			int ret = send_list(ss,s,&s->low,l,result);
 			if (ret != -1) {
 				if (ret == SOCKET_ERR) {
@@ -1028,6 +1982,8 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 				// SOCKET_RST（忽略）
 				return -1;
 			}
+		}
+		if (s->low.head != NULL) {
 			// step 3
 			// 步骤3
 			if (list_uncomplete(&s->low)) {
@@ -1078,6 +2034,8 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 		struct write_buffer * buf = MALLOC(sizeof(*buf));
 		struct send_object so;
 		buf->userobject = send_object_init(ss, &so, (void *)s->dw_buffer, s->dw_size);
+		buf->file = false;
+		buf->shared = false;
 		buf->ptr = (char*)so.buffer+s->dw_offset;
 		buf->sz = so.sz - s->dw_offset;
 		buf->buffer = (void *)s->dw_buffer;
@@ -1092,6 +2050,10 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 		s->dw_buffer = NULL;
 	}
 	int r = send_buffer_(ss,s,l,result);
+	if (s->owner) {
+		// 发送时可能关闭了socket
+		stat_queue(ss, s);
+	}
 	socket_unlock(l);
 
 	return r;
@@ -1104,6 +2066,8 @@ append_sendbuffer_(struct socket_server *ss, struct wb_list *s, struct request_s
 	struct write_buffer * buf = MALLOC(size);
 	struct send_object so;
 	buf->userobject = send_object_init(ss, &so, request->buffer, request->sz);
+	buf->file = false;
+	buf->shared = false;
 	buf->ptr = (char*)so.buffer;
 	buf->sz = so.sz;
 	buf->buffer = request->buffer;
@@ -1150,7 +2114,7 @@ append_sendbuffer_low(struct socket_server *ss,struct socket *s, struct request_
 static int
 trigger_write(struct socket_server *ss, struct request_send * request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (socket_invalid(s, id))
 		return -1;
 	if (enable_write(ss, s, true)) {
@@ -1159,6 +2123,222 @@ trigger_write(struct socket_server *ss, struct request_send * request, struct so
 	return -1;
 }
 
+/*
+	可靠UDP，见socket_server_reliable
+	每个对端地址一个会话，收到的数据包交给会话，按顺序到齐的消息以SOCKET_UDP返回。
+	发送的数据交给会话分片，确认和重传由定时器线程每个tick发来的'Z'命令驱动。
+	会话只在socket线程中使用，不需要加锁
+ */
+struct rudp_session {
+	struct rudp_session *next;
+	struct rudp_session *ready_next;
+	struct rudp *r;
+	bool ready;             // 在ready列表中
+	uint64_t active;        // 最近收发数据的时间（毫秒）
+	union sockaddr_all sa;
+	socklen_t sasz;
+	uint8_t udp_address[UDP_ADDRESS_SIZE];
+};
+
+struct rudp_host {
+	struct rudp_host *next;         // ss->rudp列表
+	struct socket *s;
+	struct rudp_session *ready;     // 有消息到齐的会话
+	uint32_t conv;
+	struct rudp_session *session[RUDP_HASH];
+};
+
+struct rudp_output_ud {
+	struct socket_server *ss;
+	struct socket *s;
+	struct rudp_session *rs;
+};
+
+static uint64_t
+rudp_now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000 + ti.tv_nsec / 1000000;
+}
+
+static inline int
+rudp_address_size(const uint8_t udp_address[UDP_ADDRESS_SIZE]) {
+	return udp_address[0] == PROTOCOL_UDP ? 1+2+4 : 1+2+16;
+}
+
+static inline unsigned
+rudp_hash(const uint8_t *udp_address, int sz) {
+	unsigned h = 2166136261u;
+	int i;
+	for (i=0;i<sz;i++) {
+		h = (h ^ udp_address[i]) * 16777619u;
+	}
+	return h % RUDP_HASH;
+}
+
+static void
+rudp_output_packet(void *ud, const uint8_t *buffer, int sz) {
+	struct rudp_output_ud *o = ud;
+	// 发不出去（EAGAIN）就当作丢包，由重传补上
+	int n = sendto(o->s->fd, buffer, sz, 0, &o->rs->sa.s, o->rs->sasz);
+	if (n > 0) {
+		stat_write(o->ss, o->s, n);
+	}
+}
+
+static void
+rudp_session_update(struct socket_server *ss, struct socket *s, struct rudp_session *rs, uint64_t now) {
+	struct rudp_output_ud o = { ss, s, rs };
+	rudp_update(rs->r, now, rudp_output_packet, &o);
+}
+
+// 找到对端地址的会话，create为true时没有就创建
+static struct rudp_session *
+rudp_session(struct rudp_host *h, const uint8_t udp_address[UDP_ADDRESS_SIZE], bool create) {
+	int sz = rudp_address_size(udp_address);
+	unsigned hash = rudp_hash(udp_address, sz);
+	struct rudp_session *rs = h->session[hash];
+	while (rs) {
+		if (memcmp(rs->udp_address, udp_address, sz) == 0)
+			return rs;
+		rs = rs->next;
+	}
+	if (!create)
+		return NULL;
+	rs = MALLOC(sizeof(*rs));
+	memset(rs, 0, sizeof(*rs));
+	rs->sasz = udp_socket_address(h->s, udp_address, &rs->sa);
+	if (rs->sasz == 0) {
+		FREE(rs);
+		return NULL;
+	}
+	memcpy(rs->udp_address, udp_address, sz);
+	if (++h->conv == 0)
+		h->conv = 1;
+	rs->r = rudp_new(h->conv);
+	rs->active = rudp_now();
+	rs->next = h->session[hash];
+	h->session[hash] = rs;
+	return rs;
+}
+
+static void
+rudp_host_delete(struct socket_server *ss, struct rudp_host *h) {
+	struct rudp_host **p = &ss->rudp;
+	while (*p != h)
+		p = &(*p)->next;
+	*p = h->next;
+	ATOM_FDEC(&ss->rudp_count);
+	int i;
+	for (i=0;i<RUDP_HASH;i++) {
+		struct rudp_session *rs = h->session[i];
+		while (rs) {
+			struct rudp_session *next = rs->next;
+			rudp_delete(rs->r);
+			FREE(rs);
+			rs = next;
+		}
+	}
+	FREE(h);
+}
+
+// 'E' : 打开可靠模式
+static void
+reliable_socket(struct socket_server *ss, struct request_resumepause *request) {
+	int id = request->id;
+	struct socket *s = socket_slot(ss, id);
+	if (socket_invalid(s, id) || ATOM_LOAD(&s->type) == SOCKET_TYPE_RESERVE) {
+		// socket已经关闭，socket_server_reliable增加的计数随槽一起重置
+		return;
+	}
+	if (s->rudp == NULL && s->protocol != PROTOCOL_TCP) {
+		struct rudp_host *h = MALLOC(sizeof(*h));
+		memset(h, 0, sizeof(*h));
+		h->s = s;
+		struct timespec ti;
+		clock_gettime(CLOCK_REALTIME, &ti);
+		// 进程重启后的新会话用不同的conv，对端据此丢掉旧的接收状态
+		h->conv = (uint32_t)(ti.tv_sec * 1000 + ti.tv_nsec / 1000000) << 8;
+		h->next = ss->rudp;
+		ss->rudp = h;
+		ATOM_FINC(&ss->rudp_count);
+		s->rudp = h;
+		s->reliable = true;
+	}
+	ATOM_FDEC(&s->udpconnecting);
+}
+
+// 可靠UDP的发送，数据交给会话之后立即发出第一批
+static int
+rudp_send_socket(struct socket_server *ss, struct socket *s, struct send_object *so, const void *buffer, const uint8_t *udp_address) {
+	if (udp_address == NULL) {
+		udp_address = s->p.udp_address;
+	}
+	struct rudp_session *rs = NULL;
+	if (udp_address[0] == s->protocol) {
+		rs = rudp_session(s->rudp, udp_address, true);
+	}
+	if (rs == NULL) {
+		skynet_error(NULL, "socket-server: udp socket (%d) error: type mismatch.", s->id);
+	} else if (rudp_send(rs->r, so->buffer, so->sz)) {
+		skynet_error(NULL, "socket-server: udp socket (%d) error: message too long (%d).", s->id, (int)so->sz);
+	} else {
+		uint64_t now = rudp_now();
+		rs->active = now;
+		rudp_session_update(ss, s, rs, now);
+	}
+	so->free_func((void *)buffer);
+	return -1;
+}
+
+static void
+rudp_drop_session(struct rudp_session **p) {
+	struct rudp_session *rs = *p;
+	*p = rs->next;
+	rudp_delete(rs->r);
+	FREE(rs);
+}
+
+// 'Z' : 定时器线程每个tick发来一次，重传超时的片，丢弃空闲和不可达的会话
+static int
+rudp_tick(struct socket_server *ss, struct socket_message *result) {
+	ATOM_STORE(&ss->rudp_tick, 0);
+	uint64_t now = rudp_now();
+	struct rudp_host *h;
+	for (h = ss->rudp; h; h = h->next) {
+		struct socket *s = h->s;
+		int i;
+		for (i=0;i<RUDP_HASH;i++) {
+			struct rudp_session **p = &h->session[i];
+			while (*p) {
+				struct rudp_session *rs = *p;
+				if (rs->ready) {
+					p = &rs->next;
+					continue;
+				}
+				rudp_session_update(ss, s, rs, now);
+				if (rudp_dead(rs->r)) {
+					if (s->p.udp_address[0] != 0) {
+						// 连接的socket只有这一个对端，报告错误并关闭
+						struct socket_lock l;
+						socket_lock_init(s, &l);
+						force_close(ss, s, &l, result);
+						result->data = "peer unreachable";
+						return SOCKET_ERR;
+					}
+					skynet_error(NULL, "socket-server: udp socket (%d) drop unreachable peer.", s->id);
+					rudp_drop_session(p);
+				} else if (rudp_pending(rs->r) == 0 && now - rs->active > RUDP_IDLE) {
+					rudp_drop_session(p);
+				} else {
+					p = &rs->next;
+				}
+			}
+		}
+	}
+	return -1;
+}
+
 /*
 	When send a package , we can assign the priority : PRIORITY_HIGH or PRIORITY_LOW
 
@@ -1176,7 +2356,7 @@ trigger_write(struct socket_server *ss, struct request_send * request, struct so
 static int
 send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result, int priority, const uint8_t *udp_address) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	struct send_object so;
 	send_object_init(ss, &so, request->buffer, request->sz);
 	uint8_t type = ATOM_LOAD(&s->type);
@@ -1192,6 +2372,9 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 		so.free_func((void *)request->buffer);
 		return -1;
 	}
+	if (s->rudp) {
+		return rudp_send_socket(ss, s, &so, request->buffer, udp_address);
+	}
 	if (send_buffer_empty(s)) {
 		if (s->protocol == PROTOCOL_TCP) {
 			append_sendbuffer(ss, s, request);	// add to high priority list, even priority == PRIORITY_LOW
@@ -1220,7 +2403,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 				return -1;
 			}
 		}
-		if (enable_write(ss, s, true)) {
+		if ((!s->coalesce || s->wb_size >= COALESCE_SIZE) && enable_write(ss, s, true)) {
 			return report_error(s, result, "enable write failed");
 		}
 	} else {
@@ -1230,6 +2413,10 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			} else {
 				append_sendbuffer(ss, s, request);
 			}
+			// 合并发送模式下写缓冲区可能还没有启用写事件
+			if (s->coalesce && s->wb_size >= COALESCE_SIZE && enable_write(ss, s, true)) {
+				return report_error(s, result, "enable write failed");
+			}
 		} else {
 			if (udp_address == NULL) {
 				udp_address = s->p.udp_address;
@@ -1237,6 +2424,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			append_sendbuffer_udp(ss,s,priority,request,udp_address);
 		}
 	}
+	stat_queue(ss, s);
 	if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
 		s->warn_size = s->warn_size == 0 ? WARNING_SIZE *2 : s->warn_size*2;
 		result->opaque = s->opaque;
@@ -1248,6 +2436,46 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 	return -1;
 }
 
+// 发送文件
+// 把文件片段追加到高优先级列表，等socket可写时用sendfile发送。文件的字节不计入wb_size
+static int
+sendfile_socket(struct socket_server *ss, struct request_sendfile * request, struct socket_message *result) {
+	int id = request->id;
+	struct socket * s = socket_slot(ss, id);
+	uint8_t type = ATOM_LOAD(&s->type);
+	if (type == SOCKET_TYPE_INVALID || s->id != id
+		|| type == SOCKET_TYPE_HALFCLOSE_WRITE
+		|| type == SOCKET_TYPE_PACCEPT
+		|| type == SOCKET_TYPE_PLISTEN
+		|| type == SOCKET_TYPE_LISTEN
+		|| s->protocol != PROTOCOL_TCP
+		|| s->closing) {
+		close(request->fd);
+		return -1;
+	}
+	struct write_buffer_file * wf = MALLOC(sizeof(*wf));
+	wf->buffer.next = NULL;
+	wf->buffer.buffer = NULL;
+	wf->buffer.ptr = NULL;
+	wf->buffer.sz = request->size;
+	wf->buffer.userobject = false;
+	wf->buffer.file = true;
+	wf->buffer.shared = false;
+	wf->fd = request->fd;
+	wf->offset = request->offset;
+	struct wb_list *list = &s->high;
+	if (list->head == NULL) {
+		list->head = list->tail = &wf->buffer;
+	} else {
+		list->tail->next = &wf->buffer;
+		list->tail = &wf->buffer;
+	}
+	if (enable_write(ss, s, true)) {
+		return report_error(s, result, "enable write failed");
+	}
+	return -1;
+}
+
 // 监听socket
 // 将socket设置为监听状态，准备接受连接
 static int
@@ -1259,6 +2487,7 @@ listen_socket(struct socket_server *ss, struct request_listen * request, struct
 		goto _failed;
 	}
 	ATOM_STORE(&s->type , SOCKET_TYPE_PLISTEN);
+	s->reuseport = request->reuseport;
 	result->opaque = request->opaque;
 	result->id = id;
 	result->ud = 0;
@@ -1287,7 +2516,7 @@ _failed:
 	result->id = id;
 	result->ud = 0;
 	result->data = "reach skynet socket number limit";
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+	socket_slot(ss, id)->type = SOCKET_TYPE_INVALID;
 
 	return SOCKET_ERR;
 }
@@ -1335,7 +2564,7 @@ halfclose_read(struct socket *s) {
 static int
 close_socket(struct socket_server *ss, struct request_close *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (socket_invalid(s, id)) {
 		// The socket is closed, ignore
 		// socket已关闭，忽略
@@ -1354,6 +2583,11 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 		return r;
 	}
 	s->closing = true;
+	if (s->coalesce) {
+		// 把合并中的数据发出去再关闭
+		s->coalesce = false;
+		enable_write(ss, s, true);
+	}
 	if (!shutdown_read) {
 		// don't read socket after socket.close()
 		// socket.close()后不要读取socket
@@ -1384,6 +2618,30 @@ bind_socket(struct socket_server *ss, struct request_bind *request, struct socke
 	return SOCKET_OPEN;
 }
 
+// 接收其他分片转交的新连接
+// 连接已经由监听所在的分片报告给服务，这里只加入本分片的事件轮询，失败时报告错误
+static int
+adopt_socket(struct socket_server *ss, struct request_bind *request, struct socket_message *result) {
+	int id = request->id;
+	struct socket *s = new_fd(ss, id, request->fd, PROTOCOL_TCP, request->opaque, false);
+	if (s == NULL) {
+		close(request->fd);
+		if (request->admission)
+			admission_release(request->admission, request->admission_ip, true);
+		result->id = id;
+		result->opaque = request->opaque;
+		result->ud = 0;
+		result->data = "reach skynet socket number limit";
+		return SOCKET_ERR;
+	}
+	s->batch = request->batch;
+	s->admission = request->admission;
+	s->admission_ip = request->admission_ip;
+	throttle_reset(ss, s, request->rl_bytes, request->rl_packets);
+	ATOM_STORE(&s->type , SOCKET_TYPE_PACCEPT);
+	return -1;
+}
+
 // 恢复socket
 // 恢复暂停的socket，重新启用读事件
 static int
@@ -1393,7 +2651,7 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 	result->opaque = request->opaque;
 	result->ud = 0;
 	result->data = NULL;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = socket_slot(ss, id);
 	if (socket_invalid(s, id)) {
 		result->data = "invalid socket";
 		return SOCKET_ERR;
@@ -1406,6 +2664,7 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 	}
 	struct socket_lock l;
 	socket_lock_init(s, &l);
+	throttle_cancel(ss, s);
 	if (enable_read(ss, s, true)) {
 		result->data = "enable read failed";
 		return SOCKET_ERR;
@@ -1414,12 +2673,23 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 	if (type == SOCKET_TYPE_PACCEPT || type == SOCKET_TYPE_PLISTEN) {
 		ATOM_STORE(&s->type , (type == SOCKET_TYPE_PACCEPT) ? SOCKET_TYPE_CONNECTED : SOCKET_TYPE_LISTEN);
 		s->opaque = request->opaque;
+		socket_lock(&l);
+		owner_change(ss, s, s->opaque);
+		socket_unlock(&l);
 		result->data = "start";
 		return SOCKET_OPEN;
 	} else if (type == SOCKET_TYPE_CONNECTED) {
 		// todo: maybe we should send a message SOCKET_TRANSFER to s->opaque
 		// 待办：也许我们应该向s->opaque发送SOCKET_TRANSFER消息
+		if (s->opaque != request->opaque) {
+			// 新的服务从这里开始计算读水位
+			s->rb_base = s->stat.read;
+			ATOM_STORE(&s->rb_consumed, 0);
+		}
 		s->opaque = request->opaque;
+		socket_lock(&l);
+		owner_change(ss, s, s->opaque);
+		socket_unlock(&l);
 		result->data = "transfer";
 		return SOCKET_OPEN;
 	}
@@ -1428,15 +2698,263 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 	return -1;
 }
 
+/*
+	读水位
+	没有消费的字节数 = 服务开始接收后读到的字节数 - 服务消费的字节数 (socket_server_consumed)
+	包括还在服务消息队列里的数据。超过高水位时socket线程自己停止读，服务消费到低水位以下时发一条恢复命令
+	在高低水位之间不会来回暂停恢复
+ */
+static inline int64_t
+watermark_size(struct socket *s, uint64_t consumed) {
+	return (int64_t)(s->stat.read - s->rb_base - consumed);
+}
+
+static bool
+watermark_read(struct socket_server *ss, struct socket *s) {
+	if (watermark_size(s, ATOM_LOAD(&s->rb_consumed)) < s->rb_high || !ATOM_CAS(&s->rb_state, RB_READING, RB_PAUSED))
+		return false;
+	enable_read(ss, s, false);
+	// 服务可能在暂停之前已经消费到低水位以下，那时它看到的还是RB_READING
+	if (watermark_size(s, ATOM_LOAD(&s->rb_consumed)) <= s->rb_low && ATOM_CAS(&s->rb_state, RB_PAUSED, RB_READING)) {
+		enable_read(ss, s, true);
+		return false;
+	}
+	return true;
+}
+
+static int
+watermark_socket(struct socket_server *ss, struct request_watermark *request) {
+	int id = request->id;
+	struct socket *s = socket_slot(ss, id);
+	if (socket_invalid(s, id)) {
+		return -1;
+	}
+	s->rb_high = request->high;
+	s->rb_low = request->low;
+	if (s->protocol == PROTOCOL_TCP) {
+		while (s->rb_high > 0 && s->p.size > s->rb_high && s->p.size > MIN_READ_BUFFER)
+			s->p.size /= 2;
+	}
+	if (ATOM_LOAD(&s->rb_state) != RB_READING) {
+		ATOM_STORE(&s->rb_state, RB_READING);
+		if (!halfclose_read(s) && !s->throttled)
+			enable_read(ss, s, true);
+	}
+	return -1;
+}
+
+// 服务消费到低水位以下，恢复读
+static int
+watermark_resume(struct socket_server *ss, struct request_resumepause *request) {
+	int id = request->id;
+	struct socket *s = socket_slot(ss, id);
+	if (socket_invalid(s, id)) {
+		return -1;
+	}
+	if (ATOM_CAS(&s->rb_state, RB_RESUMING, RB_READING) && !halfclose_read(s) && !s->throttled) {
+		enable_read(ss, s, true);
+	}
+	return -1;
+}
+
+/*
+	读限速
+	每次读以后从两个令牌桶（字节数和读次数）里扣除，任何一个不够时停止读，等补足以后由'J'命令恢复
+	暂停期间数据留在内核的接收缓冲区里，由TCP的流量控制让对端慢下来
+ */
+// 读到n字节以后调用，返回true表示暂停了读
+static bool
+throttle_read(struct socket_server *ss, struct socket *s, int n, bool paused) {
+	uint64_t elapsed = ss->time - s->rl_time;
+	int64_t wait = 0;	// 补足令牌需要的1/100秒数
+	s->rl_time = ss->time;
+	if (s->rl_bytes > 0) {
+		s->rl_btoken = token_refill(s->rl_btoken, elapsed, s->rl_bytes) - (int64_t)n * 100;
+		if (s->rl_btoken < 0)
+			wait = -s->rl_btoken / s->rl_bytes + 1;
+	}
+	if (s->rl_packets > 0) {
+		s->rl_ptoken = token_refill(s->rl_ptoken, elapsed, s->rl_packets) - 100;
+		if (s->rl_ptoken < 0) {
+			int64_t w = -s->rl_ptoken / s->rl_packets + 1;
+			if (w > wait)
+				wait = w;
+		}
+	}
+	if (wait == 0 || paused) {
+		// 已经因为读水位暂停了，欠下的令牌留到恢复以后的下一次读
+		return false;
+	}
+	s->rl_until = ss->time + wait;
+	enable_read(ss, s, false);
+	s->throttled = true;
+	s->throttle_next = ss->throttle;
+	ss->throttle = s;
+	ATOM_FINC(&ss->throttle_count);
+	++s->stat.limited;
+	return true;
+}
+
+// 'J' : 定时器线程每个tick发来一次，恢复读限速到期的连接
+static int
+throttle_tick(struct socket_server *ss) {
+	ATOM_STORE(&ss->throttle_tick, 0);
+	struct socket **pp = &ss->throttle;
+	struct socket *s;
+	while ((s = *pp)) {
+		if (s->rl_until > ss->time) {
+			pp = &s->throttle_next;
+			continue;
+		}
+		*pp = s->throttle_next;
+		s->throttle_next = NULL;
+		s->throttled = false;
+		ATOM_FDEC(&ss->throttle_count);
+		if (!halfclose_read(s) && !s->closing && ATOM_LOAD(&s->rb_state) == RB_READING) {
+			enable_read(ss, s, true);
+		}
+	}
+	return -1;
+}
+
+/*
+	准入控制
+	监听socket上的总连接数、接受速率，以及每个ip的连接数和接受速率，超过时新连接直接关闭，不通知服务
+	接受的连接继承监听socket的读限速
+ */
+static inline uint32_t
+admission_hash(const uint8_t addr[16]) {
+	uint32_t h = 2166136261u;
+	int i;
+	for (i=0;i<16;i++) {
+		h ^= addr[i];
+		h *= 16777619u;
+	}
+	return h % ADMISSION_HASH;
+}
+
+// 查找或创建ip的记录，顺便释放同一个桶里没有连接、令牌桶也满了的记录（和没有记录一样）
+static struct admission_ip *
+admission_ip(struct socket_admission *a, const uint8_t addr[16], uint64_t now) {
+	int rate = a->conf.ip_rate;
+	uint32_t h = admission_hash(addr);
+	struct admission_ip **pp = &a->ip[h];
+	struct admission_ip *ip;
+	while ((ip = *pp)) {
+		if (memcmp(ip->addr, addr, 16) == 0)
+			return ip;
+		if (ip->conn == 0 && token_refill(ip->token, now - ip->time, rate) >= (int64_t)rate * 100) {
+			*pp = ip->next;
+			FREE(ip);
+			--a->nip;
+			continue;
+		}
+		pp = &ip->next;
+	}
+	if (a->nip >= ADMISSION_IP_MAX)
+		return NULL;
+	ip = MALLOC(sizeof(*ip));
+	memcpy(ip->addr, addr, 16);
+	ip->conn = 0;
+	ip->token = (int64_t)rate * 100;
+	ip->time = now;
+	ip->next = a->ip[h];
+	a->ip[h] = ip;
+	++a->nip;
+	return ip;
+}
+
+// 检查能否接受来自u的新连接，可以时计入连接数并增加一个引用
+static bool
+admission_enter(struct socket_server *ss, struct socket_admission *a, union sockaddr_all *u, struct admission_ip **pip) {
+	uint8_t addr[16];
+	if (u->s.sa_family == AF_INET) {
+		static const uint8_t mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+		memcpy(addr, mapped, 12);
+		memcpy(addr + 12, &u->v4.sin_addr, 4);
+	} else {
+		memcpy(addr, &u->v6.sin6_addr, 16);
+	}
+	uint64_t now = ss->time;
+	bool ok = false;
+	spinlock_lock(&a->lock);
+	const struct socket_admission_conf *c = &a->conf;
+	struct admission_ip *ip = NULL;
+	if (c->max_conn > 0 && a->conn >= c->max_conn)
+		goto _out;
+	if (c->accept_rate > 0) {
+		a->token = token_refill(a->token, now - a->time, c->accept_rate);
+		a->time = now;
+		if (a->token < 100)
+			goto _out;
+	}
+	if (c->ip_conn > 0 || c->ip_rate > 0) {
+		ip = admission_ip(a, addr, now);
+		if (ip == NULL)
+			goto _out;
+		if (c->ip_conn > 0 && ip->conn >= c->ip_conn)
+			goto _out;
+		if (c->ip_rate > 0) {
+			ip->token = token_refill(ip->token, now - ip->time, c->ip_rate);
+			ip->time = now;
+			if (ip->token < 100)
+				goto _out;
+			ip->token -= 100;
+		}
+		++ip->conn;
+	}
+	if (c->accept_rate > 0)
+		a->token -= 100;
+	++a->conn;
+	++a->ref;
+	*pip = ip;
+	ok = true;
+_out:
+	spinlock_unlock(&a->lock);
+	return ok;
+}
+
+// 'I' : 监听socket设置准入控制（同时是接受的连接的默认读限速），连接只设置读限速
+static int
+admission_socket(struct socket_server *ss, struct request_admission *request) {
+	int id = request->id;
+	struct socket *s = socket_slot(ss, id);
+	if (socket_invalid(s, id)) {
+		return -1;
+	}
+	const struct socket_admission_conf *conf = &request->conf;
+	uint8_t type = ATOM_LOAD(&s->type);
+	if (type == SOCKET_TYPE_LISTEN || type == SOCKET_TYPE_PLISTEN) {
+		struct socket_admission *a = s->admission;
+		if (a == NULL) {
+			a = MALLOC(sizeof(*a));
+			memset(a, 0, sizeof(*a));
+			spinlock_init(&a->lock);
+			a->ref = 1;
+			s->admission = a;
+		}
+		spinlock_lock(&a->lock);
+		a->conf = *conf;
+		a->token = (int64_t)conf->accept_rate * 100;
+		a->time = ss->time;
+		spinlock_unlock(&a->lock);
+	} else if (s->protocol == PROTOCOL_TCP) {
+		throttle_reset(ss, s, conf->read_bytes, conf->read_packets);
+	}
+	return -1;
+}
+
 // 暂停socket
 // 暂停socket的读事件，停止接收数据
 static int
 pause_socket(struct socket_server *ss, struct request_resumepause *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = socket_slot(ss, id);
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
+	// 服务自己暂停的socket不再由读限速恢复
+	throttle_cancel(ss, s);
 	if (enable_read(ss, s, false)) {
 		return report_error(s, result, "enable read failed");
 	}
@@ -1448,7 +2966,7 @@ pause_socket(struct socket_server *ss, struct request_resumepause *request, stru
 static void
 setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = socket_slot(ss, id);
 	if (socket_invalid(s, id)) {
 		return;
 	}
@@ -1456,39 +2974,62 @@ setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
 }
 
-// 阻塞读取管道
-// 从管道中完整读取指定大小的数据
+// 设置合并发送模式，关闭时把留在写缓冲区的数据发出去
+static int
+coalesce_socket(struct socket_server *ss, struct request_setopt *request, struct socket_message *result) {
+	int id = request->id;
+	struct socket *s = socket_slot(ss, id);
+	if (socket_invalid(s, id) || s->protocol != PROTOCOL_TCP || s->closing) {
+		return -1;
+	}
+	s->coalesce = request->value;
+	if (!s->coalesce && !send_buffer_empty(s) && enable_write(ss, s, true)) {
+		return report_error(s, result, "enable write failed");
+	}
+	return -1;
+}
+
+// 设置批量投递模式，只对TCP连接和监听socket有效
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
-	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			if (errno == EINTR)
-				continue;
-			skynet_error(NULL, "socket-server : read pipe error %s.",strerror(errno));
-			return;
-		}
-		// must atomic read from a pipe
-		// 必须从管道原子性读取
-		assert(n == sz);
+batch_socket(struct socket_server *ss, struct request_setopt *request) {
+	int id = request->id;
+	struct socket *s = socket_slot(ss, id);
+	if (socket_invalid(s, id) || s->protocol != PROTOCOL_TCP) {
 		return;
 	}
+	s->batch = request->value;
 }
 
-// 检查是否有控制命令
-// 使用select检查控制管道是否有数据可读
+// 从控制命令队列取出一条命令，返回数据长度
 static int
-has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
+ctrl_pop(struct socket_server *ss, int *type, uint8_t *buffer) {
+	struct ctrl_queue *q = &ss->cmd;
+	spinlock_lock(&q->lock);
+	assert(q->tail - q->head >= 2);
+	*type = q->buffer[q->head];
+	int len = q->buffer[q->head+1];
+	memcpy(buffer, q->buffer + q->head + 2, len);
+	q->head += len + 2;
+	if (q->head == q->tail) {
+		q->head = q->tail = 0;
+	}
+	spinlock_unlock(&q->lock);
+	ATOM_FDEC(&ss->cmd_count);
+	return len;
+}
 
-	FD_SET(ss->recvctrl_fd, &ss->rfds);
+// 检查是否有控制命令
+static inline int
+has_cmd(struct socket_server *ss) {
+	return ATOM_LOAD(&ss->cmd_count) > 0;
+}
 
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {
-		return 1;
-	}
-	return 0;
+// 清除唤醒描述符上的通知
+static void
+doorbell_clear(struct socket_server *ss) {
+	uint64_t buffer[16];
+	while (read(ss->recvctrl_fd, buffer, sizeof(buffer)) > 0)
+		;
 }
 
 // 添加UDP socket
@@ -1505,7 +3046,7 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 	struct socket *ns = new_fd(ss, id, udp->fd, protocol, udp->opaque, true);
 	if (ns == NULL) {
 		close(udp->fd);
-		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		socket_slot(ss, id)->type = SOCKET_TYPE_INVALID;
 		return;
 	}
 	ATOM_STORE(&ns->type , SOCKET_TYPE_CONNECTED);
@@ -1517,7 +3058,7 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 static int
 set_udp_address(struct socket_server *ss, struct request_setudp *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = socket_slot(ss, id);
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
@@ -1548,7 +3089,7 @@ dial_udp_socket(struct socket_server *ss, struct request_dial_udp *request, stru
 	struct socket *ns = new_fd(ss, id, request->fd, protocol, request->opaque, true);
 	if (ns == NULL){
 		close(request->fd);
-		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		socket_slot(ss, id)->type = SOCKET_TYPE_INVALID;
 		return -1;
 	}
 
@@ -1567,12 +3108,12 @@ dial_udp_socket(struct socket_server *ss, struct request_dial_udp *request, stru
 // 增加发送引用计数
 // 原子操作增加socket的发送引用计数
 static inline void
-inc_sending_ref(struct socket *s, int id) {
+inc_sending_ref(struct socket_server *ss, struct socket *s, int id) {
 	if (s->protocol != PROTOCOL_TCP)
 		return;
 	for (;;) {
 		unsigned long sending = ATOM_LOAD(&s->sending);
-		if ((sending >> 16) == ID_TAG16(id)) {
+		if ((sending >> 16) == ID_TAG16(ss, id)) {
 			if ((sending & 0xffff) == 0xffff) {
 				// s->sending may overflow (rarely), so busy waiting here for socket thread dec it. see issue #794
 				// s->sending可能溢出（很少见），所以在这里忙等待socket线程减少它。见issue #794
@@ -1596,7 +3137,7 @@ inc_sending_ref(struct socket *s, int id) {
 // 原子操作减少socket的发送引用计数
 static inline void
 dec_sending_ref(struct socket_server *ss, int id) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	// Notice: udp may inc sending while type == SOCKET_TYPE_RESERVE
 	// 注意：当type == SOCKET_TYPE_RESERVE时，UDP可能增加sending
 	if (s->id == id && s->protocol == PROTOCOL_TCP) {
@@ -1605,22 +3146,84 @@ dec_sending_ref(struct socket_server *ss, int id) {
 	}
 }
 
+// 广播
+// 把同一份共享缓冲区追加到每个socket的高优先级列表。遇到错误或警告时记下进度先报告，
+// socket_server_poll下次从这里继续，每个socket的错误和警告都会报告
+static int
+broadcast_socket(struct socket_server *ss, struct socket_message *result) {
+	struct socket_sharedbuffer * sb = ss->bc_buffer;
+	while (ss->bc_index < ss->bc_n) {
+		int id = ss->bc_id[ss->bc_index++];
+		int ret = -1;
+		struct socket * s = socket_slot(ss, id);
+		uint8_t type = ATOM_LOAD(&s->type);
+		if (type == SOCKET_TYPE_INVALID || s->id != id
+			|| type == SOCKET_TYPE_HALFCLOSE_WRITE
+			|| type == SOCKET_TYPE_PACCEPT
+			|| type == SOCKET_TYPE_PLISTEN
+			|| type == SOCKET_TYPE_LISTEN
+			|| s->protocol != PROTOCOL_TCP
+			|| s->closing) {
+			dec_sending_ref(ss, id);
+			continue;
+		}
+		bool empty = send_buffer_empty(s);
+		struct write_buffer * buf = MALLOC(sizeof(*buf));
+		ATOM_FINC(&sb->ref);
+		buf->next = NULL;
+		buf->buffer = sb;
+		buf->ptr = sb->data;
+		buf->sz = sb->sz;
+		buf->userobject = false;
+		buf->file = false;
+		buf->shared = true;
+		struct wb_list *list = &s->high;
+		if (list->head == NULL) {
+			list->head = list->tail = buf;
+		} else {
+			list->tail->next = buf;
+			list->tail = buf;
+		}
+		s->wb_size += buf->sz;
+		if ((empty ? (!s->coalesce || s->wb_size >= COALESCE_SIZE) : (s->coalesce && s->wb_size >= COALESCE_SIZE))
+			&& enable_write(ss, s, true)) {
+			ret = report_error(s, result, "enable write failed");
+		} else {
+			stat_queue(ss, s);
+			if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
+				s->warn_size = s->warn_size == 0 ? WARNING_SIZE *2 : s->warn_size*2;
+				result->opaque = s->opaque;
+				result->id = s->id;
+				result->ud = s->wb_size%1024 == 0 ? s->wb_size/1024 : s->wb_size/1024 + 1;
+				result->data = NULL;
+				ret = SOCKET_WARNING;
+			}
+		}
+		dec_sending_ref(ss, id);
+		if (ret != -1)
+			return ret;
+	}
+	socket_server_sharedbuffer_release(sb);
+	FREE(ss->bc_id);
+	ss->bc_buffer = NULL;
+	ss->bc_id = NULL;
+	ss->bc_n = 0;
+	ss->bc_index = 0;
+	return -1;
+}
+
 // 处理控制命令
 // 从控制管道读取命令并处理，返回消息类型
 // return type
 static int
 ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
 	// the length of message is one byte, so 256 buffer size is enough.
 	// 消息长度是一个字节，所以256字节缓冲区足够
 	uint8_t buffer[256];
-	uint8_t header[2];
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
-	// ctrl command only exist in local fd, so don't worry about endian.
-	// 控制命令只存在于本地fd中，所以不用担心字节序
+	int type;
+	ctrl_pop(ss, &type, buffer);
+	// ctrl command only exist in local memory, so don't worry about endian.
+	// 控制命令只存在于本进程内存中，所以不用担心字节序
 	switch (type) {
 	case 'R':
 		return resume_socket(ss,(struct request_resumepause *)buffer, result);
@@ -1628,6 +3231,8 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		return pause_socket(ss,(struct request_resumepause *)buffer, result);
 	case 'B':
 		return bind_socket(ss,(struct request_bind *)buffer, result);
+	case 'H':
+		return adopt_socket(ss,(struct request_bind *)buffer, result);
 	case 'L':
 		return listen_socket(ss,(struct request_listen *)buffer, result);
 	case 'K':
@@ -1650,6 +3255,20 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		dec_sending_ref(ss, request->id);
 		return ret;
 	}
+	case 'F': {
+		struct request_sendfile * request = (struct request_sendfile *) buffer;
+		int ret = sendfile_socket(ss, request, result);
+		dec_sending_ref(ss, request->id);
+		return ret;
+	}
+	case 'M': {
+		struct request_broadcast * rb = (struct request_broadcast *)buffer;
+		ss->bc_buffer = rb->buffer;
+		ss->bc_id = rb->id;
+		ss->bc_n = rb->n;
+		ss->bc_index = 0;
+		return broadcast_socket(ss, result);
+	}
 	case 'A': {
 		struct request_send_udp * rsu = (struct request_send_udp *)buffer;
 		return send_socket(ss, &rsu->send, result, PRIORITY_HIGH, rsu->address);
@@ -1664,6 +3283,24 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
+	case 'G':
+		return coalesce_socket(ss, (struct request_setopt *)buffer, result);
+	case 'Q':
+		batch_socket(ss, (struct request_setopt *)buffer);
+		return -1;
+	case 'V':
+		return watermark_socket(ss, (struct request_watermark *)buffer);
+	case 'Y':
+		return watermark_resume(ss, (struct request_resumepause *)buffer);
+	case 'E':
+		reliable_socket(ss, (struct request_resumepause *)buffer);
+		return -1;
+	case 'Z':
+		return rudp_tick(ss, result);
+	case 'I':
+		return admission_socket(ss, (struct request_admission *)buffer);
+	case 'J':
+		return throttle_tick(ss);
 	default:
 		skynet_error(NULL, "socket-server error: Unknown ctrl %c.",type);
 		return -1;
@@ -1678,10 +3315,10 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 static int
 forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	int sz = s->p.size;
-	char * buffer = MALLOC(sz);
+	char * buffer = buffer_alloc(sz);
 	int n = (int)read(s->fd, buffer, sz);
 	if (n<0) {
-		FREE(buffer);
+		socket_server_recycle(buffer, sz);
 		switch(errno) {
 		case EINTR:
 		case AGAIN_WOULDBLOCK:
@@ -1692,7 +3329,7 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 		return -1;
 	}
 	if (n==0) {
-		FREE(buffer);
+		socket_server_recycle(buffer, sz);
 		if (s->closing) {
 			// Rare case : if s->closing is true, reading event is disable, and SOCKET_CLOSE is raised.
 			// 罕见情况：如果s->closing为true，读事件被禁用，并触发SOCKET_CLOSE
@@ -1720,22 +3357,34 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 	if (halfclose_read(s)) {
 		// discard recv data (Rare case : if socket is HALFCLOSE_READ, reading event is disable.)
 		// 丢弃接收数据（罕见情况：如果socket是HALFCLOSE_READ，读事件被禁用）
-		FREE(buffer);
+		socket_server_recycle(buffer, sz);
 		return -1;
 	}
 
 	stat_read(ss,s,n);
+	SKYNET_PROBE3(socket__read, s->id, n, sz);
 
 	result->opaque = s->opaque;
 	result->id = s->id;
 	result->ud = n;
 	result->data = buffer;
 
+	bool paused = s->rb_high > 0 && watermark_read(ss, s);
+	if (s->rl_bytes > 0 || s->rl_packets > 0) {
+		paused = throttle_read(ss, s, n, paused) || paused;
+	}
+
+	// 按滑动平均调整读缓冲区：读满时加倍，平均读取量不到一半时减半，单次的大小波动不会来回分配不同大小的缓冲区
+	s->read_avg += (n - s->read_avg) / 8;
 	if (n == sz) {
-		s->p.size *= 2;
-		return SOCKET_MORE;
-	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
+		// 有读水位时，一次读的数据不超过高水位，有读限速时不超过每秒的字节数
+		if ((s->rb_high == 0 || sz * 2 <= s->rb_high) && (s->rl_bytes == 0 || sz * 2 <= s->rl_bytes))
+			s->p.size *= 2;
+		s->read_avg = sz;
+		return paused ? SOCKET_DATA : SOCKET_MORE;
+	} else if (sz > MIN_READ_BUFFER && s->read_avg*2 < sz) {
 		s->p.size /= 2;
+		s->read_avg = s->p.size;
 	}
 
 	return SOCKET_DATA;
@@ -1761,10 +3410,139 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	return addrsz;
 }
 
+// 可靠UDP收到的数据包交给对端的会话，立即回复确认
+static void
+rudp_input_packet(struct socket_server *ss, struct socket *s, const uint8_t *buffer, int n, int protocol, union sockaddr_all *sa) {
+	struct rudp_host *h = s->rudp;
+	uint8_t udp_address[UDP_ADDRESS_SIZE];
+	gen_udp_address(protocol, sa, udp_address);
+	struct rudp_session *rs = rudp_session(h, udp_address, true);
+	if (rs == NULL)
+		return;
+	uint64_t now = rudp_now();
+	if (rudp_input(rs->r, buffer, n, now)) {
+		// 不是rudp的数据包，丢掉
+		return;
+	}
+	rs->active = now;
+	rudp_session_update(ss, s, rs, now);
+	if (!rs->ready && rudp_peek(rs->r) >= 0) {
+		rs->ready = true;
+		rs->ready_next = h->ready;
+		h->ready = rs;
+	}
+}
+
+// 返回一条到齐的消息，地址附在数据后面，和普通的UDP消息一样
+static int
+rudp_forward(struct socket *s, struct socket_message *result) {
+	struct rudp_host *h = s->rudp;
+	while (h->ready) {
+		struct rudp_session *rs = h->ready;
+		int sz = rudp_peek(rs->r);
+		if (sz < 0) {
+			h->ready = rs->ready_next;
+			rs->ready = false;
+			continue;
+		}
+		int addrsz = rudp_address_size(rs->udp_address);
+		uint8_t *data = MALLOC(sz + addrsz);
+		rudp_recv(rs->r, data);
+		memcpy(data + sz, rs->udp_address, addrsz);
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = sz;
+		result->data = (char *)data;
+		return SOCKET_UDP;
+	}
+	return -1;
+}
+
 // 转发UDP消息
 // 从UDP socket接收数据包并转发给应用层
+// 可靠UDP先返回已经到齐的消息，收到的数据包交给会话，直到有消息到齐或者读完
+#ifdef UDP_MMSG
+// 一次recvmmsg读入多个数据包，之后每次调用返回其中一个，读完再读下一批
+static int
+forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	struct udp_batch *b = &ss->udp;
+	if (s->rudp) {
+		int type = rudp_forward(s, result);
+		if (type != -1)
+			return type;
+	}
+	if (b->index >= b->n || b->id != s->id) {
+		int i;
+		for (i=0;i<UDP_BATCH;i++) {
+			b->msg[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+		}
+		b->index = 0;
+		b->n = 0;
+		int n = recvmmsg(s->fd, b->msg, UDP_BATCH, 0, NULL);
+		if (n<0) {
+			switch(errno) {
+			case EINTR:
+			case AGAIN_WOULDBLOCK:
+				return -1;
+			}
+			int error = errno;
+			// close when error
+			// 错误时关闭
+			force_close(ss, s, l, result);
+			result->data = strerror(error);
+			return SOCKET_ERR;
+		}
+		b->id = s->id;
+		b->n = n;
+	}
+	while (b->index < b->n) {
+		int i = b->index++;
+		int n = b->msg[i].msg_len;
+		socklen_t slen = b->msg[i].msg_hdr.msg_namelen;
+		union sockaddr_all *sa = &b->addr[i];
+		stat_read(ss,s,n);
+
+		uint8_t * data;
+		if (s->rudp) {
+			int protocol = slen == sizeof(sa->v4) ? PROTOCOL_UDP : PROTOCOL_UDPv6;
+			if (s->protocol == protocol) {
+				rudp_input_packet(ss, s, b->buffer[i], n, protocol, sa);
+				int type = rudp_forward(s, result);
+				if (type != -1)
+					return type;
+			}
+			continue;
+		}
+		if (slen == sizeof(sa->v4)) {
+			if (s->protocol != PROTOCOL_UDP)
+				continue;
+			data = MALLOC(n + 1 + 2 + 4);
+			gen_udp_address(PROTOCOL_UDP, sa, data + n);
+		} else {
+			if (s->protocol != PROTOCOL_UDPv6)
+				continue;
+			data = MALLOC(n + 1 + 2 + 16);
+			gen_udp_address(PROTOCOL_UDPv6, sa, data + n);
+		}
+		memcpy(data, b->buffer[i], n);
+
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = n;
+		result->data = (char *)data;
+
+		return SOCKET_UDP;
+	}
+	return -1;
+}
+#else
 static int
 forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	if (s->rudp) {
+		int type = rudp_forward(s, result);
+		if (type != -1)
+			return type;
+	}
 	union sockaddr_all sa;
 	socklen_t slen = sizeof(sa);
 	int n = recvfrom(s->fd, ss->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
@@ -1784,6 +3562,14 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lo
 	stat_read(ss,s,n);
 
 	uint8_t * data;
+	if (s->rudp) {
+		int protocol = slen == sizeof(sa.v4) ? PROTOCOL_UDP : PROTOCOL_UDPv6;
+		if (s->protocol == protocol) {
+			rudp_input_packet(ss, s, ss->udpbuffer, n, protocol, &sa);
+			return rudp_forward(s, result);
+		}
+		return -1;
+	}
 	if (slen == sizeof(sa.v4)) {
 		if (s->protocol != PROTOCOL_UDP)
 			return -1;
@@ -1804,6 +3590,7 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lo
 
 	return SOCKET_UDP;
 }
+#endif
 
 // 报告连接状态
 // 检查连接结果并报告连接成功或失败
@@ -1858,6 +3645,8 @@ getname(union sockaddr_all *u, char *buffer, size_t sz) {
 }
 
 // 报告接受连接
+static void send_request(struct socket_server *ss, struct request_package *request, char type, int len);
+
 // 接受新连接并创建socket，失败时返回0，文件限制时返回-1
 // return 0 when failed, or -1 when file limit
 static int
@@ -1887,22 +3676,60 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 			return 0;
 		}
 	}
-	int id = reserve_id(ss);
+	struct socket_admission *a = s->admission;
+	struct admission_ip *ip = NULL;
+	if (a && !admission_enter(ss, a, &u, &ip)) {
+		// 超过准入限制，直接关闭；监听socket是水平触发的，还有连接时下次轮询继续accept
+		close(client_fd);
+		++s->stat.limited;
+		return 0;
+	}
+	// 有多个分片时新连接轮流交给各个分片
+	struct socket_server *target = ss;
+	if (ss->group && !s->reuseport) {
+		target = ss->group[ss->accept_next];
+		ss->accept_next = (ss->accept_next + 1) % ss->nshard;
+	}
+	int id = reserve_id(target);
 	if (id < 0) {
 		close(client_fd);
+		if (a)
+			admission_release(a, ip, true);
 		return 0;
 	}
 	socket_keepalive(client_fd);
 	sp_nonblocking(client_fd);
-	struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
-	if (ns == NULL) {
-		close(client_fd);
-		return 0;
+	int rl_bytes = a ? a->conf.read_bytes : 0;
+	int rl_packets = a ? a->conf.read_packets : 0;
+	if (target == ss) {
+		struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
+		if (ns == NULL) {
+			close(client_fd);
+			if (a)
+				admission_release(a, ip, true);
+			return 0;
+		}
+		ns->batch = s->batch;
+		ns->admission = a;
+		ns->admission_ip = ip;
+		throttle_reset(ss, ns, rl_bytes, rl_packets);
+		ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
+	} else {
+		// 管道保证这个请求先于服务对新连接的任何操作被处理
+		struct request_package request;
+		request.u.bind.id = id;
+		request.u.bind.fd = client_fd;
+		request.u.bind.opaque = s->opaque;
+		request.u.bind.batch = s->batch;
+		request.u.bind.rl_bytes = rl_bytes;
+		request.u.bind.rl_packets = rl_packets;
+		request.u.bind.admission = a;
+		request.u.bind.admission_ip = ip;
+		send_request(target, &request, 'H', sizeof(request.u.bind));
 	}
 	// accept new one connection
-	stat_read(ss,s,1);
+	stat_accept(ss,s);
 
-	ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
 	result->opaque = s->opaque;
 	result->id = s->id;
 	result->ud = id;
@@ -1935,11 +3762,101 @@ clear_closed_event(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
+// 批量模式的socket读到的数据以SOCKET_BATCH返回
+static inline int
+data_type(struct socket_server *ss, struct socket *s) {
+	if (s->batch) {
+		ss->batched = 1;
+		return SOCKET_BATCH;
+	}
+	return SOCKET_DATA;
+}
+
+/*
+ * 读满了缓冲区，socket里可能还有数据
+ * @param n: 这一次读到的字节数
+ * @return: 1表示接着读这个socket；0表示这一轮的配额用完了，
+ *          水平触发时等下一轮的事件，边缘触发时不会再有通知，放进ready由下一轮直接读
+ */
+static int
+read_budget(struct socket_server *ss, struct socket *s, int n) {
+	s->read_burst += n;
+	if (s->read_burst < READ_BUDGET)
+		return 1;
+	s->read_burst = 0;
+	if (sp_edge() && ss->ready_n < MAX_EVENT) {
+		// 每个事件最多放进来一次，一轮的事件不超过MAX_EVENT
+		struct ready_socket *r = &ss->ready[ss->ready_n++];
+		r->s = s;
+		r->id = s->id;
+	}
+	return 0;
+}
+
+/*
+ * 把ready中的socket作为可读事件，再加上已经发生的事件（不等待）
+ * @return: 事件数量
+ */
+static int
+ready_poll(struct socket_server *ss) {
+	int i;
+	int n = 0;
+	for (i=0;i<ss->ready_n;i++) {
+		struct socket *s = ss->ready[i].s;
+		int type = ATOM_LOAD(&s->type);
+		if (s->id != ss->ready[i].id || type == SOCKET_TYPE_INVALID || type == SOCKET_TYPE_RESERVE || !s->reading)
+			continue;
+		struct event *e = &ss->ev[n++];
+		e->s = s;
+		e->read = true;
+		e->write = false;
+		e->error = false;
+		e->eof = false;
+		e->rdhup = false;
+	}
+	ss->ready_n = 0;
+	int r = sp_wait(ss->event_fd, ss->ev + n, MAX_EVENT - n, false);
+	if (r > 0)
+		n += r;
+	return n;
+}
+
 // return type
+/*
+ * 忙轮询：阻塞等待之前不停地检查事件和命令，最多ss->busypoll微秒
+ * 期间sleeping为0，其他线程发命令时不需要写唤醒描述符，省掉了唤醒socket线程的延迟
+ * @return: 事件数量，0表示超时没有事件，-1表示有新的命令
+ */
+static int
+busy_poll(struct socket_server *ss) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	uint64_t deadline = (uint64_t)ti.tv_sec * 1000000 + ti.tv_nsec / 1000 + ss->busypoll;
+	for (;;) {
+		if (has_cmd(ss))
+			return -1;
+		int n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT, false);
+		if (n > 0)
+			return n;
+		clock_gettime(CLOCK_MONOTONIC, &ti);
+		if ((uint64_t)ti.tv_sec * 1000000 + ti.tv_nsec / 1000 >= deadline)
+			return 0;
+		sched_yield();
+	}
+}
+
 // 返回类型
 int
 socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
 	for (;;) {
+		if (ss->bc_buffer) {
+			// 先处理完报告了错误或警告的广播
+			int type = broadcast_socket(ss, result);
+			if (type != -1) {
+				clear_closed_event(ss, result, type);
+				return type;
+			}
+		}
 		if (ss->checkctrl) {
 			if (has_cmd(ss)) {
 				int type = ctrl_cmd(ss, result);
@@ -1953,7 +3870,38 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			}
 		}
 		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
+			if (ss->batched) {
+				// 这一轮的事件处理完了，让上层在等待之前发出合并的消息
+				ss->batched = 0;
+				result->opaque = 0;
+				result->id = 0;
+				result->ud = 0;
+				result->data = NULL;
+				return SOCKET_IDLE;
+			}
+			int n;
+			if (ss->ready_n > 0) {
+				n = ready_poll(ss);
+			} else {
+				n = ss->busypoll ? busy_poll(ss) : 0;
+			}
+			if (n < 0) {
+				ss->checkctrl = 1;
+				continue;
+			}
+			if (n > 0) {
+				ss->event_n = n;
+			} else {
+				ATOM_STORE(&ss->sleeping, 1);
+				if (has_cmd(ss)) {
+					// 等待前又有了新命令，不需要唤醒
+					ATOM_STORE(&ss->sleeping, 0);
+					ss->checkctrl = 1;
+					continue;
+				}
+				ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT, true);
+				ATOM_STORE(&ss->sleeping, 0);
+			}
 			ss->checkctrl = 1;
 			if (more) {
 				*more = 0;
@@ -1972,7 +3920,8 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		struct socket *s = e->s;
 		if (s == NULL) {
 			// dispatch pipe message at beginning
-			// 在开始时分发管道消息
+			// 唤醒描述符的事件，命令会在下一轮开始时处理
+			doorbell_clear(ss);
 			continue;
 		}
 		struct socket_lock l;
@@ -1983,6 +3932,8 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		case SOCKET_TYPE_LISTEN: {
 			int ok = report_accept(ss, s, result);
 			if (ok > 0) {
+				// 下次继续accept同一个监听socket，直到EAGAIN
+				--ss->event_index;
 				return SOCKET_ACCEPT;
 			} if (ok < 0 ) {
 				return SOCKET_ERR;
@@ -2000,8 +3951,19 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				if (s->protocol == PROTOCOL_TCP) {
 					type = forward_message_tcp(ss, s, &l, result);
 					if (type == SOCKET_MORE) {
-						--ss->event_index;
-						return SOCKET_DATA;
+						if (read_budget(ss, s, result->ud)) {
+							--ss->event_index;
+						}
+						return data_type(ss, s);
+					}
+					s->read_burst = 0;
+					if (type == SOCKET_DATA) {
+						if (e->rdhup && s->reading) {
+							// 边缘触发模式下对方关闭了写，之后不会再有通知，一直读到返回0
+							--ss->event_index;
+							return data_type(ss, s);
+						}
+						type = data_type(ss, s);
 					}
 				} else {
 					type = forward_message_udp(ss, s, &l, result);
@@ -2059,22 +4021,47 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 }
 
 // 发送请求
-// 通过控制管道发送请求到socket线程
+// 把请求放入控制命令队列，socket线程在等待事件时才写唤醒描述符
 static void
 send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
 	request->header[6] = (uint8_t)type;
 	request->header[7] = (uint8_t)len;
-	const char * req = (const char *)request + offsetof(struct request_package, header[6]);
-	for (;;) {
-		ssize_t n = write(ss->sendctrl_fd, req, len+2);
-		if (n<0) {
-			if (errno != EINTR) {
-				skynet_error(NULL, "socket-server : send ctrl command error %s.", strerror(errno));
-			}
-			continue;
+	const uint8_t * req = (const uint8_t *)request + offsetof(struct request_package, header[6]);
+	int sz = len + 2;
+	struct ctrl_queue *q = &ss->cmd;
+	spinlock_lock(&q->lock);
+	if (q->tail + sz > q->cap) {
+		int used = q->tail - q->head;
+		if (used + sz > q->cap / 2) {
+			// 队列过半时扩容，避免频繁移动数据
+			int cap = q->cap * 2;
+			while (used + sz > cap / 2)
+				cap *= 2;
+			uint8_t *buffer = MALLOC(cap);
+			memcpy(buffer, q->buffer + q->head, used);
+			FREE(q->buffer);
+			q->buffer = buffer;
+			q->cap = cap;
+		} else {
+			memmove(q->buffer, q->buffer + q->head, used);
+		}
+		q->head = 0;
+		q->tail = used;
+	}
+	memcpy(q->buffer + q->tail, req, sz);
+	q->tail += sz;
+	spinlock_unlock(&q->lock);
+	// cmd_count与sleeping都是顺序一致的原子操作：
+	// socket线程先置sleeping再检查cmd_count，这里先增加cmd_count再检查sleeping，两边至少有一边能看到对方
+	ATOM_FINC(&ss->cmd_count);
+	// ATOM_CAS可能虚假失败，循环直到自己或其他线程把sleeping清零，清零的线程负责唤醒
+	while (ATOM_LOAD(&ss->sleeping)) {
+		if (ATOM_CAS(&ss->sleeping, 1, 0)) {
+			uint64_t one = 1;
+			while (write(ss->sendctrl_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+				;
+			break;
 		}
-		assert(n == len+2);
-		return;
 	}
 }
 
@@ -2123,7 +4110,7 @@ socket_server_connect(struct socket_server *ss, uintptr_t opaque, const char * a
 // 判断socket状态是否允许直接写入数据
 static inline int
 can_direct_write(struct socket *s, int id) {
-	return s->id == id && nomore_sending_data(s) && ATOM_LOAD(&s->type) == SOCKET_TYPE_CONNECTED && ATOM_LOAD(&s->udpconnecting) == 0;
+	return s->id == id && !s->coalesce && nomore_sending_data(s) && ATOM_LOAD(&s->type) == SOCKET_TYPE_CONNECTED && ATOM_LOAD(&s->udpconnecting) == 0 && !s->reliable;
 }
 
 // return -1 when error, 0 when success
@@ -2131,7 +4118,7 @@ can_direct_write(struct socket *s, int id) {
 int
 socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 	int id = buf->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (socket_invalid(s, id) || s->closing) {
 		free_buffer(ss, buf);
 		return -1;
@@ -2147,10 +4134,28 @@ socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 			// send directly
 			// 直接发送
 			struct send_object so;
-			send_object_init_from_sendbuffer(ss, &so, buf);
+			struct iovec one;
+			const struct iovec *iov = &one;
+			int niov = 1;
+			if (buf->type == SOCKET_BUFFER_IOVEC) {
+				// 分段缓冲区直接用writev/sendmsg发出，不拼接
+				iov = buf->buffer;
+				niov = (int)buf->sz;
+				so.buffer = NULL;
+				so.sz = 0;
+				so.free_func = dummy_free;
+				int i;
+				for (i=0;i<niov;i++) {
+					so.sz += iov[i].iov_len;
+				}
+			} else {
+				send_object_init_from_sendbuffer(ss, &so, buf);
+				one.iov_base = (void *)so.buffer;
+				one.iov_len = so.sz;
+			}
 			ssize_t n;
 			if (s->protocol == PROTOCOL_TCP) {
-				n = write(s->fd, so.buffer, so.sz);
+				n = writev(s->fd, iov, niov);
 			} else {
 				union sockaddr_all sa;
 				socklen_t sasz = udp_socket_address(s, s->p.udp_address, &sa);
@@ -2160,14 +4165,21 @@ socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 					so.free_func((void *)buf->buffer);
 					return -1;
 				}
-				n = sendto(s->fd, so.buffer, so.sz, 0, &sa.s, sasz);
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_name = &sa.s;
+				msg.msg_namelen = sasz;
+				msg.msg_iov = (struct iovec *)iov;
+				msg.msg_iovlen = niov;
+				n = sendmsg(s->fd, &msg, 0);
 			}
 			if (n<0) {
 				// ignore error, let socket thread try again
 				// 忽略错误，让socket线程重试
 				n = 0;
 			}
-			stat_write(ss,s,n);
+			if (n > 0)
+				stat_write(ss,s,n);
 			if (n == so.sz) {
 				// write done
 			// 写完成
@@ -2197,7 +4209,7 @@ socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 		socket_unlock(&l);
 	}
 
-	inc_sending_ref(s, id);
+	inc_sending_ref(ss, s, id);
 
 	struct request_package request;
 	request_init(&request);
@@ -2215,13 +4227,13 @@ int
 socket_server_send_lowpriority(struct socket_server *ss, struct socket_sendbuffer *buf) {
 	int id = buf->id;
 
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (socket_invalid(s, id)) {
 		free_buffer(ss, buf);
 		return -1;
 	}
 
-	inc_sending_ref(s, id);
+	inc_sending_ref(ss, s, id);
 
 	struct request_package request;
 	request_init(&request);
@@ -2232,6 +4244,70 @@ socket_server_send_lowpriority(struct socket_server *ss, struct socket_sendbuffe
 	return 0;
 }
 
+// 发送文件fd中从offset开始的size字节，fd的所有权交给socket服务器，发送完或者socket关闭时关闭
+int
+socket_server_sendfile(struct socket_server *ss, int id, int fd, int64_t offset, int64_t size) {
+	struct socket * s = socket_slot(ss, id);
+	if (socket_invalid(s, id) || s->closing || size <= 0) {
+		close(fd);
+		return -1;
+	}
+
+	inc_sending_ref(ss, s, id);
+
+	struct request_package request;
+	request_init(&request);
+	request.u.sendfile.id = id;
+	request.u.sendfile.fd = fd;
+	request.u.sendfile.offset = offset;
+	request.u.sendfile.size = size;
+
+	send_request(ss, &request, 'F', sizeof(request.u.sendfile));
+	return 0;
+}
+
+// 复制要广播的数据到共享缓冲区，buf的所有权交给这个函数
+struct socket_sharedbuffer *
+socket_server_sharedbuffer(struct socket_server *ss, struct socket_sendbuffer *buf) {
+	struct send_object so;
+	send_object_init_from_sendbuffer(ss, &so, buf);
+	struct socket_sharedbuffer * sb = MALLOC(sizeof(*sb) + so.sz);
+	ATOM_INIT(&sb->ref, 1);
+	sb->sz = so.sz;
+	memcpy(sb->data, so.buffer, so.sz);
+	so.free_func((void *)buf->buffer);
+	return sb;
+}
+
+// 把共享缓冲区发给这个分片中的n个socket，调用者保留自己的引用，返回排队的socket数量
+int
+socket_server_broadcast(struct socket_server *ss, struct socket_sharedbuffer *sb, const int *id, int n) {
+	int * list = MALLOC(n * sizeof(int));
+	int count = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		struct socket * s = socket_slot(ss, id[i]);
+		if (socket_invalid(s, id[i]) || s->closing)
+			continue;
+		inc_sending_ref(ss, s, id[i]);
+		list[count++] = id[i];
+	}
+	if (count == 0) {
+		FREE(list);
+		return 0;
+	}
+	ATOM_FINC(&sb->ref);
+
+	struct request_package request;
+	request_init(&request);
+	request.u.broadcast.buffer = sb;
+	request.u.broadcast.n = count;
+	request.u.broadcast.id = list;
+
+	send_request(ss, &request, 'M', sizeof(request.u.broadcast));
+	return count;
+}
+
 // 退出socket服务器
 // 发送退出请求给socket线程
 void
@@ -2271,7 +4347,7 @@ socket_server_shutdown(struct socket_server *ss, uintptr_t opaque, int id) {
 // 返回-1表示失败
 // 或返回AF_INET或AF_INET6
 static int
-do_bind(const char *host, int port, int protocol, int *family) {
+do_bind(const char *host, int port, int protocol, int *family, bool reuseport) {
 	int fd;
 	int status;
 	int reuse = 1;
@@ -2305,6 +4381,15 @@ do_bind(const char *host, int port, int protocol, int *family) {
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
 		goto _failed;
 	}
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+			goto _failed;
+		}
+#else
+		goto _failed;
+#endif
+	}
 	status = bind(fd, (struct sockaddr *)ai_list->ai_addr, ai_list->ai_addrlen);
 	if (status != 0)
 		goto _failed;
@@ -2321,9 +4406,9 @@ _failed_fd:
 // 创建监听socket
 // 绑定地址并开始监听连接
 static int
-do_listen(const char * host, int port, int backlog) {
+do_listen(const char * host, int port, int backlog, bool reuseport) {
 	int family = 0;
-	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family);
+	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family, reuseport);
 	if (listen_fd < 0) {
 		return -1;
 	}
@@ -2331,17 +4416,44 @@ do_listen(const char * host, int port, int backlog) {
 		close(listen_fd);
 		return -1;
 	}
+	// 有连接时会循环accept直到EAGAIN，监听socket必须是非阻塞的
+	sp_nonblocking(listen_fd);
 	return listen_fd;
 }
 
+static int listen_request(struct socket_server *ss, uintptr_t opaque, int fd, bool reuseport);
+
 // 开始监听端口
 // 创建监听socket并添加到事件循环
 int
 socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
-	int fd = do_listen(addr, port, backlog);
+	int fd = do_listen(addr, port, backlog, false);
 	if (fd < 0) {
 		return -1;
 	}
+	return listen_request(ss, opaque, fd, false);
+}
+
+// 用SO_REUSEPORT监听端口，同一端口可以在每个分片中各监听一次，由内核分配新连接
+// port为0时会填入实际绑定的端口，以便其他分片监听同一个端口
+int
+socket_server_listen_reuseport(struct socket_server *ss, uintptr_t opaque, const char * addr, int *port, int backlog) {
+	int fd = do_listen(addr, *port, backlog, true);
+	if (fd < 0) {
+		return -1;
+	}
+	if (*port == 0) {
+		union sockaddr_all u;
+		socklen_t slen = sizeof(u);
+		if (getsockname(fd, &u.s, &slen) == 0) {
+			*port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
+		}
+	}
+	return listen_request(ss, opaque, fd, true);
+}
+
+static int
+listen_request(struct socket_server *ss, uintptr_t opaque, int fd, bool reuseport) {
 	struct request_package request;
 	request_init(&request);
 	int id = reserve_id(ss);
@@ -2352,6 +4464,7 @@ socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * ad
 	request.u.listen.opaque = opaque;
 	request.u.listen.id = id;
 	request.u.listen.fd = fd;
+	request.u.listen.reuseport = reuseport;
 	send_request(ss, &request, 'L', sizeof(request.u.listen));
 	return id;
 }
@@ -2406,6 +4519,80 @@ socket_server_nodelay(struct socket_server *ss, int id) {
 	send_request(ss, &request, 'T', sizeof(request.u.setopt));
 }
 
+// 合并发送模式：之后的数据先留在写缓冲区，调用socket_server_flush时一次writev发出
+void
+socket_server_coalesce(struct socket_server *ss, int id, int enable) {
+	struct request_package request;
+	request_init(&request);
+	request.u.setopt.id = id;
+	request.u.setopt.what = 0;
+	request.u.setopt.value = enable;
+	send_request(ss, &request, 'G', sizeof(request.u.setopt));
+}
+
+// 批量投递模式
+void
+socket_server_batch(struct socket_server *ss, int id, int enable) {
+	struct request_package request;
+	request_init(&request);
+	request.u.setopt.id = id;
+	request.u.setopt.what = 0;
+	request.u.setopt.value = enable;
+	send_request(ss, &request, 'Q', sizeof(request.u.setopt));
+}
+
+// 设置读水位
+void
+socket_server_watermark(struct socket_server *ss, int id, int high, int low) {
+	struct request_package request;
+	request_init(&request);
+	request.u.watermark.id = id;
+	request.u.watermark.high = high;
+	request.u.watermark.low = low;
+	send_request(ss, &request, 'V', sizeof(request.u.watermark));
+}
+
+// 设置准入控制和读限速
+void
+socket_server_admission(struct socket_server *ss, int id, const struct socket_admission_conf *conf) {
+	struct request_package request;
+	request_init(&request);
+	request.u.admission.id = id;
+	request.u.admission.conf = *conf;
+	send_request(ss, &request, 'I', sizeof(request.u.admission));
+}
+
+// 服务一共消费了consumed字节，在服务的线程中调用，只在从高水位降到低水位以下时发一条命令
+void
+socket_server_consumed(struct socket_server *ss, int id, uint64_t consumed) {
+	struct socket *s = socket_slot(ss, id);
+	if (socket_invalid(s, id)) {
+		return;
+	}
+	ATOM_STORE(&s->rb_consumed, consumed);
+	if (ATOM_LOAD(&s->rb_state) != RB_PAUSED)
+		return;
+	// 暂停时socket线程不再读，stat.read不会变化
+	if (watermark_size(s, consumed) <= s->rb_low && ATOM_CAS(&s->rb_state, RB_PAUSED, RB_RESUMING)) {
+		struct request_package request;
+		request_init(&request);
+		request.u.resumepause.id = id;
+		request.u.resumepause.opaque = 0;
+		send_request(ss, &request, 'Y', sizeof(request.u.resumepause));
+	}
+}
+
+// 发送合并发送模式下留在写缓冲区的数据
+void
+socket_server_flush(struct socket_server *ss, int id) {
+	struct request_package request;
+	request_init(&request);
+	request.u.send.id = id;
+	request.u.send.sz = 0;
+	request.u.send.buffer = NULL;
+	send_request(ss, &request, 'W', sizeof(request.u.send));
+}
+
 // 设置用户对象接口
 // 配置socket服务器的用户对象处理接口
 void
@@ -2425,7 +4612,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	if (port != 0 || addr != NULL) {
 		// bind
 		// 绑定
-		fd = do_bind(addr, port, IPPROTO_UDP, &family);
+		fd = do_bind(addr, port, IPPROTO_UDP, &family, false);
 		if (fd < 0) {
 			return -1;
 		}
@@ -2466,7 +4653,7 @@ socket_server_udp_listen(struct socket_server *ss, uintptr_t opaque, const char*
 	int family;
 	// bind
 	// 绑定
-	fd = do_bind(addr, port, IPPROTO_UDP, &family);
+	fd = do_bind(addr, port, IPPROTO_UDP, &family, false);
 	if (fd < 0) {
 		return -1;
 	}
@@ -2550,7 +4737,7 @@ socket_server_udp_dial(struct socket_server *ss, uintptr_t opaque, const char* a
 int
 socket_server_udp_send(struct socket_server *ss, const struct socket_udp_address *addr, struct socket_sendbuffer *buf) {
 	int id = buf->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (socket_invalid(s, id)) {
 		free_buffer(ss, buf);
 		return -1;
@@ -2620,7 +4807,7 @@ socket_server_udp_send(struct socket_server *ss, const struct socket_udp_address
 // 为UDP socket设置默认目标地址
 int
 socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, int port) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
@@ -2671,6 +4858,33 @@ socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, i
 	return 0;
 }
 
+// 打开可靠UDP模式
+// 在发送任何数据之前调用，之后这个socket收发的都是完整、按顺序的消息
+int
+socket_server_reliable(struct socket_server *ss, int id) {
+	struct socket * s = socket_slot(ss, id);
+	if (socket_invalid(s, id)) {
+		return -1;
+	}
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	socket_lock(&l);
+	if (socket_invalid(s, id)) {
+		socket_unlock(&l);
+		return -1;
+	}
+	// 和socket_server_udp_connect一样，在socket线程处理之前禁止工作线程直接发送
+	ATOM_FINC(&s->udpconnecting);
+	socket_unlock(&l);
+
+	struct request_package request;
+	request_init(&request);
+	request.u.resumepause.id = id;
+	request.u.resumepause.opaque = 0;
+	send_request(ss, &request, 'E', sizeof(request.u.resumepause));
+	return 0;
+}
+
 // 获取UDP消息地址
 // 从UDP消息中提取发送方地址信息
 const struct socket_udp_address *
@@ -2715,7 +4929,7 @@ socket_info_release(struct socket_info *si) {
 // 查询socket信息
 // 获取socket的详细状态和统计信息
 static int
-query_info(struct socket *s, struct socket_info *si) {
+query_info(struct socket_server *ss, struct socket *s, struct socket_info *si) {
 	union sockaddr_all u;
 	socklen_t slen = sizeof(u);
 	int closing = 0;
@@ -2756,6 +4970,15 @@ query_info(struct socket *s, struct socket_info *si) {
 	si->rtime = s->stat.rtime;
 	si->wtime = s->stat.wtime;
 	si->wbuffer = s->wb_size;
+	si->wbuffer_peak = s->stat.wb_peak;
+	si->nread = s->stat.nread;
+	si->nwrite = s->stat.nwrite;
+	si->eagain = s->stat.eagain;
+	si->warntime = s->stat.warntime;
+	if (s->stat.warning) {
+		si->warntime += ss->time - s->stat.warnstart;
+	}
+	si->limited = s->stat.limited;
 	si->reading = s->reading;
 	si->writing = s->writing;
 
@@ -2768,11 +4991,15 @@ struct socket_info *
 socket_server_info(struct socket_server *ss) {
 	int i;
 	struct socket_info * si = NULL;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket * s = &ss->slot[i];
+	for (i=0;i<ss->max_socket;i++) {
+		struct socket * s = slot_index(ss, i);
+		if (s == NULL) {
+			i |= (1 << SLOT_PAGE_P) - 1;
+			continue;
+		}
 		int id = s->id;
 		struct socket_info temp;
-		if (query_info(s, &temp) && s->id == id) {
+		if (query_info(ss, s, &temp) && s->id == id) {
 			// socket_server_info may call in different thread, so check socket id again
 		// socket_server_info可能在不同线程中调用，所以再次检查socket id
 			si = socket_info_create(si);
@@ -2782,3 +5009,35 @@ socket_server_info(struct socket_server *ss) {
 	}
 	return si;
 }
+
+// 复制本分片按服务汇总的统计，最多复制n项，返回服务的数量
+int
+socket_server_service_stat(struct socket_server *ss, struct socket_service_stat *stat, int n) {
+	int i,j;
+	int count = 0;
+	spinlock_lock(&ss->owner_lock);
+	for (i=0;i<OWNER_HASH;i++) {
+		struct socket_owner *o;
+		for (o = ss->owner[i]; o; o = o->next) {
+			if (count < n) {
+				struct socket_service_stat *st = &stat[count];
+				st->handle = (uint32_t)o->opaque;
+				st->nsocket = o->nsocket;
+				st->read = o->read;
+				st->write = ATOM_LOAD(&o->write);
+				st->nread = o->nread;
+				st->nwrite = ATOM_LOAD(&o->nwrite);
+				st->eagain = o->eagain;
+				st->warntime = o->warntime;
+				st->wbuffer_peak = o->wb_peak;
+				for (j=0;j<SOCKET_STAT_HISTOGRAM;j++) {
+					st->rhistogram[j] = o->rhistogram[j];
+					st->whistogram[j] = ATOM_LOAD(&o->whistogram[j]);
+				}
+			}
+			++count;
+		}
+	}
+	spinlock_unlock(&ss->owner_lock);
+	return count;
+}
@@ -25,6 +25,10 @@
 #define SOCKET_RST 8        // 连接重置
 #define SOCKET_MORE 9       // 更多数据
 
+// 只在打开批量模式后返回，见socket_server_batch
+#define SOCKET_BATCH 10     // 批量模式的socket读到的数据，格式和SOCKET_DATA相同
+#define SOCKET_IDLE 11      // 返回过SOCKET_BATCH后即将等待事件，上层应该发出合并的消息
+
 // 前向声明
 struct socket_server;
 
@@ -44,8 +48,14 @@ struct socket_message {
  * socket服务器生命周期管理
  */
 
+// 选择之后创建的socket服务器使用的事件模型（"epoll"、"kqueue"或"uring"），不支持返回-1
+int socket_server_backend(const char *name);
+
 // 创建socket服务器
-struct socket_server * socket_server_create(uint64_t time);
+struct socket_server * socket_server_create(uint64_t time, int max_socket);
+
+// 把n个socket服务器组成分片：socket ID对n取模得到所属分片，监听到的新连接轮流分给各个分片
+void socket_server_group(struct socket_server **group, int n);
 
 // 释放socket服务器
 void socket_server_release(struct socket_server *);
@@ -56,6 +66,9 @@ void socket_server_updatetime(struct socket_server *, uint64_t time);
 // 轮询socket事件
 int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
 
+// 阻塞等待事件之前忙轮询的时间（微秒），0表示不忙轮询
+void socket_server_busypoll(struct socket_server *, int usec);
+
 /*
  * socket连接控制
  */
@@ -86,6 +99,21 @@ int socket_server_send(struct socket_server *, struct socket_sendbuffer *buffer)
 // 低优先级发送数据
 int socket_server_send_lowpriority(struct socket_server *, struct socket_sendbuffer *buffer);
 
+// 发送文件fd中从offset开始的size字节，顺序排在之前发送的数据之后；fd交给socket服务器关闭，错误时返回-1
+int socket_server_sendfile(struct socket_server *, int id, int fd, int64_t offset, int64_t size);
+
+// 广播用的共享缓冲区，引用计数，可以跨分片使用
+struct socket_sharedbuffer;
+
+// 复制buffer的数据创建共享缓冲区（引用为1），buffer的所有权交给这个函数
+struct socket_sharedbuffer * socket_server_sharedbuffer(struct socket_server *, struct socket_sendbuffer *buffer);
+
+// 释放共享缓冲区的一个引用
+void socket_server_sharedbuffer_release(struct socket_sharedbuffer *);
+
+// 把共享缓冲区追加到本分片n个socket的写队列，返回排队的socket数量
+int socket_server_broadcast(struct socket_server *, struct socket_sharedbuffer *, const int *id, int n);
+
 /*
  * TCP连接管理（控制命令返回socket ID）
  */
@@ -93,6 +121,8 @@ int socket_server_send_lowpriority(struct socket_server *, struct socket_sendbuf
 // ctrl command below returns id
 // 监听TCP端口
 int socket_server_listen(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
+// 以SO_REUSEPORT方式监听，port为0时返回实际端口
+int socket_server_listen_reuseport(struct socket_server *, uintptr_t opaque, const char * addr, int *port, int backlog);
 
 // 连接到TCP服务器
 int socket_server_connect(struct socket_server *, uintptr_t opaque, const char * addr, int port);
@@ -103,6 +133,19 @@ int socket_server_bind(struct socket_server *, uintptr_t opaque, int fd);
 // for tcp
 // 设置TCP无延迟选项
 void socket_server_nodelay(struct socket_server *, int id);
+// 合并发送模式，enable为0时关闭并发出留下的数据
+void socket_server_coalesce(struct socket_server *, int id, int enable);
+// 把合并发送模式下留在写缓冲区的数据一次发出
+void socket_server_flush(struct socket_server *, int id);
+// 批量模式：读到的数据以SOCKET_BATCH返回，由上层把同一轮的数据合并投递；监听socket打开后，接受的连接也是批量模式
+void socket_server_batch(struct socket_server *, int id, int enable);
+// 读水位：服务没有消费的数据达到high时socket线程停止读，消费到low以下时恢复，high为0时关闭
+void socket_server_watermark(struct socket_server *, int id, int high, int low);
+// 服务一共消费了consumed字节，见socket_server_watermark
+void socket_server_consumed(struct socket_server *, int id, uint64_t consumed);
+// 准入控制：用于监听socket时，超过连接数或接受速率的新连接在socket线程里直接关闭，不通知服务；
+// 接受的连接继承读限速。用于TCP连接时只设置它的读限速
+void socket_server_admission(struct socket_server *, int id, const struct socket_admission_conf *conf);
 
 /*
  * UDP相关接口
@@ -138,6 +181,10 @@ int socket_server_udp_send(struct socket_server *, const struct socket_udp_addre
 // extract the address of the message, struct socket_message * should be SOCKET_UDP
 // 提取消息的地址信息，socket_message应该是SOCKET_UDP类型
 const struct socket_udp_address * socket_server_udp_address(struct socket_server *, struct socket_message *, int *addrsz);
+// turn an udp socket into reliable udp before sending anything : the messages are acked, retransmitted and delivered in order.
+// 把UDP socket转为可靠UDP，要在发送任何数据之前调用：消息会确认、重传，按顺序完整地交给服务（SOCKET_UDP）
+// 每个对端地址一个会话，重传超过上限时连接的socket报告SOCKET_ERR并关闭，没有连接的socket丢弃这个对端的会话
+int socket_server_reliable(struct socket_server *, int id);
 
 /*
  * 用户对象接口
@@ -156,4 +203,13 @@ void socket_server_userobject(struct socket_server *, struct socket_object_inter
 // 获取socket信息
 struct socket_info * socket_server_info(struct socket_server *);
 
+// 按服务汇总的socket统计，最多填写n项，返回服务的数量（大于n时需要更大的数组）
+int socket_server_service_stat(struct socket_server *, struct socket_service_stat *stat, int n);
+
+// 把SOCKET_DATA消息的数据缓冲区放回读缓冲池，sz是消息中的数据长度；也可以直接用skynet_free释放
+void socket_server_recycle(void *buffer, int sz);
+
+// 从读缓冲池分配至少sz字节，可以用socket_server_recycle放回，也可以直接用skynet_free释放
+void * socket_server_alloc(int sz);
+
 #endif
@@ -0,0 +1,403 @@
+/*
+ * socket_uring.h - Linux io_uring事件模型实现头文件
+ * 用io_uring的一次性poll代替epoll，接口与socket_epoll.h相同
+ *
+ * sp_add/sp_enable/sp_del只修改内存中的状态并排队提交项，
+ * 所有变更在下一次sp_wait时与等待合并成一次io_uring_enter系统调用。
+ * 每个poll触发一次后在下一次sp_wait时重新提交，语义与epoll的水平触发一致，
+ * socket_server不需要改变读写方式。
+ * 只能在socket线程中使用（socket_server_create在socket线程启动前调用sp_add）。
+ */
+
+#ifndef poll_socket_uring_h
+#define poll_socket_uring_h
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SOCKET_URING
+#endif
+#endif
+
+#ifdef SOCKET_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "skynet_malloc.h"
+
+#define URING_ENTRIES 1024      // 提交队列长度
+#define URING_MAX 16            // 最多同时存在的io_uring实例数量
+#define URING_DEFAULT_FD 1024   // 文件描述符表的初始大小
+
+// 每个被监听的文件描述符的状态
+struct uring_fd {
+	void * ud;          // 用户数据指针
+	uint32_t gen;       // 代数，文件描述符被删除或修改监听事件时递增，旧的完成事件据此丢弃
+	uint16_t mask;      // 期望监听的事件（POLLIN/POLLOUT）
+	uint16_t armed;     // 已提交的poll监听的事件，0表示没有提交
+	bool used;          // 是否在监听中
+	bool dirty;         // 是否在待提交列表中
+};
+
+struct sp_uring {
+	int ring_fd;
+	unsigned sq_entries;
+	unsigned sq_tail;               // 本地的提交队列尾，sp_wait时发布给内核
+	unsigned *ksq_head;
+	unsigned *ksq_tail;
+	unsigned *ksq_mask;
+	unsigned *ksq_array;
+	unsigned *kcq_head;
+	unsigned *kcq_tail;
+	unsigned *kcq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void * sq_ptr;
+	size_t sq_sz;
+	void * cq_ptr;
+	size_t cq_sz;
+	size_t sqes_sz;
+	struct uring_fd * fds;          // 按文件描述符索引
+	int fd_cap;
+	int * dirty;                    // 需要重新提交poll的文件描述符
+	int dirty_n;
+	int dirty_cap;
+};
+
+// 为true时sp_create创建io_uring实例，由socket_server_backend设置
+static bool URING_ENABLE = false;
+static struct sp_uring * URING[URING_MAX];
+
+static int
+uring_enter(struct sp_uring *U, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, U->ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// 发布本地的提交队列尾，返回尚未被内核取走的提交项数量
+static unsigned
+uring_publish(struct sp_uring *U) {
+	__atomic_store_n(U->ksq_tail, U->sq_tail, __ATOMIC_RELEASE);
+	return U->sq_tail - __atomic_load_n(U->ksq_head, __ATOMIC_ACQUIRE);
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct sp_uring *U) {
+	if (U->sq_tail - __atomic_load_n(U->ksq_head, __ATOMIC_ACQUIRE) >= U->sq_entries) {
+		// 提交队列满了，先提交一批
+		uring_enter(U, uring_publish(U), 0, 0);
+		if (U->sq_tail - __atomic_load_n(U->ksq_head, __ATOMIC_ACQUIRE) >= U->sq_entries)
+			return NULL;
+	}
+	unsigned idx = U->sq_tail & *U->ksq_mask;
+	struct io_uring_sqe *sqe = &U->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	U->ksq_array[idx] = idx;
+	++U->sq_tail;
+	return sqe;
+}
+
+static inline uint64_t
+uring_userdata(int sock, uint32_t gen) {
+	return (uint64_t)(uint32_t)sock << 32 | gen;
+}
+
+// 取消已提交的poll，取消本身的完成事件user_data为0，直接丢弃
+static void
+uring_cancel(struct sp_uring *U, int sock, struct uring_fd *f) {
+	if (f->armed) {
+		struct io_uring_sqe *sqe = uring_sqe(U);
+		if (sqe) {
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->fd = -1;
+			sqe->addr = uring_userdata(sock, f->gen);
+			sqe->user_data = 0;
+		}
+		f->armed = 0;
+	}
+	// 代数从1开始，user_data不会为0
+	if (++f->gen == 0)
+		f->gen = 1;
+}
+
+static void
+uring_dirty(struct sp_uring *U, int sock, struct uring_fd *f) {
+	if (f->dirty)
+		return;
+	if (U->dirty_n >= U->dirty_cap) {
+		U->dirty_cap *= 2;
+		U->dirty = skynet_realloc(U->dirty, U->dirty_cap * sizeof(int));
+	}
+	U->dirty[U->dirty_n++] = sock;
+	f->dirty = true;
+}
+
+static struct uring_fd *
+uring_getfd(struct sp_uring *U, int sock) {
+	if (sock < 0)
+		return NULL;
+	if (sock >= U->fd_cap) {
+		int cap = U->fd_cap * 2;
+		while (cap <= sock)
+			cap *= 2;
+		U->fds = skynet_realloc(U->fds, cap * sizeof(struct uring_fd));
+		memset(U->fds + U->fd_cap, 0, (cap - U->fd_cap) * sizeof(struct uring_fd));
+		U->fd_cap = cap;
+	}
+	return &U->fds[sock];
+}
+
+// 查找efd对应的io_uring实例，epoll实例返回NULL
+static struct sp_uring *
+sp_uring(int efd) {
+	if (!URING_ENABLE)
+		return NULL;
+	int i;
+	for (i=0;i<URING_MAX;i++) {
+		if (URING[i] && URING[i]->ring_fd == efd)
+			return URING[i];
+	}
+	return NULL;
+}
+
+static void
+sp_uring_release(struct sp_uring *U) {
+	int i;
+	for (i=0;i<URING_MAX;i++) {
+		if (URING[i] == U)
+			URING[i] = NULL;
+	}
+	if (U->sqes)
+		munmap(U->sqes, U->sqes_sz);
+	if (U->cq_ptr && U->cq_ptr != U->sq_ptr)
+		munmap(U->cq_ptr, U->cq_sz);
+	if (U->sq_ptr)
+		munmap(U->sq_ptr, U->sq_sz);
+	close(U->ring_fd);
+	skynet_free(U->fds);
+	skynet_free(U->dirty);
+	skynet_free(U);
+}
+
+/*
+ * 创建io_uring实例
+ * @return: io_uring的文件描述符，内核不支持或实例数量超过URING_MAX时返回-1
+ */
+static int
+sp_uring_create() {
+	int slot;
+	for (slot=0;slot<URING_MAX;slot++) {
+		if (URING[slot] == NULL)
+			break;
+	}
+	if (slot == URING_MAX)
+		return -1;
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0)
+		return -1;
+	struct sp_uring *U = skynet_malloc(sizeof(*U));
+	memset(U, 0, sizeof(*U));
+	U->ring_fd = fd;
+	U->sq_entries = p.sq_entries;
+	U->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	U->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (U->cq_sz > U->sq_sz)
+			U->sq_sz = U->cq_sz;
+		U->cq_sz = U->sq_sz;
+	}
+	U->sq_ptr = mmap(NULL, U->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (U->sq_ptr == MAP_FAILED) {
+		U->sq_ptr = NULL;
+		sp_uring_release(U);
+		return -1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		U->cq_ptr = U->sq_ptr;
+	} else {
+		U->cq_ptr = mmap(NULL, U->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (U->cq_ptr == MAP_FAILED) {
+			U->cq_ptr = NULL;
+			sp_uring_release(U);
+			return -1;
+		}
+	}
+	U->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	U->sqes = mmap(NULL, U->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (U->sqes == MAP_FAILED) {
+		U->sqes = NULL;
+		sp_uring_release(U);
+		return -1;
+	}
+	char *sq = U->sq_ptr;
+	U->ksq_head = (unsigned *)(sq + p.sq_off.head);
+	U->ksq_tail = (unsigned *)(sq + p.sq_off.tail);
+	U->ksq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	U->ksq_array = (unsigned *)(sq + p.sq_off.array);
+	U->sq_tail = *U->ksq_tail;
+	char *cq = U->cq_ptr;
+	U->kcq_head = (unsigned *)(cq + p.cq_off.head);
+	U->kcq_tail = (unsigned *)(cq + p.cq_off.tail);
+	U->kcq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	U->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	U->fd_cap = URING_DEFAULT_FD;
+	U->fds = skynet_malloc(U->fd_cap * sizeof(struct uring_fd));
+	memset(U->fds, 0, U->fd_cap * sizeof(struct uring_fd));
+	U->dirty_cap = URING_DEFAULT_FD;
+	U->dirty = skynet_malloc(U->dirty_cap * sizeof(int));
+	U->dirty_n = 0;
+
+	URING[slot] = U;
+	return fd;
+}
+
+static int
+sp_uring_add(struct sp_uring *U, int sock, void *ud) {
+	struct uring_fd *f = uring_getfd(U, sock);
+	if (f == NULL || f->used)
+		return 1;
+	uring_cancel(U, sock, f);
+	f->used = true;
+	f->ud = ud;
+	f->mask = POLLIN;  // 默认监听读事件
+	uring_dirty(U, sock, f);
+	return 0;
+}
+
+static void
+sp_uring_del(struct sp_uring *U, int sock) {
+	struct uring_fd *f = uring_getfd(U, sock);
+	if (f == NULL || !f->used)
+		return;
+	uring_cancel(U, sock, f);
+	f->used = false;
+	f->ud = NULL;
+	f->mask = 0;
+}
+
+static int
+sp_uring_enable(struct sp_uring *U, int sock, void *ud, bool read_enable, bool write_enable) {
+	struct uring_fd *f = uring_getfd(U, sock);
+	if (f == NULL || !f->used)
+		return 1;
+	uint16_t mask = (read_enable ? POLLIN : 0) | (write_enable ? POLLOUT : 0);
+	f->ud = ud;
+	if (f->armed && f->armed != mask) {
+		uring_cancel(U, sock, f);
+	}
+	f->mask = mask;
+	uring_dirty(U, sock, f);
+	return 0;
+}
+
+// 为待提交列表中的文件描述符提交poll
+static void
+uring_arm(struct sp_uring *U) {
+	int i;
+	for (i=0;i<U->dirty_n;i++) {
+		int sock = U->dirty[i];
+		struct uring_fd *f = &U->fds[sock];
+		f->dirty = false;
+		if (f->used && f->mask && !f->armed) {
+			struct io_uring_sqe *sqe = uring_sqe(U);
+			if (sqe == NULL) {
+				// 提交队列仍然满，留到下一次
+				int j;
+				for (j=i;j<U->dirty_n;j++) {
+					U->fds[U->dirty[j]].dirty = true;
+				}
+				memmove(U->dirty, U->dirty + i, (U->dirty_n - i) * sizeof(int));
+				U->dirty_n -= i;
+				return;
+			}
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = sock;
+			sqe->poll32_events = f->mask;
+			sqe->user_data = uring_userdata(sock, f->gen);
+			f->armed = f->mask;
+		}
+	}
+	U->dirty_n = 0;
+}
+
+// 从完成队列取出事件，丢弃取消和过期的完成事件
+static int
+uring_reap(struct sp_uring *U, struct event *e, int max) {
+	unsigned head = *U->kcq_head;
+	unsigned tail = __atomic_load_n(U->kcq_tail, __ATOMIC_ACQUIRE);
+	int n = 0;
+	while (head != tail && n < max) {
+		struct io_uring_cqe *cqe = &U->cqes[head & *U->kcq_mask];
+		++head;
+		uint64_t userdata = cqe->user_data;
+		if (userdata == 0)
+			continue;
+		int sock = (int)(userdata >> 32);
+		uint32_t gen = (uint32_t)userdata;
+		if (sock >= U->fd_cap)
+			continue;
+		struct uring_fd *f = &U->fds[sock];
+		if (!f->used || f->gen != gen)
+			continue;
+		f->armed = 0;
+		uring_dirty(U, sock, f);
+		int res = cqe->res;
+		if (res < 0) {
+			if (res == -ECANCELED)
+				continue;
+			res = POLLERR;
+		}
+		e[n].s = f->ud;
+		e[n].write = (res & POLLOUT) != 0;
+		e[n].read = (res & POLLIN) != 0;
+		e[n].error = (res & POLLERR) != 0;
+		e[n].eof = (res & POLLHUP) != 0;
+		e[n].rdhup = false;
+		++n;
+	}
+	__atomic_store_n(U->kcq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+/*
+ * 提交所有排队的变更并等待事件
+ * @param block: 为false时只提交变更并取走已经完成的事件，不等待
+ * @return: 实际事件数量，出错返回-1并设置errno
+ */
+static int
+sp_uring_wait(struct sp_uring *U, struct event *e, int max, bool block) {
+	uring_arm(U);
+	for (;;) {
+		int n = uring_reap(U, e, max);
+		if (n > 0) {
+			unsigned to_submit = uring_publish(U);
+			if (to_submit) {
+				uring_enter(U, to_submit, 0, 0);
+			}
+			return n;
+		}
+		// 重新提交刚被丢弃的完成事件对应的poll
+		uring_arm(U);
+		// 不等待时也要进入内核一次，poll的完成事件可能还在任务队列里没有写入完成队列
+		if (uring_enter(U, uring_publish(U), block ? 1 : 0, IORING_ENTER_GETEVENTS) < 0) {
+			if (errno != EBUSY)
+				return -1;
+		}
+		if (!block) {
+			// 取到的事件对应的poll在下一次调用时重新提交
+			return uring_reap(U, e, max);
+		}
+	}
+}
+
+#endif
+
+#endif
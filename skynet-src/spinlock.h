@@ -1,6 +1,15 @@
 /*
  * spinlock.h - skynet自旋锁实现头文件
  * 提供跨平台的自旋锁实现，支持原子操作和pthread互斥锁两种方式
+ *
+ * 编译时可以选择锁的实现（加在Makefile的CFLAGS中，所有模块必须一致，因为结构体布局不同）：
+ *   默认                 test-and-test-and-set自旋锁
+ *   -DSPINLOCK_TICKET    排队锁（ticket lock），按申请顺序获得锁，高争用时不会饿死某个线程
+ *   -DSPINLOCK_FUTEX     自适应锁，先自旋SPINLOCK_SPIN次，仍拿不到就用futex休眠（非Linux平台退化为sched_yield）
+ *   -DUSE_PTHREAD_LOCK   pthread互斥锁
+ *   -DSPINLOCK_STAT      争用统计：按加锁位置（文件名:行号）统计加锁次数、争用次数和自旋次数，
+ *                        进程退出时输出到stderr（见skynet_start.c），可以和上面任意一种实现同时使用
+ * ticket锁和futex锁需要C11原子操作，不支持时使用默认实现
  */
 
 #ifndef SKYNET_SPINLOCK_H
@@ -12,6 +21,11 @@
 #define SPIN_UNLOCK(q) spinlock_unlock(&(q)->lock);  // 解锁
 #define SPIN_DESTROY(q) spinlock_destroy(&(q)->lock);// 销毁自旋锁
 
+/*
+ * 各种实现都提供spinlock_acquire_，返回加锁时等待的次数（没有争用时为0），
+ * spinlock_lock在统计模式下记录这个次数，否则忽略它（内联后计数会被编译器优化掉）
+ */
+
 #ifndef USE_PTHREAD_LOCK
 
 /*
@@ -48,9 +62,13 @@ spinlock_init(struct spinlock *lock) {
 /*
  * 加锁（忙等待）
  */
-static inline void
-spinlock_lock(struct spinlock *lock) {
-	while (atomic_flag_test_and_set_(&lock->lock)) {}
+static inline int
+spinlock_acquire_(struct spinlock *lock) {
+	int spin = 0;
+	while (atomic_flag_test_and_set_(&lock->lock)) {
+		++spin;
+	}
+	return spin;
 }
 
 /*
@@ -98,6 +116,144 @@ spinlock_destroy(struct spinlock *lock) {
 #define atomic_pause_() ((void)0)
 #endif
 
+#if defined(SPINLOCK_TICKET)
+
+/*
+ * 排队锁（ticket lock）
+ * 加锁时取一个号（next加1），等到owner叫到这个号；解锁时owner加1，叫下一个号
+ * 等待者按先来后到获得锁，但所有等待者都在读同一个owner，解锁时会让它们的缓存行都失效；
+ * 排队的线程被抢占时后面的都要等它，所以线程数多于CPU核数时不要用
+ */
+#include <sched.h>
+
+#ifndef SPINLOCK_YIELD
+#define SPINLOCK_YIELD 1024	// 自旋多少次让出一次CPU，必须是2的幂
+#endif
+
+struct spinlock {
+	STD_ atomic_uint next;   // 下一个要发出的号
+	STD_ atomic_uint owner;  // 当前持有锁的号
+};
+
+static inline void
+spinlock_init(struct spinlock *lock) {
+	STD_ atomic_init(&lock->next, 0);
+	STD_ atomic_init(&lock->owner, 0);
+}
+
+static inline int
+spinlock_acquire_(struct spinlock *lock) {
+	unsigned ticket = STD_ atomic_fetch_add_explicit(&lock->next, 1, STD_ memory_order_relaxed);
+	int spin = 0;
+	for (;;) {
+		unsigned owner = STD_ atomic_load_explicit(&lock->owner, STD_ memory_order_acquire);
+		if (owner == ticket)
+			return spin;
+		// 按前面排队的人数退避，离得越远读owner越少
+		unsigned n = ticket - owner;
+		do {
+			atomic_pause_();
+			++spin;
+		} while (--n);
+		// 排在前面的线程可能被抢占了（线程数多于CPU核数时），自旋太久就让出CPU
+		if ((spin & (SPINLOCK_YIELD - 1)) < ticket - owner)
+			sched_yield();
+	}
+}
+
+/*
+ * 只有没人排队（next == owner）时才取号成功
+ */
+static inline int
+spinlock_trylock(struct spinlock *lock) {
+	unsigned owner = STD_ atomic_load_explicit(&lock->owner, STD_ memory_order_relaxed);
+	unsigned ticket = owner;
+	return STD_ atomic_compare_exchange_strong_explicit(&lock->next, &ticket, owner + 1,
+		STD_ memory_order_acquire, STD_ memory_order_relaxed);
+}
+
+static inline void
+spinlock_unlock(struct spinlock *lock) {
+	// 只有持有者会修改owner
+	unsigned owner = STD_ atomic_load_explicit(&lock->owner, STD_ memory_order_relaxed);
+	STD_ atomic_store_explicit(&lock->owner, owner + 1, STD_ memory_order_release);
+}
+
+static inline void
+spinlock_destroy(struct spinlock *lock) {
+	(void) lock;
+}
+
+#elif defined(SPINLOCK_FUTEX)
+
+/*
+ * 自适应锁：先自旋，自旋SPINLOCK_SPIN次还拿不到锁就休眠
+ * 锁状态：0 未锁定，1 已锁定且没有休眠者，2 已锁定且可能有休眠者（解锁时需要唤醒）
+ * 适合临界区偶尔很长（或持有者被抢占）的场合，线程数多于CPU核数时不会白白烧CPU
+ */
+
+#ifndef SPINLOCK_SPIN
+#define SPINLOCK_SPIN 128
+#endif
+
+#if defined(__linux__)
+// futex系统调用定义在skynet_start.c，不在头文件中引入unistd.h（会和一些模块里的函数名冲突）
+void spinlock_wait_(STD_ atomic_int *ptr, int v);
+void spinlock_wake_(STD_ atomic_int *ptr);
+#else
+#include <sched.h>
+#define spinlock_wait_(ptr, v) sched_yield()
+#define spinlock_wake_(ptr) ((void)0)
+#endif
+
+struct spinlock {
+	STD_ atomic_int lock;  // 锁状态（futex字）
+};
+
+static inline void
+spinlock_init(struct spinlock *lock) {
+	STD_ atomic_init(&lock->lock, 0);
+}
+
+static inline int
+spinlock_trylock(struct spinlock *lock) {
+	int c = 0;
+	return STD_ atomic_compare_exchange_strong_explicit(&lock->lock, &c, 1,
+		STD_ memory_order_acquire, STD_ memory_order_relaxed);
+}
+
+static inline int
+spinlock_acquire_(struct spinlock *lock) {
+	if (spinlock_trylock(lock))
+		return 0;
+	int spin;
+	for (spin = 1; spin <= SPINLOCK_SPIN; spin++) {
+		atomic_pause_();
+		if (atomic_load_relaxed_(&lock->lock) == 0 && spinlock_trylock(lock))
+			return spin;
+	}
+	// 标记为有休眠者，交换出来的旧值为0说明恰好拿到了锁
+	while (STD_ atomic_exchange_explicit(&lock->lock, 2, STD_ memory_order_acquire) != 0) {
+		spinlock_wait_(&lock->lock, 2);
+		++spin;
+	}
+	return spin;
+}
+
+static inline void
+spinlock_unlock(struct spinlock *lock) {
+	if (STD_ atomic_exchange_explicit(&lock->lock, 0, STD_ memory_order_release) == 2) {
+		spinlock_wake_(&lock->lock);
+	}
+}
+
+static inline void
+spinlock_destroy(struct spinlock *lock) {
+	(void) lock;
+}
+
+#else
+
 /*
  * 自旋锁结构体（C11原子操作版本）
  */
@@ -116,14 +272,17 @@ spinlock_init(struct spinlock *lock) {
 /*
  * 加锁（优化的忙等待，包含CPU暂停）
  */
-static inline void
-spinlock_lock(struct spinlock *lock) {
+static inline int
+spinlock_acquire_(struct spinlock *lock) {
+	int spin = 0;
 	for (;;) {
 		if (!atomic_test_and_set_(&lock->lock))
-			return;
+			return spin;
 		// 在锁被占用时暂停CPU，减少功耗和总线争用
-		while (atomic_load_relaxed_(&lock->lock))
+		while (atomic_load_relaxed_(&lock->lock)) {
 			atomic_pause_();
+			++spin;
+		}
 	}
 }
 
@@ -153,6 +312,8 @@ spinlock_destroy(struct spinlock *lock) {
 	(void) lock;
 }
 
+#endif  // SPINLOCK_TICKET
+
 #endif  // __STDC_NO_ATOMICS__
 
 #else
@@ -182,11 +343,19 @@ spinlock_init(struct spinlock *lock) {
 }
 
 /*
- * 加锁
+ * 加锁（统计模式下先试一次，失败记为一次争用）
  */
-static inline void
-spinlock_lock(struct spinlock *lock) {
+static inline int
+spinlock_acquire_(struct spinlock *lock) {
+#ifdef SPINLOCK_STAT
+	if (pthread_mutex_trylock(&lock->lock) == 0)
+		return 0;
 	pthread_mutex_lock(&lock->lock);
+	return 1;
+#else
+	pthread_mutex_lock(&lock->lock);
+	return 0;
+#endif
 }
 
 /*
@@ -216,4 +385,60 @@ spinlock_destroy(struct spinlock *lock) {
 
 #endif
 
+#ifdef SPINLOCK_STAT
+
+/*
+ * 争用统计：每个加锁位置一个静态的统计项，第一次加锁时挂到全局链表spinlock_site_上
+ * （链表头定义在skynet_start.c，C服务和Lua扩展库通过skynet导出的符号访问它）
+ */
+
+#include "atomic.h"
+#include <stdint.h>
+
+struct spinlock_site {
+	const char *file;
+	int line;
+	int linked;                     // 已挂到链表上
+	ATOM_ULONG acquire;             // 加锁次数
+	ATOM_ULONG contended;           // 需要等待的次数
+	ATOM_ULONG spin;                // 等待的总次数（自旋次数，futex锁还包括休眠次数）
+	struct spinlock_site *next;
+};
+
+extern ATOM_POINTER spinlock_site_;
+
+static inline void
+spinlock_stat_(struct spinlock_site *site, int spin) {
+	ATOM_FINC(&site->acquire);
+	if (spin) {
+		ATOM_FINC(&site->contended);
+		ATOM_FADD(&site->spin, spin);
+	}
+	// 持有锁时执行，同一位置的锁可能是不同的锁对象，所以用原子操作挂链表
+	if (!site->linked && __sync_bool_compare_and_swap(&site->linked, 0, 1)) {
+		uintptr_t head;
+		do {
+			head = ATOM_LOAD(&spinlock_site_);
+			site->next = (struct spinlock_site *)head;
+		} while (!ATOM_CAS_POINTER(&spinlock_site_, head, (uintptr_t)site));
+	}
+}
+
+#define spinlock_lock(l) do { \
+	static struct spinlock_site site_ = { __FILE__, __LINE__ }; \
+	spinlock_stat_(&site_, spinlock_acquire_(l)); \
+} while (0)
+
+#else
+
+/*
+ * 加锁
+ */
+static inline void
+spinlock_lock(struct spinlock *lock) {
+	(void)spinlock_acquire_(lock);
+}
+
+#endif
+
 #endif
@@ -0,0 +1,189 @@
+/*
+ * benchmark.c - 消息队列和定时器的微基准测试，不需要启动skynet
+ * 和 skynet_mq.c skynet_timer.c 一起编译，见 Makefile 的 bench 目标
+ * 每项结果输出一行JSON，和 test/benchmark.lua 的格式相同，方便在版本之间比较
+ */
+
+#include "skynet.h"
+#include "skynet_mq.h"
+#include "skynet_timer.h"
+#include "atomic.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// 定时器到期时调用，这里只计数
+
+static ATOM_SIZET EXPIRED;
+
+int
+skynet_context_push(uint32_t handle, struct skynet_message *message) {
+	ATOM_FINC(&EXPIRED);
+	return 0;
+}
+
+int
+skynet_context_pushtimeout(uint32_t handle, int *session, int n) {
+	ATOM_FADD(&EXPIRED, n);
+	return 0;
+}
+
+void
+skynet_error(struct skynet_context * context, const char *msg, ...) {
+	va_list ap;
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static void
+report(const char *name, size_t ops, uint64_t nsec) {
+	double sec = nsec / 1e9;
+	printf("{\"name\":\"%s\",\"ops\":%zu,\"sec\":%.6f,\"ops_per_sec\":%.0f,\"ns_per_op\":%.1f}\n",
+		name, ops, sec, ops / sec, (double)nsec / ops);
+	fflush(stdout);
+}
+
+static void
+bench_mq_push_pop(int n) {
+	struct message_queue *q = skynet_mq_create(1);
+	struct skynet_message msg;
+	memset(&msg, 0, sizeof(msg));
+	int i;
+	uint64_t start = skynet_monotonic_time();
+	for (i=0;i<n;i++) {
+		msg.session = i;
+		skynet_mq_push(q, &msg);
+	}
+	for (i=0;i<n;i++) {
+		skynet_mq_pop(q, &msg);
+	}
+	report("mq_push_pop", n, skynet_monotonic_time() - start);
+
+	// 队列保持很短时的推入弹出，不触发扩容
+	start = skynet_monotonic_time();
+	for (i=0;i<n;i++) {
+		skynet_mq_push(q, &msg);
+		skynet_mq_pop(q, &msg);
+	}
+	report("mq_push_pop_short", n, skynet_monotonic_time() - start);
+	skynet_mq_mark_release(q);
+	skynet_mq_release(q, NULL, NULL);
+}
+
+struct producer {
+	struct message_queue *q;
+	int n;
+};
+
+static void *
+producer_thread(void *p) {
+	struct producer *pd = p;
+	struct skynet_message msg;
+	memset(&msg, 0, sizeof(msg));
+	int i;
+	for (i=0;i<pd->n;i++) {
+		msg.session = i;
+		skynet_mq_push(pd->q, &msg);
+	}
+	return NULL;
+}
+
+// 多个线程向同一个服务发消息，一个线程处理，相当于很多服务给一个热点服务发消息
+static void
+bench_mq_contended(int threads, int n) {
+	struct message_queue *q = skynet_mq_create(1);
+	struct producer pd[threads];
+	pthread_t pid[threads];
+	int i;
+	uint64_t start = skynet_monotonic_time();
+	for (i=0;i<threads;i++) {
+		pd[i].q = q;
+		pd[i].n = n;
+		pthread_create(&pid[i], NULL, producer_thread, &pd[i]);
+	}
+	size_t total = (size_t)threads * n;
+	size_t popped = 0;
+	struct skynet_message msg;
+	while (popped < total) {
+		if (skynet_mq_pop(q, &msg) == 0) {
+			++popped;
+			continue;
+		}
+		// 队列空了，像工作线程一样等它有新消息后重新进入全局队列
+		while (skynet_globalmq_pop() == NULL) ;
+	}
+	for (i=0;i<threads;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "mq_contended_%d", threads);
+	report(name, total, skynet_monotonic_time() - start);
+	skynet_mq_mark_release(q);
+	skynet_mq_release(q, NULL, NULL);
+}
+
+static void
+next_tick(void) {
+	struct timespec ti = { 0, 20 * 1000000 };
+	nanosleep(&ti, NULL);
+	skynet_updatetime();
+}
+
+static void
+bench_timer(int n) {
+	int i;
+	uint64_t start = skynet_monotonic_time();
+	for (i=0;i<n;i++) {
+		skynet_timeout(i % 64 + 1, 100000 + i % 1000, i + 1);
+	}
+	report("timer_add", n, skynet_monotonic_time() - start);
+
+	// 新添加的定时器在下一个滴答合并进时间轮，取消的是时间轮里的定时器
+	next_tick();
+	start = skynet_monotonic_time();
+	for (i=0;i<n;i++) {
+		skynet_timeout_cancel(i % 64 + 1, i + 1);
+	}
+	report("timer_cancel", n, skynet_monotonic_time() - start);
+
+	// 同一个滴答到期的定时器，只计算skynet_updatetime派发它们的时间
+	skynet_updatetime();
+	for (i=0;i<n;i++) {
+		skynet_timeout(i % 64 + 1, 1, n + i + 1);
+	}
+	ATOM_STORE(&EXPIRED, 0);
+	struct timespec ti = { 0, 30 * 1000000 };
+	nanosleep(&ti, NULL);
+	start = skynet_monotonic_time();
+	skynet_updatetime();
+	uint64_t cost = skynet_monotonic_time() - start;
+	if (ATOM_LOAD(&EXPIRED) != (size_t)n) {
+		skynet_error(NULL, "timer_expire : %zu of %d expired", ATOM_LOAD(&EXPIRED), n);
+	}
+	report("timer_expire", n, cost);
+}
+
+int
+main(int argc, char *argv[]) {
+	int n = 1000000;
+	if (argc > 1) {
+		n = strtol(argv[1], NULL, 10);
+		if (n <= 0)
+			n = 1000000;
+	}
+	skynet_mq_init(0, 0);
+	skynet_timer_init(0);
+
+	bench_mq_push_pop(n);
+	bench_mq_contended(1, n);
+	bench_mq_contended(4, n / 4);
+	bench_timer(n / 10);
+
+	return 0;
+}
@@ -0,0 +1,255 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+local driver = require "skynet.socketdriver"
+local crypt = require "skynet.crypt"
+require "skynet.manager"
+
+--[[
+	Micro benchmarks of the runtime : skynet examples/config.bench
+	Every result is a line of JSON on stdout (the same format as test/benchmark.c),
+	so `make -s bench > result.json` keeps a record to compare between releases.
+	The optional argument scales the number of operations (default 1).
+]]
+
+local mode = ...
+
+local hpc = skynet.hpc
+
+if mode == "slave" then
+
+local latency = {}
+local count = 0
+
+local CMD = {}
+
+function CMD.ping(t)
+	count = count + 1
+	latency[count] = hpc() - t
+end
+
+function CMD.sync()
+	skynet.ret()
+end
+
+function CMD.echo(...)
+	skynet.ret(skynet.pack(...))
+end
+
+function CMD.result()
+	table.sort(latency)
+	local n = count
+	local p50 = latency[math.max(1, n // 2)] or 0
+	local p99 = latency[math.max(1, n * 99 // 100)] or 0
+	latency = {}
+	count = 0
+	skynet.ret(skynet.pack(n, p50, p99))
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd, ...)
+		CMD[cmd](...)
+	end)
+end)
+
+else
+
+local scale = tonumber(mode) or 1
+
+local function report(name, ops, nsec, extra)
+	local sec = nsec / 1e9
+	local s = string.format('{"name":"%s","ops":%d,"sec":%.6f,"ops_per_sec":%.0f,"ns_per_op":%.1f',
+		name, ops, sec, ops / sec, nsec / ops)
+	if extra then
+		for _, k in ipairs(extra) do
+			s = s .. string.format(',"%s":%.1f', k, extra[k])
+		end
+	end
+	print(s .. "}")
+end
+
+-- skynet.send from one service to n services, the latency is from send to dispatch.
+-- At most `window` messages are queued for each service, or the latency is only the length of the queue.
+local function bench_send(n, count, window)
+	local slaves = {}
+	for i = 1, n do
+		slaves[i] = skynet.newservice(SERVICE_NAME, "slave")
+	end
+	local start = hpc()
+	for i = 1, count do
+		skynet.send(slaves[i % n + 1], "lua", "ping", hpc())
+		if i % (window * n) == 0 then
+			-- the call is queued after the pings, so it returns when all of them are dispatched
+			for j = 1, n do
+				skynet.call(slaves[j], "lua", "sync")
+			end
+		end
+	end
+	local p50, p99 = 0, 0
+	for i = 1, n do
+		local _, a, b = skynet.call(slaves[i], "lua", "result")
+		p50 = math.max(p50, a)
+		p99 = math.max(p99, b)
+	end
+	report("send_" .. n, count, hpc() - start, { "p50_us", "p99_us", p50_us = p50 / 1000, p99_us = p99 / 1000 })
+	for i = 1, n do
+		skynet.kill(slaves[i])
+	end
+end
+
+local function bench_call(count)
+	local slave = skynet.newservice(SERVICE_NAME, "slave")
+	local rtt = {}
+	local start = hpc()
+	for i = 1, count do
+		local t = hpc()
+		skynet.call(slave, "lua", "echo", i)
+		rtt[i] = hpc() - t
+	end
+	local cost = hpc() - start
+	table.sort(rtt)
+	report("call", count, cost, { "p50_us", "p99_us",
+		p50_us = rtt[count // 2] / 1000, p99_us = rtt[count * 99 // 100] / 1000 })
+	skynet.kill(slave)
+end
+
+-- timeouts of the next tick, the time includes waiting for the tick
+local function bench_timeout(count)
+	local co = coroutine.running()
+	local fired = 0
+	local function cb()
+		fired = fired + 1
+		if fired == count then
+			skynet.wakeup(co)
+		end
+	end
+	local start = hpc()
+	for i = 1, count do
+		skynet.timeout(1, cb)
+	end
+	local add = hpc() - start
+	skynet.wait(co)
+	report("timeout_add", count, add)
+	report("timeout_expire", count, hpc() - start)
+end
+
+local shapes = {
+	{ "int", function() return 1, 2, 3 end },
+	{ "string_1k", function() return string.rep("x", 1024) end },
+	{ "array_100", function()
+		local t = {}
+		for i = 1, 100 do t[i] = i end
+		return t
+	end },
+	{ "map_100", function()
+		local t = {}
+		for i = 1, 100 do t["key" .. i] = i end
+		return t
+	end },
+	{ "nested", function()
+		local t = {}
+		for i = 1, 10 do
+			t[i] = { id = i, name = "item" .. i, pos = { x = i, y = i * 2 }, tags = { "a", "b", "c" } }
+		end
+		return t
+	end },
+}
+
+local function bench_seri(count)
+	local pack, unpack, trash = skynet.pack, skynet.unpack, skynet.trash
+	for _, shape in ipairs(shapes) do
+		local name, gen = shape[1], shape[2]
+		local a, b, c = gen()
+		local start = hpc()
+		for i = 1, count do
+			local msg, sz = pack(a, b, c)
+			trash(msg, sz)
+		end
+		local msg, sz = pack(a, b, c)
+		report("pack_" .. name, count, hpc() - start, { "bytes", bytes = sz })
+		start = hpc()
+		for i = 1, count do
+			unpack(msg, sz)
+		end
+		report("unpack_" .. name, count, hpc() - start)
+		trash(msg, sz)
+	end
+end
+
+-- base64 and hex of a binary payload, ops are the bytes of the payload
+local function bench_codec(size, count)
+	local t = {}
+	for i = 1, size do
+		t[i] = string.char(i * 7 % 256)
+	end
+	local data = table.concat(t)
+	local codecs = {
+		{ "base64", crypt.base64encode, crypt.base64decode },
+		{ "hex", crypt.hexencode, crypt.hexdecode },
+	}
+	for _, c in ipairs(codecs) do
+		local name, encode, decode = c[1], c[2], c[3]
+		local text
+		local start = hpc()
+		for i = 1, count do
+			text = encode(data)
+		end
+		report(name .. "_encode_" .. size, size * count, hpc() - start)
+		start = hpc()
+		for i = 1, count do
+			decode(text)
+		end
+		report(name .. "_decode_" .. size, size * count, hpc() - start)
+		assert(decode(text) == data)
+	end
+end
+
+-- echo through a tcp connection of 127.0.0.1, ops are bytes
+local function bench_socket(size, count)
+	local listen_id, ip, port = socket.listen("127.0.0.1", 0)
+	socket.start(listen_id, function(id)
+		socket.start(id)
+		driver.nodelay(id)
+		skynet.fork(function()
+			while true do
+				local data = socket.read(id)
+				if not data then
+					break
+				end
+				socket.write(id, data)
+			end
+			socket.close(id)
+		end)
+	end)
+	local id = socket.open(ip, port)
+	-- or the small pipelined writes wait for delayed acks
+	driver.nodelay(id)
+	local chunk = string.rep("x", size)
+	local pipeline = 16
+	local start = hpc()
+	for i = 1, count, pipeline do
+		local n = math.min(pipeline, count - i + 1)
+		for j = 1, n do
+			socket.write(id, chunk)
+		end
+		assert(socket.read(id, size * n))
+	end
+	report("socket_echo_" .. size, size * count, hpc() - start)
+	socket.close(id)
+	socket.close(listen_id)
+end
+
+skynet.start(function()
+	local n = math.floor(100000 * scale)
+	bench_send(1, n * 10, 256)
+	bench_send(8, n * 10, 256)
+	bench_call(n)
+	bench_timeout(n)
+	bench_seri(n)
+	bench_codec(64, n)
+	bench_codec(64 * 1024, n // 100)
+	bench_socket(64, n)
+	bench_socket(4096, n // 4)
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,84 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- inject skynet.forward_type
+
+local mode, echo = ...
+
+if mode == "ECHO" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, ...)
+		skynet.ret(skynet.pack(...))
+	end)
+end)
+
+elseif mode == "FORWARD" then
+
+-- a forward service like clusterproxy : the handler takes over the lua messages.
+-- The requests coming while "busy" is preempted by the time slice are deferred and replayed later.
+
+skynet.register_protocol {
+	name = "system",
+	id = skynet.PTYPE_SYSTEM,
+	unpack = function (...) return ... end,
+}
+
+local forward_map = {
+	[skynet.PTYPE_LUA] = skynet.PTYPE_SYSTEM,
+	[skynet.PTYPE_RESPONSE] = skynet.PTYPE_RESPONSE,	-- don't free response message
+}
+
+echo = tonumber(echo)
+
+skynet.forward_type( forward_map, function()
+	-- the same as lua_timeslice_testforward = 1 in config
+	skynet.timeslice(1)
+	skynet.dispatch("system", function (session, source, msg, sz)
+		local cmd = skynet.unpack(msg, sz)
+		if cmd == "busy" then
+			skynet.trash(msg, sz)
+			local t = skynet.hpc()
+			local n = 0
+			while skynet.hpc() - t < 50000000 do	-- 50ms
+				n = n + 1
+			end
+			skynet.ret(skynet.pack(skynet.stat "preempt"))
+		else
+			-- pass the message (and its memory) on, the echo service responds to the caller
+			skynet.redirect(echo, source, "lua", session, msg, sz)
+			skynet.ignoreret()
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local echo = skynet.newservice(SERVICE_NAME, "ECHO")
+	local fwd = skynet.newservice(SERVICE_NAME, "FORWARD", echo)
+	local n = 100
+	for round = 1, 3 do
+		local wait = n + 1
+		local co = coroutine.running()
+		local preempt
+		skynet.fork(function()
+			preempt = skynet.call(fwd, "lua", "busy")
+			wait = wait - 1
+			if wait == 0 then skynet.wakeup(co) end
+		end)
+		for i = 1, n do
+			skynet.fork(function()
+				local cmd, v = skynet.call(fwd, "lua", "echo", i)
+				assert(cmd == "echo" and v == i)
+				wait = wait - 1
+				if wait == 0 then skynet.wakeup(co) end
+			end)
+		end
+		skynet.wait(co)
+		print("round", round, "preempt", preempt)
+		assert(preempt > 0)
+	end
+	print("forward test ok")
+	skynet.exit()
+end)
+
+end
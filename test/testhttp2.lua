@@ -0,0 +1,161 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+local sockethelper = require "http.sockethelper"
+local httpd = require "http.httpd"
+local http2 = require "http.http2"
+
+local PORT = 8002
+
+-- frame types
+local RST_STREAM = 0x3
+local WINDOW_UPDATE = 0x8
+local CONTINUATION = 0x9
+
+local PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+-- count the frames written by one side, each write is a whole frame or more
+local function frame_counter(write)
+	local count = setmetatable({}, { __index = function() return 0 end })
+	return count, function(data)
+		local pos = 1
+		if data:sub(1, #PREFACE) == PREFACE then
+			pos = #PREFACE + 1
+		end
+		while pos <= #data do
+			local len, type = string.unpack(">I3B", data, pos)
+			count[type] = count[type] + 1
+			pos = pos + 9 + len
+		end
+		return write(data)
+	end
+end
+
+local server_sent
+
+local function handler(url, method, header, body)
+	local path, query = url:match "([^?]*)%??(.*)"
+	if path == "/echo" then
+		-- the later requests respond first
+		local n = tonumber(query)
+		skynet.sleep((10 - n) * 5)
+		return 200, "echo " .. n
+	elseif path == "/header" then
+		return 200, tostring(#header["x-big"]), { ["x-big"] = string.rep("y", 40000) }
+	elseif path == "/upload" then
+		assert(method == "POST")
+		return 200, body
+	elseif path == "/slow" then
+		skynet.sleep(100)
+		return 200, "late"
+	elseif path == "/broken" then
+		local n = 0
+		return 200, function()
+			n = n + 1
+			if n > 1 then
+				error "broken body"
+			end
+			return "part"
+		end
+	end
+	return 404, "not found"
+end
+
+local function server()
+	local id = socket.listen("127.0.0.1", PORT)
+	socket.start(id, function(fd, addr)
+		socket.start(fd)
+		local write
+		server_sent, write = frame_counter(sockethelper.writefunc(fd))
+		local ok, err = httpd.serve({
+			read = sockethelper.readfunc(fd),
+			write = write,
+		}, handler)
+		print("server closed", ok, err)
+		socket.close(fd)
+	end)
+	return id
+end
+
+local function test_multiplex(conn)
+	local co = coroutine.running()
+	local n = 9
+	local order = {}
+	for i = 1, n do
+		skynet.fork(function()
+			local code, body = conn:request("GET", "/echo?" .. i)
+			assert(code == 200 and body == "echo " .. i, body)
+			order[#order+1] = i
+			if #order == n then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	-- all the requests are in flight on one connection at the same time
+	for i = 1, n do
+		assert(order[i] == n - i + 1)
+	end
+	print("multiplex ok", table.concat(order, " "))
+end
+
+local function test_continuation(conn, client_sent)
+	local big = string.rep("x", 50000)
+	local code, body, header = conn:request("GET", "/header", { ["x-big"] = big })
+	assert(code == 200 and body == tostring(#big), body)
+	assert(header["x-big"] == string.rep("y", 40000))
+	-- the header blocks are larger than the default max frame size 16384
+	assert(client_sent[CONTINUATION] > 0)
+	assert(server_sent[CONTINUATION] > 0)
+	print("continuation ok", client_sent[CONTINUATION], server_sent[CONTINUATION])
+end
+
+local function test_window(conn, client_sent)
+	local t = {}
+	for i = 1, 400000 do
+		t[i] = string.format("%08d", i)
+	end
+	local content = table.concat(t)	-- 3.2M, more than the 1M window of each side
+	local client_updates = client_sent[WINDOW_UPDATE]
+	local server_updates = server_sent[WINDOW_UPDATE]
+	local code, body = conn:request("POST", "/upload", { ["content-type"] = "text/plain" }, content)
+	assert(code == 200 and body == content)
+	client_updates = client_sent[WINDOW_UPDATE] - client_updates
+	server_updates = server_sent[WINDOW_UPDATE] - server_updates
+	assert(client_updates > 0 and server_updates > 0)
+	print("window update ok", client_updates, server_updates)
+end
+
+local function test_reset(conn, client_sent)
+	-- the client cancels the stream when it times out
+	local ok, err = pcall(conn.request, conn, "GET", "/slow", nil, nil, 10)
+	assert(not ok and err:find "timeout", err)
+	assert(client_sent[RST_STREAM] == 1)
+	-- the server resets the stream when the body fails after the header
+	local ok, err = pcall(conn.request, conn, "GET", "/broken")
+	assert(not ok and err:find "reset by peer", err)
+	assert(server_sent[RST_STREAM] >= 1)
+	-- the connection is still usable
+	skynet.sleep(100)	-- the response of /slow is dropped by the client
+	local code, body = conn:request("GET", "/echo?9")
+	assert(code == 200 and body == "echo 9")
+	print("rst_stream ok")
+end
+
+skynet.start(function()
+	local listen = server()
+	local fd = assert(socket.open("127.0.0.1", PORT))
+	local client_sent, write = frame_counter(sockethelper.writefunc(fd))
+	local conn = http2.connect({
+		read = sockethelper.readfunc(fd),
+		write = write,
+	}, "127.0.0.1:" .. PORT, "http")
+	test_multiplex(conn)
+	test_continuation(conn, client_sent)
+	test_window(conn, client_sent)
+	test_reset(conn, client_sent)
+	conn:close()
+	socket.close(fd)
+	socket.close(listen)
+	print("http2 test ok")
+	skynet.exit()
+end)
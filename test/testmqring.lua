@@ -0,0 +1,56 @@
+local skynet = require "skynet"
+require "skynet.manager"
+
+local mode = ...
+
+if mode == "echo" then
+
+skynet.start(function()
+	-- use a small ring, so most of the messages go through the overflow queue
+	print("mqring", skynet.mqring(16), skynet.mqring())
+	local last = {}
+	skynet.dispatch("lua", function(_,source,i)
+		if i == "query" then
+			skynet.ret(skynet.pack(last[source]))
+			return
+		end
+		assert((last[source] or 0) + 1 == i, "Message out of order")
+		last[source] = i
+	end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_,echo, n)
+		for i=1,n do
+			skynet.send(echo, "lua", i)
+			if i % 1000 == 0 then
+				skynet.yield()
+			end
+		end
+		skynet.ret(skynet.pack(skynet.call(echo, "lua", "query")))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local echo = skynet.newservice(SERVICE_NAME, "echo")
+	local n = 20000
+	local done = 0
+	for i=1,8 do
+		local sender = skynet.newservice(SERVICE_NAME, "sender")
+		skynet.fork(function()
+			assert(skynet.call(sender, "lua", echo, n) == n)
+			done = done + 1
+		end)
+	end
+	while done < 8 do
+		skynet.sleep(10)
+	end
+	print("mqring test ok")
+	skynet.exit()
+end)
+
+end
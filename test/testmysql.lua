@@ -132,6 +132,37 @@ local function test_signed(db)
     db:stmt_close(stmt)
 end
 
+-- 测试逐行读取大结果集，以及提前 break 之后连接仍然可用
+local function test_rows(db)
+	print("test rows")
+	db:query "DROP TABLE IF EXISTS `test_rows`"
+	db:query "CREATE TABLE `test_rows` (`id` int NOT NULL PRIMARY KEY, `name` varchar(16))"
+	local values = {}
+	for i = 1, 1000 do
+		values[i] = string.format("(%d,'name%d')", i, i)
+	end
+	db:query("INSERT INTO test_rows (id,name) VALUES " .. table.concat(values, ","))
+
+	local n = 0
+	for row in db:rows("SELECT * FROM test_rows ORDER BY id", 100) do
+		n = n + 1
+		assert(row.id == n and row.name == "name" .. n)
+	end
+	assert(n == 1000)
+
+	n = 0
+	for row in db:rows("SELECT * FROM test_rows ORDER BY id", 100) do
+		n = n + 1
+		if n == 150 then
+			break
+		end
+	end
+	-- 剩下的行已经丢弃，后面的查询不受影响
+	local res = db:query("SELECT COUNT(*) AS c FROM test_rows")
+	assert(res[1].c == 1000)
+	print("test rows ok")
+end
+
 skynet.start(function()
 
 	local function on_connect(db)
@@ -169,6 +200,8 @@ skynet.start(function()
 	
 	test_signed(db)
 
+	test_rows(db)
+
     -- test in another coroutine
 	skynet.fork( test2, db)
     skynet.fork( test3, db)
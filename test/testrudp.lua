@@ -0,0 +1,160 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+
+-- reliable udp (socket.reliable) against a plain udp socket speaking the protocol of skynet-src/rudp.c,
+-- so the test decides which segments are reordered, duplicated or lost.
+
+local CMD_DATA = 1
+local CMD_ACK = 2
+local MAX_PAYLOAD = 1400 - 16
+
+local function data_segment(conv, seq, una, frg, data)
+	return string.pack(">BI4I4I4BI2", CMD_DATA, conv, seq, una, frg, #data) .. data
+end
+
+local function ack_segment(conv, una, seq)
+	return string.pack(">BI4I4I4", CMD_ACK, conv, una, seq)
+end
+
+-- split a packet into segments
+local function segments(str)
+	local list = {}
+	local pos = 1
+	while pos <= #str do
+		local cmd = str:byte(pos)
+		if cmd == CMD_DATA then
+			local _, conv, seq, una, frg, len, next = string.unpack(">BI4I4I4BI2", str, pos)
+			list[#list+1] = { cmd = cmd, conv = conv, seq = seq, una = una, frg = frg, data = str:sub(next, next + len - 1) }
+			pos = next + len
+		else
+			assert(cmd == CMD_ACK)
+			local _, conv, una, seq, next = string.unpack(">BI4I4I4", str, pos)
+			list[#list+1] = { cmd = cmd, conv = conv, una = una, seq = seq }
+			pos = next
+		end
+	end
+	return list
+end
+
+local function test_receive()
+	local recv = {}
+	local server = socket.udp(function(str, from)
+		recv[#recv+1] = str
+	end, "127.0.0.1", 8767)
+	socket.reliable(server)
+
+	local una = 0	-- of conv 1
+	local c = socket.udp(function(str, from)
+		for _, s in ipairs(segments(str)) do
+			assert(s.cmd == CMD_ACK)
+			if s.conv == 1 and s.una > una then
+				una = s.una
+			end
+		end
+	end)
+	socket.udp_connect(c, "127.0.0.1", 8767)
+	local function send(seq, frg, data, conv)
+		socket.write(c, data_segment(conv or 1, seq, 0, frg, data))
+	end
+
+	-- a message of 3 fragments, the middle one is lost
+	send(2, 0, "ccc")
+	send(0, 2, "aaa")
+	skynet.sleep(20)
+	assert(#recv == 0)
+	assert(una == 1)
+	-- duplicates of the fragments already received
+	send(0, 2, "aaa")
+	send(2, 0, "ccc")
+	skynet.sleep(20)
+	assert(#recv == 0)
+	-- the lost fragment is retransmitted
+	send(1, 1, "bbb")
+	skynet.sleep(20)
+	assert(#recv == 1 and recv[1] == "aaabbbccc")
+	assert(una == 3)
+	print("lost fragment ok")
+
+	-- two messages out of order, delivered in order
+	send(5, 0, "ee")
+	send(4, 1, "dd")
+	send(3, 0, "d")
+	skynet.sleep(20)
+	assert(#recv == 3 and recv[2] == "d" and recv[3] == "ddee")
+	-- a duplicate of a delivered message is acked again, not delivered
+	send(3, 0, "d")
+	skynet.sleep(20)
+	assert(#recv == 3 and una == 6)
+	print("out of order ok")
+
+	-- the frg of a message must count down: a bad peer loses its conv, and the process survives
+	send(6, 2, "x")
+	send(7, 0, "y")
+	send(8, 0, "z")
+	skynet.sleep(20)
+	assert(#recv == 3)
+	-- a new conv (the peer restarted) is received from its una
+	send(0, 0, "restart", 2)
+	skynet.sleep(20)
+	assert(#recv == 4 and recv[4] == "restart")
+	print("fragment count ok")
+
+	socket.close(c)
+	socket.close(server)
+end
+
+local function test_retransmit()
+	local message = string.rep("0123456789", MAX_PAYLOAD * 3 // 10 + 1)	-- 4 fragments
+	local nfrag = (#message + MAX_PAYLOAD - 1) // MAX_PAYLOAD
+	local frags = {}
+	local seen = {}
+	local got = 0
+	local co = coroutine.running()
+	local peer
+	peer = socket.udp(function(str, from)
+		for _, s in ipairs(segments(str)) do
+			assert(s.cmd == CMD_DATA)
+			seen[s.seq] = (seen[s.seq] or 0) + 1
+			-- drop the first copy of seq 1, as if it was lost
+			if s.seq ~= 1 or seen[1] > 1 then
+				if not frags[s.seq] then
+					frags[s.seq] = s
+					got = got + 1
+					if got == nfrag then
+						skynet.wakeup(co)
+					end
+				end
+				local next = 0
+				while frags[next] do
+					next = next + 1
+				end
+				socket.sendto(peer, from, ack_segment(s.conv, next, s.seq))
+			end
+		end
+	end, "127.0.0.1", 8768)
+
+	local sender = socket.udp(function() end)
+	socket.reliable(sender)
+	socket.udp_connect(sender, "127.0.0.1", 8768)
+	socket.write(sender, message)
+	skynet.wait(co)
+
+	assert(seen[1] >= 2)	-- retransmitted after the timeout
+	local data = {}
+	for i = 0, nfrag - 1 do
+		assert(frags[i].frg == nfrag - 1 - i)
+		data[#data+1] = frags[i].data
+	end
+	assert(table.concat(data) == message)
+	print("retransmit ok", seen[1])
+
+	socket.close(sender)
+	socket.close(peer)
+end
+
+skynet.start(function()
+	test_receive()
+	test_retransmit()
+	print("rudp test ok")
+	skynet.exit()
+end)
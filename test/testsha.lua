@@ -214,4 +214,34 @@ print(197) assert("64534553f76e55b890101380ad9149d3cacb5b76" == hmac_sha1(string
 print(198) assert("b7efbbc21ac1a746e22368e814ef5921056331ac" == hmac_sha1(string.char(137,153,151,252,88,36,165,92,194,50,19,117), string.char(155,113,35,47,22,52,144,77,130,20,178,133,75,207,168,146,132,209,160,7,123,190,117,196,147,212,142,25,182,222,56,249,192,228,6,224,250,221,89,7,176,27,37,49,215,192,74,132,127,101,32,23,34,131,23,74,37,226,208,205,162,242,102)), 198)
 print(199) assert("950ad3222f4917f868d09feab237a909fb6d50b7" == hmac_sha1(string.char(78,46,85,132,231,4,243,255,22,45,240,155,151,119,94,213,50,111,10,83,40,204,49,52,17,69,132,44,213,83,54,251,211,159,123,55,17,58,162,170,210,3,35,237,165,181,217,27,7,249,158,22,158,207,77,121,37,63,37,39,204,68,99,158,78,175,73,183,47,99,134,65,74,234,154,33,14,117,126,98,167,242,106,112,145,82), string.char(144,133,184,16,9,8,227,98,190,60,141,255,87,69,63,214,12,67,14,206,32,120,59,232,176,82,32,194,115,52,148,143,126,86,82,101,167,249,17,169,9,105,228)), 199)
 
+local function sha256(text)
+	return crypt.hexencode(crypt.sha256(text))
+end
+
+local function hmac_sha256(key, text)
+	return crypt.hexencode(crypt.hmac_sha256(key, text))
+end
+
+-- test case from FIPS 180-4 and RFC 4231
+
+print(200) assert(sha256 "" == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", 200)
+print(201) assert(sha256 "abc" == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", 201)
+print(202) assert(sha256 "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq" == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", 202)
+print(203) assert(sha256(string.rep("a", 1000000)) == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", 203)
+print(204) assert(hmac_sha256(string.rep("\x0b", 20), "Hi There") == "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7", 204)
+print(205) assert(hmac_sha256("Jefe", "what do ya want for nothing?") == "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843", 205)
+print(206) assert(hmac_sha256(string.rep("\xaa", 131), "Test Using Larger Than Block-Size Key - Hash Key First") == "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54", 206)
+
+-- a batch of texts signed with the same key
+local texts = { "data", "", string.rep("x", 1000) }
+local batch = crypt.hmac_sha1("key", texts)
+for i, text in ipairs(texts) do
+	assert(batch[i] == crypt.hmac_sha1("key", text), 207)
+end
+batch = crypt.hmac_sha256("key", texts)
+for i, text in ipairs(texts) do
+	assert(batch[i] == crypt.hmac_sha256("key", text), 208)
+end
+print(208)
+
 skynet.start(skynet.exit)
\ No newline at end of file